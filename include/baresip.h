@@ -62,6 +62,7 @@ const char *account_outbound(const struct account *acc, unsigned ix);
 const char *account_stun_user(const struct account *acc);
 const char *account_stun_pass(const struct account *acc);
 const char *account_stun_host(const struct account *acc);
+const char *account_sipaddr(const struct account *acc);
 
 
 /*
@@ -76,6 +77,20 @@ enum call_event {
 	CALL_EVENT_CLOSED,
 	CALL_EVENT_TRANSFER,
 	CALL_EVENT_TRANSFER_FAILED,
+	CALL_EVENT_SETUP,
+	CALL_EVENT_STATS,
+};
+
+/** Phases of the call setup, in milliseconds */
+enum call_phase {
+	CALL_PHASE_MNAT = 0,  /**< Call allocated to media-nat ready    */
+	CALL_PHASE_RESPONSE,  /**< INVITE to first response, incl. DNS  */
+	CALL_PHASE_SDP,       /**< SDP offer to answer, incl. alerting  */
+	CALL_PHASE_ESTAB,     /**< SDP answer to session established    */
+	CALL_PHASE_AUDIO,     /**< Starting the audio devices           */
+	CALL_PHASE_MEDIA,     /**< Session established to first RTP     */
+
+	CALL_PHASE_MAX
 };
 
 struct call;
@@ -86,6 +101,7 @@ typedef void (call_dtmf_h)(struct call *call, char key, void *arg);
 
 int  call_modify(struct call *call);
 int  call_hold(struct call *call, bool hold);
+int  call_present(struct call *call, bool on);
 int  call_send_digit(struct call *call, char key);
 bool call_has_audio(const struct call *call);
 bool call_has_video(const struct call *call);
@@ -97,15 +113,23 @@ void call_set_handlers(struct call *call, call_event_h *eh,
 uint16_t      call_scode(const struct call *call);
 uint32_t      call_duration(const struct call *call);
 uint32_t      call_setup_duration(const struct call *call);
+int32_t       call_phase_duration(const struct call *call,
+				  enum call_phase ph);
+const char   *call_phase_name(enum call_phase ph);
+const char   *call_id(const struct call *call);
+const char   *call_statename(const struct call *call);
 const char   *call_peeruri(const struct call *call);
 const char   *call_peername(const struct call *call);
 const char   *call_localuri(const struct call *call);
 struct audio *call_audio(const struct call *call);
 struct video *call_video(const struct call *call);
+struct video *call_content(const struct call *call);
 struct list  *call_streaml(const struct call *call);
 struct ua    *call_get_ua(const struct call *call);
 bool          call_is_onhold(const struct call *call);
 bool          call_is_outgoing(const struct call *call);
+unsigned      call_relay(struct call *call, struct call *peer);
+int           call_reflect(struct call *call, bool enable, uint32_t delay);
 void          call_enable_rtp_timeout(struct call *call, uint32_t timeout_ms);
 uint32_t      call_linenum(const struct call *call);
 struct call  *call_find_linenum(const struct list *calls, uint32_t linenum);
@@ -153,7 +177,16 @@ enum audio_mode {
 	AUDIO_MODE_POLL = 0,         /**< Polling mode                  */
 	AUDIO_MODE_THREAD,           /**< Use dedicated thread          */
 	AUDIO_MODE_THREAD_REALTIME,  /**< Use dedicated realtime-thread */
-	AUDIO_MODE_TMR               /**< Use timer                     */
+	AUDIO_MODE_TMR,              /**< Use timer                     */
+	AUDIO_MODE_EVENT,            /**< Thread woken by audio source  */
+	AUDIO_MODE_POOL              /**< Shared pool of worker threads */
+};
+
+
+/** Jitter buffer mode */
+enum jbuf_mode {
+	JBUF_MODE_FIXED = 0,         /**< Fixed delay range             */
+	JBUF_MODE_ADAPTIVE           /**< Delay follows measured jitter */
 };
 
 
@@ -163,12 +196,22 @@ struct config_sip {
 	char uuid[64];          /**< Universally Unique Identifier  */
 	char local[64];         /**< Local SIP Address              */
 	char cert[256];         /**< SIP Certificate                */
+	uint32_t reg_rate;      /**< REGISTERs per second, 0=no limit */
+	uint32_t drain_rate;    /**< UAs closed per second at exit, 0=all */
+	uint32_t drain_timeout; /**< Drain deadline [s], 0=none     */
+	uint32_t msg_window;    /**< MESSAGEs in flight, 0=no limit */
 };
 
 /** Call config */
 struct config_call {
 	uint32_t local_timeout; /**< Incoming call timeout [sec] 0=off */
 	uint32_t max_calls;     /**< Maximum number of calls, 0=unlimited */
+	uint32_t cpu_budget;    /**< CPU budget [% of all CPUs], 0=off    */
+	uint32_t watchdog;      /**< Main loop lag alert [ms], 0=off      */
+	uint32_t stats_interval;/**< Call stats event interval [s], 0=off */
+	uint32_t capacity;      /**< CPU capacity [1/10 call], 0=off      */
+	uint32_t bandwidth;     /**< Media bandwidth [kbit/s], 0=off      */
+	uint32_t shards;        /**< Event loops for the media, 0=off     */
 };
 
 /** Audio */
@@ -188,6 +231,22 @@ struct config_audio {
 	uint32_t channels_src;  /**< Opt. channels for source       */
 	bool src_first;         /**< Audio source opened first      */
 	enum audio_mode txmode; /**< Audio transmit mode            */
+	uint32_t txpool_threads;/**< Transmit pool size, 0=ncpus    */
+	bool ringbuf;           /**< Use lock-free sample ring      */
+	bool timestretch;       /**< Time-stretch decoded audio     */
+	bool dtx;               /**< Discontinuous transmission     */
+	bool drift;             /**< Clock-drift compensation       */
+	bool profile;           /**< Time each pipeline stage       */
+	bool ptime_adapt;       /**< Adapt ptime to the network     */
+	uint32_t red;           /**< Redundant frames (RED), 0=off  */
+	uint32_t rt_prio;       /**< SCHED_FIFO priority, 0=default */
+	char cpus_tx[64];       /**< CPUs for the transmit threads  */
+	char cpus_dev[64];      /**< CPUs for the device threads    */
+	char cpus_pool[64];     /**< CPUs for the pool workers      */
+	char share[64];         /**< Modules with shared devices    */
+	uint32_t speakers;      /**< Decoded speakers per player, 0=all */
+	bool low_latency;       /**< Encode from the source callback */
+	uint32_t warmup;        /**< Standby device ptime [ms], 0=off */
 };
 
 #ifdef USE_VIDEO
@@ -200,6 +259,16 @@ struct config_video {
 	unsigned width, height; /**< Video resolution               */
 	uint32_t bitrate;       /**< Encoder bitrate in [bit/s]     */
 	uint32_t fps;           /**< Video framerate                */
+	uint32_t pacing;        /**< Pacing rate in [%] of bitrate  */
+	uint32_t simulcast;     /**< Number of simulcast layers     */
+	bool enc_thread;        /**< Encode in a dedicated thread   */
+	bool dec_thread;        /**< Decode in a dedicated thread   */
+	bool disp_thread;       /**< Display in a dedicated thread  */
+	uint32_t key_interval;  /**< Min. keyframe interval [ms]    */
+	bool enc_share;         /**< Share encoders between calls   */
+	bool profile;           /**< Time each pipeline stage       */
+	uint32_t sendq_max;     /**< Max age of send queue [ms]     */
+	bool adaptive;          /**< Low rate for static pictures   */
 };
 #endif
 
@@ -210,9 +279,18 @@ struct config_avt {
 	struct range rtp_bw;    /**< RTP Bandwidth range [bit/s]    */
 	bool rtcp_enable;       /**< RTCP is enabled                */
 	bool rtcp_mux;          /**< RTP/RTCP multiplexing          */
+	bool rtcp_xr;           /**< RTCP XR VoIP Metrics reports   */
 	struct range jbuf_del;  /**< Delay, number of frames        */
+	enum jbuf_mode jbuf_mode;/**< Jitter buffer mode            */
+	uint32_t jbuf_video;    /**< Video frame wait [ms], 0=off   */
 	bool rtp_stats;         /**< Enable RTP statistics          */
 	uint32_t rtp_timeout;   /**< RTP Timeout in seconds (0=off) */
+	uint32_t rtp_batch;     /**< Max packets per send call (0=off) */
+	bool rtp_uring;         /**< Send batches with io_uring     */
+	bool rtp_cc;            /**< Congestion control for video   */
+	bool rtp_fec;           /**< Forward error correction       */
+	bool rtp_bundle;        /**< Audio and video share a socket */
+	bool rtp_rxts;          /**< Kernel receive timestamps      */
 };
 
 /* Network */
@@ -228,6 +306,9 @@ struct config_net {
 /* BFCP */
 struct config_bfcp {
 	char proto[16];         /**< BFCP Transport (optional)      */
+	char content_mod[16];   /**< Presentation source module     */
+	char content_dev[128];  /**< Presentation source device     */
+	uint32_t content_share; /**< Video budget while presenting  */
 };
 #endif
 
@@ -273,10 +354,13 @@ enum presence_status {
 struct contacts {
 	struct list cl;
 	struct hash *cht;
+	struct hash *nht;
 };
 
 struct contact;
 
+typedef bool (contact_apply_h)(struct contact *contact, void *arg);
+
 int  contact_init(struct contacts *contacts);
 void contact_close(struct contacts *contacts);
 int  contact_add(struct contacts *contacts,
@@ -286,6 +370,9 @@ void contact_set_presence(struct contact *c, enum presence_status status);
 bool contact_block_access(const struct contacts *contacts, const char *uri);
 struct contact  *contact_find(const struct contacts *contacts,
 			      const char *uri);
+struct contact  *contact_find_name(const struct contacts *contacts,
+				   const struct pl *name,
+				   contact_apply_h *ah, void *arg);
 struct sip_addr *contact_addr(const struct contact *c);
 struct list     *contact_list(const struct contacts *contacts);
 const char      *contact_str(const struct contact *c);
@@ -321,14 +408,20 @@ int  message_send(struct ua *ua, const char *peer, const char *msg);
 struct ausrc;
 struct ausrc_st;
 
-/** Audio Source parameters */
+/**
+ * Audio Source parameters
+ *
+ * A source that does not support the sample format must fail with
+ * ENOTSUP, the application may then retry with AUFMT_S16LE.
+ */
 struct ausrc_prm {
 	uint32_t   srate;       /**< Sampling rate in [Hz] */
 	uint8_t    ch;          /**< Number of channels    */
 	uint32_t   ptime;       /**< Wanted packet-time in [ms] */
+	int        fmt;         /**< Sample format (enum aufmt) */
 };
 
-typedef void (ausrc_read_h)(const int16_t *sampv, size_t sampc, void *arg);
+typedef void (ausrc_read_h)(const void *sampv, size_t sampc, void *arg);
 typedef void (ausrc_error_h)(int err, const char *str, void *arg);
 
 typedef int  (ausrc_alloc_h)(struct ausrc_st **stp, const struct ausrc *ausrc,
@@ -336,8 +429,12 @@ typedef int  (ausrc_alloc_h)(struct ausrc_st **stp, const struct ausrc *ausrc,
 			     struct ausrc_prm *prm, const char *device,
 			     ausrc_read_h *rh, ausrc_error_h *errh, void *arg);
 
+typedef int  (ausrc_debug_h)(struct re_printf *pf,
+			     const struct ausrc_st *st);
+
 int ausrc_register(struct ausrc **asp, const char *name,
 		   ausrc_alloc_h *alloch);
+void ausrc_set_debug(struct ausrc *as, ausrc_debug_h *debugh);
 const struct ausrc *ausrc_find(const char *name);
 int ausrc_alloc(struct ausrc_st **stp, struct media_ctx **ctx,
 		const char *name,
@@ -352,27 +449,92 @@ int ausrc_alloc(struct ausrc_st **stp, struct media_ctx **ctx,
 struct auplay;
 struct auplay_st;
 
-/** Audio Player parameters */
+/**
+ * Audio Player parameters
+ *
+ * A player that does not support the sample format must fail with
+ * ENOTSUP, the application may then retry with AUFMT_S16LE.
+ */
 struct auplay_prm {
 	uint32_t   srate;       /**< Sampling rate in [Hz] */
 	uint8_t    ch;          /**< Number of channels    */
 	uint32_t   ptime;       /**< Wanted packet-time in [ms] */
+	int        fmt;         /**< Sample format (enum aufmt) */
 };
 
-typedef void (auplay_write_h)(int16_t *sampv, size_t sampc, void *arg);
+typedef void (auplay_write_h)(void *sampv, size_t sampc, void *arg);
 
 typedef int  (auplay_alloc_h)(struct auplay_st **stp, const struct auplay *ap,
 			      struct auplay_prm *prm, const char *device,
 			      auplay_write_h *wh, void *arg);
 
+typedef int  (auplay_debug_h)(struct re_printf *pf,
+			      const struct auplay_st *st);
+
 int auplay_register(struct auplay **pp, const char *name,
 		    auplay_alloc_h *alloch);
+void auplay_set_debug(struct auplay *ap, auplay_debug_h *debugh);
 const struct auplay *auplay_find(const char *name);
 int auplay_alloc(struct auplay_st **stp, const char *name,
 		 struct auplay_prm *prm, const char *device,
 		 auplay_write_h *wh, void *arg);
 
 
+/*
+ * Audio sample ring (lock-free, single-producer/single-consumer)
+ */
+
+struct auring;
+
+int    auring_alloc(struct auring **arp, size_t min, size_t max);
+size_t auring_write(struct auring *ar, const int16_t *sampv, size_t sampc);
+size_t auring_read(struct auring *ar, int16_t *sampv, size_t sampc);
+size_t auring_cur_sampc(const struct auring *ar);
+int    auring_debug(struct re_printf *pf, const struct auring *ar);
+
+
+/*
+ * Pointer ring (lock-free, single-producer/single-consumer)
+ */
+
+struct ptring;
+
+int      ptring_alloc(struct ptring **prp, size_t size);
+bool     ptring_push(struct ptring *pr, void *p);
+void    *ptring_pop(struct ptring *pr);
+void     ptring_flush(struct ptring *pr);
+size_t   ptring_count(const struct ptring *pr);
+uint64_t ptring_full(const struct ptring *pr);
+
+
+/*
+ * Audio level
+ */
+
+/** Level and voice activity of one audio frame */
+struct aulevel {
+	uint16_t rms;     /**< RMS level, linear                     */
+	uint16_t peak;    /**< Peak level, linear                    */
+	uint8_t dbov;     /**< RMS level in -dBov, 127 is silence    */
+	bool voice;       /**< Voice activity detected               */
+};
+
+void aulevel_calc(struct aulevel *lvl, const int16_t *sampv, size_t sampc);
+void aulevel_calc_float(struct aulevel *lvl, const float *sampv,
+			size_t sampc);
+
+
+/*
+ * Audio sample conversion
+ */
+
+void aupcm_ulaw_encode(uint8_t *dst, const int16_t *src, size_t n);
+void aupcm_ulaw_decode(int16_t *dst, const uint8_t *src, size_t n);
+void aupcm_alaw_encode(uint8_t *dst, const int16_t *src, size_t n);
+void aupcm_alaw_decode(int16_t *dst, const uint8_t *src, size_t n);
+void aupcm_swap16(int16_t *dst, const int16_t *src, size_t n);
+
+
 /*
  * Audio Filter
  */
@@ -383,6 +545,8 @@ struct aufilt;
 struct aufilt_enc_st {
 	const struct aufilt *af;
 	struct le le;
+	bool vad;             /**< The filter detects voice activity */
+	bool voice;           /**< Voice activity of the last frame  */
 };
 
 struct aufilt_dec_st {
@@ -395,6 +559,8 @@ struct aufilt_prm {
 	uint32_t srate;       /**< Sampling rate in [Hz]        */
 	uint8_t  ch;          /**< Number of channels           */
 	uint32_t ptime;       /**< Wanted packet-time in [ms]   */
+	bool     plc;         /**< Decoder conceals lost frames */
+	const struct audio *au; /**< Audio stream, see audio_level() */
 };
 
 typedef int (aufilt_encupd_h)(struct aufilt_enc_st **stp, void **ctx,
@@ -439,18 +605,67 @@ struct log {
 	log_h *h;
 };
 
+/** Rate limiter for repeated log messages */
+struct log_rl {
+	uint64_t ts;        /**< Start of current interval      */
+	uint32_t n;         /**< Messages let through           */
+	uint32_t nsupp;     /**< Messages suppressed            */
+};
+
+/** Runtime debug switch of one module */
+struct log_mod {
+	struct le le;
+	const char *name;   /**< Module name                    */
+	bool debug;         /**< Debug messages enabled         */
+};
+
+#define LOG_MOD_INIT(name) {LE_INIT, (name), false}
+
 void log_register_handler(struct log *logh);
 void log_unregister_handler(struct log *logh);
 void log_enable_debug(bool enable);
 void log_enable_info(bool enable);
 void log_enable_stderr(bool enable);
+int  log_enable_async(bool enable);
+bool log_ratelimit(struct log_rl *rl, uint32_t *suppressed);
+void log_mod_register(struct log_mod *lm);
+void log_mod_unregister(struct log_mod *lm);
+int  log_mod_enable_debug(const char *name, bool enable);
+int  log_mod_debug(struct re_printf *pf, void *unused);
 void vlog(enum log_level level, const char *fmt, va_list ap);
 void loglv(enum log_level level, const char *fmt, ...);
+void log_debug(const char *fmt, ...);
 void debug(const char *fmt, ...);
 void info(const char *fmt, ...);
 void warning(const char *fmt, ...);
 void error(const char *fmt, ...);
 
+/*
+ * BARESIP_LOG_LEVEL is the lowest log level that is compiled in.
+ * Calls below it are removed by the compiler, but their arguments are
+ * still type-checked.
+ */
+#ifndef BARESIP_LOG_LEVEL
+#define BARESIP_LOG_LEVEL 0  /* LEVEL_DEBUG */
+#endif
+
+#define LOG_NOP(fn, ...)  ((void)(0 && ((fn)(__VA_ARGS__), 0)))
+
+#if BARESIP_LOG_LEVEL > 0
+#define debug(...)        LOG_NOP(debug, __VA_ARGS__)
+#endif
+#if BARESIP_LOG_LEVEL > 1
+#define info(...)         LOG_NOP(info, __VA_ARGS__)
+#endif
+
+/** Debug message of a module, costs one branch while disabled */
+#if BARESIP_LOG_LEVEL > 0
+#define mod_dbg(lm, ...)  ((void)(lm), LOG_NOP(log_debug, __VA_ARGS__))
+#else
+#define mod_dbg(lm, ...)  \
+	((void)((lm).debug && (log_debug(__VA_ARGS__), 0)))
+#endif
+
 
 /*
  * Menc - Media encryption (for RTP)
@@ -489,6 +704,7 @@ const struct menc *menc_find(const struct list *mencl, const char *id);
  */
 
 struct network;
+struct net_dnsq;
 
 typedef void (net_change_h)(void *arg);
 
@@ -503,6 +719,9 @@ int  net_debug(struct re_printf *pf, const struct network *net);
 const struct sa *net_laddr_af(const struct network *net, int af);
 const char      *net_domain(const struct network *net);
 struct dnsc     *net_dnsc(const struct network *net);
+int  net_dns_query(struct net_dnsq **qp, struct network *net,
+		   const char *name, uint16_t type,
+		   dns_query_h *qh, void *arg);
 
 
 /*
@@ -544,10 +763,19 @@ enum ua_event {
 	UA_EVENT_CALL_TRANSFER_FAILED,
 	UA_EVENT_CALL_DTMF_START,
 	UA_EVENT_CALL_DTMF_END,
+	UA_EVENT_CALL_SETUP,
+	UA_EVENT_CALL_STATS,
+	UA_EVENT_MODULE,
 
 	UA_EVENT_MAX,
 };
 
+/** Mask bit of a User-Agent event */
+#define UA_EVENT_BIT(ev) (1u << (ev))
+
+/** Mask of all User-Agent events */
+#define UA_EVENT_ALL ((1u << UA_EVENT_MAX) - 1)
+
 /** Video mode */
 enum vidmode {
 	VIDMODE_OFF = 0,    /**< Video disabled                */
@@ -566,6 +794,10 @@ int  ua_alloc(struct ua **uap, const char *aor);
 int  ua_connect(struct ua *ua, struct call **callp,
 		const char *from_uri, const char *uri,
 		const char *params, enum vidmode vmode);
+int  ua_connect_pinned(struct ua *ua, struct call **callp,
+		       const char *from_uri, const char *uri,
+		       const char *params, enum vidmode vmode,
+		       const struct call *peer);
 void ua_hangup(struct ua *ua, struct call *call,
 	       uint16_t scode, const char *reason);
 int  ua_answer(struct ua *ua, struct call *call);
@@ -602,6 +834,8 @@ void ua_stop_all(bool forced);
 void uag_set_exit_handler(ua_exit_h *exith, void *arg);
 int  uag_reset_transp(bool reg, bool reinvite);
 int  uag_event_register(ua_event_h *eh, void *arg);
+int  uag_event_register_mask(ua_event_h *eh, uint32_t mask,
+			     const struct ua *ua, void *arg);
 void uag_event_unregister(ua_event_h *eh);
 void uag_set_sub_handler(sip_msg_h *subh);
 int  ua_print_sip_status(struct re_printf *pf, void *unused);
@@ -611,6 +845,8 @@ struct ua   *uag_find_aor(const char *aor);
 struct ua   *uag_find_param(const char *name, const char *val);
 struct sip  *uag_sip(void);
 const char  *uag_event_str(enum ua_event ev);
+void module_event(const char *module, const char *event, struct ua *ua,
+		  struct call *call, const char *fmt, ...);
 struct list *uag_list(void);
 void         uag_current_set(struct ua *ua);
 struct ua   *uag_current(void);
@@ -794,6 +1030,25 @@ typedef int (audec_decode_h)(struct audec_state *ads, int16_t *sampv,
 			     size_t *sampc, const uint8_t *buf, size_t len);
 typedef int (audec_plc_h)(struct audec_state *ads,
 			  int16_t *sampv, size_t *sampc);
+typedef void (auenc_loss_h)(struct auenc_state *aes, unsigned loss);
+typedef bool (auenc_ptime_h)(uint32_t ptime);
+
+/*
+ * Optional entry points for other sample formats than S16. The decoder
+ * conceals a lost packet if buf is NULL.
+ */
+typedef int (auenc_encode_fmt_h)(struct auenc_state *aes, uint8_t *buf,
+				 size_t *len, int fmt, const void *sampv,
+				 size_t sampc);
+typedef int (audec_decode_fmt_h)(struct audec_state *ads, int fmt,
+				 void *sampv, size_t *sampc,
+				 const uint8_t *buf, size_t len);
+
+/** Channel layout of an audio codec with more than two channels */
+enum aulayout {
+	AULAYOUT_STD = 0,     /**< Vorbis order, e.g. L C R RL RR LFE     */
+	AULAYOUT_AMBISONIC,   /**< Ambisonics, ACN order with SN3D       */
+};
 
 struct aucodec {
 	struct le le;
@@ -810,6 +1065,13 @@ struct aucodec {
 	audec_plc_h    *plch;
 	sdp_fmtp_enc_h *fmtp_ench;
 	sdp_fmtp_cmp_h *fmtp_cmph;
+	auenc_encode_fmt_h *ench_fmt;  /* Encoder for other formats */
+	audec_decode_fmt_h *dech_fmt;  /* Decoder for other formats */
+	auenc_loss_h *lossh;           /* Packet loss of the peer [%] */
+	audec_decode_h *fech;          /* Lost frame from next packet */
+	auenc_ptime_h *ptimeh;         /* Packet time is supported    */
+	enum aulayout layout;          /* Channel layout              */
+	struct le he;                  /* Hashed by name, internal    */
 };
 
 void aucodec_register(struct aucodec *ac);
@@ -819,6 +1081,21 @@ const struct aucodec *aucodec_find(const char *name, uint32_t srate,
 struct list *aucodec_list(void);
 
 
+/*
+ * Codec state pool
+ */
+
+struct statepool;
+
+typedef void (statepool_free_h)(void *st);
+
+int   statepool_alloc(struct statepool **poolp, unsigned max,
+		      statepool_free_h *freeh);
+void *statepool_get(struct statepool *pool, uint32_t key);
+bool  statepool_put(struct statepool *pool, uint32_t key, void *st);
+int   statepool_debug(struct re_printf *pf, const struct statepool *pool);
+
+
 /*
  * Video Codec
  */
@@ -844,6 +1121,19 @@ typedef int (videnc_update_h)(struct videnc_state **vesp,
 			      videnc_packet_h *pkth, void *arg);
 typedef int (videnc_encode_h)(struct videnc_state *ves, bool update,
 			      const struct vidframe *frame);
+typedef int (videnc_reconfig_h)(struct videnc_state *ves,
+				const struct videnc_param *prm);
+
+/** Size of the blocks of a region-of-interest map [pixels] */
+#define VIDENC_ROI_BLOCK 16
+
+/*
+ * Region of interest: one byte per block, row by row, 1 where the
+ * picture changed. The other blocks may be skipped by the encoder.
+ * The map applies to the next frames, map=NULL codes every block.
+ */
+typedef int (videnc_roi_h)(struct videnc_state *ves, const uint8_t *map,
+			   unsigned cols, unsigned rows);
 
 typedef int (viddec_update_h)(struct viddec_state **vdsp,
 			      const struct vidcodec *vc, const char *fmtp);
@@ -863,6 +1153,9 @@ struct vidcodec {
 	viddec_decode_h *dech;
 	sdp_fmtp_enc_h *fmtp_ench;
 	sdp_fmtp_cmp_h *fmtp_cmph;
+	videnc_reconfig_h *reconfh;  /**< Bitrate/fps, no re-open, optional */
+	videnc_roi_h *roih;          /**< Region of interest, optional      */
+	struct le he;                /**< Hashed by name, internal          */
 };
 
 void vidcodec_register(struct vidcodec *vc);
@@ -918,6 +1211,26 @@ int vidfilt_dec_append(struct list *filtl, void **ctx,
 		       const struct vidfilt *vf);
 
 
+/*
+ * Video frame pool
+ */
+
+struct vidpool;
+
+int vidpool_alloc(struct vidpool **poolp, unsigned align);
+int vidpool_get(struct vidpool *pool, struct vidframe **framep,
+		enum vidfmt fmt, const struct vidsz *size);
+int vidpool_debug(struct re_printf *pf, const struct vidpool *pool);
+
+
+/*
+ * Video scaling
+ */
+
+int vidframe_scale(struct vidframe *dst, const struct vidrect *rect,
+		   const struct vidframe *src);
+
+
 /*
  * Audio stream
  */
@@ -925,12 +1238,17 @@ int vidfilt_dec_append(struct list *filtl, void **ctx,
 struct audio;
 
 void audio_mute(struct audio *a, bool muted);
+void audio_set_gain(struct audio *a, uint32_t src, uint32_t play);
+void audio_set_affinity(struct audio *a, uint32_t key);
 bool audio_ismuted(const struct audio *a);
 void audio_set_devicename(struct audio *a, const char *src, const char *play);
 int  audio_set_source(struct audio *au, const char *mod, const char *device);
 int  audio_set_player(struct audio *au, const char *mod, const char *device);
 void audio_encoder_cycle(struct audio *audio);
+void audio_level(const struct audio *a, struct aulevel *tx,
+		 struct aulevel *rx);
 int  audio_debug(struct re_printf *pf, const struct audio *a);
+int  audio_mem_debug(struct re_printf *pf, const struct audio *a);
 
 
 /*
@@ -942,6 +1260,7 @@ struct video;
 void  video_mute(struct video *v, bool muted);
 void *video_view(const struct video *v);
 int   video_set_fullscreen(struct video *v, bool fs);
+int   video_set_visible(struct video *v, bool visible);
 int   video_set_orient(struct video *v, int orient);
 void  video_vidsrc_set_device(struct video *v, const char *dev);
 int   video_set_source(struct video *v, const char *name, const char *dev);
@@ -950,6 +1269,80 @@ void  video_encoder_cycle(struct video *video);
 int   video_debug(struct re_printf *pf, const struct video *v);
 
 
+/*
+ * Media stream
+ */
+
+struct stream;
+
+/** Statistics of one direction of a media stream */
+struct stream_dir_stats {
+	uint64_t packets;       /**< Number of RTP packets          */
+	uint64_t bytes;         /**< Number of RTP payload bytes    */
+	uint64_t errors;        /**< Number of errors               */
+	uint32_t bitrate;       /**< Current bitrate [bit/s]        */
+	int lost;               /**< Packets lost, from RTCP        */
+	uint32_t jitter;        /**< Jitter from RTCP [us]          */
+};
+
+/** Statistics of a media stream */
+struct stream_stats {
+	const char *media;            /**< Media name, e.g. "audio"       */
+	const char *codec;            /**< Codec of the remote format     */
+	struct stream_dir_stats tx;   /**< Transmit direction             */
+	struct stream_dir_stats rx;   /**< Receive direction              */
+	uint32_t rtt;                 /**< Round-trip time from RTCP [us] */
+	bool jbuf;                    /**< Jitter buffer stats are valid  */
+	uint32_t jbuf_put;            /**< Frames put in jitter buffer    */
+	uint32_t jbuf_get;            /**< Frames taken out               */
+	uint32_t jbuf_overflow;       /**< Jitter buffer overflows        */
+	uint32_t jbuf_underflow;      /**< Jitter buffer underflows       */
+	uint32_t jbuf_delay;          /**< Jitter buffer delay [ms]       */
+	bool mos_valid;               /**< MOS estimate is valid          */
+	double mos;                   /**< MOS of the received audio      */
+	double r_factor;              /**< R factor of the received audio */
+	bool sync;                    /**< Lip-sync stats are valid       */
+	int32_t sync_offset;          /**< Video minus audio offset [ms]  */
+	uint32_t sync_delay;          /**< Delay added for lip-sync [ms]  */
+	bool plc;                     /**< Concealment stats are valid    */
+	uint64_t samples;             /**< Audio samples decoded          */
+	uint64_t concealed;           /**< Samples of them concealed      */
+	uint64_t fec;                 /**< Samples of them from FEC data  */
+	bool sendq;                   /**< Send queue stats are valid     */
+	uint32_t sendq_age;           /**< Age of oldest queued pkt [ms]  */
+	uint64_t sendq_drop;          /**< Frames dropped, queue too old  */
+};
+
+int stream_stats(const struct stream *s, struct stream_stats *st);
+
+
+enum { CALL_STATS_STREAMS = 4 };
+
+/** Statistics of a call, a call-quality record */
+struct call_stats {
+	uint32_t duration;               /**< Call duration [s]              */
+	uint16_t scode;                  /**< Termination status code        */
+	int32_t setupv[CALL_PHASE_MAX];  /**< Setup phases [ms], -1 = n/a    */
+	struct stream_stats streamv[CALL_STATS_STREAMS]; /**< Media streams */
+	size_t streamc;                  /**< Number of media streams        */
+};
+
+int call_stats(const struct call *call, struct call_stats *cs);
+int call_stats_json(struct re_printf *pf, const struct call *call);
+
+
+/** Statistics of the local RTP port pool */
+struct rtpport_stat {
+	uint32_t total;         /**< Even ports in the range        */
+	uint32_t free;          /**< Ports not in use               */
+	uint32_t n_alloc;       /**< Ports handed out               */
+	uint32_t n_full;        /**< Requests with no free port     */
+	uint32_t n_bind_fail;   /**< Ports in use by someone else   */
+};
+
+int rtpport_stats(struct rtpport_stat *st);
+
+
 /*
  * Media NAT
  */
@@ -973,16 +1366,123 @@ typedef int (mnat_media_h)(struct mnat_media **mp, struct mnat_sess *sess,
 
 typedef int (mnat_update_h)(struct mnat_sess *sess);
 
+typedef int (mnat_sdpfrag_h)(struct mbuf *frag, void *arg);
+
+typedef int (mnat_trickle_h)(struct mnat_sess *sess,
+			     mnat_sdpfrag_h *fragh, void *arg);
+
+typedef int (mnat_rfrag_h)(struct mnat_sess *sess, const struct pl *frag);
+
 int mnat_register(struct mnat **mnatp, struct list *mnatl,
 		  const char *id, const char *ftag,
 		  mnat_sess_h *sessh, mnat_media_h *mediah,
 		  mnat_update_h *updateh);
+void mnat_set_trickle(struct mnat *mnat, mnat_trickle_h *trickleh,
+		      mnat_rfrag_h *rfragh);
 
 
 /*
  * Real-time
  */
 int realtime_enable(bool enable, int fps);
+int realtime_affinity(const char *cpus, int n);
+
+
+/*
+ * CPU budget governor
+ */
+
+/** Load levels, each one also applies the ones before */
+enum governor_level {
+	GOV_NORMAL = 0,  /**< Within the CPU budget            */
+	GOV_CODEC,       /**< Lower the codec complexity       */
+	GOV_VIDEO,       /**< Lower the video frame-rate       */
+	GOV_REJECT,      /**< Reject new calls                 */
+};
+
+enum governor_level governor_level(void);
+
+
+/*
+ * Admission control
+ */
+
+/** Estimated resources of a call */
+struct admit_cost {
+	uint32_t cpu;           /**< CPU [1/10 of a G.711 call]     */
+	uint32_t kbps;          /**< Bandwidth, both ways [kbit/s]  */
+	uint32_t ports;         /**< Local RTP ports                */
+};
+
+/** Resources in use, and the capacity of the node (0 = no limit) */
+struct admit_stat {
+	struct admit_cost used;
+	struct admit_cost capacity;
+	uint32_t n_accept;      /**< Calls admitted                 */
+	uint32_t n_audio;       /**< Calls admitted without video   */
+	uint32_t n_reject;      /**< Calls rejected                 */
+};
+
+int admit_stats(struct admit_stat *st);
+
+
+/*
+ * Main loop watchdog
+ */
+
+const char *watchdog_enter(const char *name);
+int watchdog_debug(struct re_printf *pf, void *unused);
+
+
+/*
+ * Event loops of the media
+ */
+
+typedef int (shard_exec_h)(void *arg);
+
+int      shard_exec(unsigned loop, shard_exec_h *h, void *arg);
+int      shard_post(unsigned loop, shard_exec_h *h, void *arg);
+unsigned shard_count(void);
+unsigned shard_loop(void);
+
+
+/*
+ * Media kernels
+ */
+
+/** CPU features that the media kernels can use */
+enum cpu_feat {
+	CPU_SSE2 = 1 << 0,
+	CPU_AVX2 = 1 << 1,
+	CPU_NEON = 1 << 2,
+};
+
+uint32_t cpu_features(void);
+int  kernel_select(const char *name, const char *isa);
+const char *kernel_isa(const char *name);
+int  kernel_debug(struct re_printf *pf, void *unused);
+
+
+/*
+ * Memory accounting
+ */
+
+/** Memory of the objects of a module or core subsystem */
+struct memtag {
+	struct le le;
+	char name[32];          /**< Module or subsystem name       */
+	size_t bytes;           /**< Live bytes                     */
+	size_t peak;            /**< Largest number of live bytes   */
+	uint64_t n_alloc;       /**< Objects allocated              */
+	uint64_t n_free;        /**< Objects freed                  */
+};
+
+struct memtag *memtag_find(const char *name);
+void memtag_alloc(struct memtag *tag, size_t size);
+void memtag_free(struct memtag *tag, size_t size);
+void memtag_resize(struct memtag *tag, size_t old, size_t size);
+struct list *memtag_list(void);
+int  memtag_debug(struct re_printf *pf, void *unused);
 
 
 /*
@@ -1072,6 +1572,8 @@ const uint8_t *h264_find_startcode(const uint8_t *p, const uint8_t *end);
 
 int h264_packetize(const uint8_t *buf, size_t len, size_t pktsize,
 		   videnc_packet_h *pkth, void *arg);
+int h264_packetize_stap(const uint8_t *buf, size_t len, size_t pktsize,
+			videnc_packet_h *pkth, void *arg);
 int h264_nal_send(bool first, bool last,
 		  bool marker, uint32_t ihdr, const uint8_t *buf,
 		  size_t size, size_t maxsz,
@@ -1103,6 +1605,58 @@ int module_preload(const char *module);
 double mos_calculate(double *r_factor, double rtt,
 		     double jitter, uint32_t num_packets_lost);
 
+enum { MOS_WINDOW = 6 };
+
+/** Sliding-window MOS estimator of one received stream */
+struct mos_est {
+	double ie;              /**< Codec equipment impairment     */
+	double bpl;             /**< Codec packet-loss robustness   */
+	uint32_t n_lost;        /**< Packets lost, from sequence    */
+	uint32_t n_burst;       /**< Number of loss bursts          */
+	struct {
+		uint64_t packets;
+		uint32_t lost;
+		uint32_t bursts;
+	} winv[MOS_WINDOW];     /**< Counts of the last intervals   */
+	unsigned wi;            /**< Next interval in the window    */
+	uint64_t packets_prev;
+	uint32_t lost_prev;
+	uint32_t burst_prev;
+	double r;               /**< Current R factor               */
+	double mos;             /**< Current MOS                    */
+	bool valid;             /**< R factor and MOS are valid     */
+};
+
+void mos_est_set_codec(struct mos_est *me, const char *codec);
+void mos_est_loss(struct mos_est *me, uint32_t lost);
+void mos_est_update(struct mos_est *me, uint64_t packets, uint32_t rtt,
+		    uint32_t jitter, uint32_t jbuf);
+int  mos_est_debug(struct re_printf *pf, const struct mos_est *me);
+
+
+/*
+ * Network path quality
+ */
+
+/** Quality of a network path, measured by a module */
+struct pathq {
+	struct le le;
+	char *name;             /**< Path name, e.g. the trunk      */
+	uint64_t sent;          /**< Probe packets sent             */
+	uint64_t received;      /**< Probe packets that came back   */
+	double loss;            /**< Loss in the last window [%]    */
+	uint32_t rtt;           /**< Round-trip time [us]           */
+	uint32_t jitter;        /**< Variation of the RTT [us]      */
+	double mos;             /**< MOS of a call on the path      */
+	bool valid;             /**< Numbers are valid              */
+};
+
+int  pathq_register(struct pathq **pqp, const char *name);
+const struct pathq *pathq_find(const char *name);
+const struct pathq *pathq_best(const char *names);
+struct list *pathq_list(void);
+int  pathq_debug(struct re_printf *pf, void *unused);
+
 
 /*
  * Baresip instance
@@ -38,6 +38,7 @@
 #   USE_PLC           Packet Loss Concealment
 #   USE_PORTAUDIO     Portaudio audio driver
 #   USE_PULSE         Pulseaudio audio driver
+#   USE_RNNOISE       RNNoise noise suppression
 #   USE_SDL           libSDL video output
 #   USE_SILK          SILK (Skype) audio codec
 #   USE_SNDFILE       sndfile wav dumper
@@ -49,6 +50,7 @@
 #   USE_SYSLOG        Syslog module
 #   USE_V4L           Video4Linux module
 #   USE_V4L2          Video4Linux2 module
+#   USE_WEBRTC_AEC    WebRTC Acoustic Echo Canceller (AEC3)
 #   USE_WINWAVE       Windows audio driver
 #   USE_X11           X11 video output
 #
@@ -144,6 +146,9 @@ USE_PORTAUDIO := $(shell [ -f $(SYSROOT)/local/include/portaudio.h ] || \
 		[ -f $(SYSROOT)/include/portaudio.h ] || \
 		[ -f $(SYSROOT_ALT)/include/portaudio.h ] && echo "yes")
 USE_PULSE := $(shell pkg-config --exists libpulse && echo "yes")
+USE_RNNOISE := $(shell [ -f $(SYSROOT)/include/rnnoise.h ] || \
+	[ -f $(SYSROOT)/local/include/rnnoise.h ] || \
+	[ -f $(SYSROOT_ALT)/include/rnnoise.h ] && echo "yes")
 USE_SDL  := $(shell [ -f $(SYSROOT)/include/SDL/SDL.h ] || \
 	[ -f $(SYSROOT)/local/include/SDL/SDL.h ] || \
 	[ -f $(SYSROOT_ALT)/include/SDL/SDl.h ] && echo "yes")
@@ -201,9 +206,14 @@ USE_V4L2 := $(shell [ -f $(SYSROOT)/include/linux/videodev2.h ] || \
 	[ -f $(SYSROOT)/local/include/linux/videodev2.h ] || \
 	[ -f $(SYSROOT)/include/sys/videoio.h ] \
 	&& echo "yes")
+USE_WEBRTC_AEC := $(shell pkg-config --exists webrtc-audio-processing-1 \
+	&& echo "yes")
 USE_X11 := $(shell [ -f $(SYSROOT)/include/X11/Xlib.h ] || \
 	[ -f $(SYSROOT)/local/include/X11/Xlib.h ] || \
 	[ -f $(SYSROOT_ALT)/include/X11/Xlib.h ] && echo "yes")
+HAVE_XDAMAGE := $(shell [ -f $(SYSROOT)/include/X11/extensions/Xdamage.h ] || \
+	[ -f $(SYSROOT)/local/include/X11/extensions/Xdamage.h ] || \
+	[ -f $(SYSROOT_ALT)/include/X11/extensions/Xdamage.h ] && echo "yes")
 USE_ZRTP := $(shell [ -f $(SYSROOT)/include/libzrtp/zrtp.h ] || \
 	[ -f $(SYSROOT)/local/include/libzrtp/zrtp.h ] || \
 	[ -f $(SYSROOT_ALT)/include/libzrtp/zrtp.h ] && echo "yes")
@@ -241,7 +251,7 @@ endif
 endif
 ifeq ($(OS),linux)
 USE_EVDEV := $(shell [ -f $(SYSROOT)/include/linux/input.h ] && echo "yes")
-MODULES   += dtmfio
+MODULES   += dtmfio shm
 endif
 ifeq ($(OS),win32)
 USE_WINWAVE := yes
@@ -267,13 +277,13 @@ MODULES   += stun turn ice natbd auloop presence
 MODULES   += contact vumeter mwi account natpmp httpd
 MODULES   += srtp
 MODULES   += uuid
-MODULES   += debug_cmd
+MODULES   += debug_cmd bench probe
 
 ifneq ($(HAVE_PTHREAD),)
-MODULES   += aubridge aufile
+MODULES   += aubridge aufile aumix
 endif
 ifneq ($(USE_VIDEO),)
-MODULES   += vidloop selfview vidbridge
+MODULES   += vidloop selfview vidbridge compositor
 ifneq ($(HAVE_PTHREAD),)
 MODULES   += fakevideo
 endif
@@ -395,6 +405,9 @@ endif
 ifneq ($(USE_PULSE),)
 MODULES   += pulse
 endif
+ifneq ($(USE_RNNOISE),)
+MODULES   += rnnoise
+endif
 ifneq ($(USE_SDL),)
 MODULES   += sdl
 endif
@@ -435,6 +448,9 @@ ifneq ($(USE_VPX),)
 MODULES   += vp8
 MODULES   += $(shell pkg-config 'vpx >= 1.3.0' && echo "vp9")
 endif
+ifneq ($(USE_WEBRTC_AEC),)
+MODULES   += webrtc_aec
+endif
 ifneq ($(USE_WINWAVE),)
 MODULES   += winwave
 endif
@@ -24,9 +24,33 @@
   "User 2 with ICE" <sip:user@1.2.3.4;transport=tcp>;medianat=ice
   "User 3 with IPv6" <sip:user@[2001:df8:0:16:216:6fff:fe91:614c]:5070>
  \endverbatim
+ *
+ * The command "uareload" reads the file again. User-Agents are created
+ * for new lines and destroyed for lines that were removed, while the
+ * User-Agents of lines that did not change keep their registrations and
+ * calls. A changed line is a new line. The module must be loaded with
+ * module_app for the command to be available.
  */
 
 
+/* The lines of an accounts file, in file order */
+struct lineset {
+	struct list linel;
+	struct hash *ht;
+};
+
+struct acline {
+	struct le le;
+	struct le he;
+	char *addr;
+};
+
+
+enum { HASH_SIZE = 256 };
+
+static struct lineset *lines;   /* lines from the last read */
+
+
 static int account_write_template(const char *file)
 {
 	FILE *f = NULL;
@@ -99,21 +123,132 @@ static int account_write_template(const char *file)
 }
 
 
+static void acline_destructor(void *arg)
+{
+	struct acline *line = arg;
+
+	list_unlink(&line->le);
+	hash_unlink(&line->he);
+	mem_deref(line->addr);
+}
+
+
+static void lineset_destructor(void *arg)
+{
+	struct lineset *set = arg;
+
+	list_flush(&set->linel);
+	mem_deref(set->ht);
+}
+
+
+static bool line_cmp_handler(struct le *le, void *arg)
+{
+	const struct acline *line = le->data;
+
+	return 0 == str_cmp(line->addr, arg);
+}
+
+
+static bool line_exists(const struct lineset *set, const char *addr)
+{
+	if (!set)
+		return false;
+
+	return NULL != hash_lookup(set->ht, hash_joaat_str(addr),
+				   line_cmp_handler, (void *)addr);
+}
+
+
 /**
- * Add a User-Agent (UA)
+ * Add a line of the accounts file
  *
  * @param addr SIP Address string
+ * @param arg  Set of lines
  *
  * @return 0 if success, otherwise errorcode
  */
 static int line_handler(const struct pl *addr, void *arg)
 {
-	char buf[512];
-	(void)arg;
+	struct lineset *set = arg;
+	struct acline *line;
+	int err;
+
+	line = mem_zalloc(sizeof(*line), acline_destructor);
+	if (!line)
+		return ENOMEM;
+
+	err = pl_strdup(&line->addr, addr);
+	if (err)
+		goto out;
+
+	/* a duplicate line has one User-Agent */
+	if (line_exists(set, line->addr))
+		goto out;
+
+	list_append(&set->linel, &line->le, line);
+	hash_append(set->ht, hash_joaat_str(line->addr), &line->he, line);
+
+ out:
+	if (!line->le.list)
+		mem_deref(line);
+
+	return err;
+}
+
+
+static int lineset_alloc(struct lineset **setp)
+{
+	struct lineset *set;
+	int err;
+
+	set = mem_zalloc(sizeof(*set), lineset_destructor);
+	if (!set)
+		return ENOMEM;
+
+	err = hash_alloc(&set->ht, HASH_SIZE);
+	if (err)
+		mem_deref(set);
+	else
+		*setp = set;
+
+	return err;
+}
+
+
+static int lines_read(struct lineset **setp, const char *file)
+{
+	struct lineset *set;
+	int err;
+
+	err = lineset_alloc(&set);
+	if (err)
+		return err;
+
+	err = conf_parse(file, line_handler, set);
+	if (err)
+		mem_deref(set);
+	else
+		*setp = set;
+
+	return err;
+}
+
+
+static int file_get(char *path, size_t psz, char *file, size_t fsz)
+{
+	int err;
+
+	err = conf_path_get(path, psz);
+	if (err) {
+		warning("account: conf_path_get (%m)\n", err);
+		return err;
+	}
 
-	(void)pl_strcpy(addr, buf, sizeof(buf));
+	if (re_snprintf(file, fsz, "%s/accounts", path) < 0)
+		return ENOMEM;
 
-	return ua_alloc(NULL, buf);
+	return 0;
 }
 
 
@@ -125,17 +260,13 @@ static int line_handler(const struct pl *addr, void *arg)
 static int account_read_file(void)
 {
 	char path[256] = "", file[256] = "";
+	struct le *le;
 	uint32_t n;
 	int err;
 
-	err = conf_path_get(path, sizeof(path));
-	if (err) {
-		warning("account: conf_path_get (%m)\n", err);
+	err = file_get(path, sizeof(path), file, sizeof(file));
+	if (err)
 		return err;
-	}
-
-	if (re_snprintf(file, sizeof(file), "%s/accounts", path) < 0)
-		return ENOMEM;
 
 	if (!conf_fileexist(file)) {
 
@@ -146,10 +277,18 @@ static int account_read_file(void)
 			return err;
 	}
 
-	err = conf_parse(file, line_handler, NULL);
+	err = lines_read(&lines, file);
 	if (err)
 		return err;
 
+	for (le = lines->linel.head; le; le = le->next) {
+		const struct acline *line = le->data;
+
+		err = ua_alloc(NULL, line->addr);
+		if (err)
+			return err;
+	}
+
 	n = list_count(uag_list());
 	info("Populated %u account%s\n", n, 1==n ? "" : "s");
 
@@ -163,14 +302,114 @@ static int account_read_file(void)
 }
 
 
+/*
+ * Reload the accounts file. Only the User-Agents of lines that were
+ * read from the file before are destroyed, so that User-Agents from
+ * other sources are kept.
+ */
+static int cmd_reload(struct re_printf *pf, void *unused)
+{
+	char path[256] = "", file[256] = "";
+	struct lineset *set = NULL, *live = NULL;
+	unsigned n_add = 0, n_del = 0, n_keep = 0;
+	struct le *le;
+	int err;
+	(void)unused;
+
+	err = file_get(path, sizeof(path), file, sizeof(file));
+	if (err)
+		return err;
+
+	err  = lines_read(&set, file);
+	err |= lineset_alloc(&live);
+	if (err)
+		goto out;
+
+	le = list_head(uag_list());
+	while (le) {
+		struct ua *ua = le->data;
+		const char *addr = account_sipaddr(ua_account(ua));
+		struct pl pl;
+
+		le = le->next;
+
+		if (!addr)
+			continue;
+
+		if (line_exists(lines, addr) && !line_exists(set, addr)) {
+
+			info("account: removing %s\n", ua_aor(ua));
+			mem_deref(ua);
+			++n_del;
+			continue;
+		}
+
+		pl_set_str(&pl, addr);
+		err = line_handler(&pl, live);
+		if (err)
+			goto out;
+	}
+
+	for (le = set->linel.head; le; le = le->next) {
+		const struct acline *line = le->data;
+
+		if (line_exists(live, line->addr)) {
+			++n_keep;
+			continue;
+		}
+
+		info("account: adding %s\n", line->addr);
+
+		err = ua_alloc(NULL, line->addr);
+		if (err) {
+			warning("account: %s: %m\n", line->addr, err);
+			continue;
+		}
+
+		++n_add;
+	}
+
+	(void)re_hprintf(pf, "accounts: %u added, %u removed,"
+			 " %u unchanged\n", n_add, n_del, n_keep);
+
+	mem_deref(lines);
+	lines = set;
+	set = NULL;
+
+ out:
+	if (err)
+		warning("account: reload of %s failed (%m)\n", file, err);
+
+	mem_deref(live);
+	mem_deref(set);
+
+	return err;
+}
+
+
+static const struct cmd cmdv[] = {
+	{"uareload", 0, 0, "Reload the accounts file", cmd_reload },
+};
+
+
 static int module_init(void)
 {
-	return account_read_file();
+	int err;
+
+	err = account_read_file();
+	if (err)
+		return err;
+
+	return cmd_register(baresip_commands(), cmdv, ARRAY_SIZE(cmdv));
 }
 
 
 static int module_close(void)
 {
+	cmd_unregister(baresip_commands(), cmdv);
+
+	lines = mem_deref(lines);
+
 	return 0;
 }
 
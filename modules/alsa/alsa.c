@@ -8,7 +8,9 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <alsa/asoundlib.h>
 #include <re.h>
 #include <rem.h>
@@ -21,6 +23,20 @@
  *
  * Advanced Linux Sound Architecture (ALSA) audio driver module
  *
+ * The device period is one packet-time, unless it is configured. In the
+ * mmap mode the threads move one period at a time directly between the
+ * audio buffer of the device and the audio stream, so the period and
+ * the buffer can be much shorter than the packet-time.
+ *
+ * Example config:
+ \verbatim
+  alsa_sample_format      s16       # s16, float or s24_3le
+  alsa_mmap               no        # use mmap access
+  alsa_period             0         # period [frames], 0 is ptime
+  alsa_buffer             0         # buffer [frames], 0 is 4 periods
+  alsa_realtime           0         # SCHED_FIFO priority, 0 is off
+ \endverbatim
+ *
  *
  * References:
  *
@@ -30,19 +46,39 @@
 
 char alsa_dev[64] = "default";
 enum aufmt alsa_sample_format = AUFMT_S16LE;
+bool alsa_mmap = false;
+
+static uint32_t alsa_period;
+static uint32_t alsa_buffer;
+static uint32_t alsa_realtime;
 
 static struct ausrc *ausrc;
 static struct auplay *auplay;
 
 
+/**
+ * Configure the hardware parameters of a PCM device
+ *
+ * @param pcm        PCM device
+ * @param srate      Sampling rate in [Hz]
+ * @param ch         Number of channels
+ * @param num_frames Frames per packet-time, the default period
+ * @param pcmfmt     Sample format
+ * @param periodp    Returned period size in frames (optional)
+ *
+ * @return 0 if success, otherwise errorcode
+ */
 int alsa_reset(snd_pcm_t *pcm, uint32_t srate, uint32_t ch,
 	       uint32_t num_frames,
-	       snd_pcm_format_t pcmfmt)
+	       snd_pcm_format_t pcmfmt, snd_pcm_uframes_t *periodp)
 {
 	snd_pcm_hw_params_t *hw_params = NULL;
-	snd_pcm_uframes_t period = num_frames, bufsize = num_frames * 4;
+	snd_pcm_uframes_t period, bufsize;
 	int err;
 
+	period  = alsa_period ? alsa_period : num_frames;
+	bufsize = alsa_buffer ? alsa_buffer : period * 4;
+
 	debug("alsa: reset: srate=%u, ch=%u, num_frames=%u, pcmfmt=%s\n",
 	      srate, ch, num_frames, snd_pcm_format_name(pcmfmt));
 
@@ -60,7 +96,8 @@ int alsa_reset(snd_pcm_t *pcm, uint32_t srate, uint32_t ch,
 		goto out;
 	}
 
-	err = snd_pcm_hw_params_set_access(pcm, hw_params,
+	err = snd_pcm_hw_params_set_access(pcm, hw_params, alsa_mmap ?
+					   SND_PCM_ACCESS_MMAP_INTERLEAVED :
 					   SND_PCM_ACCESS_RW_INTERLEAVED);
 	if (err < 0) {
 		warning("alsa: cannot set access type (%s)\n",
@@ -109,6 +146,16 @@ int alsa_reset(snd_pcm_t *pcm, uint32_t srate, uint32_t ch,
 		goto out;
 	}
 
+	/* the device may have chosen other sizes */
+	(void)snd_pcm_hw_params_get_period_size(hw_params, &period, 0);
+	(void)snd_pcm_hw_params_get_buffer_size(hw_params, &bufsize);
+
+	if (periodp)
+		*periodp = period;
+
+	debug("alsa: period=%lu buffer=%lu frames%s\n",
+	      period, bufsize, alsa_mmap ? " (mmap)" : "");
+
 	err = snd_pcm_prepare(pcm);
 	if (err < 0) {
 		warning("alsa: cannot prepare audio interface for use (%s)\n",
@@ -129,6 +176,60 @@ int alsa_reset(snd_pcm_t *pcm, uint32_t srate, uint32_t ch,
 }
 
 
+/**
+ * Give the calling device thread real-time priority and pin it to the
+ * audio_cpus_dev CPUs, if configured
+ *
+ * @param device Device name, for logging
+ */
+void alsa_thread_realtime(const char *device)
+{
+	struct sched_param param;
+	int err;
+
+	(void)realtime_affinity(conf_config()->audio.cpus_dev, -1);
+
+	if (!alsa_realtime)
+		return;
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = alsa_realtime;
+
+	err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (err) {
+		warning("alsa: could not set SCHED_FIFO priority %u"
+			" for '%s' (%m)\n", alsa_realtime, device, err);
+	}
+}
+
+
+/**
+ * Recover a PCM device from an error, and count the xruns
+ *
+ * @param pcm    PCM device
+ * @param err    Negative error code from ALSA
+ * @param n_xrun Xrun counter
+ *
+ * @return 0 if recovered, otherwise a negative error code
+ */
+int alsa_recover(snd_pcm_t *pcm, int err, uint32_t *n_xrun)
+{
+	if (err == -EPIPE || err == -ESTRPIPE)
+		++*n_xrun;
+
+	return snd_pcm_recover(pcm, err, 1);
+}
+
+
+/* Address of the first interleaved frame at offset in the mmap area */
+void *alsa_mmap_area(const snd_pcm_channel_area_t *areas,
+		     snd_pcm_uframes_t offset)
+{
+	return (uint8_t *)areas[0].addr +
+		(areas[0].first + offset * areas[0].step) / 8;
+}
+
+
 snd_pcm_format_t aufmt_to_alsaformat(enum aufmt fmt)
 {
 	switch (fmt) {
@@ -166,8 +267,18 @@ static int alsa_init(void)
 		     aufmt_name(alsa_sample_format));
 	}
 
+	(void)conf_get_bool(conf_cur(), "alsa_mmap", &alsa_mmap);
+	(void)conf_get_u32(conf_cur(), "alsa_period", &alsa_period);
+	(void)conf_get_u32(conf_cur(), "alsa_buffer", &alsa_buffer);
+	(void)conf_get_u32(conf_cur(), "alsa_realtime", &alsa_realtime);
+
 	err  = ausrc_register(&ausrc, "alsa", alsa_src_alloc);
 	err |= auplay_register(&auplay, "alsa", alsa_play_alloc);
+	if (err)
+		return err;
+
+	ausrc_set_debug(ausrc, alsa_src_debug);
+	auplay_set_debug(auplay, alsa_play_debug);
 
 	return err;
 }
@@ -7,9 +7,15 @@
 
 extern char alsa_dev[64];
 extern enum aufmt alsa_sample_format;
+extern bool alsa_mmap;
 
 int alsa_reset(snd_pcm_t *pcm, uint32_t srate, uint32_t ch,
-	       uint32_t num_frames, snd_pcm_format_t pcmfmt);
+	       uint32_t num_frames, snd_pcm_format_t pcmfmt,
+	       snd_pcm_uframes_t *periodp);
+void alsa_thread_realtime(const char *device);
+int  alsa_recover(snd_pcm_t *pcm, int err, uint32_t *n_xrun);
+void *alsa_mmap_area(const snd_pcm_channel_area_t *areas,
+		     snd_pcm_uframes_t offset);
 snd_pcm_format_t aufmt_to_alsaformat(enum aufmt fmt);
 int alsa_src_alloc(struct ausrc_st **stp, const struct ausrc *as,
 		   struct media_ctx **ctx,
@@ -18,3 +24,5 @@ int alsa_src_alloc(struct ausrc_st **stp, const struct ausrc *as,
 int alsa_play_alloc(struct auplay_st **stp, const struct auplay *ap,
 		    struct auplay_prm *prm, const char *device,
 		    auplay_write_h *wh, void *arg);
+int alsa_src_debug(struct re_printf *pf, const struct ausrc_st *st);
+int alsa_play_debug(struct re_printf *pf, const struct auplay_st *st);
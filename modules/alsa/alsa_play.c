@@ -17,14 +17,21 @@
 #include "alsa.h"
 
 
+enum {
+	WAIT_MS = 100,    /* Timeout for the device to become ready [ms] */
+};
+
+
 struct auplay_st {
 	const struct auplay *ap;  /* pointer to base-class (inheritance) */
 	pthread_t thread;
 	bool run;
 	snd_pcm_t *write;
-	int16_t *sampv;
+	void *sampv;
 	void *xsampv;
 	size_t sampc;
+	snd_pcm_uframes_t period;
+	uint32_t n_xrun;
 	auplay_write_h *wh;
 	void *arg;
 	struct auplay_prm prm;
@@ -53,12 +60,71 @@ static void auplay_destructor(void *arg)
 }
 
 
+/* Move one period at a time into the mmap area of the device */
+static void write_mmap(struct auplay_st *st)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t n;
+	size_t sampc;
+	void *sampv;
+	int err;
+
+	while (st->run) {
+
+		n = snd_pcm_avail_update(st->write);
+		if (n < 0) {
+			(void)alsa_recover(st->write, (int)n, &st->n_xrun);
+			continue;
+		}
+		else if ((snd_pcm_uframes_t)n < st->period) {
+			err = snd_pcm_wait(st->write, WAIT_MS);
+			if (err < 0)
+				(void)alsa_recover(st->write, err,
+						   &st->n_xrun);
+			continue;
+		}
+
+		frames = st->period;
+		err = snd_pcm_mmap_begin(st->write, &areas, &offset, &frames);
+		if (err < 0) {
+			(void)alsa_recover(st->write, err, &st->n_xrun);
+			continue;
+		}
+
+		sampv = alsa_mmap_area(areas, offset);
+		sampc = frames * st->prm.ch;
+
+		if (st->aufmt == st->prm.fmt) {
+			st->wh(sampv, sampc, st->arg);
+		}
+		else {
+			st->wh(st->sampv, sampc, st->arg);
+			auconv_from_s16(st->aufmt, sampv, st->sampv, sampc);
+		}
+
+		n = snd_pcm_mmap_commit(st->write, offset, frames);
+		if (n < 0 || (snd_pcm_uframes_t)n != frames) {
+			(void)alsa_recover(st->write, n < 0 ? (int)n : -EPIPE,
+					   &st->n_xrun);
+		}
+	}
+}
+
+
 static void *write_thread(void *arg)
 {
 	struct auplay_st *st = arg;
 	int n;
 	int num_frames;
 
+	alsa_thread_realtime(st->device);
+
+	if (alsa_mmap) {
+		write_mmap(st);
+		return NULL;
+	}
+
 	num_frames = st->prm.srate * st->prm.ptime / 1000;
 
 	while (st->run) {
@@ -67,7 +133,7 @@ static void *write_thread(void *arg)
 
 		st->wh(st->sampv, st->sampc, st->arg);
 
-		if (st->aufmt == AUFMT_S16LE) {
+		if (st->aufmt == st->prm.fmt) {
 			sampv = st->sampv;
 		}
 		else {
@@ -79,6 +145,7 @@ static void *write_thread(void *arg)
 		n = snd_pcm_writei(st->write, sampv, samples);
 
 		if (-EPIPE == n) {
+			++st->n_xrun;
 			snd_pcm_prepare(st->write);
 
 			n = snd_pcm_writei(st->write, sampv, samples);
@@ -100,6 +167,17 @@ static void *write_thread(void *arg)
 }
 
 
+int alsa_play_debug(struct re_printf *pf, const struct auplay_st *st)
+{
+	if (!st)
+		return 0;
+
+	return re_hprintf(pf, "alsa '%s' period=%lu frames%s xruns=%u",
+			  st->device, st->period,
+			  alsa_mmap ? " (mmap)" : "", st->n_xrun);
+}
+
+
 int alsa_play_alloc(struct auplay_st **stp, const struct auplay *ap,
 		    struct auplay_prm *prm, const char *device,
 		    auplay_write_h *wh, void *arg)
@@ -112,6 +190,10 @@ int alsa_play_alloc(struct auplay_st **stp, const struct auplay *ap,
 	if (!stp || !ap || !prm || !wh)
 		return EINVAL;
 
+	/* the application may use the device format directly */
+	if (prm->fmt != AUFMT_S16LE && prm->fmt != alsa_sample_format)
+		return ENOTSUP;
+
 	if (!str_isset(device))
 		device = alsa_dev;
 
@@ -132,21 +214,6 @@ int alsa_play_alloc(struct auplay_st **stp, const struct auplay *ap,
 	st->sampc = prm->srate * prm->ch * prm->ptime / 1000;
 	num_frames = st->prm.srate * st->prm.ptime / 1000;
 
-	st->sampv = mem_alloc(2 * st->sampc, NULL);
-	if (!st->sampv) {
-		err = ENOMEM;
-		goto out;
-	}
-
-	if (st->aufmt != AUFMT_S16LE) {
-		size_t sz = aufmt_sample_size(st->aufmt) * st->sampc;
-		st->xsampv = mem_alloc(sz, NULL);
-		if (!st->xsampv) {
-			err = ENOMEM;
-			goto out;
-		}
-	}
-
 	err = snd_pcm_open(&st->write, st->device, SND_PCM_STREAM_PLAYBACK, 0);
 	if (err < 0) {
 		warning("alsa: could not open auplay device '%s' (%s)\n",
@@ -163,13 +230,32 @@ int alsa_play_alloc(struct auplay_st **stp, const struct auplay *ap,
 	}
 
 	err = alsa_reset(st->write, st->prm.srate, st->prm.ch, num_frames,
-			 pcmfmt);
+			 pcmfmt, &st->period);
 	if (err) {
 		warning("alsa: could not reset player '%s' (%s)\n",
 			st->device, snd_strerror(err));
 		goto out;
 	}
 
+	/* in mmap mode one period is written at a time */
+	if (alsa_mmap)
+		st->sampc = st->period * prm->ch;
+
+	st->sampv = mem_alloc(aufmt_sample_size(prm->fmt) * st->sampc, NULL);
+	if (!st->sampv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (st->aufmt != st->prm.fmt && !alsa_mmap) {
+		size_t sz = aufmt_sample_size(st->aufmt) * st->sampc;
+		st->xsampv = mem_alloc(sz, NULL);
+		if (!st->xsampv) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
 	st->run = true;
 	err = pthread_create(&st->thread, NULL, write_thread, st);
 	if (err) {
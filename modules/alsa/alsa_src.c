@@ -17,14 +17,21 @@
 #include "alsa.h"
 
 
+enum {
+	WAIT_MS = 100,    /* Timeout for the device to become ready [ms] */
+};
+
+
 struct ausrc_st {
 	const struct ausrc *as;  /* pointer to base-class (inheritance) */
 	pthread_t thread;
 	bool run;
 	snd_pcm_t *read;
-	int16_t *sampv;
+	void *sampv;
 	void *xsampv;
 	size_t sampc;
+	snd_pcm_uframes_t period;
+	uint32_t n_xrun;
 	ausrc_read_h *rh;
 	void *arg;
 	struct ausrc_prm prm;
@@ -53,6 +60,62 @@ static void ausrc_destructor(void *arg)
 }
 
 
+static void recover(struct ausrc_st *st, int err)
+{
+	if (0 == alsa_recover(st->read, err, &st->n_xrun))
+		(void)snd_pcm_start(st->read);
+}
+
+
+/* Move one period at a time out of the mmap area of the device */
+static void read_mmap(struct ausrc_st *st)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t n;
+	size_t sampc;
+	void *sampv;
+	int err;
+
+	while (st->run) {
+
+		n = snd_pcm_avail_update(st->read);
+		if (n < 0) {
+			recover(st, (int)n);
+			continue;
+		}
+		else if ((snd_pcm_uframes_t)n < st->period) {
+			err = snd_pcm_wait(st->read, WAIT_MS);
+			if (err < 0)
+				recover(st, err);
+			continue;
+		}
+
+		frames = st->period;
+		err = snd_pcm_mmap_begin(st->read, &areas, &offset, &frames);
+		if (err < 0) {
+			recover(st, err);
+			continue;
+		}
+
+		sampv = alsa_mmap_area(areas, offset);
+		sampc = frames * st->prm.ch;
+
+		if (st->aufmt == st->prm.fmt) {
+			st->rh(sampv, sampc, st->arg);
+		}
+		else {
+			auconv_to_s16(st->sampv, st->aufmt, sampv, sampc);
+			st->rh(st->sampv, sampc, st->arg);
+		}
+
+		n = snd_pcm_mmap_commit(st->read, offset, frames);
+		if (n < 0 || (snd_pcm_uframes_t)n != frames)
+			recover(st, n < 0 ? (int)n : -EPIPE);
+	}
+}
+
+
 static void *read_thread(void *arg)
 {
 	struct ausrc_st *st = arg;
@@ -61,6 +124,8 @@ static void *read_thread(void *arg)
 
 	num_frames = st->prm.srate * st->prm.ptime / 1000;
 
+	alsa_thread_realtime(st->device);
+
 	/* Start */
 	err = snd_pcm_start(st->read);
 	if (err) {
@@ -69,17 +134,23 @@ static void *read_thread(void *arg)
 		goto out;
 	}
 
+	if (alsa_mmap) {
+		read_mmap(st);
+		goto out;
+	}
+
 	while (st->run) {
 		size_t sampc;
 		void *sampv;
 
-		if (st->aufmt == AUFMT_S16LE)
+		if (st->aufmt == st->prm.fmt)
 			sampv = st->sampv;
 		else
 			sampv = st->xsampv;
 
 		err = snd_pcm_readi(st->read, sampv, num_frames);
 		if (err == -EPIPE) {
+			++st->n_xrun;
 			snd_pcm_prepare(st->read);
 			continue;
 		}
@@ -89,7 +160,7 @@ static void *read_thread(void *arg)
 
 		sampc = err * st->prm.ch;
 
-		if (st->aufmt != AUFMT_S16LE) {
+		if (st->aufmt != st->prm.fmt) {
 			auconv_to_s16(st->sampv, st->aufmt,
 				      st->xsampv, sampc);
 		}
@@ -102,6 +173,17 @@ static void *read_thread(void *arg)
 }
 
 
+int alsa_src_debug(struct re_printf *pf, const struct ausrc_st *st)
+{
+	if (!st)
+		return 0;
+
+	return re_hprintf(pf, "alsa '%s' period=%lu frames%s xruns=%u",
+			  st->device, st->period,
+			  alsa_mmap ? " (mmap)" : "", st->n_xrun);
+}
+
+
 int alsa_src_alloc(struct ausrc_st **stp, const struct ausrc *as,
 		   struct media_ctx **ctx,
 		   struct ausrc_prm *prm, const char *device,
@@ -117,6 +199,10 @@ int alsa_src_alloc(struct ausrc_st **stp, const struct ausrc *as,
 	if (!stp || !as || !prm || !rh)
 		return EINVAL;
 
+	/* the application may use the device format directly */
+	if (prm->fmt != AUFMT_S16LE && prm->fmt != alsa_sample_format)
+		return ENOTSUP;
+
 	if (!str_isset(device))
 		device = alsa_dev;
 
@@ -137,21 +223,6 @@ int alsa_src_alloc(struct ausrc_st **stp, const struct ausrc *as,
 	st->sampc = prm->srate * prm->ch * prm->ptime / 1000;
 	num_frames = st->prm.srate * st->prm.ptime / 1000;
 
-	st->sampv = mem_alloc(2 * st->sampc, NULL);
-	if (!st->sampv) {
-		err = ENOMEM;
-		goto out;
-	}
-
-	if (st->aufmt != AUFMT_S16LE) {
-		size_t sz = aufmt_sample_size(st->aufmt) * st->sampc;
-		st->xsampv = mem_alloc(sz, NULL);
-		if (!st->xsampv) {
-			err = ENOMEM;
-			goto out;
-		}
-	}
-
 	err = snd_pcm_open(&st->read, st->device, SND_PCM_STREAM_CAPTURE, 0);
 	if (err < 0) {
 		warning("alsa: could not open ausrc device '%s' (%s)\n",
@@ -168,13 +239,32 @@ int alsa_src_alloc(struct ausrc_st **stp, const struct ausrc *as,
 	}
 
 	err = alsa_reset(st->read, st->prm.srate, st->prm.ch, num_frames,
-			 pcmfmt);
+			 pcmfmt, &st->period);
 	if (err) {
 		warning("alsa: could not reset source '%s' (%s)\n",
 			st->device, snd_strerror(err));
 		goto out;
 	}
 
+	/* in mmap mode one period is read at a time */
+	if (alsa_mmap)
+		st->sampc = st->period * prm->ch;
+
+	st->sampv = mem_alloc(aufmt_sample_size(prm->fmt) * st->sampc, NULL);
+	if (!st->sampv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (st->aufmt != st->prm.fmt && !alsa_mmap) {
+		size_t sz = aufmt_sample_size(st->aufmt) * st->sampc;
+		st->xsampv = mem_alloc(sz, NULL);
+		if (!st->xsampv) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
 	st->run = true;
 	err = pthread_create(&st->thread, NULL, read_thread, st);
 	if (err) {
@@ -17,6 +17,8 @@
  * so that all output to AUPLAY device is bridged as the input to
  * a AUSRC device.
  *
+ * All devices are clocked by one thread with a packet-time of 20 ms.
+ *
  * Sample config:
  *
  \verbatim
@@ -52,6 +54,8 @@ static int module_close(void)
 	ausrc  = mem_deref(ausrc);
 	auplay = mem_deref(auplay);
 
+	device_close();
+
 	ht_device = mem_deref(ht_device);
 
 	return 0;
@@ -39,3 +39,4 @@ int src_alloc(struct ausrc_st **stp, const struct ausrc *as,
 int  device_connect(struct device **devp, const char *device,
 		    struct auplay_st *auplay, struct ausrc_st *ausrc);
 void device_stop(struct device *dev);
+void device_close(void);
@@ -3,6 +3,7 @@
  *
  * Copyright (C) 2010 Creytiv.com
  */
+#include <time.h>
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -10,17 +11,46 @@
 #include "aubridge.h"
 
 
+/*
+ * All devices are clocked by one scheduler thread. It wakes up on an
+ * absolute 20 ms deadline, so the period does not drift with the time
+ * spent in the devices, and then runs every connected device in one
+ * batch. The mutex protects the list of running devices, a device is
+ * not used by the thread after it was removed from the list. It also
+ * protects the device table, as the calls of several event loops
+ * connect their devices (see call_shards).
+ */
+
+
 /* The packet-time is fixed to 20 milliseconds */
-enum {PTIME = 20};
+enum {
+	PTIME   = 20,
+	MAX_LAG = 100,   /* Do not catch up beyond this [ms] */
+};
 
 
 struct device {
 	struct le le;
+	struct le le_run;
 	const struct ausrc_st *ausrc;
 	const struct auplay_st *auplay;
 	char name[64];
+	struct auresamp rs;
+	int16_t *sampv_in;
+	int16_t *sampv_out;
+	size_t sampc_in;
+	size_t sampc_out;
+	bool run;
+};
+
+
+static struct {
+	pthread_mutex_t mutex;
 	pthread_t thread;
+	struct list runl;
 	volatile bool run;
+} sched = {
+	PTHREAD_MUTEX_INITIALIZER,
 };
 
 
@@ -30,7 +60,9 @@ static void destructor(void *arg)
 
 	device_stop(dev);
 
+	pthread_mutex_lock(&sched.mutex);
 	list_unlink(&dev->le);
+	pthread_mutex_unlock(&sched.mutex);
 }
 
 
@@ -49,85 +81,156 @@ static struct device *find_device(const char *device)
 }
 
 
-static void *device_thread(void *arg)
+/* Monotonic time in [ms] */
+static uint64_t sched_now(void)
 {
-	uint64_t now, ts = tmr_jiffies();
-	struct device *dev = arg;
-	struct auresamp rs;
-	int16_t *sampv_in, *sampv_out;
-	size_t sampc_in;
-	size_t sampc_out;
-	int err;
+#ifdef LINUX
+	struct timespec ts;
 
-	sampc_in = dev->auplay->prm.srate * dev->auplay->prm.ch * PTIME/1000;
-	sampc_out = dev->ausrc->prm.srate * dev->ausrc->prm.ch * PTIME/1000;
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	auresamp_init(&rs);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+	return tmr_jiffies();
+#endif
+}
 
-	sampv_in  = mem_alloc(2 * sampc_in, NULL);
-	sampv_out = mem_alloc(2 * sampc_out, NULL);
-	if (!sampv_in || !sampv_out)
-		goto out;
 
-	err = auresamp_setup(&rs,
-			     dev->auplay->prm.srate, dev->auplay->prm.ch,
-			     dev->ausrc->prm.srate, dev->ausrc->prm.ch);
-	if (err)
-		goto out;
+static void sched_sleep(uint64_t deadline)
+{
+#ifdef LINUX
+	struct timespec ts;
 
-	while (dev->run) {
+	ts.tv_sec  = deadline / 1000;
+	ts.tv_nsec = (deadline % 1000) * 1000000;
 
-		(void)sys_msleep(4);
+	while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					&ts, NULL))
+		;
+#else
+	uint64_t now = sched_now();
 
-		if (!dev->run)
-			break;
+	if (deadline > now)
+		(void)sys_msleep((unsigned)(deadline - now));
+#endif
+}
 
-		now = tmr_jiffies();
 
-		if (ts > now)
-			continue;
+/* Called from the scheduler thread with the mutex held */
+static void device_process(struct device *dev)
+{
+	if (dev->auplay->wh)
+		dev->auplay->wh(dev->sampv_in, dev->sampc_in,
+				dev->auplay->arg);
 
-		if (dev->auplay && dev->auplay->wh) {
-			dev->auplay->wh(sampv_in, sampc_in, dev->auplay->arg);
-		}
+	if (!dev->ausrc->rh)
+		return;
 
-		if (rs.resample) {
-			err = auresamp(&rs,
-				       sampv_out, &sampc_out,
-				       sampv_in, sampc_in);
-			if (err) {
-				warning("aubridge: auresamp error"
-					" sampc_out=%zu, sampc_in=%zu (%m)\n",
-					sampc_out, sampc_in, err);
-			}
-
-			if (dev->ausrc && dev->ausrc->rh) {
-				dev->ausrc->rh(sampv_out, sampc_out,
-					       dev->ausrc->arg);
-			}
-		}
-		else {
-			if (dev->ausrc && dev->ausrc->rh) {
-				dev->ausrc->rh(sampv_in, sampc_in,
-					       dev->ausrc->arg);
-			}
+	if (dev->rs.resample) {
+
+		size_t sampc_out = dev->sampc_out;
+		int err;
+
+		err = auresamp(&dev->rs, dev->sampv_out, &sampc_out,
+			       dev->sampv_in, dev->sampc_in);
+		if (err) {
+			warning("aubridge: auresamp error"
+				" sampc_out=%zu, sampc_in=%zu (%m)\n",
+				sampc_out, dev->sampc_in, err);
+			return;
 		}
 
-		ts += PTIME;
+		dev->ausrc->rh(dev->sampv_out, sampc_out, dev->ausrc->arg);
 	}
+	else {
+		dev->ausrc->rh(dev->sampv_in, dev->sampc_in,
+			       dev->ausrc->arg);
+	}
+}
+
+
+static void *sched_thread(void *arg)
+{
+	uint64_t now, deadline = sched_now();
+	(void)arg;
 
- out:
-	mem_deref(sampv_in);
-	mem_deref(sampv_out);
+	while (sched.run) {
+
+		struct le *le;
+
+		deadline += PTIME;
+		sched_sleep(deadline);
+
+		pthread_mutex_lock(&sched.mutex);
+
+		for (le = sched.runl.head; le; le = le->next)
+			device_process(le->data);
+
+		pthread_mutex_unlock(&sched.mutex);
+
+		/* after a stall, skip the lost periods */
+		now = sched_now();
+		if (now > deadline + MAX_LAG)
+			deadline = now;
+	}
 
 	return NULL;
 }
 
 
+static int device_start(struct device *dev)
+{
+	int err;
+
+	dev->sampc_in  = dev->auplay->prm.srate * dev->auplay->prm.ch
+		* PTIME / 1000;
+	dev->sampc_out = dev->ausrc->prm.srate * dev->ausrc->prm.ch
+		* PTIME / 1000;
+
+	auresamp_init(&dev->rs);
+
+	err = auresamp_setup(&dev->rs,
+			     dev->auplay->prm.srate, dev->auplay->prm.ch,
+			     dev->ausrc->prm.srate, dev->ausrc->prm.ch);
+	if (err)
+		return err;
+
+	dev->sampv_in = mem_zalloc(2 * dev->sampc_in, NULL);
+	if (!dev->sampv_in)
+		return ENOMEM;
+
+	if (dev->rs.resample) {
+		dev->sampv_out = mem_zalloc(2 * dev->sampc_out, NULL);
+		if (!dev->sampv_out)
+			return ENOMEM;
+	}
+
+	pthread_mutex_lock(&sched.mutex);
+
+	list_append(&sched.runl, &dev->le_run, dev);
+	dev->run = true;
+
+	if (!sched.run) {
+		sched.run = true;
+		err = pthread_create(&sched.thread, NULL, sched_thread, NULL);
+		if (err) {
+			sched.run = false;
+			list_unlink(&dev->le_run);
+			dev->run = false;
+		}
+	}
+
+	pthread_mutex_unlock(&sched.mutex);
+
+	return err;
+}
+
+
 int device_connect(struct device **devp, const char *device,
 		   struct auplay_st *auplay, struct ausrc_st *ausrc)
 {
 	struct device *dev;
+	bool created = false;
 	int err = 0;
 
 	if (!devp)
@@ -135,23 +238,30 @@ int device_connect(struct device **devp, const char *device,
 	if (!str_isset(device))
 		return ENODEV;
 
+	pthread_mutex_lock(&sched.mutex);
+
 	dev = find_device(device);
 	if (dev) {
 		*devp = mem_ref(dev);
 	}
 	else {
 		dev = mem_zalloc(sizeof(*dev), destructor);
-		if (!dev)
-			return ENOMEM;
-
-		str_ncpy(dev->name, device, sizeof(dev->name));
+		if (dev) {
+			str_ncpy(dev->name, device, sizeof(dev->name));
+			hash_append(ht_device, hash_joaat_str(device),
+				    &dev->le, dev);
+			*devp = dev;
+			created = true;
+		}
+	}
 
-		hash_append(ht_device, hash_joaat_str(device), &dev->le, dev);
+	pthread_mutex_unlock(&sched.mutex);
 
-		*devp = dev;
+	if (!dev)
+		return ENOMEM;
 
+	if (created)
 		info("aubridge: created device '%s'\n", device);
-	}
 
 	if (auplay)
 		dev->auplay = auplay;
@@ -159,14 +269,8 @@ int device_connect(struct device **devp, const char *device,
 		dev->ausrc = ausrc;
 
 	/* wait until we have both SRC+PLAY */
-	if (dev->ausrc && dev->auplay && !dev->run) {
-
-		dev->run = true;
-		err = pthread_create(&dev->thread, NULL, device_thread, dev);
-		if (err) {
-			dev->run = false;
-		}
-	}
+	if (dev->ausrc && dev->auplay && !dev->run)
+		err = device_start(dev);
 
 	return err;
 }
@@ -177,11 +281,28 @@ void device_stop(struct device *dev)
 	if (!dev)
 		return;
 
+	pthread_mutex_lock(&sched.mutex);
+
+	list_unlink(&dev->le_run);
+	dev->run = false;
 	dev->auplay = NULL;
 	dev->ausrc = NULL;
 
-	if (dev->run) {
-		dev->run = false;
-		pthread_join(dev->thread, NULL);
-	}
+	pthread_mutex_unlock(&sched.mutex);
+
+	dev->sampv_in  = mem_deref(dev->sampv_in);
+	dev->sampv_out = mem_deref(dev->sampv_out);
+}
+
+
+/**
+ * Stop the scheduler thread, when all devices are gone
+ */
+void device_close(void)
+{
+	if (!sched.run)
+		return;
+
+	sched.run = false;
+	pthread_join(sched.thread, NULL);
 }
@@ -28,6 +28,9 @@ int play_alloc(struct auplay_st **stp, const struct auplay *ap,
 	if (!stp || !ap || !prm)
 		return EINVAL;
 
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
 	st = mem_zalloc(sizeof(*st), auplay_destructor);
 	if (!st)
 		return ENOMEM;
@@ -102,6 +102,9 @@ int audiounit_player_alloc(struct auplay_st **stp, const struct auplay *ap,
 
 	(void)device;
 
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
 	st = mem_zalloc(sizeof(*st), auplay_destructor);
 	if (!st)
 		return ENOMEM;
@@ -6,6 +6,14 @@
 #define _DEFAULT_SOURCE 1
 #define _BSD_SOURCE 1
 #include <pthread.h>
+#include <string.h>
+#ifndef WIN32
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -15,14 +23,37 @@
  * @defgroup aufile aufile
  *
  * Audio module for using a WAV-file as audio input
+ *
+ * Config options:
+ *
+ \verbatim
+  aufile_mmap     {yes,no}      # Share a mapping of the file
+ \endverbatim
+ *
+ * By default each source reads the whole file into its own buffer.
+ * With aufile_mmap the file is mapped once, and all sources that play
+ * it read the samples from the mapping at their own offset. This suits
+ * long prompts and music on hold that many calls play at the same time.
  */
 
 
+/* A WAV file mapped into memory, shared by all its sources */
+struct mapfile {
+	struct le le;
+	char *path;
+	void *addr;
+	size_t len;
+	const int16_t *sampv;    /* samples of the data chunk */
+	size_t sampc;
+};
+
 struct ausrc_st {
 	const struct ausrc *as;  /* base class */
 	struct tmr tmr;
 	struct aufile *aufile;
 	struct aubuf *aubuf;
+	struct mapfile *map;
+	volatile size_t pos;     /* read offset in the mapping [samples] */
 	uint32_t ptime;
 	size_t sampc;
 	bool run;
@@ -34,6 +65,8 @@ struct ausrc_st {
 
 
 static struct ausrc *ausrc;
+static struct list mapl;
+static bool use_mmap;
 
 
 static void destructor(void *arg)
@@ -49,6 +82,145 @@ static void destructor(void *arg)
 
 	mem_deref(st->aufile);
 	mem_deref(st->aubuf);
+	mem_deref(st->map);
+}
+
+
+static void mapfile_destructor(void *arg)
+{
+	struct mapfile *mf = arg;
+
+	list_unlink(&mf->le);
+#ifndef WIN32
+	if (mf->addr)
+		(void)munmap(mf->addr, mf->len);
+#endif
+	mem_deref(mf->path);
+}
+
+
+/* Find the data chunk of a RIFF/WAVE file */
+static int wav_data(const uint8_t *p, size_t len, size_t *offset,
+		    size_t *size)
+{
+	size_t pos = 12;
+
+	if (len < 12 || memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4))
+		return EBADMSG;
+
+	while (pos + 8 <= len) {
+
+		uint32_t sz = p[pos+4] | p[pos+5] << 8 |
+			(uint32_t)p[pos+6] << 16 | (uint32_t)p[pos+7] << 24;
+
+		if (0 == memcmp(p + pos, "data", 4)) {
+			*offset = pos + 8;
+			*size   = min(sz, len - *offset);
+			return 0;
+		}
+
+		pos += 8 + sz + (sz & 1);
+	}
+
+	return EBADMSG;
+}
+
+
+static int mapfile_get(struct mapfile **mfp, const char *path)
+{
+#ifndef WIN32
+	struct mapfile *mf;
+	struct stat sb;
+	size_t offset, size;
+	struct le *le;
+	int fd, err;
+
+	LIST_FOREACH(&mapl, le) {
+
+		mf = le->data;
+
+		if (0 == str_cmp(mf->path, path)) {
+			*mfp = mem_ref(mf);
+			return 0;
+		}
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno;
+
+	mf = mem_zalloc(sizeof(*mf), mapfile_destructor);
+	if (!mf) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (fstat(fd, &sb) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	mf->len  = (size_t)sb.st_size;
+	mf->addr = mmap(NULL, mf->len, PROT_READ, MAP_SHARED, fd, 0);
+	if (mf->addr == MAP_FAILED) {
+		mf->addr = NULL;
+		err = errno;
+		goto out;
+	}
+
+	err = wav_data(mf->addr, mf->len, &offset, &size);
+	if (err || offset & 1)
+		goto out;
+
+	mf->sampv = (const int16_t *)(void *)((uint8_t *)mf->addr + offset);
+	mf->sampc = size / 2;
+
+	err = str_dup(&mf->path, path);
+	if (err)
+		goto out;
+
+	list_append(&mapl, &mf->le, mf);
+
+	info("aufile: %s: mapped %zu samples\n", path, mf->sampc);
+
+ out:
+	(void)close(fd);
+
+	if (err || !mf->sampv) {
+		mem_deref(mf);
+		return err ? err : EBADMSG;
+	}
+
+	*mfp = mf;
+
+	return 0;
+#else
+	(void)mfp;
+	(void)path;
+	return ENOSYS;
+#endif
+}
+
+
+/* Read directly from the mapping, only the last period is copied */
+static const int16_t *map_read(struct ausrc_st *st, int16_t *sampv)
+{
+	const struct mapfile *mf = st->map;
+	size_t pos = st->pos, n;
+
+	if (pos + st->sampc <= mf->sampc) {
+		st->pos = pos + st->sampc;
+		return mf->sampv + pos;
+	}
+
+	n = pos < mf->sampc ? mf->sampc - pos : 0;
+
+	memcpy(sampv, mf->sampv + pos, n * 2);
+	memset(sampv + n, 0, (st->sampc - n) * 2);
+
+	st->pos = pos + n;
+
+	return sampv;
 }
 
 
@@ -71,9 +243,14 @@ static void *play_thread(void *arg)
 		if (ts > now)
 			continue;
 
-		aubuf_read_samp(st->aubuf, sampv, st->sampc);
+		if (st->map) {
+			st->rh(map_read(st, sampv), st->sampc, st->arg);
+		}
+		else {
+			aubuf_read_samp(st->aubuf, sampv, st->sampc);
 
-		st->rh(sampv, st->sampc, st->arg);
+			st->rh(sampv, st->sampc, st->arg);
+		}
 
 		ts += st->ptime;
 	}
@@ -93,7 +270,8 @@ static void timeout(void *arg)
 	tmr_start(&st->tmr, 1000, timeout, st);
 
 	/* check if audio buffer is empty */
-	if (aubuf_cur_size(st->aubuf) < (2 * st->sampc)) {
+	if (st->map ? st->pos >= st->map->sampc :
+	    aubuf_cur_size(st->aubuf) < (2 * st->sampc)) {
 
 		info("aufile: end of file\n");
 
@@ -159,6 +337,9 @@ static int alloc_handler(struct ausrc_st **stp, const struct ausrc *as,
 	if (!stp || !as || !prm || !rh)
 		return EINVAL;
 
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
 	info("aufile: loading input file '%s'\n", dev);
 
 	st = mem_zalloc(sizeof(*st), destructor);
@@ -201,6 +382,20 @@ static int alloc_handler(struct ausrc_st **stp, const struct ausrc *as,
 
 	st->ptime = prm->ptime;
 
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (use_mmap) {
+		err = mapfile_get(&st->map, dev);
+		if (err) {
+			warning("aufile: %s: could not map file (%m),"
+				" reading it instead\n", dev, err);
+			err = 0;
+		}
+	}
+#endif
+
+	if (st->map)
+		goto start;
+
 	info("aufile: audio ptime=%u sampc=%zu aubuf=[%u:%u]\n",
 	     st->ptime, st->sampc,
 	     prm->srate * prm->ch * 2,
@@ -217,6 +412,7 @@ static int alloc_handler(struct ausrc_st **stp, const struct ausrc *as,
 	if (err)
 		goto out;
 
+ start:
 	tmr_start(&st->tmr, 1000, timeout, st);
 
 	st->run = true;
@@ -238,6 +434,8 @@ static int alloc_handler(struct ausrc_st **stp, const struct ausrc *as,
 
 static int module_init(void)
 {
+	conf_get_bool(conf_cur(), "aufile_mmap", &use_mmap);
+
 	return ausrc_register(&ausrc, "aufile", alloc_handler);
 }
 
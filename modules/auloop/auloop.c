@@ -7,6 +7,7 @@
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
+#include "auloop.h"
 
 
 /**
@@ -22,7 +23,12 @@
  \verbatim
  /auloop         Start audio-loop
  /auloop_stop    Stop audio-loop
+ /auloop_latency Measure the round-trip latency [codecs]
  \endverbatim
+ *
+ * The latency measurement sends a chirp from the player to the source
+ * through the air, so the speaker and the microphone must be able to
+ * hear each other.
  */
 
 
@@ -136,7 +142,7 @@ static int codec_read(struct audio_loop *al, int16_t *sampv, size_t sampc)
 }
 
 
-static void read_handler(const int16_t *sampv, size_t sampc, void *arg)
+static void read_handler(const void *sampv, size_t sampc, void *arg)
 {
 	struct audio_loop *al = arg;
 	int err;
@@ -150,7 +156,7 @@ static void read_handler(const int16_t *sampv, size_t sampc, void *arg)
 }
 
 
-static void write_handler(int16_t *sampv, size_t sampc, void *arg)
+static void write_handler(void *sampv, size_t sampc, void *arg)
 {
 	struct audio_loop *al = arg;
 	int err;
@@ -248,6 +254,7 @@ static int auloop_reset(struct audio_loop *al)
 	auplay_prm.srate      = al->srate;
 	auplay_prm.ch         = al->ch;
 	auplay_prm.ptime      = PTIME;
+	auplay_prm.fmt        = AUFMT_S16LE;
 	err = auplay_alloc(&al->auplay, cfg->audio.play_mod, &auplay_prm,
 			   cfg->audio.play_dev, write_handler, al);
 	if (err) {
@@ -260,6 +267,7 @@ static int auloop_reset(struct audio_loop *al)
 	ausrc_prm.srate      = al->srate;
 	ausrc_prm.ch         = al->ch;
 	ausrc_prm.ptime      = PTIME;
+	ausrc_prm.fmt        = AUFMT_S16LE;
 	err = ausrc_alloc(&al->ausrc, NULL, cfg->audio.src_mod,
 			  &ausrc_prm, cfg->audio.src_dev,
 			  read_handler, error_handler, al);
@@ -347,10 +355,21 @@ static int auloop_start(struct re_printf *pf, void *arg)
 }
 
 
+static int auloop_latency_start(struct re_printf *pf, void *arg)
+{
+	/* the devices cannot be shared with the audio loop */
+	gal = mem_deref(gal);
+
+	return auloop_latency(pf, arg);
+}
+
+
 static int auloop_stop(struct re_printf *pf, void *arg)
 {
 	(void)arg;
 
+	auloop_latency_stop();
+
 	if (gal) {
 		(void)re_hprintf(pf, "audio-loop stopped\n");
 		gal = mem_deref(gal);
@@ -363,6 +382,8 @@ static int auloop_stop(struct re_printf *pf, void *arg)
 static const struct cmd cmdv[] = {
 	{"auloop",      0, 0, "Start audio-loop", auloop_start },
 	{"auloop_stop", 0, 0, "Stop audio-loop",  auloop_stop  },
+	{"auloop_latency", 0, CMD_PRM, "Measure round-trip latency [codecs]",
+	 auloop_latency_start },
 };
 
 
@@ -0,0 +1,9 @@
+/**
+ * @file auloop.h  Audio loop -- internal interface
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+
+int  auloop_latency(struct re_printf *pf, void *arg);
+void auloop_latency_stop(void);
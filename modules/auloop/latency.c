@@ -0,0 +1,696 @@
+/**
+ * @file auloop/latency.c  Audio loop -- round-trip latency measurement
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+#define _DEFAULT_SOURCE 1
+#define _BSD_SOURCE 1
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "auloop.h"
+
+
+/*
+ * The captured audio is not looped back. Instead, silence with a chirp
+ * once per period is written to the aubuf, and the chirp is looked for
+ * with a matched filter at three points:
+ *
+ *   A: where it leaves the aubuf, before the encoder
+ *   B: where it leaves the decoder
+ *   C: where it comes back from the speaker through the microphone
+ *
+ * The stages are then:
+ *
+ *   aubuf  = A - injection     (the jitter buffer of the loop)
+ *   codec  = B - A             (the algorithmic delay of the codec)
+ *   device = C - B             (player buffers, air and source buffers)
+ *   total  = C - injection     (mouth to ear)
+ *
+ * The time of a sample is taken from the time of the callback that
+ * carries it, plus or minus its offset in the block.
+ *
+ * Example config:
+ \verbatim
+  auloop_latency_count    10     # markers per codec
+ \endverbatim
+ */
+
+
+enum {
+	PTIME     = 20,
+	PERIOD_MS = 1000,         /* One marker per period         */
+	CHIRP_MS  = 20,
+	SRATE     = 48000,        /* Sampling rate without a codec */
+	MAX_CODEC = 32,
+	MAX_MARK  = 1000,
+};
+
+#define CHIRP_F0   300.0
+#define CHIRP_F1  3400.0
+#define THRESHOLD    0.5      /* Normalized cross-correlation  */
+
+
+/** Matched filter for the chirp in one stream */
+struct detector {
+	float *buf;               /* Last samples, 2 * n at most   */
+	size_t cnt;
+	uint64_t t;               /* Time of the best match [ns]   */
+	size_t since;             /* Samples since the best match  */
+	double best;
+	int mark;                 /* Marker that is looked for     */
+	bool armed;
+};
+
+/** Times of one marker [ns], zero if not seen */
+struct mark {
+	uint64_t inj;
+	uint64_t a;
+	uint64_t b;
+	uint64_t c;
+};
+
+struct latency {
+	const struct aucodec *codecv[MAX_CODEC];
+	size_t codecc;
+	size_t index;
+	struct tmr tmr;
+
+	/* Current run */
+	const struct aucodec *ac;
+	struct ausrc_st *ausrc;
+	struct auplay_st *auplay;
+	struct auenc_state *enc;
+	struct audec_state *dec;
+	struct aubuf *ab;
+	struct lock *lock;
+	struct mark *markv;
+	uint32_t count;
+	uint32_t srate;
+	uint32_t ch;
+	int16_t *chirp;
+	float *tmpl;              /* Chirp with unit energy        */
+	size_t n;                 /* Chirp length [frames]         */
+	int16_t *txv;
+	int16_t *encv;
+	size_t sampc;             /* Samples in one packet         */
+	uint64_t src_pos;         /* Source frames                 */
+	uint64_t next_inj;
+	uint64_t inj_end;
+	uint32_t n_inj;
+	int cur;                  /* Last marker that was sent     */
+	bool done;
+	struct detector det_a;
+	struct detector det_b;
+	struct detector det_c;
+};
+
+
+static struct latency *glat;
+
+
+static uint64_t now_ns(void)
+{
+#ifdef LINUX
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return tmr_jiffies() * 1000000;
+#endif
+}
+
+
+static uint64_t frames_ns(int64_t frames, uint32_t srate)
+{
+	return (uint64_t)(frames * 1000000000 / (int64_t)srate);
+}
+
+
+static int det_alloc(struct detector *det, size_t n)
+{
+	memset(det, 0, sizeof(*det));
+
+	det->buf = mem_zalloc(2 * n * sizeof(float), NULL);
+	if (!det->buf)
+		return ENOMEM;
+
+	det->mark = -1;
+
+	return 0;
+}
+
+
+static void det_sync(struct detector *det, int cur)
+{
+	if (det->mark == cur)
+		return;
+
+	det->mark  = cur;
+	det->armed = true;
+	det->best  = 0;
+}
+
+
+/*
+ * Feed one block of interleaved samples, the first channel is used.
+ * Returns true when the chirp is found, det->t is then its start time.
+ */
+static bool det_process(struct detector *det, const struct latency *lt,
+			const int16_t *sampv, size_t frames, uint64_t t0)
+{
+	const size_t n = lt->n;
+	bool found = false;
+	size_t i, k;
+
+	for (i = 0; i < frames; i++) {
+
+		const float *w;
+		double dot = 0, en = 0, ncc;
+
+		if (det->cnt == 2 * n) {
+			memmove(det->buf, det->buf + n, n * sizeof(float));
+			det->cnt = n;
+		}
+
+		det->buf[det->cnt++] = sampv[i * lt->ch] / 32768.0f;
+
+		if (!det->armed || det->cnt < n)
+			continue;
+
+		w = det->buf + det->cnt - n;
+
+		for (k = 0; k < n; k++) {
+			dot += w[k] * lt->tmpl[k];
+			en  += w[k] * w[k];
+		}
+
+		ncc = en > 1e-9 ? dot / sqrt(en) : 0;
+
+		if (ncc > THRESHOLD && ncc > det->best) {
+
+			const int64_t start = (int64_t)i + 1 - (int64_t)n;
+
+			det->best  = ncc;
+			det->since = 0;
+			det->t     = t0 + frames_ns(start, lt->srate);
+		}
+		else if (det->best > 0 && ++det->since > n / 2) {
+			det->armed = false;
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+
+static void src_read_handler(const void *sampv, size_t sampc, void *arg)
+{
+	struct latency *lt = arg;
+	const size_t frames = sampc / lt->ch;
+	const uint64_t t0 = now_ns() - frames_ns(frames, lt->srate);
+	size_t i, j, pos = 0;
+
+	lock_write_get(lt->lock);
+
+	if (lt->done)
+		goto out;
+
+	det_sync(&lt->det_c, lt->cur);
+	if (det_process(&lt->det_c, lt, sampv, frames, t0) &&
+	    lt->det_c.mark >= 0)
+		lt->markv[lt->det_c.mark].c = lt->det_c.t;
+
+	/* Silence and markers instead of the captured audio */
+	for (i = 0; i < frames; i++, lt->src_pos++) {
+
+		int16_t s = 0;
+
+		if (lt->src_pos == lt->next_inj) {
+
+			if (lt->n_inj == lt->count) {
+				lt->done = true;
+				break;
+			}
+
+			lt->cur = lt->n_inj++;
+			lt->markv[lt->cur].inj = t0 + frames_ns(i, lt->srate);
+			lt->inj_end  = lt->src_pos + lt->n;
+			lt->next_inj = lt->src_pos +
+				(uint64_t)lt->srate * PERIOD_MS / 1000;
+		}
+
+		if (lt->src_pos < lt->inj_end)
+			s = lt->chirp[lt->n - (lt->inj_end - lt->src_pos)];
+
+		for (j = 0; j < lt->ch; j++)
+			lt->txv[pos++] = s;
+
+		if (pos == lt->sampc) {
+			(void)aubuf_write_samp(lt->ab, lt->txv, pos);
+			pos = 0;
+		}
+	}
+
+	if (pos)
+		(void)aubuf_write_samp(lt->ab, lt->txv, pos);
+
+ out:
+	lock_rel(lt->lock);
+}
+
+
+static void play_write_handler(void *sampv, size_t sampc, void *arg)
+{
+	struct latency *lt = arg;
+	int16_t *v = sampv;
+	const uint64_t t0 = now_ns();
+	uint8_t x[4096];
+	size_t xlen = sizeof(x);
+	size_t decc = sampc;
+	int err;
+
+	if (!lt->ac || sampc > lt->sampc) {
+		aubuf_read_samp(lt->ab, v, sampc);
+	}
+	else {
+		aubuf_read_samp(lt->ab, lt->encv, sampc);
+
+		err = lt->ac->ench(lt->enc, x, &xlen, lt->encv, sampc);
+		if (!err)
+			err = lt->ac->dech(lt->dec, v, &decc, x, xlen);
+		if (err)
+			decc = 0;
+
+		if (decc < sampc)
+			memset(v + decc, 0, (sampc - decc) * sizeof(int16_t));
+	}
+
+	lock_write_get(lt->lock);
+
+	if (lt->done)
+		goto out;
+
+	det_sync(&lt->det_a, lt->cur);
+	det_sync(&lt->det_b, lt->cur);
+
+	if (lt->ac && sampc <= lt->sampc) {
+
+		if (det_process(&lt->det_a, lt, lt->encv, sampc / lt->ch, t0)
+		    && lt->det_a.mark >= 0)
+			lt->markv[lt->det_a.mark].a = lt->det_a.t;
+
+		if (det_process(&lt->det_b, lt, v, sampc / lt->ch, t0) &&
+		    lt->det_b.mark >= 0)
+			lt->markv[lt->det_b.mark].b = lt->det_b.t;
+	}
+	else if (det_process(&lt->det_a, lt, v, sampc / lt->ch, t0) &&
+		 lt->det_a.mark >= 0) {
+		lt->markv[lt->det_a.mark].a = lt->det_a.t;
+		lt->markv[lt->det_a.mark].b = lt->det_a.t;
+	}
+
+ out:
+	lock_rel(lt->lock);
+}
+
+
+static void src_error_handler(int err, const char *str, void *arg)
+{
+	struct latency *lt = arg;
+
+	warning("auloop: latency: ausrc error: %m (%s)\n", err, str);
+
+	lock_write_get(lt->lock);
+	lt->done = true;
+	lock_rel(lt->lock);
+}
+
+
+static void run_stop(struct latency *lt)
+{
+	/* audio player/source must be stopped first */
+	lt->auplay = mem_deref(lt->auplay);
+	lt->ausrc  = mem_deref(lt->ausrc);
+
+	lt->enc   = mem_deref(lt->enc);
+	lt->dec   = mem_deref(lt->dec);
+	lt->ab    = mem_deref(lt->ab);
+	lt->lock  = mem_deref(lt->lock);
+	lt->markv = mem_deref(lt->markv);
+	lt->chirp = mem_deref(lt->chirp);
+	lt->tmpl  = mem_deref(lt->tmpl);
+	lt->txv   = mem_deref(lt->txv);
+	lt->encv  = mem_deref(lt->encv);
+
+	lt->det_a.buf = mem_deref(lt->det_a.buf);
+	lt->det_b.buf = mem_deref(lt->det_b.buf);
+	lt->det_c.buf = mem_deref(lt->det_c.buf);
+}
+
+
+static void destructor(void *arg)
+{
+	struct latency *lt = arg;
+
+	tmr_cancel(&lt->tmr);
+	run_stop(lt);
+}
+
+
+/* Linear chirp with a Hann window, and its normalized template */
+static int chirp_alloc(struct latency *lt)
+{
+	const double T = CHIRP_MS / 1000.0;
+	double f1 = min(CHIRP_F1, lt->srate * 0.45);
+	double en = 0;
+	size_t i;
+
+	lt->n     = lt->srate * CHIRP_MS / 1000;
+	lt->chirp = mem_alloc(lt->n * sizeof(int16_t), NULL);
+	lt->tmpl  = mem_alloc(lt->n * sizeof(float), NULL);
+	if (!lt->chirp || !lt->tmpl)
+		return ENOMEM;
+
+	for (i = 0; i < lt->n; i++) {
+
+		const double t = (double)i / lt->srate;
+		const double w = 0.5 - 0.5 * cos(2 * M_PI * i / (lt->n - 1));
+		const double s = w * sin(2 * M_PI * (CHIRP_F0 * t +
+				 (f1 - CHIRP_F0) * t * t / (2 * T)));
+
+		lt->chirp[i] = (int16_t)(s * 16384);
+		lt->tmpl[i]  = (float)s;
+		en += s * s;
+	}
+
+	for (i = 0; i < lt->n; i++)
+		lt->tmpl[i] /= (float)sqrt(en);
+
+	return 0;
+}
+
+
+static int run_start(struct latency *lt)
+{
+	const struct config *cfg = conf_config();
+	struct auplay_prm auplay_prm;
+	struct ausrc_prm ausrc_prm;
+	struct auenc_param prm = {PTIME};
+	const struct aucodec *ac = lt->codecv[lt->index];
+	int err;
+
+	if (!cfg)
+		return ENOENT;
+
+	lt->ac       = ac;
+	lt->srate    = ac ? ac->srate : SRATE;
+	lt->ch       = ac ? ac->ch : 1;
+	lt->sampc    = lt->srate * lt->ch * PTIME / 1000;
+	lt->src_pos  = 0;
+	lt->next_inj = (uint64_t)lt->srate * PERIOD_MS / 1000;
+	lt->inj_end  = 0;
+	lt->n_inj    = 0;
+	lt->cur      = -1;
+	lt->done     = false;
+
+	err = lock_alloc(&lt->lock);
+	if (err)
+		return err;
+
+	err = chirp_alloc(lt);
+	if (err)
+		return err;
+
+	err  = det_alloc(&lt->det_a, lt->n);
+	err |= det_alloc(&lt->det_b, lt->n);
+	err |= det_alloc(&lt->det_c, lt->n);
+	if (err)
+		return ENOMEM;
+
+	lt->markv = mem_zalloc(lt->count * sizeof(*lt->markv), NULL);
+	lt->txv   = mem_alloc(lt->sampc * sizeof(int16_t), NULL);
+	lt->encv  = mem_alloc(lt->sampc * sizeof(int16_t), NULL);
+	if (!lt->markv || !lt->txv || !lt->encv)
+		return ENOMEM;
+
+	if (ac) {
+		if (ac->encupdh) {
+			err = ac->encupdh(&lt->enc, ac, &prm, NULL);
+			if (err)
+				return err;
+		}
+
+		if (ac->decupdh) {
+			err = ac->decupdh(&lt->dec, ac, NULL);
+			if (err)
+				return err;
+		}
+	}
+
+	err = aubuf_alloc(&lt->ab, lt->sampc * 2, 0);
+	if (err)
+		return err;
+
+	auplay_prm.srate = lt->srate;
+	auplay_prm.ch    = lt->ch;
+	auplay_prm.ptime = PTIME;
+	auplay_prm.fmt   = AUFMT_S16LE;
+	err = auplay_alloc(&lt->auplay, cfg->audio.play_mod, &auplay_prm,
+			   cfg->audio.play_dev, play_write_handler, lt);
+	if (err) {
+		warning("auloop: latency: auplay %s,%s failed: %m\n",
+			cfg->audio.play_mod, cfg->audio.play_dev, err);
+		return err;
+	}
+
+	ausrc_prm.srate = lt->srate;
+	ausrc_prm.ch    = lt->ch;
+	ausrc_prm.ptime = PTIME;
+	ausrc_prm.fmt   = AUFMT_S16LE;
+	err = ausrc_alloc(&lt->ausrc, NULL, cfg->audio.src_mod,
+			  &ausrc_prm, cfg->audio.src_dev,
+			  src_read_handler, src_error_handler, lt);
+	if (err) {
+		warning("auloop: latency: ausrc %s,%s failed: %m\n",
+			cfg->audio.src_mod, cfg->audio.src_dev, err);
+		return err;
+	}
+
+	info("auloop: latency: %s %uHz %uch, %u markers\n",
+	     ac ? ac->name : "no codec", lt->srate, lt->ch, lt->count);
+
+	return 0;
+}
+
+
+static int ms_cmp(const void *a, const void *b)
+{
+	const double *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+
+static void stage_print(const char *name, double *v, size_t n)
+{
+	double sum = 0;
+	size_t i;
+
+	if (!n)
+		return;
+
+	qsort(v, n, sizeof(*v), ms_cmp);
+
+	for (i = 0; i < n; i++)
+		sum += v[i];
+
+	info("  %-22s min/avg/p99 %7.1f %7.1f %7.1f ms\n",
+	     name, v[0], sum / n, v[(n - 1) * 99 / 100]);
+}
+
+
+static void run_report(const struct latency *lt)
+{
+	double *aubuf, *codec, *device, *total;
+	size_t i, n = 0;
+
+	aubuf  = mem_alloc(lt->count * sizeof(double), NULL);
+	codec  = mem_alloc(lt->count * sizeof(double), NULL);
+	device = mem_alloc(lt->count * sizeof(double), NULL);
+	total  = mem_alloc(lt->count * sizeof(double), NULL);
+	if (!aubuf || !codec || !device || !total)
+		goto out;
+
+	for (i = 0; i < lt->n_inj; i++) {
+
+		const struct mark *m = &lt->markv[i];
+
+		if (!m->a || !m->b || !m->c)
+			continue;
+
+		aubuf[n]  = ((int64_t)(m->a - m->inj)) / 1e6;
+		codec[n]  = ((int64_t)(m->b - m->a)) / 1e6;
+		device[n] = ((int64_t)(m->c - m->b)) / 1e6;
+		total[n]  = ((int64_t)(m->c - m->inj)) / 1e6;
+		++n;
+	}
+
+	info("auloop: latency: %s %uHz %uch: %zu of %u markers found\n",
+	     lt->ac ? lt->ac->name : "no codec", lt->srate, lt->ch,
+	     n, lt->n_inj);
+
+	stage_print("aubuf (jitter buffer)", aubuf, n);
+	stage_print("codec", codec, n);
+	stage_print("device", device, n);
+	stage_print("total", total, n);
+
+ out:
+	mem_deref(aubuf);
+	mem_deref(codec);
+	mem_deref(device);
+	mem_deref(total);
+}
+
+
+static void tmr_handler(void *arg)
+{
+	struct latency *lt = arg;
+	bool done;
+	int err;
+
+	lock_write_get(lt->lock);
+	done = lt->done;
+	lock_rel(lt->lock);
+
+	if (!done) {
+		tmr_start(&lt->tmr, 100, tmr_handler, lt);
+		return;
+	}
+
+	run_report(lt);
+	run_stop(lt);
+
+	while (++lt->index < lt->codecc) {
+
+		err = run_start(lt);
+		if (!err) {
+			tmr_start(&lt->tmr, 100, tmr_handler, lt);
+			return;
+		}
+
+		warning("auloop: latency: %s: %m\n",
+			lt->codecv[lt->index]->name, err);
+		run_stop(lt);
+	}
+
+	info("auloop: latency measurement done\n");
+	glat = mem_deref(glat);
+}
+
+
+static bool codec_usable(const struct aucodec *ac)
+{
+	return ac->ench && ac->dech;
+}
+
+
+/**
+ * Start the latency measurement, once without a codec and then for
+ * each codec
+ *
+ * @param pf  Print handler
+ * @param arg Command argument, the codecs to run (all if not set)
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int auloop_latency(struct re_printf *pf, void *arg)
+{
+	const struct cmd_arg *carg = arg;
+	struct latency *lt;
+	int err = 0;
+
+	if (glat) {
+		(void)re_hprintf(pf, "auloop: latency: already running\n");
+		return EALREADY;
+	}
+
+	lt = mem_zalloc(sizeof(*lt), destructor);
+	if (!lt)
+		return ENOMEM;
+
+	lt->count = 10;
+	(void)conf_get_u32(conf_cur(), "auloop_latency_count", &lt->count);
+	lt->count = min(max(lt->count, 1), MAX_MARK);
+
+	/* First a run without a codec */
+	lt->codecv[lt->codecc++] = NULL;
+
+	if (carg && str_isset(carg->prm)) {
+
+		struct pl cl, c;
+
+		pl_set_str(&cl, carg->prm);
+
+		while (!re_regex(cl.p, cl.l, "[^,]+", &c)) {
+
+			char name[64];
+			const struct aucodec *ac;
+
+			cl.l -= c.p + c.l - cl.p;
+			cl.p  = c.p + c.l;
+
+			(void)pl_strcpy(&c, name, sizeof(name));
+
+			ac = aucodec_find(name, 0, 0);
+			if (!ac || !codec_usable(ac)) {
+				(void)re_hprintf(pf, "auloop: latency: no"
+						 " codec '%s'\n", name);
+				continue;
+			}
+
+			if (lt->codecc < ARRAY_SIZE(lt->codecv))
+				lt->codecv[lt->codecc++] = ac;
+		}
+	}
+	else {
+		struct le *le;
+
+		for (le = list_head(aucodec_list()); le; le = le->next) {
+
+			const struct aucodec *ac = le->data;
+
+			if (codec_usable(ac) &&
+			    lt->codecc < ARRAY_SIZE(lt->codecv))
+				lt->codecv[lt->codecc++] = ac;
+		}
+	}
+
+	(void)re_hprintf(pf, "auloop: latency: %zu runs of %u seconds\n",
+			 lt->codecc, (lt->count + 1) * PERIOD_MS / 1000);
+
+	err = run_start(lt);
+	if (err) {
+		warning("auloop: latency: %m\n", err);
+		mem_deref(lt);
+		return err;
+	}
+
+	tmr_start(&lt->tmr, 100, tmr_handler, lt);
+	glat = lt;
+
+	return 0;
+}
+
+
+void auloop_latency_stop(void)
+{
+	glat = mem_deref(glat);
+}
@@ -6,5 +6,6 @@
 
 MOD		:= auloop
 $(MOD)_SRCS	+= auloop.c
+$(MOD)_SRCS	+= latency.c
 
 include mk/mod.mk
@@ -0,0 +1,77 @@
+/**
+ * @file aumix.c Audio conference mixer
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#include "aumix.h"
+
+
+/**
+ * @defgroup aumix aumix
+ *
+ * Audio conference mixer
+ *
+ * This module mixes the audio of all calls that use the same aumix
+ * device (the "room"). The decoded audio of every participant is
+ * summed into one mix bus, and each participant is sent the mix of all
+ * the other participants. Participants that are silent are not added
+ * to the bus.
+ *
+ * The audio player and audio source of one call are paired by the
+ * order in which they are opened, so both must use the same device.
+ *
+ * In a large room most participants are silent. With audio_speakers
+ * the audio core decodes only the loudest participants of the room, as
+ * told by the RFC 6464 audio level of their packets, and the others do
+ * not cost a decoder.
+ *
+ * Sample config:
+ *
+ \verbatim
+  audio_player            aumix,room0
+  audio_source            aumix,room0
+  audio_speakers          3
+ \endverbatim
+ */
+
+
+static struct ausrc *ausrc;
+static struct auplay *auplay;
+
+struct hash *ht_room;
+
+
+static int module_init(void)
+{
+	int err;
+
+	err = hash_alloc(&ht_room, 16);
+	if (err)
+		return err;
+
+	err  = ausrc_register(&ausrc, "aumix", src_alloc);
+	err |= auplay_register(&auplay, "aumix", play_alloc);
+
+	return err;
+}
+
+
+static int module_close(void)
+{
+	ausrc  = mem_deref(ausrc);
+	auplay = mem_deref(auplay);
+
+	ht_room = mem_deref(ht_room);
+
+	return 0;
+}
+
+
+EXPORT_SYM const struct mod_export DECL_EXPORTS(aumix) = {
+	"aumix",
+	"audio",
+	module_init,
+	module_close,
+};
@@ -0,0 +1,52 @@
+/**
+ * @file aumix.h Audio conference mixer -- internal interface
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+struct room;
+struct party;
+
+struct ausrc_st {
+	const struct ausrc *as;      /* inheritance */
+	struct party *party;
+	struct ausrc_prm prm;
+	ausrc_read_h *rh;
+	void *arg;
+};
+
+struct auplay_st {
+	const struct auplay *ap;      /* inheritance */
+	struct party *party;
+	struct auplay_prm prm;
+	auplay_write_h *wh;
+	void *arg;
+};
+
+
+extern struct hash *ht_room;
+
+
+int play_alloc(struct auplay_st **stp, const struct auplay *ap,
+	       struct auplay_prm *prm, const char *device,
+	       auplay_write_h *wh, void *arg);
+int src_alloc(struct ausrc_st **stp, const struct ausrc *as,
+	      struct media_ctx **ctx,
+	      struct ausrc_prm *prm, const char *device,
+	      ausrc_read_h *rh, ausrc_error_h *errh, void *arg);
+
+
+/* room */
+int  room_join(struct party **partyp, const char *name,
+	       struct auplay_st *auplay, struct ausrc_st *ausrc);
+void room_leave(struct party *party, const struct auplay_st *auplay,
+		const struct ausrc_st *ausrc);
+
+
+/* mix */
+void     mix_acc(int32_t *bus, const int16_t *sampv, size_t sampc);
+void     mix_sat(int16_t *outv, const int32_t *bus, size_t sampc);
+void     mix_sub_sat(int16_t *outv, const int32_t *bus,
+		     const int16_t *sampv, size_t sampc);
+uint32_t mix_level(const int16_t *sampv, size_t sampc);
@@ -0,0 +1,170 @@
+/**
+ * @file mix.c Audio conference mixer -- mixing kernels
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
+#define USE_NEON 1
+#endif
+#include "aumix.h"
+
+
+/*
+ * The mix bus is kept with 32-bit samples, so that the sum of all
+ * participants never wraps. Saturation to 16-bit is done only when each
+ * participant's own output is produced. The vector paths process eight
+ * samples per iteration, the remaining samples are done in plain C.
+ */
+
+
+static inline int16_t saturate(int32_t v)
+{
+	if (v > 32767)
+		return 32767;
+	else if (v < -32768)
+		return -32768;
+
+	return (int16_t)v;
+}
+
+
+/**
+ * Add 16-bit samples to the mix bus
+ *
+ * @param bus   Mix bus
+ * @param sampv Samples to add
+ * @param sampc Number of samples
+ */
+void mix_acc(int32_t *bus, const int16_t *sampv, size_t sampc)
+{
+	size_t i = 0;
+
+#if defined (__SSE2__)
+	for (; i + 8 <= sampc; i += 8) {
+		__m128i v  = _mm_loadu_si128((const __m128i *)&sampv[i]);
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		__m128i b0 = _mm_loadu_si128((const __m128i *)&bus[i]);
+		__m128i b1 = _mm_loadu_si128((const __m128i *)&bus[i+4]);
+
+		_mm_storeu_si128((__m128i *)&bus[i],   _mm_add_epi32(b0, lo));
+		_mm_storeu_si128((__m128i *)&bus[i+4], _mm_add_epi32(b1, hi));
+	}
+#elif defined (USE_NEON)
+	for (; i + 8 <= sampc; i += 8) {
+		int16x8_t v = vld1q_s16(&sampv[i]);
+
+		vst1q_s32(&bus[i],   vaddw_s16(vld1q_s32(&bus[i]),
+					       vget_low_s16(v)));
+		vst1q_s32(&bus[i+4], vaddw_s16(vld1q_s32(&bus[i+4]),
+					       vget_high_s16(v)));
+	}
+#endif
+
+	for (; i < sampc; i++)
+		bus[i] += sampv[i];
+}
+
+
+/**
+ * Convert the mix bus to 16-bit samples with saturation
+ *
+ * @param outv  Output samples
+ * @param bus   Mix bus
+ * @param sampc Number of samples
+ */
+void mix_sat(int16_t *outv, const int32_t *bus, size_t sampc)
+{
+	size_t i = 0;
+
+#if defined (__SSE2__)
+	for (; i + 8 <= sampc; i += 8) {
+		__m128i b0 = _mm_loadu_si128((const __m128i *)&bus[i]);
+		__m128i b1 = _mm_loadu_si128((const __m128i *)&bus[i+4]);
+
+		_mm_storeu_si128((__m128i *)&outv[i], _mm_packs_epi32(b0, b1));
+	}
+#elif defined (USE_NEON)
+	for (; i + 8 <= sampc; i += 8) {
+		int32x4_t b0 = vld1q_s32(&bus[i]);
+		int32x4_t b1 = vld1q_s32(&bus[i+4]);
+
+		vst1q_s16(&outv[i], vcombine_s16(vqmovn_s32(b0),
+						 vqmovn_s32(b1)));
+	}
+#endif
+
+	for (; i < sampc; i++)
+		outv[i] = saturate(bus[i]);
+}
+
+
+/**
+ * Produce a minus-self mix: the bus with one participant's own samples
+ * removed, saturated to 16-bit
+ *
+ * @param outv  Output samples
+ * @param bus   Mix bus
+ * @param sampv Participant's own samples, which were added to the bus
+ * @param sampc Number of samples
+ */
+void mix_sub_sat(int16_t *outv, const int32_t *bus,
+		 const int16_t *sampv, size_t sampc)
+{
+	size_t i = 0;
+
+#if defined (__SSE2__)
+	for (; i + 8 <= sampc; i += 8) {
+		__m128i v  = _mm_loadu_si128((const __m128i *)&sampv[i]);
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		__m128i b0 = _mm_loadu_si128((const __m128i *)&bus[i]);
+		__m128i b1 = _mm_loadu_si128((const __m128i *)&bus[i+4]);
+
+		b0 = _mm_sub_epi32(b0, lo);
+		b1 = _mm_sub_epi32(b1, hi);
+
+		_mm_storeu_si128((__m128i *)&outv[i], _mm_packs_epi32(b0, b1));
+	}
+#elif defined (USE_NEON)
+	for (; i + 8 <= sampc; i += 8) {
+		int16x8_t v  = vld1q_s16(&sampv[i]);
+		int32x4_t b0 = vsubw_s16(vld1q_s32(&bus[i]),   vget_low_s16(v));
+		int32x4_t b1 = vsubw_s16(vld1q_s32(&bus[i+4]), vget_high_s16(v));
+
+		vst1q_s16(&outv[i], vcombine_s16(vqmovn_s32(b0),
+						 vqmovn_s32(b1)));
+	}
+#endif
+
+	for (; i < sampc; i++)
+		outv[i] = saturate(bus[i] - sampv[i]);
+}
+
+
+/**
+ * Cheap energy estimate; the mean absolute value of every 4th sample
+ *
+ * @param sampv Samples
+ * @param sampc Number of samples
+ *
+ * @return Mean absolute sample value
+ */
+uint32_t mix_level(const int16_t *sampv, size_t sampc)
+{
+	uint32_t sum = 0;
+	size_t i, n = 0;
+
+	for (i=0; i<sampc; i+=4, n++) {
+		int32_t v = sampv[i];
+
+		sum += (uint32_t)(v < 0 ? -v : v);
+	}
+
+	return n ? sum / (uint32_t)n : 0;
+}
@@ -0,0 +1,11 @@
+#
+# module.mk
+#
+# Copyright (C) 2010 Creytiv.com
+#
+
+MOD		:= aumix
+$(MOD)_SRCS	+= aumix.c mix.c room.c src.c play.c
+$(MOD)_LFLAGS	+=
+
+include mk/mod.mk
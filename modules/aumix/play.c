@@ -0,0 +1,54 @@
+/**
+ * @file aumix/play.c Audio conference mixer -- playback
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#include "aumix.h"
+
+
+static void auplay_destructor(void *arg)
+{
+	struct auplay_st *st = arg;
+
+	room_leave(st->party, st, NULL);
+
+	mem_deref(st->party);
+}
+
+
+int play_alloc(struct auplay_st **stp, const struct auplay *ap,
+	       struct auplay_prm *prm, const char *device,
+	       auplay_write_h *wh, void *arg)
+{
+	struct auplay_st *st;
+	int err;
+
+	if (!stp || !ap || !prm)
+		return EINVAL;
+
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
+	st = mem_zalloc(sizeof(*st), auplay_destructor);
+	if (!st)
+		return ENOMEM;
+
+	st->ap  = ap;
+	st->prm = *prm;
+	st->wh  = wh;
+	st->arg = arg;
+
+	err = room_join(&st->party, device, st, NULL);
+	if (err)
+		goto out;
+
+ out:
+	if (err)
+		mem_deref(st);
+	else
+		*stp = st;
+
+	return err;
+}
@@ -0,0 +1,494 @@
+/**
+ * @file room.c Audio conference mixer -- rooms and participants
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <pthread.h>
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "aumix.h"
+
+
+/* The packet-time is fixed to 20 milliseconds */
+enum {PTIME = 20};
+
+enum {
+	LEVEL_SILENCE = 64,     /* mean absolute level regarded as silence */
+	HANGOVER      = 10,     /* frames a party stays active after speech */
+};
+
+
+struct room {
+	struct le le;
+	struct list partyl;         /**< Participants (struct party)        */
+	pthread_mutex_t mutex;      /**< Protects partyl and the participants */
+	pthread_t thread;
+	volatile bool run;
+	char name[64];
+	uint32_t srate;             /**< Sample rate of the mix bus         */
+	uint8_t ch;                 /**< Channels of the mix bus            */
+	size_t sampc;               /**< Samples per frame on the mix bus   */
+	int32_t *bus;               /**< Mix bus                            */
+	int16_t *mixv;              /**< Mix of all active participants     */
+};
+
+struct party {
+	struct le le;
+	struct room *room;
+	const struct auplay_st *auplay;
+	const struct ausrc_st *ausrc;
+	struct auresamp rs_play;    /**< Player format to mix bus format    */
+	struct auresamp rs_src;     /**< Mix bus format to source format    */
+	int16_t *playv;             /**< Decoded frame, player format       */
+	int16_t *inv;               /**< Decoded frame, mix bus format      */
+	int16_t *outv;              /**< Minus-self mix, mix bus format     */
+	int16_t *srcv;              /**< Minus-self mix, source format      */
+	size_t playc;
+	size_t srcc;
+	unsigned hangover;          /**< Frames left before party is silent */
+	bool active;                /**< Party was added to the mix bus     */
+};
+
+
+static size_t frame_sampc(uint32_t srate, uint8_t ch)
+{
+	return srate * ch * PTIME / 1000;
+}
+
+
+static void room_destructor(void *arg)
+{
+	struct room *room = arg;
+
+	if (room->run) {
+		room->run = false;
+		pthread_join(room->thread, NULL);
+	}
+
+	list_unlink(&room->le);
+	pthread_mutex_destroy(&room->mutex);
+
+	mem_deref(room->bus);
+	mem_deref(room->mixv);
+}
+
+
+static void party_destructor(void *arg)
+{
+	struct party *party = arg;
+
+	pthread_mutex_lock(&party->room->mutex);
+	list_unlink(&party->le);
+	pthread_mutex_unlock(&party->room->mutex);
+
+	mem_deref(party->playv);
+	mem_deref(party->inv);
+	mem_deref(party->outv);
+	mem_deref(party->srcv);
+
+	mem_deref(party->room);
+}
+
+
+/* Pull one frame from the player and check if it contains speech */
+static void party_read(struct room *room, struct party *party)
+{
+	const struct auplay_st *ap = party->auplay;
+	size_t sampc = room->sampc;
+	int err;
+
+	party->active = false;
+
+	if (!ap || !ap->wh)
+		return;
+
+	if (party->rs_play.resample) {
+
+		ap->wh(party->playv, party->playc, ap->arg);
+
+		err = auresamp(&party->rs_play, party->inv, &sampc,
+			       party->playv, party->playc);
+		if (err || sampc != room->sampc)
+			return;
+	}
+	else {
+		ap->wh(party->inv, room->sampc, ap->arg);
+	}
+
+	if (mix_level(party->inv, room->sampc) > LEVEL_SILENCE)
+		party->hangover = HANGOVER;
+	else if (party->hangover)
+		--party->hangover;
+
+	party->active = party->hangover > 0;
+}
+
+
+static void party_write(struct room *room, struct party *party,
+			const int16_t *sampv)
+{
+	const struct ausrc_st *as = party->ausrc;
+	size_t sampc = party->srcc;
+	int err;
+
+	if (!as || !as->rh)
+		return;
+
+	if (party->rs_src.resample) {
+
+		err = auresamp(&party->rs_src, party->srcv, &sampc,
+			       sampv, room->sampc);
+		if (err)
+			return;
+
+		as->rh(party->srcv, sampc, as->arg);
+	}
+	else {
+		as->rh(sampv, room->sampc, as->arg);
+	}
+}
+
+
+static void room_mix(struct room *room)
+{
+	bool mixed = false;
+	struct le *le;
+
+	memset(room->bus, 0, room->sampc * sizeof(*room->bus));
+
+	for (le = room->partyl.head; le; le = le->next) {
+		struct party *party = le->data;
+
+		party_read(room, party);
+
+		if (party->active)
+			mix_acc(room->bus, party->inv, room->sampc);
+	}
+
+	for (le = room->partyl.head; le; le = le->next) {
+		struct party *party = le->data;
+
+		if (!party->ausrc)
+			continue;
+
+		if (party->active) {
+			mix_sub_sat(party->outv, room->bus, party->inv,
+				    room->sampc);
+			party_write(room, party, party->outv);
+		}
+		else {
+			/* all silent participants hear the same mix */
+			if (!mixed) {
+				mix_sat(room->mixv, room->bus, room->sampc);
+				mixed = true;
+			}
+			party_write(room, party, room->mixv);
+		}
+	}
+}
+
+
+static void *room_thread(void *arg)
+{
+	uint64_t now, ts = tmr_jiffies();
+	struct room *room = arg;
+
+	while (room->run) {
+
+		(void)sys_msleep(4);
+
+		if (!room->run)
+			break;
+
+		now = tmr_jiffies();
+
+		if (ts > now)
+			continue;
+
+		pthread_mutex_lock(&room->mutex);
+		room_mix(room);
+		pthread_mutex_unlock(&room->mutex);
+
+		ts += PTIME;
+	}
+
+	return NULL;
+}
+
+
+static bool list_apply_handler(struct le *le, void *arg)
+{
+	struct room *room = le->data;
+
+	return 0 == str_cmp(room->name, arg);
+}
+
+
+static struct room *find_room(const char *name)
+{
+	return list_ledata(hash_lookup(ht_room, hash_joaat_str(name),
+				       list_apply_handler, (void *)name));
+}
+
+
+static int room_alloc(struct room **roomp, const char *name,
+		      uint32_t srate, uint8_t ch)
+{
+	struct room *room;
+	int err = 0;
+
+	room = mem_zalloc(sizeof(*room), room_destructor);
+	if (!room)
+		return ENOMEM;
+
+	err = pthread_mutex_init(&room->mutex, NULL);
+	if (err) {
+		mem_deref(room);
+		return err;
+	}
+
+	str_ncpy(room->name, name, sizeof(room->name));
+	room->srate = srate;
+	room->ch    = ch;
+	room->sampc = frame_sampc(srate, ch);
+
+	room->bus  = mem_alloc(room->sampc * sizeof(*room->bus), NULL);
+	room->mixv = mem_alloc(room->sampc * sizeof(*room->mixv), NULL);
+	if (!room->bus || !room->mixv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	hash_append(ht_room, hash_joaat_str(name), &room->le, room);
+
+	room->run = true;
+	err = pthread_create(&room->thread, NULL, room_thread, room);
+	if (err) {
+		room->run = false;
+		goto out;
+	}
+
+	info("aumix: created room '%s' (%u Hz, %u ch)\n", name, srate, ch);
+
+ out:
+	if (err)
+		mem_deref(room);
+	else
+		*roomp = room;
+
+	return err;
+}
+
+
+static int party_alloc(struct party **partyp, struct room *room)
+{
+	struct party *party;
+	int err = 0;
+
+	party = mem_zalloc(sizeof(*party), party_destructor);
+	if (!party)
+		return ENOMEM;
+
+	auresamp_init(&party->rs_play);
+	auresamp_init(&party->rs_src);
+
+	party->inv  = mem_alloc(room->sampc * sizeof(int16_t), NULL);
+	party->outv = mem_alloc(room->sampc * sizeof(int16_t), NULL);
+	if (!party->inv || !party->outv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	party->room = mem_ref(room);
+
+	pthread_mutex_lock(&room->mutex);
+	list_append(&room->partyl, &party->le, party);
+	pthread_mutex_unlock(&room->mutex);
+
+ out:
+	if (err)
+		mem_deref(party);
+	else
+		*partyp = party;
+
+	return err;
+}
+
+
+/* The player and source of a call are paired in the order they are
+ * opened; pick the newest party that still lacks this half. */
+static struct party *find_party(const struct room *room, bool play)
+{
+	struct le *le;
+
+	for (le = room->partyl.tail; le; le = le->prev) {
+		struct party *party = le->data;
+
+		if (play ? !party->auplay : !party->ausrc)
+			return party;
+	}
+
+	return NULL;
+}
+
+
+static int party_set_player(struct party *party, struct auplay_st *auplay)
+{
+	const struct room *room = party->room;
+	int err;
+
+	party->playc = frame_sampc(auplay->prm.srate, auplay->prm.ch);
+
+	err = auresamp_setup(&party->rs_play,
+			     auplay->prm.srate, auplay->prm.ch,
+			     room->srate, room->ch);
+	if (err)
+		return err;
+
+	if (party->rs_play.resample) {
+		party->playv = mem_alloc(party->playc * sizeof(int16_t),
+					 NULL);
+		if (!party->playv)
+			return ENOMEM;
+	}
+
+	return 0;
+}
+
+
+static int party_set_source(struct party *party, struct ausrc_st *ausrc)
+{
+	const struct room *room = party->room;
+	int err;
+
+	party->srcc = frame_sampc(ausrc->prm.srate, ausrc->prm.ch);
+
+	err = auresamp_setup(&party->rs_src,
+			     room->srate, room->ch,
+			     ausrc->prm.srate, ausrc->prm.ch);
+	if (err)
+		return err;
+
+	if (party->rs_src.resample) {
+		party->srcv = mem_alloc(party->srcc * sizeof(int16_t), NULL);
+		if (!party->srcv)
+			return ENOMEM;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Join a participant's player or source to a room. The room is created
+ * with the audio format of its first participant.
+ *
+ * @param partyp Pointer to the participant (reference is returned)
+ * @param name   Name of the room
+ * @param auplay Audio player of the participant, or NULL
+ * @param ausrc  Audio source of the participant, or NULL
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int room_join(struct party **partyp, const char *name,
+	      struct auplay_st *auplay, struct ausrc_st *ausrc)
+{
+	struct room *room;
+	struct party *party;
+	bool created = false;
+	int err;
+
+	if (!partyp || (!auplay == !ausrc))
+		return EINVAL;
+	if (!str_isset(name))
+		return ENODEV;
+
+	room = find_room(name);
+	if (room) {
+		mem_ref(room);
+	}
+	else {
+		uint32_t srate = auplay ? auplay->prm.srate : ausrc->prm.srate;
+		uint8_t ch     = auplay ? auplay->prm.ch    : ausrc->prm.ch;
+
+		err = room_alloc(&room, name, srate, ch);
+		if (err)
+			return err;
+	}
+
+	party = find_party(room, auplay != NULL);
+	if (party) {
+		mem_ref(party);
+	}
+	else {
+		err = party_alloc(&party, room);
+		if (err)
+			goto out;
+
+		created = true;
+	}
+
+	pthread_mutex_lock(&room->mutex);
+
+	if (auplay) {
+		err = party_set_player(party, auplay);
+		if (!err)
+			party->auplay = auplay;
+	}
+	else {
+		err = party_set_source(party, ausrc);
+		if (!err)
+			party->ausrc = ausrc;
+	}
+
+	pthread_mutex_unlock(&room->mutex);
+
+	if (err) {
+		warning("aumix: %s: could not join room '%s' (%m)\n",
+			auplay ? "player" : "source", name, err);
+		mem_deref(party);
+		goto out;
+	}
+
+	if (created) {
+		info("aumix: room '%s': %u participants\n",
+		     name, list_count(&room->partyl));
+	}
+
+	*partyp = party;
+
+ out:
+	mem_deref(room);
+
+	return err;
+}
+
+
+/**
+ * Remove a participant's player or source from its room. When this
+ * function returns the handler of the player or source is not running
+ * and will not be called again.
+ *
+ * @param party  Participant
+ * @param auplay Audio player to remove, or NULL
+ * @param ausrc  Audio source to remove, or NULL
+ */
+void room_leave(struct party *party, const struct auplay_st *auplay,
+		const struct ausrc_st *ausrc)
+{
+	if (!party)
+		return;
+
+	pthread_mutex_lock(&party->room->mutex);
+
+	if (auplay && party->auplay == auplay)
+		party->auplay = NULL;
+	if (ausrc && party->ausrc == ausrc)
+		party->ausrc = NULL;
+
+	party->active = false;
+
+	pthread_mutex_unlock(&party->room->mutex);
+}
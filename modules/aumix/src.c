@@ -0,0 +1,57 @@
+/**
+ * @file aumix/src.c Audio conference mixer -- source
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#include "aumix.h"
+
+
+static void ausrc_destructor(void *arg)
+{
+	struct ausrc_st *st = arg;
+
+	room_leave(st->party, NULL, st);
+
+	mem_deref(st->party);
+}
+
+
+int src_alloc(struct ausrc_st **stp, const struct ausrc *as,
+	      struct media_ctx **ctx,
+	      struct ausrc_prm *prm, const char *device,
+	      ausrc_read_h *rh, ausrc_error_h *errh, void *arg)
+{
+	struct ausrc_st *st;
+	int err = 0;
+	(void)ctx;
+	(void)errh;
+
+	if (!stp || !as || !prm)
+		return EINVAL;
+
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
+	st = mem_zalloc(sizeof(*st), ausrc_destructor);
+	if (!st)
+		return ENOMEM;
+
+	st->as   = as;
+	st->prm  = *prm;
+	st->rh   = rh;
+	st->arg  = arg;
+
+	err = room_join(&st->party, device, NULL, st);
+	if (err)
+		goto out;
+
+ out:
+	if (err)
+		mem_deref(st);
+	else
+		*stp = st;
+
+	return err;
+}
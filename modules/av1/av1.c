@@ -3,6 +3,9 @@
  *
  * Copyright (C) 2010 - 2016 Creytiv.com
  */
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -14,22 +17,65 @@
  *
  * The AV1 video codec (Experimental)
  *
+ * The encoder uses the realtime profile of libaom, with threads and
+ * tiles picked from the picture size and the number of CPUs. It is
+ * tuned for screen content when the video source is x11grab. All of
+ * this can be set in the config:
+ *
+ \verbatim
+  av1_threads             4       # 0 is auto
+  av1_dec_threads         4       # 0 is auto
+  av1_tile_columns        2       # 1, 2, 4, .. 0 is auto
+  av1_tile_rows           1       # 1, 2, 4, .. 0 is auto
+  av1_cpu_used            8       # higher is faster
+  av1_screen_content      yes     # default is yes with x11grab
+ \endverbatim
+ *
  * Reference: http://aomedia.org/
  */
 
 
-static struct vidcodec av1 = {
-	.name      = "AV1",
-	.encupdh   = av1_encode_update,
-	.ench      = av1_encode,
-	.decupdh   = av1_decode_update,
-	.dech      = av1_decode,
+static struct av1_vidcodec av1 = {
+	.vc = {
+		.name      = "AV1",
+		.encupdh   = av1_encode_update,
+		.ench      = av1_encode,
+		.decupdh   = av1_decode_update,
+		.dech      = av1_decode,
+		.reconfh   = av1_encode_reconfig,
+	},
+	.cpu_used = 8,
 };
 
 
+unsigned av1_cpu_count(void)
+{
+#if defined (HAVE_UNISTD_H) && defined (_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n > 0)
+		return (unsigned)n;
+#endif
+
+	return 1;
+}
+
+
 static int module_init(void)
 {
-	vidcodec_register(&av1);
+	struct conf *conf = conf_cur();
+
+	av1.screen = 0 == str_casecmp(conf_config()->video.src_mod,
+				      "x11grab");
+
+	(void)conf_get_u32(conf, "av1_threads", &av1.threads);
+	(void)conf_get_u32(conf, "av1_dec_threads", &av1.dec_threads);
+	(void)conf_get_u32(conf, "av1_tile_columns", &av1.tile_cols);
+	(void)conf_get_u32(conf, "av1_tile_rows", &av1.tile_rows);
+	(void)conf_get_u32(conf, "av1_cpu_used", &av1.cpu_used);
+	(void)conf_get_bool(conf, "av1_screen_content", &av1.screen);
+
+	vidcodec_register((struct vidcodec *)&av1);
 
 	return 0;
 }
@@ -37,7 +83,7 @@ static int module_init(void)
 
 static int module_close(void)
 {
-	vidcodec_unregister(&av1);
+	vidcodec_unregister((struct vidcodec *)&av1);
 
 	return 0;
 }
@@ -5,12 +5,27 @@
  */
 
 
+struct av1_vidcodec {
+	struct vidcodec vc;
+	uint32_t threads;          /* Encoder threads, 0 = auto          */
+	uint32_t dec_threads;      /* Decoder threads, 0 = auto          */
+	uint32_t tile_cols;        /* Tile columns, 0 = auto             */
+	uint32_t tile_rows;        /* Tile rows, 0 = auto                */
+	uint32_t cpu_used;         /* Speed, higher is faster            */
+	bool screen;               /* Tune for screen content            */
+};
+
+unsigned av1_cpu_count(void);
+
+
 /* Encode */
 int av1_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 		      struct videnc_param *prm, const char *fmtp,
 		      videnc_packet_h *pkth, void *arg);
 int av1_encode(struct videnc_state *ves, bool update,
 	       const struct vidframe *frame);
+int av1_encode_reconfig(struct videnc_state *ves,
+			const struct videnc_param *prm);
 
 
 /* Decode */
@@ -16,6 +16,7 @@
 
 enum {
 	DECODE_MAXSZ = 524288,
+	DECODE_THREADS = 8,     /* Default maximum of decoder threads */
 };
 
 
@@ -60,13 +61,14 @@ static void destructor(void *arg)
 int av1_decode_update(struct viddec_state **vdsp, const struct vidcodec *vc,
 		       const char *fmtp)
 {
+	const struct av1_vidcodec *av1 = (struct av1_vidcodec *)vc;
+	aom_codec_dec_cfg_t cfg;
 	struct viddec_state *vds;
 	aom_codec_err_t res;
 	int err = 0;
-	(void)vc;
 	(void)fmtp;
 
-	if (!vdsp)
+	if (!vdsp || !vc)
 		return EINVAL;
 
 	vds = *vdsp;
@@ -84,7 +86,13 @@ int av1_decode_update(struct viddec_state **vdsp, const struct vidcodec *vc,
 		goto out;
 	}
 
-	res = aom_codec_dec_init(&vds->ctx, &aom_codec_av1_dx_algo, NULL, 0);
+	memset(&cfg, 0, sizeof(cfg));
+
+	cfg.threads = av1->dec_threads ? av1->dec_threads
+		: min(av1_cpu_count(), DECODE_THREADS);
+	cfg.allow_lowbitdepth = 1;
+
+	res = aom_codec_dec_init(&vds->ctx, &aom_codec_av1_dx_algo, &cfg, 0);
 	if (res) {
 		err = ENOMEM;
 		goto out;
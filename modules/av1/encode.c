@@ -16,11 +16,14 @@
 
 enum {
 	HDR_SIZE = 4,
+	TILE_MIN_WIDTH  = 256,  /* Narrowest tile column [pixels] */
+	TILE_MIN_HEIGHT = 128,  /* Lowest tile row [pixels]       */
 };
 
 
 struct videnc_state {
 	aom_codec_ctx_t ctx;
+	aom_codec_enc_cfg_t cfg;
 	struct vidsz size;
 	aom_codec_pts_t pts;
 	unsigned fps;
@@ -28,6 +31,7 @@ struct videnc_state {
 	unsigned pktsize;
 	bool ctxup;
 	uint16_t picid;
+	const struct av1_vidcodec *av1;
 	videnc_packet_h *pkth;
 	void *arg;
 };
@@ -75,6 +79,7 @@ int av1_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 	ves->bitrate = prm->bitrate;
 	ves->pktsize = prm->pktsize;
 	ves->fps     = prm->fps;
+	ves->av1     = (struct av1_vidcodec *)vc;
 	ves->pkth    = pkth;
 	ves->arg     = arg;
 
@@ -82,15 +87,60 @@ int av1_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 }
 
 
+/* Encoder threads for the picture size, as used by WebRTC */
+static unsigned auto_threads(const struct vidsz *size)
+{
+	const unsigned ncpu = av1_cpu_count();
+	const unsigned px = size->w * size->h;
+
+	if (px >= 1920*1080 && ncpu > 8)
+		return 8;
+	else if (px > 1280*960 && ncpu >= 6)
+		return 3;
+	else if (px > 640*480 && ncpu >= 3)
+		return 2;
+	else
+		return 1;
+}
+
+
+/* Number of tiles as log2(n), each tile at least min pixels */
+static unsigned tile_log2(unsigned n, unsigned len, unsigned min)
+{
+	unsigned log2n = 0;
+
+	while ((2u << log2n) <= n && (len >> (log2n + 1)) >= min)
+		++log2n;
+
+	return log2n;
+}
+
+
 static int open_encoder(struct videnc_state *ves, const struct vidsz *size)
 {
+	const struct av1_vidcodec *av1 = ves->av1;
 	aom_codec_enc_cfg_t cfg;
 	aom_codec_err_t res;
+	unsigned threads, cols, rows;
+	unsigned usage = 0;
+
+#ifdef AOM_USAGE_REALTIME
+	usage = AOM_USAGE_REALTIME;
+#endif
 
-	res = aom_codec_enc_config_default(&aom_codec_av1_cx_algo, &cfg, 0);
+	res = aom_codec_enc_config_default(&aom_codec_av1_cx_algo, &cfg,
+					   usage);
 	if (res)
 		return EPROTO;
 
+	threads = av1->threads ? av1->threads : auto_threads(size);
+
+	/* the tiles are coded in parallel, about one per thread */
+	cols = tile_log2(av1->tile_cols ? av1->tile_cols : threads,
+			 size->w, TILE_MIN_WIDTH);
+	rows = tile_log2(av1->tile_rows ? av1->tile_rows : threads >> cols,
+			 size->h, TILE_MIN_HEIGHT);
+
 	cfg.g_w               = size->w;
 	cfg.g_h               = size->h;
 	cfg.g_timebase.num    = 1;
@@ -101,6 +151,7 @@ static int open_encoder(struct videnc_state *ves, const struct vidsz *size)
 	cfg.rc_end_usage      = AOM_VBR;
 	cfg.rc_target_bitrate = ves->bitrate;
 	cfg.kf_mode           = AOM_KF_AUTO;
+	cfg.g_threads         = threads;
 
 	if (ves->ctxup) {
 		debug("av1: re-opening encoder\n");
@@ -116,13 +167,46 @@ static int open_encoder(struct videnc_state *ves, const struct vidsz *size)
 	}
 
 	ves->ctxup = true;
+	ves->cfg   = cfg;
+
+	res = aom_codec_control(&ves->ctx, AOME_SET_CPUUSED, av1->cpu_used);
+	if (res) {
+		warning("av1: codec ctrl: %s\n",
+			aom_codec_err_to_string(res));
+	}
 
-	res = aom_codec_control(&ves->ctx, AOME_SET_CPUUSED, 8);
+	res = aom_codec_control(&ves->ctx, AV1E_SET_TILE_COLUMNS, cols);
 	if (res) {
-		warning("av1: codec ctrl C: %s\n",
+		warning("av1: codec ctrl: %s\n",
 			aom_codec_err_to_string(res));
 	}
 
+	res = aom_codec_control(&ves->ctx, AV1E_SET_TILE_ROWS, rows);
+	if (res) {
+		warning("av1: codec ctrl: %s\n",
+			aom_codec_err_to_string(res));
+	}
+
+#ifdef AOM_CTRL_AV1E_SET_ROW_MT
+	res = aom_codec_control(&ves->ctx, AV1E_SET_ROW_MT, 1);
+	if (res) {
+		warning("av1: codec ctrl: %s\n",
+			aom_codec_err_to_string(res));
+	}
+#endif
+
+	res = aom_codec_control(&ves->ctx, AV1E_SET_TUNE_CONTENT,
+				av1->screen ? AOM_CONTENT_SCREEN
+				: AOM_CONTENT_DEFAULT);
+	if (res) {
+		warning("av1: codec ctrl: %s\n",
+			aom_codec_err_to_string(res));
+	}
+
+	info("av1: encoder opened, picture size %u x %u, %u threads,"
+	     " %u x %u tiles%s\n", size->w, size->h, threads,
+	     1 << cols, 1 << rows, av1->screen ? ", screen content" : "");
+
 	return 0;
 }
 
@@ -166,6 +250,55 @@ static inline int packetize(bool marker, const uint8_t *buf, size_t len,
 }
 
 
+/* Apply a new configuration to the running encoder */
+static int cfg_apply(struct videnc_state *ves, const aom_codec_enc_cfg_t *cfg)
+{
+	aom_codec_err_t res;
+
+	res = aom_codec_enc_config_set(&ves->ctx, cfg);
+	if (res) {
+		debug("av1: enc config: %s\n", aom_codec_err_to_string(res));
+		return EPROTO;
+	}
+
+	ves->cfg = *cfg;
+
+	return 0;
+}
+
+
+/*
+ * Bitrate and frame-rate are changed in the running encoder, so there
+ * is no keyframe. If it cannot be done, the encoder is opened again
+ * with the next frame.
+ */
+int av1_encode_reconfig(struct videnc_state *ves,
+			const struct videnc_param *prm)
+{
+	aom_codec_enc_cfg_t cfg;
+
+	if (!ves || !prm)
+		return EINVAL;
+
+	ves->bitrate = prm->bitrate;
+	ves->fps     = prm->fps;
+
+	if (!ves->ctxup)
+		return 0;
+
+	cfg = ves->cfg;
+	cfg.g_timebase.den    = ves->fps;
+	cfg.rc_target_bitrate = ves->bitrate;
+
+	if (cfg_apply(ves, &cfg)) {
+		aom_codec_destroy(&ves->ctx);
+		ves->ctxup = false;
+	}
+
+	return 0;
+}
+
+
 int av1_encode(struct videnc_state *ves, bool update,
 		const struct vidframe *frame)
 {
@@ -179,6 +312,18 @@ int av1_encode(struct videnc_state *ves, bool update,
 	if (!ves || !frame || frame->fmt != VID_FMT_YUV420P)
 		return EINVAL;
 
+	if (ves->ctxup && !vidsz_cmp(&ves->size, &frame->size)) {
+
+		aom_codec_enc_cfg_t cfg = ves->cfg;
+
+		/* a smaller picture needs no new encoder */
+		cfg.g_w = frame->size.w;
+		cfg.g_h = frame->size.h;
+
+		if (0 == cfg_apply(ves, &cfg))
+			ves->size = frame->size;
+	}
+
 	if (!ves->ctxup || !vidsz_cmp(&ves->size, &frame->size)) {
 
 		err = open_encoder(ves, &frame->size);
@@ -12,6 +12,9 @@
 #endif
 #include "h26x.h"
 #include "avcodec.h"
+#ifdef USE_HWACCEL
+#include <libavutil/hwcontext.h>
+#endif
 
 
 /**
@@ -34,8 +37,25 @@
  \verbatim
       avcodec_h264enc  <NAME>  ; e.g. h264_nvenc, h264_videotoolbox
       avcodec_h264dec  <NAME>  ; e.g. h264_cuvid, h264_vda, h264_qsv
+      avcodec_dec_threads  <N>           ; decoder threads, 0 is auto
+      avcodec_dec_thread_type {slice,frame}
+      avcodec_hwaccel  <TYPE>  ; e.g. vaapi, vdpau, videotoolbox, cuda
+      avcodec_hwaccel_device <DEVICE> ; e.g. /dev/dri/renderD128
+      avcodec_h264enc_device <DEVICE> ; e.g. /dev/dri/renderD128
  \endverbatim
  *
+ * Frame threading decodes several pictures in parallel, but delays
+ * every picture by one frame per extra thread. Slice threading adds
+ * no delay, and helps when the sender uses more than one slice.
+ *
+ * With a hardware decoder the pictures are copied back to system
+ * memory. The software decoder is used if the device cannot be opened,
+ * or does not support the codec or the stream.
+ *
+ * A hardware H.264 encoder is selected with avcodec_h264enc, e.g.
+ * h264_vaapi, h264_qsv or h264_nvenc. If it takes hardware frames, the
+ * captured pictures are uploaded to a pool of frames on the device.
+ *
  * References:
  *
  *     http://ffmpeg.org
@@ -48,8 +68,16 @@
 
 
 const uint8_t h264_level_idc = 0x0c;
+struct log_mod avcodec_log = LOG_MOD_INIT("avcodec");
 AVCodec *avcodec_h264enc;             /* optional; specified H.264 encoder */
 AVCodec *avcodec_h264dec;             /* optional; specified H.264 decoder */
+uint32_t avcodec_dec_threads = 0;
+int avcodec_dec_thread_type = FF_THREAD_SLICE;
+#ifdef USE_HWACCEL
+AVBufferRef *avcodec_hw_device;       /* optional; hardware decoder */
+AVBufferRef *avcodec_hwenc_device;    /* optional; hardware encoder */
+enum AVPixelFormat avcodec_hwenc_pix_fmt = AV_PIX_FMT_NONE;
+#endif
 
 
 int avcodec_resolve_codecid(const char *s)
@@ -93,10 +121,11 @@ static int h264_fmtp_enc(struct mbuf *mb, const struct sdp_format *fmt,
 		return 0;
 
 	return mbuf_printf(mb, "a=fmtp:%s"
-			   " packetization-mode=0"
+			   " packetization-mode=%u"
 			   ";profile-level-id=%02x%02x%02x"
 			   "\r\n",
-			   fmt->id, profile_idc, profile_iop, h264_level_idc);
+			   fmt->id, packetization_mode(vc->variant),
+			   profile_idc, profile_iop, h264_level_idc);
 }
 
 
@@ -134,6 +163,26 @@ static int mpg4_fmtp_enc(struct mbuf *mb, const struct sdp_format *fmt,
 }
 
 
+/* packetization-mode 1 aggregates the small NALs, and is preferred */
+static struct vidcodec h264_mode1 = {
+	LE_INIT,
+	NULL,
+	"H264",
+	"packetization-mode=1",
+	NULL,
+	encode_update,
+#ifdef USE_X264
+	encode_x264,
+#else
+	encode,
+#endif
+	decode_update,
+	decode_h264,
+	h264_fmtp_enc,
+	h264_fmtp_cmp,
+	encode_reconfig,
+};
+
 static struct vidcodec h264 = {
 	LE_INIT,
 	NULL,
@@ -150,6 +199,7 @@ static struct vidcodec h264 = {
 	decode_h264,
 	h264_fmtp_enc,
 	h264_fmtp_cmp,
+	encode_reconfig,
 };
 
 static struct vidcodec h263 = {
@@ -164,6 +214,7 @@ static struct vidcodec h263 = {
 	decode_h263,
 	h263_fmtp_enc,
 	NULL,
+	encode_reconfig,
 };
 
 static struct vidcodec mpg4 = {
@@ -178,13 +229,86 @@ static struct vidcodec mpg4 = {
 	decode_mpeg4,
 	mpg4_fmtp_enc,
 	NULL,
+	encode_reconfig,
 };
 
 
+#ifdef USE_HWACCEL
+static void hwaccel_init(void)
+{
+	enum AVHWDeviceType type;
+	char name[32], device[256] = "";
+	int ret;
+
+	if (conf_get_str(conf_cur(), "avcodec_hwaccel", name, sizeof(name)))
+		return;
+
+	type = av_hwdevice_find_type_by_name(name);
+	if (type == AV_HWDEVICE_TYPE_NONE) {
+		warning("avcodec: unknown hwaccel type (%s)\n", name);
+		return;
+	}
+
+	(void)conf_get_str(conf_cur(), "avcodec_hwaccel_device",
+			   device, sizeof(device));
+
+	ret = av_hwdevice_ctx_create(&avcodec_hw_device, type,
+				     str_isset(device) ? device : NULL,
+				     NULL, 0);
+	if (ret < 0) {
+		warning("avcodec: could not open %s device %s (%i),"
+			" using software decoder\n", name, device, ret);
+		return;
+	}
+
+	info("avcodec: using %s hardware decoder\n", name);
+}
+
+
+/* Opens the device of an encoder that takes hardware frames */
+static void hwenc_init(const AVCodec *codec)
+{
+	const AVCodecHWConfig *cfg;
+	char device[256] = "";
+	int i, ret;
+
+	for (i = 0;; i++) {
+
+		cfg = avcodec_get_hw_config(codec, i);
+		if (!cfg)
+			return;
+
+		if (cfg->methods & AV_CODEC_HW_CONFIG_METHOD_HW_FRAMES_CTX)
+			break;
+	}
+
+	(void)conf_get_str(conf_cur(), "avcodec_h264enc_device",
+			   device, sizeof(device));
+
+	ret = av_hwdevice_ctx_create(&avcodec_hwenc_device, cfg->device_type,
+				     str_isset(device) ? device : NULL,
+				     NULL, 0);
+	if (ret < 0) {
+		warning("avcodec: could not open %s device %s (%i),"
+			" passing frames in system memory\n",
+			av_hwdevice_get_type_name(cfg->device_type),
+			device, ret);
+		return;
+	}
+
+	avcodec_hwenc_pix_fmt = cfg->pix_fmt;
+
+	info("avcodec: %s encodes %s frames\n", codec->name,
+	     av_hwdevice_get_type_name(cfg->device_type));
+}
+#endif
+
+
 static int module_init(void)
 {
 	char h264enc[64];
 	char h264dec[64];
+	char thread_type[16];
 
 #ifdef USE_X264
 	debug("avcodec: x264 build %d\n", X264_BUILD);
@@ -198,6 +322,27 @@ static int module_init(void)
 
 	avcodec_register_all();
 
+	log_mod_register(&avcodec_log);
+
+	(void)conf_get_u32(conf_cur(), "avcodec_dec_threads",
+			   &avcodec_dec_threads);
+
+	if (0 == conf_get_str(conf_cur(), "avcodec_dec_thread_type",
+			      thread_type, sizeof(thread_type))) {
+
+		if (0 == str_casecmp(thread_type, "frame"))
+			avcodec_dec_thread_type = FF_THREAD_FRAME;
+		else if (0 == str_casecmp(thread_type, "slice"))
+			avcodec_dec_thread_type = FF_THREAD_SLICE;
+		else
+			warning("avcodec: unknown thread type (%s)\n",
+				thread_type);
+	}
+
+#ifdef USE_HWACCEL
+	hwaccel_init();
+#endif
+
 	if (0 == conf_get_str(conf_cur(), "avcodec_h264dec",
 			      h264dec, sizeof(h264dec))) {
 
@@ -209,11 +354,14 @@ static int module_init(void)
 				h264dec);
 			return ENOENT;
 		}
+		vidcodec_register(&h264_mode1);
 		vidcodec_register(&h264);
 	}
 	else {
-		if (avcodec_find_decoder(AV_CODEC_ID_H264))
+		if (avcodec_find_decoder(AV_CODEC_ID_H264)) {
+			vidcodec_register(&h264_mode1);
 			vidcodec_register(&h264);
+		}
 	}
 
 	if (avcodec_find_decoder(AV_CODEC_ID_H263))
@@ -233,6 +381,10 @@ static int module_init(void)
 				h264enc);
 			return ENOENT;
 		}
+
+#ifdef USE_HWACCEL
+		hwenc_init(avcodec_h264enc);
+#endif
 	}
 
 	return 0;
@@ -241,9 +393,17 @@ static int module_init(void)
 
 static int module_close(void)
 {
+	log_mod_unregister(&avcodec_log);
+
 	vidcodec_unregister(&mpg4);
 	vidcodec_unregister(&h263);
 	vidcodec_unregister(&h264);
+	vidcodec_unregister(&h264_mode1);
+
+#ifdef USE_HWACCEL
+	av_buffer_unref(&avcodec_hw_device);
+	av_buffer_unref(&avcodec_hwenc_device);
+#endif
 
 	return 0;
 }
@@ -15,10 +15,22 @@
 
 #endif
 
+#if LIBAVCODEC_VERSION_INT >= ((58<<16)+(18<<8)+100)
+#define USE_HWACCEL 1
+#endif
+
 
 extern const uint8_t h264_level_idc;
+extern struct log_mod avcodec_log;
 extern AVCodec *avcodec_h264enc;
 extern AVCodec *avcodec_h264dec;
+extern uint32_t avcodec_dec_threads;
+extern int avcodec_dec_thread_type;
+#ifdef USE_HWACCEL
+extern AVBufferRef *avcodec_hw_device;
+extern AVBufferRef *avcodec_hwenc_device;
+extern enum AVPixelFormat avcodec_hwenc_pix_fmt;
+#endif
 
 
 /*
@@ -31,6 +43,7 @@ int encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 		  struct videnc_param *prm, const char *fmtp,
 		  videnc_packet_h *pkth, void *arg);
 int encode(struct videnc_state *st, bool update, const struct vidframe *frame);
+int encode_reconfig(struct videnc_state *st, const struct videnc_param *prm);
 #ifdef USE_X264
 int encode_x264(struct videnc_state *st, bool update,
 		const struct vidframe *frame);
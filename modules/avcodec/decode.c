@@ -14,6 +14,9 @@
 #endif
 #include "h26x.h"
 #include "avcodec.h"
+#ifdef USE_HWACCEL
+#include <libavutil/hwcontext.h>
+#endif
 
 
 #if LIBAVUTIL_VERSION_MAJOR < 52
@@ -29,6 +32,10 @@ struct viddec_state {
 	AVFrame *pict;
 	struct mbuf *mb;
 	bool got_keyframe;
+#ifdef USE_HWACCEL
+	enum AVPixelFormat hw_pix_fmt;  /* format of hardware pictures */
+	AVFrame *sw_pict;               /* picture copied from the GPU */
+#endif
 };
 
 
@@ -46,9 +53,75 @@ static void destructor(void *arg)
 
 	if (st->pict)
 		av_free(st->pict);
+
+#ifdef USE_HWACCEL
+	av_frame_free(&st->sw_pict);
+#endif
+}
+
+
+#ifdef USE_HWACCEL
+/* Picks the hardware format if this stream can use it */
+static enum AVPixelFormat get_format(AVCodecContext *ctx,
+				     const enum AVPixelFormat *fmtv)
+{
+	const struct viddec_state *st = ctx->opaque;
+	const enum AVPixelFormat *p;
+
+	for (p = fmtv; *p != AV_PIX_FMT_NONE; p++) {
+		if (*p == st->hw_pix_fmt)
+			return *p;
+	}
+
+	warning("avcodec: hardware decoder not usable,"
+		" using software decoder\n");
+
+	return avcodec_default_get_format(ctx, fmtv);
 }
 
 
+static void init_hwaccel(struct viddec_state *st)
+{
+	enum AVHWDeviceType type;
+	int i;
+
+	if (!avcodec_hw_device)
+		return;
+
+	type = ((AVHWDeviceContext *)avcodec_hw_device->data)->type;
+
+	for (i = 0;; i++) {
+
+		const AVCodecHWConfig *cfg;
+
+		cfg = avcodec_get_hw_config(st->codec, i);
+		if (!cfg) {
+			info("avcodec: %s not supported by hardware decoder,"
+			     " using software decoder\n", st->codec->name);
+			return;
+		}
+
+		if (cfg->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX &&
+		    cfg->device_type == type) {
+			st->hw_pix_fmt = cfg->pix_fmt;
+			break;
+		}
+	}
+
+	st->sw_pict = av_frame_alloc();
+	if (!st->sw_pict)
+		return;
+
+	st->ctx->hw_device_ctx = av_buffer_ref(avcodec_hw_device);
+	if (!st->ctx->hw_device_ctx)
+		return;
+
+	st->ctx->opaque     = st;
+	st->ctx->get_format = get_format;
+}
+#endif
+
+
 static int init_decoder(struct viddec_state *st, const char *name)
 {
 	enum AVCodecID codec_id;
@@ -85,6 +158,15 @@ static int init_decoder(struct viddec_state *st, const char *name)
 	if (!st->ctx || !st->pict)
 		return ENOMEM;
 
+	/* 0 lets libavcodec choose the number of threads */
+	st->ctx->thread_count = avcodec_dec_threads;
+	st->ctx->thread_type  = avcodec_dec_thread_type;
+
+#ifdef USE_HWACCEL
+	st->hw_pix_fmt = AV_PIX_FMT_NONE;
+	init_hwaccel(st);
+#endif
+
 #if LIBAVCODEC_VERSION_INT >= ((53<<16)+(8<<8)+0)
 	if (avcodec_open2(st->ctx, st->codec, NULL) < 0)
 		return ENOENT;
@@ -213,8 +295,28 @@ static int ffdecode(struct viddec_state *st, struct vidframe *frame,
 
 	if (got_picture) {
 
+		AVFrame *pict = st->pict;
+
+#ifdef USE_HWACCEL
+		if (pict->format == st->hw_pix_fmt) {
+
+			/* copy the picture from GPU to system memory */
+			av_frame_unref(st->sw_pict);
+
+			ret = av_hwframe_transfer_data(st->sw_pict, pict, 0);
+			if (ret < 0) {
+				warning("avcodec: decode: hardware transfer"
+					" failed (%i)\n", ret);
+				err = EBADMSG;
+				goto out;
+			}
+
+			pict = st->sw_pict;
+		}
+#endif
+
 #if LIBAVCODEC_VERSION_INT >= ((53<<16)+(5<<8)+0)
-		switch (st->pict->format) {
+		switch (pict->format) {
 
 		case AV_PIX_FMT_YUV420P:
 		case AV_PIX_FMT_YUVJ420P:
@@ -228,8 +330,8 @@ static int ffdecode(struct viddec_state *st, struct vidframe *frame,
 		default:
 			warning("avcodec: decode: bad pixel format"
 				" (%i) (%s)\n",
-				st->pict->format,
-				av_get_pix_fmt_name(st->pict->format));
+				pict->format,
+				av_get_pix_fmt_name(pict->format));
 			goto out;
 		}
 #else
@@ -237,8 +339,8 @@ static int ffdecode(struct viddec_state *st, struct vidframe *frame,
 #endif
 
 		for (i=0; i<4; i++) {
-			frame->data[i]     = st->pict->data[i];
-			frame->linesize[i] = st->pict->linesize[i];
+			frame->data[i]     = pict->data[i];
+			frame->linesize[i] = pict->linesize[i];
 		}
 		frame->size.w = st->ctx->width;
 		frame->size.h = st->ctx->height;
@@ -310,6 +412,32 @@ static int h264_decode(struct viddec_state *st, bool *intra, struct mbuf *src)
 			err = h264_hdr_encode(&h264_hdr, st->mb);
 		}
 	}
+	else if (H264_NAL_STAP_A == h264_hdr.type) {
+
+		/* each aggregated NAL gets its own start sequence */
+		while (mbuf_get_left(src) >= 2) {
+
+			const size_t sz = ntohs(mbuf_read_u16(src));
+			uint8_t type;
+
+			if (!sz || mbuf_get_left(src) < sz)
+				return EBADMSG;
+
+			type = mbuf_buf(src)[0] & 0x1f;
+
+			if (type == H264_NAL_PPS || type == H264_NAL_SPS)
+				st->got_keyframe = true;
+
+			if (h264_is_keyframe(type))
+				*intra = true;
+
+			err |= mbuf_write_mem(st->mb, nal_seq, 3);
+			err |= mbuf_write_mem(st->mb, mbuf_buf(src), sz);
+			mbuf_advance(src, sz);
+		}
+
+		mbuf_set_pos(src, src->end);
+	}
 	else {
 		warning("avcodec: unknown NAL type %u\n", h264_hdr.type);
 		return EBADMSG;
@@ -374,15 +502,13 @@ int decode_h263(struct viddec_state *st, struct vidframe *frame,
 	if (err)
 		return err;
 
-#if 0
-	debug(".....[%s seq=%5u ] MODE %s -"
-	      " SBIT=%u EBIT=%u I=%s"
-	      " (%5u/%5u bytes)\n",
-	      marker ? "M" : " ", seq,
-	      h263_hdr_mode(&hdr) == H263_MODE_A ? "A" : "B",
-	      hdr.sbit, hdr.ebit, hdr.i ? "Inter" : "Intra",
-	      mbuf_get_left(src), st->mb->end);
-#endif
+	mod_dbg(avcodec_log, "avcodec: h263 [%s seq=%5u ] MODE %s -"
+		" SBIT=%u EBIT=%u I=%s"
+		" (%5zu/%5zu bytes)\n",
+		marker ? "M" : " ", seq,
+		h263_hdr_mode(&hdr) == H263_MODE_A ? "A" : "B",
+		hdr.sbit, hdr.ebit, hdr.i ? "Inter" : "Intra",
+		mbuf_get_left(src), st->mb->end);
 
 	if (!hdr.i) {
 		st->got_keyframe = true;
@@ -18,6 +18,10 @@
 #endif
 #include "h26x.h"
 #include "avcodec.h"
+#ifdef USE_HWACCEL
+#include <libavutil/hwcontext.h>
+#include <libavutil/pixdesc.h>
+#endif
 
 
 #if LIBAVUTIL_VERSION_MAJOR < 52
@@ -28,6 +32,7 @@
 
 enum {
 	DEFAULT_GOP_SIZE =   10,
+	HWFRAMES_POOL    =    8,
 };
 
 
@@ -70,6 +75,10 @@ struct videnc_state {
 #ifdef USE_X264
 	x264_t *x264;
 #endif
+#ifdef USE_HWACCEL
+	AVBufferRef *hw_frames;  /* pool of frames on the encoder device */
+	AVFrame *hw_pict;        /* picture uploaded to the device */
+#endif
 };
 
 
@@ -96,6 +105,11 @@ static void destructor(void *arg)
 
 	if (st->pict)
 		av_free(st->pict);
+
+#ifdef USE_HWACCEL
+	av_buffer_unref(&st->hw_frames);
+	av_frame_free(&st->hw_pict);
+#endif
 }
 
 
@@ -166,6 +180,59 @@ static int init_encoder(struct videnc_state *st)
 }
 
 
+#ifdef USE_HWACCEL
+static int open_hwframes(struct videnc_state *st, const struct vidsz *size,
+			 int sw_fmt)
+{
+	AVHWFramesContext *fc;
+
+	st->hw_frames = av_hwframe_ctx_alloc(avcodec_hwenc_device);
+	if (!st->hw_frames)
+		return ENOMEM;
+
+	fc = (AVHWFramesContext *)st->hw_frames->data;
+	fc->format    = avcodec_hwenc_pix_fmt;
+	fc->sw_format = sw_fmt;
+	fc->width     = size->w;
+	fc->height    = size->h;
+	fc->initial_pool_size = HWFRAMES_POOL;
+
+	if (av_hwframe_ctx_init(st->hw_frames) < 0) {
+		warning("avcodec: could not create %s frames\n",
+			av_get_pix_fmt_name(sw_fmt));
+		av_buffer_unref(&st->hw_frames);
+		return ENOTSUP;
+	}
+
+	if (!st->hw_pict) {
+		st->hw_pict = av_frame_alloc();
+		if (!st->hw_pict)
+			return ENOMEM;
+	}
+
+	return 0;
+}
+
+
+static int hwframe_upload(struct videnc_state *st)
+{
+	av_frame_unref(st->hw_pict);
+
+	if (av_hwframe_get_buffer(st->hw_frames, st->hw_pict, 0) < 0)
+		return ENOMEM;
+
+	if (av_hwframe_transfer_data(st->hw_pict, st->pict, 0) < 0)
+		return EBADMSG;
+
+	st->hw_pict->pts       = st->pict->pts;
+	st->hw_pict->key_frame = st->pict->key_frame;
+	st->hw_pict->pict_type = st->pict->pict_type;
+
+	return 0;
+}
+#endif
+
+
 static int open_encoder(struct videnc_state *st,
 			const struct videnc_param *prm,
 			const struct vidsz *size,
@@ -185,6 +252,10 @@ static int open_encoder(struct videnc_state *st,
 	if (st->pict)
 		av_free(st->pict);
 
+#ifdef USE_HWACCEL
+	av_buffer_unref(&st->hw_frames);
+#endif
+
 #if LIBAVCODEC_VERSION_INT >= ((52<<16)+(92<<8)+0)
 	st->ctx = avcodec_alloc_context3(st->codec);
 #else
@@ -212,6 +283,22 @@ static int open_encoder(struct videnc_state *st,
 	st->ctx->time_base.num = 1;
 	st->ctx->time_base.den = prm->fps;
 
+#ifdef USE_HWACCEL
+	if (st->codec == avcodec_h264enc && avcodec_hwenc_device) {
+
+		err = open_hwframes(st, size, pix_fmt);
+		if (err)
+			goto out;
+
+		st->ctx->pix_fmt       = avcodec_hwenc_pix_fmt;
+		st->ctx->hw_frames_ctx = av_buffer_ref(st->hw_frames);
+		if (!st->ctx->hw_frames_ctx) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+#endif
+
 	/* params to avoid libavcodec/x264 default preset error */
 	if (st->codec_id == AV_CODEC_ID_H264) {
 		st->ctx->me_range = 16;
@@ -285,6 +372,10 @@ static int open_encoder(struct videnc_state *st,
 			av_free(st->pict);
 			st->pict = NULL;
 		}
+
+#ifdef USE_HWACCEL
+		av_buffer_unref(&st->hw_frames);
+#endif
 	}
 	else
 		st->encsize = *size;
@@ -299,7 +390,7 @@ int decode_sdpparam_h264(struct videnc_state *st, const struct pl *name,
 	if (0 == pl_strcasecmp(name, "packetization-mode")) {
 		st->u.h264.packetization_mode = pl_u32(val);
 
-		if (st->u.h264.packetization_mode != 0) {
+		if (st->u.h264.packetization_mode > 1) {
 			warning("avcodec: illegal packetization-mode %u\n",
 				st->u.h264.packetization_mode);
 			return EPROTO;
@@ -554,6 +645,41 @@ int encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 }
 
 
+/*
+ * New bitrate and frame-rate for the running encoder. x264 takes them
+ * with x264_encoder_reconfig(). The libx264 wrapper of libavcodec reads
+ * the bitrate of the context with the next frame, the time base cannot
+ * change while the context is open and is used when it is opened again.
+ */
+int encode_reconfig(struct videnc_state *st, const struct videnc_param *prm)
+{
+	if (!st || !prm)
+		return EINVAL;
+
+	st->encprm.bitrate = prm->bitrate;
+	st->encprm.fps     = prm->fps;
+
+#ifdef USE_X264
+	if (st->x264) {
+		x264_param_t xprm;
+
+		x264_encoder_parameters(st->x264, &xprm);
+
+		xprm.i_fps_num    = prm->fps;
+		xprm.rc.i_bitrate = prm->bitrate / 1000; /* kbit/s */
+
+		if (x264_encoder_reconfig(st->x264, &xprm) < 0)
+			warning("avcodec: x264_encoder_reconfig() failed\n");
+	}
+#endif
+
+	if (st->ctx)
+		st->ctx->bit_rate = prm->bitrate;
+
+	return 0;
+}
+
+
 #ifdef USE_X264
 int encode_x264(struct videnc_state *st, bool update,
 		const struct vidframe *frame)
@@ -707,9 +833,20 @@ int encode(struct videnc_state *st, bool update, const struct vidframe *frame)
 
 #if LIBAVCODEC_VERSION_INT >= ((57<<16)+(37<<8)+100)
 	do {
+		AVFrame *pict = st->pict;
 		AVPacket *pkt;
 
-		ret = avcodec_send_frame(st->ctx, st->pict);
+#ifdef USE_HWACCEL
+		if (st->hw_frames) {
+			err = hwframe_upload(st);
+			if (err)
+				return err;
+
+			pict = st->hw_pict;
+		}
+#endif
+
+		ret = avcodec_send_frame(st->ctx, pict);
 		if (ret < 0)
 			return EBADMSG;
 
@@ -774,9 +911,17 @@ int encode(struct videnc_state *st, bool update, const struct vidframe *frame)
 		break;
 
 	case AV_CODEC_ID_H264:
-		err = h264_packetize(st->mb->buf, st->mb->end,
-				     st->encprm.pktsize,
-				     st->pkth, st->arg);
+		/* mode 1 allows the small NALs to be aggregated */
+		if (st->u.h264.packetization_mode == 1) {
+			err = h264_packetize_stap(st->mb->buf, st->mb->end,
+						  st->encprm.pktsize,
+						  st->pkth, st->arg);
+		}
+		else {
+			err = h264_packetize(st->mb->buf, st->mb->end,
+					     st->encprm.pktsize,
+					     st->pkth, st->arg);
+		}
 		break;
 
 	case AV_CODEC_ID_MPEG4:
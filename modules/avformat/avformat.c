@@ -30,6 +30,12 @@
  \verbatim
   video_source            avformat,/tmp/testfile.mp4
  \endverbatim
+ *
+ * The core shares a video source between all calls that use the same
+ * file or URL, so it is opened and decoded only once, and each frame
+ * is given to all the calls. The frames are paced by the wall clock,
+ * so the time it takes to hand a frame to many calls does not slow
+ * down the playback.
  */
 
 
@@ -66,6 +72,12 @@ struct vidsrc_st {
 	void *arg;
 	int sindex;
 	int fps;
+	uint64_t ts;              /* Time of the next frame [ms] */
+};
+
+
+enum {
+	MAX_LATE = 1000,          /* Late frames before a restart [ms] */
 };
 
 
@@ -94,6 +106,22 @@ static void destructor(void *arg)
 }
 
 
+/* wait until the next frame is due, without drift */
+static void pace(struct vidsrc_st *st, uint64_t dur)
+{
+	uint64_t now = tmr_jiffies();
+
+	/* start over after a rewind or a long stall */
+	if (!st->ts || now > st->ts + MAX_LATE)
+		st->ts = now;
+
+	st->ts += dur;
+
+	if (st->ts > now)
+		sys_msleep((unsigned)(st->ts - now));
+}
+
+
 static void handle_packet(struct vidsrc_st *st, AVPacket *pkt)
 {
 	AVFrame *frame = NULL;
@@ -175,12 +203,12 @@ static void handle_packet(struct vidsrc_st *st, AVPacket *pkt)
 	st->frameh(&vf, st->arg);
 
 #if LIBAVCODEC_VERSION_INT >= ((54<<16)+(24<<8)+100)
-	/* simulate framerate (NOTE: not accurate) */
+	/* simulate framerate */
 	dur = 1.0 * av_frame_get_pkt_duration(frame) * av_q2d(st->time_base);
 #else
 	dur = 1.0 / st->fps;
 #endif
-	sys_msleep(1000.0 * dur);
+	pace(st, (uint64_t)(1000.0 * dur));
 
  out:
 	if (frame) {
@@ -208,6 +236,7 @@ static void *read_thread(void *data)
 			debug("avformat: rewind stream (ret=%d)\n", ret);
 			sys_msleep(1000);
 			av_seek_frame(st->ic, -1, 0, 0);
+			st->ts = 0;
 			continue;
 		}
 
@@ -16,23 +16,115 @@
  *
  * N session objects
  * 1 session object has 2 call objects (left, right leg)
+ *
+ * When both legs are established, the RTP of each media stream that
+ * uses the same codec on both legs is relayed from one leg to the
+ * other without being decoded. The other media streams are bridged
+ * through the aubridge and vidbridge devices, and are transcoded.
+ *
+ * With call_shards set, the media of the outgoing call is put on the
+ * event loop of the media of the incoming call, so that it can be
+ * relayed. The sessions are only used from the main loop.
  */
 
 
+enum {
+	SESSION_HASH_SIZE = 4096,
+};
+
+/** One leg of a session */
+struct leg {
+	struct le he;             /* ht_call, by call pointer */
+	struct le hid;            /* ht_callid, by SIP Call-ID */
+	struct call *call;
+	struct session *sess;
+	bool estab;
+};
+
 struct session {
 	struct le le;
-	struct call *call_in, *call_out;
+	struct leg in, out;
+	uint32_t affinity;
+	unsigned n_relay;
 };
 
 
 static struct list sessionl;
+static struct hash *ht_call;
+static struct hash *ht_callid;
 static struct ua *ua_in, *ua_out;
+static uint32_t affinity;
+
+
+static uint32_t call_hash(const struct call *call)
+{
+	return hash_joaat((const uint8_t *)&call, sizeof(call));
+}
+
+
+static bool leg_cmp(struct le *le, void *arg)
+{
+	const struct leg *leg = le->data;
+
+	return leg->call == arg;
+}
+
+
+static bool callid_cmp(struct le *le, void *arg)
+{
+	const struct leg *leg = le->data;
+
+	return 0 == str_cmp(call_id(leg->call), arg);
+}
+
+
+static struct leg *leg_find(const struct call *call)
+{
+	return list_ledata(hash_lookup(ht_call, call_hash(call),
+				       leg_cmp, (void *)call));
+}
+
+
+static struct leg *leg_find_callid(const char *callid)
+{
+	return list_ledata(hash_lookup(ht_callid, hash_joaat_str(callid),
+				       callid_cmp, (void *)callid));
+}
+
+
+static void leg_index(struct session *sess, struct leg *leg,
+		      struct call *call)
+{
+	leg->call = call;
+	leg->sess = sess;
+
+	hash_append(ht_call, call_hash(call), &leg->he, leg);
+}
+
+
+/* The Call-ID of an outgoing call is known once the INVITE is sent */
+static void leg_index_callid(struct leg *leg)
+{
+	const char *callid = call_id(leg->call);
+
+	if (leg->hid.list || !callid)
+		return;
+
+	hash_append(ht_callid, hash_joaat_str(callid), &leg->hid, leg);
+}
+
+
+static void leg_unindex(struct leg *leg)
+{
+	hash_unlink(&leg->he);
+	hash_unlink(&leg->hid);
+}
 
 
 static struct call *other_call(struct session *sess, const struct call *call)
 {
-	if (sess->call_in == call) return sess->call_out;
-	if (sess->call_out == call) return sess->call_in;
+	if (sess->in.call == call) return sess->out.call;
+	if (sess->out.call == call) return sess->in.call;
 
 	return NULL;
 }
@@ -43,11 +135,31 @@ static void destructor(void *arg)
 	struct session *sess = arg;
 
 	debug("b2bua: session destroyed (in=%p, out=%p)\n",
-	      sess->call_in, sess->call_out);
+	      sess->in.call, sess->out.call);
 
 	list_unlink(&sess->le);
-	mem_deref(sess->call_out);
-	mem_deref(sess->call_in);
+	leg_unindex(&sess->in);
+	leg_unindex(&sess->out);
+	call_relay(sess->in.call, NULL);
+	call_relay(sess->out.call, NULL);
+	mem_deref(sess->out.call);
+	mem_deref(sess->in.call);
+}
+
+
+/* Hangup the other leg and free the session, which owns both calls */
+static void session_close(struct session *sess, struct call *call)
+{
+	struct call *call2 = other_call(sess, call);
+
+	/* the hangup emits events for the other leg */
+	leg_unindex(&sess->in);
+	leg_unindex(&sess->out);
+
+	mem_ref(call2);
+
+	ua_hangup(call_get_ua(call2), call2, call_scode(call), "");
+	mem_deref(sess);
 }
 
 
@@ -56,22 +168,30 @@ static void call_event_handler(struct call *call, enum call_event ev,
 {
 	struct session *sess = arg;
 	struct call *call2 = other_call(sess, call);
+	struct leg *leg = call == sess->in.call ? &sess->in : &sess->out;
 
 	switch (ev) {
 
 	case CALL_EVENT_ESTABLISHED:
 		debug("b2bua: CALL_ESTABLISHED: peer_uri=%s\n",
 		      call_peeruri(call));
+
+		leg->estab = true;
+		leg_index_callid(leg);
+
+		if (sess->in.estab && sess->out.estab) {
+			sess->n_relay = call_relay(sess->in.call,
+						   sess->out.call);
+			break;
+		}
+
 		ua_answer(call_get_ua(call2), call2);
 		break;
 
 	case CALL_EVENT_CLOSED:
 		debug("b2bua: CALL_CLOSED: %s\n", str);
 
-		mem_ref(call2);
-
-		ua_hangup(call_get_ua(call2), call2, call_scode(call), "");
-		mem_deref(sess);
+		session_close(sess, call);
 		break;
 
 	default:
@@ -93,34 +213,51 @@ static void call_dtmf_handler(struct call *call, char key, void *arg)
 static int new_session(struct call *call)
 {
 	struct session *sess;
+	struct call *call_out = NULL;
 	char a[64], b[64];
 	int err;
 
+	if (leg_find(call))
+		return EALREADY;
+
 	sess = mem_zalloc(sizeof(*sess), destructor);
 	if (!sess)
 		return ENOMEM;
 
-	sess->call_in = call;
-	err = ua_connect(ua_out, &sess->call_out, call_peeruri(call),
-			 call_localuri(call), NULL,
-			 call_has_video(call) ? VIDMODE_ON : VIDMODE_OFF);
+	/* both legs on the event loop of the incoming media, to relay */
+	err = ua_connect_pinned(ua_out, &call_out, call_peeruri(call),
+				call_localuri(call), NULL,
+				call_has_video(call) ? VIDMODE_ON : VIDMODE_OFF,
+				call);
 	if (err) {
 		warning("b2bua: ua_connect failed (%m)\n", err);
 		goto out;
 	}
 
+	leg_index(sess, &sess->in, call);
+	leg_index(sess, &sess->out, call_out);
+	leg_index_callid(&sess->in);
+	leg_index_callid(&sess->out);
+
 	re_snprintf(a, sizeof(a), "A-%x", sess);
 	re_snprintf(b, sizeof(b), "B-%x", sess);
 
 	/* connect the audio/video-bridge devices */
-	audio_set_devicename(call_audio(sess->call_in), a, b);
-	audio_set_devicename(call_audio(sess->call_out), b, a);
-	video_set_devicename(call_video(sess->call_in), a, b);
-	video_set_devicename(call_video(sess->call_out), b, a);
-
-	call_set_handlers(sess->call_in, call_event_handler,
+	audio_set_devicename(call_audio(call), a, b);
+	audio_set_devicename(call_audio(call_out), b, a);
+	video_set_devicename(call_video(call), a, b);
+	video_set_devicename(call_video(call_out), b, a);
+
+	/* both legs are handled by the same audio worker */
+	if (!++affinity)
+		++affinity;
+	sess->affinity = affinity;
+	audio_set_affinity(call_audio(call), sess->affinity);
+	audio_set_affinity(call_audio(call_out), sess->affinity);
+
+	call_set_handlers(call, call_event_handler,
 			  call_dtmf_handler, sess);
-	call_set_handlers(sess->call_out, call_event_handler,
+	call_set_handlers(call_out, call_event_handler,
 			  call_dtmf_handler, sess);
 
 	list_append(&sessionl, &sess->le, sess);
@@ -136,6 +273,7 @@ static int new_session(struct call *call)
 static void ua_event_handler(struct ua *ua, enum ua_event ev,
 			     struct call *call, const char *prm, void *arg)
 {
+	struct leg *leg;
 	int err;
 	(void)prm;
 	(void)arg;
@@ -152,42 +290,75 @@ static void ua_event_handler(struct ua *ua, enum ua_event ev,
 		}
 		break;
 
+	case UA_EVENT_CALL_CLOSED:
+		/* hangup of one leg from outside the module, e.g. a
+		 * command. The UA releases its reference afterwards */
+		leg = leg_find(call);
+		if (leg) {
+			mem_ref(call);
+			session_close(leg->sess, call);
+		}
+		break;
+
 	default:
 		break;
 	}
 }
 
 
+static int session_print(struct re_printf *pf, const struct session *sess)
+{
+	int err;
+
+	err  = re_hprintf(pf, "%-42s  --->  %42s\n",
+			  call_peeruri(sess->in.call),
+			  call_peeruri(sess->out.call));
+
+	err |= re_hprintf(pf, " Call-ID: %s / %s\n",
+			  call_id(sess->in.call), call_id(sess->out.call));
+	err |= re_hprintf(pf, " relayed streams: %u, worker affinity: %u\n",
+			  sess->n_relay, sess->affinity);
+
+	err |= re_hprintf(pf, " %H\n", call_status, sess->in.call);
+	err |= re_hprintf(pf, " %H\n", call_status, sess->out.call);
+
+	return err;
+}
+
+
 static int b2bua_status(struct re_printf *pf, void *arg)
 {
+	const struct cmd_arg *carg = arg;
 	struct le *le;
 	int err = 0;
-	(void)arg;
 
-	err |= re_hprintf(pf, "B2BUA status:\n");
-	err |= re_hprintf(pf, "  inbound:  %s\n", ua_aor(ua_in));
-	err |= re_hprintf(pf, "  outbound: %s\n", ua_aor(ua_out));
+	/* one session, by the Call-ID of either leg */
+	if (carg && str_isset(carg->prm)) {
 
-	err |= re_hprintf(pf, "sessions:\n");
+		struct leg *leg = leg_find_callid(carg->prm);
 
-	for (le = sessionl.head; le; le = le->next) {
+		if (!leg)
+			return re_hprintf(pf, "b2bua: no session with"
+					  " Call-ID %s\n", carg->prm);
 
-		struct session *sess = le->data;
+		return session_print(pf, leg->sess);
+	}
 
-		err |= re_hprintf(pf, "%-42s  --->  %42s\n",
-				  call_peeruri(sess->call_in),
-				  call_peeruri(sess->call_out));
+	err |= re_hprintf(pf, "B2BUA status:\n");
+	err |= re_hprintf(pf, "  inbound:  %s\n", ua_aor(ua_in));
+	err |= re_hprintf(pf, "  outbound: %s\n", ua_aor(ua_out));
 
-		err |= re_hprintf(pf, " %H\n", call_status, sess->call_in);
-		err |= re_hprintf(pf, " %H\n", call_status, sess->call_out);
-	}
+	err |= re_hprintf(pf, "sessions: %u\n", list_count(&sessionl));
+
+	for (le = sessionl.head; le; le = le->next)
+		err |= session_print(pf, le->data);
 
 	return err;
 }
 
 
 static const struct cmd cmdv[] = {
-	{"b2bua", 0,       0, "b2bua status", b2bua_status },
+	{"b2bua", 0, CMD_PRM, "b2bua status [Call-ID]", b2bua_status },
 };
 
 
@@ -207,11 +378,19 @@ static int module_init(void)
 		return ENOENT;
 	}
 
+	err  = hash_alloc(&ht_call, SESSION_HASH_SIZE);
+	err |= hash_alloc(&ht_callid, SESSION_HASH_SIZE);
+	if (err)
+		return err;
+
 	err = cmd_register(baresip_commands(), cmdv, ARRAY_SIZE(cmdv));
 	if (err)
 		return err;
 
-	err = uag_event_register(ua_event_handler, 0);
+	err = uag_event_register_mask(ua_event_handler,
+				      UA_EVENT_BIT(UA_EVENT_CALL_INCOMING) |
+				      UA_EVENT_BIT(UA_EVENT_CALL_CLOSED),
+				      NULL, NULL);
 	if (err)
 		return err;
 
@@ -234,6 +413,9 @@ static int module_close(void)
 	uag_event_unregister(ua_event_handler);
 	cmd_unregister(baresip_commands(), cmdv);
 
+	ht_callid = mem_deref(ht_callid);
+	ht_call   = mem_deref(ht_call);
+
 	return 0;
 }
 
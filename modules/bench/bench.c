@@ -0,0 +1,572 @@
+/**
+ * @file bench.c  Call load generator and benchmark
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <stdlib.h>
+#ifndef WIN32
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "bench.h"
+
+
+/**
+ * @defgroup bench bench
+ *
+ * Call load generator and benchmark
+ *
+ * Calls are placed from the current User-Agent at a fixed rate, up to a
+ * number of concurrent calls, and each call is hung up after a fixed
+ * holding time. The report has the call setup latency percentiles, the
+ * CPU time used per call and the RTP loss of both directions.
+ *
+ * The module also has a tone audio source and an audio player that
+ * discards the audio, so that no sound devices are needed. Use the
+ * fakevideo module for video. Load the module at the far end too, with
+ * answermode auto, to get the report of the other side.
+ *
+ * Example config:
+ *
+ \verbatim
+  audio_player            bench,nil
+  audio_source            bench,1000   # tone frequency [Hz]
+  video_source            fakevideo,nil
+  video_display           fakevideo,nil
+
+  bench_cps               10           # Calls per second
+  bench_concurrency       100          # Maximum concurrent calls
+  bench_calls             1000         # Number of calls, 0 is no limit
+  bench_duration          30           # Call holding time [s]
+  bench_video             no
+ \endverbatim
+ *
+ * Commands:
+ *
+ \verbatim
+ bench_start <uri>    Start placing calls to uri
+ bench_stop           Stop placing calls and hangup all calls
+ bench                Show the benchmark report
+ \endverbatim
+ */
+
+
+/** One call that is part of the benchmark */
+struct bcall {
+	struct le le;
+	struct call *call;        /* pointer only, owned by the UA */
+	struct tmr tmr;           /* holding time */
+	uint64_t ts_start;
+	uint64_t ts_estab;
+	bool outgoing;
+};
+
+/** Latency samples in [ms] */
+struct samples {
+	uint32_t *v;
+	size_t n;
+	size_t max;
+};
+
+static struct {
+	uint32_t cps;
+	uint32_t concurrency;
+	uint32_t calls;
+	uint32_t duration;
+	bool video;
+} cfg = {10, 100, 0, 30, false};
+
+static struct {
+	struct list calll;
+	struct tmr tmr;
+	char *uri;
+	bool running;
+	uint64_t ts_start;
+	uint64_t ts_stop;
+	uint64_t cpu_start;       /* [us] */
+	uint64_t cpu_stop;        /* [us] */
+	uint32_t n_slot;          /* call slots at the configured rate */
+	uint32_t n_attempt;
+	uint32_t n_placed;
+	uint32_t n_estab;
+	uint32_t n_failed;
+	uint32_t n_incoming;
+	uint64_t call_ms;         /* established time of closed calls */
+	struct samples setup;     /* INVITE to established */
+	struct samples media;     /* INVITE to first RTP packet */
+	uint64_t rx_packets;
+	uint64_t rx_lost;
+	uint64_t tx_packets;
+	uint64_t tx_lost;         /* as reported by the peer */
+	uint32_t jitter_max;      /* [us] */
+} bench;
+
+
+static uint64_t cpu_time(void)
+{
+#ifndef WIN32
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+		+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#else
+	return 0;
+#endif
+}
+
+
+static void samples_add(struct samples *s, uint32_t val)
+{
+	if (s->n >= s->max) {
+
+		size_t max = s->max ? s->max * 2 : 256;
+		uint32_t *v;
+
+		v = mem_realloc(s->v, max * sizeof(*v));
+		if (!v)
+			return;
+
+		s->v   = v;
+		s->max = max;
+	}
+
+	s->v[s->n++] = val;
+}
+
+
+static int samples_cmp(const void *a, const void *b)
+{
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+/* Nearest rank, the samples must be sorted */
+static uint32_t percentile(const struct samples *s, unsigned p)
+{
+	size_t rank;
+
+	if (!s->n)
+		return 0;
+
+	rank = (s->n * p + 99) / 100;
+
+	return s->v[rank ? rank - 1 : 0];
+}
+
+
+static int samples_print(struct re_printf *pf, struct samples *s)
+{
+	if (!s->n)
+		return re_hprintf(pf, "n=0");
+
+	qsort(s->v, s->n, sizeof(*s->v), samples_cmp);
+
+	return re_hprintf(pf, "n=%zu p50=%u p90=%u p99=%u max=%u",
+			  s->n, percentile(s, 50), percentile(s, 90),
+			  percentile(s, 99), s->v[s->n - 1]);
+}
+
+
+static void bcall_destructor(void *arg)
+{
+	struct bcall *bc = arg;
+
+	tmr_cancel(&bc->tmr);
+	list_unlink(&bc->le);
+}
+
+
+static struct bcall *bcall_find(const struct call *call)
+{
+	struct le *le;
+
+	for (le = bench.calll.head; le; le = le->next) {
+
+		struct bcall *bc = le->data;
+
+		if (bc->call == call)
+			return bc;
+	}
+
+	return NULL;
+}
+
+
+static struct bcall *bcall_add(struct call *call, bool outgoing)
+{
+	struct bcall *bc;
+
+	bc = mem_zalloc(sizeof(*bc), bcall_destructor);
+	if (!bc)
+		return NULL;
+
+	bc->call     = call;
+	bc->outgoing = outgoing;
+	bc->ts_start = tmr_jiffies();
+
+	list_append(&bench.calll, &bc->le, bc);
+
+	return bc;
+}
+
+
+static void collect_stats(const struct call *call)
+{
+	struct le *le;
+
+	for (le = list_head(call_streaml(call)); le; le = le->next) {
+
+		struct stream_stats st;
+
+		if (stream_stats(le->data, &st))
+			continue;
+
+		bench.rx_packets += st.rx.packets;
+		bench.tx_packets += st.tx.packets;
+		bench.rx_lost    += max(st.rx.lost, 0);
+		bench.tx_lost    += max(st.tx.lost, 0);
+		bench.jitter_max  = max(bench.jitter_max, st.rx.jitter);
+	}
+}
+
+
+static void finish(void)
+{
+	bench.running  = false;
+	bench.ts_stop  = tmr_jiffies();
+	bench.cpu_stop = cpu_time();
+
+	tmr_cancel(&bench.tmr);
+}
+
+
+static void hangup_handler(void *arg)
+{
+	struct bcall *bc = arg;
+
+	/* the CALL_CLOSED event frees bc */
+	ua_hangup(call_get_ua(bc->call), bc->call, 0, NULL);
+}
+
+
+static void place_handler(void *arg)
+{
+	const uint64_t now = tmr_jiffies();
+	struct call *call = NULL;
+	uint64_t next;
+	int err;
+	(void)arg;
+
+	if (list_count(&bench.calll) < cfg.concurrency) {
+
+		++bench.n_attempt;
+
+		err = ua_connect(uag_current(), &call, NULL, bench.uri, NULL,
+				 cfg.video ? VIDMODE_ON : VIDMODE_OFF);
+		if (err || !bcall_add(call, true)) {
+			warning("bench: call to %s failed (%m)\n",
+				bench.uri, err);
+			++bench.n_failed;
+		}
+		else {
+			++bench.n_placed;
+		}
+	}
+
+	if (cfg.calls && bench.n_attempt >= cfg.calls) {
+
+		/* the last call to close finishes the benchmark */
+		bench.running = false;
+		if (list_isempty(&bench.calll))
+			finish();
+		return;
+	}
+
+	/* keep the rate, also if the main loop was late. A slot is lost
+	 * if all the calls are busy */
+	++bench.n_slot;
+	next = bench.ts_start + (uint64_t)bench.n_slot * 1000 / cfg.cps;
+
+	tmr_start(&bench.tmr, next > now ? next - now : 0,
+		  place_handler, NULL);
+}
+
+
+static void ua_event_handler(struct ua *ua, enum ua_event ev,
+			     struct call *call, const char *prm, void *arg)
+{
+	struct bcall *bc;
+	(void)ua;
+	(void)prm;
+	(void)arg;
+
+	if (!call)
+		return;
+
+	bc = bcall_find(call);
+
+	switch (ev) {
+
+	case UA_EVENT_CALL_ESTABLISHED:
+		if (!bc) {
+			bc = bcall_add(call, false);
+			if (!bc)
+				break;
+			++bench.n_incoming;
+		}
+
+		bc->ts_estab = tmr_jiffies();
+		++bench.n_estab;
+
+		if (bc->outgoing) {
+			samples_add(&bench.setup,
+				    (uint32_t)(bc->ts_estab - bc->ts_start));
+
+			tmr_start(&bc->tmr, cfg.duration * 1000,
+				  hangup_handler, bc);
+		}
+		break;
+
+	case UA_EVENT_CALL_SETUP:
+		if (bc && bc->outgoing && bc->ts_estab &&
+		    call_phase_duration(call, CALL_PHASE_MEDIA) >= 0) {
+
+			uint32_t ms = (uint32_t)(bc->ts_estab - bc->ts_start);
+
+			ms += call_phase_duration(call, CALL_PHASE_MEDIA);
+
+			samples_add(&bench.media, ms);
+		}
+		break;
+
+	case UA_EVENT_CALL_CLOSED:
+		if (!bc)
+			break;
+
+		if (bc->ts_estab) {
+			bench.call_ms += tmr_jiffies() - bc->ts_estab;
+			collect_stats(call);
+		}
+		else if (bc->outgoing) {
+			++bench.n_failed;
+		}
+
+		mem_deref(bc);
+
+		if (!bench.running && bench.ts_start && !bench.ts_stop &&
+		    list_isempty(&bench.calll))
+			finish();
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+static void reset(void)
+{
+	bench.ts_start   = tmr_jiffies();
+	bench.ts_stop    = 0;
+	bench.cpu_start  = cpu_time();
+	bench.cpu_stop   = 0;
+	bench.n_slot     = 0;
+	bench.n_attempt  = 0;
+	bench.n_placed   = 0;
+	bench.n_estab    = 0;
+	bench.n_failed   = 0;
+	bench.n_incoming = 0;
+	bench.call_ms    = 0;
+	bench.setup.n    = 0;
+	bench.media.n    = 0;
+	bench.rx_packets = 0;
+	bench.rx_lost    = 0;
+	bench.tx_packets = 0;
+	bench.tx_lost    = 0;
+	bench.jitter_max = 0;
+}
+
+
+static int cmd_start(struct re_printf *pf, void *arg)
+{
+	const struct cmd_arg *carg = arg;
+	int err;
+
+	if (!str_isset(carg->prm))
+		return re_hprintf(pf, "usage: /bench_start <uri>\n");
+
+	if (bench.running)
+		return re_hprintf(pf, "bench: already running\n");
+
+	if (!uag_current())
+		return re_hprintf(pf, "bench: no User-Agent\n");
+
+	bench.uri = mem_deref(bench.uri);
+	err = str_dup(&bench.uri, carg->prm);
+	if (err)
+		return err;
+
+	reset();
+	bench.running = true;
+
+	tmr_start(&bench.tmr, 0, place_handler, NULL);
+
+	return re_hprintf(pf, "bench: calling %s, %u calls/s,"
+			  " %u concurrent, %u s per call\n",
+			  bench.uri, cfg.cps, cfg.concurrency, cfg.duration);
+}
+
+
+static int cmd_stop(struct re_printf *pf, void *arg)
+{
+	struct le *le;
+	(void)arg;
+
+	bench.running = false;
+	tmr_cancel(&bench.tmr);
+
+	le = bench.calll.head;
+	while (le) {
+
+		struct bcall *bc = le->data;
+
+		le = le->next;
+
+		if (bc->outgoing)
+			hangup_handler(bc);
+	}
+
+	if (bench.ts_start && !bench.ts_stop && list_isempty(&bench.calll))
+		finish();
+
+	return re_hprintf(pf, "bench: stopped\n");
+}
+
+
+static int cmd_report(struct re_printf *pf, void *arg)
+{
+	const uint64_t now = tmr_jiffies();
+	uint64_t wall, cpu, call_ms = bench.call_ms;
+	struct le *le;
+	int err = 0;
+	(void)arg;
+
+	if (bench.ts_start) {
+		wall = (bench.ts_stop ? bench.ts_stop : now) - bench.ts_start;
+		cpu  = (bench.cpu_stop ? bench.cpu_stop : cpu_time())
+			- bench.cpu_start;
+	}
+	else {
+		wall = 0;
+		cpu  = 0;
+	}
+
+	for (le = bench.calll.head; le; le = le->next) {
+
+		const struct bcall *bc = le->data;
+
+		if (bc->ts_estab)
+			call_ms += now - bc->ts_estab;
+	}
+
+	err |= re_hprintf(pf, "bench: %s %s, %llu.%03llu s\n",
+			  bench.running ? "running" : "stopped",
+			  bench.uri ? bench.uri : "-",
+			  wall / 1000, wall % 1000);
+
+	err |= re_hprintf(pf, " calls:  placed=%u incoming=%u established=%u"
+			  " failed=%u active=%u\n",
+			  bench.n_placed, bench.n_incoming, bench.n_estab,
+			  bench.n_failed, list_count(&bench.calll));
+
+	err |= re_hprintf(pf, " setup:  %H [ms]\n",
+			  samples_print, &bench.setup);
+	err |= re_hprintf(pf, " media:  %H [ms]\n",
+			  samples_print, &bench.media);
+
+	err |= re_hprintf(pf, " cpu:    %llu ms", cpu / 1000);
+	if (bench.n_estab) {
+		err |= re_hprintf(pf, ", %llu ms per call",
+				  cpu / 1000 / bench.n_estab);
+	}
+	if (call_ms) {
+		err |= re_hprintf(pf, ", %.2f%% of a core per call",
+				  100.0 * (double)cpu / 1000 / call_ms);
+	}
+	err |= re_hprintf(pf, "\n");
+
+	err |= re_hprintf(pf, " rtp rx: packets=%llu lost=%llu"
+			  " max jitter=%u us\n",
+			  bench.rx_packets, bench.rx_lost, bench.jitter_max);
+	err |= re_hprintf(pf, " rtp tx: packets=%llu lost at peer=%llu\n",
+			  bench.tx_packets, bench.tx_lost);
+
+	return err;
+}
+
+
+static const struct cmd cmdv[] = {
+	{"bench_start", 0, CMD_PRM, "Start call benchmark", cmd_start  },
+	{"bench_stop",  0, 0,       "Stop call benchmark",  cmd_stop   },
+	{"bench",       0, 0,       "Call benchmark report", cmd_report },
+};
+
+
+static int module_init(void)
+{
+	int err;
+
+	(void)conf_get_u32(conf_cur(), "bench_cps", &cfg.cps);
+	(void)conf_get_u32(conf_cur(), "bench_concurrency", &cfg.concurrency);
+	(void)conf_get_u32(conf_cur(), "bench_calls", &cfg.calls);
+	(void)conf_get_u32(conf_cur(), "bench_duration", &cfg.duration);
+	(void)conf_get_bool(conf_cur(), "bench_video", &cfg.video);
+
+	cfg.cps = min(max(cfg.cps, 1), 1000);
+
+	err = bench_media_init();
+	if (err)
+		return err;
+
+	err = uag_event_register(ua_event_handler, NULL);
+	if (err)
+		return err;
+
+	return cmd_register(baresip_commands(), cmdv, ARRAY_SIZE(cmdv));
+}
+
+
+static int module_close(void)
+{
+	cmd_unregister(baresip_commands(), cmdv);
+	uag_event_unregister(ua_event_handler);
+
+	tmr_cancel(&bench.tmr);
+	list_flush(&bench.calll);
+
+	bench.uri       = mem_deref(bench.uri);
+	bench.setup.v   = mem_deref(bench.setup.v);
+	bench.media.v   = mem_deref(bench.media.v);
+	bench.setup.max = 0;
+	bench.media.max = 0;
+
+	bench_media_close();
+
+	return 0;
+}
+
+
+EXPORT_SYM const struct mod_export DECL_EXPORTS(bench) = {
+	"bench",
+	"application",
+	module_init,
+	module_close,
+};
@@ -0,0 +1,9 @@
+/**
+ * @file bench.h  Call benchmark -- internal interface
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+int  bench_media_init(void);
+void bench_media_close(void);
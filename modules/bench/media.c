@@ -0,0 +1,243 @@
+/**
+ * @file bench/media.c  Call benchmark -- synthetic audio source and player
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <math.h>
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "bench.h"
+
+
+#if !defined (M_PI)
+#define M_PI 3.14159265358979323846264338327
+#endif
+
+
+/*
+ * The source sends a sine tone and the player discards what it gets.
+ * Both are paced by a timer in the main thread instead of a thread per
+ * device, so that a few hundred calls do not need a few hundred threads.
+ * The device is the tone frequency in Hz for the source, and is ignored
+ * by the player.
+ */
+
+
+enum {
+	TONE_FREQ  = 1000,       /**< Default tone frequency [Hz]      */
+	TONE_LEVEL = 8192,       /**< Tone amplitude, about -12 dBFS   */
+	TABLE_BITS = 10,         /**< Sine table has 2^n entries       */
+};
+
+struct ausrc_st {
+	const struct ausrc *as;  /* inheritance */
+	struct tmr tmr;
+	uint64_t ts;
+	int16_t *sampv;
+	size_t sampc;
+	uint32_t ptime;
+	uint32_t phase;
+	uint32_t step;
+	uint8_t ch;
+	ausrc_read_h *rh;
+	void *arg;
+};
+
+struct auplay_st {
+	const struct auplay *ap;  /* inheritance */
+	struct tmr tmr;
+	uint64_t ts;
+	int16_t *sampv;
+	size_t sampc;
+	uint32_t ptime;
+	auplay_write_h *wh;
+	void *arg;
+};
+
+
+static struct ausrc *ausrc;
+static struct auplay *auplay;
+static int16_t sinev[1 << TABLE_BITS];
+
+
+static void src_destructor(void *arg)
+{
+	struct ausrc_st *st = arg;
+
+	tmr_cancel(&st->tmr);
+	mem_deref(st->sampv);
+}
+
+
+static void play_destructor(void *arg)
+{
+	struct auplay_st *st = arg;
+
+	tmr_cancel(&st->tmr);
+	mem_deref(st->sampv);
+}
+
+
+static void src_tmr_handler(void *arg)
+{
+	struct ausrc_st *st = arg;
+	const uint64_t now = tmr_jiffies();
+
+	/* catch up if the main loop was late */
+	while (st->ts <= now) {
+
+		size_t i, frames = st->sampc / st->ch;
+		uint8_t c;
+
+		for (i=0; i<frames; i++) {
+
+			int16_t s = sinev[st->phase >> (32 - TABLE_BITS)];
+
+			for (c=0; c<st->ch; c++)
+				st->sampv[i*st->ch + c] = s;
+
+			st->phase += st->step;
+		}
+
+		st->rh(st->sampv, st->sampc, st->arg);
+
+		st->ts += st->ptime;
+	}
+
+	tmr_start(&st->tmr, st->ts - now, src_tmr_handler, st);
+}
+
+
+static void play_tmr_handler(void *arg)
+{
+	struct auplay_st *st = arg;
+	const uint64_t now = tmr_jiffies();
+
+	while (st->ts <= now) {
+
+		st->wh(st->sampv, st->sampc, st->arg);
+
+		st->ts += st->ptime;
+	}
+
+	tmr_start(&st->tmr, st->ts - now, play_tmr_handler, st);
+}
+
+
+static int src_alloc(struct ausrc_st **stp, const struct ausrc *as,
+		     struct media_ctx **ctx,
+		     struct ausrc_prm *prm, const char *device,
+		     ausrc_read_h *rh, ausrc_error_h *errh, void *arg)
+{
+	struct ausrc_st *st;
+	uint32_t freq = TONE_FREQ;
+	struct pl pl;
+	(void)ctx;
+	(void)errh;
+
+	if (!stp || !as || !prm || !rh)
+		return EINVAL;
+
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
+	if (!prm->srate || !prm->ch || !prm->ptime)
+		return EINVAL;
+
+	if (str_isset(device)) {
+		pl_set_str(&pl, device);
+		if (pl_u32(&pl))
+			freq = pl_u32(&pl);
+	}
+
+	st = mem_zalloc(sizeof(*st), src_destructor);
+	if (!st)
+		return ENOMEM;
+
+	st->as    = as;
+	st->rh    = rh;
+	st->arg   = arg;
+	st->ch    = prm->ch;
+	st->ptime = prm->ptime;
+	st->sampc = prm->srate * prm->ch * prm->ptime / 1000;
+	st->step  = (uint32_t)(((uint64_t)freq << 32) / prm->srate);
+
+	st->sampv = mem_alloc(st->sampc * sizeof(int16_t), NULL);
+	if (!st->sampv) {
+		mem_deref(st);
+		return ENOMEM;
+	}
+
+	st->ts = tmr_jiffies() + st->ptime;
+	tmr_start(&st->tmr, st->ptime, src_tmr_handler, st);
+
+	*stp = st;
+
+	return 0;
+}
+
+
+static int play_alloc(struct auplay_st **stp, const struct auplay *ap,
+		      struct auplay_prm *prm, const char *device,
+		      auplay_write_h *wh, void *arg)
+{
+	struct auplay_st *st;
+	(void)device;
+
+	if (!stp || !ap || !prm || !wh)
+		return EINVAL;
+
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
+	if (!prm->srate || !prm->ch || !prm->ptime)
+		return EINVAL;
+
+	st = mem_zalloc(sizeof(*st), play_destructor);
+	if (!st)
+		return ENOMEM;
+
+	st->ap    = ap;
+	st->wh    = wh;
+	st->arg   = arg;
+	st->ptime = prm->ptime;
+	st->sampc = prm->srate * prm->ch * prm->ptime / 1000;
+
+	st->sampv = mem_alloc(st->sampc * sizeof(int16_t), NULL);
+	if (!st->sampv) {
+		mem_deref(st);
+		return ENOMEM;
+	}
+
+	st->ts = tmr_jiffies() + st->ptime;
+	tmr_start(&st->tmr, st->ptime, play_tmr_handler, st);
+
+	*stp = st;
+
+	return 0;
+}
+
+
+int bench_media_init(void)
+{
+	size_t i;
+	int err;
+
+	for (i=0; i<ARRAY_SIZE(sinev); i++) {
+		sinev[i] = (int16_t)(TONE_LEVEL *
+				     sin(2 * M_PI * i / ARRAY_SIZE(sinev)));
+	}
+
+	err  = ausrc_register(&ausrc, "bench", src_alloc);
+	err |= auplay_register(&auplay, "bench", play_alloc);
+
+	return err;
+}
+
+
+void bench_media_close(void)
+{
+	ausrc  = mem_deref(ausrc);
+	auplay = mem_deref(auplay);
+}
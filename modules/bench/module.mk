@@ -0,0 +1,12 @@
+#
+# module.mk
+#
+# Copyright (C) 2010 Creytiv.com
+#
+
+MOD		:= bench
+$(MOD)_SRCS	+= bench.c
+$(MOD)_SRCS	+= media.c
+$(MOD)_LFLAGS	+= -lm
+
+include mk/mod.mk
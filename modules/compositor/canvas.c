@@ -0,0 +1,365 @@
+/**
+ * @file compositor/canvas.c Video compositor -- canvas
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "compositor.h"
+
+
+/*
+ * Tiles are drawn into the canvas by the thread that decodes their
+ * call, and the canvas is output from a timer in the main thread. The
+ * lock protects the canvas picture and the tile rectangles. The output
+ * picture is copied under the lock, so the encoders and the local
+ * display run without holding it.
+ */
+
+
+struct canvas {
+	struct le le;
+	char *name;
+	struct lock *lock;
+	struct vidframe *frame;       /* tiles are drawn here */
+	struct vidframe *out;         /* copy that is output */
+	struct list tilel;
+	struct list srcl;
+	struct vidisp_st *disp;       /* optional local display */
+	struct tmr tmr;
+	bool dirty;                   /* a tile changed since the output */
+	enum layout layout;
+	unsigned focus;               /* active speaker tile */
+	uint64_t n_draw;
+	uint64_t n_out;
+};
+
+
+static void destructor(void *arg)
+{
+	struct canvas *cv = arg;
+
+	tmr_cancel(&cv->tmr);
+	list_unlink(&cv->le);
+	mem_deref(cv->disp);
+	mem_deref(cv->frame);
+	mem_deref(cv->out);
+	mem_deref(cv->lock);
+	mem_deref(cv->name);
+}
+
+
+static void clear(struct vidframe *frame)
+{
+	vidframe_fill(frame, 0, 0, 0);
+}
+
+
+static void layout_grid(struct canvas *cv, unsigned n)
+{
+	const struct vidsz *sz = &cv->frame->size;
+	unsigned cols = 1, rows, i = 0;
+	struct le *le;
+
+	while (cols * cols < n)
+		++cols;
+
+	rows = (n + cols - 1) / cols;
+
+	for (le = cv->tilel.head; le; le = le->next, i++) {
+
+		struct vidisp_st *tile = le->data;
+
+		tile->rect.w = sz->w / cols;
+		tile->rect.h = sz->h / rows;
+		tile->rect.x = (i % cols) * tile->rect.w;
+		tile->rect.y = (i / cols) * tile->rect.h;
+	}
+}
+
+
+/* The active speaker takes the top three quarters, the others share
+ * a strip along the bottom */
+static void layout_speaker(struct canvas *cv, unsigned n)
+{
+	const struct vidsz *sz = &cv->frame->size;
+	const unsigned strip = n > 1 ? sz->h / 4 : 0;
+	unsigned focus = cv->focus < n ? cv->focus : 0;
+	unsigned i = 0, j = 0;
+	struct le *le;
+
+	for (le = cv->tilel.head; le; le = le->next, i++) {
+
+		struct vidisp_st *tile = le->data;
+
+		if (i == focus) {
+			tile->rect.x = 0;
+			tile->rect.y = 0;
+			tile->rect.w = sz->w;
+			tile->rect.h = sz->h - strip;
+			continue;
+		}
+
+		tile->rect.w = sz->w / (n - 1);
+		tile->rect.h = strip;
+		tile->rect.x = j++ * tile->rect.w;
+		tile->rect.y = sz->h - strip;
+	}
+}
+
+
+/* Lock must be held */
+static void layout_update(struct canvas *cv)
+{
+	unsigned n = list_count(&cv->tilel);
+
+	clear(cv->frame);
+	cv->dirty = true;
+
+	if (!n)
+		return;
+
+	if (cv->layout == LAYOUT_SPEAKER)
+		layout_speaker(cv, n);
+	else
+		layout_grid(cv, n);
+}
+
+
+static void tmr_handler(void *arg)
+{
+	struct canvas *cv = arg;
+	struct le *le;
+	bool dirty;
+
+	tmr_start(&cv->tmr, 1000 / compositor_cfg.fps, tmr_handler, cv);
+
+	lock_write_get(cv->lock);
+	dirty = cv->dirty;
+	if (dirty) {
+		vidframe_copy(cv->out, cv->frame);
+		cv->dirty = false;
+	}
+	lock_rel(cv->lock);
+
+	if (!dirty)
+		return;
+
+	++cv->n_out;
+
+	for (le = cv->srcl.head; le; le = le->next) {
+
+		struct vidsrc_st *src = le->data;
+
+		if (src->frameh)
+			src->frameh(cv->out, src->arg);
+	}
+
+	if (cv->disp && vidisp_display(cv->disp, cv->name, cv->out)) {
+		warning("compositor: %s: local display closed\n", cv->name);
+		cv->disp = mem_deref(cv->disp);
+	}
+}
+
+
+static bool canvas_cmp(struct le *le, void *arg)
+{
+	struct canvas *cv = le->data;
+
+	return 0 == str_cmp(cv->name, arg);
+}
+
+
+/**
+ * Get the canvas with the given name, or create it
+ *
+ * @param cvp  Pointer to referenced canvas
+ * @param name Canvas name, from the device of the display or source
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int canvas_get(struct canvas **cvp, const char *name)
+{
+	const struct compositor_cfg *cfg = &compositor_cfg;
+	struct canvas *cv;
+	int err;
+
+	if (!cvp || !str_isset(name))
+		return EINVAL;
+
+	cv = list_ledata(hash_lookup(ht_canvas, hash_joaat_str(name),
+				     canvas_cmp, (void *)name));
+	if (cv) {
+		*cvp = mem_ref(cv);
+		return 0;
+	}
+
+	cv = mem_zalloc(sizeof(*cv), destructor);
+	if (!cv)
+		return ENOMEM;
+
+	cv->layout = cfg->layout;
+
+	err  = str_dup(&cv->name, name);
+	err |= lock_alloc(&cv->lock);
+	err |= vidframe_alloc(&cv->frame, VID_FMT_YUV420P, &cfg->size);
+	err |= vidframe_alloc(&cv->out, VID_FMT_YUV420P, &cfg->size);
+	if (err)
+		goto out;
+
+	clear(cv->frame);
+
+	if (str_isset(cfg->disp_mod)) {
+
+		err = vidisp_alloc(&cv->disp, cfg->disp_mod, NULL,
+				   cfg->disp_dev, NULL, NULL);
+		if (err) {
+			warning("compositor: %s: local display %s failed"
+				" (%m)\n", name, cfg->disp_mod, err);
+			err = 0;
+		}
+	}
+
+	hash_append(ht_canvas, hash_joaat_str(name), &cv->le, cv);
+	tmr_start(&cv->tmr, 1000 / cfg->fps, tmr_handler, cv);
+
+	info("compositor: canvas %s %u x %u\n", name,
+	     cfg->size.w, cfg->size.h);
+
+ out:
+	if (err)
+		mem_deref(cv);
+	else
+		*cvp = cv;
+
+	return err;
+}
+
+
+void canvas_tile_add(struct canvas *cv, struct vidisp_st *tile)
+{
+	if (!cv || !tile)
+		return;
+
+	lock_write_get(cv->lock);
+	list_append(&cv->tilel, &tile->le, tile);
+	layout_update(cv);
+	lock_rel(cv->lock);
+}
+
+
+void canvas_tile_remove(struct canvas *cv, struct vidisp_st *tile)
+{
+	if (!cv || !tile)
+		return;
+
+	lock_write_get(cv->lock);
+	list_unlink(&tile->le);
+	layout_update(cv);
+	lock_rel(cv->lock);
+}
+
+
+void canvas_src_add(struct canvas *cv, struct vidsrc_st *src)
+{
+	if (!cv || !src)
+		return;
+
+	list_append(&cv->srcl, &src->le, src);
+}
+
+
+void canvas_src_remove(struct canvas *cv, struct vidsrc_st *src)
+{
+	if (!cv || !src)
+		return;
+
+	list_unlink(&src->le);
+}
+
+
+/**
+ * Draw a decoded frame into its tile
+ *
+ * @param cv    Canvas
+ * @param tile  Tile of the call
+ * @param frame Decoded frame
+ *
+ * @note This function has REAL-TIME properties
+ */
+void canvas_draw(struct canvas *cv, struct vidisp_st *tile,
+		 const struct vidframe *frame)
+{
+	if (!cv || !tile || !frame)
+		return;
+
+	lock_write_get(cv->lock);
+
+	if (tile->rect.w && tile->rect.h &&
+	    vidframe_scale(cv->frame, &tile->rect, frame))
+		vidconv(cv->frame, frame, &tile->rect);
+
+	cv->dirty = true;
+	++cv->n_draw;
+
+	lock_rel(cv->lock);
+}
+
+
+static bool layout_handler(struct le *le, void *arg)
+{
+	const struct canvas *tmpl = arg;
+	struct canvas *cv = le->data;
+
+	lock_write_get(cv->lock);
+	cv->layout = tmpl->layout;
+	cv->focus  = tmpl->focus;
+	layout_update(cv);
+	lock_rel(cv->lock);
+
+	return false;
+}
+
+
+/**
+ * Set the layout of all canvases
+ *
+ * @param layout Layout
+ * @param focus  Index of the active speaker tile
+ */
+void canvas_set_layout(enum layout layout, unsigned focus)
+{
+	struct canvas tmpl;
+
+	tmpl.layout = layout;
+	tmpl.focus  = focus;
+
+	(void)hash_apply(ht_canvas, layout_handler, &tmpl);
+}
+
+
+static bool debug_handler(struct le *le, void *arg)
+{
+	const struct canvas *cv = le->data;
+	struct re_printf *pf = arg;
+
+	(void)re_hprintf(pf, "%s: %s layout, tiles=%u sources=%u"
+			 " drawn=%llu output=%llu\n",
+			 cv->name,
+			 cv->layout == LAYOUT_SPEAKER ? "speaker" : "grid",
+			 list_count(&cv->tilel), list_count(&cv->srcl),
+			 cv->n_draw, cv->n_out);
+
+	return false;
+}
+
+
+int canvas_debug(struct re_printf *pf, void *unused)
+{
+	(void)unused;
+
+	(void)hash_apply(ht_canvas, debug_handler, pf);
+
+	return 0;
+}
@@ -0,0 +1,173 @@
+/**
+ * @file compositor.c Video compositor
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "compositor.h"
+
+
+/**
+ * @defgroup compositor compositor
+ *
+ * Multi-party video compositor
+ *
+ * The decoded video of every call that uses the same compositor device
+ * (the "canvas") is drawn as one tile of a common picture. The picture
+ * is the video source of every call on that canvas, and it can also be
+ * shown on a local display.
+ *
+ * A tile is drawn only when its call delivers a new frame. The canvas
+ * is output at the configured frame-rate, and only if a tile changed.
+ *
+ * Sample config:
+ *
+ \verbatim
+  video_display           compositor,canvas0
+  video_source            compositor,canvas0
+ \endverbatim
+ *
+ * Config options:
+ *
+ \verbatim
+  compositor_size         1280x720
+  compositor_fps          25
+  compositor_layout       grid     # {grid,speaker}
+  compositor_display      x11,nil  # optional local display
+ \endverbatim
+ *
+ * Commands:
+ *
+ \verbatim
+ compositor_layout <grid|speaker> [tile]   Set layout and active speaker
+ compositor                                Show canvas status
+ \endverbatim
+ */
+
+
+static struct vidisp *vidisp;
+static struct vidsrc *vidsrc;
+
+struct hash *ht_canvas;
+struct compositor_cfg compositor_cfg = {
+	{1280, 720},
+	25,
+	LAYOUT_GRID,
+	"",
+	"",
+};
+
+
+static int layout_decode(enum layout *layout, const struct pl *pl)
+{
+	if (0 == pl_strcasecmp(pl, "grid"))
+		*layout = LAYOUT_GRID;
+	else if (0 == pl_strcasecmp(pl, "speaker"))
+		*layout = LAYOUT_SPEAKER;
+	else
+		return EINVAL;
+
+	return 0;
+}
+
+
+static int cmd_layout(struct re_printf *pf, void *arg)
+{
+	const struct cmd_arg *carg = arg;
+	struct pl name, focus = PL_INIT;
+	enum layout layout;
+
+	if (re_regex(carg->prm, str_len(carg->prm), "[a-z]+[ ]*[0-9]*",
+		     &name, NULL, &focus) ||
+	    layout_decode(&layout, &name)) {
+		return re_hprintf(pf, "usage: /compositor_layout"
+				  " <grid|speaker> [tile]\n");
+	}
+
+	compositor_cfg.layout = layout;
+
+	canvas_set_layout(layout, pl_u32(&focus));
+
+	return 0;
+}
+
+
+static const struct cmd cmdv[] = {
+	{"compositor_layout", 0, CMD_PRM, "Set compositor layout",
+	 cmd_layout },
+	{"compositor",        0, 0,       "Compositor status",
+	 canvas_debug },
+};
+
+
+static int module_init(void)
+{
+	struct pl pl;
+	int err;
+
+	(void)conf_get_vidsz(conf_cur(), "compositor_size",
+			     &compositor_cfg.size);
+	(void)conf_get_u32(conf_cur(), "compositor_fps", &compositor_cfg.fps);
+
+	if (0 == conf_get(conf_cur(), "compositor_display", &pl)) {
+
+		struct pl mod, dev = PL_INIT;
+
+		if (0 == re_regex(pl.p, pl.l, "[^,]+[,]*[~]*",
+				  &mod, NULL, &dev)) {
+			(void)pl_strcpy(&mod, compositor_cfg.disp_mod,
+					sizeof(compositor_cfg.disp_mod));
+			(void)pl_strcpy(&dev, compositor_cfg.disp_dev,
+					sizeof(compositor_cfg.disp_dev));
+		}
+	}
+
+	if (0 == conf_get(conf_cur(), "compositor_layout", &pl) &&
+	    layout_decode(&compositor_cfg.layout, &pl)) {
+		warning("compositor: unknown layout `%r'\n", &pl);
+	}
+
+	if (!compositor_cfg.fps)
+		compositor_cfg.fps = 25;
+
+	/* the chroma planes are subsampled by two */
+	compositor_cfg.size.w &= ~1u;
+	compositor_cfg.size.h &= ~1u;
+	if (!compositor_cfg.size.w || !compositor_cfg.size.h)
+		return EINVAL;
+
+	err = hash_alloc(&ht_canvas, 16);
+	if (err)
+		return err;
+
+	err  = vidisp_register(&vidisp, "compositor", disp_alloc,
+			       NULL, disp_display, 0);
+	err |= vidsrc_register(&vidsrc, "compositor", src_alloc, NULL);
+	if (err)
+		return err;
+
+	return cmd_register(baresip_commands(), cmdv, ARRAY_SIZE(cmdv));
+}
+
+
+static int module_close(void)
+{
+	cmd_unregister(baresip_commands(), cmdv);
+
+	vidsrc = mem_deref(vidsrc);
+	vidisp = mem_deref(vidisp);
+
+	ht_canvas = mem_deref(ht_canvas);
+
+	return 0;
+}
+
+
+EXPORT_SYM const struct mod_export DECL_EXPORTS(compositor) = {
+	"compositor",
+	"video",
+	module_init,
+	module_close,
+};
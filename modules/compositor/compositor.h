@@ -0,0 +1,64 @@
+/**
+ * @file compositor.h Video compositor -- internal interface
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+struct canvas;
+
+enum layout {
+	LAYOUT_GRID,
+	LAYOUT_SPEAKER,
+};
+
+struct vidisp_st {
+	const struct vidisp *vd;      /* inheritance (1st) */
+	struct le le;
+	struct canvas *cv;
+	struct vidrect rect;          /* tile on the canvas */
+};
+
+struct vidsrc_st {
+	const struct vidsrc *vs;      /* inheritance (1st) */
+	struct le le;
+	struct canvas *cv;
+	vidsrc_frame_h *frameh;
+	void *arg;
+};
+
+struct compositor_cfg {
+	struct vidsz size;
+	uint32_t fps;
+	enum layout layout;
+	char disp_mod[16];
+	char disp_dev[64];
+};
+
+
+extern struct hash *ht_canvas;
+extern struct compositor_cfg compositor_cfg;
+
+
+int disp_alloc(struct vidisp_st **stp, const struct vidisp *vd,
+	       struct vidisp_prm *prm, const char *dev,
+	       vidisp_resize_h *resizeh, void *arg);
+int disp_display(struct vidisp_st *st, const char *title,
+		 const struct vidframe *frame);
+int src_alloc(struct vidsrc_st **stp, const struct vidsrc *vs,
+	      struct media_ctx **ctx, struct vidsrc_prm *prm,
+	      const struct vidsz *size, const char *fmt,
+	      const char *dev, vidsrc_frame_h *frameh,
+	      vidsrc_error_h *errorh, void *arg);
+
+
+/* canvas */
+int  canvas_get(struct canvas **cvp, const char *name);
+void canvas_tile_add(struct canvas *cv, struct vidisp_st *tile);
+void canvas_tile_remove(struct canvas *cv, struct vidisp_st *tile);
+void canvas_src_add(struct canvas *cv, struct vidsrc_st *src);
+void canvas_src_remove(struct canvas *cv, struct vidsrc_st *src);
+void canvas_draw(struct canvas *cv, struct vidisp_st *tile,
+		 const struct vidframe *frame);
+void canvas_set_layout(enum layout layout, unsigned focus);
+int  canvas_debug(struct re_printf *pf, void *unused);
@@ -0,0 +1,64 @@
+/**
+ * @file compositor/disp.c Video compositor -- display
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "compositor.h"
+
+
+static void destructor(void *arg)
+{
+	struct vidisp_st *st = arg;
+
+	canvas_tile_remove(st->cv, st);
+	mem_deref(st->cv);
+}
+
+
+int disp_alloc(struct vidisp_st **stp, const struct vidisp *vd,
+	       struct vidisp_prm *prm, const char *dev,
+	       vidisp_resize_h *resizeh, void *arg)
+{
+	struct vidisp_st *st;
+	int err;
+	(void)prm;
+	(void)resizeh;
+	(void)arg;
+
+	if (!stp || !vd || !dev)
+		return EINVAL;
+
+	st = mem_zalloc(sizeof(*st), destructor);
+	if (!st)
+		return ENOMEM;
+
+	st->vd = vd;
+
+	err = canvas_get(&st->cv, dev);
+	if (err)
+		goto out;
+
+	canvas_tile_add(st->cv, st);
+
+ out:
+	if (err)
+		mem_deref(st);
+	else
+		*stp = st;
+
+	return err;
+}
+
+
+int disp_display(struct vidisp_st *st, const char *title,
+		 const struct vidframe *frame)
+{
+	(void)title;
+
+	canvas_draw(st->cv, st, frame);
+
+	return 0;
+}
@@ -0,0 +1,11 @@
+#
+# module.mk
+#
+# Copyright (C) 2010 Creytiv.com
+#
+
+MOD		:= compositor
+$(MOD)_SRCS	+= compositor.c canvas.c disp.c src.c
+$(MOD)_LFLAGS	+=
+
+include mk/mod.mk
@@ -0,0 +1,59 @@
+/**
+ * @file compositor/src.c Video compositor -- source
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "compositor.h"
+
+
+static void destructor(void *arg)
+{
+	struct vidsrc_st *st = arg;
+
+	canvas_src_remove(st->cv, st);
+	mem_deref(st->cv);
+}
+
+
+int src_alloc(struct vidsrc_st **stp, const struct vidsrc *vs,
+	      struct media_ctx **ctx, struct vidsrc_prm *prm,
+	      const struct vidsz *size, const char *fmt,
+	      const char *dev, vidsrc_frame_h *frameh,
+	      vidsrc_error_h *errorh, void *arg)
+{
+	struct vidsrc_st *st;
+	int err;
+	(void)ctx;
+	(void)prm;
+	(void)size;
+	(void)fmt;
+	(void)errorh;
+
+	if (!stp || !vs || !dev || !frameh)
+		return EINVAL;
+
+	st = mem_zalloc(sizeof(*st), destructor);
+	if (!st)
+		return ENOMEM;
+
+	st->vs     = vs;
+	st->frameh = frameh;
+	st->arg    = arg;
+
+	err = canvas_get(&st->cv, dev);
+	if (err)
+		goto out;
+
+	canvas_src_add(st->cv, st);
+
+ out:
+	if (err)
+		mem_deref(st);
+	else
+		*stp = st;
+
+	return err;
+}
@@ -29,6 +29,16 @@ static int confline_handler(const struct pl *addr, void *arg)
 }
 
 
+static bool print_handler(struct contact *c, void *arg)
+{
+	struct re_printf *pf = arg;
+
+	(void)re_hprintf(pf, "%s\n", contact_str(c));
+
+	return false;
+}
+
+
 static int cmd_contact(struct re_printf *pf, void *arg)
 {
 	const struct cmd_arg *carg = arg;
@@ -44,7 +54,13 @@ static int cmd_contact(struct re_printf *pf, void *arg)
 
 	err |= re_hprintf(pf, "\n");
 
-	for (le = list_head(contact_list(contacts)); le; le = le->next) {
+	/* a name that matches exactly is found in the index */
+	cnt = contact_find_name(contacts, &pl, print_handler, pf);
+
+	/* otherwise list the names that start with the parameter */
+	le = cnt ? NULL : list_head(contact_list(contacts));
+
+	for (; le; le = le->next) {
 
 		struct contact *c = le->data;
 
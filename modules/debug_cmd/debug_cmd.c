@@ -4,7 +4,13 @@
  * Copyright (C) 2010 - 2016 Creytiv.com
  */
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#ifdef LINUX
+#include <dirent.h>
+#include <stdio.h>
+#include <unistd.h>
+#endif
 #include <re.h>
 #include <baresip.h>
 
@@ -16,6 +22,40 @@
  */
 
 
+enum {
+	PROF_INTERVAL = 10,      /**< Probe timer interval [ms]         */
+	PROF_HIST     = 12,      /**< Stall histogram, 2^n ms buckets   */
+	PROF_TOPN     = 8,       /**< Number of entries in top tables   */
+	PROF_THREADS  = 64,      /**< Max number of threads sampled     */
+};
+
+struct thread_cpu {
+	int tid;
+	char name[16];
+	uint64_t ticks;
+	uint64_t delta;
+};
+
+struct stall {
+	uint64_t ts;
+	uint64_t ms;
+};
+
+/** Main loop profiler, sampled by a probe timer */
+static struct {
+	struct tmr tmr;
+	uint64_t t_start;
+	uint64_t t_exp;
+	uint64_t n;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t histv[PROF_HIST];
+	struct stall topv[PROF_TOPN];
+	struct thread_cpu thrv[PROF_THREADS];
+	size_t thrc;
+	bool on;
+} prof;
+
 static uint64_t start_ticks;          /**< Ticks when app started         */
 static time_t start_time;             /**< Start time of application      */
 
@@ -90,7 +130,294 @@ static int cmd_play_file(struct re_printf *pf, void *arg)
 }
 
 
+/* logdebug [<module> on|off] */
+static int cmd_log_debug(struct re_printf *pf, void *arg)
+{
+	const struct cmd_arg *carg = arg;
+	struct pl name, val;
+	char *mod = NULL;
+	int err;
+
+	if (!str_isset(carg->prm))
+		return log_mod_debug(pf, NULL);
+
+	if (re_regex(carg->prm, str_len(carg->prm), "[^ ]+ [a-z]+",
+		     &name, &val))
+		return re_hprintf(pf, "usage: /logdebug <module> on|off\n");
+
+	err = pl_strdup(&mod, &name);
+	if (err)
+		return err;
+
+	err = log_mod_enable_debug(mod, 0 == pl_strcasecmp(&val, "on"));
+	if (err)
+		(void)re_hprintf(pf, "logdebug: no module '%s'\n", mod);
+
+	mem_deref(mod);
+
+	return err;
+}
+
+
+/*
+ * The probe timer fires every PROF_INTERVAL ms. Any timer or fd handler
+ * that blocks the main loop delays it, so its lateness is the time the
+ * loop was stalled.
+ */
+static void prof_timeout(void *arg)
+{
+	uint64_t now = tmr_jiffies();
+	uint64_t lag = now > prof.t_exp ? now - prof.t_exp : 0;
+	unsigned b = 0, i;
+	(void)arg;
+
+	while (b < PROF_HIST - 1 && (1ULL << b) <= lag)
+		++b;
+
+	++prof.n;
+	prof.sum += lag;
+	++prof.histv[b];
+	prof.max = max(prof.max, lag);
+
+	/* keep the longest stalls, sorted */
+	for (i=0; i<PROF_TOPN; i++) {
+
+		if (lag <= prof.topv[i].ms)
+			continue;
+
+		memmove(&prof.topv[i+1], &prof.topv[i],
+			(PROF_TOPN - i - 1) * sizeof(prof.topv[0]));
+
+		prof.topv[i].ts = now - start_ticks;
+		prof.topv[i].ms = lag;
+		break;
+	}
+
+	prof.t_exp = now + PROF_INTERVAL;
+	tmr_start(&prof.tmr, PROF_INTERVAL, prof_timeout, NULL);
+}
+
+
+#ifdef LINUX
+static int thread_read(struct thread_cpu *thr, int tid)
+{
+	unsigned long utime, stime;
+	char path[64], buf[512];
+	const char *p, *q;
+	FILE *f;
+	size_t n;
+
+	re_snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+
+	f = fopen(path, "r");
+	if (!f)
+		return errno;
+
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+
+	/* the thread name may contain spaces and parentheses */
+	p = strchr(buf, '(');
+	q = strrchr(buf, ')');
+	if (!p || !q || q < p)
+		return EBADMSG;
+
+	if (2 != sscanf(q + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+			" %lu %lu", &utime, &stime))
+		return EBADMSG;
+
+	thr->tid   = tid;
+	thr->ticks = (uint64_t)utime + stime;
+	str_ncpy(thr->name, p + 1, min(sizeof(thr->name), (size_t)(q - p)));
+
+	return 0;
+}
+
+
+static size_t threads_read(struct thread_cpu *thrv, size_t sz)
+{
+	struct dirent *de;
+	size_t n = 0;
+	DIR *dir;
+
+	dir = opendir("/proc/self/task");
+	if (!dir)
+		return 0;
+
+	while (n < sz && (de = readdir(dir))) {
+
+		if (de->d_name[0] == '.')
+			continue;
+
+		if (0 == thread_read(&thrv[n], atoi(de->d_name)))
+			++n;
+	}
+
+	closedir(dir);
+
+	return n;
+}
+
+
+static int thread_cmp(const void *a, const void *b)
+{
+	const struct thread_cpu *ta = a, *tb = b;
+
+	return (tb->delta > ta->delta) - (tb->delta < ta->delta);
+}
+
+
+static int threads_print(struct re_printf *pf, uint64_t dur)
+{
+	struct thread_cpu thrv[PROF_THREADS];
+	long hz = sysconf(_SC_CLK_TCK);
+	size_t n, i, j;
+	int err = 0;
+
+	n = threads_read(thrv, ARRAY_SIZE(thrv));
+
+	for (i=0; i<n; i++) {
+
+		thrv[i].delta = thrv[i].ticks;
+
+		/* threads started after the profile get all their CPU */
+		for (j=0; j<prof.thrc; j++) {
+			if (prof.thrv[j].tid == thrv[i].tid) {
+				thrv[i].delta -= prof.thrv[j].ticks;
+				break;
+			}
+		}
+	}
+
+	qsort(thrv, n, sizeof(thrv[0]), thread_cmp);
+
+	err |= re_hprintf(pf, " Thread CPU:\n");
+
+	for (i=0; i<min(n, (size_t)PROF_TOPN); i++) {
+
+		uint64_t ms = hz > 0 ? thrv[i].delta * 1000 / hz : 0;
+
+		err |= re_hprintf(pf, "  %-6d %-16s %6llu ms %5.1f%%\n",
+				  thrv[i].tid, thrv[i].name, ms,
+				  dur ? 100.0 * ms / dur : 0.0);
+	}
+
+	return err;
+}
+#endif
+
+
+static void prof_start(void)
+{
+	tmr_cancel(&prof.tmr);
+	memset(&prof, 0, sizeof(prof));
+
+	prof.on      = true;
+	prof.t_start = tmr_jiffies();
+	prof.t_exp   = prof.t_start + PROF_INTERVAL;
+
+#ifdef LINUX
+	prof.thrc = threads_read(prof.thrv, ARRAY_SIZE(prof.thrv));
+#endif
+
+	tmr_start(&prof.tmr, PROF_INTERVAL, prof_timeout, NULL);
+}
+
+
+static int prof_print(struct re_printf *pf)
+{
+	uint64_t dur = tmr_jiffies() - prof.t_start;
+	unsigned i, last = 0;
+	int err = 0;
+
+	err |= re_hprintf(pf, "\n--- Runtime profile (%llu ms, %s) ---\n",
+			  dur, prof.on ? "running" : "stopped");
+
+	err |= re_hprintf(pf, " Main loop stalls: n=%llu avg=%llums"
+			  " max=%llums\n",
+			  prof.n, prof.n ? prof.sum / prof.n : 0, prof.max);
+
+	for (i=0; i<PROF_HIST; i++) {
+		if (prof.histv[i])
+			last = i + 1;
+	}
+
+	for (i=0; i<last; i++) {
+		err |= re_hprintf(pf, "  < %5u ms: %llu\n",
+				  1u << i, prof.histv[i]);
+	}
+
+	err |= re_hprintf(pf, " Longest stalls:\n");
+
+	for (i=0; i<PROF_TOPN && prof.topv[i].ms; i++) {
+		err |= re_hprintf(pf, "  %6llu ms at uptime %llu.%03llu s\n",
+				  prof.topv[i].ms, prof.topv[i].ts / 1000,
+				  prof.topv[i].ts % 1000);
+	}
+
+#ifdef LINUX
+	err |= threads_print(pf, dur);
+#endif
+
+	return err;
+}
+
+
+static int cmd_call_mem(struct re_printf *pf, void *unused)
+{
+	struct le *leu, *lec;
+	unsigned n = 0;
+	int err = 0;
+	(void)unused;
+
+	err |= re_hprintf(pf, "\n--- Memory per call [bytes] ---\n");
+
+	for (leu = list_head(uag_list()); leu; leu = leu->next) {
+
+		const struct ua *ua = leu->data;
+
+		for (lec = list_head(ua_calls(ua)); lec; lec = lec->next) {
+
+			const struct call *call = lec->data;
+
+			err |= re_hprintf(pf, " %s line %u: %H\n",
+					  ua_aor(ua), call_linenum(call),
+					  audio_mem_debug, call_audio(call));
+			++n;
+		}
+	}
+
+	err |= re_hprintf(pf, " %u calls\n", n);
+
+	return err;
+}
+
+
+/* profile [on|off] */
+static int cmd_profile(struct re_printf *pf, void *arg)
+{
+	const struct cmd_arg *carg = arg;
+
+	if (0 == str_casecmp(carg->prm, "on")) {
+		prof_start();
+		return re_hprintf(pf, "profile: started\n");
+	}
+	else if (0 == str_casecmp(carg->prm, "off")) {
+		tmr_cancel(&prof.tmr);
+		prof.on = false;
+		return re_hprintf(pf, "profile: stopped\n");
+	}
+
+	if (!prof.t_start)
+		return re_hprintf(pf, "usage: /profile on|off\n");
+
+	return prof_print(pf);
+}
+
+
 static const struct cmd debugcmdv[] = {
+{"logdebug", 0, CMD_PRM, "Module debug messages",    cmd_log_debug        },
 {"main",     0,       0, "Main loop debug",          re_debug             },
 {"config",   0,       0, "Print configuration",      cmd_config_print     },
 {"sipstat", 'i',      0, "SIP debug",                ua_print_sip_status  },
@@ -99,8 +426,13 @@ static const struct cmd debugcmdv[] = {
 {"sysinfo", 's',      0, "System info",              print_system_info    },
 {"timers",   0,       0, "Timer debug",              tmr_status           },
 {"uastat",  'u',      0, "UA debug",                 cmd_ua_debug         },
+{"watchdog", 0,       0, "Main loop lag",            watchdog_debug       },
+{"kernels",  0,       0, "Media kernels and CPU",    kernel_debug         },
 {"memstat", 'y',      0, "Memory status",            mem_status           },
+{"callmem",  0,       0, "Memory per call",          cmd_call_mem         },
+{"memtags",  0,       0, "Memory per module",        memtag_debug         },
 {"play",     0, CMD_PRM, "Play audio file",          cmd_play_file        },
+{"profile",  0, CMD_PRM, "Runtime profile [on|off]", cmd_profile          },
 };
 
 
@@ -122,6 +454,8 @@ static int module_close(void)
 {
 	cmd_unregister(baresip_commands(), debugcmdv);
 
+	tmr_cancel(&prof.tmr);
+
 	return 0;
 }
 
@@ -27,6 +27,30 @@
  \endverbatim
  *
  *
+ * By default a self-signed certificate is made when the module is
+ * loaded. A certificate that was generated beforehand can be used
+ * instead, e.g. an ECDSA P-256 one:
+ *
+ \verbatim
+  openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 \
+          -nodes -subj /CN=dtls@baresip -days 365 \
+          -keyout dtls.pem -out dtls.pem
+ \endverbatim
+ *
+ * Config options:
+ *
+ \verbatim
+  dtls_srtp_certificate   /path/to/dtls.pem  # Certificate and key
+  dtls_srtp_handshakes    16                 # Concurrent handshakes
+ \endverbatim
+ *
+ * The handshakes run in the main thread, where their key exchange
+ * competes with the media of all other calls. To keep a burst of new
+ * calls from stalling the media, only a limited number of handshakes
+ * run at the same time; the connects of the other calls wait for one
+ * of them to finish. Incoming handshakes are always accepted, but are
+ * counted towards the limit. 0 means no limit.
+ *
  * Internally the protocol stack diagram looks something like this:
  *
  \verbatim
@@ -65,6 +89,11 @@ struct dtls_srtp {
 };
 
 static struct tls *tls;
+static char fp_sha1[64];     /* fingerprints of the certificate */
+static char fp_sha256[128];
+static struct list waitl;    /* components waiting to connect */
+static uint32_t handshakes_max = 16;
+static uint32_t handshakes_n;
 static const char* srtp_profiles =
 	"SRTP_AES128_CM_SHA1_80:"
 	"SRTP_AES128_CM_SHA1_32";
@@ -78,6 +107,9 @@ static void sess_destructor(void *arg)
 }
 
 
+static void handshake_done(struct comp *comp);
+
+
 static void destructor(void *arg)
 {
 	struct dtls_srtp *st = arg;
@@ -88,6 +120,9 @@ static void destructor(void *arg)
 	for (i=0; i<2; i++) {
 		struct comp *c = &st->compv[i];
 
+		list_unlink(&c->le);
+		handshake_done(c);
+
 		mem_deref(c->uh_srtp);
 		mem_deref(c->tls_conn);
 		mem_deref(c->dtls_sock);
@@ -175,8 +210,8 @@ static int session_alloc(struct menc_sess **sessp,
 		goto out;
 
 	/* RFC 4572 */
-	err = sdp_session_set_lattr(sdp, true, "fingerprint", "SHA-256 %H",
-				    dtls_print_sha256_fingerprint, tls);
+	err = sdp_session_set_lattr(sdp, true, "fingerprint", "SHA-256 %s",
+				    fp_sha256);
 	if (err)
 		goto out;
 
@@ -198,6 +233,8 @@ static void dtls_estab_handler(void *arg)
 	uint8_t cli_key[30], srv_key[30];
 	int err;
 
+	handshake_done(comp);
+
 	if (!verify_fingerprint(ds->sess->sdp, ds->sdpm, comp->tls_conn)) {
 		warning("dtls_srtp: could not verify remote fingerprint\n");
 		if (ds->sess->errorh)
@@ -239,6 +276,8 @@ static void dtls_close_handler(int err, void *arg)
 
 	info("dtls_srtp: dtls-connection closed (%m)\n", err);
 
+	handshake_done(comp);
+
 	comp->tls_conn = mem_deref(comp->tls_conn);
 
 	if (!comp->negotiated) {
@@ -263,6 +302,52 @@ static void dtls_conn_handler(const struct sa *peer, void *arg)
 		warning("dtls_srtp: dtls_accept failed (%m)\n", err);
 		return;
 	}
+
+	if (!comp->handshake) {
+		comp->handshake = true;
+		++handshakes_n;
+	}
+}
+
+
+static int component_connect(struct comp *comp)
+{
+	int err;
+
+	err = dtls_connect(&comp->tls_conn, tls, comp->dtls_sock,
+			   &comp->raddr, dtls_estab_handler, NULL,
+			   dtls_close_handler, comp);
+	if (err) {
+		warning("dtls_srtp: dtls_connect() failed (%m)\n", err);
+		return err;
+	}
+
+	comp->handshake = true;
+	++handshakes_n;
+
+	return 0;
+}
+
+
+static void handshake_done(struct comp *comp)
+{
+	struct le *le;
+
+	if (!comp->handshake)
+		return;
+
+	comp->handshake = false;
+	--handshakes_n;
+
+	while (handshakes_n < handshakes_max && (le = list_head(&waitl))) {
+
+		struct comp *next = le->data;
+
+		list_unlink(le);
+
+		if (component_connect(next) && next->ds->sess->errorh)
+			next->ds->sess->errorh(EPROTO, next->ds->sess->arg);
+	}
 }
 
 
@@ -291,15 +376,16 @@ static int component_start(struct comp *comp, struct sdp_media *sdpm)
 
 		if (comp->ds->active && !comp->tls_conn) {
 
-			err = dtls_connect(&comp->tls_conn, tls,
-					   comp->dtls_sock, &raddr,
-					   dtls_estab_handler, NULL,
-					   dtls_close_handler, comp);
-			if (err) {
-				warning("dtls_srtp: dtls_connect()"
-					" failed (%m)\n", err);
-				return err;
+			comp->raddr = raddr;
+
+			if (handshakes_max && handshakes_n >= handshakes_max) {
+				debug("dtls_srtp: %u handshakes running,"
+				      " connect later\n", handshakes_n);
+				list_append(&waitl, &comp->le, comp);
+				return 0;
 			}
+
+			err = component_connect(comp);
 		}
 	}
 
@@ -415,15 +501,13 @@ static int media_alloc(struct menc_media **mp, struct menc_sess *sess,
 
 		if (0 == pl_strcasecmp(&hash, "SHA-1")) {
 			err = sdp_media_set_lattr(st->sdpm, true,
-						  "fingerprint", "SHA-1 %H",
-						  dtls_print_sha1_fingerprint,
-						  tls);
+						  "fingerprint", "SHA-1 %s",
+						  fp_sha1);
 		}
 		else if (0 == pl_strcasecmp(&hash, "SHA-256")) {
 			err = sdp_media_set_lattr(st->sdpm, true,
-						  "fingerprint", "SHA-256 %H",
-						 dtls_print_sha256_fingerprint,
-						  tls);
+						  "fingerprint", "SHA-256 %s",
+						  fp_sha256);
 		}
 		else {
 			info("dtls_srtp: unsupported fingerprint hash `%r'\n",
@@ -453,20 +537,40 @@ static struct menc dtls_srtp2 = {
 static int module_init(void)
 {
 	struct list *mencl = baresip_mencl();
+	char cert[256] = "";
 	int err;
 
-	err = tls_alloc(&tls, TLS_METHOD_DTLSV1, NULL, NULL);
+	(void)conf_get_str(conf_cur(), "dtls_srtp_certificate",
+			   cert, sizeof(cert));
+	(void)conf_get_u32(conf_cur(), "dtls_srtp_handshakes",
+			   &handshakes_max);
+
+	err = tls_alloc(&tls, TLS_METHOD_DTLSV1,
+			str_isset(cert) ? cert : NULL, NULL);
 	if (err) {
 		warning("dtls_srtp: failed to create DTLS context (%m)\n",
 			err);
 		return err;
 	}
 
-	err = tls_set_selfsigned(tls, "dtls@baresip");
+	if (!str_isset(cert)) {
+		err = tls_set_selfsigned(tls, "dtls@baresip");
+		if (err) {
+			warning("dtls_srtp: failed to self-sign"
+				" certificate (%m)\n", err);
+			return err;
+		}
+	}
+
+	/* the certificate is the same for all calls */
+	err  = re_snprintf(fp_sha1, sizeof(fp_sha1), "%H",
+			   dtls_print_sha1_fingerprint, tls) < 0;
+	err |= re_snprintf(fp_sha256, sizeof(fp_sha256), "%H",
+			   dtls_print_sha256_fingerprint, tls) < 0;
 	if (err) {
-		warning("dtls_srtp: failed to self-sign certificate (%m)\n",
-			err);
-		return err;
+		warning("dtls_srtp: failed to get certificate"
+			" fingerprint\n");
+		return EINVAL;
 	}
 
 	tls_set_verify_client(tls);
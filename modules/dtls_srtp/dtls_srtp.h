@@ -18,7 +18,10 @@ struct comp {
 	struct srtp_stream *rx;
 	struct udp_helper *uh_srtp;
 	void *app_sock;
+	struct le le;               /* waiting to start the handshake */
+	struct sa raddr;
 	bool negotiated;
+	bool handshake;             /* handshake in progress */
 	bool is_rtp;
 };
 
@@ -120,7 +120,10 @@ static int module_init(void)
 		      " This might cause issues.\n");
 	}
 
-	uag_event_register( ua_event_handler, NULL );
+	uag_event_register_mask(ua_event_handler,
+				UA_EVENT_BIT(UA_EVENT_CALL_ESTABLISHED) |
+				UA_EVENT_BIT(UA_EVENT_CALL_CLOSED),
+				NULL, NULL);
 
 	return 0;
 }
@@ -11,6 +11,19 @@
  * REQUIRES: aubridge
  * NOTE: This module is experimental.
  *
+ * With echo_reflect the module is a test call server that does not
+ * decode the media. The RTP packets of each stream are sent back to
+ * the caller as they are, with the SSRC, sequence numbers and payload
+ * types of the call, after an optional delay. No codecs or devices are
+ * used and aubridge is not needed. RTCP is not reflected, each stream
+ * sends its own reports, which give the caller the loss, jitter and
+ * round-trip time of the path.
+ *
+ * Example config:
+ \verbatim
+  echo_reflect    yes
+  echo_delay      200     # [ms]
+ \endverbatim
  */
 
 struct session {
@@ -20,6 +33,8 @@ struct session {
 
 
 static struct list sessionl;
+static bool reflect;
+static uint32_t delay;
 
 
 static void destructor(void *arg)
@@ -74,9 +89,14 @@ static int new_session(struct call *call)
 
 	sess->call_in = call;
 
-	re_snprintf(a, sizeof(a), "A-%x", sess);
+	if (reflect) {
+		(void)call_reflect(sess->call_in, true, delay);
+	}
+	else {
+		re_snprintf(a, sizeof(a), "A-%x", sess);
 
-	audio_set_devicename(call_audio(sess->call_in), a, a);
+		audio_set_devicename(call_audio(sess->call_in), a, a);
+	}
 
 	call_set_handlers(sess->call_in, call_event_handler,
 			call_dtmf_handler, sess);
@@ -123,7 +143,12 @@ static int module_init(void)
 
 	list_init(&sessionl);
 
-	err = uag_event_register(ua_event_handler, 0);
+	(void)conf_get_bool(conf_cur(), "echo_reflect", &reflect);
+	(void)conf_get_u32(conf_cur(), "echo_delay", &delay);
+
+	err = uag_event_register_mask(ua_event_handler,
+				      UA_EVENT_BIT(UA_EVENT_CALL_INCOMING),
+				      NULL, NULL);
 	if (err)
 		return err;
 
@@ -7,6 +7,7 @@
 #define _BSD_SOURCE 1
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -20,20 +21,39 @@
  * This module can be used to generate fake video input frames, and to
  * send output video frames to a fake non-existant display.
  *
+ * The source has moving diagonal bars and a moving box, and a share of
+ * the 16x16 blocks are filled with noise, which sets how hard the frames
+ * are to encode. All frames are drawn in a ring when the source is
+ * opened, so sending a frame costs nothing, and they are sent on an
+ * absolute clock so that the rate does not drift. The resolution is the
+ * one that is asked for, i.e. video_size.
+ *
  * Example config:
  \verbatim
   video_source    fakevideo,nil
   video_display   fakevideo,nil
+
+  fakevideo_fps          60      # overrides video_fps
+  fakevideo_complexity   10      # noise blocks in percent, 0-100
+  fakevideo_ring         16      # frames that are drawn in advance
  \endverbatim
  */
 
 
+enum {
+	RING_MAX  = 64,
+	BLOCK     = 16,
+	BAR_CYCLE = 64,
+};
+
+
 struct vidsrc_st {
 	const struct vidsrc *vs;  /* inheritance */
-	struct vidframe *frame;
+	struct vidframe *ringv[RING_MAX];
+	unsigned ringc;
 	pthread_t thread;
 	bool run;
-	int fps;
+	unsigned fps;
 	vidsrc_frame_h *frameh;
 	void *arg;
 };
@@ -47,21 +67,134 @@ static struct vidsrc *vidsrc;
 static struct vidisp *vidisp;
 
 
+/* Monotonic time in [ns] */
+static uint64_t now_ns(void)
+{
+#ifdef LINUX
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return tmr_jiffies() * 1000000;
+#endif
+}
+
+
+static void sleep_until(uint64_t deadline)
+{
+#ifdef LINUX
+	struct timespec ts;
+
+	ts.tv_sec  = deadline / 1000000000;
+	ts.tv_nsec = deadline % 1000000000;
+
+	while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					&ts, NULL))
+		;
+#else
+	uint64_t now = now_ns();
+
+	if (deadline > now)
+		(void)sys_msleep((unsigned)((deadline - now) / 1000000));
+#endif
+}
+
+
+static uint32_t rand_next(uint32_t *seed)
+{
+	*seed = *seed * 1664525 + 1013904223;
+
+	return *seed >> 16;
+}
+
+
+/* Draw frame number i of the ring */
+static void frame_draw(struct vidframe *f, unsigned i, unsigned ringc,
+		       uint32_t complexity, uint32_t *seed)
+{
+	const unsigned w = f->size.w, h = f->size.h;
+	const unsigned shift = i * BAR_CYCLE / ringc;
+	const unsigned bs = max(h / 4, 2u) & ~1u;
+	const unsigned bx = i * (w > bs ? w - bs : 0) / ringc;
+	const unsigned by = (h - min(bs, h)) / 2;
+	unsigned x, y, k;
+
+	for (y = 0; y < h; y++) {
+
+		uint8_t *p = f->data[0] + y * f->linesize[0];
+
+		for (x = 0; x < w; x++) {
+			p[x] = 16 + ((x + y + shift) % BAR_CYCLE) * 219 /
+				(BAR_CYCLE - 1);
+		}
+	}
+
+	for (y = 0; y < h / 2; y++) {
+
+		uint8_t *u = f->data[1] + y * f->linesize[1];
+		uint8_t *v = f->data[2] + y * f->linesize[2];
+
+		for (x = 0; x < w / 2; x++) {
+			u[x] = 64 + ((2 * x + shift) & 127);
+			v[x] = 64 + ((2 * y) & 127);
+		}
+	}
+
+	/* Box */
+	for (y = by; y < min(by + bs, h); y++) {
+
+		memset(f->data[0] + y * f->linesize[0] + bx, 235,
+		       min(bs, w - bx));
+	}
+
+	/* Noise blocks */
+	for (y = 0; y + BLOCK <= h; y += BLOCK) {
+		for (x = 0; x + BLOCK <= w; x += BLOCK) {
+
+			if (rand_next(seed) % 100 >= complexity)
+				continue;
+
+			for (k = 0; k < BLOCK; k++) {
+
+				uint8_t *p = f->data[0] +
+					(y + k) * f->linesize[0] + x;
+				unsigned j;
+
+				for (j = 0; j < BLOCK; j++)
+					p[j] = 16 + rand_next(seed) % 220;
+			}
+		}
+	}
+}
+
+
 static void *read_thread(void *arg)
 {
 	struct vidsrc_st *st = arg;
-	uint64_t ts = tmr_jiffies();
+	uint64_t t0 = now_ns();
+	uint64_t n = 0;
 
 	while (st->run) {
 
-		if (tmr_jiffies() < ts) {
-			sys_msleep(4);
-			continue;
-		}
+		uint64_t deadline = t0 + n * 1000000000 / st->fps;
+
+		sleep_until(deadline);
 
-		st->frameh(st->frame, st->arg);
+		if (!st->run)
+			break;
 
-		ts += (1000/st->fps);
+		st->frameh(st->ringv[n % st->ringc], st->arg);
+
+		/* start over if more than one second late */
+		if (now_ns() > deadline + 1000000000) {
+			warning("fakevideo: source is late, restarting\n");
+			t0 = now_ns();
+			n  = 0;
+		}
+
+		++n;
 	}
 
 	return NULL;
@@ -71,13 +204,15 @@ static void *read_thread(void *arg)
 static void src_destructor(void *arg)
 {
 	struct vidsrc_st *st = arg;
+	unsigned i;
 
 	if (st->run) {
 		st->run = false;
 		pthread_join(st->thread, NULL);
 	}
 
-	mem_deref(st->frame);
+	for (i = 0; i < st->ringc; i++)
+		mem_deref(st->ringv[i]);
 }
 
 
@@ -95,7 +230,10 @@ static int src_alloc(struct vidsrc_st **stp, const struct vidsrc *vs,
 		     vidsrc_error_h *errorh, void *arg)
 {
 	struct vidsrc_st *st;
-	int err;
+	uint32_t fps = 0, complexity = 10, ringc = 16;
+	uint32_t seed = 1;
+	unsigned i;
+	int err = 0;
 
 	(void)ctx;
 	(void)fmt;
@@ -105,18 +243,32 @@ static int src_alloc(struct vidsrc_st **stp, const struct vidsrc *vs,
 	if (!stp || !prm || !size || !frameh)
 		return EINVAL;
 
+	(void)conf_get_u32(conf_cur(), "fakevideo_fps", &fps);
+	(void)conf_get_u32(conf_cur(), "fakevideo_complexity", &complexity);
+	(void)conf_get_u32(conf_cur(), "fakevideo_ring", &ringc);
+
 	st = mem_zalloc(sizeof(*st), src_destructor);
 	if (!st)
 		return ENOMEM;
 
 	st->vs     = vs;
-	st->fps    = prm->fps;
+	st->fps    = fps ? fps : (unsigned)max(prm->fps, 1);
+	st->ringc  = min(max(ringc, 1u), (uint32_t)RING_MAX);
 	st->frameh = frameh;
 	st->arg    = arg;
 
-	err = vidframe_alloc(&st->frame, VID_FMT_YUV420P, size);
-	if (err)
-		goto out;
+	for (i = 0; i < st->ringc; i++) {
+
+		err = vidframe_alloc(&st->ringv[i], VID_FMT_YUV420P, size);
+		if (err)
+			goto out;
+
+		frame_draw(st->ringv[i], i, st->ringc,
+			   min(complexity, 100u), &seed);
+	}
+
+	info("fakevideo: %ux%u at %u fps, %u%% noise blocks\n",
+	     size->w, size->h, st->fps, min(complexity, 100u));
 
 	st->run = true;
 	err = pthread_create(&st->thread, NULL, read_thread, st);
@@ -5,7 +5,6 @@
  */
 
 #include <re.h>
-#include <rem.h>
 #include <baresip.h>
 
 
@@ -29,8 +28,7 @@ static int pcmu_encode(struct auenc_state *aes, uint8_t *buf,
 
 	*len = sampc;
 
-	while (sampc--)
-		*buf++ = g711_pcm2ulaw(*sampv++);
+	aupcm_ulaw_encode(buf, sampv, sampc);
 
 	return 0;
 }
@@ -49,8 +47,7 @@ static int pcmu_decode(struct audec_state *ads, int16_t *sampv,
 
 	*sampc = len;
 
-	while (len--)
-		*sampv++ = g711_ulaw2pcm(*buf++);
+	aupcm_ulaw_decode(sampv, buf, len);
 
 	return 0;
 }
@@ -69,8 +66,7 @@ static int pcma_encode(struct auenc_state *aes, uint8_t *buf,
 
 	*len = sampc;
 
-	while (sampc--)
-		*buf++ = g711_pcm2alaw(*sampv++);
+	aupcm_alaw_encode(buf, sampv, sampc);
 
 	return 0;
 }
@@ -89,21 +85,29 @@ static int pcma_decode(struct audec_state *ads, int16_t *sampv,
 
 	*sampc = len;
 
-	while (len--)
-		*sampv++ = g711_alaw2pcm(*buf++);
+	aupcm_alaw_decode(sampv, buf, len);
 
 	return 0;
 }
 
 
+/* Each sample is encoded on its own, any frame length can be sent */
+static bool ptime_handler(uint32_t ptime)
+{
+	return ptime > 0;
+}
+
+
 static struct aucodec pcmu = {
 	LE_INIT, "0", "PCMU", 8000, 8000, 1, NULL,
-	NULL, pcmu_encode, NULL, pcmu_decode, NULL, NULL, NULL
+	NULL, pcmu_encode, NULL, pcmu_decode, NULL, NULL, NULL,
+	NULL, NULL, NULL, NULL, ptime_handler
 };
 
 static struct aucodec pcma = {
 	LE_INIT, "8", "PCMA", 8000, 8000, 1, NULL,
-	NULL, pcma_encode, NULL, pcma_decode, NULL, NULL, NULL
+	NULL, pcma_encode, NULL, pcma_decode, NULL, NULL, NULL,
+	NULL, NULL, NULL, NULL, ptime_handler
 };
 
 
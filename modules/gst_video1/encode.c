@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <re.h>
@@ -23,6 +24,13 @@
 #include "gst_video.h"
 
 
+enum {
+	RELEASE_TIMEOUT = 2,  /* [s] */
+};
+
+#define H264_CAPS "video/x-h264,stream-format=byte-stream,alignment=au"
+
+
 struct videnc_state {
 
 	struct {
@@ -67,10 +75,20 @@ struct videnc_state {
 			/* 0: no-wait, 1: wait, -1: pipeline destroyed */
 			int flag;
 		} wait;
+
+		/* Frame memory wrapped in a buffer, 1: in use */
+		struct {
+			pthread_mutex_t mutex;
+			pthread_cond_t cond;
+			int flag;
+		} release;
 	} streamer;
 };
 
 
+static char encoder_element[32] = "x264enc";
+
+
 static void appsrc_need_data_cb(GstAppSrc *src, guint size, gpointer user_data)
 {
 	struct videnc_state *st = user_data;
@@ -128,6 +146,7 @@ static GstFlowReturn appsink_new_sample_cb(GstAppSink *sink,
 		data = info.data;
 		size = info.size;
 
+		/* packetized straight from the mapped buffer */
 		h264_packetize(data, size, st->encoder.pktsize,
 			       st->pkth, st->arg);
 
@@ -206,6 +225,8 @@ static void bus_destroy_notify_cb(struct videnc_state *st)
  *  |   '----|   |----'  '---|   |----'     |   handler
  *  '--------'   '-----------'   '----------'
  * </pre>
+ *
+ * The encoder can be replaced by vaapih264enc or omxh264enc.
  */
 static int pipeline_init(struct videnc_state *st, const struct vidsz *size)
 {
@@ -214,21 +235,41 @@ static int pipeline_init(struct videnc_state *st, const struct vidsz *size)
 	GstBus *bus;
 	GError* gerror = NULL;
 	char pipeline[1024];
+	char enc[256];
 	GstStateChangeReturn ret;
 	int err = 0;
 
 	if (!st || !size)
 		return EINVAL;
 
+	/* hardware encoders are followed by h264parse, for the
+	   parameter sets in each IDR and an Annex-B byte stream */
+	if (0 == str_casecmp(encoder_element, "vaapih264enc")) {
+		snprintf(enc, sizeof(enc),
+		 "vaapih264enc rate-control=cbr max-bframes=0 bitrate=%u ! "
+		 "h264parse config-interval=-1 ! " H264_CAPS,
+		 st->encoder.bitrate / 1000 /* kbit/s */);
+	}
+	else if (0 == str_casecmp(encoder_element, "omxh264enc")) {
+		snprintf(enc, sizeof(enc),
+		 "omxh264enc control-rate=variable target-bitrate=%u ! "
+		 "h264parse config-interval=-1 ! " H264_CAPS,
+		 st->encoder.bitrate);
+	}
+	else {
+		snprintf(enc, sizeof(enc),
+		 "x264enc byte-stream=TRUE tune=zerolatency rc-lookahead=0 "
+		 "sync-lookahead=0 bitrate=%u",
+		 st->encoder.bitrate / 1000 /* kbit/s */);
+	}
+
 	snprintf(pipeline, sizeof(pipeline),
 	 "appsrc name=source is-live=TRUE block=TRUE "
 	 "do-timestamp=TRUE max-bytes=1000000 ! "
 	 "videoparse width=%d height=%d format=i420 framerate=%d/1 ! "
-	 "x264enc byte-stream=TRUE rc-lookahead=0 "
-	 "sync-lookahead=0 bitrate=%d ! "
+	 "%s ! "
 	 "appsink name=sink emit-signals=TRUE drop=TRUE",
-	 size->w, size->h,
-	 st->encoder.fps, st->encoder.bitrate / 1000 /* kbit/s */);
+	 size->w, size->h, st->encoder.fps, enc);
 
 	/* Initialize pipeline. */
 	st->streamer.pipeline = gst_parse_launch(pipeline, &gerror);
@@ -322,6 +363,9 @@ static void destruct_resources(void *data)
 
 	pthread_mutex_destroy(&st->streamer.wait.mutex);
 	pthread_cond_destroy(&st->streamer.wait.cond);
+
+	pthread_mutex_destroy(&st->streamer.release.mutex);
+	pthread_cond_destroy(&st->streamer.release.cond);
 }
 
 
@@ -342,6 +386,9 @@ static int allocate_resources(struct videnc_state **stp)
 	pthread_mutex_init(&st->streamer.wait.mutex, NULL);
 	pthread_cond_init(&st->streamer.wait.cond, NULL);
 
+	pthread_mutex_init(&st->streamer.release.mutex, NULL);
+	pthread_cond_init(&st->streamer.release.cond, NULL);
+
 
 	/* Set appsource callbacks. */
 	st->streamer.appsrcCallbacks.need_data = &appsrc_need_data_cb;
@@ -453,15 +500,102 @@ int gst_video1_encoder_set(struct videnc_state **stp,
 }
 
 
+/* Called by gstreamer when the wrapped frame is not used anymore */
+static void frame_release_cb(gpointer user_data)
+{
+	struct videnc_state *st = user_data;
+
+	pthread_mutex_lock(&st->streamer.release.mutex);
+	st->streamer.release.flag = 0;
+	pthread_cond_signal(&st->streamer.release.cond);
+	pthread_mutex_unlock(&st->streamer.release.mutex);
+}
+
+
+/*
+ * Wait until gstreamer has released the wrapped frame. If the encoder
+ * holds on to it, the pipeline is stopped, which drops all buffers.
+ */
+static int frame_release_wait(struct videnc_state *st)
+{
+	struct timespec ts;
+	int err = 0;
+
+	(void)clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += RELEASE_TIMEOUT;
+
+	pthread_mutex_lock(&st->streamer.release.mutex);
+	while (st->streamer.release.flag == 1 && !err) {
+		err = pthread_cond_timedwait(&st->streamer.release.cond,
+					     &st->streamer.release.mutex,
+					     &ts);
+	}
+	pthread_mutex_unlock(&st->streamer.release.mutex);
+
+	if (err) {
+		warning("gst_video: encoder did not release frame\n");
+
+		pipeline_close(st);
+
+		/* the pipeline in NULL state has dropped all buffers */
+		pthread_mutex_lock(&st->streamer.release.mutex);
+		while (st->streamer.release.flag == 1)
+			pthread_cond_wait(&st->streamer.release.cond,
+					  &st->streamer.release.mutex);
+		pthread_mutex_unlock(&st->streamer.release.mutex);
+	}
+
+	return err;
+}
+
+
+/* True if the I420 planes follow each other, as from vidframe_alloc() */
+static bool frame_is_contiguous(const struct vidframe *frame)
+{
+	const unsigned h = frame->size.h;
+
+	return frame->data[1] == frame->data[0] + frame->linesize[0] * h &&
+	       frame->data[2] == frame->data[1] + frame->linesize[1] * h / 2;
+}
+
+
+/* Copy the frame, for frames with planes in separate memory */
+static GstBuffer *frame_copy(const struct vidframe *frame)
+{
+	const unsigned h = frame->size.h;
+	uint8_t *data;
+	size_t size, pos = 0;
+
+	size = frame->linesize[0] * h
+		+ frame->linesize[1] * h / 2
+		+ frame->linesize[2] * h / 2;
+
+	/* allocate memory; memory is freed within callback of
+	   gst_memory_new_wrapped of gst_video_push */
+	data = g_try_malloc(size);
+	if (!data)
+		return NULL;
+
+	memcpy(&data[pos], frame->data[0], frame->linesize[0] * h);
+	pos += frame->linesize[0] * h;
+	memcpy(&data[pos], frame->data[1], frame->linesize[1] * h / 2);
+	pos += frame->linesize[1] * h / 2;
+	memcpy(&data[pos], frame->data[2], frame->linesize[2] * h / 2);
+
+	return gst_buffer_new_wrapped_full(0, data, size, 0, size,
+					   data, g_free);
+}
+
+
 /*
  * couple gstreamer tightly by lock-stepping
  */
 static int pipeline_push(struct videnc_state *st, const struct vidframe *frame)
 {
 	GstBuffer *buffer;
-	uint8_t *data;
 	size_t size;
 	GstFlowReturn ret;
+	bool wrapped;
 	int err = 0;
 
 #if 1
@@ -483,39 +617,33 @@ static int pipeline_push(struct videnc_state *st, const struct vidframe *frame)
 		return err;
 #endif
 
-	/*
-	 * Copy frame into buffer for gstreamer
-	 */
-
 	/* NOTE: I420 (YUV420P): hardcoded. */
 	size = frame->linesize[0] * frame->size.h
-		+ frame->linesize[1] * frame->size.h * 0.5
-		+ frame->linesize[2] * frame->size.h * 0.5;
+		+ frame->linesize[1] * frame->size.h / 2
+		+ frame->linesize[2] * frame->size.h / 2;
 
-	/* allocate memory; memory is freed within callback of
-	   gst_memory_new_wrapped of gst_video_push */
-	data = g_try_malloc(size);
-	if (!data)
+	/*
+	 * Wrap the frame memory in a gstreamer buffer. The frame belongs
+	 * to the caller, so this function does not return before
+	 * gstreamer has released the buffer.
+	 */
+	wrapped = frame_is_contiguous(frame);
+	if (wrapped) {
+		pthread_mutex_lock(&st->streamer.release.mutex);
+		st->streamer.release.flag = 1;
+		pthread_mutex_unlock(&st->streamer.release.mutex);
+
+		buffer = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY,
+						     frame->data[0], size,
+						     0, size, st,
+						     frame_release_cb);
+	}
+	else {
+		buffer = frame_copy(frame);
+	}
+	if (!buffer)
 		return ENOMEM;
 
-	/* copy content of frame */
-	size = 0;
-	memcpy(&data[size], frame->data[0],
-	       frame->linesize[0] * frame->size.h);
-	size += frame->linesize[0] * frame->size.h;
-	memcpy(&data[size], frame->data[1],
-	       frame->linesize[1] * frame->size.h * 0.5);
-	size += frame->linesize[1] * frame->size.h * 0.5;
-	memcpy(&data[size], frame->data[2],
-	       frame->linesize[2] * frame->size.h * 0.5);
-	size += frame->linesize[2] * frame->size.h * 0.5;
-
-	/* Wrap memory in a gstreamer buffer */
-	buffer = gst_buffer_new();
-	gst_buffer_insert_memory(buffer, -1,
-				 gst_memory_new_wrapped (0, data, size, 0,
-							 size, data, g_free));
-
 	/*
 	 * Push data and EOS into gstreamer.
 	 */
@@ -536,28 +664,26 @@ static int pipeline_push(struct videnc_state *st, const struct vidframe *frame)
 	}
 #endif
 
+ out:
+	if (wrapped) {
+		int e = frame_release_wait(st);
+		if (!err)
+			err = e;
+	}
 
-#if 0
-	/*
-	 * Wait "processing done".
-	 */
-	pthread_mutex_lock(&st->streamer.eos.mutex);
-	if (st->streamer.eos.flag == 0)
-		/* will returns with EOS (1) or error (-1) */
-		pthread_cond_wait(&st->streamer.wait.cond,
-				  &st->streamer.wait.mutex);
-	if (st->streamer.eos.flag == 1)
-		/* reset eos */
-		st->streamer.eos.flag = 0;
-	else
-		/* error */
-		err = -1;
-	pthread_mutex_unlock(&st->streamer.wait.mutex);
-#endif
+	return err;
+}
 
 
- out:
-	return err;
+/**
+ * Select the Gstreamer H.264 encoder element
+ *
+ * @param element x264enc, vaapih264enc or omxh264enc
+ */
+void gst_video1_encoder_element(const char *element)
+{
+	if (str_isset(element))
+		str_ncpy(encoder_element, element, sizeof(encoder_element));
 }
 
 
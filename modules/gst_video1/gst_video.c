@@ -23,6 +23,11 @@
  *
  * Thanks to Victor Sergienko and Fadeev Alexander for the
  * initial version, which was based on avcodec module.
+ *
+ * Example config:
+ \verbatim
+  gst_video1_encoder    x264enc   # x264enc, vaapih264enc or omxh264enc
+ \endverbatim
  */
 
 
@@ -38,8 +43,14 @@ static struct vidcodec h264 = {
 
 static int module_init(void)
 {
+	char element[32] = "";
+
 	gst_init(NULL, NULL);
 
+	if (0 == conf_get_str(conf_cur(), "gst_video1_encoder",
+			      element, sizeof(element)))
+		gst_video1_encoder_element(element);
+
 	vidcodec_register(&h264);
 
 	info("gst_video: using gstreamer (%s)\n", gst_version_string());
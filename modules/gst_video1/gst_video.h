@@ -15,6 +15,7 @@ int gst_video1_encoder_set(struct videnc_state **stp,
 			  videnc_packet_h *pkth, void *arg);
 int gst_video1_encode(struct videnc_state *st, bool update,
 		     const struct vidframe *frame);
+void gst_video1_encoder_element(const char *element);
 
 
 /* SDP */
@@ -169,12 +169,10 @@ int h265_decode(struct viddec_state *vds, struct vidframe *frame,
 
 	mbuf_advance(mb, H265_HDR_SIZE);
 
-#if 0
-	debug("h265: decode: %s type=%2d  %s\n",
-		  h265_is_keyframe(hdr.nal_unit_type) ? "<KEY>" : "     ",
-		  hdr.nal_unit_type,
-		  h265_nalunit_name(hdr.nal_unit_type));
-#endif
+	mod_dbg(h265_log, "h265: decode: %s type=%2d  %s\n",
+		h265_is_keyframe(hdr.nal_unit_type) ? "<KEY>" : "     ",
+		hdr.nal_unit_type,
+		h265_nalunit_name(hdr.nal_unit_type));
 
 	if (vds->frag && hdr.nal_unit_type != H265_NAL_FU) {
 		debug("h265: lost fragments; discarding previous NAL\n");
@@ -195,6 +193,33 @@ int h265_decode(struct viddec_state *vds, struct vidframe *frame,
 		if (err)
 			goto out;
 	}
+	else if (H265_NAL_AP == hdr.nal_unit_type) {
+
+		while (mbuf_get_left(mb) >= 2) {
+
+			const uint16_t len = ntohs(mbuf_read_u16(mb));
+			struct h265_nal nal;
+
+			if (len < H265_HDR_SIZE || len > mbuf_get_left(mb)) {
+				err = EBADMSG;
+				goto out;
+			}
+
+			err = h265_nal_decode(&nal, mbuf_buf(mb));
+			if (err)
+				goto out;
+
+			if (h265_is_keyframe(nal.nal_unit_type))
+				*intra = true;
+
+			err  = mbuf_write_mem(vds->mb, nal_seq, 3);
+			err |= mbuf_write_mem(vds->mb, mbuf_buf(mb), len);
+			if (err)
+				goto out;
+
+			mbuf_advance(mb, len);
+		}
+	}
 	else if (H265_NAL_FU == hdr.nal_unit_type) {
 
 		struct fu fu;
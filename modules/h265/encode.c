@@ -12,6 +12,22 @@
 #include "h265.h"
 
 
+/*
+ * Example config, the defaults are for low latency:
+ *
+ *   h265_preset     ultrafast
+ *   h265_threads    1           # frame threads
+ *   h265_wpp        yes         # wavefront parallel processing
+ *   h265_slices     1
+ *   h265_pools      4           # x265 thread pools, e.g. "4" or "+,-"
+ *   h265_aggregate  yes         # Aggregation Packets (RFC 7798)
+ */
+
+
+enum {
+	AP_HDR_SIZE = H265_HDR_SIZE + 2,  /* header and NAL unit size */
+};
+
 struct videnc_state {
 	struct vidsz size;
 	x265_param *param;
@@ -22,6 +38,14 @@ struct videnc_state {
 	unsigned pktsize;
 	videnc_packet_h *pkth;
 	void *arg;
+
+	/* Aggregation Packet */
+	struct {
+		struct mbuf *mb;
+		unsigned n;
+		unsigned tid;
+		bool enabled;
+	} ap;
 };
 
 
@@ -33,11 +57,51 @@ static void destructor(void *arg)
 		x265_encoder_close(st->x265);
 	if (st->param)
 		x265_param_free(st->param);
+	mem_deref(st->ap.mb);
+}
+
+
+/* Threading and low-latency parameters from the config */
+static int set_threads(x265_param *param)
+{
+	char pools[64] = "";
+	uint32_t threads = 1, slices = 1;
+	bool wpp = true;
+
+	(void)conf_get_u32(conf_cur(), "h265_threads", &threads);
+	(void)conf_get_u32(conf_cur(), "h265_slices", &slices);
+	(void)conf_get_bool(conf_cur(), "h265_wpp", &wpp);
+
+	/* each frame thread adds one frame of latency */
+	param->frameNumThreads  = threads;
+	param->bEnableWavefront = wpp;
+	param->maxSlices        = max(slices, 1u);
+
+	/* no lookahead and no B-frames */
+	param->rc.lookaheadDepth = 0;
+	param->lookaheadSlices   = 0;
+	param->bframes           = 0;
+
+	if (0 == conf_get_str(conf_cur(), "h265_pools", pools, sizeof(pools))
+	    && 0 != x265_param_parse(param, "pools", pools)) {
+
+		warning("h265: invalid pools '%s'\n", pools);
+		return EINVAL;
+	}
+
+	return 0;
 }
 
 
 static int set_params(struct videnc_state *st, unsigned fps, unsigned bitrate)
 {
+	char preset[32] = "ultrafast";
+
+	(void)conf_get_str(conf_cur(), "h265_preset", preset, sizeof(preset));
+
+	if (st->param)
+		x265_param_free(st->param);
+
 	st->param = x265_param_alloc();
 	if (!st->param) {
 		warning("h265: x265_param_alloc failed\n");
@@ -52,12 +116,15 @@ static int set_params(struct videnc_state *st, unsigned fps, unsigned bitrate)
 	}
 
 	if (0 != x265_param_default_preset(st->param,
-					   "ultrafast", "zerolatency")) {
+					   preset, "zerolatency")) {
 
 		warning("h265: x265_param_default_preset error\n");
 		return EINVAL;
 	}
 
+	if (set_threads(st->param))
+		return EINVAL;
+
 	st->param->fpsNum = fps;
 	st->param->fpsDenom = 1;
 
@@ -111,6 +178,18 @@ int h265_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 	ves->pkth    = pkth;
 	ves->arg     = arg;
 
+	ves->ap.enabled = true;
+	(void)conf_get_bool(conf_cur(), "h265_aggregate", &ves->ap.enabled);
+
+	if (ves->ap.enabled &&
+	    (!ves->ap.mb || ves->ap.mb->size < prm->pktsize)) {
+
+		ves->ap.mb = mem_deref(ves->ap.mb);
+		ves->ap.mb = mbuf_alloc(prm->pktsize);
+		if (!ves->ap.mb)
+			return ENOMEM;
+	}
+
 	err = set_params(ves, prm->fps, prm->bitrate);
 	if (err)
 		return err;
@@ -179,6 +258,83 @@ static inline int packetize(bool marker, const uint8_t *buf, size_t len,
 }
 
 
+static void ap_reset(struct videnc_state *st)
+{
+	st->ap.mb->pos = H265_HDR_SIZE;
+	st->ap.mb->end = H265_HDR_SIZE;
+	st->ap.n   = 0;
+	st->ap.tid = 7;
+}
+
+
+/* Send the aggregated NAL units, a single one is sent as it is */
+static int ap_flush(struct videnc_state *st, bool marker)
+{
+	struct mbuf *mb = st->ap.mb;
+	int err = 0;
+
+	if (st->ap.n == 1) {
+		err = st->pkth(marker, NULL, 0, mb->buf + AP_HDR_SIZE,
+			       mb->end - AP_HDR_SIZE, st->arg);
+	}
+	else if (st->ap.n > 1) {
+		h265_nal_encode(mb->buf, H265_NAL_AP, st->ap.tid);
+
+		err = st->pkth(marker, NULL, 0, mb->buf, mb->end, st->arg);
+	}
+
+	ap_reset(st);
+
+	return err;
+}
+
+
+/*
+ * Small NAL units, like VPS, SPS, PPS and SEI, are sent together in
+ * Aggregation Packets (RFC 7798 4.4.2). Larger ones are sent with
+ * packetize().
+ */
+static int ap_packetize(struct videnc_state *st, bool marker,
+			const uint8_t *buf, size_t len)
+{
+	struct mbuf *mb = st->ap.mb;
+	struct h265_nal nal;
+	int err;
+
+	if (len < H265_HDR_SIZE)
+		return EBADMSG;
+
+	if (mb->end + 2 + len > st->pktsize) {
+
+		err = ap_flush(st, false);
+		if (err)
+			return err;
+
+		if (H265_HDR_SIZE + 2 + len > st->pktsize) {
+			return packetize(marker, buf, len, st->pktsize,
+					 st->pkth, st->arg);
+		}
+	}
+
+	err = h265_nal_decode(&nal, buf);
+	if (err)
+		return err;
+
+	err  = mbuf_write_u16(mb, htons((uint16_t)len));
+	err |= mbuf_write_mem(mb, buf, len);
+	if (err)
+		return err;
+
+	++st->ap.n;
+	st->ap.tid = min(st->ap.tid, nal.nuh_temporal_id_plus1);
+
+	if (marker)
+		return ap_flush(st, true);
+
+	return 0;
+}
+
+
 int h265_encode(struct videnc_state *st, bool update,
 		const struct vidframe *frame)
 {
@@ -246,6 +402,9 @@ int h265_encode(struct videnc_state *st, bool update,
 	if (n <= 0)
 		goto out;
 
+	if (st->ap.enabled)
+		ap_reset(st);
+
 	for (i=0; i<nalc; i++) {
 
 		x265_nal *nal = &nalv[i];
@@ -253,11 +412,9 @@ int h265_encode(struct videnc_state *st, bool update,
 		size_t len = nal->sizeBytes;
 		bool marker;
 
-#if 0
-		debug("h265: encode: %s type=%2d  %s\n",
-			  h265_is_keyframe(nal->type) ? "<KEY>" : "     ",
-			  nal->type, h265_nalunit_name(nal->type));
-#endif
+		mod_dbg(h265_log, "h265: encode: %s type=%2d  %s\n",
+			h265_is_keyframe(nal->type) ? "<KEY>" : "     ",
+			nal->type, h265_nalunit_name(nal->type));
 
 		h265_skip_startcode(&p, &len);
 
@@ -265,8 +422,13 @@ int h265_encode(struct videnc_state *st, bool update,
 
 		marker = (i+1)==nalc;  /* last NAL */
 
-		err = packetize(marker, p, len, st->pktsize,
-				st->pkth, st->arg);
+		if (st->ap.enabled) {
+			err = ap_packetize(st, marker, p, len);
+		}
+		else {
+			err = packetize(marker, p, len, st->pktsize,
+					st->pkth, st->arg);
+		}
 		if (err)
 			goto out;
 	}
@@ -28,6 +28,8 @@
  */
 
 
+struct log_mod h265_log = LOG_MOD_INIT("h265");
+
 static struct vidcodec h265 = {
 	.name      = "H265",
 	.fmtp      = "profile-id=1",
@@ -46,6 +48,7 @@ static int module_init(void)
 	avcodec_register_all();
 
 	vidcodec_register(&h265);
+	log_mod_register(&h265_log);
 
 	return 0;
 }
@@ -53,6 +56,7 @@ static int module_init(void)
 
 static int module_close(void)
 {
+	log_mod_unregister(&h265_log);
 	vidcodec_unregister(&h265);
 
 	return 0;
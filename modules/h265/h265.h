@@ -56,6 +56,8 @@ bool h265_is_keyframe(enum h265_naltype type);
 const char *h265_nalunit_name(enum h265_naltype type);
 
 
+extern struct log_mod h265_log;
+
 /* encoder */
 int h265_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 		       struct videnc_param *prm, const char *fmtp,
@@ -0,0 +1,316 @@
+/**
+ * @file api.c  JSON control API and event stream for the webserver UI
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#include "httpd.h"
+
+
+/*
+ * The state is printed as JSON straight into the HTTP response:
+ *
+ *   GET /api/uas      User-Agents
+ *   GET /api/calls    Calls and their state
+ *   GET /api/streams  Calls with the statistics of their streams
+ *   GET /api/events   WebSocket that pushes the UA events, and with
+ *                     ?stats=<seconds> the streams periodically
+ *
+ * A client subscribes to the events once, instead of polling.
+ */
+
+
+enum {
+	KEEPALIVE = 30000,      /* WebSocket ping interval [ms]  */
+	STATS_MIN = 1,          /* Minimum stats interval [s]    */
+};
+
+struct walk {
+	int (*printh)(struct re_printf *pf, const struct call *call);
+};
+
+struct client {
+	struct le le;
+	struct websock_conn *wc;
+	struct tmr tmr;
+	uint32_t stats;         /* Stats interval [s], 0 = off   */
+};
+
+static struct websock *websock;
+static struct list clientl;
+
+
+static int json_str_print(struct re_printf *pf, const char *str)
+{
+	const char *p, *start = str;
+	int err = 0;
+
+	if (!str)
+		return re_hprintf(pf, "null");
+
+	err |= re_hprintf(pf, "\"");
+
+	for (p = str; *p; p++) {
+
+		if (*p != '"' && *p != '\\' && (unsigned char)*p >= 0x20)
+			continue;
+
+		err |= pf->vph(start, p - start, pf->arg);
+
+		if (*p == '"' || *p == '\\')
+			err |= re_hprintf(pf, "\\%c", *p);
+		else
+			err |= re_hprintf(pf, "\\u%04x", (unsigned char)*p);
+
+		start = p + 1;
+	}
+
+	err |= pf->vph(start, p - start, pf->arg);
+	err |= re_hprintf(pf, "\"");
+
+	return err;
+}
+
+
+static int uas_print(struct re_printf *pf, void *unused)
+{
+	struct le *le;
+	int err;
+	(void)unused;
+
+	err = re_hprintf(pf, "[");
+
+	for (le = list_head(uag_list()); le; le = le->next) {
+
+		const struct ua *ua = le->data;
+
+		err |= re_hprintf(pf, "%s{\"aor\":%H,\"registered\":%s,"
+				  "\"calls\":%u}",
+				  le == list_head(uag_list()) ? "" : ",",
+				  json_str_print, ua_aor(ua),
+				  ua_isregistered(ua) ? "true" : "false",
+				  list_count(ua_calls(ua)));
+	}
+
+	err |= re_hprintf(pf, "]");
+
+	return err;
+}
+
+
+static int call_print(struct re_printf *pf, const struct call *call)
+{
+	return re_hprintf(pf, "{\"ua\":%H,\"line\":%u,\"call_id\":%H,"
+			  "\"state\":\"%s\",\"dir\":\"%s\",\"peer\":%H,"
+			  "\"duration\":%u,\"onhold\":%s}",
+			  json_str_print, ua_aor(call_get_ua(call)),
+			  call_linenum(call),
+			  json_str_print, call_id(call),
+			  call_statename(call),
+			  call_is_outgoing(call) ? "out" : "in",
+			  json_str_print, call_peeruri(call),
+			  call_duration(call),
+			  call_is_onhold(call) ? "true" : "false");
+}
+
+
+static int stream_print(struct re_printf *pf, const struct call *call)
+{
+	return re_hprintf(pf, "{\"ua\":%H,\"line\":%u,\"call\":%H}",
+			  json_str_print, ua_aor(call_get_ua(call)),
+			  call_linenum(call),
+			  call_stats_json, call);
+}
+
+
+static const struct walk walk_calls   = {call_print};
+static const struct walk walk_streams = {stream_print};
+
+
+/* walk all calls of all User-Agents */
+static int calls_print(struct re_printf *pf, const struct walk *walk)
+{
+	struct le *leu, *lec;
+	bool first = true;
+	int err;
+
+	err = re_hprintf(pf, "[");
+
+	for (leu = list_head(uag_list()); leu; leu = leu->next) {
+
+		const struct ua *ua = leu->data;
+
+		for (lec = list_head(ua_calls(ua)); lec; lec = lec->next) {
+
+			err |= re_hprintf(pf, "%s", first ? "" : ",");
+			err |= walk->printh(pf, lec->data);
+			first = false;
+		}
+	}
+
+	err |= re_hprintf(pf, "]");
+
+	return err;
+}
+
+
+static void client_destructor(void *arg)
+{
+	struct client *cli = arg;
+
+	tmr_cancel(&cli->tmr);
+	list_unlink(&cli->le);
+	mem_deref(cli->wc);
+}
+
+
+static void stats_handler(void *arg)
+{
+	struct client *cli = arg;
+	int err;
+
+	tmr_start(&cli->tmr, cli->stats * 1000, stats_handler, cli);
+
+	err = websock_send(cli->wc, WEBSOCK_TEXT,
+			   "{\"event\":\"STATS\",\"streams\":%H}",
+			   calls_print, &walk_streams);
+	if (err)
+		warning("httpd: api: could not send stats (%m)\n", err);
+}
+
+
+static void recv_handler(const struct websock_hdr *hdr, struct mbuf *mb,
+			 void *arg)
+{
+	(void)hdr;
+	(void)mb;
+	(void)arg;
+
+	/* commands are given with the HTTP requests */
+}
+
+
+static void close_handler(int err, void *arg)
+{
+	struct client *cli = arg;
+
+	info("httpd: api: event client closed (%m)\n", err);
+
+	mem_deref(cli);
+}
+
+
+static void events_accept(struct http_conn *conn, const struct http_msg *msg)
+{
+	struct client *cli;
+	struct pl pl;
+	int err;
+
+	cli = mem_zalloc(sizeof(*cli), client_destructor);
+	if (!cli) {
+		http_ereply(conn, 500, "Server Error");
+		return;
+	}
+
+	if (0 == re_regex(msg->prm.p, msg->prm.l, "stats=[0-9]+", &pl))
+		cli->stats = max(pl_u32(&pl), (uint32_t)STATS_MIN);
+
+	err = websock_accept(&cli->wc, websock, conn, msg, KEEPALIVE,
+			     recv_handler, close_handler, cli);
+	if (err) {
+		warning("httpd: api: websocket accept failed (%m)\n", err);
+		http_ereply(conn, 400, "Bad Request");
+		mem_deref(cli);
+		return;
+	}
+
+	list_append(&clientl, &cli->le, cli);
+
+	if (cli->stats)
+		tmr_start(&cli->tmr, cli->stats * 1000, stats_handler, cli);
+}
+
+
+static void ua_event_handler(struct ua *ua, enum ua_event ev,
+			     struct call *call, const char *prm, void *arg)
+{
+	struct le *le;
+	(void)arg;
+
+	for (le = list_head(&clientl); le; ) {
+
+		struct client *cli = le->data;
+		int err;
+
+		le = le->next;
+
+		err = websock_send(cli->wc, WEBSOCK_TEXT,
+				   "{\"event\":\"%s\",\"ua\":%H,\"line\":%u,"
+				   "\"call_id\":%H,\"param\":%H}",
+				   uag_event_str(ev),
+				   json_str_print, ua ? ua_aor(ua) : NULL,
+				   call ? call_linenum(call) : 0,
+				   json_str_print, call ? call_id(call) : NULL,
+				   json_str_print, prm);
+		if (err) {
+			warning("httpd: api: event send failed (%m)\n", err);
+			mem_deref(cli);
+		}
+	}
+}
+
+
+/**
+ * Handle a request to the JSON API
+ *
+ * @param conn HTTP connection
+ * @param msg  HTTP request, with a path starting with /api/
+ */
+void api_request(struct http_conn *conn, const struct http_msg *msg)
+{
+	static const char *ctype = "application/json;charset=utf-8";
+
+	if (0 == pl_strcasecmp(&msg->path, "/api/uas")) {
+
+		http_creply(conn, 200, "OK", ctype, "%H", uas_print, NULL);
+	}
+	else if (0 == pl_strcasecmp(&msg->path, "/api/calls")) {
+
+		http_creply(conn, 200, "OK", ctype,
+			    "%H", calls_print, &walk_calls);
+	}
+	else if (0 == pl_strcasecmp(&msg->path, "/api/streams")) {
+
+		http_creply(conn, 200, "OK", ctype,
+			    "%H", calls_print, &walk_streams);
+	}
+	else if (0 == pl_strcasecmp(&msg->path, "/api/events")) {
+
+		events_accept(conn, msg);
+	}
+	else {
+		http_ereply(conn, 404, "Not Found");
+	}
+}
+
+
+int api_init(void)
+{
+	int err;
+
+	err = websock_alloc(&websock, NULL, NULL);
+	if (err)
+		return err;
+
+	return uag_event_register(ua_event_handler, NULL);
+}
+
+
+void api_close(void)
+{
+	uag_event_unregister(ua_event_handler);
+
+	list_flush(&clientl);
+	websock = mem_deref(websock);
+}
@@ -0,0 +1,12 @@
+/**
+ * @file httpd.h  Webserver UI module -- internal interface
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+
+int metrics_print(struct re_printf *pf, void *unused);
+
+int  api_init(void);
+void api_close(void);
+void api_request(struct http_conn *conn, const struct http_msg *msg);
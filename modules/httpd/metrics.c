@@ -0,0 +1,489 @@
+/**
+ * @file metrics.c  OpenMetrics exporter for the webserver UI
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#include "httpd.h"
+
+
+/*
+ * The samples are printed straight into the HTTP response, without
+ * building any strings per call. OpenMetrics requires the samples of
+ * a metric family to be contiguous, so all streams are walked once per
+ * family and their statistics are read again each time.
+ */
+
+
+enum field {
+	F_PACKETS,
+	F_BYTES,
+	F_ERRORS,
+	F_BITRATE,
+	F_LOST,
+	F_JITTER,
+	F_RTT,
+	F_MOS,
+	F_JBUF_DELAY,
+	F_JBUF_OVERFLOW,
+	F_JBUF_UNDERFLOW,
+	F_SYNC_OFFSET,
+	F_SYNC_DELAY,
+	F_SAMPLES,
+	F_CONCEALED,
+	F_SENDQ_AGE,
+	F_SENDQ_DROP,
+};
+
+struct family {
+	enum field field;
+	const char *name;
+	const char *type;
+	const char *help;
+	bool dir;               /* one sample for each direction */
+};
+
+static const struct family familyv[] = {
+	{F_PACKETS, "baresip_stream_packets", "counter",
+	 "Number of RTP packets", true},
+	{F_BYTES, "baresip_stream_bytes", "counter",
+	 "Number of RTP payload bytes", true},
+	{F_ERRORS, "baresip_stream_errors", "counter",
+	 "Number of send or receive errors", true},
+	{F_BITRATE, "baresip_stream_bitrate_bps", "gauge",
+	 "Current bitrate in bits per second", true},
+	{F_LOST, "baresip_stream_packets_lost", "gauge",
+	 "Cumulative packets lost, from RTCP", true},
+	{F_JITTER, "baresip_stream_jitter_seconds", "gauge",
+	 "Interarrival jitter, from RTCP", true},
+	{F_RTT, "baresip_stream_rtt_seconds", "gauge",
+	 "Round-trip time, from RTCP", false},
+	{F_MOS, "baresip_stream_mos", "gauge",
+	 "Pseudo mean opinion score of the received media", false},
+	{F_JBUF_DELAY, "baresip_jbuf_delay_seconds", "gauge",
+	 "Jitter buffer delay", false},
+	{F_JBUF_OVERFLOW, "baresip_jbuf_overflow", "counter",
+	 "Number of jitter buffer overflows", false},
+	{F_JBUF_UNDERFLOW, "baresip_jbuf_underflow", "counter",
+	 "Number of jitter buffer underflows", false},
+	{F_SYNC_OFFSET, "baresip_sync_offset_seconds", "gauge",
+	 "Lip-sync error, positive if the video is late", false},
+	{F_SYNC_DELAY, "baresip_sync_delay_seconds", "gauge",
+	 "Playout delay added for lip-sync", false},
+	{F_SAMPLES, "baresip_audio_samples", "counter",
+	 "Number of audio samples decoded", false},
+	{F_CONCEALED, "baresip_audio_concealed_samples", "counter",
+	 "Number of decoded audio samples that were concealed", false},
+	{F_SENDQ_AGE, "baresip_video_sendq_age_seconds", "gauge",
+	 "Age of the oldest packet in the video send queue", false},
+	{F_SENDQ_DROP, "baresip_video_sendq_dropped_frames", "counter",
+	 "Number of video frames dropped from the send queue", false},
+};
+
+
+/* Label value, escaped as specified by OpenMetrics */
+static int label_print(struct re_printf *pf, const char *str)
+{
+	const char *p, *start = str;
+	int err = 0;
+
+	if (!str)
+		return 0;
+
+	for (p = str; *p; p++) {
+
+		const char *esc;
+
+		switch (*p) {
+
+		case '\\': esc = "\\\\"; break;
+		case '"':  esc = "\\\""; break;
+		case '\n': esc = "\\n";  break;
+		default:   continue;
+		}
+
+		err |= pf->vph(start, p - start, pf->arg);
+		err |= re_hprintf(pf, "%s", esc);
+		start = p + 1;
+	}
+
+	err |= pf->vph(start, p - start, pf->arg);
+
+	return err;
+}
+
+
+static int labels_print(struct re_printf *pf, const struct ua *ua,
+			const struct call *call,
+			const struct stream_stats *st, const char *dir)
+{
+	int err;
+
+	err = re_hprintf(pf, "{ua=\"%H\",line=\"%u\",media=\"%H\"",
+			 label_print, ua_aor(ua), call_linenum(call),
+			 label_print, st->media);
+	if (dir)
+		err |= re_hprintf(pf, ",dir=\"%s\"", dir);
+
+	err |= re_hprintf(pf, "}");
+
+	return err;
+}
+
+
+static int value_print(struct re_printf *pf, enum field field,
+		       const struct stream_stats *st,
+		       const struct stream_dir_stats *ds)
+{
+	double mos;
+
+	switch (field) {
+
+	case F_PACKETS:
+		return re_hprintf(pf, "%llu", ds->packets);
+
+	case F_BYTES:
+		return re_hprintf(pf, "%llu", ds->bytes);
+
+	case F_ERRORS:
+		return re_hprintf(pf, "%llu", ds->errors);
+
+	case F_BITRATE:
+		return re_hprintf(pf, "%u", ds->bitrate);
+
+	case F_LOST:
+		return re_hprintf(pf, "%d", ds->lost);
+
+	case F_JITTER:
+		return re_hprintf(pf, "%.6f", ds->jitter / 1000000.0);
+
+	case F_RTT:
+		return re_hprintf(pf, "%.6f", st->rtt / 1000000.0);
+
+	case F_MOS:
+		if (st->mos_valid)
+			return re_hprintf(pf, "%.2f", st->mos);
+
+		mos = mos_calculate(NULL, st->rtt / 1000.0,
+				    st->rx.jitter / 1000.0,
+				    st->rx.lost > 0 ? st->rx.lost : 0);
+		return re_hprintf(pf, "%.2f", mos);
+
+	case F_JBUF_DELAY:
+		return re_hprintf(pf, "%.3f", st->jbuf_delay / 1000.0);
+
+	case F_JBUF_OVERFLOW:
+		return re_hprintf(pf, "%u", st->jbuf_overflow);
+
+	case F_JBUF_UNDERFLOW:
+		return re_hprintf(pf, "%u", st->jbuf_underflow);
+
+	case F_SYNC_OFFSET:
+		return re_hprintf(pf, "%.3f", st->sync_offset / 1000.0);
+
+	case F_SYNC_DELAY:
+		return re_hprintf(pf, "%.3f", st->sync_delay / 1000.0);
+
+	case F_SAMPLES:
+		return re_hprintf(pf, "%llu", st->samples);
+
+	case F_CONCEALED:
+		return re_hprintf(pf, "%llu", st->concealed);
+
+	case F_SENDQ_AGE:
+		return re_hprintf(pf, "%.3f", st->sendq_age / 1000.0);
+
+	case F_SENDQ_DROP:
+		return re_hprintf(pf, "%llu", st->sendq_drop);
+	}
+
+	return 0;
+}
+
+
+static int sample_print(struct re_printf *pf, const struct family *fam,
+			const struct ua *ua, const struct call *call,
+			const struct stream_stats *st, const char *dir,
+			const struct stream_dir_stats *ds)
+{
+	bool counter = !str_cmp(fam->type, "counter");
+	int err;
+
+	err  = re_hprintf(pf, "%s%s", fam->name, counter ? "_total" : "");
+	err |= labels_print(pf, ua, call, st, dir);
+	err |= re_hprintf(pf, " ");
+	err |= value_print(pf, fam->field, st, ds);
+	err |= re_hprintf(pf, "\n");
+
+	return err;
+}
+
+
+static int family_print(struct re_printf *pf, const struct family *fam)
+{
+	struct le *leu, *lec, *les;
+	int err;
+
+	err = re_hprintf(pf, "# TYPE %s %s\n# HELP %s %s\n",
+			 fam->name, fam->type, fam->name, fam->help);
+
+	for (leu = list_head(uag_list()); leu; leu = leu->next) {
+
+		const struct ua *ua = leu->data;
+
+		for (lec = list_head(ua_calls(ua)); lec; lec = lec->next) {
+
+			const struct call *call = lec->data;
+
+			les = list_head(call_streaml(call));
+			for (; les; les = les->next) {
+
+				struct stream_stats st;
+
+				if (stream_stats(les->data, &st))
+					continue;
+
+				if (fam->field >= F_SENDQ_AGE) {
+					if (!st.sendq)
+						continue;
+				}
+				else if (fam->field >= F_SAMPLES) {
+					if (!st.plc)
+						continue;
+				}
+				else if (fam->field >= F_SYNC_OFFSET) {
+					if (!st.sync)
+						continue;
+				}
+				else if (fam->field >= F_JBUF_DELAY &&
+					 !st.jbuf) {
+					continue;
+				}
+
+				if (!fam->dir) {
+					err |= sample_print(pf, fam, ua, call,
+							    &st, NULL, NULL);
+					continue;
+				}
+
+				err |= sample_print(pf, fam, ua, call, &st,
+						    "tx", &st.tx);
+				err |= sample_print(pf, fam, ua, call, &st,
+						    "rx", &st.rx);
+			}
+		}
+	}
+
+	return err;
+}
+
+
+/* The quality of the network paths, from the probe module */
+static int pathq_print(struct re_printf *pf)
+{
+	static const struct {
+		const char *name;
+		const char *help;
+	} pfamv[] = {
+		{"baresip_path_loss_ratio", "Probe loss in the last window"},
+		{"baresip_path_rtt_seconds", "Round-trip time of the probes"},
+		{"baresip_path_jitter_seconds", "Variation of the round-trip"
+		 " time"},
+		{"baresip_path_mos", "Pseudo mean opinion score of the path"},
+	};
+	struct le *le;
+	size_t i;
+	int err = 0;
+
+	if (list_isempty(pathq_list()))
+		return 0;
+
+	for (i=0; i<ARRAY_SIZE(pfamv); i++) {
+
+		err |= re_hprintf(pf, "# TYPE %s gauge\n# HELP %s %s\n",
+				  pfamv[i].name, pfamv[i].name,
+				  pfamv[i].help);
+
+		for (le = list_head(pathq_list()); le; le = le->next) {
+
+			const struct pathq *pq = le->data;
+			double v;
+
+			if (!pq->valid)
+				continue;
+
+			switch (i) {
+
+			case 0:  v = pq->loss / 100.0;       break;
+			case 1:  v = pq->rtt / 1000000.0;    break;
+			case 2:  v = pq->jitter / 1000000.0; break;
+			default: v = pq->mos;                break;
+			}
+
+			err |= re_hprintf(pf, "%s{path=\"%H\"} %.6f\n",
+					  pfamv[i].name, label_print,
+					  pq->name, v);
+		}
+	}
+
+	return err;
+}
+
+
+/* The memory of each module and core subsystem, from the memory tags */
+static int memtag_print(struct re_printf *pf)
+{
+	static const struct {
+		const char *name;
+		const char *type;
+		const char *help;
+	} mfamv[] = {
+		{"baresip_memory_bytes", "gauge",
+		 "Live bytes of the objects of a module"},
+		{"baresip_memory_peak_bytes", "gauge",
+		 "Largest number of live bytes of a module"},
+		{"baresip_memory_objects", "gauge",
+		 "Live objects of a module"},
+		{"baresip_memory_allocations", "counter",
+		 "Number of objects allocated by a module"},
+	};
+	struct le *le;
+	size_t i;
+	int err = 0;
+
+	for (i=0; i<ARRAY_SIZE(mfamv); i++) {
+
+		err |= re_hprintf(pf, "# TYPE %s %s\n# HELP %s %s\n",
+				  mfamv[i].name, mfamv[i].type,
+				  mfamv[i].name, mfamv[i].help);
+
+		for (le = list_head(memtag_list()); le; le = le->next) {
+
+			const struct memtag *tag = le->data;
+			uint64_t v;
+
+			if (!tag->n_alloc)
+				continue;
+
+			switch (i) {
+
+			case 0:  v = tag->bytes;                 break;
+			case 1:  v = tag->peak;                  break;
+			case 2:  v = tag->n_alloc - tag->n_free; break;
+			default: v = tag->n_alloc;               break;
+			}
+
+			err |= re_hprintf(pf, "%s%s{tag=\"%H\"} %llu\n",
+					  mfamv[i].name,
+					  i == 3 ? "_total" : "",
+					  label_print, tag->name, v);
+		}
+	}
+
+	return err;
+}
+
+
+/* The headroom of each resource that has a capacity, for load balancers */
+static int admit_print(struct re_printf *pf)
+{
+	static const char *namev[] = {"cpu", "bandwidth", "ports"};
+	uint32_t usedv[3], capv[3];
+	struct admit_stat st;
+	size_t i;
+	int err;
+
+	if (admit_stats(&st))
+		return 0;
+
+	usedv[0] = st.used.cpu;    capv[0] = st.capacity.cpu;
+	usedv[1] = st.used.kbps;   capv[1] = st.capacity.kbps;
+	usedv[2] = st.used.ports;  capv[2] = st.capacity.ports;
+
+	err = re_hprintf(pf,
+			 "# TYPE baresip_admit_headroom_ratio gauge\n"
+			 "# HELP baresip_admit_headroom_ratio Part of a"
+			 " resource that is left for new calls\n");
+
+	for (i=0; i<ARRAY_SIZE(namev); i++) {
+
+		if (!capv[i])
+			continue;
+
+		err |= re_hprintf(pf, "baresip_admit_headroom_ratio"
+				  "{resource=\"%s\"} %.3f\n", namev[i],
+				  usedv[i] >= capv[i] ? 0.0 :
+				  1.0 - (double)usedv[i] / capv[i]);
+	}
+
+	err |= re_hprintf(pf,
+			  "# TYPE baresip_admit_calls counter\n"
+			  "# HELP baresip_admit_calls Admission decisions"
+			  " for new calls\n"
+			  "baresip_admit_calls_total{result=\"accept\"} %u\n"
+			  "baresip_admit_calls_total{result=\"audio\"} %u\n"
+			  "baresip_admit_calls_total{result=\"reject\"} %u\n",
+			  st.n_accept, st.n_audio, st.n_reject);
+
+	return err;
+}
+
+
+static uint32_t call_count(void)
+{
+	struct le *le;
+	uint32_t n = 0;
+
+	for (le = list_head(uag_list()); le; le = le->next)
+		n += list_count(ua_calls(le->data));
+
+	return n;
+}
+
+
+/**
+ * Print the metrics of all calls in OpenMetrics text format
+ *
+ * @param pf     Print handler
+ * @param unused Unused
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int metrics_print(struct re_printf *pf, void *unused)
+{
+	struct rtpport_stat ps;
+	size_t i;
+	int err;
+	(void)unused;
+
+	err = re_hprintf(pf, "# TYPE baresip_calls gauge\n"
+			 "# HELP baresip_calls Number of active calls\n"
+			 "baresip_calls %u\n", call_count());
+
+	if (!rtpport_stats(&ps)) {
+		err |= re_hprintf(pf,
+			"# TYPE baresip_rtp_ports_free gauge\n"
+			"# HELP baresip_rtp_ports_free Free local RTP ports\n"
+			"baresip_rtp_ports_free %u\n"
+			"# TYPE baresip_rtp_ports gauge\n"
+			"# HELP baresip_rtp_ports Local RTP ports in the pool\n"
+			"baresip_rtp_ports %u\n"
+			"# TYPE baresip_rtp_port_bind_failures counter\n"
+			"# HELP baresip_rtp_port_bind_failures Ports in use"
+			" by other programs\n"
+			"baresip_rtp_port_bind_failures_total %u\n",
+			ps.free, ps.total, ps.n_bind_fail);
+	}
+
+	for (i=0; i<ARRAY_SIZE(familyv); i++)
+		err |= family_print(pf, &familyv[i]);
+
+	err |= admit_print(pf);
+	err |= pathq_print(pf);
+	err |= memtag_print(pf);
+
+	err |= re_hprintf(pf, "# EOF\n");
+
+	return err;
+}
@@ -5,6 +5,8 @@
 #
 
 MOD		:= httpd
+$(MOD)_SRCS	+= api.c
 $(MOD)_SRCS	+= httpd.c
+$(MOD)_SRCS	+= metrics.c
 
 include mk/mod.mk
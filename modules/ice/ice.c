@@ -25,7 +25,16 @@
   ice_debug       {yes,no}             # Enable ICE debugging/tracing
   ice_nomination  {regular,aggressive} # Regular or aggressive nomination
   ice_mode        {full,lite}          # Full ICE-mode or ICE-lite
+  ice_trickle     {yes,no}             # Trickle candidates (RFC 8838)
+  ice_rto         100                  # Check retransmit timeout [ms]
+  ice_rc          7                    # Check retransmit count
  \endverbatim
+ *
+ * With trickle enabled the offer or answer is sent as soon as the host
+ * candidates are known. The STUN/TURN candidates of all media streams
+ * are gathered at the same time, and are sent to the peer in SIP INFO
+ * requests (RFC 8840) when they arrive. Peers that do not announce
+ * trickle support get a Re-INVITE with the complete candidates instead.
  */
 
 
@@ -40,6 +49,12 @@ struct mnat_sess {
 	int mediac;
 	bool started;
 	bool send_reinvite;
+	bool trickle;            /**< Trickle local candidates           */
+	bool rtrickle;           /**< Peer announced trickle support     */
+	bool rknown;             /**< Got the SDP of the peer            */
+	struct tmr tmr_trickle;
+	mnat_sdpfrag_h *fragh;
+	void *fragarg;
 	mnat_estab_h *estabh;
 	void *arg;
 };
@@ -54,6 +69,9 @@ struct mnat_media {
 	struct sdp_media *sdpm;
 	struct icem *icem;
 	bool complete;
+	bool gathered;           /**< Server candidates are gathered     */
+	uint64_t ts_check;       /**< Connectivity checks started        */
+	bool sent;               /**< Trickled to the peer               */
 };
 
 
@@ -63,16 +81,23 @@ static struct {
 	enum ice_nomination nom;
 	bool turn;
 	bool debug;
+	bool trickle;
+	uint32_t rto;
+	uint32_t rc;
 } ice = {
 	ICE_MODE_FULL,
 	ICE_NOMINATION_REGULAR,
 	true,
-	false
+	false,
+	false,
+	0,
+	0
 };
 
 
 static void gather_handler(int err, uint16_t scode, const char *reason,
 			   void *arg);
+static void trickle_gathered(struct mnat_sess *sess);
 
 
 static bool is_cellular(const struct sa *laddr)
@@ -117,6 +142,7 @@ static void session_destructor(void *arg)
 {
 	struct mnat_sess *sess = arg;
 
+	tmr_cancel(&sess->tmr_trickle);
 	list_flush(&sess->medial);
 	mem_deref(sess->dnsq);
 	mem_deref(sess->user);
@@ -211,8 +237,6 @@ static int media_start(struct mnat_sess *sess, struct mnat_media *m)
 {
 	int err = 0;
 
-	net_if_apply(if_handler, m);
-
 	switch (ice.mode) {
 
 	default:
@@ -267,6 +291,21 @@ static void dns_handler(int err, const struct sa *srv, void *arg)
 	return;
 
  out:
+	/* a trickling session goes on with its host candidates */
+	if (sess->trickle) {
+		warning("ice: trickle: no %s-server (%m)\n",
+			ice.turn ? "TURN" : "STUN", err);
+
+		LIST_FOREACH(&sess->medial, le) {
+			struct mnat_media *m = le->data;
+
+			m->gathered = true;
+		}
+
+		trickle_gathered(sess);
+		return;
+	}
+
 	sess->estabh(err, 0, NULL, sess->arg);
 }
 
@@ -307,6 +346,10 @@ static int session_alloc(struct mnat_sess **sessp, struct dnsc *dnsc,
 
 	ice_conf(sess->ice)->nom   = ice.nom;
 	ice_conf(sess->ice)->debug = ice.debug;
+	if (ice.rto)
+		ice_conf(sess->ice)->rto = ice.rto;
+	if (ice.rc)
+		ice_conf(sess->ice)->rc = ice.rc;
 
 	if (ICE_MODE_LITE == ice.mode) {
 		err |= sdp_session_set_lattr(ss, true,
@@ -410,11 +453,161 @@ static bool refresh_laddr(struct mnat_media *m,
 }
 
 
+static bool media_gathered(const struct mnat_sess *sess)
+{
+	struct le *le;
+
+	LIST_FOREACH(&sess->medial, le) {
+		const struct mnat_media *m = le->data;
+
+		if (!m->gathered)
+			return false;
+	}
+
+	return true;
+}
+
+
+static bool media_complete(const struct mnat_sess *sess)
+{
+	struct le *le;
+
+	LIST_FOREACH(&sess->medial, le) {
+		const struct mnat_media *m = le->data;
+
+		if (!m->complete)
+			return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * Send the candidates of the gathered media streams in one SDP
+ * fragment (RFC 8840). The candidates that the peer already has are
+ * sent again, which the peer ignores as redundant.
+ */
+static void trickle_send(struct mnat_sess *sess)
+{
+	struct mbuf *mb;
+	struct le *le;
+	unsigned n = 0;
+	int err;
+
+	if (!sess->fragh)
+		return;
+
+	LIST_FOREACH(&sess->medial, le) {
+		const struct mnat_media *m = le->data;
+
+		if (m->gathered && !m->sent)
+			++n;
+	}
+
+	if (!n)
+		return;
+
+	mb = mbuf_alloc(1024);
+	if (!mb)
+		return;
+
+	err = mbuf_printf(mb, "a=%s:%s\r\na=%s:%s\r\n",
+			  ice_attr_ufrag, ice_ufrag(sess->ice),
+			  ice_attr_pwd, ice_pwd(sess->ice));
+
+	LIST_FOREACH(&sess->medial, le) {
+		struct mnat_media *m = le->data;
+		struct le *lc;
+
+		if (!m->gathered || m->sent)
+			continue;
+
+		err |= mbuf_printf(mb, "m=%s 9 %s 0\r\na=mid:%s\r\n",
+				   sdp_media_name(m->sdpm),
+				   sdp_media_proto(m->sdpm),
+				   sdp_media_name(m->sdpm));
+
+		LIST_FOREACH(icem_lcandl(m->icem), lc) {
+			err |= mbuf_printf(mb, "a=%s:%H\r\n", ice_attr_cand,
+					   ice_cand_encode, lc->data);
+		}
+
+		m->sent = true;
+	}
+
+	if (media_gathered(sess))
+		err |= mbuf_printf(mb, "a=end-of-candidates\r\n");
+
+	if (err)
+		goto out;
+
+	mb->pos = 0;
+	err = sess->fragh(mb, sess->fragarg);
+	if (err) {
+		warning("ice: trickle: could not send candidates (%m)\n",
+			err);
+	}
+
+ out:
+	mem_deref(mb);
+}
+
+
+/*
+ * The server candidates of a trickling session are on their way, send
+ * them now if the peer can take them, or else update the peer with a
+ * Re-INVITE when the connectivity checks are done.
+ */
+static void trickle_gathered(struct mnat_sess *sess)
+{
+	if (!sess->rknown)
+		return;
+
+	if (sess->rtrickle) {
+		trickle_send(sess);
+		return;
+	}
+
+	if (!media_gathered(sess))
+		return;
+
+	if (sess->started && media_complete(sess)) {
+
+		info("ice: peer does not trickle -- sending Re-INVITE\n");
+		sess->estabh(0, 0, NULL, sess->arg);
+	}
+	else {
+		sess->send_reinvite = true;
+	}
+}
+
+
 static void gather_handler(int err, uint16_t scode, const char *reason,
 			   void *arg)
 {
 	struct mnat_media *m = arg;
 
+	/* the offer was sent with the host candidates already */
+	if (m->sess->trickle) {
+
+		if (err || scode) {
+			warning("ice: %s: trickle: gather error: %m (%u %s)\n",
+				sdp_media_name(m->sdpm), err, scode, reason);
+		}
+		else {
+			refresh_laddr(m,
+				      icem_cand_default(m->icem, 1),
+				      icem_cand_default(m->icem, 2));
+
+			(void)set_media_attributes(m);
+		}
+
+		m->gathered = true;
+		trickle_gathered(m->sess);
+		return;
+	}
+
 	if (err || scode) {
 		warning("ice: gather error: %m (%u %s)\n",
 			err, scode, reason);
@@ -442,10 +635,11 @@ static void conncheck_handler(int err, bool update, void *arg)
 {
 	struct mnat_media *m = arg;
 	struct mnat_sess *sess = m->sess;
-	struct le *le;
 
-	info("ice: %s: connectivity check is complete (update=%d)\n",
-	     sdp_media_name(m->sdpm), update);
+	info("ice: %s: connectivity check is complete (update=%d)"
+	     " after %llu ms\n",
+	     sdp_media_name(m->sdpm), update,
+	     m->ts_check ? tmr_jiffies() - m->ts_check : 0ULL);
 
 	ice_printf(m, "Dumping media state: %H\n", icem_debug, m->icem);
 
@@ -466,11 +660,8 @@ static void conncheck_handler(int err, bool update, void *arg)
 		(void)set_media_attributes(m);
 
 		/* Check all conncheck flags */
-		LIST_FOREACH(&sess->medial, le) {
-			struct mnat_media *mx = le->data;
-			if (!mx->complete)
-				return;
-		}
+		if (!media_complete(sess))
+			return;
 	}
 
 	/* call estab-handler and send re-invite */
@@ -519,6 +710,7 @@ static int ice_start(struct mnat_sess *sess)
 			m->complete = false;
 
 			if (ice.mode == ICE_MODE_FULL) {
+				m->ts_check = tmr_jiffies();
 				err = icem_conncheck_start(m->icem);
 				if (err)
 					return err;
@@ -568,6 +760,10 @@ static int media_alloc(struct mnat_media **mp, struct mnat_sess *sess,
 			err |= icem_comp_add(m->icem, i+1, m->compv[i].sock);
 	}
 
+	/* host candidates do not wait for the STUN/TURN server */
+	if (!err)
+		net_if_apply(if_handler, m);
+
 	if (sa_isset(&sess->srv, SA_ALL))
 		err |= media_start(sess, m);
 
@@ -632,6 +828,20 @@ static int update(struct mnat_sess *sess)
 	/* SDP session */
 	(void)sdp_session_rattr_apply(sess->sdp, NULL, sdp_attr_handler, sess);
 
+	if (sess->trickle && !sess->rknown) {
+
+		const char *opts = sdp_session_rattr(sess->sdp, "ice-options");
+
+		sess->rknown   = true;
+		sess->rtrickle = opts && NULL != strstr(opts, "trickle");
+
+		info("ice: peer %s trickle candidates\n",
+		     sess->rtrickle ? "accepts" : "does not accept");
+
+		if (!sess->rtrickle && media_gathered(sess))
+			sess->send_reinvite = true;
+	}
+
 	/* SDP medialines */
 	for (le = sess->medial.head; le; le = le->next) {
 		struct mnat_media *m = le->data;
@@ -657,17 +867,126 @@ static int update(struct mnat_sess *sess)
 		}
 	}
 
+	if (sess->rtrickle)
+		trickle_send(sess);
+
 	return err;
 }
 
 
+/* All media streams are allocated, offer the host candidates */
+static void trickle_tmr_handler(void *arg)
+{
+	struct mnat_sess *sess = arg;
+	struct le *le;
+
+	LIST_FOREACH(&sess->medial, le) {
+		struct mnat_media *m = le->data;
+
+		(void)set_media_attributes(m);
+	}
+
+	sess->estabh(0, 0, NULL, sess->arg);
+}
+
+
+static int trickle(struct mnat_sess *sess, mnat_sdpfrag_h *fragh,
+		   void *arg)
+{
+	int err;
+
+	if (!sess || !fragh)
+		return EINVAL;
+
+	if (!ice.trickle || ice.mode != ICE_MODE_FULL)
+		return ENOTSUP;
+
+	err = sdp_session_set_lattr(sess->sdp, true,
+				    "ice-options", "trickle");
+	if (err)
+		return err;
+
+	sess->trickle = true;
+	sess->fragh   = fragh;
+	sess->fragarg = arg;
+
+	tmr_start(&sess->tmr_trickle, 0, trickle_tmr_handler, sess);
+
+	return 0;
+}
+
+
+static struct mnat_media *media_find(const struct mnat_sess *sess,
+				     const struct pl *name)
+{
+	struct le *le;
+
+	LIST_FOREACH(&sess->medial, le) {
+		struct mnat_media *m = le->data;
+
+		if (0 == pl_strcmp(name, sdp_media_name(m->sdpm)))
+			return m;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Candidates from the peer (RFC 8840). Checks that are running pick
+ * them up as peer-reflexive candidates, the others when they start.
+ */
+static int rfrag(struct mnat_sess *sess, const struct pl *frag)
+{
+	struct mnat_media *m = NULL;
+	struct pl line, rest;
+	char cand[256];
+	unsigned n = 0;
+
+	if (!sess || !frag)
+		return EINVAL;
+
+	rest = *frag;
+
+	while (0 == re_regex(rest.p, rest.l, "[^\r\n]+", &line)) {
+
+		struct pl name, val;
+
+		pl_advance(&rest, line.p + line.l - rest.p);
+
+		if (0 == re_regex(line.p, line.l, "^m=[^ ]+", &name)) {
+
+			m = media_find(sess, &name);
+			continue;
+		}
+
+		if (!m || re_regex(line.p, line.l, "^a=candidate:[~]+", &val))
+			continue;
+
+		if (pl_strcpy(&val, cand, sizeof(cand)))
+			continue;
+
+		if (0 == icem_sdp_decode(m->icem, ice_attr_cand, cand))
+			++n;
+	}
+
+	debug("ice: trickle: added %u remote candidates\n", n);
+
+	return 0;
+}
+
+
 static int module_init(void)
 {
+	int err;
 #ifdef MODULE_CONF
 	struct pl pl;
 
 	conf_get_bool(conf_cur(), "ice_turn", &ice.turn);
 	conf_get_bool(conf_cur(), "ice_debug", &ice.debug);
+	conf_get_bool(conf_cur(), "ice_trickle", &ice.trickle);
+	conf_get_u32(conf_cur(), "ice_rto", &ice.rto);
+	conf_get_u32(conf_cur(), "ice_rc", &ice.rc);
 
 	if (!conf_get(conf_cur(), "ice_nomination", &pl)) {
 		if (0 == pl_strcasecmp(&pl, "regular"))
@@ -689,9 +1008,15 @@ static int module_init(void)
 	}
 #endif
 
-	return mnat_register(&mnat, baresip_mnatl(),
-			     "ice", "+sip.ice",
-			     session_alloc, media_alloc, update);
+	err = mnat_register(&mnat, baresip_mnatl(),
+			    "ice", "+sip.ice",
+			    session_alloc, media_alloc, update);
+	if (err)
+		return err;
+
+	mnat_set_trickle(mnat, trickle, rfrag);
+
+	return 0;
 }
 
 
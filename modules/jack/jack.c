@@ -3,20 +3,285 @@
  *
  * Copyright (C) 2010 Creytiv.com
  */
+#include <pthread.h>
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
+#include <jack/jack.h>
 #include "mod_jack.h"
 
 
+/**
+ * @defgroup jack jack
+ *
+ * Audio driver module for JACK
+ *
+ * All players and sources share one JACK client, each of them has its
+ * own ports on it. The ports are named after the device, e.g. with
+ * "jack,studio3" the ports are studio3_out_1 and studio3_in_1, and
+ * otherwise out<n>_1 and in<n>_1. With a float pipeline the samples
+ * are copied to and from the JACK buffers as they are.
+ *
+ * Example config:
+ \verbatim
+  jack_client_name   baresip
+  jack_autoconnect   yes       # Connect to the physical ports
+ \endverbatim
+ */
+
+
+static struct {
+	jack_client_t *client;
+	struct list streaml;       /* Protected by mutex */
+	pthread_mutex_t mutex;
+	char name[64];
+	bool autoconnect;
+	unsigned n_port;           /* Port groups registered so far */
+} jack = {
+	.name        = "baresip",
+	.autoconnect = true,
+};
+
 static struct auplay *auplay;
 static struct ausrc *ausrc;
 
 
+/*
+ * Called in the realtime thread of JACK. The streams are only added and
+ * removed with the mutex held, a cycle in which that happens is skipped.
+ */
+static int process_handler(jack_nframes_t nframes, void *arg)
+{
+	struct le *le;
+	(void)arg;
+
+	if (pthread_mutex_trylock(&jack.mutex))
+		return 0;
+
+	for (le = jack.streaml.head; le; le = le->next) {
+		struct jack_stream *js = le->data;
+
+		js->h(nframes, js->arg);
+	}
+
+	pthread_mutex_unlock(&jack.mutex);
+
+	return 0;
+}
+
+
+static void shutdown_handler(void *arg)
+{
+	(void)arg;
+
+	warning("jack: server has shut down\n");
+}
+
+
+static int client_open(void)
+{
+	jack_status_t status;
+
+	jack.client = jack_client_open(jack.name, JackNullOption,
+				       &status, NULL);
+	if (!jack.client) {
+		warning("jack: jack_client_open() failed, "
+			"status = 0x%2.0x\n", status);
+
+		if (status & JackServerFailed)
+			warning("jack: Unable to connect to JACK server\n");
+
+		return ENODEV;
+	}
+
+	if (status & JackServerStarted)
+		info("jack: JACK server started\n");
+
+	if (status & JackNameNotUnique) {
+		info("jack: unique name `%s' assigned\n",
+		     jack_get_client_name(jack.client));
+	}
+
+	jack_set_process_callback(jack.client, process_handler, NULL);
+	jack_on_shutdown(jack.client, shutdown_handler, NULL);
+
+	if (jack_activate(jack.client)) {
+		warning("jack: cannot activate client\n");
+		jack_client_close(jack.client);
+		jack.client = NULL;
+		return ENODEV;
+	}
+
+	info("jack: engine sample rate: %" PRIu32 " max_frames=%u\n",
+	     jack_get_sample_rate(jack.client),
+	     jack_get_buffer_size(jack.client));
+
+	return 0;
+}
+
+
+/**
+ * Add a stream to the shared client, with one port per channel. The
+ * process handler is called after mod_jack_start().
+ *
+ * @param js     Stream entry
+ * @param srate  Sample rate, must be the one of the JACK server
+ * @param ch     Number of channels
+ * @param device Device name, the prefix of the port names (optional)
+ * @param input  True for input ports (source), false for output ports
+ * @param h      Process handler, called in the realtime thread
+ * @param arg    Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mod_jack_add(struct jack_stream *js, uint32_t srate, uint8_t ch,
+		 const char *device, bool input,
+		 mod_jack_process_h *h, void *arg)
+{
+	const unsigned long flags = input ? JackPortIsInput : JackPortIsOutput;
+	const char **physv = NULL;
+	char prefix[32];
+	unsigned i;
+	int err;
+
+	if (!js || !ch || ch > ARRAY_SIZE(js->portv) || !h)
+		return EINVAL;
+
+	if (!jack.client) {
+		err = client_open();
+		if (err)
+			return err;
+	}
+
+	/* currently the application must use the same sample-rate
+	   as the jack server backend */
+	if (srate != jack_get_sample_rate(jack.client)) {
+		warning("jack: samplerate %uHz expected\n",
+			jack_get_sample_rate(jack.client));
+		return EINVAL;
+	}
+
+	js->nframes = jack_get_buffer_size(jack.client);
+	js->ch      = ch;
+	js->h       = h;
+	js->arg     = arg;
+
+	++jack.n_port;
+
+	if (str_isset(device))
+		str_ncpy(prefix, device, sizeof(prefix));
+	else
+		re_snprintf(prefix, sizeof(prefix), "%s%u",
+			    input ? "in" : "out", jack.n_port);
+
+	for (i=0; i<ch; i++) {
+
+		char name[64];
+
+		re_snprintf(name, sizeof(name), "%s_%s_%u", prefix,
+			    input ? "in" : "out", i+1);
+
+		js->portv[i] = jack_port_register(jack.client, name,
+						  JACK_DEFAULT_AUDIO_TYPE,
+						  flags, 0);
+		if (!js->portv[i]) {
+			warning("jack: no more JACK ports available\n");
+			err = ENODEV;
+			goto out;
+		}
+	}
+
+	/* Note the confusing (but necessary) orientation of the driver
+	 * backend ports: playback ports are "input" to the backend, and
+	 * capture ports are "output" from it.
+	 */
+	if (jack.autoconnect) {
+		physv = jack_get_ports(jack.client, NULL, NULL,
+				       JackPortIsPhysical |
+				       (input ? JackPortIsOutput
+					      : JackPortIsInput));
+		if (!physv)
+			warning("jack: no physical ports\n");
+	}
+
+	for (i=0; physv && physv[i] && i<ch; i++) {
+
+		const char *port = jack_port_name(js->portv[i]);
+
+		if (input ? jack_connect(jack.client, physv[i], port)
+			  : jack_connect(jack.client, port, physv[i]))
+			warning("jack: cannot connect port %s\n", port);
+	}
+
+	err = 0;
+
+ out:
+	if (physv)
+		jack_free(physv);
+
+	if (err)
+		mod_jack_remove(js);
+
+	return err;
+}
+
+
+/**
+ * Start calling the process handler of a stream
+ *
+ * @param js Stream entry
+ */
+void mod_jack_start(struct jack_stream *js)
+{
+	if (!js)
+		return;
+
+	pthread_mutex_lock(&jack.mutex);
+	list_append(&jack.streaml, &js->le, js);
+	pthread_mutex_unlock(&jack.mutex);
+}
+
+
+/**
+ * Remove a stream from the shared client, and unregister its ports
+ *
+ * @param js Stream entry
+ */
+void mod_jack_remove(struct jack_stream *js)
+{
+	unsigned i;
+
+	if (!js || !jack.client)
+		return;
+
+	pthread_mutex_lock(&jack.mutex);
+	list_unlink(&js->le);
+	pthread_mutex_unlock(&jack.mutex);
+
+	for (i=0; i<ARRAY_SIZE(js->portv); i++) {
+
+		if (!js->portv[i])
+			continue;
+
+		(void)jack_port_unregister(jack.client, js->portv[i]);
+		js->portv[i] = NULL;
+	}
+}
+
+
 static int module_init(void)
 {
+	struct conf *conf = conf_cur();
 	int err = 0;
 
+	(void)conf_get_str(conf, "jack_client_name",
+			   jack.name, sizeof(jack.name));
+	(void)conf_get_bool(conf, "jack_autoconnect", &jack.autoconnect);
+
+	err = pthread_mutex_init(&jack.mutex, NULL);
+	if (err)
+		return err;
+
 	err |= auplay_register(&auplay, "jack", jack_play_alloc);
 	err |= ausrc_register(&ausrc, "jack", jack_src_alloc);
 
@@ -29,6 +294,13 @@ static int module_close(void)
 	auplay = mem_deref(auplay);
 	ausrc  = mem_deref(ausrc);
 
+	if (jack.client) {
+		jack_client_close(jack.client);
+		jack.client = NULL;
+	}
+
+	pthread_mutex_destroy(&jack.mutex);
+
 	return 0;
 }
 
@@ -14,15 +14,12 @@
 struct ausrc_st {
 	const struct ausrc *as;  /* pointer to base-class (inheritance) */
 
+	struct jack_stream js;
 	struct ausrc_prm prm;
-	int16_t *sampv;
+	void *sampv;
 	size_t sampc;             /* includes number of channels */
 	ausrc_read_h *rh;
 	void *arg;
-
-	jack_client_t *client;
-	jack_port_t *portv[2];
-	jack_nframes_t nframes;       /* num frames per port (channel) */
 };
 
 
@@ -46,32 +43,51 @@ static inline int16_t ausamp_float2short(float in)
 }
 
 
-static int process_handler(jack_nframes_t nframes, void *arg)
+/* Called in the realtime thread of JACK, once for each audio cycle */
+static void process_handler(jack_nframes_t nframes, void *arg)
 {
 	struct ausrc_st *st = arg;
 	size_t sampc = nframes * st->prm.ch;
 	size_t ch, j;
 
-	/* 2. convert from 16-bit to float and copy to Jack */
+	if (nframes > st->js.nframes)
+		return;
+
+	/* mono float is read directly from the Jack buffer */
+	if (st->prm.fmt == AUFMT_FLOAT && st->prm.ch == 1) {
 
-	/* 3. de-interleave [LRLRLRLR] -> [LLLLL]+[RRRRR] */
+		st->rh(jack_port_get_buffer(st->js.portv[0], nframes),
+		       sampc, st->arg);
+		return;
+	}
+
+	/* 1. interleave [LLLLL]+[RRRRR] -> [LRLRLRLR], float is copied
+	 *    as it is and 16-bit is converted */
 	for (ch = 0; ch < st->prm.ch; ch++) {
 
 		const jack_default_audio_sample_t *buffer;
 
-		buffer = jack_port_get_buffer(st->portv[ch], st->nframes);
+		buffer = jack_port_get_buffer(st->js.portv[ch], nframes);
+
+		if (st->prm.fmt == AUFMT_FLOAT) {
+			float *sampv = st->sampv;
 
-		for (j = 0; j < nframes; j++) {
-			int16_t samp;
-			samp = ausamp_float2short(buffer[j]);
-			st->sampv[j*st->prm.ch + ch] = samp;
+			for (j = 0; j < nframes; j++)
+				sampv[j*st->prm.ch + ch] = buffer[j];
+		}
+		else {
+			int16_t *sampv = st->sampv;
+
+			for (j = 0; j < nframes; j++) {
+				int16_t samp;
+				samp = ausamp_float2short(buffer[j]);
+				sampv[j*st->prm.ch + ch] = samp;
+			}
 		}
 	}
 
-	/* 1. read data from app (signed 16-bit) interleaved */
+	/* 2. give data to app (signed 16-bit or float) interleaved */
 	st->rh(st->sampv, sampc, st->arg);
-
-	return 0;
 }
 
 
@@ -81,103 +97,12 @@ static void ausrc_destructor(void *arg)
 
 	info("jack: source destroy\n");
 
-	if (st->client)
-		jack_client_close(st->client);
+	mod_jack_remove(&st->js);
 
 	mem_deref(st->sampv);
 }
 
 
-static int start_jack(struct ausrc_st *st)
-{
-	const char **ports;
-	const char *client_name = "baresip";
-	const char *server_name = NULL;
-	jack_options_t options = JackNullOption;
-	jack_status_t status;
-	unsigned ch;
-	jack_nframes_t engine_srate;
-
-	/* open a client connection to the JACK server */
-
-	st->client = jack_client_open(client_name, options,
-				      &status, server_name);
-	if (st->client == NULL) {
-		warning("jack: jack_client_open() failed, "
-			"status = 0x%2.0x\n", status);
-
-		if (status & JackServerFailed) {
-			warning("jack: Unable to connect to JACK server\n");
-		}
-		return ENODEV;
-	}
-	if (status & JackServerStarted) {
-		info("jack: JACK server started\n");
-	}
-	if (status & JackNameNotUnique) {
-		client_name = jack_get_client_name(st->client);
-		info("jack: unique name `%s' assigned\n", client_name);
-	}
-
-	jack_set_process_callback(st->client, process_handler, st);
-
-	engine_srate = jack_get_sample_rate(st->client);
-	st->nframes  = jack_get_buffer_size(st->client);
-
-	info("jack: engine sample rate: %" PRIu32 " max_frames=%u\n",
-	     engine_srate, st->nframes);
-
-	/* currently the application must use the same sample-rate
-	   as the jack server backend */
-	if (engine_srate != st->prm.srate) {
-		warning("jack: samplerate %uHz expected\n", engine_srate);
-		return EINVAL;
-	}
-
-	/* create one port per channel */
-	for (ch=0; ch<st->prm.ch; ch++) {
-
-		char buf[32];
-		re_snprintf(buf, sizeof(buf), "input_%u", ch+1);
-
-		st->portv[ch] = jack_port_register(st->client, buf,
-						   JACK_DEFAULT_AUDIO_TYPE,
-						   JackPortIsInput, 0);
-		if ( st->portv[ch] == NULL) {
-			warning("jack: no more JACK ports available\n");
-			return ENODEV;
-		}
-	}
-
-	/* Tell the JACK server that we are ready to roll.  Our
-	 * process() callback will start running now. */
-
-	if (jack_activate (st->client)) {
-		warning("jack: cannot activate client");
-		return ENODEV;
-	}
-
-	ports = jack_get_ports (st->client, NULL, NULL,
-				JackPortIsOutput);
-	if (ports == NULL) {
-		warning("jack: no physical playback ports\n");
-		return ENODEV;
-	}
-
-	for (ch=0; ch<st->prm.ch; ch++) {
-
-		if (jack_connect(st->client, ports[ch],
-				 jack_port_name(st->portv[ch]))) {
-			warning("jack: cannot connect output ports\n");
-		}
-	}
-
-	jack_free(ports);
-
-	return 0;
-}
-
-
 int jack_src_alloc(struct ausrc_st **stp, const struct ausrc *as,
 		   struct media_ctx **ctx,
 		   struct ausrc_prm *prm, const char *device,
@@ -186,12 +111,18 @@ int jack_src_alloc(struct ausrc_st **stp, const struct ausrc *as,
 	struct ausrc_st *st;
 	int err = 0;
 
+	(void)ctx;
+	(void)errh;
+
 	if (!stp || !as || !prm || !rh)
 		return EINVAL;
 
-	if (prm->ch > ARRAY_SIZE(st->portv))
+	if (prm->ch > JACK_MAXCH)
 		return EINVAL;
 
+	if (prm->fmt != AUFMT_S16LE && prm->fmt != AUFMT_FLOAT)
+		return ENOTSUP;
+
 	st = mem_zalloc(sizeof(*st), ausrc_destructor);
 	if (!st)
 		return ENOMEM;
@@ -201,17 +132,20 @@ int jack_src_alloc(struct ausrc_st **stp, const struct ausrc *as,
 	st->rh  = rh;
 	st->arg = arg;
 
-	err = start_jack(st);
+	err = mod_jack_add(&st->js, prm->srate, prm->ch, device, true,
+			   process_handler, st);
 	if (err)
 		goto out;
 
-	st->sampc = st->nframes * prm->ch;
-	st->sampv = mem_alloc(st->sampc * sizeof(int16_t), NULL);
+	st->sampc = st->js.nframes * prm->ch;
+	st->sampv = mem_alloc(st->sampc * aufmt_sample_size(prm->fmt), NULL);
 	if (!st->sampv) {
 		err = ENOMEM;
 		goto out;
 	}
 
+	mod_jack_start(&st->js);
+
 	info("jack: source sampc=%zu\n", st->sampc);
 
  out:
@@ -5,6 +5,29 @@
  */
 
 
+enum {
+	JACK_MAXCH = 16,
+};
+
+typedef void (mod_jack_process_h)(jack_nframes_t nframes, void *arg);
+
+/** A player or source on the shared client */
+struct jack_stream {
+	struct le le;
+	jack_port_t *portv[JACK_MAXCH];
+	jack_nframes_t nframes;       /* max frames per port (channel) */
+	uint8_t ch;
+	mod_jack_process_h *h;
+	void *arg;
+};
+
+int  mod_jack_add(struct jack_stream *js, uint32_t srate, uint8_t ch,
+		  const char *device, bool input,
+		  mod_jack_process_h *h, void *arg);
+void mod_jack_start(struct jack_stream *js);
+void mod_jack_remove(struct jack_stream *js);
+
+
 int jack_play_alloc(struct auplay_st **stp, const struct auplay *ap,
 		    struct auplay_prm *prm, const char *device,
 		    auplay_write_h *wh, void *arg);
@@ -3,6 +3,7 @@
  *
  * Copyright (C) 2010 - 2015 Creytiv.com
  */
+#include <string.h>
 #include <re.h>
 #include <baresip.h>
 
@@ -20,7 +21,6 @@ enum {NR_CODECS = 8};
 static int encode(struct auenc_state *st, uint8_t *buf, size_t *len,
 		  const int16_t *sampv, size_t sampc)
 {
-	int16_t *p = (void *)buf;
 	(void)st;
 
 	if (!buf || !len || !sampv)
@@ -31,8 +31,11 @@ static int encode(struct auenc_state *st, uint8_t *buf, size_t *len,
 
 	*len = sampc*2;
 
-	while (sampc--)
-		*p++ = htons(*sampv++);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	memcpy(buf, sampv, sampc*2);
+#else
+	aupcm_swap16((void *)buf, sampv, sampc);
+#endif
 
 	return 0;
 }
@@ -41,7 +44,6 @@ static int encode(struct auenc_state *st, uint8_t *buf, size_t *len,
 static int decode(struct audec_state *st, int16_t *sampv, size_t *sampc,
 		  const uint8_t *buf, size_t len)
 {
-	int16_t *p = (void *)buf;
 	(void)st;
 
 	if (!buf || !len || !sampv)
@@ -52,9 +54,11 @@ static int decode(struct audec_state *st, int16_t *sampv, size_t *sampc,
 
 	*sampc = len/2;
 
-	len /= 2;
-	while (len--)
-		*sampv++ = ntohs(*p++);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	memcpy(sampv, buf, *sampc*2);
+#else
+	aupcm_swap16(sampv, (const void *)buf, *sampc);
+#endif
 
 	return 0;
 }
@@ -13,14 +13,41 @@
 #include "sdes.h"
 
 
+/**
+ * @defgroup libsrtp libsrtp
+ *
+ * Secure RTP with SDES key exchange, using libsrtp
+ *
+ * The AES-256 and AES-GCM suites need a libsrtp that is built with
+ * OpenSSL, which then also does the AES of all suites, with AES-NI where
+ * the CPU has it. The preferred suite is offered, and any of the suites
+ * is accepted from the peer.
+ *
+ * libsrtp protects one packet per call. The helper is on the RTP socket
+ * above the batched send of the core, so a burst from the pacer is
+ * protected packet by packet and then sent with one system call.
+ *
+ * Example config:
+ \verbatim
+  srtp_crypto_suite    AEAD_AES_128_GCM   # Offered suite
+  srtp_replay_window   1024               # Packets, for high-rate video
+ \endverbatim
+ */
+
+
+enum {
+	KEY_MAX = 48,        /* Largest master key and salt, 46 used */
+};
+
 struct menc_st {
 	/* one SRTP session per media line */
-	uint8_t key_tx[32];  /* 32 for alignment, only 30 used */
-	uint8_t key_rx[32];
+	uint8_t key_tx[KEY_MAX];
+	uint8_t key_rx[KEY_MAX];
 	srtp_t srtp_tx, srtp_rx;
 	srtp_policy_t policy_tx, policy_rx;
 	bool use_srtp;
 	char *crypto_suite;
+	struct log_rl rl;            /**< Rate limit for packet errors     */
 
 	void *rtpsock;
 	void *rtcpsock;
@@ -30,8 +57,32 @@ struct menc_st {
 };
 
 
-static const char aes_cm_128_hmac_sha1_32[] = "AES_CM_128_HMAC_SHA1_32";
-static const char aes_cm_128_hmac_sha1_80[] = "AES_CM_128_HMAC_SHA1_80";
+typedef void (policy_set_h)(crypto_policy_t *p);
+
+/* SDES crypto suites, with the length of master key and salt */
+static const struct suite {
+	const char *name;
+	size_t keylen;
+	policy_set_h *policyh;
+} suitev[] = {
+	{"AES_CM_128_HMAC_SHA1_80", 30,
+	 crypto_policy_set_aes_cm_128_hmac_sha1_80},
+	{"AES_CM_128_HMAC_SHA1_32", 30,
+	 crypto_policy_set_aes_cm_128_hmac_sha1_32},
+#ifdef OPENSSL
+	{"AES_256_CM_HMAC_SHA1_80", 46,
+	 crypto_policy_set_aes_cm_256_hmac_sha1_80},
+	{"AES_256_CM_HMAC_SHA1_32", 46,
+	 crypto_policy_set_aes_cm_256_hmac_sha1_32},
+	{"AEAD_AES_128_GCM",        28,
+	 crypto_policy_set_aes_gcm_128_16_auth},
+	{"AEAD_AES_256_GCM",        44,
+	 crypto_policy_set_aes_gcm_256_16_auth},
+#endif
+};
+
+static char pref_suite[32] = "AES_CM_128_HMAC_SHA1_80";
+static uint32_t replay_window;    /* 0 is the default of libsrtp */
 
 
 static void destructor(void *arg)
@@ -54,10 +105,29 @@ static void destructor(void *arg)
 }
 
 
+static const struct suite *suite_find(const char *name)
+{
+	size_t i;
+
+	for (i=0; i<ARRAY_SIZE(suitev); i++) {
+
+		if (0 == str_casecmp(name, suitev[i].name))
+			return &suitev[i];
+	}
+
+	return NULL;
+}
+
+
 static bool cryptosuite_issupported(const struct pl *suite)
 {
-	if (0 == pl_strcasecmp(suite, aes_cm_128_hmac_sha1_32)) return true;
-	if (0 == pl_strcasecmp(suite, aes_cm_128_hmac_sha1_80)) return true;
+	size_t i;
+
+	for (i=0; i<ARRAY_SIZE(suitev); i++) {
+
+		if (0 == pl_strcasecmp(suite, suitev[i].name))
+			return true;
+	}
 
 	return false;
 }
@@ -123,20 +193,17 @@ static bool is_rtcp_packet(const struct mbuf *mb)
 
 static int start_srtp(struct menc_st *st, const char *suite)
 {
+	const struct suite *cs = suite_find(suite);
 	crypto_policy_t policy;
 	err_status_t e;
 
-	if (0 == str_casecmp(suite, aes_cm_128_hmac_sha1_32)) {
-		crypto_policy_set_aes_cm_128_hmac_sha1_32(&policy);
-	}
-	else if (0 == str_casecmp(suite, aes_cm_128_hmac_sha1_80)) {
-		crypto_policy_set_aes_cm_128_hmac_sha1_80(&policy);
-	}
-	else {
+	if (!cs) {
 		warning("srtp: unknown SRTP crypto suite (%s)\n", suite);
 		return ENOENT;
 	}
 
+	cs->policyh(&policy);
+
 	/* transmit policy */
 	st->policy_tx.rtp = policy;
 	st->policy_tx.rtcp = policy;
@@ -149,6 +216,7 @@ static int start_srtp(struct menc_st *st, const char *suite)
 	st->policy_rx.rtcp = policy;
 	st->policy_rx.ssrc.type = ssrc_any_inbound;
 	st->policy_rx.key = st->key_rx;
+	st->policy_rx.window_size = replay_window;
 	st->policy_rx.next = NULL;
 
 	/* allocate and initialize the SRTP session */
@@ -177,8 +245,8 @@ static int setup_srtp(struct menc_st *st)
 {
 	err_status_t e;
 
-	/* init SRTP */
-	e = crypto_get_random(st->key_tx, SRTP_MASTER_KEY_LEN);
+	/* init SRTP, enough key for any suite */
+	e = crypto_get_random(st->key_tx, sizeof(st->key_tx));
 	if (err_status_ok != e) {
 		warning("srtp: crypto_get_random() failed (%H)\n",
 			errstatus_print, e);
@@ -189,34 +257,51 @@ static int setup_srtp(struct menc_st *st)
 }
 
 
+static void packet_error(struct menc_st *st, const char *op, bool rtcp,
+			 int len, err_status_t e)
+{
+	uint32_t nsupp = 0;
+
+	if (!log_ratelimit(&st->rl, &nsupp))
+		return;
+
+	if (nsupp) {
+		warning("srtp: %s %s-packet with %d bytes (%H)"
+			" (%u more suppressed)\n", op, rtcp ? "RTCP" : "RTP",
+			len, errstatus_print, e, nsupp);
+	}
+	else {
+		warning("srtp: %s %s-packet with %d bytes (%H)\n",
+			op, rtcp ? "RTCP" : "RTP", len, errstatus_print, e);
+	}
+}
+
+
 static bool send_handler(int *err, struct sa *dst, struct mbuf *mb, void *arg)
 {
 	struct menc_st *st = arg;
 	err_status_t e;
+	bool rtcp;
 	int len;
 	(void)dst;
 
 	if (!st->use_srtp || !is_rtp_or_rtcp(mb))
 		return false;
 
-	len = (int)mbuf_get_left(mb);
+	len  = (int)mbuf_get_left(mb);
+	rtcp = is_rtcp_packet(mb);
 
 	if (mbuf_get_space(mb) < ((size_t)len + SRTP_MAX_TRAILER_LEN)) {
 		mbuf_resize(mb, mb->pos + len + SRTP_MAX_TRAILER_LEN);
 	}
 
-	if (is_rtcp_packet(mb)) {
+	if (rtcp)
 		e = srtp_protect_rtcp(st->srtp_tx, mbuf_buf(mb), &len);
-	}
-	else {
+	else
 		e = srtp_protect(st->srtp_tx, mbuf_buf(mb), &len);
-	}
 
 	if (err_status_ok != e) {
-		warning("srtp: send: failed to protect %s-packet"
-			" with %d bytes (%H)\n",
-			is_rtcp_packet(mb) ? "RTCP" : "RTP",
-			len, errstatus_print, e);
+		packet_error(st, "send: failed to protect", rtcp, len, e);
 		*err = EPROTO;
 		return false;
 	}
@@ -231,26 +316,23 @@ static bool recv_handler(struct sa *src, struct mbuf *mb, void *arg)
 {
 	struct menc_st *st = arg;
 	err_status_t e;
+	bool rtcp;
 	int len;
 	(void)src;
 
 	if (!st->use_srtp || !is_rtp_or_rtcp(mb))
 		return false;
 
-	len = (int)mbuf_get_left(mb);
+	len  = (int)mbuf_get_left(mb);
+	rtcp = is_rtcp_packet(mb);
 
-	if (is_rtcp_packet(mb)) {
+	if (rtcp)
 		e = srtp_unprotect_rtcp(st->srtp_rx, mbuf_buf(mb), &len);
-	}
-	else {
+	else
 		e = srtp_unprotect(st->srtp_rx, mbuf_buf(mb), &len);
-	}
 
 	if (e != err_status_ok) {
-		warning("srtp: recv: failed to unprotect %s-packet"
-			" with %d bytes (%H)\n",
-			is_rtcp_packet(mb) ? "RTCP" : "RTP",
-			len, errstatus_print, e);
+		packet_error(st, "recv: failed to unprotect", rtcp, len, e);
 		return true;   /* error - drop packet */
 	}
 
@@ -264,12 +346,16 @@ static bool recv_handler(struct sa *src, struct mbuf *mb, void *arg)
 static int sdp_enc(struct menc_st *st, struct sdp_media *m,
 		   uint32_t tag, const char *suite)
 {
+	const struct suite *cs = suite_find(suite);
 	char key[128] = "";
 	size_t olen;
 	int err;
 
+	if (!cs)
+		return ENOENT;
+
 	olen = sizeof(key);
-	err = base64_encode(st->key_tx, SRTP_MASTER_KEY_LEN, key, &olen);
+	err = base64_encode(st->key_tx, cs->keylen, key, &olen);
 	if (err)
 		return err;
 
@@ -279,9 +365,13 @@ static int sdp_enc(struct menc_st *st, struct sdp_media *m,
 
 static int start_crypto(struct menc_st *st, const struct pl *key_info)
 {
+	const struct suite *cs = suite_find(st->crypto_suite);
 	size_t olen;
 	int err;
 
+	if (!cs)
+		return ENOENT;
+
 	/* key-info is BASE64 encoded */
 
 	olen = sizeof(st->key_rx);
@@ -289,8 +379,10 @@ static int start_crypto(struct menc_st *st, const struct pl *key_info)
 	if (err)
 		return err;
 
-	if (SRTP_MASTER_KEY_LEN != olen) {
-		warning("srtp: srtp keylen is %u (should be 30)\n", olen);
+	if (cs->keylen != olen) {
+		warning("srtp: srtp keylen is %u (should be %u)\n",
+			olen, cs->keylen);
+		return EBADMSG;
 	}
 
 	err = start_srtp(st, st->crypto_suite);
@@ -382,7 +474,7 @@ static int alloc(struct menc_media **stp, struct menc_sess *sess,
 			goto out;
 
 		/* set our preferred crypto-suite */
-		err |= str_dup(&st->crypto_suite, aes_cm_128_hmac_sha1_80);
+		err |= str_dup(&st->crypto_suite, pref_suite);
 		if (err)
 			goto out;
 
@@ -434,6 +526,16 @@ static int mod_srtp_init(void)
 	struct list *mencl = baresip_mencl();
 	err_status_t err;
 
+	(void)conf_get_str(conf_cur(), "srtp_crypto_suite",
+			   pref_suite, sizeof(pref_suite));
+	(void)conf_get_u32(conf_cur(), "srtp_replay_window", &replay_window);
+
+	if (!suite_find(pref_suite)) {
+		warning("srtp: crypto suite %s is not supported\n",
+			pref_suite);
+		return ENOTSUP;
+	}
+
 	err = srtp_init();
 	if (err_status_ok != err) {
 		warning("srtp: srtp_init() failed (%H)\n",
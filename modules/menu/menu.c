@@ -4,6 +4,7 @@
  * Copyright (C) 2010 Creytiv.com
  */
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <re.h>
 #include <baresip.h>
@@ -16,6 +17,15 @@
  *
  * This module must be loaded if you want to use the interactive menu
  * to control the Baresip application.
+ *
+ * The status line of the current call is checked several times per
+ * second, but it is only printed when the duration or a bitrate of the
+ * call has changed, and not more often than menu_stat_interval.
+ *
+ * Example config:
+ \verbatim
+  menu_stat_interval      500     # [ms]
+ \endverbatim
  */
 
 
@@ -25,6 +35,18 @@ enum statmode {
 	STATMODE_OFF,
 };
 
+enum {
+	STAT_TICK = 100,              /**< Status check interval [ms]     */
+};
+
+/** The values of the last printed status line */
+struct statline {
+	const struct call *call;      /**< Call of the line, NULL if none */
+	uint32_t duration;            /**< Call duration [s]              */
+	uint32_t bitratev[2 * CALL_STATS_STREAMS]; /**< TX/RX [bit/s]     */
+	uint64_t ts;                  /**< Time of printing [ms]          */
+};
+
 
 static uint64_t start_ticks;          /**< Ticks when app started         */
 static struct tmr tmr_alert;          /**< Incoming call alert timer      */
@@ -41,6 +63,9 @@ static struct {
 	uint32_t redial_delay;        /**< Redial delay in [seconds]      */
 	uint32_t redial_attempts;     /**< Number of re-dial attempts     */
 	uint32_t current_attempts;    /**< Current number of re-dials     */
+
+	struct statline stat;         /**< Last printed status line       */
+	uint32_t stat_interval;       /**< Min print interval [ms]        */
 } menu;
 
 
@@ -689,6 +714,28 @@ static int call_video_debug(struct re_printf *pf, void *unused)
 	(void)unused;
 	return video_debug(pf, call_video(ua_call(uag_cur())));
 }
+
+
+static int cmd_present(struct re_printf *pf, void *unused)
+{
+	int err;
+	(void)unused;
+
+	err = call_present(ua_call(uag_cur()), true);
+	if (err)
+		re_hprintf(pf, "present: %m\n", err);
+
+	return 0;
+}
+
+
+static int cmd_present_stop(struct re_printf *pf, void *unused)
+{
+	(void)pf;
+	(void)unused;
+
+	return call_present(ua_call(uag_cur()), false);
+}
 #endif
 
 
@@ -757,6 +804,8 @@ static const struct cmd callcmdv[] = {
 #ifdef USE_VIDEO
 {"video_cycle", 'E',      0, "Cycle video encoder", call_videoenc_cycle   },
 {"video_debug", 'V',      0, "Video stream",        call_video_debug      },
+{"present",     0,        0, "Start presenting",    cmd_present           },
+{"present_stop",0,        0, "Stop presenting",     cmd_present_stop      },
 #endif
 
 /* Numeric keypad for DTMF events: */
@@ -809,8 +858,45 @@ static int menu_set_incall(bool incall)
 }
 
 
+/*
+ * Compare the stats of a call with the last printed status line, and
+ * take them over if they differ
+ *
+ * @return True if the status line must be printed again
+ */
+static bool statline_update(struct statline *sl, const struct call *call)
+{
+	struct call_stats cs;
+	struct statline cur;
+	size_t i;
+
+	if (call_stats(call, &cs))
+		return false;
+
+	memset(&cur, 0, sizeof(cur));
+
+	cur.call     = call;
+	cur.duration = cs.duration;
+
+	for (i=0; i<cs.streamc; i++) {
+		cur.bitratev[2*i]   = cs.streamv[i].tx.bitrate;
+		cur.bitratev[2*i+1] = cs.streamv[i].rx.bitrate;
+	}
+
+	if (cur.call == sl->call && cur.duration == sl->duration &&
+	    0 == memcmp(cur.bitratev, sl->bitratev, sizeof(cur.bitratev)))
+		return false;
+
+	cur.ts = sl->ts;
+	*sl = cur;
+
+	return true;
+}
+
+
 static void tmrstat_handler(void *arg)
 {
+	const uint64_t now = tmr_jiffies();
 	struct call *call;
 	(void)arg;
 
@@ -819,24 +905,37 @@ static void tmrstat_handler(void *arg)
 	if (!call)
 		return;
 
-	tmr_start(&tmr_stat, 100, tmrstat_handler, 0);
+	tmr_start(&tmr_stat, STAT_TICK, tmrstat_handler, 0);
 
-	if (ui_isediting())
+	/* the line is printed again when editing is done */
+	if (ui_isediting() || STATMODE_OFF == statmode) {
+		menu.stat.call = NULL;
 		return;
-
-	if (STATMODE_OFF != statmode) {
-		(void)re_fprintf(stderr, "%H\r", call_status, call);
 	}
+
+	if (menu.stat.call == call &&
+	    now < menu.stat.ts + menu.stat_interval)
+		return;
+
+	if (!statline_update(&menu.stat, call))
+		return;
+
+	menu.stat.ts = now;
+
+	(void)re_fprintf(stderr, "%H\r", call_status, call);
 }
 
 
 static void update_callstatus(void)
 {
 	/* if there are any active calls, enable the call status view */
-	if (have_active_calls())
-		tmr_start(&tmr_stat, 100, tmrstat_handler, 0);
-	else
+	if (have_active_calls()) {
+		tmr_start(&tmr_stat, STAT_TICK, tmrstat_handler, 0);
+	}
+	else {
 		tmr_cancel(&tmr_stat);
+		menu.stat.call = NULL;
+	}
 }
 
 
@@ -1056,6 +1155,9 @@ static int module_init(void)
 	}
 	conf_get_u32(conf_cur(), "redial_delay", &menu.redial_delay);
 
+	menu.stat_interval = 500;
+	conf_get_u32(conf_cur(), "menu_stat_interval", &menu.stat_interval);
+
 	if (menu.redial_attempts) {
 		info("menu: redial enabled with %u attempts and"
 		     " %u seconds delay\n",
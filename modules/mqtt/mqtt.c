@@ -4,6 +4,7 @@
  * Copyright (C) 2017 Erdem MEYDANLI
  */
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
@@ -23,6 +24,32 @@
  * MQTT protocol.
  */
 
+/*
+ * Events are not published on the thread that raised them. They are put
+ * into a bounded lock-free queue (the bounded MPMC queue of D. Vyukov,
+ * since the client callback thread publishes too) and a publisher thread
+ * sends them in batches. When the queue is full the event is dropped and
+ * counted. State events are published with QoS 0, and of the state
+ * events on one topic in a batch only the last one is sent.
+ */
+
+enum {
+    PUB_QUEUE    = 256,    /**< Queue size, must be a power of two */
+    PUB_BATCH    = 32,     /**< Max events published per batch     */
+    PUB_INTERVAL = 20,     /**< Publisher batch interval [ms]      */
+};
+
+struct pub_msg {
+    const char *topic;     /**< Static topic string                */
+    bool state;            /**< State event, may be coalesced      */
+    char payload[];
+};
+
+struct pub_cell {
+    size_t seq;
+    struct pub_msg *msg;
+};
+
 /** Defines the status modes */
 
 enum statmode {
@@ -55,7 +82,25 @@ static struct {
     MQTTClient client;
     MQTTClient_connectOptions connection_options;
     enum statmode statmode;
-} mqtt;
+
+    struct {
+        struct pub_cell cellv[PUB_QUEUE];
+        size_t head;               /**< Next cell to write             */
+        size_t tail;               /**< Next cell to read              */
+        pthread_t thread;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        bool run;
+        uint64_t n_pub;            /**< Events published               */
+        uint64_t n_coalesced;      /**< State events superseded        */
+        uint64_t n_dropped;        /**< Events dropped, queue full     */
+    } pub;
+} mqtt = {
+    .pub = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .cond  = PTHREAD_COND_INITIALIZER,
+    },
+};
 
 static const char *translate_errorcode(uint16_t scode)
 {
@@ -85,22 +130,232 @@ static const char *get_event_message(const char *event, int result)
     return buf;
 }
 
-static void mqtt_send_message(const char *msg)
+static void pub_init(void)
+{
+    size_t i;
+
+    for (i = 0; i < PUB_QUEUE; i++)
+        mqtt.pub.cellv[i].seq = i;
+
+    mqtt.pub.head = 0;
+    mqtt.pub.tail = 0;
+}
+
+/* may be called from any thread */
+static bool pub_push(struct pub_msg *msg)
+{
+    size_t pos = __atomic_load_n(&mqtt.pub.head, __ATOMIC_RELAXED);
+    struct pub_cell *cell;
+
+    for (;;) {
+        size_t seq;
+        intptr_t dif;
+
+        cell = &mqtt.pub.cellv[pos & (PUB_QUEUE - 1)];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (intptr_t)seq - (intptr_t)pos;
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&mqtt.pub.head, &pos, pos + 1,
+                                            true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        }
+        else if (dif < 0) {
+            return false;
+        }
+        else {
+            pos = __atomic_load_n(&mqtt.pub.head, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->msg = msg;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/* publisher thread only */
+static struct pub_msg *pub_pop(void)
+{
+    size_t pos = mqtt.pub.tail;
+    struct pub_cell *cell = &mqtt.pub.cellv[pos & (PUB_QUEUE - 1)];
+    struct pub_msg *msg;
+
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return NULL;
+
+    msg = cell->msg;
+    mqtt.pub.tail = pos + 1;
+    __atomic_store_n(&cell->seq, pos + PUB_QUEUE, __ATOMIC_RELEASE);
+
+    return msg;
+}
+
+static void pub_send(const struct pub_msg *msg)
 {
-    int ret = MQTTClient_isConnected(mqtt.client);
+    MQTTClient_message pubmsg = MQTTClient_message_initializer;
 
-    if (1 == ret) {
-        MQTTClient_message pubmsg = MQTTClient_message_initializer;
+    pubmsg.payload = (char *) msg->payload;
+    pubmsg.payloadlen = strlen(msg->payload) + 1;
+    pubmsg.qos = msg->state ? 0 : 1;
+    pubmsg.retained = 0;
 
-        pubmsg.payload = (char *) msg;
-        pubmsg.payloadlen = strlen(msg) + 1;
-        pubmsg.qos = 1;
-        pubmsg.retained = 0;
+    MQTTClient_publishMessage(mqtt.client, msg->topic, &pubmsg, NULL);
+}
+
+/* a state event is superseded by a later one on the same topic */
+static bool pub_superseded(struct pub_msg **batch, size_t i, size_t n)
+{
+    size_t j;
+
+    if (!batch[i]->state)
+        return false;
 
-        MQTTClient_publishMessage(mqtt.client, "baresip/write", &pubmsg, NULL);
-    } else {
-        info("*** mqtt: connection failed!\n");
+    for (j = i + 1; j < n; j++) {
+        if (batch[j]->state && batch[j]->topic == batch[i]->topic)
+            return true;
     }
+
+    return false;
+}
+
+static void pub_flush(void)
+{
+    struct pub_msg *batch[PUB_BATCH];
+    size_t n, i;
+
+    do {
+        bool connected;
+
+        for (n = 0; n < PUB_BATCH; n++) {
+            batch[n] = pub_pop();
+            if (!batch[n])
+                break;
+        }
+
+        if (!n)
+            return;
+
+        connected = 1 == MQTTClient_isConnected(mqtt.client);
+        if (!connected)
+            info("*** mqtt: connection failed!\n");
+
+        for (i = 0; i < n; i++) {
+
+            if (pub_superseded(batch, i, n)) {
+                __atomic_fetch_add(&mqtt.pub.n_coalesced, 1,
+                                   __ATOMIC_RELAXED);
+            }
+            else if (connected) {
+                pub_send(batch[i]);
+                __atomic_fetch_add(&mqtt.pub.n_pub, 1, __ATOMIC_RELAXED);
+            }
+
+            free(batch[i]);
+        }
+
+    } while (n == PUB_BATCH);
+}
+
+static void *pub_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&mqtt.pub.mutex);
+
+    while (mqtt.pub.run) {
+
+        struct timespec ts;
+
+        (void)clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += PUB_INTERVAL * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_nsec -= 1000000000;
+            ++ts.tv_sec;
+        }
+
+        (void)pthread_cond_timedwait(&mqtt.pub.cond, &mqtt.pub.mutex, &ts);
+
+        pthread_mutex_unlock(&mqtt.pub.mutex);
+        pub_flush();
+        pthread_mutex_lock(&mqtt.pub.mutex);
+    }
+
+    pthread_mutex_unlock(&mqtt.pub.mutex);
+
+    /* publish what is left */
+    pub_flush();
+
+    return NULL;
+}
+
+static void mqtt_enqueue(const char *topic, const char *msg, bool state)
+{
+    size_t len = strlen(msg) + 1;
+    struct pub_msg *pm;
+
+    pm = malloc(sizeof(*pm) + len);
+    if (!pm)
+        return;
+
+    pm->topic = topic;
+    pm->state = state;
+    memcpy(pm->payload, msg, len);
+
+    if (!pub_push(pm)) {
+        uint64_t n = __atomic_add_fetch(&mqtt.pub.n_dropped, 1,
+                                        __ATOMIC_RELAXED);
+        if (n == 1 || n % 100 == 0)
+            warning("mqtt: publish queue full, %llu events dropped\n", n);
+        free(pm);
+    }
+}
+
+static void mqtt_publish(const char *topic, const char *msg)
+{
+    mqtt_enqueue(topic, msg, false);
+}
+
+static void mqtt_send_state(const char *msg)
+{
+    mqtt_enqueue("baresip/write", msg, true);
+}
+
+static int mqtt_pub_debug(struct re_printf *pf, void *unused)
+{
+    (void)unused;
+
+    return re_hprintf(pf, "mqtt: published=%llu coalesced=%llu"
+                      " dropped=%llu\n",
+                      __atomic_load_n(&mqtt.pub.n_pub, __ATOMIC_RELAXED),
+                      __atomic_load_n(&mqtt.pub.n_coalesced,
+                                      __ATOMIC_RELAXED),
+                      __atomic_load_n(&mqtt.pub.n_dropped,
+                                      __ATOMIC_RELAXED));
+}
+
+static const struct cmd cmdv[] = {
+    {"mqttstat", 0, 0, "MQTT publisher statistics", mqtt_pub_debug},
+};
+
+static void mqtt_send_message(const char *msg)
+{
+    mqtt_publish("baresip/write", msg);
+}
+
+/* call-quality record, printed into one buffer */
+static void mqtt_send_stats(const struct call *call, const char *type)
+{
+    char buf[4096];
+
+    if (re_snprintf(buf, sizeof(buf), "{ \"event\" : \"%s\", \"call\" : %H }",
+                    type, call_stats_json, call) < 0) {
+        warning("mqtt: call stats record too long\n");
+        return;
+    }
+
+    mqtt_publish("baresip/stats", buf);
 }
 
 static void ua_event_handler(struct ua *ua, enum ua_event ev,
@@ -137,27 +392,27 @@ static void ua_event_handler(struct ua *ua, enum ua_event ev,
                 /* Alert user */
                 (void)play_file(&mqtt.play, player,
                         "ring.wav", -1);
-                mqtt_send_message("{ \"status\" : \"calling\" }");
+                mqtt_send_state("{ \"status\" : \"calling\" }");
             }
         }
         break;
 
     case UA_EVENT_CALL_RINGING:
-        mqtt_send_message("{ \"status\" : \"ringing\" }");
+        mqtt_send_state("{ \"status\" : \"ringing\" }");
         /* stop any ringtones */
         mqtt.play = mem_deref(mqtt.play);
         (void)play_file(&mqtt.play, player, "ringback.wav", -1);
         break;
 
     case UA_EVENT_CALL_ESTABLISHED:
-        mqtt_send_message("{ \"status\" : \"connected\" }");
+        mqtt_send_state("{ \"status\" : \"connected\" }");
         /* stop any ringtones */
         mqtt.play = mem_deref(mqtt.play);
         break;
 
     case UA_EVENT_CALL_CLOSED:
         /* stop any ringtones */
-        mqtt_send_message("{ \"status\" : \"closed\" }");
+        mqtt_send_state("{ \"status\" : \"closed\" }");
 
         mqtt.play = mem_deref(mqtt.play);
 
@@ -171,6 +426,10 @@ static void ua_event_handler(struct ua *ua, enum ua_event ev,
         }
         break;
 
+    case UA_EVENT_CALL_STATS:
+        mqtt_send_stats(call, prm);
+        break;
+
     case UA_EVENT_REGISTER_OK:
         mqtt_send_message("{ \"status\" : \"registered\" }");
         break;
@@ -380,6 +639,17 @@ static int module_init(void)
     MQTTClient_create(&mqtt.client, "localhost", "meerd", MQTTCLIENT_PERSISTENCE_NONE, NULL);
     memcpy(&mqtt.connection_options, &connection_options, sizeof(connection_options));
 
+    pub_init();
+    mqtt.pub.run = true;
+    err = pthread_create(&mqtt.pub.thread, NULL, pub_thread, NULL);
+    if (err) {
+        mqtt.pub.run = false;
+        warning("mqtt: could not start publisher (%m)\n", err);
+        return err;
+    }
+
+    (void)cmd_register(baresip_commands(), cmdv, ARRAY_SIZE(cmdv));
+
     mqtt.connection_options.keepAliveInterval = 20;
     mqtt.connection_options.cleansession = 1;
     MQTTClient_setCallbacks(mqtt.client, NULL, mqtt_connection_lost, mqtt_message_arrived, NULL);
@@ -402,6 +672,19 @@ static int module_close(void)
 
     message_close();
     uag_event_unregister(ua_event_handler);
+    cmd_unregister(baresip_commands(), cmdv);
+
+    if (mqtt.pub.run) {
+        pthread_mutex_lock(&mqtt.pub.mutex);
+        mqtt.pub.run = false;
+        pthread_cond_signal(&mqtt.pub.cond);
+        pthread_mutex_unlock(&mqtt.pub.mutex);
+
+        pthread_join(mqtt.pub.thread, NULL);
+    }
+
+    info("mqtt: published=%llu coalesced=%llu dropped=%llu\n",
+         mqtt.pub.n_pub, mqtt.pub.n_coalesced, mqtt.pub.n_dropped);
 
     mqtt.play = mem_deref(mqtt.play);
 
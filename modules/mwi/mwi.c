@@ -13,27 +13,92 @@
  *
  * Message Waiting Indication
  *
+ * The SUBSCRIBE requests are sent from a queue at mwi_rate, which is
+ * sip_reg_rate by default, so that they do not add to the burst of
+ * REGISTERs when many User-Agents register at once. The expiry of each
+ * subscription is a little random, which keeps the refreshes spread out.
+ *
+ * With mwi_list the mailboxes of all User-Agents are subscribed with one
+ * resource list subscription (RFC 4662), sent by the first User-Agent
+ * that registers. The server sends one NOTIFY with a part per mailbox,
+ * and each part is shown for the User-Agent in its Message-Account. If
+ * the server does not accept the list, each User-Agent subscribes on
+ * its own.
+ *
+ * Example config:
+ \verbatim
+  mwi_rate        50                          # SUBSCRIBEs per second
+  mwi_list        sip:mwi-list@example.com    # Resource list URI
+ \endverbatim
  */
 
 
+enum {
+	EXPIRES    = 600,      /**< Subscription expiry [s]              */
+	JITTER     = 60,       /**< Random part of the expiry [s]        */
+	QUEUE_TICK = 10,       /**< Queue timer interval [ms]            */
+	HASH_SIZE  = 256,      /**< Buckets of the subscription hash     */
+};
+
 struct mwi {
 	struct le le;
+	struct le he;          /**< Hash element, by User-Agent          */
+	struct le le_q;        /**< Element of the subscribe queue       */
 	struct sipsub *sub;
 	struct ua *ua;
 	struct tmr tmr;
+	bool list;             /**< Resource list subscription           */
 	bool shutdown;
 };
 
 static struct tmr tmr;
 static struct list mwil;
+static struct hash *ht_mwi;
+
+static struct {
+	struct list q;         /**< Queued subscriptions                 */
+	struct tmr tmr;        /**< Sends the queued SUBSCRIBEs          */
+	uint64_t ts;           /**< Time of the last tick                */
+	uint32_t credit;       /**< Requests that may be sent, x1000     */
+} mwiq;
+
+static struct {
+	uint32_t rate;         /**< SUBSCRIBEs per second, 0=no limit    */
+	char list[256];        /**< Resource list URI (optional)         */
+} mwi_conf;
+
+static struct mwi *rls;        /**< The resource list subscription   */
+static bool rls_failed;        /**< The server rejected the list     */
+
+
+static int mwi_subscribe(struct mwi *mwi);
+
+
+static uint32_t ua_hash(const struct ua *ua)
+{
+	return hash_joaat((const uint8_t *)&ua, sizeof(ua));
+}
+
+
+static bool mwi_cmp(struct le *le, void *arg)
+{
+	const struct mwi *mwi = le->data;
+
+	return mwi->ua == arg;
+}
 
 
 static void destructor(void *arg)
 {
 	struct mwi *mwi = arg;
 
+	if (rls == mwi)
+		rls = NULL;
+
 	tmr_cancel(&mwi->tmr);
 	list_unlink(&mwi->le);
+	list_unlink(&mwi->le_q);
+	hash_unlink(&mwi->he);
 	mem_deref(mwi->sub);
 	mem_deref(mwi->ua);
 }
@@ -54,14 +119,89 @@ static int auth_handler(char **username, char **password,
 }
 
 
+static void mwi_output(const struct ua *ua, const struct pl *body)
+{
+	ui_output("----- MWI for %s -----\n", ua_aor(ua));
+	ui_output("%r\n", body);
+}
+
+
+/* One part of a list NOTIFY, the summary of one mailbox */
+static void decode_part(const struct pl *part)
+{
+	struct pl body, acc;
+	struct ua *ua;
+	char aor[256];
+
+	if (re_regex(part->p, part->l, "\r\n\r\n[^]+", &body))
+		return;
+
+	/* the RLMI document of the list itself */
+	if (re_regex(part->p, body.p - part->p,
+		     "application/simple-message-summary"))
+		return;
+
+	if (re_regex(body.p, body.l, "Message-Account:[ \t]*[^\r\n]+",
+		     NULL, &acc))
+		return;
+
+	(void)pl_strcpy(&acc, aor, sizeof(aor));
+
+	ua = uag_find_aor(aor);
+	if (!ua) {
+		debug("mwi: no User-Agent for mailbox %s\n", aor);
+		return;
+	}
+
+	mwi_output(ua, &body);
+}
+
+
+static void decode_list(const struct sip_msg *msg)
+{
+	struct pl bnd, s, e, p;
+	char expr[64];
+
+	if (re_regex(msg->ctyp.params.p, msg->ctyp.params.l,
+		     "boundary=[~]+", &bnd))
+		return;
+
+	if (re_snprintf(expr, sizeof(expr), "--%r[^]+", &bnd) < 0)
+		return;
+
+	if (re_regex((char *)mbuf_buf(msg->mb), mbuf_get_left(msg->mb),
+		     expr, &s))
+		return;
+
+	while (s.l > 2) {
+		if (re_regex(s.p, s.l, expr, &e))
+			return;
+
+		p.p = s.p + 2;
+		p.l = e.p - p.p - bnd.l - 2;
+
+		decode_part(&p);
+
+		s = e;
+	}
+}
+
+
 static void notify_handler(struct sip *sip, const struct sip_msg *msg,
 			   void *arg)
 {
 	struct mwi *mwi = arg;
 
-	if (mbuf_get_left(msg->mb)) {
-		ui_output("----- MWI for %s -----\n", ua_aor(mwi->ua));
-		ui_output("%b\n", mbuf_buf(msg->mb), mbuf_get_left(msg->mb));
+	if (mwi->list && msg_ctype_cmp(&msg->ctyp, "multipart", "related")) {
+		decode_list(msg);
+	}
+	else if (mbuf_get_left(msg->mb)) {
+		struct pl body;
+
+		body.p = (const char *)mbuf_buf(msg->mb);
+		body.l = mbuf_get_left(msg->mb);
+
+		mwi_output(mwi->ua, &body);
 	}
 
 	(void)sip_treply(NULL, sip, msg, 200, "OK");
@@ -71,48 +211,149 @@ static void notify_handler(struct sip *sip, const struct sip_msg *msg,
 }
 
 
+static void queue_handler(void *arg)
+{
+	const uint64_t now = tmr_jiffies();
+	struct le *le;
+	(void)arg;
+
+	/* allow a burst of one tick at most */
+	mwiq.credit += (uint32_t)min(now - mwiq.ts, QUEUE_TICK) *
+		mwi_conf.rate;
+	mwiq.ts = now;
+
+	while ((le = list_head(&mwiq.q)) && mwiq.credit >= 1000) {
+
+		struct mwi *mwi = le->data;
+
+		list_unlink(&mwi->le_q);
+		mwiq.credit -= 1000;
+
+		(void)mwi_subscribe(mwi);
+	}
+
+	if (list_isempty(&mwiq.q))
+		mwiq.credit = 0;
+	else
+		tmr_start(&mwiq.tmr, QUEUE_TICK, queue_handler, NULL);
+}
+
+
+static struct mwi *mwi_find(const struct ua *ua)
+{
+	return list_ledata(hash_lookup(ht_mwi, ua_hash(ua),
+				       mwi_cmp, (void *)ua));
+}
+
+
+static void mwi_add(struct ua *ua)
+{
+	struct mwi *mwi;
+
+	if (mwi_find(ua))
+		return;
+
+	/* one list subscription covers all User-Agents */
+	if (str_isset(mwi_conf.list) && !rls_failed && rls)
+		return;
+
+	mwi = mem_zalloc(sizeof(*mwi), destructor);
+	if (!mwi)
+		return;
+
+	list_append(&mwil, &mwi->le, mwi);
+	hash_append(ht_mwi, ua_hash(ua), &mwi->he, mwi);
+	mwi->ua = mem_ref(ua);
+
+	if (str_isset(mwi_conf.list) && !rls_failed) {
+		mwi->list = true;
+		rls = mwi;
+	}
+
+	if (!mwi_conf.rate) {
+		(void)mwi_subscribe(mwi);
+		return;
+	}
+
+	list_append(&mwiq.q, &mwi->le_q, mwi);
+
+	if (!tmr_isrunning(&mwiq.tmr)) {
+		mwiq.ts = tmr_jiffies();
+		mwiq.credit = 1000;
+		queue_handler(NULL);
+	}
+}
+
+
+/* The server does not take the list, subscribe one by one */
+static void list_fallback(void)
+{
+	struct le *le;
+
+	warning("mwi: resource list %s not accepted,"
+		" subscribing each mailbox\n", mwi_conf.list);
+
+	rls_failed = true;
+
+	for (le = list_head(uag_list()); le; le = le->next) {
+		struct ua *ua = le->data;
+
+		if (ua_isregistered(ua) || !account_regint(ua_account(ua)))
+			mwi_add(ua);
+	}
+}
+
+
 static void close_handler(int err, const struct sip_msg *msg,
 			  const struct sipevent_substate *substate,
 			  void *arg)
 {
 	struct mwi *mwi = arg;
+	bool fallback;
 	(void)substate;
 
 	info("mwi: subscription for %s closed: %s (%u %r)\n",
-	     ua_aor(mwi->ua),
+	     mwi->list ? mwi_conf.list : ua_aor(mwi->ua),
 	     err ? strerror(err) : "",
 	     err ? 0 : msg->scode,
 	     err ? 0 : &msg->reason);
 
+	fallback = mwi->list && !mwi->shutdown && (err || msg->scode >= 300);
+
 	mem_deref(mwi);
+
+	if (fallback)
+		list_fallback();
 }
 
 
-static int mwi_subscribe(struct ua *ua)
+static int mwi_subscribe(struct mwi *mwi)
 {
+	struct ua *ua = mwi->ua;
+	const char *uri = mwi->list ? mwi_conf.list : ua_aor(ua);
 	const char *routev[1];
-	struct mwi *mwi;
+	uint32_t expires;
 	int err;
 
-	mwi = mem_zalloc(sizeof(*mwi), destructor);
-	if (!mwi)
-		return ENOMEM;
-
-	list_append(&mwil, &mwi->le, mwi);
-	mwi->ua = mem_ref(ua);
-
 	routev[0] = ua_outbound(ua);
 
-	info("mwi: subscribing to messages for %s\n", ua_aor(ua));
+	/* the refreshes of all subscriptions are not in step */
+	expires = EXPIRES - rand_u32() % JITTER;
 
-	err = sipevent_subscribe(&mwi->sub, uag_sipevent_sock(), ua_aor(ua),
+	info("mwi: subscribing to messages for %s\n", uri);
+
+	err = sipevent_subscribe(&mwi->sub, uag_sipevent_sock(), uri,
 				 NULL, ua_aor(ua), "message-summary", NULL,
-	                         600, ua_cuser(ua),
+	                         expires, ua_cuser(ua),
 				 routev, routev[0] ? 1 : 0,
 	                         auth_handler, ua_account(ua), true, NULL,
 				 notify_handler, close_handler, mwi,
+				 "%s"
 				 "Accept:"
-				 " application/simple-message-summary\r\n");
+				 " application/simple-message-summary%s\r\n",
+				 mwi->list ? "Supported: eventlist\r\n" : "",
+				 mwi->list ? ", multipart/related,"
+				 " application/rlmi+xml" : "");
 	if (err) {
 		warning("mwi: subscribe ERROR: %m\n", err);
 	}
@@ -124,22 +365,6 @@ static int mwi_subscribe(struct ua *ua)
 }
 
 
-static struct mwi *mwi_find(const struct ua *ua)
-{
-	struct le *le;
-
-	for (le = mwil.head; le; le = le->next) {
-
-		struct mwi *mwi = le->data;
-
-		if (mwi->ua == ua)
-			return mwi;
-	}
-
-	return NULL;
-}
-
-
 static void ua_event_handler(struct ua *ua,
 			     enum ua_event ev,
 			     struct call *call,
@@ -152,8 +377,7 @@ static void ua_event_handler(struct ua *ua,
 
 	if (ev == UA_EVENT_REGISTER_OK) {
 
-		if (!mwi_find(ua))
-			mwi_subscribe(ua);
+		mwi_add(ua);
 	}
 	else if (ev == UA_EVENT_SHUTDOWN) {
 
@@ -161,6 +385,8 @@ static void ua_event_handler(struct ua *ua,
 
 		info("mwi: shutdown\n");
 
+		tmr_cancel(&mwiq.tmr);
+
 		le = list_head(&mwil);
 		while (le) {
 			struct mwi *mwi = le->data;
@@ -190,7 +416,7 @@ static void tmr_handler(void *arg)
 		struct account *acc = ua_account(ua);
 
 		if (account_regint(acc) == 0) {
-			mwi_subscribe(ua);
+			mwi_add(ua);
 		}
 	}
 }
@@ -198,10 +424,25 @@ static void tmr_handler(void *arg)
 
 static int module_init(void)
 {
+	int err;
+
+	mwi_conf.rate = conf_config()->sip.reg_rate;
+
+	(void)conf_get_u32(conf_cur(), "mwi_rate", &mwi_conf.rate);
+	(void)conf_get_str(conf_cur(), "mwi_list",
+			   mwi_conf.list, sizeof(mwi_conf.list));
+
+	err = hash_alloc(&ht_mwi, HASH_SIZE);
+	if (err)
+		return err;
+
 	list_init(&mwil);
 	tmr_start(&tmr, 1, tmr_handler, 0);
 
-	return uag_event_register(ua_event_handler, NULL);
+	return uag_event_register_mask(ua_event_handler,
+				       UA_EVENT_BIT(UA_EVENT_REGISTER_OK) |
+				       UA_EVENT_BIT(UA_EVENT_SHUTDOWN),
+				       NULL, NULL);
 }
 
 
@@ -209,7 +450,10 @@ static int module_close(void)
 {
 	uag_event_unregister(ua_event_handler);
 	tmr_cancel(&tmr);
+	tmr_cancel(&mwiq.tmr);
 	list_flush(&mwil);
+	ht_mwi = mem_deref(ht_mwi);
+	rls_failed = false;
 
 	return 0;
 }
@@ -14,25 +14,54 @@
  * NAT Port Mapping Protocol (NAT-PMP)
  *
  * https://tools.ietf.org/html/rfc6886
+ *
+ * The mappings are kept in a table by internal port, and all of them are
+ * renewed from one timer, in a batch when they are close to expiry.
+ * With natpmp_pool set, the ports at the start of the rtp_ports range
+ * are mapped when the module is loaded and kept mapped. A stream that
+ * gets one of these ports is established without asking the gateway.
+ * For the best hit rate, rtp_ports should not have more ports than the
+ * pool.
+ *
+ * Example config:
+ \verbatim
+  natpmp_server   10.0.0.1
+  natpmp_pool     64          # Ports mapped in advance, 0 = off
+ \endverbatim
  */
 
 enum {
-	LIFETIME = 300 /* seconds */
+	LIFETIME   = 300,   /* seconds */
+	RENEW_TICK = 10,    /* Interval of the renew timer [s]          */
+	RENEW_LEFT = 75,    /* Renewed with less than this left [s]     */
+	HASH_SIZE  = 256,
+};
+
+/* A port mapping, used by at most one stream component */
+struct mapping {
+	struct le he;               /* Element of the table, by port    */
+	struct natpmp_req *natpmp;  /* Pending request                  */
+	struct comp *comp;          /* Stream component, or NULL        */
+	uint64_t expires;           /* Time of expiry [ms]              */
+	uint32_t lifetime;
+	uint16_t int_port;
+	uint16_t ext_port;
+	bool granted;
+	bool pooled;                /* Kept when no stream uses it      */
 };
 
 struct mnat_sess {
 	struct list medial;
+	struct tmr tmr;             /* Completes with pooled mappings   */
 	mnat_estab_h *estabh;
 	void *arg;
 };
 
 struct mnat_media {
 	struct comp {
-		struct natpmp_req *natpmp;
+		struct mapping *map;
 		struct mnat_media *media;   /* pointer to parent */
-		struct tmr tmr;
 		uint16_t int_port;
-		uint32_t lifetime;
 		unsigned id;
 		bool granted;
 	} compv[2];
@@ -47,6 +76,9 @@ struct mnat_media {
 static struct mnat *mnat;
 static struct sa natpmp_srv, natpmp_extaddr;
 static struct natpmp_req *natpmp_ext;
+static struct hash *ht_map;
+static struct tmr tmr_renew;
+static uint32_t pool_size;
 
 
 static void natpmp_resp_handler(int err, const struct natpmp_resp *resp,
@@ -57,10 +89,76 @@ static void session_destructor(void *arg)
 {
 	struct mnat_sess *sess = arg;
 
+	tmr_cancel(&sess->tmr);
 	list_flush(&sess->medial);
 }
 
 
+static void mapping_destructor(void *arg)
+{
+	struct mapping *map = arg;
+
+	hash_unlink(&map->he);
+	mem_deref(map->natpmp);
+
+	/* Destroy the mapping */
+	if (map->granted) {
+		(void)natpmp_mapping_request(NULL, &natpmp_srv,
+					     map->int_port, 0, 0,
+					     NULL, NULL);
+	}
+}
+
+
+static bool mapping_cmp(struct le *le, void *arg)
+{
+	const struct mapping *map = le->data;
+
+	return map->int_port == *(uint16_t *)arg;
+}
+
+
+static struct mapping *mapping_find(uint16_t port)
+{
+	return list_ledata(hash_lookup(ht_map, port, mapping_cmp, &port));
+}
+
+
+static int mapping_request(struct mapping *map)
+{
+	map->natpmp = mem_deref(map->natpmp);
+
+	return natpmp_mapping_request(&map->natpmp, &natpmp_srv,
+				      map->int_port, 0, map->lifetime,
+				      natpmp_resp_handler, map);
+}
+
+
+static int mapping_alloc(struct mapping **mapp, uint16_t port, bool pooled)
+{
+	struct mapping *map;
+	int err;
+
+	map = mem_zalloc(sizeof(*map), mapping_destructor);
+	if (!map)
+		return ENOMEM;
+
+	map->int_port = port;
+	map->lifetime = LIFETIME;
+	map->pooled   = pooled;
+
+	hash_append(ht_map, port, &map->he, map);
+
+	err = mapping_request(map);
+	if (err)
+		mem_deref(map);
+	else
+		*mapp = map;
+
+	return err;
+}
+
+
 static void media_destructor(void *arg)
 {
 	struct mnat_media *m = arg;
@@ -71,15 +169,14 @@ static void media_destructor(void *arg)
 	for (i=0; i<m->compc; i++) {
 		struct comp *comp = &m->compv[i];
 
-		/* Destroy the mapping */
-		if (comp->granted) {
-			(void)natpmp_mapping_request(NULL, &natpmp_srv,
-						     comp->int_port, 0, 0,
-						     NULL, NULL);
-		}
+		if (!comp->map)
+			continue;
 
-		tmr_cancel(&comp->tmr);
-		mem_deref(comp->natpmp);
+		comp->map->comp = NULL;
+
+		/* a pooled mapping is kept for the next stream */
+		if (!comp->map->pooled)
+			mem_deref(comp->map);
 	}
 
 	mem_deref(m->sdpm);
@@ -131,28 +228,66 @@ static void is_complete(struct mnat_sess *sess)
 }
 
 
-static void refresh_timeout(void *arg)
+/* Update SDP media with external IP-address mapping */
+static void comp_granted(struct comp *comp)
+{
+	struct mnat_media *m = comp->media;
+	struct sa map_addr;
+
+	map_addr = natpmp_extaddr;
+	sa_set_port(&map_addr, comp->map->ext_port);
+
+	if (comp->id == 1)
+		sdp_media_set_laddr(m->sdpm, &map_addr);
+	else
+		sdp_media_set_laddr_rtcp(m->sdpm, &map_addr);
+
+	comp->granted = true;
+}
+
+
+static bool renew_apply(struct le *le, void *arg)
 {
-	struct comp *comp = arg;
+	struct mapping *map = le->data;
+	uint32_t *n = arg;
+
+	/* one that failed is tried again */
+	if (map->natpmp ||
+	    (map->granted &&
+	     map->expires > tmr_jiffies() + RENEW_LEFT * 1000))
+		return false;
+
+	if (0 == mapping_request(map))
+		++*n;
 
-	comp->natpmp = mem_deref(comp->natpmp);
-	(void)natpmp_mapping_request(&comp->natpmp, &natpmp_srv,
-				     comp->int_port, 0, comp->lifetime,
-				     natpmp_resp_handler, comp);
+	return false;
+}
+
+
+/* The mappings close to expiry are renewed together */
+static void renew_handler(void *arg)
+{
+	uint32_t n = 0;
+	(void)arg;
+
+	tmr_start(&tmr_renew, RENEW_TICK * 1000, renew_handler, NULL);
+
+	(void)hash_apply(ht_map, renew_apply, &n);
+
+	if (n)
+		debug("natpmp: renewing %u mappings\n", n);
 }
 
 
 static void natpmp_resp_handler(int err, const struct natpmp_resp *resp,
 				void *arg)
 {
-	struct comp *comp = arg;
-	struct mnat_media *m = comp->media;
-	struct sa map_addr;
+	struct mapping *map = arg;
+	struct comp *comp = map->comp;
 
 	if (err) {
 		warning("natpmp: response error: %m\n", err);
-		complete(m->sess, err);
-		return;
+		goto error;
 	}
 
 	if (resp->op != NATPMP_OP_MAPPING_UDP)
@@ -160,38 +295,45 @@ static void natpmp_resp_handler(int err, const struct natpmp_resp *resp,
 	if (resp->result != NATPMP_SUCCESS) {
 		warning("natpmp: request failed with result code: %d\n",
 			resp->result);
-		complete(m->sess, EPROTO);
-		return;
+		err = EPROTO;
+		goto error;
 	}
 
-	if (resp->u.map.int_port != comp->int_port) {
+	if (resp->u.map.int_port != map->int_port) {
 		info("natpmp: ignoring response for internal_port=%u\n",
 		     resp->u.map.int_port);
 		return;
 	}
 
+	debug("natpmp: mapping granted:"
+	      " internal_port=%u, external_port=%u, lifetime=%u\n",
+	      resp->u.map.int_port, resp->u.map.ext_port,
+	      resp->u.map.lifetime);
+
+	map->ext_port = resp->u.map.ext_port;
+	map->lifetime = resp->u.map.lifetime;
+	map->expires  = tmr_jiffies() + map->lifetime * 1000ULL;
+	map->granted  = true;
+
+	/* a renewal, the stream has the mapping already */
+	if (!comp || comp->granted)
+		return;
+
 	info("natpmp: mapping granted for comp %u:"
-	     " internal_port=%u, external_port=%u, lifetime=%u\n",
-	     comp->id,
-	     resp->u.map.int_port, resp->u.map.ext_port,
-	     resp->u.map.lifetime);
+	     " internal_port=%u, external_port=%u\n",
+	     comp->id, map->int_port, map->ext_port);
 
-	map_addr = natpmp_extaddr;
-	sa_set_port(&map_addr, resp->u.map.ext_port);
-	comp->lifetime = resp->u.map.lifetime;
+	comp_granted(comp);
 
-	/* Update SDP media with external IP-address mapping */
-	if (comp->id == 1)
-		sdp_media_set_laddr(m->sdpm, &map_addr);
-	else
-		sdp_media_set_laddr_rtcp(m->sdpm, &map_addr);
+	is_complete(comp->media->sess);
 
-	comp->granted = true;
+	return;
 
-	tmr_start(&comp->tmr, comp->lifetime * 1000 * 3/4,
-		  refresh_timeout, comp);
+ error:
+	map->granted = false;
 
-	is_complete(m->sess);
+	if (comp && !comp->granted)
+		complete(comp->media->sess, err);
 }
 
 
@@ -229,8 +371,17 @@ static int session_alloc(struct mnat_sess **sessp, struct dnsc *dnsc,
 }
 
 
+static void sess_complete_handler(void *arg)
+{
+	struct mnat_sess *sess = arg;
+
+	is_complete(sess);
+}
+
+
 static int comp_alloc(struct comp *comp, void *sock)
 {
+	struct mapping *map;
 	struct sa laddr;
 	int err;
 
@@ -243,11 +394,33 @@ static int comp_alloc(struct comp *comp, void *sock)
 	info("natpmp: `%s' stream comp %u local UDP port is %u\n",
 	     sdp_media_name(comp->media->sdpm), comp->id, comp->int_port);
 
-	err = natpmp_mapping_request(&comp->natpmp, &natpmp_srv,
-				     comp->int_port, 0, comp->lifetime,
-				     natpmp_resp_handler, comp);
-	if (err)
-		goto out;
+	map = mapping_find(comp->int_port);
+	if (map && map->comp) {
+		warning("natpmp: port %u is mapped for another stream\n",
+			comp->int_port);
+		return EADDRINUSE;
+	}
+
+	if (!map) {
+		err = mapping_alloc(&map, comp->int_port, false);
+		if (err)
+			goto out;
+	}
+	else if (!map->granted && !map->natpmp) {
+		err = mapping_request(map);
+		if (err)
+			goto out;
+	}
+
+	map->comp = comp;
+	comp->map = map;
+
+	/* from the pool, completed from the main loop */
+	if (map->granted) {
+		comp_granted(comp);
+		tmr_start(&comp->media->sess->tmr, 0,
+			  sess_complete_handler, comp->media->sess);
+	}
 
  out:
 	return err;
@@ -284,7 +457,6 @@ static int media_alloc(struct mnat_media **mp, struct mnat_sess *sess,
 
 		comp->id = i+1;
 		comp->media = m;
-		comp->lifetime = LIFETIME;
 
 		err = comp_alloc(comp, i==0 ? sock1 : sock2);
 		if (err)
@@ -347,6 +519,35 @@ static bool net_rt_handler(const char *ifname, const struct sa *dst,
 }
 
 
+/* Map the first ports of the RTP port range in advance */
+static void pool_init(void)
+{
+	const struct range *ports = &conf_config()->avt.rtp_ports;
+	uint32_t port, n = 0;
+
+	if (!pool_size || !ports->min)
+		return;
+
+	for (port = ports->min; port <= ports->max && n < pool_size; port++) {
+
+		struct mapping *map;
+
+		if (mapping_alloc(&map, (uint16_t)port, true))
+			break;
+
+		++n;
+	}
+
+	if (ports->max - ports->min + 1 > n) {
+		info("natpmp: pool has %u of the %u ports in rtp_ports\n",
+		     n, ports->max - ports->min + 1);
+	}
+	else {
+		info("natpmp: pool has all %u ports of rtp_ports\n", n);
+	}
+}
+
+
 static int module_init(void)
 {
 	int err;
@@ -357,6 +558,7 @@ static int module_init(void)
 	net_rt_list(net_rt_handler, NULL);
 
 	conf_get_sa(conf_cur(), "natpmp_server", &natpmp_srv);
+	(void)conf_get_u32(conf_cur(), "natpmp_pool", &pool_size);
 
 	info("natpmp: using NAT-PMP server at %J\n", &natpmp_srv);
 
@@ -365,6 +567,14 @@ static int module_init(void)
 	if (err)
 		return err;
 
+	err = hash_alloc(&ht_map, HASH_SIZE);
+	if (err)
+		return err;
+
+	pool_init();
+
+	tmr_start(&tmr_renew, RENEW_TICK * 1000, renew_handler, NULL);
+
 	return mnat_register(&mnat, baresip_mnatl(), "natpmp", NULL,
 			     session_alloc, media_alloc, NULL);
 }
@@ -375,6 +585,10 @@ static int module_close(void)
 	mnat       = mem_deref(mnat);
 	natpmp_ext = mem_deref(natpmp_ext);
 
+	tmr_cancel(&tmr_renew);
+	hash_flush(ht_map);
+	ht_map     = mem_deref(ht_map);
+
 	return 0;
 }
 
@@ -54,9 +54,10 @@ static void texture_render(struct vidisp_st *st)
 
 	glBindTexture(GL_TEXTURE_2D, st->texture_id);
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB,
-		     st->vf->size.w, st->vf->size.h, 0,
-		     GL_RGB, GL_UNSIGNED_SHORT_5_6_5, st->vf->data[0]);
+	/* the texture was allocated in texture_init(), only update it */
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
+			st->vf->size.w, st->vf->size.h,
+			GL_RGB, GL_UNSIGNED_SHORT_5_6_5, st->vf->data[0]);
 
 	/* Setup the vertices */
 	glEnableClientState(GL_VERTEX_ARRAY);
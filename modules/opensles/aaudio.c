@@ -0,0 +1,387 @@
+/**
+ * @file opensles/aaudio.c  AAudio audio driver for Android 8.0 and later
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <time.h>
+#include <aaudio/AAudio.h>
+#include <re.h>
+#include <baresip.h>
+#include <SLES/OpenSLES.h>
+#include "opensles.h"
+
+
+/*
+ * The streams are opened exclusive with low latency, at the native
+ * sample rate of the device. The device asks for one burst of samples in
+ * each callback, the audio core handles any number of samples. If the
+ * configured sample rate is not the native one the stream is opened
+ * with the configured rate, and AAudio converts it outside the fast path.
+ * Setting auplay_srate and ausrc_srate to the native rate moves the
+ * resampling to the audio core.
+ */
+
+
+struct auplay_st {
+	const struct auplay *ap;      /* inheritance */
+
+	AAudioStream *s;
+	uint8_t ch;
+	auplay_write_h *wh;
+	void *arg;
+};
+
+struct ausrc_st {
+	const struct ausrc *as;       /* inheritance */
+
+	AAudioStream *s;
+	uint8_t ch;
+	bool ready;
+	ausrc_read_h *rh;
+	ausrc_error_h *errh;
+	void *arg;
+};
+
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void stream_close(AAudioStream *s)
+{
+	if (!s)
+		return;
+
+	/* waits for the callback to return */
+	(void)AAudioStream_requestStop(s);
+	(void)AAudioStream_close(s);
+}
+
+
+static int stream_open(AAudioStream **sp, aaudio_direction_t dir,
+		       int32_t srate, uint8_t ch, enum aufmt fmt,
+		       AAudioStream_dataCallback datah,
+		       AAudioStream_errorCallback errh, void *arg)
+{
+	AAudioStreamBuilder *b;
+	aaudio_result_t r;
+
+	r = AAudio_createStreamBuilder(&b);
+	if (r != AAUDIO_OK)
+		return ENOMEM;
+
+	AAudioStreamBuilder_setDirection(b, dir);
+	AAudioStreamBuilder_setSharingMode(b, AAUDIO_SHARING_MODE_EXCLUSIVE);
+	AAudioStreamBuilder_setPerformanceMode(b,
+					AAUDIO_PERFORMANCE_MODE_LOW_LATENCY);
+	AAudioStreamBuilder_setSampleRate(b, srate);
+	AAudioStreamBuilder_setChannelCount(b, ch);
+	AAudioStreamBuilder_setFormat(b, fmt == AUFMT_FLOAT
+				      ? AAUDIO_FORMAT_PCM_FLOAT
+				      : AAUDIO_FORMAT_PCM_I16);
+	AAudioStreamBuilder_setDataCallback(b, datah, arg);
+	AAudioStreamBuilder_setErrorCallback(b, errh, arg);
+
+	r = AAudioStreamBuilder_openStream(b, sp);
+
+	AAudioStreamBuilder_delete(b);
+
+	if (r != AAUDIO_OK) {
+		warning("aaudio: could not open stream (%s)\n",
+			AAudio_convertResultToText(r));
+		return ENODEV;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Open a stream at the native sample rate of the device. If that is not
+ * the sample rate of the application, the stream is opened again with
+ * the sample rate of the application.
+ */
+static int stream_alloc(AAudioStream **sp, aaudio_direction_t dir,
+			uint32_t srate, uint8_t ch, enum aufmt fmt,
+			AAudioStream_dataCallback datah,
+			AAudioStream_errorCallback errh, void *arg)
+{
+	const char *key = dir == AAUDIO_DIRECTION_OUTPUT
+		? "auplay_srate" : "ausrc_srate";
+	AAudioStream *s;
+	int32_t native;
+	int err;
+
+	err = stream_open(&s, dir, AAUDIO_UNSPECIFIED, ch, fmt,
+			  datah, errh, arg);
+	if (err)
+		return err;
+
+	native = AAudioStream_getSampleRate(s);
+	if (native != (int32_t)srate) {
+
+		warning("aaudio: the native sample rate is %d Hz, set"
+			" `%s %d' to resample in the audio core\n",
+			native, key, native);
+
+		(void)AAudioStream_close(s);
+
+		err = stream_open(&s, dir, srate, ch, fmt, datah, errh, arg);
+		if (err)
+			return err;
+	}
+
+	if (AAudioStream_getSharingMode(s) != AAUDIO_SHARING_MODE_EXCLUSIVE ||
+	    AAudioStream_getPerformanceMode(s) !=
+	    AAUDIO_PERFORMANCE_MODE_LOW_LATENCY) {
+		info("aaudio: %s stream is not on the low-latency path\n",
+		     dir == AAUDIO_DIRECTION_OUTPUT ? "output" : "input");
+	}
+
+	info("aaudio: %s stream %d Hz, %d channels, burst %d frames\n",
+	     dir == AAUDIO_DIRECTION_OUTPUT ? "output" : "input",
+	     AAudioStream_getSampleRate(s), AAudioStream_getChannelCount(s),
+	     AAudioStream_getFramesPerBurst(s));
+
+	*sp = s;
+
+	return 0;
+}
+
+
+static void auplay_destructor(void *arg)
+{
+	struct auplay_st *st = arg;
+
+	stream_close(st->s);
+}
+
+
+static aaudio_data_callback_result_t write_handler(AAudioStream *s,
+						   void *arg, void *data,
+						   int32_t nframes)
+{
+	struct auplay_st *st = arg;
+	(void)s;
+
+	st->wh(data, (size_t)nframes * st->ch, st->arg);
+
+	return AAUDIO_CALLBACK_RESULT_CONTINUE;
+}
+
+
+static void play_error_handler(AAudioStream *s, void *arg,
+			       aaudio_result_t error)
+{
+	(void)s;
+	(void)arg;
+
+	warning("aaudio: output stream error (%s)\n",
+		AAudio_convertResultToText(error));
+}
+
+
+/*
+ * The output latency is the time from writing the next frame until it
+ * is presented, estimated from the last timestamp of the device.
+ */
+int aaudio_player_debug(struct re_printf *pf, const struct auplay_st *st)
+{
+	int64_t pos, ns, lat = 0;
+	int32_t srate;
+
+	if (!st)
+		return 0;
+
+	srate = AAudioStream_getSampleRate(st->s);
+
+	if (srate > 0 && AAudioStream_getTimestamp(st->s, CLOCK_MONOTONIC,
+						   &pos, &ns) == AAUDIO_OK) {
+
+		const int64_t written = AAudioStream_getFramesWritten(st->s);
+
+		lat = ns + (written - pos) * 1000000000 / srate - now_ns();
+	}
+
+	return re_hprintf(pf, "aaudio latency=%.1fms buffer=%d xruns=%d",
+			  lat / 1000000.0,
+			  AAudioStream_getBufferSizeInFrames(st->s),
+			  AAudioStream_getXRunCount(st->s));
+}
+
+
+int aaudio_player_alloc(struct auplay_st **stp, const struct auplay *ap,
+			struct auplay_prm *prm, const char *device,
+			auplay_write_h *wh, void *arg)
+{
+	struct auplay_st *st;
+	aaudio_result_t r;
+	int err;
+	(void)device;
+
+	if (!stp || !ap || !prm || !wh)
+		return EINVAL;
+
+	if (prm->fmt != AUFMT_S16LE && prm->fmt != AUFMT_FLOAT)
+		return ENOTSUP;
+
+	st = mem_zalloc(sizeof(*st), auplay_destructor);
+	if (!st)
+		return ENOMEM;
+
+	st->ap  = ap;
+	st->ch  = prm->ch;
+	st->wh  = wh;
+	st->arg = arg;
+
+	err = stream_alloc(&st->s, AAUDIO_DIRECTION_OUTPUT, prm->srate,
+			   prm->ch, prm->fmt, write_handler,
+			   play_error_handler, st);
+	if (err)
+		goto out;
+
+	/* one burst is played while the next one is written */
+	(void)AAudioStream_setBufferSizeInFrames(st->s,
+				2 * AAudioStream_getFramesPerBurst(st->s));
+
+	r = AAudioStream_requestStart(st->s);
+	if (r != AAUDIO_OK) {
+		warning("aaudio: could not start player (%s)\n",
+			AAudio_convertResultToText(r));
+		err = ENODEV;
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(st);
+	else
+		*stp = st;
+
+	return err;
+}
+
+
+static void ausrc_destructor(void *arg)
+{
+	struct ausrc_st *st = arg;
+
+	st->ready = false;
+	stream_close(st->s);
+}
+
+
+static aaudio_data_callback_result_t read_handler(AAudioStream *s,
+						  void *arg, void *data,
+						  int32_t nframes)
+{
+	struct ausrc_st *st = arg;
+	(void)s;
+
+	st->rh(data, (size_t)nframes * st->ch, st->arg);
+
+	return AAUDIO_CALLBACK_RESULT_CONTINUE;
+}
+
+
+/* Called in a thread of AAudio, e.g. when the headset is unplugged */
+static void src_error_handler(AAudioStream *s, void *arg,
+			      aaudio_result_t error)
+{
+	struct ausrc_st *st = arg;
+	(void)s;
+
+	warning("aaudio: input stream error (%s)\n",
+		AAudio_convertResultToText(error));
+
+	if (st->ready && st->errh) {
+		st->ready = false;
+		st->errh(ENODEV, AAudio_convertResultToText(error), st->arg);
+	}
+}
+
+
+/*
+ * The input latency is the age of the next frame that is read,
+ * estimated from the last timestamp of the device.
+ */
+int aaudio_recorder_debug(struct re_printf *pf, const struct ausrc_st *st)
+{
+	int64_t pos, ns, lat = 0;
+	int32_t srate;
+
+	if (!st)
+		return 0;
+
+	srate = AAudioStream_getSampleRate(st->s);
+
+	if (srate > 0 && AAudioStream_getTimestamp(st->s, CLOCK_MONOTONIC,
+						   &pos, &ns) == AAUDIO_OK) {
+
+		const int64_t read = AAudioStream_getFramesRead(st->s);
+
+		lat = now_ns() - ns - (read - pos) * 1000000000 / srate;
+	}
+
+	return re_hprintf(pf, "aaudio latency=%.1fms xruns=%d",
+			  lat / 1000000.0, AAudioStream_getXRunCount(st->s));
+}
+
+
+int aaudio_recorder_alloc(struct ausrc_st **stp, const struct ausrc *as,
+			  struct media_ctx **ctx,
+			  struct ausrc_prm *prm, const char *device,
+			  ausrc_read_h *rh, ausrc_error_h *errh, void *arg)
+{
+	struct ausrc_st *st;
+	aaudio_result_t r;
+	int err;
+	(void)ctx;
+	(void)device;
+
+	if (!stp || !as || !prm || !rh)
+		return EINVAL;
+
+	if (prm->fmt != AUFMT_S16LE && prm->fmt != AUFMT_FLOAT)
+		return ENOTSUP;
+
+	st = mem_zalloc(sizeof(*st), ausrc_destructor);
+	if (!st)
+		return ENOMEM;
+
+	st->as   = as;
+	st->ch   = prm->ch;
+	st->rh   = rh;
+	st->errh = errh;
+	st->arg  = arg;
+
+	err = stream_alloc(&st->s, AAUDIO_DIRECTION_INPUT, prm->srate,
+			   prm->ch, prm->fmt, read_handler,
+			   src_error_handler, st);
+	if (err)
+		goto out;
+
+	st->ready = true;
+
+	r = AAudioStream_requestStart(st->s);
+	if (r != AAUDIO_OK) {
+		warning("aaudio: could not start recorder (%s)\n",
+			AAudio_convertResultToText(r));
+		err = ENODEV;
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(st);
+	else
+		*stp = st;
+
+	return err;
+}
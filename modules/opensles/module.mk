@@ -10,4 +10,10 @@ $(MOD)_SRCS	+= player.c
 $(MOD)_SRCS	+= recorder.c
 $(MOD)_LFLAGS	+= -lOpenSLES
 
+ifneq ($(shell [ -f $(SYSROOT)/include/aaudio/AAudio.h ] && echo 1),)
+$(MOD)_SRCS	+= aaudio.c
+$(MOD)_CFLAGS	+= -DUSE_AAUDIO
+$(MOD)_LFLAGS	+= -laaudio
+endif
+
 include mk/mod.mk
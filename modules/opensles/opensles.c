@@ -13,7 +13,20 @@
 /**
  * @defgroup opensles opensles
  *
- * Audio driver module for Android OpenSLES
+ * Audio driver module for Android OpenSLES and AAudio
+ *
+ * If the NDK has AAudio (Android 8.0 and later) the module also has the
+ * "aaudio" driver. It opens exclusive low-latency streams at the native
+ * sample rate of the device, which is 48000 Hz on most devices. On older
+ * devices the "opensles" driver is used instead.
+ *
+ * Example config:
+ \verbatim
+  audio_player    aaudio,
+  audio_source    aaudio,
+  auplay_srate    48000     # Native rate, resampled in the audio core
+  ausrc_srate     48000
+ \endverbatim
  */
 
 
@@ -23,6 +36,10 @@ SLEngineItf engineEngine;
 
 static struct auplay *auplay;
 static struct ausrc *ausrc;
+#ifdef USE_AAUDIO
+static struct auplay *auplay_aa;
+static struct ausrc *ausrc_aa;
+#endif
 
 
 static int module_init(void)
@@ -50,6 +67,14 @@ static int module_init(void)
 	err  = auplay_register(&auplay, "opensles", opensles_player_alloc);
 	err |= ausrc_register(&ausrc, "opensles", opensles_recorder_alloc);
 
+#ifdef USE_AAUDIO
+	err |= auplay_register(&auplay_aa, "aaudio", aaudio_player_alloc);
+	err |= ausrc_register(&ausrc_aa, "aaudio", aaudio_recorder_alloc);
+
+	auplay_set_debug(auplay_aa, aaudio_player_debug);
+	ausrc_set_debug(ausrc_aa, aaudio_recorder_debug);
+#endif
+
 	return err;
 }
 
@@ -58,6 +83,10 @@ static int module_close(void)
 {
 	auplay = mem_deref(auplay);
 	ausrc = mem_deref(ausrc);
+#ifdef USE_AAUDIO
+	auplay_aa = mem_deref(auplay_aa);
+	ausrc_aa  = mem_deref(ausrc_aa);
+#endif
 
 	if (engineObject != NULL) {
 		(*engineObject)->Destroy(engineObject);
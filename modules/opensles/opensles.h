@@ -16,3 +16,16 @@ int opensles_recorder_alloc(struct ausrc_st **stp, const struct ausrc *as,
 			    struct media_ctx **ctx,
 			    struct ausrc_prm *prm, const char *device,
 			    ausrc_read_h *rh, ausrc_error_h *errh, void *arg);
+
+
+#ifdef USE_AAUDIO
+int aaudio_player_alloc(struct auplay_st **stp, const struct auplay *ap,
+			struct auplay_prm *prm, const char *device,
+			auplay_write_h *wh, void *arg);
+int aaudio_player_debug(struct re_printf *pf, const struct auplay_st *st);
+int aaudio_recorder_alloc(struct ausrc_st **stp, const struct ausrc *as,
+			  struct media_ctx **ctx,
+			  struct ausrc_prm *prm, const char *device,
+			  ausrc_read_h *rh, ausrc_error_h *errh, void *arg);
+int aaudio_recorder_debug(struct re_printf *pf, const struct ausrc_st *st);
+#endif
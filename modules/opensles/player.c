@@ -153,6 +153,9 @@ int opensles_player_alloc(struct auplay_st **stp, const struct auplay *ap,
 	if (!stp || !ap || !prm || !wh)
 		return EINVAL;
 
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
 	debug("opensles: opening player %uHz, %uchannels\n",
 			prm->srate, prm->ch);
 
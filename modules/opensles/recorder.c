@@ -162,6 +162,9 @@ int opensles_recorder_alloc(struct ausrc_st **stp, const struct ausrc *as,
 	if (!stp || !as || !prm || !rh)
 		return EINVAL;
 
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
 	debug("opensles: opening recorder %uHz, %uchannels\n",
 			prm->srate, prm->ch);
 
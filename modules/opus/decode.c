@@ -12,6 +12,7 @@
 
 struct audec_state {
 	OpusDecoder *dec;
+	uint32_t srate;
 	unsigned ch;
 };
 
@@ -20,7 +21,13 @@ static void destructor(void *arg)
 {
 	struct audec_state *ads = arg;
 
-	if (ads->dec)
+	if (!ads->dec)
+		return;
+
+	(void)opus_decoder_ctl(ads->dec, OPUS_RESET_STATE);
+
+	if (!statepool_put(opus_decpool, opus_pool_key(ads->srate, ads->ch),
+			   ads->dec))
 		opus_decoder_destroy(ads->dec);
 }
 
@@ -44,9 +51,13 @@ int opus_decode_update(struct audec_state **adsp, const struct aucodec *ac,
 	if (!ads)
 		return ENOMEM;
 
-	ads->ch = ac->ch;
+	ads->srate = ac->srate;
+	ads->ch    = ac->ch;
 
-	ads->dec = opus_decoder_create(ac->srate, ac->ch, &opuserr);
+	ads->dec = statepool_get(opus_decpool,
+				 opus_pool_key(ac->srate, ac->ch));
+	if (!ads->dec)
+		ads->dec = opus_decoder_create(ac->srate, ac->ch, &opuserr);
 	if (!ads->dec) {
 		warning("opus: decoder create: %s\n", opus_strerror(opuserr));
 		err = ENOMEM;
@@ -84,6 +95,30 @@ int opus_decode_frm(struct audec_state *ads, int16_t *sampv, size_t *sampc,
 }
 
 
+/* Decode the lost frame before this packet, from its in-band FEC data */
+int opus_decode_fec(struct audec_state *ads, int16_t *sampv, size_t *sampc,
+		    const uint8_t *buf, size_t len)
+{
+	int n, frames;
+
+	if (!ads || !sampv || !sampc || !buf)
+		return EINVAL;
+
+	/* the lost frame has the duration of this one */
+	frames = opus_packet_get_nb_samples(buf, (opus_int32)len, 48000);
+	if (frames <= 0 || (size_t)frames * ads->ch > *sampc)
+		return EPROTO;
+
+	n = opus_decode(ads->dec, buf, (opus_int32)len, sampv, frames, 1);
+	if (n < 0)
+		return EPROTO;
+
+	*sampc = n * ads->ch;
+
+	return 0;
+}
+
+
 int opus_decode_pkloss(struct audec_state *ads, int16_t *sampv, size_t *sampc)
 {
 	int n;
@@ -99,3 +134,44 @@ int opus_decode_pkloss(struct audec_state *ads, int16_t *sampv, size_t *sampc)
 
 	return 0;
 }
+
+
+/* Decode to S16 or float, a NULL buffer conceals a lost packet */
+int opus_decode_fmt_frm(struct audec_state *ads, int fmt,
+			void *sampv, size_t *sampc,
+			const uint8_t *buf, size_t len)
+{
+	int n;
+
+	if (!ads || !sampv || !sampc)
+		return EINVAL;
+
+	if (!buf)
+		len = 0;
+
+	switch (fmt) {
+
+	case AUFMT_S16LE:
+		n = opus_decode(ads->dec, buf, (opus_int32)len,
+				sampv, (int)(*sampc/ads->ch), 0);
+		break;
+
+	case AUFMT_FLOAT:
+		n = opus_decode_float(ads->dec, buf, (opus_int32)len,
+				      sampv, (int)(*sampc/ads->ch), 0);
+		break;
+
+	default:
+		return ENOTSUP;
+	}
+
+	if (n < 0) {
+		if (buf)
+			warning("opus: decode error: %s\n", opus_strerror(n));
+		return EPROTO;
+	}
+
+	*sampc = n * ads->ch;
+
+	return 0;
+}
@@ -10,9 +10,37 @@
 #include "opus.h"
 
 
+/*
+ * The encoder follows the packet loss that the peer reports in RTCP.
+ * In-band FEC is switched on while there is loss (or always, if the
+ * peer asked for it with useinbandfec=1), and the expected loss is
+ * given to the encoder so it spends enough bits on the FEC data. The
+ * loss is applied from the encoding thread, before the next frame.
+ *
+ * When the CPU budget governor asks for it, the encoder switches to a
+ * lower complexity until the load is back to normal.
+ *
+ * With DTX the encoder sends a frame only now and then during silence,
+ * the 1-2 byte frames in between are not sent.
+ */
+
+
+enum {
+	LOSS_DECAY  = 2,   /* Loss estimate decrease per report [%] */
+	COMPLEX     = 10,  /* Complexity                            */
+	COMPLEX_LOW = 3,   /* Complexity under CPU load             */
+};
+
+
 struct auenc_state {
 	OpusEncoder *enc;
+	uint32_t srate;
 	unsigned ch;
+	volatile opus_int32 loss;  /* Reported loss, written by RTCP */
+	opus_int32 loss_cur;       /* Loss given to the encoder      */
+	opus_int32 complex;        /* Complexity of the encoder      */
+	bool fec;                  /* In-band FEC wanted by the peer */
+	bool dtx;                  /* Discontinuous transmission     */
 };
 
 
@@ -20,7 +48,14 @@ static void destructor(void *arg)
 {
 	struct auenc_state *aes = arg;
 
-	if (aes->enc)
+	if (!aes->enc)
+		return;
+
+	/* reset to the state of a new encoder, and reuse it */
+	(void)opus_encoder_ctl(aes->enc, OPUS_RESET_STATE);
+
+	if (!statepool_put(opus_encpool, opus_pool_key(aes->srate, aes->ch),
+			   aes->enc))
 		opus_encoder_destroy(aes->enc);
 }
 
@@ -89,19 +124,23 @@ int opus_encode_update(struct auenc_state **aesp, const struct aucodec *ac,
 	aes = *aesp;
 
 	if (!aes) {
-		const opus_int32 complex = 10;
 		int opuserr;
 
 		aes = mem_zalloc(sizeof(*aes), destructor);
 		if (!aes)
 			return ENOMEM;
 
-		aes->ch = ac->ch;
+		aes->srate = ac->srate;
+		aes->ch    = ac->ch;
 
-		aes->enc = opus_encoder_create(ac->srate, ac->ch,
-					       /* this has big impact on cpu */
-					       OPUS_APPLICATION_AUDIO,
-					       &opuserr);
+		aes->enc = statepool_get(opus_encpool,
+					 opus_pool_key(ac->srate, ac->ch));
+		if (!aes->enc) {
+			/* the application has big impact on cpu */
+			aes->enc = opus_encoder_create(ac->srate, ac->ch,
+						       OPUS_APPLICATION_AUDIO,
+						       &opuserr);
+		}
 		if (!aes->enc) {
 			warning("opus: encoder create: %s\n",
 				opus_strerror(opuserr));
@@ -109,7 +148,9 @@ int opus_encode_update(struct auenc_state **aesp, const struct aucodec *ac,
 			return ENOMEM;
 		}
 
-		(void)opus_encoder_ctl(aes->enc, OPUS_SET_COMPLEXITY(complex));
+		aes->complex = COMPLEX;
+		(void)opus_encoder_ctl(aes->enc,
+				       OPUS_SET_COMPLEXITY(aes->complex));
 
 		*aesp = aes;
 	}
@@ -142,6 +183,11 @@ int opus_encode_update(struct auenc_state **aesp, const struct aucodec *ac,
 	(void)opus_encoder_ctl(aes->enc, OPUS_SET_INBAND_FEC(prm.inband_fec));
 	(void)opus_encoder_ctl(aes->enc, OPUS_SET_DTX(prm.dtx));
 
+	aes->fec      = prm.inband_fec;
+	aes->dtx      = prm.dtx;
+	aes->loss_cur = 0;
+	(void)opus_encoder_ctl(aes->enc, OPUS_SET_PACKET_LOSS_PERC(0));
+
 
 #if 0
 	{
@@ -166,6 +212,60 @@ int opus_encode_update(struct auenc_state **aesp, const struct aucodec *ac,
 }
 
 
+/* Apply the load level and the reported loss, from the encoding thread */
+static void encoder_update(struct auenc_state *aes)
+{
+	const opus_int32 complex = governor_level() >= GOV_CODEC
+		? COMPLEX_LOW : COMPLEX;
+	const opus_int32 loss = aes->loss;
+
+	if (complex != aes->complex) {
+		(void)opus_encoder_ctl(aes->enc, OPUS_SET_COMPLEXITY(complex));
+		aes->complex = complex;
+	}
+
+	if (!opus_adapt || loss == aes->loss_cur)
+		return;
+
+	(void)opus_encoder_ctl(aes->enc, OPUS_SET_PACKET_LOSS_PERC(loss));
+	(void)opus_encoder_ctl(aes->enc,
+			       OPUS_SET_INBAND_FEC(aes->fec || loss > 0));
+
+	aes->loss_cur = loss;
+}
+
+
+/* Packet loss reported by the peer [%], rises fast and decays slowly */
+void opus_encode_loss(struct auenc_state *aes, unsigned loss)
+{
+	opus_int32 cur;
+
+	if (!aes)
+		return;
+
+	cur = aes->loss - LOSS_DECAY;
+
+	aes->loss = max((opus_int32)min(loss, 100), max(cur, 0));
+}
+
+
+/* The frame length is given by the number of samples of each frame */
+bool opus_encode_ptime(uint32_t ptime)
+{
+	switch (ptime) {
+
+	case 10:
+	case 20:
+	case 40:
+	case 60:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+
 int opus_encode_frm(struct auenc_state *aes, uint8_t *buf, size_t *len,
 		    const int16_t *sampv, size_t sampc)
 {
@@ -174,6 +274,8 @@ int opus_encode_frm(struct auenc_state *aes, uint8_t *buf, size_t *len,
 	if (!aes || !buf || !len || !sampv)
 		return EINVAL;
 
+	encoder_update(aes);
+
 	n = opus_encode(aes->enc, sampv, (int)(sampc/aes->ch),
 			buf, (opus_int32)(*len));
 	if (n < 0) {
@@ -181,7 +283,46 @@ int opus_encode_frm(struct auenc_state *aes, uint8_t *buf, size_t *len,
 		return EPROTO;
 	}
 
-	*len = n;
+	/* nothing is sent for a DTX frame */
+	*len = (aes->dtx && n <= 2) ? 0 : n;
+
+	return 0;
+}
+
+
+int opus_encode_fmt_frm(struct auenc_state *aes, uint8_t *buf, size_t *len,
+			int fmt, const void *sampv, size_t sampc)
+{
+	opus_int32 n;
+
+	if (!aes || !buf || !len || !sampv)
+		return EINVAL;
+
+	encoder_update(aes);
+
+	switch (fmt) {
+
+	case AUFMT_S16LE:
+		n = opus_encode(aes->enc, sampv, (int)(sampc/aes->ch),
+				buf, (opus_int32)(*len));
+		break;
+
+	case AUFMT_FLOAT:
+		n = opus_encode_float(aes->enc, sampv, (int)(sampc/aes->ch),
+				      buf, (opus_int32)(*len));
+		break;
+
+	default:
+		return ENOTSUP;
+	}
+
+	if (n < 0) {
+		warning("opus: encode error: %s\n", opus_strerror((int)n));
+		return EPROTO;
+	}
+
+	/* nothing is sent for a DTX frame */
+	*len = (aes->dtx && n <= 2) ? 0 : n;
 
 	return 0;
 }
@@ -7,6 +7,7 @@
 MOD		:= opus
 $(MOD)_SRCS	+= decode.c
 $(MOD)_SRCS	+= encode.c
+$(MOD)_SRCS	+= multistream.c
 $(MOD)_SRCS	+= opus.c
 $(MOD)_SRCS	+= sdp.c
 $(MOD)_LFLAGS	+= -lopus -lm
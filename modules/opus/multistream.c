@@ -0,0 +1,415 @@
+/**
+ * @file opus/multistream.c Opus Multistream (surround and ambisonics)
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <re.h>
+#include <baresip.h>
+#include <opus/opus.h>
+#include <opus/opus_multistream.h>
+#include "opus.h"
+
+
+/*
+ * More than two channels are coded as several Opus streams in one
+ * packet, each with one or two channels. The streams and the mapping
+ * of the channels are not in the packets, so they are signalled in the
+ * fmtp, the same way as WebRTC does it:
+ *
+ *   a=rtpmap:100 multiopus/48000/6
+ *   a=fmtp:100 channel_mapping=0,4,1,2,3,5;num_streams=4;coupled_streams=2
+ *
+ * The encoder uses the layout of libopus for the channel count, mapping
+ * family 1 for surround (Vorbis order: FL C FR RL RR LFE for 5.1) and
+ * family 2 for ambisonics (ACN order, SN3D). If the peer has no fmtp,
+ * it is assumed to use the same layout.
+ */
+
+
+enum {
+	MS_MAXCH = 16,   /* Third order ambisonics */
+};
+
+struct msparam {
+	int streams;
+	int coupled;
+	unsigned char mapping[MS_MAXCH];
+};
+
+struct auenc_state {
+	OpusMSEncoder *enc;
+	unsigned ch;
+};
+
+struct audec_state {
+	OpusMSDecoder *dec;
+	unsigned ch;
+};
+
+
+static int ms_family;
+static struct msparam ms_local;
+
+
+static void enc_destructor(void *arg)
+{
+	struct auenc_state *aes = arg;
+
+	if (aes->enc)
+		opus_multistream_encoder_destroy(aes->enc);
+}
+
+
+static void dec_destructor(void *arg)
+{
+	struct audec_state *ads = arg;
+
+	if (ads->dec)
+		opus_multistream_decoder_destroy(ads->dec);
+}
+
+
+/* The layout that libopus uses for an encoder with these channels */
+static OpusMSEncoder *enc_create(struct msparam *prm, unsigned ch, int *errp)
+{
+	return opus_multistream_surround_encoder_create(48000, ch, ms_family,
+							&prm->streams,
+							&prm->coupled,
+							prm->mapping,
+							OPUS_APPLICATION_AUDIO,
+							errp);
+}
+
+
+static int decode_fmtp(struct msparam *prm, unsigned ch, const char *fmtp)
+{
+	struct pl pl, val, v;
+	unsigned n = 0;
+
+	if (!str_isset(fmtp))
+		return ENOENT;
+
+	pl_set_str(&pl, fmtp);
+
+	if (!fmt_param_get(&pl, "num_streams", &val))
+		return ENOENT;
+	prm->streams = pl_u32(&val);
+
+	if (!fmt_param_get(&pl, "coupled_streams", &val))
+		return ENOENT;
+	prm->coupled = pl_u32(&val);
+
+	if (!fmt_param_get(&pl, "channel_mapping", &val))
+		return ENOENT;
+
+	while (n < ch && 0 == re_regex(val.p, val.l, "[0-9]+", &v)) {
+
+		const uint32_t m = pl_u32(&v);
+
+		if (m >= (uint32_t)(prm->streams + prm->coupled) && m != 255)
+			return EPROTO;
+
+		prm->mapping[n++] = (unsigned char)m;
+
+		pl_advance(&val, v.p + v.l - val.p);
+	}
+
+	if (n != ch || prm->coupled > prm->streams ||
+	    prm->streams + prm->coupled > (int)ch * 2)
+		return EPROTO;
+
+	return 0;
+}
+
+
+static int ms_encode_update(struct auenc_state **aesp,
+			    const struct aucodec *ac,
+			    struct auenc_param *param, const char *fmtp)
+{
+	struct auenc_state *aes;
+	struct msparam prm;
+	int opuserr;
+	(void)param;
+	(void)fmtp;
+
+	if (!aesp || !ac || !ac->ch)
+		return EINVAL;
+
+	if (*aesp)
+		return 0;
+
+	aes = mem_zalloc(sizeof(*aes), enc_destructor);
+	if (!aes)
+		return ENOMEM;
+
+	aes->ch  = ac->ch;
+	aes->enc = enc_create(&prm, ac->ch, &opuserr);
+	if (!aes->enc) {
+		warning("opus: multistream encoder create: %s\n",
+			opus_strerror(opuserr));
+		mem_deref(aes);
+		return ENOMEM;
+	}
+
+	*aesp = aes;
+
+	return 0;
+}
+
+
+static int ms_encode_frm(struct auenc_state *aes, uint8_t *buf, size_t *len,
+			 const int16_t *sampv, size_t sampc)
+{
+	opus_int32 n;
+
+	if (!aes || !buf || !len || !sampv)
+		return EINVAL;
+
+	n = opus_multistream_encode(aes->enc, sampv, (int)(sampc/aes->ch),
+				    buf, (opus_int32)(*len));
+	if (n < 0) {
+		warning("opus: multistream encode error: %s\n",
+			opus_strerror((int)n));
+		return EPROTO;
+	}
+
+	*len = n;
+
+	return 0;
+}
+
+
+static int ms_encode_fmt_frm(struct auenc_state *aes,
+			     uint8_t *buf, size_t *len,
+			     int fmt, const void *sampv, size_t sampc)
+{
+	opus_int32 n;
+
+	if (!aes || !buf || !len || !sampv)
+		return EINVAL;
+
+	switch (fmt) {
+
+	case AUFMT_S16LE:
+		return ms_encode_frm(aes, buf, len, sampv, sampc);
+
+	case AUFMT_FLOAT:
+		n = opus_multistream_encode_float(aes->enc, sampv,
+						  (int)(sampc/aes->ch),
+						  buf, (opus_int32)(*len));
+		break;
+
+	default:
+		return ENOTSUP;
+	}
+
+	if (n < 0) {
+		warning("opus: multistream encode error: %s\n",
+			opus_strerror((int)n));
+		return EPROTO;
+	}
+
+	*len = n;
+
+	return 0;
+}
+
+
+static int ms_decode_update(struct audec_state **adsp,
+			    const struct aucodec *ac, const char *fmtp)
+{
+	struct audec_state *ads;
+	struct msparam prm = ms_local;
+	int opuserr, err;
+
+	if (!adsp || !ac || !ac->ch)
+		return EINVAL;
+
+	if (*adsp)
+		return 0;
+
+	err = decode_fmtp(&prm, ac->ch, fmtp);
+	if (err == ENOENT) {
+		prm = ms_local;
+	}
+	else if (err) {
+		warning("opus: multistream: invalid fmtp (%s)\n", fmtp);
+		return err;
+	}
+
+	ads = mem_zalloc(sizeof(*ads), dec_destructor);
+	if (!ads)
+		return ENOMEM;
+
+	ads->ch  = ac->ch;
+	ads->dec = opus_multistream_decoder_create(48000, ac->ch,
+						   prm.streams, prm.coupled,
+						   prm.mapping, &opuserr);
+	if (!ads->dec) {
+		warning("opus: multistream decoder create: %s\n",
+			opus_strerror(opuserr));
+		mem_deref(ads);
+		return ENOMEM;
+	}
+
+	*adsp = ads;
+
+	return 0;
+}
+
+
+static int ms_decode_frm(struct audec_state *ads,
+			 int16_t *sampv, size_t *sampc,
+			 const uint8_t *buf, size_t len)
+{
+	int n;
+
+	if (!ads || !sampv || !sampc)
+		return EINVAL;
+
+	n = opus_multistream_decode(ads->dec, buf, (opus_int32)len,
+				    sampv, (int)(*sampc/ads->ch), 0);
+	if (n < 0) {
+		if (buf)
+			warning("opus: multistream decode error: %s\n",
+				opus_strerror(n));
+		return EPROTO;
+	}
+
+	*sampc = n * ads->ch;
+
+	return 0;
+}
+
+
+static int ms_decode_pkloss(struct audec_state *ads,
+			    int16_t *sampv, size_t *sampc)
+{
+	return ms_decode_frm(ads, sampv, sampc, NULL, 0);
+}
+
+
+static int ms_decode_fmt_frm(struct audec_state *ads, int fmt,
+			     void *sampv, size_t *sampc,
+			     const uint8_t *buf, size_t len)
+{
+	int n;
+
+	if (!ads || !sampv || !sampc)
+		return EINVAL;
+
+	if (!buf)
+		len = 0;
+
+	switch (fmt) {
+
+	case AUFMT_S16LE:
+		return ms_decode_frm(ads, sampv, sampc, buf, len);
+
+	case AUFMT_FLOAT:
+		n = opus_multistream_decode_float(ads->dec, buf,
+						  (opus_int32)len, sampv,
+						  (int)(*sampc/ads->ch), 0);
+		break;
+
+	default:
+		return ENOTSUP;
+	}
+
+	if (n < 0) {
+		if (buf)
+			warning("opus: multistream decode error: %s\n",
+				opus_strerror(n));
+		return EPROTO;
+	}
+
+	*sampc = n * ads->ch;
+
+	return 0;
+}
+
+
+static int ms_fmtp_enc(struct mbuf *mb, const struct sdp_format *fmt,
+		       bool offer, void *arg)
+{
+	const struct aucodec *ac = arg;
+	unsigned i;
+	int err;
+	(void)offer;
+
+	if (!mb || !fmt || !ac)
+		return 0;
+
+	err = mbuf_printf(mb, "a=fmtp:%s channel_mapping=", fmt->id);
+
+	for (i=0; i<ac->ch; i++) {
+		err |= mbuf_printf(mb, "%s%u", i ? "," : "",
+				   ms_local.mapping[i]);
+	}
+
+	err |= mbuf_printf(mb, ";num_streams=%d;coupled_streams=%d\r\n",
+			   ms_local.streams, ms_local.coupled);
+
+	return err;
+}
+
+
+static struct aucodec multiopus = {
+	.name      = "multiopus",
+	.srate     = 48000,
+	.crate     = 48000,
+	.encupdh   = ms_encode_update,
+	.ench      = ms_encode_frm,
+	.decupdh   = ms_decode_update,
+	.dech      = ms_decode_frm,
+	.plch      = ms_decode_pkloss,
+	.fmtp_ench = ms_fmtp_enc,
+	.ench_fmt  = ms_encode_fmt_frm,
+	.dech_fmt  = ms_decode_fmt_frm,
+	.ptimeh    = opus_encode_ptime,
+};
+
+
+/**
+ * Register the multistream codec
+ *
+ * @param ch        Number of channels, 3 to 16
+ * @param ambisonic True for ambisonics, false for surround
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int opus_multistream_init(uint32_t ch, bool ambisonic)
+{
+	OpusMSEncoder *enc;
+	int opuserr;
+
+	if (ch < 3 || ch > MS_MAXCH)
+		return EINVAL;
+
+	ms_family = ambisonic ? 2 : 1;
+
+	/* the local layout, for the fmtp */
+	enc = enc_create(&ms_local, ch, &opuserr);
+	if (!enc) {
+		warning("opus: %u channels of %s are not supported: %s\n",
+			ch, ambisonic ? "ambisonics" : "surround",
+			opus_strerror(opuserr));
+		return ENOTSUP;
+	}
+
+	opus_multistream_encoder_destroy(enc);
+
+	multiopus.ch     = ch;
+	multiopus.layout = ambisonic ? AULAYOUT_AMBISONIC : AULAYOUT_STD;
+
+	aucodec_register(&multiopus);
+
+	return 0;
+}
+
+
+void opus_multistream_close(void)
+{
+	aucodec_unregister(&multiopus);
+}
@@ -24,8 +24,16 @@
   opus_cbr        {yes,no}   # Constant Bitrate (inverse of VBR)
   opus_inbandfec  {yes,no}   # Enable inband Forward Error Correction (FEC)
   opus_dtx        {yes,no}   # Enable Discontinuous Transmission (DTX)
+  opus_adaptive   {yes,no}   # FEC and loss from RTCP reports (default yes)
+  opus_channels   6          # Also offer "multiopus" with 3-16 channels
+  opus_mapping    surround   # {surround,ambisonics} for opus_channels
  \endverbatim
  *
+ * The multistream codec is for surround sound (e.g. 6 channels for 5.1)
+ * and first to third order ambisonics (4, 9 or 16 channels, or two more
+ * for a stereo track, libopus 1.3 or later). The audio core mixes it
+ * to the channels of the audio player and source.
+ *
  * References:
  *
  *    RFC 6716  Definition of the Opus Audio Codec
@@ -35,6 +43,14 @@
  */
 
 
+enum {
+	POOL_MAX = 8,   /* Maximum number of pooled states, per pool */
+};
+
+
+bool opus_adapt = true;
+struct statepool *opus_encpool;
+struct statepool *opus_decpool;
 static bool opus_mirror;
 static char fmtp[256] = "stereo=1;sprop-stereo=1";
 static char fmtp_mirror[256];
@@ -70,6 +86,11 @@ static struct aucodec opus = {
 	.dech      = opus_decode_frm,
 	.plch      = opus_decode_pkloss,
 	.fmtp_ench = opus_fmtp_enc,
+	.ench_fmt  = opus_encode_fmt_frm,
+	.dech_fmt  = opus_decode_fmt_frm,
+	.lossh     = opus_encode_loss,
+	.fech      = opus_decode_fec,
+	.ptimeh    = opus_encode_ptime,
 };
 
 
@@ -84,13 +105,44 @@ void opus_mirror_params(const char *x)
 }
 
 
+/*
+ * Encoders and decoders are reset and pooled when a stream is closed,
+ * and reused for the next stream with the same sample rate and
+ * channels. The fmtp parameters are applied again on each update.
+ */
+uint32_t opus_pool_key(uint32_t srate, unsigned ch)
+{
+	return srate << 8 | ch;
+}
+
+
+static void enc_free(void *st)
+{
+	opus_encoder_destroy(st);
+}
+
+
+static void dec_free(void *st)
+{
+	opus_decoder_destroy(st);
+}
+
+
 static int module_init(void)
 {
 	struct conf *conf = conf_cur();
 	uint32_t value;
 	char *p = fmtp + str_len(fmtp);
 	bool b;
-	int n = 0;
+	int n = 0, err;
+
+	err  = statepool_alloc(&opus_encpool, POOL_MAX, enc_free);
+	err |= statepool_alloc(&opus_decpool, POOL_MAX, dec_free);
+	if (err) {
+		opus_encpool = mem_deref(opus_encpool);
+		opus_decpool = mem_deref(opus_decpool);
+		return ENOMEM;
+	}
 
 	if (0 == conf_get_u32(conf, "opus_bitrate", &value)) {
 
@@ -133,19 +185,41 @@ static int module_init(void)
 	}
 
 	(void)conf_get_bool(conf, "opus_mirror", &opus_mirror);
+	(void)conf_get_bool(conf, "opus_adaptive", &opus_adapt);
 
 	debug("opus: fmtp=\"%s\"\n", fmtp);
 
 	aucodec_register(&opus);
 
+	if (0 == conf_get_u32(conf, "opus_channels", &value) && value > 2) {
+
+		char mapping[16] = "surround";
+
+		(void)conf_get_str(conf, "opus_mapping",
+				   mapping, sizeof(mapping));
+
+		b = 0 == str_casecmp(mapping, "ambisonics");
+
+		err = opus_multistream_init(value, b);
+		if (err)
+			return err;
+	}
+
 	return 0;
 }
 
 
 static int module_close(void)
 {
+	opus_multistream_close();
 	aucodec_unregister(&opus);
 
+	debug("opus: encoder pool: %H\n", statepool_debug, opus_encpool);
+	debug("opus: decoder pool: %H\n", statepool_debug, opus_decpool);
+
+	opus_encpool = mem_deref(opus_encpool);
+	opus_decpool = mem_deref(opus_decpool);
+
 	return 0;
 }
 
@@ -20,6 +20,10 @@ int opus_encode_update(struct auenc_state **aesp, const struct aucodec *ac,
 		       struct auenc_param *prm, const char *fmtp);
 int opus_encode_frm(struct auenc_state *aes, uint8_t *buf, size_t *len,
 		    const int16_t *sampv, size_t sampc);
+int opus_encode_fmt_frm(struct auenc_state *aes, uint8_t *buf, size_t *len,
+			int fmt, const void *sampv, size_t sampc);
+void opus_encode_loss(struct auenc_state *aes, unsigned loss);
+bool opus_encode_ptime(uint32_t ptime);
 
 
 /* Decode */
@@ -28,6 +32,16 @@ int opus_decode_update(struct audec_state **adsp, const struct aucodec *ac,
 int opus_decode_frm(struct audec_state *ads, int16_t *sampv, size_t *sampc,
 		    const uint8_t *buf, size_t len);
 int opus_decode_pkloss(struct audec_state *st, int16_t *sampv, size_t *sampc);
+int opus_decode_fec(struct audec_state *ads, int16_t *sampv, size_t *sampc,
+		    const uint8_t *buf, size_t len);
+int opus_decode_fmt_frm(struct audec_state *ads, int fmt,
+			void *sampv, size_t *sampc,
+			const uint8_t *buf, size_t len);
+
+
+/* Multistream */
+int  opus_multistream_init(uint32_t ch, bool ambisonic);
+void opus_multistream_close(void);
 
 
 /* SDP */
@@ -35,3 +49,13 @@ void opus_decode_fmtp(struct opus_param *prm, const char *fmtp);
 
 
 void opus_mirror_params(const char *fmtp);
+
+
+/* State pools */
+uint32_t opus_pool_key(uint32_t srate, unsigned ch);
+
+extern struct statepool *opus_encpool;
+extern struct statepool *opus_decpool;
+
+
+extern bool opus_adapt;
@@ -179,6 +179,8 @@ static void *record_thread(void *arg)
 	struct ausrc_st *st = arg;
 	int n;
 
+	(void)realtime_affinity(conf_config()->audio.cpus_dev, -1);
+
 	while (st->run) {
 
 		n = read(st->fd, st->sampv, st->sampc*2);
@@ -197,6 +199,8 @@ static void *play_thread(void *arg)
 	struct auplay_st *st = arg;
 	int n;
 
+	(void)realtime_affinity(conf_config()->audio.cpus_dev, -1);
+
 	while (st->run) {
 
 		st->wh(st->sampv, st->sampc, st->arg);
@@ -226,6 +230,9 @@ static int src_alloc(struct ausrc_st **stp, const struct ausrc *as,
 	if (!stp || !as || !prm || !rh)
 		return EINVAL;
 
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
 	st = mem_zalloc(sizeof(*st), ausrc_destructor);
 	if (!st)
 		return ENOMEM;
@@ -285,6 +292,9 @@ static int play_alloc(struct auplay_st **stp, const struct auplay *ap,
 	if (!stp || !ap || !prm || !wh)
 		return EINVAL;
 
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
 	st = mem_zalloc(sizeof(*st), auplay_destructor);
 	if (!st)
 		return ENOMEM;
@@ -16,16 +16,43 @@
  *
  * This module implements the medianat interface with PCP, which is
  * the successor of the NAT-PMP protocol.
+ *
+ * The mappings are kept in a table by internal port, and each one is
+ * refreshed by its PCP request. With pcp_pool set, the ports at the
+ * start of the rtp_ports range are mapped when the module is loaded and
+ * kept mapped. Their refreshes are sent close together, and a stream
+ * that gets one of these ports is established without asking the
+ * server. For the best hit rate, rtp_ports should not have more ports
+ * than the pool.
+ *
+ * Example config:
+ \verbatim
+  pcp_server      10.0.0.1:5351
+  pcp_pool        64          # Ports mapped in advance, 0 = off
+ \endverbatim
  */
 
 
 enum {
-	LIFETIME = 120 /* seconds */
+	LIFETIME  = 120, /* seconds */
+	HASH_SIZE = 256,
+};
+
+/* A port mapping, used by at most one stream component */
+struct mapping {
+	struct le he;               /* Element of the table, by port    */
+	struct pcp_request *pcp;
+	struct comp *comp;          /* Stream component, or NULL        */
+	struct sa ext_addr;
+	uint32_t srv_epoch;
+	uint16_t int_port;
+	bool granted;
+	bool pooled;                /* Kept when no stream uses it      */
 };
 
 struct mnat_sess {
-	struct le le;
 	struct list medial;
+	struct tmr tmr;             /* Completes with pooled mappings   */
 	mnat_estab_h *estabh;
 	void *arg;
 };
@@ -33,7 +60,7 @@ struct mnat_sess {
 struct mnat_media {
 
 	struct comp {
-		struct pcp_request *pcp;
+		struct mapping *map;
 		struct mnat_media *media;  /* pointer to parent */
 		unsigned id;
 		bool granted;
@@ -43,25 +70,83 @@ struct mnat_media {
 	struct le le;
 	struct mnat_sess *sess;
 	struct sdp_media *sdpm;
-	uint32_t srv_epoch;
 };
 
 
 static struct mnat *mnat;
 static struct sa pcp_srv;
-static struct list sessl;
+static struct hash *ht_map;
 static struct pcp_listener *lsnr;
+static uint32_t pool_size;
+
+
+static void pcp_resp_handler(int err, struct pcp_msg *msg, void *arg);
 
 
 static void session_destructor(void *arg)
 {
 	struct mnat_sess *sess = arg;
 
-	list_unlink(&sess->le);
+	tmr_cancel(&sess->tmr);
 	list_flush(&sess->medial);
 }
 
 
+static void mapping_destructor(void *arg)
+{
+	struct mapping *map = arg;
+
+	hash_unlink(&map->he);
+	mem_deref(map->pcp);
+}
+
+
+static bool mapping_cmp(struct le *le, void *arg)
+{
+	const struct mapping *map = le->data;
+
+	return map->int_port == *(uint16_t *)arg;
+}
+
+
+static struct mapping *mapping_find(uint16_t port)
+{
+	return list_ledata(hash_lookup(ht_map, port, mapping_cmp, &port));
+}
+
+
+static int mapping_alloc(struct mapping **mapp, uint16_t port, bool pooled)
+{
+	struct mapping *map;
+	struct pcp_map pm;
+	int err;
+
+	map = mem_zalloc(sizeof(*map), mapping_destructor);
+	if (!map)
+		return ENOMEM;
+
+	map->int_port = port;
+	map->pooled   = pooled;
+
+	hash_append(ht_map, port, &map->he, map);
+
+	rand_bytes(pm.nonce, sizeof(pm.nonce));
+	pm.proto = IPPROTO_UDP;
+	pm.int_port = port;
+	/* note: using same address-family as the PCP server */
+	sa_init(&pm.ext_addr, sa_af(&pcp_srv));
+
+	err = pcp_request(&map->pcp, NULL, &pcp_srv, PCP_MAP,
+			  LIFETIME, &pm, pcp_resp_handler, map, 0);
+	if (err)
+		mem_deref(map);
+	else
+		*mapp = map;
+
+	return err;
+}
+
+
 static void media_destructor(void *arg)
 {
 	struct mnat_media *m = arg;
@@ -72,7 +157,14 @@ static void media_destructor(void *arg)
 	for (i=0; i<m->compc; i++) {
 		struct comp *comp = &m->compv[i];
 
-		mem_deref(comp->pcp);
+		if (!comp->map)
+			continue;
+
+		comp->map->comp = NULL;
+
+		/* a pooled mapping is kept for the next stream */
+		if (!comp->map->pooled)
+			mem_deref(comp->map);
 	}
 
 	mem_deref(m->sdpm);
@@ -125,18 +217,30 @@ static void is_complete(struct mnat_sess *sess)
 }
 
 
-/* todo: detect multiple responses */
-static void pcp_resp_handler(int err, struct pcp_msg *msg, void *arg)
+/* Update SDP media with external IP-address mapping */
+static void comp_granted(struct comp *comp)
 {
-	struct comp *comp = arg;
 	struct mnat_media *m = comp->media;
-	const struct pcp_map *map;
+
+	if (comp->id == 1)
+		sdp_media_set_laddr(m->sdpm, &comp->map->ext_addr);
+	else
+		sdp_media_set_laddr_rtcp(m->sdpm, &comp->map->ext_addr);
+
+	comp->granted = true;
+}
+
+
+/* Called for the first response, and for each refresh */
+static void pcp_resp_handler(int err, struct pcp_msg *msg, void *arg)
+{
+	struct mapping *map = arg;
+	struct comp *comp = map->comp;
+	const struct pcp_map *pm;
 
 	if (err) {
 		warning("pcp: mapping error: %m\n", err);
-
-		complete(m->sess, err, NULL);
-		return;
+		goto error;
 	}
 	else if (msg->hdr.result != PCP_SUCCESS) {
 		warning("pcp: mapping error: %s\n",
@@ -144,28 +248,38 @@ static void pcp_resp_handler(int err, struct pcp_msg *msg, void *arg)
 
 		re_printf("%H\n", pcp_msg_print, msg);
 
-		complete(m->sess, EPROTO, "pcp error");
-		return;
+		err = EPROTO;
+		goto error;
 	}
 
-	map = pcp_msg_payload(msg);
+	pm = pcp_msg_payload(msg);
+
+	map->ext_addr  = pm->ext_addr;
+	map->srv_epoch = msg->hdr.epoch;
+	map->granted   = true;
+
+	/* a refresh, the stream has the mapping already */
+	if (!comp || comp->granted)
+		return;
 
 	info("pcp: %s: mapping for %s:"
 	     " internal_port=%u, external_addr=%J\n",
-	     sdp_media_name(m->sdpm),
+	     sdp_media_name(comp->media->sdpm),
 	     comp->id==1 ? "RTP" : "RTCP",
-	     map->int_port, &map->ext_addr);
+	     pm->int_port, &pm->ext_addr);
 
-	/* Update SDP media with external IP-address mapping */
-	if (comp->id == 1)
-		sdp_media_set_laddr(m->sdpm, &map->ext_addr);
-	else
-		sdp_media_set_laddr_rtcp(m->sdpm, &map->ext_addr);
+	comp_granted(comp);
 
-	comp->granted = true;
-	m->srv_epoch = msg->hdr.epoch;
+	is_complete(comp->media->sess);
+
+	return;
+
+ error:
+	map->granted = false;
 
-	is_complete(m->sess);
+	if (comp && !comp->granted)
+		complete(comp->media->sess, err, err == EPROTO ? "pcp error"
+			 : NULL);
 }
 
 
@@ -194,8 +308,6 @@ static int session_alloc(struct mnat_sess **sessp, struct dnsc *dnsc,
 	sess->estabh = estabh;
 	sess->arg    = arg;
 
-	list_append(&sessl, &sess->le, sess);
-
 	if (err)
 		mem_deref(sess);
 	else
@@ -205,13 +317,64 @@ static int session_alloc(struct mnat_sess **sessp, struct dnsc *dnsc,
 }
 
 
+static void sess_complete_handler(void *arg)
+{
+	struct mnat_sess *sess = arg;
+
+	is_complete(sess);
+}
+
+
+static int comp_alloc(struct comp *comp, void *sock)
+{
+	struct mapping *map;
+	struct sa laddr;
+	int err;
+
+	err = udp_local_get(sock, &laddr);
+	if (err)
+		return err;
+
+	info("pcp: %s: internal port for %s is %u\n",
+	     sdp_media_name(comp->media->sdpm),
+	     comp->id==1 ? "RTP" : "RTCP",
+	     sa_port(&laddr));
+
+	map = mapping_find(sa_port(&laddr));
+	if (map && map->comp) {
+		warning("pcp: port %u is mapped for another stream\n",
+			sa_port(&laddr));
+		return EADDRINUSE;
+	}
+
+	if (!map) {
+		err = mapping_alloc(&map, sa_port(&laddr), false);
+		if (err)
+			return err;
+	}
+	else if (!map->granted) {
+		pcp_force_refresh(map->pcp);
+	}
+
+	map->comp = comp;
+	comp->map = map;
+
+	/* from the pool, completed from the main loop */
+	if (map->granted) {
+		comp_granted(comp);
+		tmr_start(&comp->media->sess->tmr, 0,
+			  sess_complete_handler, comp->media->sess);
+	}
+
+	return 0;
+}
+
+
 static int media_alloc(struct mnat_media **mp, struct mnat_sess *sess,
 		       int proto, void *sock1, void *sock2,
 		       struct sdp_media *sdpm)
 {
 	struct mnat_media *m;
-	struct sa laddr;
-	struct pcp_map map;
 	unsigned i;
 	int err = 0;
 
@@ -234,23 +397,7 @@ static int media_alloc(struct mnat_media **mp, struct mnat_sess *sess,
 		comp->id = i+1;
 		comp->media = m;
 
-		err = udp_local_get(i==0 ? sock1 : sock2, &laddr);
-		if (err)
-			goto out;
-
-		rand_bytes(map.nonce, sizeof(map.nonce));
-		map.proto = proto;
-		map.int_port = sa_port(&laddr);
-		/* note: using same address-family as the PCP server */
-		sa_init(&map.ext_addr, sa_af(&pcp_srv));
-
-		info("pcp: %s: internal port for %s is %u\n",
-		     sdp_media_name(sdpm),
-		     i==0 ? "RTP" : "RTCP",
-		     map.int_port);
-
-		err = pcp_request(&comp->pcp, NULL, &pcp_srv, PCP_MAP,
-				  LIFETIME, &map, pcp_resp_handler, comp, 0);
+		err = comp_alloc(comp, i==0 ? sock1 : sock2);
 		if (err)
 			goto out;
 	}
@@ -266,53 +413,68 @@ static int media_alloc(struct mnat_media **mp, struct mnat_sess *sess,
 }
 
 
-static void media_refresh(struct mnat_media *media)
+/* Returns true for the first mapping older than the server epoch */
+static bool reboot_apply(struct le *le, void *arg)
 {
-	unsigned i;
-
-	for (i=0; i<media->compc; i++) {
-		struct comp *comp = &media->compv[i];
+	const struct mapping *map = le->data;
 
-		pcp_force_refresh(comp->pcp);
-	}
+	return *(uint32_t *)arg < map->srv_epoch;
 }
 
 
-static void refresh_session(struct mnat_sess *sess, uint32_t epoch_time)
+static bool epoch_apply(struct le *le, void *arg)
 {
-	struct le *le;
+	struct mapping *map = le->data;
+	const uint32_t epoch_time = *(uint32_t *)arg;
 
-	for (le = sess->medial.head; le; le = le->next) {
-
-		struct mnat_media *m = le->data;
+	if (epoch_time < map->srv_epoch)
+		pcp_force_refresh(map->pcp);
 
-		if (epoch_time < m->srv_epoch) {
-			info("pcp: detected PCP Server reboot!\n");
-			media_refresh(m);
-		}
+	map->srv_epoch = epoch_time;
 
-		m->srv_epoch = epoch_time;
-	}
+	return false;
 }
 
 
 static void pcp_msg_handler(const struct pcp_msg *msg, void *arg)
 {
-	struct le *le;
+	uint32_t epoch_time = msg->hdr.epoch;
 
 	(void)arg;
 
 	info("pcp: received notification: %H\n", pcp_msg_print, msg);
 
-	if (msg->hdr.opcode == PCP_ANNOUNCE) {
+	if (msg->hdr.opcode != PCP_ANNOUNCE)
+		return;
+
+	if (hash_apply(ht_map, reboot_apply, &epoch_time))
+		info("pcp: detected PCP Server reboot!\n");
 
-		for (le = sessl.head; le; le = le->next) {
+	(void)hash_apply(ht_map, epoch_apply, &epoch_time);
+}
+
+
+/* Map the first ports of the RTP port range in advance */
+static void pool_init(void)
+{
+	const struct range *ports = &conf_config()->avt.rtp_ports;
+	uint32_t port, n = 0;
+
+	if (!pool_size || !ports->min)
+		return;
+
+	for (port = ports->min; port <= ports->max && n < pool_size; port++) {
+
+		struct mapping *map;
 
-			struct mnat_sess *sess = le->data;
+		if (mapping_alloc(&map, (uint16_t)port, true))
+			break;
 
-			refresh_session(sess, msg->hdr.epoch);
-		}
+		++n;
 	}
+
+	info("pcp: pool has %u of the %u ports in rtp_ports\n",
+	     n, ports->max - ports->min + 1);
 }
 
 
@@ -336,6 +498,12 @@ static int module_init(void)
 
 	info("pcp: using PCP server at %J\n", &pcp_srv);
 
+	(void)conf_get_u32(conf_cur(), "pcp_pool", &pool_size);
+
+	err = hash_alloc(&ht_map, HASH_SIZE);
+	if (err)
+		return err;
+
 #if 1
 	/* todo: if multiple applications are listening on port 5350
 	   then this will not work */
@@ -346,6 +514,8 @@ static int module_init(void)
 	}
 #endif
 
+	pool_init();
+
 	return mnat_register(&mnat, baresip_mnatl(), "pcp", NULL,
 			     session_alloc, media_alloc, NULL);
 }
@@ -355,6 +525,10 @@ static int module_close(void)
 {
 	lsnr = mem_deref(lsnr);
 	mnat = mem_deref(mnat);
+
+	hash_flush(ht_map);
+	ht_map = mem_deref(ht_map);
+
 	return 0;
 }
 
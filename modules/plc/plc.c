@@ -16,6 +16,8 @@
  *
  * Packet Loss Concealment (PLC) audio-filter using spandsp
  *
+ * The filter is only used for codecs that cannot conceal lost frames
+ * themselves, the audio core asks the codec first.
  */
 
 
@@ -48,6 +50,12 @@ static int update(struct aufilt_dec_st **stp, void **ctx,
 	if (*stp)
 		return 0;
 
+	/* the decoder does it better, and without the extra cost */
+	if (prm->plc) {
+		debug("plc: concealment done by the decoder\n");
+		return 0;
+	}
+
 	/* XXX: add support for stereo PLC */
 	if (prm->ch != 1) {
 		warning("plc: only mono supported (ch=%u)\n", prm->ch);
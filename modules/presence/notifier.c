@@ -19,10 +19,17 @@ struct notifier {
 	struct le le;
 	struct sipnot *not;
 	struct ua *ua;
+	struct tmr tmr;         /* pending NOTIFY */
+	uint64_t last;          /* time of the last NOTIFY */
 };
 
 static struct list notifierl;
 
+static struct {
+	uint64_t n_sent;        /* status NOTIFY sent */
+	uint64_t n_merged;      /* status changes merged into another */
+} notstat;
+
 
 static const char *presence_status_str(enum presence_status st)
 {
@@ -97,6 +104,7 @@ static void destructor(void *arg)
 {
 	struct notifier *not = arg;
 
+	tmr_cancel(&not->tmr);
 	list_unlink(&not->le);
 	mem_deref(not->not);
 	mem_deref(not->ua);
@@ -125,6 +133,7 @@ static int notifier_alloc(struct notifier **notp,
 		return ENOMEM;
 
 	not->ua   = mem_ref(ua);
+	tmr_init(&not->tmr);
 
 	err = sipevent_accept(&not->not, uag_sipevent_sock(),
 			      msg, NULL, se, 200, "OK",
@@ -173,29 +182,83 @@ static int notifier_add(const struct sip_msg *msg, struct ua *ua)
 	if (err)
 		return err;
 
+	not->last = tmr_jiffies();
 	(void)notify(not, ua_presence_status(ua));
 
 	return 0;
 }
 
 
+static void notify_handler(void *arg)
+{
+	struct notifier *not = arg;
+
+	not->last = tmr_jiffies();
+	++notstat.n_sent;
+
+	(void)notify(not, ua_presence_status(not->ua));
+}
+
+
+/*
+ * A watcher gets at most one NOTIFY per throttle window, with the last
+ * status. The NOTIFYs of one status change are spread evenly over the
+ * window, so that many watchers are not notified in one burst.
+ */
 void notifier_update_status(struct ua *ua)
 {
 	struct le *le;
+	unsigned n = 0, i = 0;
+
+	for (le = notifierl.head; le; le = le->next) {
+
+		struct notifier *not = le->data;
+
+		if (not->ua == ua && !tmr_isrunning(&not->tmr))
+			++n;
+	}
 
 	for (le = notifierl.head; le; le = le->next) {
 
 		struct notifier *not = le->data;
+		uint32_t delay;
+
+		if (not->ua != ua)
+			continue;
 
-		if (not->ua == ua)
-			(void)notify(not, ua_presence_status(not->ua));
+		if (tmr_isrunning(&not->tmr)) {
+			++notstat.n_merged;
+			continue;
+		}
+
+		delay  = presence_throttle_delay(not->last);
+		delay += (uint32_t)((uint64_t)i++ * presence_throttle / n);
+
+		tmr_start(&not->tmr, delay, notify_handler, not);
 	}
 }
 
 
+int notifier_debug(struct re_printf *pf)
+{
+	return re_hprintf(pf, "notifier: %u watchers, sent=%llu"
+			  " merged=%llu\n", list_count(&notifierl),
+			  notstat.n_sent, notstat.n_merged);
+}
+
+
 static bool sub_handler(const struct sip_msg *msg, void *arg)
 {
 	struct ua *ua = arg;
+	char uri[256];
+
+	(void)pl_strcpy(&msg->from.auri, uri, sizeof(uri));
+
+	if (contact_block_access(baresip_contacts(), uri)) {
+		info("presence: blocked subscription from %s\n", uri);
+		(void)sip_treply(NULL, uag_sip(), msg, 403, "Forbidden");
+		return true;
+	}
 
 	if (notifier_add(msg, ua))
 		(void)sip_treply(NULL, uag_sip(), msg, 400, "Bad Presence");
@@ -8,6 +8,27 @@
 #include "presence.h"
 
 
+uint32_t presence_throttle = 1000;
+
+
+/**
+ * Get the time until the throttle window of the last update ends
+ *
+ * @param last Time of the last update [ms], 0 for none
+ *
+ * @return Delay in [ms], 0 if an update can be sent now
+ */
+uint32_t presence_throttle_delay(uint64_t last)
+{
+	const uint64_t now = tmr_jiffies();
+
+	if (!last || now >= last + presence_throttle)
+		return 0;
+
+	return (uint32_t)(last + presence_throttle - now);
+}
+
+
 static int status_update(struct ua *current_ua,
 			 const enum presence_status new_status)
 {
@@ -46,9 +67,24 @@ static int cmd_offline(struct re_printf *pf, void *arg)
 }
 
 
+static int cmd_debug(struct re_printf *pf, void *arg)
+{
+	int err;
+	(void)arg;
+
+	err  = re_hprintf(pf, "presence: throttle %u ms\n",
+			  presence_throttle);
+	err |= publisher_debug(pf);
+	err |= notifier_debug(pf);
+
+	return err;
+}
+
+
 static const struct cmd cmdv[] = {
 	{"presence_online",  '[', 0, "Set presence online",   cmd_online  },
 	{"presence_offline", ']', 0, "Set presence offline",  cmd_offline },
+	{"presence",          0,  0, "Presence statistics",   cmd_debug   },
 };
 
 
@@ -75,6 +111,9 @@ static int module_init(void)
 {
 	int err;
 
+	(void)conf_get_u32(conf_cur(), "presence_throttle",
+			   &presence_throttle);
+
 	err = subscriber_init();
 	if (err)
 		return err;
@@ -91,7 +130,9 @@ static int module_init(void)
 	if (err)
 		return err;
 
-	err = uag_event_register(event_handler, NULL);
+	err = uag_event_register_mask(event_handler,
+				      UA_EVENT_BIT(UA_EVENT_SHUTDOWN),
+				      NULL, NULL);
 	if (err)
 		return err;
 
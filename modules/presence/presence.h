@@ -4,6 +4,15 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
+/*
+ * Status changes of a UA within the throttle window are merged, so
+ * that one PUBLISH and one NOTIFY per watcher carry the last status.
+ */
+extern uint32_t presence_throttle;     /* throttle window [ms] */
+
+uint32_t presence_throttle_delay(uint64_t last);
+
+
 int  subscriber_init(void);
 void subscriber_close(void);
 void subscriber_close_all(void);
@@ -12,8 +21,10 @@ void subscriber_close_all(void);
 int  notifier_init(void);
 void notifier_close(void);
 void notifier_update_status(struct ua *ua);
+int  notifier_debug(struct re_printf *pf);
 
 
 int  publisher_init(void);
 void publisher_close(void);
 void publisher_update_status(struct ua *ua);
+int  publisher_debug(struct re_printf *pf);
@@ -14,6 +14,8 @@
 struct publisher {
 	struct le le;
 	struct tmr tmr;
+	struct tmr tmr_th;      /* end of the throttle window */
+	uint64_t last;          /* time of the last status PUBLISH */
 	unsigned failc;
 	char *etag;
 	unsigned int expires;
@@ -23,6 +25,11 @@ struct publisher {
 
 static struct list publ = LIST_INIT;
 
+static struct {
+	uint64_t n_sent;        /* status PUBLISH sent */
+	uint64_t n_merged;      /* status changes merged into another */
+} pubstat;
+
 static void tmr_handler(void *arg);
 static int publish(struct publisher *pub);
 
@@ -202,11 +209,29 @@ static void destructor(void *arg)
 
 	list_unlink(&pub->le);
 	tmr_cancel(&pub->tmr);
+	tmr_cancel(&pub->tmr_th);
 	mem_deref(pub->ua);
 	mem_deref(pub->etag);
 }
 
 
+static void throttle_handler(void *arg)
+{
+	struct publisher *pub = arg;
+
+	pub->last    = tmr_jiffies();
+	pub->refresh = 0;
+	++pubstat.n_sent;
+
+	publish(pub);
+}
+
+
+/*
+ * The status is published at the end of the throttle window, or at
+ * once if the window has passed. Changes while the PUBLISH is pending
+ * are merged into it.
+ */
 void publisher_update_status(struct ua *ua)
 {
 	struct le *le;
@@ -215,14 +240,28 @@ void publisher_update_status(struct ua *ua)
 
 		struct publisher *pub = le->data;
 
-		if (pub->ua == ua) {
-			pub->refresh = 0;
-			publish(pub);
+		if (pub->ua != ua)
+			continue;
+
+		if (tmr_isrunning(&pub->tmr_th)) {
+			++pubstat.n_merged;
+			continue;
 		}
+
+		tmr_start(&pub->tmr_th, presence_throttle_delay(pub->last),
+			  throttle_handler, pub);
 	}
 }
 
 
+int publisher_debug(struct re_printf *pf)
+{
+	return re_hprintf(pf, "publisher: %u publishers, sent=%llu"
+			  " merged=%llu\n", list_count(&publ),
+			  pubstat.n_sent, pubstat.n_merged);
+}
+
+
 static int publisher_alloc(struct ua *ua)
 {
 	struct publisher *pub;
@@ -235,6 +274,7 @@ static int publisher_alloc(struct ua *ua)
 	pub->expires = account_pubint(ua_account(ua));
 
 	tmr_init(&pub->tmr);
+	tmr_init(&pub->tmr_th);
 	tmr_start(&pub->tmr, 10, tmr_handler, pub);
 
 	list_append(&publ, &pub->le, pub);
@@ -270,7 +310,8 @@ int publisher_init(void)
 	struct le *le;
 	int err = 0;
 
-	uag_event_register(pub_ua_event_handler, NULL);
+	uag_event_register_mask(pub_ua_event_handler,
+				UA_EVENT_BIT(UA_EVENT_REGISTER_OK), NULL, NULL);
 
 	for (le = list_head(uag_list()); le; le = le->next) {
 
@@ -300,6 +341,7 @@ void publisher_close(void)
 
 		struct publisher *pub = le->data;
 
+		tmr_cancel(&pub->tmr_th);
 		ua_presence_status_set(pub->ua, PRESENCE_CLOSED);
 		pub->expires = 0;
 		publish(pub);
@@ -0,0 +1,10 @@
+#
+# module.mk
+#
+# Copyright (C) 2010 Creytiv.com
+#
+
+MOD		:= probe
+$(MOD)_SRCS	+= probe.c
+
+include mk/mod.mk
@@ -0,0 +1,367 @@
+/**
+ * @file probe.c  Quality probes of network paths
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <time.h>
+#include <re.h>
+#include <baresip.h>
+
+
+/**
+ * @defgroup probe probe
+ *
+ * Quality probes of network paths, without placing calls
+ *
+ * A low-rate flow of RTP packets, about the size of G.711 voice, is sent
+ * on each configured path to a reflector, which sends the packets back
+ * to the source. Each packet carries its send time, so the loss, the
+ * round-trip time and its variation are measured at the sender. The
+ * loss is counted over the last 100 packets, and a MOS is estimated from
+ * the three numbers.
+ *
+ * The numbers are kept in the network paths of the core (pathq), where
+ * the application reads them to choose a route for a call, e.g. with
+ * pathq_best("trunk1,trunk2"). The httpd module exports them as metrics.
+ *
+ * The reflector is this module on the far side, with probe_reflect set.
+ * The addresses are IP addresses, not host names.
+ *
+ * Example config:
+ \verbatim
+  probe_path        trunk1,192.0.2.10:5004
+  probe_path        trunk2,198.51.100.7:5004
+  probe_interval    100           # [ms] between packets
+  probe_size        160           # payload bytes
+
+  probe_reflect     5004          # reflect probes on this port, 0 = off
+ \endverbatim
+ *
+ * Commands:
+ \verbatim
+ probe                Show the quality of the paths
+ \endverbatim
+ */
+
+
+enum {
+	PT          = 96,       /* Payload type of the probes       */
+	WINDOW      = 100,      /* Packets in the loss window       */
+	TIMEOUT     = 1000,     /* Packet is lost after this [ms]   */
+	HDR_SIZE    = 16,       /* Magic, sequence, send time       */
+	SIZE_MAX_   = 1200,     /* Max payload bytes                */
+	MAGIC       = 0x70726231,  /* "prb1" */
+};
+
+struct path {
+	struct le le;
+	struct pathq *pq;         /* Numbers of the path, in the core */
+	struct rtp_sock *rtp;
+	struct sa peer;           /* Reflector                        */
+	struct tmr tmr;
+	uint32_t seq;             /* Next probe sequence number       */
+	struct {
+		uint32_t seq;
+		uint64_t ts;      /* Send time [us], 0 if unused      */
+		bool back;
+	} winv[WINDOW];
+	double rtt;               /* Smoothed RTT [us]                */
+	double jitter;            /* Smoothed RTT variation [us]      */
+	uint32_t rtt_prev;
+	bool have_prev;
+};
+
+
+static struct list pathl;
+static struct rtp_sock *reflector;
+static uint32_t interval = 100;
+static uint32_t size = 160;
+
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void path_destructor(void *arg)
+{
+	struct path *p = arg;
+
+	tmr_cancel(&p->tmr);
+	list_unlink(&p->le);
+	mem_deref(p->rtp);
+	mem_deref(p->pq);
+}
+
+
+/* Loss over the packets of the window that are old enough */
+static void path_update(struct path *p, uint64_t now)
+{
+	struct pathq *pq = p->pq;
+	uint32_t n = 0, lost = 0;
+	size_t i;
+
+	for (i=0; i<WINDOW; i++) {
+
+		if (!p->winv[i].ts || now - p->winv[i].ts < TIMEOUT * 1000)
+			continue;
+
+		++n;
+		if (!p->winv[i].back)
+			++lost;
+	}
+
+	if (!n)
+		return;
+
+	pq->loss = 100.0 * lost / n;
+
+	if (lost == n) {
+		pq->valid = false;
+		return;
+	}
+
+	pq->rtt    = (uint32_t)p->rtt;
+	pq->jitter = (uint32_t)p->jitter;
+	pq->mos    = mos_calculate(NULL, p->rtt / 1000.0, p->jitter / 1000.0,
+				   (uint32_t)(pq->loss + 0.5));
+	pq->valid  = true;
+}
+
+
+static void timeout(void *arg)
+{
+	struct path *p = arg;
+	const uint64_t now = now_us();
+	const uint32_t i = p->seq % WINDOW;
+	struct mbuf *mb;
+
+	tmr_start(&p->tmr, interval, timeout, p);
+
+	path_update(p, now);
+
+	mb = mbuf_alloc(RTP_HEADER_SIZE + size);
+	if (!mb)
+		return;
+
+	mb->pos = RTP_HEADER_SIZE;
+
+	(void)mbuf_write_u32(mb, htonl(MAGIC));
+	(void)mbuf_write_u32(mb, htonl(p->seq));
+	(void)mbuf_write_u32(mb, htonl((uint32_t)(now >> 32)));
+	(void)mbuf_write_u32(mb, htonl((uint32_t)now));
+	(void)mbuf_fill(mb, 0xd5, size - HDR_SIZE);   /* silence, A-law */
+
+	mb->pos = RTP_HEADER_SIZE;
+
+	p->winv[i].seq  = p->seq;
+	p->winv[i].ts   = now;
+	p->winv[i].back = false;
+
+	if (0 == rtp_send(p->rtp, &p->peer, false, PT,
+			  p->seq * interval * 8, mb))
+		++p->pq->sent;
+
+	++p->seq;
+
+	mem_deref(mb);
+}
+
+
+static void path_recv(const struct sa *src, const struct rtp_header *hdr,
+		      struct mbuf *mb, void *arg)
+{
+	struct path *p = arg;
+	uint64_t ts, now;
+	uint32_t seq, rtt, d, i;
+
+	if (!sa_cmp(src, &p->peer, SA_ALL) || hdr->pt != PT ||
+	    mbuf_get_left(mb) < HDR_SIZE)
+		return;
+
+	if (ntohl(mbuf_read_u32(mb)) != MAGIC)
+		return;
+
+	seq = ntohl(mbuf_read_u32(mb));
+	ts  = (uint64_t)ntohl(mbuf_read_u32(mb)) << 32;
+	ts |= ntohl(mbuf_read_u32(mb));
+
+	i = seq % WINDOW;
+	if (p->winv[i].seq != seq || p->winv[i].ts != ts || p->winv[i].back)
+		return;
+
+	p->winv[i].back = true;
+	++p->pq->received;
+
+	now = now_us();
+	rtt = (uint32_t)(now - ts);
+
+	/* RFC 3550 style smoothing of the RTT and its variation */
+	if (p->have_prev) {
+		d = rtt > p->rtt_prev ? rtt - p->rtt_prev : p->rtt_prev - rtt;
+
+		p->jitter += (d - p->jitter) / 16.0;
+		p->rtt    += (rtt - p->rtt) / 8.0;
+	}
+	else {
+		p->rtt = rtt;
+	}
+
+	p->rtt_prev  = rtt;
+	p->have_prev = true;
+}
+
+
+/* The probes go back to the sender as they are */
+static void reflect_recv(const struct sa *src, const struct rtp_header *hdr,
+			 struct mbuf *mb, void *arg)
+{
+	const size_t pos = mb->pos;
+	(void)arg;
+
+	if (hdr->pt != PT || mbuf_get_left(mb) < HDR_SIZE ||
+	    mbuf_get_left(mb) > SIZE_MAX_)
+		return;
+
+	if (ntohl(mbuf_read_u32(mb)) != MAGIC)
+		return;
+
+	mb->pos = pos;
+
+	(void)rtp_send(reflector, src, hdr->m, PT, hdr->ts, mb);
+}
+
+
+static int path_handler(const struct pl *val, void *arg)
+{
+	struct pl name, addr;
+	struct path *p;
+	struct sa laddr;
+	char buf[64];
+	int err;
+	(void)arg;
+
+	if (re_regex(val->p, val->l, "[^,]+,[^]+", &name, &addr)) {
+		warning("probe: probe_path: expected name,address: %r\n",
+			val);
+		return EINVAL;
+	}
+
+	p = mem_zalloc(sizeof(*p), path_destructor);
+	if (!p)
+		return ENOMEM;
+
+	err = sa_decode(&p->peer, addr.p, addr.l);
+	if (err) {
+		warning("probe: invalid address: %r\n", &addr);
+		goto out;
+	}
+
+	(void)pl_strcpy(&name, buf, sizeof(buf));
+
+	err = pathq_register(&p->pq, buf);
+	if (err)
+		goto out;
+
+	sa_init(&laddr, sa_af(&p->peer));
+
+	err = rtp_listen(&p->rtp, IPPROTO_UDP, &laddr, 1024, 65535, false,
+			 path_recv, NULL, p);
+	if (err)
+		goto out;
+
+	list_append(&pathl, &p->le, p);
+
+	/* the paths start a little apart */
+	tmr_start(&p->tmr, list_count(&pathl) * 10, timeout, p);
+
+	info("probe: %s: %J\n", buf, &p->peer);
+
+ out:
+	if (err)
+		mem_deref(p);
+
+	return err;
+}
+
+
+static int cmd_probe(struct re_printf *pf, void *arg)
+{
+	(void)arg;
+
+	return pathq_debug(pf, NULL);
+}
+
+
+static const struct cmd cmdv[] = {
+	{"probe", 0, 0, "Show the quality of the network paths", cmd_probe },
+};
+
+
+static int module_init(void)
+{
+	uint32_t port = 0;
+	struct sa laddr;
+	int err;
+
+	list_init(&pathl);
+
+	(void)conf_get_u32(conf_cur(), "probe_interval", &interval);
+	(void)conf_get_u32(conf_cur(), "probe_size", &size);
+	(void)conf_get_u32(conf_cur(), "probe_reflect", &port);
+
+	interval = max(interval, 10u);
+	size     = min(max(size, (uint32_t)HDR_SIZE), (uint32_t)SIZE_MAX_);
+
+	if (port) {
+		sa_init(&laddr, AF_INET);
+
+		err = rtp_listen(&reflector, IPPROTO_UDP, &laddr, port, port,
+				 false, reflect_recv, NULL, NULL);
+		if (err) {
+			warning("probe: reflector on port %u: %m\n", port,
+				err);
+			goto out;
+		}
+
+		info("probe: reflecting on port %u\n", port);
+	}
+
+	err = conf_apply(conf_cur(), "probe_path", path_handler, NULL);
+	if (err)
+		goto out;
+
+	err = cmd_register(baresip_commands(), cmdv, ARRAY_SIZE(cmdv));
+
+ out:
+	if (err) {
+		list_flush(&pathl);
+		reflector = mem_deref(reflector);
+	}
+
+	return err;
+}
+
+
+static int module_close(void)
+{
+	cmd_unregister(baresip_commands(), cmdv);
+
+	list_flush(&pathl);
+	reflector = mem_deref(reflector);
+
+	return 0;
+}
+
+
+EXPORT_SYM const struct mod_export DECL_EXPORTS(probe) = {
+	"probe",
+	"application",
+	module_init,
+	module_close
+};
@@ -4,22 +4,25 @@
  * Copyright (C) 2010 - 2016 Creytiv.com
  */
 #include <pulse/pulseaudio.h>
-#include <pulse/simple.h>
-#include <pthread.h>
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
 #include "pulse.h"
 
 
+/*
+ * The server asks for more samples in the mainloop thread, and they are
+ * written straight into its buffer, without a copy.
+ */
+
+
 struct auplay_st {
 	const struct auplay *ap;      /* inheritance */
 
-	pa_simple *s;
-	pthread_t thread;
-	bool run;
-	int16_t *sampv;
-	size_t sampc;
+	pa_threaded_mainloop *ml;
+	pa_stream *s;
+	size_t frame_bytes;
+	uint64_t n_underflow;
 	auplay_write_h *wh;
 	void *arg;
 };
@@ -29,38 +32,88 @@ static void auplay_destructor(void *arg)
 {
 	struct auplay_st *st = arg;
 
-	/* Wait for termination of other thread */
-	if (st->run) {
-		debug("pulse: stopping playback thread\n");
-		st->run = false;
-		(void)pthread_join(st->thread, NULL);
-	}
+	if (!st->s)
+		return;
 
-	if (st->s)
-		pa_simple_free(st->s);
+	debug("pulse: stopping playback\n");
 
-	mem_deref(st->sampv);
+	pa_threaded_mainloop_lock(st->ml);
+	pa_stream_set_write_callback(st->s, NULL, NULL);
+	pa_stream_set_underflow_callback(st->s, NULL, NULL);
+	pa_stream_set_state_callback(st->s, NULL, NULL);
+	(void)pa_stream_disconnect(st->s);
+	pa_stream_unref(st->s);
+	pa_threaded_mainloop_unlock(st->ml);
 }
 
 
-static void *write_thread(void *arg)
+static void state_handler(pa_stream *s, void *arg)
 {
 	struct auplay_st *st = arg;
-	const size_t num_bytes = st->sampc * 2;
-	int ret, pa_error = 0;
+	(void)s;
+
+	pa_threaded_mainloop_signal(st->ml, 0);
+}
 
-	while (st->run) {
 
-		st->wh(st->sampv, st->sampc, st->arg);
+static void underflow_handler(pa_stream *s, void *arg)
+{
+	struct auplay_st *st = arg;
+	(void)s;
+
+	++st->n_underflow;
+}
+
 
-		ret = pa_simple_write(st->s, st->sampv, num_bytes, &pa_error);
-		if (ret < 0) {
-			warning("pulse: pa_simple_write error (%s)\n",
-				pa_strerror(pa_error));
+/* Called in the mainloop thread */
+static void write_handler(pa_stream *s, size_t nbytes, void *arg)
+{
+	struct auplay_st *st = arg;
+
+	while (nbytes >= st->frame_bytes) {
+
+		size_t n = nbytes;
+		void *data;
+
+		if (pa_stream_begin_write(s, &data, &n) || !data)
+			break;
+
+		n = min(n, nbytes);
+		n -= n % st->frame_bytes;
+		if (!n) {
+			(void)pa_stream_cancel_write(s);
+			break;
 		}
+
+		st->wh(data, n / 2, st->arg);
+
+		if (pa_stream_write(s, data, n, NULL, 0, PA_SEEK_RELATIVE)) {
+			warning("pulse: write error (%s)\n",
+				pa_strerror(pa_context_errno(
+					    pa_stream_get_context(s))));
+			break;
+		}
+
+		nbytes -= n;
 	}
+}
+
+
+int pulse_player_debug(struct re_printf *pf, const struct auplay_st *st)
+{
+	pa_usec_t usec = 0;
+	int neg = 0;
+
+	if (!st)
+		return 0;
 
-	return NULL;
+	pa_threaded_mainloop_lock(st->ml);
+	if (pa_stream_get_latency(st->s, &usec, &neg))
+		usec = 0;
+	pa_threaded_mainloop_unlock(st->ml);
+
+	return re_hprintf(pf, "pulse latency=%.1fms underflows=%llu",
+			  neg ? 0.0 : usec / 1000.0, st->n_underflow);
 }
 
 
@@ -68,14 +121,20 @@ int pulse_player_alloc(struct auplay_st **stp, const struct auplay *ap,
 		       struct auplay_prm *prm, const char *device,
 		       auplay_write_h *wh, void *arg)
 {
+	const pa_stream_flags_t flags = PA_STREAM_ADJUST_LATENCY |
+		PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
 	struct auplay_st *st;
+	pa_context *ctx;
 	pa_sample_spec ss;
 	pa_buffer_attr attr;
-	int err = 0, pa_error = 0;
+	int err;
 
 	if (!stp || !ap || !prm || !wh)
 		return EINVAL;
 
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
 	debug("pulse: opening player (%u Hz, %d channels, device '%s')\n",
 	      prm->srate, prm->ch, device);
 
@@ -87,44 +146,50 @@ int pulse_player_alloc(struct auplay_st **stp, const struct auplay *ap,
 	st->wh  = wh;
 	st->arg = arg;
 
-	st->sampc = prm->srate * prm->ch * prm->ptime / 1000;
-
-	st->sampv = mem_alloc(2 * st->sampc, NULL);
-	if (!st->sampv) {
-		err = ENOMEM;
+	err = pulse_context(&st->ml, &ctx);
+	if (err)
 		goto out;
-	}
 
 	ss.format   = PA_SAMPLE_S16NE;
 	ss.channels = prm->ch;
 	ss.rate     = prm->srate;
 
+	st->frame_bytes = pa_frame_size(&ss);
+
+	/* a packet is requested while another one is played */
 	attr.maxlength = (uint32_t)-1;
-	attr.tlength   = (uint32_t)pa_usec_to_bytes(prm->ptime * 1000, &ss);
+	attr.tlength   = (uint32_t)pa_usec_to_bytes((2 * prm->ptime +
+						     pulse_latency()) * 1000,
+						    &ss);
 	attr.prebuf    = (uint32_t)-1;
-	attr.minreq    = (uint32_t)-1;
+	attr.minreq    = (uint32_t)pa_usec_to_bytes(prm->ptime * 1000, &ss);
 	attr.fragsize  = (uint32_t)-1;
 
-	st->s = pa_simple_new(NULL,
-			      "Baresip",
-			      PA_STREAM_PLAYBACK,
-			      str_isset(device) ? device : 0,
-			      "VoIP Playback",
-			      &ss,
-			      NULL,
-			      &attr,
-			      &pa_error);
+	pa_threaded_mainloop_lock(st->ml);
+
+	st->s = pa_stream_new(ctx, "VoIP Playback", &ss, NULL);
 	if (!st->s) {
-		warning("pulse: could not connect to server (%s)\n",
-			pa_strerror(pa_error));
-		err = ENODEV;
+		pa_threaded_mainloop_unlock(st->ml);
+		err = ENOMEM;
 		goto out;
 	}
 
-	st->run = true;
-	err = pthread_create(&st->thread, NULL, write_thread, st);
+	pa_stream_set_state_callback(st->s, state_handler, st);
+	pa_stream_set_write_callback(st->s, write_handler, st);
+	pa_stream_set_underflow_callback(st->s, underflow_handler, st);
+
+	if (pa_stream_connect_playback(st->s,
+				       str_isset(device) ? device : NULL,
+				       &attr, flags, NULL, NULL))
+		err = ENODEV;
+	else
+		err = pulse_stream_wait(st->ml, st->s);
+
+	pa_threaded_mainloop_unlock(st->ml);
+
 	if (err) {
-		st->run = false;
+		warning("pulse: could not open player '%s' (%s)\n", device,
+			pa_strerror(pa_context_errno(ctx)));
 		goto out;
 	}
 
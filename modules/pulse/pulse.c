@@ -3,7 +3,7 @@
  *
  * Copyright (C) 2010 - 2016 Creytiv.com
  */
-
+#include <pulse/pulseaudio.h>
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -13,24 +13,205 @@
 /**
  * @defgroup pulse pulse
  *
- * Audio driver module for Pulseaudio
+ * Audio driver module for Pulseaudio, and for PipeWire with its
+ * Pulseaudio server
+ *
+ * The asynchronous API is used, the streams of all calls are handled by
+ * one mainloop thread. The server is asked for a latency of one packet
+ * time for the recorder, and two for the player. The latency that is
+ * actually reached is shown in the audio debug.
  *
- * This module is experimental and work-in-progress. It is using
- * the pulseaudio "simple" interface.
+ * Example config:
+ \verbatim
+  pulse_latency   0      # Extra player latency [ms], for slow systems
+ \endverbatim
  */
 
 
+static struct {
+	pa_threaded_mainloop *ml;
+	pa_context *ctx;
+	uint32_t latency;          /* Extra player latency [ms] */
+} pulse;
+
 static struct auplay *auplay;
 static struct ausrc *ausrc;
 
 
+static void context_state_handler(pa_context *ctx, void *arg)
+{
+	(void)arg;
+
+	switch (pa_context_get_state(ctx)) {
+
+	case PA_CONTEXT_READY:
+	case PA_CONTEXT_FAILED:
+	case PA_CONTEXT_TERMINATED:
+		pa_threaded_mainloop_signal(pulse.ml, 0);
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+/* Runs once in the mainloop thread, which does all the audio I/O */
+static void thread_setup(pa_mainloop_api *api, void *arg)
+{
+	(void)api;
+	(void)arg;
+
+	(void)realtime_affinity(conf_config()->audio.cpus_dev, -1);
+}
+
+
+/**
+ * Get the context, it is connected to the server on first use
+ *
+ * @param mlp  Returned mainloop
+ * @param ctxp Returned context
+ *
+ * @return 0 if success, otherwise errorcode
+ *
+ * @note Must be called in the main thread
+ */
+int pulse_context(pa_threaded_mainloop **mlp, pa_context **ctxp)
+{
+	pa_context_state_t state;
+	int err = 0;
+
+	if (!mlp || !ctxp)
+		return EINVAL;
+
+	if (pulse.ctx)
+		goto out;
+
+	pulse.ml = pa_threaded_mainloop_new();
+	if (!pulse.ml)
+		return ENOMEM;
+
+	pulse.ctx = pa_context_new(pa_threaded_mainloop_get_api(pulse.ml),
+				   "Baresip");
+	if (!pulse.ctx) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	pa_context_set_state_callback(pulse.ctx, context_state_handler,
+				      NULL);
+
+	if (pa_context_connect(pulse.ctx, NULL, PA_CONTEXT_NOFLAGS, NULL)) {
+		warning("pulse: could not connect to server (%s)\n",
+			pa_strerror(pa_context_errno(pulse.ctx)));
+		err = ENODEV;
+		goto out;
+	}
+
+	pa_threaded_mainloop_lock(pulse.ml);
+
+	if (pa_threaded_mainloop_start(pulse.ml)) {
+		pa_threaded_mainloop_unlock(pulse.ml);
+		err = ENOMEM;
+		goto out;
+	}
+
+	pa_mainloop_api_once(pa_threaded_mainloop_get_api(pulse.ml),
+			     thread_setup, NULL);
+
+	for (;;) {
+		state = pa_context_get_state(pulse.ctx);
+		if (!PA_CONTEXT_IS_GOOD(state) || state == PA_CONTEXT_READY)
+			break;
+
+		pa_threaded_mainloop_wait(pulse.ml);
+	}
+
+	pa_threaded_mainloop_unlock(pulse.ml);
+
+	if (state != PA_CONTEXT_READY) {
+		warning("pulse: could not connect to server (%s)\n",
+			pa_strerror(pa_context_errno(pulse.ctx)));
+		err = ENODEV;
+		goto out;
+	}
+
+	info("pulse: connected to %s\n",
+	     pa_context_get_server(pulse.ctx));
+
+ out:
+	if (err) {
+		pulse_close();
+	}
+	else {
+		*mlp  = pulse.ml;
+		*ctxp = pulse.ctx;
+	}
+
+	return err;
+}
+
+
+/**
+ * Wait until a new stream is ready
+ *
+ * @param ml Mainloop, must be locked
+ * @param s  Stream, its state handler must signal the mainloop
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int pulse_stream_wait(pa_threaded_mainloop *ml, pa_stream *s)
+{
+	for (;;) {
+		const pa_stream_state_t state = pa_stream_get_state(s);
+
+		if (state == PA_STREAM_READY)
+			return 0;
+
+		if (!PA_STREAM_IS_GOOD(state))
+			return ENODEV;
+
+		pa_threaded_mainloop_wait(ml);
+	}
+}
+
+
+uint32_t pulse_latency(void)
+{
+	return pulse.latency;
+}
+
+
+void pulse_close(void)
+{
+	if (pulse.ml)
+		pa_threaded_mainloop_stop(pulse.ml);
+
+	if (pulse.ctx) {
+		pa_context_disconnect(pulse.ctx);
+		pa_context_unref(pulse.ctx);
+		pulse.ctx = NULL;
+	}
+
+	if (pulse.ml) {
+		pa_threaded_mainloop_free(pulse.ml);
+		pulse.ml = NULL;
+	}
+}
+
+
 static int module_init(void)
 {
 	int err;
 
+	(void)conf_get_u32(conf_cur(), "pulse_latency", &pulse.latency);
+
 	err  = auplay_register(&auplay, "pulse", pulse_player_alloc);
 	err |= ausrc_register(&ausrc, "pulse", pulse_recorder_alloc);
 
+	auplay_set_debug(auplay, pulse_player_debug);
+	ausrc_set_debug(ausrc, pulse_recorder_debug);
+
 	return err;
 }
 
@@ -40,6 +221,8 @@ static int module_close(void)
 	auplay = mem_deref(auplay);
 	ausrc  = mem_deref(ausrc);
 
+	pulse_close();
+
 	return 0;
 }
 
@@ -5,10 +5,19 @@
  */
 
 
+/* Shared context */
+int  pulse_context(pa_threaded_mainloop **mlp, pa_context **ctxp);
+uint32_t pulse_latency(void);
+void pulse_close(void);
+int  pulse_stream_wait(pa_threaded_mainloop *ml, pa_stream *s);
+
+
 int pulse_player_alloc(struct auplay_st **stp, const struct auplay *ap,
 		       struct auplay_prm *prm, const char *device,
 		       auplay_write_h *wh, void *arg);
+int pulse_player_debug(struct re_printf *pf, const struct auplay_st *st);
 int pulse_recorder_alloc(struct ausrc_st **stp, const struct ausrc *as,
 			 struct media_ctx **ctx,
 			 struct ausrc_prm *prm, const char *device,
 			 ausrc_read_h *rh, ausrc_error_h *errh, void *arg);
+int pulse_recorder_debug(struct re_printf *pf, const struct ausrc_st *st);
@@ -4,23 +4,30 @@
  * Copyright (C) 2010 - 2016 Creytiv.com
  */
 #include <pulse/pulseaudio.h>
-#include <pulse/simple.h>
-#include <pthread.h>
+#include <string.h>
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
 #include "pulse.h"
 
 
+/*
+ * The samples are read from the buffer of the server in the mainloop
+ * thread. They are copied in packets, the buffer of the server may be
+ * read-only shared memory.
+ */
+
+
 struct ausrc_st {
 	const struct ausrc *as;      /* inheritance */
 
-	pa_simple *s;
-	pthread_t thread;
-	bool run;
+	pa_threaded_mainloop *ml;
+	pa_stream *s;
 	int16_t *sampv;
 	size_t sampc;
+	bool ready;
 	ausrc_read_h *rh;
+	ausrc_error_h *errh;
 	void *arg;
 };
 
@@ -29,39 +36,89 @@ static void ausrc_destructor(void *arg)
 {
 	struct ausrc_st *st = arg;
 
-	/* Wait for termination of other thread */
-	if (st->run) {
-		debug("pulse: stopping record thread\n");
-		st->run = false;
-		(void)pthread_join(st->thread, NULL);
-	}
+	if (!st->s)
+		goto out;
+
+	debug("pulse: stopping recording\n");
 
-	if (st->s)
-		pa_simple_free(st->s);
+	pa_threaded_mainloop_lock(st->ml);
+	pa_stream_set_read_callback(st->s, NULL, NULL);
+	pa_stream_set_state_callback(st->s, NULL, NULL);
+	(void)pa_stream_disconnect(st->s);
+	pa_stream_unref(st->s);
+	pa_threaded_mainloop_unlock(st->ml);
 
+ out:
 	mem_deref(st->sampv);
 }
 
 
-static void *read_thread(void *arg)
+static void state_handler(pa_stream *s, void *arg)
 {
 	struct ausrc_st *st = arg;
-	const size_t num_bytes = st->sampc * 2;
-	int ret, pa_error = 0;
 
-	while (st->run) {
+	/* the server or the device went away */
+	if (st->ready && !PA_STREAM_IS_GOOD(pa_stream_get_state(s))) {
+
+		st->ready = false;
+
+		if (st->errh)
+			st->errh(ENODEV, "pulse stream failed", st->arg);
+	}
+
+	pa_threaded_mainloop_signal(st->ml, 0);
+}
+
+
+/* Called in the mainloop thread */
+static void read_handler(pa_stream *s, size_t nbytes, void *arg)
+{
+	struct ausrc_st *st = arg;
+	(void)nbytes;
+
+	for (;;) {
+		const void *data;
+		size_t n;
+
+		if (pa_stream_peek(s, &data, &n) || !n)
+			break;
+
+		/* a hole is dropped, the application has its own timing */
+		if (data) {
+			const int16_t *p = data;
+			size_t sampc = n / 2;
+
+			while (sampc) {
+				const size_t c = min(sampc, st->sampc);
+
+				memcpy(st->sampv, p, c * 2);
+				st->rh(st->sampv, c, st->arg);
 
-		ret = pa_simple_read(st->s, st->sampv, num_bytes, &pa_error);
-		if (ret < 0) {
-			warning("pulse: pa_simple_write error (%s)\n",
-				pa_strerror(pa_error));
-			continue;
+				p     += c;
+				sampc -= c;
+			}
 		}
 
-		st->rh(st->sampv, st->sampc, st->arg);
+		(void)pa_stream_drop(s);
 	}
+}
+
+
+int pulse_recorder_debug(struct re_printf *pf, const struct ausrc_st *st)
+{
+	pa_usec_t usec = 0;
+	int neg = 0;
+
+	if (!st)
+		return 0;
+
+	pa_threaded_mainloop_lock(st->ml);
+	if (pa_stream_get_latency(st->s, &usec, &neg))
+		usec = 0;
+	pa_threaded_mainloop_unlock(st->ml);
 
-	return NULL;
+	return re_hprintf(pf, "pulse latency=%.1fms",
+			  neg ? 0.0 : usec / 1000.0);
 }
 
 
@@ -70,19 +127,22 @@ int pulse_recorder_alloc(struct ausrc_st **stp, const struct ausrc *as,
 			 struct ausrc_prm *prm, const char *device,
 			 ausrc_read_h *rh, ausrc_error_h *errh, void *arg)
 {
+	const pa_stream_flags_t flags = PA_STREAM_ADJUST_LATENCY |
+		PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
 	struct ausrc_st *st;
+	pa_context *pctx;
 	pa_sample_spec ss;
 	pa_buffer_attr attr;
-	int pa_error;
 	int err;
 
 	(void)ctx;
-	(void)device;
-	(void)errh;
 
-	if (!stp || !as || !prm)
+	if (!stp || !as || !prm || !rh)
 		return EINVAL;
 
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
 	debug("pulse: opening recorder (%u Hz, %d channels, device '%s')\n",
 	      prm->srate, prm->ch, device);
 
@@ -90,9 +150,10 @@ int pulse_recorder_alloc(struct ausrc_st **stp, const struct ausrc *as,
 	if (!st)
 		return ENOMEM;
 
-	st->as  = as;
-	st->rh  = rh;
-	st->arg = arg;
+	st->as   = as;
+	st->rh   = rh;
+	st->errh = errh;
+	st->arg  = arg;
 
 	st->sampc = prm->srate * prm->ch * prm->ptime / 1000;
 
@@ -102,36 +163,47 @@ int pulse_recorder_alloc(struct ausrc_st **stp, const struct ausrc *as,
 		goto out;
 	}
 
+	err = pulse_context(&st->ml, &pctx);
+	if (err)
+		goto out;
+
 	ss.format   = PA_SAMPLE_S16NE;
 	ss.channels = prm->ch;
 	ss.rate     = prm->srate;
 
+	/* one packet at a time */
 	attr.maxlength = (uint32_t)-1;
 	attr.tlength   = (uint32_t)-1;
 	attr.prebuf    = (uint32_t)-1;
 	attr.minreq    = (uint32_t)-1;
 	attr.fragsize  = (uint32_t)pa_usec_to_bytes(prm->ptime * 1000, &ss);
 
-	st->s = pa_simple_new(NULL,
-			      "Baresip",
-			      PA_STREAM_RECORD,
-			      str_isset(device) ? device : 0,
-			      "VoIP Record",
-			      &ss,
-			      NULL,
-			      &attr,
-			      &pa_error);
+	pa_threaded_mainloop_lock(st->ml);
+
+	st->s = pa_stream_new(pctx, "VoIP Record", &ss, NULL);
 	if (!st->s) {
-		warning("pulse: could not connect to server (%s)\n",
-			pa_strerror(pa_error));
-		err = ENODEV;
+		pa_threaded_mainloop_unlock(st->ml);
+		err = ENOMEM;
 		goto out;
 	}
 
-	st->run = true;
-	err = pthread_create(&st->thread, NULL, read_thread, st);
+	pa_stream_set_state_callback(st->s, state_handler, st);
+	pa_stream_set_read_callback(st->s, read_handler, st);
+
+	if (pa_stream_connect_record(st->s,
+				     str_isset(device) ? device : NULL,
+				     &attr, flags))
+		err = ENODEV;
+	else
+		err = pulse_stream_wait(st->ml, st->s);
+
+	st->ready = !err;
+
+	pa_threaded_mainloop_unlock(st->ml);
+
 	if (err) {
-		st->run = false;
+		warning("pulse: could not open recorder '%s' (%s)\n", device,
+			pa_strerror(pa_context_errno(pctx)));
 		goto out;
 	}
 
@@ -0,0 +1,11 @@
+#
+# module.mk
+#
+# Copyright (C) 2010 Creytiv.com
+#
+
+MOD		:= rnnoise
+$(MOD)_SRCS	+= rnnoise.c
+$(MOD)_LFLAGS	+= -lrnnoise -lm
+
+include mk/mod.mk
@@ -0,0 +1,219 @@
+/**
+ * @file rnnoise.c  Noise suppression with RNNoise
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <math.h>
+#include <rnnoise.h>
+#include <re.h>
+#include <baresip.h>
+
+
+/**
+ * @defgroup rnnoise rnnoise
+ *
+ * Noise suppression, voice activity detection and automatic gain control
+ * for the encoder, with the recurrent neural network of RNNoise
+ *
+ * RNNoise works on blocks of 10 ms at 48000 Hz, so the filter is only
+ * used with a mono encoder at 48000 Hz, e.g. Opus, and is left out of
+ * the pipeline otherwise. The voice activity of RNNoise replaces the one
+ * from the audio level for DTX. The gain control follows the level of the
+ * denoised audio, which is only measured while someone is talking.
+ *
+ * The conversions to and from float and the gain have simple loops that
+ * the compiler turns into SIMD code, the network itself is vectorized
+ * in the RNNoise library.
+ *
+ * Example config:
+ \verbatim
+  rnnoise_agc         yes
+  rnnoise_agc_level   20      # Target level [-dBov]
+ \endverbatim
+ */
+
+
+enum {
+	SRATE    = 48000,
+	BLOCK    = 480,     /* Samples per block of RNNoise (10 ms)     */
+	GAIN_MAX = 30,      /* Max. gain of the AGC [dB]                */
+	GAIN_MIN = -10,     /* Min. gain of the AGC [dB]                */
+};
+
+#define VAD_PROB   0.6f     /* Voice probability for voice activity */
+#define GAIN_UP    0.5f     /* Max. gain increase per packet [dB]   */
+#define GAIN_DOWN  3.0f     /* Max. gain decrease per packet [dB]   */
+
+
+struct rnnoise_enc {
+	struct aufilt_enc_st af;    /* base class */
+	DenoiseState *ds;
+	float buf[BLOCK];
+	float gain_db;              /* Gain of the next packet [dB]     */
+	float gain;                 /* Gain of the last block, linear   */
+};
+
+
+static struct {
+	bool agc;
+	uint32_t agc_level;
+} rnconf = {
+	true,
+	20,
+};
+
+
+static void destructor(void *arg)
+{
+	struct rnnoise_enc *st = arg;
+
+	list_unlink(&st->af.le);
+
+	if (st->ds)
+		rnnoise_destroy(st->ds);
+}
+
+
+/* RNNoise takes float samples with the range of int16 */
+static void block_load(float *dst, const int16_t *src)
+{
+	size_t i;
+
+	for (i=0; i<BLOCK; i++)
+		dst[i] = src[i];
+}
+
+
+/* The gain goes from g0 to g1 in the block, without steps */
+static void block_store(int16_t *dst, const float *src, float g0, float g1)
+{
+	const float d = (g1 - g0) / BLOCK;
+	int i;
+
+	for (i=0; i<BLOCK; i++) {
+		float v = src[i] * (g0 + d * i);
+
+		v = v >  32767.0f ?  32767.0f : v;
+		v = v < -32768.0f ? -32768.0f : v;
+
+		dst[i] = (int16_t)(int32_t)v;
+	}
+}
+
+
+/* Adapt the gain to the level of a packet with voice */
+static void agc_update(struct rnnoise_enc *st, const int16_t *sampv,
+		       size_t sampc)
+{
+	struct aulevel lvl;
+	float d;
+
+	aulevel_calc(&lvl, sampv, sampc);
+
+	d = (float)lvl.dbov - (float)rnconf.agc_level;
+	d = d > 0 ? min(d, GAIN_UP) : max(d, -GAIN_DOWN);
+
+	st->gain_db = min(max(st->gain_db + d, GAIN_MIN), GAIN_MAX);
+}
+
+
+static int encode_update(struct aufilt_enc_st **stp, void **ctx,
+			 const struct aufilt *af, struct aufilt_prm *prm)
+{
+	struct rnnoise_enc *st;
+	(void)ctx;
+
+	if (!stp || !af || !prm)
+		return EINVAL;
+
+	if (*stp)
+		return 0;
+
+	/* no resampling for the filter, it is only a cleanup */
+	if (prm->srate != SRATE || prm->ch != 1) {
+		info("rnnoise: %uHz/%uch is not supported, filter not used\n",
+		     prm->srate, prm->ch);
+		return 0;
+	}
+
+	st = mem_zalloc(sizeof(*st), destructor);
+	if (!st)
+		return ENOMEM;
+
+	st->ds = rnnoise_create(NULL);
+	if (!st->ds) {
+		mem_deref(st);
+		return ENOMEM;
+	}
+
+	st->af.vad = true;
+	st->gain   = 1.0f;
+
+	*stp = (struct aufilt_enc_st *)st;
+
+	return 0;
+}
+
+
+static int encode(struct aufilt_enc_st *aest, int16_t *sampv, size_t *sampc)
+{
+	struct rnnoise_enc *st = (struct rnnoise_enc *)aest;
+	float gain = 1.0f, prob = 0;
+	size_t i;
+
+	if (rnconf.agc)
+		gain = powf(10.0f, st->gain_db / 20.0f);
+
+	/* the packet time is a multiple of 10 ms */
+	for (i=0; i + BLOCK <= *sampc; i += BLOCK) {
+
+		block_load(st->buf, &sampv[i]);
+
+		prob = max(prob, rnnoise_process_frame(st->ds, st->buf,
+						       st->buf));
+
+		block_store(&sampv[i], st->buf, st->gain, gain);
+		st->gain = gain;
+	}
+
+	st->af.voice = prob >= VAD_PROB;
+
+	if (rnconf.agc && st->af.voice)
+		agc_update(st, sampv, *sampc);
+
+	return 0;
+}
+
+
+static struct aufilt rnnoise = {
+	LE_INIT, "rnnoise", encode_update, encode, NULL, NULL
+};
+
+
+static int module_init(void)
+{
+	struct conf *conf = conf_cur();
+
+	(void)conf_get_bool(conf, "rnnoise_agc", &rnconf.agc);
+	(void)conf_get_u32(conf, "rnnoise_agc_level", &rnconf.agc_level);
+
+	aufilt_register(&rnnoise);
+
+	return 0;
+}
+
+
+static int module_close(void)
+{
+	aufilt_unregister(&rnnoise);
+
+	return 0;
+}
+
+
+EXPORT_SYM const struct mod_export DECL_EXPORTS(rnnoise) = {
+	"rnnoise",
+	"filter",
+	module_init,
+	module_close
+};
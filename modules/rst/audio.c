@@ -16,12 +16,39 @@
 #include "rst.h"
 
 
+/*
+ * The stream is decoded once for each output format into a ring of
+ * samples, and every audio source reads from the ring of its format at
+ * its own position. The decoders are fed in the main thread, and the
+ * sources read in their own threads.
+ */
+
+
+enum {
+	RING_SEC   = 20,        /* Size of the ring [s]             */
+	PREBUF_SEC = 1,         /* Buffering before playout [s]     */
+	DEC_SZ     = 4096,      /* Bytes decoded at a time          */
+};
+
+struct mp3dec {
+	struct le le;
+	struct lock *lock;      /* Protects ringv and wpos          */
+	mpg123_handle *mp3;
+	int16_t *ringv;
+	size_t ringsz;          /* Size of the ring [samples]       */
+	size_t prebuf;          /* Buffering [samples]              */
+	uint64_t wpos;          /* Samples written in total         */
+	uint32_t srate;
+	uint8_t ch;
+};
+
 struct ausrc_st {
 	const struct ausrc *as;  /* pointer to base-class (inheritance) */
 	pthread_t thread;
 	struct rst *rst;
-	mpg123_handle *mp3;
-	struct aubuf *aubuf;
+	struct mp3dec *dec;
+	uint64_t rpos;           /* Samples read in total */
+	bool wait;               /* Buffering             */
 	ausrc_read_h *rh;
 	ausrc_error_h *errh;
 	void *arg;
@@ -34,24 +61,162 @@ struct ausrc_st {
 static struct ausrc *ausrc;
 
 
+static void dec_destructor(void *arg)
+{
+	struct mp3dec *dec = arg;
+
+	list_unlink(&dec->le);
+
+	if (dec->mp3) {
+		mpg123_close(dec->mp3);
+		mpg123_delete(dec->mp3);
+	}
+
+	mem_deref(dec->ringv);
+	mem_deref(dec->lock);
+}
+
+
+static int dec_alloc(struct mp3dec **decp, struct list *decl,
+		     uint32_t srate, uint8_t ch)
+{
+	struct mp3dec *dec;
+	struct le *le;
+	int err;
+
+	for (le = list_head(decl); le; le = le->next) {
+
+		dec = le->data;
+
+		if (dec->srate == srate && dec->ch == ch) {
+			*decp = mem_ref(dec);
+			return 0;
+		}
+	}
+
+	dec = mem_zalloc(sizeof(*dec), dec_destructor);
+	if (!dec)
+		return ENOMEM;
+
+	dec->srate  = srate;
+	dec->ch     = ch;
+	dec->ringsz = srate * ch * RING_SEC;
+	dec->prebuf = srate * ch * PREBUF_SEC;
+
+	err = lock_alloc(&dec->lock);
+	if (err)
+		goto out;
+
+	dec->ringv = mem_zalloc(dec->ringsz * sizeof(int16_t), NULL);
+	if (!dec->ringv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	dec->mp3 = mpg123_new(NULL, &err);
+	if (!dec->mp3) {
+		err = ENODEV;
+		goto out;
+	}
+
+	err = mpg123_open_feed(dec->mp3);
+	if (err != MPG123_OK) {
+		warning("rst: mpg123_open_feed: %s\n",
+			mpg123_strerror(dec->mp3));
+		err = ENODEV;
+		goto out;
+	}
+
+	/* Set wanted output format */
+	mpg123_format_none(dec->mp3);
+	mpg123_format(dec->mp3, srate, ch, MPG123_ENC_SIGNED_16);
+	mpg123_volume(dec->mp3, 0.3);
+
+	info("rst: decoder %u Hz, %u ch, ring %u seconds\n",
+	     srate, ch, RING_SEC);
+
+	list_append(decl, &dec->le, dec);
+
+ out:
+	if (err)
+		mem_deref(dec);
+	else
+		*decp = dec;
+
+	return err;
+}
+
+
+static void ring_write(struct mp3dec *dec, const int16_t *sampv,
+		       size_t sampc)
+{
+	size_t pos, n;
+
+	lock_write_get(dec->lock);
+
+	pos = dec->wpos % dec->ringsz;
+	n   = min(sampc, dec->ringsz - pos);
+
+	memcpy(&dec->ringv[pos], sampv, n * 2);
+	memcpy(dec->ringv, &sampv[n], (sampc - n) * 2);
+
+	dec->wpos += sampc;
+
+	lock_rel(dec->lock);
+}
+
+
+/* read from the position of the source, silence while buffering */
+static void ring_read(struct ausrc_st *st, int16_t *sampv, size_t sampc)
+{
+	struct mp3dec *dec = st->dec;
+	uint64_t avail;
+	size_t pos, n;
+
+	lock_read_get(dec->lock);
+
+	avail = dec->wpos - st->rpos;
+
+	/* overwritten by the writer, skip ahead */
+	if (avail > dec->ringsz - sampc) {
+		st->rpos = dec->wpos - dec->prebuf;
+		avail    = dec->prebuf;
+	}
+
+	if (st->wait && avail >= dec->prebuf)
+		st->wait = false;
+	else if (avail < sampc)
+		st->wait = true;
+
+	if (st->wait) {
+		lock_rel(dec->lock);
+		memset(sampv, 0, sampc * 2);
+		return;
+	}
+
+	pos = st->rpos % dec->ringsz;
+	n   = min(sampc, dec->ringsz - pos);
+
+	memcpy(sampv, &dec->ringv[pos], n * 2);
+	memcpy(&sampv[n], dec->ringv, (sampc - n) * 2);
+
+	st->rpos += sampc;
+
+	lock_rel(dec->lock);
+}
+
+
 static void destructor(void *arg)
 {
 	struct ausrc_st *st = arg;
 
-	rst_set_audio(st->rst, NULL);
-	mem_deref(st->rst);
-
 	if (st->run) {
 		st->run = false;
 		pthread_join(st->thread, NULL);
 	}
 
-	if (st->mp3) {
-		mpg123_close(st->mp3);
-		mpg123_delete(st->mp3);
-	}
-
-	mem_deref(st->aubuf);
+	mem_deref(st->dec);
+	mem_deref(st->rst);
 }
 
 
@@ -80,7 +245,7 @@ static void *play_thread(void *arg)
 		}
 #endif
 
-		aubuf_read_samp(st->aubuf, sampv, st->sampc);
+		ring_read(st, sampv, st->sampc);
 
 		st->rh(sampv, st->sampc, st->arg);
 
@@ -93,31 +258,28 @@ static void *play_thread(void *arg)
 }
 
 
-static inline int decode(struct ausrc_st *st)
+static inline int decode(struct mp3dec *dec)
 {
+	int16_t buf[DEC_SZ / 2];
 	int err, ch, encoding;
-	struct mbuf *mb;
+	size_t n = 0;
 	long srate;
 
-	mb = mbuf_alloc(4096);
-	if (!mb)
-		return ENOMEM;
-
-	err = mpg123_read(st->mp3, mb->buf, mb->size, &mb->end);
+	err = mpg123_read(dec->mp3, (void *)buf, sizeof(buf), &n);
 
 	switch (err) {
 
 	case MPG123_NEW_FORMAT:
-		mpg123_getformat(st->mp3, &srate, &ch, &encoding);
+		mpg123_getformat(dec->mp3, &srate, &ch, &encoding);
 		info("rst: new format: %i hz, %i ch, encoding 0x%04x\n",
 		     srate, ch, encoding);
 		/*@fallthrough@*/
 
 	case MPG123_OK:
 	case MPG123_NEED_MORE:
-		if (mb->end == 0)
+		if (n == 0)
 			break;
-		aubuf_append(st->aubuf, mb);
+		ring_write(dec, buf, n / 2);
 		break;
 
 	default:
@@ -126,25 +288,31 @@ static inline int decode(struct ausrc_st *st)
 		break;
 	}
 
-	mem_deref(mb);
-
 	return err;
 }
 
 
-void rst_audio_feed(struct ausrc_st *st, const uint8_t *buf, size_t sz)
+/**
+ * Feed MP3 data to all decoders of a stream
+ *
+ * @param decl List of decoders
+ * @param buf  MP3 data
+ * @param sz   Size of the data in bytes
+ */
+void rst_audio_feed(struct list *decl, const uint8_t *buf, size_t sz)
 {
-	int err;
+	struct le *le;
 
-	if (!st)
-		return;
+	for (le = list_head(decl); le; le = le->next) {
 
-	err = mpg123_feed(st->mp3, buf, sz);
-	if (err)
-		return;
+		struct mp3dec *dec = le->data;
 
-	while (MPG123_OK == decode(st))
-		;
+		if (mpg123_feed(dec->mp3, buf, sz))
+			continue;
+
+		while (MPG123_OK == decode(dec))
+			;
+	}
 }
 
 
@@ -159,6 +327,9 @@ static int alloc_handler(struct ausrc_st **stp, const struct ausrc *as,
 	if (!stp || !as || !prm || !rh)
 		return EINVAL;
 
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
 	st = mem_zalloc(sizeof(*st), destructor);
 	if (!st)
 		return ENOMEM;
@@ -167,41 +338,13 @@ static int alloc_handler(struct ausrc_st **stp, const struct ausrc *as,
 	st->rh   = rh;
 	st->errh = errh;
 	st->arg  = arg;
-
-	st->mp3 = mpg123_new(NULL, &err);
-	if (!st->mp3) {
-		err = ENODEV;
-		goto out;
-	}
-
-	err = mpg123_open_feed(st->mp3);
-	if (err != MPG123_OK) {
-		warning("rst: mpg123_open_feed: %s\n",
-			mpg123_strerror(st->mp3));
-		err = ENODEV;
-		goto out;
-	}
-
-	/* Set wanted output format */
-	mpg123_format_none(st->mp3);
-	mpg123_format(st->mp3, prm->srate, prm->ch, MPG123_ENC_SIGNED_16);
-	mpg123_volume(st->mp3, 0.3);
+	st->wait = true;
 
 	st->sampc = prm->srate * prm->ch * prm->ptime / 1000;
 
 	st->ptime = prm->ptime;
 
-	info("rst: audio ptime=%u sampc=%zu aubuf=[%u:%u]\n",
-	     st->ptime, st->sampc,
-	     prm->srate * prm->ch * 2,
-	     prm->srate * prm->ch * 40);
-
-	/* 1 - 20 seconds of audio */
-	err = aubuf_alloc(&st->aubuf,
-			  prm->srate * prm->ch * 2,
-			  prm->srate * prm->ch * 40);
-	if (err)
-		goto out;
+	info("rst: audio ptime=%u sampc=%zu\n", st->ptime, st->sampc);
 
 	if (ctx && *ctx && (*ctx)->id && !strcmp((*ctx)->id, "rst")) {
 		st->rst = mem_ref(*ctx);
@@ -215,7 +358,16 @@ static int alloc_handler(struct ausrc_st **stp, const struct ausrc *as,
 			*ctx = (struct media_ctx *)st->rst;
 	}
 
-	rst_set_audio(st->rst, st);
+	err = dec_alloc(&st->dec, rst_decoders(st->rst),
+			prm->srate, prm->ch);
+	if (err)
+		goto out;
+
+	/* start a second before the newest samples */
+	lock_read_get(st->dec->lock);
+	st->rpos = st->dec->wpos - min(st->dec->wpos,
+				       (uint64_t)st->dec->prebuf);
+	lock_rel(st->dec->lock);
 
 	st->run = true;
 
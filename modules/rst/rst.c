@@ -24,6 +24,10 @@
   audio_source        rst,http://relay.slayradio.org:8000/
   video_source        rst,http://relay.slayradio.org:8000/
  \endverbatim
+ *
+ * All calls that play the same URL share one HTTP connection, and the
+ * MP3 stream is decoded once for each sampling rate and channel count
+ * that the calls ask for.
  */
 
 
@@ -34,10 +38,12 @@ enum {
 
 struct rst {
 	const char *id;
-	struct ausrc_st *ausrc_st;
-	struct vidsrc_st *vidsrc_st;
+	struct le le;
+	struct list decl;
+	struct list vidl;
+	char *dev;
 	struct tmr tmr;
-	struct dns_query *dnsq;
+	struct net_dnsq *dnsq;
 	struct tcp_conn *tc;
 	struct mbuf *mb;
 	char *host;
@@ -52,6 +58,9 @@ struct rst {
 };
 
 
+static struct list rstl;
+
+
 static int rst_connect(struct rst *rst);
 
 
@@ -59,10 +68,12 @@ static void destructor(void *arg)
 {
 	struct rst *rst = arg;
 
+	list_unlink(&rst->le);
 	tmr_cancel(&rst->tmr);
 	mem_deref(rst->dnsq);
 	mem_deref(rst->tc);
 	mem_deref(rst->mb);
+	mem_deref(rst->dev);
 	mem_deref(rst->host);
 	mem_deref(rst->path);
 	mem_deref(rst->name);
@@ -90,6 +101,15 @@ static void reconnect(void *arg)
 }
 
 
+static void video_update(struct rst *rst)
+{
+	struct le *le;
+
+	for (le = rst->vidl.head; le; le = le->next)
+		rst_video_update(le->data, rst->name, rst->meta);
+}
+
+
 static void recv_handler(struct mbuf *mb, void *arg)
 {
 	struct rst *rst = arg;
@@ -148,7 +168,7 @@ static void recv_handler(struct mbuf *mb, void *arg)
 			return;
 		}
 
-		rst_video_update(rst->vidsrc_st, rst->name, NULL);
+		video_update(rst);
 
 		rst->mb->pos += hdr.l;
 
@@ -184,15 +204,14 @@ static void recv_handler(struct mbuf *mb, void *arg)
 				rst->metasz = 0;
 				rst->bytec  = 0;
 
-				rst_video_update(rst->vidsrc_st, rst->name,
-						 rst->meta);
+				video_update(rst);
 			}
 		}
 		else if (rst->bytec < rst->metaint) {
 
 			n = min(mbuf_get_left(mb), rst->metaint - rst->bytec);
 
-			rst_audio_feed(rst->ausrc_st, mbuf_buf(mb), n);
+			rst_audio_feed(&rst->decl, mbuf_buf(mb), n);
 
 			rst->bytec += n;
 			mb->pos    += n;
@@ -308,9 +327,10 @@ static int rst_connect(struct rst *rst)
 		}
 	}
 	else {
-		err = dnsc_query(&rst->dnsq, net_dnsc(baresip_network()),
-				 rst->host, DNS_TYPE_A,
-				 DNS_CLASS_IN, true, dns_handler, rst);
+		rst->dnsq = mem_deref(rst->dnsq);
+
+		err = net_dns_query(&rst->dnsq, baresip_network(),
+				    rst->host, DNS_TYPE_A, dns_handler, rst);
 		if (err) {
 			warning("rst: dns query error: %m\n", err);
 		}
@@ -320,15 +340,34 @@ static int rst_connect(struct rst *rst)
 }
 
 
+/**
+ * Get the stream of a URL, it is connected if no one else plays it
+ *
+ * @param rstp Pointer to the stream, shared with the other callers
+ * @param dev  HTTP URL
+ *
+ * @return 0 if success, otherwise errorcode
+ */
 int rst_alloc(struct rst **rstp, const char *dev)
 {
 	struct pl host, port, path;
 	struct rst *rst;
+	struct le *le;
 	int err;
 
 	if (!rstp || !dev)
 		return EINVAL;
 
+	for (le = rstl.head; le; le = le->next) {
+
+		rst = le->data;
+
+		if (!str_cmp(rst->dev, dev)) {
+			*rstp = mem_ref(rst);
+			return 0;
+		}
+	}
+
 	if (re_regex(dev, strlen(dev), "http://[^:/]+[:]*[0-9]*[^]+",
 		     &host, NULL, &port, &path)) {
 		warning("rst: bad http url: %s\n", dev);
@@ -341,6 +380,10 @@ int rst_alloc(struct rst **rstp, const char *dev)
 
 	rst->id = "rst";
 
+	err = str_dup(&rst->dev, dev);
+	if (err)
+		goto out;
+
 	err = pl_strdup(&rst->host, &host);
 	if (err)
 		goto out;
@@ -356,6 +399,8 @@ int rst_alloc(struct rst **rstp, const char *dev)
 	if (err)
 		goto out;
 
+	list_append(&rstl, &rst->le, rst);
+
  out:
 	if (err)
 		mem_deref(rst);
@@ -366,21 +411,22 @@ int rst_alloc(struct rst **rstp, const char *dev)
 }
 
 
-void rst_set_audio(struct rst *rst, struct ausrc_st *st)
+/* MP3 decoders of the stream, one for each output format */
+struct list *rst_decoders(struct rst *rst)
 {
-	if (!rst)
-		return;
-
-	rst->ausrc_st = st;
+	return rst ? &rst->decl : NULL;
 }
 
 
-void rst_set_video(struct rst *rst, struct vidsrc_st *st)
+void rst_add_video(struct rst *rst, struct le *le, struct vidsrc_st *st)
 {
-	if (!rst)
+	if (!rst || !le)
 		return;
 
-	rst->vidsrc_st = st;
+	list_append(&rst->vidl, le, st);
+
+	if (rst->head_recv)
+		rst_video_update(st, rst->name, rst->meta);
 }
 
 
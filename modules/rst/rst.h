@@ -5,16 +5,16 @@
  */
 
 
-/* Shared AV state */
+/* Shared AV state, one for each URL */
 struct rst;
 
 int  rst_alloc(struct rst **rstp, const char *dev);
-void rst_set_audio(struct rst *rst, struct ausrc_st *st);
-void rst_set_video(struct rst *rst, struct vidsrc_st *st);
+struct list *rst_decoders(struct rst *rst);
+void rst_add_video(struct rst *rst, struct le *le, struct vidsrc_st *st);
 
 
 /* Audio */
-void rst_audio_feed(struct ausrc_st *st, const uint8_t *buf, size_t sz);
+void rst_audio_feed(struct list *decl, const uint8_t *buf, size_t sz);
 int  rst_audio_init(void);
 void rst_audio_close(void);
 
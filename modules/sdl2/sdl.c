@@ -4,6 +4,7 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
+#include <pthread.h>
 #include <SDL2/SDL.h>
 #include <re.h>
 #include <rem.h>
@@ -14,9 +15,21 @@
  * @defgroup sdl2 sdl2
  *
  * Video display using Simple DirectMedia Layer version 2 (SDL2)
+ *
+ * The window is owned by a presentation thread, so the thread that
+ * decodes the video never waits for the texture upload or for the
+ * vertical sync of the display. The frames are passed through three
+ * buffers: the decoder fills the back buffer and swaps it with the
+ * middle one, and the presentation thread swaps the middle buffer with
+ * the front one whenever it is ready for a new frame. The latest frame
+ * is always shown, and frames that arrive faster than the display
+ * refresh are dropped. The YUV to RGB conversion is done by the SDL
+ * renderer on the GPU.
  */
 
 
+enum {BACK = 0, MID, FRONT, NBUF};
+
 struct vidisp_st {
 	const struct vidisp *vd;        /**< Inheritance (1st)     */
 	SDL_Window *window;             /**< SDL Window            */
@@ -25,6 +38,17 @@ struct vidisp_st {
 	struct vidsz size;              /**< Current size          */
 	enum vidfmt fmt;                /**< Current pixel format  */
 	bool fullscreen;                /**< Fullscreen flag       */
+
+	struct vidframe *bufv[NBUF];    /**< Triple buffer         */
+	char title[256];                /**< Title of next frame   */
+	pthread_t thread;               /**< Presentation thread   */
+	pthread_mutex_t mutex;          /**< Protects shared state */
+	pthread_cond_t cond;            /**< A new frame is ready  */
+	bool fresh;                     /**< Middle buffer is new  */
+	bool hide;                      /**< Hide the window       */
+	bool run;                       /**< Thread is running     */
+	int err;                        /**< Presentation error    */
+	uint64_t n_drop;                /**< Frames never shown    */
 };
 
 
@@ -79,11 +103,33 @@ static void sdl_reset(struct vidisp_st *st)
 static void destructor(void *arg)
 {
 	struct vidisp_st *st = arg;
+	int i;
+
+	if (st->run) {
+		pthread_mutex_lock(&st->mutex);
+		st->run = false;
+		pthread_cond_signal(&st->cond);
+		pthread_mutex_unlock(&st->mutex);
+
+		pthread_join(st->thread, NULL);
+
+		pthread_cond_destroy(&st->cond);
+		pthread_mutex_destroy(&st->mutex);
+	}
 
 	sdl_reset(st);
+
+	for (i=0; i<NBUF; i++)
+		mem_deref(st->bufv[i]);
+
+	if (st->n_drop)
+		debug("sdl2: %llu frames dropped\n", st->n_drop);
 }
 
 
+static void *present_thread(void *arg);
+
+
 static int alloc(struct vidisp_st **stp, const struct vidisp *vd,
 		 struct vidisp_prm *prm, const char *dev,
 		 vidisp_resize_h *resizeh, void *arg)
@@ -106,6 +152,17 @@ static int alloc(struct vidisp_st **stp, const struct vidisp *vd,
 
 	st->vd = vd;
 
+	pthread_mutex_init(&st->mutex, NULL);
+	pthread_cond_init(&st->cond, NULL);
+
+	st->run = true;
+	err = pthread_create(&st->thread, NULL, present_thread, st);
+	if (err) {
+		st->run = false;
+		pthread_cond_destroy(&st->cond);
+		pthread_mutex_destroy(&st->mutex);
+	}
+
 	if (err)
 		mem_deref(st);
 	else
@@ -115,8 +172,9 @@ static int alloc(struct vidisp_st **stp, const struct vidisp *vd,
 }
 
 
-static int display(struct vidisp_st *st, const char *title,
-		   const struct vidframe *frame)
+/* Called in the presentation thread */
+static int render(struct vidisp_st *st, const char *title,
+		  const struct vidframe *frame)
 {
 	void *pixels;
 	uint8_t *d;
@@ -124,15 +182,7 @@ static int display(struct vidisp_st *st, const char *title,
 	unsigned i, h;
 	uint32_t format;
 
-	if (!st || !frame)
-		return EINVAL;
-
 	format = match_fmt(frame->fmt);
-	if (format == SDL_PIXELFORMAT_UNKNOWN) {
-		warning("sdl2: pixel format not supported (%s)\n",
-			vidfmt_name(frame->fmt));
-		return ENOTSUP;
-	}
 
 	if (!vidsz_cmp(&st->size, &frame->size) || frame->fmt != st->fmt) {
 		if (st->size.w && st->size.h) {
@@ -152,7 +202,7 @@ static int display(struct vidisp_st *st, const char *title,
 		if (st->fullscreen)
 			flags |= SDL_WINDOW_FULLSCREEN;
 
-		if (title) {
+		if (str_isset(title)) {
 			re_snprintf(capt, sizeof(capt), "%s - %u x %u",
 				    title, frame->size.w, frame->size.h);
 		}
@@ -250,12 +300,120 @@ static int display(struct vidisp_st *st, const char *title,
 }
 
 
+static void *present_thread(void *arg)
+{
+	struct vidisp_st *st = arg;
+	char title[sizeof(st->title)];
+
+	pthread_mutex_lock(&st->mutex);
+
+	while (st->run) {
+
+		struct vidframe *frame;
+		bool hidden;
+		int err;
+
+		if (!st->fresh && !st->hide) {
+			pthread_cond_wait(&st->cond, &st->mutex);
+			continue;
+		}
+
+		hidden = st->hide;
+		st->hide = false;
+
+		frame = NULL;
+		if (st->fresh) {
+			frame = st->bufv[MID];
+			st->bufv[MID] = st->bufv[FRONT];
+			st->bufv[FRONT] = frame;
+			st->fresh = false;
+
+			str_ncpy(title, st->title, sizeof(title));
+		}
+
+		pthread_mutex_unlock(&st->mutex);
+
+		if (hidden && st->window)
+			SDL_HideWindow(st->window);
+
+		err = frame ? render(st, title, frame) : 0;
+
+		pthread_mutex_lock(&st->mutex);
+
+		if (frame)
+			st->err = err;
+	}
+
+	pthread_mutex_unlock(&st->mutex);
+
+	/* the window belongs to this thread */
+	sdl_reset(st);
+
+	return NULL;
+}
+
+
+static int display(struct vidisp_st *st, const char *title,
+		   const struct vidframe *frame)
+{
+	struct vidframe *back;
+	int err;
+
+	if (!st || !frame)
+		return EINVAL;
+
+	if (match_fmt(frame->fmt) == SDL_PIXELFORMAT_UNKNOWN) {
+		warning("sdl2: pixel format not supported (%s)\n",
+			vidfmt_name(frame->fmt));
+		return ENOTSUP;
+	}
+
+	/* only this thread uses the back buffer */
+	back = st->bufv[BACK];
+	if (back && (back->fmt != frame->fmt ||
+		     !vidsz_cmp(&back->size, &frame->size)))
+		back = st->bufv[BACK] = mem_deref(back);
+
+	if (!back) {
+		err = vidframe_alloc(&st->bufv[BACK], frame->fmt,
+				     &frame->size);
+		if (err)
+			return err;
+
+		back = st->bufv[BACK];
+	}
+
+	vidframe_copy(back, frame);
+
+	pthread_mutex_lock(&st->mutex);
+
+	if (st->fresh)
+		++st->n_drop;
+
+	st->bufv[BACK] = st->bufv[MID];
+	st->bufv[MID]  = back;
+	st->fresh      = true;
+
+	str_ncpy(st->title, title ? title : "", sizeof(st->title));
+
+	err = st->err;
+
+	pthread_cond_signal(&st->cond);
+	pthread_mutex_unlock(&st->mutex);
+
+	return err;
+}
+
+
 static void hide(struct vidisp_st *st)
 {
-	if (!st || !st->window)
+	if (!st)
 		return;
 
-	SDL_HideWindow(st->window);
+	pthread_mutex_lock(&st->mutex);
+	st->hide = true;
+	pthread_cond_signal(&st->cond);
+	pthread_mutex_unlock(&st->mutex);
 }
 
 
@@ -195,7 +195,7 @@ static int encode_pip(struct vidfilt_enc_st *st, struct vidframe *frame)
 
 		err = vidframe_alloc(&selfview->frame, VID_FMT_YUV420P, &sz);
 	}
-	if (!err)
+	if (!err && vidframe_scale(selfview->frame, NULL, frame))
 		vidconv(selfview->frame, frame, NULL);
 	lock_rel(selfview->lock);
 
@@ -226,7 +226,8 @@ static int decode_pip(struct vidfilt_dec_st *st, struct vidframe *frame)
 		else
 			rect.y = frame->size.h/2;
 
-		vidconv(frame, sv->frame, &rect);
+		if (vidframe_scale(frame, &rect, sv->frame))
+			vidconv(frame, sv->frame, &rect);
 
 		vidframe_draw_rect(frame, rect.x, rect.y, rect.w, rect.h,
 				   127, 127, 127);
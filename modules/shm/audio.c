@@ -0,0 +1,284 @@
+/**
+ * @file shm/audio.c  Shared memory media exchange -- audio
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#define _DEFAULT_SOURCE 1
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "shm.h"
+
+
+/*
+ * The player is clocked by a thread of its own, which lets the audio
+ * core write each packet straight into a slot of the ring. The source
+ * thread sleeps on the eventfd and passes the frames of the other
+ * process on as they are, in any size up to one packet.
+ */
+
+
+enum {
+	WAIT_MS = 100,     /* Max wait for a frame, to check for stop */
+};
+
+struct auplay_st {
+	const struct auplay *ap;      /* inheritance */
+
+	struct shm_seg *seg;
+	void *buf;                    /* Packet when the ring is full */
+	pthread_t thread;
+	volatile bool run;
+	size_t sampc;
+	size_t bytes;
+	uint32_t ptime;
+	auplay_write_h *wh;
+	void *arg;
+};
+
+struct ausrc_st {
+	const struct ausrc *as;       /* inheritance */
+
+	struct shm_seg *seg;
+	pthread_t thread;
+	volatile bool run;
+	size_t size;                  /* Bytes per sample */
+	size_t max;                   /* Max bytes per frame */
+	ausrc_read_h *rh;
+	void *arg;
+};
+
+
+/* Monotonic time in [us] */
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void sleep_until(uint64_t deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec  = deadline / 1000000;
+	ts.tv_nsec = (deadline % 1000000) * 1000;
+
+	while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					&ts, NULL))
+		;
+}
+
+
+static void *play_thread(void *arg)
+{
+	struct auplay_st *st = arg;
+	uint64_t t0 = now_us();
+	uint64_t n = 0;
+
+	while (st->run) {
+
+		const uint64_t ts = t0 + n * st->ptime * 1000;
+		struct shm_frame *f;
+		void *p;
+
+		sleep_until(ts);
+
+		if (!st->run)
+			break;
+
+		/* the packet is written into the ring */
+		p = shm_seg_claim(st->seg, &f);
+		if (p) {
+			st->wh(p, st->sampc, st->arg);
+
+			f->ts  = ts;
+			f->len = (uint32_t)st->bytes;
+
+			shm_seg_commit(st->seg);
+		}
+		else {
+			st->wh(st->buf, st->sampc, st->arg);
+		}
+
+		++n;
+	}
+
+	return NULL;
+}
+
+
+static void *src_thread(void *arg)
+{
+	struct ausrc_st *st = arg;
+
+	while (st->run) {
+
+		const struct shm_frame *f;
+
+		(void)shm_seg_wait(st->seg, WAIT_MS);
+
+		while (st->run && (f = shm_seg_peek(st->seg))) {
+
+			const size_t len = min((size_t)f->len, st->max);
+
+			if (len >= st->size)
+				st->rh(f + 1, len / st->size, st->arg);
+
+			shm_seg_release(st->seg);
+		}
+	}
+
+	return NULL;
+}
+
+
+static void auplay_destructor(void *arg)
+{
+	struct auplay_st *st = arg;
+
+	if (st->run) {
+		st->run = false;
+		pthread_join(st->thread, NULL);
+	}
+
+	mem_deref(st->seg);
+	mem_deref(st->buf);
+}
+
+
+static void ausrc_destructor(void *arg)
+{
+	struct ausrc_st *st = arg;
+
+	if (st->run) {
+		st->run = false;
+		pthread_join(st->thread, NULL);
+	}
+
+	mem_deref(st->seg);
+}
+
+
+/* The header is the same for both directions */
+static void hdr_init(struct shm_seg *seg, int fmt, uint32_t srate,
+		     uint8_t ch)
+{
+	struct shm_hdr *hdr = shm_seg_hdr(seg);
+
+	hdr->fmt   = (uint32_t)fmt;
+	hdr->srate = srate;
+	hdr->ch    = ch;
+
+	shm_seg_ready(seg);
+}
+
+
+int shm_play_alloc(struct auplay_st **stp, const struct auplay *ap,
+		   struct auplay_prm *prm, const char *device,
+		   auplay_write_h *wh, void *arg)
+{
+	struct auplay_st *st;
+	int err;
+
+	if (!stp || !ap || !prm || !wh || !prm->ptime)
+		return EINVAL;
+
+	if (prm->fmt != AUFMT_S16LE && prm->fmt != AUFMT_FLOAT)
+		return ENOTSUP;
+
+	st = mem_zalloc(sizeof(*st), auplay_destructor);
+	if (!st)
+		return ENOMEM;
+
+	st->ap    = ap;
+	st->ptime = prm->ptime;
+	st->wh    = wh;
+	st->arg   = arg;
+	st->sampc = prm->srate * prm->ch * prm->ptime / 1000;
+	st->bytes = st->sampc * aufmt_sample_size(prm->fmt);
+
+	st->buf = mem_alloc(st->bytes, NULL);
+	if (!st->buf) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err = shm_seg_alloc(&st->seg, device, SHM_AUDIO, SHM_TO_PEER,
+			    shm_slots(), st->bytes);
+	if (err)
+		goto out;
+
+	hdr_init(st->seg, prm->fmt, prm->srate, prm->ch);
+
+	st->run = true;
+	err = pthread_create(&st->thread, NULL, play_thread, st);
+	if (err) {
+		st->run = false;
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(st);
+	else
+		*stp = st;
+
+	return err;
+}
+
+
+int shm_src_alloc(struct ausrc_st **stp, const struct ausrc *as,
+		  struct media_ctx **ctx,
+		  struct ausrc_prm *prm, const char *device,
+		  ausrc_read_h *rh, ausrc_error_h *errh, void *arg)
+{
+	struct ausrc_st *st;
+	int err;
+	(void)ctx;
+	(void)errh;
+
+	if (!stp || !as || !prm || !rh || !prm->ptime)
+		return EINVAL;
+
+	if (prm->fmt != AUFMT_S16LE && prm->fmt != AUFMT_FLOAT)
+		return ENOTSUP;
+
+	st = mem_zalloc(sizeof(*st), ausrc_destructor);
+	if (!st)
+		return ENOMEM;
+
+	st->as   = as;
+	st->rh   = rh;
+	st->arg  = arg;
+	st->size = aufmt_sample_size(prm->fmt);
+	st->max  = st->size * prm->srate * prm->ch * prm->ptime / 1000;
+
+	err = shm_seg_alloc(&st->seg, device, SHM_AUDIO, SHM_FROM_PEER,
+			    shm_slots(), st->max);
+	if (err)
+		goto out;
+
+	hdr_init(st->seg, prm->fmt, prm->srate, prm->ch);
+
+	st->run = true;
+	err = pthread_create(&st->thread, NULL, src_thread, st);
+	if (err) {
+		st->run = false;
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(st);
+	else
+		*stp = st;
+
+	return err;
+}
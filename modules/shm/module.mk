@@ -0,0 +1,11 @@
+#
+# module.mk
+#
+# Copyright (C) 2010 Creytiv.com
+#
+
+MOD		:= shm
+$(MOD)_SRCS	+= shm.c audio.c video.c
+$(MOD)_LFLAGS	+= -lrt
+
+include mk/mod.mk
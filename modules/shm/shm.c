@@ -0,0 +1,354 @@
+/**
+ * @file shm.c  Shared memory media exchange
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#define _DEFAULT_SOURCE 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "shm.h"
+
+
+/**
+ * @defgroup shm shm
+ *
+ * Audio and video devices that exchange frames with another process on
+ * the same host through POSIX shared memory
+ *
+ * Each stream has a segment of its own, named after the device and a
+ * counter, e.g. /dev/shm/asr.1 for the first stream of "shm,asr". The
+ * segment has a ring of slots with one producer and one consumer, which
+ * needs no locks and no system calls except for the eventfd that wakes
+ * up the consumer. The layout is described in shm.h.
+ *
+ * The player and the display write the audio and the video of the call
+ * into the ring, the source and the video source read the frames that
+ * the other process writes. A frame is dropped when the ring is full.
+ *
+ * Example config:
+ \verbatim
+  audio_player    shm,asr
+  audio_source    shm,tts
+  video_display   shm,vision
+
+  shm_slots       16      # Frames in a ring (power of two)
+ \endverbatim
+ */
+
+
+#if defined (__GNUC__) || defined (__clang__)
+#define LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+#error "shm: atomic load/store builtins are required"
+#endif
+
+
+struct shm_seg {
+	char name[64];
+	struct shm_hdr *hdr;
+	uint8_t *slotv;
+	size_t len;                /* Bytes mapped */
+	int fd;                    /* eventfd      */
+};
+
+static struct auplay *auplay;
+static struct ausrc *ausrc;
+static struct vidsrc *vidsrc;
+static struct vidisp *vidisp;
+static uint32_t slots = 16;
+static uint32_t counter;
+
+
+static void destructor(void *arg)
+{
+	struct shm_seg *seg = arg;
+
+	if (seg->hdr) {
+		(void)munmap(seg->hdr, seg->len);
+		(void)shm_unlink(seg->name);
+	}
+
+	if (seg->fd >= 0)
+		(void)close(seg->fd);
+}
+
+
+/**
+ * Create a shared memory segment with a ring of frames
+ *
+ * @param segp  Pointer to allocated segment
+ * @param dev   Device name, the prefix of the segment name
+ * @param type  Audio or video
+ * @param dir   Direction of the frames
+ * @param n     Number of slots, a power of two
+ * @param size  Max bytes of data per frame
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int shm_seg_alloc(struct shm_seg **segp, const char *dev,
+		  enum shm_type type, enum shm_dir dir,
+		  uint32_t n, size_t size)
+{
+	struct shm_seg *seg;
+	struct shm_hdr *hdr;
+	size_t slot_size;
+	int fd, err = 0;
+
+	if (!segp || !n || (n & (n - 1)) || !size)
+		return EINVAL;
+
+	seg = mem_zalloc(sizeof(*seg), destructor);
+	if (!seg)
+		return ENOMEM;
+
+	seg->fd = -1;
+
+	/* slots start on a cache line */
+	slot_size = (sizeof(struct shm_frame) + size + 63) & ~(size_t)63;
+	seg->len  = sizeof(*hdr) + n * slot_size;
+
+	re_snprintf(seg->name, sizeof(seg->name), "/%s.%u",
+		    str_isset(dev) ? dev : "baresip", ++counter);
+
+	/* a segment that was left behind by a crash */
+	(void)shm_unlink(seg->name);
+
+	fd = shm_open(seg->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		err = errno;
+		warning("shm: %s: %m\n", seg->name, err);
+		goto out;
+	}
+
+	if (ftruncate(fd, (off_t)seg->len) < 0) {
+		err = errno;
+		(void)close(fd);
+		(void)shm_unlink(seg->name);
+		goto out;
+	}
+
+	hdr = mmap(NULL, seg->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	(void)close(fd);
+	if (hdr == MAP_FAILED) {
+		err = errno;
+		(void)shm_unlink(seg->name);
+		goto out;
+	}
+
+	seg->hdr   = hdr;
+	seg->slotv = (uint8_t *)hdr + sizeof(*hdr);
+
+	seg->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (seg->fd < 0) {
+		err = errno;
+		goto out;
+	}
+
+	hdr->version   = SHM_VERSION;
+	hdr->type      = type;
+	hdr->dir       = dir;
+	hdr->pid       = (uint32_t)getpid();
+	hdr->efd       = seg->fd;
+	hdr->slots     = n;
+	hdr->slot_size = (uint32_t)slot_size;
+
+ out:
+	if (err)
+		mem_deref(seg);
+	else
+		*segp = seg;
+
+	return err;
+}
+
+
+/**
+ * Get the header of a segment, for filling in the format
+ *
+ * @param seg Segment
+ *
+ * @return Shared header
+ */
+struct shm_hdr *shm_seg_hdr(const struct shm_seg *seg)
+{
+	return seg ? seg->hdr : NULL;
+}
+
+
+/**
+ * Set the magic of a segment, after which the other process may use it
+ *
+ * @param seg Segment
+ */
+void shm_seg_ready(struct shm_seg *seg)
+{
+	if (!seg)
+		return;
+
+	STORE_RELEASE(&seg->hdr->magic, SHM_MAGIC);
+
+	info("shm: %s ready\n", seg->name);
+}
+
+
+const char *shm_seg_name(const struct shm_seg *seg)
+{
+	return seg ? seg->name : NULL;
+}
+
+
+/**
+ * Get the next free slot of the producer
+ *
+ * @param seg Segment
+ * @param fp  Returns the frame header of the slot
+ *
+ * @return Data of the slot, NULL if the ring is full
+ */
+void *shm_seg_claim(struct shm_seg *seg, struct shm_frame **fp)
+{
+	struct shm_hdr *hdr = seg->hdr;
+	const uint64_t wpos = hdr->wpos;
+	struct shm_frame *f;
+
+	if (wpos - LOAD_ACQUIRE(&hdr->rpos) >= hdr->slots) {
+		++hdr->n_drop;
+		return NULL;
+	}
+
+	f = (struct shm_frame *)(void *)
+		(seg->slotv + (wpos & (hdr->slots - 1)) * hdr->slot_size);
+
+	*fp = f;
+
+	return f + 1;
+}
+
+
+/**
+ * Hand the claimed slot to the consumer
+ *
+ * @param seg Segment
+ */
+void shm_seg_commit(struct shm_seg *seg)
+{
+	const uint64_t one = 1;
+
+	STORE_RELEASE(&seg->hdr->wpos, seg->hdr->wpos + 1);
+
+	/* a consumer that is not waiting leaves the counter to grow */
+	(void)write(seg->fd, &one, sizeof(one));
+}
+
+
+/**
+ * Get the oldest frame of the consumer
+ *
+ * @param seg Segment
+ *
+ * @return Frame, or NULL if the ring is empty
+ */
+const struct shm_frame *shm_seg_peek(struct shm_seg *seg)
+{
+	struct shm_hdr *hdr = seg->hdr;
+	const uint64_t rpos = hdr->rpos;
+
+	if (LOAD_ACQUIRE(&hdr->wpos) == rpos)
+		return NULL;
+
+	return (const struct shm_frame *)(void *)
+		(seg->slotv + (rpos & (hdr->slots - 1)) * hdr->slot_size);
+}
+
+
+/**
+ * Give the slot of the last peeked frame back to the producer
+ *
+ * @param seg Segment
+ */
+void shm_seg_release(struct shm_seg *seg)
+{
+	STORE_RELEASE(&seg->hdr->rpos, seg->hdr->rpos + 1);
+}
+
+
+/**
+ * Wait for the producer to commit a frame
+ *
+ * @param seg        Segment
+ * @param timeout_ms Max time to wait [ms]
+ *
+ * @return 0 if there may be frames, ETIMEDOUT if not
+ */
+int shm_seg_wait(struct shm_seg *seg, int timeout_ms)
+{
+	struct pollfd pfd;
+	uint64_t n;
+
+	pfd.fd      = seg->fd;
+	pfd.events  = POLLIN;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, timeout_ms) <= 0)
+		return ETIMEDOUT;
+
+	(void)read(seg->fd, &n, sizeof(n));
+
+	return 0;
+}
+
+
+uint32_t shm_slots(void)
+{
+	return slots;
+}
+
+
+static int module_init(void)
+{
+	int err;
+
+	(void)conf_get_u32(conf_cur(), "shm_slots", &slots);
+
+	if (!slots || (slots & (slots - 1))) {
+		warning("shm: shm_slots must be a power of two\n");
+		return EINVAL;
+	}
+
+	err  = auplay_register(&auplay, "shm", shm_play_alloc);
+	err |= ausrc_register(&ausrc, "shm", shm_src_alloc);
+	err |= vidsrc_register(&vidsrc, "shm", shm_vidsrc_alloc, NULL);
+	err |= vidisp_register(&vidisp, "shm", shm_vidisp_alloc, NULL,
+			       shm_display, NULL);
+
+	return err;
+}
+
+
+static int module_close(void)
+{
+	auplay = mem_deref(auplay);
+	ausrc  = mem_deref(ausrc);
+	vidsrc = mem_deref(vidsrc);
+	vidisp = mem_deref(vidisp);
+
+	return 0;
+}
+
+
+EXPORT_SYM const struct mod_export DECL_EXPORTS(shm) = {
+	"shm",
+	"sound",
+	module_init,
+	module_close
+};
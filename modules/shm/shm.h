@@ -0,0 +1,102 @@
+/**
+ * @file shm.h  Shared memory media exchange -- interface
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+/*
+ * Layout of a segment, which external processes map as well:
+ *
+ *   struct shm_hdr
+ *   slot 0 .. slots-1, each slot_size bytes:
+ *       struct shm_frame, then the samples or the planes of the frame
+ *
+ * The ring has one producer and one consumer. The producer writes the
+ * slot at wpos % slots, then stores wpos + 1 with release semantics and
+ * adds 1 to the eventfd. The consumer reads the slot at rpos % slots
+ * once wpos is ahead, then stores rpos + 1 with release semantics. A
+ * producer that finds the ring full drops the frame, it never waits.
+ *
+ * The eventfd is owned by baresip, the other process gets its own copy
+ * with pidfd_open(pid) and pidfd_getfd(efd).
+ */
+
+#define SHM_MAGIC    0x62736d31   /* "bsm1" */
+#define SHM_VERSION  1
+
+enum shm_type {
+	SHM_AUDIO = 1,
+	SHM_VIDEO = 2,
+};
+
+/* Who writes the frames */
+enum shm_dir {
+	SHM_TO_PEER   = 1,          /* baresip is the producer  */
+	SHM_FROM_PEER = 2,          /* baresip is the consumer  */
+};
+
+struct shm_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t type;              /* enum shm_type            */
+	uint32_t dir;               /* enum shm_dir             */
+	uint32_t pid;               /* Owner of the eventfd     */
+	int32_t  efd;               /* eventfd, in process pid  */
+	uint32_t slots;             /* Power of two             */
+	uint32_t slot_size;         /* Bytes per slot           */
+	uint32_t fmt;               /* enum aufmt, enum vidfmt  */
+	uint32_t srate;             /* Audio sample rate [Hz]   */
+	uint32_t ch;                /* Audio channels           */
+	uint32_t width;             /* Video frame size         */
+	uint32_t height;
+	uint8_t pad0[12];
+
+	uint64_t wpos __attribute__((aligned(64)));   /* Producer */
+	uint64_t n_drop;            /* Frames dropped, ring full */
+	uint64_t rpos __attribute__((aligned(64)));   /* Consumer */
+} __attribute__((aligned(64)));
+
+struct shm_frame {
+	uint64_t ts;                /* Timestamp [us]           */
+	uint32_t len;               /* Bytes of data            */
+	uint32_t width;             /* Video frame size         */
+	uint32_t height;
+	uint32_t pad;
+};
+
+
+struct shm_seg;
+
+int  shm_seg_alloc(struct shm_seg **segp, const char *dev,
+		   enum shm_type type, enum shm_dir dir,
+		   uint32_t n, size_t size);
+struct shm_hdr *shm_seg_hdr(const struct shm_seg *seg);
+void shm_seg_ready(struct shm_seg *seg);
+const char *shm_seg_name(const struct shm_seg *seg);
+void *shm_seg_claim(struct shm_seg *seg, struct shm_frame **fp);
+void shm_seg_commit(struct shm_seg *seg);
+const struct shm_frame *shm_seg_peek(struct shm_seg *seg);
+void shm_seg_release(struct shm_seg *seg);
+int  shm_seg_wait(struct shm_seg *seg, int timeout_ms);
+uint32_t shm_slots(void);
+
+
+int shm_play_alloc(struct auplay_st **stp, const struct auplay *ap,
+		   struct auplay_prm *prm, const char *device,
+		   auplay_write_h *wh, void *arg);
+int shm_src_alloc(struct ausrc_st **stp, const struct ausrc *as,
+		  struct media_ctx **ctx,
+		  struct ausrc_prm *prm, const char *device,
+		  ausrc_read_h *rh, ausrc_error_h *errh, void *arg);
+
+int shm_vidsrc_alloc(struct vidsrc_st **stp, const struct vidsrc *vs,
+		     struct media_ctx **ctx, struct vidsrc_prm *prm,
+		     const struct vidsz *size, const char *fmt,
+		     const char *dev, vidsrc_frame_h *frameh,
+		     vidsrc_error_h *errorh, void *arg);
+int shm_vidisp_alloc(struct vidisp_st **stp, const struct vidisp *vd,
+		     struct vidisp_prm *prm, const char *dev,
+		     vidisp_resize_h *resizeh, void *arg);
+int shm_display(struct vidisp_st *st, const char *title,
+		const struct vidframe *frame);
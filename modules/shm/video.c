@@ -0,0 +1,258 @@
+/**
+ * @file shm/video.c  Shared memory media exchange -- video
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#define _DEFAULT_SOURCE 1
+#include <pthread.h>
+#include <time.h>
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "shm.h"
+
+
+/*
+ * The frames in the ring are YUV420P with the planes packed one after
+ * the other. The display makes its segment for the size of the first
+ * frame, and later frames are converted into the slot at that size.
+ * The source passes the frames of the other process on without a copy,
+ * they may be smaller than the size that was asked for.
+ */
+
+
+enum {
+	WAIT_MS = 100,     /* Max wait for a frame, to check for stop */
+};
+
+struct vidsrc_st {
+	const struct vidsrc *vs;      /* inheritance */
+
+	struct shm_seg *seg;
+	struct vidsz size;
+	pthread_t thread;
+	volatile bool run;
+	vidsrc_frame_h *frameh;
+	void *arg;
+};
+
+struct vidisp_st {
+	const struct vidisp *vd;      /* inheritance */
+
+	struct shm_seg *seg;
+	char *dev;
+	struct vidsz size;
+	bool failed;
+};
+
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void hdr_init(struct shm_seg *seg, const struct vidsz *size)
+{
+	struct shm_hdr *hdr = shm_seg_hdr(seg);
+
+	hdr->fmt    = VID_FMT_YUV420P;
+	hdr->width  = size->w;
+	hdr->height = size->h;
+
+	shm_seg_ready(seg);
+}
+
+
+static void *src_thread(void *arg)
+{
+	struct vidsrc_st *st = arg;
+	const size_t max = vidframe_size(VID_FMT_YUV420P, &st->size);
+
+	while (st->run) {
+
+		const struct shm_frame *f;
+
+		(void)shm_seg_wait(st->seg, WAIT_MS);
+
+		while (st->run && (f = shm_seg_peek(st->seg))) {
+
+			struct vidframe vf;
+			struct vidsz sz;
+
+			sz.w = f->width  ? f->width  : st->size.w;
+			sz.h = f->height ? f->height : st->size.h;
+
+			if (vidframe_size(VID_FMT_YUV420P, &sz) <= max &&
+			    f->len >= vidframe_size(VID_FMT_YUV420P, &sz)) {
+
+				vidframe_init_buf(&vf, VID_FMT_YUV420P, &sz,
+						  (uint8_t *)(void *)(f + 1));
+
+				st->frameh(&vf, st->arg);
+			}
+
+			shm_seg_release(st->seg);
+		}
+	}
+
+	return NULL;
+}
+
+
+static void src_destructor(void *arg)
+{
+	struct vidsrc_st *st = arg;
+
+	if (st->run) {
+		st->run = false;
+		pthread_join(st->thread, NULL);
+	}
+
+	mem_deref(st->seg);
+}
+
+
+static void disp_destructor(void *arg)
+{
+	struct vidisp_st *st = arg;
+
+	mem_deref(st->seg);
+	mem_deref(st->dev);
+}
+
+
+int shm_vidsrc_alloc(struct vidsrc_st **stp, const struct vidsrc *vs,
+		     struct media_ctx **ctx, struct vidsrc_prm *prm,
+		     const struct vidsz *size, const char *fmt,
+		     const char *dev, vidsrc_frame_h *frameh,
+		     vidsrc_error_h *errorh, void *arg)
+{
+	struct vidsrc_st *st;
+	int err;
+	(void)ctx;
+	(void)prm;
+	(void)fmt;
+	(void)errorh;
+
+	if (!stp || !vs || !size || !size->w || !size->h || !frameh)
+		return EINVAL;
+
+	st = mem_zalloc(sizeof(*st), src_destructor);
+	if (!st)
+		return ENOMEM;
+
+	st->vs     = vs;
+	st->size   = *size;
+	st->frameh = frameh;
+	st->arg    = arg;
+
+	err = shm_seg_alloc(&st->seg, dev, SHM_VIDEO, SHM_FROM_PEER,
+			    shm_slots(),
+			    vidframe_size(VID_FMT_YUV420P, size));
+	if (err)
+		goto out;
+
+	hdr_init(st->seg, size);
+
+	st->run = true;
+	err = pthread_create(&st->thread, NULL, src_thread, st);
+	if (err) {
+		st->run = false;
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(st);
+	else
+		*stp = st;
+
+	return err;
+}
+
+
+int shm_vidisp_alloc(struct vidisp_st **stp, const struct vidisp *vd,
+		     struct vidisp_prm *prm, const char *dev,
+		     vidisp_resize_h *resizeh, void *arg)
+{
+	struct vidisp_st *st;
+	int err = 0;
+	(void)prm;
+	(void)resizeh;
+	(void)arg;
+
+	if (!stp || !vd)
+		return EINVAL;
+
+	st = mem_zalloc(sizeof(*st), disp_destructor);
+	if (!st)
+		return ENOMEM;
+
+	st->vd = vd;
+
+	if (str_isset(dev))
+		err = str_dup(&st->dev, dev);
+
+	if (err)
+		mem_deref(st);
+	else
+		*stp = st;
+
+	return err;
+}
+
+
+int shm_display(struct vidisp_st *st, const char *title,
+		const struct vidframe *frame)
+{
+	struct shm_frame *f;
+	struct vidframe vf;
+	void *p;
+	int err;
+	(void)title;
+
+	if (!st || !frame)
+		return EINVAL;
+
+	if (st->failed)
+		return 0;
+
+	if (!st->seg) {
+
+		st->size = frame->size;
+
+		err = shm_seg_alloc(&st->seg, st->dev, SHM_VIDEO, SHM_TO_PEER,
+				    shm_slots(),
+				    vidframe_size(VID_FMT_YUV420P,
+						  &st->size));
+		if (err) {
+			st->failed = true;
+			return err;
+		}
+
+		hdr_init(st->seg, &st->size);
+	}
+
+	p = shm_seg_claim(st->seg, &f);
+	if (!p)
+		return 0;
+
+	vidframe_init_buf(&vf, VID_FMT_YUV420P, &st->size, p);
+
+	/* copy, and convert or scale if needed */
+	vidconv(&vf, frame, NULL);
+
+	f->ts     = now_us();
+	f->len    = (uint32_t)vidframe_size(VID_FMT_YUV420P, &st->size);
+	f->width  = st->size.w;
+	f->height = st->size.h;
+
+	shm_seg_commit(st->seg);
+
+	return 0;
+}
@@ -15,13 +15,11 @@
 #include "png_vf.h"
 
 
-static char *png_filename(const struct tm *tmx, const char *name,
-			  char *buf, unsigned int length);
 static void png_save_free(png_structp png_ptr, png_byte **png_row_pointers,
 			  int png_height);
 
 
-int png_save_vidframe(const struct vidframe *vf, const char *path)
+int png_save_vidframe(const struct vidframe *vf, const char *filename)
 {
 	png_byte **png_row_pointers = NULL;
 	png_byte *row;
@@ -34,14 +32,11 @@ int png_save_vidframe(const struct vidframe *vf, const char *path)
 	unsigned int width = vf->size.w & ~1;
 	unsigned int height = vf->size.h & ~1;
 	unsigned int bytes_per_pixel = 3; /* RGB format */
-	time_t tnow;
-	struct tm *tmx;
-	char filename_buf[64];
 	struct vidframe *f2 = NULL;
 	int err = 0;
 
-	tnow = time(NULL);
-	tmx = localtime(&tnow);
+	if (!str_isset(filename))
+		return EINVAL;
 
 	if (vf->fmt != VID_FMT_RGB32) {
 
@@ -118,8 +113,7 @@ int png_save_vidframe(const struct vidframe *vf, const char *path)
 	}
 
 	/* Write the image data. */
-	fp = fopen(png_filename(tmx, path,
-				filename_buf, sizeof(filename_buf)), "wb");
+	fp = fopen(filename, "wb");
 	if (fp == NULL) {
 		err = errno;
 		goto out;
@@ -129,8 +123,6 @@ int png_save_vidframe(const struct vidframe *vf, const char *path)
 	png_set_rows(png_ptr, info_ptr, png_row_pointers);
 	png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
 
-	info("png: wrote %s\n", filename_buf);
-
  out:
 	/* Finish writing. */
 	mem_deref(f2);
@@ -139,7 +131,7 @@ int png_save_vidframe(const struct vidframe *vf, const char *path)
 	if (fp)
 		fclose(fp);
 
-	return 0;
+	return err;
 }
 
 
@@ -159,8 +151,8 @@ static void png_save_free(png_structp png_ptr, png_byte **png_row_pointers,
 }
 
 
-static char *png_filename(const struct tm *tmx, const char *name,
-			  char *buf, unsigned int length)
+char *png_filename(const struct tm *tmx, const char *name,
+		   char *buf, unsigned int length)
 {
 	/*
 	 * -2013-03-03-15-22-56.png - 24 chars
@@ -3,4 +3,6 @@
  */
 
 
-int png_save_vidframe(const struct vidframe *vf, const char *path);
+int   png_save_vidframe(const struct vidframe *vf, const char *filename);
+char *png_filename(const struct tm *tmx, const char *name,
+		   char *buf, unsigned int length);
@@ -3,7 +3,11 @@
  *
  * Copyright (C) 2010 Creytiv.com
  */
+#define _DEFAULT_SOURCE 1
+#define _BSD_SOURCE 1
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -15,18 +19,137 @@
  *
  * Take snapshot of the video stream and save it as PNG-files
  *
+ * The video thread only copies the frame, the conversion, compression
+ * and file writing are done by a worker thread. When a file has been
+ * written a module event "snapshot,saved,<file>" is sent, or
+ * "snapshot,thumbnail,<file>" for thumbnails.
+ *
+ * With a thumbnail interval, a small picture of each direction is
+ * written to thumbnail-send.png and thumbnail-recv.png at that interval,
+ * e.g. for monitoring dashboards.
  *
  * Commands:
  *
  \verbatim
  snapshot       Take video snapshot
  \endverbatim
+ *
+ * Example config:
+ \verbatim
+  snapshot_thumbnail        10     # interval [s], 0 is off
+  snapshot_thumbnail_width  160
+ \endverbatim
  */
 
 
+enum {
+	JOB_MAX     = 4,         /* Frames that can wait for the worker */
+	THUMB_WIDTH = 160,
+};
+
+/** One frame for the worker, the slots and their frames are reused */
+struct job {
+	struct le le;
+	struct vidframe *frame;
+	const char *name;
+	time_t t;
+	bool thumb;
+	char file[64];
+	int err;
+};
+
+
+static struct {
+	struct job jobv[JOB_MAX];
+	struct list freel;           /* Protected by mutex */
+	struct list queuel;          /* Protected by mutex */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool run;
+	struct mqueue *mq;
+	uint32_t thumb_interval;     /* [ms] */
+	uint32_t thumb_width;
+	uint64_t thumb_enc;          /* Next thumbnail [jiffies] */
+	uint64_t thumb_dec;
+} snap;
+
 static bool flag_enc, flag_dec;
 
 
+/* Called from the video threads, only the frame is copied here */
+static int submit(const struct vidframe *frame, const char *name, bool thumb)
+{
+	struct job *job;
+	int err = 0;
+
+	pthread_mutex_lock(&snap.mutex);
+	job = list_ledata(list_head(&snap.freel));
+	if (job)
+		list_unlink(&job->le);
+	pthread_mutex_unlock(&snap.mutex);
+
+	if (!job)
+		return EBUSY;
+
+	if (!job->frame || job->frame->fmt != frame->fmt ||
+	    !vidsz_cmp(&job->frame->size, &frame->size)) {
+
+		job->frame = mem_deref(job->frame);
+
+		err = vidframe_alloc(&job->frame, frame->fmt, &frame->size);
+		if (err)
+			goto out;
+	}
+
+	vidframe_copy(job->frame, frame);
+
+	job->name  = name;
+	job->t     = time(NULL);
+	job->thumb = thumb;
+
+ out:
+	pthread_mutex_lock(&snap.mutex);
+	if (err) {
+		list_append(&snap.freel, &job->le, job);
+	}
+	else {
+		list_append(&snap.queuel, &job->le, job);
+		pthread_cond_signal(&snap.cond);
+	}
+	pthread_mutex_unlock(&snap.mutex);
+
+	return err;
+}
+
+
+static void filter(struct vidframe *frame, bool *flag, uint64_t *thumb,
+		   const char *name, const char *thumb_name)
+{
+	int err;
+
+	if (*flag) {
+		*flag = false;
+
+		err = submit(frame, name, false);
+		if (err)
+			warning("snapshot: %s: %m\n", name, err);
+	}
+
+	if (snap.thumb_interval) {
+
+		const uint64_t now = tmr_jiffies();
+
+		if (now < *thumb)
+			return;
+
+		*thumb = now + snap.thumb_interval;
+
+		(void)submit(frame, thumb_name, true);
+	}
+}
+
+
 static int encode(struct vidfilt_enc_st *st, struct vidframe *frame)
 {
 	(void)st;
@@ -34,10 +157,8 @@ static int encode(struct vidfilt_enc_st *st, struct vidframe *frame)
 	if (!frame)
 		return 0;
 
-	if (flag_enc) {
-		flag_enc = false;
-		png_save_vidframe(frame, "snapshot-send");
-	}
+	filter(frame, &flag_enc, &snap.thumb_enc,
+	       "snapshot-send", "thumbnail-send");
 
 	return 0;
 }
@@ -50,15 +171,115 @@ static int decode(struct vidfilt_dec_st *st, struct vidframe *frame)
 	if (!frame)
 		return 0;
 
-	if (flag_dec) {
-		flag_dec = false;
-		png_save_vidframe(frame, "snapshot-recv");
-	}
+	filter(frame, &flag_dec, &snap.thumb_dec,
+	       "snapshot-recv", "thumbnail-recv");
 
 	return 0;
 }
 
 
+static void job_run(struct job *job, struct vidframe **rgbp)
+{
+	const struct vidframe *src = job->frame;
+	struct vidsz size = src->size;
+	struct vidrect rect;
+	struct tm tmx;
+
+	if (job->thumb && size.w > snap.thumb_width) {
+		size.w = snap.thumb_width & ~1u;
+		size.h = (unsigned)((uint64_t)src->size.h * size.w /
+				    src->size.w) & ~1u;
+		size.h = max(size.h, 2u);
+	}
+
+	/* the converted frame is kept for the next job */
+	if (!*rgbp || !vidsz_cmp(&(*rgbp)->size, &size)) {
+
+		*rgbp = mem_deref(*rgbp);
+
+		job->err = vidframe_alloc(rgbp, VID_FMT_RGB32, &size);
+		if (job->err)
+			return;
+	}
+
+	rect.x = 0;
+	rect.y = 0;
+	rect.w = size.w;
+	rect.h = size.h;
+
+	vidconv(*rgbp, src, &rect);
+
+	if (job->thumb) {
+		re_snprintf(job->file, sizeof(job->file), "%s.png",
+			    job->name);
+	}
+	else {
+		(void)localtime_r(&job->t, &tmx);
+		png_filename(&tmx, job->name, job->file, sizeof(job->file));
+	}
+
+	job->err = png_save_vidframe(*rgbp, job->file);
+}
+
+
+static void *worker_thread(void *arg)
+{
+	struct vidframe *rgb = NULL;
+	(void)arg;
+
+	for (;;) {
+		struct job *job;
+
+		pthread_mutex_lock(&snap.mutex);
+
+		while (snap.run && !snap.queuel.head)
+			pthread_cond_wait(&snap.cond, &snap.mutex);
+
+		job = list_ledata(list_head(&snap.queuel));
+		if (job)
+			list_unlink(&job->le);
+
+		pthread_mutex_unlock(&snap.mutex);
+
+		if (!job)
+			break;
+
+		job_run(job, &rgb);
+
+		/* the job is freed when the main thread has seen it */
+		mqueue_push(snap.mq, 0, job);
+	}
+
+	mem_deref(rgb);
+
+	return NULL;
+}
+
+
+/* Called in the main thread when a job is done */
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	struct job *job = data;
+	(void)id;
+	(void)arg;
+
+	if (job->err) {
+		warning("snapshot: %s: %m\n", job->name, job->err);
+	}
+	else {
+		if (!job->thumb)
+			info("snapshot: wrote %s\n", job->file);
+
+		module_event("snapshot", job->thumb ? "thumbnail" : "saved",
+			     NULL, NULL, "%s", job->file);
+	}
+
+	pthread_mutex_lock(&snap.mutex);
+	list_append(&snap.freel, &job->le, job);
+	pthread_mutex_unlock(&snap.mutex);
+}
+
+
 static int do_snapshot(struct re_printf *pf, void *arg)
 {
 	(void)pf;
@@ -83,6 +304,36 @@ static const struct cmd cmdv[] = {
 
 static int module_init(void)
 {
+	uint32_t interval = 0;
+	unsigned i;
+	int err;
+
+	snap.thumb_width = THUMB_WIDTH;
+
+	(void)conf_get_u32(conf_cur(), "snapshot_thumbnail", &interval);
+	(void)conf_get_u32(conf_cur(), "snapshot_thumbnail_width",
+			   &snap.thumb_width);
+
+	snap.thumb_interval = interval * 1000;
+	snap.thumb_width    = max(snap.thumb_width, 2u);
+
+	for (i = 0; i < JOB_MAX; i++)
+		list_append(&snap.freel, &snap.jobv[i].le, &snap.jobv[i]);
+
+	err = mqueue_alloc(&snap.mq, mqueue_handler, NULL);
+	if (err)
+		return err;
+
+	pthread_mutex_init(&snap.mutex, NULL);
+	pthread_cond_init(&snap.cond, NULL);
+
+	snap.run = true;
+	err = pthread_create(&snap.thread, NULL, worker_thread, NULL);
+	if (err) {
+		snap.run = false;
+		return err;
+	}
+
 	vidfilt_register(&snapshot);
 	return cmd_register(baresip_commands(), cmdv, ARRAY_SIZE(cmdv));
 }
@@ -90,8 +341,29 @@ static int module_init(void)
 
 static int module_close(void)
 {
+	unsigned i;
+
 	vidfilt_unregister(&snapshot);
 	cmd_unregister(baresip_commands(), cmdv);
+
+	if (snap.run) {
+		pthread_mutex_lock(&snap.mutex);
+		snap.run = false;
+		list_clear(&snap.queuel);
+		pthread_cond_signal(&snap.cond);
+		pthread_mutex_unlock(&snap.mutex);
+
+		pthread_join(snap.thread, NULL);
+	}
+
+	snap.mq = mem_deref(snap.mq);
+
+	list_clear(&snap.freel);
+	list_clear(&snap.queuel);
+
+	for (i = 0; i < JOB_MAX; i++)
+		snap.jobv[i].frame = mem_deref(snap.jobv[i].frame);
+
 	return 0;
 }
 
@@ -5,6 +5,7 @@
  */
 #include <sndfile.h>
 #include <time.h>
+#include <pthread.h>
 #include <re.h>
 #include <baresip.h>
 
@@ -17,21 +18,72 @@
  * Example Configuration:
  \verbatim
   snd_path 					/tmp/
+  snd_buffer				2000	# [ms]
+  snd_format				wav	# {wav,flac,opus}
+  snd_stereo				no	# Both directions in one file
  \endverbatim
+ *
+ * The audio filters only copy the samples into a lock-free ring per
+ * direction. One writer thread drains the rings of all files to disk,
+ * and syncs them once per second. If the disk falls behind by more than
+ * the buffer, the newest samples are dropped and counted.
+ *
+ * The files are compressed by libsndfile in the writer thread when the
+ * format is FLAC or Ogg/Opus. With snd_stereo, a call is written to one
+ * file with the sent audio on the left channel and the received audio
+ * on the right channel. Both directions must be mono with the same
+ * sampling rate, otherwise they are written to separate files.
+ *
+ * The Ogg/Opus format needs no seeking, so snd_path can also be a
+ * directory of named pipes or a network file system.
  */
 
 
+enum {
+	WRITE_INTERVAL = 100,   /* [ms] */
+	SYNC_INTERVAL  = 1000,  /* [ms] */
+	MAX_SKEW       = 500,   /* [ms] one direction may lag the other */
+	CHUNK          = 1024,  /* [samples] per direction */
+};
+
+enum dir {DIR_ENC = 0, DIR_DEC = 1};
+
+/* One file that is being recorded, with a ring per direction */
+struct rec {
+	struct le le;
+	SNDFILE *sf;
+	struct auring *ringv[2];
+	uint64_t n_drop[2];       /* written by the audio threads */
+	size_t skew;              /* MAX_SKEW in samples */
+	uint32_t srate;
+	bool stereo;
+	char filename[128];
+};
+
 struct sndfile_enc {
 	struct aufilt_enc_st af;  /* base class */
-	SNDFILE *enc;
+	struct rec *rec;
 };
 
 struct sndfile_dec {
 	struct aufilt_dec_st af;  /* base class */
-	SNDFILE *dec;
+	struct rec *rec;
 };
 
 static char file_path[256] = ".";
+static uint32_t buffer_ms = 2000;
+static bool stereo;
+static int sf_format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+static const char *file_ext = "wav";
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_t thread;
+	struct list recl;
+	volatile bool run;
+} writer = {
+	PTHREAD_MUTEX_INITIALIZER,
+};
 
 
 static int timestamp_print(struct re_printf *pf, const struct tm *tm)
@@ -45,12 +97,138 @@ static int timestamp_print(struct re_printf *pf, const struct tm *tm)
 }
 
 
+static void drain_mono(struct rec *rec, struct auring *ring)
+{
+	int16_t sampv[CHUNK];
+	size_t n;
+
+	if (!ring)
+		return;
+
+	while ((n = min(auring_cur_sampc(ring), ARRAY_SIZE(sampv)))) {
+
+		n = auring_read(ring, sampv, n);
+
+		(void)sf_write_short(rec->sf, sampv, n);
+	}
+}
+
+
+/*
+ * Interleave what both directions have. If one direction stops, e.g.
+ * no packets are received, the other one is written with silence once
+ * it is ahead by more than MAX_SKEW. At the end everything is written.
+ */
+static void drain_stereo(struct rec *rec, bool flush)
+{
+	int16_t l[CHUNK], r[CHUNK], sampv[2*CHUNK];
+	size_t i, n;
+
+	for (;;) {
+		size_t nl = auring_cur_sampc(rec->ringv[DIR_ENC]);
+		size_t nr = auring_cur_sampc(rec->ringv[DIR_DEC]);
+
+		n = min(nl, nr);
+
+		if (flush || nl > nr + rec->skew || nr > nl + rec->skew)
+			n = max(nl, nr);
+
+		n = min(n, (size_t)CHUNK);
+		if (!n)
+			break;
+
+		/* missing samples are read as silence */
+		(void)auring_read(rec->ringv[DIR_ENC], l, n);
+		(void)auring_read(rec->ringv[DIR_DEC], r, n);
+
+		for (i=0; i<n; i++) {
+			sampv[2*i]   = l[i];
+			sampv[2*i+1] = r[i];
+		}
+
+		(void)sf_write_short(rec->sf, sampv, 2*n);
+	}
+}
+
+
+/* Writer thread, or any thread once the rec is off the list */
+static void rec_drain(struct rec *rec, bool flush)
+{
+	if (rec->stereo) {
+		drain_stereo(rec, flush);
+	}
+	else {
+		drain_mono(rec, rec->ringv[DIR_ENC]);
+		drain_mono(rec, rec->ringv[DIR_DEC]);
+	}
+}
+
+
+static void *writer_thread(void *arg)
+{
+	uint64_t ts_sync = tmr_jiffies();
+	(void)arg;
+
+	while (writer.run) {
+
+		bool sync = tmr_jiffies() >= ts_sync + SYNC_INTERVAL;
+		struct le *le;
+
+		(void)sys_msleep(WRITE_INTERVAL);
+
+		pthread_mutex_lock(&writer.mutex);
+
+		LIST_FOREACH(&writer.recl, le) {
+			struct rec *rec = le->data;
+
+			rec_drain(rec, false);
+
+			if (sync)
+				sf_write_sync(rec->sf);
+		}
+
+		pthread_mutex_unlock(&writer.mutex);
+
+		if (sync)
+			ts_sync = tmr_jiffies();
+	}
+
+	return NULL;
+}
+
+
+static void rec_destructor(void *arg)
+{
+	struct rec *rec = arg;
+	int i;
+
+	pthread_mutex_lock(&writer.mutex);
+	list_unlink(&rec->le);
+	pthread_mutex_unlock(&writer.mutex);
+
+	if (rec->sf) {
+		rec_drain(rec, true);
+		sf_close(rec->sf);
+	}
+
+	for (i=0; i<2; i++) {
+
+		if (rec->n_drop[i]) {
+			warning("sndfile: %s: dropped %llu %s samples\n",
+				rec->filename, rec->n_drop[i],
+				i == DIR_ENC ? "encode" : "decode");
+		}
+
+		mem_deref(rec->ringv[i]);
+	}
+}
+
+
 static void enc_destructor(void *arg)
 {
 	struct sndfile_enc *st = arg;
 
-	if (st->enc)
-		sf_close(st->enc);
+	mem_deref(st->rec);
 
 	list_unlink(&st->af.le);
 }
@@ -60,41 +238,107 @@ static void dec_destructor(void *arg)
 {
 	struct sndfile_dec *st = arg;
 
-	if (st->dec)
-		sf_close(st->dec);
+	mem_deref(st->rec);
 
 	list_unlink(&st->af.le);
 }
 
 
-static SNDFILE *openfile(const struct aufilt_prm *prm, bool enc)
+static int openfile(struct rec **recp, const struct aufilt_prm *prm,
+		    enum dir dir, bool both)
 {
-	char filename[128];
 	SF_INFO sfinfo;
 	time_t tnow = time(0);
 	struct tm *tm = localtime(&tnow);
-	SNDFILE *sf;
+	struct rec *rec;
+	size_t sz;
+	int i, err = 0;
 
-	(void)re_snprintf(filename, sizeof(filename),
-			  "%s/dump-%H-%s.wav",
+	rec = mem_zalloc(sizeof(*rec), rec_destructor);
+	if (!rec)
+		return ENOMEM;
+
+	rec->stereo = both;
+	rec->srate  = prm->srate;
+	rec->skew   = prm->srate * MAX_SKEW / 1000;
+
+	(void)re_snprintf(rec->filename, sizeof(rec->filename),
+			  "%s/dump-%H-%s.%s",
 				file_path,
-			  timestamp_print, tm, enc ? "enc" : "dec");
+			  timestamp_print, tm,
+			  both ? "call" : dir == DIR_ENC ? "enc" : "dec",
+			  file_ext);
+
+	sz = prm->srate * prm->ch * max(buffer_ms, 200) / 1000;
+
+	for (i=0; i<2; i++) {
+		if (both || i == (int)dir)
+			err |= auring_alloc(&rec->ringv[i], 0, sz);
+	}
+	if (err)
+		goto out;
 
 	sfinfo.samplerate = prm->srate;
-	sfinfo.channels   = prm->ch;
-	sfinfo.format     = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+	sfinfo.channels   = both ? 2 : prm->ch;
+	sfinfo.format     = sf_format;
 
-	sf = sf_open(filename, SFM_WRITE, &sfinfo);
-	if (!sf) {
-		warning("sndfile: could not open: %s\n", filename);
+	rec->sf = sf_open(rec->filename, SFM_WRITE, &sfinfo);
+	if (!rec->sf) {
+		warning("sndfile: could not open: %s\n", rec->filename);
 		puts(sf_strerror(NULL));
-		return NULL;
+		err = ENOMEM;
+		goto out;
 	}
 
 	info("sndfile: dumping %s audio to %s\n",
-	     enc ? "encode" : "decode", filename);
+	     both ? "call" : dir == DIR_ENC ? "encode" : "decode",
+	     rec->filename);
 
-	return sf;
+	pthread_mutex_lock(&writer.mutex);
+	list_append(&writer.recl, &rec->le, rec);
+	pthread_mutex_unlock(&writer.mutex);
+
+ out:
+	if (err)
+		mem_deref(rec);
+	else
+		*recp = rec;
+
+	return err;
+}
+
+
+/* The encoder and decoder of a call share a stereo file via ctx */
+static int rec_get(struct rec **recp, void **ctx,
+		   const struct aufilt_prm *prm, enum dir dir)
+{
+	struct rec *rec = ctx ? *ctx : NULL;
+	int err;
+
+	if (rec && rec->srate == prm->srate && prm->ch == 1) {
+		*recp = mem_ref(rec);
+		return 0;
+	}
+
+	err = openfile(recp, prm, dir, stereo && ctx && !rec && prm->ch == 1);
+	if (err)
+		return err;
+
+	if (ctx && !rec && (*recp)->stereo)
+		*ctx = *recp;
+
+	return 0;
+}
+
+
+/* Audio thread, this must not block */
+static void rec_write(struct rec *rec, enum dir dir,
+		      const int16_t *sampv, size_t sampc)
+{
+	size_t n = auring_write(rec->ringv[dir], sampv, sampc);
+
+	if (n < sampc)
+		rec->n_drop[dir] += sampc - n;
 }
 
 
@@ -103,16 +347,13 @@ static int encode_update(struct aufilt_enc_st **stp, void **ctx,
 {
 	struct sndfile_enc *st;
 	int err = 0;
-	(void)ctx;
 	(void)af;
 
 	st = mem_zalloc(sizeof(*st), enc_destructor);
 	if (!st)
 		return EINVAL;
 
-	st->enc = openfile(prm, true);
-	if (!st->enc)
-		err = ENOMEM;
+	err = rec_get(&st->rec, ctx, prm, DIR_ENC);
 
 	if (err)
 		mem_deref(st);
@@ -128,16 +369,13 @@ static int decode_update(struct aufilt_dec_st **stp, void **ctx,
 {
 	struct sndfile_dec *st;
 	int err = 0;
-	(void)ctx;
 	(void)af;
 
 	st = mem_zalloc(sizeof(*st), dec_destructor);
 	if (!st)
 		return EINVAL;
 
-	st->dec = openfile(prm, false);
-	if (!st->dec)
-		err = ENOMEM;
+	err = rec_get(&st->rec, ctx, prm, DIR_DEC);
 
 	if (err)
 		mem_deref(st);
@@ -152,7 +390,7 @@ static int encode(struct aufilt_enc_st *st, int16_t *sampv, size_t *sampc)
 {
 	struct sndfile_enc *sf = (struct sndfile_enc *)st;
 
-	sf_write_short(sf->enc, sampv, *sampc);
+	rec_write(sf->rec, DIR_ENC, sampv, *sampc);
 
 	return 0;
 }
@@ -162,7 +400,7 @@ static int decode(struct aufilt_dec_st *st, int16_t *sampv, size_t *sampc)
 {
 	struct sndfile_dec *sf = (struct sndfile_dec *)st;
 
-	sf_write_short(sf->dec, sampv, *sampc);
+	rec_write(sf->rec, DIR_DEC, sampv, *sampc);
 
 	return 0;
 }
@@ -173,13 +411,54 @@ static struct aufilt sndfile = {
 };
 
 
+static int format_decode(const struct pl *pl)
+{
+	if (0 == pl_strcasecmp(pl, "wav")) {
+		sf_format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+		file_ext  = "wav";
+	}
+	else if (0 == pl_strcasecmp(pl, "flac")) {
+		sf_format = SF_FORMAT_FLAC | SF_FORMAT_PCM_16;
+		file_ext  = "flac";
+	}
+#ifdef SF_FORMAT_OPUS
+	else if (0 == pl_strcasecmp(pl, "opus")) {
+		sf_format = SF_FORMAT_OGG | SF_FORMAT_OPUS;
+		file_ext  = "opus";
+	}
+#endif
+	else {
+		return ENOTSUP;
+	}
+
+	return 0;
+}
+
+
 static int module_init(void)
 {
-	aufilt_register(&sndfile);
+	struct pl pl;
+	int err;
 
 	conf_get_str(conf_cur(), "snd_path", file_path, sizeof(file_path));
+	conf_get_u32(conf_cur(), "snd_buffer", &buffer_ms);
+	conf_get_bool(conf_cur(), "snd_stereo", &stereo);
+
+	if (0 == conf_get(conf_cur(), "snd_format", &pl) &&
+	    format_decode(&pl)) {
+		warning("sndfile: unsupported format `%r'\n", &pl);
+	}
 
-	info("sndfile: saving files in %s\n", file_path);
+	writer.run = true;
+	err = pthread_create(&writer.thread, NULL, writer_thread, NULL);
+	if (err) {
+		writer.run = false;
+		return err;
+	}
+
+	aufilt_register(&sndfile);
+
+	info("sndfile: saving %s files in %s\n", file_ext, file_path);
 
 	return 0;
 }
@@ -188,6 +467,12 @@ static int module_init(void)
 static int module_close(void)
 {
 	aufilt_unregister(&sndfile);
+
+	if (writer.run) {
+		writer.run = false;
+		pthread_join(writer.thread, NULL);
+	}
+
 	return 0;
 }
 
@@ -154,6 +154,9 @@ static int src_alloc(struct ausrc_st **stp, const struct ausrc *as,
 	if (!stp || !as || !prm)
 		return EINVAL;
 
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
 	name = (str_isset(device)) ? device : SIO_DEVANY;
 
 	if ((st = mem_zalloc(sizeof(*st), ausrc_destructor)) == NULL)
@@ -222,6 +225,9 @@ static int play_alloc(struct auplay_st **stp, const struct auplay *ap,
 	if (!stp || !ap || !prm)
 		return EINVAL;
 
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
 	name = (str_isset(device)) ? device : SIO_DEVANY;
 
 	if ((st = mem_zalloc(sizeof(*st), auplay_destructor)) == NULL)
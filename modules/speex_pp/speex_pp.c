@@ -86,6 +86,7 @@ static int encode_update(struct aufilt_enc_st **stp, void **ctx,
 
 	speex_preprocess_ctl(st->state, SPEEX_PREPROCESS_SET_VAD,
 			     &pp_conf.vad_enabled);
+	st->af.vad = pp_conf.vad_enabled != 0;
 	speex_preprocess_ctl(st->state, SPEEX_PREPROCESS_SET_DEREVERB,
 			     &pp_conf.dereverb_enabled);
 
@@ -118,8 +119,8 @@ static int encode(struct aufilt_enc_st *st, int16_t *sampv, size_t *sampc)
 	is_speech = speex_preprocess(pp->state, sampv, NULL);
 #endif
 
-	/* XXX: Handle is_speech and VAD */
-	(void)is_speech;
+	/* the audio core uses it for DTX */
+	pp->af.voice = is_speech != 0;
 
 	return 0;
 }
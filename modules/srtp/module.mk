@@ -8,4 +8,9 @@ MOD		:= srtp
 $(MOD)_SRCS	+= srtp.c sdes.c
 $(MOD)_LFLAGS	+=
 
+# the AES-GCM suites of libre are newer than the module
+ifneq ($(shell grep -s SRTP_AES_128_GCM $(LIBRE_INC)/re_srtp.h),)
+$(MOD)_CFLAGS	+= -DHAVE_SRTP_GCM
+endif
+
 include mk/mod.mk
@@ -3,6 +3,7 @@
  *
  * Copyright (C) 2010 Creytiv.com
  */
+#include <string.h>
 #include <re.h>
 #include <baresip.h>
 #include "sdes.h"
@@ -15,6 +16,11 @@
  *
  * This module implements media encryption using SRTP and SDES.
  *
+ * The AEAD_AES_128_GCM and AEAD_AES_256_GCM suites (RFC 7714) are
+ * offered before AES_CM_128_HMAC_SHA1_80, since one AES-GCM pass does
+ * both encryption and authentication. They need a libre with AES-GCM.
+ * Each offered a=crypto line has its own master key.
+ *
  * SRTP can be enabled in ~/.baresip/accounts:
  *
  \verbatim
@@ -25,15 +31,35 @@
  */
 
 
-#define SRTP_MASTER_KEY_LEN  30
+/* master key and salt of the largest suite, AEAD_AES_256_GCM */
+#define SRTP_MASTER_KEY_MAXLEN  44
+
+
+static const char aes_cm_128_hmac_sha1_32[] = "AES_CM_128_HMAC_SHA1_32";
+static const char aes_cm_128_hmac_sha1_80[] = "AES_CM_128_HMAC_SHA1_80";
+#ifdef HAVE_SRTP_GCM
+static const char aead_aes_128_gcm[]        = "AEAD_AES_128_GCM";
+static const char aead_aes_256_gcm[]        = "AEAD_AES_256_GCM";
+#endif
+
+/* crypto-suites in the order of preference, a=crypto tag is index + 1 */
+static const char *offered_suitev[] = {
+#ifdef HAVE_SRTP_GCM
+	aead_aes_128_gcm,
+	aead_aes_256_gcm,
+#endif
+	aes_cm_128_hmac_sha1_80,
+};
 
 
 struct menc_st {
 	/* one SRTP session per media line */
-	uint8_t key_tx[32];
-	uint8_t key_rx[32];
+	uint8_t key_tx[SRTP_MASTER_KEY_MAXLEN];
+	uint8_t key_rx[SRTP_MASTER_KEY_MAXLEN];
+	uint8_t keyv[ARRAY_SIZE(offered_suitev)][SRTP_MASTER_KEY_MAXLEN];
 	struct srtp *srtp_tx, *srtp_rx;
 	bool use_srtp;
+	bool offered;                /**< Offer sent, answer pending       */
 	char *crypto_suite;
 
 	void *rtpsock;
@@ -44,12 +70,6 @@ struct menc_st {
 };
 
 
-static const char aes_cm_128_hmac_sha1_32[] = "AES_CM_128_HMAC_SHA1_32";
-static const char aes_cm_128_hmac_sha1_80[] = "AES_CM_128_HMAC_SHA1_80";
-
-static const char *preferred_suite = aes_cm_128_hmac_sha1_80;
-
-
 static void destructor(void *arg)
 {
 	struct menc_st *st = arg;
@@ -72,6 +92,10 @@ static bool cryptosuite_issupported(const struct pl *suite)
 {
 	if (0 == pl_strcasecmp(suite, aes_cm_128_hmac_sha1_32)) return true;
 	if (0 == pl_strcasecmp(suite, aes_cm_128_hmac_sha1_80)) return true;
+#ifdef HAVE_SRTP_GCM
+	if (0 == pl_strcasecmp(suite, aead_aes_128_gcm))        return true;
+	if (0 == pl_strcasecmp(suite, aead_aes_256_gcm))        return true;
+#endif
 
 	return false;
 }
@@ -121,21 +145,45 @@ static enum srtp_suite resolve_suite(const char *suite)
 		return SRTP_AES_CM_128_HMAC_SHA1_32;
 	if (0 == str_casecmp(suite, aes_cm_128_hmac_sha1_80))
 		return SRTP_AES_CM_128_HMAC_SHA1_80;
+#ifdef HAVE_SRTP_GCM
+	if (0 == str_casecmp(suite, aead_aes_128_gcm))
+		return SRTP_AES_128_GCM;
+	if (0 == str_casecmp(suite, aead_aes_256_gcm))
+		return SRTP_AES_256_GCM;
+#endif
 
 	return -1;
 }
 
 
+/* Length of the master key and master salt, RFC 3711 and RFC 7714 */
+static size_t master_key_len(const char *suite)
+{
+#ifdef HAVE_SRTP_GCM
+	if (0 == str_casecmp(suite, aead_aes_128_gcm))
+		return 16 + 12;
+	if (0 == str_casecmp(suite, aead_aes_256_gcm))
+		return 32 + 12;
+#else
+	(void)suite;
+#endif
+
+	return 16 + 14;
+}
+
+
 static int start_srtp(struct menc_st *st, const char *suite_name)
 {
 	enum srtp_suite suite;
+	size_t key_len;
 	int err;
 
 	suite = resolve_suite(suite_name);
+	key_len = master_key_len(suite_name);
 
 	/* allocate and initialize the SRTP session */
 	if (!st->srtp_tx) {
-		err = srtp_alloc(&st->srtp_tx, suite, st->key_tx, 30, 0);
+		err = srtp_alloc(&st->srtp_tx, suite, st->key_tx, key_len, 0);
 		if (err) {
 			warning("srtp: srtp_alloc TX failed (%m)\n", err);
 			return err;
@@ -143,7 +191,7 @@ static int start_srtp(struct menc_st *st, const char *suite_name)
 	}
 
 	if (!st->srtp_rx) {
-		err = srtp_alloc(&st->srtp_rx, suite, st->key_rx, 30, 0);
+		err = srtp_alloc(&st->srtp_rx, suite, st->key_rx, key_len, 0);
 		if (err) {
 			warning("srtp: srtp_alloc RX failed (%m)\n", err);
 			return err;
@@ -217,25 +265,48 @@ static bool recv_handler(struct sa *src, struct mbuf *mb, void *arg)
 
 
 /* a=crypto:<tag> <crypto-suite> <key-params> [<session-params>] */
-static int sdp_enc(struct menc_st *st, struct sdp_media *m,
-		   uint32_t tag, const char *suite)
+static int sdp_enc(struct sdp_media *m, uint32_t tag, const char *suite,
+		   const uint8_t *key_tx, bool replace)
 {
 	char key[128] = "";
 	size_t olen;
 	int err;
 
 	olen = sizeof(key);
-	err = base64_encode(st->key_tx, SRTP_MASTER_KEY_LEN, key, &olen);
+	err = base64_encode(key_tx, master_key_len(suite), key, &olen);
 	if (err)
 		return err;
 
-	return sdes_encode_crypto(m, tag, suite, key, olen);
+	return sdes_encode_crypto(m, replace, tag, suite, key, olen);
+}
+
+
+static int sdp_offer(struct menc_st *st, struct sdp_media *m)
+{
+	size_t i;
+	int err = 0;
+
+	/* the running session keeps its suite and key */
+	if (st->use_srtp)
+		return sdp_enc(m, 1, st->crypto_suite, st->key_tx, true);
+
+	for (i=0; i<ARRAY_SIZE(offered_suitev); i++) {
+
+		err = sdp_enc(m, (uint32_t)i + 1, offered_suitev[i],
+			      st->keyv[i], i == 0);
+		if (err)
+			return err;
+	}
+
+	st->offered = true;
+
+	return 0;
 }
 
 
 static int start_crypto(struct menc_st *st, const struct pl *key_info)
 {
-	size_t olen;
+	size_t olen, key_len;
 	int err;
 
 	/* key-info is BASE64 encoded */
@@ -245,8 +316,10 @@ static int start_crypto(struct menc_st *st, const struct pl *key_info)
 	if (err)
 		return err;
 
-	if (SRTP_MASTER_KEY_LEN != olen) {
-		warning("srtp: srtp keylen is %u (should be 30)\n", olen);
+	key_len = master_key_len(st->crypto_suite);
+	if (key_len != olen) {
+		warning("srtp: srtp keylen is %u (should be %zu)\n",
+			olen, key_len);
 	}
 
 	err = start_srtp(st, st->crypto_suite);
@@ -275,13 +348,25 @@ static bool sdp_attr_handler(const char *name, const char *value, void *arg)
 	if (!cryptosuite_issupported(&c.suite))
 		return false;
 
+	/* the answer to our offer: send with the key of the chosen line */
+	if (st->offered) {
+
+		if (c.tag < 1 || c.tag > ARRAY_SIZE(offered_suitev) ||
+		    pl_strcasecmp(&c.suite, offered_suitev[c.tag - 1]))
+			return false;
+
+		memcpy(st->key_tx, st->keyv[c.tag - 1], sizeof(st->key_tx));
+	}
+
 	st->crypto_suite = mem_deref(st->crypto_suite);
 	pl_strdup(&st->crypto_suite, &c.suite);
 
 	if (start_crypto(st, &c.key_info))
 		return false;
 
-	sdp_enc(st, st->sdpm, c.tag, st->crypto_suite);
+	st->offered = false;
+
+	sdp_enc(st->sdpm, c.tag, st->crypto_suite, st->key_tx, true);
 
 	return true;
 }
@@ -338,11 +423,12 @@ static int alloc(struct menc_media **stp, struct menc_sess *sess,
 			goto out;
 
 		/* set our preferred crypto-suite */
-		err |= str_dup(&st->crypto_suite, preferred_suite);
+		err |= str_dup(&st->crypto_suite, offered_suitev[0]);
 		if (err)
 			goto out;
 
-		rand_bytes(st->key_tx, SRTP_MASTER_KEY_LEN);
+		rand_bytes(st->key_tx, sizeof(st->key_tx));
+		rand_bytes((uint8_t *)st->keyv, sizeof(st->keyv));
 	}
 
 	/* SDP handling */
@@ -358,7 +444,7 @@ static int alloc(struct menc_media **stp, struct menc_sess *sess,
 	}
 
 	if (!rattr)
-		err = sdp_enc(st, sdpm, 0, st->crypto_suite);
+		err = sdp_offer(st, sdpm);
 
  out:
 	if (err)
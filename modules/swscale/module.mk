@@ -6,6 +6,6 @@
 
 MOD		:= swscale
 $(MOD)_SRCS	+= swscale.c
-$(MOD)_LFLAGS	+= -lswscale
+$(MOD)_LFLAGS	+= -lswscale -lavutil
 
 include mk/mod.mk
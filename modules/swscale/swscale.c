@@ -3,10 +3,38 @@
  *
  * Copyright (C) 2010 - 2016 Creytiv.com
  */
+#include <string.h>
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
 #include <libswscale/swscale.h>
+#include <libavutil/frame.h>
+#include <libavutil/opt.h>
+
+
+/**
+ * @defgroup swscale swscale
+ *
+ * Video filter for scaling and pixel conversion, before the encoder
+ *
+ * The frame is scaled to the video size of the config. A frame that
+ * already has the wanted size and format is passed through untouched.
+ * With libswscale 6.1 or later the scaling is done in slices on
+ * several threads.
+ *
+ * Example config:
+ \verbatim
+  swscale_format    yuv420p     # yuv420p or nv12
+  swscale_method    bicubic     # point, fast_bilinear, bilinear,
+                                # bicubic or area
+  swscale_threads   0           # 0 is one per CPU
+ \endverbatim
+ */
+
+
+#if LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100)
+#define SWS_FRAME_API 1
+#endif
 
 
 struct swscale_enc {
@@ -15,10 +43,18 @@ struct swscale_enc {
 	struct SwsContext *sws;
 	struct vidframe *frame;
 	struct vidsz dst_size;
+	struct vidsz src_size;
+	enum vidfmt src_fmt;
+#ifdef SWS_FRAME_API
+	AVFrame *src;
+	AVFrame *dst;
+#endif
 };
 
 
-static enum vidfmt swscale_format = VID_FMT_YUV420P;  /* XXX: configurable */
+static enum vidfmt swscale_format = VID_FMT_YUV420P;
+static int swscale_flags = SWS_BICUBIC;
+static uint32_t swscale_threads;
 
 
 static enum AVPixelFormat vidfmt_to_avpixfmt(enum vidfmt fmt)
@@ -41,7 +77,82 @@ static void encode_destructor(void *arg)
 
 	mem_deref(st->frame);
 	sws_freeContext(st->sws);
+#ifdef SWS_FRAME_API
+	av_frame_free(&st->src);
+	av_frame_free(&st->dst);
+#endif
+}
+
+
+static struct SwsContext *context_alloc(int width, int height,
+					enum AVPixelFormat fmt,
+					const struct vidsz *dst_size,
+					enum AVPixelFormat dst_fmt)
+{
+#ifdef SWS_FRAME_API
+	struct SwsContext *sws;
+
+	sws = sws_alloc_context();
+	if (!sws)
+		return NULL;
+
+	av_opt_set_int(sws, "srcw",       width,           0);
+	av_opt_set_int(sws, "srch",       height,          0);
+	av_opt_set_int(sws, "src_format", fmt,             0);
+	av_opt_set_int(sws, "dstw",       dst_size->w,     0);
+	av_opt_set_int(sws, "dsth",       dst_size->h,     0);
+	av_opt_set_int(sws, "dst_format", dst_fmt,         0);
+	av_opt_set_int(sws, "sws_flags",  swscale_flags,   0);
+	av_opt_set_int(sws, "threads",    swscale_threads, 0);
+
+	if (sws_init_context(sws, NULL, NULL) < 0) {
+		sws_freeContext(sws);
+		return NULL;
+	}
+
+	return sws;
+#else
+	return sws_getContext(width, height, fmt,
+			      dst_size->w, dst_size->h, dst_fmt,
+			      swscale_flags, NULL, NULL, NULL);
+#endif
+}
+
+
+#ifdef SWS_FRAME_API
+static void buffer_free(void *opaque, uint8_t *data)
+{
+	(void)opaque;
+	(void)data;
+}
+
+
+/* Let an AVFrame point to the pixels of a vidframe, without a copy */
+static int avframe_wrap(AVFrame *avf, const struct vidframe *vf,
+			enum AVPixelFormat fmt)
+{
+	int i;
+
+	av_frame_unref(avf);
+
+	for (i=0; i<4; i++) {
+		avf->data[i]     = vf->data[i];
+		avf->linesize[i] = vf->linesize[i];
+	}
+
+	avf->width  = vf->size.w;
+	avf->height = vf->size.h;
+	avf->format = fmt;
+
+	/* the frame API wants reference counted frames, the buffer
+	 * is owned by the vidframe */
+	avf->buf[0] = av_buffer_create(vf->data[0],
+				       vf->linesize[0] * vf->size.h,
+				       buffer_free, NULL, 0);
+
+	return avf->buf[0] ? 0 : ENOMEM;
 }
+#endif
 
 
 static int encode_update(struct vidfilt_enc_st **stp, void **ctx,
@@ -82,10 +193,13 @@ static int encode_process(struct vidfilt_enc_st *st, struct vidframe *frame)
 {
 	struct swscale_enc *enc = (struct swscale_enc *)st;
 	enum AVPixelFormat avpixfmt, avpixfmt_dst;
+#ifndef SWS_FRAME_API
 	const uint8_t *srcSlice[4];
 	uint8_t *dst[4];
 	int srcStride[4], dstStride[4];
-	int width, height, i, h;
+	int i;
+#endif
+	int width, height, h;
 	int err = 0;
 
 	if (!st)
@@ -111,21 +225,33 @@ static int encode_process(struct vidfilt_enc_st *st, struct vidframe *frame)
 		return EINVAL;
 	}
 
+	/* nothing to do */
+	if (frame->fmt == swscale_format &&
+	    vidsz_cmp(&frame->size, &enc->dst_size))
+		return 0;
+
+	/* the input changed */
+	if (enc->sws && (frame->fmt != enc->src_fmt ||
+			 !vidsz_cmp(&frame->size, &enc->src_size))) {
+
+		sws_freeContext(enc->sws);
+		enc->sws = NULL;
+	}
+
 	if (!enc->sws) {
 
 		struct SwsContext *sws;
-		int flags = 0;
 
-		sws = sws_getContext(width, height, avpixfmt,
-				     enc->dst_size.w, enc->dst_size.h,
-				     avpixfmt_dst,
-				     flags, NULL, NULL, NULL);
+		sws = context_alloc(width, height, avpixfmt,
+				    &enc->dst_size, avpixfmt_dst);
 		if (!sws) {
 			warning("swscale: sws_getContext error\n");
 			return ENOMEM;
 		}
 
-		enc->sws = sws;
+		enc->sws      = sws;
+		enc->src_fmt  = frame->fmt;
+		enc->src_size = frame->size;
 
 		info("swscale: created SwsContext:"
 		     " `%s' %d x %d --> `%s' %u x %u\n",
@@ -144,6 +270,30 @@ static int encode_process(struct vidfilt_enc_st *st, struct vidframe *frame)
 		}
 	}
 
+#ifdef SWS_FRAME_API
+	if (!enc->src || !enc->dst) {
+		enc->src = av_frame_alloc();
+		enc->dst = av_frame_alloc();
+		if (!enc->src || !enc->dst)
+			return ENOMEM;
+	}
+
+	err  = avframe_wrap(enc->src, frame, avpixfmt);
+	err |= avframe_wrap(enc->dst, enc->frame, avpixfmt_dst);
+	if (err)
+		return ENOMEM;
+
+	/* the frame API scales the slices in parallel */
+	h = sws_scale_frame(enc->sws, enc->dst, enc->src);
+
+	av_frame_unref(enc->src);
+	av_frame_unref(enc->dst);
+
+	if (h < 0) {
+		warning("swscale: sws_scale_frame error (%d)\n", h);
+		return EPROTO;
+	}
+#else
 	for (i=0; i<4; i++) {
 		srcSlice[i]  = frame->data[i];
 		srcStride[i] = frame->linesize[i];
@@ -157,6 +307,7 @@ static int encode_process(struct vidfilt_enc_st *st, struct vidframe *frame)
 		warning("swscale: sws_scale error (%d)\n", h);
 		return EPROTO;
 	}
+#endif
 
 	/* Copy the converted frame back to the input frame */
 	for (i=0; i<4; i++) {
@@ -175,8 +326,56 @@ static struct vidfilt vf_swscale = {
 };
 
 
+static const struct {
+	const char *name;
+	int flags;
+} methodv[] = {
+	{"point",         SWS_POINT},
+	{"fast_bilinear", SWS_FAST_BILINEAR},
+	{"bilinear",      SWS_BILINEAR},
+	{"bicubic",       SWS_BICUBIC},
+	{"area",          SWS_AREA},
+};
+
+
 static int module_init(void)
 {
+	char method[32] = "", format[32] = "";
+	size_t i;
+
+	if (0 == conf_get_str(conf_cur(), "swscale_format",
+			      format, sizeof(format))) {
+
+		if (0 == str_casecmp(format, "nv12"))
+			swscale_format = VID_FMT_NV12;
+		else if (0 == str_casecmp(format, "yuv420p"))
+			swscale_format = VID_FMT_YUV420P;
+		else
+			warning("swscale: unknown format '%s'\n", format);
+	}
+
+	if (0 == conf_get_str(conf_cur(), "swscale_method",
+			      method, sizeof(method))) {
+
+		for (i=0; i<ARRAY_SIZE(methodv); i++) {
+
+			if (0 == str_casecmp(method, methodv[i].name)) {
+				swscale_flags = methodv[i].flags;
+				break;
+			}
+		}
+
+		if (i == ARRAY_SIZE(methodv))
+			warning("swscale: unknown method '%s'\n", method);
+	}
+
+	(void)conf_get_u32(conf_cur(), "swscale_threads", &swscale_threads);
+
+#ifndef SWS_FRAME_API
+	if (swscale_threads != 1)
+		info("swscale: threads need libswscale 6.1 or later\n");
+#endif
+
 	vidfilt_register(&vf_swscale);
 	return 0;
 }
@@ -12,6 +12,11 @@
  *
  * Traversal Using Relays around NAT (TURN) for media NAT traversal
  *
+ * Media to the peer is sent on a TURN channel (4 bytes of framing)
+ * instead of Send indications (36 bytes). The channel is bound to the
+ * address in the SDP of the peer, as soon as both the allocation and
+ * the address are known, and is moved when the address changes.
+ *
  * XXX: use turn RSV_TOKEN for RTP/RTCP even/odd pair ?
  */
 
@@ -35,6 +40,8 @@ struct mnat_media {
 	struct le le;
 	struct sa addr1;
 	struct sa addr2;
+	struct sa chan1;         /**< Peer of the channel on component 1 */
+	struct sa chan2;         /**< Peer of the channel on component 2 */
 	struct mnat_sess *sess;
 	struct sdp_media *sdpm;
 	struct turnc *turnc1;
@@ -72,6 +79,45 @@ static void media_destructor(void *arg)
 }
 
 
+static int chan_bind(struct turnc *turnc, struct sa *chan,
+		     const struct sa *peer)
+{
+	int err;
+
+	if (!turnc || !sa_isset(peer, SA_ALL) || sa_cmp(chan, peer, SA_ALL))
+		return 0;
+
+	err = turnc_add_chan(turnc, peer, NULL, NULL);
+	if (err == EADDRINUSE)
+		err = 0;
+	if (err)
+		return err;
+
+	debug("turn: channel bound to %J\n", peer);
+
+	*chan = *peer;
+
+	return 0;
+}
+
+
+static int media_chan_bind(struct mnat_media *m)
+{
+	struct sa raddr1, raddr2;
+	int err = 0;
+
+	raddr1 = *sdp_media_raddr(m->sdpm);
+	sdp_media_raddr_rtcp(m->sdpm, &raddr2);
+
+	if (sa_isset(&m->addr1, SA_ALL))
+		err |= chan_bind(m->turnc1, &m->chan1, &raddr1);
+	if (sa_isset(&m->addr2, SA_ALL))
+		err |= chan_bind(m->turnc2, &m->chan2, &raddr2);
+
+	return err;
+}
+
+
 static void turn_handler1(int err, uint16_t scode, const char *reason,
 			  const struct sa *relay_addr,
 			  const struct sa *mapped_addr,
@@ -88,6 +134,9 @@ static void turn_handler1(int err, uint16_t scode, const char *reason,
 
 		m->addr1 = *relay_addr;
 
+		/* the answer may have come before the allocation */
+		(void)media_chan_bind(m);
+
 		if (m->turnc2 && !sa_isset(&m->addr2, SA_ALL))
 			return;
 
@@ -115,6 +164,8 @@ static void turn_handler2(int err, uint16_t scode, const char *reason,
 
 		m->addr2 = *relay_addr;
 
+		(void)media_chan_bind(m);
+
 		if (m->turnc1 && !sa_isset(&m->addr1, SA_ALL))
 			return;
 
@@ -261,16 +312,8 @@ static int update(struct mnat_sess *sess)
 	for (le=sess->medial.head; le; le=le->next) {
 
 		struct mnat_media *m = le->data;
-		struct sa raddr1, raddr2;
-
-		raddr1 = *sdp_media_raddr(m->sdpm);
-		sdp_media_raddr_rtcp(m->sdpm, &raddr2);
-
-		if (m->turnc1 && sa_isset(&raddr1, SA_ALL))
-			err |= turnc_add_chan(m->turnc1, &raddr1, NULL, NULL);
 
-		if (m->turnc2 && sa_isset(&raddr2, SA_ALL))
-			err |= turnc_add_chan(m->turnc2, &raddr2, NULL, NULL);
+		err |= media_chan_bind(m);
 	}
 
 	return err;
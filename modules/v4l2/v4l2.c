@@ -41,6 +41,17 @@
  * @defgroup v4l2 v4l2
  *
  * V4L2 (Video for Linux 2) video-source module
+ *
+ * The captured buffers are memory mapped and passed to the video stream
+ * without a copy. A device that can deliver YUV420P is set to that
+ * format, which is the format of the encoders, so the frames are not
+ * converted either.
+ *
+ * Config options:
+ *
+ \verbatim
+  v4l2_buffers            4    # capture buffers, 2-32
+ \endverbatim
  */
 
 
@@ -64,7 +75,13 @@ struct vidsrc_st {
 };
 
 
+enum {
+	BUFFERS_MIN = 2,
+	BUFFERS_MAX = 32,
+};
+
 static struct vidsrc *vidsrc;
+static uint32_t n_buffers = 4;
 
 
 static enum vidfmt match_fmt(u_int32_t fmt)
@@ -84,6 +101,16 @@ static enum vidfmt match_fmt(u_int32_t fmt)
 }
 
 
+/* The encoders take YUV420P, any other format is converted per frame */
+static int fmt_rank(u_int32_t fmt)
+{
+	if (match_fmt(fmt) == VID_FMT_N)
+		return 0;
+
+	return fmt == V4L2_PIX_FMT_YUV420 ? 2 : 1;
+}
+
+
 static void print_video_input(struct vidsrc_st *st)
 {
 	struct v4l2_input input;
@@ -125,7 +152,7 @@ static int init_mmap(struct vidsrc_st *st, const char *dev_name)
 
 	memset(&req, 0, sizeof(req));
 
-	req.count  = 4;
+	req.count  = n_buffers;
 	req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	req.memory = V4L2_MEMORY_MMAP;
 
@@ -189,6 +216,7 @@ static int v4l2_init_device(struct vidsrc_st *st, const char *dev_name,
 	struct v4l2_fmtdesc fmts;
 	unsigned int min;
 	const char *pix;
+	int rank = 0;
 	int err;
 
 	if (-1 == xioctl(st->fd, VIDIOC_QUERYCAP, &cap)) {
@@ -219,9 +247,9 @@ static int v4l2_init_device(struct vidsrc_st *st, const char *dev_name,
 	fmts.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	for (fmts.index=0; !v4l2_ioctl(st->fd, VIDIOC_ENUM_FMT, &fmts);
 			fmts.index++) {
-		if (match_fmt(fmts.pixelformat) != VID_FMT_N) {
+		if (fmt_rank(fmts.pixelformat) > rank) {
 			st->pixfmt = fmts.pixelformat;
-			break;
+			rank = fmt_rank(fmts.pixelformat);
 		}
 	}
 
@@ -369,8 +397,10 @@ static int read_frame(struct vidsrc_st *st)
 
 	if (buf.index >= st->n_buffers) {
 		warning("v4l2: index >= n_buffers\n");
+		return EINVAL;
 	}
 
+	/* the frame handler is done with the buffer when it returns */
 	call_frame_handler(st, st->buffers[buf.index].start);
 
 	if (-1 == xioctl (st->fd, VIDIOC_QBUF, &buf)) {
@@ -491,6 +521,10 @@ static int alloc(struct vidsrc_st **stp, const struct vidsrc *vs,
 
 static int v4l_init(void)
 {
+	(void)conf_get_u32(conf_cur(), "v4l2_buffers", &n_buffers);
+
+	n_buffers = min(max(n_buffers, BUFFERS_MIN), BUFFERS_MAX);
+
 	return vidsrc_register(&vidsrc, "v4l2", alloc, NULL);
 }
 
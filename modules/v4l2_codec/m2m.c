@@ -0,0 +1,603 @@
+/**
+ * @file m2m.c  Video4Linux2 memory-to-memory H.264 encoder
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+#define _DEFAULT_SOURCE 1
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#if defined (OPENBSD) || defined (NETBSD)
+#include <sys/videoio.h>
+#else
+#include <linux/videodev2.h>
+#endif
+#include "v4l2_codec.h"
+
+
+/*
+ * The M2M encoder (e.g. /dev/video11 on the Raspberry Pi) takes raw
+ * frames on its OUTPUT queue and gives H.264 on its CAPTURE queue.
+ * Each encoder state opens the device, which gives it a context of
+ * its own, so several streams can be encoded at the same time.
+ *
+ * The frames come from any video source in system memory, they are
+ * copied into the mmap'ed buffers of the OUTPUT queue.
+ */
+
+
+enum {
+	N_OUT       = 2,
+	N_CAP       = 4,
+	CAP_SIZE    = 512 * 1024,
+	ENC_TIMEOUT = 100,        /* [ms] */
+	KEY_PERIOD  = 10,         /* [s] */
+};
+
+struct m2m_buf {
+	void *start;
+	size_t length;
+};
+
+struct videnc_state {
+	struct videnc_param encprm;
+	videnc_packet_h *pkth;
+	void *arg;
+
+	int fd;
+	struct vidsz size;
+	enum vidfmt fmt;
+	unsigned bpl;                /* OUTPUT bytes per line */
+	unsigned height;             /* OUTPUT lines of the luma plane */
+	struct m2m_buf outv[N_OUT];
+	struct m2m_buf capv[N_CAP];
+	bool out_busy[N_OUT];
+	unsigned n_out;
+	unsigned n_cap;
+};
+
+
+static char m2m_device[64] = "/dev/video11";
+
+
+static int xioctl(int fd, unsigned long int request, void *arg)
+{
+	int r;
+
+	do r = ioctl (fd, request, arg);
+	while (-1 == r && EINTR == errno);
+
+	return r;
+}
+
+
+static uint32_t pixfmt(enum vidfmt fmt)
+{
+	switch (fmt) {
+
+	case VID_FMT_YUV420P: return V4L2_PIX_FMT_YUV420;
+	case VID_FMT_NV12:    return V4L2_PIX_FMT_NV12;
+	default:              return 0;
+	}
+}
+
+
+static int set_ctrl(int fd, uint32_t id, int32_t value, const char *name)
+{
+	struct v4l2_control ctrl;
+	int err;
+
+	memset(&ctrl, 0, sizeof(ctrl));
+	ctrl.id    = id;
+	ctrl.value = value;
+
+	if (-1 == xioctl(fd, VIDIOC_S_CTRL, &ctrl)) {
+		err = errno;
+		warning("v4l2_codec: m2m: set %s (%m)\n", name, err);
+		return err;
+	}
+
+	return 0;
+}
+
+
+static int set_format(struct videnc_state *st, enum v4l2_buf_type type,
+		      uint32_t fourcc, uint32_t sizeimage)
+{
+	struct v4l2_format fmt;
+	int err;
+
+	memset(&fmt, 0, sizeof(fmt));
+
+	fmt.type = type;
+	fmt.fmt.pix_mp.width       = st->size.w;
+	fmt.fmt.pix_mp.height      = st->size.h;
+	fmt.fmt.pix_mp.pixelformat = fourcc;
+	fmt.fmt.pix_mp.field       = V4L2_FIELD_NONE;
+	fmt.fmt.pix_mp.num_planes  = 1;
+	fmt.fmt.pix_mp.plane_fmt[0].sizeimage = sizeimage;
+
+	if (-1 == xioctl(st->fd, VIDIOC_S_FMT, &fmt)) {
+		err = errno;
+		warning("v4l2_codec: m2m: set format (%m)\n", err);
+		return err;
+	}
+
+	if (type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+
+		/* the driver may align the stride and the height */
+		st->bpl    = fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
+		st->height = fmt.fmt.pix_mp.height;
+
+		if (st->bpl < st->size.w || st->height < st->size.h)
+			return EPROTO;
+	}
+
+	return 0;
+}
+
+
+static int alloc_buffers(int fd, enum v4l2_buf_type type,
+			 struct m2m_buf *bufv, unsigned count,
+			 unsigned *countp)
+{
+	struct v4l2_requestbuffers req;
+	unsigned i;
+	int err;
+
+	memset(&req, 0, sizeof(req));
+
+	req.count  = count;
+	req.type   = type;
+	req.memory = V4L2_MEMORY_MMAP;
+
+	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
+		err = errno;
+		warning("v4l2_codec: m2m: requesting buffers (%m)\n", err);
+		return err;
+	}
+
+	*countp = min(req.count, count);
+
+	for (i=0; i<*countp; i++) {
+
+		struct v4l2_plane planes[1];
+		struct v4l2_buffer buf;
+
+		memset(&buf, 0, sizeof(buf));
+		memset(planes, 0, sizeof(planes));
+
+		buf.type     = type;
+		buf.memory   = V4L2_MEMORY_MMAP;
+		buf.index    = i;
+		buf.m.planes = planes;
+		buf.length   = 1;
+
+		if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf)) {
+			err = errno;
+			warning("v4l2_codec: m2m: querying buffer (%m)\n",
+				err);
+			return err;
+		}
+
+		bufv[i].start = mmap(NULL, planes[0].length,
+				     PROT_READ | PROT_WRITE, MAP_SHARED,
+				     fd, planes[0].m.mem_offset);
+		if (bufv[i].start == MAP_FAILED) {
+			bufv[i].start = NULL;
+			err = errno;
+			warning("v4l2_codec: m2m: mmap failed (%m)\n", err);
+			return err;
+		}
+
+		bufv[i].length = planes[0].length;
+	}
+
+	return 0;
+}
+
+
+static int queue_buffer(int fd, enum v4l2_buf_type type, unsigned index,
+			size_t bytesused)
+{
+	struct v4l2_plane planes[1];
+	struct v4l2_buffer buf;
+
+	memset(&buf, 0, sizeof(buf));
+	memset(planes, 0, sizeof(planes));
+
+	planes[0].bytesused = (uint32_t)bytesused;
+
+	buf.type     = type;
+	buf.memory   = V4L2_MEMORY_MMAP;
+	buf.index    = index;
+	buf.m.planes = planes;
+	buf.length   = 1;
+
+	if (type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+		(void)gettimeofday(&buf.timestamp, NULL);
+
+	if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+		return errno;
+
+	return 0;
+}
+
+
+/* Non-blocking, returns EAGAIN if no buffer is ready */
+static int dequeue_buffer(int fd, enum v4l2_buf_type type,
+			  unsigned *index, size_t *bytesused)
+{
+	struct v4l2_plane planes[1];
+	struct v4l2_buffer buf;
+
+	memset(&buf, 0, sizeof(buf));
+	memset(planes, 0, sizeof(planes));
+
+	buf.type     = type;
+	buf.memory   = V4L2_MEMORY_MMAP;
+	buf.m.planes = planes;
+	buf.length   = 1;
+
+	if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf))
+		return errno;
+
+	*index = buf.index;
+	if (bytesused)
+		*bytesused = planes[0].bytesused;
+
+	return 0;
+}
+
+
+static void device_close(struct videnc_state *st)
+{
+	enum v4l2_buf_type type;
+	unsigned i;
+
+	if (st->fd < 0)
+		return;
+
+	type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	(void)xioctl(st->fd, VIDIOC_STREAMOFF, &type);
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	(void)xioctl(st->fd, VIDIOC_STREAMOFF, &type);
+
+	for (i=0; i<N_OUT; i++) {
+		if (st->outv[i].start)
+			munmap(st->outv[i].start, st->outv[i].length);
+	}
+	for (i=0; i<N_CAP; i++) {
+		if (st->capv[i].start)
+			munmap(st->capv[i].start, st->capv[i].length);
+	}
+
+	memset(st->outv, 0, sizeof(st->outv));
+	memset(st->capv, 0, sizeof(st->capv));
+	memset(st->out_busy, 0, sizeof(st->out_busy));
+
+	close(st->fd);
+	st->fd = -1;
+}
+
+
+static int device_open(struct videnc_state *st, enum vidfmt fmt,
+		       const struct vidsz *size)
+{
+	struct v4l2_capability caps;
+	struct v4l2_streamparm parm;
+	enum v4l2_buf_type type;
+	unsigned i;
+	int err;
+
+	st->fd = open(m2m_device, O_RDWR | O_NONBLOCK);
+	if (st->fd == -1) {
+		err = errno;
+		warning("v4l2_codec: m2m: open %s (%m)\n", m2m_device, err);
+		return err;
+	}
+
+	memset(&caps, 0, sizeof(caps));
+	if (-1 == xioctl(st->fd, VIDIOC_QUERYCAP, &caps)) {
+		err = errno;
+		goto out;
+	}
+
+	if (!(caps.capabilities & V4L2_CAP_VIDEO_M2M_MPLANE)) {
+		warning("v4l2_codec: m2m: %s is not a M2M device\n",
+			m2m_device);
+		err = ENODEV;
+		goto out;
+	}
+
+	st->size = *size;
+	st->fmt  = fmt;
+
+	err  = set_format(st, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+			  pixfmt(fmt), 0);
+	err |= set_format(st, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+			  V4L2_PIX_FMT_H264, CAP_SIZE);
+	if (err) {
+		err = EPROTO;
+		goto out;
+	}
+
+	memset(&parm, 0, sizeof(parm));
+	parm.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	parm.parm.output.timeperframe.numerator   = 1;
+	parm.parm.output.timeperframe.denominator = st->encprm.fps;
+	(void)xioctl(st->fd, VIDIOC_S_PARM, &parm);
+
+	/* the controls are optional */
+	(void)set_ctrl(st->fd, V4L2_CID_MPEG_VIDEO_BITRATE,
+		       st->encprm.bitrate, "bitrate");
+	(void)set_ctrl(st->fd, V4L2_CID_MPEG_VIDEO_H264_PROFILE,
+		       V4L2_MPEG_VIDEO_H264_PROFILE_CONSTRAINED_BASELINE,
+		       "profile");
+	(void)set_ctrl(st->fd, V4L2_CID_MPEG_VIDEO_H264_I_PERIOD,
+		       st->encprm.fps * KEY_PERIOD, "i-period");
+	(void)set_ctrl(st->fd, V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER,
+		       1, "repeat-seq-header");
+
+	err = alloc_buffers(st->fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+			    st->outv, N_OUT, &st->n_out);
+	if (err)
+		goto out;
+
+	err = alloc_buffers(st->fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+			    st->capv, N_CAP, &st->n_cap);
+	if (err)
+		goto out;
+
+	for (i=0; i<st->n_cap; i++) {
+		err = queue_buffer(st->fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+				   i, 0);
+		if (err)
+			goto out;
+	}
+
+	type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	if (-1 == xioctl(st->fd, VIDIOC_STREAMON, &type)) {
+		err = errno;
+		goto out;
+	}
+
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	if (-1 == xioctl(st->fd, VIDIOC_STREAMON, &type)) {
+		err = errno;
+		goto out;
+	}
+
+	info("v4l2_codec: m2m: %s: %s %u x %u, %u bit/s\n",
+	     m2m_device, vidfmt_name(fmt), size->w, size->h,
+	     st->encprm.bitrate);
+
+ out:
+	if (err) {
+		warning("v4l2_codec: m2m: could not open encoder (%m)\n",
+			err);
+		device_close(st);
+	}
+
+	return err;
+}
+
+
+/* Copy the frame into an OUTPUT buffer, with the stride of the driver */
+static size_t frame_copy(const struct videnc_state *st, uint8_t *dst,
+			 const struct vidframe *frame)
+{
+	const unsigned w = frame->size.w, h = frame->size.h;
+	uint8_t *u = dst + st->bpl * st->height;
+	unsigned y;
+
+	for (y=0; y<h; y++) {
+		memcpy(dst + y * st->bpl,
+		       frame->data[0] + y * frame->linesize[0], w);
+	}
+
+	if (frame->fmt == VID_FMT_NV12) {
+
+		for (y=0; y<h/2; y++) {
+			memcpy(u + y * st->bpl,
+			       frame->data[1] + y * frame->linesize[1], w);
+		}
+	}
+	else {
+		uint8_t *v = u + st->bpl/2 * st->height/2;
+
+		for (y=0; y<h/2; y++) {
+			memcpy(u + y * st->bpl/2,
+			       frame->data[1] + y * frame->linesize[1], w/2);
+			memcpy(v + y * st->bpl/2,
+			       frame->data[2] + y * frame->linesize[2], w/2);
+		}
+	}
+
+	return st->bpl * st->height * 3 / 2;
+}
+
+
+/* Packetize all the encoded frames that are ready */
+static int capture_drain(struct videnc_state *st)
+{
+	unsigned index;
+	size_t len;
+	int err;
+
+	for (;;) {
+		err = dequeue_buffer(st->fd,
+				     V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+				     &index, &len);
+		if (err == EAGAIN)
+			return 0;
+		else if (err)
+			return err;
+
+		if (index >= st->n_cap)
+			return EPROTO;
+
+		err = h264_packetize(st->capv[index].start,
+				     min(len, st->capv[index].length),
+				     st->encprm.pktsize, st->pkth, st->arg);
+		if (err)
+			warning("h264_packetize error (%m)\n", err);
+
+		err = queue_buffer(st->fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+				   index, 0);
+		if (err)
+			return err;
+	}
+}
+
+
+static void enc_destructor(void *arg)
+{
+	struct videnc_state *st = arg;
+
+	device_close(st);
+}
+
+
+/**
+ * Set the M2M encoder device
+ *
+ * @param device Device name, e.g. /dev/video11
+ */
+void v4l2_m2m_device(const char *device)
+{
+	if (str_isset(device))
+		str_ncpy(m2m_device, device, sizeof(m2m_device));
+}
+
+
+int v4l2_m2m_encode_update(struct videnc_state **vesp,
+			   const struct vidcodec *vc,
+			   struct videnc_param *prm, const char *fmtp,
+			   videnc_packet_h *pkth, void *arg)
+{
+	struct videnc_state *st;
+	(void)fmtp;
+
+	if (!vesp || !vc || !prm || !pkth)
+		return EINVAL;
+
+	if (*vesp)
+		return v4l2_m2m_encode_reconfig(*vesp, prm);
+
+	st = mem_zalloc(sizeof(*st), enc_destructor);
+	if (!st)
+		return ENOMEM;
+
+	st->encprm = *prm;
+	st->pkth   = pkth;
+	st->arg    = arg;
+	st->fd     = -1;
+
+	info("v4l2_codec: m2m encoder %s: %d fps, %d bit/s, pktsize=%u\n",
+	     vc->name, prm->fps, prm->bitrate, prm->pktsize);
+
+	*vesp = st;
+
+	return 0;
+}
+
+
+/*
+ * The bitrate is changed in the running encoder. The frame-rate is
+ * only a hint for the rate control of the M2M encoder.
+ */
+int v4l2_m2m_encode_reconfig(struct videnc_state *st,
+			     const struct videnc_param *prm)
+{
+	if (!st || !prm)
+		return EINVAL;
+
+	if (st->fd >= 0 && prm->bitrate != st->encprm.bitrate) {
+		(void)set_ctrl(st->fd, V4L2_CID_MPEG_VIDEO_BITRATE,
+			       prm->bitrate, "bitrate");
+	}
+
+	st->encprm.bitrate = prm->bitrate;
+	st->encprm.fps     = prm->fps;
+
+	return 0;
+}
+
+
+int v4l2_m2m_encode(struct videnc_state *st, bool update,
+		    const struct vidframe *frame)
+{
+	struct pollfd pfd;
+	unsigned index, i;
+	size_t len;
+	int err;
+
+	if (!st || !frame)
+		return EINVAL;
+
+	if (!pixfmt(frame->fmt)) {
+		warning("v4l2_codec: m2m: pixel format not supported (%s)\n",
+			vidfmt_name(frame->fmt));
+		return ENOTSUP;
+	}
+
+	if (st->fd < 0 || frame->fmt != st->fmt ||
+	    !vidsz_cmp(&frame->size, &st->size)) {
+
+		device_close(st);
+
+		err = device_open(st, frame->fmt, &frame->size);
+		if (err)
+			return err;
+	}
+	else if (update) {
+		(void)set_ctrl(st->fd, V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME,
+			       1, "force-key-frame");
+	}
+
+	/* get back the OUTPUT buffers that the encoder has read */
+	while (0 == dequeue_buffer(st->fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+				   &index, NULL)) {
+		if (index < st->n_out)
+			st->out_busy[index] = false;
+	}
+
+	for (i=0; i<st->n_out; i++) {
+		if (!st->out_busy[i])
+			break;
+	}
+	if (i == st->n_out) {
+		debug("v4l2_codec: m2m: encoder busy, frame dropped\n");
+		return capture_drain(st);
+	}
+
+	len = frame_copy(st, st->outv[i].start, frame);
+	if (len > st->outv[i].length)
+		return EPROTO;
+
+	err = queue_buffer(st->fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, i, len);
+	if (err) {
+		warning("v4l2_codec: m2m: queue frame (%m)\n", err);
+		return err;
+	}
+
+	st->out_busy[i] = true;
+
+	/* wait for the encoded frame, like a software encoder */
+	pfd.fd      = st->fd;
+	pfd.events  = POLLIN;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, ENC_TIMEOUT) < 0)
+		return errno;
+
+	return capture_drain(st);
+}
@@ -6,6 +6,7 @@
 
 MOD		:= v4l2_codec
 $(MOD)_SRCS	+= v4l2_codec.c
+$(MOD)_SRCS	+= m2m.c
 $(MOD)_LFLAGS	+=
 
 include mk/mod.mk
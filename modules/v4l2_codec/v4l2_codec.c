@@ -20,6 +20,7 @@
 #else
 #include <linux/videodev2.h>
 #endif
+#include "v4l2_codec.h"
 
 
 /**
@@ -31,6 +32,14 @@
  * for devices that supports compressed formats such as H.264.
  * The module implements both the vidsrc API and the vidcodec API.
  *
+ * With a memory-to-memory encoder device in the config, the H.264
+ * encoder is fed from any video source instead, with one encoder
+ * context per stream:
+ *
+ \verbatim
+  v4l2_codec_m2m    /dev/video11
+ \endverbatim
+ *
  *
  * TODO:
  *
@@ -560,6 +569,23 @@ static struct vidcodec h264 = {
 
 static int module_init(void)
 {
+	char device[64] = "";
+
+	if (0 == conf_get_str(conf_cur(), "v4l2_codec_m2m",
+			      device, sizeof(device))) {
+
+		v4l2_m2m_device(device);
+
+		h264.encupdh = v4l2_m2m_encode_update;
+		h264.ench    = v4l2_m2m_encode;
+		h264.reconfh = v4l2_m2m_encode_reconfig;
+
+		info("v4l2_codec inited (m2m encoder %s)\n", device);
+
+		vidcodec_register(&h264);
+		return 0;
+	}
+
 	info("v4l2_codec inited\n");
 
 	vidcodec_register(&h264);
@@ -0,0 +1,17 @@
+/**
+ * @file v4l2_codec.h  Video4Linux2 video-codec -- internal API
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+
+/* M2M encoder */
+void v4l2_m2m_device(const char *device);
+int  v4l2_m2m_encode_update(struct videnc_state **vesp,
+			    const struct vidcodec *vc,
+			    struct videnc_param *prm, const char *fmtp,
+			    videnc_packet_h *pkth, void *arg);
+int  v4l2_m2m_encode_reconfig(struct videnc_state *st,
+			      const struct videnc_param *prm);
+int  v4l2_m2m_encode(struct videnc_state *st, bool update,
+		     const struct vidframe *frame);
@@ -13,10 +13,15 @@ static void destructor(void *arg)
 {
 	struct vidisp_st *st = arg;
 
+	lock_write_get(ht_lock);
+
 	if (st->vidsrc)
 		st->vidsrc->vidisp = NULL;
 
 	list_unlink(&st->le);
+
+	lock_rel(ht_lock);
+
 	mem_deref(st->device);
 }
 
@@ -44,6 +49,8 @@ int vidbridge_disp_alloc(struct vidisp_st **stp, const struct vidisp *vd,
 	if (err)
 		goto out;
 
+	lock_write_get(ht_lock);
+
 	/* find the vidsrc with the same device-name */
 	st->vidsrc = vidbridge_src_find(dev);
 	if (st->vidsrc) {
@@ -52,6 +59,8 @@ int vidbridge_disp_alloc(struct vidisp_st **stp, const struct vidisp *vd,
 
 	hash_append(ht_disp, hash_joaat_str(dev), &st->le, st);
 
+	lock_rel(ht_lock);
+
  out:
 	if (err)
 		mem_deref(st);
@@ -13,10 +13,15 @@ static void destructor(void *arg)
 {
 	struct vidsrc_st *st = arg;
 
+	lock_write_get(ht_lock);
+
 	if (st->vidisp)
 		st->vidisp->vidsrc = NULL;
 
 	list_unlink(&st->le);
+
+	lock_rel(ht_lock);
+
 	mem_deref(st->device);
 }
 
@@ -49,6 +54,8 @@ int vidbridge_src_alloc(struct vidsrc_st **stp, const struct vidsrc *vs,
 	if (err)
 		goto out;
 
+	lock_write_get(ht_lock);
+
 	/* find a vidisp device with same name */
 	st->vidisp = vidbridge_disp_find(dev);
 	if (st->vidisp) {
@@ -57,6 +64,8 @@ int vidbridge_src_alloc(struct vidsrc_st **stp, const struct vidsrc *vs,
 
 	hash_append(ht_src, hash_joaat_str(dev), &st->le, st);
 
+	lock_rel(ht_lock);
+
  out:
 	if (err)
 		mem_deref(st);
@@ -32,6 +32,7 @@ static struct vidsrc *vidsrc;
 
 struct hash *ht_src;
 struct hash *ht_disp;
+struct lock *ht_lock;      /* the calls of all event loops use the tables */
 
 
 static int module_init(void)
@@ -40,6 +41,7 @@ static int module_init(void)
 
 	err  = hash_alloc(&ht_src, 32);
 	err |= hash_alloc(&ht_disp, 32);
+	err |= lock_alloc(&ht_lock);
 	if (err)
 		return err;
 
@@ -63,6 +65,7 @@ static int module_close(void)
 
 	ht_src  = mem_deref(ht_src);
 	ht_disp = mem_deref(ht_disp);
+	ht_lock = mem_deref(ht_lock);
 
 	return 0;
 }
@@ -27,6 +27,7 @@ struct vidisp_st {
 
 extern struct hash *ht_src;
 extern struct hash *ht_disp;
+extern struct lock *ht_lock;
 
 
 int vidbridge_disp_alloc(struct vidisp_st **stp, const struct vidisp *vd,
@@ -34,7 +35,7 @@ int vidbridge_disp_alloc(struct vidisp_st **stp, const struct vidisp *vd,
 			 vidisp_resize_h *resizeh, void *arg);
 int vidbridge_disp_display(struct vidisp_st *st, const char *title,
 			   const struct vidframe *frame);
-struct vidisp_st *vidbridge_disp_find(const char *device);
+struct vidisp_st *vidbridge_disp_find(const char *device);  /* ht_lock held */
 
 
 int vidbridge_src_alloc(struct vidsrc_st **stp, const struct vidsrc *vs,
@@ -42,6 +43,6 @@ int vidbridge_src_alloc(struct vidsrc_st **stp, const struct vidsrc *vs,
 			const struct vidsz *size, const char *fmt,
 			const char *dev, vidsrc_frame_h *frameh,
 			vidsrc_error_h *errorh, void *arg);
-struct vidsrc_st *vidbridge_src_find(const char *device);
+struct vidsrc_st *vidbridge_src_find(const char *device);   /* ht_lock held */
 void vidbridge_src_input(const struct vidsrc_st *st,
 			 const struct vidframe *frame);
@@ -58,6 +58,7 @@ static void destructor(void *arg)
 	tmr_cancel(&panel->tmr);
 	mem_deref(panel->label);
 	mem_deref(panel->rrdv);
+	mem_deref(panel->pool);
 
 	if (panel->cr)
 		cairo_destroy(panel->cr);
@@ -83,6 +84,10 @@ int panel_alloc(struct panel **panelp, const char *label,
 	if (err)
 		goto out;
 
+	err = vidpool_alloc(&panel->pool, 0);
+	if (err)
+		goto out;
+
 	panel->size.w = width;
 	panel->size.h = height;
 	panel->yoffs = yoffs;
@@ -185,7 +190,7 @@ static int draw_text(struct panel *panel, struct vidframe *frame)
 	vidframe_init_buf(&f, VID_FMT_ARGB, &panel->size_text,
 			  cairo_image_surface_get_data(panel->surface));
 
-	err = vidframe_alloc(&f2, frame->fmt, &panel->size_text);
+	err = vidpool_get(panel->pool, &f2, frame->fmt, &panel->size_text);
 	if (err)
 		goto out;
 
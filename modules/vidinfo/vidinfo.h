@@ -30,6 +30,7 @@ struct panel {
 	struct tmr tmr;
 
 	uint64_t pts_prev;
+	struct vidpool *pool;
 
 	/* cairo backend: */
 	cairo_surface_t *surface;
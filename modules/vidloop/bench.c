@@ -0,0 +1,638 @@
+/**
+ * @file vidloop/bench.c  Video codec benchmark
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#define _DEFAULT_SOURCE 1
+#define _BSD_SOURCE 1
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "vidloop.h"
+
+
+/*
+ * Each combination of codec, size and bitrate encodes the same frames
+ * of a synthetic source with a fixed seed, and decodes them again. No
+ * video source or display is used, and the frames are processed as
+ * fast as possible, so a run can be compared with an earlier one.
+ *
+ * The decoded frames are matched with the source frames in order, the
+ * PSNR is over all planes and the SSIM is over the luma plane in 8x8
+ * blocks. The latency of a frame is from the start of its encoding to
+ * the end of its decoding.
+ *
+ * Example config:
+ \verbatim
+  vidloop_bench_frames    300
+  vidloop_bench_sizes     352x288,640x480,1280x720
+  vidloop_bench_bitrates  256000,1024000
+  vidloop_bench_output    /tmp/vidloop.json   # one JSON object per line
+ \endverbatim
+ */
+
+
+enum {
+	FPS      = 30,
+	PKTSIZE  = 1480,
+	FIFO_MAX = 32,          /* Frames in the codecs at most  */
+	SEED     = 1,
+};
+
+/** One frame that is being encoded and decoded */
+struct pending {
+	struct le le;
+	struct vidframe *frame;   /* Copy of the source frame */
+	uint64_t ts;              /* Start of encoding [ns]   */
+};
+
+/** Latency samples in [us] */
+struct samples {
+	uint32_t *v;
+	size_t n;
+	size_t max;
+};
+
+/** One benchmark run */
+struct run {
+	const struct vidcodec *vc;
+	struct viddec_state *dec;
+	struct vidframe *conv;    /* Decoded frame in YUV420P */
+	struct list fifo;
+	struct samples lat;
+	struct vidsz size;
+	uint32_t bitrate;
+	uint16_t seq;
+	uint32_t frames_in;
+	uint32_t frames_out;
+	uint32_t n_intra;
+	uint32_t n_nomatch;       /* Decoded without a source frame */
+	uint64_t bytes;
+	uint64_t dec_ns;          /* Total time in the decoder */
+	double sse;               /* Squared error, all planes */
+	uint64_t pixels;          /* Samples in sse            */
+	double ssim;              /* Sum over all frames       */
+	uint32_t ssim_n;
+	int err;
+};
+
+
+static uint64_t now_ns(void)
+{
+#ifdef LINUX
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return tmr_jiffies() * 1000000;
+#endif
+}
+
+
+static void samples_add(struct samples *s, uint32_t val)
+{
+	if (s->n >= s->max) {
+
+		size_t max = s->max ? s->max * 2 : 256;
+		uint32_t *v;
+
+		v = mem_realloc(s->v, max * sizeof(*v));
+		if (!v)
+			return;
+
+		s->v   = v;
+		s->max = max;
+	}
+
+	s->v[s->n++] = val;
+}
+
+
+static int samples_cmp(const void *a, const void *b)
+{
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+/* Nearest rank, the samples must be sorted */
+static uint32_t percentile(const struct samples *s, unsigned p)
+{
+	size_t rank;
+
+	if (!s->n)
+		return 0;
+
+	rank = (s->n * p + 99) / 100;
+
+	return s->v[rank ? rank - 1 : 0];
+}
+
+
+static void pending_destructor(void *arg)
+{
+	struct pending *p = arg;
+
+	list_unlink(&p->le);
+	mem_deref(p->frame);
+}
+
+
+/* A moving pattern with noise, the same for the same seed */
+static void synth_frame(struct vidframe *f, unsigned n, uint32_t *seed)
+{
+	const unsigned w = f->size.w, h = f->size.h;
+	const unsigned bx = (n * 4) % w, by = (n * 2) % h;
+	unsigned x, y;
+
+	for (y=0; y<h; y++) {
+
+		uint8_t *p = f->data[0] + y * f->linesize[0];
+
+		for (x=0; x<w; x++) {
+
+			unsigned v = ((x + 2*n) ^ (y + n)) & 0xff;
+
+			if (x - bx < w / 8 && y - by < h / 8)
+				v = 235;
+
+			*seed = *seed * 1103515245 + 12345;
+			v += (*seed >> 16) & 0xf;
+
+			p[x] = (uint8_t)min(v, 255u);
+		}
+	}
+
+	for (y=0; y<h/2; y++) {
+
+		uint8_t *u = f->data[1] + y * f->linesize[1];
+		uint8_t *v = f->data[2] + y * f->linesize[2];
+
+		for (x=0; x<w/2; x++) {
+			u[x] = (uint8_t)(x + n);
+			v[x] = (uint8_t)(y - n);
+		}
+	}
+}
+
+
+static double plane_sse(const uint8_t *a, unsigned la,
+			const uint8_t *b, unsigned lb,
+			unsigned w, unsigned h)
+{
+	double sse = 0;
+	unsigned x, y;
+
+	for (y=0; y<h; y++) {
+		for (x=0; x<w; x++) {
+			const int d = a[y*la + x] - b[y*lb + x];
+
+			sse += d * d;
+		}
+	}
+
+	return sse;
+}
+
+
+/* Mean SSIM of the luma plane in 8x8 blocks */
+static double ssim_luma(const struct vidframe *a, const struct vidframe *b)
+{
+	const double c1 = 6.5025, c2 = 58.5225;
+	const unsigned w = a->size.w & ~7u, h = a->size.h & ~7u;
+	double sum = 0;
+	unsigned x, y, n = 0;
+
+	for (y=0; y<h; y+=8) {
+		for (x=0; x<w; x+=8) {
+
+			double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+			double ma, mb, va, vb, cov;
+			unsigned i, j;
+
+			for (j=0; j<8; j++) {
+
+				const uint8_t *pa, *pb;
+
+				pa = a->data[0] + (y+j) * a->linesize[0] + x;
+				pb = b->data[0] + (y+j) * b->linesize[0] + x;
+
+				for (i=0; i<8; i++) {
+					sa  += pa[i];
+					sb  += pb[i];
+					saa += pa[i] * pa[i];
+					sbb += pb[i] * pb[i];
+					sab += pa[i] * pb[i];
+				}
+			}
+
+			ma  = sa / 64;
+			mb  = sb / 64;
+			va  = saa / 64 - ma * ma;
+			vb  = sbb / 64 - mb * mb;
+			cov = sab / 64 - ma * mb;
+
+			sum += (2 * ma * mb + c1) * (2 * cov + c2) /
+				((ma * ma + mb * mb + c1) * (va + vb + c2));
+			++n;
+		}
+	}
+
+	return n ? sum / n : 1.0;
+}
+
+
+static void compare(struct run *r, const struct vidframe *src,
+		    const struct vidframe *dec)
+{
+	const unsigned w = src->size.w, h = src->size.h;
+
+	r->sse += plane_sse(src->data[0], src->linesize[0],
+			    dec->data[0], dec->linesize[0], w, h);
+	r->sse += plane_sse(src->data[1], src->linesize[1],
+			    dec->data[1], dec->linesize[1], w/2, h/2);
+	r->sse += plane_sse(src->data[2], src->linesize[2],
+			    dec->data[2], dec->linesize[2], w/2, h/2);
+	r->pixels += w * h + 2 * (w/2) * (h/2);
+
+	r->ssim += ssim_luma(src, dec);
+	++r->ssim_n;
+}
+
+
+static void decoded(struct run *r, struct vidframe *frame)
+{
+	struct pending *p = list_ledata(list_head(&r->fifo));
+	const uint64_t now = now_ns();
+
+	if (!p) {
+		++r->n_nomatch;
+		return;
+	}
+
+	++r->frames_out;
+	samples_add(&r->lat, (uint32_t)((now - p->ts) / 1000));
+
+	if (frame->fmt != VID_FMT_YUV420P) {
+
+		if (!r->conv && vidframe_alloc(&r->conv, VID_FMT_YUV420P,
+					       &frame->size))
+			goto out;
+
+		vidconv(r->conv, frame, NULL);
+		frame = r->conv;
+	}
+
+	if (vidsz_cmp(&frame->size, &p->frame->size))
+		compare(r, p->frame, frame);
+	else
+		++r->n_nomatch;
+
+ out:
+	mem_deref(p);
+}
+
+
+static int packet_handler(bool marker, const uint8_t *hdr, size_t hdr_len,
+			  const uint8_t *pld, size_t pld_len, void *arg)
+{
+	struct run *r = arg;
+	struct vidframe frame;
+	struct mbuf *mb;
+	uint64_t t0;
+	bool intra = false;
+	int err;
+
+	mb = mbuf_alloc(hdr_len + pld_len);
+	if (!mb)
+		return ENOMEM;
+
+	if (hdr_len)
+		(void)mbuf_write_mem(mb, hdr, hdr_len);
+	(void)mbuf_write_mem(mb, pld, pld_len);
+	mb->pos = 0;
+
+	r->bytes += hdr_len + pld_len;
+
+	frame.data[0] = NULL;
+
+	t0 = now_ns();
+	err = r->vc->dech(r->dec, &frame, &intra, marker, r->seq++, mb);
+	r->dec_ns += now_ns() - t0;
+
+	if (err) {
+		r->err = err;
+		goto out;
+	}
+
+	if (intra)
+		++r->n_intra;
+
+	if (vidframe_isvalid(&frame))
+		decoded(r, &frame);
+
+ out:
+	mem_deref(mb);
+
+	return 0;
+}
+
+
+static int run_print(struct re_printf *pf, const struct run *r,
+		     double enc_s, double dec_s, double psnr, double ssim,
+		     bool json)
+{
+	const double dur = (double)r->frames_in / FPS;
+
+	if (json) {
+		return re_hprintf(pf, "{\"codec\":\"%s\",\"width\":%u,"
+				  "\"height\":%u,\"bitrate\":%u,"
+				  "\"frames_in\":%u,\"frames_out\":%u,"
+				  "\"intra\":%u,\"kbps\":%.1f,"
+				  "\"enc_fps\":%.1f,\"dec_fps\":%.1f,"
+				  "\"lat_p50_us\":%u,\"lat_p95_us\":%u,"
+				  "\"lat_p99_us\":%u,"
+				  "\"psnr\":%.3f,\"ssim\":%.5f}\n",
+				  r->vc->name, r->size.w, r->size.h,
+				  r->bitrate, r->frames_in, r->frames_out,
+				  r->n_intra, 8.0 * r->bytes / dur / 1000,
+				  enc_s > 0 ? r->frames_in / enc_s : 0.0,
+				  dec_s > 0 ? r->frames_out / dec_s : 0.0,
+				  percentile(&r->lat, 50),
+				  percentile(&r->lat, 95),
+				  percentile(&r->lat, 99),
+				  psnr, ssim);
+	}
+
+	return re_hprintf(pf, "%-8s %4ux%-4u %7u bit/s: %u/%u frames,"
+			  " %.0f kbit/s, enc %.1f fps, dec %.1f fps,"
+			  " latency p50/p95/p99 %u/%u/%u us,"
+			  " PSNR %.2f dB, SSIM %.4f\n",
+			  r->vc->name, r->size.w, r->size.h, r->bitrate,
+			  r->frames_out, r->frames_in,
+			  8.0 * r->bytes / dur / 1000,
+			  enc_s > 0 ? r->frames_in / enc_s : 0.0,
+			  dec_s > 0 ? r->frames_out / dec_s : 0.0,
+			  percentile(&r->lat, 50), percentile(&r->lat, 95),
+			  percentile(&r->lat, 99), psnr, ssim);
+}
+
+
+static int bench_one(struct re_printf *pf, struct re_printf *pff,
+		     const struct vidcodec *vc, const struct vidsz *size,
+		     uint32_t bitrate, uint32_t frames)
+{
+	struct videnc_state *enc = NULL;
+	struct vidframe *src = NULL;
+	struct videnc_param prm;
+	struct run r;
+	uint32_t seed = SEED;
+	uint64_t enc_ns = 0;
+	double psnr, ssim;
+	unsigned n;
+	int err;
+
+	memset(&r, 0, sizeof(r));
+	r.vc      = vc;
+	r.size    = *size;
+	r.bitrate = bitrate;
+
+	prm.fps     = FPS;
+	prm.pktsize = PKTSIZE;
+	prm.bitrate = bitrate;
+	prm.max_fs  = -1;
+
+	err = vc->encupdh(&enc, vc, &prm, NULL, packet_handler, &r);
+	if (err)
+		goto out;
+
+	if (vc->decupdh) {
+		err = vc->decupdh(&r.dec, vc, NULL);
+		if (err)
+			goto out;
+	}
+
+	err = vidframe_alloc(&src, VID_FMT_YUV420P, size);
+	if (err)
+		goto out;
+
+	for (n=0; n<frames && !r.err; n++) {
+
+		struct pending *p;
+		uint64_t t0, dec0;
+
+		synth_frame(src, n, &seed);
+
+		p = mem_zalloc(sizeof(*p), pending_destructor);
+		if (!p) {
+			err = ENOMEM;
+			goto out;
+		}
+
+		err = vidframe_alloc(&p->frame, VID_FMT_YUV420P, size);
+		if (err) {
+			mem_deref(p);
+			goto out;
+		}
+
+		vidframe_copy(p->frame, src);
+		list_append(&r.fifo, &p->le, p);
+
+		/* the codec dropped or holds back frames */
+		if (list_count(&r.fifo) > FIFO_MAX)
+			mem_deref(list_ledata(list_head(&r.fifo)));
+
+		dec0 = r.dec_ns;
+		t0 = p->ts = now_ns();
+
+		err = vc->ench(enc, n == 0, src);
+		if (err)
+			goto out;
+
+		/* the decoder is called from inside the encoder */
+		enc_ns += now_ns() - t0 - (r.dec_ns - dec0);
+
+		++r.frames_in;
+	}
+
+	err = r.err;
+	if (err)
+		goto out;
+
+	if (r.lat.n)
+		qsort(r.lat.v, r.lat.n, sizeof(*r.lat.v), samples_cmp);
+
+	psnr = 99.0;
+	if (r.pixels && r.sse > 0)
+		psnr = 10 * log10(255.0 * 255.0 * r.pixels / r.sse);
+
+	ssim = r.ssim_n ? r.ssim / r.ssim_n : 0.0;
+
+	err = run_print(pf, &r, enc_ns / 1e9, r.dec_ns / 1e9,
+			psnr, ssim, false);
+
+	if (pff) {
+		err |= run_print(pff, &r, enc_ns / 1e9, r.dec_ns / 1e9,
+				 psnr, ssim, true);
+	}
+
+ out:
+	if (err) {
+		(void)re_hprintf(pf, "%-8s %4ux%-4u %7u bit/s: failed (%m)\n",
+				 vc->name, size->w, size->h, bitrate, err);
+	}
+
+	list_flush(&r.fifo);
+	mem_deref(r.lat.v);
+	mem_deref(enc);
+	mem_deref(r.dec);
+	mem_deref(r.conv);
+	mem_deref(src);
+
+	return err;
+}
+
+
+static int print_handler(const char *p, size_t size, void *arg)
+{
+	return fwrite(p, 1, size, arg) == size ? 0 : EIO;
+}
+
+
+/* take the next item of a comma separated list */
+static bool list_next(struct pl *item, struct pl *lst)
+{
+	if (re_regex(lst->p, lst->l, "[^,]+", item))
+		return false;
+
+	lst->l -= item->p + item->l - lst->p;
+	lst->p  = item->p + item->l;
+
+	return true;
+}
+
+
+static int bench_codec(struct re_printf *pf, struct re_printf *pff,
+		       const struct vidcodec *vc, uint32_t frames)
+{
+	char sizes[256] = "352x288,640x480,1280x720";
+	char bitrates[256] = "256000,1024000";
+	struct pl sl, bl, s, b, w, h;
+	int err = 0;
+
+	(void)conf_get_str(conf_cur(), "vidloop_bench_sizes",
+			   sizes, sizeof(sizes));
+	(void)conf_get_str(conf_cur(), "vidloop_bench_bitrates",
+			   bitrates, sizeof(bitrates));
+
+	pl_set_str(&sl, sizes);
+
+	while (list_next(&s, &sl)) {
+
+		struct vidsz size;
+
+		if (re_regex(s.p, s.l, "[0-9]+x[0-9]+", &w, &h)) {
+			warning("vidloop: bench: bad size '%r'\n", &s);
+			continue;
+		}
+
+		size.w = pl_u32(&w) & ~1u;
+		size.h = pl_u32(&h) & ~1u;
+
+		pl_set_str(&bl, bitrates);
+
+		while (list_next(&b, &bl)) {
+			err |= bench_one(pf, pff, vc, &size, pl_u32(&b),
+					 frames);
+		}
+	}
+
+	return err;
+}
+
+
+/**
+ * Run the codec benchmark
+ *
+ * @param pf  Print handler for the report
+ * @param arg Command argument, the codecs to run (all if not set)
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int vidloop_bench(struct re_printf *pf, void *arg)
+{
+	const struct cmd_arg *carg = arg;
+	struct re_printf pf_file = {print_handler, NULL}, *pff;
+	char output[256] = "";
+	uint32_t frames = 300;
+	struct pl cl, c;
+	FILE *f = NULL;
+	int err = 0;
+
+	(void)conf_get_u32(conf_cur(), "vidloop_bench_frames", &frames);
+	(void)conf_get_str(conf_cur(), "vidloop_bench_output",
+			   output, sizeof(output));
+
+	if (str_isset(output)) {
+		f = fopen(output, "a");
+		if (!f) {
+			err = errno;
+			warning("vidloop: bench: %s: %m\n", output, err);
+			return err;
+		}
+
+		pf_file.arg = f;
+	}
+
+	(void)re_hprintf(pf, "vidloop: bench: %u frames per run\n", frames);
+
+	pff = f ? &pf_file : NULL;
+
+	if (str_isset(carg->prm)) {
+
+		pl_set_str(&cl, carg->prm);
+
+		while (list_next(&c, &cl)) {
+
+			char name[64];
+			const struct vidcodec *vc;
+
+			(void)pl_strcpy(&c, name, sizeof(name));
+
+			vc = vidcodec_find_encoder(name);
+			if (!vc || !vc->dech) {
+				(void)re_hprintf(pf, "vidloop: bench: no"
+						 " codec '%s'\n", name);
+				err = ENOENT;
+				continue;
+			}
+
+			err |= bench_codec(pf, pff, vc, frames);
+		}
+	}
+	else {
+		struct le *le;
+
+		for (le = list_head(vidcodec_list()); le; le = le->next) {
+
+			const struct vidcodec *vc = le->data;
+
+			if (vc->encupdh && vc->dech)
+				err |= bench_codec(pf, pff, vc, frames);
+		}
+	}
+
+	if (f)
+		fclose(f);
+
+	return err;
+}
@@ -5,6 +5,7 @@
 #
 
 MOD		:= vidloop
+$(MOD)_SRCS	+= bench.c
 $(MOD)_SRCS	+= vidloop.c
 
 include mk/mod.mk
@@ -10,6 +10,7 @@
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
+#include "vidloop.h"
 
 
 /**
@@ -29,6 +30,12 @@
  \verbatim
   baresip -e"/vidloop h264"
  \endverbatim
+ *
+ * The codecs can also be benchmarked without a video source or display,
+ * see bench.c for the config:
+ \verbatim
+  baresip -e"/vidloop_bench h264,vp8"
+ \endverbatim
  */
 
 
@@ -65,6 +72,7 @@ struct video_loop {
 	uint16_t seq;
 	bool need_conv;
 	int err;
+	struct vidpool *pool;
 };
 
 
@@ -90,8 +98,8 @@ static int display(struct video_loop *vl, struct vidframe *frame)
 		 */
 		if (!frame_filt) {
 
-			err = vidframe_alloc(&frame_filt, frame->fmt,
-					     &frame->size);
+			err = vidpool_get(vl->pool, &frame_filt, frame->fmt,
+					  &frame->size);
 			if (err)
 				return err;
 
@@ -188,7 +196,8 @@ static void vidsrc_frame_handler(struct vidframe *frame, void *arg)
 			vl->need_conv = true;
 		}
 
-		if (vidframe_alloc(&f2, VIDLOOP_INTERNAL_FMT, &frame->size))
+		if (vidpool_get(vl->pool, &f2, VIDLOOP_INTERNAL_FMT,
+				&frame->size))
 			return;
 
 		vidconv(f2, frame, 0);
@@ -228,6 +237,7 @@ static void vidloop_destructor(void *arg)
 	mem_deref(vl->vidisp);
 	list_flush(&vl->filtencl);
 	list_flush(&vl->filtdecl);
+	mem_deref(vl->pool);
 }
 
 
@@ -371,6 +381,10 @@ static int video_loop_alloc(struct video_loop **vlp, const struct vidsz *size)
 	vl->cfg = cfg->video;
 	tmr_init(&vl->tmr_bw);
 
+	err = vidpool_alloc(&vl->pool, 0);
+	if (err)
+		goto out;
+
 	/* Video filters */
 	for (le = list_head(vidfilt_list()); le; le = le->next) {
 		struct vidfilt *vf = le->data;
@@ -470,6 +484,8 @@ static int vidloop_stop(struct re_printf *pf, void *arg)
 static const struct cmd cmdv[] = {
 	{"vidloop",     0, CMD_PRM, "Start video-loop <codec>", vidloop_start},
 	{"vidloop_stop",0, 0,       "Stop video-loop",          vidloop_stop },
+	{"vidloop_bench",0, CMD_PRM, "Benchmark video codecs [codecs]",
+	 vidloop_bench},
 };
 
 
@@ -0,0 +1,8 @@
+/**
+ * @file vidloop.h  Video loop -- internal interface
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+int vidloop_bench(struct re_printf *pf, void *arg);
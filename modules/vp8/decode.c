@@ -13,8 +13,26 @@
 #include "vp8.h"
 
 
+/*
+ * The encoder sends each partition of a frame in its own packets. When
+ * the decoder can conceal errors, the partitions are given to it one by
+ * one, as fragments of the frame. A partition that lost a packet is
+ * given up to the loss, and the decoder conceals the macroblocks that
+ * it could not decode, so the frame is still shown. The first partition
+ * has the modes and motion vectors of the whole frame, without it the
+ * frame is dropped.
+ *
+ * The decoder tells when a frame was concealed, or refers to one that
+ * was. A picture update is asked for only when this goes on for a
+ * while, a loss in a frame that is not a reference costs nothing.
+ */
+
+
 enum {
-	DECODE_MAXSZ = 524288,
+	DECODE_MAXSZ   = 524288,
+	DECODE_THREADS = 4,     /* Default maximum of decoder threads */
+	FRAG_MAX       = 9,     /* First partition and 8 token parts  */
+	CORRUPT_MAX    = 30,    /* Concealed frames before a picup    */
 };
 
 
@@ -38,9 +56,18 @@ struct hdr {
 struct viddec_state {
 	vpx_codec_ctx_t ctx;
 	struct mbuf *mb;
+	struct {
+		size_t pos;
+		size_t len;
+	} fragv[FRAG_MAX];      /* Partitions in the buffer            */
+	unsigned n_frag;
+	unsigned partid;        /* Partition of the open fragment      */
+	bool open;              /* Last fragment is being received     */
+	bool frag;              /* Partitions are given one by one     */
 	bool ctxup;
 	bool started;
 	uint16_t seq;
+	unsigned n_corrupt;     /* Concealed frames in a row           */
 };
 
 
@@ -58,10 +85,15 @@ static void destructor(void *arg)
 int vp8_decode_update(struct viddec_state **vdsp, const struct vidcodec *vc,
 		       const char *fmtp)
 {
+	const struct vp8_vidcodec *vp8 = (const struct vp8_vidcodec *)vc;
+	const vpx_codec_caps_t ec = VPX_CODEC_CAP_ERROR_CONCEALMENT |
+		VPX_CODEC_CAP_INPUT_FRAGMENTS;
+	vpx_codec_caps_t caps;
 	struct viddec_state *vds;
+	vpx_codec_dec_cfg_t cfg;
+	vpx_codec_flags_t flags = 0;
 	vpx_codec_err_t res;
 	int err = 0;
-	(void)vc;
 	(void)fmtp;
 
 	if (!vdsp)
@@ -82,7 +114,22 @@ int vp8_decode_update(struct viddec_state **vdsp, const struct vidcodec *vc,
 		goto out;
 	}
 
-	res = vpx_codec_dec_init(&vds->ctx, &vpx_codec_vp8_dx_algo, NULL, 0);
+	memset(&cfg, 0, sizeof(cfg));
+
+	caps = vpx_codec_get_caps(&vpx_codec_vp8_dx_algo);
+
+	cfg.threads = vp8->dec_threads ? vp8->dec_threads
+		: min(vp8_cpu_count(), DECODE_THREADS);
+
+	/* libvpx must be built with --enable-error-concealment */
+	if ((caps & ec) == ec) {
+		flags |= VPX_CODEC_USE_ERROR_CONCEALMENT |
+			VPX_CODEC_USE_INPUT_FRAGMENTS;
+		vds->frag = true;
+	}
+
+	res = vpx_codec_dec_init(&vds->ctx, &vpx_codec_vp8_dx_algo, &cfg,
+				 flags);
 	if (res) {
 		err = ENOMEM;
 		goto out;
@@ -191,6 +238,40 @@ static inline int16_t seq_diff(uint16_t x, uint16_t y)
 }
 
 
+static void frame_reset(struct viddec_state *vds)
+{
+	mbuf_rewind(vds->mb);
+	vds->n_frag  = 0;
+	vds->open    = false;
+	vds->started = false;
+}
+
+
+/* The fragments must stay in place until the end of the frame */
+static vpx_codec_err_t frame_decode(struct viddec_state *vds)
+{
+	vpx_codec_err_t res;
+	unsigned i;
+
+	if (!vds->frag) {
+		return vpx_codec_decode(&vds->ctx, vds->mb->buf,
+					(unsigned int)vds->mb->end, NULL, 1);
+	}
+
+	for (i=0; i<vds->n_frag; i++) {
+
+		res = vpx_codec_decode(&vds->ctx,
+				       vds->mb->buf + vds->fragv[i].pos,
+				       (unsigned int)vds->fragv[i].len,
+				       NULL, 1);
+		if (res)
+			return res;
+	}
+
+	return vpx_codec_decode(&vds->ctx, NULL, 0, NULL, 1);
+}
+
+
 int vp8_decode(struct viddec_state *vds, struct vidframe *frame,
 	       bool *intra, bool marker, uint16_t seq, struct mbuf *mb)
 {
@@ -198,6 +279,7 @@ int vp8_decode(struct viddec_state *vds, struct vidframe *frame,
 	vpx_codec_err_t res;
 	vpx_image_t *img;
 	struct hdr hdr;
+	int corrupt = 0;
 	int err, i;
 
 	if (!vds || !frame || !intra || !mb)
@@ -209,21 +291,28 @@ int vp8_decode(struct viddec_state *vds, struct vidframe *frame,
 	if (err)
 		return err;
 
-#if 0
-	debug("vp8: header: x=%u noref=%u start=%u partid=%u "
-	      "i=%u l=%u t=%u k=%u "
-	      "picid=%u tl0picidx=%u tid=%u y=%u keyidx=%u\n",
-	      hdr.x, hdr.noref, hdr.start, hdr.partid,
-	      hdr.i, hdr.l, hdr.t, hdr.k,
-	      hdr.picid, hdr.tl0picidx, hdr.tid, hdr.y, hdr.keyidx);
-#endif
+	mod_dbg(vp8_log, "vp8: header: x=%u noref=%u start=%u partid=%u "
+		"i=%u l=%u t=%u k=%u "
+		"picid=%u tl0picidx=%u tid=%u y=%u keyidx=%u\n",
+		hdr.x, hdr.noref, hdr.start, hdr.partid,
+		hdr.i, hdr.l, hdr.t, hdr.k,
+		hdr.picid, hdr.tl0picidx, hdr.tid, hdr.y, hdr.keyidx);
 
 	if (hdr.start && hdr.partid == 0) {
 
+		/* the last packet of the frame before was lost, it is
+		 * decoded as it is, so that the references stay close */
+		if (vds->started && vds->frag && vds->n_frag > 1) {
+			(void)frame_decode(vds);
+			while (vpx_codec_get_frame(&vds->ctx, &iter))
+				;
+			iter = NULL;
+		}
+
 		if (is_keyframe(mb))
 			*intra = true;
 
-		mbuf_rewind(vds->mb);
+		frame_reset(vds);
 		vds->started = true;
 	}
 	else {
@@ -231,18 +320,44 @@ int vp8_decode(struct viddec_state *vds, struct vidframe *frame,
 			return 0;
 
 		if (seq_diff(vds->seq, seq) != 1) {
-			mbuf_rewind(vds->mb);
-			vds->started = false;
-			return 0;
+
+			/* without the first partition there is no frame */
+			if (!vds->frag || !vds->n_frag ||
+			    (vds->open && vds->partid == 0)) {
+				frame_reset(vds);
+				return 0;
+			}
+
+			vds->open = false;
 		}
 	}
 
 	vds->seq = seq;
 
+	if (vds->frag && (!vds->open || hdr.partid != vds->partid)) {
+
+		/* the rest of a partition that lost a packet is skipped */
+		if (!hdr.start || vds->n_frag >= FRAG_MAX) {
+			vds->open = false;
+			goto marker;
+		}
+
+		vds->fragv[vds->n_frag].pos = vds->mb->end;
+		vds->fragv[vds->n_frag].len = 0;
+		++vds->n_frag;
+
+		vds->partid = hdr.partid;
+		vds->open   = true;
+	}
+
 	err = mbuf_write_mem(vds->mb, mbuf_buf(mb), mbuf_get_left(mb));
 	if (err)
 		goto out;
 
+	if (vds->frag)
+		vds->fragv[vds->n_frag - 1].len += mbuf_get_left(mb);
+
+ marker:
 	if (!marker) {
 
 		if (vds->mb->end > DECODE_MAXSZ) {
@@ -254,8 +369,7 @@ int vp8_decode(struct viddec_state *vds, struct vidframe *frame,
 		return 0;
 	}
 
-	res = vpx_codec_decode(&vds->ctx, vds->mb->buf,
-			       (unsigned int)vds->mb->end, NULL, 1);
+	res = frame_decode(vds);
 	if (res) {
 		debug("vp8: decode error: %s\n", vpx_codec_err_to_string(res));
 		err = EPROTO;
@@ -273,6 +387,17 @@ int vp8_decode(struct viddec_state *vds, struct vidframe *frame,
 		goto out;
 	}
 
+	/* a concealed picture is shown, for a while */
+	(void)vpx_codec_control(&vds->ctx, VP8D_GET_FRAME_CORRUPTED,
+				&corrupt);
+	if (!corrupt) {
+		vds->n_corrupt = 0;
+	}
+	else if (++vds->n_corrupt % CORRUPT_MAX == 0) {
+		err = EPROTO;
+		goto out;
+	}
+
 	for (i=0; i<4; i++) {
 		frame->data[i]     = img->planes[i];
 		frame->linesize[i] = img->stride[i];
@@ -283,8 +408,7 @@ int vp8_decode(struct viddec_state *vds, struct vidframe *frame,
 	frame->fmt    = VID_FMT_YUV420P;
 
  out:
-	mbuf_rewind(vds->mb);
-	vds->started = false;
+	frame_reset(vds);
 
 	return err;
 }
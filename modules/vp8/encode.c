@@ -14,19 +14,50 @@
 
 
 enum {
-	HDR_SIZE = 4,
+	HDR_SIZE = 6,
+	TL_MAX   = 3,
+	TL_PERIOD = 4,
+	PART_MAX = 4,   /* the descriptor has room for 4 token partitions */
+};
+
+
+/*
+ * Temporal layers (L1T2 and L1T3). Layer 0 only references layer 0 in
+ * the LAST buffer. With three layers, layer 1 references LAST and
+ * updates GOLDEN. The top layer references LAST and GOLDEN and updates
+ * nothing, so it can be dropped without breaking the other layers.
+ */
+static const uint8_t tl_pattern[TL_MAX][TL_PERIOD] = {
+	{0, 0, 0, 0},
+	{0, 1, 0, 1},
+	{0, 2, 1, 2},
+};
+
+/* cumulative share of the bitrate, in [%] */
+static const uint8_t tl_rate[TL_MAX][TL_MAX] = {
+	{100},
+	{60, 100},
+	{40, 60, 100},
 };
 
 
 struct videnc_state {
 	vpx_codec_ctx_t ctx;
+	vpx_codec_enc_cfg_t cfg;
 	struct vidsz size;
 	vpx_codec_pts_t pts;
 	unsigned fps;
 	unsigned bitrate;
 	unsigned pktsize;
 	bool ctxup;
+	bool roi;
 	uint16_t picid;
+	unsigned n_tl;
+	unsigned tl_frame;
+	uint8_t tl0picidx;
+	unsigned threads;
+	unsigned token_parts;
+	unsigned cpu_used;
 	videnc_packet_h *pkth;
 	void *arg;
 };
@@ -48,7 +79,6 @@ int vp8_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 	const struct vp8_vidcodec *vp8 = (struct vp8_vidcodec *)vc;
 	struct videnc_state *ves;
 	uint32_t max_fs;
-	(void)vp8;
 
 	if (!vesp || !vc || !prm || prm->pktsize < (HDR_SIZE + 1))
 		return EINVAL;
@@ -77,6 +107,10 @@ int vp8_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 	ves->bitrate = prm->bitrate;
 	ves->pktsize = prm->pktsize;
 	ves->fps     = prm->fps;
+	ves->n_tl    = min(max(vp8->temporal_layers, 1), TL_MAX);
+	ves->threads = vp8->threads;
+	ves->token_parts = min(vp8->token_parts, PART_MAX);
+	ves->cpu_used = min(vp8->cpu_used, 16);
 	ves->pkth    = pkth;
 	ves->arg     = arg;
 
@@ -88,29 +122,100 @@ int vp8_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 }
 
 
+/* Encoder threads for the picture size, as used by WebRTC */
+static unsigned auto_threads(const struct vidsz *size)
+{
+	const unsigned ncpu = vp8_cpu_count();
+	const unsigned px = size->w * size->h;
+
+	if (px >= 1920*1080 && ncpu > 8)
+		return 8;
+	else if (px > 1280*960 && ncpu >= 6)
+		return 3;
+	else if (px > 640*480 && ncpu >= 3)
+		return 2;
+	else
+		return 1;
+}
+
+
+/* Token partitions as VP8E_SET_TOKEN_PARTITIONS wants them, log2(n) */
+static int token_partitions(unsigned n)
+{
+	if (n >= 4)
+		return VP8_FOUR_TOKENPARTITION;
+	else if (n >= 2)
+		return VP8_TWO_TOKENPARTITION;
+	else
+		return VP8_ONE_TOKENPARTITION;
+}
+
+
+/* Frame-rate and bitrate, also of the temporal layers */
+static void cfg_rate(vpx_codec_enc_cfg_t *cfg, const struct videnc_state *ves)
+{
+	unsigned i;
+
+	cfg->g_timebase.num    = 1;
+	cfg->g_timebase.den    = ves->fps;
+	cfg->rc_target_bitrate = ves->bitrate;
+
+	if (ves->n_tl < 2)
+		return;
+
+	for (i=0; i<ves->n_tl; i++) {
+		cfg->ts_target_bitrate[i] =
+			cfg->rc_target_bitrate * tl_rate[ves->n_tl-1][i] / 100;
+	}
+}
+
+
 static int open_encoder(struct videnc_state *ves, const struct vidsz *size)
 {
 	vpx_codec_enc_cfg_t cfg;
 	vpx_codec_err_t res;
 	vpx_codec_flags_t flags = 0;
+	unsigned threads, parts;
 
 	res = vpx_codec_enc_config_default(&vpx_codec_vp8_cx_algo, &cfg, 0);
 	if (res)
 		return EPROTO;
 
+	threads = ves->threads ? ves->threads : auto_threads(size);
+
+	/* one partition per thread, so they can be coded in parallel */
+	parts = ves->token_parts ? ves->token_parts : min(threads, PART_MAX);
+
 	cfg.g_profile = 2;
 	cfg.g_w = size->w;
 	cfg.g_h = size->h;
-	cfg.g_timebase.num    = 1;
-	cfg.g_timebase.den    = ves->fps;
 #ifdef VPX_ERROR_RESILIENT_DEFAULT
 	cfg.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
 #endif
 	cfg.g_pass            = VPX_RC_ONE_PASS;
 	cfg.g_lag_in_frames   = 0;
 	cfg.rc_end_usage      = VPX_VBR;
-	cfg.rc_target_bitrate = ves->bitrate;
 	cfg.kf_mode           = VPX_KF_AUTO;
+	cfg.g_threads         = threads;
+
+	if (ves->n_tl > 1) {
+
+		const unsigned n = ves->n_tl;
+		unsigned i;
+
+		cfg.ts_number_layers = n;
+		cfg.ts_periodicity   = TL_PERIOD;
+
+		for (i=0; i<n; i++)
+			cfg.ts_rate_decimator[i] = 1 << (n - 1 - i);
+
+		for (i=0; i<TL_PERIOD; i++)
+			cfg.ts_layer_id[i] = tl_pattern[n-1][i];
+	}
+
+	cfg_rate(&cfg, ves);
+
+	ves->tl_frame = 0;
 
 	if (ves->ctxup) {
 		debug("vp8: re-opening encoder\n");
@@ -130,8 +235,19 @@ static int open_encoder(struct videnc_state *ves, const struct vidsz *size)
 	}
 
 	ves->ctxup = true;
+	ves->roi   = false;
+	ves->cfg   = cfg;
+
+	debug("vp8: encoder opened, %u x %u, %u threads, %u partitions\n",
+	      size->w, size->h, threads, parts);
+
+	res = vpx_codec_control(&ves->ctx, VP8E_SET_CPUUSED, ves->cpu_used);
+	if (res) {
+		warning("vp8: codec ctrl: %s\n", vpx_codec_err_to_string(res));
+	}
 
-	res = vpx_codec_control(&ves->ctx, VP8E_SET_CPUUSED, 16);
+	res = vpx_codec_control(&ves->ctx, VP8E_SET_TOKEN_PARTITIONS,
+				token_partitions(parts));
 	if (res) {
 		warning("vp8: codec ctrl: %s\n", vpx_codec_err_to_string(res));
 	}
@@ -145,45 +261,168 @@ static int open_encoder(struct videnc_state *ves, const struct vidsz *size)
 }
 
 
-static inline void hdr_encode(uint8_t hdr[HDR_SIZE], bool noref, bool start,
-			      uint8_t partid, uint16_t picid)
+/* Temporal layer of the next frame */
+struct tl {
+	bool on;
+	uint8_t tid;
+	bool sync;
+	uint8_t tl0picidx;
+};
+
+
+static vpx_enc_frame_flags_t tl_flags(unsigned n_tl, unsigned tid)
+{
+	if (tid == 0) {
+		return VP8_EFLAG_NO_REF_GF | VP8_EFLAG_NO_REF_ARF |
+			VP8_EFLAG_NO_UPD_GF | VP8_EFLAG_NO_UPD_ARF;
+	}
+	else if (tid < n_tl - 1) {
+		return VP8_EFLAG_NO_REF_GF | VP8_EFLAG_NO_REF_ARF |
+			VP8_EFLAG_NO_UPD_LAST | VP8_EFLAG_NO_UPD_ARF;
+	}
+	else {
+		return VP8_EFLAG_NO_REF_ARF | VP8_EFLAG_NO_UPD_LAST |
+			VP8_EFLAG_NO_UPD_GF | VP8_EFLAG_NO_UPD_ARF |
+			VP8_EFLAG_NO_UPD_ENTROPY;
+	}
+}
+
+
+/* RFC 7741 section 4.2, returns the size of the descriptor */
+static inline size_t hdr_encode(uint8_t hdr[HDR_SIZE], bool noref,
+				bool start, uint8_t partid, uint16_t picid,
+				const struct tl *tl)
 {
 	hdr[0] = 1<<7 | noref<<5 | start<<4 | (partid & 0x7);
-	hdr[1] = 1<<7;
+	hdr[1] = 1<<7 | tl->on<<6 | tl->on<<5;
 	hdr[2] = 1<<7 | (picid>>8 & 0x7f);
 	hdr[3] = picid & 0xff;
+
+	if (!tl->on)
+		return 4;
+
+	hdr[4] = tl->tl0picidx;
+	hdr[5] = tl->tid<<6 | tl->sync<<5;
+
+	return 6;
 }
 
 
 static inline int packetize(bool marker, const uint8_t *buf, size_t len,
 			    size_t maxlen, bool noref, uint8_t partid,
-			    uint16_t picid, videnc_packet_h *pkth, void *arg)
+			    uint16_t picid, const struct tl *tl,
+			    videnc_packet_h *pkth, void *arg)
 {
 	uint8_t hdr[HDR_SIZE];
+	size_t hdr_len;
 	bool start = true;
 	int err = 0;
 
-	maxlen -= sizeof(hdr);
+	maxlen -= tl->on ? 6 : 4;
 
 	while (len > maxlen) {
 
-		hdr_encode(hdr, noref, start, partid, picid);
+		hdr_len = hdr_encode(hdr, noref, start, partid, picid, tl);
 
-		err |= pkth(false, hdr, sizeof(hdr), buf, maxlen, arg);
+		err |= pkth(false, hdr, hdr_len, buf, maxlen, arg);
 
 		buf  += maxlen;
 		len  -= maxlen;
 		start = false;
 	}
 
-	hdr_encode(hdr, noref, start, partid, picid);
+	hdr_len = hdr_encode(hdr, noref, start, partid, picid, tl);
 
-	err |= pkth(marker, hdr, sizeof(hdr), buf, len, arg);
+	err |= pkth(marker, hdr, hdr_len, buf, len, arg);
 
 	return err;
 }
 
 
+/* Apply a new configuration to the running encoder */
+static int cfg_apply(struct videnc_state *ves, const vpx_codec_enc_cfg_t *cfg)
+{
+	vpx_codec_err_t res;
+
+	res = vpx_codec_enc_config_set(&ves->ctx, cfg);
+	if (res) {
+		debug("vp8: enc config: %s\n", vpx_codec_err_to_string(res));
+		return EPROTO;
+	}
+
+	ves->cfg = *cfg;
+
+	return 0;
+}
+
+
+/*
+ * Bitrate and frame-rate are changed in the running encoder, so there
+ * is no keyframe. If it cannot be done, the encoder is opened again
+ * with the next frame.
+ */
+int vp8_encode_reconfig(struct videnc_state *ves,
+			const struct videnc_param *prm)
+{
+	vpx_codec_enc_cfg_t cfg;
+
+	if (!ves || !prm)
+		return EINVAL;
+
+	ves->bitrate = prm->bitrate;
+	ves->fps     = prm->fps;
+
+	if (!ves->ctxup)
+		return 0;
+
+	cfg = ves->cfg;
+	cfg_rate(&cfg, ves);
+
+	if (cfg_apply(ves, &cfg)) {
+		vpx_codec_destroy(&ves->ctx);
+		ves->ctxup = false;
+	}
+
+	return 0;
+}
+
+
+/*
+ * The region of interest is the active map of libvpx, its blocks are
+ * the macroblocks. Inactive macroblocks are coded as skipped.
+ */
+int vp8_encode_roi(struct videnc_state *ves, const uint8_t *map,
+		   unsigned cols, unsigned rows)
+{
+	vpx_active_map_t am;
+	vpx_codec_err_t res;
+
+	if (!ves)
+		return EINVAL;
+
+	if (!ves->ctxup || (!map && !ves->roi))
+		return 0;
+
+	/* the size is checked also to turn the map off */
+	am.active_map = (unsigned char *)map;
+	am.cols = (ves->size.w + 15) / 16;
+	am.rows = (ves->size.h + 15) / 16;
+
+	if (map && (cols != am.cols || rows != am.rows))
+		return EINVAL;
+
+	res = vpx_codec_control(&ves->ctx, VP8E_SET_ACTIVEMAP, &am);
+	if (res) {
+		debug("vp8: active map: %s\n", vpx_codec_err_to_string(res));
+		return EPROTO;
+	}
+
+	ves->roi = map != NULL;
+
+	return 0;
+}
+
+
 int vp8_encode(struct videnc_state *ves, bool update,
 		const struct vidframe *frame)
 {
@@ -191,11 +430,24 @@ int vp8_encode(struct videnc_state *ves, bool update,
 	vpx_codec_iter_t iter = NULL;
 	vpx_codec_err_t res;
 	vpx_image_t img;
+	struct tl tl;
 	int err, i;
 
 	if (!ves || !frame || frame->fmt != VID_FMT_YUV420P)
 		return EINVAL;
 
+	if (ves->ctxup && !vidsz_cmp(&ves->size, &frame->size)) {
+
+		vpx_codec_enc_cfg_t cfg = ves->cfg;
+
+		/* a smaller picture needs no new encoder */
+		cfg.g_w = frame->size.w;
+		cfg.g_h = frame->size.h;
+
+		if (0 == cfg_apply(ves, &cfg))
+			ves->size = frame->size;
+	}
+
 	if (!ves->ctxup || !vidsz_cmp(&ves->size, &frame->size)) {
 
 		err = open_encoder(ves, &frame->size);
@@ -208,6 +460,33 @@ int vp8_encode(struct videnc_state *ves, bool update,
 	if (update) {
 		/* debug("vp8: picture update\n"); */
 		flags |= VPX_EFLAG_FORCE_KF;
+		ves->tl_frame = 0;
+	}
+
+	memset(&tl, 0, sizeof(tl));
+
+	if (ves->n_tl > 1) {
+
+		tl.on  = true;
+		tl.tid = tl_pattern[ves->n_tl-1][ves->tl_frame % TL_PERIOD];
+
+		/* the top of three layers references layer 1 */
+		tl.sync = !(ves->n_tl == 3 && tl.tid == 2);
+
+		if (tl.tid == 0)
+			++ves->tl0picidx;
+		tl.tl0picidx = ves->tl0picidx;
+
+		++ves->tl_frame;
+
+		flags |= tl_flags(ves->n_tl, tl.tid);
+
+		res = vpx_codec_control(&ves->ctx, VP8E_SET_TEMPORAL_LAYER_ID,
+					tl.tid);
+		if (res) {
+			warning("vp8: codec ctrl: %s\n",
+				vpx_codec_err_to_string(res));
+		}
 	}
 
 	memset(&img, 0, sizeof(img));
@@ -257,7 +536,7 @@ int vp8_encode(struct videnc_state *ves, bool update,
 				pkt->data.frame.buf,
 				pkt->data.frame.sz,
 				ves->pktsize, !keyframe, partid, ves->picid,
-				ves->pkth, ves->arg);
+				&tl, ves->pkth, ves->arg);
 		if (err)
 			return err;
 	}
@@ -3,6 +3,9 @@
  *
  * Copyright (C) 2010 Creytiv.com
  */
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -22,9 +25,35 @@
  *     http://www.webmproject.org/
  *
  *     https://tools.ietf.org/html/rfc7741
+ *
+ * Temporal layers can be enabled in ~/.baresip/config, from 1 to 3:
+ *
+ \verbatim
+  vp8_temporal_layers     3
+ \endverbatim
+ *
+ * The encoder threads and token partitions are picked from the picture
+ * size and the number of CPUs, or set in the config:
+ *
+ \verbatim
+  vp8_threads             4       # 0 is auto
+  vp8_token_partitions    4       # 1, 2 or 4, 0 is auto
+  vp8_cpu_used            16      # 0-16, higher is faster
+ \endverbatim
+ *
+ * The decoder uses up to 4 threads, or as set in the config. When
+ * libvpx was built with --enable-error-concealment, a frame that lost
+ * packets is decoded from the partitions that were received, and the
+ * missing parts are concealed:
+ *
+ \verbatim
+  vp8_dec_threads         2       # 0 is auto
+ \endverbatim
  */
 
 
+struct log_mod vp8_log = LOG_MOD_INIT("vp8");
+
 static struct vp8_vidcodec vp8 = {
 	.vc = {
 		.name      = "VP8",
@@ -33,14 +62,43 @@ static struct vp8_vidcodec vp8 = {
 		.decupdh   = vp8_decode_update,
 		.dech      = vp8_decode,
 		.fmtp_ench = vp8_fmtp_enc,
+		.reconfh   = vp8_encode_reconfig,
+		.roih      = vp8_encode_roi,
 	},
 	.max_fs   = 3600,
+	.temporal_layers = 1,
+	.threads  = 0,
+	.token_parts = 0,
+	.cpu_used = 16,
+	.dec_threads = 0,
 };
 
 
+unsigned vp8_cpu_count(void)
+{
+#if defined (HAVE_UNISTD_H) && defined (_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n > 0)
+		return (unsigned)n;
+#endif
+
+	return 1;
+}
+
+
 static int module_init(void)
 {
+	(void)conf_get_u32(conf_cur(), "vp8_temporal_layers",
+			   &vp8.temporal_layers);
+	(void)conf_get_u32(conf_cur(), "vp8_threads", &vp8.threads);
+	(void)conf_get_u32(conf_cur(), "vp8_token_partitions",
+			   &vp8.token_parts);
+	(void)conf_get_u32(conf_cur(), "vp8_cpu_used", &vp8.cpu_used);
+	(void)conf_get_u32(conf_cur(), "vp8_dec_threads", &vp8.dec_threads);
+
 	vidcodec_register((struct vidcodec *)&vp8);
+	log_mod_register(&vp8_log);
 
 	return 0;
 }
@@ -48,6 +106,7 @@ static int module_init(void)
 
 static int module_close(void)
 {
+	log_mod_unregister(&vp8_log);
 	vidcodec_unregister((struct vidcodec *)&vp8);
 
 	return 0;
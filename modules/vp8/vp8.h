@@ -7,14 +7,27 @@
 struct vp8_vidcodec {
 	struct vidcodec vc;
 	uint32_t max_fs;
+	uint32_t temporal_layers;
+	uint32_t threads;          /* Encoder threads, 0 = auto          */
+	uint32_t token_parts;      /* Token partitions, 0 = auto         */
+	uint32_t cpu_used;         /* Speed, 0 (best) to 16 (fastest)    */
+	uint32_t dec_threads;      /* Decoder threads, 0 = auto          */
 };
 
+extern struct log_mod vp8_log;
+
+unsigned vp8_cpu_count(void);
+
 /* Encode */
 int vp8_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 		      struct videnc_param *prm, const char *fmtp,
 		      videnc_packet_h *pkth, void *arg);
 int vp8_encode(struct videnc_state *ves, bool update,
 	       const struct vidframe *frame);
+int vp8_encode_reconfig(struct videnc_state *ves,
+			const struct videnc_param *prm);
+int vp8_encode_roi(struct videnc_state *ves, const uint8_t *map,
+		   unsigned cols, unsigned rows);
 
 
 /* Decode */
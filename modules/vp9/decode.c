@@ -30,6 +30,8 @@ struct hdr {
 
 	/* extension fields */
 	uint16_t picid;
+	unsigned tid:3;  /* Temporal layer ID                        */
+	uint8_t tl0picidx;
 };
 
 struct viddec_state {
@@ -127,10 +129,6 @@ static inline int hdr_decode(struct hdr *hdr, struct mbuf *mb)
 		warning("vp9: decode: P-bit not supported\n");
 		return EPROTO;
 	}
-	if (hdr->l) {
-		warning("vp9: decode: L-bit not supported\n");
-		return EPROTO;
-	}
 	if (hdr->f) {
 		warning("vp9: decode: F-bit not supported\n");
 		return EPROTO;
@@ -160,6 +158,18 @@ static inline int hdr_decode(struct hdr *hdr, struct mbuf *mb)
 		}
 	}
 
+	/* layer indices, with TL0PICIDX in non-flexible mode */
+	if (hdr->l) {
+
+		if (mbuf_get_left(mb) < 2)
+			return EBADMSG;
+
+		v = mbuf_read_u8(mb);
+
+		hdr->tid = v>>5 & 0x7;
+		hdr->tl0picidx = mbuf_read_u8(mb);
+	}
+
 	return 0;
 }
 
@@ -208,10 +218,8 @@ int vp9_decode(struct viddec_state *vds, struct vidframe *frame,
 	if (err)
 		return err;
 
-#if 0
-	debug("vp9: [%c] header: i=%u start=%u end=%u picid=%u \n",
-	      marker ? 'M' : ' ', hdr.i, hdr.b, hdr.e, hdr.picid);
-#endif
+	mod_dbg(vp9_log, "vp9: [%c] header: i=%u start=%u end=%u picid=%u\n",
+		marker ? 'M' : ' ', hdr.i, hdr.b, hdr.e, hdr.picid);
 
 	if (hdr.b) {
 
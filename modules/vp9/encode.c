@@ -4,6 +4,9 @@
  * Copyright (C) 2010 - 2016 Creytiv.com
  */
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #include <string.h>
 #include <re.h>
 #include <rem.h>
@@ -14,19 +17,58 @@
 
 
 enum {
-	HDR_SIZE = 3,
+	HDR_SIZE = 5,
+	TL_MAX   = 3,
+	TL_PERIOD = 4,
+	TILE_MIN_WIDTH = 256,  /* Narrowest tile column [pixels] */
+};
+
+
+/*
+ * Temporal layers (L1T2 and L1T3), with the same reference structure as
+ * the vp8 module. The top layer is never referenced.
+ */
+static const uint8_t tl_pattern[TL_MAX][TL_PERIOD] = {
+	{0, 0, 0, 0},
+	{0, 1, 0, 1},
+	{0, 2, 1, 2},
+};
+
+/* cumulative share of the bitrate, in [%] */
+static const uint8_t tl_rate[TL_MAX][TL_MAX] = {
+	{100},
+	{60, 100},
+	{40, 60, 100},
+};
+
+
+/* Temporal layer of the next frame */
+struct tl {
+	bool on;
+	uint8_t tid;
+	bool sync;
+	uint8_t tl0picidx;
 };
 
 
 struct videnc_state {
 	vpx_codec_ctx_t ctx;
+	vpx_codec_enc_cfg_t cfg;
 	struct vidsz size;
 	vpx_codec_pts_t pts;
 	unsigned fps;
 	unsigned bitrate;
 	unsigned pktsize;
 	bool ctxup;
+	bool roi;
 	uint16_t picid;
+	unsigned n_tl;
+	unsigned tl_frame;
+	uint8_t tl0picidx;
+	unsigned threads;
+	unsigned tile_cols;
+	bool row_mt;
+	unsigned cpu_used;
 	videnc_packet_h *pkth;
 	void *arg;
 
@@ -60,7 +102,6 @@ int vp9_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 	const struct vp9_vidcodec *vp9 = (struct vp9_vidcodec *)vc;
 	struct videnc_state *ves;
 	uint32_t max_fs;
-	(void)vp9;
 
 	if (!vesp || !vc || !prm || prm->pktsize < (HDR_SIZE + 1))
 		return EINVAL;
@@ -89,6 +130,11 @@ int vp9_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 	ves->bitrate = prm->bitrate;
 	ves->pktsize = prm->pktsize;
 	ves->fps     = prm->fps;
+	ves->n_tl    = min(max(vp9->temporal_layers, 1), TL_MAX);
+	ves->threads = vp9->threads;
+	ves->tile_cols = vp9->tile_cols;
+	ves->row_mt  = vp9->row_mt;
+	ves->cpu_used = min(vp9->cpu_used, 9);
 	ves->pkth    = pkth;
 	ves->arg     = arg;
 
@@ -100,15 +146,86 @@ int vp9_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 }
 
 
+static unsigned cpu_count(void)
+{
+#if defined (HAVE_UNISTD_H) && defined (_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n > 0)
+		return (unsigned)n;
+#endif
+
+	return 1;
+}
+
+
+/* Encoder threads for the picture size, as used by WebRTC */
+static unsigned auto_threads(const struct vidsz *size)
+{
+	const unsigned ncpu = cpu_count();
+	const unsigned px = size->w * size->h;
+
+	if (px >= 1920*1080 && ncpu > 8)
+		return 8;
+	else if (px > 1280*960 && ncpu >= 6)
+		return 3;
+	else if (px > 640*480 && ncpu >= 3)
+		return 2;
+	else
+		return 1;
+}
+
+
+/* Tile columns as VP9E_SET_TILE_COLUMNS wants them, log2(n) */
+static int tile_columns(unsigned n, unsigned width)
+{
+	int log2n = 0;
+
+	while ((2u << log2n) <= n &&
+	       (width >> (log2n + 1)) >= TILE_MIN_WIDTH)
+		++log2n;
+
+	return log2n;
+}
+
+
+/* Frame-rate and bitrate, also of the temporal layers */
+static void cfg_rate(vpx_codec_enc_cfg_t *cfg, const struct videnc_state *ves)
+{
+	unsigned i;
+
+	cfg->g_timebase.num    = 1;
+	cfg->g_timebase.den    = ves->fps;
+	cfg->rc_target_bitrate = ves->bitrate / 1000;
+
+	if (ves->n_tl < 2)
+		return;
+
+	for (i=0; i<ves->n_tl; i++) {
+		cfg->ts_target_bitrate[i] =
+			cfg->rc_target_bitrate * tl_rate[ves->n_tl-1][i] / 100;
+#ifdef VPX_MAX_LAYERS
+		cfg->layer_target_bitrate[i] = cfg->ts_target_bitrate[i];
+#endif
+	}
+}
+
+
 static int open_encoder(struct videnc_state *ves, const struct vidsz *size)
 {
 	vpx_codec_enc_cfg_t cfg;
 	vpx_codec_err_t res;
+	unsigned threads, cols;
 
 	res = vpx_codec_enc_config_default(&vpx_codec_vp9_cx_algo, &cfg, 0);
 	if (res)
 		return EPROTO;
 
+	threads = ves->threads ? ves->threads : auto_threads(size);
+
+	/* one tile column per thread, so they can be coded in parallel */
+	cols = ves->tile_cols ? ves->tile_cols : threads;
+
 	/*
 	  Profile 0 = 8 bit yuv420p
 	  Profile 1 = 8 bit yuv422/440/444p
@@ -119,14 +236,32 @@ static int open_encoder(struct videnc_state *ves, const struct vidsz *size)
 	cfg.g_profile         = 0;
 	cfg.g_w               = size->w;
 	cfg.g_h               = size->h;
-	cfg.g_timebase.num    = 1;
-	cfg.g_timebase.den    = ves->fps;
-	cfg.rc_target_bitrate = ves->bitrate / 1000;
 	cfg.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
 	cfg.g_pass            = VPX_RC_ONE_PASS;
 	cfg.g_lag_in_frames   = 0;
 	cfg.rc_end_usage      = VPX_VBR;
 	cfg.kf_mode           = VPX_KF_AUTO;
+	cfg.g_threads         = threads;
+
+	if (ves->n_tl > 1) {
+
+		const unsigned n = ves->n_tl;
+		unsigned i;
+
+		cfg.ss_number_layers = 1;
+		cfg.ts_number_layers = n;
+		cfg.ts_periodicity   = TL_PERIOD;
+
+		for (i=0; i<n; i++)
+			cfg.ts_rate_decimator[i] = 1 << (n - 1 - i);
+
+		for (i=0; i<TL_PERIOD; i++)
+			cfg.ts_layer_id[i] = tl_pattern[n-1][i];
+	}
+
+	cfg_rate(&cfg, ves);
+
+	ves->tl_frame = 0;
 
 	if (ves->ctxup) {
 		debug("vp9: re-opening encoder\n");
@@ -142,11 +277,33 @@ static int open_encoder(struct videnc_state *ves, const struct vidsz *size)
 	}
 
 	ves->ctxup = true;
+	ves->roi   = false;
+	ves->cfg   = cfg;
+
+	if (ves->n_tl > 1) {
+		res = vpx_codec_control(&ves->ctx, VP9E_SET_SVC, 1);
+		if (res) {
+			warning("vp9: codec ctrl: %s\n",
+				vpx_codec_err_to_string(res));
+		}
+	}
+
+	res = vpx_codec_control(&ves->ctx, VP8E_SET_CPUUSED, ves->cpu_used);
+	if (res) {
+		warning("vp9: codec ctrl: %s\n", vpx_codec_err_to_string(res));
+	}
 
-	res = vpx_codec_control(&ves->ctx, VP8E_SET_CPUUSED, 8);
+	res = vpx_codec_control(&ves->ctx, VP9E_SET_TILE_COLUMNS,
+				tile_columns(cols, size->w));
+	if (res) {
+		warning("vp9: codec ctrl: %s\n", vpx_codec_err_to_string(res));
+	}
+#ifdef VPX_CTRL_VP9E_SET_ROW_MT
+	res = vpx_codec_control(&ves->ctx, VP9E_SET_ROW_MT, ves->row_mt);
 	if (res) {
 		warning("vp9: codec ctrl: %s\n", vpx_codec_err_to_string(res));
 	}
+#endif
 #ifdef VP9E_SET_NOISE_SENSITIVITY
 	res = vpx_codec_control(&ves->ctx, VP9E_SET_NOISE_SENSITIVITY, 0);
 	if (res) {
@@ -154,18 +311,49 @@ static int open_encoder(struct videnc_state *ves, const struct vidsz *size)
 	}
 #endif
 
-	info("vp9: encoder opened, picture size %u x %u\n", size->w, size->h);
+	info("vp9: encoder opened, picture size %u x %u, %u threads\n",
+	     size->w, size->h, threads);
 
 	return 0;
 }
 
 
-static inline void hdr_encode(uint8_t hdr[HDR_SIZE], bool start, bool end,
-			      uint16_t picid)
+static vpx_enc_frame_flags_t tl_flags(unsigned n_tl, unsigned tid)
 {
-	hdr[0] = 1<<7 | start<<3 | end<<2;
+	if (tid == 0) {
+		return VP8_EFLAG_NO_REF_GF | VP8_EFLAG_NO_REF_ARF |
+			VP8_EFLAG_NO_UPD_GF | VP8_EFLAG_NO_UPD_ARF;
+	}
+	else if (tid < n_tl - 1) {
+		return VP8_EFLAG_NO_REF_GF | VP8_EFLAG_NO_REF_ARF |
+			VP8_EFLAG_NO_UPD_LAST | VP8_EFLAG_NO_UPD_ARF;
+	}
+	else {
+		return VP8_EFLAG_NO_REF_ARF | VP8_EFLAG_NO_UPD_LAST |
+			VP8_EFLAG_NO_UPD_GF | VP8_EFLAG_NO_UPD_ARF;
+	}
+}
+
+
+/*
+ * Non-flexible mode, with the layer indices and TL0PICIDX when there
+ * are temporal layers. Returns the size of the descriptor.
+ */
+static inline size_t hdr_encode(uint8_t hdr[HDR_SIZE], bool start, bool end,
+				uint16_t picid, const struct tl *tl)
+{
+	hdr[0] = 1<<7 | tl->on<<5 | start<<3 | end<<2;
 	hdr[1] = 1<<7 | (picid>>8 & 0x7f);
 	hdr[2] = picid & 0xff;
+
+	if (!tl->on)
+		return 3;
+
+	/* TID, U, SID and D */
+	hdr[3] = tl->tid<<5 | tl->sync<<4;
+	hdr[4] = tl->tl0picidx;
+
+	return 5;
 }
 
 
@@ -181,33 +369,118 @@ static int send_packet(struct videnc_state *ves, bool marker,
 
 static inline int packetize(struct videnc_state *ves,
 			    bool marker, const uint8_t *buf, size_t len,
-			    size_t maxlen, uint16_t picid)
+			    size_t maxlen, uint16_t picid, const struct tl *tl)
 {
 	uint8_t hdr[HDR_SIZE];
+	size_t hdr_len;
 	bool start = true;
 	int err = 0;
 
-	maxlen -= sizeof(hdr);
+	maxlen -= tl->on ? 5 : 3;
 
 	while (len > maxlen) {
 
-		hdr_encode(hdr, start, false, picid);
+		hdr_len = hdr_encode(hdr, start, false, picid, tl);
 
-		err |= send_packet(ves, false, hdr, sizeof(hdr), buf, maxlen);
+		err |= send_packet(ves, false, hdr, hdr_len, buf, maxlen);
 
 		buf  += maxlen;
 		len  -= maxlen;
 		start = false;
 	}
 
-	hdr_encode(hdr, start, true, picid);
+	hdr_len = hdr_encode(hdr, start, true, picid, tl);
 
-	err |= send_packet(ves, marker, hdr, sizeof(hdr), buf, len);
+	err |= send_packet(ves, marker, hdr, hdr_len, buf, len);
 
 	return err;
 }
 
 
+/* Apply a new configuration to the running encoder */
+static int cfg_apply(struct videnc_state *ves, const vpx_codec_enc_cfg_t *cfg)
+{
+	vpx_codec_err_t res;
+
+	res = vpx_codec_enc_config_set(&ves->ctx, cfg);
+	if (res) {
+		debug("vp9: enc config: %s\n", vpx_codec_err_to_string(res));
+		return EPROTO;
+	}
+
+	ves->cfg = *cfg;
+
+	return 0;
+}
+
+
+/*
+ * Bitrate and frame-rate are changed in the running encoder, so there
+ * is no keyframe. If it cannot be done, the encoder is opened again
+ * with the next frame.
+ */
+int vp9_encode_reconfig(struct videnc_state *ves,
+			const struct videnc_param *prm)
+{
+	vpx_codec_enc_cfg_t cfg;
+
+	if (!ves || !prm)
+		return EINVAL;
+
+	ves->bitrate = prm->bitrate;
+	ves->fps     = prm->fps;
+
+	if (!ves->ctxup)
+		return 0;
+
+	cfg = ves->cfg;
+	cfg_rate(&cfg, ves);
+
+	if (cfg_apply(ves, &cfg)) {
+		vpx_codec_destroy(&ves->ctx);
+		ves->ctxup = false;
+	}
+
+	return 0;
+}
+
+
+/*
+ * The region of interest is the active map of libvpx, its blocks are
+ * the macroblocks. Inactive macroblocks are coded as skipped.
+ */
+int vp9_encode_roi(struct videnc_state *ves, const uint8_t *map,
+		   unsigned cols, unsigned rows)
+{
+	vpx_active_map_t am;
+	vpx_codec_err_t res;
+
+	if (!ves)
+		return EINVAL;
+
+	if (!ves->ctxup || (!map && !ves->roi))
+		return 0;
+
+	/* the size is checked also to turn the map off */
+	am.active_map = (unsigned char *)map;
+	am.cols = (ves->size.w + 15) / 16;
+	am.rows = (ves->size.h + 15) / 16;
+
+	if (map && (cols != am.cols || rows != am.rows))
+		return EINVAL;
+
+	res = vpx_codec_control(&ves->ctx, VP8E_SET_ACTIVEMAP, &am);
+	if (res) {
+		debug("vp9: active map: %s\n", vpx_codec_err_to_string(res));
+		return EPROTO;
+	}
+
+	ves->roi = map != NULL;
+
+	return 0;
+}
+
+
 int vp9_encode(struct videnc_state *ves, bool update,
 		const struct vidframe *frame)
 {
@@ -216,6 +489,7 @@ int vp9_encode(struct videnc_state *ves, bool update,
 	vpx_codec_err_t res;
 	vpx_image_t *img = NULL;
 	vpx_img_fmt_t img_fmt;
+	struct tl tl;
 	int err, i;
 
 	if (!ves || !frame)
@@ -233,6 +507,18 @@ int vp9_encode(struct videnc_state *ves, bool update,
 		return EINVAL;
 	}
 
+	if (ves->ctxup && !vidsz_cmp(&ves->size, &frame->size)) {
+
+		vpx_codec_enc_cfg_t cfg = ves->cfg;
+
+		/* a smaller picture needs no new encoder */
+		cfg.g_w = frame->size.w;
+		cfg.g_h = frame->size.h;
+
+		if (0 == cfg_apply(ves, &cfg))
+			ves->size = frame->size;
+	}
+
 	if (!ves->ctxup || !vidsz_cmp(&ves->size, &frame->size)) {
 
 		err = open_encoder(ves, &frame->size);
@@ -247,6 +533,38 @@ int vp9_encode(struct videnc_state *ves, bool update,
 	if (update) {
 		/* debug("vp9: picture update\n"); */
 		flags |= VPX_EFLAG_FORCE_KF;
+		ves->tl_frame = 0;
+	}
+
+	memset(&tl, 0, sizeof(tl));
+
+	if (ves->n_tl > 1) {
+
+		vpx_svc_layer_id_t lid;
+
+		tl.on  = true;
+		tl.tid = tl_pattern[ves->n_tl-1][ves->tl_frame % TL_PERIOD];
+
+		/* the top of three layers references layer 1 */
+		tl.sync = !(ves->n_tl == 3 && tl.tid == 2);
+
+		if (tl.tid == 0)
+			++ves->tl0picidx;
+		tl.tl0picidx = ves->tl0picidx;
+
+		++ves->tl_frame;
+
+		flags |= tl_flags(ves->n_tl, tl.tid);
+
+		memset(&lid, 0, sizeof(lid));
+		lid.temporal_layer_id = tl.tid;
+
+		res = vpx_codec_control(&ves->ctx, VP9E_SET_SVC_LAYER_ID,
+					&lid);
+		if (res) {
+			warning("vp9: codec ctrl: %s\n",
+				vpx_codec_err_to_string(res));
+		}
 	}
 
 	img = vpx_img_wrap(NULL, img_fmt, frame->size.w, frame->size.h,
@@ -295,7 +613,7 @@ int vp9_encode(struct videnc_state *ves, bool update,
 				marker,
 				pkt->data.frame.buf,
 				pkt->data.frame.sz,
-				ves->pktsize, ves->picid);
+				ves->pktsize, ves->picid, &tl);
 		if (err)
 			return err;
 	}
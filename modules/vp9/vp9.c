@@ -26,9 +26,27 @@
  *     http://www.webmproject.org/
  *
  *     draft-ietf-payload-vp9-02
+ *
+ * Temporal layers can be enabled in ~/.baresip/config, from 1 to 3:
+ *
+ \verbatim
+  vp9_temporal_layers     3
+ \endverbatim
+ *
+ * The encoder threads and tile columns are picked from the picture size
+ * and the number of CPUs, or set in the config:
+ *
+ \verbatim
+  vp9_threads             4       # 0 is auto
+  vp9_tile_columns        4       # 1, 2, 4, .. 0 is auto
+  vp9_row_mt              yes     # libvpx 1.7.0 or later
+  vp9_cpu_used            8       # 0-9, higher is faster
+ \endverbatim
  */
 
 
+struct log_mod vp9_log = LOG_MOD_INIT("vp9");
+
 static struct vp9_vidcodec vp9 = {
 	.vc = {
 		.name      = "VP9",
@@ -37,20 +55,36 @@ static struct vp9_vidcodec vp9 = {
 		.decupdh   = vp9_decode_update,
 		.dech      = vp9_decode,
 		.fmtp_ench = vp9_fmtp_enc,
+		.reconfh   = vp9_encode_reconfig,
+		.roih      = vp9_encode_roi,
 	},
-	.max_fs = 3600
+	.max_fs = 3600,
+	.temporal_layers = 1,
+	.threads   = 0,
+	.tile_cols = 0,
+	.row_mt    = true,
+	.cpu_used  = 8,
 };
 
 
 static int module_init(void)
 {
+	(void)conf_get_u32(conf_cur(), "vp9_temporal_layers",
+			   &vp9.temporal_layers);
+	(void)conf_get_u32(conf_cur(), "vp9_threads", &vp9.threads);
+	(void)conf_get_u32(conf_cur(), "vp9_tile_columns", &vp9.tile_cols);
+	(void)conf_get_bool(conf_cur(), "vp9_row_mt", &vp9.row_mt);
+	(void)conf_get_u32(conf_cur(), "vp9_cpu_used", &vp9.cpu_used);
+
 	vidcodec_register((struct vidcodec *)&vp9);
+	log_mod_register(&vp9_log);
 	return 0;
 }
 
 
 static int module_close(void)
 {
+	log_mod_unregister(&vp9_log);
 	vidcodec_unregister((struct vidcodec *)&vp9);
 	return 0;
 }
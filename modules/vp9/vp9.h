@@ -7,14 +7,25 @@
 struct vp9_vidcodec {
 	struct vidcodec vc;
 	uint32_t max_fs;
+	uint32_t temporal_layers;
+	uint32_t threads;          /* Encoder threads, 0 = auto          */
+	uint32_t tile_cols;        /* Tile columns, 0 = auto             */
+	bool row_mt;               /* Row based multi-threading          */
+	uint32_t cpu_used;         /* Speed, 0 (best) to 9 (fastest)     */
 };
 
+extern struct log_mod vp9_log;
+
 /* Encode */
 int vp9_encode_update(struct videnc_state **vesp, const struct vidcodec *vc,
 		      struct videnc_param *prm, const char *fmtp,
 		      videnc_packet_h *pkth, void *arg);
 int vp9_encode(struct videnc_state *ves, bool update,
 	       const struct vidframe *frame);
+int vp9_encode_reconfig(struct videnc_state *ves,
+			const struct videnc_param *prm);
+int vp9_encode_roi(struct videnc_state *ves, const uint8_t *map,
+		   unsigned cols, unsigned rows);
 
 
 /* Decode */
@@ -4,7 +4,6 @@
  * Copyright (C) 2010 Creytiv.com
  */
 #include <string.h>
-#include <stdlib.h>
 #include <re.h>
 #include <baresip.h>
 
@@ -16,21 +15,22 @@
  *
  * The Volume unit (VU) meter module takes the audio-signal as input
  * and prints a simple ASCII-art bar for the recording and playback levels.
- * It is using the aufilt API to get the audio samples.
+ * It is using the aufilt API to follow the audio stream, and shows the
+ * RMS level that the stream computes once per frame (audio_level()).
  */
 
 
 struct vumeter_enc {
 	struct aufilt_enc_st af;  /* inheritance */
 	struct tmr tmr;
-	int16_t avg_rec;
+	const struct audio *au;
 	volatile bool started;
 };
 
 struct vumeter_dec {
 	struct aufilt_dec_st af;  /* inheritance */
 	struct tmr tmr;
-	int16_t avg_play;
+	const struct audio *au;
 	volatile bool started;
 };
 
@@ -53,21 +53,6 @@ static void dec_destructor(void *arg)
 }
 
 
-static int16_t calc_avg_s16(const int16_t *sampv, size_t sampc)
-{
-	int32_t v = 0;
-	size_t i;
-
-	if (!sampv || !sampc)
-		return 0;
-
-	for (i=0; i<sampc; i++)
-		v += abs(sampv[i]);
-
-	return v/sampc;
-}
-
-
 static int audio_print_vu(struct re_printf *pf, int16_t *avg)
 {
 	char buf[16];
@@ -97,22 +82,30 @@ static void print_vumeter(int pos, int color, int value)
 static void enc_tmr_handler(void *arg)
 {
 	struct vumeter_enc *st = arg;
+	struct aulevel lvl;
 
 	tmr_start(&st->tmr, 100, enc_tmr_handler, st);
 
-	if (st->started)
-		print_vumeter(60, 31, st->avg_rec);
+	if (!st->started || !st->au)
+		return;
+
+	audio_level(st->au, &lvl, NULL);
+	print_vumeter(60, 31, lvl.rms);
 }
 
 
 static void dec_tmr_handler(void *arg)
 {
 	struct vumeter_dec *st = arg;
+	struct aulevel lvl;
 
 	tmr_start(&st->tmr, 100, dec_tmr_handler, st);
 
-	if (st->started)
-		print_vumeter(80, 32, st->avg_play);
+	if (!st->started || !st->au)
+		return;
+
+	audio_level(st->au, NULL, &lvl);
+	print_vumeter(80, 32, lvl.rms);
 }
 
 
@@ -121,9 +114,8 @@ static int encode_update(struct aufilt_enc_st **stp, void **ctx,
 {
 	struct vumeter_enc *st;
 	(void)ctx;
-	(void)prm;
 
-	if (!stp || !af)
+	if (!stp || !af || !prm)
 		return EINVAL;
 
 	if (*stp)
@@ -133,6 +125,8 @@ static int encode_update(struct aufilt_enc_st **stp, void **ctx,
 	if (!st)
 		return ENOMEM;
 
+	st->au = prm->au;
+
 	tmr_start(&st->tmr, 100, enc_tmr_handler, st);
 
 	*stp = (struct aufilt_enc_st *)st;
@@ -146,9 +140,8 @@ static int decode_update(struct aufilt_dec_st **stp, void **ctx,
 {
 	struct vumeter_dec *st;
 	(void)ctx;
-	(void)prm;
 
-	if (!stp || !af)
+	if (!stp || !af || !prm)
 		return EINVAL;
 
 	if (*stp)
@@ -158,6 +151,8 @@ static int decode_update(struct aufilt_dec_st **stp, void **ctx,
 	if (!st)
 		return ENOMEM;
 
+	st->au = prm->au;
+
 	tmr_start(&st->tmr, 100, dec_tmr_handler, st);
 
 	*stp = (struct aufilt_dec_st *)st;
@@ -169,8 +164,9 @@ static int decode_update(struct aufilt_dec_st **stp, void **ctx,
 static int encode(struct aufilt_enc_st *st, int16_t *sampv, size_t *sampc)
 {
 	struct vumeter_enc *vu = (void *)st;
+	(void)sampv;
+	(void)sampc;
 
-	vu->avg_rec = calc_avg_s16(sampv, *sampc);
 	vu->started = true;
 
 	return 0;
@@ -180,8 +176,9 @@ static int encode(struct aufilt_enc_st *st, int16_t *sampv, size_t *sampc)
 static int decode(struct aufilt_dec_st *st, int16_t *sampv, size_t *sampc)
 {
 	struct vumeter_dec *vu = (void *)st;
+	(void)sampv;
+	(void)sampc;
 
-	vu->avg_play = calc_avg_s16(sampv, *sampc);
 	vu->started = true;
 
 	return 0;
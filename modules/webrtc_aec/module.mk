@@ -0,0 +1,13 @@
+#
+# module.mk
+#
+# Copyright (C) 2010 Creytiv.com
+#
+
+MOD		:= webrtc_aec
+$(MOD)_SRCS	+= webrtc_aec.cpp
+$(MOD)_LFLAGS	+= $(shell pkg-config --libs webrtc-audio-processing-1) \
+		   -lstdc++
+$(MOD)_CXXFLAGS	+= $(shell pkg-config --cflags webrtc-audio-processing-1)
+
+include mk/mod.mk
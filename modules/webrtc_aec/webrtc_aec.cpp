@@ -0,0 +1,358 @@
+/**
+ * @file webrtc_aec.cpp  WebRTC Acoustic Echo Cancellation (AEC3)
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <time.h>
+#include <pthread.h>
+#include <modules/audio_processing/include/audio_processing.h>
+#include <re.h>
+#include <baresip.h>
+
+
+/**
+ * @defgroup webrtc_aec webrtc_aec
+ *
+ * Acoustic Echo Cancellation (AEC) with AEC3 from the WebRTC audio
+ * processing library
+ *
+ * The echo canceller does not run in the audio filters. The decoder
+ * passes the far-end audio and the encoder the near-end audio through
+ * lock-free rings to a worker thread, which processes them in blocks of
+ * 10 ms. The encoder gets the processed audio back from a third ring,
+ * which delays the sent audio by one packet-time. AEC3 estimates the
+ * delay between the player and the source by itself.
+ */
+
+
+enum {
+	BLOCK_MS = 10,      /* Block size of the audio processing [ms] */
+	WAIT_MS  = 10,      /* Worker wakes up at least this often [ms] */
+	RING_PKT = 8,       /* Ring size in packets                     */
+};
+
+struct aec {
+	webrtc::AudioProcessing *apm;
+	struct auring *farr;        /* far-end, written by the decoder   */
+	struct auring *nearr;       /* near-end, written by the encoder  */
+	struct auring *outr;        /* processed near-end audio          */
+	int16_t *farv;
+	int16_t *nearv;
+	size_t blockc;
+	uint32_t srate;
+	uint8_t ch;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	volatile bool run;
+};
+
+struct enc_st {
+	struct aufilt_enc_st af;  /* base class */
+	struct aec *aec;
+};
+
+struct dec_st {
+	struct aufilt_dec_st af;  /* base class */
+	struct aec *aec;
+};
+
+
+static void enc_destructor(void *arg)
+{
+	struct enc_st *st = (struct enc_st *)arg;
+
+	list_unlink(&st->af.le);
+	mem_deref(st->aec);
+}
+
+
+static void dec_destructor(void *arg)
+{
+	struct dec_st *st = (struct dec_st *)arg;
+
+	list_unlink(&st->af.le);
+	mem_deref(st->aec);
+}
+
+
+static void aec_destructor(void *arg)
+{
+	struct aec *aec = (struct aec *)arg;
+
+	if (aec->run) {
+		pthread_mutex_lock(&aec->mutex);
+		aec->run = false;
+		pthread_cond_signal(&aec->cond);
+		pthread_mutex_unlock(&aec->mutex);
+
+		pthread_join(aec->thread, NULL);
+	}
+
+	delete aec->apm;
+
+	mem_deref(aec->farr);
+	mem_deref(aec->nearr);
+	mem_deref(aec->outr);
+	mem_deref(aec->farv);
+	mem_deref(aec->nearv);
+
+	pthread_cond_destroy(&aec->cond);
+	pthread_mutex_destroy(&aec->mutex);
+}
+
+
+static void worker_wait(struct aec *aec)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_REALTIME, &ts);
+
+	ts.tv_nsec += WAIT_MS * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_nsec -= 1000000000;
+		++ts.tv_sec;
+	}
+
+	pthread_mutex_lock(&aec->mutex);
+	if (aec->run)
+		(void)pthread_cond_timedwait(&aec->cond, &aec->mutex, &ts);
+	pthread_mutex_unlock(&aec->mutex);
+}
+
+
+static void *worker(void *arg)
+{
+	struct aec *aec = (struct aec *)arg;
+	const webrtc::StreamConfig sc(aec->srate, aec->ch);
+
+	while (aec->run) {
+
+		worker_wait(aec);
+
+		/* the far-end must be analyzed before the near-end */
+		while (auring_cur_sampc(aec->farr) >= aec->blockc) {
+
+			(void)auring_read(aec->farr, aec->farv, aec->blockc);
+			(void)aec->apm->ProcessReverseStream(aec->farv, sc, sc,
+							     aec->farv);
+		}
+
+		while (auring_cur_sampc(aec->nearr) >= aec->blockc) {
+
+			(void)auring_read(aec->nearr, aec->nearv,
+					  aec->blockc);
+			(void)aec->apm->ProcessStream(aec->nearv, sc, sc,
+						      aec->nearv);
+			(void)auring_write(aec->outr, aec->nearv,
+					   aec->blockc);
+		}
+	}
+
+	return NULL;
+}
+
+
+static int aec_alloc(struct aec **aecp, void **ctx, struct aufilt_prm *prm)
+{
+	webrtc::AudioProcessing::Config config;
+	struct aec *aec;
+	size_t sampc;
+	int err;
+
+	if (!aecp || !ctx || !prm)
+		return EINVAL;
+
+	if (*ctx) {
+		*aecp = (struct aec *)mem_ref(*ctx);
+		return 0;
+	}
+
+	switch (prm->srate) {
+
+	case 8000:
+	case 16000:
+	case 32000:
+	case 48000:
+		break;
+
+	default:
+		warning("webrtc_aec: unsupported sampling rate %uHz\n",
+			prm->srate);
+		return ENOTSUP;
+	}
+
+	aec = (struct aec *)mem_zalloc(sizeof(*aec), aec_destructor);
+	if (!aec)
+		return ENOMEM;
+
+	pthread_mutex_init(&aec->mutex, NULL);
+	pthread_cond_init(&aec->cond, NULL);
+
+	aec->srate  = prm->srate;
+	aec->ch     = prm->ch;
+	aec->blockc = prm->srate * prm->ch * BLOCK_MS / 1000;
+
+	sampc = prm->srate * prm->ch * prm->ptime / 1000;
+
+	/* the encoder reads one packet behind the worker */
+	err  = auring_alloc(&aec->farr, 0, RING_PKT * sampc);
+	err |= auring_alloc(&aec->nearr, 0, RING_PKT * sampc);
+	err |= auring_alloc(&aec->outr, sampc + aec->blockc,
+			    RING_PKT * sampc);
+	if (err)
+		goto out;
+
+	aec->farv  = (int16_t *)mem_alloc(2 * aec->blockc, NULL);
+	aec->nearv = (int16_t *)mem_alloc(2 * aec->blockc, NULL);
+	if (!aec->farv || !aec->nearv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	aec->apm = webrtc::AudioProcessingBuilder().Create();
+	if (!aec->apm) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	config.echo_canceller.enabled     = true;
+	config.echo_canceller.mobile_mode = false;
+	config.high_pass_filter.enabled   = true;
+
+	aec->apm->ApplyConfig(config);
+
+	aec->run = true;
+	err = pthread_create(&aec->thread, NULL, worker, aec);
+	if (err) {
+		aec->run = false;
+		goto out;
+	}
+
+	info("webrtc_aec: AEC3 loaded: srate = %uHz, channels = %u\n",
+	     prm->srate, prm->ch);
+
+ out:
+	if (err)
+		mem_deref(aec);
+	else
+		*ctx = *aecp = aec;
+
+	return err;
+}
+
+
+static int encode_update(struct aufilt_enc_st **stp, void **ctx,
+			 const struct aufilt *af, struct aufilt_prm *prm)
+{
+	struct enc_st *st;
+	int err;
+
+	if (!stp || !ctx || !af || !prm)
+		return EINVAL;
+
+	if (*stp)
+		return 0;
+
+	st = (struct enc_st *)mem_zalloc(sizeof(*st), enc_destructor);
+	if (!st)
+		return ENOMEM;
+
+	err = aec_alloc(&st->aec, ctx, prm);
+
+	if (err)
+		mem_deref(st);
+	else
+		*stp = (struct aufilt_enc_st *)st;
+
+	return err;
+}
+
+
+static int decode_update(struct aufilt_dec_st **stp, void **ctx,
+			 const struct aufilt *af, struct aufilt_prm *prm)
+{
+	struct dec_st *st;
+	int err;
+
+	if (!stp || !ctx || !af || !prm)
+		return EINVAL;
+
+	if (*stp)
+		return 0;
+
+	st = (struct dec_st *)mem_zalloc(sizeof(*st), dec_destructor);
+	if (!st)
+		return ENOMEM;
+
+	err = aec_alloc(&st->aec, ctx, prm);
+
+	if (err)
+		mem_deref(st);
+	else
+		*stp = (struct aufilt_dec_st *)st;
+
+	return err;
+}
+
+
+/*
+ * @note This function has REAL-TIME properties
+ */
+static int encode(struct aufilt_enc_st *st, int16_t *sampv, size_t *sampc)
+{
+	struct aec *aec = ((struct enc_st *)st)->aec;
+
+	if (!*sampc)
+		return 0;
+
+	(void)auring_write(aec->nearr, sampv, *sampc);
+
+	/* a lost wakeup is covered by the timeout of the worker */
+	pthread_cond_signal(&aec->cond);
+
+	(void)auring_read(aec->outr, sampv, *sampc);
+
+	return 0;
+}
+
+
+/*
+ * @note This function has REAL-TIME properties
+ */
+static int decode(struct aufilt_dec_st *st, int16_t *sampv, size_t *sampc)
+{
+	struct aec *aec = ((struct dec_st *)st)->aec;
+
+	if (*sampc)
+		(void)auring_write(aec->farr, sampv, *sampc);
+
+	return 0;
+}
+
+
+static struct aufilt webrtc_aec = {
+	LE_INIT, "webrtc_aec", encode_update, encode, decode_update, decode
+};
+
+
+static int module_init(void)
+{
+	aufilt_register(&webrtc_aec);
+	return 0;
+}
+
+
+static int module_close(void)
+{
+	aufilt_unregister(&webrtc_aec);
+	return 0;
+}
+
+
+extern "C" const struct mod_export DECL_EXPORTS(webrtc_aec) = {
+	"webrtc_aec",
+	"filter",
+	module_init,
+	module_close
+};
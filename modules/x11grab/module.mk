@@ -8,5 +8,9 @@ MOD		:= x11grab
 $(MOD)_SRCS	+= x11grab.c
 $(MOD)_LFLAGS	+= -L$(SYSROOT)/X11/lib -lX11 -lXext
 $(MOD)_CFLAGS	+= -Wno-variadic-macros
+ifeq ($(HAVE_XDAMAGE),yes)
+$(MOD)_LFLAGS	+= -lXdamage -lXfixes
+$(MOD)_CFLAGS	+= -DHAVE_XDAMAGE
+endif
 
 include mk/mod.mk
@@ -9,8 +9,15 @@
 #ifndef SOLARIS
 #define _XOPEN_SOURCE 1
 #endif
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#ifdef HAVE_XDAMAGE
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
+#endif
 #include <pthread.h>
 #include <re.h>
 #include <rem.h>
@@ -22,15 +29,33 @@
  *
  * X11 window-grabbing video-source module
  *
+ * The screen is grabbed into shared memory with the MIT-SHM extension if
+ * the X server supports it. With the XDamage extension, the screen is
+ * only grabbed when something on it changed. Without shared memory only
+ * the changed part is read from the server. While the screen does not
+ * change, one frame per second is still sent, so that the peer gets
+ * the picture updates it asks for.
+ *
  *
  * XXX: add option to select a specific X window and x,y offset
  */
 
 
+enum {
+	KEEPALIVE_MS = 1000,    /* frame interval of a static screen */
+};
+
 struct vidsrc_st {
 	const struct vidsrc *vs;  /* inheritance */
 	Display *disp;
 	XImage *image;
+	XShmSegmentInfo shm;
+	bool xshmat;
+#ifdef HAVE_XDAMAGE
+	Damage damage;
+	XserverRegion region;
+	int damage_ev;
+#endif
 	pthread_t thread;
 	bool run;
 	int fps;
@@ -43,10 +68,180 @@ struct vidsrc_st {
 
 static struct vidsrc *vidsrc;
 
+static struct {
+	int shm_error;
+	int (*errorh) (Display *, XErrorEvent *);
+} x11;
+
+
+/* NOTE: Global handler */
+static int error_handler(Display *d, XErrorEvent *e)
+{
+	if (e->error_code == BadAccess)
+		x11.shm_error = 1;
+	else if (x11.errorh)
+		return x11.errorh(d, e);
+
+	return 0;
+}
+
+
+static int xshm_open(struct vidsrc_st *st, const struct vidsz *sz)
+{
+	const int scr = DefaultScreen(st->disp);
+
+	if (!XShmQueryExtension(st->disp))
+		return ENOSYS;
+
+	st->image = XShmCreateImage(st->disp, DefaultVisual(st->disp, scr),
+				    DefaultDepth(st->disp, scr), ZPixmap,
+				    NULL, &st->shm, sz->w, sz->h);
+	if (!st->image)
+		return ENOMEM;
+
+	st->shm.shmid = shmget(IPC_PRIVATE,
+			       st->image->bytes_per_line * st->image->height,
+			       IPC_CREAT | 0600);
+	if (st->shm.shmid < 0)
+		return ENOMEM;
+
+	st->shm.shmaddr = shmat(st->shm.shmid, NULL, 0);
+	if (st->shm.shmaddr == (char *)-1)
+		return ENOMEM;
+
+	st->image->data = st->shm.shmaddr;
+	st->shm.readOnly = false;
+
+	x11.shm_error = 0;
+	x11.errorh = XSetErrorHandler(error_handler);
+
+	if (!XShmAttach(st->disp, &st->shm)) {
+		XSetErrorHandler(x11.errorh);
+		return ENOMEM;
+	}
+
+	XSync(st->disp, False);
+	XSetErrorHandler(x11.errorh);
+
+	if (x11.shm_error)
+		return EACCES;
+
+	st->xshmat = true;
+
+	return 0;
+}
+
+
+static void xshm_close(struct vidsrc_st *st)
+{
+	if (st->xshmat) {
+		XShmDetach(st->disp, &st->shm);
+		st->xshmat = false;
+	}
+
+	if (st->image) {
+		/* the data is the shared memory, not freed by Xlib */
+		st->image->data = NULL;
+		XDestroyImage(st->image);
+		st->image = NULL;
+	}
+
+	if (st->shm.shmaddr != (char *)-1) {
+		shmdt(st->shm.shmaddr);
+		st->shm.shmaddr = (char *)-1;
+	}
+
+	if (st->shm.shmid >= 0) {
+		shmctl(st->shm.shmid, IPC_RMID, NULL);
+		st->shm.shmid = -1;
+	}
+}
+
+
+#ifdef HAVE_XDAMAGE
+static void damage_open(struct vidsrc_st *st)
+{
+	int ev_base, err_base;
+
+	if (!XFixesQueryExtension(st->disp, &ev_base, &err_base) ||
+	    !XDamageQueryExtension(st->disp, &st->damage_ev, &err_base)) {
+		info("x11grab: no XDamage, grabbing every frame\n");
+		return;
+	}
+
+	st->region = XFixesCreateRegion(st->disp, NULL, 0);
+	st->damage = XDamageCreate(st->disp,
+				   RootWindow(st->disp,
+					      DefaultScreen(st->disp)),
+				   XDamageReportNonEmpty);
+}
+
+
+/*
+ * Get the bounding box of what changed on the screen since the last
+ * call, clipped to the grabbed area. Returns false if nothing changed.
+ */
+static bool damage_get(struct vidsrc_st *st, struct vidrect *rect)
+{
+	int x0 = st->size.w, y0 = st->size.h, x1 = 0, y1 = 0;
+	bool damaged = false;
+	XRectangle *rv;
+	int i, n;
+
+	if (!st->damage) {
+		rect->x = rect->y = 0;
+		rect->w = st->size.w;
+		rect->h = st->size.h;
+		return true;
+	}
+
+	while (XPending(st->disp)) {
+
+		XEvent ev;
+
+		XNextEvent(st->disp, &ev);
+
+		if (ev.type == st->damage_ev + XDamageNotify)
+			damaged = true;
+	}
+
+	if (!damaged)
+		return false;
+
+	XDamageSubtract(st->disp, st->damage, None, st->region);
+
+	rv = XFixesFetchRegion(st->disp, st->region, &n);
+	for (i=0; i<n; i++) {
+		x0 = min(x0, rv[i].x);
+		y0 = min(y0, rv[i].y);
+		x1 = max(x1, rv[i].x + rv[i].width);
+		y1 = max(y1, rv[i].y + rv[i].height);
+	}
+	if (rv)
+		XFree(rv);
+
+	x0 = max(x0, 0);
+	y0 = max(y0, 0);
+	x1 = min(x1, (int)st->size.w);
+	y1 = min(y1, (int)st->size.h);
+
+	if (x1 <= x0 || y1 <= y0)
+		return false;
+
+	rect->x = x0;
+	rect->y = y0;
+	rect->w = x1 - x0;
+	rect->h = y1 - y0;
+
+	return true;
+}
+#endif
+
 
 static int x11grab_open(struct vidsrc_st *st, const struct vidsz *sz)
 {
 	int x = 0, y = 0;
+	int err;
 
 	st->disp = XOpenDisplay(NULL);
 	if (!st->disp) {
@@ -54,9 +249,16 @@ static int x11grab_open(struct vidsrc_st *st, const struct vidsz *sz)
 		return ENODEV;
 	}
 
-	st->image = XGetImage(st->disp,
-			      RootWindow(st->disp, DefaultScreen(st->disp)),
-			      x, y, sz->w, sz->h, AllPlanes, ZPixmap);
+	err = xshm_open(st, sz);
+	if (err) {
+		info("x11grab: shared memory disabled (%m)\n", err);
+		xshm_close(st);
+
+		st->image = XGetImage(st->disp,
+				      RootWindow(st->disp,
+						 DefaultScreen(st->disp)),
+				      x, y, sz->w, sz->h, AllPlanes, ZPixmap);
+	}
 	if (!st->image) {
 		warning("x11grab: error creating Ximage\n");
 		return ENODEV;
@@ -80,19 +282,32 @@ static int x11grab_open(struct vidsrc_st *st, const struct vidsz *sz)
 		return ENOSYS;
 	}
 
+#ifdef HAVE_XDAMAGE
+	damage_open(st);
+#endif
+
 	return 0;
 }
 
 
-static inline uint8_t *x11grab_read(struct vidsrc_st *st)
+static inline uint8_t *x11grab_read(struct vidsrc_st *st,
+				    const struct vidrect *rect)
 {
-	const int x = 0, y = 0;
+	const Window root = RootWindow(st->disp, DefaultScreen(st->disp));
 	XImage *im;
 
-	im = XGetSubImage(st->disp,
-			  RootWindow(st->disp, DefaultScreen(st->disp)),
-			  x, y, st->size.w, st->size.h, AllPlanes, ZPixmap,
-			  st->image, 0, 0);
+	if (st->xshmat) {
+		if (!XShmGetImage(st->disp, root, st->image, 0, 0, AllPlanes))
+			return NULL;
+
+		return (uint8_t *)st->image->data;
+	}
+
+	/* only the changed part is copied into the image */
+	im = XGetSubImage(st->disp, root,
+			  rect->x, rect->y, rect->w, rect->h,
+			  AllPlanes, ZPixmap,
+			  st->image, rect->x, rect->y);
 	if (!im)
 		return NULL;
 
@@ -113,21 +328,42 @@ static void call_frame_handler(struct vidsrc_st *st, uint8_t *buf)
 static void *read_thread(void *arg)
 {
 	struct vidsrc_st *st = arg;
-	uint64_t ts = tmr_jiffies();
+	uint64_t ts = tmr_jiffies(), last = 0;
+	struct vidrect rect = {0, 0, st->size.w, st->size.h};
+	bool changed = true;
 	uint8_t *buf;
 
 	while (st->run) {
 
-		if (tmr_jiffies() < ts) {
+		uint64_t now = tmr_jiffies();
+
+		if (now < ts) {
 			sys_msleep(4);
 			continue;
 		}
 
-		buf = x11grab_read(st);
-		if (!buf)
+		ts += (1000/st->fps);
+
+#ifdef HAVE_XDAMAGE
+		/* the first frame is always grabbed in full */
+		if (last)
+			changed = damage_get(st, &rect);
+#endif
+
+		if (changed) {
+			buf = x11grab_read(st, &rect);
+			if (!buf)
+				continue;
+		}
+		else if (now < last + KEEPALIVE_MS) {
+			/* nothing changed, the peer has the picture */
 			continue;
+		}
+		else {
+			buf = (uint8_t *)st->image->data;
+		}
 
-		ts += (1000/st->fps);
+		last = now;
 
 		call_frame_handler(st, buf);
 	}
@@ -145,7 +381,16 @@ static void destructor(void *arg)
 		pthread_join(st->thread, NULL);
 	}
 
-	if (st->image)
+#ifdef HAVE_XDAMAGE
+	if (st->damage)
+		XDamageDestroy(st->disp, st->damage);
+	if (st->region)
+		XFixesDestroyRegion(st->disp, st->region);
+#endif
+
+	if (st->shm.shmid >= 0)
+		xshm_close(st);
+	else if (st->image)
 		XDestroyImage(st->image);
 
 	if (st->disp)
@@ -175,6 +420,8 @@ static int alloc(struct vidsrc_st **stp, const struct vidsrc *vs,
 		return ENOMEM;
 
 	st->vs     = vs;
+	st->shm.shmid   = -1;
+	st->shm.shmaddr = (char *)-1;
 	st->size   = *size;
 	st->fps    = prm->fps;
 	st->frameh = frameh;
@@ -25,34 +25,63 @@
  * Thanks:
  *
  *   Ingo Feinerer
+ *
+ * Only the first stream of a call does a Diffie-Hellman exchange. The
+ * other streams are started when it is secure, and use Multistream mode,
+ * with keys derived from the session key. A few sessions are kept ready
+ * with their first stream attached, which computes its DH key pair, so
+ * that this is not done during call setup.
+ *
+ * Example config:
+ \verbatim
+  zrtp_precompute   2       # Sessions with a DH key pair ready
+ \endverbatim
  */
 
 
 enum {
-	PRESZ = 36  /* Preamble size for TURN/STUN header */
+	PRESZ = 36,       /* Preamble size for TURN/STUN header */
+	POOL_TICK = 50,   /* Interval for computing the next session [ms] */
 };
 
 struct menc_sess {
+	struct le le;                 /* Element of the pool */
 	zrtp_session_t *zrtp_session;
+	zrtp_stream_t *zrtp_stream;   /* Attached in advance, not used yet */
+	struct list medial;
+	bool secure;                  /* First stream is secure */
 };
 
 struct menc_media {
-	const struct menc_sess *sess;
+	struct le le;
+	struct menc_sess *sess;
 	struct udp_helper *uh;
 	struct sa raddr;
 	void *rtpsock;
 	zrtp_stream_t *zrtp_stream;
+	uint32_t ssrc;
+	bool started;
+	bool pending;                 /* Waits for the first stream */
 };
 
 
 static zrtp_global_t *zrtp_global;
 static zrtp_config_t zrtp_config;
+static zrtp_profile_t zrtp_profile;
+static struct list pool;
+static struct tmr tmr_pool;
+static uint32_t pool_size = 2;
 
 
 static void session_destructor(void *arg)
 {
 	struct menc_sess *st = arg;
 
+	list_unlink(&st->le);
+
+	if (st->zrtp_stream)
+		zrtp_stream_stop(st->zrtp_stream);
+
 	if (st->zrtp_session)
 		zrtp_session_down(st->zrtp_session);
 }
@@ -62,6 +91,7 @@ static void media_destructor(void *arg)
 {
 	struct menc_media *st = arg;
 
+	list_unlink(&st->le);
 	mem_deref(st->uh);
 	mem_deref(st->rtpsock);
 
@@ -124,24 +154,21 @@ static bool udp_helper_recv(struct sa *src, struct mbuf *mb, void *arg)
 }
 
 
-static int session_alloc(struct menc_sess **sessp, struct sdp_session *sdp,
-			 bool offerer, menc_error_h *errorh, void *arg)
+/*
+ * A session with its first stream attached. Attaching the stream
+ * computes its DH key pair, which is the expensive part of the setup.
+ */
+static int sess_create(struct menc_sess **sessp)
 {
 	struct menc_sess *st;
 	zrtp_status_t s;
 	int err = 0;
-	(void)offerer;
-	(void)errorh;
-	(void)arg;
-
-	if (!sessp || !sdp)
-		return EINVAL;
 
 	st = mem_zalloc(sizeof(*st), session_destructor);
 	if (!st)
 		return ENOMEM;
 
-	s = zrtp_session_init(zrtp_global, NULL,
+	s = zrtp_session_init(zrtp_global, &zrtp_profile,
 			      ZRTP_SIGNALING_ROLE_UNKNOWN, &st->zrtp_session);
 	if (s != zrtp_status_ok) {
 		warning("zrtp: zrtp_session_init failed (status = %d)\n", s);
@@ -149,6 +176,13 @@ static int session_alloc(struct menc_sess **sessp, struct sdp_session *sdp,
 		goto out;
 	}
 
+	s = zrtp_stream_attach(st->zrtp_session, &st->zrtp_stream);
+	if (s != zrtp_status_ok) {
+		warning("zrtp: zrtp_stream_attach failed (status=%d)\n", s);
+		err = EPROTO;
+		goto out;
+	}
+
  out:
 	if (err)
 		mem_deref(st);
@@ -159,6 +193,67 @@ static int session_alloc(struct menc_sess **sessp, struct sdp_session *sdp,
 }
 
 
+/* One session per tick, the main loop is not held up for long */
+static void pool_handler(void *arg)
+{
+	struct menc_sess *st;
+	(void)arg;
+
+	if (list_count(&pool) >= pool_size)
+		return;
+
+	if (sess_create(&st))
+		return;
+
+	list_append(&pool, &st->le, st);
+
+	tmr_start(&tmr_pool, POOL_TICK, pool_handler, NULL);
+}
+
+
+static int session_alloc(struct menc_sess **sessp, struct sdp_session *sdp,
+			 bool offerer, menc_error_h *errorh, void *arg)
+{
+	struct menc_sess *st;
+	int err;
+	(void)offerer;
+	(void)errorh;
+	(void)arg;
+
+	if (!sessp || !sdp)
+		return EINVAL;
+
+	st = list_ledata(list_head(&pool));
+	if (st) {
+		list_unlink(&st->le);
+		tmr_start(&tmr_pool, POOL_TICK, pool_handler, NULL);
+	}
+	else {
+		err = sess_create(&st);
+		if (err)
+			return err;
+	}
+
+	*sessp = st;
+
+	return 0;
+}
+
+
+static void stream_start(struct menc_media *st)
+{
+	zrtp_status_t s;
+
+	st->started = true;
+	st->pending = false;
+
+	s = zrtp_stream_start(st->zrtp_stream, st->ssrc);
+	if (s != zrtp_status_ok) {
+		warning("zrtp: zrtp_stream_start: status = %d\n", s);
+	}
+}
+
+
 static int media_alloc(struct menc_media **stp, struct menc_sess *sess,
 		       struct rtp_sock *rtp,
 		       int proto, void *rtpsock, void *rtcpsock,
@@ -183,17 +278,26 @@ static int media_alloc(struct menc_media **stp, struct menc_sess *sess,
 
 	st->sess = sess;
 	st->rtpsock = mem_ref(rtpsock);
+	list_append(&sess->medial, &st->le, st);
 
 	err = udp_register_helper(&st->uh, rtpsock, layer,
 				  udp_helper_send, udp_helper_recv, st);
 	if (err)
 		goto out;
 
-	s = zrtp_stream_attach(sess->zrtp_session, &st->zrtp_stream);
-	if (s != zrtp_status_ok) {
-		warning("zrtp: zrtp_stream_attach failed (status=%d)\n", s);
-		err = EPROTO;
-		goto out;
+	/* the first stream was attached in advance */
+	if (sess->zrtp_stream) {
+		st->zrtp_stream = sess->zrtp_stream;
+		sess->zrtp_stream = NULL;
+	}
+	else {
+		s = zrtp_stream_attach(sess->zrtp_session, &st->zrtp_stream);
+		if (s != zrtp_status_ok) {
+			warning("zrtp: zrtp_stream_attach failed"
+				" (status=%d)\n", s);
+			err = EPROTO;
+			goto out;
+		}
 	}
 
 	zrtp_stream_set_userdata(st->zrtp_stream, st);
@@ -208,12 +312,28 @@ static int media_alloc(struct menc_media **stp, struct menc_sess *sess,
 
  start:
 	if (sa_isset(sdp_media_raddr(sdpm), SA_ALL)) {
+
+		struct le *le;
+		bool dh = false;
+
 		st->raddr = *sdp_media_raddr(sdpm);
+		st->ssrc  = rtp_sess_ssrc(rtp);
 
-		s = zrtp_stream_start(st->zrtp_stream, rtp_sess_ssrc(rtp));
-		if (s != zrtp_status_ok) {
-			warning("zrtp: zrtp_stream_start: status = %d\n", s);
+		if (st->started)
+			return 0;
+
+		for (le = sess->medial.head; le; le = le->next) {
+			const struct menc_media *m = le->data;
+
+			if (m != st && m->started)
+				dh = true;
 		}
+
+		/* Multistream mode once the DH stream is secure */
+		if (dh && !sess->secure)
+			st->pending = true;
+		else
+			stream_start(st);
 	}
 
 	return err;
@@ -254,8 +374,21 @@ static int on_send_packet(const zrtp_stream_t *stream,
 static void on_zrtp_secure(zrtp_stream_t *stream)
 {
 	const struct menc_media *st = zrtp_stream_get_userdata(stream);
-	const struct menc_sess *sess = st->sess;
+	struct menc_sess *sess = st->sess;
 	zrtp_session_info_t sess_info;
+	struct le *le;
+
+	if (!sess->secure) {
+
+		sess->secure = true;
+
+		for (le = sess->medial.head; le; le = le->next) {
+			struct menc_media *m = le->data;
+
+			if (m->pending)
+				stream_start(m);
+		}
+	}
 
 	zrtp_session_get(sess->zrtp_session, &sess_info);
 	if (!sess_info.sas_is_verified && sess_info.sas_is_ready) {
@@ -315,6 +448,23 @@ static const struct cmd cmdv[] = {
 };
 
 
+/* Multistream mode must be in the profile of the sessions */
+static void profile_init(void)
+{
+	size_t i;
+
+	zrtp_profile_defaults(&zrtp_profile, zrtp_global);
+
+	for (i=0; i<ZRTP_MAX_COMP_COUNT && zrtp_profile.pk_schemes[i]; i++) {
+		if (zrtp_profile.pk_schemes[i] == ZRTP_PKTYPE_MULT)
+			return;
+	}
+
+	if (i < ZRTP_MAX_COMP_COUNT)
+		zrtp_profile.pk_schemes[i] = ZRTP_PKTYPE_MULT;
+}
+
+
 static int module_init(void)
 {
 	zrtp_status_t s;
@@ -377,6 +527,12 @@ static int module_init(void)
 		return ENOSYS;
 	}
 
+	profile_init();
+
+	(void)conf_get_u32(conf_cur(), "zrtp_precompute", &pool_size);
+
+	tmr_start(&tmr_pool, POOL_TICK, pool_handler, NULL);
+
 	menc_register(baresip_mencl(), &menc_zrtp);
 
 	debug("zrtp:  cache_file:  %s\n",
@@ -394,6 +550,9 @@ static int module_close(void)
 	cmd_unregister(baresip_commands(), cmdv);
 	menc_unregister(&menc_zrtp);
 
+	tmr_cancel(&tmr_pool);
+	list_flush(&pool);
+
 	if (zrtp_global) {
 		zrtp_down(zrtp_global);
 		zrtp_global = NULL;
@@ -21,6 +21,12 @@ static void destructor(void *arg)
 
 	list_clear(&acc->aucodecl);
 	list_clear(&acc->vidcodecl);
+	list_clear(&acc->aucodec_sdp);
+	mem_deref(acc->acv);
+	mem_deref(acc->vcv);
+	mem_deref(acc->aucodecv);
+	mem_deref(acc->vidcodecv);
+	mem_deref(acc->acv_sdp);
 	mem_deref(acc->auth_user);
 	mem_deref(acc->auth_pass);
 	for (i=0; i<ARRAY_SIZE(acc->outboundv); i++)
@@ -185,9 +191,50 @@ static int csl_parse(struct pl *pl, char *str, size_t sz)
 }
 
 
+/* Append a codec to a growing array of codec pointers */
+static int codecv_append(void ***vp, size_t *np, void *codec)
+{
+	void **v;
+
+	v = mem_realloc(*vp, (*np + 1) * sizeof(*v));
+	if (!v)
+		return ENOMEM;
+
+	v[(*np)++] = codec;
+	*vp = v;
+
+	return 0;
+}
+
+
+/*
+ * The list of an array of codecs, for the users of the list API. The
+ * elements are allocated in one block, in the order of the array.
+ */
+static int codecl_build(struct list *l, struct le **levp, void **v, size_t n)
+{
+	size_t i;
+
+	list_init(l);
+
+	if (!n)
+		return 0;
+
+	*levp = mem_zalloc(n * sizeof(**levp), NULL);
+	if (!*levp)
+		return ENOMEM;
+
+	for (i=0; i<n; i++)
+		list_append(l, &(*levp)[i], v[i]);
+
+	return 0;
+}
+
+
 static int audio_codecs_decode(struct account *acc, const struct pl *prm)
 {
 	struct pl tmp;
+	int err;
 
 	if (!acc || !prm)
 		return EINVAL;
@@ -197,7 +244,6 @@ static int audio_codecs_decode(struct account *acc, const struct pl *prm)
 	if (0 == msg_param_exists(prm, "audio_codecs", &tmp)) {
 		struct pl acs;
 		char cname[64];
-		unsigned i = 0;
 
 		if (msg_param_decode(prm, "audio_codecs", &acs))
 			return 0;
@@ -228,12 +274,15 @@ static int audio_codecs_decode(struct account *acc, const struct pl *prm)
 				continue;
 			}
 
-			/* NOTE: static list with references to aucodec */
-			list_append(&acc->aucodecl, &acc->acv[i++], ac);
-
-			if (i >= ARRAY_SIZE(acc->acv))
-				break;
+			/* NOTE: references to the registered aucodec */
+			err = codecv_append((void ***)&acc->aucodecv,
+					    &acc->aucodecc, ac);
+			if (err)
+				return err;
 		}
+
+		return codecl_build(&acc->aucodecl, &acc->acv,
+				    (void **)acc->aucodecv, acc->aucodecc);
 	}
 
 	return 0;
@@ -244,6 +293,7 @@ static int audio_codecs_decode(struct account *acc, const struct pl *prm)
 static int video_codecs_decode(struct account *acc, const struct pl *prm)
 {
 	struct pl tmp;
+	int err;
 
 	if (!acc || !prm)
 		return EINVAL;
@@ -253,7 +303,6 @@ static int video_codecs_decode(struct account *acc, const struct pl *prm)
 	if (0 == msg_param_exists(prm, "video_codecs", &tmp)) {
 		struct pl vcs;
 		char cname[64];
-		unsigned i = 0;
 
 		if (msg_param_decode(prm, "video_codecs", &vcs))
 			return 0;
@@ -268,12 +317,15 @@ static int video_codecs_decode(struct account *acc, const struct pl *prm)
 				continue;
 			}
 
-			/* NOTE: static list with references to vidcodec */
-			list_append(&acc->vidcodecl, &acc->vcv[i++], vc);
-
-			if (i >= ARRAY_SIZE(acc->vcv))
-				break;
+			/* NOTE: references to the registered vidcodec */
+			err = codecv_append((void ***)&acc->vidcodecv,
+					    &acc->vidcodecc, vc);
+			if (err)
+				return err;
 		}
+
+		return codecl_build(&acc->vidcodecl, &acc->vcv,
+				    (void **)acc->vidcodecv, acc->vidcodecc);
 	}
 
 	return 0;
@@ -481,6 +533,68 @@ struct list *account_aucodecl(const struct account *acc)
 }
 
 
+/**
+ * Get the audio-codecs of an account that can be offered with the audio
+ * config. The codecs are checked once, and again only after a codec was
+ * registered or unregistered, or the audio config has changed.
+ *
+ * @param acc User-Agent account
+ * @param cfg Audio configuration
+ *
+ * @return List of audio-codecs
+ */
+struct list *account_aucodec_sdp(struct account *acc,
+				 const struct config_audio *cfg)
+{
+	const struct list *codecl;
+	struct le *le;
+	size_t i, n = 0;
+
+	if (!acc || !cfg)
+		return NULL;
+
+	if (acc->aucodec_gen == aucodec_generation() &&
+	    !memcmp(&acc->aucodec_srate, &cfg->srate, sizeof(cfg->srate)) &&
+	    !memcmp(&acc->aucodec_ch, &cfg->channels, sizeof(cfg->channels)))
+		return &acc->aucodec_sdp;
+
+	list_clear(&acc->aucodec_sdp);
+	acc->acv_sdp = mem_deref(acc->acv_sdp);
+	acc->aucodec_gen = 0;
+
+	codecl = aucodec_list();
+
+	acc->acv_sdp = mem_zalloc((max(acc->aucodecc, list_count(codecl))
+				   + 1) * sizeof(*le), NULL);
+	if (!acc->acv_sdp)
+		return &acc->aucodec_sdp;
+
+	/* the preferences of the account are walked as an array */
+	for (i=0; i<acc->aucodecc; i++) {
+		struct aucodec *ac = acc->aucodecv[i];
+
+		if (audio_codec_usable(cfg, ac))
+			list_append(&acc->aucodec_sdp, &acc->acv_sdp[n++], ac);
+	}
+
+	for (le = list_head(codecl); le; le = le->next) {
+		struct aucodec *ac = le->data;
+
+		if (acc->aucodecc)
+			break;
+
+		if (audio_codec_usable(cfg, ac))
+			list_append(&acc->aucodec_sdp, &acc->acv_sdp[n++], ac);
+	}
+
+	acc->aucodec_gen   = aucodec_generation();
+	acc->aucodec_srate = cfg->srate;
+	acc->aucodec_ch    = cfg->channels;
+
+	return &acc->aucodec_sdp;
+}
+
+
 #ifdef USE_VIDEO
 struct list *account_vidcodecl(const struct account *acc)
 {
@@ -583,6 +697,19 @@ const char *account_stun_pass(const struct account *acc)
 }
 
 
+/**
+ * Get the SIP address that the account was allocated from
+ *
+ * @param acc User-Agent account
+ *
+ * @return SIP address string
+ */
+const char *account_sipaddr(const struct account *acc)
+{
+	return acc ? acc->buf : NULL;
+}
+
+
 /**
  * Get the STUN hostname of an account
  *
@@ -610,7 +737,6 @@ static const char *answermode_str(enum answermode mode)
 
 int account_debug(struct re_printf *pf, const struct account *acc)
 {
-	struct le *le;
 	size_t i;
 	int err = 0;
 
@@ -626,10 +752,10 @@ int account_debug(struct re_printf *pf, const struct account *acc)
 	err |= re_hprintf(pf, " dispname:     %s\n", acc->dispname);
 	err |= re_hprintf(pf, " answermode:   %s\n",
 			  answermode_str(acc->answermode));
-	if (!list_isempty(&acc->aucodecl)) {
+	if (acc->aucodecc) {
 		err |= re_hprintf(pf, " audio_codecs:");
-		for (le = list_head(&acc->aucodecl); le; le = le->next) {
-			const struct aucodec *ac = le->data;
+		for (i=0; i<acc->aucodecc; i++) {
+			const struct aucodec *ac = acc->aucodecv[i];
 			err |= re_hprintf(pf, " %s/%u/%u",
 					  ac->name, ac->srate, ac->ch);
 		}
@@ -654,10 +780,10 @@ int account_debug(struct re_printf *pf, const struct account *acc)
 	err |= re_hprintf(pf, " sipnat:       %s\n", acc->sipnat);
 	err |= re_hprintf(pf, " stunserver:   stun:%s@%s:%u\n",
 			  acc->stun_user, acc->stun_host, acc->stun_port);
-	if (!list_isempty(&acc->vidcodecl)) {
+	if (acc->vidcodecc) {
 		err |= re_hprintf(pf, " video_codecs:");
-		for (le = list_head(&acc->vidcodecl); le; le = le->next) {
-			const struct vidcodec *vc = le->data;
+		for (i=0; i<acc->vidcodecc; i++) {
+			const struct vidcodec *vc = acc->vidcodecv[i];
 			err |= re_hprintf(pf, " %s", vc->name);
 		}
 		err |= re_hprintf(pf, "\n");
@@ -0,0 +1,245 @@
+/**
+ * @file admit.c  Admission control of calls
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * Each call holds an estimate of what it costs: CPU, bandwidth and
+ * local RTP ports. The estimate is made when the call is allocated,
+ * from the media it was offered, and again when the media has been
+ * agreed on. The CPU cost is in units of a tenth of a G.711 call; a
+ * video stream costs by its pixel rate, both ways, and more for each
+ * video filter. An HD video call at 30 fps is about 50 audio calls.
+ *
+ * A new call is admitted if its cost fits in what is left of each
+ * resource. When only the audio fits, or the CPU governor has started
+ * to lower the video frame-rate, the call is answered without video.
+ *
+ * The calls of all event loops share the resources, see shard_lock().
+ */
+
+
+enum {
+	AUDIO_CPU   = 10,        /**< CPU cost of an audio stream [units] */
+	AUDIO_KBPS  = 200,       /**< Both ways, with overhead [kbit/s]   */
+	VIDEO_PIXEL = 100000,    /**< Pixels per second for one CPU unit  */
+};
+
+static struct {
+	struct admit_cost used;
+	uint32_t n_accept;
+	uint32_t n_audio;
+	uint32_t n_reject;
+} adm;
+
+
+static void estimate(struct admit_cost *cost, unsigned n_video)
+{
+	const struct config *cfg = conf_config();
+	uint64_t cpu = 0;
+
+	cost->cpu   = AUDIO_CPU;
+	cost->kbps  = AUDIO_KBPS;
+	cost->ports = 1 + n_video;
+
+	if (!n_video || !cfg)
+		return;
+
+	cpu = (uint64_t)cfg->video.width * cfg->video.height * cfg->video.fps
+		* 2 / VIDEO_PIXEL;
+	cpu += cpu * list_count(vidfilt_list()) / 4;
+
+	cost->cpu  += (uint32_t)(cpu * n_video);
+	cost->kbps += 2 * cfg->video.bitrate / 1000 * n_video;
+}
+
+
+static bool fits(const struct admit_cost *cost,
+		 const struct rtpport_stat *ps)
+{
+	const struct config *cfg = conf_config();
+
+	if (!cfg)
+		return true;
+
+	if (cfg->call.capacity &&
+	    adm.used.cpu + cost->cpu > cfg->call.capacity)
+		return false;
+
+	if (cfg->call.bandwidth &&
+	    adm.used.kbps + cost->kbps > cfg->call.bandwidth)
+		return false;
+
+	if (ps->total && ps->free < cost->ports)
+		return false;
+
+	return true;
+}
+
+
+/**
+ * Decide if a new call is admitted
+ *
+ * @param video True if the call was offered video
+ *
+ * @return ADMIT_ACCEPT, ADMIT_AUDIO to answer without video, or
+ *         ADMIT_REJECT
+ */
+enum admit_result admit_call(bool video)
+{
+	struct admit_cost cost;
+	struct rtpport_stat ps;
+	enum admit_result res;
+
+	if (rtpport_stats(&ps))
+		memset(&ps, 0, sizeof(ps));
+
+	shard_lock();
+
+	if (video && governor_level() < GOV_VIDEO) {
+
+		estimate(&cost, 1);
+		if (fits(&cost, &ps)) {
+			++adm.n_accept;
+			res = ADMIT_ACCEPT;
+			goto out;
+		}
+	}
+
+	estimate(&cost, 0);
+	if (fits(&cost, &ps)) {
+
+		if (video)
+			++adm.n_audio;
+		else
+			++adm.n_accept;
+
+		res = video ? ADMIT_AUDIO : ADMIT_ACCEPT;
+		goto out;
+	}
+
+	++adm.n_reject;
+	res = ADMIT_REJECT;
+
+ out:
+	shard_unlock();
+
+	return res;
+}
+
+
+/**
+ * Set the cost of a call, the old cost is released
+ *
+ * @param cost    Cost of the call
+ * @param n_video Number of video streams
+ */
+void admit_update(struct admit_cost *cost, unsigned n_video)
+{
+	if (!cost)
+		return;
+
+	admit_release(cost);
+	estimate(cost, n_video);
+
+	shard_lock();
+	adm.used.cpu   += cost->cpu;
+	adm.used.kbps  += cost->kbps;
+	adm.used.ports += cost->ports;
+	shard_unlock();
+}
+
+
+/**
+ * Release the cost of a call
+ *
+ * @param cost Cost of the call, which is cleared
+ */
+void admit_release(struct admit_cost *cost)
+{
+	if (!cost)
+		return;
+
+	shard_lock();
+	adm.used.cpu   -= min(cost->cpu, adm.used.cpu);
+	adm.used.kbps  -= min(cost->kbps, adm.used.kbps);
+	adm.used.ports -= min(cost->ports, adm.used.ports);
+	shard_unlock();
+
+	memset(cost, 0, sizeof(*cost));
+}
+
+
+/**
+ * Get the resources in use and the capacity of the node
+ *
+ * @param st Admission statistics
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int admit_stats(struct admit_stat *st)
+{
+	const struct config *cfg = conf_config();
+	struct rtpport_stat ps;
+
+	if (!st)
+		return EINVAL;
+
+	memset(st, 0, sizeof(*st));
+
+	shard_lock();
+	st->used     = adm.used;
+	st->n_accept = adm.n_accept;
+	st->n_audio  = adm.n_audio;
+	st->n_reject = adm.n_reject;
+	shard_unlock();
+
+	if (cfg) {
+		st->capacity.cpu  = cfg->call.capacity;
+		st->capacity.kbps = cfg->call.bandwidth;
+	}
+
+	if (!rtpport_stats(&ps))
+		st->capacity.ports = ps.total;
+
+	return 0;
+}
+
+
+/**
+ * Print the admission control status
+ *
+ * @param pf     Print handler
+ * @param unused Unused parameter
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int admit_debug(struct re_printf *pf, void *unused)
+{
+	struct admit_stat st;
+	int err;
+	(void)unused;
+
+	err = admit_stats(&st);
+	if (err)
+		return err;
+
+	err  = re_hprintf(pf, "admission control:\n");
+	err |= re_hprintf(pf, " cpu:       %u / %u units\n",
+			  st.used.cpu, st.capacity.cpu);
+	err |= re_hprintf(pf, " bandwidth: %u / %u kbit/s\n",
+			  st.used.kbps, st.capacity.kbps);
+	err |= re_hprintf(pf, " ports:     %u / %u\n",
+			  st.used.ports, st.capacity.ports);
+	err |= re_hprintf(pf, " calls:     %u accepted, %u audio-only,"
+			  " %u rejected\n",
+			  st.n_accept, st.n_audio, st.n_reject);
+
+	return err;
+}
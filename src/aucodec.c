@@ -9,7 +9,17 @@
 #include "core.h"
 
 
+enum { CODEC_HASH_SIZE = 32 };
+
+struct find {
+	const char *name;
+	uint32_t srate;
+	uint8_t ch;
+};
+
 static struct list aucodecl;
+static struct hash *aucodech;    /* the codecs by name, for lookups */
+static uint32_t generation = 1;
 
 
 /**
@@ -22,7 +32,13 @@ void aucodec_register(struct aucodec *ac)
 	if (!ac)
 		return;
 
+	if (!aucodech && hash_alloc(&aucodech, CODEC_HASH_SIZE))
+		return;
+
 	list_append(&aucodecl, &ac->le, ac);
+	hash_append(aucodech, hash_joaat_ci(ac->name, str_len(ac->name)),
+		    &ac->he, ac);
+	++generation;
 
 	info("aucodec: %s/%u/%u\n", ac->name, ac->srate, ac->ch);
 }
@@ -39,31 +55,55 @@ void aucodec_unregister(struct aucodec *ac)
 		return;
 
 	list_unlink(&ac->le);
+	hash_unlink(&ac->he);
+	++generation;
+
+	if (list_isempty(&aucodecl))
+		aucodech = mem_deref(aucodech);
 }
 
 
-const struct aucodec *aucodec_find(const char *name, uint32_t srate,
-				   uint8_t ch)
+static bool find_handler(struct le *le, void *arg)
 {
-	struct le *le;
+	const struct aucodec *ac = le->data;
+	const struct find *f = arg;
 
-	for (le=aucodecl.head; le; le=le->next) {
+	if (f->name && 0 != str_casecmp(f->name, ac->name))
+		return false;
 
-		struct aucodec *ac = le->data;
+	if (f->srate && f->srate != ac->srate)
+		return false;
 
-		if (name && 0 != str_casecmp(name, ac->name))
-			continue;
+	if (f->ch && f->ch != ac->ch)
+		return false;
 
-		if (srate && srate != ac->srate)
-			continue;
+	return true;
+}
 
-		if (ch && ch != ac->ch)
-			continue;
 
-		return ac;
+/**
+ * Find an Audio Codec, the first registered codec that matches
+ *
+ * @param name  Name of the codec, or NULL for any
+ * @param srate Sample rate, or 0 for any
+ * @param ch    Number of channels, or 0 for any
+ *
+ * @return Matching Audio Codec if found, otherwise NULL
+ */
+const struct aucodec *aucodec_find(const char *name, uint32_t srate,
+				   uint8_t ch)
+{
+	struct find f = {name, srate, ch};
+
+	/* the codecs with the same name are in order of registration */
+	if (name) {
+		return list_ledata(hash_lookup(aucodech,
+					       hash_joaat_ci(name,
+							     str_len(name)),
+					       find_handler, &f));
 	}
 
-	return NULL;
+	return list_ledata(list_apply(&aucodecl, true, find_handler, &f));
 }
 
 
@@ -74,3 +114,15 @@ struct list *aucodec_list(void)
 {
 	return &aucodecl;
 }
+
+
+/**
+ * Get the generation of the list of Audio Codecs, it changes when a
+ * codec is registered or unregistered
+ *
+ * @return Generation number, never 0
+ */
+uint32_t aucodec_generation(void)
+{
+	return generation;
+}
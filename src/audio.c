@@ -8,6 +8,7 @@
 #define _BSD_SOURCE 1
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -53,7 +54,35 @@
  */
 
 enum {
-	AUDIO_SAMPSZ    = 3*1920  /* Max samples, 48000Hz 2ch at 60ms */
+	AUDIO_CHSAMP    = 2880,   /* Max samples per ch, 48000Hz 60ms */
+	DRIFT_FACTOR    = 3,      /* Max samples after drift comp.    */
+	DTX_HANGOVER    = 200,    /* Silence before sending stops [ms] */
+	CN_INTERVAL     = 500,    /* Comfort Noise update interval [ms] */
+	PTIME_LOSS_HIGH = 256*5/100, /* Loss that increases ptime [1/256] */
+	PTIME_LOSS_LOW  = 256*1/100, /* Loss that allows a decrease       */
+	PTIME_RTT_HIGH  = 400000, /* RTT that increases ptime [us]     */
+	PTIME_RTT_LOW   = 250000, /* RTT that allows a decrease [us]   */
+	PTIME_GOOD      = 3,      /* Good reports before a decrease    */
+	RED_RX_BLOCKS   = 8,      /* Max. blocks of a received RED packet */
+};
+
+
+/* Class of a local payload type, for the dispatch of received packets */
+enum pt_class {
+	PTC_NONE = 0,    /* Not negotiated          */
+	PTC_AUDIO,       /* Audio codec             */
+	PTC_TELEV,       /* Telephone events        */
+	PTC_CN,          /* Comfort Noise           */
+	PTC_FEC,         /* Forward Error Correction */
+	PTC_RED,         /* Redundant audio data    */
+};
+
+
+/** Encoder made ahead of a codec change, switched to between frames */
+struct enc_next {
+	const struct aucodec *ac;     /**< Audio codec                     */
+	struct auenc_state *enc;      /**< Encoder state (optional)        */
+	int pt;                       /**< Payload type of encoder         */
 };
 
 
@@ -75,24 +104,50 @@ enum {
  *
  */
 struct autx {
-	struct ausrc_st *ausrc;       /**< Audio Source                    */
+	struct ausrc_sub *ausrc;      /**< Audio Source                    */
 	struct ausrc_prm ausrc_prm;   /**< Audio Source parameters         */
 	const struct aucodec *ac;     /**< Current audio encoder           */
 	struct auenc_state *enc;      /**< Audio encoder state (optional)  */
+	char *enc_fmtp;               /**< Format parameters of encoder    */
+	struct enc_next *enc_next;    /**< Encoder to switch to, or NULL   */
+	struct enc_next *enc_old;     /**< Switched out, freed by main     */
+	int pt;                       /**< Payload type of encoder         */
+	int pt_telev;                 /**< Remote telephone-event PT or -1 */
+	int pt_cn;                    /**< Remote Comfort Noise PT or -1   */
+	int pt_red;                   /**< Remote RED payload type or -1   */
+	uint32_t red_crate;           /**< Clock rate of the RED format    */
+	struct red_enc red;           /**< Previous frames for RED         */
 	struct aubuf *aubuf;          /**< Packetize outgoing stream       */
-	struct auresamp resamp;       /**< Optional resampler for DSP      */
+	struct auring *ring;          /**< Lock-free buffer (alternative)  */
+	struct resamp *resamp;        /**< Optional resampler for DSP      */
 	struct list filtl;            /**< Audio filters in encoding order */
 	struct mbuf *mb;              /**< Buffer for outgoing RTP packets */
+	struct aulevel level;         /**< Level of the last sent frame    */
 	char device[64];              /**< Audio source device name        */
-	int16_t *sampv;               /**< Sample buffer                   */
-	int16_t *sampv_rs;            /**< Sample buffer for resampler     */
+	int16_t *sampv_dr;            /**< Sample buffer for drift         */
+	float *sampv_f;               /**< Float sample buffer (optional)  */
+	float *sampv_cv;              /**< Buffer for device conversion    */
+	struct audrift *drift;        /**< Optional drift compensation     */
+	int fmt;                      /**< Sample format of the buffer     */
 	uint32_t ptime;               /**< Packet time for sending         */
+	uint32_t ptime_neg;           /**< Negotiated packet time          */
+	uint32_t ptime_max;           /**< Max. packet time of peer, or 0  */
+	uint32_t ptime_next;          /**< Adapted packet time, to apply   */
+	unsigned ptime_good;          /**< Good reports in a row           */
 	uint32_t ts;                  /**< Timestamp for outgoing RTP      */
 	uint32_t ts_tel;              /**< Timestamp for Telephony Events  */
+	uint32_t dtx_ms;              /**< Duration of silence [ms]        */
+	uint32_t cn_ms;               /**< Time since last CN packet [ms]  */
+	int vad;                      /**< Voice activity of filters or -1 */
 	size_t psize;                 /**< Packet size for sending         */
+	size_t sampsz;                /**< Max samples of a frame          */
 	bool marker;                  /**< Marker bit for outgoing RTP     */
 	bool muted;                   /**< Audio source is muted           */
+	bool direct;                  /**< Encode from the source callback */
+	uint64_t n_direct;            /**< Frames encoded from the source  */
+	uint32_t gain;                /**< Audio source gain [%]           */
 	int cur_key;                  /**< Currently transmitted event     */
+	struct pipeprof prof;           /**< Optional per-stage timing       */
 
 	union {
 		struct tmr tmr;       /**< Timer for sending RTP packets   */
@@ -100,8 +155,12 @@ struct autx {
 		struct {
 			pthread_t tid;/**< Audio transmit thread           */
 			bool run;     /**< Audio transmit thread running   */
+			pthread_mutex_t mutex; /**< Protects cond (event)  */
+			pthread_cond_t cond;   /**< Signalled per frame    */
+			bool up;      /**< Mutex and cond are initialized  */
 		} thr;
 #endif
+		struct txpool_entry pool; /**< Shared transmit pool entry */
 	} u;
 };
 
@@ -122,18 +181,38 @@ struct autx {
  \endverbatim
  */
 struct aurx {
-	struct auplay_st *auplay;     /**< Audio Player                    */
+	struct auplay_sub *auplay;    /**< Audio Player                    */
 	struct auplay_prm auplay_prm; /**< Audio Player parameters         */
 	const struct aucodec *ac;     /**< Current audio decoder           */
 	struct audec_state *dec;      /**< Audio decoder state (optional)  */
+	struct stream *strm;          /**< Media stream, for statistics    */
 	struct aubuf *aubuf;          /**< Incoming audio buffer           */
-	struct auresamp resamp;       /**< Optional resampler for DSP      */
+	struct auring *ring;          /**< Lock-free buffer (alternative)  */
+	struct resamp *resamp;        /**< Optional resampler for DSP      */
+	struct wsola *wsola;          /**< Optional time-stretching        */
 	struct list filtl;            /**< Audio filters in decoding order */
+	struct aulevel level;         /**< Level of the last decoded frame */
 	char device[64];              /**< Audio player device name        */
-	int16_t *sampv;               /**< Sample buffer                   */
-	int16_t *sampv_rs;            /**< Sample buffer for resampler     */
+	int16_t *sampv_ts;            /**< Sample buffer for time-stretch  */
+	int16_t *sampv_dr;            /**< Sample buffer for drift         */
+	float *sampv_f;               /**< Float sample buffer (optional)  */
+	float *sampv_cv;              /**< Buffer for device conversion    */
+	struct audrift *drift;        /**< Optional drift compensation     */
+	int fmt;                      /**< Sample format of the buffer     */
 	uint32_t ptime;               /**< Packet time for receiving       */
+	size_t sampsz;                /**< Max samples of a frame          */
 	int pt;                       /**< Payload type for incoming RTP   */
+	int32_t cn_amp;               /**< Comfort Noise amplitude         */
+	uint32_t cn_seed;             /**< Comfort Noise generator state   */
+	volatile bool cn;             /**< Peer is in a silence period     */
+	bool fec;                     /**< Recover lost frame from next    */
+	bool red;                     /**< Last packet was RED             */
+	bool red_lost;                /**< Loss before the next packet     */
+	uint16_t seq;                 /**< Sequence number of last packet  */
+	uint32_t gain;                /**< Audio player gain [%]           */
+	struct pipeprof prof;           /**< Optional per-stage timing       */
+	struct spkent spk;            /**< Speaker selection (optional)    */
+	uint64_t n_dormant;           /**< Packets not decoded, dormant    */
 };
 
 
@@ -144,14 +223,129 @@ struct audio {
 	struct aurx rx;               /**< Receive                         */
 	struct stream *strm;          /**< Generic media stream            */
 	struct telev *telev;          /**< Telephony events                */
+	uint8_t ptv[128];             /**< Class of local payload types    */
 	struct config_audio cfg;      /**< Audio configuration             */
 	bool started;                 /**< Stream is started flag          */
+	uint32_t affinity;            /**< Worker pool affinity key        */
+	struct avsync *avsync;        /**< Lip-sync of the call, or NULL   */
 	audio_event_h *eventh;        /**< Event handler                   */
 	audio_err_h *errh;            /**< Audio error handler             */
 	void *arg;                    /**< Handler argument                */
 };
 
 
+/*
+ * The sample buffers of the encoder and the decoder hold one frame only
+ * while it is processed, so they are shared by all calls processed on
+ * the same thread, instead of being allocated for each call. They are
+ * released when the thread exits, and are not counted as memory of
+ * the calls (malloc instead of mem_alloc). They grow to the frame size
+ * of the stream with the most channels on the thread.
+ */
+struct scratch {
+	int16_t *sampv;     /**< Sample buffer                           */
+	int16_t *sampv_rs;  /**< Sample buffer for resampler             */
+	size_t sz;          /**< Size of the buffers [samples]           */
+};
+
+struct scratch_set {
+	struct scratch tx;
+	struct scratch rx;
+};
+
+#ifdef HAVE_PTHREAD
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+
+static void scratch_release(void *arg)
+{
+	struct scratch_set *ss = arg;
+
+	free(ss->tx.sampv);
+	free(ss->tx.sampv_rs);
+	free(ss->rx.sampv);
+	free(ss->rx.sampv_rs);
+	free(ss);
+}
+
+
+static void scratch_key_create(void)
+{
+	(void)pthread_key_create(&scratch_key, scratch_release);
+}
+
+
+static struct scratch_set *scratch_set_get(void)
+{
+	struct scratch_set *ss;
+
+	(void)pthread_once(&scratch_once, scratch_key_create);
+
+	ss = pthread_getspecific(scratch_key);
+	if (ss)
+		return ss;
+
+	ss = calloc(1, sizeof(*ss));
+	if (!ss)
+		return NULL;
+
+	if (pthread_setspecific(scratch_key, ss)) {
+		free(ss);
+		return NULL;
+	}
+
+	return ss;
+}
+#else
+static struct scratch_set *scratch_set_get(void)
+{
+	static struct scratch_set ss;
+
+	return &ss;
+}
+#endif
+
+
+static int scratch_grow(struct scratch *sc, size_t sz)
+{
+	int16_t *sampv, *sampv_rs;
+
+	if (sc->sz >= sz)
+		return 0;
+
+	sampv = realloc(sc->sampv, sz * sizeof(int16_t));
+	if (sampv)
+		sc->sampv = sampv;
+
+	sampv_rs = realloc(sc->sampv_rs, sz * sizeof(int16_t));
+	if (sampv_rs)
+		sc->sampv_rs = sampv_rs;
+
+	if (!sampv || !sampv_rs)
+		return ENOMEM;
+
+	sc->sz = sz;
+
+	return 0;
+}
+
+
+/* Get the scratch buffers of the calling thread, of at least sz samples */
+static struct scratch_set *scratch_get(size_t sz)
+{
+	struct scratch_set *ss = scratch_set_get();
+
+	if (!ss)
+		return NULL;
+
+	if (scratch_grow(&ss->tx, sz) || scratch_grow(&ss->rx, sz))
+		return NULL;
+
+	return ss;
+}
+
+
 static void stop_tx(struct autx *tx, struct audio *a)
 {
 	if (!tx || !a)
@@ -167,11 +361,27 @@ static void stop_tx(struct autx *tx, struct audio *a)
 			pthread_join(tx->u.thr.tid, NULL);
 		}
 		break;
+
+	case AUDIO_MODE_EVENT:
+		if (tx->u.thr.run) {
+			pthread_mutex_lock(&tx->u.thr.mutex);
+			tx->u.thr.run = false;
+			pthread_cond_signal(&tx->u.thr.cond);
+			pthread_mutex_unlock(&tx->u.thr.mutex);
+			pthread_join(tx->u.thr.tid, NULL);
+		}
+		break;
 #endif
 	case AUDIO_MODE_TMR:
 		tmr_cancel(&tx->u.tmr);
 		break;
 
+	case AUDIO_MODE_POOL:
+		/* no more signals from the audio source after this */
+		tx->ausrc = mem_deref(tx->ausrc);
+		txpool_detach(&tx->u.pool);
+		break;
+
 	default:
 		break;
 	}
@@ -179,6 +389,7 @@ static void stop_tx(struct autx *tx, struct audio *a)
 	/* audio source must be stopped first */
 	tx->ausrc = mem_deref(tx->ausrc);
 	tx->aubuf = mem_deref(tx->aubuf);
+	tx->ring  = mem_deref(tx->ring);
 
 	list_flush(&tx->filtl);
 }
@@ -192,6 +403,7 @@ static void stop_rx(struct aurx *rx)
 	/* audio player must be stopped first */
 	rx->auplay = mem_deref(rx->auplay);
 	rx->aubuf  = mem_deref(rx->aubuf);
+	rx->ring   = mem_deref(rx->ring);
 
 	list_flush(&rx->filtl);
 }
@@ -201,24 +413,48 @@ static void audio_destructor(void *arg)
 {
 	struct audio *a = arg;
 
+	memtag_free(memtag_core(MEMTAG_AUDIO), sizeof(*a));
+
 	stop_tx(&a->tx, a);
 	stop_rx(&a->rx);
+	speaker_leave(&a->rx.spk);
 
 	mem_deref(a->tx.enc);
+	mem_deref(a->tx.enc_fmtp);
+	mem_deref(a->tx.enc_next);
+	mem_deref(a->tx.enc_old);
 	mem_deref(a->rx.dec);
 	mem_deref(a->tx.aubuf);
+	mem_deref(a->tx.ring);
 	mem_deref(a->tx.mb);
-	mem_deref(a->tx.sampv);
-	mem_deref(a->rx.sampv);
 	mem_deref(a->rx.aubuf);
-	mem_deref(a->tx.sampv_rs);
-	mem_deref(a->rx.sampv_rs);
+	mem_deref(a->rx.ring);
+	mem_deref(a->rx.sampv_ts);
+	mem_deref(a->tx.resamp);
+	mem_deref(a->rx.resamp);
+	mem_deref(a->rx.wsola);
+	mem_deref(a->tx.sampv_dr);
+	mem_deref(a->tx.drift);
+	mem_deref(a->rx.sampv_dr);
+	mem_deref(a->rx.drift);
+	mem_deref(a->tx.sampv_f);
+	mem_deref(a->tx.sampv_cv);
+	mem_deref(a->rx.sampv_f);
+	mem_deref(a->rx.sampv_cv);
 
 	list_flush(&a->tx.filtl);
 	list_flush(&a->rx.filtl);
 
 	mem_deref(a->strm);
 	mem_deref(a->telev);
+	mem_deref(a->avsync);
+
+#ifdef HAVE_PTHREAD
+	if (a->cfg.txmode == AUDIO_MODE_EVENT && a->tx.u.thr.up) {
+		pthread_cond_destroy(&a->tx.u.thr.cond);
+		pthread_mutex_destroy(&a->tx.u.thr.mutex);
+	}
+#endif
 }
 
 
@@ -272,6 +508,39 @@ static inline uint32_t get_framesize(const struct aucodec *ac,
 }
 
 
+/* Number of bytes buffered in the transmit buffer */
+static inline size_t autx_cur_size(const struct autx *tx)
+{
+	if (tx->ring)
+		return 2 * auring_cur_sampc(tx->ring);
+
+	return aubuf_cur_size(tx->aubuf);
+}
+
+
+/* Number of bytes buffered in the receive buffer */
+static inline size_t aurx_cur_size(const struct aurx *rx)
+{
+	if (rx->ring)
+		return 2 * auring_cur_sampc(rx->ring);
+
+	return aubuf_cur_size(rx->aubuf);
+}
+
+
+/* Time until the newest buffered sample is played [ms] */
+static uint32_t aurx_delay(const struct aurx *rx)
+{
+	const size_t sz = rx->ring ? 2 : aufmt_sample_size(rx->fmt);
+	const size_t rate = sz * rx->auplay_prm.srate * rx->auplay_prm.ch;
+
+	if (!rate)
+		return 0;
+
+	return (uint32_t)(aurx_cur_size(rx) * 1000 / rate);
+}
+
+
 static bool aucodec_equal(const struct aucodec *a, const struct aucodec *b)
 {
 	if (!a || !b)
@@ -281,32 +550,208 @@ static bool aucodec_equal(const struct aucodec *a, const struct aucodec *b)
 }
 
 
-static int add_audio_codec(struct audio *a, struct sdp_media *m,
-			   struct aucodec *ac)
+/**
+ * Check if an audio codec can be offered with the audio config
+ *
+ * @param cfg Audio configuration
+ * @param ac  Audio codec
+ *
+ * @return True if usable, otherwise false
+ */
+bool audio_codec_usable(const struct config_audio *cfg,
+			const struct aucodec *ac)
 {
-	if (!in_range(&a->cfg.srate, get_srate(ac))) {
+	if (!cfg || !ac)
+		return false;
+
+	if (!in_range(&cfg->srate, get_srate(ac))) {
 		debug("audio: skip %uHz codec (audio range %uHz - %uHz)\n",
-		      get_srate(ac), a->cfg.srate.min, a->cfg.srate.max);
-		return 0;
+		      get_srate(ac), cfg->srate.min, cfg->srate.max);
+		return false;
 	}
 
-	if (!in_range(&a->cfg.channels, get_ch(ac))) {
+	if (!in_range(&cfg->channels, get_ch(ac))) {
 		debug("audio: skip codec with %uch (audio range %uch-%uch)\n",
-		      get_ch(ac), a->cfg.channels.min, a->cfg.channels.max);
-		return 0;
+		      get_ch(ac), cfg->channels.min, cfg->channels.max);
+		return false;
 	}
 
 	if (ac->crate < 8000) {
 		warning("audio: illegal clock rate %u\n", ac->crate);
-		return EINVAL;
+		return false;
 	}
 
+	return true;
+}
+
+
+/* The codec has been checked with audio_codec_usable() */
+static int add_audio_codec(struct sdp_media *m, struct aucodec *ac)
+{
 	return sdp_format_add(NULL, m, false, ac->pt, ac->name, ac->crate,
 			      ac->ch, ac->fmtp_ench, ac->fmtp_cmph, ac, false,
 			      "%s", ac->fmtp);
 }
 
 
+/*
+ * Discontinuous transmission. After a hangover of silent frames nothing
+ * is encoded, and a Comfort Noise packet (RFC 3389) with the noise level
+ * is sent every CN_INTERVAL instead. The spectral information is not
+ * sent. This is only done if the peer accepts CN.
+ *
+ * @return True if the frame is not sent
+ */
+static bool dtx_handler(struct audio *a, struct autx *tx)
+{
+	int err;
+
+	if (tx->level.voice) {
+
+		/* first packet of a talkspurt */
+		if (tx->dtx_ms >= DTX_HANGOVER)
+			tx->marker = true;
+
+		tx->dtx_ms = 0;
+		tx->cn_ms  = 0;
+		return false;
+	}
+
+	if (tx->dtx_ms < DTX_HANGOVER) {
+		tx->dtx_ms += tx->ptime;
+		return false;
+	}
+
+	if (tx->pt_cn < 0)
+		return false;
+
+	if (tx->cn_ms == 0) {
+
+		tx->mb->pos = tx->mb->end = STREAM_PRESZ;
+		(void)mbuf_write_u8(tx->mb, tx->level.dbov);
+		tx->mb->pos = STREAM_PRESZ;
+
+		err = stream_send(a->strm, false, tx->pt_cn, tx->ts, tx->mb);
+		if (err) {
+			warning("audio: CN: stream_send %m\n", err);
+		}
+	}
+
+	tx->cn_ms += tx->ptime;
+	if (tx->cn_ms >= CN_INTERVAL)
+		tx->cn_ms = 0;
+
+	return true;
+}
+
+
+static void enc_next_destructor(void *arg)
+{
+	struct enc_next *en = arg;
+
+	mem_deref(en->enc);
+}
+
+
+/*
+ * Switch to the encoder that was made ahead, between two frames. The
+ * encoder that was switched out is left for the main thread to free.
+ */
+static void enc_switch(struct audio *a, struct autx *tx)
+{
+	struct enc_next *en;
+	const struct aucodec *ac;
+	struct auenc_state *enc;
+	int pt;
+
+	en = __atomic_exchange_n(&tx->enc_next, NULL, __ATOMIC_ACQ_REL);
+	if (!en)
+		return;
+
+	ac  = tx->ac;
+	enc = tx->enc;
+	pt  = tx->pt;
+
+	tx->ac  = en->ac;
+	tx->enc = en->enc;
+	tx->pt  = en->pt;
+
+	en->ac  = ac;
+	en->enc = enc;
+	en->pt  = pt;
+
+	/* the frames for RED were encoded with the old codec */
+	red_enc_reset(&tx->red);
+	stream_update_encoder(a->strm, tx->pt);
+
+	/* the main thread has not freed the last one, two quick changes */
+	mem_deref(__atomic_exchange_n(&tx->enc_old, en, __ATOMIC_ACQ_REL));
+}
+
+
+/* Drop an encoder that was made ahead, and one that was switched out */
+static void enc_next_cancel(struct autx *tx)
+{
+	mem_deref(__atomic_exchange_n(&tx->enc_next, NULL,
+				      __ATOMIC_ACQ_REL));
+	mem_deref(__atomic_exchange_n(&tx->enc_old, NULL,
+				      __ATOMIC_ACQ_REL));
+}
+
+
+/*
+ * The new encoder is made while the old one is still sending, and the
+ * transmit path switches to it between two frames, without a gap.
+ */
+static int enc_prewarm(struct audio *a, const struct aucodec *ac,
+		       int pt_tx, const char *params)
+{
+	struct autx *tx = &a->tx;
+	struct enc_next *en;
+	int err = 0;
+
+	en = mem_zalloc(sizeof(*en), enc_next_destructor);
+	if (!en)
+		return ENOMEM;
+
+	en->ac = ac;
+	en->pt = pt_tx;
+
+	if (ac->encupdh) {
+		struct auenc_param prm;
+
+		prm.ptime = tx->ptime;
+
+		err = ac->encupdh(&en->enc, ac, &prm, params);
+		if (err) {
+			warning("audio: alloc encoder: %m\n", err);
+			goto out;
+		}
+	}
+
+	tx->enc_fmtp = mem_deref(tx->enc_fmtp);
+	if (params) {
+		err = str_dup(&tx->enc_fmtp, params);
+		if (err)
+			goto out;
+	}
+
+	/* the new encoder starts with the negotiated ptime */
+	tx->ptime_good = 0;
+	__atomic_store_n(&tx->ptime_next, tx->ptime_neg, __ATOMIC_RELEASE);
+
+	stream_set_srate(a->strm, ac->crate, ac->crate);
+
+	__atomic_store_n(&tx->enc_next, en, __ATOMIC_RELEASE);
+	en = NULL;
+
+ out:
+	mem_deref(en);
+
+	return err;
+}
+
+
 /**
  * Encoder audio and send via stream
  *
@@ -314,24 +759,73 @@ static int add_audio_codec(struct audio *a, struct sdp_media *m,
  *
  * @param a     Audio object
  * @param tx    Audio transmit object
+ * @param fmt   Sample format (enum aufmt)
  * @param sampv Audio samples
  * @param sampc Number of audio samples
  */
-static void encode_rtp_send(struct audio *a, struct autx *tx,
-			    int16_t *sampv, size_t sampc)
+static void encode_rtp_send(struct audio *a, struct autx *tx, int fmt,
+			    const void *sampv, size_t sampc)
 {
 	size_t frame_size;  /* number of samples per channel */
 	size_t sampc_rtp;
+	uint64_t t0;
 	size_t len;
+	int pt = -1;
 	int err;
 
+	if (__atomic_load_n(&tx->enc_next, __ATOMIC_RELAXED))
+		enc_switch(a, tx);
+
 	if (!tx->ac || !tx->ac->ench)
 		return;
 
+	/* the RTP of another call is relayed instead */
+	if (stream_is_relayed(a->strm))
+		return;
+
+	/* on hold the source and encoder are kept, but nothing is sent */
+	if (!stream_is_sending(a->strm)) {
+		sampc_rtp  = sampc * tx->ac->crate / tx->ac->srate;
+		tx->ts    += (uint32_t)(sampc_rtp / get_ch(tx->ac));
+		tx->marker = true;
+		return;
+	}
+
 	tx->mb->pos = tx->mb->end = STREAM_PRESZ;
 	len = mbuf_get_space(tx->mb);
 
-	err = tx->ac->ench(tx->enc, mbuf_buf(tx->mb), &len, sampv, sampc);
+	if (fmt == AUFMT_FLOAT)
+		aulevel_calc_float(&tx->level, sampv, sampc);
+	else
+		aulevel_calc(&tx->level, sampv, sampc);
+	stream_set_audio_level(a->strm, tx->level.dbov);
+
+	/* the voice activity detection of a filter is more precise */
+	if (tx->vad >= 0)
+		tx->level.voice = tx->vad != 0;
+
+	pipeprof_mark(&tx->prof, "level");
+
+	if (a->cfg.dtx && dtx_handler(a, tx)) {
+		red_enc_reset(&tx->red);
+		goto next;
+	}
+
+	t0 = governor_clock();
+
+	if (fmt == AUFMT_S16LE) {
+		err = tx->ac->ench(tx->enc, mbuf_buf(tx->mb), &len,
+				   sampv, sampc);
+	}
+	else {
+		err = tx->ac->ench_fmt(tx->enc, mbuf_buf(tx->mb), &len,
+				       fmt, sampv, sampc);
+	}
+
+	governor_frame(t0, tx->ptime);
+
+	pipeprof_mark(&tx->prof, tx->ac->name);
+
 	if ((err & 0xffff0000) == 0x00010000) {
 		/* MPA needs some special treatment here */
 		tx->ts = err & 0xffff;
@@ -346,15 +840,24 @@ static void encode_rtp_send(struct audio *a, struct autx *tx,
 	tx->mb->pos = STREAM_PRESZ;
 	tx->mb->end = STREAM_PRESZ + len;
 
+	/* the previous frames are sent again, if the peer takes RED */
+	if (len && tx->pt_red >= 0 && tx->red_crate == tx->ac->crate &&
+	    0 == red_encode(&tx->red, tx->mb, tx->pt, tx->ts))
+		pt = tx->pt_red;
+
 	if (mbuf_get_left(tx->mb)) {
 		if (len) {
-			err = stream_send(a->strm, tx->marker, -1,
+			err = stream_send(a->strm, tx->marker, pt,
 					tx->ts, tx->mb);
+
+			pipeprof_mark(&tx->prof, "send");
+
 			if (err)
 				goto out;
 		}
 	}
 
+ next:
 	/* Convert from audio samplerate to RTP clockrate */
 	sampc_rtp = sampc * tx->ac->crate / tx->ac->srate;
 
@@ -373,98 +876,298 @@ static void encode_rtp_send(struct audio *a, struct autx *tx,
 
 
 /*
+ * Resample, filter, encode and send one frame of S16 samples
+ *
  * @note This function has REAL-TIME properties
  */
-static void poll_aubuf_tx(struct audio *a)
+static void process_tx(struct audio *a, struct scratch *sc, size_t sampc)
 {
 	struct autx *tx = &a->tx;
-	int16_t *sampv = tx->sampv;
-	size_t sampc;
+	int16_t *sampv = sc->sampv;
 	struct le *le;
 	int err = 0;
 
-	sampc = tx->psize / 2;
-
-	/* timed read from audio-buffer */
-	aubuf_read_samp(tx->aubuf, tx->sampv, sampc);
-
 	/* optional resampler */
-	if (tx->resamp.resample) {
-		size_t sampc_rs = AUDIO_SAMPSZ;
+	if (tx->resamp) {
+		size_t sampc_rs = tx->sampsz;
 
-		err = auresamp(&tx->resamp,
-			       tx->sampv_rs, &sampc_rs,
-			       tx->sampv, sampc);
+		err = resamp_process(tx->resamp,
+				     sc->sampv_rs, &sampc_rs,
+				     sc->sampv, sampc);
 		if (err)
 			return;
 
-		sampv = tx->sampv_rs;
+		sampv = sc->sampv_rs;
 		sampc = sampc_rs;
+
+		pipeprof_mark(&tx->prof, "resamp");
 	}
 
 	/* Process exactly one audio-frame in list order */
+	tx->vad = -1;
 	for (le = tx->filtl.head; le; le = le->next) {
 		struct aufilt_enc_st *st = le->data;
 
-		if (st->af && st->af->ench)
+		if (st->af && st->af->ench) {
 			err |= st->af->ench(st, sampv, &sampc);
+			pipeprof_mark(&tx->prof, st->af->name);
+		}
+
+		if (st->vad)
+			tx->vad = st->voice;
 	}
 	if (err) {
 		warning("audio: aufilter encode: %m\n", err);
 	}
 
 	/* Encode and send */
-	encode_rtp_send(a, tx, sampv, sampc);
+	encode_rtp_send(a, tx, AUFMT_S16LE, sampv, sampc);
 }
 
 
-static void check_telev(struct audio *a, struct autx *tx)
+/*
+ * @note This function has REAL-TIME properties
+ */
+static void poll_aubuf_tx(struct audio *a)
 {
-	const struct sdp_format *fmt;
-	bool marker = false;
-	int err;
-
-	tx->mb->pos = tx->mb->end = STREAM_PRESZ;
+	struct autx *tx = &a->tx;
+	struct scratch_set *ss = scratch_get(tx->sampsz);
+	struct scratch *sc;
+	uint32_t ptime;
+	size_t sampc;
 
-	err = telev_poll(a->telev, &marker, tx->mb);
-	if (err)
+	if (!ss)
 		return;
 
-	if (marker)
-		tx->ts_tel = tx->ts;
+	/* the adapted packet time is applied from the encoding thread */
+	ptime = __atomic_load_n(&tx->ptime_next, __ATOMIC_ACQUIRE);
+	if (ptime != tx->ptime) {
 
-	fmt = sdp_media_rformat(stream_sdpmedia(audio_strm(a)), telev_rtpfmt);
-	if (!fmt)
-		return;
+		tx->ptime = ptime;
+		tx->psize = aufmt_sample_size(tx->fmt)
+			* calc_nsamp(tx->ausrc_prm.srate, tx->ausrc_prm.ch,
+				     ptime);
 
-	tx->mb->pos = STREAM_PRESZ;
-	err = stream_send(a->strm, marker, fmt->pt, tx->ts_tel, tx->mb);
-	if (err) {
-		warning("audio: telev: stream_send %m\n", err);
+		if (autx_cur_size(tx) < tx->psize)
+			return;
 	}
-}
 
+	sc = &ss->tx;
 
-/**
- * Write samples to Audio Player.
- *
- * @note This function has REAL-TIME properties
- *
- * @note The application is responsible for filling in silence in
- *       the case of underrun
- *
- * @note This function may be called from any thread
- *
- * @param buf Buffer to fill with audio samples
- * @param sz  Number of bytes in buffer
- * @param arg Handler argument
- */
-static void auplay_write_handler(int16_t *sampv, size_t sampc, void *arg)
-{
-	struct aurx *rx = arg;
+	PROBE2(audio_tx_begin, a, tx->psize);
+	pipeprof_begin(&tx->prof, 0);
 
-	aubuf_read_samp(rx->aubuf, sampv, sampc);
-}
+	/* float frames go to the encoder as they are, if possible */
+	if (tx->fmt == AUFMT_FLOAT) {
+
+		sampc = tx->psize / sizeof(float);
+
+		aubuf_read(tx->aubuf, (uint8_t *)tx->sampv_f, tx->psize);
+		pipeprof_mark(&tx->prof, "aubuf");
+
+		if (tx->ac && tx->ac->ench_fmt) {
+			encode_rtp_send(a, tx, AUFMT_FLOAT,
+					tx->sampv_f, sampc);
+			goto out;
+		}
+
+		auconv_to_s16(sc->sampv, AUFMT_FLOAT, tx->sampv_f, sampc);
+	}
+	else {
+		sampc = tx->psize / 2;
+
+		/* timed read from audio-buffer */
+		if (tx->ring)
+			(void)auring_read(tx->ring, sc->sampv, sampc);
+		else
+			aubuf_read_samp(tx->aubuf, sc->sampv, sampc);
+
+		pipeprof_mark(&tx->prof, "aubuf");
+	}
+
+	process_tx(a, sc, sampc);
+
+ out:
+	PROBE1(audio_tx_end, a);
+}
+
+
+/*
+ * Encode one frame straight from the audio source, without the buffer,
+ * when the device period is the packet time
+ *
+ * @return True if the frame was taken
+ *
+ * @note This function has REAL-TIME properties
+ */
+static bool direct_tx(struct audio *a, const void *sampv, size_t sampc)
+{
+	struct autx *tx = &a->tx;
+	const int fmt = tx->ausrc_prm.fmt;
+	struct scratch_set *ss;
+	uint32_t ptime;
+
+	if (fmt != tx->fmt || sampc * aufmt_sample_size(fmt) != tx->psize)
+		return false;
+
+	/* frames that are buffered, or a new ptime, go the usual way */
+	ptime = __atomic_load_n(&tx->ptime_next, __ATOMIC_ACQUIRE);
+	if (ptime != tx->ptime || autx_cur_size(tx))
+		return false;
+
+	ss = scratch_get(tx->sampsz);
+	if (!ss || sampc > tx->sampsz)
+		return false;
+
+	pipeprof_begin(&tx->prof, 0);
+
+	if (fmt == AUFMT_FLOAT) {
+
+		if (tx->ac && tx->ac->ench_fmt) {
+			encode_rtp_send(a, tx, AUFMT_FLOAT, sampv, sampc);
+			goto out;
+		}
+
+		auconv_to_s16(ss->tx.sampv, AUFMT_FLOAT, sampv, sampc);
+	}
+	else {
+		/* the filters work in place */
+		memcpy(ss->tx.sampv, sampv, sampc * sizeof(int16_t));
+	}
+
+	process_tx(a, &ss->tx, sampc);
+
+ out:
+	++tx->n_direct;
+
+	return true;
+}
+
+
+static void check_telev(struct audio *a, struct autx *tx)
+{
+	bool marker = false;
+	int err;
+
+	tx->mb->pos = tx->mb->end = STREAM_PRESZ;
+
+	err = telev_poll(a->telev, &marker, tx->mb);
+	if (err)
+		return;
+
+	if (marker)
+		tx->ts_tel = tx->ts;
+
+	if (tx->pt_telev < 0)
+		return;
+
+	tx->mb->pos = STREAM_PRESZ;
+	err = stream_send(a->strm, marker, tx->pt_telev, tx->ts_tel, tx->mb);
+	if (err) {
+		warning("audio: telev: stream_send %m\n", err);
+	}
+}
+
+
+/* White noise at the level of the last CN packet */
+static void comfort_noise(struct aurx *rx, int fmt, void *sampv,
+			  size_t sampc)
+{
+	const int32_t amp = rx->cn_amp;
+	uint32_t seed = rx->cn_seed;
+	size_t i;
+
+	for (i=0; i<sampc; i++) {
+
+		int32_t v;
+
+		seed = seed * 1664525 + 1013904223;
+
+		v = (((int32_t)(seed >> 16) - 32768) * amp) >> 15;
+
+		if (fmt == AUFMT_FLOAT)
+			((float *)sampv)[i] = v * (1.0f / 32768);
+		else
+			((int16_t *)sampv)[i] = (int16_t)v;
+	}
+
+	rx->cn_seed = seed;
+}
+
+
+/* Read float samples from the buffer to an S16 device */
+static size_t aurx_read_s16(struct aurx *rx, int16_t *sampv, size_t sampc)
+{
+	const size_t n = min(aubuf_cur_size(rx->aubuf) / sizeof(float),
+			     sampc);
+	size_t i;
+
+	for (i=0; i<sampc; i+=rx->sampsz) {
+
+		const size_t c = min(sampc - i, rx->sampsz);
+
+		aubuf_read(rx->aubuf, (uint8_t *)rx->sampv_cv,
+			   c * sizeof(float));
+		auconv_to_s16(&sampv[i], AUFMT_FLOAT, rx->sampv_cv, c);
+	}
+
+	return n;
+}
+
+
+/**
+ * Write samples to Audio Player.
+ *
+ * @note This function has REAL-TIME properties
+ *
+ * @note The application is responsible for filling in silence in
+ *       the case of underrun
+ *
+ * @note This function may be called from any thread
+ *
+ * @param buf Buffer to fill with audio samples
+ * @param sz  Number of bytes in buffer
+ * @param arg Handler argument
+ */
+static void auplay_write_handler(void *sampv, size_t sampc, void *arg)
+{
+	struct aurx *rx = arg;
+	const int fmt = rx->auplay_prm.fmt;
+	const size_t sz = aufmt_sample_size(fmt);
+	size_t n;
+
+	if (fmt != rx->fmt) {
+		n = aurx_read_s16(rx, sampv, sampc);
+	}
+	else if (rx->ring) {
+		n = auring_read(rx->ring, sampv, sampc);
+	}
+	else {
+		n = min(aubuf_cur_size(rx->aubuf) / sz, sampc);
+		aubuf_read(rx->aubuf, sampv, sampc * sz);
+	}
+
+	/* fill what the peer did not send during silence */
+	if (rx->cn && n < sampc)
+		comfort_noise(rx, fmt, (uint8_t *)sampv + n * sz, sampc - n);
+}
+
+
+/* Write samples from an S16 device to the float buffer */
+static void autx_write_float(struct autx *tx, const int16_t *sampv,
+			     size_t sampc)
+{
+	size_t i;
+
+	for (i=0; i<sampc; i+=tx->sampsz) {
+
+		const size_t c = min(sampc - i, tx->sampsz);
+
+		auconv_from_s16(AUFMT_FLOAT, tx->sampv_cv, &sampv[i], c);
+		(void)aubuf_write(tx->aubuf, (uint8_t *)tx->sampv_cv,
+				  c * sizeof(float));
+	}
+}
 
 
 /**
@@ -478,28 +1181,63 @@ static void auplay_write_handler(int16_t *sampv, size_t sampc, void *arg)
  * @param sz  Number of bytes in buffer
  * @param arg Handler argument
  */
-static void ausrc_read_handler(const int16_t *sampv, size_t sampc, void *arg)
+static void ausrc_read_handler(const void *sampv, size_t sampc, void *arg)
 {
 	struct audio *a = arg;
 	struct autx *tx = &a->tx;
+	const int fmt = tx->ausrc_prm.fmt;
 
 	if (tx->muted)
-		memset((void *)sampv, 0, sampc*2);
+		memset((void *)sampv, 0, sampc * aufmt_sample_size(fmt));
+
+	/* optional clock-drift compensation against the sender */
+	if (tx->drift) {
+		sampc = audrift_process(tx->drift, tx->sampv_dr,
+					DRIFT_FACTOR * tx->sampsz,
+					sampv, sampc, autx_cur_size(tx) / 2);
+		sampv = tx->sampv_dr;
+	}
+
+	if (tx->direct && direct_tx(a, sampv, sampc))
+		goto out;
 
-	(void)aubuf_write_samp(tx->aubuf, sampv, sampc);
+	if (fmt != tx->fmt)
+		autx_write_float(tx, sampv, sampc);
+	else if (tx->ring)
+		(void)auring_write(tx->ring, sampv, sampc);
+	else
+		(void)aubuf_write(tx->aubuf, sampv,
+				  sampc * aufmt_sample_size(fmt));
 
 	if (a->cfg.txmode == AUDIO_MODE_POLL) {
 		unsigned i;
 
 		for (i=0; i<16; i++) {
 
-			if (aubuf_cur_size(tx->aubuf) < tx->psize)
+			if (autx_cur_size(tx) < tx->psize)
 				break;
 
 			poll_aubuf_tx(a);
 		}
 	}
+#ifdef HAVE_PTHREAD
+	else if (a->cfg.txmode == AUDIO_MODE_EVENT) {
 
+		/* wake up the encoder only when a full frame is ready */
+		if (autx_cur_size(tx) >= tx->psize) {
+			pthread_mutex_lock(&tx->u.thr.mutex);
+			pthread_cond_signal(&tx->u.thr.cond);
+			pthread_mutex_unlock(&tx->u.thr.mutex);
+		}
+	}
+#endif
+	else if (a->cfg.txmode == AUDIO_MODE_POOL) {
+
+		if (autx_cur_size(tx) >= tx->psize)
+			txpool_signal(&tx->u.pool);
+	}
+
+ out:
 	/* Exact timing: send Telephony-Events from here */
 	check_telev(a, tx);
 }
@@ -548,29 +1286,95 @@ static void handle_telev(struct audio *a, struct mbuf *mb)
 }
 
 
-static int aurx_stream_decode(struct aurx *rx, struct mbuf *mb)
+/*
+ * Decoding to float for a float buffer. The float path is only used
+ * without filters, resampler, time-stretching and drift compensation,
+ * so the frame goes straight into the buffer.
+ */
+static int aurx_stream_decode_float(struct aurx *rx, struct mbuf *mb)
 {
-	size_t sampc = AUDIO_SAMPSZ;
+	const bool plc = !mbuf_get_left(mb);
+	size_t sampc = rx->sampsz;
+	int err;
+
+	if (!plc) {
+		err = rx->ac->dech_fmt(rx->dec, AUFMT_FLOAT,
+				       rx->sampv_f, &sampc,
+				       mbuf_buf(mb), mbuf_get_left(mb));
+	}
+	else {
+		sampc = rx->ac->srate * rx->ac->ch * rx->ptime / 1000;
+
+		err = rx->ac->dech_fmt(rx->dec, AUFMT_FLOAT,
+				       rx->sampv_f, &sampc, NULL, 0);
+	}
+
+	if (err) {
+		warning("audio: %s codec decode %u bytes: %m\n",
+			rx->ac->name, mbuf_get_left(mb), err);
+		return err;
+	}
+
+	stream_plc_count(rx->strm, sampc, plc, false);
+
+	pipeprof_mark(&rx->prof, rx->ac->name);
+
+	aulevel_calc_float(&rx->level, rx->sampv_f, sampc);
+
+	pipeprof_mark(&rx->prof, "level");
+
+	if (!rx->aubuf)
+		return 0;
+
+	err = aubuf_write(rx->aubuf, (uint8_t *)rx->sampv_f,
+			  sampc * sizeof(float));
+
+	pipeprof_mark(&rx->prof, "aubuf");
+
+	return err;
+}
+
+
+static int aurx_decode(struct aurx *rx, struct mbuf *mb, bool fec)
+{
+	size_t sampc = rx->sampsz;
+	struct scratch_set *ss;
+	struct scratch *sc;
 	int16_t *sampv;
 	struct le *le;
+	bool plc = false;
 	int err = 0;
 
-	/* No decoder set */
-	if (!rx->ac)
-		return 0;
+	pipeprof_begin(&rx->prof, 0);
 
-	if (mbuf_get_left(mb)) {
-		err = rx->ac->dech(rx->dec, rx->sampv, &sampc,
+	/* float frames go to the buffer as they are, if possible */
+	if (rx->fmt == AUFMT_FLOAT && rx->ac->dech_fmt && !fec)
+		return aurx_stream_decode_float(rx, mb);
+
+	ss = scratch_get(rx->sampsz);
+	if (!ss)
+		return ENOMEM;
+
+	sc = &ss->rx;
+
+	if (fec) {
+		err = rx->ac->fech(rx->dec, sc->sampv, &sampc,
+				   mbuf_buf(mb), mbuf_get_left(mb));
+	}
+	else if (mbuf_get_left(mb)) {
+		err = rx->ac->dech(rx->dec, sc->sampv, &sampc,
 				   mbuf_buf(mb), mbuf_get_left(mb));
 	}
 	else if (rx->ac->plch) {
 		sampc = rx->ac->srate * rx->ac->ch * rx->ptime / 1000;
 
-		err = rx->ac->plch(rx->dec, rx->sampv, &sampc);
+		err = rx->ac->plch(rx->dec, sc->sampv, &sampc);
+		plc = true;
 	}
 	else {
-		/* no PLC in the codec, might be done in filters below */
+		/* no PLC in the codec, a PLC filter may fill the frame */
 		sampc = 0;
+		plc = true;
 	}
 
 	if (err) {
@@ -579,34 +1383,92 @@ static int aurx_stream_decode(struct aurx *rx, struct mbuf *mb)
 		goto out;
 	}
 
+	pipeprof_mark(&rx->prof, rx->ac->name);
+
 	/* Process exactly one audio-frame in reverse list order */
 	for (le = rx->filtl.tail; le; le = le->prev) {
 		struct aufilt_dec_st *st = le->data;
 
-		if (st->af && st->af->dech)
-			err |= st->af->dech(st, rx->sampv, &sampc);
+		if (st->af && st->af->dech) {
+			err |= st->af->dech(st, sc->sampv, &sampc);
+			pipeprof_mark(&rx->prof, st->af->name);
+		}
 	}
 
-	if (!rx->aubuf)
+	stream_plc_count(rx->strm, sampc, plc, fec);
+
+	aulevel_calc(&rx->level, sc->sampv, sampc);
+
+	pipeprof_mark(&rx->prof, "level");
+
+	if (!rx->aubuf && !rx->ring)
 		goto out;
 
-	sampv = rx->sampv;
+	sampv = sc->sampv;
 
 	/* optional resampler */
-	if (rx->resamp.resample) {
-		size_t sampc_rs = AUDIO_SAMPSZ;
+	if (rx->resamp) {
+		size_t sampc_rs = rx->sampsz;
 
-		err = auresamp(&rx->resamp,
-			       rx->sampv_rs, &sampc_rs,
-			       rx->sampv, sampc);
+		err = resamp_process(rx->resamp,
+				     sc->sampv_rs, &sampc_rs,
+				     sc->sampv, sampc);
 		if (err)
 			return err;
 
-		sampv = rx->sampv_rs;
+		sampv = sc->sampv_rs;
 		sampc = sampc_rs;
+
+		pipeprof_mark(&rx->prof, "resamp");
+	}
+
+	/* optional time-stretching, keeps the buffer at 1-3 frames */
+	if (rx->wsola && sampc) {
+		const size_t cur = aurx_cur_size(rx);
+		size_t n;
+		int dir = 0;
+
+		if (cur > 3 * sampc * 2)
+			dir = -1;
+		else if (cur < sampc * 2)
+			dir = 1;
+
+		n = wsola_process(rx->wsola, rx->sampv_ts, rx->sampsz * 2,
+				  sampv, sampc, dir);
+		if (n) {
+			sampv = rx->sampv_ts;
+			sampc = n;
+		}
+
+		pipeprof_mark(&rx->prof, "stretch");
+	}
+
+	/* optional clock-drift compensation against the player */
+	if (rx->drift && sampc) {
+		sampc = audrift_process(rx->drift, rx->sampv_dr,
+					DRIFT_FACTOR * rx->sampsz,
+					sampv, sampc, aurx_cur_size(rx) / 2);
+		sampv = rx->sampv_dr;
+
+		pipeprof_mark(&rx->prof, "drift");
+	}
+
+	if (rx->fmt == AUFMT_FLOAT) {
+		sampc = min(sampc, rx->sampsz);
+		auconv_from_s16(AUFMT_FLOAT, rx->sampv_f, sampv, sampc);
+		err = aubuf_write(rx->aubuf, (uint8_t *)rx->sampv_f,
+				  sampc * sizeof(float));
+	}
+	else if (rx->ring) {
+		if (auring_write(rx->ring, sampv, sampc) < sampc)
+			err = ENOSPC;
+	}
+	else {
+		err = aubuf_write_samp(rx->aubuf, sampv, sampc);
 	}
 
-	err = aubuf_write_samp(rx->aubuf, sampv, sampc);
+	pipeprof_mark(&rx->prof, "aubuf");
+
 	if (err)
 		goto out;
 
@@ -615,44 +1477,374 @@ static int aurx_stream_decode(struct aurx *rx, struct mbuf *mb)
 }
 
 
-/* Handle incoming stream data from the network */
-static void stream_recv_handler(const struct rtp_header *hdr,
-				struct mbuf *mb, void *arg)
-{
-	struct audio *a = arg;
-	struct aurx *rx = &a->rx;
-	int err;
+static int aurx_stream_decode(struct aurx *rx, struct mbuf *mb)
+{
+	int err = 0;
+
+	/* No decoder set */
+	if (!rx->ac)
+		return 0;
+
+	PROBE2(audio_decode_begin, rx, mbuf_get_left(mb));
+
+	/* A lost frame is recovered from the in-band FEC data of the
+	 * next packet, if the codec has it. Both arrive back to back
+	 * from the jitter buffer. Only the last of several lost frames
+	 * is in the next packet, the others are concealed.
+	 */
+	if (rx->ac->fech) {
+
+		if (!mbuf_get_left(mb)) {
+			if (rx->fec)
+				(void)aurx_decode(rx, mb, false);
+
+			rx->fec = true;
+			goto out;
+		}
+
+		if (rx->fec) {
+			rx->fec = false;
+			(void)aurx_decode(rx, mb, true);
+		}
+	}
+
+	err = aurx_decode(rx, mb, false);
+
+ out:
+	PROBE2(audio_decode_end, rx, err);
+
+	return err;
+}
+
+
+/* The first byte is the noise level in -dBov */
+static void handle_cn(struct aurx *rx, const struct mbuf *mb)
+{
+	double amp;
+
+	if (!mbuf_get_left(mb))
+		return;
+
+	/* uniform noise has a peak of sqrt(3) times the RMS level */
+	amp = 32768.0 * 1.732 * pow(10.0, -(mbuf_buf(mb)[0] & 0x7f) / 20.0);
+
+	rx->cn_amp = (int32_t)min(amp, 32767.0);
+	rx->cn = true;
+}
+
+
+/* Handle the payload of a packet, or a lost packet if mb is NULL */
+static void recv_payload(struct audio *a, const struct rtp_header *hdr,
+			 struct mbuf *mb)
+{
+	struct aurx *rx = &a->rx;
+	enum pt_class ptc;
+	int err;
+
+	if (!mb)
+		goto out;
+
+	ptc = hdr->pt != rx->pt ? a->ptv[hdr->pt & 0x7f] : PTC_AUDIO;
+
+	/* Telephone event? */
+	if (ptc == PTC_TELEV) {
+		handle_telev(a, mb);
+		return;
+	}
+
+	/* Comfort Noise (CN) as of RFC 3389 */
+	if (PT_CN == hdr->pt || ptc == PTC_CN) {
+		handle_cn(rx, mb);
+		return;
+	}
+
+	/* Audio payload-type changed? */
+	/* XXX: this logic should be moved to stream.c */
+	if (hdr->pt != rx->pt) {
+
+		err = pt_handler(a, rx->pt, hdr->pt);
+		if (err)
+			return;
+	}
+
+	rx->cn = false;
+
+	/* the jitter buffer adds the delay for lip-sync */
+	if (a->avsync) {
+		avsync_play(a->avsync, AVSYNC_AUDIO, hdr->ts, aurx_delay(rx));
+		stream_jbuf_delay(a->strm,
+				  avsync_delay(a->avsync, AVSYNC_AUDIO));
+	}
+
+ out:
+	/* a dormant stream has no decoding and no concealment */
+	if (!speaker_active(&rx->spk)) {
+		++rx->n_dormant;
+		return;
+	}
+
+	(void)aurx_stream_decode(&a->rx, mb);
+}
+
+
+/*
+ * The frames lost before a RED packet are decoded from its redundant
+ * blocks, as far as it has them, and the others are concealed.
+ */
+static void red_recv(struct audio *a, const struct rtp_header *hdr,
+		     struct mbuf *mb)
+{
+	struct red_block blkv[RED_RX_BLOCKS];
+	struct aurx *rx = &a->rx;
+	struct rtp_header h = *hdr;
+	unsigned i, n = RED_RX_BLOCKS;
+	unsigned lost = 0, recov;
+	bool lost_pkt = rx->red_lost;
+
+	rx->red      = true;
+	rx->red_lost = false;
+
+	if (lost_pkt)
+		lost = (uint16_t)(hdr->seq - rx->seq - 1);
+
+	rx->seq = hdr->seq;
+
+	if (red_decode(blkv, &n, hdr->ts, mb)) {
+		debug("audio: invalid RED payload (%zu bytes)\n",
+		      mbuf_get_left(mb));
+		if (lost_pkt)
+			recv_payload(a, hdr, NULL);
+		return;
+	}
+
+	/* only blocks of the same codec as the primary */
+	for (recov = 0; recov < min(lost, n - 1); recov++) {
+		if (blkv[n - 2 - recov].pt != blkv[n - 1].pt)
+			break;
+	}
+
+	if (lost_pkt && recov < max(lost, 1u))
+		recv_payload(a, hdr, NULL);
+
+	for (i = n - 1 - recov; i < n; i++) {
+
+		struct mbuf mbb;
+
+		mbb.buf  = (uint8_t *)blkv[i].buf;
+		mbb.size = blkv[i].len;
+		mbb.pos  = 0;
+		mbb.end  = blkv[i].len;
+
+		h.pt = blkv[i].pt;
+		h.ts = blkv[i].ts;
+
+		recv_payload(a, &h, &mbb);
+	}
+}
+
+
+/* Handle incoming stream data from the network */
+static void stream_recv_handler(const struct rtp_header *hdr,
+				struct mbuf *mb, void *arg)
+{
+	struct audio *a = arg;
+	struct aurx *rx = &a->rx;
+	uint8_t dbov;
+	bool voice;
+
+	if (mb && rx->spk.grp &&
+	    !stream_rx_audio_level(a->strm, hdr, mb, &dbov, &voice))
+		speaker_level(&rx->spk, dbov, voice);
+
+	if (!mb) {
+		/* the next RED packet may have the lost frame */
+		if (rx->red) {
+			rx->red_lost = true;
+			return;
+		}
+	}
+	else if (a->ptv[hdr->pt & 0x7f] == PTC_RED) {
+		red_recv(a, hdr, mb);
+		return;
+	}
+	else {
+		if (rx->red_lost)
+			recv_payload(a, hdr, NULL);
+
+		rx->red      = false;
+		rx->red_lost = false;
+		rx->seq      = hdr->seq;
+	}
+
+	recv_payload(a, hdr, mb);
+}
+
+
+/* A multiple of the negotiated ptime that the peer and the buffers take */
+static bool ptime_usable(const struct autx *tx, uint32_t ptime)
+{
+	if (ptime > tx->ptime_max)
+		return false;
+
+	if (calc_nsamp(tx->ausrc_prm.srate, tx->ausrc_prm.ch,
+		       ptime) > tx->sampsz ||
+	    get_framesize(tx->ac, ptime) > tx->sampsz)
+		return false;
+
+	return tx->ac->ptimeh(ptime);
+}
+
+
+/*
+ * On a congested link (high loss or RTT reported by the peer) the
+ * packet time is increased one step, to send fewer packets with less
+ * header overhead. After a few good reports it is decreased again,
+ * down to the negotiated ptime. The steps are multiples of the
+ * negotiated ptime, up to the maxptime of the peer, and only with an
+ * encoder that takes frames of that length.
+ */
+static void ptime_adapt(struct audio *a, uint8_t fraction)
+{
+	struct autx *tx = &a->tx;
+	struct stream_stats st;
+	uint32_t cur, next, p;
+
+	if (!a->cfg.ptime_adapt || !tx->ac || !tx->ac->ptimeh ||
+	    !tx->ausrc || tx->ptime_max <= tx->ptime_neg)
+		return;
+
+	if (stream_stats(a->strm, &st))
+		return;
+
+	cur  = tx->ptime_next;
+	next = cur;
+
+	if (fraction > PTIME_LOSS_HIGH || st.rtt > PTIME_RTT_HIGH) {
+
+		tx->ptime_good = 0;
+
+		for (p = cur + tx->ptime_neg; p <= tx->ptime_max;
+		     p += tx->ptime_neg) {
+
+			if (ptime_usable(tx, p)) {
+				next = p;
+				break;
+			}
+		}
+	}
+	else if (fraction < PTIME_LOSS_LOW && st.rtt < PTIME_RTT_LOW) {
+
+		if (++tx->ptime_good < PTIME_GOOD)
+			return;
+
+		tx->ptime_good = 0;
+
+		for (p = cur - tx->ptime_neg; p > tx->ptime_neg;
+		     p -= tx->ptime_neg) {
+
+			if (ptime_usable(tx, p)) {
+				next = p;
+				break;
+			}
+		}
+
+		if (next == cur)
+			next = tx->ptime_neg;
+	}
+	else {
+		tx->ptime_good = 0;
+	}
+
+	if (next == cur)
+		return;
+
+	info("audio: ptime %ums -> %ums (loss %u%%, rtt %ums)\n",
+	     cur, next, fraction * 100 / 256, st.rtt / 1000);
+
+	__atomic_store_n(&tx->ptime_next, next, __ATOMIC_RELEASE);
+}
+
+
+/* Packet loss reported by the peer, for encoders that adapt to it */
+static void stream_loss_handler(uint8_t fraction, void *arg)
+{
+	struct audio *a = arg;
+	struct autx *tx = &a->tx;
+
+	if (tx->ac && tx->ac->lossh && tx->enc)
+		tx->ac->lossh(tx->enc, fraction * 100 / 256);
+
+	ptime_adapt(a, fraction);
+}
+
+
+/*
+ * Classify the negotiated payload types, so that the packets are
+ * dispatched without looking up and comparing the SDP formats.
+ * Called when the SDP is negotiated and when the stream starts.
+ */
+static void pt_classify(struct audio *a)
+{
+	const struct sdp_media *m = stream_sdpmedia(a->strm);
+	const struct sdp_format *fmt;
+	struct le *le;
+
+	memset(a->ptv, PTC_NONE, sizeof(a->ptv));
+
+	for (le = list_head(sdp_media_format_lst(m, true)); le;
+	     le = le->next) {
+
+		enum pt_class ptc = PTC_NONE;
 
-	if (!mb)
-		goto out;
+		fmt = le->data;
 
-	/* Telephone event? */
-	if (hdr->pt != rx->pt) {
-		const struct sdp_format *fmt;
+		if (fmt->pt < 0 || fmt->pt > PT_DYN_MAX)
+			continue;
 
-		fmt = sdp_media_lformat(stream_sdpmedia(a->strm), hdr->pt);
+		if (!str_casecmp(fmt->name, telev_rtpfmt))
+			ptc = PTC_TELEV;
+		else if (!str_casecmp(fmt->name, "CN"))
+			ptc = PTC_CN;
+		else if (!str_casecmp(fmt->name, "ulpfec"))
+			ptc = PTC_FEC;
+		else if (!str_casecmp(fmt->name, "red"))
+			ptc = PTC_RED;
+		else if (fmt->data)
+			ptc = PTC_AUDIO;
 
-		if (fmt && !str_casecmp(fmt->name, "telephone-event")) {
-			handle_telev(a, mb);
-			return;
-		}
+		/* the first format with a payload type is used, as
+		   with sdp_media_lformat() */
+		if (a->ptv[fmt->pt] == PTC_NONE)
+			a->ptv[fmt->pt] = ptc;
 	}
 
-	/* Comfort Noise (CN) as of RFC 3389 */
-	if (PT_CN == hdr->pt)
-		return;
+	fmt = sdp_media_rformat(m, telev_rtpfmt);
+	a->tx.pt_telev = fmt ? fmt->pt : -1;
 
-	/* Audio payload-type changed? */
-	/* XXX: this logic should be moved to stream.c */
-	if (hdr->pt != rx->pt) {
+	fmt = sdp_media_rformat(m, "CN");
+	a->tx.pt_cn = fmt ? fmt->pt : -1;
 
-		err = pt_handler(a, rx->pt, hdr->pt);
-		if (err)
-			return;
-	}
+	fmt = a->cfg.red ? sdp_media_rformat(m, "red") : NULL;
+	a->tx.pt_red    = fmt ? fmt->pt : -1;
+	a->tx.red_crate = fmt ? fmt->srate : 0;
+}
 
- out:
-	(void)aurx_stream_decode(&a->rx, mb);
+
+/* Redundant audio data (RFC 2198) of the first codec */
+static int add_red_codec(struct audio *a)
+{
+	struct sdp_media *m = stream_sdpmedia(audio_strm(a));
+	const struct sdp_format *fmt;
+	const unsigned depth = min(a->cfg.red, (uint32_t)RED_DEPTH_MAX);
+
+	fmt = list_ledata(list_head(sdp_media_format_lst(m, true)));
+	if (!fmt)
+		return 0;
+
+	return sdp_format_add(NULL, m, false, NULL, "red", fmt->srate,
+			      fmt->ch, NULL, NULL, NULL, false,
+			      "%s/%s%s%s", fmt->id, fmt->id,
+			      depth > 1 ? "/" : "", depth > 1 ? fmt->id : "");
 }
 
 
@@ -674,6 +1866,29 @@ static int add_telev_codec(struct audio *a)
 }
 
 
+/*
+ * The sample buffers hold the longest frame of the stream, 60 ms at
+ * 48000 Hz, for the most channels of the codecs and the devices. It is
+ * at least stereo.
+ */
+static size_t calc_sampsz(const struct config_audio *cfg,
+			  const struct list *aucodecl)
+{
+	uint32_t ch = max(cfg->channels_src, cfg->channels_play);
+	struct le *le;
+
+	ch = max(ch, 2u);
+
+	for (le = list_head(aucodecl); le; le = le->next) {
+		const struct aucodec *ac = le->data;
+
+		ch = max(ch, (uint32_t)ac->ch);
+	}
+
+	return AUDIO_CHSAMP * ch;
+}
+
+
 int audio_alloc(struct audio **ap, const struct config *cfg,
 		struct call *call, struct sdp_session *sdp_sess, int label,
 		const struct mnat *mnat, struct mnat_sess *mnat_sess,
@@ -694,12 +1909,20 @@ int audio_alloc(struct audio **ap, const struct config *cfg,
 	if (!a)
 		return ENOMEM;
 
+	memtag_alloc(memtag_core(MEMTAG_AUDIO), sizeof(*a));
+
 	MAGIC_INIT(a);
 
 	a->cfg = cfg->audio;
 	tx = &a->tx;
 	rx = &a->rx;
 
+	tx->sampsz = calc_sampsz(&a->cfg, aucodecl);
+	rx->sampsz = tx->sampsz;
+
+	pipeprof_init(&tx->prof, a->cfg.profile);
+	pipeprof_init(&rx->prof, a->cfg.profile);
+
 	err = stream_alloc(&a->strm, &cfg->avt, call, sdp_sess,
 			   "audio", label,
 			   mnat, mnat_sess, menc, menc_sess,
@@ -708,10 +1931,17 @@ int audio_alloc(struct audio **ap, const struct config *cfg,
 	if (err)
 		goto out;
 
+	rx->strm = a->strm;
+
 	if (cfg->avt.rtp_bw.max) {
 		stream_set_bw(a->strm, AUDIO_BANDWIDTH);
 	}
 
+	stream_set_loss_handler(a->strm, stream_loss_handler, a);
+
+	if (a->cfg.timestretch)
+		stream_jbuf_smooth(a->strm, true);
+
 	err = sdp_media_set_lattr(stream_sdpmedia(a->strm), true,
 				  "ptime", "%u", ptime);
 	if (err)
@@ -719,15 +1949,14 @@ int audio_alloc(struct audio **ap, const struct config *cfg,
 
 	/* Audio codecs */
 	for (le = list_head(aucodecl); le; le = le->next) {
-		err = add_audio_codec(a, stream_sdpmedia(a->strm), le->data);
+		err = add_audio_codec(stream_sdpmedia(a->strm), le->data);
 		if (err)
 			goto out;
 	}
 
-	tx->mb = mbuf_alloc(STREAM_PRESZ + 4096);
-	tx->sampv = mem_zalloc(AUDIO_SAMPSZ * 2, NULL);
-	rx->sampv = mem_zalloc(AUDIO_SAMPSZ * 2, NULL);
-	if (!tx->mb || !tx->sampv || !rx->sampv) {
+	/* 4096 bytes for each pair of channels */
+	tx->mb = mbuf_alloc(STREAM_PRESZ + 2048 * tx->sampsz / AUDIO_CHSAMP);
+	if (!tx->mb) {
 		err = ENOMEM;
 		goto out;
 	}
@@ -740,23 +1969,97 @@ int audio_alloc(struct audio **ap, const struct config *cfg,
 	if (err)
 		goto out;
 
-	auresamp_init(&tx->resamp);
+	if (a->cfg.dtx) {
+		err = sdp_format_add(NULL, stream_sdpmedia(a->strm), false,
+				     "13", "CN", 8000, 1, NULL, NULL, NULL,
+				     false, NULL);
+		if (err)
+			goto out;
+	}
+
+	if (!list_isempty(aucodecl)) {
+		const struct aucodec *ac = list_ledata(list_head(aucodecl));
+
+		err = stream_enable_fec(a->strm, ac->crate);
+		if (err)
+			goto out;
+	}
+
+	if (a->cfg.red && !list_isempty(aucodecl)) {
+		err = add_red_codec(a);
+		if (err)
+			goto out;
+	}
+
 	str_ncpy(tx->device, a->cfg.src_dev, sizeof(tx->device));
 	tx->ptime  = ptime;
+	tx->ptime_neg  = ptime;
+	tx->ptime_next = ptime;
 	tx->ts     = rand_u16();
 	tx->marker = true;
+	tx->gain   = 100;
+	tx->pt_telev = -1;
+	tx->pt_cn    = -1;
+	tx->vad      = -1;
+	tx->pt_red   = -1;
+	red_enc_init(&tx->red, a->cfg.red);
 
-	auresamp_init(&rx->resamp);
 	str_ncpy(rx->device, a->cfg.play_dev, sizeof(rx->device));
 	rx->pt     = -1;
 	rx->ptime  = ptime;
+	rx->gain   = 100;
+
+	/* only the loudest streams of a conference are decoded */
+	if (a->cfg.speakers) {
+		err = speaker_join(&rx->spk, a->cfg.play_mod,
+				   a->cfg.play_dev, a->cfg.speakers);
+		if (err)
+			goto out;
+	}
+
+	/* the source clocks the encoder, the jitter buffer starts with one
+	 * frame and only grows with the jitter of the network */
+	if (a->cfg.low_latency) {
+		a->cfg.txmode = AUDIO_MODE_POLL;
+		tx->direct    = true;
+
+		err = stream_jbuf_reset(a->strm, 1, cfg->avt.jbuf_del.max);
+		if (err)
+			goto out;
+	}
 
 	a->eventh  = eventh;
 	a->errh    = errh;
 	a->arg     = arg;
 
-	if (a->cfg.txmode == AUDIO_MODE_TMR)
+	switch (a->cfg.txmode) {
+
+#ifdef HAVE_PTHREAD
+	case AUDIO_MODE_EVENT:
+		err = pthread_mutex_init(&tx->u.thr.mutex, NULL);
+		if (err) {
+			a->cfg.txmode = AUDIO_MODE_POLL;
+			goto out;
+		}
+
+		err = pthread_cond_init(&tx->u.thr.cond, NULL);
+		if (err) {
+			pthread_mutex_destroy(&tx->u.thr.mutex);
+			a->cfg.txmode = AUDIO_MODE_POLL;
+			goto out;
+		}
+
+		tx->u.thr.up = true;
+		break;
+#endif
+
+	case AUDIO_MODE_TMR:
 		tmr_init(&tx->u.tmr);
+		break;
+
+	default:
+		break;
+	}
 
  out:
 	if (err)
@@ -779,11 +2082,13 @@ static void *tx_thread(void *arg)
 	if (a->cfg.txmode == AUDIO_MODE_THREAD_REALTIME)
 		(void)realtime_enable(true, 1);
 
+	(void)realtime_affinity(a->cfg.cpus_tx, -1);
+
 	while (a->tx.u.thr.run) {
 
 		for (i=0; i<16; i++) {
 
-			if (aubuf_cur_size(tx->aubuf) < tx->psize)
+			if (autx_cur_size(tx) < tx->psize)
 				break;
 
 			poll_aubuf_tx(a);
@@ -794,6 +2099,49 @@ static void *tx_thread(void *arg)
 
 	return NULL;
 }
+
+
+/*
+ * Event-driven transmit thread. Sleeps until the audio source signals
+ * that at least one packet is buffered, then encodes without delay.
+ */
+static void *tx_thread_event(void *arg)
+{
+	struct audio *a = arg;
+	struct autx *tx = &a->tx;
+	unsigned i;
+	bool run;
+
+	(void)realtime_affinity(a->cfg.cpus_tx, -1);
+
+	for (;;) {
+
+		pthread_mutex_lock(&tx->u.thr.mutex);
+
+		while (tx->u.thr.run &&
+		       autx_cur_size(tx) < tx->psize) {
+			pthread_cond_wait(&tx->u.thr.cond, &tx->u.thr.mutex);
+		}
+
+		/* the flag is written by stop_tx() with the mutex */
+		run = tx->u.thr.run;
+
+		pthread_mutex_unlock(&tx->u.thr.mutex);
+
+		if (!run)
+			break;
+
+		for (i=0; i<16; i++) {
+
+			if (autx_cur_size(tx) < tx->psize)
+				break;
+
+			poll_aubuf_tx(a);
+		}
+	}
+
+	return NULL;
+}
 #endif
 
 
@@ -807,7 +2155,28 @@ static void timeout_tx(void *arg)
 
 	for (i=0; i<16; i++) {
 
-		if (aubuf_cur_size(tx->aubuf) < tx->psize)
+		if (autx_cur_size(tx) < tx->psize)
+			break;
+
+		poll_aubuf_tx(a);
+	}
+}
+
+
+/*
+ * Called from a shared transmit pool worker
+ *
+ * @note This function has REAL-TIME properties
+ */
+static void pool_tx(void *arg)
+{
+	struct audio *a = arg;
+	struct autx *tx = &a->tx;
+	unsigned i;
+
+	for (i=0; i<16; i++) {
+
+		if (autx_cur_size(tx) < tx->psize)
 			break;
 
 		poll_aubuf_tx(a);
@@ -815,7 +2184,7 @@ static void timeout_tx(void *arg)
 }
 
 
-static void aufilt_param_set(struct aufilt_prm *prm,
+static void aufilt_param_set(struct aufilt_prm *prm, const struct audio *a,
 			     const struct aucodec *ac, uint32_t ptime)
 {
 	if (!ac) {
@@ -826,19 +2195,24 @@ static void aufilt_param_set(struct aufilt_prm *prm,
 	prm->srate      = get_srate(ac);
 	prm->ch         = get_ch(ac);
 	prm->ptime      = ptime;
+	prm->plc        = ac->plch != NULL;
+	prm->au         = a;
 }
 
 
 static int autx_print_pipeline(struct re_printf *pf, const struct autx *autx)
 {
+	const struct ausrc_st *st;
 	struct le *le;
 	int err;
 
 	if (!autx)
 		return 0;
 
+	st = ausrc_sub_st(autx->ausrc);
+
 	err = re_hprintf(pf, "audio tx pipeline:  %10s",
-			 autx->ausrc ? autx->ausrc->as->name : "src");
+			 st ? st->as->name : "src");
 
 	for (le = list_head(&autx->filtl); le; le = le->next) {
 		struct aufilt_enc_st *st = le->data;
@@ -856,14 +2230,17 @@ static int autx_print_pipeline(struct re_printf *pf, const struct autx *autx)
 
 static int aurx_print_pipeline(struct re_printf *pf, const struct aurx *aurx)
 {
+	const struct auplay_st *st;
 	struct le *le;
 	int err;
 
 	if (!aurx)
 		return 0;
 
+	st = auplay_sub_st(aurx->auplay);
+
 	err = re_hprintf(pf, "audio rx pipeline:  %10s",
-			 aurx->auplay ? aurx->auplay->ap->name : "play");
+			 st ? st->ap->name : "play");
 
 	for (le = list_head(&aurx->filtl); le; le = le->next) {
 		struct aufilt_dec_st *st = le->data;
@@ -903,8 +2280,8 @@ static int aufilt_setup(struct audio *a)
 	if (!list_isempty(&tx->filtl) || !list_isempty(&rx->filtl))
 		return 0;
 
-	aufilt_param_set(&encprm, tx->ac, tx->ptime);
-	aufilt_param_set(&decprm, rx->ac, rx->ptime);
+	aufilt_param_set(&encprm, a, tx->ac, tx->ptime);
+	aufilt_param_set(&decprm, a, rx->ac, rx->ptime);
 
 	/* Audio filters */
 	for (le = list_head(aufilt_list()); le; le = le->next) {
@@ -913,22 +2290,28 @@ static int aufilt_setup(struct audio *a)
 		struct aufilt_dec_st *decst = NULL;
 		void *ctx = NULL;
 
+		/* a filter may not be needed for the encoder */
 		if (af->encupdh) {
 			err |= af->encupdh(&encst, &ctx, af, &encprm);
 			if (err)
 				break;
 
-			encst->af = af;
-			list_append(&tx->filtl, &encst->le, encst);
+			if (encst) {
+				encst->af = af;
+				list_append(&tx->filtl, &encst->le, encst);
+			}
 		}
 
+		/* a filter may not be needed for the decoder */
 		if (af->decupdh) {
 			err |= af->decupdh(&decst, &ctx, af, &decprm);
 			if (err)
 				break;
 
-			decst->af = af;
-			list_append(&rx->filtl, &decst->le, decst);
+			if (decst) {
+				decst->af = af;
+				list_append(&rx->filtl, &decst->le, decst);
+			}
 		}
 
 		if (err) {
@@ -942,6 +2325,163 @@ static int aufilt_setup(struct audio *a)
 }
 
 
+/*
+ * Float buffers are used with a codec that takes float samples, when
+ * none of the S16 processing steps (filters, resampler, time-stretching,
+ * drift compensation, lock-free ring) is in the pipeline. The device is
+ * then asked for float samples, and S16 is the fallback.
+ */
+static bool aurx_use_float(const struct aurx *rx, const struct audio *a,
+			   bool resamp)
+{
+	return rx->ac->dech_fmt && list_isempty(&rx->filtl) && !resamp &&
+		!a->cfg.timestretch && !a->cfg.drift && !a->cfg.ringbuf;
+}
+
+
+static bool autx_use_float(const struct autx *tx, const struct audio *a,
+			   bool resamp)
+{
+	return tx->ac->ench_fmt && list_isempty(&tx->filtl) && !resamp &&
+		!a->cfg.drift && !a->cfg.ringbuf;
+}
+
+
+static int alloc_float(float **sampvp, float **sampv_cvp, size_t sampsz)
+{
+	if (!*sampvp)
+		*sampvp = mem_zalloc(sampsz * sizeof(float), NULL);
+	if (!*sampv_cvp)
+		*sampv_cvp = mem_zalloc(sampsz * sizeof(float), NULL);
+
+	return *sampvp && *sampv_cvp ? 0 : ENOMEM;
+}
+
+
+/* Allocate the buffer for the sample format and open the player */
+/* The module is in the list of modules with shared devices */
+static bool device_shared(const struct audio *a, const char *mod)
+{
+	struct pl pl, name;
+
+	if (!str_isset(mod))
+		return false;
+
+	/* the devices in standby are shared */
+	if (a->cfg.warmup && (!str_casecmp(mod, a->cfg.play_mod) ||
+			      !str_casecmp(mod, a->cfg.src_mod)))
+		return true;
+
+	pl_set_str(&pl, a->cfg.share);
+
+	while (!re_regex(pl.p, pl.l, "[^, \t]+", &name)) {
+
+		if (!pl_strcasecmp(&name, mod))
+			return true;
+
+		pl.l -= name.p + name.l - pl.p;
+		pl.p  = name.p + name.l;
+	}
+
+	return false;
+}
+
+
+static int open_player(struct aurx *rx, struct audio *a,
+		       const struct auplay_prm *prm)
+{
+	int err;
+
+	if (rx->aubuf && rx->fmt != prm->fmt)
+		rx->aubuf = mem_deref(rx->aubuf);
+
+	if (!rx->aubuf && !rx->ring) {
+		size_t psize;
+
+		psize = aufmt_sample_size(prm->fmt)
+			* calc_nsamp(prm->srate, prm->ch, prm->ptime);
+
+		if (a->cfg.ringbuf) {
+			err = auring_alloc(&rx->ring, psize/2,
+					   max(psize/2 * 8, rx->sampsz));
+		}
+		else {
+			err = aubuf_alloc(&rx->aubuf, psize * 1, psize * 8);
+		}
+		if (err)
+			return err;
+	}
+
+	if (prm->fmt == AUFMT_FLOAT) {
+		err = alloc_float(&rx->sampv_f, &rx->sampv_cv, rx->sampsz);
+		if (err)
+			return err;
+	}
+
+	rx->fmt        = prm->fmt;
+	rx->auplay_prm = *prm;
+
+	err = auplay_subscribe(&rx->auplay, a->cfg.play_mod,
+			       &rx->auplay_prm, rx->device,
+			       device_shared(a, a->cfg.play_mod),
+			       auplay_write_handler, rx);
+	if (err)
+		return err;
+
+	auplay_sub_gain(rx->auplay, rx->gain);
+
+	return 0;
+}
+
+
+/* Allocate the buffer for the sample format and open the source */
+static int open_source(struct autx *tx, struct audio *a,
+		       const struct ausrc_prm *prm)
+{
+	int err;
+
+	if (tx->aubuf && tx->fmt != prm->fmt)
+		tx->aubuf = mem_deref(tx->aubuf);
+
+	tx->psize = aufmt_sample_size(prm->fmt)
+		* calc_nsamp(prm->srate, prm->ch, prm->ptime);
+
+	if (!tx->aubuf && !tx->ring) {
+		if (a->cfg.ringbuf) {
+			err = auring_alloc(&tx->ring, 0,
+					   max(tx->psize/2 * 30,
+					       tx->sampsz));
+		}
+		else {
+			err = aubuf_alloc(&tx->aubuf, tx->psize * 2,
+					  tx->psize * 30);
+		}
+		if (err)
+			return err;
+	}
+
+	if (prm->fmt == AUFMT_FLOAT) {
+		err = alloc_float(&tx->sampv_f, &tx->sampv_cv, tx->sampsz);
+		if (err)
+			return err;
+	}
+
+	tx->fmt       = prm->fmt;
+	tx->ausrc_prm = *prm;
+
+	err = ausrc_subscribe(&tx->ausrc, NULL, a->cfg.src_mod,
+			      &tx->ausrc_prm, tx->device,
+			      device_shared(a, a->cfg.src_mod),
+			      ausrc_read_handler, ausrc_error_handler, a);
+	if (err)
+		return err;
+
+	ausrc_sub_gain(tx->ausrc, tx->gain);
+
+	return 0;
+}
+
+
 static int start_player(struct aurx *rx, struct audio *a)
 {
 	const struct aucodec *ac = rx->ac;
@@ -964,20 +2504,23 @@ static int start_player(struct aurx *rx, struct audio *a)
 		channels_dsp = a->cfg.channels_play;
 	}
 
+	/* ambisonics are decoded for the speakers */
+	if (ac->layout != AULAYOUT_STD)
+		resamp = true;
+
 	/* Optional resampler, if configured */
-	if (resamp && !rx->sampv_rs) {
+	if (resamp && !rx->resamp) {
 
 		info("audio: enable auplay resampler:"
 		     " %uHz/%uch --> %uHz/%uch\n",
 		     get_srate(ac), get_ch(ac), srate_dsp, channels_dsp);
 
-		rx->sampv_rs = mem_zalloc(AUDIO_SAMPSZ * 2, NULL);
-		if (!rx->sampv_rs)
-			return ENOMEM;
-
-		err = auresamp_setup(&rx->resamp,
-				     get_srate(ac), get_ch(ac),
-				     srate_dsp, channels_dsp);
+		err = resamp_alloc(&rx->resamp,
+				   get_srate(ac), get_ch(ac),
+				   srate_dsp, channels_dsp);
+		if (!err)
+			err = resamp_layout(rx->resamp, ac->layout,
+					    AULAYOUT_STD);
 		if (err) {
 			warning("audio: could not setup auplay resampler"
 				" (%m)\n", err);
@@ -993,27 +2536,52 @@ static int start_player(struct aurx *rx, struct audio *a)
 		prm.srate      = srate_dsp;
 		prm.ch         = channels_dsp;
 		prm.ptime      = rx->ptime;
+		prm.fmt        = aurx_use_float(rx, a, resamp)
+			? AUFMT_FLOAT : AUFMT_S16LE;
 
-		if (!rx->aubuf) {
-			size_t psize;
+		if (a->cfg.timestretch) {
 
-			psize = 2 * calc_nsamp(prm.srate, prm.ch, prm.ptime);
+			if (!rx->sampv_ts) {
+				rx->sampv_ts = mem_zalloc(rx->sampsz * 4,
+							  NULL);
+				if (!rx->sampv_ts)
+					return ENOMEM;
+			}
 
-			err = aubuf_alloc(&rx->aubuf, psize * 1, psize * 8);
+			rx->wsola = mem_deref(rx->wsola);
+
+			err = wsola_alloc(&rx->wsola, prm.srate, prm.ch);
+			if (err)
+				return err;
+		}
+
+		if (a->cfg.drift) {
+
+			if (!rx->sampv_dr) {
+				rx->sampv_dr = mem_zalloc(DRIFT_FACTOR *
+							  rx->sampsz * 2,
+							  NULL);
+				if (!rx->sampv_dr)
+					return ENOMEM;
+			}
+
+			rx->drift = mem_deref(rx->drift);
+
+			err = audrift_alloc(&rx->drift, prm.srate, prm.ch);
 			if (err)
 				return err;
 		}
 
-		err = auplay_alloc(&rx->auplay, a->cfg.play_mod,
-				   &prm, rx->device,
-				   auplay_write_handler, rx);
+		err = open_player(rx, a, &prm);
+		if (err == ENOTSUP && prm.fmt != AUFMT_S16LE) {
+			prm.fmt = AUFMT_S16LE;
+			err = open_player(rx, a, &prm);
+		}
 		if (err) {
 			warning("audio: start_player failed (%s.%s): %m\n",
 				a->cfg.play_mod, rx->device, err);
 			return err;
 		}
-
-		rx->auplay_prm = prm;
 	}
 
 	return 0;
@@ -1042,20 +2610,22 @@ static int start_source(struct autx *tx, struct audio *a)
 		channels_dsp = a->cfg.channels_src;
 	}
 
+	if (ac->layout != AULAYOUT_STD)
+		resamp = true;
+
 	/* Optional resampler, if configured */
-	if (resamp && !tx->sampv_rs) {
+	if (resamp && !tx->resamp) {
 
 		info("audio: enable ausrc resampler:"
 		     " %uHz/%uch <-- %uHz/%uch\n",
 		     get_srate(ac), get_ch(ac), srate_dsp, channels_dsp);
 
-		tx->sampv_rs = mem_zalloc(AUDIO_SAMPSZ * 2, NULL);
-		if (!tx->sampv_rs)
-			return ENOMEM;
-
-		err = auresamp_setup(&tx->resamp,
-				     srate_dsp, channels_dsp,
-				     get_srate(ac), get_ch(ac));
+		err = resamp_alloc(&tx->resamp,
+				   srate_dsp, channels_dsp,
+				   get_srate(ac), get_ch(ac));
+		if (!err)
+			err = resamp_layout(tx->resamp, AULAYOUT_STD,
+					    ac->layout);
 		if (err) {
 			warning("audio: could not setup ausrc resampler"
 				" (%m)\n", err);
@@ -1071,19 +2641,33 @@ static int start_source(struct autx *tx, struct audio *a)
 		prm.srate      = srate_dsp;
 		prm.ch         = channels_dsp;
 		prm.ptime      = tx->ptime;
+		prm.fmt        = autx_use_float(tx, a, resamp)
+			? AUFMT_FLOAT : AUFMT_S16LE;
+
+		/* in poll and event mode the source clocks the sender */
+		if (a->cfg.drift && a->cfg.txmode != AUDIO_MODE_POLL &&
+		    a->cfg.txmode != AUDIO_MODE_EVENT) {
+
+			if (!tx->sampv_dr) {
+				tx->sampv_dr = mem_zalloc(DRIFT_FACTOR *
+							  tx->sampsz * 2,
+							  NULL);
+				if (!tx->sampv_dr)
+					return ENOMEM;
+			}
 
-		tx->psize = 2 * calc_nsamp(prm.srate, prm.ch, prm.ptime);
+			tx->drift = mem_deref(tx->drift);
 
-		if (!tx->aubuf) {
-			err = aubuf_alloc(&tx->aubuf, tx->psize * 2,
-					  tx->psize * 30);
+			err = audrift_alloc(&tx->drift, prm.srate, prm.ch);
 			if (err)
 				return err;
 		}
 
-		err = ausrc_alloc(&tx->ausrc, NULL, a->cfg.src_mod,
-				  &prm, tx->device,
-				  ausrc_read_handler, ausrc_error_handler, a);
+		err = open_source(tx, a, &prm);
+		if (err == ENOTSUP && prm.fmt != AUFMT_S16LE) {
+			prm.fmt = AUFMT_S16LE;
+			err = open_source(tx, a, &prm);
+		}
 		if (err) {
 			warning("audio: start_source failed (%s.%s): %m\n",
 				a->cfg.src_mod, tx->device, err);
@@ -1097,9 +2681,21 @@ static int start_source(struct autx *tx, struct audio *a)
 			if (!tx->u.thr.run) {
 				tx->u.thr.run = true;
 				err = pthread_create(&tx->u.thr.tid, NULL,
-						     tx_thread, a);
+						     tx_thread, a);
+				if (err) {
+					tx->u.thr.run = false;
+					return err;
+				}
+			}
+			break;
+
+		case AUDIO_MODE_EVENT:
+			if (!tx->u.thr.run) {
+				tx->u.thr.run = true;
+				err = pthread_create(&tx->u.thr.tid, NULL,
+						     tx_thread_event, a);
 				if (err) {
-					tx->u.thr.tid = false;
+					tx->u.thr.run = false;
 					return err;
 				}
 			}
@@ -1110,11 +2706,22 @@ static int start_source(struct autx *tx, struct audio *a)
 			tmr_start(&tx->u.tmr, 1, timeout_tx, a);
 			break;
 
+		case AUDIO_MODE_POOL:
+			if (!tx->u.pool.shard) {
+				err = txpool_attach(&tx->u.pool,
+						    a->cfg.txpool_threads,
+						    a->affinity, pool_tx, a);
+				if (err) {
+					warning("audio: txpool attach"
+						" failed (%m)\n", err);
+					return err;
+				}
+			}
+			break;
+
 		default:
 			break;
 		}
-
-		tx->ausrc_prm = prm;
 	}
 
 	return 0;
@@ -1135,6 +2742,12 @@ int audio_start(struct audio *a)
 	if (!a)
 		return EINVAL;
 
+	/* a reflected stream has no codecs and no devices */
+	if (stream_is_reflected(a->strm))
+		return 0;
+
+	pt_classify(a);
+
 	/* Audio filter */
 	if (!list_isempty(aufilt_list())) {
 		err = aufilt_setup(a);
@@ -1194,14 +2807,40 @@ int audio_encoder_set(struct audio *a, const struct aucodec *ac,
 	if (!a || !ac)
 		return EINVAL;
 
+	if (stream_is_reflected(a->strm))
+		return 0;
+
+	ac = module_lazy_aucodec(ac);
+	if (!ac)
+		return ENOENT;
+
 	tx = &a->tx;
 
+	if (AUDIO_CHSAMP * get_ch(ac) > tx->sampsz) {
+		warning("audio: %s: %u channels not supported\n",
+			ac->name, get_ch(ac));
+		return ENOTSUP;
+	}
+
+	/* a change that was not switched to yet is replaced */
+	enc_next_cancel(tx);
+
+	/* a re-offer of the same codec keeps the encoder as it is */
+	if (ac == tx->ac && tx->ausrc && pt_tx == tx->pt &&
+	    0 == str_cmp(params ? params : "",
+			 tx->enc_fmtp ? tx->enc_fmtp : ""))
+		return 0;
+
 	reset = !aucodec_equal(ac, tx->ac);
 
 	if (ac != tx->ac) {
 		info("audio: Set audio encoder: %s %uHz %dch\n",
 		     ac->name, get_srate(ac), get_ch(ac));
 
+		/* the source is kept, the encoders are switched by it */
+		if (!reset && tx->ausrc)
+			return enc_prewarm(a, ac, pt_tx, params);
+
 		/* Audio source must be stopped first */
 		if (reset) {
 			tx->ausrc = mem_deref(tx->ausrc);
@@ -1209,6 +2848,11 @@ int audio_encoder_set(struct audio *a, const struct aucodec *ac,
 
 		tx->enc = mem_deref(tx->enc);
 		tx->ac = ac;
+
+		/* the new encoder starts with the negotiated ptime */
+		tx->ptime_good = 0;
+		__atomic_store_n(&tx->ptime_next, tx->ptime_neg,
+				 __ATOMIC_RELEASE);
 	}
 
 	if (ac->encupdh) {
@@ -1223,6 +2867,14 @@ int audio_encoder_set(struct audio *a, const struct aucodec *ac,
 		}
 	}
 
+	tx->enc_fmtp = mem_deref(tx->enc_fmtp);
+	if (params) {
+		err = str_dup(&tx->enc_fmtp, params);
+		if (err)
+			return err;
+	}
+	tx->pt = pt_tx;
+
 	stream_set_srate(a->strm, ac->crate, ac->crate);
 	stream_update_encoder(a->strm, pt_tx);
 
@@ -1244,8 +2896,21 @@ int audio_decoder_set(struct audio *a, const struct aucodec *ac,
 	if (!a || !ac)
 		return EINVAL;
 
+	if (stream_is_reflected(a->strm))
+		return 0;
+
+	ac = module_lazy_aucodec(ac);
+	if (!ac)
+		return ENOENT;
+
 	rx = &a->rx;
 
+	if (AUDIO_CHSAMP * get_ch(ac) > rx->sampsz) {
+		warning("audio: %s: %u channels not supported\n",
+			ac->name, get_ch(ac));
+		return ENOTSUP;
+	}
+
 	reset = !aucodec_equal(ac, rx->ac);
 
 	if (ac != rx->ac) {
@@ -1256,6 +2921,7 @@ int audio_decoder_set(struct audio *a, const struct aucodec *ac,
 		rx->pt = pt_rx;
 		rx->ac = ac;
 		rx->dec = mem_deref(rx->dec);
+		rx->fec = false;
 	}
 
 	if (ac->decupdh) {
@@ -1282,6 +2948,44 @@ int audio_decoder_set(struct audio *a, const struct aucodec *ac,
 }
 
 
+/*
+ * The audio belongs to the event loop of the media of its call. The
+ * public functions that are called from another loop run there.
+ */
+struct audio_job {
+	struct audio *a;
+	struct re_printf *pf;    /**< Print handler                      */
+	const char *mod;         /**< Device module                      */
+	const char *dev;         /**< Device, or the source device       */
+	const char *play;        /**< Player device                      */
+	uint32_t gain_src;       /**< Source gain [%]                    */
+	uint32_t gain_play;      /**< Player gain [%]                    */
+	bool muted;              /**< Mute the source                    */
+};
+
+
+static bool audio_remote(const struct audio *a)
+{
+	return call_loop(a->strm->call) != shard_loop();
+}
+
+
+static int audio_exec(struct audio_job *job, shard_exec_h *h)
+{
+	return shard_exec(call_loop(job->a->strm->call), h, job);
+}
+
+
+static int cycle_handler(void *arg)
+{
+	struct audio_job *job = arg;
+
+	audio_encoder_cycle(job->a);
+
+	return 0;
+}
+
+
 /**
  * Use the next audio encoder in the local list of negotiated codecs
  *
@@ -1294,6 +2998,16 @@ void audio_encoder_cycle(struct audio *audio)
 	if (!audio)
 		return;
 
+	if (audio_remote(audio)) {
+		struct audio_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.a = audio;
+
+		(void)audio_exec(&job, cycle_handler);
+		return;
+	}
+
 	rc = sdp_media_format_cycle(stream_sdpmedia(audio_strm(audio)));
 	if (!rc) {
 		info("audio: encoder cycle: no remote codec found\n");
@@ -1310,6 +3024,24 @@ struct stream *audio_strm(const struct audio *a)
 }
 
 
+/**
+ * Set the lip-sync state of the call, to align the audio with the video
+ *
+ * @param a  Audio object
+ * @param as Lip-sync state, or NULL
+ */
+void audio_set_avsync(struct audio *a, struct avsync *as)
+{
+	if (!a)
+		return;
+
+	mem_deref(a->avsync);
+	a->avsync = mem_ref(as);
+
+	stream_set_avsync(a->strm, as, AVSYNC_AUDIO);
+}
+
+
 int audio_send_digit(struct audio *a, char key)
 {
 	int err = 0;
@@ -1341,6 +3073,33 @@ int audio_send_digit(struct audio *a, char key)
 }
 
 
+/**
+ * Set the worker pool affinity of the audio stream. Streams with the
+ * same key are encoded by the same worker in the "pool" transmit mode.
+ * It takes effect when the stream is started.
+ *
+ * @param a    Audio stream
+ * @param key  Affinity key, 0 for the least loaded worker
+ */
+void audio_set_affinity(struct audio *a, uint32_t key)
+{
+	if (!a)
+		return;
+
+	a->affinity = key;
+}
+
+
+static int mute_handler(void *arg)
+{
+	struct audio_job *job = arg;
+
+	audio_mute(job->a, job->muted);
+
+	return 0;
+}
+
+
 /**
  * Mute the audio stream source (i.e. Microphone)
  *
@@ -1352,10 +3111,65 @@ void audio_mute(struct audio *a, bool muted)
 	if (!a)
 		return;
 
+	if (audio_remote(a)) {
+		struct audio_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.a     = a;
+		job.muted = muted;
+
+		(void)audio_exec(&job, mute_handler);
+		return;
+	}
+
 	a->tx.muted = muted;
 }
 
 
+static int gain_handler(void *arg)
+{
+	struct audio_job *job = arg;
+
+	audio_set_gain(job->a, job->gain_src, job->gain_play);
+
+	return 0;
+}
+
+
+/**
+ * Set the gain of the audio source and player of a call
+ *
+ * @param a    Audio stream
+ * @param src  Audio source gain in [%], 100 for unity
+ * @param play Audio player gain in [%], 0 to mute
+ *
+ * @note On a shared device only the audio of this call is changed
+ */
+void audio_set_gain(struct audio *a, uint32_t src, uint32_t play)
+{
+	if (!a)
+		return;
+
+	if (audio_remote(a)) {
+		struct audio_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.a         = a;
+		job.gain_src  = src;
+		job.gain_play = play;
+
+		(void)audio_exec(&job, gain_handler);
+		return;
+	}
+
+	a->tx.gain = src;
+	a->rx.gain = play;
+
+	ausrc_sub_gain(a->tx.ausrc, src);
+	auplay_sub_gain(a->rx.auplay, play);
+}
+
+
 /**
  * Get the mute state of an audio source
  *
@@ -1372,6 +3186,28 @@ bool audio_ismuted(const struct audio *a)
 }
 
 
+/**
+ * Get the level of the last sent and the last decoded audio frame
+ *
+ * @param a      Audio stream
+ * @param tx     Returned transmit level (optional)
+ * @param rx     Returned receive level (optional)
+ *
+ * @note The levels are updated by the audio threads, once per frame
+ */
+void audio_level(const struct audio *a, struct aulevel *tx,
+		 struct aulevel *rx)
+{
+	if (!a)
+		return;
+
+	if (tx)
+		*tx = a->tx.level;
+	if (rx)
+		*rx = a->rx.level;
+}
+
+
 void audio_sdp_attr_decode(struct audio *a)
 {
 	const char *attr;
@@ -1379,6 +3215,8 @@ void audio_sdp_attr_decode(struct audio *a)
 	if (!a)
 		return;
 
+	pt_classify(a);
+
 	/* This is probably only meaningful for audio data, but
 	   may be used with other media types if it makes sense. */
 	attr = sdp_media_rattr(stream_sdpmedia(a->strm), "ptime");
@@ -1386,19 +3224,44 @@ void audio_sdp_attr_decode(struct audio *a)
 		struct autx *tx = &a->tx;
 		uint32_t ptime_tx = atoi(attr);
 
-		if (ptime_tx && ptime_tx != a->tx.ptime) {
+		if (ptime_tx && ptime_tx != a->tx.ptime_neg) {
 
 			info("audio: peer changed ptime_tx %ums -> %ums\n",
-			     a->tx.ptime, ptime_tx);
+			     a->tx.ptime_neg, ptime_tx);
 
 			tx->ptime = ptime_tx;
+			tx->ptime_neg = ptime_tx;
+			__atomic_store_n(&tx->ptime_next, ptime_tx,
+					 __ATOMIC_RELEASE);
 
 			if (tx->ac) {
-				tx->psize = 2 * get_framesize(tx->ac,
-							      ptime_tx);
+				tx->psize = aufmt_sample_size(tx->fmt)
+					* get_framesize(tx->ac, ptime_tx);
 			}
 		}
 	}
+
+	/* upper limit of the adapted ptime */
+	attr = sdp_media_rattr(stream_sdpmedia(a->strm), "maxptime");
+	a->tx.ptime_max = attr ? atoi(attr) : 0;
+}
+
+
+static int autx_buf_debug(struct re_printf *pf, const struct autx *tx)
+{
+	if (tx->ring)
+		return auring_debug(pf, tx->ring);
+
+	return aubuf_debug(pf, tx->aubuf);
+}
+
+
+static int aurx_buf_debug(struct re_printf *pf, const struct aurx *rx)
+{
+	if (rx->ring)
+		return auring_debug(pf, rx->ring);
+
+	return aubuf_debug(pf, rx->aubuf);
 }
 
 
@@ -1412,15 +3275,106 @@ static int aucodec_print(struct re_printf *pf, const struct aucodec *ac)
 }
 
 
+static int profile_handler(void *arg)
+{
+	struct audio_job *job = arg;
+
+	return audio_print_profile(job->pf, job->a);
+}
+
+
+/**
+ * Print the time spent in each stage of the audio pipeline
+ *
+ * @param pf Print handler
+ * @param a  Audio object
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int audio_print_profile(struct re_printf *pf, const struct audio *a)
+{
+	int err;
+
+	if (!a || !a->cfg.profile)
+		return 0;
+
+	if (audio_remote(a)) {
+		struct audio_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.a  = (struct audio *)a;
+		job.pf = pf;
+
+		return audio_exec(&job, profile_handler);
+	}
+
+	err  = re_hprintf(pf, " tx profile:\n%H", pipeprof_debug, &a->tx.prof);
+	err |= re_hprintf(pf, " rx profile:\n%H", pipeprof_debug, &a->rx.prof);
+
+	return err;
+}
+
+
+/*
+ * Estimate of the mouth-to-ear latency: one frame for the capture, the
+ * frames in the buffers, half the round-trip time, the jitter buffer and
+ * one period of the player
+ */
+static int audio_print_latency(struct re_printf *pf, const struct audio *a)
+{
+	const struct autx *tx = &a->tx;
+	const struct aurx *rx = &a->rx;
+	const size_t sz = tx->ring ? 2 : aufmt_sample_size(tx->fmt);
+	const size_t rate = sz * tx->ausrc_prm.srate * tx->ausrc_prm.ch;
+	const uint32_t rxbuf = aurx_delay(rx);
+	struct stream_stats st;
+	uint32_t txbuf = 0, net, total;
+
+	if (stream_stats(a->strm, &st))
+		return 0;
+
+	if (rate)
+		txbuf = (uint32_t)(autx_cur_size(tx) * 1000 / rate);
+
+	net   = st.rtt / 2000;
+	total = tx->ptime + txbuf + net + st.jbuf_delay + rxbuf + rx->ptime;
+
+	return re_hprintf(pf, " latency: %ums (capture=%u txbuf=%u net=%u"
+			  " jbuf=%u rxbuf=%u play=%u) direct=%llu\n",
+			  total, tx->ptime, txbuf, net, st.jbuf_delay,
+			  rxbuf, rx->ptime, tx->n_direct);
+}
+
+
+static int debug_handler(void *arg)
+{
+	struct audio_job *job = arg;
+
+	return audio_debug(job->pf, job->a);
+}
+
+
 int audio_debug(struct re_printf *pf, const struct audio *a)
 {
 	const struct autx *tx;
 	const struct aurx *rx;
+	struct ausrc_st *src;
+	struct auplay_st *play;
 	int err;
 
 	if (!a)
 		return 0;
 
+	if (audio_remote(a)) {
+		struct audio_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.a  = (struct audio *)a;
+		job.pf = pf;
+
+		return audio_exec(&job, debug_handler);
+	}
+
 	tx = &a->tx;
 	rx = &a->rx;
 
@@ -1428,12 +3382,12 @@ int audio_debug(struct re_printf *pf, const struct audio *a)
 
 	err |= re_hprintf(pf, " tx:   %H %H ptime=%ums\n",
 			  aucodec_print, tx->ac,
-			  aubuf_debug, tx->aubuf,
+			  autx_buf_debug, tx,
 			  tx->ptime);
 
 	err |= re_hprintf(pf, " rx:   %H %H ptime=%ums pt=%d\n",
 			  aucodec_print, rx->ac,
-			  aubuf_debug, rx->aubuf,
+			  aurx_buf_debug, rx,
 			  rx->ptime, rx->pt);
 
 	err |= re_hprintf(pf,
@@ -1442,22 +3396,142 @@ int audio_debug(struct re_printf *pf, const struct audio *a)
 			  autx_print_pipeline, tx,
 			  aurx_print_pipeline, rx);
 
+	src  = ausrc_sub_st(tx->ausrc);
+	play = auplay_sub_st(rx->auplay);
+
+	if (src && src->as->debugh)
+		err |= re_hprintf(pf, " source: %H\n", src->as->debugh, src);
+	if (play && play->ap->debugh) {
+		err |= re_hprintf(pf, " player: %H\n",
+				  play->ap->debugh, play);
+	}
+
+	err |= audio_print_profile(pf, a);
+
+	if (tx->resamp)
+		err |= re_hprintf(pf, " tx %H\n", resamp_debug, tx->resamp);
+	if (rx->resamp)
+		err |= re_hprintf(pf, " rx %H\n", resamp_debug, rx->resamp);
+	if (rx->wsola)
+		err |= re_hprintf(pf, " %H\n", wsola_debug, rx->wsola);
+	if (tx->drift)
+		err |= re_hprintf(pf, " tx %H\n", audrift_debug, tx->drift);
+	if (rx->drift)
+		err |= re_hprintf(pf, " rx %H\n", audrift_debug, rx->drift);
+
+	if (tx->direct)
+		err |= audio_print_latency(pf, a);
+	if (rx->spk.grp) {
+		err |= re_hprintf(pf, " speaker: %s dormant=%llu\n",
+				  speaker_active(&rx->spk)
+				  ? "decoded" : "dormant", rx->n_dormant);
+	}
+
 	err |= stream_debug(pf, a->strm);
 
 	return err;
 }
 
 
+static int mem_debug_handler(void *arg)
+{
+	struct audio_job *job = arg;
+
+	return audio_mem_debug(job->pf, job->a);
+}
+
+
+/**
+ * Print the memory used by an audio stream
+ *
+ * The sample buffers shared by the threads are not included.
+ *
+ * @param pf Print function
+ * @param a  Audio object
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int audio_mem_debug(struct re_printf *pf, const struct audio *a)
+{
+	const struct autx *tx;
+	const struct aurx *rx;
+	size_t mb, flt = 0, dsp = 0, buf;
+
+	if (!a)
+		return 0;
+
+	if (audio_remote(a)) {
+		struct audio_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.a  = (struct audio *)a;
+		job.pf = pf;
+
+		return audio_exec(&job, mem_debug_handler);
+	}
+
+	tx = &a->tx;
+	rx = &a->rx;
+
+	mb  = tx->mb ? tx->mb->size : 0;
+	buf = autx_cur_size(tx) + aurx_cur_size(rx);
+
+	if (tx->sampv_f)  flt += tx->sampsz * sizeof(float);
+	if (tx->sampv_cv) flt += tx->sampsz * sizeof(float);
+	if (rx->sampv_f)  flt += rx->sampsz * sizeof(float);
+	if (rx->sampv_cv) flt += rx->sampsz * sizeof(float);
+
+	if (rx->sampv_ts) dsp += rx->sampsz * 4;
+	if (tx->sampv_dr) dsp += DRIFT_FACTOR * tx->sampsz * 2;
+	if (rx->sampv_dr) dsp += DRIFT_FACTOR * rx->sampsz * 2;
+
+	return re_hprintf(pf, "audio=%zu mbuf=%zu float=%zu dsp=%zu"
+			  " buffered=%zu total=%zu",
+			  sizeof(*a), mb, flt, dsp, buf,
+			  sizeof(*a) + mb + flt + dsp + buf);
+}
+
+
+static int devicename_handler(void *arg)
+{
+	struct audio_job *job = arg;
+
+	audio_set_devicename(job->a, job->dev, job->play);
+
+	return 0;
+}
+
+
 void audio_set_devicename(struct audio *a, const char *src, const char *play)
 {
 	if (!a)
 		return;
 
+	if (audio_remote(a)) {
+		struct audio_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.a    = a;
+		job.dev  = src;
+		job.play = play;
+
+		(void)audio_exec(&job, devicename_handler);
+		return;
+	}
+
 	str_ncpy(a->tx.device, src, sizeof(a->tx.device));
 	str_ncpy(a->rx.device, play, sizeof(a->rx.device));
 }
 
 
+static int source_handler(void *arg)
+{
+	struct audio_job *job = arg;
+
+	return audio_set_source(job->a, job->mod, job->dev);
+}
+
+
 int audio_set_source(struct audio *au, const char *mod, const char *device)
 {
 	struct autx *tx;
@@ -1466,23 +3540,55 @@ int audio_set_source(struct audio *au, const char *mod, const char *device)
 	if (!au)
 		return EINVAL;
 
+	if (audio_remote(au)) {
+		struct audio_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.a   = au;
+		job.mod = mod;
+		job.dev = device;
+
+		return audio_exec(&job, source_handler);
+	}
+
 	tx = &au->tx;
 
 	/* stop the audio device first */
 	tx->ausrc = mem_deref(tx->ausrc);
 
-	err = ausrc_alloc(&tx->ausrc, NULL, mod, &tx->ausrc_prm, device,
-			  ausrc_read_handler, ausrc_error_handler, au);
+	/* an S16 device is converted to the float buffer */
+	tx->ausrc_prm.fmt = tx->fmt;
+
+	err = ausrc_subscribe(&tx->ausrc, NULL, mod, &tx->ausrc_prm, device,
+			      device_shared(au, mod), ausrc_read_handler,
+			      ausrc_error_handler, au);
+	if (err == ENOTSUP && tx->fmt != AUFMT_S16LE) {
+		tx->ausrc_prm.fmt = AUFMT_S16LE;
+		err = ausrc_subscribe(&tx->ausrc, NULL, mod, &tx->ausrc_prm,
+				      device, device_shared(au, mod),
+				      ausrc_read_handler,
+				      ausrc_error_handler, au);
+	}
 	if (err) {
 		warning("audio: set_source failed (%s.%s): %m\n",
 			mod, device, err);
 		return err;
 	}
 
+	ausrc_sub_gain(tx->ausrc, tx->gain);
+
 	return 0;
 }
 
 
+static int player_handler(void *arg)
+{
+	struct audio_job *job = arg;
+
+	return audio_set_player(job->a, job->mod, job->dev);
+}
+
+
 int audio_set_player(struct audio *au, const char *mod, const char *device)
 {
 	struct aurx *rx;
@@ -1491,19 +3597,42 @@ int audio_set_player(struct audio *au, const char *mod, const char *device)
 	if (!au)
 		return EINVAL;
 
+	if (audio_remote(au)) {
+		struct audio_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.a   = au;
+		job.mod = mod;
+		job.dev = device;
+
+		return audio_exec(&job, player_handler);
+	}
+
 	rx = &au->rx;
 
 	/* stop the audio device first */
 	rx->auplay = mem_deref(rx->auplay);
 
-	err = auplay_alloc(&rx->auplay, mod, &rx->auplay_prm, device,
-			   auplay_write_handler, rx);
+	/* the float buffer is converted for an S16 device */
+	rx->auplay_prm.fmt = rx->fmt;
+
+	err = auplay_subscribe(&rx->auplay, mod, &rx->auplay_prm, device,
+			       device_shared(au, mod),
+			       auplay_write_handler, rx);
+	if (err == ENOTSUP && rx->fmt != AUFMT_S16LE) {
+		rx->auplay_prm.fmt = AUFMT_S16LE;
+		err = auplay_subscribe(&rx->auplay, mod, &rx->auplay_prm,
+				       device, device_shared(au, mod),
+				       auplay_write_handler, rx);
+	}
 	if (err) {
 		warning("audio: set_player failed (%s.%s): %m\n",
 			mod, device, err);
 		return err;
 	}
 
+	auplay_sub_gain(rx->auplay, rx->gain);
+
 	return 0;
 }
 
@@ -1539,21 +3668,22 @@ int audio_print_rtpstat(struct re_printf *pf, const struct audio *a)
 			 "EX=BareSip;"   /* Reporter Identifier	             */
 			 "CS=%d;"        /* Call Setup in milliseconds       */
 			 "CD=%d;"        /* Call Duration in seconds	     */
-			 "PR=%u;PS=%u;"  /* Packets RX, TX                   */
+			 "PR=%llu;PS=%llu;" /* Packets RX, TX                */
 			 "PL=%d,%d;"     /* Packets Lost RX, TX              */
-			 "PD=%d,%d;"     /* Packets Discarded, RX, TX        */
+			 "PD=%llu,%llu;" /* Packets Discarded, RX, TX        */
 			 "JI=%.1f,%.1f;" /* Jitter RX, TX in timestamp units */
 			 "IP=%J,%J"      /* Local, Remote IPs                */
 			 ,
 			 call_setup_duration(s->call) * 1000,
 			 call_duration(s->call),
 
-			 s->metric_rx.n_packets,
-			 s->metric_tx.n_packets,
+			 metric_n_packets(&s->metric_rx),
+			 metric_n_packets(&s->metric_tx),
 
 			 rtcp->rx.lost, rtcp->tx.lost,
 
-			 s->metric_rx.n_err, s->metric_tx.n_err,
+			 metric_n_err(&s->metric_rx),
+			 metric_n_err(&s->metric_tx),
 
 			 /* timestamp units (ie: 8 ts units = 1 ms @ 8KHZ) */
 			 1.0 * rtcp->rx.jit/1000 * (srate_rx/1000),
@@ -0,0 +1,177 @@
+/**
+ * @file audrift.c  Clock-drift compensation with a fractional resampler
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <math.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * The clocks on both sides of an audio buffer run at slightly different
+ * rates, and the buffer slowly fills or runs empty. The writer passes
+ * each frame through this resampler together with the current fill of
+ * the buffer. The fill is smoothed, and a PI controller adjusts the
+ * resampling ratio so that the fill stays at the level that was measured
+ * after the start. The ratio stays within MAX_CORR of 1, so the change
+ * of pitch is not audible, and the samples are interpolated linearly at
+ * a fractional position that is carried over from frame to frame.
+ */
+
+
+enum {
+	MAX_CH = 16,
+	WARMUP = 50,             /* frames until the target fill is set    */
+};
+
+#define MAX_CORR  0.001          /* maximum correction, 1000 ppm        */
+#define TAU       20.0           /* time constant of the controller [s] */
+#define ALPHA     (1.0 / 32)     /* smoothing of the buffer fill        */
+
+
+struct audrift {
+	double rate;             /**< Samples per second, all channels    */
+	uint8_t ch;              /**< Number of channels                  */
+	int16_t prev[MAX_CH];    /**< Last sample-frame of previous frame */
+	double pos;              /**< Next output position, -1 is prev    */
+	double fill;             /**< Smoothed buffer fill [samples]      */
+	double target;           /**< Wanted buffer fill [samples]        */
+	double integ;            /**< Integral part of the correction     */
+	double ratio;            /**< Output samples per input sample     */
+	unsigned warmup;         /**< Frames left until target is set     */
+};
+
+
+/**
+ * Allocate a clock-drift compensator
+ *
+ * @param dp    Pointer to allocated object
+ * @param srate Sampling rate in [Hz]
+ * @param ch    Number of channels
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int audrift_alloc(struct audrift **dp, uint32_t srate, uint8_t ch)
+{
+	struct audrift *d;
+
+	if (!dp || !srate || !ch || ch > MAX_CH)
+		return EINVAL;
+
+	d = mem_zalloc(sizeof(*d), NULL);
+	if (!d)
+		return ENOMEM;
+
+	d->rate   = (double)srate * ch;
+	d->ch     = ch;
+	d->ratio  = 1.0;
+	d->warmup = WARMUP;
+
+	*dp = d;
+
+	return 0;
+}
+
+
+static void update_ratio(struct audrift *d, size_t fill, size_t inc)
+{
+	double dev, corr;
+
+	if (d->warmup) {
+
+		if (d->warmup == WARMUP)
+			d->fill = fill;
+		else
+			d->fill += (fill - d->fill) * ALPHA;
+
+		if (--d->warmup == 0)
+			d->target = d->fill;
+
+		return;
+	}
+
+	d->fill += (fill - d->fill) * ALPHA;
+
+	/* deviation from the target in seconds of audio */
+	dev = (d->fill - d->target) / d->rate;
+
+	d->integ += dev * (inc / d->rate) / (TAU * TAU);
+	d->integ  = max(min(d->integ, MAX_CORR), -MAX_CORR);
+
+	corr = 1.4 / TAU * dev + d->integ;
+	corr = max(min(corr, MAX_CORR), -MAX_CORR);
+
+	d->ratio = 1.0 - corr;
+}
+
+
+/**
+ * Resample one frame for the buffer fill
+ *
+ * @param d     Clock-drift compensator
+ * @param outv  Output samples
+ * @param outsz Size of the output buffer in samples
+ * @param inv   Input samples
+ * @param inc   Number of input samples
+ * @param fill  Current fill of the buffer in samples
+ *
+ * @return Number of output samples
+ *
+ * @note This function has REAL-TIME properties
+ */
+size_t audrift_process(struct audrift *d, int16_t *outv, size_t outsz,
+		       const int16_t *inv, size_t inc, size_t fill)
+{
+	const uint8_t ch = d ? d->ch : 1;
+	size_t frames, n = 0;
+	double pos, step;
+	uint8_t c;
+
+	if (!d || !outv || !inv)
+		return 0;
+
+	frames = inc / ch;
+	if (!frames)
+		return 0;
+
+	update_ratio(d, fill, inc);
+
+	step = 1.0 / d->ratio;
+	pos  = d->pos;
+
+	while (pos < (double)(frames - 1) && n + ch <= outsz) {
+
+		const long i = (long)floor(pos);
+		const double f = pos - i;
+		const int16_t *b = &inv[(i + 1) * ch];
+
+		for (c=0; c<ch; c++) {
+			const double a = i < 0 ? d->prev[c] : inv[i*ch + c];
+
+			outv[n++] = (int16_t)(a + f * (b[c] - a));
+		}
+
+		pos += step;
+	}
+
+	d->pos = max(pos - frames, -1.0);
+
+	for (c=0; c<ch; c++)
+		d->prev[c] = inv[(frames - 1) * ch + c];
+
+	return n;
+}
+
+
+int audrift_debug(struct re_printf *pf, const struct audrift *d)
+{
+	if (!d)
+		return 0;
+
+	return re_hprintf(pf, "drift: %+d ppm fill=%.1fms target=%.1fms",
+			  (int)((d->ratio - 1.0) * 1e6),
+			  d->fill * 1000 / d->rate,
+			  d->target * 1000 / d->rate);
+}
@@ -0,0 +1,113 @@
+/**
+ * @file aulevel.c  Audio level metering and voice activity
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <math.h>
+#include <re.h>
+#include <baresip.h>
+
+
+/*
+ * The RMS level, the peak level and the voice activity of a frame are
+ * computed in one pass over the samples. The loop has no branches and
+ * no data-dependent indexing, so the compiler turns it into SIMD code
+ * (SSE2/AVX2 or NEON) at the usual optimization levels.
+ */
+
+
+enum {
+	LEVEL_VOICE = 50,       /* voice activity below [-dBov]     */
+	LEVEL_MAX   = 127,      /* silence [-dBov]                  */
+};
+
+
+static void level_set(struct aulevel *lvl, double ms, double peak)
+{
+	double db;
+
+	if (ms <= 0)
+		return;
+
+	db = -10.0 * log10(ms / (32768.0 * 32768.0));
+
+	lvl->rms   = (uint16_t)min(sqrt(ms), 32767.0);
+	lvl->peak  = (uint16_t)min(peak, 32767.0);
+	lvl->dbov  = db >= LEVEL_MAX ? LEVEL_MAX : (uint8_t)max(db, 0.0);
+	lvl->voice = lvl->dbov < LEVEL_VOICE;
+}
+
+
+/**
+ * Compute the level of one audio frame
+ *
+ * @param lvl   Returned audio level
+ * @param sampv Audio samples
+ * @param sampc Number of samples
+ *
+ * @note This function has REAL-TIME properties
+ */
+void aulevel_calc(struct aulevel *lvl, const int16_t *sampv, size_t sampc)
+{
+	uint64_t sum = 0;
+	int32_t peak = 0;
+	size_t i;
+
+	if (!lvl)
+		return;
+
+	memset(lvl, 0, sizeof(*lvl));
+	lvl->dbov = LEVEL_MAX;
+
+	if (!sampv || !sampc)
+		return;
+
+	for (i=0; i<sampc; i++) {
+		const int32_t v = sampv[i];
+		const int32_t m = v >> 31;
+		const int32_t a = (v ^ m) - m;
+
+		sum  += (uint32_t)(v * v);
+		peak  = a > peak ? a : peak;
+	}
+
+	level_set(lvl, (double)sum / sampc, peak);
+}
+
+
+/**
+ * Compute the level of one audio frame of float samples
+ *
+ * @param lvl   Returned audio level
+ * @param sampv Audio samples, full scale is 1.0
+ * @param sampc Number of samples
+ *
+ * @note This function has REAL-TIME properties
+ */
+void aulevel_calc_float(struct aulevel *lvl, const float *sampv,
+			size_t sampc)
+{
+	float sum = 0, peak = 0;
+	size_t i;
+
+	if (!lvl)
+		return;
+
+	memset(lvl, 0, sizeof(*lvl));
+	lvl->dbov = LEVEL_MAX;
+
+	if (!sampv || !sampc)
+		return;
+
+	for (i=0; i<sampc; i++) {
+		const float v = sampv[i];
+		const float a = fabsf(v);
+
+		sum  += v * v;
+		peak  = a > peak ? a : peak;
+	}
+
+	level_set(lvl, (double)sum / sampc * (32768.0 * 32768.0),
+		  peak * 32768.0);
+}
@@ -0,0 +1,611 @@
+/**
+ * @file aupcm.c  G.711 and 16-bit PCM sample conversion in batches
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
+#define USE_NEON 1
+#endif
+#if defined (__x86_64__) && defined (__GNUC__)
+#include <immintrin.h>
+#define USE_AVX2 1
+#endif
+#include "core.h"
+
+
+/*
+ * The G.711 segment (exponent) and mantissa of 8 samples are computed
+ * at a time with 16-bit vector arithmetic, as in the ITU-T G.191
+ * reference, instead of looking up each sample in a table. The results
+ * are the same as with g711_pcm2ulaw() and friends, which are used for
+ * the samples that do not fill a vector.
+ *
+ * SSE2 has no shift by a different count per lane, so these shifts are
+ * done in three steps of 1, 2 and 4 bits.
+ *
+ * Each conversion is a media kernel, the implementation for the CPU is
+ * selected at startup (see kernel.c).
+ */
+
+
+enum {
+	ULAW_BIAS = 0x84,       /* Bias of the u-law segments      */
+	ULAW_CLIP = 32635,      /* Largest magnitude before bias   */
+};
+
+
+#if defined (__SSE2__)
+
+static inline __m128i sel(__m128i m, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+
+static inline __m128i bit_set(__m128i v, short bit)
+{
+	const __m128i b = _mm_set1_epi16(bit);
+
+	return _mm_cmpeq_epi16(_mm_and_si128(v, b), b);
+}
+
+
+/* v << sh, sh is 0-7 in each lane */
+static inline __m128i sllv(__m128i v, __m128i sh)
+{
+	v = sel(bit_set(sh, 1), _mm_slli_epi16(v, 1), v);
+	v = sel(bit_set(sh, 2), _mm_slli_epi16(v, 2), v);
+	v = sel(bit_set(sh, 4), _mm_slli_epi16(v, 4), v);
+
+	return v;
+}
+
+
+/* v >> sh (logical), sh is 0-7 in each lane */
+static inline __m128i srlv(__m128i v, __m128i sh)
+{
+	v = sel(bit_set(sh, 1), _mm_srli_epi16(v, 1), v);
+	v = sel(bit_set(sh, 2), _mm_srli_epi16(v, 2), v);
+	v = sel(bit_set(sh, 4), _mm_srli_epi16(v, 4), v);
+
+	return v;
+}
+
+
+/* Number of the 7 segment limits, from lim, that v has reached */
+static inline __m128i segment(__m128i v, int lim)
+{
+	__m128i seg = _mm_setzero_si128();
+	int i;
+
+	for (i=0; i<7; i++, lim <<= 1) {
+		seg = _mm_sub_epi16(seg, _mm_cmpgt_epi16(v,
+					_mm_set1_epi16((short)(lim - 1))));
+	}
+
+	return seg;
+}
+
+
+static inline __m128i ulaw_enc8(__m128i x)
+{
+	const __m128i s = _mm_srai_epi16(x, 15);
+	__m128i v, seg, mant;
+
+	/* magnitude, -32768 saturates */
+	v = _mm_subs_epi16(_mm_xor_si128(x, s), s);
+	v = _mm_min_epi16(v, _mm_set1_epi16(ULAW_CLIP));
+	v = _mm_add_epi16(v, _mm_set1_epi16(ULAW_BIAS));
+
+	seg  = segment(v, 0x100);
+	mant = _mm_and_si128(srlv(_mm_srli_epi16(v, 3), seg),
+			     _mm_set1_epi16(0x0f));
+
+	v = _mm_or_si128(_mm_slli_epi16(seg, 4), mant);
+
+	return _mm_xor_si128(v, _mm_xor_si128(_mm_set1_epi16(0xff),
+				    _mm_and_si128(s, _mm_set1_epi16(0x80))));
+}
+
+
+static inline __m128i alaw_enc8(__m128i x)
+{
+	const __m128i s = _mm_srai_epi16(x, 15);
+	__m128i m, seg, mant;
+
+	/* 12-bit magnitude, negative values are one's complement */
+	m = _mm_srli_epi16(_mm_xor_si128(x, s), 3);
+
+	seg  = segment(m, 0x20);
+	mant = _mm_and_si128(srlv(m, _mm_max_epi16(seg, _mm_set1_epi16(1))),
+			     _mm_set1_epi16(0x0f));
+
+	m = _mm_or_si128(_mm_slli_epi16(seg, 4), mant);
+
+	return _mm_xor_si128(m, _mm_xor_si128(_mm_set1_epi16(0xd5),
+				    _mm_and_si128(s, _mm_set1_epi16(0x80))));
+}
+
+
+/* u is 8 codewords in 16-bit lanes */
+static inline __m128i ulaw_dec8(__m128i u)
+{
+	__m128i x, s, t;
+
+	x = _mm_xor_si128(u, _mm_set1_epi16(0xff));
+	s = bit_set(x, 0x80);
+
+	t = _mm_add_epi16(_mm_slli_epi16(_mm_and_si128(x,
+				_mm_set1_epi16(0x0f)), 3),
+			  _mm_set1_epi16(ULAW_BIAS));
+	t = sllv(t, _mm_and_si128(_mm_srli_epi16(x, 4), _mm_set1_epi16(7)));
+	t = _mm_sub_epi16(t, _mm_set1_epi16(ULAW_BIAS));
+
+	return _mm_sub_epi16(_mm_xor_si128(t, s), s);
+}
+
+
+static inline __m128i alaw_dec8(__m128i a)
+{
+	__m128i s, t, seg;
+
+	a = _mm_xor_si128(a, _mm_set1_epi16(0x55));
+	s = _mm_cmpeq_epi16(_mm_and_si128(a, _mm_set1_epi16(0x80)),
+			    _mm_setzero_si128());
+
+	seg = _mm_and_si128(_mm_srli_epi16(a, 4), _mm_set1_epi16(7));
+
+	t = _mm_add_epi16(_mm_slli_epi16(_mm_and_si128(a,
+				_mm_set1_epi16(0x0f)), 4),
+			  _mm_set1_epi16(8));
+	t = _mm_add_epi16(t, _mm_andnot_si128(_mm_cmpeq_epi16(seg,
+				_mm_setzero_si128()), _mm_set1_epi16(0x100)));
+	t = sllv(t, _mm_subs_epu16(seg, _mm_set1_epi16(1)));
+
+	return _mm_sub_epi16(_mm_xor_si128(t, s), s);
+}
+
+#elif defined (USE_NEON)
+
+/* Number of the 7 segment limits, from lim, that v has reached */
+static inline int16x8_t segment(int16x8_t v, int lim)
+{
+	int16x8_t seg = vdupq_n_s16(0);
+	int i;
+
+	for (i=0; i<7; i++, lim <<= 1) {
+		seg = vsubq_s16(seg, vreinterpretq_s16_u16(
+					vcgeq_s16(v, vdupq_n_s16(lim))));
+	}
+
+	return seg;
+}
+
+
+static inline uint16x8_t ulaw_enc8(int16x8_t x)
+{
+	const int16x8_t s = vshrq_n_s16(x, 15);
+	int16x8_t v, seg, mant;
+
+	v = vqabsq_s16(x);
+	v = vminq_s16(v, vdupq_n_s16(ULAW_CLIP));
+	v = vaddq_s16(v, vdupq_n_s16(ULAW_BIAS));
+
+	seg  = segment(v, 0x100);
+	mant = vandq_s16(vshlq_s16(vshrq_n_s16(v, 3), vnegq_s16(seg)),
+			 vdupq_n_s16(0x0f));
+
+	v = vorrq_s16(vshlq_n_s16(seg, 4), mant);
+	v = veorq_s16(v, veorq_s16(vdupq_n_s16(0xff),
+				   vandq_s16(s, vdupq_n_s16(0x80))));
+
+	return vreinterpretq_u16_s16(v);
+}
+
+
+static inline uint16x8_t alaw_enc8(int16x8_t x)
+{
+	const int16x8_t s = vshrq_n_s16(x, 15);
+	int16x8_t m, seg, mant;
+
+	m = vshrq_n_s16(veorq_s16(x, s), 3);
+
+	seg  = segment(m, 0x20);
+	mant = vandq_s16(vshlq_s16(m, vnegq_s16(vmaxq_s16(seg,
+						vdupq_n_s16(1)))),
+			 vdupq_n_s16(0x0f));
+
+	m = vorrq_s16(vshlq_n_s16(seg, 4), mant);
+	m = veorq_s16(m, veorq_s16(vdupq_n_s16(0xd5),
+				   vandq_s16(s, vdupq_n_s16(0x80))));
+
+	return vreinterpretq_u16_s16(m);
+}
+
+
+/* u is 8 codewords in 16-bit lanes */
+static inline int16x8_t ulaw_dec8(uint16x8_t u)
+{
+	int16x8_t x, t;
+	uint16x8_t neg;
+
+	x   = vreinterpretq_s16_u16(veorq_u16(u, vdupq_n_u16(0xff)));
+	neg = vtstq_s16(x, vdupq_n_s16(0x80));
+
+	t = vaddq_s16(vshlq_n_s16(vandq_s16(x, vdupq_n_s16(0x0f)), 3),
+		      vdupq_n_s16(ULAW_BIAS));
+	t = vshlq_s16(t, vandq_s16(vshrq_n_s16(x, 4), vdupq_n_s16(7)));
+	t = vsubq_s16(t, vdupq_n_s16(ULAW_BIAS));
+
+	return vbslq_s16(neg, vnegq_s16(t), t);
+}
+
+
+static inline int16x8_t alaw_dec8(uint16x8_t u)
+{
+	int16x8_t a, t, seg;
+	uint16x8_t pos;
+
+	a   = vreinterpretq_s16_u16(veorq_u16(u, vdupq_n_u16(0x55)));
+	pos = vtstq_s16(a, vdupq_n_s16(0x80));
+
+	seg = vandq_s16(vshrq_n_s16(a, 4), vdupq_n_s16(7));
+
+	t = vaddq_s16(vshlq_n_s16(vandq_s16(a, vdupq_n_s16(0x0f)), 4),
+		      vdupq_n_s16(8));
+	t = vaddq_s16(t, vandq_s16(vreinterpretq_s16_u16(
+				vtstq_s16(seg, seg)), vdupq_n_s16(0x100)));
+	t = vshlq_s16(t, vmaxq_s16(vsubq_s16(seg, vdupq_n_s16(1)),
+				   vdupq_n_s16(0)));
+
+	return vbslq_s16(pos, t, vnegq_s16(t));
+}
+
+#endif
+
+
+typedef void (enc_h)(uint8_t *dst, const int16_t *src, size_t n);
+typedef void (dec_h)(int16_t *dst, const uint8_t *src, size_t n);
+typedef void (swap_h)(int16_t *dst, const int16_t *src, size_t n);
+
+
+static void ulaw_enc_c(uint8_t *dst, const int16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++)
+		dst[i] = g711_pcm2ulaw(src[i]);
+}
+
+
+static void ulaw_dec_c(int16_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++)
+		dst[i] = g711_ulaw2pcm(src[i]);
+}
+
+
+static void alaw_enc_c(uint8_t *dst, const int16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++)
+		dst[i] = g711_pcm2alaw(src[i]);
+}
+
+
+static void alaw_dec_c(int16_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++)
+		dst[i] = g711_alaw2pcm(src[i]);
+}
+
+
+static void swap16_c(int16_t *dst, const int16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++) {
+		uint16_t v = (uint16_t)src[i];
+
+		dst[i] = (int16_t)(v << 8 | v >> 8);
+	}
+}
+
+
+#if defined (__SSE2__)
+
+static void ulaw_enc_sse2(uint8_t *dst, const int16_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)&src[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *)&src[i+8]);
+
+		_mm_storeu_si128((__m128i *)&dst[i],
+				 _mm_packus_epi16(ulaw_enc8(a), ulaw_enc8(b)));
+	}
+
+	ulaw_enc_c(&dst[i], &src[i], n - i);
+}
+
+
+static void ulaw_dec_sse2(int16_t *dst, const uint8_t *src, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+
+		_mm_storeu_si128((__m128i *)&dst[i],
+				 ulaw_dec8(_mm_unpacklo_epi8(v, zero)));
+		_mm_storeu_si128((__m128i *)&dst[i+8],
+				 ulaw_dec8(_mm_unpackhi_epi8(v, zero)));
+	}
+
+	ulaw_dec_c(&dst[i], &src[i], n - i);
+}
+
+
+static void alaw_enc_sse2(uint8_t *dst, const int16_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)&src[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *)&src[i+8]);
+
+		_mm_storeu_si128((__m128i *)&dst[i],
+				 _mm_packus_epi16(alaw_enc8(a), alaw_enc8(b)));
+	}
+
+	alaw_enc_c(&dst[i], &src[i], n - i);
+}
+
+
+static void alaw_dec_sse2(int16_t *dst, const uint8_t *src, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+
+		_mm_storeu_si128((__m128i *)&dst[i],
+				 alaw_dec8(_mm_unpacklo_epi8(v, zero)));
+		_mm_storeu_si128((__m128i *)&dst[i+8],
+				 alaw_dec8(_mm_unpackhi_epi8(v, zero)));
+	}
+
+	alaw_dec_c(&dst[i], &src[i], n - i);
+}
+
+
+static void swap16_sse2(int16_t *dst, const int16_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+
+		_mm_storeu_si128((__m128i *)&dst[i],
+				 _mm_or_si128(_mm_slli_epi16(v, 8),
+					      _mm_srli_epi16(v, 8)));
+	}
+
+	swap16_c(&dst[i], &src[i], n - i);
+}
+
+#elif defined (USE_NEON)
+
+static void ulaw_enc_neon(uint8_t *dst, const int16_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8)
+		vst1_u8(&dst[i], vmovn_u16(ulaw_enc8(vld1q_s16(&src[i]))));
+
+	ulaw_enc_c(&dst[i], &src[i], n - i);
+}
+
+
+static void ulaw_dec_neon(int16_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8)
+		vst1q_s16(&dst[i], ulaw_dec8(vmovl_u8(vld1_u8(&src[i]))));
+
+	ulaw_dec_c(&dst[i], &src[i], n - i);
+}
+
+
+static void alaw_enc_neon(uint8_t *dst, const int16_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8)
+		vst1_u8(&dst[i], vmovn_u16(alaw_enc8(vld1q_s16(&src[i]))));
+
+	alaw_enc_c(&dst[i], &src[i], n - i);
+}
+
+
+static void alaw_dec_neon(int16_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8)
+		vst1q_s16(&dst[i], alaw_dec8(vmovl_u8(vld1_u8(&src[i]))));
+
+	alaw_dec_c(&dst[i], &src[i], n - i);
+}
+
+
+static void swap16_neon(int16_t *dst, const int16_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)&src[i]);
+
+		vst1q_u8((uint8_t *)&dst[i], vrev16q_u8(v));
+	}
+
+	swap16_c(&dst[i], &src[i], n - i);
+}
+
+#endif
+
+
+#if defined (USE_AVX2)
+
+__attribute__((target("avx2")))
+static void swap16_avx2(int16_t *dst, const int16_t *src, size_t n)
+{
+	const __m256i shuf = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+					      9, 8, 11, 10, 13, 12, 15, 14,
+					      1, 0, 3, 2, 5, 4, 7, 6,
+					      9, 8, 11, 10, 13, 12, 15, 14);
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&src[i]);
+
+		_mm256_storeu_si256((__m256i *)&dst[i],
+				    _mm256_shuffle_epi8(v, shuf));
+	}
+
+	swap16_c(&dst[i], &src[i], n - i);
+}
+
+#endif
+
+
+static kernel_fn *ulaw_enc = (kernel_fn *)ulaw_enc_c;
+static kernel_fn *ulaw_dec = (kernel_fn *)ulaw_dec_c;
+static kernel_fn *alaw_enc = (kernel_fn *)alaw_enc_c;
+static kernel_fn *alaw_dec = (kernel_fn *)alaw_dec_c;
+static kernel_fn *swap16   = (kernel_fn *)swap16_c;
+
+
+/* C first, then the implementations for the CPU, best last */
+#define IMPL(name, isa, feat) {#isa, feat, (kernel_fn *)name ## _ ## isa}
+#if defined (__SSE2__)
+#define IMPLV(name) IMPL(name, c, 0), IMPL(name, sse2, CPU_SSE2)
+#elif defined (USE_NEON)
+#define IMPLV(name) IMPL(name, c, 0), IMPL(name, neon, CPU_NEON)
+#else
+#define IMPLV(name) IMPL(name, c, 0)
+#endif
+
+static const struct kernel_impl ulaw_enc_implv[] = { IMPLV(ulaw_enc) };
+static const struct kernel_impl ulaw_dec_implv[] = { IMPLV(ulaw_dec) };
+static const struct kernel_impl alaw_enc_implv[] = { IMPLV(alaw_enc) };
+static const struct kernel_impl alaw_dec_implv[] = { IMPLV(alaw_dec) };
+static const struct kernel_impl swap16_implv[] = {
+	IMPLV(swap16),
+#if defined (USE_AVX2)
+	IMPL(swap16, avx2, CPU_SSE2 | CPU_AVX2),
+#endif
+};
+
+static struct kernel kernelv[] = {
+	{LE_INIT, "ulaw_encode", &ulaw_enc,
+	 ulaw_enc_implv, ARRAY_SIZE(ulaw_enc_implv), NULL},
+	{LE_INIT, "ulaw_decode", &ulaw_dec,
+	 ulaw_dec_implv, ARRAY_SIZE(ulaw_dec_implv), NULL},
+	{LE_INIT, "alaw_encode", &alaw_enc,
+	 alaw_enc_implv, ARRAY_SIZE(alaw_enc_implv), NULL},
+	{LE_INIT, "alaw_decode", &alaw_dec,
+	 alaw_dec_implv, ARRAY_SIZE(alaw_dec_implv), NULL},
+	{LE_INIT, "swap16", &swap16,
+	 swap16_implv, ARRAY_SIZE(swap16_implv), NULL},
+};
+
+
+/* Register the kernels of the sample conversion */
+void aupcm_kernels(void)
+{
+	size_t i;
+
+	for (i=0; i<ARRAY_SIZE(kernelv); i++)
+		kernel_register(&kernelv[i]);
+}
+
+
+/**
+ * Encode samples with G.711 u-law
+ *
+ * @param dst Buffer for n codewords
+ * @param src Samples
+ * @param n   Number of samples
+ */
+void aupcm_ulaw_encode(uint8_t *dst, const int16_t *src, size_t n)
+{
+	((enc_h *)ulaw_enc)(dst, src, n);
+}
+
+
+/**
+ * Decode G.711 u-law codewords
+ *
+ * @param dst Buffer for n samples
+ * @param src Codewords
+ * @param n   Number of codewords
+ */
+void aupcm_ulaw_decode(int16_t *dst, const uint8_t *src, size_t n)
+{
+	((dec_h *)ulaw_dec)(dst, src, n);
+}
+
+
+/**
+ * Encode samples with G.711 A-law
+ *
+ * @param dst Buffer for n codewords
+ * @param src Samples
+ * @param n   Number of samples
+ */
+void aupcm_alaw_encode(uint8_t *dst, const int16_t *src, size_t n)
+{
+	((enc_h *)alaw_enc)(dst, src, n);
+}
+
+
+/**
+ * Decode G.711 A-law codewords
+ *
+ * @param dst Buffer for n samples
+ * @param src Codewords
+ * @param n   Number of codewords
+ */
+void aupcm_alaw_decode(int16_t *dst, const uint8_t *src, size_t n)
+{
+	((dec_h *)alaw_dec)(dst, src, n);
+}
+
+
+/**
+ * Swap the bytes of 16-bit samples, e.g. between network and host order
+ *
+ * @param dst Buffer for n samples, may be the same as src
+ * @param src Samples
+ * @param n   Number of samples
+ */
+void aupcm_swap16(int16_t *dst, const int16_t *src, size_t n)
+{
+	((swap_h *)swap16)(dst, src, n);
+}
@@ -54,6 +54,22 @@ int auplay_register(struct auplay **app, const char *name,
 }
 
 
+/**
+ * Set the debug handler of an Audio Player, which prints the state of
+ * a device in the audio debug output
+ *
+ * @param ap      Audio Player
+ * @param debugh  Debug handler
+ */
+void auplay_set_debug(struct auplay *ap, auplay_debug_h *debugh)
+{
+	if (!ap)
+		return;
+
+	ap->debugh = debugh;
+}
+
+
 /**
  * Find an Audio Player by name
  *
@@ -0,0 +1,221 @@
+/**
+ * @file auring.c  Lock-free single-producer/single-consumer sample ring
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * The ring holds 16-bit samples and is safe for exactly one writer
+ * thread and one reader thread. The read and write positions are
+ * free-running counters, only the writer updates `wpos' and only the
+ * reader updates `rpos'. No locks are taken and no memory is allocated
+ * after auring_alloc(), so both ends may be used from real-time audio
+ * callbacks.
+ */
+
+
+#if defined (__GNUC__) || defined (__clang__)
+#define LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOAD_RELAXED(p)     __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+#error "auring: atomic load/store builtins are required"
+#endif
+
+
+struct auring {
+	int16_t *sampv;          /**< Sample storage                    */
+	size_t size;             /**< Capacity in samples, power of two */
+	size_t mask;             /**< size - 1                          */
+	size_t wpos;             /**< Write position (writer only)      */
+	size_t rpos;             /**< Read position (reader only)       */
+	size_t min;              /**< Prefill level in samples          */
+	bool filling;            /**< Reader is waiting for prefill     */
+	uint64_t n_overrun;      /**< Samples dropped by the writer     */
+	uint64_t n_underrun;     /**< Samples zero-filled by the reader */
+};
+
+
+static void destructor(void *arg)
+{
+	struct auring *ar = arg;
+
+	mem_deref(ar->sampv);
+}
+
+
+static size_t pow2_ceil(size_t n)
+{
+	size_t v = 1;
+
+	while (v < n)
+		v <<= 1;
+
+	return v;
+}
+
+
+/**
+ * Allocate a new sample ring
+ *
+ * @param arp  Pointer to allocated ring
+ * @param min  Prefill level in samples before reading starts (0 = none)
+ * @param max  Minimum capacity in samples (rounded up to a power of two)
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int auring_alloc(struct auring **arp, size_t min, size_t max)
+{
+	struct auring *ar;
+
+	if (!arp || !max || min > max)
+		return EINVAL;
+
+	ar = mem_zalloc(sizeof(*ar), destructor);
+	if (!ar)
+		return ENOMEM;
+
+	ar->size  = pow2_ceil(max);
+	ar->mask  = ar->size - 1;
+	ar->min   = min;
+	ar->filling = min > 0;
+
+	ar->sampv = mem_zalloc(ar->size * sizeof(int16_t), NULL);
+	if (!ar->sampv) {
+		mem_deref(ar);
+		return ENOMEM;
+	}
+
+	*arp = ar;
+
+	return 0;
+}
+
+
+/**
+ * Write samples to the ring. If there is not enough space the newest
+ * samples are dropped.
+ *
+ * @param ar    Sample ring
+ * @param sampv Samples to write
+ * @param sampc Number of samples
+ *
+ * @return Number of samples written
+ *
+ * @note This function has REAL-TIME properties; writer side only
+ */
+size_t auring_write(struct auring *ar, const int16_t *sampv, size_t sampc)
+{
+	size_t wpos, rpos, space, ofs, n;
+
+	if (!ar || !sampv)
+		return 0;
+
+	wpos = LOAD_RELAXED(&ar->wpos);
+	rpos = LOAD_ACQUIRE(&ar->rpos);
+
+	space = ar->size - (wpos - rpos);
+	if (sampc > space) {
+		ar->n_overrun += sampc - space;
+		sampc = space;
+	}
+
+	ofs = wpos & ar->mask;
+	n   = min(sampc, ar->size - ofs);
+
+	memcpy(&ar->sampv[ofs], sampv, n * sizeof(int16_t));
+	if (sampc > n)
+		memcpy(ar->sampv, &sampv[n], (sampc - n) * sizeof(int16_t));
+
+	STORE_RELEASE(&ar->wpos, wpos + sampc);
+
+	return sampc;
+}
+
+
+/**
+ * Read samples from the ring. Missing samples are filled with silence.
+ *
+ * @param ar    Sample ring
+ * @param sampv Buffer for samples
+ * @param sampc Number of samples to read
+ *
+ * @return Number of samples read from the ring (excluding silence)
+ *
+ * @note This function has REAL-TIME properties; reader side only
+ */
+size_t auring_read(struct auring *ar, int16_t *sampv, size_t sampc)
+{
+	size_t wpos, rpos, avail, ofs, n, cnt;
+
+	if (!ar || !sampv)
+		return 0;
+
+	rpos = LOAD_RELAXED(&ar->rpos);
+	wpos = LOAD_ACQUIRE(&ar->wpos);
+
+	avail = wpos - rpos;
+
+	if (ar->filling) {
+		if (avail < ar->min) {
+			memset(sampv, 0, sampc * sizeof(int16_t));
+			return 0;
+		}
+
+		ar->filling = false;
+	}
+
+	cnt = min(sampc, avail);
+
+	ofs = rpos & ar->mask;
+	n   = min(cnt, ar->size - ofs);
+
+	memcpy(sampv, &ar->sampv[ofs], n * sizeof(int16_t));
+	if (cnt > n)
+		memcpy(&sampv[n], ar->sampv, (cnt - n) * sizeof(int16_t));
+
+	STORE_RELEASE(&ar->rpos, rpos + cnt);
+
+	if (cnt < sampc) {
+		memset(&sampv[cnt], 0, (sampc - cnt) * sizeof(int16_t));
+		ar->n_underrun += sampc - cnt;
+		ar->filling = ar->min > 0;
+	}
+
+	return cnt;
+}
+
+
+/**
+ * Get the number of samples currently stored in the ring
+ *
+ * @param ar Sample ring
+ *
+ * @return Number of samples
+ *
+ * @note May be called from either side
+ */
+size_t auring_cur_sampc(const struct auring *ar)
+{
+	if (!ar)
+		return 0;
+
+	return LOAD_ACQUIRE(&ar->wpos) - LOAD_ACQUIRE(&ar->rpos);
+}
+
+
+int auring_debug(struct re_printf *pf, const struct auring *ar)
+{
+	if (!ar)
+		return 0;
+
+	return re_hprintf(pf, "auring=%zu/%zu samples (overrun=%llu"
+			  " underrun=%llu)",
+			  auring_cur_sampc(ar), ar->size,
+			  ar->n_overrun, ar->n_underrun);
+}
@@ -0,0 +1,706 @@
+/**
+ * @file aushare.c  Audio devices shared by several calls
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * A shared audio device is opened once, by the first call that uses
+ * it, and closed when the last call is gone. The player mixes the audio
+ * of all calls, and the source gives its samples to all calls. Each
+ * call has its own gain, a gain of 0 mutes it.
+ *
+ * Only calls with the same sampling rate, channels, packet-time and
+ * sample format can share a device. A call with other parameters, or a
+ * device that is not shared, gets a device of its own as before.
+ *
+ * The samples are handled by the threads of the devices, the calls
+ * come and go in the main thread. The lock protects the list of
+ * subscribers, and a subscriber is not called any more once it is
+ * freed.
+ *
+ * With audio_warmup the configured player and source are opened at
+ * startup and kept running without subscribers, the player plays
+ * silence. A call with the same parameters attaches to the running
+ * device, and does not wait for the device to open.
+ */
+
+
+enum {
+	GAIN_UNITY = 100,       /**< Gain that leaves the samples alone  */
+	WARM_SRATE = 48000,     /**< Standby rate, if none is configured */
+};
+
+struct aushare {
+	struct le le;
+	struct lock *lock;      /**< Protects subl                      */
+	struct list subl;       /**< Subscribers                        */
+	char name[16];          /**< Audio driver module                */
+	char dev[128];          /**< Device name                        */
+	int fmt;                /**< Sample format                      */
+	uint32_t srate;
+	uint8_t ch;
+	uint32_t ptime;
+	void *buf;              /**< Samples of one subscriber          */
+	void *bus;              /**< Sum of all subscribers             */
+	size_t sampc;           /**< Size of buf and bus [samples]      */
+	struct auplay_st *play; /**< Player state, or NULL              */
+	struct ausrc_st *src;   /**< Source state, or NULL              */
+};
+
+struct auplay_sub {
+	struct le le;
+	struct aushare *sh;
+	uint32_t gain;          /**< Gain [%]                           */
+	auplay_write_h *wh;
+	void *arg;
+};
+
+struct ausrc_sub {
+	struct le le;
+	struct aushare *sh;
+	uint32_t gain;          /**< Gain [%]                           */
+	ausrc_read_h *rh;
+	ausrc_error_h *errh;
+	void *arg;
+};
+
+
+static struct list playl = LIST_INIT;
+static struct list srcl  = LIST_INIT;
+static struct aushare *warm_play;   /**< Player in standby, or NULL  */
+static struct aushare *warm_src;    /**< Source in standby, or NULL  */
+
+
+static void share_destructor(void *arg)
+{
+	struct aushare *sh = arg;
+
+	list_unlink(&sh->le);
+
+	/* the device is stopped before the buffers are freed */
+	mem_deref(sh->play);
+	mem_deref(sh->src);
+	mem_deref(sh->buf);
+	mem_deref(sh->bus);
+	mem_deref(sh->lock);
+}
+
+
+static void play_sub_destructor(void *arg)
+{
+	struct auplay_sub *sub = arg;
+
+	if (sub->sh) {
+		lock_write_get(sub->sh->lock);
+		list_unlink(&sub->le);
+		lock_rel(sub->sh->lock);
+	}
+
+	mem_deref(sub->sh);
+}
+
+
+static void src_sub_destructor(void *arg)
+{
+	struct ausrc_sub *sub = arg;
+
+	if (sub->sh) {
+		lock_write_get(sub->sh->lock);
+		list_unlink(&sub->le);
+		lock_rel(sub->sh->lock);
+	}
+
+	mem_deref(sub->sh);
+}
+
+
+static void gain_apply(int fmt, void *sampv, size_t sampc, uint32_t gain)
+{
+	size_t i;
+
+	if (gain == GAIN_UNITY)
+		return;
+
+	if (!gain) {
+		memset(sampv, 0, sampc * aufmt_sample_size(fmt));
+		return;
+	}
+
+	if (fmt == AUFMT_S16LE) {
+		int16_t *s = sampv;
+
+		for (i=0; i<sampc; i++) {
+			const int32_t v = (int32_t)s[i] * (int32_t)gain
+				/ GAIN_UNITY;
+
+			s[i] = (int16_t)max(min(v, 32767), -32768);
+		}
+	}
+	else if (fmt == AUFMT_FLOAT) {
+		float *f = sampv;
+
+		for (i=0; i<sampc; i++)
+			f[i] = f[i] * gain / GAIN_UNITY;
+	}
+}
+
+
+/* Grow the buffers to sampc samples, in the device thread */
+static int share_bufs(struct aushare *sh, size_t sampc, bool bus)
+{
+	const size_t sz = aufmt_sample_size(sh->fmt);
+	const size_t bsz = (sh->fmt == AUFMT_S16LE) ? sizeof(int32_t) : sz;
+	void *p;
+
+	if (sampc <= sh->sampc)
+		return 0;
+
+	p = mem_realloc(sh->buf, sampc * sz);
+	if (!p)
+		return ENOMEM;
+	sh->buf = p;
+
+	if (bus) {
+		p = mem_realloc(sh->bus, sampc * bsz);
+		if (!p)
+			return ENOMEM;
+		sh->bus = p;
+	}
+
+	sh->sampc = sampc;
+
+	return 0;
+}
+
+
+static void bus_add(struct aushare *sh, size_t sampc)
+{
+	size_t i;
+
+	if (sh->fmt == AUFMT_S16LE) {
+		const int16_t *s = sh->buf;
+		int32_t *b = sh->bus;
+
+		for (i=0; i<sampc; i++)
+			b[i] += s[i];
+	}
+	else {
+		const float *f = sh->buf;
+		float *b = sh->bus;
+
+		for (i=0; i<sampc; i++)
+			b[i] += f[i];
+	}
+}
+
+
+static void bus_get(const struct aushare *sh, void *sampv, size_t sampc)
+{
+	size_t i;
+
+	if (sh->fmt == AUFMT_S16LE) {
+		const int32_t *b = sh->bus;
+		int16_t *s = sampv;
+
+		for (i=0; i<sampc; i++)
+			s[i] = (int16_t)max(min(b[i], 32767), -32768);
+	}
+	else {
+		const float *b = sh->bus;
+		float *f = sampv;
+
+		for (i=0; i<sampc; i++)
+			f[i] = max(min(b[i], 1.0f), -1.0f);
+	}
+}
+
+
+static void play_write_handler(void *sampv, size_t sampc, void *arg)
+{
+	struct aushare *sh = arg;
+	struct le *le;
+
+	lock_read_get(sh->lock);
+
+	/* a single call writes to the device directly */
+	if (list_count(&sh->subl) == 1) {
+
+		struct auplay_sub *sub = list_ledata(sh->subl.head);
+
+		sub->wh(sampv, sampc, sub->arg);
+		gain_apply(sh->fmt, sampv, sampc, sub->gain);
+		goto out;
+	}
+
+	if (list_isempty(&sh->subl) || share_bufs(sh, sampc, true)) {
+		memset(sampv, 0, sampc * aufmt_sample_size(sh->fmt));
+		goto out;
+	}
+
+	memset(sh->bus, 0, sampc * ((sh->fmt == AUFMT_S16LE)
+				    ? sizeof(int32_t) : sizeof(float)));
+
+	for (le = sh->subl.head; le; le = le->next) {
+
+		struct auplay_sub *sub = le->data;
+
+		/* a muted call still gives its samples */
+		sub->wh(sh->buf, sampc, sub->arg);
+
+		if (!sub->gain)
+			continue;
+
+		gain_apply(sh->fmt, sh->buf, sampc, sub->gain);
+		bus_add(sh, sampc);
+	}
+
+	bus_get(sh, sampv, sampc);
+
+ out:
+	lock_rel(sh->lock);
+}
+
+
+static void src_read_handler(const void *sampv, size_t sampc, void *arg)
+{
+	struct aushare *sh = arg;
+	const size_t sz = aufmt_sample_size(sh->fmt);
+	struct le *le;
+	bool copy;
+
+	lock_read_get(sh->lock);
+
+	copy = list_count(&sh->subl) > 1;
+
+	if (copy && share_bufs(sh, sampc, false))
+		goto out;
+
+	for (le = sh->subl.head; le; le = le->next) {
+
+		struct ausrc_sub *sub = le->data;
+		void *p = (void *)sampv;
+
+		/* each call may change its own samples */
+		if (copy) {
+			memcpy(sh->buf, sampv, sampc * sz);
+			p = sh->buf;
+		}
+
+		gain_apply(sh->fmt, p, sampc, sub->gain);
+		sub->rh(p, sampc, sub->arg);
+	}
+
+ out:
+	lock_rel(sh->lock);
+}
+
+
+static void src_error_handler(int err, const char *str, void *arg)
+{
+	struct aushare *sh = arg;
+	struct list subl = LIST_INIT;
+	struct le *le;
+
+	/* a device of its own stays with its call */
+	if (!sh->le.list) {
+		struct ausrc_sub *sub = list_ledata(sh->subl.head);
+
+		if (sub && sub->errh)
+			sub->errh(err, str, sub->arg);
+		return;
+	}
+
+	/* a new subscriber opens the device again */
+	list_unlink(&sh->le);
+
+	lock_write_get(sh->lock);
+
+	while ((le = sh->subl.head)) {
+		list_unlink(le);
+		list_append(&subl, le, le->data);
+	}
+
+	lock_rel(sh->lock);
+
+	/* the subscriber may free itself in the handler */
+	while ((le = subl.head)) {
+
+		struct ausrc_sub *sub = le->data;
+
+		list_unlink(le);
+
+		if (sub->errh)
+			sub->errh(err, str, sub->arg);
+	}
+}
+
+
+static bool share_match(const struct aushare *sh, const char *name,
+			const char *dev, int fmt, uint32_t srate, uint8_t ch,
+			uint32_t ptime)
+{
+	return !str_casecmp(sh->name, name) && !str_cmp(sh->dev, dev) &&
+		sh->fmt == fmt && sh->srate == srate && sh->ch == ch &&
+		sh->ptime == ptime;
+}
+
+
+static struct aushare *share_find(const struct list *shl, const char *name,
+				  const char *dev, int fmt, uint32_t srate,
+				  uint8_t ch, uint32_t ptime)
+{
+	struct le *le;
+
+	for (le = shl->head; le; le = le->next) {
+
+		struct aushare *sh = le->data;
+
+		if (share_match(sh, name, dev, fmt, srate, ch, ptime))
+			return sh;
+	}
+
+	return NULL;
+}
+
+
+static int share_alloc(struct aushare **shp, const char *name,
+		       const char *dev, int fmt, uint32_t srate, uint8_t ch,
+		       uint32_t ptime)
+{
+	struct aushare *sh;
+	int err;
+
+	sh = mem_zalloc(sizeof(*sh), share_destructor);
+	if (!sh)
+		return ENOMEM;
+
+	str_ncpy(sh->name, name, sizeof(sh->name));
+	str_ncpy(sh->dev, dev, sizeof(sh->dev));
+	sh->fmt   = fmt;
+	sh->srate = srate;
+	sh->ch    = ch;
+	sh->ptime = ptime;
+
+	err = lock_alloc(&sh->lock);
+	if (err)
+		mem_deref(sh);
+	else
+		*shp = sh;
+
+	return err;
+}
+
+
+static bool fmt_mixable(int fmt)
+{
+	return fmt == AUFMT_S16LE || fmt == AUFMT_FLOAT;
+}
+
+
+/**
+ * Subscribe to an audio player, the device is opened if no one else
+ * has it open with the same parameters
+ *
+ * @param subp  Pointer to allocated subscription
+ * @param name  Name of the audio player
+ * @param prm   Audio player parameters
+ * @param dev   Audio device
+ * @param share True to share the device with other calls
+ * @param wh    Write handler
+ * @param arg   Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int auplay_subscribe(struct auplay_sub **subp, const char *name,
+		     struct auplay_prm *prm, const char *dev, bool share,
+		     auplay_write_h *wh, void *arg)
+{
+	const struct auplay *ap = auplay_find(name);
+	struct auplay_sub *sub;
+	struct aushare *sh = NULL;
+	int err;
+
+	if (!subp || !prm || !wh)
+		return EINVAL;
+
+	if (!ap)
+		return ENOENT;
+
+	if (!dev)
+		dev = "";
+
+	share = share && fmt_mixable(prm->fmt);
+
+	sub = mem_zalloc(sizeof(*sub), play_sub_destructor);
+	if (!sub)
+		return ENOMEM;
+
+	sub->gain = GAIN_UNITY;
+	sub->wh   = wh;
+	sub->arg  = arg;
+
+	if (share) {
+		sh = share_find(&playl, ap->name, dev, prm->fmt,
+				prm->srate, prm->ch, prm->ptime);
+	}
+
+	if (sh) {
+		sub->sh = mem_ref(sh);
+	}
+	else {
+		err = share_alloc(&sub->sh, ap->name, dev, prm->fmt,
+				  prm->srate, prm->ch, prm->ptime);
+		if (err)
+			goto out;
+
+		err = auplay_alloc(&sub->sh->play, ap->name, prm, dev,
+				   play_write_handler, sub->sh);
+		if (err)
+			goto out;
+
+		if (share) {
+			list_append(&playl, &sub->sh->le, sub->sh);
+			info("aushare: opened player %s,%s\n", ap->name, dev);
+		}
+	}
+
+	lock_write_get(sub->sh->lock);
+	list_append(&sub->sh->subl, &sub->le, sub);
+	lock_rel(sub->sh->lock);
+
+ out:
+	if (err)
+		mem_deref(sub);
+	else
+		*subp = sub;
+
+	return err;
+}
+
+
+/**
+ * Subscribe to an audio source, the device is opened if no one else
+ * has it open with the same parameters
+ *
+ * @param subp  Pointer to allocated subscription
+ * @param ctx   Media context (optional)
+ * @param name  Name of the audio source
+ * @param prm   Audio source parameters
+ * @param dev   Audio device
+ * @param share True to share the device with other calls
+ * @param rh    Read handler
+ * @param errh  Error handler (optional)
+ * @param arg   Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int ausrc_subscribe(struct ausrc_sub **subp, struct media_ctx **ctx,
+		    const char *name, struct ausrc_prm *prm, const char *dev,
+		    bool share, ausrc_read_h *rh, ausrc_error_h *errh,
+		    void *arg)
+{
+	const struct ausrc *as = ausrc_find(name);
+	struct ausrc_sub *sub;
+	struct aushare *sh = NULL;
+	int err = 0;
+
+	if (!subp || !prm || !rh)
+		return EINVAL;
+
+	if (!as)
+		return ENOENT;
+
+	if (!dev)
+		dev = "";
+
+	/* a media context belongs to one call */
+	share = share && fmt_mixable(prm->fmt) && !(ctx && *ctx);
+
+	sub = mem_zalloc(sizeof(*sub), src_sub_destructor);
+	if (!sub)
+		return ENOMEM;
+
+	sub->gain = GAIN_UNITY;
+	sub->rh   = rh;
+	sub->errh = errh;
+	sub->arg  = arg;
+
+	if (share) {
+		sh = share_find(&srcl, as->name, dev, prm->fmt,
+				prm->srate, prm->ch, prm->ptime);
+	}
+
+	if (sh) {
+		sub->sh = mem_ref(sh);
+	}
+	else {
+		err = share_alloc(&sub->sh, as->name, dev, prm->fmt,
+				  prm->srate, prm->ch, prm->ptime);
+		if (err)
+			goto out;
+
+		err = ausrc_alloc(&sub->sh->src, ctx, as->name, prm, dev,
+				  src_read_handler, src_error_handler,
+				  sub->sh);
+		if (err)
+			goto out;
+
+		if (share) {
+			list_append(&srcl, &sub->sh->le, sub->sh);
+			info("aushare: opened source %s,%s\n", as->name, dev);
+		}
+	}
+
+	lock_write_get(sub->sh->lock);
+	list_append(&sub->sh->subl, &sub->le, sub);
+	lock_rel(sub->sh->lock);
+
+ out:
+	if (err)
+		mem_deref(sub);
+	else
+		*subp = sub;
+
+	return err;
+}
+
+
+/**
+ * Open the configured audio player and source in standby, so that the
+ * calls attach to running devices
+ *
+ * @param cfg Audio configuration
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int aushare_warmup(const struct config_audio *cfg)
+{
+	const struct auplay *ap;
+	const struct ausrc *as;
+	int err;
+
+	if (!cfg)
+		return EINVAL;
+
+	if (!cfg->warmup)
+		return 0;
+
+	ap = auplay_find(cfg->play_mod);
+	if (ap && !warm_play) {
+
+		struct auplay_prm prm;
+
+		prm.srate = cfg->srate_play ? cfg->srate_play : WARM_SRATE;
+		prm.ch    = cfg->channels_play ? cfg->channels_play : 1;
+		prm.ptime = cfg->warmup;
+		prm.fmt   = AUFMT_S16LE;
+
+		err = share_alloc(&warm_play, ap->name, cfg->play_dev,
+				  prm.fmt, prm.srate, prm.ch, prm.ptime);
+		if (err)
+			return err;
+
+		err = auplay_alloc(&warm_play->play, ap->name, &prm,
+				   cfg->play_dev, play_write_handler,
+				   warm_play);
+		if (err) {
+			warning("aushare: standby player %s,%s: %m\n",
+				ap->name, cfg->play_dev, err);
+			warm_play = mem_deref(warm_play);
+			return err;
+		}
+
+		list_append(&playl, &warm_play->le, warm_play);
+
+		info("aushare: player %s,%s in standby (%uHz %uch %ums)\n",
+		     ap->name, cfg->play_dev, prm.srate, prm.ch, prm.ptime);
+	}
+
+	as = ausrc_find(cfg->src_mod);
+	if (as && !warm_src) {
+
+		struct ausrc_prm prm;
+
+		prm.srate = cfg->srate_src ? cfg->srate_src : WARM_SRATE;
+		prm.ch    = cfg->channels_src ? cfg->channels_src : 1;
+		prm.ptime = cfg->warmup;
+		prm.fmt   = AUFMT_S16LE;
+
+		err = share_alloc(&warm_src, as->name, cfg->src_dev,
+				  prm.fmt, prm.srate, prm.ch, prm.ptime);
+		if (err)
+			return err;
+
+		err = ausrc_alloc(&warm_src->src, NULL, as->name, &prm,
+				  cfg->src_dev, src_read_handler,
+				  src_error_handler, warm_src);
+		if (err) {
+			warning("aushare: standby source %s,%s: %m\n",
+				as->name, cfg->src_dev, err);
+			warm_src = mem_deref(warm_src);
+			return err;
+		}
+
+		list_append(&srcl, &warm_src->le, warm_src);
+
+		info("aushare: source %s,%s in standby (%uHz %uch %ums)\n",
+		     as->name, cfg->src_dev, prm.srate, prm.ch, prm.ptime);
+	}
+
+	return 0;
+}
+
+
+/**
+ * Close the devices in standby, once the calls that use them are gone
+ */
+void aushare_cooldown(void)
+{
+	warm_play = mem_deref(warm_play);
+	warm_src  = mem_deref(warm_src);
+}
+
+
+struct auplay_st *auplay_sub_st(const struct auplay_sub *sub)
+{
+	return sub && sub->sh ? sub->sh->play : NULL;
+}
+
+
+struct ausrc_st *ausrc_sub_st(const struct ausrc_sub *sub)
+{
+	return sub && sub->sh ? sub->sh->src : NULL;
+}
+
+
+/**
+ * Set the gain of a call on a shared audio player
+ *
+ * @param sub  Subscription
+ * @param gain Gain in [%], 100 for unity and 0 to mute
+ */
+void auplay_sub_gain(struct auplay_sub *sub, uint32_t gain)
+{
+	if (sub)
+		sub->gain = gain;
+}
+
+
+/**
+ * Set the gain of a call on a shared audio source
+ *
+ * @param sub  Subscription
+ * @param gain Gain in [%], 100 for unity and 0 to mute
+ */
+void ausrc_sub_gain(struct ausrc_sub *sub, uint32_t gain)
+{
+	if (sub)
+		sub->gain = gain;
+}
@@ -53,6 +53,22 @@ int ausrc_register(struct ausrc **asp, const char *name, ausrc_alloc_h *alloch)
 }
 
 
+/**
+ * Set the debug handler of an Audio Source, which prints the state of
+ * a device in the audio debug output
+ *
+ * @param as      Audio Source
+ * @param debugh  Debug handler
+ */
+void ausrc_set_debug(struct ausrc *as, ausrc_debug_h *debugh)
+{
+	if (!as)
+		return;
+
+	as->debugh = debugh;
+}
+
+
 /**
  * Find an Audio Source by name
  *
@@ -0,0 +1,308 @@
+/**
+ * @file avsync.c  Audio/video lip-sync
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * The RTCP sender reports of a stream map its RTP timestamps to the NTP
+ * wall clock of the sender. When a frame is played out, the local play
+ * time minus the capture time from that map is the offset of the
+ * stream. The audio and video of a call are captured with the same
+ * clock, so the difference of the two offsets is the lip-sync error,
+ * whatever the clock offset between the two hosts is.
+ *
+ * Once a second the error is reduced by one step. When the video is
+ * late, the video hold is reduced first and then the audio is delayed
+ * in the jitter buffer. When the audio is late, the audio delay is
+ * reduced first and then the video frames are held before they are
+ * displayed.
+ *
+ * The frames are played by the media threads, the lock protects the
+ * state of both sides.
+ */
+
+
+enum {
+	TMR_INTERVAL = 1000,  /**< Control interval [ms]                  */
+	DEADBAND     =   20,  /**< Error that is left alone [ms]          */
+	STEP_MAX     =   40,  /**< Largest change per interval [ms]       */
+	DELAY_MAX    =  500,  /**< Largest added delay [ms]               */
+};
+
+struct avsync_side {
+	uint64_t ntp;         /**< NTP time of the last SR [us]           */
+	uint32_t rtp;         /**< RTP timestamp of the last SR           */
+	uint32_t srate;       /**< RTP clock rate [Hz]                    */
+	bool sr;              /**< A sender report was received           */
+	int64_t offset;       /**< Smoothed play minus capture time [us]  */
+	bool valid;           /**< The offset was measured                */
+	unsigned n;           /**< Frames played in this interval         */
+	uint32_t delay;       /**< Added playout delay [ms]               */
+};
+
+struct avsync {
+	struct avsync_side sidev[AVSYNC_MEDIA_MAX];
+	struct lock *lock;
+	struct tmr tmr;
+	int32_t error;        /**< Video minus audio offset [ms]          */
+	bool valid;           /**< The error was measured                 */
+	uint32_t n_adjust;    /**< Number of delay changes                */
+};
+
+
+static void destructor(void *arg)
+{
+	struct avsync *as = arg;
+
+	tmr_cancel(&as->tmr);
+	mem_deref(as->lock);
+}
+
+
+/* Move the delay from the late side, then add it to the early side */
+static void adjust(struct avsync_side *late, struct avsync_side *early,
+		   uint32_t step)
+{
+	const uint32_t d = min(step, late->delay);
+
+	late->delay -= d;
+	early->delay = min(early->delay + step - d, DELAY_MAX);
+}
+
+
+static void tmr_handler(void *arg)
+{
+	struct avsync *as = arg;
+	struct avsync_side *a = &as->sidev[AVSYNC_AUDIO];
+	struct avsync_side *v = &as->sidev[AVSYNC_VIDEO];
+	int32_t e;
+
+	tmr_start(&as->tmr, TMR_INTERVAL, tmr_handler, as);
+
+	lock_write_get(as->lock);
+
+	/* both streams must be playing */
+	if (!a->n || !v->n || !a->valid || !v->valid)
+		goto out;
+
+	e = (int32_t)((v->offset - a->offset) / 1000);
+
+	as->error = e;
+	as->valid = true;
+
+	if (e > DEADBAND) {
+		adjust(v, a, min((uint32_t)e, STEP_MAX));
+		++as->n_adjust;
+	}
+	else if (e < -DEADBAND) {
+		adjust(a, v, min((uint32_t)-e, STEP_MAX));
+		++as->n_adjust;
+	}
+
+ out:
+	a->n = 0;
+	v->n = 0;
+
+	lock_rel(as->lock);
+}
+
+
+/**
+ * Allocate the lip-sync state of a call
+ *
+ * @param asp Pointer to allocated lip-sync state
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int avsync_alloc(struct avsync **asp)
+{
+	struct avsync *as;
+	int err;
+
+	if (!asp)
+		return EINVAL;
+
+	as = mem_zalloc(sizeof(*as), destructor);
+	if (!as)
+		return ENOMEM;
+
+	err = lock_alloc(&as->lock);
+	if (err) {
+		mem_deref(as);
+		return err;
+	}
+
+	tmr_start(&as->tmr, TMR_INTERVAL, tmr_handler, as);
+
+	*asp = as;
+
+	return 0;
+}
+
+
+/**
+ * Update the RTP to NTP time map of a stream from a sender report
+ *
+ * @param as       Lip-sync state
+ * @param media    Media of the stream
+ * @param ntp_sec  NTP timestamp, seconds
+ * @param ntp_frac NTP timestamp, fraction of a second
+ * @param rtp_ts   RTP timestamp of the same instant
+ * @param srate    RTP clock rate [Hz]
+ */
+void avsync_sr(struct avsync *as, enum avsync_media media,
+	       uint32_t ntp_sec, uint32_t ntp_frac, uint32_t rtp_ts,
+	       uint32_t srate)
+{
+	struct avsync_side *s;
+
+	if (!as || media >= AVSYNC_MEDIA_MAX || !srate)
+		return;
+
+	s = &as->sidev[media];
+
+	lock_write_get(as->lock);
+
+	s->ntp   = (uint64_t)ntp_sec * 1000000
+		+ (((uint64_t)ntp_frac * 1000000) >> 32);
+	s->rtp   = rtp_ts;
+	s->srate = srate;
+	s->sr    = true;
+
+	lock_rel(as->lock);
+}
+
+
+/**
+ * Account a frame that is played out
+ *
+ * @param as     Lip-sync state
+ * @param media  Media of the frame
+ * @param rtp_ts RTP timestamp of the frame
+ * @param delay  Time until the frame is heard or seen [ms]
+ *
+ * @note This function may be called from any thread
+ */
+void avsync_play(struct avsync *as, enum avsync_media media,
+		 uint32_t rtp_ts, uint32_t delay)
+{
+	struct avsync_side *s;
+	int64_t capture, x;
+
+	if (!as || media >= AVSYNC_MEDIA_MAX)
+		return;
+
+	s = &as->sidev[media];
+
+	lock_write_get(as->lock);
+
+	if (!s->sr)
+		goto out;
+
+	capture = (int64_t)s->ntp
+		+ (int64_t)(int32_t)(rtp_ts - s->rtp) * 1000000 / s->srate;
+
+	x = (int64_t)(tmr_jiffies() + delay) * 1000 - capture;
+
+	if (s->valid) {
+		s->offset += (x - s->offset) / 8;
+	}
+	else {
+		s->offset = x;
+		s->valid  = true;
+	}
+
+	++s->n;
+
+ out:
+	lock_rel(as->lock);
+}
+
+
+/**
+ * Get the playout delay that is added to a stream
+ *
+ * @param as    Lip-sync state
+ * @param media Media of the stream
+ *
+ * @return Added delay [ms]
+ *
+ * @note This function may be called from any thread
+ */
+uint32_t avsync_delay(const struct avsync *as, enum avsync_media media)
+{
+	uint32_t delay;
+
+	if (!as || media >= AVSYNC_MEDIA_MAX)
+		return 0;
+
+	lock_read_get(as->lock);
+	delay = as->sidev[media].delay;
+	lock_rel(as->lock);
+
+	return delay;
+}
+
+
+/**
+ * Get the measured lip-sync error
+ *
+ * @param as     Lip-sync state
+ * @param offset Video minus audio offset [ms], positive if video is late
+ *
+ * @return 0 if success, ENOENT if not measured, otherwise errorcode
+ */
+int avsync_offset(const struct avsync *as, int32_t *offset)
+{
+	int err = 0;
+
+	if (!as || !offset)
+		return EINVAL;
+
+	lock_read_get(as->lock);
+
+	if (as->valid)
+		*offset = as->error;
+	else
+		err = ENOENT;
+
+	lock_rel(as->lock);
+
+	return err;
+}
+
+
+int avsync_debug(struct re_printf *pf, const struct avsync *as)
+{
+	int err;
+
+	if (!as)
+		return 0;
+
+	lock_read_get(as->lock);
+
+	if (as->valid) {
+		err = re_hprintf(pf, " a/v sync: offset=%d ms"
+				 " (audio delay=%u ms, video hold=%u ms,"
+				 " %u changes)\n",
+				 as->error,
+				 as->sidev[AVSYNC_AUDIO].delay,
+				 as->sidev[AVSYNC_VIDEO].delay,
+				 as->n_adjust);
+	}
+	else {
+		err = re_hprintf(pf, " a/v sync: not measured"
+				 " (sender reports: audio=%s, video=%s)\n",
+				 as->sidev[AVSYNC_AUDIO].sr ? "yes" : "no",
+				 as->sidev[AVSYNC_VIDEO].sr ? "yes" : "no");
+	}
+
+	lock_rel(as->lock);
+
+	return err;
+}
@@ -34,6 +34,9 @@ int baresip_init(struct config *cfg, bool prefer_ipv6)
 	list_init(&baresip.mnatl);
 	list_init(&baresip.mencl);
 
+	kernel_init();
+	memtag_init();
+
 	/* Initialise Network */
 	err = net_alloc(&baresip.net, &cfg->net,
 			prefer_ipv6 ? AF_INET6 : AF_INET);
@@ -54,15 +57,27 @@ int baresip_init(struct config *cfg, bool prefer_ipv6)
 	if (err)
 		return err;
 
+	err = governor_init(cfg->call.cpu_budget);
+	if (err)
+		return err;
+
+	err = watchdog_init(cfg->call.watchdog);
+	if (err)
+		return err;
+
 	return 0;
 }
 
 
 void baresip_close(void)
 {
+	watchdog_close();
+	governor_close();
+	rtpport_close();
 	baresip.player = mem_deref(baresip.player);
 	baresip.commands = mem_deref(baresip.commands);
 	contact_close(&baresip.contacts);
+	memtag_close();
 
 	baresip.net = mem_deref(baresip.net);
 }
@@ -9,15 +9,38 @@
 #include "core.h"
 
 
+/*
+ * The floor is the presentation stream of the call (RFC 4583). The
+ * active side is the floor control client, it asks the server for the
+ * floor and is told when it is granted, released or revoked. The
+ * passive side is the server, with one participant: the floor is granted
+ * to the side that asks for it, if the other side does not hold it.
+ */
+
+
+enum {
+	FLOOR_ID = 1,
+};
+
 struct bfcp {
 	struct bfcp_conn *conn;
 	struct sdp_media *sdpm;
 	struct mnat_media *mnat_st;
 	bool active;
+	uint16_t floorid;         /**< Floor of the presentation stream  */
+	uint16_t floorreqid;      /**< Floor request that holds it       */
+	bool granted;             /**< Floor is held by this side        */
+	bfcp_floor_h *floorh;
+	void *arg;
+
+	/* client */
+	uint32_t confid;
+	uint16_t userid;
 
 	/* server */
 	uint32_t lconfid;
 	uint16_t luserid;
+	bool peer_granted;        /**< Floor is held by the peer         */
 };
 
 
@@ -55,10 +78,73 @@ static enum bfcp_transp str2tp(const char *proto)
 }
 
 
+static void floor_set(struct bfcp *bfcp, bool granted)
+{
+	if (granted == bfcp->granted)
+		return;
+
+	bfcp->granted = granted;
+
+	info("bfcp: floor %u %s\n", bfcp->floorid,
+	     granted ? "granted" : "released");
+
+	if (bfcp->floorh)
+		bfcp->floorh(granted, bfcp->arg);
+}
+
+
+/* Client: the status of the floor request, from the server */
+static void floor_status(struct bfcp *bfcp, const struct bfcp_msg *msg)
+{
+	struct bfcp_attr *info, *ors, *rs;
+
+	info = bfcp_msg_attr(msg, BFCP_FLOOR_REQ_INFO);
+	if (!info)
+		return;
+
+	ors = bfcp_attr_subattr(info, BFCP_OVERALL_REQ_STATUS);
+	rs  = ors ? bfcp_attr_subattr(ors, BFCP_REQUEST_STATUS) : NULL;
+	if (!rs)
+		return;
+
+	bfcp->floorreqid = info->v.u16;
+
+	switch (rs->v.reqstatus.status) {
+
+	case BFCP_GRANTED:
+		floor_set(bfcp, true);
+		break;
+
+	case BFCP_DENIED:
+	case BFCP_CANCELLED:
+	case BFCP_RELEASED:
+	case BFCP_REVOKED:
+		floor_set(bfcp, false);
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+/* Server: the floor is granted to the side that asks for it first */
+static int floor_reply(struct bfcp *bfcp, const struct bfcp_msg *msg,
+		       enum bfcp_reqstat status)
+{
+	struct bfcp_reqstatus rs = {status, 0};
+
+	return bfcp_reply(bfcp->conn, msg, BFCP_FLOOR_REQUEST_STATUS, 1,
+			  BFCP_FLOOR_REQ_INFO, 2, &bfcp->floorreqid,
+			  BFCP_OVERALL_REQ_STATUS, 1, &bfcp->floorreqid,
+			  BFCP_REQUEST_STATUS, 0, &rs,
+			  BFCP_FLOOR_REQ_STATUS, 0, &bfcp->floorid);
+}
+
+
 static void bfcp_resp_handler(int err, const struct bfcp_msg *msg, void *arg)
 {
 	struct bfcp *bfcp = arg;
-	(void)bfcp;
 
 	if (err) {
 		warning("bfcp: error response: %m\n", err);
@@ -67,6 +153,9 @@ static void bfcp_resp_handler(int err, const struct bfcp_msg *msg, void *arg)
 
 	info("bfcp: received BFCP response: '%s'\n",
 	     bfcp_prim_name(msg->prim));
+
+	if (msg->prim == BFCP_FLOOR_REQUEST_STATUS)
+		floor_status(bfcp, msg);
 }
 
 
@@ -82,6 +171,37 @@ static void bfcp_msg_handler(const struct bfcp_msg *msg, void *arg)
 		(void)bfcp_reply(bfcp->conn, msg, BFCP_HELLO_ACK, 0);
 		break;
 
+	case BFCP_FLOOR_REQUEST_STATUS:
+		floor_status(bfcp, msg);
+		(void)bfcp_reply(bfcp->conn, msg, BFCP_FLOOR_REQ_STATUS_ACK, 0);
+		break;
+
+	case BFCP_FLOOR_REQUEST:
+		if (bfcp->active) {
+			(void)bfcp_ereply(bfcp->conn, msg, BFCP_UNKNOWN_PRIM);
+			break;
+		}
+
+		if (bfcp->granted) {
+			(void)floor_reply(bfcp, msg, BFCP_DENIED);
+			break;
+		}
+
+		++bfcp->floorreqid;
+		bfcp->peer_granted = true;
+		(void)floor_reply(bfcp, msg, BFCP_GRANTED);
+		break;
+
+	case BFCP_FLOOR_RELEASE:
+		if (bfcp->active) {
+			(void)bfcp_ereply(bfcp->conn, msg, BFCP_UNKNOWN_PRIM);
+			break;
+		}
+
+		bfcp->peer_granted = false;
+		(void)floor_reply(bfcp, msg, BFCP_RELEASED);
+		break;
+
 	default:
 		(void)bfcp_ereply(bfcp->conn, msg, BFCP_UNKNOWN_PRIM);
 		break;
@@ -89,9 +209,25 @@ static void bfcp_msg_handler(const struct bfcp_msg *msg, void *arg)
 }
 
 
+/**
+ * Allocate a BFCP agent
+ *
+ * @param bfcpp     Pointer to allocated BFCP agent
+ * @param sdp_sess  SDP session
+ * @param proto     BFCP transport, "udp" or "dtls"
+ * @param offerer   True if SDP offerer, the floor control client
+ * @param mnat      Media NAT (optional)
+ * @param mnat_sess Media NAT session (optional)
+ * @param mstrm     Label of the presentation stream, 0 if none
+ * @param floorh    Handler for the floor of this side (optional)
+ * @param arg       Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
 int bfcp_alloc(struct bfcp **bfcpp, struct sdp_session *sdp_sess,
 	       const char *proto, bool offerer,
-	       const struct mnat *mnat, struct mnat_sess *mnat_sess)
+	       const struct mnat *mnat, struct mnat_sess *mnat_sess,
+	       int mstrm, bfcp_floor_h *floorh, void *arg)
 {
 	struct bfcp *bfcp;
 	struct sa laddr;
@@ -107,7 +243,10 @@ int bfcp_alloc(struct bfcp **bfcpp, struct sdp_session *sdp_sess,
 	if (!bfcp)
 		return ENOMEM;
 
-	bfcp->active = offerer;
+	bfcp->active  = offerer;
+	bfcp->floorid = FLOOR_ID;
+	bfcp->floorh  = floorh;
+	bfcp->arg     = arg;
 
 	sa_init(&laddr, AF_INET);
 
@@ -142,6 +281,12 @@ int bfcp_alloc(struct bfcp **bfcpp, struct sdp_session *sdp_sess,
 					   "%u", bfcp->lconfid);
 		err |= sdp_media_set_lattr(bfcp->sdpm, true, "userid",
 					   "%u", bfcp->luserid);
+
+		if (mstrm) {
+			err |= sdp_media_set_lattr(bfcp->sdpm, true,
+						   "floorid", "%u mstrm:%d",
+						   bfcp->floorid, mstrm);
+		}
 	}
 
 	if (err)
@@ -173,8 +318,8 @@ int bfcp_alloc(struct bfcp **bfcpp, struct sdp_session *sdp_sess,
 int bfcp_start(struct bfcp *bfcp)
 {
 	const struct sa *paddr;
-	uint32_t confid = 0;
-	uint16_t userid = 0;
+	const char *fid;
+	struct pl floorid;
 	int err = 0;
 
 	if (!bfcp)
@@ -188,12 +333,78 @@ int bfcp_start(struct bfcp *bfcp)
 	if (bfcp->active) {
 
 		paddr  = sdp_media_raddr(bfcp->sdpm);
-		confid = sdp_media_rattr_u32(bfcp->sdpm, "confid");
-		userid = sdp_media_rattr_u32(bfcp->sdpm, "userid");
+		bfcp->confid = sdp_media_rattr_u32(bfcp->sdpm, "confid");
+		bfcp->userid = sdp_media_rattr_u32(bfcp->sdpm, "userid");
+
+		/* a=floorid:1 mstrm:3 */
+		fid = sdp_media_rattr(bfcp->sdpm, "floorid");
+		if (0 == re_regex(fid, str_len(fid), "[0-9]+", &floorid))
+			bfcp->floorid = pl_u32(&floorid);
 
 		err = bfcp_request(bfcp->conn, paddr, BFCP_VER2, BFCP_HELLO,
-				   confid, userid, bfcp_resp_handler, bfcp, 0);
+				   bfcp->confid, bfcp->userid,
+				   bfcp_resp_handler, bfcp, 0);
 	}
 
 	return err;
 }
+
+
+/**
+ * Ask for the floor of the presentation stream, or release it
+ *
+ * @param bfcp    BFCP agent
+ * @param request True to ask for the floor, false to release it
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int bfcp_floor(struct bfcp *bfcp, bool request)
+{
+	if (!bfcp)
+		return EINVAL;
+
+	if (!sdp_media_rport(bfcp->sdpm))
+		return ENOTCONN;
+
+	/* the server grants the floor to itself */
+	if (!bfcp->active) {
+
+		if (request && bfcp->peer_granted)
+			return EBUSY;
+
+		floor_set(bfcp, request);
+		return 0;
+	}
+
+	if (request) {
+		return bfcp_request(bfcp->conn, sdp_media_raddr(bfcp->sdpm),
+				    BFCP_VER2, BFCP_FLOOR_REQUEST,
+				    bfcp->confid, bfcp->userid,
+				    bfcp_resp_handler, bfcp,
+				    1, BFCP_FLOOR_ID, 0, &bfcp->floorid);
+	}
+
+	if (!bfcp->granted)
+		return 0;
+
+	floor_set(bfcp, false);
+
+	return bfcp_request(bfcp->conn, sdp_media_raddr(bfcp->sdpm),
+			    BFCP_VER2, BFCP_FLOOR_RELEASE,
+			    bfcp->confid, bfcp->userid,
+			    bfcp_resp_handler, bfcp,
+			    1, BFCP_FLOOR_REQUEST_ID, 0, &bfcp->floorreqid);
+}
+
+
+/**
+ * Check if this side holds the floor of the presentation stream
+ *
+ * @param bfcp BFCP agent
+ *
+ * @return True if the floor is held
+ */
+bool bfcp_floor_granted(const struct bfcp *bfcp)
+{
+	return bfcp ? bfcp->granted : false;
+}
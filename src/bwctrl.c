@@ -0,0 +1,159 @@
+/**
+ * @file bwctrl.c  Sender-side congestion control
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * Loss-based controller from Google Congestion Control
+ * (draft-ietf-rmcat-gcc, section 6):
+ *
+ *   fraction lost > 10%  ->  rate = rate * (1 - 0.5 * loss)
+ *   fraction lost <  2%  ->  rate = rate * 1.05
+ *   otherwise            ->  rate is kept
+ *
+ * If the receiver sends REMB (draft-alvestrand-rmcat-remb) the rate is
+ * also capped by the receiver's estimate. The result is always kept
+ * within the configured min/max.
+ */
+
+
+enum {
+	LOSS_LOW  = 256 * 2 / 100,     /* fraction lost, 1/256 units */
+	LOSS_HIGH = 256 * 10 / 100,
+};
+
+
+static uint32_t clamp_rate(const struct bwctrl *bc, uint64_t rate)
+{
+	if (bc->remb && rate > bc->remb)
+		rate = bc->remb;
+
+	if (rate < bc->min)
+		rate = bc->min;
+	if (rate > bc->max)
+		rate = bc->max;
+
+	return (uint32_t)rate;
+}
+
+
+/**
+ * Initialise the congestion controller
+ *
+ * @param bc    Congestion control state
+ * @param start Initial target bitrate [bit/s]
+ * @param min   Lower bound of the target bitrate [bit/s]
+ * @param max   Upper bound of the target bitrate [bit/s]
+ */
+void bwctrl_init(struct bwctrl *bc, uint32_t start, uint32_t min,
+		 uint32_t max)
+{
+	if (!bc)
+		return;
+
+	memset(bc, 0, sizeof(*bc));
+
+	bc->min  = min;
+	bc->max  = max(min, max);
+	bc->rate = clamp_rate(bc, start);
+}
+
+
+/**
+ * Update the target bitrate from a report block about our stream
+ *
+ * @param bc Congestion control state
+ * @param rr Report block from an RTCP SR or RR
+ *
+ * @return True if the target bitrate was changed
+ */
+bool bwctrl_rr_handler(struct bwctrl *bc, const struct rtcp_rr *rr)
+{
+	uint32_t prev;
+	uint64_t rate;
+
+	if (!bc || !rr)
+		return false;
+
+	prev = bc->rate;
+	rate = prev;
+
+	bc->fraction = rr->fraction;
+	++bc->n_rr;
+
+	if (rr->fraction > LOSS_HIGH) {
+		rate = rate * (512 - rr->fraction) / 512;
+		++bc->n_decr;
+	}
+	else if (rr->fraction < LOSS_LOW) {
+		rate = rate * 105 / 100;
+	}
+
+	bc->rate = clamp_rate(bc, rate);
+
+	return bc->rate != prev;
+}
+
+
+/**
+ * Update the target bitrate from a REMB message
+ *
+ * @param bc  Congestion control state
+ * @param afb Application layer feedback (FCI of RTCP PSFB/AFB)
+ *
+ * @return True if the target bitrate was changed
+ */
+bool bwctrl_remb_handler(struct bwctrl *bc, struct mbuf *afb)
+{
+	uint32_t prev, v, mantissa;
+	const uint8_t *p;
+	uint8_t exp;
+
+	if (!bc || !afb)
+		return false;
+
+	/* "REMB" | num ssrc | exp(6) mantissa(18) | ssrc .. */
+	if (mbuf_get_left(afb) < 8)
+		return false;
+
+	p = mbuf_buf(afb);
+	if (memcmp(p, "REMB", 4))
+		return false;
+
+	v = (uint32_t)p[5] << 16 | (uint32_t)p[6] << 8 | p[7];
+
+	exp      = (v >> 18) & 0x3f;
+	mantissa = v & 0x3ffff;
+
+	if (exp > 14)
+		bc->remb = UINT32_MAX;
+	else
+		bc->remb = max(mantissa << exp, 1);
+
+	++bc->n_remb;
+
+	prev = bc->rate;
+	bc->rate = clamp_rate(bc, bc->rate);
+
+	return bc->rate != prev;
+}
+
+
+int bwctrl_debug(struct re_printf *pf, const struct bwctrl *bc)
+{
+	if (!bc || !bc->max)
+		return 0;
+
+	return re_hprintf(pf, " bwctrl: target=%u bit/s (%u-%u)"
+			  " loss=%u%% rr=%u remb=%u (%u bit/s)"
+			  " decreases=%u\n",
+			  bc->rate, bc->min, bc->max,
+			  bc->fraction * 100 / 256,
+			  bc->n_rr, bc->n_remb, bc->remb, bc->n_decr);
+}
@@ -24,6 +24,9 @@
 /** Call constants */
 enum {
 	PTIME           = 20,    /**< Packet time for audio               */
+	SETUP_POLL      = 10,    /**< Polling for first RTP packet [ms]   */
+	SETUP_WAIT      = 30000, /**< Wait for first RTP packet [ms]      */
+	SETUP_HIST      = 16,    /**< Setup histogram buckets, 2^n [ms]   */
 };
 
 
@@ -38,10 +41,19 @@ enum state {
 	STATE_TERMINATED
 };
 
-/** SIP Call Control object */
+/**
+ * SIP Call Control object
+ *
+ * The call lives on the main loop, with its SIP session. The SDP session
+ * and the media belong to the event loop of the media, and are changed
+ * there with shard_exec() while the main loop waits.
+ */
 struct call {
 	MAGIC_DECL                /**< Magic number for debugging           */
 	struct le le;             /**< Linked list element                  */
+	struct le le_live;        /**< Element of the list of live calls    */
+	uint32_t serial;          /**< Serial number of the call            */
+	unsigned loop;            /**< Event loop of the media              */
 	struct ua *ua;            /**< SIP User-agent                       */
 	struct account *acc;      /**< Account (ref.)                       */
 	struct sipsess *sess;     /**< SIP Session                          */
@@ -52,7 +64,13 @@ struct call {
 	struct audio *audio;      /**< Audio stream                         */
 #ifdef USE_VIDEO
 	struct video *video;      /**< Video stream                         */
+	struct video *content;    /**< Presentation stream, or NULL         */
 	struct bfcp *bfcp;        /**< BFCP Client                          */
+	struct avsync *avsync;    /**< Audio/video lip-sync                 */
+	uint32_t bw_video;        /**< Estimate of the camera stream        */
+	uint32_t bw_content;      /**< Estimate of the presentation stream  */
+	bool presenting;          /**< This side holds the floor            */
+	struct admit_cost cost;   /**< Resources held by the call           */
 #endif
 	enum state state;         /**< Call state                           */
 	char *local_uri;          /**< Local SIP uri                        */
@@ -64,11 +82,28 @@ struct call {
 	time_t time_start;        /**< Time when call started               */
 	time_t time_conn;         /**< Time when call initiated             */
 	time_t time_stop;         /**< Time when call stopped               */
+	struct tmr tmr_setup;     /**< Timer for the first RTP packet       */
+	struct hktmr tmr_stats;   /**< Timer for the call stats event       */
+	bool stats_end;           /**< The final call stats event was sent  */
+	struct {
+		uint64_t alloc;       /**< Call allocated                   */
+		uint64_t mnat;        /**< Media-nat established            */
+		uint64_t invite;      /**< INVITE sent                      */
+		uint64_t response;    /**< First response received          */
+		uint64_t offer;       /**< SDP offer sent or received       */
+		uint64_t answer;      /**< SDP answer sent or received      */
+		uint64_t estab;       /**< Session established              */
+		uint64_t audio;       /**< Audio start called               */
+		uint64_t audio_done;  /**< Audio start returned             */
+		uint64_t media;       /**< First RTP packet received        */
+		bool reported;        /**< Added to the setup histograms    */
+	} ts;                     /**< Call setup timestamps [jiffies]      */
 	bool outgoing;            /**< True if outgoing, false if incoming  */
 	bool got_offer;           /**< Got SDP Offer from Peer              */
 	bool on_hold;             /**< True if call is on hold              */
 	struct mnat_sess *mnats;  /**< Media NAT session                    */
 	bool mnat_wait;           /**< Waiting for MNAT to establish        */
+	struct mbuf *trickle;     /**< SDP fragments waiting for the dialog */
 	struct menc_sess *mencs;  /**< Media encryption session state       */
 	int af;                   /**< Preferred Address Family             */
 	uint16_t scode;           /**< Termination status code              */
@@ -84,7 +119,82 @@ struct call {
 };
 
 
+/** Events of the media, reported to the main loop */
+enum media_ev_type {
+	MEDIA_DTMF,
+	MEDIA_AUDIO_ERR,
+	MEDIA_VIDEO_ERR,
+	MEDIA_MENC_ERR,
+	MEDIA_STREAM_ERR,
+	MEDIA_MNAT,
+	MEDIA_SDPFRAG,
+	MEDIA_RTPSTAT,
+};
+
+/** An event of the media of a call */
+struct media_ev {
+	struct call *call;        /**< Call of the event                    */
+	uint32_t serial;          /**< Serial number of the call            */
+	enum media_ev_type type;  /**< Event type                           */
+	int err;                  /**< Error code                           */
+	int key;                  /**< DTMF key                             */
+	bool end;                 /**< DTMF key released                    */
+	uint16_t scode;           /**< Media NAT status code                */
+	const char *str;          /**< Reason, stream name or RTP stats     */
+	struct mbuf *mb;          /**< SDP fragment                         */
+	char *buf;                /**< Copy of the string                   */
+};
+
+typedef int (media_print_h)(struct re_printf *pf, const struct call *call);
+
+/** Work on the media of a call, on its event loop */
+struct media_job {
+	struct call *call;        /**< Call object                          */
+	const struct config *cfg; /**< Configuration, for the allocation    */
+	const struct call_prm *prm; /**< Call parameters                  */
+	struct dnsc *dnsc;        /**< DNS client of the main loop          */
+	const struct call *peer;  /**< Call to relay to                     */
+	struct mbuf *mb;          /**< SDP to decode                        */
+	struct mbuf **descp;      /**< Encoded SDP                          */
+	struct pl *frag;          /**< SDP fragment of the peer             */
+	const struct sa *laddr;   /**< Local address                        */
+	struct re_printf *pf;     /**< Print handler                        */
+	media_print_h *printh;    /**< Print function of the call           */
+	struct call_stats *cs;    /**< Call statistics                      */
+	char *str;                /**< Printed RTP statistics               */
+	uint64_t ts;              /**< First RTP packet [jiffies]           */
+	uint32_t delay;           /**< Delay of the reflected media [ms]    */
+	unsigned n;               /**< Number of relayed streams            */
+	bool offer;               /**< SDP offer, or got an SDP offer       */
+	bool active;              /**< Call is established                  */
+	bool enable;              /**< Hold, present or reflect             */
+	char key;                 /**< DTMF digit                           */
+};
+
+
+/*
+ * The live calls, to find the call of an event that the media of a
+ * call reported from its event loop. The call may be gone, or its
+ * memory reused, before the main loop gets to the event.
+ */
+static struct list calll;
+static uint32_t call_serial;
+
+
+/*
+ * Process-wide call setup latency, one histogram per phase. The calls
+ * of all event loops count here, under shard_lock().
+ */
+static struct setup_stats {
+	uint64_t histv[CALL_PHASE_MAX][SETUP_HIST];
+	uint64_t n[CALL_PHASE_MAX];
+	uint64_t sum[CALL_PHASE_MAX];
+	uint64_t max[CALL_PHASE_MAX];
+} setup_stats;
+
+
 static int send_invite(struct call *call);
+static int send_sdpfrag(struct call *call, struct mbuf *mb);
 
 
 static const char *state_name(enum state st)
@@ -105,15 +215,130 @@ static const char *state_name(enum state st)
 
 static void set_state(struct call *call, enum state st)
 {
+	PROBE3(call_state, call, call->state, st);
+
 	call->state = st;
 }
 
 
-static void call_stream_start(struct call *call, bool active)
+#ifdef USE_VIDEO
+/*
+ * The camera and the presentation go on the same path, so the video
+ * budget is the higher of the estimates of their congestion controls.
+ * While this side presents, bfcp_content_share [%] of the budget goes
+ * to the presentation, otherwise all of it goes to the camera.
+ */
+static void video_budget(struct call *call)
+{
+	const uint32_t share = conf_config()->bfcp.content_share;
+	uint32_t total = call->bw_video, bw;
+
+	if (!call->presenting) {
+		video_set_bitrate(call->video, total);
+		return;
+	}
+
+	total = max(total, call->bw_content);
+	bw    = (uint32_t)((uint64_t)total * share / 100);
+
+	video_set_bitrate(call->video, total - bw);
+	video_set_bitrate(call->content, bw);
+}
+
+
+static void video_bw_handler(uint32_t bps, void *arg)
+{
+	struct call *call = arg;
+
+	call->bw_video = bps;
+	video_budget(call);
+}
+
+
+static void content_bw_handler(uint32_t bps, void *arg)
+{
+	struct call *call = arg;
+
+	call->bw_content = bps;
+	video_budget(call);
+}
+
+
+static void bfcp_floor_handler(bool granted, void *arg)
+{
+	struct call *call = arg;
+	const struct config_bfcp *cfg = &conf_config()->bfcp;
+	int err;
+
+	if (!call->content)
+		return;
+
+	err = video_present(call->content,
+			    granted ? cfg->content_mod : NULL,
+			    cfg->content_dev);
+	if (err) {
+		warning("call: could not present from %s,%s (%m)\n",
+			cfg->content_mod, cfg->content_dev, err);
+		(void)bfcp_floor(call->bfcp, false);
+		return;
+	}
+
+	call->presenting = granted;
+
+	info("call: presentation %s\n", granted ? "started" : "stopped");
+
+	video_budget(call);
+}
+
+
+static void content_start(struct call *call)
 {
 	const struct sdp_format *sc;
 	int err;
 
+	sc = sdp_media_rformat(stream_sdpmedia(video_strm(call->content)),
+			       NULL);
+	if (!sc) {
+		if (video_is_started(call->content)) {
+			info("call: presentation stream is disabled..\n");
+			video_stop(call->content);
+		}
+		return;
+	}
+
+	err  = video_encoder_set(call->content, sc->data, sc->pt, sc->params);
+	err |= video_decoder_set(call->content, sc->data, sc->pt,
+				 sc->rparams);
+	if (!err && !video_is_started(call->content))
+		err = video_start(call->content, call->peer_uri);
+	if (err)
+		warning("call: presentation stream error: %m\n", err);
+}
+#endif
+
+
+/* The cost of the call, once the media has been agreed on */
+static void call_cost_update(struct call *call)
+{
+	unsigned n_video = 0;
+
+#ifdef USE_VIDEO
+	n_video += video_is_started(call->video);
+	n_video += video_is_started(call->content);
+#endif
+
+	admit_update(&call->cost, n_video);
+}
+
+
+static int start_handler(void *arg)
+{
+	struct media_job *job = arg;
+	struct call *call = job->call;
+	const struct sdp_format *sc;
+	struct le *le;
+	int err;
+
 	/* Audio Stream */
 	sc = sdp_media_rformat(stream_sdpmedia(audio_strm(call->audio)), NULL);
 	if (sc) {
@@ -134,7 +359,16 @@ static void call_stream_start(struct call *call, bool active)
 			}
 
 			if (!err) {
+				const bool first = !call->ts.audio;
+
+				if (first)
+					call->ts.audio = tmr_jiffies();
+
 				err = audio_start(call->audio);
+
+				if (first)
+					call->ts.audio_done = tmr_jiffies();
+
 				if (err) {
 					warning("call: start:"
 						" audio_start error: %m\n",
@@ -169,6 +403,8 @@ static void call_stream_start(struct call *call, bool active)
 		info("call: video stream is disabled..\n");
 	}
 
+	content_start(call);
+
 	if (call->bfcp) {
 		err = bfcp_start(call->bfcp);
 		if (err) {
@@ -177,25 +413,38 @@ static void call_stream_start(struct call *call, bool active)
 	}
 #endif
 
-	if (active) {
-		struct le *le;
-
-		tmr_cancel(&call->tmr_inv);
-		call->time_start = time(NULL);
+	call_cost_update(call);
 
+	if (job->active) {
 		FOREACH_STREAM {
 			stream_reset(le->data);
 		}
 	}
+
+	return 0;
 }
 
 
-static void call_stream_stop(struct call *call)
+static void call_stream_start(struct call *call, bool active)
 {
-	if (!call)
-		return;
+	struct media_job job;
 
-	call->time_stop = time(NULL);
+	memset(&job, 0, sizeof(job));
+	job.call   = call;
+	job.active = active;
+
+	(void)shard_exec(call->loop, start_handler, &job);
+
+	if (active) {
+		tmr_cancel(&call->tmr_inv);
+		call->time_start = time(NULL);
+	}
+}
+
+
+static int stop_handler(void *arg)
+{
+	struct call *call = arg;
 
 	/* Audio */
 	audio_stop(call->audio);
@@ -203,9 +452,24 @@ static void call_stream_stop(struct call *call)
 	/* Video */
 #ifdef USE_VIDEO
 	video_stop(call->video);
+	video_stop(call->content);
 #endif
 
+	return 0;
+}
+
+
+static void call_stream_stop(struct call *call)
+{
+	if (!call)
+		return;
+
+	call->time_stop = time(NULL);
+
+	(void)shard_exec(call->loop, stop_handler, call);
+
 	tmr_cancel(&call->tmr_inv);
+	hktmr_cancel(&call->tmr_stats);
 }
 
 
@@ -224,10 +488,24 @@ static void call_event_handler(struct call *call, enum call_event ev,
 	(void)re_vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
 
+	/* the final call-quality record, while the streams still exist */
+	if (ev == CALL_EVENT_CLOSED && call->time_start && !call->stats_end) {
+		call->stats_end = true;
+		eh(call, CALL_EVENT_STATS, "end", eh_arg);
+	}
+
 	eh(call, ev, buf, eh_arg);
 }
 
 
+static void stats_handler(void *arg)
+{
+	struct call *call = arg;
+
+	call_event_handler(call, CALL_EVENT_STATS, "periodic");
+}
+
+
 static void invite_timeout(void *arg)
 {
 	struct call *call = arg;
@@ -239,13 +517,10 @@ static void invite_timeout(void *arg)
 }
 
 
-/** Called when all media streams are established */
-static void mnat_handler(int err, uint16_t scode, const char *reason,
-			 void *arg)
+/** Called on the main loop when all media streams are established */
+static void mnat_established(struct call *call, int err, uint16_t scode,
+			     const char *reason)
 {
-	struct call *call = arg;
-	MAGIC_CHECK(call);
-
 	if (err) {
 		warning("call: medianat '%s' failed: %m\n",
 			call->acc->mnatid, err);
@@ -261,6 +536,9 @@ static void mnat_handler(int err, uint16_t scode, const char *reason,
 
 	info("call: media-nat `%s' established\n", call->acc->mnatid);
 
+	if (!call->ts.mnat)
+		call->ts.mnat = tmr_jiffies();
+
 	/* Re-INVITE */
 	if (!call->mnat_wait) {
 		info("call: medianat established -- sending Re-INVITE\n");
@@ -286,8 +564,9 @@ static void mnat_handler(int err, uint16_t scode, const char *reason,
 }
 
 
-static int update_media(struct call *call)
+static int update_handler(void *arg)
 {
+	struct call *call = arg;
 	const struct sdp_format *sc;
 	struct le *le;
 	int err = 0;
@@ -298,6 +577,8 @@ static int update_media(struct call *call)
 #ifdef USE_VIDEO
 	if (call->video)
 		video_sdp_attr_decode(call->video);
+	if (call->content)
+		video_sdp_attr_decode(call->content);
 #endif
 
 	/* Update each stream */
@@ -347,12 +628,22 @@ static int update_media(struct call *call)
 		info("video stream is disabled..\n");
 		video_stop(call->video);
 	}
+
+	content_start(call);
 #endif
 
+	call_cost_update(call);
+
 	return err;
 }
 
 
+static int update_media(struct call *call)
+{
+	return shard_exec(call->loop, update_handler, call);
+}
+
+
 static void print_summary(const struct call *call)
 {
 	uint32_t dur = call_duration(call);
@@ -364,101 +655,550 @@ static void print_summary(const struct call *call)
 }
 
 
+static int32_t phase_diff(uint64_t from, uint64_t to)
+{
+	if (!from || !to || to < from)
+		return -1;
+
+	return (int32_t)(to - from);
+}
+
+
+/**
+ * Get the duration of a call setup phase
+ *
+ * @param call  Call object
+ * @param ph    Call setup phase
+ *
+ * @return Duration in [ms], -1 if the phase was not completed
+ */
+int32_t call_phase_duration(const struct call *call, enum call_phase ph)
+{
+	if (!call)
+		return -1;
+
+	switch (ph) {
+
+	case CALL_PHASE_MNAT:
+		return phase_diff(call->ts.alloc, call->ts.mnat);
+
+	case CALL_PHASE_RESPONSE:
+		return phase_diff(call->ts.invite, call->ts.response);
+
+	case CALL_PHASE_SDP:
+		return phase_diff(call->ts.offer, call->ts.answer);
+
+	case CALL_PHASE_ESTAB:
+		return phase_diff(call->ts.answer, call->ts.estab);
+
+	case CALL_PHASE_AUDIO:
+		return phase_diff(call->ts.audio, call->ts.audio_done);
+
+	case CALL_PHASE_MEDIA:
+		return phase_diff(call->ts.estab, call->ts.media);
+
+	default:
+		return -1;
+	}
+}
+
+
+/**
+ * Get the name of a call setup phase
+ *
+ * @param ph  Call setup phase
+ *
+ * @return Name of the phase
+ */
+const char *call_phase_name(enum call_phase ph)
+{
+	switch (ph) {
+
+	case CALL_PHASE_MNAT:     return "mnat";
+	case CALL_PHASE_RESPONSE: return "response";
+	case CALL_PHASE_SDP:      return "sdp";
+	case CALL_PHASE_ESTAB:    return "estab";
+	case CALL_PHASE_AUDIO:    return "audio";
+	case CALL_PHASE_MEDIA:    return "media";
+	default:                  return "?";
+	}
+}
+
+
+static int phases_print(struct re_printf *pf, const struct call *call)
+{
+	const char *sep = "";
+	int i, err = 0;
+
+	for (i=0; i<CALL_PHASE_MAX; i++) {
+
+		int32_t dur = call_phase_duration(call, i);
+
+		if (dur < 0)
+			continue;
+
+		err |= re_hprintf(pf, "%s%s=%d", sep, call_phase_name(i), dur);
+		sep = " ";
+	}
+
+	return err;
+}
+
+
+static unsigned setup_bucket(uint32_t ms)
+{
+	unsigned i = 0;
+
+	while (ms && i < SETUP_HIST - 1) {
+		ms >>= 1;
+		++i;
+	}
+
+	return i;
+}
+
+
+/* Add the completed phases of the call to the histograms, once */
+static void setup_record(struct call *call)
+{
+	int i;
+
+	if (call->ts.reported)
+		return;
+
+	call->ts.reported = true;
+
+	for (i=0; i<CALL_PHASE_MAX; i++) {
+
+		int32_t dur = call_phase_duration(call, i);
+
+		if (dur < 0)
+			continue;
+
+		shard_lock();
+		++setup_stats.histv[i][setup_bucket(dur)];
+		++setup_stats.n[i];
+		setup_stats.sum[i] += dur;
+		if ((uint64_t)dur > setup_stats.max[i])
+			setup_stats.max[i] = dur;
+		shard_unlock();
+	}
+}
+
+
+static int first_rx_handler(void *arg)
+{
+	struct media_job *job = arg;
+	struct call *call = job->call;
+	struct le *le;
+
+	FOREACH_STREAM {
+		struct stream *strm = le->data;
+		uint64_t ts = metric_ts_start(&strm->metric_rx);
+
+		if (ts && (!job->ts || ts < job->ts))
+			job->ts = ts;
+	}
+
+	return 0;
+}
+
+
+/* Wait for the first RTP packet, and then report the call setup */
+static void setup_poll_handler(void *arg)
+{
+	struct call *call = arg;
+	struct media_job job;
+	uint64_t first;
+
+	memset(&job, 0, sizeof(job));
+	job.call = call;
+
+	(void)shard_exec(call->loop, first_rx_handler, &job);
+	first = job.ts;
+
+	/* with early media the first packet came before the 200 OK */
+	if (first) {
+		call->ts.media = max(first, call->ts.estab);
+	}
+	else if (tmr_jiffies() < call->ts.estab + SETUP_WAIT) {
+		tmr_start(&call->tmr_setup, SETUP_POLL,
+			  setup_poll_handler, call);
+		return;
+	}
+
+	setup_record(call);
+
+	info("call: setup %s: %H\n", call->peer_uri, phases_print, call);
+
+	call_event_handler(call, CALL_EVENT_SETUP, "%H", phases_print, call);
+}
+
+
+/**
+ * Print the call setup latency histograms of all calls
+ *
+ * @param pf      Print handler
+ * @param unused  Unused parameter
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int call_setup_stats(struct re_printf *pf, void *unused)
+{
+	struct setup_stats st;
+	int i, j, err = 0;
+	(void)unused;
+
+	shard_lock();
+	st = setup_stats;
+	shard_unlock();
+
+	err |= re_hprintf(pf, "Call setup latency [ms]:\n");
+
+	for (i=0; i<CALL_PHASE_MAX; i++) {
+
+		const uint64_t n = st.n[i];
+
+		err |= re_hprintf(pf, "  %-8s n=%llu avg=%llu max=%llu ",
+				  call_phase_name(i), n,
+				  n ? st.sum[i] / n : 0,
+				  st.max[i]);
+
+		for (j=0; j<SETUP_HIST; j++) {
+
+			if (!st.histv[i][j])
+				continue;
+
+			err |= re_hprintf(pf, " <%u:%llu", 1u << j,
+					  st.histv[i][j]);
+		}
+
+		err |= re_hprintf(pf, "\n");
+	}
+
+	return err;
+}
+
+
+/* The media is freed on its event loop, where it was used */
+static int media_free_handler(void *arg)
+{
+	struct call *call = arg;
+
+	call->audio = mem_deref(call->audio);
+#ifdef USE_VIDEO
+	call->video   = mem_deref(call->video);
+	call->content = mem_deref(call->content);
+	call->bfcp    = mem_deref(call->bfcp);
+	call->avsync  = mem_deref(call->avsync);
+#endif
+	call->sdp   = mem_deref(call->sdp);
+	call->mnats = mem_deref(call->mnats);
+	call->mencs = mem_deref(call->mencs);
+
+	return 0;
+}
+
+
 static void call_destructor(void *arg)
 {
 	struct call *call = arg;
 
+	list_unlink(&call->le_live);
+
+	memtag_free(memtag_core(MEMTAG_CALL), sizeof(*call));
+
 	if (call->state != STATE_IDLE)
 		print_summary(call);
 
 	call_stream_stop(call);
 	list_unlink(&call->le);
 	tmr_cancel(&call->tmr_dtmf);
+	tmr_cancel(&call->tmr_setup);
+	hktmr_cancel(&call->tmr_stats);
+
+	setup_record(call);
+	admit_release(&call->cost);
 
 	mem_deref(call->sess);
 	mem_deref(call->local_uri);
 	mem_deref(call->local_name);
 	mem_deref(call->peer_uri);
 	mem_deref(call->peer_name);
-	mem_deref(call->audio);
-#ifdef USE_VIDEO
-	mem_deref(call->video);
-	mem_deref(call->bfcp);
-#endif
-	mem_deref(call->sdp);
-	mem_deref(call->mnats);
-	mem_deref(call->mencs);
+	(void)shard_exec(call->loop, media_free_handler, call);
+	mem_deref(call->trickle);
 	mem_deref(call->sub);
 	mem_deref(call->not);
 	mem_deref(call->acc);
 }
 
 
-static void audio_event_handler(int key, bool end, void *arg)
+/*
+ * Candidates that are gathered after the offer was sent. INFO needs an
+ * established dialog, so they are held back until then.
+ */
+static int trickle_add(struct call *call, struct mbuf *frag)
 {
-	struct call *call = arg;
-	MAGIC_CHECK(call);
+	if (call->state == STATE_ESTABLISHED)
+		return send_sdpfrag(call, frag);
 
-	info("received event: '%c' (end=%d)\n", key, end);
+	if (!call->trickle) {
+		call->trickle = mbuf_alloc(512);
+		if (!call->trickle)
+			return ENOMEM;
+	}
 
-	if (call->dtmfh)
-		call->dtmfh(call, end ? KEYCODE_REL : key, call->arg);
+	return mbuf_write_mem(call->trickle, mbuf_buf(frag),
+			      mbuf_get_left(frag));
 }
 
 
-static void audio_error_handler(int err, const char *str, void *arg)
+/* Handle an event of the media, on the main loop */
+static int media_ev_apply(struct call *call, const struct media_ev *ev)
 {
-	struct call *call = arg;
 	MAGIC_CHECK(call);
 
-	if (err) {
-		warning("call: audio device error: %m (%s)\n", err, str);
+	switch (ev->type) {
+
+	case MEDIA_DTMF:
+		info("received event: '%c' (end=%d)\n", ev->key, ev->end);
+
+		if (call->dtmfh)
+			call->dtmfh(call, ev->end ? KEYCODE_REL : ev->key,
+				    call->arg);
+		break;
+
+	case MEDIA_AUDIO_ERR:
+		if (ev->err) {
+			warning("call: audio device error: %m (%s)\n",
+				ev->err, ev->str);
+		}
+
+		call_stream_stop(call);
+		call_event_handler(call, CALL_EVENT_CLOSED, "%s", ev->str);
+		break;
+
+	case MEDIA_VIDEO_ERR:
+		warning("call: video device error: %m (%s)\n",
+			ev->err, ev->str);
+
+		call_stream_stop(call);
+		call_event_handler(call, CALL_EVENT_CLOSED, "%s", ev->str);
+		break;
+
+	case MEDIA_MENC_ERR:
+		warning("call: mediaenc '%s' error: %m\n",
+			call->acc->mencid, ev->err);
+
+		call_stream_stop(call);
+		call_event_handler(call, CALL_EVENT_CLOSED,
+				   "mediaenc failed");
+		break;
+
+	case MEDIA_STREAM_ERR:
+		info("call: error in \"%s\" rtp stream (%m)\n",
+		     ev->str, ev->err);
+
+		call->scode = 701;
+		set_state(call, STATE_TERMINATED);
+
+		call_stream_stop(call);
+		call_event_handler(call, CALL_EVENT_CLOSED,
+				   "rtp stream error");
+		break;
+
+	case MEDIA_MNAT:
+		mnat_established(call, ev->err, ev->scode, ev->str);
+		break;
+
+	case MEDIA_SDPFRAG:
+		return trickle_add(call, ev->mb);
+
+	case MEDIA_RTPSTAT:
+		sipsess_set_close_headers(call->sess, "X-RTP-Stat: %s\r\n",
+					  ev->str);
+		break;
 	}
 
-	call_stream_stop(call);
-	call_event_handler(call, CALL_EVENT_CLOSED, str);
+	return 0;
+}
+
+
+static void media_ev_destructor(void *arg)
+{
+	struct media_ev *ev = arg;
+
+	mem_deref(ev->mb);
+	mem_deref(ev->buf);
+}
+
+
+static int media_ev_handler(void *arg)
+{
+	struct media_ev *ev = arg;
+	struct le *le;
+
+	/* the handler may free the call */
+	for (le = list_head(&calll); le; le = le->next) {
+
+		struct call *call = le->data;
+
+		if (call == ev->call && call->serial == ev->serial) {
+			(void)media_ev_apply(call, ev);
+			break;
+		}
+	}
+
+	mem_deref(ev);
+
+	return 0;
+}
+
+
+/*
+ * Report an event of the media to its call. When the media has an event
+ * loop of its own, a copy of the event goes to the main loop. This also
+ * covers the events from the threads of the devices.
+ */
+static int media_report(struct call *call, const struct media_ev *ev)
+{
+	struct media_ev *cp;
+	int err = 0;
+
+	if (!call->loop)
+		return media_ev_apply(call, ev);
+
+	cp = mem_zalloc(sizeof(*cp), media_ev_destructor);
+	if (!cp)
+		return ENOMEM;
+
+	*cp = *ev;
+	cp->call   = call;
+	cp->serial = call->serial;
+	cp->mb     = NULL;
+	cp->buf    = NULL;
+
+	if (ev->str) {
+		err = str_dup(&cp->buf, ev->str);
+		cp->str = cp->buf;
+	}
+
+	if (!err && ev->mb) {
+		const size_t len = mbuf_get_left(ev->mb);
+
+		cp->mb = mbuf_alloc(len);
+		if (!cp->mb)
+			err = ENOMEM;
+		else
+			err = mbuf_write_mem(cp->mb, mbuf_buf(ev->mb), len);
+
+		if (cp->mb)
+			cp->mb->pos = 0;
+	}
+
+	if (!err)
+		err = shard_post(0, media_ev_handler, cp);
+
+	if (err)
+		mem_deref(cp);
+
+	return err;
+}
+
+
+static void audio_event_handler(int key, bool end, void *arg)
+{
+	struct media_ev ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = MEDIA_DTMF;
+	ev.key  = key;
+	ev.end  = end;
+
+	(void)media_report(arg, &ev);
+}
+
+
+static void audio_error_handler(int err, const char *str, void *arg)
+{
+	struct media_ev ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = MEDIA_AUDIO_ERR;
+	ev.err  = err;
+	ev.str  = str;
+
+	(void)media_report(arg, &ev);
 }
 
 
 #ifdef USE_VIDEO
 static void video_error_handler(int err, const char *str, void *arg)
 {
-	struct call *call = arg;
-	MAGIC_CHECK(call);
+	struct media_ev ev;
 
-	warning("call: video device error: %m (%s)\n", err, str);
+	memset(&ev, 0, sizeof(ev));
+	ev.type = MEDIA_VIDEO_ERR;
+	ev.err  = err;
+	ev.str  = str;
 
-	call_stream_stop(call);
-	call_event_handler(call, CALL_EVENT_CLOSED, str);
+	(void)media_report(arg, &ev);
 }
 #endif
 
 
 static void menc_error_handler(int err, void *arg)
 {
-	struct call *call = arg;
-	MAGIC_CHECK(call);
+	struct media_ev ev;
 
-	warning("call: mediaenc '%s' error: %m\n", call->acc->mencid, err);
+	memset(&ev, 0, sizeof(ev));
+	ev.type = MEDIA_MENC_ERR;
+	ev.err  = err;
 
-	call_stream_stop(call);
-	call_event_handler(call, CALL_EVENT_CLOSED, "mediaenc failed");
+	(void)media_report(arg, &ev);
 }
 
 
 static void stream_error_handler(struct stream *strm, int err, void *arg)
 {
-	struct call *call = arg;
-	MAGIC_CHECK(call);
+	struct media_ev ev;
 
-	info("call: error in \"%s\" rtp stream (%m)\n",
-		sdp_media_name(stream_sdpmedia(strm)), err);
+	memset(&ev, 0, sizeof(ev));
+	ev.type = MEDIA_STREAM_ERR;
+	ev.err  = err;
+	ev.str  = sdp_media_name(stream_sdpmedia(strm));
 
-	call->scode = 701;
-	set_state(call, STATE_TERMINATED);
+	(void)media_report(arg, &ev);
+}
 
-	call_stream_stop(call);
-	call_event_handler(call, CALL_EVENT_CLOSED, "rtp stream error");
+
+static void mnat_handler(int err, uint16_t scode, const char *reason,
+			 void *arg)
+{
+	struct media_ev ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type  = MEDIA_MNAT;
+	ev.err   = err;
+	ev.scode = scode;
+	ev.str   = reason;
+
+	(void)media_report(arg, &ev);
+}
+
+
+static int mnat_sdpfrag_handler(struct mbuf *frag, void *arg)
+{
+	struct media_ev ev;
+
+	if (!frag)
+		return EINVAL;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = MEDIA_SDPFRAG;
+	ev.mb   = frag;
+
+	return media_report(arg, &ev);
 }
 
 
@@ -468,13 +1208,162 @@ static int assign_linenum(uint32_t *linenum, const struct list *lst)
 
 	for (num=CALL_LINENUM_MIN; num<CALL_LINENUM_MAX; num++) {
 
-		if (!call_find_linenum(lst, num)) {
-			*linenum = num;
-			return 0;
-		}
+		if (!call_find_linenum(lst, num)) {
+			*linenum = num;
+			return 0;
+		}
+	}
+
+	return ENOENT;
+}
+
+
+/*
+ * Allocate the SDP session and the media streams of a call, with their
+ * media NAT and encryption, on the event loop of the media
+ */
+static int media_alloc_handler(void *arg)
+{
+	struct media_job *job = arg;
+	struct call *call = job->call;
+	const struct config *cfg = job->cfg;
+	struct account *acc = call->acc;
+	const bool got_offer = job->offer;
+	enum vidmode vidmode = job->prm->vidmode;
+	bool use_video = true;
+	int content_label = 0;
+	int label = 0;
+	struct le *le;
+	int err;
+
+	/* Init SDP info */
+	err = sdp_session_alloc(&call->sdp, &job->prm->laddr);
+	if (err)
+		return err;
+
+	err = sdp_session_set_lattr(call->sdp, true,
+				    "tool", "baresip " BARESIP_VERSION);
+	if (err)
+		return err;
+
+	/* Initialise media NAT handling, with the DNS client of the loop */
+	if (acc->mnat) {
+		err = acc->mnat->sessh(&call->mnats,
+				       shard_loop() ? shard_dnsc() : job->dnsc,
+				       call->af,
+				       acc->stun_host, acc->stun_port,
+				       acc->stun_user, acc->stun_pass,
+				       call->sdp, !got_offer,
+				       mnat_handler, call);
+		if (err) {
+			warning("call: medianat session: %m\n", err);
+			return err;
+		}
+
+		if (acc->mnat->trickleh &&
+		    !acc->mnat->trickleh(call->mnats,
+					 mnat_sdpfrag_handler, call)) {
+			info("call: medianat `%s' trickles candidates\n",
+			     acc->mnatid);
+		}
+	}
+
+	/* Media encryption */
+	if (acc->menc) {
+		if (acc->menc->sessh) {
+			err = acc->menc->sessh(&call->mencs, call->sdp,
+						!got_offer,
+						menc_error_handler, call);
+			if (err) {
+				warning("call: mediaenc session: %m\n", err);
+				return err;
+			}
+		}
+	}
+
+	/* Audio stream */
+	err = audio_alloc(&call->audio, cfg, call,
+			  call->sdp, ++label,
+			  acc->mnat, call->mnats, acc->menc, call->mencs,
+			  acc->ptime, account_aucodec_sdp(acc, &cfg->audio),
+			  audio_event_handler, audio_error_handler, call);
+	if (err)
+		return err;
+
+#ifdef USE_VIDEO
+	/* We require at least one video codec, and at least one
+	   video source or video display */
+	use_video = (vidmode != VIDMODE_OFF)
+		&& (list_head(account_vidcodecl(call->acc)) != NULL)
+		&& (NULL != vidsrc_find(NULL) || NULL != vidisp_find(NULL));
+
+	debug("call: use_video=%d\n", use_video);
+
+	/* Video stream */
+	if (use_video) {
+ 		err = video_alloc(&call->video, cfg,
+				  call, call->sdp, ++label,
+				  acc->mnat, call->mnats,
+				  acc->menc, call->mencs,
+				  "main",
+				  account_vidcodecl(call->acc),
+				  video_error_handler, call);
+		if (err)
+			return err;
+
+		/* align the audio and video of the call */
+		err = avsync_alloc(&call->avsync);
+		if (err)
+			return err;
+
+		audio_set_avsync(call->audio, call->avsync);
+		video_set_avsync(call->video, call->avsync);
+ 	}
+
+	/* RFC 4582: the presentation is a second video stream */
+	if (use_video && str_isset(cfg->bfcp.proto) &&
+	    str_isset(cfg->bfcp.content_mod)) {
+
+		content_label = ++label;
+
+		err = video_alloc(&call->content, cfg,
+				  call, call->sdp, content_label,
+				  acc->mnat, call->mnats,
+				  acc->menc, call->mencs,
+				  "slides",
+				  account_vidcodecl(call->acc),
+				  video_error_handler, call);
+		if (err)
+			return err;
+
+		call->bw_video   = cfg->video.bitrate;
+		call->bw_content = cfg->video.bitrate;
+
+		video_set_bw_handler(call->video, video_bw_handler, call);
+		video_set_bw_handler(call->content, content_bw_handler, call);
+	}
+
+	if (str_isset(cfg->bfcp.proto)) {
+
+		err = bfcp_alloc(&call->bfcp, call->sdp,
+				 cfg->bfcp.proto, !got_offer,
+				 acc->mnat, call->mnats,
+				 content_label, bfcp_floor_handler, call);
+		if (err)
+			return err;
+	}
+#else
+	(void)use_video;
+	(void)vidmode;
+	(void)content_label;
+#endif
+
+	FOREACH_STREAM {
+		struct stream *strm = le->data;
+		stream_set_error_handler(strm, stream_error_handler, call);
 	}
 
-	return ENOENT;
+	return 0;
 }
 
 
@@ -504,11 +1393,9 @@ int call_alloc(struct call **callp, const struct config *cfg, struct list *lst,
 	       struct dnsc *dnsc,
 	       call_event_h *eh, void *arg)
 {
+	struct media_job job;
 	struct call *call;
-	struct le *le;
-	enum vidmode vidmode = prm ? prm->vidmode : VIDMODE_OFF;
-	bool use_video = true, got_offer = false;
-	int label = 0;
+	bool got_offer = false;
 	int err = 0;
 
 	if (!cfg || !local_uri || !acc || !ua || !prm)
@@ -521,12 +1408,17 @@ int call_alloc(struct call **callp, const struct config *cfg, struct list *lst,
 	if (!call)
 		return ENOMEM;
 
+	memtag_alloc(memtag_core(MEMTAG_CALL), sizeof(*call));
+
 	MAGIC_INIT(call);
 
 	call->config_avt = cfg->avt;
 	call->config_call = cfg->call;
 
 	tmr_init(&call->tmr_inv);
+	tmr_init(&call->tmr_setup);
+
+	call->ts.alloc = tmr_jiffies();
 
 	call->acc    = mem_ref(acc);
 	call->ua     = ua;
@@ -534,6 +1426,10 @@ int call_alloc(struct call **callp, const struct config *cfg, struct list *lst,
 	call->eh     = eh;
 	call->arg    = arg;
 	call->af     = prm ? prm->af : AF_INET;
+	call->loop   = prm->loop ? prm->loop : shard_next();
+	call->serial = ++call_serial;
+
+	list_append(&calll, &call->le_live, call);
 
 	err = str_dup(&call->local_uri, local_uri);
 	if (local_name)
@@ -541,102 +1437,31 @@ int call_alloc(struct call **callp, const struct config *cfg, struct list *lst,
 	if (err)
 		goto out;
 
-	/* Init SDP info */
-	err = sdp_session_alloc(&call->sdp, &prm->laddr);
-	if (err)
-		goto out;
-
-	err = sdp_session_set_lattr(call->sdp, true,
-				    "tool", "baresip " BARESIP_VERSION);
-	if (err)
-		goto out;
-
 	/* Check for incoming SDP Offer */
-	if (msg && mbuf_get_left(msg->mb))
+	if (msg && mbuf_get_left(msg->mb)) {
 		got_offer = true;
-
-	/* Initialise media NAT handling */
-	if (acc->mnat) {
-		err = acc->mnat->sessh(&call->mnats,
-				       dnsc, call->af,
-				       acc->stun_host, acc->stun_port,
-				       acc->stun_user, acc->stun_pass,
-				       call->sdp, !got_offer,
-				       mnat_handler, call);
-		if (err) {
-			warning("call: medianat session: %m\n", err);
-			goto out;
-		}
+		call->ts.offer = call->ts.alloc;
 	}
-	call->mnat_wait = true;
 
-	/* Media encryption */
-	if (acc->menc) {
-		if (acc->menc->sessh) {
-			err = acc->menc->sessh(&call->mencs, call->sdp,
-						!got_offer,
-						menc_error_handler, call);
-			if (err) {
-				warning("call: mediaenc session: %m\n", err);
-				goto out;
-			}
-		}
-	}
+	/* the media of the call, on its event loop */
+	memset(&job, 0, sizeof(job));
+	job.call  = call;
+	job.cfg   = cfg;
+	job.prm   = prm;
+	job.dnsc  = dnsc;
+	job.offer = got_offer;
 
-	/* Audio stream */
-	err = audio_alloc(&call->audio, cfg, call,
-			  call->sdp, ++label,
-			  acc->mnat, call->mnats, acc->menc, call->mencs,
-			  acc->ptime, account_aucodecl(call->acc),
-			  audio_event_handler, audio_error_handler, call);
+	err = shard_exec(call->loop, media_alloc_handler, &job);
 	if (err)
 		goto out;
 
-#ifdef USE_VIDEO
-	/* We require at least one video codec, and at least one
-	   video source or video display */
-	use_video = (vidmode != VIDMODE_OFF)
-		&& (list_head(account_vidcodecl(call->acc)) != NULL)
-		&& (NULL != vidsrc_find(NULL) || NULL != vidisp_find(NULL));
-
-	debug("call: use_video=%d\n", use_video);
-
-	/* Video stream */
-	if (use_video) {
- 		err = video_alloc(&call->video, cfg,
-				  call, call->sdp, ++label,
-				  acc->mnat, call->mnats,
-				  acc->menc, call->mencs,
-				  "main",
-				  account_vidcodecl(call->acc),
-				  video_error_handler, call);
-		if (err)
-			goto out;
- 	}
-
-	if (str_isset(cfg->bfcp.proto)) {
-
-		err = bfcp_alloc(&call->bfcp, call->sdp,
-				 cfg->bfcp.proto, !got_offer,
-				 acc->mnat, call->mnats);
-		if (err)
-			goto out;
-	}
-#else
-	(void)use_video;
-	(void)vidmode;
-#endif
+	call->mnat_wait = true;
 
 	/* inherit certain properties from original call */
 	if (xcall) {
 		call->not = mem_ref(xcall->not);
 	}
 
-	FOREACH_STREAM {
-		struct stream *strm = le->data;
-		stream_set_error_handler(strm, stream_error_handler, call);
-	}
-
 	if (cfg->avt.rtp_timeout) {
 		call_enable_rtp_timeout(call, cfg->avt.rtp_timeout*1000);
 	}
@@ -647,6 +1472,13 @@ int call_alloc(struct call **callp, const struct config *cfg, struct list *lst,
 		goto out;
 	}
 
+	/* the media that was offered, until it has been agreed on */
+#ifdef USE_VIDEO
+	admit_update(&call->cost, call->video != NULL);
+#else
+	admit_update(&call->cost, 0);
+#endif
+
 	/* NOTE: The new call must always be added to the tail of list,
 	 *       which indicates the current call.
 	 */
@@ -810,13 +1642,20 @@ int call_answer(struct call *call, uint16_t scode)
 			return err;
 	}
 
-	err = sdp_encode(&desc, call->sdp, !call->got_offer);
+	err = call_sdp_get(call, &desc, !call->got_offer);
 	if (err)
 		return err;
 
 	err = sipsess_answer(call->sess, scode, "Answering", desc,
 			     "Allow: %s\r\n", uag_allowed_methods());
 
+	if (!err) {
+		if (call->got_offer)
+			call->ts.answer = tmr_jiffies();
+		else
+			call->ts.offer = tmr_jiffies();
+	}
+
 	mem_deref(desc);
 
 	return err;
@@ -859,6 +1698,19 @@ bool call_has_video(const struct call *call)
 }
 
 
+static int hold_handler(void *arg)
+{
+	struct media_job *job = arg;
+	struct call *call = job->call;
+	struct le *le;
+
+	FOREACH_STREAM
+		stream_hold(le->data, job->enable);
+
+	return 0;
+}
+
+
 /**
  * Put the current call on hold/resume
  *
@@ -869,7 +1721,7 @@ bool call_has_video(const struct call *call)
  */
 int call_hold(struct call *call, bool hold)
 {
-	struct le *le;
+	struct media_job job;
 
 	if (!call || !call->sess)
 		return EINVAL;
@@ -881,16 +1733,55 @@ int call_hold(struct call *call, bool hold)
 
 	call->on_hold = hold;
 
-	FOREACH_STREAM
-		stream_hold(le->data, hold);
+	memset(&job, 0, sizeof(job));
+	job.call   = call;
+	job.enable = hold;
+
+	(void)shard_exec(call->loop, hold_handler, &job);
 
 	return call_modify(call);
 }
 
 
+static int sdp_encode_handler(void *arg)
+{
+	struct media_job *job = arg;
+
+	return sdp_encode(job->descp, job->call->sdp, job->offer);
+}
+
+
 int call_sdp_get(const struct call *call, struct mbuf **descp, bool offer)
 {
-	return sdp_encode(descp, call->sdp, offer);
+	struct media_job job;
+
+	memset(&job, 0, sizeof(job));
+	job.call  = (struct call *)call;
+	job.descp = descp;
+	job.offer = offer;
+
+	return shard_exec(call->loop, sdp_encode_handler, &job);
+}
+
+
+static int sdp_decode_handler(void *arg)
+{
+	struct media_job *job = arg;
+
+	return sdp_decode(job->call->sdp, job->mb, job->offer);
+}
+
+
+static int call_sdp_decode(struct call *call, struct mbuf *mb, bool offer)
+{
+	struct media_job job;
+
+	memset(&job, 0, sizeof(job));
+	job.call  = call;
+	job.mb    = mb;
+	job.offer = offer;
+
+	return shard_exec(call->loop, sdp_decode_handler, &job);
 }
 
 
@@ -919,12 +1810,228 @@ const char *call_peername(const struct call *call)
 }
 
 
-int call_debug(struct re_printf *pf, const struct call *call)
+static int stream_stats_handler(void *arg)
+{
+	struct media_job *job = arg;
+	const struct call *call = job->call;
+	struct call_stats *cs = job->cs;
+	struct le *le;
+
+	FOREACH_STREAM {
+
+		struct stream_stats *st = &cs->streamv[cs->streamc];
+
+		if (cs->streamc >= ARRAY_SIZE(cs->streamv))
+			break;
+
+		if (0 == stream_stats(le->data, st))
+			++cs->streamc;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Get the statistics of a call and its media streams
+ *
+ * @param call Call object
+ * @param cs   Returned statistics
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int call_stats(const struct call *call, struct call_stats *cs)
+{
+	struct media_job job;
+	int i;
+
+	if (!call || !cs)
+		return EINVAL;
+
+	memset(cs, 0, sizeof(*cs));
+
+	cs->duration = call_duration(call);
+	cs->scode    = call->scode;
+
+	for (i=0; i<CALL_PHASE_MAX; i++)
+		cs->setupv[i] = call_phase_duration(call, i);
+
+	memset(&job, 0, sizeof(job));
+	job.call = (struct call *)call;
+	job.cs   = cs;
+
+	return shard_exec(call->loop, stream_stats_handler, &job);
+}
+
+
+/* JSON string, or null */
+static int json_str_print(struct re_printf *pf, const char *str)
+{
+	const char *p, *start = str;
+	int err = 0;
+
+	if (!str)
+		return re_hprintf(pf, "null");
+
+	err |= re_hprintf(pf, "\"");
+
+	for (p = str; *p; p++) {
+
+		if (*p != '"' && *p != '\\' && (unsigned char)*p >= 0x20)
+			continue;
+
+		err |= pf->vph(start, p - start, pf->arg);
+
+		if (*p == '"' || *p == '\\')
+			err |= re_hprintf(pf, "\\%c", *p);
+		else
+			err |= re_hprintf(pf, "\\u%04x", (unsigned char)*p);
+
+		start = p + 1;
+	}
+
+	err |= pf->vph(start, p - start, pf->arg);
+	err |= re_hprintf(pf, "\"");
+
+	return err;
+}
+
+
+static int json_dir_print(struct re_printf *pf,
+			  const struct stream_dir_stats *ds)
+{
+	return re_hprintf(pf, "{\"packets\":%llu,\"bytes\":%llu,"
+			  "\"errors\":%llu,\"bitrate\":%u,\"lost\":%d,"
+			  "\"jitter\":%.3f}",
+			  ds->packets, ds->bytes, ds->errors, ds->bitrate,
+			  ds->lost, ds->jitter / 1000.0);
+}
+
+
+static int json_stream_print(struct re_printf *pf,
+			     const struct stream_stats *st)
 {
+	double mos;
 	int err;
 
-	if (!call)
-		return 0;
+	if (st->mos_valid)
+		mos = st->mos;
+	else
+		mos = mos_calculate(NULL, st->rtt / 1000.0,
+				    st->rx.jitter / 1000.0,
+				    st->rx.lost > 0 ? st->rx.lost : 0);
+
+	err = re_hprintf(pf, "{\"media\":%H,\"codec\":%H,\"rtt\":%.3f,"
+			 "\"mos\":%.2f,\"tx\":%H,\"rx\":%H",
+			 json_str_print, st->media,
+			 json_str_print, st->codec,
+			 st->rtt / 1000.0, mos,
+			 json_dir_print, &st->tx,
+			 json_dir_print, &st->rx);
+
+	if (st->jbuf) {
+		err |= re_hprintf(pf, ",\"jbuf\":{\"put\":%u,\"get\":%u,"
+				  "\"overflow\":%u,\"underflow\":%u,"
+				  "\"delay\":%u}",
+				  st->jbuf_put, st->jbuf_get,
+				  st->jbuf_overflow, st->jbuf_underflow,
+				  st->jbuf_delay);
+	}
+
+	if (st->plc) {
+		err |= re_hprintf(pf, ",\"plc\":{\"samples\":%llu,"
+				  "\"concealed\":%llu,\"fec\":%llu,"
+				  "\"ratio\":%.4f}",
+				  st->samples, st->concealed, st->fec,
+				  (double)st->concealed / st->samples);
+	}
+
+	err |= re_hprintf(pf, "}");
+
+	return err;
+}
+
+
+/**
+ * Print a call-quality record of a call as one JSON object
+ *
+ * Times are in milliseconds, except the duration in seconds. The
+ * record is printed straight to the print handler.
+ *
+ * @param pf   Print handler
+ * @param call Call object
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int call_stats_json(struct re_printf *pf, const struct call *call)
+{
+	struct call_stats cs;
+	size_t i;
+	int err;
+
+	err = call_stats(call, &cs);
+	if (err)
+		return err;
+
+	err = re_hprintf(pf, "{\"call_id\":%H,\"local\":%H,\"peer\":%H,"
+			 "\"dir\":\"%s\",\"duration\":%u,\"scode\":%u,"
+			 "\"setup\":{",
+			 json_str_print, call_id(call),
+			 json_str_print, call->local_uri,
+			 json_str_print, call->peer_uri,
+			 call->outgoing ? "out" : "in",
+			 cs.duration, cs.scode);
+
+	for (i=0; i<CALL_PHASE_MAX; i++) {
+
+		err |= re_hprintf(pf, "%s\"%s\":", i ? "," : "",
+				  call_phase_name(i));
+
+		if (cs.setupv[i] < 0)
+			err |= re_hprintf(pf, "null");
+		else
+			err |= re_hprintf(pf, "%d", cs.setupv[i]);
+	}
+
+	err |= re_hprintf(pf, "},\"streams\":[");
+
+	for (i=0; i<cs.streamc; i++) {
+		err |= re_hprintf(pf, "%s%H", i ? "," : "",
+				  json_stream_print, &cs.streamv[i]);
+	}
+
+	err |= re_hprintf(pf, "]}");
+
+	return err;
+}
+
+
+static int print_handler(void *arg)
+{
+	struct media_job *job = arg;
+
+	return job->printh(job->pf, job->call);
+}
+
+
+/* Print a call with a handler that reads its media, on its event loop */
+static int media_print(struct re_printf *pf, const struct call *call,
+		       media_print_h *printh)
+{
+	struct media_job job;
+
+	memset(&job, 0, sizeof(job));
+	job.call   = (struct call *)call;
+	job.pf     = pf;
+	job.printh = printh;
+
+	return shard_exec(call->loop, print_handler, &job);
+}
+
+
+static int debug_print(struct re_printf *pf, const struct call *call)
+{
+	int err;
 
 	err = re_hprintf(pf, "===== Call debug (%s) =====\n",
 			 state_name(call->state));
@@ -940,6 +2047,11 @@ int call_debug(struct re_printf *pf, const struct call *call)
 	err |= re_hprintf(pf, " direction: %s\n",
 			  call->outgoing ? "Outgoing" : "Incoming");
 
+	err |= re_hprintf(pf, " setup [ms]: %H\n", phases_print, call);
+#ifdef USE_VIDEO
+	err |= avsync_debug(pf, call->avsync);
+#endif
+
 	/* SDP debug */
 	err |= sdp_session_debug(pf, call->sdp);
 
@@ -947,22 +2059,51 @@ int call_debug(struct re_printf *pf, const struct call *call)
 }
 
 
-static int print_duration(struct re_printf *pf, const struct call *call)
-{
-	const uint32_t dur = call_duration(call);
-	const uint32_t sec = dur%60%60;
-	const uint32_t min = dur/60%60;
-	const uint32_t hrs = dur/60/60;
+int call_debug(struct re_printf *pf, const struct call *call)
+{
+	if (!call)
+		return 0;
+
+	return media_print(pf, call, debug_print);
+}
+
+
+static int print_duration(struct re_printf *pf, const struct call *call)
+{
+	const uint32_t dur = call_duration(call);
+	const uint32_t sec = dur%60%60;
+	const uint32_t min = dur/60%60;
+	const uint32_t hrs = dur/60/60;
+
+	return re_hprintf(pf, "%u:%02u:%02u", hrs, min, sec);
+}
+
+
+static int status_print(struct re_printf *pf, const struct call *call)
+{
+	struct le *le;
+	int err;
+
+	err = re_hprintf(pf, "\r[%H]", print_duration, call);
+
+	FOREACH_STREAM
+		err |= stream_print(pf, le->data);
+
+	err |= re_hprintf(pf, " (bit/s)");
+
+#ifdef USE_VIDEO
+	if (call->video)
+		err |= video_print(pf, call->video);
+	if (call->content)
+		err |= video_print(pf, call->content);
+#endif
 
-	return re_hprintf(pf, "%u:%02u:%02u", hrs, min, sec);
+	return err;
 }
 
 
 int call_status(struct re_printf *pf, const struct call *call)
 {
-	struct le *le;
-	int err;
-
 	if (!call)
 		return EINVAL;
 
@@ -975,17 +2116,17 @@ int call_status(struct re_printf *pf, const struct call *call)
 		return 0;
 	}
 
-	err = re_hprintf(pf, "\r[%H]", print_duration, call);
+	return media_print(pf, call, status_print);
+}
 
-	FOREACH_STREAM
-		err |= stream_print(pf, le->data);
 
-	err |= re_hprintf(pf, " (bit/s)");
+static int jbuf_print(struct re_printf *pf, const struct call *call)
+{
+	struct le *le;
+	int err = 0;
 
-#ifdef USE_VIDEO
-	if (call->video)
-		err |= video_print(pf, call->video);
-#endif
+	FOREACH_STREAM
+		err |= stream_jbuf_stat(pf, le->data);
 
 	return err;
 }
@@ -993,16 +2134,10 @@ int call_status(struct re_printf *pf, const struct call *call)
 
 int call_jbuf_stat(struct re_printf *pf, const struct call *call)
 {
-	struct le *le;
-	int err = 0;
-
 	if (!call)
 		return EINVAL;
 
-	FOREACH_STREAM
-		err |= stream_jbuf_stat(pf, le->data);
-
-	return err;
+	return media_print(pf, call, jbuf_print);
 }
 
 
@@ -1019,6 +2154,14 @@ int call_info(struct re_printf *pf, const struct call *call)
 }
 
 
+static int digit_handler(void *arg)
+{
+	struct media_job *job = arg;
+
+	return audio_send_digit(job->call->audio, job->key);
+}
+
+
 /**
  * Send a DTMF digit to the peer
  *
@@ -1029,10 +2172,16 @@ int call_info(struct re_printf *pf, const struct call *call)
  */
 int call_send_digit(struct call *call, char key)
 {
+	struct media_job job;
+
 	if (!call)
 		return EINVAL;
 
-	return audio_send_digit(call->audio, key);
+	memset(&job, 0, sizeof(job));
+	job.call = call;
+	job.key  = key;
+
+	return shard_exec(call->loop, digit_handler, &job);
 }
 
 
@@ -1048,6 +2197,19 @@ struct account *call_account(const struct call *call)
 }
 
 
+/**
+ * Get the event loop of the media of a call
+ *
+ * @param call  Call object
+ *
+ * @return Event loop, 0 for the main loop
+ */
+unsigned call_loop(const struct call *call)
+{
+	return call ? call->loop : 0;
+}
+
+
 static int auth_handler(char **username, char **password,
 			const char *realm, void *arg)
 {
@@ -1070,7 +2232,7 @@ static int sipsess_offer_handler(struct mbuf **descp,
 	if (got_offer) {
 
 		/* Decode SDP Offer */
-		err = sdp_decode(call->sdp, msg->mb, true);
+		err = call_sdp_decode(call, msg->mb, true);
 		if (err)
 			return err;
 
@@ -1080,7 +2242,7 @@ static int sipsess_offer_handler(struct mbuf **descp,
 	}
 
 	/* Encode SDP Answer */
-	return sdp_encode(descp, call->sdp, !got_offer);
+	return call_sdp_get(call, descp, !got_offer);
 }
 
 
@@ -1094,7 +2256,7 @@ static int sipsess_answer_handler(const struct sip_msg *msg, void *arg)
 	if (msg_ctype_cmp(&msg->ctyp, "multipart", "mixed"))
 		(void)sdp_decode_multipart(&msg->ctyp.params, msg->mb);
 
-	err = sdp_decode(call->sdp, msg->mb, false);
+	err = call_sdp_decode(call, msg->mb, false);
 	if (err) {
 		warning("call: could not decode SDP answer: %m\n", err);
 		return err;
@@ -1104,6 +2266,40 @@ static int sipsess_answer_handler(const struct sip_msg *msg, void *arg)
 	if (err)
 		return err;
 
+	if (!call->ts.response)
+		call->ts.response = tmr_jiffies();
+	if (!call->ts.answer)
+		call->ts.answer = tmr_jiffies();
+
+	return 0;
+}
+
+
+static int send_sdpfrag(struct call *call, struct mbuf *mb)
+{
+	int err;
+
+	err = sipsess_info(call->sess, "application/trickle-ice-sdpfrag",
+			   mb, NULL, NULL);
+	if (err) {
+		warning("call: could not send trickle fragment (%m)\n",
+			err);
+	}
+
+	return err;
+}
+
+
+static int rtp_timeout_handler(void *arg)
+{
+	struct call *call = arg;
+	struct le *le;
+
+	FOREACH_STREAM {
+		struct stream *strm = le->data;
+		stream_enable_rtp_timeout(strm, call->rtp_timeout_ms);
+	}
+
 	return 0;
 }
 
@@ -1121,16 +2317,27 @@ static void sipsess_estab_handler(const struct sip_msg *msg, void *arg)
 
 	set_state(call, STATE_ESTABLISHED);
 
+	call->ts.estab = tmr_jiffies();
+	if (call->outgoing && !call->ts.response)
+		call->ts.response = call->ts.estab;
+
 	call_stream_start(call, true);
 
-	if (call->rtp_timeout_ms) {
+	tmr_start(&call->tmr_setup, SETUP_POLL, setup_poll_handler, call);
 
-		struct le *le;
+	if (call->trickle) {
+		call->trickle->pos = 0;
+		(void)send_sdpfrag(call, call->trickle);
+		call->trickle = mem_deref(call->trickle);
+	}
 
-		FOREACH_STREAM {
-			struct stream *strm = le->data;
-			stream_enable_rtp_timeout(strm, call->rtp_timeout_ms);
-		}
+	if (call->rtp_timeout_ms)
+		(void)shard_exec(call->loop, rtp_timeout_handler, call);
+
+	if (call->config_call.stats_interval) {
+		(void)hktmr_start(&call->tmr_stats,
+				  call->config_call.stats_interval * 1000,
+				  stats_handler, call);
 	}
 
 	/* the transferor will hangup this call */
@@ -1165,6 +2372,15 @@ static void call_handle_info_req(struct call *call, const struct sip_msg *req)
 #endif
 
 
+static int rfrag_handler(void *arg)
+{
+	struct media_job *job = arg;
+	struct call *call = job->call;
+
+	return call->acc->mnat->rfragh(call->mnats, job->frag);
+}
+
+
 static void dtmfend_handler(void *arg)
 {
 	struct call *call = arg;
@@ -1207,6 +2423,26 @@ static void sipsess_info_handler(struct sip *sip, const struct sip_msg *msg,
 			}
 		}
 	}
+	else if (msg_ctype_cmp(&msg->ctyp,
+			       "application", "trickle-ice-sdpfrag") &&
+		 call->acc->mnat && call->acc->mnat->rfragh) {
+
+		struct media_job job;
+		struct pl body;
+		int err;
+
+		pl_set_mbuf(&body, msg->mb);
+
+		memset(&job, 0, sizeof(job));
+		job.call = call;
+		job.frag = &body;
+
+		err = shard_exec(call->loop, rfrag_handler, &job);
+		if (err)
+			(void)sip_reply(sip, msg, 400, "Bad Request");
+		else
+			(void)sip_reply(sip, msg, 200, "OK");
+	}
 #ifdef USE_VIDEO
 	else if (msg_ctype_cmp(&msg->ctyp,
 			       "application", "media_control+xml")) {
@@ -1353,7 +2589,7 @@ int call_accept(struct call *call, struct sipsess_sock *sess_sock,
 		struct sdp_media *m;
 		const struct sa *raddr;
 
-		err = sdp_decode(call->sdp, msg->mb, true);
+		err = call_sdp_decode(call, msg->mb, true);
 		if (err)
 			return err;
 
@@ -1436,6 +2672,9 @@ static void sipsess_progr_handler(const struct sip_msg *msg, void *arg)
 	info("call: SIP Progress: %u %r (%r/%r)\n",
 	     msg->scode, &msg->reason, &msg->ctyp.type, &msg->ctyp.subtype);
 
+	if (!call->ts.response)
+		call->ts.response = tmr_jiffies();
+
 	if (msg->scode <= 100)
 		return;
 
@@ -1449,17 +2688,20 @@ static void sipsess_progr_handler(const struct sip_msg *msg, void *arg)
 	 */
 	if (msg_ctype_cmp(&msg->ctyp, "application", "sdp")
 	    && mbuf_get_left(msg->mb)
-	    && !sdp_decode(call->sdp, msg->mb, false)) {
+	    && !call_sdp_decode(call, msg->mb, false)) {
 		media = true;
 	}
 	else if (msg_ctype_cmp(&msg->ctyp, "multipart", "mixed") &&
 		 !sdp_decode_multipart(&msg->ctyp.params, msg->mb) &&
-		 !sdp_decode(call->sdp, msg->mb, false)) {
+		 !call_sdp_decode(call, msg->mb, false)) {
 		media = true;
 	}
 	else
 		media = false;
 
+	if (media && !call->ts.answer)
+		call->ts.answer = tmr_jiffies();
+
 	switch (msg->scode) {
 
 	case 180:
@@ -1489,12 +2731,15 @@ static int send_invite(struct call *call)
 	struct mbuf *desc;
 	int err;
 
-	routev[0] = ua_outbound(call->ua);
+	routev[0] = eyeballs_route(ua_outbound(call->ua));
 
 	err = call_sdp_get(call, &desc, true);
 	if (err)
 		return err;
 
+	call->ts.invite = tmr_jiffies();
+	call->ts.offer  = call->ts.invite;
+
 	err = sipsess_connect(&call->sess, uag_sipsess_sock(),
 			      call->peer_uri,
 			      call->local_name,
@@ -1586,6 +2831,68 @@ struct video *call_video(const struct call *call)
 }
 
 
+/**
+ * Get the presentation video object for the current call
+ *
+ * @param call  Call object
+ *
+ * @return Video object, NULL if the call has no presentation stream
+ */
+struct video *call_content(const struct call *call)
+{
+#ifdef USE_VIDEO
+	return call ? call->content : NULL;
+#else
+	(void)call;
+	return NULL;
+#endif
+}
+
+
+#ifdef USE_VIDEO
+static int present_handler(void *arg)
+{
+	struct media_job *job = arg;
+
+	return bfcp_floor(job->call->bfcp, job->enable);
+}
+#endif
+
+
+/**
+ * Start or stop presenting, on the presentation stream of the call.
+ * The floor is asked for with BFCP, and the presentation is sent from
+ * bfcp_content_source when it is granted.
+ *
+ * @param call  Call object
+ * @param on    True to present, false to stop
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int call_present(struct call *call, bool on)
+{
+#ifdef USE_VIDEO
+	struct media_job job;
+
+	if (!call)
+		return EINVAL;
+
+	if (!call->content || !call->bfcp)
+		return ENOTSUP;
+
+	memset(&job, 0, sizeof(job));
+	job.call   = call;
+	job.enable = on;
+
+	return shard_exec(call->loop, present_handler, &job);
+#else
+	(void)call;
+	(void)on;
+	return ENOTSUP;
+#endif
+}
+
+
 /**
  * Get the list of media streams for the current call
  *
@@ -1599,12 +2906,28 @@ struct list *call_streaml(const struct call *call)
 }
 
 
+static int laddr_handler(void *arg)
+{
+	struct media_job *job = arg;
+
+	sdp_session_set_laddr(job->call->sdp, job->laddr);
+
+	return 0;
+}
+
+
 int call_reset_transp(struct call *call, const struct sa *laddr)
 {
+	struct media_job job;
+
 	if (!call)
 		return EINVAL;
 
-	sdp_session_set_laddr(call->sdp, laddr);
+	memset(&job, 0, sizeof(job));
+	job.call  = call;
+	job.laddr = laddr;
+
+	(void)shard_exec(call->loop, laddr_handler, &job);
 
 	return call_modify(call);
 }
@@ -1794,14 +3117,45 @@ void call_set_handlers(struct call *call, call_event_h *eh,
 }
 
 
+static int rtpstat_handler(void *arg)
+{
+	struct media_job *job = arg;
+
+	return re_sdprintf(&job->str, "%H",
+			   audio_print_rtpstat, job->call->audio);
+}
+
+
+/*
+ * Also called on the event loop of the media, when an RTCP sender
+ * report came in. The SIP session is on the main loop.
+ */
 void call_set_xrtpstat(struct call *call)
 {
+	struct media_job job;
+	struct media_ev ev;
+
 	if (!call)
 		return;
 
-	sipsess_set_close_headers(call->sess,
-				  "X-RTP-Stat: %H\r\n",
-				  audio_print_rtpstat, call->audio);
+	memset(&job, 0, sizeof(job));
+	job.call = call;
+
+	if (shard_exec(call->loop, rtpstat_handler, &job))
+		goto out;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = MEDIA_RTPSTAT;
+	ev.str  = job.str;
+
+	/* on hangup the headers are needed right away */
+	if (shard_loop())
+		(void)media_report(call, &ev);
+	else
+		(void)media_ev_apply(call, &ev);
+
+ out:
+	mem_deref(job.str);
 }
 
 
@@ -1811,12 +3165,164 @@ bool call_is_onhold(const struct call *call)
 }
 
 
+/**
+ * Get the SIP Call-ID of the call
+ *
+ * @param call  Call object
+ *
+ * @return Call-ID, or NULL if the INVITE has not been sent yet
+ */
+const char *call_id(const struct call *call)
+{
+	if (!call || !call->sess)
+		return NULL;
+
+	return sip_dialog_callid(sipsess_dialog(call->sess));
+}
+
+
+/**
+ * Get the name of the current state of a call
+ *
+ * @param call Call object
+ *
+ * @return Name of the call state, e.g. "ESTABLISHED"
+ */
+const char *call_statename(const struct call *call)
+{
+	return call ? state_name(call->state) : NULL;
+}
+
+
 bool call_is_outgoing(const struct call *call)
 {
 	return call ? call->outgoing : false;
 }
 
 
+static struct stream *stream_find(const struct call *call, const char *name)
+{
+	struct le *le;
+
+	FOREACH_STREAM {
+		struct stream *strm = le->data;
+
+		if (0 == str_cmp(sdp_media_name(strm->sdp), name))
+			return strm;
+	}
+
+	return NULL;
+}
+
+
+static int relay_handler(void *arg)
+{
+	struct media_job *job = arg;
+	struct call *call = job->call;
+	struct le *le;
+
+	FOREACH_STREAM {
+		struct stream *strm = le->data;
+		const char *name = sdp_media_name(strm->sdp);
+		struct stream *dst;
+
+		(void)stream_relay(strm->relay_src, NULL);
+		(void)stream_relay(strm, NULL);
+
+		dst = job->peer ? stream_find(job->peer, name) : NULL;
+		if (!dst)
+			continue;
+
+		if (stream_relay(strm, dst) || stream_relay(dst, strm)) {
+			(void)stream_relay(strm, NULL);
+			(void)stream_relay(dst, NULL);
+
+			info("call: %s: codecs differ, transcoding\n", name);
+			continue;
+		}
+
+		info("call: %s: relaying RTP without transcoding\n", name);
+		++job->n;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Relay the media of a call to another call in both directions, without
+ * transcoding. This is done for each media stream where both calls use
+ * the same codec, the other streams still go through the devices.
+ *
+ * @param call  Call object
+ * @param peer  Call to relay to, NULL to stop relaying
+ *
+ * @return Number of media streams that are relayed
+ */
+unsigned call_relay(struct call *call, struct call *peer)
+{
+	struct media_job job;
+
+	if (!call)
+		return 0;
+
+	/* the streams are only used from their own event loop */
+	if (peer && peer->loop != call->loop) {
+		info("call: media on other event loops, transcoding\n");
+		peer = NULL;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.call = call;
+	job.peer = peer;
+
+	(void)shard_exec(call->loop, relay_handler, &job);
+
+	return job.n;
+}
+
+
+static int reflect_handler(void *arg)
+{
+	struct media_job *job = arg;
+	struct call *call = job->call;
+	struct le *le;
+	int err = 0;
+
+	FOREACH_STREAM {
+		err |= stream_reflect(le->data, job->enable, job->delay);
+	}
+
+	return err;
+}
+
+
+/**
+ * Send the media of a call back to the peer, without decoding it. This
+ * is done for all media streams, no codecs or devices are used.
+ *
+ * @param call   Call object
+ * @param enable True to reflect, false to stop
+ * @param delay  Delay of the reflected media [ms]
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int call_reflect(struct call *call, bool enable, uint32_t delay)
+{
+	struct media_job job;
+
+	if (!call)
+		return EINVAL;
+
+	memset(&job, 0, sizeof(job));
+	job.call   = call;
+	job.enable = enable;
+	job.delay  = delay;
+
+	return shard_exec(call->loop, reflect_handler, &job);
+}
+
+
 void call_enable_rtp_timeout(struct call *call, uint32_t timeout_ms)
 {
 	if (!call)
@@ -12,7 +12,8 @@
 
 enum {
 	KEYCODE_DEL = 0x7f,
-	LONG_PREFIX = '/'
+	LONG_PREFIX = '/',
+	CMD_HASH_SIZE = 256,
 };
 
 
@@ -20,6 +21,7 @@ struct cmds {
 	struct le le;
 	const struct cmd *cmdv;
 	size_t cmdc;
+	struct le *hev;          /**< Hash entries, by key and by name     */
 };
 
 struct cmd_ctx {
@@ -30,6 +32,8 @@ struct cmd_ctx {
 
 struct commands {
 	struct list cmdl;        /**< List of command blocks (struct cmds) */
+	struct hash *ht_key;     /**< Commands by short key                */
+	struct hash *ht_long;    /**< Commands by long name, no case       */
 };
 
 
@@ -42,7 +46,12 @@ static int cmd_print_all(struct re_printf *pf,
 static void destructor(void *arg)
 {
 	struct cmds *cmds = arg;
+	size_t i;
+
+	for (i=0; cmds->hev && i<2*cmds->cmdc; i++)
+		hash_unlink(&cmds->hev[i]);
 
+	mem_deref(cmds->hev);
 	list_unlink(&cmds->le);
 }
 
@@ -60,6 +69,8 @@ static void commands_destructor(void *data)
 	struct commands *commands = data;
 
 	list_flush(&commands->cmdl);
+	mem_deref(commands->ht_long);
+	mem_deref(commands->ht_key);
 }
 
 
@@ -104,29 +115,30 @@ struct cmds *cmds_find(const struct commands *commands,
 }
 
 
-static const struct cmd *cmd_find_by_key(const struct commands *commands,
-					 char key)
+static bool key_handler(struct le *le, void *arg)
 {
-	struct le *le;
+	const struct cmd *cmd = le->data;
 
-	if (!commands)
-		return NULL;
+	return cmd->key == *(char *)arg;
+}
 
-	for (le = commands->cmdl.tail; le; le = le->prev) {
 
-		struct cmds *cmds = le->data;
-		size_t i;
+static bool long_handler(struct le *le, void *arg)
+{
+	const struct cmd *cmd = le->data;
 
-		for (i=0; i<cmds->cmdc; i++) {
+	return 0 == str_casecmp(cmd->name, arg);
+}
 
-			const struct cmd *cmd = &cmds->cmdv[i];
 
-			if (cmd->key == key && cmd->h)
-				return cmd;
-		}
-	}
+static const struct cmd *cmd_find_by_key(const struct commands *commands,
+					 char key)
+{
+	if (!commands)
+		return NULL;
 
-	return NULL;
+	return list_ledata(hash_lookup(commands->ht_key, (uint8_t)key,
+				       key_handler, &key));
 }
 
 
@@ -266,6 +278,21 @@ static int editor_input(struct commands *commands, struct mbuf *mb, char key,
 }
 
 
+/* run a command handler, marked for the main loop watchdog */
+static int cmd_call(const struct cmd *cmd, struct re_printf *pf,
+		    struct cmd_arg *arg)
+{
+	const char *prev;
+	int err;
+
+	prev = watchdog_enter(cmd->name ? cmd->name : cmd->desc);
+	err = cmd->h(pf, arg);
+	(void)watchdog_enter(prev);
+
+	return err;
+}
+
+
 static int cmd_report(const struct cmd *cmd, struct re_printf *pf,
 		      struct mbuf *mb, bool compl, void *data)
 {
@@ -283,7 +310,7 @@ static int cmd_report(const struct cmd *cmd, struct re_printf *pf,
 	arg.complete = compl;
 	arg.data     = data;
 
-	err = cmd->h(pf, &arg);
+	err = cmd_call(cmd, pf, &arg);
 
 	mem_deref(arg.prm);
 
@@ -325,7 +352,7 @@ int cmd_process_long(struct commands *commands, const char *str, size_t len,
 		arg.data     = data;
 
 		if (cmd_long->h)
-			err = cmd_long->h(pf_resp, &arg);
+			err = cmd_call(cmd_long, pf_resp, &arg);
 	}
 	else {
 		err = re_hprintf(pf_resp, "command not found (%s)\n", name);
@@ -434,9 +461,34 @@ int cmd_register(struct commands *commands,
 	if (!cmds)
 		return ENOMEM;
 
+	cmds->hev = mem_zalloc(2 * cmdc * sizeof(*cmds->hev), NULL);
+	if (!cmds->hev) {
+		mem_deref(cmds);
+		return ENOMEM;
+	}
+
 	cmds->cmdv = cmdv;
 	cmds->cmdc = cmdc;
 
+	/* only commands with a handler can be found */
+	for (i=0; i<cmdc; i++) {
+		const struct cmd *cmd = &cmdv[i];
+
+		if (!cmd->h)
+			continue;
+
+		if (cmd->key) {
+			hash_append(commands->ht_key, (uint8_t)cmd->key,
+				    &cmds->hev[2*i], (void *)cmd);
+		}
+
+		if (str_isset(cmd->name)) {
+			hash_append(commands->ht_long,
+				    hash_joaat_str_ci(cmd->name),
+				    &cmds->hev[2*i + 1], (void *)cmd);
+		}
+	}
+
 	list_append(&commands->cmdl, &cmds->le, cmds);
 
 	return 0;
@@ -458,26 +510,12 @@ void cmd_unregister(struct commands *commands, const struct cmd *cmdv)
 const struct cmd *cmd_find_long(const struct commands *commands,
 				const char *name)
 {
-	struct le *le;
-
 	if (!commands || !name)
 		return NULL;
 
-	for (le = commands->cmdl.tail; le; le = le->prev) {
-
-		struct cmds *cmds = le->data;
-		size_t i;
-
-		for (i=0; i<cmds->cmdc; i++) {
-
-			const struct cmd *cmd = &cmds->cmdv[i];
-
-			if (0 == str_casecmp(name, cmd->name) && cmd->h)
-				return cmd;
-		}
-	}
-
-	return NULL;
+	return list_ledata(hash_lookup(commands->ht_long,
+				       hash_joaat_str_ci(name),
+				       long_handler, (void *)name));
 }
 
 
@@ -539,7 +577,7 @@ int cmd_process(struct commands *commands, struct cmd_ctx **ctxp, char key,
 		arg.complete = true;
 		arg.data     = data;
 
-		return cmd->h(pf, &arg);
+		return cmd_call(cmd, pf, &arg);
 	}
 	else if (key == LONG_PREFIX) {
 
@@ -718,6 +756,7 @@ int cmd_print(struct re_printf *pf, const struct commands *commands)
 int cmd_init(struct commands **commandsp)
 {
 	struct commands *commands;
+	int err;
 
 	if (!commandsp)
 		return EINVAL;
@@ -728,6 +767,13 @@ int cmd_init(struct commands **commandsp)
 
 	list_init(&commands->cmdl);
 
+	err  = hash_alloc(&commands->ht_key, CMD_HASH_SIZE);
+	err |= hash_alloc(&commands->ht_long, CMD_HASH_SIZE);
+	if (err) {
+		mem_deref(commands);
+		return err;
+	}
+
 	*commandsp = commands;
 
 	return 0;
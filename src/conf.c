@@ -10,6 +10,7 @@
 #include <unistd.h>
 #endif
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #ifdef HAVE_IO_H
 #include <io.h>
@@ -28,6 +29,7 @@
 #ifdef WIN32
 #define open _open
 #define read _read
+#define write _write
 #define close _close
 #endif
 
@@ -39,6 +41,27 @@
 #endif
 
 
+/*
+ * With "config_snapshot yes" the parsed core config is written to the
+ * file config.snap next to the config file. On the next start it is read
+ * instead of parsing the config again, as long as the config file has
+ * the same size and modification time and the snapshot was written by
+ * the same version with the same layout. The snapshot is a header and
+ * the config struct as it is in memory, so it could also be mapped.
+ */
+enum { SNAP_MAGIC = 0x62736331 };   /* "bsc1" */
+
+struct snap_hdr {
+	uint32_t magic;
+	uint32_t size;              /* Size of struct config        */
+	char version[16];           /* BARESIP_VERSION              */
+	int64_t mtime;              /* Config file modified [s]     */
+	int64_t fsize;              /* Config file size             */
+	uint32_t crc;               /* CRC-32 of struct config      */
+	uint32_t pad;
+};
+
+
 static const char *conf_path = NULL;
 static struct conf *conf_obj;
 
@@ -73,8 +96,45 @@ static void print_populated(const char *what, uint32_t n)
 }
 
 
+/*
+ * Call the handler for each complete line in the buffer. The start of
+ * an incomplete line is kept for the next read, unless at end of file.
+ */
+static int parse_lines(struct mbuf *mb, bool eof, confline_h *ch, void *arg)
+{
+	struct pl pl, val;
+	int err = 0;
+
+	pl.p = (const char *)mb->buf;
+	pl.l = mb->end;
+
+	while (pl.l && !err) {
+		const char *lb = pl_strchr(&pl, '\n');
+
+		if (!lb && !eof)
+			break;
+
+		val.p = pl.p;
+		val.l = lb ? (uint32_t)(lb - pl.p) : pl.l;
+		pl_advance(&pl, lb ? val.l + 1 : val.l);
+
+		if (!val.l || val.p[0] == '#')
+			continue;
+
+		err = ch(&val, arg);
+	}
+
+	memmove(mb->buf, pl.p, pl.l);
+	mb->end = pl.l;
+	mb->pos = 0;
+
+	return err;
+}
+
+
 /**
- * Parse a config file, calling handler for each line
+ * Parse a config file, calling handler for each line. The file is read
+ * in blocks, so only the line being parsed is kept in memory.
  *
  * @param filename Config file
  * @param ch       Line handler
@@ -84,52 +144,143 @@ static void print_populated(const char *what, uint32_t n)
  */
 int conf_parse(const char *filename, confline_h *ch, void *arg)
 {
-	struct pl pl, val;
 	struct mbuf *mb;
 	int err = 0, fd = open(filename, O_RDONLY);
 	if (fd < 0)
 		return errno;
 
-	mb = mbuf_alloc(1024);
+	mb = mbuf_alloc(4096);
 	if (!mb) {
 		err = ENOMEM;
 		goto out;
 	}
 
 	for (;;) {
-		uint8_t buf[1024];
+		uint8_t buf[4096];
 
 		const ssize_t n = read(fd, (void *)buf, sizeof(buf));
 		if (n < 0) {
 			err = errno;
 			break;
 		}
-		else if (n == 0)
+		else if (n == 0) {
+			err = parse_lines(mb, true, ch, arg);
 			break;
+		}
 
-		err |= mbuf_write_mem(mb, buf, n);
+		mb->pos = mb->end;
+		err  = mbuf_write_mem(mb, buf, n);
+		err |= parse_lines(mb, false, ch, arg);
+		if (err)
+			break;
 	}
 
-	pl.p = (const char *)mb->buf;
-	pl.l = mb->end;
+ out:
+	mem_deref(mb);
+	(void)close(fd);
 
-	while (pl.p < ((const char *)mb->buf + mb->end) && !err) {
-		const char *lb = pl_strchr(&pl, '\n');
+	return err;
+}
 
-		val.p = pl.p;
-		val.l = lb ? (uint32_t)(lb - pl.p) : pl.l;
-		pl_advance(&pl, val.l + 1);
 
-		if (!val.l || val.p[0] == '#')
-			continue;
+static int file_stat(const char *file, int64_t *mtime, int64_t *fsize)
+{
+	struct stat st;
 
-		err = ch(&val, arg);
+	if (stat(file, &st) < 0)
+		return errno;
+
+	*mtime = st.st_mtime;
+	*fsize = st.st_size;
+
+	return 0;
+}
+
+
+static int snapshot_load(struct config *cfg, const char *file,
+			 const char *snap)
+{
+	struct snap_hdr hdr;
+	struct config *tmp;
+	int64_t mtime, fsize;
+	int fd, err;
+
+	err = file_stat(file, &mtime, &fsize);
+	if (err)
+		return err;
+
+	fd = open(snap, O_RDONLY);
+	if (fd < 0)
+		return errno;
+
+	tmp = mem_alloc(sizeof(*tmp), NULL);
+	if (!tmp) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (read(fd, (void *)&hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    read(fd, (void *)tmp, sizeof(*tmp)) != sizeof(*tmp)) {
+		err = EBADMSG;
+		goto out;
 	}
 
+	if (hdr.magic != SNAP_MAGIC || hdr.size != sizeof(*tmp) ||
+	    strncmp(hdr.version, BARESIP_VERSION, sizeof(hdr.version)) ||
+	    hdr.mtime != mtime || hdr.fsize != fsize ||
+	    hdr.crc != crc32(0, tmp, sizeof(*tmp))) {
+		err = ESTALE;
+		goto out;
+	}
+
+	*cfg = *tmp;
+
  out:
-	mem_deref(mb);
+	mem_deref(tmp);
+	(void)close(fd);
+
+	return err;
+}
+
+
+/* Written to a temporary file first, a reader never sees half of it */
+static int snapshot_save(const struct config *cfg, const char *file,
+			 const char *snap)
+{
+	char tmp[FS_PATH_MAX];
+	struct snap_hdr hdr;
+	int fd, err;
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	err = file_stat(file, &hdr.mtime, &hdr.fsize);
+	if (err)
+		return err;
+
+	hdr.magic = SNAP_MAGIC;
+	hdr.size  = sizeof(*cfg);
+	hdr.crc   = crc32(0, cfg, sizeof(*cfg));
+	str_ncpy(hdr.version, BARESIP_VERSION, sizeof(hdr.version));
+
+	if (re_snprintf(tmp, sizeof(tmp), "%s.tmp", snap) < 0)
+		return ENOMEM;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return errno;
+
+	if (write(fd, (const void *)&hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, (const void *)cfg, sizeof(*cfg)) != sizeof(*cfg))
+		err = EIO;
+
 	(void)close(fd);
 
+	if (!err && rename(tmp, snap) < 0)
+		err = errno;
+
+	if (err)
+		(void)remove(tmp);
+
 	return err;
 }
 
@@ -296,7 +447,8 @@ int conf_get_sa(const struct conf *conf, const char *name, struct sa *sa)
  */
 int conf_configure(void)
 {
-	char path[FS_PATH_MAX], file[FS_PATH_MAX];
+	char path[FS_PATH_MAX], file[FS_PATH_MAX], snap[FS_PATH_MAX];
+	bool snapshot = false;
 	int err;
 
 #if defined (WIN32)
@@ -326,10 +478,31 @@ int conf_configure(void)
 	if (err)
 		goto out;
 
+	(void)conf_get_bool(conf_obj, "config_snapshot", &snapshot);
+
+	if (re_snprintf(snap, sizeof(snap), "%s/config.snap", path) < 0)
+		return ENOMEM;
+
+	if (snapshot && 0 == snapshot_load(conf_config(), file, snap)) {
+
+		debug("conf: core config read from %s\n", snap);
+
+		err = config_parse_poll(conf_obj);
+		goto out;
+	}
+
 	err = config_parse_conf(conf_config(), conf_obj);
 	if (err)
 		goto out;
 
+	if (snapshot) {
+		err = snapshot_save(conf_config(), file, snap);
+		if (err) {
+			warning("conf: could not write %s (%m)\n", snap, err);
+			err = 0;
+		}
+	}
+
  out:
 	return err;
 }
@@ -352,6 +525,10 @@ int conf_modules(void)
 		goto out;
 	}
 
+	/* the audio devices are opened once their modules are loaded */
+	if (aushare_warmup(&conf_config()->audio))
+		warning("conf: audio warmup failed\n");
+
 	print_populated("audio codec",  list_count(aucodec_list()));
 	print_populated("audio filter", list_count(aufilt_list()));
 #ifdef USE_VIDEO
@@ -382,5 +559,7 @@ struct conf *conf_cur(void)
 
 void conf_close(void)
 {
+	aushare_cooldown();
+	module_close();
 	conf_obj = mem_deref(conf_obj);
 }
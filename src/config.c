@@ -27,13 +27,18 @@ static struct config core_config = {
 		16,
 		"",
 		"",
-		""
+		"",
+		0,
+		0,
+		30,
+		0
 	},
 
 	/** Call config */
 	{
 		120,
-		4
+		4,
+		0
 	},
 
 	/** Audio */
@@ -50,6 +55,9 @@ static struct config core_config = {
 		0,
 		false,
 		AUDIO_MODE_POLL,
+		0,
+		false,
+		false,
 	},
 
 #ifdef USE_VIDEO
@@ -60,6 +68,16 @@ static struct config core_config = {
 		352, 288,
 		500000,
 		25,
+		250,
+		1,
+		false,
+		false,
+		false,
+		500,
+		false,
+		false,
+		500,
+		false,
 	},
 #endif
 
@@ -70,9 +88,18 @@ static struct config core_config = {
 		{0, 0},
 		true,
 		false,
+		false,
 		{5, 10},
+		JBUF_MODE_FIXED,
+		200,
 		false,
-		0
+		0,
+		0,
+		false,
+		false,
+		false,
+		false,
+		false
 	},
 
 	/* Network */
@@ -85,7 +112,9 @@ static struct config core_config = {
 #ifdef USE_VIDEO
 	/* BFCP */
 	{
-		""
+		"",
+		"", "",
+		75
 	},
 #endif
 };
@@ -100,6 +129,45 @@ static int range_print(struct re_printf *pf, const struct range *rng)
 }
 
 
+static const char *txmode_str(enum audio_mode mode)
+{
+	switch (mode) {
+
+	case AUDIO_MODE_POLL:            return "poll";
+	case AUDIO_MODE_THREAD:          return "thread";
+	case AUDIO_MODE_THREAD_REALTIME: return "thread_realtime";
+	case AUDIO_MODE_TMR:             return "timer";
+	case AUDIO_MODE_EVENT:           return "event";
+	case AUDIO_MODE_POOL:            return "pool";
+	default:                         return "?";
+	}
+}
+
+
+static int txmode_decode(enum audio_mode *modep, const struct pl *pl)
+{
+	static const enum audio_mode modev[] = {
+		AUDIO_MODE_POLL,
+		AUDIO_MODE_THREAD,
+		AUDIO_MODE_THREAD_REALTIME,
+		AUDIO_MODE_TMR,
+		AUDIO_MODE_EVENT,
+		AUDIO_MODE_POOL,
+	};
+	size_t i;
+
+	for (i=0; i<ARRAY_SIZE(modev); i++) {
+
+		if (0 == pl_strcasecmp(pl, txmode_str(modev[i]))) {
+			*modep = modev[i];
+			return 0;
+		}
+	}
+
+	return ENOENT;
+}
+
+
 static int dns_server_handler(const struct pl *pl, void *arg)
 {
 	struct config_net *cfg = arg;
@@ -127,18 +195,20 @@ static int dns_server_handler(const struct pl *pl, void *arg)
 }
 
 
-int config_parse_conf(struct config *cfg, const struct conf *conf)
+/**
+ * Set the poll method of the main loop from the config. It is not part
+ * of the core config, and also needed with a config snapshot.
+ *
+ * @param conf Config object
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int config_parse_poll(const struct conf *conf)
 {
-	struct pl pollm, as, ap;
 	enum poll_method method;
-	struct vidsz size = {0, 0};
-	uint32_t v;
+	struct pl pollm;
 	int err = 0;
 
-	if (!cfg || !conf)
-		return EINVAL;
-
-	/* Core */
 	if (0 == conf_get(conf, "poll_method", &pollm)) {
 		if (0 == poll_method_type(&method, &pollm)) {
 			err = poll_method_set(method);
@@ -152,18 +222,51 @@ int config_parse_conf(struct config *cfg, const struct conf *conf)
 		}
 	}
 
+	return err;
+}
+
+
+int config_parse_conf(struct config *cfg, const struct conf *conf)
+{
+	struct pl as, ap, txmode, jbmode;
+	struct vidsz size = {0, 0};
+	uint32_t v;
+	int err = 0;
+
+	if (!cfg || !conf)
+		return EINVAL;
+
+	/* Core */
+	err = config_parse_poll(conf);
+
 	/* SIP */
 	(void)conf_get_u32(conf, "sip_trans_bsize", &cfg->sip.trans_bsize);
 	(void)conf_get_str(conf, "sip_listen", cfg->sip.local,
 			   sizeof(cfg->sip.local));
 	(void)conf_get_str(conf, "sip_certificate", cfg->sip.cert,
 			   sizeof(cfg->sip.cert));
+	(void)conf_get_u32(conf, "sip_reg_rate", &cfg->sip.reg_rate);
+	(void)conf_get_u32(conf, "sip_drain_rate", &cfg->sip.drain_rate);
+	(void)conf_get_u32(conf, "sip_drain_timeout",
+			   &cfg->sip.drain_timeout);
+	(void)conf_get_u32(conf, "sip_msg_window", &cfg->sip.msg_window);
 
 	/* Call */
 	(void)conf_get_u32(conf, "call_local_timeout",
 			   &cfg->call.local_timeout);
 	(void)conf_get_u32(conf, "call_max_calls",
 			   &cfg->call.max_calls);
+	(void)conf_get_u32(conf, "call_cpu_budget",
+			   &cfg->call.cpu_budget);
+	(void)conf_get_u32(conf, "call_watchdog",
+			   &cfg->call.watchdog);
+	(void)conf_get_u32(conf, "call_stats_interval",
+			   &cfg->call.stats_interval);
+	(void)conf_get_u32(conf, "call_capacity",
+			   &cfg->call.capacity);
+	(void)conf_get_u32(conf, "call_bandwidth",
+			   &cfg->call.bandwidth);
+	(void)conf_get_u32(conf, "call_shards", &cfg->call.shards);
 
 	/* Audio */
 	(void)conf_get_str(conf, "audio_path", cfg->audio.audio_path,
@@ -195,6 +298,37 @@ int config_parse_conf(struct config *cfg, const struct conf *conf)
 	    0 == conf_get(conf, "audio_player", &ap))
 		cfg->audio.src_first = as.p < ap.p;
 
+	if (0 == conf_get(conf, "audio_txmode", &txmode)) {
+		if (txmode_decode(&cfg->audio.txmode, &txmode)) {
+			warning("config: unknown audio_txmode (%r)\n",
+				&txmode);
+		}
+	}
+	(void)conf_get_u32(conf, "audio_txpool_threads",
+			   &cfg->audio.txpool_threads);
+	(void)conf_get_bool(conf, "audio_ringbuf", &cfg->audio.ringbuf);
+	(void)conf_get_bool(conf, "audio_timestretch",
+			    &cfg->audio.timestretch);
+	(void)conf_get_bool(conf, "audio_dtx", &cfg->audio.dtx);
+	(void)conf_get_bool(conf, "audio_drift", &cfg->audio.drift);
+	(void)conf_get_bool(conf, "audio_profile", &cfg->audio.profile);
+	(void)conf_get_bool(conf, "audio_ptime_adapt",
+			    &cfg->audio.ptime_adapt);
+	(void)conf_get_u32(conf, "audio_red", &cfg->audio.red);
+	(void)conf_get_u32(conf, "audio_rt_priority", &cfg->audio.rt_prio);
+	(void)conf_get_str(conf, "audio_cpus_tx", cfg->audio.cpus_tx,
+			   sizeof(cfg->audio.cpus_tx));
+	(void)conf_get_str(conf, "audio_cpus_dev", cfg->audio.cpus_dev,
+			   sizeof(cfg->audio.cpus_dev));
+	(void)conf_get_str(conf, "audio_cpus_pool", cfg->audio.cpus_pool,
+			   sizeof(cfg->audio.cpus_pool));
+	(void)conf_get_str(conf, "audio_share", cfg->audio.share,
+			   sizeof(cfg->audio.share));
+	(void)conf_get_u32(conf, "audio_speakers", &cfg->audio.speakers);
+	(void)conf_get_bool(conf, "audio_low_latency",
+			    &cfg->audio.low_latency);
+	(void)conf_get_u32(conf, "audio_warmup", &cfg->audio.warmup);
+
 #ifdef USE_VIDEO
 	/* Video */
 	(void)conf_get_csv(conf, "video_source",
@@ -209,6 +343,21 @@ int config_parse_conf(struct config *cfg, const struct conf *conf)
 	}
 	(void)conf_get_u32(conf, "video_bitrate", &cfg->video.bitrate);
 	(void)conf_get_u32(conf, "video_fps", &cfg->video.fps);
+	(void)conf_get_u32(conf, "video_pacing", &cfg->video.pacing);
+	(void)conf_get_u32(conf, "video_sendq_max", &cfg->video.sendq_max);
+	(void)conf_get_u32(conf, "video_simulcast", &cfg->video.simulcast);
+	(void)conf_get_bool(conf, "video_encode_thread",
+			    &cfg->video.enc_thread);
+	(void)conf_get_bool(conf, "video_decode_thread",
+			    &cfg->video.dec_thread);
+	(void)conf_get_bool(conf, "video_display_thread",
+			    &cfg->video.disp_thread);
+	(void)conf_get_u32(conf, "video_keyframe_interval",
+			   &cfg->video.key_interval);
+	(void)conf_get_bool(conf, "video_encode_share",
+			    &cfg->video.enc_share);
+	(void)conf_get_bool(conf, "video_profile", &cfg->video.profile);
+	(void)conf_get_bool(conf, "video_adaptive", &cfg->video.adaptive);
 #else
 	(void)size;
 #endif
@@ -224,10 +373,28 @@ int config_parse_conf(struct config *cfg, const struct conf *conf)
 	}
 	(void)conf_get_bool(conf, "rtcp_enable", &cfg->avt.rtcp_enable);
 	(void)conf_get_bool(conf, "rtcp_mux", &cfg->avt.rtcp_mux);
+	(void)conf_get_bool(conf, "rtcp_xr", &cfg->avt.rtcp_xr);
 	(void)conf_get_range(conf, "jitter_buffer_delay",
 			     &cfg->avt.jbuf_del);
+	if (0 == conf_get(conf, "jitter_buffer_mode", &jbmode)) {
+		if (0 == pl_strcasecmp(&jbmode, "adaptive"))
+			cfg->avt.jbuf_mode = JBUF_MODE_ADAPTIVE;
+		else if (0 == pl_strcasecmp(&jbmode, "fixed"))
+			cfg->avt.jbuf_mode = JBUF_MODE_FIXED;
+		else {
+			warning("config: unknown jitter_buffer_mode (%r)\n",
+				&jbmode);
+		}
+	}
+	(void)conf_get_u32(conf, "jitter_buffer_video", &cfg->avt.jbuf_video);
 	(void)conf_get_bool(conf, "rtp_stats", &cfg->avt.rtp_stats);
 	(void)conf_get_u32(conf, "rtp_timeout", &cfg->avt.rtp_timeout);
+	(void)conf_get_u32(conf, "rtp_batch", &cfg->avt.rtp_batch);
+	(void)conf_get_bool(conf, "rtp_uring", &cfg->avt.rtp_uring);
+	(void)conf_get_bool(conf, "rtp_congestion_ctrl", &cfg->avt.rtp_cc);
+	(void)conf_get_bool(conf, "rtp_fec", &cfg->avt.rtp_fec);
+	(void)conf_get_bool(conf, "rtp_bundle", &cfg->avt.rtp_bundle);
+	(void)conf_get_bool(conf, "rtp_rx_timestamp", &cfg->avt.rtp_rxts);
 
 	if (err) {
 		warning("config: configure parse error (%m)\n", err);
@@ -242,7 +409,34 @@ int config_parse_conf(struct config *cfg, const struct conf *conf)
 	/* BFCP */
 	(void)conf_get_str(conf, "bfcp_proto", cfg->bfcp.proto,
 			   sizeof(cfg->bfcp.proto));
+	(void)conf_get_csv(conf, "bfcp_content_source",
+			   cfg->bfcp.content_mod,
+			   sizeof(cfg->bfcp.content_mod),
+			   cfg->bfcp.content_dev,
+			   sizeof(cfg->bfcp.content_dev));
+	if (0 == conf_get_u32(conf, "bfcp_content_share",
+			      &cfg->bfcp.content_share))
+		cfg->bfcp.content_share = min(cfg->bfcp.content_share, 95u);
+#endif
+
+	/* shared devices and encoders are not used across event loops */
+	if (cfg->call.shards) {
+
+		if (str_isset(cfg->audio.share) || cfg->audio.speakers) {
+			warning("config: call_shards: audio_share and"
+				" audio_speakers are disabled\n");
+			cfg->audio.share[0] = '\0';
+			cfg->audio.speakers = 0;
+		}
+
+#ifdef USE_VIDEO
+		if (cfg->video.enc_share) {
+			warning("config: call_shards: video_encode_share"
+				" is disabled\n");
+			cfg->video.enc_share = false;
+		}
 #endif
+	}
 
 	return err;
 }
@@ -261,10 +455,20 @@ int config_print(struct re_printf *pf, const struct config *cfg)
 			 "sip_trans_bsize\t\t%u\n"
 			 "sip_listen\t\t%s\n"
 			 "sip_certificate\t%s\n"
+			 "sip_reg_rate\t\t%u\n"
+			 "sip_drain_rate\t\t%u\n"
+			 "sip_drain_timeout\t%u\n"
+			 "sip_msg_window\t\t%u\n"
 			 "\n"
 			 "# Call\n"
 			 "call_local_timeout\t%u\n"
 			 "call_max_calls\t%u\n"
+			 "call_cpu_budget\t%u\n"
+			 "call_watchdog\t%u\n"
+			 "call_stats_interval\t%u\n"
+			 "call_capacity\t\t%u\n"
+			 "call_bandwidth\t\t%u\n"
+			 "call_shards\t\t%u\n"
 			 "\n"
 			 "# Audio\n"
 			 "audio_path\t\t%s\n"
@@ -277,6 +481,23 @@ int config_print(struct re_printf *pf, const struct config *cfg)
 			 "ausrc_srate\t\t%u\n"
 			 "auplay_channels\t\t%u\n"
 			 "ausrc_channels\t\t%u\n"
+			 "audio_txmode\t\t%s\n"
+			 "audio_txpool_threads\t%u\n"
+			 "audio_ringbuf\t\t%s\n"
+			 "audio_timestretch\t%s\n"
+			 "audio_dtx\t\t%s\n"
+			 "audio_drift\t\t%s\n"
+			 "audio_profile\t\t%s\n"
+			 "audio_ptime_adapt\t%s\n"
+			 "audio_red\t\t%u\n"
+			 "audio_rt_priority\t%u\n"
+			 "audio_cpus_tx\t\t%s\n"
+			 "audio_cpus_dev\t\t%s\n"
+			 "audio_cpus_pool\t\t%s\n"
+			 "audio_share\t\t%s\n"
+			 "audio_speakers\t\t%u\n"
+			 "audio_low_latency\t%s\n"
+			 "audio_warmup\t\t%u\n"
 			 "\n"
 #ifdef USE_VIDEO
 			 "# Video\n"
@@ -285,6 +506,16 @@ int config_print(struct re_printf *pf, const struct config *cfg)
 			 "video_size\t\t\"%ux%u\"\n"
 			 "video_bitrate\t\t%u\n"
 			 "video_fps\t\t%u\n"
+			 "video_pacing\t\t%u\n"
+			 "video_sendq_max\t\t%u\n"
+			 "video_simulcast\t\t%u\n"
+			 "video_encode_thread\t%s\n"
+			 "video_decode_thread\t%s\n"
+			 "video_display_thread\t%s\n"
+			 "video_keyframe_interval\t%u\n"
+			 "video_encode_share\t%s\n"
+			 "video_profile\t\t%s\n"
+			 "video_adaptive\t\t%s\n"
 			 "\n"
 #endif
 			 "# AVT\n"
@@ -293,9 +524,18 @@ int config_print(struct re_printf *pf, const struct config *cfg)
 			 "rtp_bandwidth\t\t%H\n"
 			 "rtcp_enable\t\t%s\n"
 			 "rtcp_mux\t\t%s\n"
+			 "rtcp_xr\t\t\t%s\n"
 			 "jitter_buffer_delay\t%H\n"
+			 "jitter_buffer_mode\t%s\n"
+			 "jitter_buffer_video\t%u # in [ms]\n"
 			 "rtp_stats\t\t%s\n"
 			 "rtp_timeout\t\t%u # in seconds\n"
+			 "rtp_batch\t\t%u # packets\n"
+			 "rtp_uring\t\t%s\n"
+			 "rtp_congestion_ctrl\t%s\n"
+			 "rtp_fec\t\t\t%s\n"
+			 "rtp_bundle\t\t%s\n"
+			 "rtp_rx_timestamp\t%s\n"
 			 "\n"
 			 "# Network\n"
 			 "net_interface\t\t%s\n"
@@ -303,14 +543,25 @@ int config_print(struct re_printf *pf, const struct config *cfg)
 #ifdef USE_VIDEO
 			 "# BFCP\n"
 			 "bfcp_proto\t\t%s\n"
+			 "bfcp_content_source\t%s,%s\n"
+			 "bfcp_content_share\t%u\n"
 			 "\n"
 #endif
 			 ,
 
 			 cfg->sip.trans_bsize, cfg->sip.local, cfg->sip.cert,
+			 cfg->sip.reg_rate,
+			 cfg->sip.drain_rate, cfg->sip.drain_timeout,
+			 cfg->sip.msg_window,
 
 			 cfg->call.local_timeout,
 			 cfg->call.max_calls,
+			 cfg->call.cpu_budget,
+			 cfg->call.watchdog,
+			 cfg->call.stats_interval,
+			 cfg->call.capacity,
+			 cfg->call.bandwidth,
+			 cfg->call.shards,
 
 			 cfg->audio.audio_path,
 			 cfg->audio.play_mod,  cfg->audio.play_dev,
@@ -320,12 +571,38 @@ int config_print(struct re_printf *pf, const struct config *cfg)
 			 range_print, &cfg->audio.channels,
 			 cfg->audio.srate_play, cfg->audio.srate_src,
 			 cfg->audio.channels_play, cfg->audio.channels_src,
+			 txmode_str(cfg->audio.txmode),
+			 cfg->audio.txpool_threads,
+			 cfg->audio.ringbuf ? "yes" : "no",
+			 cfg->audio.timestretch ? "yes" : "no",
+			 cfg->audio.dtx ? "yes" : "no",
+			 cfg->audio.drift ? "yes" : "no",
+			 cfg->audio.profile ? "yes" : "no",
+			 cfg->audio.ptime_adapt ? "yes" : "no",
+			 cfg->audio.red,
+			 cfg->audio.rt_prio,
+			 cfg->audio.cpus_tx,
+			 cfg->audio.cpus_dev,
+			 cfg->audio.cpus_pool,
+			 cfg->audio.share,
+			 cfg->audio.speakers,
+			 cfg->audio.low_latency ? "yes" : "no",
+			 cfg->audio.warmup,
 
 #ifdef USE_VIDEO
 			 cfg->video.src_mod, cfg->video.src_dev,
 			 cfg->video.disp_mod, cfg->video.disp_dev,
 			 cfg->video.width, cfg->video.height,
 			 cfg->video.bitrate, cfg->video.fps,
+			 cfg->video.pacing, cfg->video.sendq_max,
+			 cfg->video.simulcast,
+			 cfg->video.enc_thread ? "yes" : "no",
+			 cfg->video.dec_thread ? "yes" : "no",
+			 cfg->video.disp_thread ? "yes" : "no",
+			 cfg->video.key_interval,
+			 cfg->video.enc_share ? "yes" : "no",
+			 cfg->video.profile ? "yes" : "no",
+			 cfg->video.adaptive ? "yes" : "no",
 #endif
 
 			 cfg->avt.rtp_tos,
@@ -333,14 +610,26 @@ int config_print(struct re_printf *pf, const struct config *cfg)
 			 range_print, &cfg->avt.rtp_bw,
 			 cfg->avt.rtcp_enable ? "yes" : "no",
 			 cfg->avt.rtcp_mux ? "yes" : "no",
+			 cfg->avt.rtcp_xr ? "yes" : "no",
 			 range_print, &cfg->avt.jbuf_del,
+			 cfg->avt.jbuf_mode == JBUF_MODE_ADAPTIVE
+				 ? "adaptive" : "fixed",
+			 cfg->avt.jbuf_video,
 			 cfg->avt.rtp_stats ? "yes" : "no",
 			 cfg->avt.rtp_timeout,
+			 cfg->avt.rtp_batch,
+			 cfg->avt.rtp_uring ? "yes" : "no",
+			 cfg->avt.rtp_cc ? "yes" : "no",
+			 cfg->avt.rtp_fec ? "yes" : "no",
+			 cfg->avt.rtp_bundle ? "yes" : "no",
+			 cfg->avt.rtp_rxts ? "yes" : "no",
 
 			 cfg->net.ifname
 
 #ifdef USE_VIDEO
-			 ,cfg->bfcp.proto
+			 ,cfg->bfcp.proto,
+			 cfg->bfcp.content_mod, cfg->bfcp.content_dev,
+			 cfg->bfcp.content_share
 #endif
 		   );
 
@@ -423,14 +712,27 @@ static int core_config_template(struct re_printf *pf, const struct config *cfg)
 				", kqueue .."
 #endif
 				"\n"
+			  "#config_snapshot\tno\t\t# binary cache\n"
 			  "\n# SIP\n"
 			  "sip_trans_bsize\t\t128\n"
 			  "#sip_listen\t\t0.0.0.0:5060\n"
 			  "#sip_certificate\tcert.pem\n"
+			  "#sip_reg_rate\t\t50 # REGISTERs per second\n"
+			  "#sip_drain_rate\t\t500 # UAs closed per second"
+				" at exit\n"
+			  "#sip_drain_timeout\t30 # [s], then forced\n"
+			  "#sip_msg_window\t\t32 # MESSAGEs in flight"
+				" per destination\n"
 			  "\n"
 			  "# Call\n"
 			  "call_local_timeout\t%u\n"
 			  "call_max_calls\t%u\n"
+			  "#call_cpu_budget\t80\t\t# [%%], 0 = off\n"
+			  "#call_watchdog\t\t200\t\t# [ms], 0 = off\n"
+			  "#call_stats_interval\t60\t\t# [s], 0 = off\n"
+			  "#call_capacity\t\t4000\t\t# [1/10 call], 0 = off\n"
+			  "#call_bandwidth\t\t100000\t\t# [kbit/s], 0 = off\n"
+			  "#call_shards\t\t4\t\t# event loops for the media\n"
 			  "\n"
 			  "# Audio\n"
 #if defined (PREFIX)
@@ -447,6 +749,29 @@ static int core_config_template(struct re_printf *pf, const struct config *cfg)
 			  "#auplay_srate\t\t48000\n"
 			  "#ausrc_channels\t\t0\n"
 			  "#auplay_channels\t\t0\n"
+			  "#audio_txmode\t\tpoll\t\t# poll, thread,"
+				" thread_realtime, timer, event, pool\n"
+			  "#audio_txpool_threads\t0\t\t# 0 = number of CPUs\n"
+			  "#audio_ringbuf\t\tno\t\t# lock-free sample ring\n"
+			  "#audio_timestretch\tno\t\t# WSOLA playout\n"
+			  "#audio_dtx\t\tno\t\t# silence suppression, CN\n"
+			  "#audio_drift\t\tno\t\t# clock-drift compensation\n"
+			  "#audio_profile\t\tno\t\t# time pipeline stages\n"
+			  "#audio_ptime_adapt\tno\t\t# larger ptime on"
+				" congestion\n"
+			  "#audio_red\t\t0\t\t# redundant frames, 0-2\n"
+			  "#audio_rt_priority\t0\t\t# SCHED_FIFO, 0 = 10\n"
+			  "#audio_cpus_tx\t\t2\t\t# pin transmit threads\n"
+			  "#audio_cpus_dev\t\t3\t\t# pin device threads\n"
+			  "#audio_cpus_pool\t4-7\t\t# one CPU per worker\n"
+			  "#audio_share\t\talsa,pulse\t# one device for all"
+				" calls\n"
+			  "#audio_speakers\t\t3\t\t# decoded per player"
+				" device\n"
+			  "#audio_low_latency\tno\t\t# encode in the"
+				" device callback\n"
+			  "#audio_warmup\t\t20\t\t# ptime of devices in"
+				" standby, 0 = off\n"
 			  ,
 			  poll_method_name(poll_method_best()),
 			  cfg->call.local_timeout,
@@ -464,11 +789,22 @@ static int core_config_template(struct re_printf *pf, const struct config *cfg)
 			  "#video_display\t\t%s\n"
 			  "video_size\t\t%dx%d\n"
 			  "video_bitrate\t\t%u\n"
-			  "video_fps\t\t%u\n",
+			  "video_fps\t\t%u\n"
+			  "video_pacing\t\t%u\t\t# [%%] of bitrate\n"
+			  "#video_sendq_max\t500\t\t# [ms], 0 = no limit\n"
+			  "#video_simulcast\t3\t\t# layers\n"
+			  "#video_encode_thread\tno\n"
+			  "#video_decode_thread\tno\n"
+			  "#video_display_thread\tno\n"
+			  "#video_keyframe_interval\t500\t# min. [ms]\n"
+			  "#video_encode_share\tno\n"
+			  "#video_profile\t\tno\t\t# time pipeline stages\n"
+			  "#video_adaptive\t\tno\t\t# low rate when static\n",
 			  default_video_device(),
 			  default_video_display(),
 			  cfg->video.width, cfg->video.height,
-			  cfg->video.bitrate, cfg->video.fps);
+			  cfg->video.bitrate, cfg->video.fps,
+			  cfg->video.pacing);
 #endif
 
 	err |= re_hprintf(pf,
@@ -478,9 +814,18 @@ static int core_config_template(struct re_printf *pf, const struct config *cfg)
 			  "#rtp_bandwidth\t\t512-1024 # [kbit/s]\n"
 			  "rtcp_enable\t\tyes\n"
 			  "rtcp_mux\t\tno\n"
+			  "#rtcp_xr\t\tyes\t\t# RFC 3611 VoIP Metrics\n"
 			  "jitter_buffer_delay\t%u-%u\t\t# frames\n"
+			  "#jitter_buffer_mode\tfixed\t\t# fixed, adaptive\n"
+			  "#jitter_buffer_video\t200\t\t# frame wait [ms]\n"
 			  "rtp_stats\t\tno\n"
 			  "#rtp_timeout\t\t60\n"
+			  "#rtp_batch\t\t16\t\t# packets per send (Linux)\n"
+			  "#rtp_uring\t\tyes\t\t# send batches with io_uring\n"
+			  "#rtp_congestion_ctrl\tyes\t\t# adapt video bitrate\n"
+			  "#rtp_fec\t\tyes\t\t# RFC 5109 ULPFEC\n"
+			  "#rtp_bundle\t\tyes\t\t# one socket per call\n"
+			  "#rtp_rx_timestamp\tyes\t\t# kernel timestamps (Linux)\n"
 			  "\n# Network\n"
 			  "#dns_server\t\t10.0.0.1:53\n"
 			  "#net_interface\t\t%H\n",
@@ -490,7 +835,9 @@ static int core_config_template(struct re_printf *pf, const struct config *cfg)
 #ifdef USE_VIDEO
 	err |= re_hprintf(pf,
 			  "\n# BFCP\n"
-			  "#bfcp_proto\t\tudp\n");
+			  "#bfcp_proto\t\tudp\n"
+			  "#bfcp_content_source\tx11grab,:0.0\n"
+			  "#bfcp_content_share\t75\t\t# [%%] presenting\n");
 #endif
 
 	return err;
@@ -627,7 +974,9 @@ int config_write_template(const char *file, const struct config *cfg)
 	(void)re_fprintf(f, "module\t\t\t" MOD_PRE "vumeter" MOD_EXT "\n");
 	(void)re_fprintf(f, "#module\t\t\t" MOD_PRE "sndfile" MOD_EXT "\n");
 	(void)re_fprintf(f, "#module\t\t\t" MOD_PRE "speex_aec" MOD_EXT "\n");
+	(void)re_fprintf(f, "#module\t\t\t" MOD_PRE "webrtc_aec" MOD_EXT "\n");
 	(void)re_fprintf(f, "#module\t\t\t" MOD_PRE "speex_pp" MOD_EXT "\n");
+	(void)re_fprintf(f, "#module\t\t\t" MOD_PRE "rnnoise" MOD_EXT "\n");
 	(void)re_fprintf(f, "#module\t\t\t" MOD_PRE "plc" MOD_EXT "\n");
 
 	(void)re_fprintf(f, "\n# Audio driver Modules\n");
@@ -650,6 +999,9 @@ int config_write_template(const char *file, const struct config *cfg)
 	(void)re_fprintf(f, "#module\t\t\t" MOD_PRE "portaudio" MOD_EXT "\n");
 	(void)re_fprintf(f, "#module\t\t\t" MOD_PRE "aubridge" MOD_EXT "\n");
 	(void)re_fprintf(f, "#module\t\t\t" MOD_PRE "aufile" MOD_EXT "\n");
+#ifdef LINUX
+	(void)re_fprintf(f, "#module\t\t\t" MOD_PRE "shm" MOD_EXT "\n");
+#endif
 
 #ifdef USE_VIDEO
 
@@ -692,6 +1044,7 @@ int config_write_template(const char *file, const struct config *cfg)
 	(void)re_fprintf(f, "#module\t\t\t" MOD_PRE "x11grab" MOD_EXT "\n");
 	(void)re_fprintf(f, "#module\t\t\t" MOD_PRE "cairo" MOD_EXT "\n");
 	(void)re_fprintf(f, "#module\t\t\t" MOD_PRE "vidbridge" MOD_EXT "\n");
+	(void)re_fprintf(f, "#module\t\t\t" MOD_PRE "compositor" MOD_EXT "\n");
 
 	(void)re_fprintf(f, "\n# Video display modules\n");
 #ifdef DARWIN
@@ -728,14 +1081,31 @@ int config_write_template(const char *file, const struct config *cfg)
 	(void)re_fprintf(f, "# Temporary Modules (loaded then unloaded)\n");
 	(void)re_fprintf(f, "\n");
 	(void)re_fprintf(f, "module_tmp\t\t" MOD_PRE "uuid" MOD_EXT "\n");
-	(void)re_fprintf(f, "module_tmp\t\t" MOD_PRE "account" MOD_EXT "\n");
+	(void)re_fprintf(f, "\n");
+
+	(void)re_fprintf(f, "\n#------------------------------------"
+			 "------------------------------------------\n");
+	(void)re_fprintf(f, "# Codec Modules loaded on demand\n");
+	(void)re_fprintf(f, "# module_lazy <module> audio"
+			 " <name/srate/ch[/pt[/crate]]> [fmtp]\n");
+	(void)re_fprintf(f, "# module_lazy <module> video"
+			 " <name[/variant]> [fmtp]\n");
+	(void)re_fprintf(f, "\n");
+	(void)re_fprintf(f, "#module_lazy\t\t" MOD_PRE "g722" MOD_EXT
+			 " audio G722/16000/1/9/8000\n");
+#ifdef USE_VIDEO
+	(void)re_fprintf(f, "#module_lazy\t\t" MOD_PRE "avcodec" MOD_EXT
+			 " video H264 packetization-mode=0\n");
+#endif
 	(void)re_fprintf(f, "\n");
 
 	(void)re_fprintf(f, "\n#------------------------------------"
 			 "------------------------------------------\n");
 	(void)re_fprintf(f, "# Application Modules\n");
 	(void)re_fprintf(f, "\n");
+	(void)re_fprintf(f, "module_app\t\t" MOD_PRE "account"MOD_EXT"\n");
 	(void)re_fprintf(f, "module_app\t\t" MOD_PRE "auloop"MOD_EXT"\n");
+	(void)re_fprintf(f, "#module_app\t\t" MOD_PRE "bench"MOD_EXT"\n");
 	(void)re_fprintf(f, "module_app\t\t"  MOD_PRE "contact"MOD_EXT"\n");
 	(void)re_fprintf(f, "module_app\t\t"  MOD_PRE "debug_cmd"MOD_EXT"\n");
 #ifdef LINUX
@@ -780,22 +1150,75 @@ int config_write_template(const char *file, const struct config *cfg)
 	(void)re_fprintf(f, "\n# Opus codec parameters\n");
 	(void)re_fprintf(f, "opus_bitrate\t\t28000 # 6000-510000\n");
 
+	(void)re_fprintf(f, "\n# VP8 and VP9 codec parameters\n");
+	(void)re_fprintf(f, "#vp8_temporal_layers\t3 # 1-3\n");
+	(void)re_fprintf(f, "#vp9_temporal_layers\t3 # 1-3\n");
+	(void)re_fprintf(f, "#vp8_threads\t\t0 # 0 is auto\n");
+	(void)re_fprintf(f, "#vp9_threads\t\t0 # 0 is auto\n");
+	(void)re_fprintf(f, "#vp8_dec_threads\t0 # 0 is auto\n");
+
+	(void)re_fprintf(f, "\n# avcodec parameters\n");
+	(void)re_fprintf(f, "#avcodec_dec_threads\t0 # 0 is auto\n");
+	(void)re_fprintf(f, "#avcodec_dec_thread_type\tslice"
+			 " # {slice,frame}\n");
+	(void)re_fprintf(f, "#avcodec_hwaccel\tvaapi"
+			 " # vaapi, vdpau, videotoolbox, cuda\n");
+	(void)re_fprintf(f, "#avcodec_hwaccel_device\t/dev/dri/renderD128\n");
+	(void)re_fprintf(f, "#avcodec_h264enc\th264_vaapi"
+			 " # h264_vaapi, h264_qsv, h264_nvenc\n");
+	(void)re_fprintf(f, "#avcodec_h264enc_device\t/dev/dri/renderD128\n");
+
+	(void)re_fprintf(f, "\n# v4l2\n");
+	(void)re_fprintf(f, "#v4l2_buffers\t\t4 # 2-32\n");
+
 	(void)re_fprintf(f,
 			"\n# Selfview\n"
 			"video_selfview\t\twindow # {window,pip}\n"
 			"#selfview_size\t\t64x64\n");
 
+	(void)re_fprintf(f,
+			"\n# Compositor\n"
+			"#compositor_size\t1280x720\n"
+			"#compositor_fps\t\t25\n"
+			"#compositor_layout\tgrid # {grid,speaker}\n"
+			"#compositor_display\tx11,nil\n");
+
+	(void)re_fprintf(f,
+			"\n# Call benchmark\n"
+			"#bench_cps\t\t10\n"
+			"#bench_concurrency\t100\n"
+			"#bench_calls\t\t1000 # 0 is no limit\n"
+			"#bench_duration\t\t30 # [s]\n"
+			"#bench_video\t\tno\n");
+
+	(void)re_fprintf(f,
+			"\n# Presence\n"
+			"#presence_throttle\t1000 # [ms]\n");
+
 	(void)re_fprintf(f,
 			"\n# ICE\n"
 			"ice_turn\t\tno\n"
 			"ice_debug\t\tno\n"
 			"ice_nomination\t\tregular\t# {regular,aggressive}\n"
-			"ice_mode\t\tfull\t# {full,lite}\n");
+			"ice_mode\t\tfull\t# {full,lite}\n"
+			"ice_trickle\t\tno\n"
+			"#ice_rto\t\t100\t# [ms]\n"
+			"#ice_rc\t\t\t7\n");
+
+	(void)re_fprintf(f,
+			"\n# WAV file source\n"
+			"#aufile_mmap\t\tno\n");
+
+	(void)re_fprintf(f,
+			"\n# DTLS-SRTP\n"
+			"#dtls_srtp_certificate\t/path/to/dtls.pem\n"
+			"#dtls_srtp_handshakes\t16 # 0 is no limit\n");
 
 	(void)re_fprintf(f,
 			"\n# Menu\n"
 			"#redial_attempts\t\t3 # Num or <inf>\n"
-			"#redial_delay\t\t5 # Delay in seconds\n");
+			"#redial_delay\t\t5 # Delay in seconds\n"
+			"#menu_stat_interval\t500 # [ms]\n");
 
 	if (f)
 		(void)fclose(f);
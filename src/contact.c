@@ -4,10 +4,16 @@
  * Copyright (C) 2010 Creytiv.com
  */
 #include <string.h>
+#include <ctype.h>
 #include <re.h>
 #include <baresip.h>
 
 
+enum {
+	CONTACT_HASH_SIZE = 1024,
+	KEY_MAX = 256,
+};
+
 enum access {
 	ACCESS_UNKNOWN = 0,
 	ACCESS_BLOCK,
@@ -16,9 +22,11 @@ enum access {
 
 struct contact {
 	struct le le;
-	struct le he;          /* hash-element with key 'auri' */
+	struct le he;          /* hash-element with key 'key' */
+	struct le hn;          /* hash-element with the name as key */
 	struct sip_addr addr;
 	char *buf;
+	char *key;             /* normalized AOR */
 	enum presence_status status;
 	enum access access;
 };
@@ -29,11 +37,57 @@ static void destructor(void *arg)
 	struct contact *c = arg;
 
 	hash_unlink(&c->he);
+	hash_unlink(&c->hn);
 	list_unlink(&c->le);
+	mem_deref(c->key);
 	mem_deref(c->buf);
 }
 
 
+/*
+ * The AOR is normalized to scheme:user@host[:port], without parameters.
+ * The scheme and the host are not case-sensitive (RFC 3261 19.1.4), so
+ * they are written in lower case. An AOR that is not a valid URI, such
+ * as the wildcard, is used as it is.
+ */
+static int aor_key(char *key, size_t sz, const struct pl *auri)
+{
+	struct uri uri;
+	size_t i, hoff;
+	int n;
+
+	if (uri_decode(&uri, auri) || !pl_isset(&uri.host)) {
+		n = re_snprintf(key, sz, "%r", auri);
+		return n < 0 ? ENOMEM : 0;
+	}
+
+	if (uri.port)
+		n = re_snprintf(key, sz, "%r:%r@%r:%u", &uri.scheme,
+				&uri.user, &uri.host, uri.port);
+	else
+		n = re_snprintf(key, sz, "%r:%r@%r", &uri.scheme,
+				&uri.user, &uri.host);
+	if (n < 0)
+		return ENOMEM;
+
+	for (i=0; i<uri.scheme.l; i++)
+		key[i] = (char)tolower((unsigned char)key[i]);
+
+	hoff = uri.scheme.l + 1 + uri.user.l + 1;
+	for (i=hoff; i<hoff + uri.host.l; i++)
+		key[i] = (char)tolower((unsigned char)key[i]);
+
+	return 0;
+}
+
+
+/* The name is the display name if set, otherwise the user */
+static const struct pl *contact_name(const struct contact *c)
+{
+	return pl_isset(&c->addr.dname) ? &c->addr.dname : &c->addr.uri.user;
+}
+
+
 /**
  * Add a contact
  *
@@ -46,6 +100,7 @@ static void destructor(void *arg)
 int contact_add(struct contacts *contacts,
 		struct contact **contactp, const struct pl *addr)
 {
+	char key[KEY_MAX];
 	struct contact *c;
 	struct pl pl;
 	int err;
@@ -89,8 +144,16 @@ int contact_add(struct contacts *contacts,
 
 	c->status = PRESENCE_UNKNOWN;
 
+	err  = aor_key(key, sizeof(key), &c->addr.auri);
+	err |= str_dup(&c->key, key);
+	if (err)
+		goto out;
+
 	list_append(&contacts->cl, &c->le, c);
-	hash_append(contacts->cht, hash_joaat_pl(&c->addr.auri), &c->he, c);
+	hash_append(contacts->cht, hash_joaat_str(c->key), &c->he, c);
+	hash_append(contacts->nht, hash_joaat_ci(contact_name(c)->p,
+						  contact_name(c)->l),
+		    &c->hn, c);
 
  out:
 	if (err)
@@ -220,7 +283,8 @@ int contact_init(struct contacts *contacts)
 
 	list_init(&contacts->cl);
 
-	err = hash_alloc(&contacts->cht, 32);
+	err  = hash_alloc(&contacts->cht, CONTACT_HASH_SIZE);
+	err |= hash_alloc(&contacts->nht, CONTACT_HASH_SIZE);
 
 	return err;
 }
@@ -237,7 +301,9 @@ void contact_close(struct contacts *contacts)
 		return;
 
 	hash_clear(contacts->cht);
+	hash_clear(contacts->nht);
 	contacts->cht = mem_deref(contacts->cht);
+	contacts->nht = mem_deref(contacts->nht);
 	list_flush(&contacts->cl);
 }
 
@@ -246,12 +312,13 @@ static bool find_handler(struct le *le, void *arg)
 {
 	struct contact *c = le->data;
 
-	return 0 == pl_strcmp(&c->addr.auri, arg);
+	return 0 == str_cmp(c->key, arg);
 }
 
 
 /**
- * Lookup a SIP uri in all registered contacts
+ * Lookup a SIP uri in all registered contacts. The uri is compared with
+ * the normalized AOR of each contact, so URI parameters are ignored.
  *
  * @param contacts Contacts container
  * @param uri      SIP uri to lookup
@@ -260,11 +327,74 @@ static bool find_handler(struct le *le, void *arg)
  */
 struct contact *contact_find(const struct contacts *contacts, const char *uri)
 {
-	if (!contacts)
+	char key[KEY_MAX];
+	struct pl pl;
+
+	if (!contacts || !uri)
+		return NULL;
+
+	pl_set_str(&pl, uri);
+
+	if (aor_key(key, sizeof(key), &pl))
 		return NULL;
 
-	return list_ledata(hash_lookup(contacts->cht, hash_joaat_str(uri),
-				       find_handler, (void *)uri));
+	return list_ledata(hash_lookup(contacts->cht, hash_joaat_str(key),
+				       find_handler, key));
+}
+
+
+struct name_match {
+	const struct pl *name;
+	contact_apply_h *ah;
+	void *arg;
+	struct contact *c;
+};
+
+
+static bool name_handler(struct le *le, void *arg)
+{
+	struct name_match *nm = arg;
+	struct contact *c = le->data;
+
+	if (pl_casecmp(contact_name(c), nm->name))
+		return false;
+
+	nm->c = c;
+
+	return nm->ah ? nm->ah(c, nm->arg) : true;
+}
+
+
+/**
+ * Apply a handler to the contacts with a given name. The name is the
+ * display name of the contact if set, otherwise the user part of the
+ * SIP uri. The names are compared without case.
+ *
+ * @param contacts Contacts container
+ * @param name     Name to lookup
+ * @param ah       Handler, returns true to stop (optional)
+ * @param arg      Handler argument
+ *
+ * @return The last contact that matched, otherwise NULL
+ */
+struct contact *contact_find_name(const struct contacts *contacts,
+				  const struct pl *name,
+				  contact_apply_h *ah, void *arg)
+{
+	struct name_match nm;
+
+	if (!contacts || !pl_isset(name))
+		return NULL;
+
+	nm.name = name;
+	nm.ah   = ah;
+	nm.arg  = arg;
+	nm.c    = NULL;
+
+	(void)hash_lookup(contacts->nht, hash_joaat_ci(name->p, name->l),
+			  name_handler, &nm);
+
+	return nm.c;
 }
 
 
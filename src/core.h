@@ -18,6 +18,26 @@
 #endif
 
 
+/*
+ * Static probes (USDT) for perf, bpftrace and systemtap, with USE_USDT.
+ * A probe is a nop until a tracer attaches to it, the arguments are
+ * integers or pointers. List them with "perf list sdt_baresip:*" or
+ * "bpftrace -l 'usdt:baresip:*'".
+ */
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+#define PROBE1(name, a)           DTRACE_PROBE1(baresip, name, a)
+#define PROBE2(name, a, b)        DTRACE_PROBE2(baresip, name, a, b)
+#define PROBE3(name, a, b, c)     DTRACE_PROBE3(baresip, name, a, b, c)
+#define PROBE4(name, a, b, c, d)  DTRACE_PROBE4(baresip, name, a, b, c, d)
+#else
+#define PROBE1(name, a)           (void)0
+#define PROBE2(name, a, b)        (void)0
+#define PROBE3(name, a, b, c)     (void)0
+#define PROBE4(name, a, b, c, d)  (void)0
+#endif
+
+
 /**
  * RFC 3551:
  *
@@ -53,7 +73,9 @@ struct account {
 
 	/* parameters: */
 	enum answermode answermode;  /**< Answermode for incoming calls      */
-	struct le acv[8];            /**< List elements for aucodecl         */
+	struct aucodec **aucodecv;   /**< Preferred audio-codecs, in order   */
+	size_t aucodecc;             /**< Number of preferred audio-codecs   */
+	struct le *acv;              /**< List elements for aucodecl         */
 	struct list aucodecl;        /**< List of preferred audio-codecs     */
 	char *auth_user;             /**< Authentication username            */
 	char *auth_pass;             /**< Authentication password            */
@@ -72,10 +94,27 @@ struct account {
 	char *stun_pass;             /**< STUN Password                      */
 	char *stun_host;             /**< STUN Hostname                      */
 	uint16_t stun_port;          /**< STUN Port number                   */
-	struct le vcv[4];            /**< List elements for vidcodecl        */
+	struct vidcodec **vidcodecv; /**< Preferred video-codecs, in order   */
+	size_t vidcodecc;            /**< Number of preferred video-codecs   */
+	struct le *vcv;              /**< List elements for vidcodecl        */
 	struct list vidcodecl;       /**< List of preferred video-codecs     */
+	struct le *acv_sdp;          /**< List elements for aucodec_sdp      */
+	struct list aucodec_sdp;     /**< Audio-codecs usable for the SDP    */
+	uint32_t aucodec_gen;        /**< Codec generation of aucodec_sdp    */
+	struct range aucodec_srate;  /**< Audio config of aucodec_sdp        */
+	struct range aucodec_ch;     /**< Audio config of aucodec_sdp        */
 };
 
+struct list *account_aucodec_sdp(struct account *acc,
+				 const struct config_audio *cfg);
+
+
+/*
+ * Audio Codec
+ */
+
+uint32_t aucodec_generation(void);
+
 
 /*
  * Audio Player
@@ -89,6 +128,7 @@ struct auplay {
 	struct le        le;
 	const char      *name;
 	auplay_alloc_h  *alloch;
+	auplay_debug_h  *debugh;
 };
 
 
@@ -104,14 +144,38 @@ struct ausrc {
 	struct le        le;
 	const char      *name;
 	ausrc_alloc_h   *alloch;
+	ausrc_debug_h   *debugh;
 };
 
 
+/*
+ * Shared audio devices
+ */
+
+struct auplay_sub;
+struct ausrc_sub;
+
+int  auplay_subscribe(struct auplay_sub **subp, const char *name,
+		      struct auplay_prm *prm, const char *dev, bool share,
+		      auplay_write_h *wh, void *arg);
+int  ausrc_subscribe(struct ausrc_sub **subp, struct media_ctx **ctx,
+		     const char *name, struct ausrc_prm *prm, const char *dev,
+		     bool share, ausrc_read_h *rh, ausrc_error_h *errh,
+		     void *arg);
+struct auplay_st *auplay_sub_st(const struct auplay_sub *sub);
+struct ausrc_st  *ausrc_sub_st(const struct ausrc_sub *sub);
+void auplay_sub_gain(struct auplay_sub *sub, uint32_t gain);
+void ausrc_sub_gain(struct ausrc_sub *sub, uint32_t gain);
+int  aushare_warmup(const struct config_audio *cfg);
+void aushare_cooldown(void);
+
+
 /*
  * Audio Stream
  */
 
 struct audio;
+struct avsync;
 
 typedef void (audio_event_h)(int key, bool end, void *arg);
 typedef void (audio_err_h)(int err, const char *str, void *arg);
@@ -132,6 +196,32 @@ struct stream *audio_strm(const struct audio *a);
 int  audio_send_digit(struct audio *a, char key);
 void audio_sdp_attr_decode(struct audio *a);
 int  audio_print_rtpstat(struct re_printf *pf, const struct audio *au);
+int  audio_print_profile(struct re_printf *pf, const struct audio *a);
+void audio_set_avsync(struct audio *a, struct avsync *as);
+bool audio_codec_usable(const struct config_audio *cfg,
+			const struct aucodec *ac);
+
+
+/*
+ * Audio/video lip-sync
+ */
+
+enum avsync_media {
+	AVSYNC_AUDIO = 0,
+	AVSYNC_VIDEO,
+
+	AVSYNC_MEDIA_MAX
+};
+
+int      avsync_alloc(struct avsync **asp);
+void     avsync_sr(struct avsync *as, enum avsync_media media,
+		   uint32_t ntp_sec, uint32_t ntp_frac, uint32_t rtp_ts,
+		   uint32_t srate);
+void     avsync_play(struct avsync *as, enum avsync_media media,
+		     uint32_t rtp_ts, uint32_t delay);
+uint32_t avsync_delay(const struct avsync *as, enum avsync_media media);
+int      avsync_offset(const struct avsync *as, int32_t *offset);
+int      avsync_debug(struct re_printf *pf, const struct avsync *as);
 
 
 /*
@@ -139,10 +229,16 @@ int  audio_print_rtpstat(struct re_printf *pf, const struct audio *au);
  */
 
 struct bfcp;
-int bfcp_alloc(struct bfcp **bfcpp, struct sdp_session *sdp_sess,
-	       const char *proto, bool offerer,
-	       const struct mnat *mnat, struct mnat_sess *mnat_sess);
-int bfcp_start(struct bfcp *bfcp);
+
+typedef void (bfcp_floor_h)(bool granted, void *arg);
+
+int  bfcp_alloc(struct bfcp **bfcpp, struct sdp_session *sdp_sess,
+		const char *proto, bool offerer,
+		const struct mnat *mnat, struct mnat_sess *mnat_sess,
+		int mstrm, bfcp_floor_h *floorh, void *arg);
+int  bfcp_start(struct bfcp *bfcp);
+int  bfcp_floor(struct bfcp *bfcp, bool request);
+bool bfcp_floor_granted(const struct bfcp *bfcp);
 
 
 /*
@@ -161,6 +257,7 @@ struct call_prm {
 	struct sa laddr;
 	enum vidmode vidmode;
 	int af;
+	unsigned loop;       /**< Event loop of the media, 0 for any */
 };
 
 int  call_alloc(struct call **callp, const struct config *cfg,
@@ -179,12 +276,14 @@ int  call_answer(struct call *call, uint16_t scode);
 int  call_sdp_get(const struct call *call, struct mbuf **descp, bool offer);
 int  call_jbuf_stat(struct re_printf *pf, const struct call *call);
 int  call_info(struct re_printf *pf, const struct call *call);
+int  call_setup_stats(struct re_printf *pf, void *unused);
 int  call_reset_transp(struct call *call, const struct sa *laddr);
 int  call_notify_sipfrag(struct call *call, uint16_t scode,
 			 const char *reason, ...);
 int  call_af(const struct call *call);
 void call_set_xrtpstat(struct call *call);
 struct account *call_account(const struct call *call);
+unsigned call_loop(const struct call *call);
 
 
 /*
@@ -197,6 +296,279 @@ int conf_get_csv(const struct conf *conf, const char *name,
 		 char *str1, size_t sz1, char *str2, size_t sz2);
 
 
+/*
+ * Config
+ */
+
+int config_parse_poll(const struct conf *conf);
+
+
+/*
+ * Congestion control
+ */
+
+/** Sender-side bandwidth estimation state */
+struct bwctrl {
+	uint32_t rate;           /**< Current target bitrate [bit/s]        */
+	uint32_t min;            /**< Lower bound of the target [bit/s]     */
+	uint32_t max;            /**< Upper bound of the target [bit/s]     */
+	uint32_t remb;           /**< Last REMB from the receiver, 0 = none */
+	uint8_t fraction;        /**< Last fraction lost (1/256)            */
+	uint32_t n_rr;           /**< Receiver reports processed            */
+	uint32_t n_remb;         /**< REMB messages processed               */
+	uint32_t n_decr;         /**< Number of rate decreases              */
+};
+
+void bwctrl_init(struct bwctrl *bc, uint32_t start, uint32_t min,
+		 uint32_t max);
+bool bwctrl_rr_handler(struct bwctrl *bc, const struct rtcp_rr *rr);
+bool bwctrl_remb_handler(struct bwctrl *bc, struct mbuf *afb);
+int  bwctrl_debug(struct re_printf *pf, const struct bwctrl *bc);
+
+
+/*
+ * CPU budget governor
+ */
+
+int      governor_init(uint32_t budget);
+void     governor_close(void);
+uint64_t governor_clock(void);
+void     governor_frame(uint64_t t0, uint32_t ptime);
+
+
+/*
+ * Admission control
+ */
+
+enum admit_result {
+	ADMIT_ACCEPT = 0,
+	ADMIT_AUDIO,      /**< Answer without video */
+	ADMIT_REJECT,
+};
+
+enum admit_result admit_call(bool video);
+void admit_update(struct admit_cost *cost, unsigned n_video);
+void admit_release(struct admit_cost *cost);
+int  admit_debug(struct re_printf *pf, void *unused);
+
+
+/*
+ * Main loop watchdog
+ */
+
+int  watchdog_init(uint32_t threshold);
+void watchdog_close(void);
+
+
+/*
+ * Event loops of the media
+ */
+
+enum { SHARD_MAX = 32 };
+
+int  shard_init(unsigned n);
+void shard_close(void);
+unsigned shard_next(void);
+void shard_lock(void);
+void shard_unlock(void);
+struct dnsc *shard_dnsc(void);
+
+
+/*
+ * Media kernels
+ */
+
+typedef void (kernel_fn)(void);
+
+/** One implementation of a media kernel */
+struct kernel_impl {
+	const char *isa;          /**< Instruction set, e.g. "sse2"      */
+	uint32_t feat;            /**< CPU features it needs             */
+	kernel_fn *fn;            /**< Function, cast from its own type  */
+};
+
+/** Media kernel, with one implementation per instruction set */
+struct kernel {
+	struct le le;
+	const char *name;                 /**< Kernel name               */
+	kernel_fn **fnp;                  /**< Pointer that is called    */
+	const struct kernel_impl *implv;  /**< C first, best last        */
+	size_t implc;                     /**< Number of implementations */
+	const struct kernel_impl *cur;    /**< Selected implementation   */
+};
+
+void kernel_register(struct kernel *k);
+void kernel_init(void);
+void aupcm_kernels(void);
+void vidscale_kernels(void);
+
+
+/*
+ * Memory accounting
+ */
+
+enum memtag_core {
+	MEMTAG_UA = 0,
+	MEMTAG_CALL,
+	MEMTAG_STREAM,
+	MEMTAG_AUDIO,
+	MEMTAG_VIDEO,
+
+	MEMTAG_CORE_MAX
+};
+
+void memtag_init(void);
+void memtag_close(void);
+struct memtag *memtag_core(enum memtag_core id);
+struct memtag *memtag_register(const char *name);
+
+
+/*
+ * RTP port pool
+ */
+
+int  rtpport_alloc(uint16_t *portp, const struct range *range);
+void rtpport_release(uint16_t port);
+void rtpport_failed(void);
+void rtpport_close(void);
+
+
+/*
+ * Network
+ */
+
+int net_dns_servers(const struct network *net, struct sa *srvv,
+		    uint32_t *n);
+
+
+/*
+ * DNS cache
+ */
+
+struct dnscache;
+
+int  dnscache_alloc(struct dnscache **cachep, struct dnsc *dnsc);
+void dnscache_flush(struct dnscache *cache);
+void dnscache_set_dnsc(struct dnscache *cache, struct dnsc *dnsc);
+int  dnscache_query(struct dnscache *cache, struct net_dnsq **qp,
+		    const char *name, uint16_t type,
+		    dns_query_h *qh, void *arg);
+int  dnscache_debug(struct re_printf *pf, const struct dnscache *cache);
+
+
+/*
+ * Happy Eyeballs
+ */
+
+const char *eyeballs_route(const char *uri);
+void        eyeballs_flush(void);
+
+
+/*
+ * Forward error correction
+ */
+
+struct fec;
+
+typedef void (fec_recover_h)(const struct rtp_header *hdr, struct mbuf *mb,
+			     void *arg);
+
+int  fec_alloc(struct fec **fecp, struct udp_sock *us, uint32_t ssrc,
+	       fec_recover_h *recovh, void *arg);
+void fec_set_pt(struct fec *fec, int pt_tx, int pt_rx);
+void fec_set_loss(struct fec *fec, uint8_t fraction);
+int  fec_send(struct fec *fec, const struct sa *dst);
+void fec_recv_media(struct fec *fec, const struct rtp_header *hdr,
+		    const struct mbuf *mb);
+void fec_recv(struct fec *fec, uint32_t ssrc, struct mbuf *mb);
+int  fec_pt_rx(const struct fec *fec);
+int  fec_debug(struct re_printf *pf, const struct fec *fec);
+
+
+/*
+ * Redundant audio data (RFC 2198)
+ */
+
+enum {
+	RED_DEPTH_MAX = 2,      /**< Max. redundant frames per packet   */
+	RED_BLOCK_MAX = 1023,   /**< Max. length of a redundant block   */
+};
+
+/** Encoded frame, kept to be sent again */
+struct red_frame {
+	uint8_t buf[RED_BLOCK_MAX];
+	size_t len;
+	uint32_t ts;
+	uint8_t pt;
+};
+
+/** RED encoder */
+struct red_enc {
+	struct red_frame framev[RED_DEPTH_MAX];  /**< Oldest first      */
+	unsigned n;             /**< Number of frames in framev         */
+	unsigned depth;         /**< Redundant frames per packet        */
+};
+
+/** Block of a received RED payload */
+struct red_block {
+	const uint8_t *buf;
+	size_t len;
+	uint32_t ts;
+	uint8_t pt;
+};
+
+void red_enc_init(struct red_enc *re, unsigned depth);
+void red_enc_reset(struct red_enc *re);
+int  red_encode(struct red_enc *re, struct mbuf *mb, uint8_t pt,
+		uint32_t ts);
+int  red_decode(struct red_block *blkv, unsigned *blkc, uint32_t ts,
+		const struct mbuf *mb);
+
+
+/*
+ * Housekeeping timers
+ */
+
+typedef void (hktmr_h)(void *arg);
+
+/** Periodic job sharing one timer with all jobs of the same interval */
+struct hktmr {
+	struct le le;             /**< Linked list element              */
+	struct hkbucket *bucket;  /**< Bucket of the interval, or NULL  */
+	hktmr_h *h;               /**< Handler called on every tick     */
+	void *arg;                /**< Handler argument                 */
+};
+
+int  hktmr_start(struct hktmr *ht, uint32_t interval, hktmr_h *h, void *arg);
+void hktmr_cancel(struct hktmr *ht);
+bool hktmr_isrunning(const struct hktmr *ht);
+
+
+/*
+ * Speaker selection
+ */
+
+struct spkgroup;
+
+/** Audio stream in the speaker selection of its player device */
+struct spkent {
+	struct le le;             /**< Linked list element (group)      */
+	struct spkgroup *grp;     /**< Group of the stream, or NULL     */
+	uint64_t ts_voice;        /**< Time of the last voice [ms]      */
+	uint8_t level;            /**< Level of the last voice [-dBov]  */
+	bool known;               /**< The peer sends the audio level   */
+	bool active;              /**< Packets are decoded              */
+	bool speaking;            /**< Voice within the hold time       */
+	bool chosen;              /**< Among the loudest of the group   */
+};
+
+int  speaker_join(struct spkent *e, const char *mod, const char *dev,
+		  uint32_t n);
+void speaker_leave(struct spkent *e);
+void speaker_level(struct spkent *e, uint8_t dbov, bool voice);
+bool speaker_active(const struct spkent *e);
+
+
 /*
  * Media control
  */
@@ -215,6 +587,8 @@ struct mnat {
 	mnat_sess_h *sessh;
 	mnat_media_h *mediah;
 	mnat_update_h *updateh;
+	mnat_trickle_h *trickleh;
+	mnat_rfrag_h *rfragh;
 };
 
 const struct mnat *mnat_find(const struct list *mnatl, const char *id);
@@ -224,27 +598,113 @@ const struct mnat *mnat_find(const struct list *mnatl, const char *id);
  * Metric
  */
 
+enum {
+	METRIC_HIST_IAT  = 16,   /**< Inter-arrival buckets, 2^n [ms]  */
+	METRIC_HIST_SIZE = 12,   /**< Packet size buckets, 2^n [bytes] */
+	METRIC_HIST_DELAY = 20,  /**< Dispatch delay buckets, 2^n [us] */
+};
+
+/*
+ * The counters and histograms are updated with atomic operations, and
+ * may be used from any thread. Read them with metric_snapshot().
+ */
 struct metric {
 	/* internal stuff: */
-	struct tmr tmr;
+	struct hktmr tmr;
 	uint64_t ts_start;
-	bool started;
+	uint64_t ts_prev;
 
 	/* counters: */
-	uint32_t n_packets;
-	uint32_t n_bytes;
-	uint32_t n_err;
+	uint64_t n_packets;
+	uint64_t n_bytes;
+	uint64_t n_err;
+
+	/* histograms: */
+	uint64_t iatv[METRIC_HIST_IAT];
+	uint64_t sizev[METRIC_HIST_SIZE];
+	uint64_t delayv[METRIC_HIST_DELAY];
 
 	/* bitrate calculation */
 	uint32_t cur_bitrate;
 	uint64_t ts_last;
-	uint32_t n_bytes_last;
+	uint64_t n_bytes_last;
+};
+
+/** A consistent copy of the metric counters */
+struct metric_snapshot {
+	uint64_t n_packets;                 /**< Number of packets        */
+	uint64_t n_bytes;                   /**< Number of bytes          */
+	uint64_t n_err;                     /**< Number of errors         */
+	uint32_t cur_bitrate;               /**< Bitrate of last period   */
+	uint32_t avg_bitrate;               /**< Bitrate since start      */
+	uint64_t iatv[METRIC_HIST_IAT];     /**< Inter-arrival histogram  */
+	uint64_t sizev[METRIC_HIST_SIZE];   /**< Packet size histogram    */
+	uint64_t delayv[METRIC_HIST_DELAY]; /**< Dispatch delay histogram */
 };
 
 void     metric_init(struct metric *metric);
 void     metric_reset(struct metric *metric);
 void     metric_add_packet(struct metric *metric, size_t packetsize);
+void     metric_add_packet_at(struct metric *metric, size_t packetsize,
+			      uint64_t ts);
+void     metric_add_delay(struct metric *metric, uint64_t delay);
+void     metric_add_error(struct metric *metric);
+uint64_t metric_n_packets(const struct metric *metric);
+uint64_t metric_n_err(const struct metric *metric);
+uint64_t metric_ts_start(const struct metric *metric);
 uint32_t metric_avg_bitrate(const struct metric *metric);
+void     metric_snapshot(const struct metric *metric,
+			 struct metric_snapshot *snap);
+int      metric_debug(struct re_printf *pf, const struct metric *metric);
+
+
+/*
+ * Media pipeline profiler
+ */
+
+enum {
+	PIPEPROF_STAGES = 16,    /**< Stages per direction             */
+	PIPEPROF_HIST   = 16,    /**< Stage time buckets, 2^n [us]     */
+	PIPEPROF_LAT    = 256,   /**< Latency buckets, 1 [ms] each     */
+};
+
+struct pipeprof_stage {
+	const char *name;        /**< Stage name, static string        */
+	uint64_t n;              /**< Number of frames                 */
+	uint64_t sum;            /**< Total time [ns]                  */
+	uint64_t max;            /**< Longest time [ns]                */
+	uint64_t histv[PIPEPROF_HIST]; /**< Time histogram             */
+};
+
+struct pipeprof {
+	struct pipeprof_stage stagev[PIPEPROF_STAGES];
+	uint64_t t;              /**< End of the previous stage [ns]   */
+	unsigned i;              /**< Index of the next stage          */
+	bool enabled;            /**< Timing is taken                  */
+};
+
+/** End-to-end latency of frames, one writer thread */
+struct pipeprof_lat {
+	uint64_t n;              /**< Number of frames                 */
+	uint64_t histv[PIPEPROF_LAT]; /**< Latency histogram           */
+};
+
+void     pipeprof_init(struct pipeprof *pp, bool enabled);
+uint64_t pipeprof_stamp(const struct pipeprof *pp);
+void     pipeprof_begin(struct pipeprof *pp, uint64_t t0);
+void     pipeprof_mark(struct pipeprof *pp, const char *name);
+int      pipeprof_debug(struct re_printf *pf, const struct pipeprof *pp);
+void     pipeprof_lat_add(struct pipeprof_lat *pl, uint64_t t0);
+unsigned pipeprof_lat_pct(const struct pipeprof_lat *pl, unsigned pct);
+int      pipeprof_lat_debug(struct re_printf *pf,
+			    const struct pipeprof_lat *pl);
+
+
+/*
+ * Message
+ */
+
+int message_debug(struct re_printf *pf, void *unused);
 
 
 /*
@@ -252,7 +712,10 @@ uint32_t metric_avg_bitrate(const struct metric *metric);
  */
 
 int module_init(const struct conf *conf);
+void module_close(void);
 void module_app_unload(void);
+const struct aucodec  *module_lazy_aucodec(const struct aucodec *ac);
+const struct vidcodec *module_lazy_vidcodec(const struct vidcodec *vc);
 
 
 /*
@@ -269,6 +732,87 @@ bool reg_isok(const struct reg *reg);
 int  reg_sipfd(const struct reg *reg);
 int  reg_debug(struct re_printf *pf, const struct reg *reg);
 int  reg_status(struct re_printf *pf, const struct reg *reg);
+int  reg_queue_debug(struct re_printf *pf, void *unused);
+int  reg_conn_debug(struct re_printf *pf);
+
+
+/*
+ * RTP batched send
+ */
+
+struct rtpbatch;
+
+int  rtpbatch_alloc(struct rtpbatch **bp, struct udp_sock *us,
+		    uint32_t size, bool uring);
+void rtpbatch_begin(struct rtpbatch *b);
+int  rtpbatch_flush(struct rtpbatch *b);
+int  rtpbatch_debug(struct re_printf *pf, const struct rtpbatch *b);
+
+
+/*
+ * RTP retransmission
+ */
+
+struct rtxcache;
+
+int      rtxcache_alloc(struct rtxcache **rcp, struct udp_sock *us,
+			uint32_t ssrc);
+unsigned rtxcache_resend(struct rtxcache *rc, uint16_t pid, uint16_t blp);
+int      rtxcache_debug(struct re_printf *pf, const struct rtxcache *rc);
+
+
+/*
+ * RTCP Extended Reports
+ */
+
+/** VoIP Metrics report block (RFC 3611 section 4.7) */
+struct rtcpxr_voip {
+	uint32_t ssrc;           /**< SSRC of the reported stream          */
+	uint8_t loss_rate;       /**< Fraction lost [1/256]                */
+	uint8_t discard_rate;    /**< Fraction discarded [1/256]           */
+	uint8_t burst_density;   /**< Fraction lost or discarded in bursts */
+	uint8_t gap_density;     /**< Fraction lost or discarded in gaps   */
+	uint16_t burst_duration; /**< Mean burst duration [ms]             */
+	uint16_t gap_duration;   /**< Mean gap duration [ms]               */
+	uint16_t rtt;            /**< Round-trip delay [ms]                */
+	uint16_t es_delay;       /**< End system delay [ms]                */
+	uint8_t r_factor;        /**< R factor, 127 = unavailable          */
+	uint8_t mos_lq;          /**< Listening quality MOS x 10           */
+	uint8_t mos_cq;          /**< Conversational quality MOS x 10      */
+	uint8_t rx_config;       /**< PLC, jitter buffer adaptive and rate */
+	uint16_t jb_nominal;     /**< Jitter buffer nominal delay [ms]     */
+	uint16_t jb_max;         /**< Jitter buffer maximum delay [ms]     */
+	uint16_t jb_abs_max;     /**< Jitter buffer absolute maximum [ms]  */
+};
+
+struct rtcpxr;
+
+typedef void (rtcpxr_voip_h)(const struct rtcpxr_voip *v, void *arg);
+
+int  rtcpxr_alloc(struct rtcpxr **xrp, struct rtp_sock *rtp,
+		  rtcpxr_voip_h *voiph, void *arg);
+void rtcpxr_voip_calc(struct rtcpxr_voip *v, uint32_t ssrc,
+		      const struct stream_stats *st, bool adaptive);
+int  rtcpxr_encode(struct mbuf *mb, uint32_t ssrc,
+		   const struct rtcpxr_voip *v);
+int  rtcpxr_voip_debug(struct re_printf *pf, const struct rtcpxr_voip *v);
+
+
+/*
+ * RTP header extensions
+ */
+
+struct rtpext;
+
+int  rtpext_alloc(struct rtpext **xp, struct udp_sock *us, uint32_t ssrc,
+		  uint16_t *seqp, bool audio);
+int  rtpext_sdp_offer(const struct rtpext *x, struct sdp_media *m);
+void rtpext_sdp_decode(struct rtpext *x, struct sdp_media *m);
+void rtpext_set_audio_level(struct rtpext *x, uint8_t dbov);
+int  rtpext_audio_level_rx(const struct rtpext *x,
+			   const struct rtp_header *hdr,
+			   const struct mbuf *mb, uint8_t *dbov, bool *voice);
+int  rtpext_debug(struct re_printf *pf, const struct rtpext *x);
 
 
 /*
@@ -282,6 +826,14 @@ int  rtpkeep_alloc(struct rtpkeep **rkp, const char *method, int proto,
 void rtpkeep_refresh(struct rtpkeep *rk, uint32_t ts);
 
 
+/*
+ * RTP receive timestamps
+ */
+
+int rxts_enable(struct udp_sock *us);
+int rxts_delay(struct udp_sock *us, int af, uint64_t *delay);
+
+
 /*
  * SDP
  */
@@ -296,13 +848,35 @@ const struct sdp_format *sdp_media_format_cycle(struct sdp_media *m);
 
 struct rtp_header;
 
-enum {STREAM_PRESZ = 4+12}; /* same as RTP_HEADER_SIZE */
+enum {STREAM_PRESZ = 4+12+16}; /* RTP header and extensions */
+enum {STREAM_SIMULCAST_MAX = 3}; /* number of simulcast layers */
 
 typedef void (stream_rtp_h)(const struct rtp_header *hdr, struct mbuf *mb,
 			    void *arg);
 typedef void (stream_rtcp_h)(struct rtcp_msg *msg, void *arg);
 
 typedef void (stream_error_h)(struct stream *strm, int err, void *arg);
+typedef void (stream_bw_h)(uint32_t bps, void *arg);
+typedef void (stream_loss_h)(uint8_t fraction, void *arg);
+
+
+/** Adaptive jitter buffer state */
+struct jbuf_adapt {
+	int64_t transit;         /**< Relative transit time of last packet  */
+	uint32_t jitter;         /**< RFC 3550 inter-arrival jitter [us]    */
+	uint32_t frame_us;       /**< Estimated frame duration [us]         */
+	uint32_t ts_prev;        /**< RTP timestamp of last packet          */
+	uint16_t seq_prev;       /**< Sequence number of last packet        */
+	bool valid;              /**< Previous packet values are valid      */
+	uint32_t depth;          /**< Frames currently in jitter buffer     */
+	uint32_t target;         /**< Target delay in frames                */
+	uint32_t n_late;         /**< Packets arriving too late             */
+	uint32_t n_dup;          /**< Duplicate packets                     */
+	uint32_t n_drop;         /**< Frames dropped, shrink or overflow    */
+	uint32_t n_grow;         /**< Reads skipped to grow the delay       */
+	uint32_t extra;          /**< Added delay for lip-sync [us]         */
+	bool smooth;             /**< Deliver instead of dropping frames    */
+};
 
 
 /** Defines a generic media stream */
@@ -312,15 +886,26 @@ struct stream {
 	struct call *call;       /**< Ref. to call object                   */
 	struct sdp_media *sdp;   /**< SDP Media line                        */
 	struct rtp_sock *rtp;    /**< RTP Socket                            */
+	uint16_t rtp_port;       /**< Port from the RTP port pool           */
 	struct rtpkeep *rtpkeep; /**< RTP Keepalive                         */
 	struct rtcp_stats rtcp_stats;/**< RTCP statistics                   */
 	struct jbuf *jbuf;       /**< Jitter Buffer for incoming RTP        */
+	struct vidbuf *vbuf;     /**< Frame buffer for incoming video       */
+	struct reorder *reord;   /**< Reorder window, without a jitter buf. */
+	struct jbuf_adapt jba;   /**< Adaptive jitter buffer state          */
+	struct bwctrl bwc;       /**< Congestion control for sending        */
+	stream_bw_h *bwh;        /**< Target bitrate handler, or NULL       */
+	void *bwh_arg;           /**< Target bitrate handler argument       */
+	stream_loss_h *lossh;    /**< Reported packet loss handler, or NULL */
+	void *lossh_arg;         /**< Reported packet loss handler argument */
+	uint32_t srate_rx;       /**< RTP clock rate for receiving          */
 	struct mnat_media *mns;  /**< Media NAT traversal state             */
 	const struct menc *menc; /**< Media encryption module               */
 	struct menc_sess *mencs; /**< Media encryption session state        */
 	struct menc_media *mes;  /**< Media Encryption media state          */
 	struct metric metric_tx; /**< Metrics for transmit                  */
 	struct metric metric_rx; /**< Metrics for receiving                 */
+	struct log_rl rl_drop;   /**< Rate limit for dropped RTP messages   */
 	char *cname;             /**< RTCP Canonical end-point identifier   */
 	uint32_t ssrc_rx;        /**< Incoming syncronizing source          */
 	uint32_t pseq;           /**< Sequence number for incoming RTP      */
@@ -333,10 +918,65 @@ struct stream {
 	void *arg;               /**< Handler argument                      */
 	stream_error_h *errorh;  /**< Stream error handler                  */
 	void *errorh_arg;        /**< Error handler argument                */
-	struct tmr tmr_rtp;      /**< Timer for detecting RTP timeout       */
+	struct hktmr tmr_rtp;    /**< Timer for detecting RTP timeout       */
 	uint64_t ts_last;        /**< Timestamp of last received RTP pkt    */
 	bool terminated;         /**< Stream is terminated flag             */
 	uint32_t rtp_timeout_ms; /**< RTP Timeout value in [ms]             */
+	struct rtpbatch *batch;  /**< Batched sender, created on first use  */
+	bool batch_failed;       /**< Batched sending is not available      */
+	struct rtxcache *rtx;    /**< Send history for retransmission       */
+	bool nack;               /**< Send NACK for lost packets            */
+	bool nack_valid;         /**< nack_seq is valid                     */
+	uint16_t nack_seq;       /**< Highest sequence number received      */
+	uint64_t nack_ts;        /**< Time of last NACK sent                */
+	uint32_t n_nack;         /**< Number of NACK items sent             */
+	struct {
+		struct mbuf *mb;     /**< RTCP feedback waiting to be sent */
+		struct tmr tmr;      /**< Sends the feedback               */
+		uint64_t n_msg;      /**< Feedback messages                */
+		uint32_t n_pkt;      /**< RTCP packets they were sent in   */
+	} fb;
+	uint32_t fb_pli;         /**< Packet of the PLI waiting, plus one   */
+	struct fec *fec;         /**< Forward error correction, optional    */
+	int fec_pt;              /**< Local payload type for FEC            */
+	struct stream *base;     /**< Stream owning the shared socket       */
+	uint32_t n_bundle;       /**< Streams sharing our socket            */
+	uint32_t ssrc_sig;       /**< Incoming SSRC signalled in SDP        */
+	bool rxts;               /**< Use kernel receive timestamps         */
+	struct rtpext *ext;      /**< RTP header extensions                 */
+	struct rtcpxr *xr;       /**< RTCP XR receiver of the socket owner  */
+	struct hktmr tmr_xr;     /**< Timer for sending RTCP XR             */
+	struct rtcpxr_voip xr_tx;/**< VoIP Metrics sent last                */
+	struct rtcpxr_voip xr_rx;/**< VoIP Metrics received last            */
+	uint32_t n_xr_rx;        /**< Number of VoIP Metrics received       */
+	struct mos_est mos;      /**< MOS of the received audio             */
+	uint16_t twcc_seq;       /**< Transport-wide sequence number        */
+	struct rtp_sock *simv[STREAM_SIMULCAST_MAX - 1]; /**< Lower layers  */
+	unsigned n_sim;          /**< Number of lower simulcast layers      */
+	bool sim_active;         /**< Peer accepted simulcast               */
+	uint32_t ts_tx;          /**< RTP timestamp of last packet sent     */
+	struct stream *relay;    /**< Received RTP is sent on this stream   */
+	struct stream *relay_src;/**< Stream whose RTP is sent on this one  */
+	int relay_pt_in;         /**< Last relayed payload type             */
+	int relay_pt_out;        /**< Payload type it is sent with, or -1   */
+	uint32_t relay_ts_off;   /**< Offset added to relayed timestamps    */
+	bool relay_sync;         /**< Timestamp offset must be updated      */
+	uint64_t n_relay;        /**< Number of packets relayed             */
+	struct list relay_q;     /**< Relayed packets waiting for the delay */
+	struct tmr relay_tmr;    /**< Sends the delayed packets             */
+	uint32_t relay_delay;    /**< Delay of relayed packets [ms]         */
+	struct avsync *avsync;   /**< Lip-sync of the call, or NULL         */
+	enum avsync_media avsync_media; /**< Media of this stream           */
+	struct {
+		uint64_t n_samp;     /**< Audio samples decoded           */
+		uint64_t n_conceal;  /**< Samples of them concealed       */
+		uint64_t n_fec;      /**< Samples of them from FEC data   */
+	} plc;
+	struct {
+		bool valid;          /**< Reported by the sender          */
+		uint32_t age;        /**< Age of oldest packet [ms]       */
+		uint64_t n_drop;     /**< Frames dropped, too old         */
+	} sendq;
 };
 
 int  stream_alloc(struct stream **sp, const struct config_avt *cfg,
@@ -362,6 +1002,105 @@ void stream_set_error_handler(struct stream *strm,
 int  stream_debug(struct re_printf *pf, const struct stream *s);
 int  stream_print(struct re_printf *pf, const struct stream *s);
 void stream_enable_rtp_timeout(struct stream *strm, uint32_t timeout_ms);
+void stream_jbuf_smooth(struct stream *s, bool enable);
+void stream_jbuf_delay(struct stream *s, uint32_t delay);
+int  stream_jbuf_reset(struct stream *s, uint32_t min, uint32_t max);
+void stream_sendq_report(struct stream *s, uint32_t age, uint64_t n_drop);
+void stream_set_avsync(struct stream *s, struct avsync *as,
+		       enum avsync_media media);
+void stream_batch_begin(struct stream *s);
+void stream_batch_flush(struct stream *s);
+int  stream_enable_fec(struct stream *s, uint32_t srate);
+int  stream_enable_rtx(struct stream *s);
+unsigned stream_resend(struct stream *s, uint16_t pid, uint16_t blp);
+void stream_set_nack(struct stream *s, bool enable);
+bool stream_nack_pending(const struct stream *s);
+void stream_set_audio_level(struct stream *s, uint8_t dbov);
+int  stream_rx_audio_level(const struct stream *s,
+			   const struct rtp_header *hdr,
+			   const struct mbuf *mb, uint8_t *dbov, bool *voice);
+void stream_plc_count(struct stream *s, size_t sampc, bool concealed,
+		      bool fec);
+void stream_set_bw_handler(struct stream *s, uint32_t min, uint32_t max,
+			   stream_bw_h *bwh, void *arg);
+void stream_set_loss_handler(struct stream *s, stream_loss_h *lossh,
+			     void *arg);
+int  stream_enable_simulcast(struct stream *s, unsigned layers);
+unsigned stream_simulcast_layers(const struct stream *s);
+int  stream_send_layer(struct stream *s, unsigned layer, bool marker,
+		       int pt, uint32_t ts, struct mbuf *mb);
+int  stream_relay(struct stream *s, struct stream *dst);
+int  stream_reflect(struct stream *s, bool enable, uint32_t delay);
+bool stream_is_relayed(const struct stream *s);
+bool stream_is_reflected(const struct stream *s);
+bool stream_is_sending(const struct stream *s);
+
+/* selftest hooks */
+int  stream_test_alloc(struct stream **sp, const struct config_avt *cfg,
+		       uint32_t srate, stream_rtp_h *rtph, void *arg);
+void stream_test_recv(struct stream *s, const struct rtp_header *hdr,
+		      struct mbuf *mb, uint64_t arrival);
+
+
+/*
+ * Time-scale modification (WSOLA)
+ */
+
+struct wsola;
+
+int    wsola_alloc(struct wsola **wp, uint32_t srate, uint8_t ch);
+size_t wsola_process(struct wsola *w, int16_t *outv, size_t outsz,
+		     const int16_t *inv, size_t inc, int dir);
+int    wsola_debug(struct re_printf *pf, const struct wsola *w);
+
+
+/*
+ * Clock-drift compensation
+ */
+
+struct audrift;
+
+int    audrift_alloc(struct audrift **dp, uint32_t srate, uint8_t ch);
+size_t audrift_process(struct audrift *d, int16_t *outv, size_t outsz,
+		       const int16_t *inv, size_t inc, size_t fill);
+int    audrift_debug(struct re_printf *pf, const struct audrift *d);
+
+
+/*
+ * Resampler
+ */
+
+struct resamp;
+
+int resamp_alloc(struct resamp **rsp, uint32_t irate, uint8_t ich,
+		 uint32_t orate, uint8_t och);
+int resamp_process(struct resamp *rs, int16_t *outv, size_t *outc,
+		   const int16_t *inv, size_t inc);
+int resamp_layout(struct resamp *rs, enum aulayout ilayout,
+		  enum aulayout olayout);
+int resamp_debug(struct re_printf *pf, const struct resamp *rs);
+
+
+/*
+ * Audio transmit worker pool
+ */
+
+struct txpool_shard;
+
+typedef void (txpool_poll_h)(void *arg);
+
+/** Defines an entry in the shared transmit pool */
+struct txpool_entry {
+	struct le le;                /**< Linked list element (shard)  */
+	struct txpool_shard *shard;  /**< Owning shard, NULL if idle   */
+	txpool_poll_h *pollh;        /**< Poll handler                 */
+	void *arg;                   /**< Handler argument             */
+};
+
+int  txpool_attach(struct txpool_entry *ent, unsigned nthreads,
+		   uint32_t key, txpool_poll_h *pollh, void *arg);
+void txpool_detach(struct txpool_entry *ent);
+void txpool_signal(struct txpool_entry *ent);
 
 
 /*
@@ -373,11 +1112,56 @@ struct ua;
 void         ua_event(struct ua *ua, enum ua_event ev, struct call *call,
 		      const char *fmt, ...);
 void         ua_printf(const struct ua *ua, const char *fmt, ...);
+int          ua_drain_debug(struct re_printf *pf);
 
 struct tls  *uag_tls(void);
 const char  *uag_allowed_methods(void);
 
 
+/*
+ * Video frame assembly buffer
+ */
+
+/** Video frame buffer statistics */
+struct vidbuf_stat {
+	uint32_t n_put;          /**< Packets put in the buffer             */
+	uint32_t n_get;          /**< Frames given out                      */
+	uint32_t n_incomplete;   /**< Frames given out with missing packets */
+	uint32_t n_late;         /**< Packets after their frame was out     */
+	uint32_t n_overflow;     /**< Frames given out early, buffer full   */
+	uint32_t delay;          /**< Assembly time of the last frame [ms]  */
+};
+
+struct vidbuf;
+
+typedef void (vidbuf_h)(const struct rtp_header *hdr, struct mbuf *mb,
+			void *arg);
+
+int  vidbuf_alloc(struct vidbuf **vbp, uint32_t wait, vidbuf_h *h,
+		  void *arg);
+int  vidbuf_put(struct vidbuf *vb, const struct rtp_header *hdr,
+		struct mbuf *mb);
+void vidbuf_flush(struct vidbuf *vb);
+int  vidbuf_stats(const struct vidbuf *vb, struct vidbuf_stat *st);
+int  vidbuf_debug(struct re_printf *pf, const struct vidbuf *vb);
+
+
+/*
+ * RTP reorder window
+ */
+
+struct reorder;
+
+typedef void (reorder_h)(const struct rtp_header *hdr, struct mbuf *mb,
+			 void *arg);
+
+int  reorder_alloc(struct reorder **rop, reorder_h *h, void *arg);
+void reorder_put(struct reorder *ro, const struct rtp_header *hdr,
+		 struct mbuf *mb);
+void reorder_flush(struct reorder *ro);
+int  reorder_debug(struct re_printf *pf, const struct reorder *ro);
+
+
 /*
  * Video Display
  */
@@ -407,6 +1191,46 @@ struct vidsrc {
 
 struct vidsrc *vidsrc_get(struct vidsrc_st *st);
 
+struct vidsrc_sub;
+
+int vidsrc_subscribe(struct vidsrc_sub **subp, const char *name,
+		     const struct vidsrc_prm *prm, const struct vidsz *size,
+		     const char *dev, vidsrc_frame_h *frameh,
+		     vidsrc_error_h *errorh, void *arg);
+struct vidsrc_st *vidsrc_sub_st(const struct vidsrc_sub *sub);
+uint32_t vidsrc_sub_count(const struct vidsrc_sub *sub);
+
+
+/*
+ * Shared video encoder
+ */
+
+struct encshare_sub;
+
+typedef int (encshare_packet_h)(bool marker, uint32_t ts,
+				const uint8_t *hdr, size_t hdr_len,
+				const uint8_t *pld, size_t pld_len, void *arg);
+
+int  encshare_subscribe(struct encshare_sub **subp, const void *src,
+			const struct vidsz *size, struct vidcodec *vc,
+			const struct videnc_param *prm, const char *fmtp,
+			uint32_t ts, encshare_packet_h *pkth, void *arg);
+int  encshare_encode(struct encshare_sub *sub, bool picup, uint32_t bitrate,
+		     const struct vidframe *frame, uint32_t ts);
+uint32_t encshare_count(const struct encshare_sub *sub);
+
+
+/*
+ * Changed regions of a video picture
+ */
+
+struct vidchange;
+
+int  vidchange_alloc(struct vidchange **vcp, uint32_t hold);
+bool vidchange_update(struct vidchange *vc, const struct vidframe *frame);
+const uint8_t *vidchange_map(const struct vidchange *vc,
+			     unsigned *cols, unsigned *rows);
+
 
 /*
  * Video Stream
@@ -415,6 +1239,7 @@ struct vidsrc *vidsrc_get(struct vidsrc_st *st);
 struct video;
 
 typedef void (video_err_h)(int err, const char *str, void *arg);
+typedef void (video_bw_h)(uint32_t bps, void *arg);
 
 int  video_alloc(struct video **vp, const struct config *cfg,
 		 struct call *call, struct sdp_session *sdp_sess, int label,
@@ -432,4 +1257,16 @@ int  video_decoder_set(struct video *v, struct vidcodec *vc, int pt_rx,
 struct stream *video_strm(const struct video *v);
 void video_update_picture(struct video *v);
 void video_sdp_attr_decode(struct video *v);
+void video_set_avsync(struct video *v, struct avsync *as);
+int  video_present(struct video *v, const char *mod, const char *dev);
+void video_set_bw_handler(struct video *v, video_bw_h *bwh, void *arg);
+void video_set_bitrate(struct video *v, uint32_t bps);
 int  video_print(struct re_printf *pf, const struct video *v);
+int  video_print_profile(struct re_printf *pf, const struct video *v);
+
+/* selftest hooks */
+int  video_test_alloc(struct video **vp, struct stream *strm,
+		      uint32_t bitrate);
+int  video_test_queue(struct video *v, bool marker, uint32_t ts,
+		      const uint8_t *pld, size_t pld_len);
+void video_test_poll(struct video *v, uint64_t jfs, uint64_t prev_jfs);
@@ -0,0 +1,595 @@
+/**
+ * @file dnscache.c  Cache of DNS answers
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * Answers are cached by name and type for the lowest TTL of the answer.
+ * An answer that was used since it was resolved is refreshed in the
+ * background shortly before it expires, so that popular names stay in
+ * the cache. If the refresh fails, the old answer is used for a grace
+ * period. Failed lookups are kept in a smaller negative cache.
+ *
+ * Lookups of a name that is being resolved wait for the same query.
+ */
+
+
+enum {
+	CACHE_HASH_SIZE = 256,
+	CACHE_MAX = 1024,       /**< Positive entries                  */
+	NEG_MAX   = 256,        /**< Negative entries                  */
+	TTL_MIN   = 5,          /**< Shortest TTL [s]                  */
+	TTL_MAX   = 3600,       /**< Longest TTL [s]                   */
+	NEG_TTL   = 30,         /**< TTL of a negative entry [s]       */
+	STALE_TTL = 60,         /**< Grace after a failed refresh [s]  */
+};
+
+struct dnscache {
+	struct hash *ht;        /**< Entries by name and type          */
+	struct list entl;       /**< Positive entries, oldest first    */
+	struct list negl;       /**< Negative entries, oldest first    */
+	struct dnsc *dnsc;      /**< DNS Client                        */
+	uint64_t n_hit;         /**< Answers from the cache            */
+	uint64_t n_miss;        /**< Answers from a query              */
+	uint64_t n_neg;         /**< Failures from the negative cache  */
+	uint64_t n_refresh;     /**< Refreshes before expiry           */
+	uint64_t n_stale;       /**< Failed refreshes                  */
+};
+
+struct dnsent {
+	struct le he;           /**< Hash element                      */
+	struct le le;           /**< In entl or negl                   */
+	struct dnscache *cache;
+	char *name;
+	uint16_t type;
+	struct dnshdr hdr;
+	struct list ansl;       /**< Copy of the answer records        */
+	struct list addl;       /**< Copy of the additional records    */
+	struct list reql;       /**< Lookups waiting for the query     */
+	struct dns_query *q;    /**< Query in progress                 */
+	struct tmr tmr;         /**< Refresh or expiry                 */
+	uint64_t expires;       /**< Expiry time [ms]                  */
+	int err;                /**< Error of a negative entry         */
+	bool valid;             /**< Has an answer or an error         */
+	bool used;              /**< Used since it was resolved        */
+};
+
+struct net_dnsq {
+	struct le le;
+	struct tmr tmr;
+	struct dnsent *ent;
+	dns_query_h *qh;
+	void *arg;
+};
+
+
+static void query_handler(int err, const struct dnshdr *hdr,
+			  struct list *ansl, struct list *authl,
+			  struct list *addl, void *arg);
+
+
+static void ent_destructor(void *arg)
+{
+	struct dnsent *ent = arg;
+
+	tmr_cancel(&ent->tmr);
+	hash_unlink(&ent->he);
+	list_unlink(&ent->le);
+	mem_deref(ent->q);
+	list_flush(&ent->ansl);
+	list_flush(&ent->addl);
+	mem_deref(ent->name);
+}
+
+
+static void req_destructor(void *arg)
+{
+	struct net_dnsq *req = arg;
+
+	tmr_cancel(&req->tmr);
+	list_unlink(&req->le);
+	mem_deref(req->ent);
+}
+
+
+static void cache_destructor(void *arg)
+{
+	struct dnscache *cache = arg;
+
+	dnscache_flush(cache);
+	mem_deref(cache->ht);
+	mem_deref(cache->dnsc);
+}
+
+
+static void ent_remove(struct dnsent *ent)
+{
+	hash_unlink(&ent->he);
+	list_unlink(&ent->le);
+	tmr_cancel(&ent->tmr);
+	mem_deref(ent);
+}
+
+
+static bool ent_cmp_handler(struct le *le, void *arg)
+{
+	const struct dnsent *ent = le->data;
+	const struct dnsent *key = arg;
+
+	return ent->type == key->type && 0 == str_casecmp(ent->name,
+							  key->name);
+}
+
+
+static uint32_t ent_hash(const char *name, uint16_t type)
+{
+	return hash_joaat_ci(name, str_len(name)) ^ type;
+}
+
+
+static int str_dup_opt(char **dst, const char *src)
+{
+	return src ? str_dup(dst, src) : 0;
+}
+
+
+static struct dnsrr *rr_dup(const struct dnsrr *rr)
+{
+	struct dnsrr *cp;
+	int err;
+
+	cp = dns_rr_alloc();
+	if (!cp)
+		return NULL;
+
+	cp->type     = rr->type;
+	cp->dnsclass = rr->dnsclass;
+	cp->ttl      = rr->ttl;
+	cp->rdlen    = rr->rdlen;
+
+	err = str_dup_opt(&cp->name, rr->name);
+
+	switch (rr->type) {
+
+	case DNS_TYPE_A:
+		cp->rdata.a = rr->rdata.a;
+		break;
+
+	case DNS_TYPE_AAAA:
+		cp->rdata.aaaa = rr->rdata.aaaa;
+		break;
+
+	case DNS_TYPE_CNAME:
+		err |= str_dup_opt(&cp->rdata.cname.cname,
+				   rr->rdata.cname.cname);
+		break;
+
+	case DNS_TYPE_SRV:
+		cp->rdata.srv.pri    = rr->rdata.srv.pri;
+		cp->rdata.srv.weight = rr->rdata.srv.weight;
+		cp->rdata.srv.port   = rr->rdata.srv.port;
+		err |= str_dup_opt(&cp->rdata.srv.target,
+				   rr->rdata.srv.target);
+		break;
+
+	case DNS_TYPE_NAPTR:
+		cp->rdata.naptr.order = rr->rdata.naptr.order;
+		cp->rdata.naptr.pref  = rr->rdata.naptr.pref;
+		err |= str_dup_opt(&cp->rdata.naptr.flags,
+				   rr->rdata.naptr.flags);
+		err |= str_dup_opt(&cp->rdata.naptr.services,
+				   rr->rdata.naptr.services);
+		err |= str_dup_opt(&cp->rdata.naptr.regexp,
+				   rr->rdata.naptr.regexp);
+		err |= str_dup_opt(&cp->rdata.naptr.replace,
+				   rr->rdata.naptr.replace);
+		break;
+
+	default:
+		/* not used by the callers of the cache */
+		err = ENOTSUP;
+		break;
+	}
+
+	if (err)
+		return mem_deref(cp);
+
+	return cp;
+}
+
+
+/* Copy the records, and return the lowest TTL */
+static uint32_t rrlist_copy(struct list *dst, const struct list *src)
+{
+	uint32_t ttl = TTL_MAX;
+	struct le *le;
+
+	for (le = list_head(src); le; le = le->next) {
+
+		const struct dnsrr *rr = le->data;
+		struct dnsrr *cp = rr_dup(rr);
+
+		if (!cp)
+			continue;
+
+		list_append(dst, &cp->le, cp);
+
+		if ((uint64_t)rr->ttl < ttl)
+			ttl = (uint32_t)rr->ttl;
+	}
+
+	return ttl;
+}
+
+
+static void req_deliver(struct net_dnsq *req)
+{
+	struct dnsent *ent = req->ent;
+	struct list authl = LIST_INIT;
+
+	list_unlink(&req->le);
+
+	/* the handler may release the request */
+	req->qh(ent->err, ent->err ? NULL : &ent->hdr, &ent->ansl, &authl,
+		&ent->addl, req->arg);
+}
+
+
+static void req_tmr_handler(void *arg)
+{
+	req_deliver(arg);
+}
+
+
+static void reql_deliver(struct dnsent *ent)
+{
+	struct le *le;
+
+	while ((le = list_head(&ent->reql)))
+		req_deliver(le->data);
+}
+
+
+static void trim(struct list *lst, unsigned max)
+{
+	struct le *le = list_head(lst);
+
+	while (le && list_count(lst) > max) {
+
+		struct dnsent *ent = le->data;
+
+		le = le->next;
+
+		if (!ent->q && list_isempty(&ent->reql))
+			ent_remove(ent);
+	}
+}
+
+
+static int ent_query(struct dnsent *ent)
+{
+	struct dnscache *cache = ent->cache;
+
+	if (ent->q)
+		return 0;
+
+	return dnsc_query(&ent->q, cache->dnsc, ent->name, ent->type,
+			  DNS_CLASS_IN, true, query_handler, ent);
+}
+
+
+static void expire_handler(void *arg)
+{
+	struct dnsent *ent = arg;
+
+	/* a query in progress updates the entry */
+	if (ent->q || !list_isempty(&ent->reql))
+		return;
+
+	ent_remove(ent);
+}
+
+
+static void refresh_handler(void *arg)
+{
+	struct dnsent *ent = arg;
+	const uint64_t now = tmr_jiffies();
+
+	tmr_start(&ent->tmr, ent->expires > now ? ent->expires - now : 0,
+		  expire_handler, ent);
+
+	if (!ent->used)
+		return;
+
+	if (0 == ent_query(ent))
+		++ent->cache->n_refresh;
+}
+
+
+static void query_handler(int err, const struct dnshdr *hdr,
+			  struct list *ansl, struct list *authl,
+			  struct list *addl, void *arg)
+{
+	struct dnsent *ent = arg;
+	struct dnscache *cache = ent->cache;
+	const uint64_t now = tmr_jiffies();
+	(void)authl;
+
+	ent->q = NULL;
+
+	if (!err && (!hdr || hdr->rcode != DNS_RCODE_OK ||
+		     list_isempty(ansl)))
+		err = ENOENT;
+
+	mem_ref(ent);
+
+	if (!err) {
+		uint32_t ttl;
+
+		list_flush(&ent->ansl);
+		list_flush(&ent->addl);
+
+		ttl = rrlist_copy(&ent->ansl, ansl);
+		(void)rrlist_copy(&ent->addl, addl);
+		ttl = max(ttl, TTL_MIN);
+
+		ent->hdr     = *hdr;
+		ent->err     = 0;
+		ent->valid   = true;
+		ent->used    = false;
+		ent->expires = now + ttl * 1000;
+
+		list_unlink(&ent->le);
+		list_append(&cache->entl, &ent->le, ent);
+
+		tmr_start(&ent->tmr, ttl * 900, refresh_handler, ent);
+	}
+	else if (ent->valid && !ent->err) {
+
+		/* keep the last answer for a while */
+		debug("dnscache: refresh of %s failed (%m)\n",
+		      ent->name, err);
+
+		++cache->n_stale;
+
+		ent->expires = now + STALE_TTL * 1000;
+		tmr_start(&ent->tmr, STALE_TTL * 1000, expire_handler, ent);
+	}
+	else {
+		list_flush(&ent->ansl);
+		list_flush(&ent->addl);
+
+		ent->err     = err;
+		ent->valid   = true;
+		ent->expires = now + NEG_TTL * 1000;
+
+		list_unlink(&ent->le);
+		list_append(&cache->negl, &ent->le, ent);
+
+		tmr_start(&ent->tmr, NEG_TTL * 1000, expire_handler, ent);
+	}
+
+	reql_deliver(ent);
+
+	if (ent->he.list) {
+		trim(&cache->entl, CACHE_MAX);
+		trim(&cache->negl, NEG_MAX);
+	}
+
+	mem_deref(ent);
+}
+
+
+/**
+ * Allocate a cache of DNS answers
+ *
+ * @param cachep Pointer to allocated cache
+ * @param dnsc   DNS Client
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int dnscache_alloc(struct dnscache **cachep, struct dnsc *dnsc)
+{
+	struct dnscache *cache;
+	int err;
+
+	if (!cachep)
+		return EINVAL;
+
+	cache = mem_zalloc(sizeof(*cache), cache_destructor);
+	if (!cache)
+		return ENOMEM;
+
+	err = hash_alloc(&cache->ht, CACHE_HASH_SIZE);
+	if (err)
+		goto out;
+
+	cache->dnsc = mem_ref(dnsc);
+
+ out:
+	if (err)
+		mem_deref(cache);
+	else
+		*cachep = cache;
+
+	return err;
+}
+
+
+static bool flush_handler(struct le *le, void *arg)
+{
+	struct dnsent *ent = le->data;
+	(void)arg;
+
+	mem_ref(ent);
+
+	ent_remove(ent);
+	ent->q = mem_deref(ent->q);
+
+	if (!list_isempty(&ent->reql)) {
+		list_flush(&ent->ansl);
+		list_flush(&ent->addl);
+		ent->err = ECONNABORTED;
+		reql_deliver(ent);
+	}
+
+	mem_deref(ent);
+
+	return false;
+}
+
+
+/**
+ * Remove all entries. Lookups that wait for a query get ECONNABORTED.
+ *
+ * @param cache DNS cache
+ */
+void dnscache_flush(struct dnscache *cache)
+{
+	if (!cache)
+		return;
+
+	(void)hash_apply(cache->ht, flush_handler, NULL);
+}
+
+
+/**
+ * Use another DNS Client. The cache is flushed.
+ *
+ * @param cache DNS cache
+ * @param dnsc  DNS Client
+ */
+void dnscache_set_dnsc(struct dnscache *cache, struct dnsc *dnsc)
+{
+	if (!cache)
+		return;
+
+	dnscache_flush(cache);
+
+	mem_deref(cache->dnsc);
+	cache->dnsc = mem_ref(dnsc);
+}
+
+
+/**
+ * Look up a name in the cache, and query the DNS server if it is not
+ * there. The handler is always called from the main loop, and not
+ * before this function has returned.
+ *
+ * @param cache DNS cache
+ * @param qp    Pointer to the lookup, release it to cancel
+ * @param name  Domain name
+ * @param type  Resource record type, A, AAAA, SRV or NAPTR
+ * @param qh    Handler, the records are valid in the handler only
+ * @param arg   Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int dnscache_query(struct dnscache *cache, struct net_dnsq **qp,
+		   const char *name, uint16_t type,
+		   dns_query_h *qh, void *arg)
+{
+	struct dnsent *ent, key;
+	struct net_dnsq *req;
+	int err = 0;
+
+	if (!cache || !qp || !str_isset(name) || !qh)
+		return EINVAL;
+
+	switch (type) {
+
+	case DNS_TYPE_A:
+	case DNS_TYPE_AAAA:
+	case DNS_TYPE_SRV:
+	case DNS_TYPE_NAPTR:
+		break;
+
+	default:
+		return ENOTSUP;
+	}
+
+	key.name = (char *)name;
+	key.type = type;
+
+	ent = list_ledata(hash_lookup(cache->ht, ent_hash(name, type),
+				      ent_cmp_handler, &key));
+	if (!ent) {
+		ent = mem_zalloc(sizeof(*ent), ent_destructor);
+		if (!ent)
+			return ENOMEM;
+
+		ent->cache = cache;
+		ent->type  = type;
+		tmr_init(&ent->tmr);
+
+		err = str_dup(&ent->name, name);
+		if (err) {
+			mem_deref(ent);
+			return err;
+		}
+
+		hash_append(cache->ht, ent_hash(name, type), &ent->he, ent);
+	}
+
+	req = mem_zalloc(sizeof(*req), req_destructor);
+	if (!req)
+		return ENOMEM;
+
+	req->ent = mem_ref(ent);
+	req->qh  = qh;
+	req->arg = arg;
+	tmr_init(&req->tmr);
+
+	if (ent->valid && tmr_jiffies() < ent->expires) {
+
+		if (ent->err)
+			++cache->n_neg;
+		else
+			++cache->n_hit;
+
+		ent->used = true;
+
+		tmr_start(&req->tmr, 0, req_tmr_handler, req);
+	}
+	else {
+		err = ent_query(ent);
+		if (err) {
+			if (!ent->q && list_isempty(&ent->reql) &&
+			    !ent->valid)
+				ent_remove(ent);
+			goto out;
+		}
+
+		++cache->n_miss;
+
+		list_append(&ent->reql, &req->le, req);
+	}
+
+ out:
+	if (err)
+		mem_deref(req);
+	else
+		*qp = req;
+
+	return err;
+}
+
+
+int dnscache_debug(struct re_printf *pf, const struct dnscache *cache)
+{
+	if (!cache)
+		return 0;
+
+	return re_hprintf(pf, " DNS cache: entries=%u negative=%u"
+			  " hits=%llu misses=%llu negative-hits=%llu"
+			  " refreshed=%llu stale=%llu\n",
+			  list_count(&cache->entl), list_count(&cache->negl),
+			  cache->n_hit, cache->n_miss, cache->n_neg,
+			  cache->n_refresh, cache->n_stale);
+}
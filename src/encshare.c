@@ -0,0 +1,366 @@
+/**
+ * @file encshare.c  Video encoders shared by several streams
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * The streams of a conference all send the same picture. When they
+ * also use the same codec, picture size and encoder parameters, the
+ * picture is encoded once and each packet is sent on all the streams.
+ * Every stream has its own RTP session, so the SSRC and the sequence
+ * numbers are still its own, and the timestamps are moved by an offset
+ * so that they continue from what the stream sent before.
+ *
+ * The first subscriber is the owner and encodes the frames, the others
+ * only give their requests for a picture update and their bitrate.
+ * The encoder uses the lowest bitrate of all subscribers, so it fits
+ * the stream with the least bandwidth.
+ *
+ * The subscribers come and go in the main thread, the frames are
+ * encoded in the thread of the owner. The lock protects the state of
+ * the encoder and the list of subscribers.
+ */
+
+
+enum {
+	SRATE = 90000,
+};
+
+struct encshare {
+	struct le le;
+	struct lock *lock;
+	struct list subl;                  /**< Subscribers, owner first  */
+	const void *src;                   /**< Source of the frames      */
+	struct vidsz size;                 /**< Picture size              */
+	struct vidcodec *vc;
+	struct videnc_state *enc;
+	struct videnc_param prm;           /**< Negotiated parameters     */
+	uint32_t bitrate;                  /**< Current encoder bitrate   */
+	char *fmtp;
+	const struct encshare_sub *owner;  /**< Owner of the last frame   */
+	uint32_t ts_owner;                 /**< Timestamp of the owner    */
+	uint32_t ts;                       /**< Shared timestamp          */
+	bool picup;                        /**< Picture update requested  */
+	uint64_t n_frames;                 /**< Frames encoded            */
+};
+
+struct encshare_sub {
+	struct le le;
+	struct encshare *es;
+	uint32_t ts_off;                   /**< Added to the timestamps   */
+	uint32_t bitrate;                  /**< Bitrate of the stream     */
+	encshare_packet_h *pkth;
+	void *arg;
+};
+
+
+static struct list esl = LIST_INIT;
+
+
+static void es_destructor(void *arg)
+{
+	struct encshare *es = arg;
+
+	list_unlink(&es->le);
+	mem_deref(es->enc);
+	mem_deref(es->fmtp);
+	mem_deref(es->lock);
+}
+
+
+static void sub_destructor(void *arg)
+{
+	struct encshare_sub *sub = arg;
+	struct encshare *es = sub->es;
+
+	if (es) {
+		lock_write_get(es->lock);
+		list_unlink(&sub->le);
+		if (es->owner == sub)
+			es->owner = NULL;
+		lock_rel(es->lock);
+	}
+
+	mem_deref(es);
+}
+
+
+/* Called with the lock held, while the owner encodes */
+static int packet_handler(bool marker, const uint8_t *hdr, size_t hdr_len,
+			  const uint8_t *pld, size_t pld_len, void *arg)
+{
+	struct encshare *es = arg;
+	struct le *le;
+	int err = 0;
+
+	for (le = es->subl.head; le; le = le->next) {
+
+		struct encshare_sub *sub = le->data;
+
+		err |= sub->pkth(marker, es->ts + sub->ts_off,
+				 hdr, hdr_len, pld, pld_len, sub->arg);
+	}
+
+	return err;
+}
+
+
+static bool es_match(const struct encshare *es, const void *src,
+		     const struct vidsz *size, const struct vidcodec *vc,
+		     const struct videnc_param *prm, const char *fmtp)
+{
+	if (es->src != src || es->vc != vc || !vidsz_cmp(&es->size, size))
+		return false;
+
+	if (es->prm.bitrate != prm->bitrate ||
+	    es->prm.pktsize != prm->pktsize ||
+	    es->prm.fps     != prm->fps ||
+	    es->prm.max_fs  != prm->max_fs)
+		return false;
+
+	return 0 == str_cmp(es->fmtp ? es->fmtp : "", fmtp ? fmtp : "");
+}
+
+
+static int es_alloc(struct encshare **esp, const void *src,
+		    const struct vidsz *size, struct vidcodec *vc,
+		    const struct videnc_param *prm, const char *fmtp)
+{
+	struct encshare *es;
+	int err;
+
+	es = mem_zalloc(sizeof(*es), es_destructor);
+	if (!es)
+		return ENOMEM;
+
+	es->src     = src;
+	es->size    = *size;
+	es->vc      = vc;
+	es->prm     = *prm;
+	es->bitrate = prm->bitrate;
+
+	err = lock_alloc(&es->lock);
+	if (err)
+		goto out;
+
+	if (fmtp) {
+		err = str_dup(&es->fmtp, fmtp);
+		if (err)
+			goto out;
+	}
+
+	err = vc->encupdh(&es->enc, vc, &es->prm, es->fmtp,
+			  packet_handler, es);
+	if (err)
+		goto out;
+
+	list_append(&esl, &es->le, es);
+
+ out:
+	if (err)
+		mem_deref(es);
+	else
+		*esp = es;
+
+	return err;
+}
+
+
+/* Follow the lowest bitrate of the subscribers, called with the lock */
+static void es_bitrate(struct encshare *es)
+{
+	struct videnc_param prm = es->prm;
+	uint32_t bitrate = 0, step;
+	struct le *le;
+
+	for (le = es->subl.head; le; le = le->next) {
+
+		const struct encshare_sub *sub = le->data;
+
+		if (!bitrate || sub->bitrate < bitrate)
+			bitrate = sub->bitrate;
+	}
+
+	/* re-opening the encoder is expensive, skip small changes */
+	step = es->vc->reconfh ? es->bitrate/50 : es->bitrate/10;
+	if (!bitrate || (bitrate <= es->bitrate + step &&
+			 bitrate >= es->bitrate - step))
+		return;
+
+	prm.bitrate = bitrate;
+
+	if (es->vc->reconfh) {
+		if (es->vc->reconfh(es->enc, &prm))
+			return;
+	}
+	else if (es->vc->encupdh(&es->enc, es->vc, &prm, es->fmtp,
+				 packet_handler, es)) {
+		return;
+	}
+
+	es->bitrate = bitrate;
+}
+
+
+/**
+ * Subscribe to a shared video encoder, the encoder is allocated if no
+ * one else has one with the same parameters
+ *
+ * @param subp Pointer to allocated subscription
+ * @param src  Source of the frames, that all subscribers must have
+ * @param size Picture size
+ * @param vc   Video codec
+ * @param prm  Negotiated encoder parameters
+ * @param fmtp Encoder format parameters (optional)
+ * @param ts   Next RTP timestamp of the stream
+ * @param pkth Packet handler of the stream
+ * @param arg  Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int encshare_subscribe(struct encshare_sub **subp, const void *src,
+		       const struct vidsz *size, struct vidcodec *vc,
+		       const struct videnc_param *prm, const char *fmtp,
+		       uint32_t ts, encshare_packet_h *pkth, void *arg)
+{
+	struct encshare_sub *sub;
+	struct encshare *es = NULL;
+	struct le *le;
+	int err = 0;
+
+	if (!subp || !src || !size || !vc || !vc->encupdh || !prm || !pkth)
+		return EINVAL;
+
+	sub = mem_zalloc(sizeof(*sub), sub_destructor);
+	if (!sub)
+		return ENOMEM;
+
+	sub->bitrate = prm->bitrate;
+	sub->pkth    = pkth;
+	sub->arg     = arg;
+
+	for (le = esl.head; le; le = le->next) {
+
+		if (es_match(le->data, src, size, vc, prm, fmtp)) {
+			es = mem_ref(le->data);
+			break;
+		}
+	}
+
+	if (!es) {
+		err = es_alloc(&es, src, size, vc, prm, fmtp);
+		if (err)
+			goto out;
+	}
+
+	sub->es = es;
+
+	lock_write_get(es->lock);
+
+	/* the stream continues with its own timestamps */
+	sub->ts_off = ts - es->ts;
+	list_append(&es->subl, &sub->le, sub);
+
+	/* the new stream starts with a keyframe */
+	es->picup = true;
+
+	lock_rel(es->lock);
+
+	debug("encshare: %s %ux%u shared by %u\n", vc->name,
+	      size->w, size->h, list_count(&es->subl));
+
+ out:
+	if (err)
+		mem_deref(sub);
+	else
+		*subp = sub;
+
+	return err;
+}
+
+
+/**
+ * Give a frame to a shared encoder
+ *
+ * @param sub     Subscription
+ * @param picup   The stream needs a picture update
+ * @param bitrate Target bitrate of the stream [bit/s], 0 for no change
+ * @param frame   Video frame
+ * @param ts      RTP timestamp of the frame in the stream
+ *
+ * @return 0 if success, otherwise errorcode
+ *
+ * @note The frame is encoded only if the subscriber is the owner
+ */
+int encshare_encode(struct encshare_sub *sub, bool picup, uint32_t bitrate,
+		    const struct vidframe *frame, uint32_t ts)
+{
+	struct encshare *es;
+	int err = 0;
+
+	if (!sub || !sub->es || !frame)
+		return EINVAL;
+
+	es = sub->es;
+
+	lock_write_get(es->lock);
+
+	if (picup)
+		es->picup = true;
+
+	if (bitrate && bitrate != sub->bitrate) {
+		sub->bitrate = bitrate;
+		es_bitrate(es);
+	}
+
+	if (list_head(&es->subl) != &sub->le)
+		goto out;
+
+	/* the clock follows the owner, a new one starts one frame later */
+	if (es->owner == sub)
+		es->ts += ts - es->ts_owner;
+	else if (es->n_frames)
+		es->ts += SRATE / (es->prm.fps ? es->prm.fps : 25);
+
+	es->owner    = sub;
+	es->ts_owner = ts;
+
+	err = es->vc->ench(es->enc, es->picup, frame);
+	if (!err) {
+		es->picup = false;
+		++es->n_frames;
+	}
+
+ out:
+	lock_rel(es->lock);
+
+	return err;
+}
+
+
+/**
+ * Get the number of streams that share the encoder
+ *
+ * @param sub Subscription
+ *
+ * @return Number of subscribers, including this one
+ */
+uint32_t encshare_count(const struct encshare_sub *sub)
+{
+	uint32_t n;
+
+	if (!sub || !sub->es)
+		return 0;
+
+	lock_read_get(sub->es->lock);
+	n = list_count(&sub->es->subl);
+	lock_rel(sub->es->lock);
+
+	return n;
+}
@@ -0,0 +1,559 @@
+/**
+ * @file eyeballs.c  Happy Eyeballs for SIP outbound proxies (RFC 8305)
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * The SIP stack tries the addresses of a server one at a time, so if
+ * IPv6 is broken a TCP or TLS connection waits for a full connect
+ * timeout before IPv4 is tried.
+ *
+ * For an outbound proxy with a host name and a TCP or TLS transport,
+ * the A and AAAA records are resolved here, and TCP connections to the
+ * addresses are started 250 ms apart, IPv6 first and then alternating
+ * between the address families. The first connection that is up wins,
+ * the others are closed, and the outbound route is then sent to the
+ * address of the winner for the next 10 minutes. Until the race is
+ * done, or if it fails, the route is used as it is.
+ *
+ * The race is only run if there is a local address of both families.
+ */
+
+
+enum {
+	RESOLUTION_DELAY = 50,     /**< Wait for AAAA after A [ms]       */
+	ATTEMPT_DELAY    = 250,    /**< Between two connects [ms]        */
+	RACE_TIMEOUT     = 10000,  /**< Give up the race [ms]            */
+	WIN_TTL          = 600,    /**< Keep the winner [s]              */
+	FAIL_TTL         = 30,     /**< Keep a failed race [s]           */
+	MAX_ADDR         = 4,      /**< Addresses of each family         */
+};
+
+struct attempt {
+	struct eyeball *eb;
+	struct tcp_conn *tc;
+	struct sa addr;
+};
+
+struct eyeball {
+	struct le le;
+	char *uri;                 /**< Route as it is configured        */
+	char *route;               /**< Route to the winner, or NULL     */
+	struct uri puri;           /**< Decoded route                    */
+	char *host;                /**< Name to resolve                  */
+	uint16_t port;
+	bool tls;
+	struct net_dnsq *q_srv;
+	struct net_dnsq *q_a;
+	struct net_dnsq *q_aaaa;
+	struct sa v4[MAX_ADDR];
+	struct sa v6[MAX_ADDR];
+	unsigned n4, n6;           /**< Resolved addresses               */
+	unsigned i4, i6;           /**< Addresses tried                  */
+	bool done4, done6;         /**< Resolving is done                */
+	bool last6;                /**< Last attempt was IPv6            */
+	bool started;              /**< Connection attempts started      */
+	bool pending;              /**< Next attempt is scheduled        */
+	struct attempt attv[2 * MAX_ADDR];
+	unsigned n_att;
+	struct tmr tmr;            /**< Next attempt, resolution delay   */
+	struct tmr tmr_race;       /**< Race timeout                     */
+	uint64_t ts;               /**< Start of the race                */
+	uint64_t expires;          /**< End of the result                */
+	bool racing;
+};
+
+
+static struct list ebl;
+
+
+static void attempt_next(void *arg);
+
+
+static void race_stop(struct eyeball *eb)
+{
+	unsigned i;
+
+	tmr_cancel(&eb->tmr);
+	tmr_cancel(&eb->tmr_race);
+
+	eb->q_srv  = mem_deref(eb->q_srv);
+	eb->q_a    = mem_deref(eb->q_a);
+	eb->q_aaaa = mem_deref(eb->q_aaaa);
+
+	for (i=0; i<eb->n_att; i++)
+		eb->attv[i].tc = mem_deref(eb->attv[i].tc);
+
+	eb->racing = false;
+}
+
+
+static void destructor(void *arg)
+{
+	struct eyeball *eb = arg;
+
+	race_stop(eb);
+	list_unlink(&eb->le);
+	mem_deref(eb->route);
+	mem_deref(eb->host);
+	mem_deref(eb->uri);
+}
+
+
+static void race_done(struct eyeball *eb, const struct sa *addr)
+{
+	const struct uri *u = &eb->puri;
+
+	race_stop(eb);
+
+	if (!addr) {
+		info("eyeballs: %s: no address could be reached\n", eb->uri);
+		eb->expires = tmr_jiffies() + FAIL_TTL * 1000;
+		return;
+	}
+
+	info("eyeballs: %s: %J is up after %llu ms\n", eb->uri, addr,
+	     tmr_jiffies() - eb->ts);
+
+	eb->route = mem_deref(eb->route);
+	if (re_sdprintf(&eb->route, "%r:%r%s%J%r%r", &u->scheme, &u->user,
+			pl_isset(&u->user) ? "@" : "", addr,
+			&u->params, &u->headers))
+		eb->route = mem_deref(eb->route);
+
+	eb->expires = tmr_jiffies() + WIN_TTL * 1000;
+}
+
+
+static bool attempts_open(const struct eyeball *eb)
+{
+	unsigned i;
+
+	for (i=0; i<eb->n_att; i++) {
+		if (eb->attv[i].tc)
+			return true;
+	}
+
+	return false;
+}
+
+
+static void estab_handler(void *arg)
+{
+	struct attempt *att = arg;
+
+	race_done(att->eb, &att->addr);
+}
+
+
+static void close_handler(int err, void *arg)
+{
+	struct attempt *att = arg;
+	struct eyeball *eb = att->eb;
+
+	debug("eyeballs: %J: %m\n", &att->addr, err);
+
+	att->tc = mem_deref(att->tc);
+
+	/* a failed attempt starts the next one at once */
+	tmr_cancel(&eb->tmr);
+	attempt_next(eb);
+}
+
+
+/* IPv6 first, then the families in turn */
+static const struct sa *addr_next(struct eyeball *eb)
+{
+	const bool want6 = !eb->last6;
+
+	if (want6 && eb->i6 < eb->n6) {
+		eb->last6 = true;
+		return &eb->v6[eb->i6++];
+	}
+	if (eb->i4 < eb->n4) {
+		eb->last6 = false;
+		return &eb->v4[eb->i4++];
+	}
+	if (eb->i6 < eb->n6) {
+		eb->last6 = true;
+		return &eb->v6[eb->i6++];
+	}
+
+	return NULL;
+}
+
+
+static void attempt_next(void *arg)
+{
+	struct eyeball *eb = arg;
+
+	eb->pending = false;
+
+	while (eb->n_att < ARRAY_SIZE(eb->attv)) {
+
+		struct attempt *att = &eb->attv[eb->n_att];
+		const struct sa *addr;
+		int err;
+
+		addr = addr_next(eb);
+		if (!addr)
+			break;
+
+		att->eb   = eb;
+		att->addr = *addr;
+
+		err = tcp_connect(&att->tc, addr, estab_handler, NULL,
+				  close_handler, att);
+		++eb->n_att;
+		if (err) {
+			debug("eyeballs: %J: connect: %m\n", addr, err);
+			continue;
+		}
+
+		tmr_start(&eb->tmr, ATTEMPT_DELAY, attempt_next, eb);
+		eb->pending = true;
+		return;
+	}
+
+	/* nothing more to try */
+	if (eb->done4 && eb->done6 && !attempts_open(eb))
+		race_done(eb, NULL);
+}
+
+
+static void attempts_start(void *arg)
+{
+	struct eyeball *eb = arg;
+
+	if (eb->started)
+		return;
+
+	eb->started = true;
+	attempt_next(eb);
+}
+
+
+static void race_timeout(void *arg)
+{
+	race_done(arg, NULL);
+}
+
+
+static unsigned addr_add(struct sa *addrv, unsigned max, struct list *ansl,
+			 uint16_t type, uint16_t port)
+{
+	struct le *le;
+	unsigned n = 0;
+
+	for (le = list_head(ansl); le && n < max; le = le->next) {
+
+		const struct dnsrr *rr = le->data;
+
+		if (rr->type != type)
+			continue;
+
+		if (type == DNS_TYPE_A)
+			sa_set_in(&addrv[n], rr->rdata.a.addr, port);
+		else
+			sa_set_in6(&addrv[n], rr->rdata.aaaa.addr, port);
+
+		++n;
+	}
+
+	return n;
+}
+
+
+static void a_handler(int err, const struct dnshdr *hdr, struct list *ansl,
+		      struct list *authl, struct list *addl, void *arg)
+{
+	struct eyeball *eb = arg;
+	(void)hdr;
+	(void)authl;
+	(void)addl;
+
+	eb->q_a   = mem_deref(eb->q_a);
+	eb->done4 = true;
+
+	if (!err)
+		eb->n4 = addr_add(eb->v4, MAX_ADDR, ansl, DNS_TYPE_A,
+				  eb->port);
+
+	if (!eb->started) {
+		/* give the AAAA answer a little more time */
+		if (!eb->done6 && eb->n4)
+			tmr_start(&eb->tmr, RESOLUTION_DELAY,
+				  attempts_start, eb);
+		else if (eb->done6)
+			attempts_start(eb);
+	}
+	else if (!eb->pending) {
+		attempt_next(eb);
+	}
+}
+
+
+static void aaaa_handler(int err, const struct dnshdr *hdr,
+			 struct list *ansl, struct list *authl,
+			 struct list *addl, void *arg)
+{
+	struct eyeball *eb = arg;
+	(void)hdr;
+	(void)authl;
+	(void)addl;
+
+	eb->q_aaaa = mem_deref(eb->q_aaaa);
+	eb->done6  = true;
+
+	if (!err)
+		eb->n6 = addr_add(eb->v6, MAX_ADDR, ansl, DNS_TYPE_AAAA,
+				  eb->port);
+
+	if (!eb->started) {
+		if (eb->n6 || eb->done4) {
+			tmr_cancel(&eb->tmr);
+			attempts_start(eb);
+		}
+	}
+	else if (!eb->pending) {
+		attempt_next(eb);
+	}
+}
+
+
+static int resolve(struct eyeball *eb)
+{
+	struct network *net = baresip_network();
+	int err;
+
+	err  = net_dns_query(&eb->q_aaaa, net, eb->host, DNS_TYPE_AAAA,
+			     aaaa_handler, eb);
+	err |= net_dns_query(&eb->q_a, net, eb->host, DNS_TYPE_A,
+			     a_handler, eb);
+
+	return err;
+}
+
+
+/* The server with the lowest priority and the highest weight */
+static void srv_handler(int err, const struct dnshdr *hdr,
+			struct list *ansl, struct list *authl,
+			struct list *addl, void *arg)
+{
+	struct eyeball *eb = arg;
+	const struct dnsrr *best = NULL;
+	struct le *le;
+	(void)hdr;
+	(void)authl;
+	(void)addl;
+
+	eb->q_srv = mem_deref(eb->q_srv);
+
+	for (le = err ? NULL : list_head(ansl); le; le = le->next) {
+
+		const struct dnsrr *rr = le->data;
+
+		if (rr->type != DNS_TYPE_SRV)
+			continue;
+
+		if (!best || rr->rdata.srv.pri < best->rdata.srv.pri ||
+		    (rr->rdata.srv.pri == best->rdata.srv.pri &&
+		     rr->rdata.srv.weight > best->rdata.srv.weight))
+			best = rr;
+	}
+
+	if (best) {
+		char *host;
+
+		if (!str_dup(&host, best->rdata.srv.target)) {
+			mem_deref(eb->host);
+			eb->host = host;
+			eb->port = best->rdata.srv.port;
+		}
+	}
+
+	err = resolve(eb);
+	if (err)
+		race_done(eb, NULL);
+}
+
+
+static int race_start(struct eyeball *eb)
+{
+	struct network *net = baresip_network();
+	const struct uri *u = &eb->puri;
+	int err;
+
+	race_stop(eb);
+
+	eb->n4 = eb->n6 = 0;
+	eb->i4 = eb->i6 = 0;
+	eb->done4 = eb->done6 = false;
+	eb->last6 = false;
+	eb->started = false;
+	eb->pending = false;
+	memset(eb->attv, 0, sizeof(eb->attv));
+	eb->n_att = 0;
+
+	eb->host = mem_deref(eb->host);
+	err = pl_strdup(&eb->host, &u->host);
+	if (err)
+		return err;
+
+	eb->ts     = tmr_jiffies();
+	eb->racing = true;
+
+	tmr_start(&eb->tmr_race, RACE_TIMEOUT, race_timeout, eb);
+
+	/* RFC 3263, a host name with no port may have SRV records */
+	if (u->port) {
+		eb->port = u->port;
+		err = resolve(eb);
+	}
+	else {
+		char name[256];
+
+		re_snprintf(name, sizeof(name), "%s.%s",
+			    eb->tls ? "_sips._tcp" : "_sip._tcp", eb->host);
+
+		eb->port = eb->tls ? SIP_PORT_TLS : SIP_PORT;
+		err = net_dns_query(&eb->q_srv, net, name, DNS_TYPE_SRV,
+				    srv_handler, eb);
+	}
+
+	if (err)
+		race_stop(eb);
+
+	return err;
+}
+
+
+static bool dual_stack(void)
+{
+#ifdef HAVE_INET6
+	struct network *net = baresip_network();
+
+	return sa_isset(net_laddr_af(net, AF_INET), SA_ADDR) &&
+		sa_isset(net_laddr_af(net, AF_INET6), SA_ADDR);
+#else
+	return false;
+#endif
+}
+
+
+/* A race is only useful for a connection to a host name */
+static int eyeball_alloc(struct eyeball **ebp, const char *uri)
+{
+	struct pl pl, transp;
+	struct eyeball *eb;
+	struct sa sa;
+	int err;
+
+	eb = mem_zalloc(sizeof(*eb), destructor);
+	if (!eb)
+		return ENOMEM;
+
+	tmr_init(&eb->tmr);
+	tmr_init(&eb->tmr_race);
+
+	err = str_dup(&eb->uri, uri);
+	if (err)
+		goto out;
+
+	pl_set_str(&pl, eb->uri);
+
+	err = uri_decode(&eb->puri, &pl);
+	if (err)
+		goto out;
+
+	if (!sa_set(&sa, &eb->puri.host, 0)) {
+		err = ENOTSUP;
+		goto out;
+	}
+
+	eb->tls = !pl_strcasecmp(&eb->puri.scheme, "sips");
+
+	if (!msg_param_decode(&eb->puri.params, "transport", &transp)) {
+
+		if (!pl_strcasecmp(&transp, "tls"))
+			eb->tls = true;
+		else if (pl_strcasecmp(&transp, "tcp")) {
+			err = ENOTSUP;
+			goto out;
+		}
+	}
+	else if (!eb->tls) {
+		err = ENOTSUP;
+		goto out;
+	}
+
+	list_append(&ebl, &eb->le, eb);
+
+ out:
+	if (err)
+		mem_deref(eb);
+	else
+		*ebp = eb;
+
+	return err;
+}
+
+
+/**
+ * Get the route to use for an outbound proxy. If the addresses of the
+ * proxy were raced, the route is to the address of the winner,
+ * otherwise it is the route as it is, and a race is started.
+ *
+ * @param uri Outbound proxy route
+ *
+ * @return Route to use, valid until the next call
+ */
+const char *eyeballs_route(const char *uri)
+{
+	struct eyeball *eb = NULL;
+	struct le *le;
+
+	if (!str_isset(uri) || !dual_stack())
+		return uri;
+
+	for (le = ebl.head; le; le = le->next) {
+
+		struct eyeball *e = le->data;
+
+		if (0 == str_cmp(e->uri, uri)) {
+			eb = e;
+			break;
+		}
+	}
+
+	if (!eb) {
+		if (eyeball_alloc(&eb, uri))
+			return uri;
+	}
+
+	/* the old winner is used while the race is run again */
+	if (!eb->racing && tmr_jiffies() >= eb->expires) {
+
+		int err = race_start(eb);
+		if (err) {
+			debug("eyeballs: %s: %m\n", uri, err);
+		}
+	}
+
+	return eb->route ? eb->route : uri;
+}
+
+
+/**
+ * Forget all races, for example when the local addresses changed
+ */
+void eyeballs_flush(void)
+{
+	list_flush(&ebl);
+}
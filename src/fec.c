@@ -0,0 +1,552 @@
+/**
+ * @file fec.c  Forward error correction for RTP (RFC 5109)
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * Generic XOR parity (ULPFEC, RFC 5109) with one protection level.
+ *
+ * Transmit: a UDP helper above the media encryption layer sees the
+ * outgoing RTP packets in clear. Every `k' consecutive packets are
+ * XOR'ed into one FEC packet, which is sent on its own SSRC and sequence
+ * space with the negotiated "ulpfec" payload type. The group size is
+ * chosen from the fraction lost reported by the peer.
+ *
+ * Receive: recent media packets are kept in a small history. When a FEC
+ * packet arrives and exactly one packet of its group is missing, that
+ * packet is rebuilt and handed back to the stream before the jitter
+ * buffer.
+ *
+ * As in RFC 5109, everything after the fixed RTP header is protected:
+ * the CSRC list, the header extension and the payload. The history
+ * keeps them in the same form, taken from the bytes in front of the
+ * payload of a decoded packet.
+ */
+
+
+enum {
+	LAYER_FEC   = 30,          /* above SRTP/DTLS                  */
+	FEC_HDR_SIZE = 10,
+	ULP_HDR_SIZE = 4,          /* level 0 header, 16-bit mask      */
+	FEC_PKTSZ   = 1400,        /* max protected length             */
+	FEC_PRESZ   = 36,          /* headroom for the layers below    */
+	FEC_HIST    = 64,          /* received packets kept, power of 2 */
+	FEC_GROUP_MAX = 16,
+	FEC_B0_PAD  = 0x20,        /* P bit of the first header byte   */
+	FEC_B0_EXT  = 0x10,        /* X bit                            */
+	FEC_B0_CC   = 0x0f,        /* CSRC count                       */
+};
+
+
+/* Fields of one packet that are protected (RFC 5109 section 8.1) */
+struct fec_bits {
+	uint8_t b0;                /**< P, X and CC                    */
+	uint8_t b1;                /**< M and PT                       */
+	uint32_t ts;
+	uint16_t len;              /**< Length of data after header    */
+	uint8_t data[FEC_PKTSZ];
+};
+
+struct fec_hist {
+	struct fec_bits bits;
+	uint16_t seq;
+	bool valid;
+};
+
+struct fec {
+	struct udp_helper *uh;
+	struct udp_sock *us;
+	fec_recover_h *recovh;
+	void *arg;
+	int pt_tx;                 /**< Payload type to send, -1 = off */
+	int pt_rx;                 /**< Payload type to receive        */
+
+	/* transmit */
+	struct fec_bits acc;       /**< XOR of the current group       */
+	uint32_t ssrc_media;       /**< SSRC of the protected stream   */
+	uint32_t ssrc;             /**< SSRC of the FEC packets        */
+	uint32_t ts_last;
+	uint16_t seq;              /**< Next FEC sequence number       */
+	uint16_t base;             /**< First sequence number of group */
+	uint16_t maxlen;           /**< Longest packet in the group    */
+	unsigned count;            /**< Packets in the current group   */
+	unsigned k;                /**< Group size                     */
+	bool pending;              /**< A complete group is ready      */
+	struct mbuf *mb;
+
+	/* receive */
+	struct fec_hist *histv;
+
+	uint32_t n_sent;
+	uint32_t n_recv;
+	uint32_t n_recovered;
+};
+
+
+static void destructor(void *arg)
+{
+	struct fec *fec = arg;
+
+	mem_deref(fec->uh);
+	mem_deref(fec->mb);
+	mem_deref(fec->histv);
+}
+
+
+static void bits_xor(struct fec_bits *acc, const struct fec_bits *b)
+{
+	size_t i;
+
+	acc->b0  ^= b->b0;
+	acc->b1  ^= b->b1;
+	acc->ts  ^= b->ts;
+	acc->len ^= b->len;
+
+	for (i=0; i<b->len; i++)
+		acc->data[i] ^= b->data[i];
+}
+
+
+static void group_reset(struct fec *fec)
+{
+	memset(&fec->acc, 0, sizeof(fec->acc));
+	fec->count  = 0;
+	fec->maxlen = 0;
+}
+
+
+static bool send_handler(int *err, struct sa *dst, struct mbuf *mb,
+			 void *arg)
+{
+	struct fec *fec = arg;
+	const uint8_t *p = mbuf_buf(mb);
+	size_t len = mbuf_get_left(mb);
+	struct fec_bits *acc = &fec->acc;
+	uint16_t seq;
+	size_t i;
+	(void)err;
+	(void)dst;
+
+	if (fec->pt_tx < 0 || !fec->k || fec->pending)
+		return false;
+
+	/* only RTP packets of the protected stream */
+	if (len < RTP_HEADER_SIZE || (p[0] >> 6) != 2)
+		return false;
+	if ((p[1] & 0x7f) == fec->pt_tx || (p[1] >= 192 && p[1] <= 223))
+		return false;
+	if (fec->ssrc_media != ((uint32_t)p[8] << 24 | p[9] << 16 |
+				p[10] << 8 | p[11]))
+		return false;
+
+	seq = (uint16_t)(p[2] << 8 | p[3]);
+	len -= RTP_HEADER_SIZE;
+
+	/* a group must be consecutive and fit the buffer */
+	if (fec->count && seq != (uint16_t)(fec->base + fec->count))
+		group_reset(fec);
+
+	if (len > FEC_PKTSZ) {
+		group_reset(fec);
+		return false;
+	}
+
+	if (!fec->count)
+		fec->base = seq;
+
+	acc->b0  ^= p[0] & 0x3f;
+	acc->b1  ^= p[1];
+	acc->ts  ^= (uint32_t)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+	acc->len ^= (uint16_t)len;
+
+	for (i=0; i<len; i++)
+		acc->data[i] ^= p[RTP_HEADER_SIZE + i];
+
+	fec->maxlen  = max(fec->maxlen, (uint16_t)len);
+	fec->ts_last = (uint32_t)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+
+	if (++fec->count >= fec->k)
+		fec->pending = true;
+
+	return false;
+}
+
+
+/**
+ * Allocate a FEC encoder and decoder for one stream
+ *
+ * @param fecp   Pointer to allocated FEC state
+ * @param us     RTP socket
+ * @param ssrc   SSRC of the protected outgoing stream
+ * @param recovh Handler for recovered packets
+ * @param arg    Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int fec_alloc(struct fec **fecp, struct udp_sock *us, uint32_t ssrc,
+	      fec_recover_h *recovh, void *arg)
+{
+	struct fec *fec;
+	int err;
+
+	if (!fecp || !us || !recovh)
+		return EINVAL;
+
+	fec = mem_zalloc(sizeof(*fec), destructor);
+	if (!fec)
+		return ENOMEM;
+
+	fec->us     = us;
+	fec->recovh = recovh;
+	fec->arg    = arg;
+	fec->pt_tx  = -1;
+	fec->pt_rx  = -1;
+	fec->ssrc_media = ssrc;
+	fec->ssrc   = rand_u32();
+	fec->seq    = rand_u16();
+	fec->k      = FEC_GROUP_MAX;
+
+	fec->mb    = mbuf_alloc(FEC_PRESZ + RTP_HEADER_SIZE + FEC_HDR_SIZE
+				+ ULP_HDR_SIZE + FEC_PKTSZ);
+	fec->histv = mem_zalloc(FEC_HIST * sizeof(*fec->histv), NULL);
+	if (!fec->mb || !fec->histv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err = udp_register_helper(&fec->uh, us, LAYER_FEC,
+				  send_handler, NULL, fec);
+
+ out:
+	if (err)
+		mem_deref(fec);
+	else
+		*fecp = fec;
+
+	return err;
+}
+
+
+/**
+ * Set the negotiated payload types
+ *
+ * @param fec   FEC state
+ * @param pt_tx Payload type for sending, -1 to disable sending
+ * @param pt_rx Payload type for receiving, -1 to disable receiving
+ */
+void fec_set_pt(struct fec *fec, int pt_tx, int pt_rx)
+{
+	if (!fec)
+		return;
+
+	fec->pt_tx = pt_tx;
+	fec->pt_rx = pt_rx;
+
+	group_reset(fec);
+	fec->pending = false;
+}
+
+
+/**
+ * Adapt the FEC overhead to the loss reported by the receiver
+ *
+ * @param fec      FEC state
+ * @param fraction Fraction lost from an RTCP report block (1/256)
+ */
+void fec_set_loss(struct fec *fec, uint8_t fraction)
+{
+	unsigned k;
+
+	if (!fec)
+		return;
+
+	if (fraction < 256 * 1 / 100)
+		k = FEC_GROUP_MAX;
+	else if (fraction < 256 * 3 / 100)
+		k = 10;
+	else if (fraction < 256 * 6 / 100)
+		k = 6;
+	else if (fraction < 256 * 12 / 100)
+		k = 4;
+	else
+		k = 2;
+
+	fec->k = k;
+}
+
+
+/**
+ * Send the FEC packet of the last complete group, if any
+ *
+ * @param fec FEC state
+ * @param dst Destination address
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int fec_send(struct fec *fec, const struct sa *dst)
+{
+	struct mbuf *mb;
+	uint16_t mask;
+	int err;
+
+	if (!fec || !dst)
+		return EINVAL;
+
+	if (!fec->pending)
+		return 0;
+
+	mb = fec->mb;
+	mb->pos = mb->end = FEC_PRESZ;
+
+	mask = (uint16_t)(0xffff << (16 - fec->count));
+
+	/* RTP header */
+	err  = mbuf_write_u8(mb, 0x80);
+	err |= mbuf_write_u8(mb, fec->pt_tx & 0x7f);
+	err |= mbuf_write_u16(mb, htons(fec->seq));
+	err |= mbuf_write_u32(mb, htonl(fec->ts_last));
+	err |= mbuf_write_u32(mb, htonl(fec->ssrc));
+
+	/* FEC header, E=0 L=0 */
+	err |= mbuf_write_u8(mb, fec->acc.b0 & 0x3f);
+	err |= mbuf_write_u8(mb, fec->acc.b1);
+	err |= mbuf_write_u16(mb, htons(fec->base));
+	err |= mbuf_write_u32(mb, htonl(fec->acc.ts));
+	err |= mbuf_write_u16(mb, htons(fec->acc.len));
+
+	/* ULP level 0 header */
+	err |= mbuf_write_u16(mb, htons(fec->maxlen));
+	err |= mbuf_write_u16(mb, htons(mask));
+
+	err |= mbuf_write_mem(mb, fec->acc.data, fec->maxlen);
+
+	group_reset(fec);
+	fec->pending = false;
+
+	if (err)
+		return err;
+
+	mb->pos = FEC_PRESZ;
+
+	err = udp_send(fec->us, dst, mb);
+	if (err)
+		return err;
+
+	++fec->seq;
+	++fec->n_sent;
+
+	return 0;
+}
+
+
+static struct fec_hist *hist_lookup(struct fec *fec, uint16_t seq)
+{
+	struct fec_hist *h = &fec->histv[seq & (FEC_HIST - 1)];
+
+	return (h->valid && h->seq == seq) ? h : NULL;
+}
+
+
+static void hist_store(struct fec *fec, uint16_t seq,
+		       const struct fec_bits *bits)
+{
+	struct fec_hist *h = &fec->histv[seq & (FEC_HIST - 1)];
+
+	h->seq   = seq;
+	h->valid = true;
+	h->bits  = *bits;
+}
+
+
+/**
+ * Keep a copy of a received media packet for recovery
+ *
+ * @param fec FEC state
+ * @param hdr RTP header
+ * @param mb  RTP payload
+ */
+void fec_recv_media(struct fec *fec, const struct rtp_header *hdr,
+		    const struct mbuf *mb)
+{
+	struct fec_hist *h;
+	size_t hlen, len;
+
+	if (!fec || !hdr || !mb || fec->pt_rx < 0)
+		return;
+
+	/* the CSRC list and the extension are in front of the payload */
+	hlen = 4 * hdr->cc;
+	if (hdr->ext)
+		hlen += 4 + 4 * hdr->x.len;
+
+	len = hlen + mbuf_get_left(mb);
+
+	/* the padding was removed from the payload, it cannot be kept */
+	if (hdr->pad || mb->pos < hlen || len > FEC_PKTSZ)
+		return;
+
+	h = &fec->histv[hdr->seq & (FEC_HIST - 1)];
+
+	h->seq   = hdr->seq;
+	h->valid = true;
+	h->bits.b0  = (hdr->ext ? FEC_B0_EXT : 0) | (hdr->cc & FEC_B0_CC);
+	h->bits.b1  = (hdr->m ? 0x80 : 0) | (hdr->pt & 0x7f);
+	h->bits.ts  = hdr->ts;
+	h->bits.len = (uint16_t)len;
+	memcpy(h->bits.data, mb->buf + mb->pos - hlen, len);
+}
+
+
+/**
+ * Handle a received FEC packet, and recover a lost packet if possible
+ *
+ * @param fec  FEC state
+ * @param ssrc SSRC of the protected incoming stream
+ * @param mb   RTP payload of the FEC packet
+ */
+void fec_recv(struct fec *fec, uint32_t ssrc, struct mbuf *mb)
+{
+	struct fec_bits bits;
+	struct rtp_header hdr;
+	const struct fec_hist *h;
+	struct mbuf *mbr;
+	uint16_t base, mask, protlen, seq = 0;
+	unsigned i, missing = 0;
+	size_t hlen;
+	const uint8_t *p;
+
+	if (!fec || !mb)
+		return;
+
+	if (mbuf_get_left(mb) < FEC_HDR_SIZE + ULP_HDR_SIZE)
+		return;
+
+	p = mbuf_buf(mb);
+
+	/* only a 16-bit mask and one level (E=0, L=0) */
+	if (p[0] & 0xc0)
+		return;
+
+	++fec->n_recv;
+
+	memset(&bits, 0, sizeof(bits));
+
+	bits.b0  = p[0] & 0x3f;
+	bits.b1  = p[1];
+	base     = (uint16_t)(p[2] << 8 | p[3]);
+	bits.ts  = (uint32_t)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+	bits.len = (uint16_t)(p[8] << 8 | p[9]);
+	protlen  = (uint16_t)(p[10] << 8 | p[11]);
+	mask     = (uint16_t)(p[12] << 8 | p[13]);
+
+	if (protlen > FEC_PKTSZ ||
+	    protlen > mbuf_get_left(mb) - FEC_HDR_SIZE - ULP_HDR_SIZE)
+		return;
+
+	memcpy(bits.data, p + FEC_HDR_SIZE + ULP_HDR_SIZE, protlen);
+
+	for (i=0; i<16; i++) {
+
+		uint16_t s;
+
+		if (!(mask & (0x8000 >> i)))
+			continue;
+
+		s = base + i;
+
+		h = hist_lookup(fec, s);
+		if (h) {
+			bits_xor(&bits, &h->bits);
+		}
+		else {
+			seq = s;
+			if (++missing > 1)
+				return;
+		}
+	}
+
+	if (missing != 1)
+		return;
+
+	/* the recovered length must be covered by the FEC payload */
+	if (bits.len > protlen || bits.b0 & FEC_B0_PAD)
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ver  = RTP_VERSION;
+	hdr.cc   = bits.b0 & FEC_B0_CC;
+	hdr.ext  = (bits.b0 & FEC_B0_EXT) != 0;
+	hdr.m    = (bits.b1 >> 7) & 1;
+	hdr.pt   = bits.b1 & 0x7f;
+	hdr.seq  = seq;
+	hdr.ts   = bits.ts;
+	hdr.ssrc = ssrc;
+
+	hlen = 4 * hdr.cc;
+
+	for (i=0; i<hdr.cc && 4*i + 4 <= bits.len; i++) {
+		p = &bits.data[4*i];
+		hdr.csrc[i] = (uint32_t)p[0] << 24 | p[1] << 16 |
+			p[2] << 8 | p[3];
+	}
+
+	if (hdr.ext && hlen + 4 <= bits.len) {
+		p = &bits.data[hlen];
+		hdr.x.type = (uint16_t)(p[0] << 8 | p[1]);
+		hdr.x.len  = (uint16_t)(p[2] << 8 | p[3]);
+		hlen += 4 + 4 * hdr.x.len;
+	}
+	else if (hdr.ext) {
+		return;
+	}
+
+	if (hlen > bits.len)
+		return;
+
+	hist_store(fec, seq, &bits);
+
+	/* the payload follows the extension, as in a decoded packet */
+	mbr = mbuf_alloc(bits.len);
+	if (!mbr)
+		return;
+
+	(void)mbuf_write_mem(mbr, bits.data, bits.len);
+	mbr->pos = hlen;
+
+	++fec->n_recovered;
+
+	fec->recovh(&hdr, mbr, fec->arg);
+
+	mem_deref(mbr);
+}
+
+
+/**
+ * Get the negotiated payload type for receiving FEC
+ *
+ * @param fec FEC state
+ *
+ * @return Payload type, or -1 if not receiving
+ */
+int fec_pt_rx(const struct fec *fec)
+{
+	return fec ? fec->pt_rx : -1;
+}
+
+
+int fec_debug(struct re_printf *pf, const struct fec *fec)
+{
+	if (!fec)
+		return 0;
+
+	return re_hprintf(pf, " fec: pt=%d/%d group=%u sent=%u recv=%u"
+			  " recovered=%u\n",
+			  fec->pt_tx, fec->pt_rx, fec->k,
+			  fec->n_sent, fec->n_recv, fec->n_recovered);
+}
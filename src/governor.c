@@ -0,0 +1,248 @@
+/**
+ * @file governor.c  CPU budget governor
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#define _DEFAULT_SOURCE 1
+#define _BSD_SOURCE 1
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifndef WIN32
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+#include <time.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * The governor keeps the calls within a CPU budget. Once a second it
+ * looks at the CPU time used by the process, and at the slowest audio
+ * frame encoded since the last check. When either is over its budget
+ * for a while, the load level goes up by one step: first the codecs use
+ * a lower complexity, then the video frame-rate is halved, and at last
+ * new calls are rejected. When the load has been well below the budget
+ * for longer, the level goes down again one step at a time.
+ *
+ * The frame times are given by the media threads, the level is read by
+ * them without locking.
+ */
+
+
+#if defined (__GNUC__) || defined (__clang__)
+#define LOAD(p)        __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define XCHG(p, v)     __atomic_exchange_n((p), (v), __ATOMIC_RELAXED)
+#else
+#error "governor: atomic builtins are required"
+#endif
+
+
+enum {
+	TMR_INTERVAL = 1000,  /**< Check interval [ms]                    */
+	FRAME_BUDGET = 500,   /**< Encode time per frame [1/1000 ptime]   */
+	UP_COUNT     = 2,     /**< Intervals over budget to step up       */
+	DOWN_COUNT   = 5,     /**< Intervals below budget to step down    */
+};
+
+
+static struct {
+	struct tmr tmr;
+	uint32_t budget;      /**< CPU budget [% of all CPUs], 0 = off    */
+	unsigned ncpu;
+	uint64_t ts_last;     /**< Wall clock at the last check [us]      */
+	uint64_t cpu_last;    /**< CPU time at the last check [us]        */
+	uint32_t cpu;         /**< CPU load in the last interval [%]      */
+	uint32_t frame;       /**< Slowest frame in the interval [1/1000] */
+	uint32_t frame_max;   /**< Slowest frame, written by media threads */
+	unsigned n_over;
+	unsigned n_under;
+	int level;
+} gov;
+
+
+static unsigned cpu_count(void)
+{
+#if defined (HAVE_UNISTD_H) && defined (_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n > 0)
+		return (unsigned)n;
+#endif
+
+	return 1;
+}
+
+
+/* CPU time used by the process [us], 0 if not known */
+static uint64_t cpu_time(void)
+{
+#ifndef WIN32
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+		+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#else
+	return 0;
+#endif
+}
+
+
+static uint64_t now_us(void)
+{
+#ifdef LINUX
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	return tmr_jiffies() * 1000;
+#endif
+}
+
+
+static const char *level_name(int level)
+{
+	switch (level) {
+
+	case GOV_NORMAL: return "normal";
+	case GOV_CODEC:  return "codec";
+	case GOV_VIDEO:  return "video";
+	case GOV_REJECT: return "reject";
+	default:         return "?";
+	}
+}
+
+
+static void set_level(int level)
+{
+	info("governor: load level %s -> %s (cpu %u%%, frame %u%%)\n",
+	     level_name(gov.level), level_name(level),
+	     gov.cpu, gov.frame / 10);
+
+	STORE(&gov.level, level);
+}
+
+
+static void tmr_handler(void *arg)
+{
+	const uint64_t ts = now_us();
+	const uint64_t cpu = cpu_time();
+	bool over, under;
+	(void)arg;
+
+	tmr_start(&gov.tmr, TMR_INTERVAL, tmr_handler, NULL);
+
+	if (ts > gov.ts_last && cpu >= gov.cpu_last) {
+		gov.cpu = (uint32_t)(100 * (cpu - gov.cpu_last)
+				     / ((ts - gov.ts_last) * gov.ncpu));
+	}
+
+	gov.ts_last  = ts;
+	gov.cpu_last = cpu;
+	gov.frame    = XCHG(&gov.frame_max, 0);
+
+	over  = gov.cpu > gov.budget || gov.frame > FRAME_BUDGET;
+	under = gov.cpu < gov.budget * 3 / 4 && gov.frame < FRAME_BUDGET / 2;
+
+	gov.n_over  = over  ? gov.n_over + 1  : 0;
+	gov.n_under = under ? gov.n_under + 1 : 0;
+
+	if (gov.n_over >= UP_COUNT && gov.level < GOV_REJECT) {
+		gov.n_over = 0;
+		set_level(gov.level + 1);
+	}
+	else if (gov.n_under >= DOWN_COUNT && gov.level > GOV_NORMAL) {
+		gov.n_under = 0;
+		set_level(gov.level - 1);
+	}
+}
+
+
+/**
+ * Start the governor
+ *
+ * @param budget CPU budget in percent of all CPUs, 0 to disable
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int governor_init(uint32_t budget)
+{
+	governor_close();
+
+	if (!budget)
+		return 0;
+
+	gov.ncpu     = cpu_count();
+	gov.ts_last  = now_us();
+	gov.cpu_last = cpu_time();
+	STORE(&gov.budget, min(budget, 100));
+
+	info("governor: CPU budget %u%% of %u CPUs\n", gov.budget, gov.ncpu);
+
+	tmr_start(&gov.tmr, TMR_INTERVAL, tmr_handler, NULL);
+
+	return 0;
+}
+
+
+void governor_close(void)
+{
+	tmr_cancel(&gov.tmr);
+
+	gov.n_over  = 0;
+	gov.n_under = 0;
+	STORE(&gov.budget, 0);
+	STORE(&gov.level, GOV_NORMAL);
+}
+
+
+/**
+ * Get the timestamp for the start of a frame
+ *
+ * @return Timestamp to give to governor_frame(), 0 if not enabled
+ */
+uint64_t governor_clock(void)
+{
+	return LOAD(&gov.budget) ? now_us() : 0;
+}
+
+
+/**
+ * Account the processing time of one media frame
+ *
+ * @param t0    Timestamp from governor_clock()
+ * @param ptime Packet time of the frame [ms]
+ */
+void governor_frame(uint64_t t0, uint32_t ptime)
+{
+	uint32_t frame;
+
+	if (!t0 || !ptime)
+		return;
+
+	frame = (uint32_t)((now_us() - t0) / ptime);
+
+	/* a lost maximum is picked up by the next frame */
+	if (frame > LOAD(&gov.frame_max))
+		STORE(&gov.frame_max, frame);
+}
+
+
+/**
+ * Get the current load level
+ *
+ * @return Load level
+ */
+enum governor_level governor_level(void)
+{
+	return (enum governor_level)LOAD(&gov.level);
+}
+
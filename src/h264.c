@@ -9,6 +9,20 @@
 #include <baresip.h>
 
 
+enum {
+	STAP_SIZE = 1500,    /**< Largest aggregation packet [bytes]   */
+	STAP_NALS = 16,      /**< Largest number of aggregated NALs     */
+};
+
+/** NAL units waiting to be sent in one STAP-A packet */
+struct stap {
+	const uint8_t *nalv[STAP_NALS];
+	size_t szv[STAP_NALS];
+	unsigned n;
+	size_t size;         /**< Payload size with all NALs [bytes]   */
+};
+
+
 int h264_hdr_encode(const struct h264_hdr *hdr, struct mbuf *mb)
 {
 	uint8_t v;
@@ -150,6 +164,114 @@ int h264_nal_send(bool first, bool last,
 }
 
 
+/*
+ * Send the waiting NAL units. A single NAL unit is sent as it is, more
+ * are copied into one STAP-A packet (RFC 6184 section 5.7.1), which
+ * has the highest NRI of all of them.
+ */
+static int stap_send(struct stap *st, bool marker,
+		     videnc_packet_h *pkth, void *arg)
+{
+	uint8_t pkt[STAP_SIZE], hdr = H264_NAL_STAP_A;
+	size_t len = 0;
+	unsigned i;
+
+	if (!st->n)
+		return 0;
+
+	if (st->n == 1) {
+		st->n = 0;
+		return pkth(marker, st->nalv[0], 1, st->nalv[0] + 1,
+			    st->szv[0] - 1, arg);
+	}
+
+	for (i=0; i<st->n; i++) {
+
+		hdr |= st->nalv[i][0] & 0x80;
+		if ((st->nalv[i][0] & 0x60) > (hdr & 0x60))
+			hdr = (hdr & ~0x60) | (st->nalv[i][0] & 0x60);
+
+		pkt[len++] = (uint8_t)(st->szv[i] >> 8);
+		pkt[len++] = (uint8_t)(st->szv[i] & 0xff);
+		memcpy(&pkt[len], st->nalv[i], st->szv[i]);
+		len += st->szv[i];
+	}
+
+	st->n = 0;
+
+	return pkth(marker, &hdr, 1, pkt, len, arg);
+}
+
+
+/**
+ * Packetize an H.264 byte stream, with the small NAL units aggregated
+ * in STAP-A packets. This requires packetization-mode 1.
+ *
+ * @param buf     H.264 byte stream with start codes
+ * @param len     Length of the byte stream
+ * @param pktsize Largest RTP payload size
+ * @param pkth    Packet handler
+ * @param arg     Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int h264_packetize_stap(const uint8_t *buf, size_t len, size_t pktsize,
+			videnc_packet_h *pkth, void *arg)
+{
+	const uint8_t *end = buf + len;
+	const size_t maxsz = min(pktsize, STAP_SIZE + 1);
+	struct stap st;
+	const uint8_t *r;
+	int err = 0;
+
+	st.n    = 0;
+	st.size = 0;
+
+	r = h264_find_startcode(buf, end);
+
+	while (r < end) {
+		const uint8_t *r1;
+		size_t sz;
+
+		/* skip zeros */
+		while (!*(r++))
+			;
+
+		r1 = h264_find_startcode(r, end);
+		sz = r1 - r;
+
+		/* STAP-A header, and a size field per NAL */
+		if (sz && 1 + 2 + sz <= maxsz) {
+
+			if (st.n && (st.n == STAP_NALS ||
+				     st.size + 2 + sz > maxsz))
+				err |= stap_send(&st, false, pkth, arg);
+
+			if (!st.n)
+				st.size = 1;
+
+			st.nalv[st.n] = r;
+			st.szv[st.n]  = sz;
+			st.size += 2 + sz;
+			++st.n;
+		}
+		else if (sz) {
+			err |= stap_send(&st, false, pkth, arg);
+			err |= h264_nal_send(true, true, (r1 >= end), r[0],
+					     r+1, sz-1, pktsize,
+					     pkth, arg);
+		}
+
+		r = r1;
+	}
+
+	/* the waiting NAL units end the frame */
+	err |= stap_send(&st, true, pkth, arg);
+
+	return err;
+}
+
+
 int h264_packetize(const uint8_t *buf, size_t len, size_t pktsize,
 		   videnc_packet_h *pkth, void *arg)
 {
@@ -0,0 +1,172 @@
+/**
+ * @file hktimer.c  Shared timers for periodic housekeeping jobs
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * Periodic jobs with the same interval share one bucket, and each
+ * bucket has one libre timer. On every tick the whole bucket is walked,
+ * so starting or stopping a job never touches the sorted timer list,
+ * and thousands of streams cost one timer per interval.
+ *
+ * A job that joins a bucket first runs on the next tick of the bucket,
+ * which is at most one interval later. Each event loop has its own
+ * buckets, as the timers of a loop only run on that loop.
+ */
+
+
+struct hkbucket {
+	struct le le;
+	struct tmr tmr;
+	struct list jobl;        /**< Jobs waiting for the next tick  */
+	struct list runl;        /**< Jobs not yet run in this tick   */
+	uint32_t interval;       /**< Interval in [ms]                */
+	uint32_t n;              /**< Number of jobs                  */
+};
+
+
+static struct list bucketv[SHARD_MAX + 1];
+
+
+static void bucket_destructor(void *arg)
+{
+	struct hkbucket *b = arg;
+
+	tmr_cancel(&b->tmr);
+	list_unlink(&b->le);
+}
+
+
+static void bucket_handler(void *arg)
+{
+	struct hkbucket *b = arg;
+	struct le *le;
+
+	tmr_start(&b->tmr, b->interval, bucket_handler, b);
+
+	while ((le = list_head(&b->jobl))) {
+		list_unlink(le);
+		list_append(&b->runl, le, le->data);
+	}
+
+	/* a job may start or cancel any job, including itself */
+	mem_ref(b);
+
+	while ((le = list_head(&b->runl))) {
+
+		struct hktmr *ht = le->data;
+
+		list_unlink(le);
+		list_append(&b->jobl, le, ht);
+
+		ht->h(ht->arg);
+	}
+
+	mem_deref(b);
+}
+
+
+static struct hkbucket *bucket_get(uint32_t interval)
+{
+	struct list *bucketl = &bucketv[shard_loop()];
+	struct hkbucket *b;
+	struct le *le;
+
+	for (le = list_head(bucketl); le; le = le->next) {
+
+		b = le->data;
+
+		if (b->interval == interval)
+			return b;
+	}
+
+	b = mem_zalloc(sizeof(*b), bucket_destructor);
+	if (!b)
+		return NULL;
+
+	b->interval = interval;
+
+	list_append(bucketl, &b->le, b);
+	tmr_start(&b->tmr, interval, bucket_handler, b);
+
+	return b;
+}
+
+
+/**
+ * Start a periodic housekeeping job, or restart it with a new interval
+ *
+ * @param ht       Housekeeping timer, zero-initialised or cancelled
+ * @param interval Interval in [ms]
+ * @param h        Handler called on every tick
+ * @param arg      Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int hktmr_start(struct hktmr *ht, uint32_t interval, hktmr_h *h, void *arg)
+{
+	struct hkbucket *b;
+
+	if (!ht || !interval || !h)
+		return EINVAL;
+
+	hktmr_cancel(ht);
+
+	b = bucket_get(interval);
+	if (!b)
+		return ENOMEM;
+
+	ht->bucket = b;
+	ht->h      = h;
+	ht->arg    = arg;
+
+	list_append(&b->jobl, &ht->le, ht);
+	++b->n;
+
+	return 0;
+}
+
+
+/**
+ * Stop a periodic housekeeping job
+ *
+ * @param ht Housekeeping timer
+ */
+void hktmr_cancel(struct hktmr *ht)
+{
+	struct hkbucket *b;
+
+	if (!ht || !ht->bucket)
+		return;
+
+	b = ht->bucket;
+
+	list_unlink(&ht->le);
+	ht->bucket = NULL;
+
+	if (--b->n == 0) {
+
+		/* a running tick still holds a reference */
+		tmr_cancel(&b->tmr);
+		list_unlink(&b->le);
+		mem_deref(b);
+	}
+}
+
+
+/**
+ * Check if a periodic housekeeping job is running
+ *
+ * @param ht Housekeeping timer
+ *
+ * @return True if running, False if not running
+ */
+bool hktmr_isrunning(const struct hktmr *ht)
+{
+	return ht ? ht->bucket != NULL : false;
+}
@@ -0,0 +1,231 @@
+/**
+ * @file kernel.c  Media kernels selected by CPU features
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * A media kernel, e.g. the G.711 encoder, has a plain C implementation
+ * and one for each instruction set that it was written for. The code
+ * that owns the kernel calls it through a function pointer, which
+ * points to the C implementation until the kernel is registered. The
+ * CPU is probed once, at startup, and the pointer of each kernel is
+ * then set to the last of its implementations that the CPU can run.
+ *
+ * A kernel can also be set to any of its implementations by hand, e.g.
+ * to test them against the C implementation.
+ */
+
+
+static struct list kernell;
+static uint32_t cpu_feat;
+static bool cpu_probed;
+
+
+static uint32_t cpu_probe(void)
+{
+	uint32_t feat = 0;
+
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2"))
+		feat |= CPU_SSE2;
+	if (__builtin_cpu_supports("avx2"))
+		feat |= CPU_AVX2;
+#elif defined (__aarch64__) || defined (__ARM_NEON) || defined (__ARM_NEON__)
+	/* mandatory on AArch64, and the build was made for it on ARMv7 */
+	feat |= CPU_NEON;
+#endif
+
+	return feat;
+}
+
+
+/**
+ * Get the features of the CPU that the media kernels can use
+ *
+ * @return Bitmask of CPU features (enum cpu_feat)
+ */
+uint32_t cpu_features(void)
+{
+	if (!cpu_probed) {
+		cpu_feat   = cpu_probe();
+		cpu_probed = true;
+	}
+
+	return cpu_feat;
+}
+
+
+static struct kernel *kernel_find(const char *name)
+{
+	struct le *le;
+
+	for (le = kernell.head; le; le = le->next) {
+		struct kernel *k = le->data;
+
+		if (0 == str_cmp(k->name, name))
+			return k;
+	}
+
+	return NULL;
+}
+
+
+static bool impl_runs(const struct kernel_impl *impl)
+{
+	return (impl->feat & cpu_features()) == impl->feat;
+}
+
+
+static void kernel_set(struct kernel *k, const struct kernel_impl *impl)
+{
+	*k->fnp = impl->fn;
+	k->cur  = impl;
+}
+
+
+static void kernel_best(struct kernel *k)
+{
+	size_t i = k->implc;
+
+	while (i--) {
+		if (impl_runs(&k->implv[i])) {
+			kernel_set(k, &k->implv[i]);
+			return;
+		}
+	}
+}
+
+
+/**
+ * Register a media kernel, and select its best implementation
+ *
+ * @param k Media kernel, which is not copied
+ */
+void kernel_register(struct kernel *k)
+{
+	if (!k || !k->fnp || !k->implc)
+		return;
+
+	if (!k->le.list)
+		list_append(&kernell, &k->le, k);
+
+	kernel_best(k);
+}
+
+
+/**
+ * Register the media kernels of the core
+ */
+void kernel_init(void)
+{
+	(void)cpu_features();
+
+	aupcm_kernels();
+#ifdef USE_VIDEO
+	vidscale_kernels();
+#endif
+}
+
+
+/**
+ * Select an implementation of a media kernel
+ *
+ * @param name Kernel name, e.g. "ulaw_encode"
+ * @param isa  Instruction set, e.g. "sse2", or NULL for the best one
+ *
+ * @return 0 if success, ENOENT if the kernel or implementation is not
+ *         in this build, ENOTSUP if the CPU can not run it
+ */
+int kernel_select(const char *name, const char *isa)
+{
+	struct kernel *k;
+	size_t i;
+
+	k = kernel_find(name);
+	if (!k)
+		return ENOENT;
+
+	if (!isa) {
+		kernel_best(k);
+		return 0;
+	}
+
+	for (i=0; i<k->implc; i++) {
+
+		const struct kernel_impl *impl = &k->implv[i];
+
+		if (str_cmp(impl->isa, isa))
+			continue;
+
+		if (!impl_runs(impl))
+			return ENOTSUP;
+
+		kernel_set(k, impl);
+		return 0;
+	}
+
+	return ENOENT;
+}
+
+
+/**
+ * Get the selected implementation of a media kernel
+ *
+ * @param name Kernel name
+ *
+ * @return Instruction set of the implementation, NULL if not found
+ */
+const char *kernel_isa(const char *name)
+{
+	const struct kernel *k = kernel_find(name);
+
+	return (k && k->cur) ? k->cur->isa : NULL;
+}
+
+
+/**
+ * Print the CPU features and the media kernels
+ *
+ * @param pf     Print handler
+ * @param unused Unused parameter
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int kernel_debug(struct re_printf *pf, void *unused)
+{
+	const uint32_t feat = cpu_features();
+	struct le *le;
+	int err;
+	(void)unused;
+
+	err = re_hprintf(pf, "CPU features:%s%s%s\n",
+			 feat & CPU_SSE2 ? " sse2" : "",
+			 feat & CPU_AVX2 ? " avx2" : "",
+			 feat & CPU_NEON ? " neon" : "");
+
+	for (le = kernell.head; le; le = le->next) {
+
+		const struct kernel *k = le->data;
+		size_t i;
+
+		err |= re_hprintf(pf, "  %-16s %-5s (",
+				  k->name, k->cur ? k->cur->isa : "?");
+
+		for (i=0; i<k->implc; i++) {
+			err |= re_hprintf(pf, "%s%s%s", i ? " " : "",
+					  k->implv[i].isa,
+					  impl_runs(&k->implv[i]) ? "" : "-");
+		}
+
+		err |= re_hprintf(pf, ")\n");
+	}
+
+	return err;
+}
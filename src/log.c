@@ -4,20 +4,90 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
+#include <pthread.h>
+#include <time.h>
 #include <re.h>
 #include <baresip.h>
 
 
+/*
+ * In asynchronous mode every thread that logs gets a ring of its own
+ * and writes pre-formatted records into it without taking a lock. One
+ * writer thread drains the rings in sequence order and does the
+ * output to stderr and to the registered handlers, so the handlers
+ * are called from the writer thread only. If a ring is full, the
+ * record is dropped and counted, the logging thread never waits.
+ */
+
+
+#if defined (__GNUC__) || defined (__clang__)
+#define LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOAD_RELAXED(p)     __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ADD(p, v)           (void)__atomic_add_fetch((p), (v), \
+						     __ATOMIC_RELAXED)
+#define FETCH_ADD(p, v)     __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define XCHG(p, v)          __atomic_exchange_n((p), (v), __ATOMIC_RELAXED)
+#else
+#error "log: atomic builtins are required"
+#endif
+
+
+enum {
+	LOG_RING_SIZE   = 64,    /* Records per thread, power of two */
+	LOG_MSG_SIZE    = 1000,  /* Longer messages are truncated    */
+	LOG_WRITER_WAIT = 20,    /* Writer idle wait in [ms]         */
+	LOG_RL_BURST    = 10,    /* Messages per rate limit interval */
+	LOG_RL_INTERVAL = 5000,  /* Rate limit interval in [ms]      */
+};
+
+struct log_rec {
+	uint64_t seq;            /**< Global sequence number            */
+	enum log_level level;    /**< Log level                         */
+	char msg[LOG_MSG_SIZE];  /**< Formatted message                 */
+};
+
+struct log_ring {
+	struct le le;            /**< Member of lg.ringl                */
+	struct log_rec recv[LOG_RING_SIZE]; /**< Record storage         */
+	uint32_t wpos;           /**< Write position (owner thread)     */
+	uint32_t rpos;           /**< Read position (writer thread)     */
+	uint32_t n_drop;         /**< Records dropped on a full ring    */
+	bool dead;               /**< Owner thread has exited           */
+};
+
+
 static struct {
 	struct list logl;
+	struct list modl;
 	bool debug;
 	bool info;
 	bool stder;
+
+	/* Asynchronous mode */
+	bool async;              /**< Records go to the rings           */
+	bool run;                /**< Writer thread is running          */
+	pthread_t tid;           /**< Writer thread                     */
+	pthread_key_t key;       /**< Ring of the calling thread        */
+	pthread_mutex_t mutex;   /**< Protects logl and ringl           */
+	pthread_cond_t cond;     /**< Wakes up the writer thread        */
+	struct list ringl;       /**< All rings (struct log_ring)       */
+	uint64_t seq;            /**< Next record sequence number       */
 } lg = {
+	LIST_INIT,
 	LIST_INIT,
 	false,
 	true,
-	true
+	true,
+
+	false,
+	false,
+	0,
+	0,
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	LIST_INIT,
+	0
 };
 
 
@@ -26,7 +96,9 @@ void log_register_handler(struct log *log)
 	if (!log)
 		return;
 
+	pthread_mutex_lock(&lg.mutex);
 	list_append(&lg.logl, &log->le, log);
+	pthread_mutex_unlock(&lg.mutex);
 }
 
 
@@ -35,7 +107,9 @@ void log_unregister_handler(struct log *log)
 	if (!log)
 		return;
 
+	pthread_mutex_lock(&lg.mutex);
 	list_unlink(&log->le);
+	pthread_mutex_unlock(&lg.mutex);
 }
 
 
@@ -45,6 +119,112 @@ void log_enable_debug(bool enable)
 }
 
 
+/**
+ * Register the runtime debug switch of a module
+ *
+ * The switch is independent of log_enable_debug() and starts out
+ * disabled. Registering it twice has no effect.
+ *
+ * @param lm Module debug switch
+ */
+void log_mod_register(struct log_mod *lm)
+{
+	if (!lm)
+		return;
+
+	pthread_mutex_lock(&lg.mutex);
+
+	if (!lm->le.list)
+		list_append(&lg.modl, &lm->le, lm);
+
+	pthread_mutex_unlock(&lg.mutex);
+}
+
+
+/**
+ * Unregister the runtime debug switch of a module
+ *
+ * @param lm Module debug switch
+ */
+void log_mod_unregister(struct log_mod *lm)
+{
+	if (!lm)
+		return;
+
+	pthread_mutex_lock(&lg.mutex);
+	list_unlink(&lm->le);
+	pthread_mutex_unlock(&lg.mutex);
+}
+
+
+/**
+ * Enable or disable the debug messages of one module
+ *
+ * @param name   Module name
+ * @param enable True to enable, false to disable
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int log_mod_enable_debug(const char *name, bool enable)
+{
+	struct le *le;
+	int err = ENOENT;
+
+	if (!name)
+		return EINVAL;
+
+	pthread_mutex_lock(&lg.mutex);
+
+	for (le = lg.modl.head; le; le = le->next) {
+
+		struct log_mod *lm = le->data;
+
+		if (0 == str_casecmp(lm->name, name)) {
+			lm->debug = enable;
+			err = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&lg.mutex);
+
+	return err;
+}
+
+
+/**
+ * Print the debug switches of all modules
+ *
+ * @param pf     Print handler
+ * @param unused Unused parameter
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int log_mod_debug(struct re_printf *pf, void *unused)
+{
+	struct le *le;
+	int err;
+
+	(void)unused;
+
+	err = re_hprintf(pf, "--- Module debug (%s compiled in) ---\n",
+			 BARESIP_LOG_LEVEL > LEVEL_DEBUG ? "not" : "is");
+
+	pthread_mutex_lock(&lg.mutex);
+
+	for (le = lg.modl.head; le; le = le->next) {
+
+		const struct log_mod *lm = le->data;
+
+		err |= re_hprintf(pf, "  %-12s %s\n", lm->name,
+				  lm->debug ? "on" : "off");
+	}
+
+	pthread_mutex_unlock(&lg.mutex);
+
+	return err;
+}
+
+
 void log_enable_info(bool enable)
 {
 	lg.info = enable;
@@ -57,14 +237,10 @@ void log_enable_stderr(bool enable)
 }
 
 
-void vlog(enum log_level level, const char *fmt, va_list ap)
+static void output(enum log_level level, const char *msg)
 {
-	char buf[4096];
 	struct le *le;
 
-	if (re_vsnprintf(buf, sizeof(buf), fmt, ap) < 0)
-		return;
-
 	if (lg.stder) {
 
 		bool color = level == LEVEL_WARN || level == LEVEL_ERROR;
@@ -72,7 +248,7 @@ void vlog(enum log_level level, const char *fmt, va_list ap)
 		if (color)
 			(void)re_fprintf(stderr, "\x1b[31m"); /* Red */
 
-		(void)re_fprintf(stderr, "%s", buf);
+		(void)re_fprintf(stderr, "%s", msg);
 
 		if (color)
 			(void)re_fprintf(stderr, "\x1b[;m");
@@ -86,8 +262,278 @@ void vlog(enum log_level level, const char *fmt, va_list ap)
 		le = le->next;
 
 		if (log->h)
-			log->h(level, buf);
+			log->h(level, msg);
+	}
+}
+
+
+/* Called in the owner thread when it exits */
+static void ring_release(void *arg)
+{
+	struct log_ring *ring = arg;
+
+	STORE_RELEASE(&ring->dead, true);
+}
+
+
+static struct log_ring *ring_get(void)
+{
+	struct log_ring *ring;
+
+	ring = pthread_getspecific(lg.key);
+	if (ring)
+		return ring;
+
+	ring = mem_zalloc(sizeof(*ring), NULL);
+	if (!ring)
+		return NULL;
+
+	pthread_mutex_lock(&lg.mutex);
+	list_append(&lg.ringl, &ring->le, ring);
+	pthread_mutex_unlock(&lg.mutex);
+
+	if (pthread_setspecific(lg.key, ring)) {
+		ring_release(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+
+static void ring_push(enum log_level level, const char *msg)
+{
+	struct log_ring *ring = ring_get();
+	struct log_rec *rec;
+	uint32_t wpos;
+
+	if (!ring)
+		return;
+
+	wpos = ring->wpos;
+
+	if (wpos - LOAD_ACQUIRE(&ring->rpos) >= LOG_RING_SIZE) {
+		ADD(&ring->n_drop, 1);
+		return;
 	}
+
+	rec = &ring->recv[wpos & (LOG_RING_SIZE - 1)];
+
+	rec->seq   = FETCH_ADD(&lg.seq, 1);
+	rec->level = level;
+	str_ncpy(rec->msg, msg, sizeof(rec->msg));
+
+	STORE_RELEASE(&ring->wpos, wpos + 1);
+
+	/* Do not wait for the writer to wake up on its own */
+	if (level >= LEVEL_WARN)
+		pthread_cond_signal(&lg.cond);
+}
+
+
+/* Output all pending records in sequence order, lg.mutex is held */
+static void drain(void)
+{
+	struct le *le;
+
+	for (;;) {
+		struct log_ring *next = NULL;
+		uint64_t seq = 0;
+		struct log_rec *rec;
+
+		for (le = lg.ringl.head; le; le = le->next) {
+
+			struct log_ring *ring = le->data;
+			uint32_t rpos = ring->rpos;
+
+			if (rpos == LOAD_ACQUIRE(&ring->wpos))
+				continue;
+
+			rec = &ring->recv[rpos & (LOG_RING_SIZE - 1)];
+
+			if (!next || rec->seq < seq) {
+				next = ring;
+				seq  = rec->seq;
+			}
+		}
+
+		if (!next)
+			break;
+
+		rec = &next->recv[next->rpos & (LOG_RING_SIZE - 1)];
+
+		output(rec->level, rec->msg);
+
+		STORE_RELEASE(&next->rpos, next->rpos + 1);
+	}
+
+	le = lg.ringl.head;
+
+	while (le) {
+
+		struct log_ring *ring = le->data;
+		uint32_t n_drop = XCHG(&ring->n_drop, 0);
+		bool dead = LOAD_ACQUIRE(&ring->dead);
+		char buf[64];
+
+		le = le->next;
+
+		if (n_drop) {
+			if (re_snprintf(buf, sizeof(buf),
+					"log: %u messages dropped\n",
+					n_drop) >= 0)
+				output(LEVEL_WARN, buf);
+		}
+
+		/* No more records after the owner thread has exited */
+		if (dead && ring->rpos == LOAD_ACQUIRE(&ring->wpos)) {
+			list_unlink(&ring->le);
+			mem_deref(ring);
+		}
+	}
+}
+
+
+static void *writer_thread(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&lg.mutex);
+
+	while (lg.run) {
+
+		struct timespec ts;
+		uint64_t ns;
+
+		drain();
+
+		(void)clock_gettime(CLOCK_REALTIME, &ts);
+		ns = ts.tv_nsec + LOG_WRITER_WAIT * 1000000ULL;
+		ts.tv_sec  += (time_t)(ns / 1000000000ULL);
+		ts.tv_nsec  = (long)(ns % 1000000000ULL);
+
+		(void)pthread_cond_timedwait(&lg.cond, &lg.mutex, &ts);
+	}
+
+	drain();
+
+	pthread_mutex_unlock(&lg.mutex);
+
+	return NULL;
+}
+
+
+/**
+ * Enable or disable asynchronous logging
+ *
+ * When enabled, log messages are queued by the calling thread and
+ * written by a dedicated writer thread, and the log handlers are
+ * called from that thread. Disabling it writes all queued messages.
+ * It must be disabled while no other thread is logging, e.g. after
+ * all modules have been unloaded.
+ *
+ * @param enable True to enable, false to disable
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int log_enable_async(bool enable)
+{
+	int err;
+
+	if (enable == lg.async)
+		return 0;
+
+	if (enable) {
+
+		err = pthread_key_create(&lg.key, ring_release);
+		if (err)
+			return err;
+
+		lg.run = true;
+
+		err = pthread_create(&lg.tid, NULL, writer_thread, NULL);
+		if (err) {
+			lg.run = false;
+			(void)pthread_key_delete(lg.key);
+			return err;
+		}
+
+		STORE_RELEASE(&lg.async, true);
+	}
+	else {
+		STORE_RELEASE(&lg.async, false);
+
+		pthread_mutex_lock(&lg.mutex);
+		lg.run = false;
+		pthread_cond_signal(&lg.cond);
+		pthread_mutex_unlock(&lg.mutex);
+
+		pthread_join(lg.tid, NULL);
+
+		/* Destructors are not called for a deleted key */
+		(void)pthread_key_delete(lg.key);
+		list_flush(&lg.ringl);
+	}
+
+	return 0;
+}
+
+
+/**
+ * Check if a repeated message may be logged
+ *
+ * At most a burst of messages is let through per interval, the rest
+ * is counted. Use one rate limiter per message and owner thread.
+ *
+ * @param rl         Rate limiter state, zero-initialised
+ * @param suppressed Returns the number of messages suppressed since
+ *                   the previous message that was let through
+ *
+ * @return True if the message should be logged, otherwise false
+ */
+bool log_ratelimit(struct log_rl *rl, uint32_t *suppressed)
+{
+	const uint64_t now = tmr_jiffies();
+
+	if (!rl)
+		return true;
+
+	if (!rl->ts || now - rl->ts >= LOG_RL_INTERVAL) {
+		rl->ts = now;
+		rl->n  = 0;
+	}
+
+	if (rl->n >= LOG_RL_BURST) {
+		++rl->nsupp;
+		return false;
+	}
+
+	++rl->n;
+
+	if (suppressed)
+		*suppressed = rl->nsupp;
+
+	rl->nsupp = 0;
+
+	return true;
+}
+
+
+void vlog(enum log_level level, const char *fmt, va_list ap)
+{
+	char buf[4096];
+
+	if (re_vsnprintf(buf, sizeof(buf), fmt, ap) < 0)
+		return;
+
+	/* The writer thread holds lg.mutex while calling the handlers */
+	if (LOAD_ACQUIRE(&lg.async) &&
+	    !pthread_equal(pthread_self(), lg.tid)) {
+		ring_push(level, buf);
+		return;
+	}
+
+	output(level, buf);
 }
 
 
@@ -107,7 +553,19 @@ void loglv(enum log_level level, const char *fmt, ...)
 }
 
 
-void debug(const char *fmt, ...)
+/* Debug message that was already enabled by the caller, see mod_dbg() */
+void log_debug(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vlog(LEVEL_DEBUG, fmt, ap);
+	va_end(ap);
+}
+
+
+/* The names are in parentheses, debug() and info() may be macros */
+void (debug)(const char *fmt, ...)
 {
 	va_list ap;
 
@@ -120,7 +578,7 @@ void debug(const char *fmt, ...)
 }
 
 
-void info(const char *fmt, ...)
+void (info)(const char *fmt, ...)
 {
 	va_list ap;
 
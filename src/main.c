@@ -52,6 +52,7 @@ static void usage(void)
 #if HAVE_INET6
 			 "\t-6               Prefer IPv6\n"
 #endif
+			 "\t-a               Asynchronous logging\n"
 			 "\t-d               Daemon\n"
 			 "\t-e <commands>    Execute commands (repeat)\n"
 			 "\t-f <path>        Config path\n"
@@ -90,7 +91,7 @@ int main(int argc, char *argv[])
 
 #ifdef HAVE_GETOPT
 	for (;;) {
-		const int c = getopt(argc, argv, "6de:f:p:hu:vtm:");
+		const int c = getopt(argc, argv, "6ade:f:p:hu:vtm:");
 		if (0 > c)
 			break;
 
@@ -107,6 +108,15 @@ int main(int argc, char *argv[])
 			break;
 #endif
 
+		case 'a':
+			err = log_enable_async(true);
+			if (err) {
+				warning("main: async logging failed (%m)\n",
+					err);
+				goto out;
+			}
+			break;
+
 		case 'd':
 			run_daemon = true;
 			break;
@@ -255,6 +265,9 @@ int main(int argc, char *argv[])
 	debug("main: unloading modules..\n");
 	mod_close();
 
+	/* Write all queued log messages */
+	(void)log_enable_async(false);
+
 	libre_close();
 
 	/* Check for memory leaks */
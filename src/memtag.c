@@ -0,0 +1,247 @@
+/**
+ * @file memtag.c  Memory accounting per module and core subsystem
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * The objects of a module or a core subsystem are counted in its tag
+ * when they are allocated, and again in their destructor, with the size
+ * that the owner knows of. Objects are allocated in the media threads
+ * too, so the counters are updated with relaxed atomics, which costs a
+ * few instructions per object. The peak may miss a concurrent update.
+ *
+ * The core subsystems have static tags. A tag is made for each module
+ * that is loaded, and the module counts its objects there.
+ */
+
+
+static struct memtag corev[MEMTAG_CORE_MAX] = {
+	{LE_INIT, "ua",     0, 0, 0, 0},
+	{LE_INIT, "call",   0, 0, 0, 0},
+	{LE_INIT, "stream", 0, 0, 0, 0},
+	{LE_INIT, "audio",  0, 0, 0, 0},
+	{LE_INIT, "video",  0, 0, 0, 0},
+};
+
+static struct list tagl;
+
+
+static void tag_destructor(void *arg)
+{
+	struct memtag *tag = arg;
+
+	list_unlink(&tag->le);
+}
+
+
+/**
+ * Add the static tags of the core subsystems
+ */
+void memtag_init(void)
+{
+	size_t i;
+
+	for (i=0; i<ARRAY_SIZE(corev); i++) {
+
+		if (!corev[i].le.list)
+			list_append(&tagl, &corev[i].le, &corev[i]);
+	}
+}
+
+
+/**
+ * Remove all tags, the tags of the modules are freed
+ */
+void memtag_close(void)
+{
+	size_t i;
+
+	for (i=0; i<ARRAY_SIZE(corev); i++)
+		list_unlink(&corev[i].le);
+
+	list_flush(&tagl);
+}
+
+
+/**
+ * Get the tag of a core subsystem
+ *
+ * @param id Core subsystem
+ *
+ * @return Memory tag
+ */
+struct memtag *memtag_core(enum memtag_core id)
+{
+	return id < MEMTAG_CORE_MAX ? &corev[id] : NULL;
+}
+
+
+/**
+ * Find a memory tag
+ *
+ * @param name Module or subsystem name
+ *
+ * @return Memory tag if found, otherwise NULL
+ */
+struct memtag *memtag_find(const char *name)
+{
+	struct le *le;
+
+	for (le = tagl.head; le; le = le->next) {
+		struct memtag *tag = le->data;
+
+		if (0 == str_casecmp(tag->name, name))
+			return tag;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Get the tag of a module, it is made if it does not exist
+ *
+ * @param name Module name
+ *
+ * @return Memory tag, NULL if out of memory
+ */
+struct memtag *memtag_register(const char *name)
+{
+	struct memtag *tag;
+
+	if (!str_isset(name))
+		return NULL;
+
+	tag = memtag_find(name);
+	if (tag)
+		return tag;
+
+	tag = mem_zalloc(sizeof(*tag), tag_destructor);
+	if (!tag)
+		return NULL;
+
+	str_ncpy(tag->name, name, sizeof(tag->name));
+	list_append(&tagl, &tag->le, tag);
+
+	return tag;
+}
+
+
+/**
+ * Count an allocated object
+ *
+ * @param tag  Memory tag, may be NULL
+ * @param size Size of the object [bytes]
+ */
+void memtag_alloc(struct memtag *tag, size_t size)
+{
+	size_t bytes;
+
+	if (!tag)
+		return;
+
+	__atomic_add_fetch(&tag->n_alloc, 1, __ATOMIC_RELAXED);
+	bytes = __atomic_add_fetch(&tag->bytes, size, __ATOMIC_RELAXED);
+
+	if (bytes > __atomic_load_n(&tag->peak, __ATOMIC_RELAXED))
+		__atomic_store_n(&tag->peak, bytes, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Count a freed object
+ *
+ * @param tag  Memory tag, may be NULL
+ * @param size Size of the object [bytes], as when it was counted
+ */
+void memtag_free(struct memtag *tag, size_t size)
+{
+	if (!tag)
+		return;
+
+	__atomic_add_fetch(&tag->n_free, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&tag->bytes, size, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Count a change of the size of an object
+ *
+ * @param tag  Memory tag, may be NULL
+ * @param old  Old size [bytes]
+ * @param size New size [bytes]
+ */
+void memtag_resize(struct memtag *tag, size_t old, size_t size)
+{
+	size_t bytes;
+
+	if (!tag || size == old)
+		return;
+
+	if (size < old) {
+		__atomic_sub_fetch(&tag->bytes, old - size, __ATOMIC_RELAXED);
+		return;
+	}
+
+	bytes = __atomic_add_fetch(&tag->bytes, size - old, __ATOMIC_RELAXED);
+
+	if (bytes > __atomic_load_n(&tag->peak, __ATOMIC_RELAXED))
+		__atomic_store_n(&tag->peak, bytes, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Get the list of memory tags
+ *
+ * @return List of memory tags (struct memtag)
+ */
+struct list *memtag_list(void)
+{
+	return &tagl;
+}
+
+
+/**
+ * Print the memory of each module and core subsystem
+ *
+ * @param pf     Print handler
+ * @param unused Unused parameter
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int memtag_debug(struct re_printf *pf, void *unused)
+{
+	struct le *le;
+	int err;
+	(void)unused;
+
+	err = re_hprintf(pf, "%-16s %12s %12s %10s %12s\n",
+			 "tag", "bytes", "peak", "objects", "allocs");
+
+	for (le = tagl.head; le; le = le->next) {
+
+		const struct memtag *tag = le->data;
+		const uint64_t n_alloc = __atomic_load_n(&tag->n_alloc,
+							 __ATOMIC_RELAXED);
+		const uint64_t n_free  = __atomic_load_n(&tag->n_free,
+							 __ATOMIC_RELAXED);
+
+		if (!n_alloc)
+			continue;
+
+		err |= re_hprintf(pf, "%-16s %12zu %12zu %10llu %12llu\n",
+				  tag->name,
+				  __atomic_load_n(&tag->bytes,
+						  __ATOMIC_RELAXED),
+				  __atomic_load_n(&tag->peak,
+						  __ATOMIC_RELAXED),
+				  n_alloc - n_free, n_alloc);
+	}
+
+	return err;
+}
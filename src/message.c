@@ -8,17 +8,76 @@
 #include "core.h"
 
 
+/*
+ * Outgoing messages are queued per destination, which is the account
+ * and the next hop, i.e. the outbound proxy or the host of the peer.
+ * With sip_msg_window set, only that many MESSAGE requests of one
+ * destination are in flight at a time, the next one is sent when a
+ * response arrives. The destination keeps the digest credentials, so
+ * after the first challenge the requests are authenticated right away.
+ * The SIP stack shares the connection to the next hop.
+ */
+
+
+enum {
+	DEST_HASH_SIZE = 64,
+	DEST_IDLE      = 60000,     /**< Idle destination is freed [ms]     */
+};
+
+/** Messages to one destination */
+struct msg_dest {
+	struct le he;               /**< Hash element, by key               */
+	struct list q;              /**< Queued messages (struct msg_out)   */
+	struct list sentl;          /**< Messages in flight                 */
+	struct account *acc;        /**< Account of the sender              */
+	struct sip_auth *auth;      /**< Shared credentials                 */
+	struct tmr tmr;             /**< Frees the idle destination         */
+	char *key;                  /**< AOR and next hop                   */
+};
+
+/** Outgoing message */
+struct msg_out {
+	struct le le;               /**< Element of the queue or sentl      */
+	struct msg_dest *dest;      /**< Destination, not referenced        */
+	struct sip_loopstate ls;
+	struct sip_dialog *dlg;
+	struct sip_request *req;
+	char *body;
+	uint64_t ts;                /**< Time the request was first sent    */
+	bool queued;                /**< Waiting for the window             */
+};
+
 static struct sip_lsnr *lsnr;
 static message_recv_h *recvh;
 static void *recvarg;
+static struct hash *ht_dest;
+
+static struct {
+	uint64_t n_sent;            /**< Requests sent                      */
+	uint64_t n_ok;              /**< 2xx responses                      */
+	uint64_t n_fail;            /**< Errors and error responses         */
+	uint64_t n_auth;            /**< Requests sent again with auth      */
+	uint64_t ms_total;          /**< Sum of the delivery times          */
+	uint32_t n_queued;          /**< Waiting for the window             */
+	uint32_t n_dest;            /**< Destinations                       */
+} msgstat;
 
 
 static void handle_message(struct ua *ua, const struct sip_msg *msg)
 {
 	static const char ctype_text[] = "text/plain";
 	struct pl ctype_pl = {ctype_text, sizeof(ctype_text)-1};
+	char uri[256];
 	(void)ua;
 
+	(void)pl_strcpy(&msg->from.auri, uri, sizeof(uri));
+
+	if (contact_block_access(baresip_contacts(), uri)) {
+		info("message: blocked access: \"%s\"\n", uri);
+		(void)sip_reply(uag_sip(), msg, 403, "Forbidden");
+		return;
+	}
+
 	if (msg_ctype_cmp(&msg->ctyp, "text", "plain") && recvh) {
 		recvh(&msg->from.auri, &ctype_pl, msg->mb, recvarg);
 		(void)sip_reply(uag_sip(), msg, 200, "OK");
@@ -54,12 +113,70 @@ static bool request_handler(const struct sip_msg *msg, void *arg)
 }
 
 
-static void resp_handler(int err, const struct sip_msg *msg, void *arg)
+static void dest_destructor(void *arg)
 {
-	struct ua *ua = arg;
+	struct msg_dest *dest = arg;
+
+	tmr_cancel(&dest->tmr);
+	hash_unlink(&dest->he);
+	list_flush(&dest->q);
+	list_flush(&dest->sentl);
+	mem_deref(dest->auth);
+	mem_deref(dest->acc);
+	mem_deref(dest->key);
+
+	--msgstat.n_dest;
+}
+
+
+static void msg_destructor(void *arg)
+{
+	struct msg_out *m = arg;
+
+	if (m->queued)
+		--msgstat.n_queued;
+
+	list_unlink(&m->le);
+	mem_deref(m->req);
+	mem_deref(m->dlg);
+	mem_deref(m->body);
+}
+
+
+static void idle_handler(void *arg)
+{
+	struct msg_dest *dest = arg;
+
+	mem_deref(dest);
+}
+
+
+static int auth_handler(char **username, char **password,
+			const char *realm, void *arg)
+{
+	struct account *acc = arg;
+
+	return account_auth(acc, username, password, realm);
+}
 
-	(void)ua;
 
+static void resp_handler(int err, const struct sip_msg *msg, void *arg);
+
+
+static int msg_request(struct msg_out *m)
+{
+	return sip_drequestf(&m->req, uag_sip(), true, "MESSAGE", m->dlg,
+			     0, m->dest->auth, NULL, resp_handler, m,
+			     "Accept: text/plain\r\n"
+			     "Content-Type: text/plain\r\n"
+			     "Content-Length: %zu\r\n"
+			     "\r\n%s",
+			     str_len(m->body), m->body);
+}
+
+
+static void print_error(int err, const struct sip_msg *msg)
+{
 	if (err) {
 		(void)re_fprintf(stderr, " \x1b[31m%m\x1b[;m\n", err);
 		return;
@@ -72,6 +189,153 @@ static void resp_handler(int err, const struct sip_msg *msg, void *arg)
 }
 
 
+/* Send queued messages while the window has room */
+static void dest_send(struct msg_dest *dest)
+{
+	const uint32_t window = conf_config()->sip.msg_window;
+	struct le *le;
+
+	while ((le = list_head(&dest->q)) &&
+	       (!window || list_count(&dest->sentl) < window)) {
+
+		struct msg_out *m = le->data;
+		int err;
+
+		list_unlink(&m->le);
+		list_append(&dest->sentl, &m->le, m);
+		m->queued = false;
+		--msgstat.n_queued;
+
+		m->ts = tmr_jiffies();
+
+		err = msg_request(m);
+		if (err) {
+			print_error(err, NULL);
+			++msgstat.n_fail;
+			mem_deref(m);
+			continue;
+		}
+
+		++msgstat.n_sent;
+	}
+
+	if (list_isempty(&dest->sentl) && list_isempty(&dest->q))
+		tmr_start(&dest->tmr, DEST_IDLE, idle_handler, dest);
+	else
+		tmr_cancel(&dest->tmr);
+}
+
+
+static void resp_handler(int err, const struct sip_msg *msg, void *arg)
+{
+	struct msg_out *m = arg;
+	struct msg_dest *dest = m->dest;
+
+	if (err || sip_request_loops(&m->ls, msg->scode))
+		goto out;
+
+	if (msg->scode < 200)
+		return;
+
+	if (msg->scode == 401 || msg->scode == 407) {
+
+		err = sip_auth_authenticate(dest->auth, msg);
+		if (err) {
+			err = (err == EAUTH) ? 0 : err;
+			goto out;
+		}
+
+		err = msg_request(m);
+		if (err)
+			goto out;
+
+		++msgstat.n_auth;
+		return;
+	}
+	else if (msg->scode == 403) {
+		sip_auth_reset(dest->auth);
+	}
+
+ out:
+	print_error(err, msg);
+
+	if (!err && msg->scode < 300) {
+		++msgstat.n_ok;
+		msgstat.ms_total += tmr_jiffies() - m->ts;
+	}
+	else {
+		++msgstat.n_fail;
+	}
+
+	mem_deref(m);
+
+	dest_send(dest);
+}
+
+
+static bool dest_cmp(struct le *le, void *arg)
+{
+	const struct msg_dest *dest = le->data;
+
+	return 0 == str_cmp(dest->key, arg);
+}
+
+
+static int dest_get(struct msg_dest **destp, struct ua *ua,
+		    const struct sip_addr *addr, const char *route)
+{
+	struct msg_dest *dest;
+	char *key = NULL;
+	int err;
+
+	if (route)
+		err = re_sdprintf(&key, "%s %s", ua_aor(ua), route);
+	else
+		err = re_sdprintf(&key, "%s %r", ua_aor(ua), &addr->uri.host);
+	if (err)
+		return err;
+
+	if (!ht_dest) {
+		err = hash_alloc(&ht_dest, DEST_HASH_SIZE);
+		if (err)
+			goto out;
+	}
+
+	dest = list_ledata(hash_lookup(ht_dest, hash_joaat_str(key),
+				       dest_cmp, key));
+	if (dest) {
+		*destp = dest;
+		goto out;
+	}
+
+	dest = mem_zalloc(sizeof(*dest), dest_destructor);
+	if (!dest) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	++msgstat.n_dest;   /* undone by the destructor */
+	dest->acc = mem_ref(ua_account(ua));
+	dest->key = key;
+	key = NULL;
+
+	err = sip_auth_alloc(&dest->auth, auth_handler, dest->acc, true);
+	if (err) {
+		mem_deref(dest);
+		goto out;
+	}
+
+	hash_append(ht_dest, hash_joaat_str(dest->key), &dest->he, dest);
+
+	*destp = dest;
+
+ out:
+	mem_deref(key);
+
+	return err;
+}
+
+
 int message_init(message_recv_h *h, void *arg)
 {
 	int err;
@@ -90,6 +354,32 @@ int message_init(message_recv_h *h, void *arg)
 void message_close(void)
 {
 	lsnr = mem_deref(lsnr);
+
+	hash_flush(ht_dest);
+	ht_dest = mem_deref(ht_dest);
+}
+
+
+/**
+ * Print the delivery statistics of outgoing messages
+ *
+ * @param pf     Print handler for debug output
+ * @param unused Unused parameter
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int message_debug(struct re_printf *pf, void *unused)
+{
+	(void)unused;
+
+	return re_hprintf(pf, "Messages: window=%u destinations=%u"
+			  " queued=%u sent=%llu ok=%llu failed=%llu"
+			  " auth=%llu avg=%llums\n",
+			  conf_config()->sip.msg_window,
+			  msgstat.n_dest,
+			  msgstat.n_queued, msgstat.n_sent,
+			  msgstat.n_ok, msgstat.n_fail, msgstat.n_auth,
+			  msgstat.n_ok ? msgstat.ms_total / msgstat.n_ok : 0);
 }
 
 
@@ -104,7 +394,10 @@ void message_close(void)
  */
 int message_send(struct ua *ua, const char *peer, const char *msg)
 {
+	const char *routev[1];
+	struct msg_dest *dest;
 	struct sip_addr addr;
+	struct msg_out *m;
 	struct pl pl;
 	char *uri = NULL;
 	int err = 0;
@@ -122,13 +415,36 @@ int message_send(struct ua *ua, const char *peer, const char *msg)
 	if (err)
 		return err;
 
-	err = sip_req_send(ua, "MESSAGE", uri, resp_handler, ua,
-			   "Accept: text/plain\r\n"
-			   "Content-Type: text/plain\r\n"
-			   "Content-Length: %zu\r\n"
-			   "\r\n%s",
-			   str_len(msg), msg);
+	routev[0] = eyeballs_route(ua_outbound(ua));
+
+	err = dest_get(&dest, ua, &addr, routev[0]);
+	if (err)
+		goto out;
+
+	m = mem_zalloc(sizeof(*m), msg_destructor);
+	if (!m) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	m->dest = dest;
+
+	err  = str_dup(&m->body, msg);
+	err |= sip_dialog_alloc(&m->dlg, uri, uri, NULL, ua_aor(ua),
+				routev[0] ? routev : NULL,
+				routev[0] ? 1 : 0);
+	if (err) {
+		mem_deref(m);
+		goto out;
+	}
+
+	list_append(&dest->q, &m->le, m);
+	m->queued = true;
+	++msgstat.n_queued;
+
+	dest_send(dest);
 
+ out:
 	mem_deref(uri);
 
 	return err;
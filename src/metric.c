@@ -3,46 +3,65 @@
  *
  * Copyright (C) 2010 Creytiv.com
  */
+#include <string.h>
 #include <re.h>
 #include <baresip.h>
 #include "core.h"
 
 
+/*
+ * The packet counters are written by the media threads and read by the
+ * main thread, so they are 64-bit and updated with relaxed atomic
+ * operations. The histograms have one bucket per power of two, which
+ * keeps them at a fixed size.
+ */
+
+
+#if defined (__GNUC__) || defined (__clang__)
+#define LOAD(p)        __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define ADD(p, v)      (void)__atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#define XCHG(p, v)     __atomic_exchange_n((p), (v), __ATOMIC_RELAXED)
+#define LOG2(v)        ((v) ? 64 - __builtin_clzll(v) : 0)
+#else
+#error "metric: atomic builtins are required"
+#endif
+
+
 enum {TMR_INTERVAL = 3};
 static void tmr_handler(void *arg)
 {
 	struct metric *metric = arg;
 	const uint64_t now = tmr_jiffies();
+	uint64_t n_bytes;
 	uint32_t diff;
 
-	tmr_start(&metric->tmr, TMR_INTERVAL * 1000, tmr_handler, metric);
-
-	if (!metric->started)
+	if (!LOAD(&metric->ts_start))
 		return;
 
  	if (now <= metric->ts_last)
 		return;
 
+	n_bytes = LOAD(&metric->n_bytes);
+
 	if (metric->ts_last) {
-		uint32_t bytes = metric->n_bytes - metric->n_bytes_last;
+		uint64_t bytes = n_bytes - metric->n_bytes_last;
 		diff = (uint32_t)(now - metric->ts_last);
-		metric->cur_bitrate = 1000 * 8 * bytes / diff;
+		STORE(&metric->cur_bitrate,
+		      (uint32_t)(1000 * 8 * bytes / diff));
 	}
 
 	/* Update counters */
 	metric->ts_last = now;
-	metric->n_bytes_last = metric->n_bytes;
+	metric->n_bytes_last = n_bytes;
 }
 
 
-static void metric_start(struct metric *metric)
+static inline unsigned bucket(uint64_t v, unsigned n)
 {
-	if (metric->started)
-		return;
-
-	metric->ts_start = tmr_jiffies();
+	unsigned i = LOG2(v);
 
-	metric->started = true;
+	return i < n ? i : n - 1;
 }
 
 
@@ -51,7 +70,8 @@ void metric_init(struct metric *metric)
 	if (!metric)
 		return;
 
-	tmr_start(&metric->tmr, 100, tmr_handler, metric);
+	(void)hktmr_start(&metric->tmr, TMR_INTERVAL * 1000,
+			  tmr_handler, metric);
 }
 
 
@@ -60,31 +80,207 @@ void metric_reset(struct metric *metric)
 	if (!metric)
 		return;
 
-	tmr_cancel(&metric->tmr);
+	hktmr_cancel(&metric->tmr);
 }
 
 
+/**
+ * Count one packet
+ *
+ * @param metric     Metric object
+ * @param packetsize Size of the packet in bytes
+ *
+ * @note This function has REAL-TIME properties
+ */
 void metric_add_packet(struct metric *metric, size_t packetsize)
+{
+	metric_add_packet_at(metric, packetsize, tmr_jiffies());
+}
+
+
+/**
+ * Count one packet that was sent or received at a given time
+ *
+ * @param metric     Metric object
+ * @param packetsize Size of the packet in bytes
+ * @param now        Time of the packet, in the tmr_jiffies() clock [ms]
+ *
+ * @note This function has REAL-TIME properties
+ */
+void metric_add_packet_at(struct metric *metric, size_t packetsize,
+			  uint64_t now)
+{
+	uint64_t prev;
+
+	if (!metric)
+		return;
+
+	prev = XCHG(&metric->ts_prev, now);
+
+	if (!prev) {
+		uint64_t zero = 0;
+
+		(void)__atomic_compare_exchange_n(&metric->ts_start, &zero,
+						  now, false,
+						  __ATOMIC_RELAXED,
+						  __ATOMIC_RELAXED);
+	}
+	else if (now >= prev) {
+		ADD(&metric->iatv[bucket(now - prev, METRIC_HIST_IAT)], 1);
+	}
+
+	ADD(&metric->sizev[bucket(packetsize, METRIC_HIST_SIZE)], 1);
+	ADD(&metric->n_bytes, packetsize);
+	ADD(&metric->n_packets, 1);
+}
+
+
+/**
+ * Count one error
+ *
+ * @param metric Metric object
+ *
+ * @note This function has REAL-TIME properties
+ */
+void metric_add_error(struct metric *metric)
 {
 	if (!metric)
 		return;
 
-	if (!metric->started)
-		metric_start(metric);
+	ADD(&metric->n_err, 1);
+}
+
+
+/**
+ * Count the time a received packet waited before it was handled
+ *
+ * @param metric Metric object
+ * @param delay  Delay in [us]
+ *
+ * @note This function has REAL-TIME properties
+ */
+void metric_add_delay(struct metric *metric, uint64_t delay)
+{
+	if (!metric)
+		return;
 
-	metric->n_bytes += (uint32_t)packetsize;
-	metric->n_packets++;
+	ADD(&metric->delayv[bucket(delay, METRIC_HIST_DELAY)], 1);
+}
+
+
+uint64_t metric_n_packets(const struct metric *metric)
+{
+	return metric ? LOAD(&metric->n_packets) : 0;
+}
+
+
+uint64_t metric_n_err(const struct metric *metric)
+{
+	return metric ? LOAD(&metric->n_err) : 0;
+}
+
+
+/* Time of the first packet in [ms], or 0 */
+uint64_t metric_ts_start(const struct metric *metric)
+{
+	return metric ? LOAD(&metric->ts_start) : 0;
 }
 
 
 uint32_t metric_avg_bitrate(const struct metric *metric)
 {
-	int diff;
+	uint64_t ts_start;
+	uint64_t diff;
+
+	if (!metric)
+		return 0;
 
-	if (!metric || !metric->ts_start)
+	ts_start = LOAD(&metric->ts_start);
+	if (!ts_start)
 		return 0;
 
-	diff = (int)(tmr_jiffies() - metric->ts_start);
+	diff = tmr_jiffies() - ts_start;
+	if (!diff)
+		return 0;
+
+	return (uint32_t)(1000 * 8 * LOAD(&metric->n_bytes) / diff);
+}
+
+
+/**
+ * Take a copy of all counters and histograms, from any thread
+ *
+ * @param metric Metric object
+ * @param snap   Returned snapshot
+ */
+void metric_snapshot(const struct metric *metric,
+		     struct metric_snapshot *snap)
+{
+	unsigned i;
+
+	if (!snap)
+		return;
+
+	memset(snap, 0, sizeof(*snap));
+
+	if (!metric)
+		return;
+
+	snap->n_packets   = LOAD(&metric->n_packets);
+	snap->n_bytes     = LOAD(&metric->n_bytes);
+	snap->n_err       = LOAD(&metric->n_err);
+	snap->cur_bitrate = LOAD(&metric->cur_bitrate);
+	snap->avg_bitrate = metric_avg_bitrate(metric);
+
+	for (i=0; i<METRIC_HIST_IAT; i++)
+		snap->iatv[i] = LOAD(&metric->iatv[i]);
+
+	for (i=0; i<METRIC_HIST_SIZE; i++)
+		snap->sizev[i] = LOAD(&metric->sizev[i]);
+
+	for (i=0; i<METRIC_HIST_DELAY; i++)
+		snap->delayv[i] = LOAD(&metric->delayv[i]);
+}
+
+
+static int hist_print(struct re_printf *pf, const uint64_t *v, unsigned n)
+{
+	unsigned i, last = 0;
+	int err = 0;
+
+	for (i=0; i<n; i++) {
+		if (v[i])
+			last = i + 1;
+	}
+
+	for (i=0; i<last; i++)
+		err |= re_hprintf(pf, " %llu", v[i]);
+
+	return err;
+}
+
+
+int metric_debug(struct re_printf *pf, const struct metric *metric)
+{
+	struct metric_snapshot snap;
+	int err;
+
+	if (!metric)
+		return 0;
+
+	metric_snapshot(metric, &snap);
+
+	err  = re_hprintf(pf, "  packets=%llu bytes=%llu errors=%llu"
+			  " bitrate=%u/%u\n",
+			  snap.n_packets, snap.n_bytes, snap.n_err,
+			  snap.cur_bitrate, snap.avg_bitrate);
+	err |= re_hprintf(pf, "  inter-arrival (2^n ms):");
+	err |= hist_print(pf, snap.iatv, METRIC_HIST_IAT);
+	err |= re_hprintf(pf, "\n  size (2^n bytes):");
+	err |= hist_print(pf, snap.sizev, METRIC_HIST_SIZE);
+	err |= re_hprintf(pf, "\n  dispatch delay (2^n us):");
+	err |= hist_print(pf, snap.delayv, METRIC_HIST_DELAY);
+	err |= re_hprintf(pf, "\n");
 
-	return 1000 * 8 * (metric->n_bytes / diff);
+	return err;
 }
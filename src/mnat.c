@@ -60,6 +60,29 @@ int mnat_register(struct mnat **mnatp, struct list *mnatl,
 }
 
 
+/**
+ * Enable trickling of candidates for a Media NAT traversal module
+ *
+ * The trickle handler is called for each new session, and returns 0 if
+ * the session sends its offer early and trickles the rest of its
+ * candidates as SDP fragments. The remote fragment handler is called
+ * with the fragments that are received from the peer.
+ *
+ * @param mnat     Media NAT traversal module
+ * @param trickleh Session trickle handler
+ * @param rfragh   Remote SDP fragment handler
+ */
+void mnat_set_trickle(struct mnat *mnat, mnat_trickle_h *trickleh,
+		      mnat_rfrag_h *rfragh)
+{
+	if (!mnat)
+		return;
+
+	mnat->trickleh = trickleh;
+	mnat->rfragh   = rfragh;
+}
+
+
 /**
  * Find a Media NAT module by name
  *
@@ -14,7 +14,33 @@ struct modapp {
 };
 
 
+/*
+ * A lazy codec is registered from a module_lazy config line. It is a
+ * stub without handlers, so that it can be offered in SDP. The module
+ * is loaded when the codec is first used, and the stub then refers to
+ * the real codec. The real codec is taken out of the codec list, so the
+ * stub keeps its place in the order of preference.
+ */
+struct lazycodec {
+	struct aucodec ac;           /**< Stub audio codec                 */
+#ifdef USE_VIDEO
+	struct vidcodec vc;          /**< Stub video codec                 */
+#endif
+	struct le le;                /**< Linked list element              */
+	char *path;                  /**< Module path                      */
+	char *module;                /**< Module file name                 */
+	char *name;                  /**< Codec name                       */
+	char *variant;               /**< Video Codec Variant              */
+	char *pt;                    /**< Static payload type              */
+	char *fmtp;                  /**< Format parameters                */
+	bool video;                  /**< Video codec                      */
+	bool failed;                 /**< The module could not be loaded   */
+	const void *real;            /**< Real codec, once loaded          */
+};
+
+
 static struct list modappl;
+static struct list lazyl;
 
 
 static void modapp_destructor(void *arg)
@@ -57,13 +83,20 @@ static const struct mod_export *find_module(const struct pl *pl)
 static int load_module(struct mod **modp, const struct pl *modpath,
 		       const struct pl *name)
 {
-	char file[FS_PATH_MAX];
+	char file[FS_PATH_MAX], tag[32];
 	struct mod *m = NULL;
+	struct pl base;
 	int err = 0;
 
 	if (!name)
 		return EINVAL;
 
+	/* the module counts its objects in a tag of its own */
+	if (re_regex(name->p, name->l, "[^.]+", &base))
+		base = *name;
+	(void)pl_strcpy(&base, tag, sizeof(tag));
+	(void)memtag_register(tag);
+
 #ifdef STATIC
 	/* Try static first */
 	err = mod_add(&m, find_module(name));
@@ -128,6 +161,335 @@ static int module_app_handler(const struct pl *val, void *arg)
 }
 
 
+static void lazy_destructor(void *arg)
+{
+	struct lazycodec *lz = arg;
+
+	list_unlink(&lz->le);
+	aucodec_unregister(&lz->ac);
+#ifdef USE_VIDEO
+	vidcodec_unregister(&lz->vc);
+#endif
+	mem_deref(lz->path);
+	mem_deref(lz->module);
+	mem_deref(lz->name);
+	mem_deref(lz->variant);
+	mem_deref(lz->pt);
+	mem_deref(lz->fmtp);
+}
+
+
+static int lazy_audio(struct lazycodec *lz, const struct pl *spec)
+{
+	struct pl name, srate, ch, pt = PL_INIT, crate = PL_INIT;
+	int err;
+
+	if (re_regex(spec->p, spec->l,
+		     "[^/]+/[0-9]+/[0-9]+[/]*[0-9]*[/]*[0-9]*",
+		     &name, &srate, &ch, NULL, &pt, NULL, &crate))
+		return EINVAL;
+
+	err = pl_strdup(&lz->name, &name);
+	if (pl_isset(&pt))
+		err |= pl_strdup(&lz->pt, &pt);
+	if (err)
+		return err;
+
+	lz->ac.name  = lz->name;
+	lz->ac.pt    = lz->pt;
+	lz->ac.srate = pl_u32(&srate);
+	lz->ac.crate = pl_isset(&crate) ? pl_u32(&crate) : lz->ac.srate;
+	lz->ac.ch    = pl_u32(&ch);
+	lz->ac.fmtp  = lz->fmtp;
+
+	aucodec_register(&lz->ac);
+
+	return 0;
+}
+
+
+#ifdef USE_VIDEO
+static int lazy_video(struct lazycodec *lz, const struct pl *spec)
+{
+	struct pl name, variant = PL_INIT;
+	int err;
+
+	if (re_regex(spec->p, spec->l, "[^/]+[/]*[^]*",
+		     &name, NULL, &variant))
+		return EINVAL;
+
+	err = pl_strdup(&lz->name, &name);
+	if (pl_isset(&variant))
+		err |= pl_strdup(&lz->variant, &variant);
+	if (err)
+		return err;
+
+	lz->video = true;
+
+	lz->vc.name    = lz->name;
+	lz->vc.variant = lz->variant;
+	lz->vc.fmtp    = lz->fmtp;
+
+	vidcodec_register(&lz->vc);
+
+	return 0;
+}
+#endif
+
+
+/* module_lazy  <module> <audio|video> <codec> [<fmtp>] */
+static int module_lazy_handler(const struct pl *val, void *arg)
+{
+	const struct pl *path = arg;
+	struct pl module, type, spec, fmtp = PL_INIT;
+	struct lazycodec *lz;
+	int err;
+
+	if (re_regex(val->p, val->l, "[^ \t]+[ \t]+[^ \t]+[ \t]+[^ \t]+"
+		     "[ \t]*[^]*", &module, NULL, &type, NULL, &spec,
+		     NULL, &fmtp)) {
+		warning("module: invalid module_lazy `%r'\n", val);
+		return 0;
+	}
+
+	lz = mem_zalloc(sizeof(*lz), lazy_destructor);
+	if (!lz)
+		return ENOMEM;
+
+	err  = pl_strdup(&lz->path, path);
+	err |= pl_strdup(&lz->module, &module);
+	if (pl_isset(&fmtp))
+		err |= pl_strdup(&lz->fmtp, &fmtp);
+	if (err)
+		goto out;
+
+	if (0 == pl_strcasecmp(&type, "audio"))
+		err = lazy_audio(lz, &spec);
+#ifdef USE_VIDEO
+	else if (0 == pl_strcasecmp(&type, "video"))
+		err = lazy_video(lz, &spec);
+#endif
+	else
+		err = ENOTSUP;
+
+	if (err) {
+		warning("module: module_lazy `%r': %m\n", val, err);
+		err = 0;
+		goto out;
+	}
+
+	debug("module: %r codec %s is loaded on demand from %s\n",
+	      &type, lz->name, lz->module);
+
+	list_append(&lazyl, &lz->le, lz);
+
+ out:
+	if (!lz->le.list)
+		mem_deref(lz);
+
+	return err;
+}
+
+
+static struct mod *mod_find_pl(const struct pl *name)
+{
+	char buf[64];
+
+	if (pl_strcpy(name, buf, sizeof(buf)))
+		return NULL;
+
+	return mod_find(buf);
+}
+
+
+static bool lazy_is_stub(const void *codec)
+{
+	struct le *le;
+
+	for (le = lazyl.head; le; le = le->next) {
+		const struct lazycodec *lz = le->data;
+
+#ifdef USE_VIDEO
+		if (codec == &lz->vc)
+			return true;
+#endif
+		if (codec == &lz->ac)
+			return true;
+	}
+
+	return false;
+}
+
+
+/* Take the real codec of each stub of this module out of the list */
+static void lazy_bind(const char *module)
+{
+	struct le *le, *cle;
+
+	for (le = lazyl.head; le; le = le->next) {
+		struct lazycodec *lz = le->data;
+
+		if (lz->real || str_casecmp(lz->module, module))
+			continue;
+
+		if (!lz->video) {
+
+			for (cle = list_head(aucodec_list()); cle;
+			     cle = cle->next) {
+
+				struct aucodec *ac = cle->data;
+
+				if (lazy_is_stub(ac) ||
+				    str_casecmp(ac->name, lz->name) ||
+				    ac->srate != lz->ac.srate ||
+				    ac->ch != lz->ac.ch)
+					continue;
+
+				aucodec_unregister(ac);
+				lz->real = ac;
+				break;
+			}
+		}
+#ifdef USE_VIDEO
+		else {
+			for (cle = list_head(vidcodec_list()); cle;
+			     cle = cle->next) {
+
+				struct vidcodec *vc = cle->data;
+
+				if (lazy_is_stub(vc) ||
+				    str_casecmp(vc->name, lz->name) ||
+				    (lz->variant &&
+				     str_casecmp(vc->variant, lz->variant)))
+					continue;
+
+				vidcodec_unregister(vc);
+				lz->real = vc;
+				break;
+			}
+		}
+#endif
+
+		if (!lz->real) {
+			warning("module: %s has no codec %s\n",
+				lz->module, lz->name);
+			lz->failed = true;
+		}
+	}
+}
+
+
+static const void *lazy_resolve(const void *codec)
+{
+	struct lazycodec *lz = NULL;
+	struct pl path, name, base;
+	struct le *le;
+
+	for (le = lazyl.head; le; le = le->next) {
+		struct lazycodec *l = le->data;
+
+#ifdef USE_VIDEO
+		if (codec == &l->vc) {
+			lz = l;
+			break;
+		}
+#endif
+		if (codec == &l->ac) {
+			lz = l;
+			break;
+		}
+	}
+
+	if (!lz)
+		return codec;
+
+	if (lz->real || lz->failed)
+		return lz->real;
+
+	/* modules are only loaded on the main loop */
+	if (shard_loop()) {
+		warning("module: %s is not loaded\n", lz->module);
+		return NULL;
+	}
+
+	info("module: loading %s for codec %s\n", lz->module, lz->name);
+
+	pl_set_str(&path, lz->path);
+	pl_set_str(&name, lz->module);
+
+	if (re_regex(name.p, name.l, "[^.]+", &base) || !pl_isset(&base))
+		base = name;
+
+	/* the module may have been loaded from a module line */
+	if (!mod_find_pl(&base) && load_module(NULL, &path, &name)) {
+
+		/* all stubs of the module fail the same way */
+		for (le = lazyl.head; le; le = le->next) {
+			struct lazycodec *l = le->data;
+
+			if (!str_casecmp(l->module, lz->module))
+				l->failed = true;
+		}
+
+		return NULL;
+	}
+
+	lazy_bind(lz->module);
+
+	return lz->real;
+}
+
+
+/**
+ * Get the real Audio Codec of a codec that is loaded on demand.
+ * The module of the codec is loaded when this is first called.
+ *
+ * @param ac Audio Codec, may be a stub from module_lazy
+ *
+ * @return The real Audio Codec, or NULL if it could not be loaded
+ */
+const struct aucodec *module_lazy_aucodec(const struct aucodec *ac)
+{
+	return ac ? lazy_resolve(ac) : NULL;
+}
+
+
+/**
+ * Get the real Video Codec of a codec that is loaded on demand.
+ * The module of the codec is loaded when this is first called.
+ *
+ * @param vc Video Codec, may be a stub from module_lazy
+ *
+ * @return The real Video Codec, or NULL if it could not be loaded
+ */
+const struct vidcodec *module_lazy_vidcodec(const struct vidcodec *vc)
+{
+	return vc ? lazy_resolve(vc) : NULL;
+}
+
+
+/*
+ * With event loops for the media the codecs are used there, so the
+ * modules of all lazy codecs are loaded up front on the main loop
+ */
+static void lazy_load_all(void)
+{
+	struct le *le;
+
+	for (le = lazyl.head; le; le = le->next) {
+		struct lazycodec *lz = le->data;
+
+#ifdef USE_VIDEO
+		if (lz->video) {
+			(void)lazy_resolve(&lz->vc);
+			continue;
+		}
+#endif
+		(void)lazy_resolve(&lz->ac);
+	}
+}
+
+
 int module_init(const struct conf *conf)
 {
 	struct pl path;
@@ -151,10 +513,23 @@ int module_init(const struct conf *conf)
 	if (err)
 		return err;
 
+	err = conf_apply(conf, "module_lazy", module_lazy_handler, &path);
+	if (err)
+		return err;
+
+	if (shard_count())
+		lazy_load_all();
+
 	return 0;
 }
 
 
+void module_close(void)
+{
+	list_flush(&lazyl);
+}
+
+
 void module_app_unload(void)
 {
 	list_flush(&modappl);
@@ -61,3 +61,155 @@ double mos_calculate(double *r_factor, double rtt,
 
 	return mos_val;
 }
+
+
+/*
+ * Sliding-window estimator
+ *
+ * The E-model (ITU-T G.107) is evaluated at each RTCP interval over the
+ * last MOS_WINDOW intervals. The loss is counted from the sequence
+ * numbers of the received packets, so that the mean length of a loss
+ * burst is known. The codec impairment Ie and the packet-loss
+ * robustness Bpl are from ITU-T G.113 Appendix I; codecs that are not
+ * listed there get the values of G.711 with packet loss concealment.
+ */
+
+
+static const struct {
+	const char *name;
+	double ie;
+	double bpl;
+} codecv[] = {
+	{"PCMU",    0, 25.1},
+	{"PCMA",    0, 25.1},
+	{"G722",    0, 25.1},
+	{"G729",   11, 19.0},
+	{"G723",   15, 16.1},
+	{"iLBC",   11, 32.0},
+	{"AMR",     5, 10.0},
+	{"GSM",    20, 10.0},
+};
+
+
+/**
+ * Set the codec impairment of a MOS estimator
+ *
+ * @param me    MOS estimator
+ * @param codec Name of the received codec
+ */
+void mos_est_set_codec(struct mos_est *me, const char *codec)
+{
+	size_t i;
+
+	if (!me)
+		return;
+
+	me->ie  = 0;
+	me->bpl = 25.1;
+
+	for (i=0; i<ARRAY_SIZE(codecv); i++) {
+
+		if (0 == str_casecmp(codec, codecv[i].name)) {
+			me->ie  = codecv[i].ie;
+			me->bpl = codecv[i].bpl;
+			break;
+		}
+	}
+}
+
+
+/**
+ * Count lost packets of a received stream
+ *
+ * @param me   MOS estimator
+ * @param lost Number of packets missing before the received one
+ *
+ * @note This function has REAL-TIME properties
+ */
+void mos_est_loss(struct mos_est *me, uint32_t lost)
+{
+	if (!me || !lost)
+		return;
+
+	__atomic_fetch_add(&me->n_lost, lost, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&me->n_burst, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Update a MOS estimator, once every RTCP interval
+ *
+ * @param me        MOS estimator
+ * @param packets   Number of packets received since the start
+ * @param rtt       Round-trip time [us]
+ * @param jitter    Inter-arrival jitter [us]
+ * @param jbuf      Jitter buffer delay [ms]
+ */
+void mos_est_update(struct mos_est *me, uint64_t packets, uint32_t rtt,
+		    uint32_t jitter, uint32_t jbuf)
+{
+	uint64_t n_rx = 0, n_lost = 0, n_burst = 0;
+	double ppl, burst_r, ie_eff, d, id, r;
+	uint32_t lost, burst;
+	unsigned i;
+
+	if (!me)
+		return;
+
+	lost  = __atomic_load_n(&me->n_lost, __ATOMIC_RELAXED);
+	burst = __atomic_load_n(&me->n_burst, __ATOMIC_RELAXED);
+
+	me->winv[me->wi].packets = packets - me->packets_prev;
+	me->winv[me->wi].lost    = lost - me->lost_prev;
+	me->winv[me->wi].bursts  = burst - me->burst_prev;
+	me->wi = (me->wi + 1) % MOS_WINDOW;
+
+	me->packets_prev = packets;
+	me->lost_prev    = lost;
+	me->burst_prev   = burst;
+
+	for (i=0; i<MOS_WINDOW; i++) {
+		n_rx    += me->winv[i].packets;
+		n_lost  += me->winv[i].lost;
+		n_burst += me->winv[i].bursts;
+	}
+
+	if (!n_rx)
+		return;
+
+	/* packet loss [%], and the mean burst length over random loss */
+	ppl = 100.0 * n_lost / (n_rx + n_lost);
+	burst_r = 1.0;
+	if (n_burst) {
+		burst_r = (double)n_lost / n_burst
+			* (1.0 - (double)n_lost / (n_rx + n_lost));
+	}
+
+	ie_eff = me->ie + (95 - me->ie) * ppl / (ppl / burst_r + me->bpl);
+
+	/* one-way delay: network, jitter buffer and packetization */
+	d = rtt / 2000.0 + (jbuf ? jbuf : 2 * jitter / 1000.0) + 20;
+	id = 0.024 * d;
+	if (d > 177.3)
+		id += 0.11 * (d - 177.3);
+
+	r = 93.2 - id - ie_eff;
+	if (r > 100)
+		r = 100;
+	else if (r < 0)
+		r = 0;
+
+	me->r     = r;
+	me->mos   = rfactor_to_mos(r);
+	me->valid = true;
+}
+
+
+int mos_est_debug(struct re_printf *pf, const struct mos_est *me)
+{
+	if (!me || !me->valid)
+		return 0;
+
+	return re_hprintf(pf, " mos: %.2f (R=%.1f, Ie=%.0f, Bpl=%.1f)\n",
+			  me->mos, me->r, me->ie, me->bpl);
+}
@@ -3,11 +3,25 @@
  *
  * Copyright (C) 2010 - 2016 Creytiv.com
  */
+#ifdef LINUX
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
 #include <re.h>
 #include <baresip.h>
 #include "core.h"
 
 
+enum {
+	NL_DELAY = 500,      /* wait for a burst of changes to end [ms] */
+};
+
+
 struct network {
 	struct config_net cfg;
 	struct sa laddr;
@@ -17,7 +31,12 @@ struct network {
 	char ifname6[16];
 #endif
 	struct tmr tmr;
+#ifdef LINUX
+	struct tmr tmr_nl;
+	int nl_fd;           /**< Netlink socket, or -1             */
+#endif
 	struct dnsc *dnsc;
+	struct dnscache *cache;   /**< Cache of DNS answers         */
 	struct sa nsv[NET_MAX_NS];/**< Configured name servers      */
 	uint32_t nsn;        /**< Number of configured name servers */
 	uint32_t interval;
@@ -105,25 +124,143 @@ static void dns_refresh(struct network *net)
 }
 
 
+static void net_refresh(struct network *net)
+{
+	bool change;
+
+	dns_refresh(net);
+
+	change = net_check(net);
+	if (change && net->ch) {
+		net->ch(net->arg);
+	}
+}
+
+
 /**
  * Detect changes in IP address(es)
  */
 static void ipchange_handler(void *arg)
 {
 	struct network *net = arg;
-	bool change;
 
 	tmr_start(&net->tmr, net->interval * 1000, ipchange_handler, net);
 
-	dns_refresh(net);
+	net_refresh(net);
+}
 
-	change = net_check(net);
-	if (change && net->ch) {
-		net->ch(net->arg);
+
+#ifdef LINUX
+/*
+ * The kernel tells about new and removed addresses and routes on a
+ * netlink socket, so a change is seen at once instead of at the next
+ * poll. The messages only trigger net_check(), which finds out if the
+ * address that is used has changed.
+ */
+
+
+static void nl_timeout(void *arg)
+{
+	net_refresh(arg);
+}
+
+
+static void nl_handler(int flags, void *arg)
+{
+	struct network *net = arg;
+	bool change = false;
+	uint8_t buf[4096];
+	ssize_t n;
+	(void)flags;
+
+	for (;;) {
+		const struct nlmsghdr *nh;
+		int len;
+
+		n = recv(net->nl_fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n < 0) {
+			/* messages were lost, check anyway */
+			if (errno == ENOBUFS)
+				change = true;
+			break;
+		}
+		if (n == 0)
+			break;
+
+		len = (int)n;
+
+		for (nh = (void *)buf; NLMSG_OK(nh, len);
+		     nh = NLMSG_NEXT(nh, len)) {
+
+			switch (nh->nlmsg_type) {
+
+			case RTM_NEWADDR:
+			case RTM_DELADDR:
+			case RTM_NEWROUTE:
+			case RTM_DELROUTE:
+				change = true;
+				break;
+
+			default:
+				break;
+			}
+		}
 	}
+
+	if (change)
+		tmr_start(&net->tmr_nl, NL_DELAY, nl_timeout, net);
 }
 
 
+static void nl_close(struct network *net)
+{
+	if (net->nl_fd < 0)
+		return;
+
+	fd_close(net->nl_fd);
+	(void)close(net->nl_fd);
+	net->nl_fd = -1;
+
+	tmr_cancel(&net->tmr_nl);
+}
+
+
+static int nl_open(struct network *net)
+{
+	struct sockaddr_nl sa;
+	int fd, err;
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd < 0)
+		return errno;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE;
+#ifdef HAVE_INET6
+	sa.nl_groups |= RTMGRP_IPV6_IFADDR | RTMGRP_IPV6_ROUTE;
+#endif
+
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	err = fd_listen(fd, FD_READ, nl_handler, net);
+	if (err)
+		goto out;
+
+	net->nl_fd = fd;
+
+ out:
+	if (err)
+		(void)close(fd);
+
+	return err;
+}
+#endif
+
+
 /**
  * Check if local IP address(es) changed
  *
@@ -212,6 +349,10 @@ static void net_destructor(void *data)
 	struct network *net = data;
 
 	tmr_cancel(&net->tmr);
+#ifdef LINUX
+	nl_close(net);
+#endif
+	mem_deref(net->cache);
 	mem_deref(net->dnsc);
 }
 
@@ -263,6 +404,10 @@ int net_alloc(struct network **netp, const struct config_net *cfg, int af)
 	net->af  = af;
 
 	tmr_init(&net->tmr);
+#ifdef LINUX
+	tmr_init(&net->tmr_nl);
+	net->nl_fd = -1;
+#endif
 
 	if (cfg->nsc) {
 		size_t i;
@@ -296,6 +441,10 @@ int net_alloc(struct network **netp, const struct config_net *cfg, int af)
 		goto out;
 	}
 
+	err = dnscache_alloc(&net->cache, net->dnsc);
+	if (err)
+		goto out;
+
 	sa_init(&net->laddr, AF_INET);
 	(void)sa_set_str(&net->laddr, "127.0.0.1", 0);
 
@@ -398,6 +547,8 @@ int net_use_nameserver(struct network *net, const struct sa *ns)
 	if (err)
 		return err;
 
+	dnscache_set_dnsc(net->cache, dnsc);
+
 	mem_deref(net->dnsc);
 	net->dnsc = dnsc;
 
@@ -406,7 +557,9 @@ int net_use_nameserver(struct network *net, const struct sa *ns)
 
 
 /**
- * Check for networking changes with a regular interval
+ * Check for networking changes with a regular interval. On Linux the
+ * kernel also reports changes as they happen, and the interval is only
+ * a fallback.
  *
  * @param net       Network instance
  * @param interval  Interval in seconds
@@ -427,6 +580,19 @@ void net_change(struct network *net, uint32_t interval,
 		tmr_start(&net->tmr, interval * 1000, ipchange_handler, net);
 	else
 		tmr_cancel(&net->tmr);
+
+#ifdef LINUX
+	if (ch && net->nl_fd < 0) {
+		int err = nl_open(net);
+		if (err) {
+			info("net: no netlink, polling every %u seconds"
+			     " (%m)\n", interval, err);
+		}
+	}
+	else if (!ch) {
+		nl_close(net);
+	}
+#endif
 }
 
 
@@ -457,6 +623,8 @@ static int dns_debug(struct re_printf *pf, const struct network *net)
 	for (i=0; i<nsn; i++)
 		err |= re_hprintf(pf, "   %u: %J\n", i, &nsv[i]);
 
+	err |= dnscache_debug(pf, net->cache);
+
 	return err;
 }
 
@@ -494,6 +662,10 @@ int net_debug(struct re_printf *pf, const struct network *net)
 			  net->ifname6, &net->laddr6);
 #endif
 	err |= re_hprintf(pf, " Domain: %s\n", net->domain);
+#ifdef LINUX
+	err |= re_hprintf(pf, " Netlink: %s\n",
+			  net->nl_fd >= 0 ? "yes" : "no");
+#endif
 
 	err |= net_if_debug(pf, NULL);
 
@@ -541,10 +713,57 @@ struct dnsc *net_dnsc(const struct network *net)
 	if (!net)
 		return NULL;
 
+	/* each event loop of the User-Agents has its own client */
+	if (shard_loop())
+		return shard_dnsc();
+
 	return net->dnsc;
 }
 
 
+/**
+ * Get the DNS servers that are in use
+ *
+ * @param net  Network instance
+ * @param srvv DNS servers
+ * @param n    Size of srvv on input, number of servers on output
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int net_dns_servers(const struct network *net, struct sa *srvv, uint32_t *n)
+{
+	if (!net || !srvv || !n)
+		return EINVAL;
+
+	return net_dns_srv_get(net, srvv, n, NULL);
+}
+
+
+/**
+ * Resolve a domain name, using the cache of DNS answers. The answers are
+ * cached for their TTL, and failures for a short time. Answers that are
+ * used are refreshed before they expire.
+ *
+ * @param qp   Pointer to the query, release it to cancel
+ * @param net  Network instance
+ * @param name Domain name
+ * @param type Resource record type, A, AAAA, SRV or NAPTR
+ * @param qh   Query handler, the records are valid in the handler only
+ * @param arg  Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int net_dns_query(struct net_dnsq **qp, struct network *net,
+		  const char *name, uint16_t type,
+		  dns_query_h *qh, void *arg)
+{
+	if (!net)
+		return EINVAL;
+
+	return dnscache_query(net->cache, qp, name, type, qh, arg);
+}
+
+
 /**
  * Get the network domain name
  *
@@ -0,0 +1,162 @@
+/**
+ * @file pathq.c  Quality of network paths
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * A path is the route to one trunk or peer, whose quality is measured
+ * by a module, e.g. probe. The module registers the path and keeps the
+ * numbers up to date, the application reads them before it chooses a
+ * route for a call.
+ */
+
+
+static struct list pathql = LIST_INIT;
+
+
+static void destructor(void *arg)
+{
+	struct pathq *pq = arg;
+
+	list_unlink(&pq->le);
+	mem_deref(pq->name);
+}
+
+
+/**
+ * Register a network path
+ *
+ * @param pqp   Pointer to allocated path
+ * @param name  Name of the path, e.g. the trunk
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int pathq_register(struct pathq **pqp, const char *name)
+{
+	struct pathq *pq;
+	int err;
+
+	if (!pqp || !str_isset(name))
+		return EINVAL;
+
+	if (pathq_find(name))
+		return EALREADY;
+
+	pq = mem_zalloc(sizeof(*pq), destructor);
+	if (!pq)
+		return ENOMEM;
+
+	err = str_dup(&pq->name, name);
+	if (err) {
+		mem_deref(pq);
+		return err;
+	}
+
+	list_append(&pathql, &pq->le, pq);
+
+	*pqp = pq;
+
+	return 0;
+}
+
+
+/**
+ * Find a network path by name
+ *
+ * @param name Name of the path
+ *
+ * @return Path if found, otherwise NULL
+ */
+const struct pathq *pathq_find(const char *name)
+{
+	struct le *le;
+
+	for (le = pathql.head; le; le = le->next) {
+		const struct pathq *pq = le->data;
+
+		if (0 == str_casecmp(pq->name, name))
+			return pq;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Choose the path with the best quality
+ *
+ * @param names Comma-separated names of the paths to choose from
+ *
+ * @return Path with the highest MOS, NULL if none has a valid one
+ */
+const struct pathq *pathq_best(const char *names)
+{
+	const struct pathq *best = NULL;
+	struct pl pl, name;
+	struct le *le;
+
+	pl_set_str(&pl, names);
+
+	while (!re_regex(pl.p, pl.l, "[^, \t]+", &name)) {
+
+		for (le = pathql.head; le; le = le->next) {
+			const struct pathq *pq = le->data;
+
+			if (pl_strcasecmp(&name, pq->name) || !pq->valid)
+				continue;
+
+			if (!best || pq->mos > best->mos)
+				best = pq;
+		}
+
+		pl.l -= name.p + name.l - pl.p;
+		pl.p  = name.p + name.l;
+	}
+
+	return best;
+}
+
+
+/**
+ * Get the list of network paths
+ *
+ * @return List of paths (struct pathq)
+ */
+struct list *pathq_list(void)
+{
+	return &pathql;
+}
+
+
+int pathq_debug(struct re_printf *pf, void *unused)
+{
+	struct le *le;
+	int err;
+	(void)unused;
+
+	err = re_hprintf(pf, "\n--- Network paths: (%u) ---\n",
+			 list_count(&pathql));
+
+	for (le = pathql.head; le; le = le->next) {
+		const struct pathq *pq = le->data;
+
+		if (!pq->valid) {
+			err |= re_hprintf(pf, "  %-16s no reply (sent %llu)\n",
+					  pq->name, pq->sent);
+			continue;
+		}
+
+		err |= re_hprintf(pf, "  %-16s loss=%.1f%% rtt=%.1fms"
+				  " jitter=%.1fms mos=%.2f (%llu/%llu)\n",
+				  pq->name, pq->loss, pq->rtt / 1000.0,
+				  pq->jitter / 1000.0, pq->mos,
+				  pq->received, pq->sent);
+	}
+
+	return err;
+}
@@ -0,0 +1,258 @@
+/**
+ * @file pipeprof.c  Per-stage timing of the media pipelines
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <time.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * A profiler follows one direction of one media stream. The frame is
+ * started with pipeprof_begin() and every stage ends with
+ * pipeprof_mark(), which accounts the time since the previous mark.
+ * Only the thread that processes the frames writes the counters, so
+ * they are updated with relaxed loads and stores instead of atomic
+ * additions. Any thread may read them.
+ *
+ * The latency histograms follow a frame through several stages and
+ * threads, from a timestamp taken with pipeprof_stamp(). They have one
+ * bucket per millisecond, so that percentiles can be read from them.
+ */
+
+
+#if defined (__GNUC__) || defined (__clang__)
+#define LOAD(p)        __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define LOG2(v)        ((v) ? 64 - __builtin_clzll(v) : 0)
+#else
+#error "pipeprof: atomic builtins are required"
+#endif
+
+
+static uint64_t now_ns(void)
+{
+#ifdef LINUX
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return tmr_jiffies() * 1000000;
+#endif
+}
+
+
+static void stage_add(struct pipeprof_stage *st, const char *name,
+		      uint64_t ns)
+{
+	unsigned b = LOG2(ns / 1000);
+
+	/* another filter or codec in this place, start over */
+	if (st->name != name) {
+		memset(st, 0, sizeof(*st));
+		STORE(&st->name, name);
+	}
+
+	if (b >= PIPEPROF_HIST)
+		b = PIPEPROF_HIST - 1;
+
+	STORE(&st->n,   st->n + 1);
+	STORE(&st->sum, st->sum + ns);
+	STORE(&st->histv[b], st->histv[b] + 1);
+
+	if (ns > st->max)
+		STORE(&st->max, ns);
+}
+
+
+/**
+ * Initialise a pipeline profiler
+ *
+ * @param pp      Profiler
+ * @param enabled True to take the timing, otherwise all calls are no-ops
+ */
+void pipeprof_init(struct pipeprof *pp, bool enabled)
+{
+	if (!pp)
+		return;
+
+	memset(pp, 0, sizeof(*pp));
+	pp->enabled = enabled;
+}
+
+
+/**
+ * Get a timestamp for the latency of a frame
+ *
+ * @param pp Profiler
+ *
+ * @return Timestamp [ns], 0 if the profiler is not enabled
+ *
+ * @note This function has REAL-TIME properties
+ */
+uint64_t pipeprof_stamp(const struct pipeprof *pp)
+{
+	return pp && pp->enabled ? now_ns() : 0;
+}
+
+
+/**
+ * Start the timing of one frame
+ *
+ * @param pp Profiler
+ * @param t0 Timestamp from pipeprof_stamp() when the frame entered the
+ *           pipeline, 0 for now
+ *
+ * @note This function has REAL-TIME properties
+ */
+void pipeprof_begin(struct pipeprof *pp, uint64_t t0)
+{
+	if (!pp || !pp->enabled)
+		return;
+
+	pp->i = 0;
+	pp->t = t0 ? t0 : now_ns();
+}
+
+
+/**
+ * End one stage of the current frame
+ *
+ * @param pp   Profiler
+ * @param name Name of the stage, must be a static string
+ *
+ * @note This function has REAL-TIME properties
+ */
+void pipeprof_mark(struct pipeprof *pp, const char *name)
+{
+	uint64_t now;
+
+	if (!pp || !pp->t)
+		return;
+
+	now = now_ns();
+
+	if (pp->i < PIPEPROF_STAGES)
+		stage_add(&pp->stagev[pp->i++], name, now - pp->t);
+
+	pp->t = now;
+}
+
+
+/**
+ * Print the stage timing of a profiler
+ *
+ * @param pf Print handler
+ * @param pp Profiler
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int pipeprof_debug(struct re_printf *pf, const struct pipeprof *pp)
+{
+	unsigned i, j, last;
+	int err = 0;
+
+	if (!pp || !pp->enabled)
+		return 0;
+
+	for (i=0; i<PIPEPROF_STAGES; i++) {
+
+		const struct pipeprof_stage *st = &pp->stagev[i];
+		const char *name = LOAD(&st->name);
+		uint64_t n = LOAD(&st->n);
+
+		if (!name)
+			break;
+
+		err |= re_hprintf(pf, "  %-12s n=%llu avg=%lluns max=%lluns"
+				  " (2^n us):", name, n,
+				  n ? LOAD(&st->sum) / n : 0,
+				  LOAD(&st->max));
+
+		for (j=0, last=0; j<PIPEPROF_HIST; j++) {
+			if (LOAD(&st->histv[j]))
+				last = j + 1;
+		}
+
+		for (j=0; j<last; j++)
+			err |= re_hprintf(pf, " %llu", LOAD(&st->histv[j]));
+
+		err |= re_hprintf(pf, "\n");
+	}
+
+	return err;
+}
+
+
+/**
+ * Add the latency of one frame
+ *
+ * @param pl Latency histogram
+ * @param t0 Timestamp from pipeprof_stamp(), 0 to ignore the frame
+ *
+ * @note This function has REAL-TIME properties
+ */
+void pipeprof_lat_add(struct pipeprof_lat *pl, uint64_t t0)
+{
+	uint64_t ms;
+
+	if (!pl || !t0)
+		return;
+
+	ms = (now_ns() - t0) / 1000000;
+	if (ms >= PIPEPROF_LAT)
+		ms = PIPEPROF_LAT - 1;
+
+	STORE(&pl->histv[ms], pl->histv[ms] + 1);
+	STORE(&pl->n, pl->n + 1);
+}
+
+
+/**
+ * Get a latency percentile
+ *
+ * @param pl  Latency histogram
+ * @param pct Percentile, 1 to 100
+ *
+ * @return Latency [ms], the last bucket holds all longer latencies
+ */
+unsigned pipeprof_lat_pct(const struct pipeprof_lat *pl, unsigned pct)
+{
+	uint64_t n, sum = 0;
+	unsigned i;
+
+	if (!pl)
+		return 0;
+
+	n = LOAD(&pl->n);
+	if (!n)
+		return 0;
+
+	for (i=0; i<PIPEPROF_LAT - 1; i++) {
+
+		sum += LOAD(&pl->histv[i]);
+
+		if (sum * 100 >= n * pct)
+			break;
+	}
+
+	return i;
+}
+
+
+int pipeprof_lat_debug(struct re_printf *pf, const struct pipeprof_lat *pl)
+{
+	if (!pl)
+		return 0;
+
+	return re_hprintf(pf, "n=%llu p50=%ums p90=%ums p99=%ums",
+			  LOAD(&pl->n),
+			  pipeprof_lat_pct(pl, 50),
+			  pipeprof_lat_pct(pl, 90),
+			  pipeprof_lat_pct(pl, 99));
+}
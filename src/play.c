@@ -18,7 +18,8 @@ struct play {
 	struct le le;
 	struct play **playp;
 	struct lock *lock;
-	struct mbuf *mb;
+	const struct mbuf *mb;    /**< Samples, shared and read-only       */
+	size_t pos;               /**< Read position in the samples        */
 	struct auplay_st *auplay;
 	struct tmr tmr;
 	int repeat;
@@ -34,10 +35,26 @@ static const char default_play_path[FS_PATH_MAX] = PREFIX "/share/baresip";
 
 struct player {
 	struct list playl;
+	struct list filel;        /**< Decoded files                        */
 	char play_path[FS_PATH_MAX];
 };
 
 
+/*
+ * Decoded audio-files are kept by the player, so that a file which is
+ * played for many calls at once, such as the ring tone, is read and
+ * decoded only once. Each play only has its own read position, the
+ * samples are shared and never written after the file was loaded.
+ */
+struct playfile {
+	struct le le;
+	char *path;
+	struct mbuf *mb;
+	uint32_t srate;
+	uint8_t ch;
+};
+
+
 static void tmr_polling(void *arg);
 
 
@@ -55,7 +72,7 @@ static void tmr_repeat(void *arg)
 
 	lock_write_get(play->lock);
 
-	play->mb->pos = 0;
+	play->pos = 0;
 	play->eof = false;
 
 	tmr_start(&play->tmr, 1000, tmr_polling, arg);
@@ -89,26 +106,30 @@ static void tmr_polling(void *arg)
 /**
  * NOTE: DSP cannot be destroyed inside handler
  */
-static void write_handler(int16_t *sampv, size_t sampc, void *arg)
+static void write_handler(void *sampv, size_t sampc, void *arg)
 {
 	struct play *play = arg;
 	size_t sz = sampc * 2;
+	size_t left;
 
 	lock_write_get(play->lock);
 
 	if (play->eof)
 		goto silence;
 
-	if (mbuf_get_left(play->mb) < sz) {
+	left = play->mb->end - play->pos;
+
+	if (left < sz) {
 
 		memset(sampv, 0, sz);
-		(void)mbuf_read_mem(play->mb, (void *)sampv,
-				    mbuf_get_left(play->mb));
+		memcpy(sampv, play->mb->buf + play->pos, left);
+		play->pos += left;
 
 		play->eof = true;
 	}
 	else {
-		(void)mbuf_read_mem(play->mb, (void *)sampv, sz);
+		memcpy(sampv, play->mb->buf + play->pos, sz);
+		play->pos += sz;
 	}
 
  silence:
@@ -131,7 +152,7 @@ static void destructor(void *arg)
 	lock_rel(play->lock);
 
 	mem_deref(play->auplay);
-	mem_deref(play->mb);
+	mem_deref((void *)play->mb);
 	mem_deref(play->lock);
 
 	if (play->playp)
@@ -139,6 +160,10 @@ static void destructor(void *arg)
 }
 
 
+/*
+ * A block is decoded straight into the buffer in one loop per format,
+ * which the compiler can unroll and vectorise.
+ */
 static int aufile_load(struct mbuf *mb, const char *filename,
 		       uint32_t *srate, uint8_t *channels)
 {
@@ -152,8 +177,8 @@ static int aufile_load(struct mbuf *mb, const char *filename,
 
 	while (!err) {
 		uint8_t buf[4096];
-		size_t i, n;
-		int16_t *p = (void *)buf;
+		int16_t *dst;
+		size_t n;
 
 		n = sizeof(buf);
 
@@ -161,29 +186,35 @@ static int aufile_load(struct mbuf *mb, const char *filename,
 		if (err || !n)
 			break;
 
+		if (prm.fmt == AUFMT_S16LE)
+			n &= ~(size_t)1;
+
+		err = mbuf_resize(mb, mb->end + 2 * n);
+		if (err)
+			break;
+
+		dst = (int16_t *)(void *)(mb->buf + mb->end);
+
 		switch (prm.fmt) {
 
 		case AUFMT_S16LE:
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
 			/* convert from Little-Endian to Native-Endian */
-			for (i=0; i<n/2; i++) {
-				int16_t s = sys_ltohs(*p++);
-				err |= mbuf_write_u16(mb, s);
-			}
-
+			aupcm_swap16(dst, (const void *)buf, n/2);
+#else
+			memcpy(dst, buf, n);
+#endif
+			mb->end += n;
 			break;
 
 		case AUFMT_PCMA:
-			for (i=0; i<n; i++) {
-				err |= mbuf_write_u16(mb,
-						      g711_alaw2pcm(buf[i]));
-			}
+			aupcm_alaw_decode(dst, buf, n);
+			mb->end += 2 * n;
 			break;
 
 		case AUFMT_PCMU:
-			for (i=0; i<n; i++) {
-				err |= mbuf_write_u16(mb,
-						      g711_ulaw2pcm(buf[i]));
-			}
+			aupcm_ulaw_decode(dst, buf, n);
+			mb->end += 2 * n;
 			break;
 
 		default:
@@ -242,6 +273,7 @@ int play_tone(struct play **playp, struct player *player,
 	tmr_init(&play->tmr);
 	play->repeat = repeat;
 	play->mb     = mem_ref(tone);
+	play->pos    = tone->pos;
 
 	err = lock_alloc(&play->lock);
 	if (err)
@@ -250,6 +282,7 @@ int play_tone(struct play **playp, struct player *player,
 	wprm.ch         = ch;
 	wprm.srate      = srate;
 	wprm.ptime      = PTIME;
+	wprm.fmt        = AUFMT_S16LE;
 
 	err = auplay_alloc(&play->auplay, cfg->audio.alert_mod, &wprm,
 			   cfg->audio.alert_dev, write_handler, play);
@@ -282,13 +315,83 @@ int play_tone(struct play **playp, struct player *player,
  *
  * @return 0 if success, otherwise errorcode
  */
+static void playfile_destructor(void *arg)
+{
+	struct playfile *pf = arg;
+
+	list_unlink(&pf->le);
+	mem_deref(pf->mb);
+	mem_deref(pf->path);
+}
+
+
+static int playfile_get(struct playfile **pfp, struct player *player,
+			const char *path)
+{
+	struct playfile *pf;
+	struct le *le;
+	int err;
+
+	LIST_FOREACH(&player->filel, le) {
+
+		pf = le->data;
+
+		if (0 == str_cmp(pf->path, path)) {
+			*pfp = pf;
+			return 0;
+		}
+	}
+
+	pf = mem_zalloc(sizeof(*pf), playfile_destructor);
+	if (!pf)
+		return ENOMEM;
+
+	err = str_dup(&pf->path, path);
+	if (err)
+		goto out;
+
+	pf->mb = mbuf_alloc(1024);
+	if (!pf->mb) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err = aufile_load(pf->mb, path, &pf->srate, &pf->ch);
+	if (err)
+		goto out;
+
+	mbuf_trim(pf->mb);
+
+	list_append(&player->filel, &pf->le, pf);
+
+ out:
+	if (err)
+		mem_deref(pf);
+	else
+		*pfp = pf;
+
+	return err;
+}
+
+
+/**
+ * Play an audio file in WAV format
+ *
+ * @param playp    Pointer to allocated player object
+ * @param player   Audio-file player
+ * @param filename Name of WAV file to play
+ * @param repeat   Number of times to repeat
+ *
+ * @return 0 if success, otherwise errorcode
+ *
+ * @note The file is decoded the first time it is played, and the
+ *       samples are kept for later plays until the path changes.
+ */
 int play_file(struct play **playp, struct player *player,
 	      const char *filename, int repeat)
 {
-	struct mbuf *mb;
+	struct playfile *pf;
 	char path[FS_PATH_MAX];
-	uint32_t srate = 0;
-	uint8_t ch = 0;
 	int err;
 
 	if (!player)
@@ -300,22 +403,13 @@ int play_file(struct play **playp, struct player *player,
 			player->play_path, filename) < 0)
 		return ENOMEM;
 
-	mb = mbuf_alloc(1024);
-	if (!mb)
-		return ENOMEM;
-
-	err = aufile_load(mb, path, &srate, &ch);
+	err = playfile_get(&pf, player, path);
 	if (err) {
 		warning("play: %s: %m\n", path, err);
-		goto out;
+		return err;
 	}
 
-	err = play_tone(playp, player, mb, srate, ch, repeat);
-
- out:
-	mem_deref(mb);
-
-	return err;
+	return play_tone(playp, player, pf->mb, pf->srate, pf->ch, repeat);
 }
 
 
@@ -324,6 +418,7 @@ static void player_destructor(void *data)
 	struct player *player = data;
 
 	list_flush(&player->playl);
+	list_flush(&player->filel);
 }
 
 
@@ -339,6 +434,7 @@ int play_init(struct player **playerp)
 		return ENOMEM;
 
 	list_init(&player->playl);
+	list_init(&player->filel);
 
 	str_ncpy(player->play_path, default_play_path,
 		 sizeof(player->play_path));
@@ -355,4 +451,7 @@ void play_set_path(struct player *player, const char *path)
 		return;
 
 	str_ncpy(player->play_path, path, sizeof(player->play_path));
+
+	/* files from the old path are not played again */
+	list_flush(&player->filel);
 }
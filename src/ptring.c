@@ -0,0 +1,189 @@
+/**
+ * @file ptring.c  Lock-free single-producer/single-consumer pointer ring
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * The ring hands objects from one thread to another, and is safe for
+ * exactly one writer thread and one reader thread at a time. As in the
+ * audio sample ring, the positions are free-running counters and each
+ * is only updated by its own side. The ring does not hold references,
+ * the objects that are left in it must be popped by its owner.
+ */
+
+
+#if defined (__GNUC__) || defined (__clang__)
+#define LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOAD_RELAXED(p)     __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ADD_RELAXED(p, v)   __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#else
+#error "ptring: atomic load/store builtins are required"
+#endif
+
+
+struct ptring {
+	void **ptrv;             /**< Object storage                    */
+	size_t size;             /**< Capacity, power of two            */
+	size_t mask;             /**< size - 1                          */
+	size_t wpos;             /**< Write position (writer only)      */
+	size_t rpos;             /**< Read position (reader only)       */
+	uint64_t n_full;         /**< Objects refused, the ring was full */
+};
+
+
+static void destructor(void *arg)
+{
+	struct ptring *pr = arg;
+
+	mem_deref(pr->ptrv);
+}
+
+
+/**
+ * Allocate a new pointer ring
+ *
+ * @param prp  Pointer to allocated ring
+ * @param size Minimum capacity (rounded up to a power of two)
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int ptring_alloc(struct ptring **prp, size_t size)
+{
+	struct ptring *pr;
+
+	if (!prp || !size)
+		return EINVAL;
+
+	pr = mem_zalloc(sizeof(*pr), destructor);
+	if (!pr)
+		return ENOMEM;
+
+	pr->size = 1;
+	while (pr->size < size)
+		pr->size <<= 1;
+
+	pr->mask = pr->size - 1;
+
+	pr->ptrv = mem_zalloc(pr->size * sizeof(void *), NULL);
+	if (!pr->ptrv) {
+		mem_deref(pr);
+		return ENOMEM;
+	}
+
+	*prp = pr;
+
+	return 0;
+}
+
+
+/**
+ * Add an object to the ring
+ *
+ * @param pr Pointer ring
+ * @param p  Object
+ *
+ * @return True if added, false if the ring is full
+ *
+ * @note This function has REAL-TIME properties; writer side only
+ */
+bool ptring_push(struct ptring *pr, void *p)
+{
+	size_t wpos;
+
+	if (!pr || !p)
+		return false;
+
+	wpos = LOAD_RELAXED(&pr->wpos);
+
+	if (wpos - LOAD_ACQUIRE(&pr->rpos) >= pr->size) {
+		ADD_RELAXED(&pr->n_full, 1);
+		return false;
+	}
+
+	pr->ptrv[wpos & pr->mask] = p;
+
+	STORE_RELEASE(&pr->wpos, wpos + 1);
+
+	return true;
+}
+
+
+/**
+ * Take the oldest object from the ring
+ *
+ * @param pr Pointer ring
+ *
+ * @return Object, or NULL if the ring is empty
+ *
+ * @note This function has REAL-TIME properties; reader side only
+ */
+void *ptring_pop(struct ptring *pr)
+{
+	size_t rpos;
+	void *p;
+
+	if (!pr)
+		return NULL;
+
+	rpos = LOAD_RELAXED(&pr->rpos);
+
+	if (rpos == LOAD_ACQUIRE(&pr->wpos))
+		return NULL;
+
+	p = pr->ptrv[rpos & pr->mask];
+
+	STORE_RELEASE(&pr->rpos, rpos + 1);
+
+	return p;
+}
+
+
+/**
+ * Take all objects from the ring and dereference them
+ *
+ * @param pr Pointer ring
+ *
+ * @note Reader side only, the objects must be memory objects
+ */
+void ptring_flush(struct ptring *pr)
+{
+	void *p;
+
+	while ((p = ptring_pop(pr)))
+		mem_deref(p);
+}
+
+
+/**
+ * Get the number of objects in the ring
+ *
+ * @param pr Pointer ring
+ *
+ * @return Number of objects
+ */
+size_t ptring_count(const struct ptring *pr)
+{
+	if (!pr)
+		return 0;
+
+	return LOAD_ACQUIRE(&pr->wpos) - LOAD_ACQUIRE(&pr->rpos);
+}
+
+
+/**
+ * Get the number of objects that were refused because the ring was full
+ *
+ * @param pr Pointer ring
+ *
+ * @return Number of objects refused
+ */
+uint64_t ptring_full(const struct ptring *pr)
+{
+	return pr ? LOAD_RELAXED(&pr->n_full) : 0;
+}
@@ -3,6 +3,13 @@
  *
  * Copyright (C) 2010 Creytiv.com
  */
+#ifdef LINUX
+#define _GNU_SOURCE 1
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
 #include <re.h>
 #include <baresip.h>
 #ifdef DARWIN
@@ -39,9 +46,103 @@ static int set_realtime(int period, int computation, int constraint)
 #endif
 
 
+#ifdef LINUX
+enum { RT_PRIO = 10 };  /* Default SCHED_FIFO priority, below IRQ threads */
+
+
+static int set_realtime(bool enable)
+{
+	struct sched_param param;
+	uint32_t prio = conf_config()->audio.rt_prio;
+	int err;
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = enable ? (prio ? (int)prio : RT_PRIO) : 0;
+
+	err = pthread_setschedparam(pthread_self(),
+				    enable ? SCHED_FIFO : SCHED_OTHER,
+				    &param);
+	if (err) {
+		warning("realtime: could not set SCHED_FIFO priority %d"
+			" (%m)\n", param.sched_priority, err);
+	}
+
+	return err;
+}
+
+
+/* Parse a CPU list like "2,4-7" */
+static int cpuset_decode(cpu_set_t *set, const char *cpus)
+{
+	const char *p = cpus;
+
+	CPU_ZERO(set);
+
+	while (*p) {
+		unsigned long a, b;
+		char *end;
+
+		a = strtoul(p, &end, 10);
+		if (end == p)
+			return EINVAL;
+
+		b = a;
+		if (*end == '-') {
+			p = end + 1;
+			b = strtoul(p, &end, 10);
+			if (end == p || b < a)
+				return EINVAL;
+		}
+
+		if (b >= CPU_SETSIZE)
+			return EINVAL;
+
+		for (; a <= b; a++)
+			CPU_SET(a, set);
+
+		p = end;
+		if (*p == ',')
+			++p;
+		else if (*p)
+			return EINVAL;
+	}
+
+	return CPU_COUNT(set) ? 0 : EINVAL;
+}
+
+
+/* Keep only the n-th CPU of the set, counting round */
+static void cpuset_select(cpu_set_t *set, unsigned n)
+{
+	cpu_set_t one;
+	unsigned k = n % CPU_COUNT(set);
+	int i;
+
+	CPU_ZERO(&one);
+
+	for (i=0; i<CPU_SETSIZE; i++) {
+
+		if (!CPU_ISSET(i, set))
+			continue;
+
+		if (k-- == 0) {
+			CPU_SET(i, &one);
+			break;
+		}
+	}
+
+	*set = one;
+}
+#endif
+
+
 /**
  * Enable real-time scheduling (for selected platforms)
  *
+ * On Linux the calling thread gets the SCHED_FIFO policy, with the
+ * priority from audio_rt_priority. This needs CAP_SYS_NICE or an
+ * rtprio limit.
+ *
  * @param enable True to enable, false to disable
  * @param fps    Wanted video framerate
  *
@@ -92,9 +193,55 @@ int realtime_enable(bool enable, int fps)
 
 		return 0;
 	}
+#elif defined (LINUX)
+	(void)fps;
+
+	return set_realtime(enable);
 #else
 	(void)enable;
 	(void)fps;
 	return ENOSYS;
 #endif
 }
+
+
+/**
+ * Pin the calling thread to a list of CPUs (Linux only)
+ *
+ * @param cpus CPU list, e.g. "2,4-7". Nothing is done if empty
+ * @param n    Use only the n-th CPU of the list (modulo the number of
+ *             CPUs), or the whole list if negative
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int realtime_affinity(const char *cpus, int n)
+{
+#ifdef LINUX
+	cpu_set_t set;
+	int err;
+
+	if (!str_isset(cpus))
+		return 0;
+
+	err = cpuset_decode(&set, cpus);
+	if (err) {
+		warning("realtime: invalid CPU list '%s'\n", cpus);
+		return err;
+	}
+
+	if (n >= 0)
+		cpuset_select(&set, n);
+
+	err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err) {
+		warning("realtime: could not pin thread to CPUs '%s' (%m)\n",
+			cpus, err);
+	}
+
+	return err;
+#else
+	(void)n;
+
+	return str_isset(cpus) ? ENOSYS : 0;
+#endif
+}
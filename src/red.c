@@ -0,0 +1,218 @@
+/**
+ * @file red.c  RTP Payload for Redundant Audio Data (RFC 2198)
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * The encoded frames of the last packets are sent again in front of
+ * the primary frame. Each redundant block has a 4 byte header with
+ * the payload type, the timestamp offset and the length of the block,
+ * the primary block has a 1 byte header with the payload type:
+ *
+ *    0                   1                   2                   3
+ *    0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ *   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *   |F|   block PT  |  timestamp offset         |   block length    |
+ *   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ */
+
+
+enum {
+	RED_HDRSZ  = 4,         /* Header of a redundant block    */
+	RED_TS_MAX = 0x3fff,    /* Max. timestamp offset (14 bit) */
+};
+
+
+/**
+ * Initialise the RED encoder
+ *
+ * @param re    RED encoder
+ * @param depth Number of redundant frames per packet
+ */
+void red_enc_init(struct red_enc *re, unsigned depth)
+{
+	if (!re)
+		return;
+
+	memset(re, 0, sizeof(*re));
+	re->depth = min(depth, (unsigned)RED_DEPTH_MAX);
+}
+
+
+/**
+ * Forget the previous frames, e.g. after a silence period
+ *
+ * @param re RED encoder
+ */
+void red_enc_reset(struct red_enc *re)
+{
+	if (re)
+		re->n = 0;
+}
+
+
+static void enc_push(struct red_enc *re, const uint8_t *p, size_t len,
+		     uint8_t pt, uint32_t ts)
+{
+	struct red_frame *rf;
+
+	if (!re->depth)
+		return;
+
+	if (len > RED_BLOCK_MAX) {
+		re->n = 0;
+		return;
+	}
+
+	if (re->n == re->depth) {
+		memmove(&re->framev[0], &re->framev[1],
+			(re->n - 1) * sizeof(re->framev[0]));
+		--re->n;
+	}
+
+	rf = &re->framev[re->n++];
+
+	memcpy(rf->buf, p, len);
+	rf->len = len;
+	rf->pt  = pt;
+	rf->ts  = ts;
+}
+
+
+/**
+ * Encode a primary frame with the previous frames as RED payload.
+ * The frame is replaced in the buffer, and kept for the next packets.
+ *
+ * @param re RED encoder
+ * @param mb Buffer with the primary frame from pos to end
+ * @param pt Payload type of the primary frame
+ * @param ts RTP timestamp of the primary frame
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int red_encode(struct red_enc *re, struct mbuf *mb, uint8_t pt, uint32_t ts)
+{
+	size_t len, hlen = 1, dlen = 0;
+	uint8_t *p;
+	unsigned i, first;
+
+	if (!re || !mb)
+		return EINVAL;
+
+	len = mbuf_get_left(mb);
+
+	/* the frames that are too old for the timestamp offset */
+	for (first = 0; first < re->n; first++) {
+		if (ts - re->framev[first].ts <= RED_TS_MAX)
+			break;
+	}
+
+	for (i = first; i < re->n; i++) {
+		hlen += RED_HDRSZ;
+		dlen += re->framev[i].len;
+	}
+
+	if (mb->pos + hlen + dlen + len > mb->size)
+		return ENOMEM;
+
+	p = mbuf_buf(mb);
+
+	memmove(p + hlen + dlen, p, len);
+
+	for (i = first; i < re->n; i++) {
+
+		const struct red_frame *rf = &re->framev[i];
+		uint32_t off = ts - rf->ts;
+
+		*p++ = 0x80 | rf->pt;
+		*p++ = off >> 6;
+		*p++ = (off & 0x3f) << 2 | (uint8_t)(rf->len >> 8);
+		*p++ = rf->len & 0xff;
+	}
+
+	*p++ = pt & 0x7f;
+
+	for (i = first; i < re->n; i++) {
+		memcpy(p, re->framev[i].buf, re->framev[i].len);
+		p += re->framev[i].len;
+	}
+
+	/* the primary frame is sent again with the next packets */
+	enc_push(re, p, len, pt, ts);
+
+	mb->end = mb->pos + hlen + dlen + len;
+
+	return 0;
+}
+
+
+/**
+ * Decode a RED payload into its blocks
+ *
+ * @param blkv Returned blocks, oldest first, the last is the primary
+ * @param blkc Number of blocks in blkv, returned number of blocks
+ * @param ts   RTP timestamp of the packet
+ * @param mb   Buffer with the RED payload
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int red_decode(struct red_block *blkv, unsigned *blkc, uint32_t ts,
+	       const struct mbuf *mb)
+{
+	const uint8_t *p, *end;
+	unsigned i, n = 0;
+
+	if (!blkv || !blkc || !*blkc || !mb)
+		return EINVAL;
+
+	p   = mbuf_buf(mb);
+	end = p + mbuf_get_left(mb);
+
+	/* headers */
+	for (;;) {
+
+		struct red_block *blk;
+
+		if (p >= end || n >= *blkc)
+			return EBADMSG;
+
+		blk = &blkv[n++];
+		blk->pt = *p & 0x7f;
+
+		if (!(*p & 0x80)) {
+			blk->ts = ts;
+			++p;
+			break;
+		}
+
+		if (end - p < RED_HDRSZ)
+			return EBADMSG;
+
+		blk->ts  = ts - ((uint32_t)p[1] << 6 | p[2] >> 2);
+		blk->len = (p[2] & 0x3) << 8 | p[3];
+		p += RED_HDRSZ;
+	}
+
+	/* data */
+	for (i = 0; i + 1 < n; i++) {
+
+		if ((size_t)(end - p) < blkv[i].len)
+			return EBADMSG;
+
+		blkv[i].buf = p;
+		p += blkv[i].len;
+	}
+
+	blkv[n-1].buf = p;
+	blkv[n-1].len = end - p;
+
+	*blkc = n;
+
+	return 0;
+}
@@ -8,28 +8,178 @@
 #include "core.h"
 
 
+/*
+ * With sip_reg_rate set, the REGISTER requests of all User-Agents are
+ * sent from a queue at that rate, instead of all at once when the
+ * program starts or the network changes. Refreshes are sent by the SIP
+ * stack relative to the first request, so they stay spread out too.
+ */
+
+
+/*
+ * The SIP stack keeps one TCP or TLS connection to each server, and it
+ * is shared by all User-Agents. The first response to a REGISTER on a
+ * connection that no other client is using is counted as a new
+ * connection, its response time includes the connect and the TLS
+ * handshake. The connections are told apart by their file descriptor,
+ * so the counts are approximate if a descriptor is used again.
+ */
+
+
+enum {
+	QUEUE_TICK = 10,             /**< Queue timer interval [ms]          */
+	CONN_HASH_SIZE = 64,
+};
+
+/** A TCP or TLS connection used by register clients */
+struct regconn {
+	struct le he;                /**< Hash element                       */
+	int fd;                      /**< File descriptor                    */
+	uint32_t n_reg;              /**< Clients using the connection       */
+};
+
 /** Register client */
 struct reg {
 	struct le le;                /**< Linked list element                */
+	struct le le_q;              /**< Element of the register queue      */
 	struct ua *ua;               /**< Pointer to parent UA object        */
 	struct sipreg *sipreg;       /**< SIP Register client                */
 	int id;                      /**< Registration ID (for SIP outbound) */
 
+	/* queued request: */
+	char *uri;                   /**< Registrar URI                      */
+	char *params;                /**< Contact parameters                 */
+	char *outbound;              /**< Outbound proxy                     */
+	uint32_t regint;             /**< Registration interval [s]          */
+
 	/* status: */
 	uint16_t scode;              /**< Registration status code           */
 	char *srv;                   /**< SIP Server id                      */
 	int sipfd;                   /**< Cached file-descr. for SIP conn    */
 	int af;                      /**< Cached address family for SIP conn */
+	int connfd;                  /**< Counted TCP or TLS connection      */
+	uint64_t ts_sent;            /**< Time the request was sent          */
 };
 
+static struct {
+	struct list regl;            /**< Queued register clients            */
+	struct tmr tmr;              /**< Sends the queued requests          */
+	uint64_t ts;                 /**< Time of the last tick              */
+	uint32_t credit;             /**< Requests that may be sent, x1000   */
+	uint64_t n_sent;             /**< Requests sent from the queue       */
+} regq;
+
+static struct {
+	struct hash *ht;             /**< Connections by file descriptor     */
+	uint32_t n_conn;             /**< Connections in use                 */
+	uint64_t n_new;              /**< Responses on a new connection      */
+	uint64_t n_reuse;            /**< Responses on a shared connection   */
+	uint64_t ms_new;             /**< Response time on a new connection  */
+	uint64_t ms_reuse;           /**< Response time on a shared conn.    */
+} regc;
+
+
+static bool conn_cmp_handler(struct le *le, void *arg)
+{
+	const struct regconn *rc = le->data;
+
+	return rc->fd == *(int *)arg;
+}
+
+
+static void conn_destructor(void *arg)
+{
+	struct regconn *rc = arg;
+
+	hash_unlink(&rc->he);
+
+	if (--regc.n_conn == 0)
+		regc.ht = mem_deref(regc.ht);
+}
+
+
+static void conn_unref(struct reg *reg)
+{
+	struct regconn *rc;
+
+	if (reg->connfd < 0)
+		return;
+
+	rc = list_ledata(hash_lookup(regc.ht, (uint32_t)reg->connfd,
+				     conn_cmp_handler, &reg->connfd));
+	if (rc && --rc->n_reg == 0)
+		mem_deref(rc);
+
+	reg->connfd = -1;
+}
+
+
+static void conn_count(struct reg *reg, const struct sip_msg *msg)
+{
+	struct regconn *rc;
+	uint64_t ms;
+	int fd;
+
+	/* only the first response, and not the refreshes */
+	if (!reg->ts_sent || msg->tp == SIP_TRANSP_UDP)
+		return;
+
+	ms = tmr_jiffies() - reg->ts_sent;
+	reg->ts_sent = 0;
+
+	fd = sipmsg_fd(msg);
+	if (fd < 0)
+		return;
+
+	if (fd != reg->connfd) {
+
+		conn_unref(reg);
+
+		if (!regc.ht && hash_alloc(&regc.ht, CONN_HASH_SIZE))
+			return;
+
+		rc = list_ledata(hash_lookup(regc.ht, (uint32_t)fd,
+					     conn_cmp_handler, &fd));
+		if (!rc) {
+			rc = mem_zalloc(sizeof(*rc), conn_destructor);
+			if (!rc)
+				return;
+
+			rc->fd = fd;
+			hash_append(regc.ht, (uint32_t)fd, &rc->he, rc);
+			++regc.n_conn;
+		}
+
+		++rc->n_reg;
+		reg->connfd = fd;
+
+		if (rc->n_reg == 1) {
+			++regc.n_new;
+			regc.ms_new += ms;
+			return;
+		}
+	}
+
+	++regc.n_reuse;
+	regc.ms_reuse += ms;
+}
+
 
 static void destructor(void *arg)
 {
 	struct reg *reg = arg;
 
 	list_unlink(&reg->le);
+	list_unlink(&reg->le_q);
+	conn_unref(reg);
 	mem_deref(reg->sipreg);
 	mem_deref(reg->srv);
+	mem_deref(reg->uri);
+	mem_deref(reg->params);
+	mem_deref(reg->outbound);
+
+	if (list_isempty(&regq.regl))
+		tmr_cancel(&regq.tmr);
 }
 
 
@@ -128,6 +278,8 @@ static void register_handler(int err, const struct sip_msg *msg, void *arg)
 		return;
 	}
 
+	conn_count(reg, msg);
+
 	hdr = sip_msg_hdr(msg, SIP_HDR_SERVER);
 	if (hdr) {
 		reg->srv = mem_deref(reg->srv);
@@ -194,9 +346,10 @@ int reg_add(struct list *lst, struct ua *ua, int regid)
 	if (!reg)
 		return ENOMEM;
 
-	reg->ua    = ua;
-	reg->id    = regid;
-	reg->sipfd = -1;
+	reg->ua     = ua;
+	reg->id     = regid;
+	reg->sipfd  = -1;
+	reg->connfd = -1;
 
 	list_append(lst, &reg->le, reg);
 
@@ -204,32 +357,107 @@ int reg_add(struct list *lst, struct ua *ua, int regid)
 }
 
 
+static int send_register(struct reg *reg, const char *reg_uri,
+			 const char *params, uint32_t regint,
+			 const char *outbound)
+{
+	const char *routev[1];
+
+	routev[0] = eyeballs_route(outbound);
+
+	reg->ts_sent = tmr_jiffies();
+
+	reg->sipreg = mem_deref(reg->sipreg);
+	return sipreg_register(&reg->sipreg, uag_sip(), reg_uri,
+			       ua_aor(reg->ua), ua_aor(reg->ua),
+			       regint, ua_local_cuser(reg->ua),
+			       routev[0] ? routev : NULL,
+			       routev[0] ? 1 : 0,
+			       reg->id,
+			       sip_auth_handler, ua_account(reg->ua), true,
+			       register_handler, reg,
+			       params[0] ? &params[1] : NULL,
+			       "Allow: %s\r\n", uag_allowed_methods());
+}
+
+
+static void queue_handler(void *arg)
+{
+	const uint32_t rate = conf_config()->sip.reg_rate;
+	const uint64_t now = tmr_jiffies();
+	struct le *le;
+	(void)arg;
+
+	/* allow a burst of one tick at most */
+	regq.credit += (uint32_t)min(now - regq.ts, QUEUE_TICK) * rate;
+	regq.ts = now;
+
+	while ((le = list_head(&regq.regl)) && regq.credit >= 1000) {
+
+		struct reg *reg = le->data;
+		int err;
+
+		list_unlink(&reg->le_q);
+		regq.credit -= 1000;
+		++regq.n_sent;
+
+		err = send_register(reg, reg->uri, reg->params, reg->regint,
+				    reg->outbound);
+		if (err) {
+			warning("reg: %s: Register: %m\n",
+				ua_aor(reg->ua), err);
+
+			reg->scode = 999;
+			ua_event(reg->ua, UA_EVENT_REGISTER_FAIL, NULL,
+				 "%m", err);
+		}
+	}
+
+	if (list_isempty(&regq.regl))
+		regq.credit = 0;
+	else
+		tmr_start(&regq.tmr, QUEUE_TICK, queue_handler, NULL);
+}
+
+
 int reg_register(struct reg *reg, const char *reg_uri, const char *params,
 		 uint32_t regint, const char *outbound)
 {
-	const char *routev[1];
 	int err;
 
 	if (!reg || !reg_uri)
 		return EINVAL;
 
 	reg->scode = 0;
-	routev[0] = outbound;
 
-	reg->sipreg = mem_deref(reg->sipreg);
-	err = sipreg_register(&reg->sipreg, uag_sip(), reg_uri,
-			      ua_aor(reg->ua), ua_aor(reg->ua),
-			      regint, ua_local_cuser(reg->ua),
-			      routev[0] ? routev : NULL,
-			      routev[0] ? 1 : 0,
-			      reg->id,
-			      sip_auth_handler, ua_account(reg->ua), true,
-			      register_handler, reg,
-			      params[0] ? &params[1] : NULL,
-			      "Allow: %s\r\n", uag_allowed_methods());
+	if (!conf_config() || !conf_config()->sip.reg_rate)
+		return send_register(reg, reg_uri, params, regint, outbound);
+
+	reg->uri      = mem_deref(reg->uri);
+	reg->params   = mem_deref(reg->params);
+	reg->outbound = mem_deref(reg->outbound);
+
+	err  = str_dup(&reg->uri, reg_uri);
+	err |= str_dup(&reg->params, params);
+	if (outbound)
+		err |= str_dup(&reg->outbound, outbound);
 	if (err)
 		return err;
 
+	reg->regint = regint;
+
+	reg->sipreg = mem_deref(reg->sipreg);
+
+	/* a client that is queued again keeps its place */
+	if (!reg->le_q.list)
+		list_append(&regq.regl, &reg->le_q, reg);
+
+	if (!tmr_isrunning(&regq.tmr)) {
+		regq.ts = tmr_jiffies();
+		regq.credit = 1000;
+		queue_handler(NULL);
+	}
+
 	return 0;
 }
 
@@ -243,6 +471,8 @@ void reg_unregister(struct reg *reg)
 	reg->sipfd = -1;
 	reg->af    = 0;
 
+	conn_unref(reg);
+	list_unlink(&reg->le_q);
 	reg->sipreg = mem_deref(reg->sipreg);
 }
 
@@ -295,3 +525,43 @@ int reg_status(struct re_printf *pf, const struct reg *reg)
 
 	return re_hprintf(pf, " %s %s", print_scode(reg->scode), reg->srv);
 }
+
+
+/**
+ * Print the status of the register queue
+ *
+ * @param pf     Print handler for debug output
+ * @param unused Unused parameter
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int reg_queue_debug(struct re_printf *pf, void *unused)
+{
+	(void)unused;
+
+	return re_hprintf(pf, "Register queue: rate=%u/s queued=%u"
+			  " sent=%llu\n",
+			  conf_config()->sip.reg_rate,
+			  list_count(&regq.regl), regq.n_sent);
+}
+
+
+/**
+ * Print how the TCP and TLS connections are shared by register clients
+ *
+ * @param pf Print handler for debug output
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int reg_conn_debug(struct re_printf *pf)
+{
+	const uint64_t n = regc.n_new + regc.n_reuse;
+
+	return re_hprintf(pf, "Register connections: %u in use,"
+			  " %llu new, %llu shared (%llu%%),"
+			  " response %llu ms new, %llu ms shared\n",
+			  regc.n_conn, regc.n_new, regc.n_reuse,
+			  n ? regc.n_reuse * 100 / n : 0,
+			  regc.n_new ? regc.ms_new / regc.n_new : 0,
+			  regc.n_reuse ? regc.ms_reuse / regc.n_reuse : 0);
+}
@@ -0,0 +1,263 @@
+/**
+ * @file reorder.c  Reorder window for incoming RTP packets
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * A stream without a jitter buffer hands the packets to the receiver as
+ * they arrive, so a packet that overtakes another one looks like a loss
+ * to the decoder, which then asks for a new picture.
+ *
+ * The window puts the packets back in sequence order. A packet that is
+ * next in sequence goes out at once, together with the packets after
+ * it that were held. Only a packet after a gap is held, in a slot of a
+ * small ring indexed by sequence number, until the gap is filled. The
+ * gap is given up when the ring is full or after a short wait, and the
+ * packets that were held go out with the loss before them. Packets that
+ * were already given out, or are held, are dropped as duplicates.
+ */
+
+
+enum {
+	REORDER_SIZE = 8,       /**< Slots in the ring, power of two    */
+	REORDER_WAIT = 10,      /**< Wait for a missing packet [ms]     */
+	REORDER_JUMP = 3000,    /**< Larger jumps restart the sequence  */
+};
+
+struct reorder_slot {
+	struct rtp_header hdr;
+	struct mbuf *mb;        /**< Held packet, NULL if empty         */
+};
+
+struct reorder {
+	struct reorder_slot slotv[REORDER_SIZE];
+	struct tmr tmr;         /**< Gives up the gap                   */
+	uint16_t seq_next;      /**< Next packet to give out            */
+	bool started;           /**< seq_next is valid                  */
+	unsigned n_held;        /**< Packets in the ring                */
+	uint32_t n_reorder;     /**< Packets that were held for a gap   */
+	uint32_t n_dup;         /**< Duplicates dropped                 */
+	uint32_t n_late;        /**< Packets after their gap was given up */
+	uint32_t n_gap;         /**< Gaps given up                      */
+	reorder_h *h;
+	void *arg;
+};
+
+
+static void destructor(void *arg)
+{
+	struct reorder *ro = arg;
+
+	tmr_cancel(&ro->tmr);
+	reorder_flush(ro);
+}
+
+
+static inline struct reorder_slot *slot(struct reorder *ro, uint16_t seq)
+{
+	return &ro->slotv[seq & (REORDER_SIZE - 1)];
+}
+
+
+/* The held packets from seq_next on, until the next gap */
+static void release(struct reorder *ro)
+{
+	struct reorder_slot *sl;
+
+	while (ro->n_held && (sl = slot(ro, ro->seq_next))->mb) {
+
+		struct mbuf *mb = sl->mb;
+
+		sl->mb = NULL;
+		--ro->n_held;
+		++ro->seq_next;
+
+		ro->h(&sl->hdr, mb, ro->arg);
+		mem_deref(mb);
+	}
+
+	if (!ro->n_held)
+		tmr_cancel(&ro->tmr);
+}
+
+
+/* The missing packets before the first held one are not waited for */
+static void skip_gap(struct reorder *ro)
+{
+	if (!ro->n_held)
+		return;
+
+	while (!slot(ro, ro->seq_next)->mb)
+		++ro->seq_next;
+
+	++ro->n_gap;
+
+	release(ro);
+}
+
+
+static void tmr_handler(void *arg)
+{
+	struct reorder *ro = arg;
+
+	skip_gap(ro);
+
+	if (ro->n_held)
+		tmr_start(&ro->tmr, REORDER_WAIT, tmr_handler, ro);
+}
+
+
+/**
+ * Allocate a reorder window
+ *
+ * @param rop Pointer to allocated reorder window
+ * @param h   Handler for the packets in sequence order
+ * @param arg Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int reorder_alloc(struct reorder **rop, reorder_h *h, void *arg)
+{
+	struct reorder *ro;
+
+	if (!rop || !h)
+		return EINVAL;
+
+	ro = mem_zalloc(sizeof(*ro), destructor);
+	if (!ro)
+		return ENOMEM;
+
+	tmr_init(&ro->tmr);
+	ro->h   = h;
+	ro->arg = arg;
+
+	*rop = ro;
+
+	return 0;
+}
+
+
+/**
+ * Put an incoming RTP packet in the reorder window
+ *
+ * @param ro  Reorder window
+ * @param hdr RTP header
+ * @param mb  RTP payload
+ */
+void reorder_put(struct reorder *ro, const struct rtp_header *hdr,
+		 struct mbuf *mb)
+{
+	struct reorder_slot *sl;
+	int16_t d;
+
+	if (!ro || !hdr || !mb)
+		return;
+
+	if (!ro->started) {
+		ro->seq_next = hdr->seq;
+		ro->started  = true;
+	}
+
+	d = (int16_t)(hdr->seq - ro->seq_next);
+
+	/* the sender started again, e.g. a new SSRC */
+	if (d >= REORDER_JUMP || d <= -REORDER_JUMP) {
+		reorder_flush(ro);
+		ro->seq_next = hdr->seq;
+		ro->started  = true;
+		d = 0;
+	}
+
+	if (d < 0) {
+		++ro->n_late;
+		return;
+	}
+
+	if (d == 0) {
+		++ro->seq_next;
+		ro->h(hdr, mb, ro->arg);
+		release(ro);
+		return;
+	}
+
+	/* no room for the packet, the gaps before it are given up */
+	while (d >= REORDER_SIZE) {
+
+		if (ro->n_held) {
+			skip_gap(ro);
+		}
+		else {
+			ro->seq_next = hdr->seq;
+			++ro->n_gap;
+		}
+
+		d = (int16_t)(hdr->seq - ro->seq_next);
+	}
+
+	if (d == 0) {
+		++ro->seq_next;
+		ro->h(hdr, mb, ro->arg);
+		release(ro);
+		return;
+	}
+
+	sl = slot(ro, hdr->seq);
+	if (sl->mb) {
+		++ro->n_dup;
+		return;
+	}
+
+	sl->hdr = *hdr;
+	sl->mb  = mem_ref(mb);
+	++ro->n_held;
+	++ro->n_reorder;
+
+	if (!tmr_isrunning(&ro->tmr))
+		tmr_start(&ro->tmr, REORDER_WAIT, tmr_handler, ro);
+}
+
+
+/**
+ * Drop the held packets, the next packet starts the sequence again
+ *
+ * @param ro Reorder window
+ */
+void reorder_flush(struct reorder *ro)
+{
+	size_t i;
+
+	if (!ro)
+		return;
+
+	for (i=0; i<REORDER_SIZE; i++)
+		ro->slotv[i].mb = mem_deref(ro->slotv[i].mb);
+
+	tmr_cancel(&ro->tmr);
+	ro->n_held  = 0;
+	ro->started = false;
+}
+
+
+/**
+ * Print the reorder window statistics
+ *
+ * @param pf Print handler
+ * @param ro Reorder window
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int reorder_debug(struct re_printf *pf, const struct reorder *ro)
+{
+	if (!ro)
+		return 0;
+
+	return re_hprintf(pf, " reorder: held=%u reordered=%u dup=%u"
+			  " late=%u gaps=%u\n",
+			  ro->n_held, ro->n_reorder, ro->n_dup,
+			  ro->n_late, ro->n_gap);
+}
@@ -0,0 +1,729 @@
+/**
+ * @file resamp.c  Polyphase resampler for any ratio of sampling rates
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <math.h>
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
+#define USE_NEON 1
+#endif
+
+#if !defined (M_PI)
+#define M_PI 3.14159265358979323846264338327
+#endif
+
+
+/*
+ * The rates are reduced to the ratio L/M. Conceptually the input is
+ * upsampled by L, low-pass filtered and decimated by M. Only the
+ * outputs are calculated, each from one of the L phases of the
+ * filter, so one output costs one dot product of TAPS * max(1, M/L)
+ * taps. The filter is a Kaiser windowed sinc, with the cutoff below
+ * the lower of the two Nyquist frequencies, and the coefficients of
+ * each phase are scaled to a DC gain of exactly 1.
+ *
+ * The filter banks are computed once for each ratio, and are shared
+ * by all resamplers with that ratio. They are allocated and released
+ * by the setup of the audio streams, under shard_lock() as the streams
+ * of all event loops share them.
+ *
+ * Mono and stereo are converted into each other before or after the
+ * filter, whichever is fewer channels to filter. Other channel counts
+ * are converted with a mixing matrix, made for the channel layouts:
+ * speakers that are missing in the output are folded into the front
+ * left and right (e.g. 5.1 to stereo), and ambisonics are decoded to
+ * two virtual cardioids at +/-90 degrees. Rows that would clip are
+ * scaled down.
+ */
+
+
+enum {
+	TAPS     = 32,          /* Taps per phase at the input rate   */
+	ALIGN    = 8,           /* Taps are a multiple of this        */
+	MAX_L    = 1024,        /* Maximum number of phases           */
+	MAX_CH   = 16,
+	STD_MAX  = 8,           /* Channels of the standard layouts   */
+	CHUNK    = 1024,        /* Input samples filtered at a time   */
+	FRAC     = 14,          /* Fixed point of the coefficients    */
+};
+
+#define ROLLOFF  0.91           /* Cutoff relative to the Nyquist     */
+#define BETA     8.0            /* Kaiser window, about -80 dB        */
+
+
+struct bank {
+	struct le le;
+	uint32_t l;             /**< Upsampling factor (phases)       */
+	uint32_t m;             /**< Decimation factor                */
+	size_t taps;            /**< Taps per phase                   */
+	int16_t *coefv;         /**< Coefficients [l][taps]           */
+};
+
+struct resamp {
+	struct bank *bank;      /**< Shared filter bank               */
+	uint32_t irate;         /**< Input sampling rate [Hz]         */
+	uint32_t orate;         /**< Output sampling rate [Hz]        */
+	uint8_t ich;            /**< Input channels                   */
+	uint8_t och;            /**< Output channels                  */
+	uint8_t fch;            /**< Filtered channels                */
+	uint32_t phase;         /**< Phase of the next output         */
+	size_t pos;             /**< Input position of the next output */
+	size_t len;             /**< Samples in each channel buffer   */
+	int16_t *bufv[MAX_CH];  /**< History and input, per channel   */
+	int16_t *mixv;          /**< Channel mix [och][ich], or NULL  */
+};
+
+/* Speakers of the standard layouts */
+enum spk {
+	SPK_L, SPK_R, SPK_C, SPK_LFE, SPK_RL, SPK_RR, SPK_SL, SPK_SR, SPK_RC
+};
+
+/* Vorbis channel order, as used by Opus and FLAC */
+static const uint8_t spkv[STD_MAX][STD_MAX] = {
+	{SPK_C},
+	{SPK_L, SPK_R},
+	{SPK_L, SPK_C, SPK_R},
+	{SPK_L, SPK_R, SPK_RL, SPK_RR},
+	{SPK_L, SPK_C, SPK_R, SPK_RL, SPK_RR},
+	{SPK_L, SPK_C, SPK_R, SPK_RL, SPK_RR, SPK_LFE},
+	{SPK_L, SPK_C, SPK_R, SPK_SL, SPK_SR, SPK_RC, SPK_LFE},
+	{SPK_L, SPK_C, SPK_R, SPK_SL, SPK_SR, SPK_RL, SPK_RR, SPK_LFE},
+};
+
+/* Gain in a stereo downmix, and azimuth [degrees] */
+static const struct {
+	double l, r;
+	int az;
+} spk_info[] = {
+	[SPK_L]   = {1.0,   0.0,     30},
+	[SPK_R]   = {0.0,   1.0,    -30},
+	[SPK_C]   = {0.707, 0.707,    0},
+	[SPK_LFE] = {0.0,   0.0,      0},
+	[SPK_RL]  = {0.707, 0.0,    110},
+	[SPK_RR]  = {0.0,   0.707, -110},
+	[SPK_SL]  = {0.707, 0.0,     90},
+	[SPK_SR]  = {0.0,   0.707,  -90},
+	[SPK_RC]  = {0.5,   0.5,    180},
+};
+
+typedef double mixm_t[MAX_CH][MAX_CH];
+
+static struct list bankl;
+
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+	while (b) {
+		uint32_t t = a % b;
+
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+
+/* Modified Bessel function of the first kind, order 0 */
+static double bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	int k;
+
+	for (k=1; k<32; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum  += term;
+	}
+
+	return sum;
+}
+
+
+static void bank_destructor(void *arg)
+{
+	struct bank *b = arg;
+
+	list_unlink(&b->le);
+	mem_deref(b->coefv);
+}
+
+
+static int bank_design(struct bank *b)
+{
+	const size_t n = b->l * b->taps;
+	const double fc = ROLLOFF * 0.5 / max(b->l, b->m);
+	const double mid = (n - 1) / 2.0;
+	const double i0b = bessel_i0(BETA);
+	double *hv;
+	uint32_t p;
+	size_t i, j;
+
+	hv = mem_alloc(n * sizeof(*hv), NULL);
+	if (!hv)
+		return ENOMEM;
+
+	for (i=0; i<n; i++) {
+		double t = i - mid;
+		double w = 2.0 * t / (n - 1);
+
+		hv[i] = t == 0 ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t);
+		hv[i] *= bessel_i0(BETA * sqrt(max(0.0, 1.0 - w * w))) / i0b;
+	}
+
+	/* reversed per phase, so the dot product runs forward in time */
+	for (p=0; p<b->l; p++) {
+
+		int16_t *cv = &b->coefv[p * b->taps];
+		double sum = 0;
+
+		for (j=0; j<b->taps; j++)
+			sum += hv[p + j * b->l];
+
+		for (j=0; j<b->taps; j++) {
+			double c = hv[p + j * b->l] / sum;
+
+			cv[b->taps - 1 - j] = (int16_t)lround(c * (1 << FRAC));
+		}
+	}
+
+	mem_deref(hv);
+
+	return 0;
+}
+
+
+static int bank_get(struct bank **bp, uint32_t l, uint32_t m)
+{
+	struct bank *b;
+	struct le *le;
+	int err;
+
+	shard_lock();
+
+	for (le = bankl.head; le; le = le->next) {
+
+		b = le->data;
+
+		if (b->l == l && b->m == m) {
+			*bp = mem_ref(b);
+			err = 0;
+			goto unlock;
+		}
+	}
+
+	b = mem_zalloc(sizeof(*b), bank_destructor);
+	if (!b) {
+		err = ENOMEM;
+		goto unlock;
+	}
+
+	b->l    = l;
+	b->m    = m;
+	b->taps = (TAPS * max(l, m) / l + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+
+	b->coefv = mem_zalloc(l * b->taps * sizeof(int16_t), NULL);
+	if (!b->coefv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err = bank_design(b);
+	if (err)
+		goto out;
+
+	list_append(&bankl, &b->le, b);
+
+ out:
+	if (err)
+		mem_deref(b);
+	else
+		*bp = b;
+
+ unlock:
+	shard_unlock();
+
+	return err;
+}
+
+
+static void destructor(void *arg)
+{
+	struct resamp *rs = arg;
+	int i;
+
+	for (i=0; i<MAX_CH; i++)
+		mem_deref(rs->bufv[i]);
+
+	mem_deref(rs->mixv);
+
+	shard_lock();
+	mem_deref(rs->bank);
+	shard_unlock();
+}
+
+
+static int std_index(uint8_t ch, enum spk spk)
+{
+	uint8_t i;
+
+	for (i=0; i<ch; i++) {
+		if (spkv[ch-1][i] == spk)
+			return i;
+	}
+
+	return -1;
+}
+
+
+static int std_to_std(mixm_t m, uint8_t ich, uint8_t och)
+{
+	uint8_t i;
+
+	if (ich > STD_MAX || och > STD_MAX)
+		return ENOTSUP;
+
+	for (i=0; i<ich; i++) {
+
+		const enum spk spk = spkv[ich-1][i];
+		const int o = std_index(och, spk);
+
+		if (o >= 0) {
+			m[o][i] += 1.0;
+		}
+		else if (spk == SPK_LFE) {
+			continue;
+		}
+		else if (och == 1) {
+			m[0][i] += (spk_info[spk].l + spk_info[spk].r) / 2;
+		}
+		else {
+			m[std_index(och, SPK_L)][i] += spk_info[spk].l;
+			m[std_index(och, SPK_R)][i] += spk_info[spk].r;
+		}
+	}
+
+	return 0;
+}
+
+
+/* Two virtual cardioids at +/-90 degrees, from W and Y */
+static int amb_to_std(mixm_t m, uint8_t ich, uint8_t och)
+{
+	mixm_t s;
+	uint8_t o;
+	int err;
+
+	if (ich < 2 || och == 1) {
+		m[0][0] = 1.0;
+		return 0;
+	}
+
+	memset(s, 0, sizeof(s));
+
+	err = std_to_std(s, 2, och);
+	if (err)
+		return err;
+
+	for (o=0; o<och; o++) {
+		m[o][0] = 0.5 * (s[o][0] + s[o][1]);
+		m[o][1] = 0.5 * (s[o][0] - s[o][1]);
+	}
+
+	return 0;
+}
+
+
+/* Each speaker is a plane wave from its azimuth, in first order */
+static int std_to_amb(mixm_t m, uint8_t ich, uint8_t och)
+{
+	uint8_t i;
+
+	if (ich > STD_MAX)
+		return ENOTSUP;
+
+	for (i=0; i<ich; i++) {
+
+		const enum spk spk = spkv[ich-1][i];
+		const double az = spk_info[spk].az * M_PI / 180;
+
+		if (spk == SPK_LFE)
+			continue;
+
+		m[0][i] += 1.0;
+
+		if (och >= 4) {
+			m[1][i] += sin(az);
+			m[3][i] += cos(az);
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * Set the channel layouts of the input and the output
+ *
+ * @param rs      Resampler
+ * @param ilayout Channel layout of the input
+ * @param olayout Channel layout of the output
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int resamp_layout(struct resamp *rs, enum aulayout ilayout,
+		  enum aulayout olayout)
+{
+	mixm_t m;
+	uint8_t o, i;
+	int err;
+
+	if (!rs)
+		return EINVAL;
+
+	rs->mixv = mem_deref(rs->mixv);
+
+	/* mono and stereo are converted without a matrix */
+	if (ilayout == olayout &&
+	    (rs->ich == rs->och || (rs->ich <= 2 && rs->och <= 2)))
+		return 0;
+
+	memset(m, 0, sizeof(m));
+
+	if (ilayout == AULAYOUT_AMBISONIC && olayout == AULAYOUT_AMBISONIC) {
+		for (i=0; i<min(rs->ich, rs->och); i++)
+			m[i][i] = 1.0;
+		err = 0;
+	}
+	else if (ilayout == AULAYOUT_AMBISONIC)
+		err = amb_to_std(m, rs->ich, rs->och);
+	else if (olayout == AULAYOUT_AMBISONIC)
+		err = std_to_amb(m, rs->ich, rs->och);
+	else
+		err = std_to_std(m, rs->ich, rs->och);
+
+	if (err)
+		return err;
+
+	rs->mixv = mem_zalloc(rs->och * rs->ich * sizeof(int16_t), NULL);
+	if (!rs->mixv)
+		return ENOMEM;
+
+	for (o=0; o<rs->och; o++) {
+
+		double sum = 0;
+
+		for (i=0; i<rs->ich; i++)
+			sum += fabs(m[o][i]);
+
+		for (i=0; i<rs->ich; i++) {
+
+			const double c = sum > 1.0 ? m[o][i] / sum : m[o][i];
+
+			rs->mixv[o * rs->ich + i] =
+				(int16_t)lround(c * (1 << FRAC));
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * Allocate a resampler
+ *
+ * @param rsp   Pointer to allocated resampler
+ * @param irate Input sampling rate in [Hz]
+ * @param ich   Input channels, 1 to 16
+ * @param orate Output sampling rate in [Hz]
+ * @param och   Output channels, 1 to 16
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int resamp_alloc(struct resamp **rsp, uint32_t irate, uint8_t ich,
+		 uint32_t orate, uint8_t och)
+{
+	struct resamp *rs;
+	uint32_t g;
+	int i, err;
+
+	if (!rsp || !irate || !orate)
+		return EINVAL;
+
+	if (!ich || ich > MAX_CH || !och || och > MAX_CH)
+		return ENOTSUP;
+
+	g = gcd(irate, orate);
+	if (orate / g > MAX_L)
+		return ENOTSUP;
+
+	rs = mem_zalloc(sizeof(*rs), destructor);
+	if (!rs)
+		return ENOMEM;
+
+	rs->irate = irate;
+	rs->orate = orate;
+	rs->ich   = ich;
+	rs->och   = och;
+	rs->fch   = min(ich, och);
+
+	err = bank_get(&rs->bank, orate / g, irate / g);
+	if (err)
+		goto out;
+
+	/* history of taps - 1 samples, zero at the start */
+	rs->len = rs->bank->taps - 1;
+
+	for (i=0; i<rs->fch; i++) {
+
+		rs->bufv[i] = mem_zalloc((rs->bank->taps + CHUNK) *
+					 sizeof(int16_t), NULL);
+		if (!rs->bufv[i]) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
+	err = resamp_layout(rs, AULAYOUT_STD, AULAYOUT_STD);
+
+ out:
+	if (err)
+		mem_deref(rs);
+	else
+		*rsp = rs;
+
+	return err;
+}
+
+
+static inline int32_t dot(const int16_t *xv, const int16_t *cv, size_t n)
+{
+	int32_t acc = 0;
+	size_t i = 0;
+
+#if defined (__SSE2__)
+	__m128i sum = _mm_setzero_si128();
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *)&xv[i]);
+		__m128i c = _mm_loadu_si128((const __m128i *)&cv[i]);
+
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(x, c));
+	}
+
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+	acc = _mm_cvtsi128_si32(sum);
+#elif defined (USE_NEON)
+	int32x4_t sum = vdupq_n_s32(0);
+
+	for (; i + 8 <= n; i += 8) {
+		int16x8_t x = vld1q_s16(&xv[i]);
+		int16x8_t c = vld1q_s16(&cv[i]);
+
+		sum = vmlal_s16(sum, vget_low_s16(x), vget_low_s16(c));
+		sum = vmlal_s16(sum, vget_high_s16(x), vget_high_s16(c));
+	}
+
+	acc = vgetq_lane_s32(sum, 0) + vgetq_lane_s32(sum, 1) +
+		vgetq_lane_s32(sum, 2) + vgetq_lane_s32(sum, 3);
+#endif
+
+	for (; i < n; i++)
+		acc += xv[i] * cv[i];
+
+	return acc;
+}
+
+
+static inline int16_t mix(const int16_t *mixv, const int16_t *x, size_t n)
+{
+	int32_t acc = 0;
+	size_t i;
+
+	for (i=0; i<n; i++)
+		acc += mixv[i] * x[i];
+
+	acc = (acc + (1 << (FRAC-1))) >> FRAC;
+
+	return (int16_t)max(min(acc, 32767), -32768);
+}
+
+
+/* append n sample-frames of input to the channel buffers */
+static void load(struct resamp *rs, const int16_t *inv, size_t n)
+{
+	size_t i;
+
+	if (rs->mixv && rs->och <= rs->ich) {
+
+		/* mixed down before the filter */
+		for (i=0; i<n; i++) {
+
+			const int16_t *x = &inv[i * rs->ich];
+			uint8_t o;
+
+			for (o=0; o<rs->och; o++) {
+				rs->bufv[o][rs->len + i] =
+					mix(&rs->mixv[o * rs->ich], x,
+					    rs->ich);
+			}
+		}
+	}
+	else if (rs->ich == rs->fch) {
+
+		if (rs->fch == 1) {
+			memcpy(&rs->bufv[0][rs->len], inv, n * 2);
+		}
+		else {
+			for (i=0; i<n; i++) {
+				uint8_t c;
+
+				for (c=0; c<rs->fch; c++) {
+					rs->bufv[c][rs->len + i] =
+						inv[rs->ich * i + c];
+				}
+			}
+		}
+	}
+	else {
+		/* stereo to mono */
+		for (i=0; i<n; i++)
+			rs->bufv[0][rs->len + i] = (inv[2*i] + inv[2*i+1]) / 2;
+	}
+
+	rs->len += n;
+}
+
+
+/* filter all complete outputs, returns the number of sample-frames */
+static size_t filter(struct resamp *rs, int16_t *outv, size_t outsz)
+{
+	const struct bank *b = rs->bank;
+	size_t n = 0;
+
+	while (rs->pos + b->taps <= rs->len && n < outsz) {
+
+		const int16_t *cv = &b->coefv[rs->phase * b->taps];
+		int16_t yv[MAX_CH];
+		uint8_t c;
+
+		for (c=0; c<rs->fch; c++) {
+
+			int32_t acc = dot(&rs->bufv[c][rs->pos], cv, b->taps);
+
+			acc = (acc + (1 << (FRAC-1))) >> FRAC;
+			acc = max(min(acc, 32767), -32768);
+
+			yv[c] = (int16_t)acc;
+		}
+
+		if (rs->mixv && rs->och > rs->ich) {
+
+			/* mixed up after the filter */
+			for (c=0; c<rs->och; c++) {
+				outv[n * rs->och + c] =
+					mix(&rs->mixv[c * rs->ich], yv,
+					    rs->ich);
+			}
+		}
+		else {
+			for (c=0; c<rs->fch; c++)
+				outv[n * rs->och + c] = yv[c];
+
+			/* mono to stereo */
+			if (rs->och > rs->fch)
+				outv[n * rs->och + 1] = yv[0];
+		}
+
+		rs->phase += b->m;
+		rs->pos   += rs->phase / b->l;
+		rs->phase %= b->l;
+		++n;
+	}
+
+	return n;
+}
+
+
+/**
+ * Resample a frame of interleaved samples
+ *
+ * @param rs   Resampler
+ * @param outv Output samples
+ * @param outc Size of the output buffer, returns the number of samples
+ * @param inv  Input samples
+ * @param inc  Number of input samples
+ *
+ * @return 0 if success, otherwise errorcode
+ *
+ * @note This function has REAL-TIME properties
+ */
+int resamp_process(struct resamp *rs, int16_t *outv, size_t *outc,
+		   const int16_t *inv, size_t inc)
+{
+	size_t frames, outsz, n = 0;
+	int err = 0;
+
+	if (!rs || !outv || !outc || !inv)
+		return EINVAL;
+
+	frames = inc / rs->ich;
+	outsz  = *outc / rs->och;
+
+	while (frames) {
+
+		const size_t chunk = min(frames, (size_t)CHUNK);
+		uint8_t c;
+
+		load(rs, inv, chunk);
+		inv    += chunk * rs->ich;
+		frames -= chunk;
+
+		n += filter(rs, &outv[n * rs->och], outsz - n);
+
+		/* output buffer is full, skip the rest of the input */
+		if (rs->pos + rs->bank->taps <= rs->len) {
+			rs->pos = rs->len - (rs->bank->taps - 1);
+			frames  = 0;
+			err     = ENOMEM;
+		}
+
+		/* keep the samples that are needed by the next outputs */
+		for (c=0; c<rs->fch; c++) {
+			memmove(rs->bufv[c], &rs->bufv[c][rs->pos],
+				(rs->len - rs->pos) * 2);
+		}
+
+		rs->len -= rs->pos;
+		rs->pos  = 0;
+	}
+
+	*outc = n * rs->och;
+
+	return err;
+}
+
+
+int resamp_debug(struct re_printf *pf, const struct resamp *rs)
+{
+	uint32_t n;
+
+	if (!rs)
+		return 0;
+
+	shard_lock();
+	n = list_count(&bankl);
+	shard_unlock();
+
+	return re_hprintf(pf, "%uHz/%uch --> %uHz/%uch"
+			  " (%u/%u, %zu taps, %u banks)",
+			  rs->irate, rs->ich, rs->orate, rs->och,
+			  rs->bank->l, rs->bank->m, rs->bank->taps, n);
+}
@@ -0,0 +1,292 @@
+/**
+ * @file rtcpxr.c  RTCP Extended Reports, VoIP Metrics (RFC 3611)
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * libre does not decode RTCP XR, so a UDP helper is registered above
+ * the media encryption layer of the RTP and RTCP sockets. It walks
+ * each incoming compound RTCP packet in plain text and decodes the
+ * VoIP Metrics blocks, and lets libre handle the packet as before.
+ *
+ * The metrics sent are calculated from the statistics of the stream,
+ * since the start of the call. Loss is not tracked per packet, so all
+ * loss is reported as isolated (gap) loss, and the levels, the echo
+ * return loss and the conversational MOS are reported as unavailable.
+ */
+
+
+enum {
+	LAYER_XR     = 30,      /* above SRTP/DTLS                 */
+	RTCP_XR      = 207,     /* RTCP packet type                */
+	XR_HDRSZ     = 8,       /* RTCP header and sender SSRC     */
+	BT_VOIP      = 7,       /* VoIP Metrics block type         */
+	VOIP_LEN     = 8,       /* VoIP Metrics block length       */
+	VOIP_SZ      = 36,      /* VoIP Metrics block size         */
+	GMIN         = 16,      /* Gap threshold (RFC 3611 4.7.2)  */
+	UNAVAILABLE  = 127,
+};
+
+struct rtcpxr {
+	struct udp_helper *uh_rtp;
+	struct udp_helper *uh_rtcp;
+	rtcpxr_voip_h *voiph;
+	void *arg;
+};
+
+
+static void destructor(void *arg)
+{
+	struct rtcpxr *xr = arg;
+
+	mem_deref(xr->uh_rtcp);
+	mem_deref(xr->uh_rtp);
+}
+
+
+static void voip_decode(struct rtcpxr_voip *v, const uint8_t *p)
+{
+	v->ssrc           = (uint32_t)p[4] << 24 | p[5] << 16 |
+			    p[6] << 8 | p[7];
+	v->loss_rate      = p[8];
+	v->discard_rate   = p[9];
+	v->burst_density  = p[10];
+	v->gap_density    = p[11];
+	v->burst_duration = p[12] << 8 | p[13];
+	v->gap_duration   = p[14] << 8 | p[15];
+	v->rtt            = p[16] << 8 | p[17];
+	v->es_delay       = p[18] << 8 | p[19];
+	v->r_factor       = p[24];
+	v->mos_lq         = p[26];
+	v->mos_cq         = p[27];
+	v->rx_config      = p[28];
+	v->jb_nominal     = p[30] << 8 | p[31];
+	v->jb_max         = p[32] << 8 | p[33];
+	v->jb_abs_max     = p[34] << 8 | p[35];
+}
+
+
+/* walk the report blocks of one XR packet */
+static void xr_decode(struct rtcpxr *xr, const uint8_t *p, size_t len)
+{
+	size_t pos = XR_HDRSZ;
+
+	while (pos + 4 <= len) {
+
+		size_t blen = 4 + 4 * (p[pos+2] << 8 | p[pos+3]);
+
+		if (pos + blen > len)
+			break;
+
+		if (p[pos] == BT_VOIP && blen == VOIP_SZ) {
+
+			struct rtcpxr_voip v;
+
+			voip_decode(&v, p + pos);
+			xr->voiph(&v, xr->arg);
+		}
+
+		pos += blen;
+	}
+}
+
+
+static bool recv_handler(struct sa *src, struct mbuf *mb, void *arg)
+{
+	struct rtcpxr *xr = arg;
+	const uint8_t *p = mbuf_buf(mb);
+	size_t left = mbuf_get_left(mb);
+	(void)src;
+
+	/* compound RTCP only, RTP is passed on when multiplexed */
+	if (left < 4 || (p[0] >> 6) != 2 || p[1] < 192 || p[1] > 223)
+		return false;
+
+	while (left >= 4 && (p[0] >> 6) == 2) {
+
+		size_t len = 4 + 4 * (p[2] << 8 | p[3]);
+
+		if (len > left)
+			break;
+
+		if (p[1] == RTCP_XR && len >= XR_HDRSZ)
+			xr_decode(xr, p, len);
+
+		p    += len;
+		left -= len;
+	}
+
+	return false;
+}
+
+
+/**
+ * Allocate the RTCP XR receiver of an RTP socket
+ *
+ * @param xrp   Pointer to allocated RTCP XR receiver
+ * @param rtp   RTP socket
+ * @param voiph Handler called for each received VoIP Metrics block
+ * @param arg   Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int rtcpxr_alloc(struct rtcpxr **xrp, struct rtp_sock *rtp,
+		 rtcpxr_voip_h *voiph, void *arg)
+{
+	struct rtcpxr *xr;
+	int err;
+
+	if (!xrp || !rtp || !voiph)
+		return EINVAL;
+
+	xr = mem_zalloc(sizeof(*xr), destructor);
+	if (!xr)
+		return ENOMEM;
+
+	xr->voiph = voiph;
+	xr->arg   = arg;
+
+	/* RTCP is received on the RTP socket when multiplexed */
+	err = udp_register_helper(&xr->uh_rtp, rtp_sock(rtp), LAYER_XR,
+				  NULL, recv_handler, xr);
+	if (!err && rtcp_sock(rtp)) {
+		err = udp_register_helper(&xr->uh_rtcp, rtcp_sock(rtp),
+					  LAYER_XR, NULL, recv_handler, xr);
+	}
+
+	if (err)
+		mem_deref(xr);
+	else
+		*xrp = xr;
+
+	return err;
+}
+
+
+/**
+ * Calculate the VoIP Metrics of a received stream
+ *
+ * @param v        Returned VoIP Metrics
+ * @param ssrc     SSRC of the received stream
+ * @param st       Statistics of the stream
+ * @param adaptive True if the jitter buffer is adaptive
+ */
+void rtcpxr_voip_calc(struct rtcpxr_voip *v, uint32_t ssrc,
+		      const struct stream_stats *st, bool adaptive)
+{
+	uint64_t expected;
+	uint32_t lost;
+	double mos, r;
+
+	if (!v || !st)
+		return;
+
+	memset(v, 0, sizeof(*v));
+
+	lost = st->rx.lost > 0 ? st->rx.lost : 0;
+	expected = st->rx.packets + lost;
+
+	if (st->mos_valid) {
+		mos = st->mos;
+		r   = st->r_factor;
+	}
+	else {
+		mos = mos_calculate(&r, st->rtt / 1000.0,
+				    st->rx.jitter / 1000.0, lost);
+	}
+
+	v->ssrc = ssrc;
+
+	if (expected) {
+		v->loss_rate    = (uint8_t)min(255, 256 * lost / expected);
+		v->discard_rate = (uint8_t)min(255, 256 * st->jbuf_overflow
+					       / expected);
+	}
+
+	v->gap_density = v->loss_rate;
+	v->rtt         = (uint16_t)min(65535, st->rtt / 1000);
+	v->es_delay    = (uint16_t)min(65535, st->jbuf_delay);
+	v->r_factor    = (uint8_t)r;
+	v->mos_lq      = (uint8_t)(10 * mos);
+	v->mos_cq      = UNAVAILABLE;
+	v->rx_config   = adaptive ? 0x30 : 0x20;  /* JBA bits */
+	v->jb_nominal  = (uint16_t)min(65535, st->jbuf_delay);
+}
+
+
+/**
+ * Encode an RTCP XR packet with one VoIP Metrics block
+ *
+ * @param mb   Buffer to encode into
+ * @param ssrc SSRC of the sender of the packet
+ * @param v    VoIP Metrics
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int rtcpxr_encode(struct mbuf *mb, uint32_t ssrc,
+		  const struct rtcpxr_voip *v)
+{
+	int err;
+
+	if (!mb || !v)
+		return EINVAL;
+
+	err  = mbuf_write_u8(mb, 2 << 6);
+	err |= mbuf_write_u8(mb, RTCP_XR);
+	err |= mbuf_write_u16(mb, htons((XR_HDRSZ + VOIP_SZ) / 4 - 1));
+	err |= mbuf_write_u32(mb, htonl(ssrc));
+
+	err |= mbuf_write_u8(mb, BT_VOIP);
+	err |= mbuf_write_u8(mb, 0);
+	err |= mbuf_write_u16(mb, htons(VOIP_LEN));
+	err |= mbuf_write_u32(mb, htonl(v->ssrc));
+
+	err |= mbuf_write_u8(mb, v->loss_rate);
+	err |= mbuf_write_u8(mb, v->discard_rate);
+	err |= mbuf_write_u8(mb, v->burst_density);
+	err |= mbuf_write_u8(mb, v->gap_density);
+	err |= mbuf_write_u16(mb, htons(v->burst_duration));
+	err |= mbuf_write_u16(mb, htons(v->gap_duration));
+	err |= mbuf_write_u16(mb, htons(v->rtt));
+	err |= mbuf_write_u16(mb, htons(v->es_delay));
+
+	err |= mbuf_write_u8(mb, UNAVAILABLE);    /* signal level */
+	err |= mbuf_write_u8(mb, UNAVAILABLE);    /* noise level  */
+	err |= mbuf_write_u8(mb, UNAVAILABLE);    /* RERL         */
+	err |= mbuf_write_u8(mb, GMIN);
+
+	err |= mbuf_write_u8(mb, v->r_factor);
+	err |= mbuf_write_u8(mb, UNAVAILABLE);    /* external R   */
+	err |= mbuf_write_u8(mb, v->mos_lq);
+	err |= mbuf_write_u8(mb, v->mos_cq);
+
+	err |= mbuf_write_u8(mb, v->rx_config);
+	err |= mbuf_write_u8(mb, 0);
+	err |= mbuf_write_u16(mb, htons(v->jb_nominal));
+	err |= mbuf_write_u16(mb, htons(v->jb_max));
+	err |= mbuf_write_u16(mb, htons(v->jb_abs_max));
+
+	return err;
+}
+
+
+int rtcpxr_voip_debug(struct re_printf *pf, const struct rtcpxr_voip *v)
+{
+	if (!v)
+		return 0;
+
+	return re_hprintf(pf, "loss=%.1f%% discard=%.1f%% rtt=%ums"
+			  " delay=%ums R=%u MOS-LQ=%.1f"
+			  " jb=%u/%u/%ums",
+			  100.0 * v->loss_rate / 256,
+			  100.0 * v->discard_rate / 256,
+			  v->rtt, v->es_delay, v->r_factor,
+			  v->mos_lq / 10.0,
+			  v->jb_nominal, v->jb_max, v->jb_abs_max);
+}
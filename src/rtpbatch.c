@@ -0,0 +1,392 @@
+/**
+ * @file rtpbatch.c  Batched sending of RTP packets
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#ifdef LINUX
+#define _GNU_SOURCE 1
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#endif
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * A UDP helper is registered on the lowest layer of the RTP socket, so
+ * it sees each packet exactly as it goes on the wire, after all other
+ * helpers (SRTP, ICE, TURN, ..) have processed it. While a batch is
+ * open the packets are copied into a fixed array instead of being sent,
+ * and rtpbatch_flush() sends them all with one sendmmsg() call.
+ *
+ * When built with liburing and rtp_uring is set, the batch is queued as
+ * one sendmsg per packet on a ring of its own, and submitted with one
+ * system call also when it has IPv4 and IPv6 packets. The completions
+ * are reaped in rtpbatch_flush(), so they stay with the thread that owns
+ * the stream, and the packet buffers are free for the next batch.
+ */
+
+
+#ifdef LINUX
+
+enum {
+	LAYER_BATCH = -1000,
+	BATCH_MAX   = 64,       /* max packets in one batch    */
+	BATCH_PKTSZ = 2048,     /* max size of a batched packet */
+};
+
+
+struct rtpbatch {
+	struct udp_helper *uh;
+	struct udp_sock *us;
+	struct mmsghdr *msgv;
+	struct iovec *iov;
+	struct sa *dstv;
+	uint8_t *buf;
+	size_t size;             /**< Capacity in packets             */
+	size_t n;                /**< Packets in the current batch    */
+	bool active;             /**< Batch is open                   */
+	uint64_t n_pkt;          /**< Packets sent in batches         */
+	uint64_t n_call;         /**< Number of sendmmsg() calls      */
+	uint64_t n_err;          /**< Packets that could not be sent  */
+#ifdef HAVE_LIBURING
+	struct io_uring ring;
+	bool uring;              /**< Send with io_uring              */
+#endif
+};
+
+
+static void destructor(void *arg)
+{
+	struct rtpbatch *b = arg;
+
+	(void)rtpbatch_flush(b);
+
+#ifdef HAVE_LIBURING
+	if (b->uring)
+		io_uring_queue_exit(&b->ring);
+#endif
+
+	mem_deref(b->uh);
+	mem_deref(b->msgv);
+	mem_deref(b->iov);
+	mem_deref(b->dstv);
+	mem_deref(b->buf);
+}
+
+
+static int send_run(struct rtpbatch *b, size_t start, size_t cnt)
+{
+	int fd = udp_sock_fd(b->us, sa_af(&b->dstv[start]));
+	size_t i = 0;
+
+	if (fd < 0)
+		return EBADF;
+
+	while (i < cnt) {
+
+		int r = sendmmsg(fd, &b->msgv[start + i],
+				 (unsigned)(cnt - i), 0);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+
+			b->n_err += cnt - i;
+			return errno;
+		}
+
+		++b->n_call;
+		b->n_pkt += r;
+		i += r;
+	}
+
+	return 0;
+}
+
+
+/* one sendmmsg() per run of packets with the same address family */
+static int send_mmsg(struct rtpbatch *b)
+{
+	size_t i, j;
+	int err = 0;
+
+	for (i=0; i<b->n; i=j) {
+
+		int af = sa_af(&b->dstv[i]);
+
+		for (j=i+1; j<b->n && sa_af(&b->dstv[j]) == af; j++)
+			;
+
+		err |= send_run(b, i, j - i);
+	}
+
+	return err;
+}
+
+
+#ifdef HAVE_LIBURING
+static int send_uring(struct rtpbatch *b)
+{
+	struct io_uring_cqe *cqe;
+	unsigned n = 0;
+	size_t i;
+	int r, err = 0;
+
+	/* the ring has room for a whole batch */
+	for (i=0; i<b->n; i++) {
+
+		int fd = udp_sock_fd(b->us, sa_af(&b->dstv[i]));
+		struct io_uring_sqe *sqe;
+
+		sqe = fd < 0 ? NULL : io_uring_get_sqe(&b->ring);
+		if (!sqe) {
+			++b->n_err;
+			err = EBADF;
+			continue;
+		}
+
+		io_uring_prep_sendmsg(sqe, fd, &b->msgv[i].msg_hdr, 0);
+		++n;
+	}
+
+	if (!n)
+		return err;
+
+	r = io_uring_submit_and_wait(&b->ring, n);
+	if (r < 0) {
+		b->n_err += n;
+		return -r;
+	}
+
+	++b->n_call;
+
+	/* wait for all of them, the buffers are used again */
+	while (r-- > 0) {
+
+		if (io_uring_wait_cqe(&b->ring, &cqe))
+			break;
+
+		if (cqe->res < 0) {
+			++b->n_err;
+			err = -cqe->res;
+		}
+		else
+			++b->n_pkt;
+
+		io_uring_cqe_seen(&b->ring, cqe);
+	}
+
+	return err;
+}
+#endif
+
+
+static bool send_handler(int *err, struct sa *dst, struct mbuf *mb,
+			 void *arg)
+{
+	struct rtpbatch *b = arg;
+	size_t len = mbuf_get_left(mb);
+	struct mmsghdr *msg;
+
+	if (!b->active)
+		return false;
+
+	/* keep the packet order, send oversized packets directly */
+	if (len > BATCH_PKTSZ) {
+		*err = rtpbatch_flush(b);
+		b->active = true;
+		return false;
+	}
+
+	if (b->n >= b->size) {
+		*err = rtpbatch_flush(b);
+		b->active = true;
+	}
+
+	memcpy(&b->buf[b->n * BATCH_PKTSZ], mbuf_buf(mb), len);
+	b->dstv[b->n] = *dst;
+
+	msg = &b->msgv[b->n];
+	memset(msg, 0, sizeof(*msg));
+
+	b->iov[b->n].iov_base = &b->buf[b->n * BATCH_PKTSZ];
+	b->iov[b->n].iov_len  = len;
+
+	msg->msg_hdr.msg_name    = &b->dstv[b->n].u.sa;
+	msg->msg_hdr.msg_namelen = b->dstv[b->n].len;
+	msg->msg_hdr.msg_iov     = &b->iov[b->n];
+	msg->msg_hdr.msg_iovlen  = 1;
+
+	++b->n;
+
+	return true;
+}
+
+
+/**
+ * Allocate a sender for batched RTP packets
+ *
+ * @param bp   Pointer to allocated batch sender
+ * @param us   UDP socket to send on
+ * @param size  Max number of packets per batch
+ * @param uring Send with io_uring, if available
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int rtpbatch_alloc(struct rtpbatch **bp, struct udp_sock *us, uint32_t size,
+		   bool uring)
+{
+	struct rtpbatch *b;
+	int err;
+
+	if (!bp || !us || size < 2)
+		return EINVAL;
+
+	b = mem_zalloc(sizeof(*b), destructor);
+	if (!b)
+		return ENOMEM;
+
+	b->us   = us;
+	b->size = min(size, BATCH_MAX);
+
+	b->msgv = mem_zalloc(b->size * sizeof(*b->msgv), NULL);
+	b->iov  = mem_zalloc(b->size * sizeof(*b->iov), NULL);
+	b->dstv = mem_zalloc(b->size * sizeof(*b->dstv), NULL);
+	b->buf  = mem_alloc(b->size * BATCH_PKTSZ, NULL);
+	if (!b->msgv || !b->iov || !b->dstv || !b->buf) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err = udp_register_helper(&b->uh, us, LAYER_BATCH,
+				  send_handler, NULL, b);
+	if (err)
+		goto out;
+
+#ifdef HAVE_LIBURING
+	if (uring) {
+		int r = io_uring_queue_init((unsigned)b->size, &b->ring, 0);
+		if (r < 0)
+			warning("rtpbatch: io_uring not available (%m),"
+				" using sendmmsg\n", -r);
+		else
+			b->uring = true;
+	}
+#else
+	if (uring)
+		warning("rtpbatch: built without io_uring support\n");
+#endif
+
+ out:
+	if (err)
+		mem_deref(b);
+	else
+		*bp = b;
+
+	return err;
+}
+
+
+/**
+ * Start collecting packets sent on the socket
+ *
+ * @param b Batch sender
+ */
+void rtpbatch_begin(struct rtpbatch *b)
+{
+	if (!b)
+		return;
+
+	b->active = true;
+}
+
+
+/**
+ * Send all collected packets and close the batch
+ *
+ * @param b Batch sender
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int rtpbatch_flush(struct rtpbatch *b)
+{
+	int err;
+
+	if (!b)
+		return EINVAL;
+
+	b->active = false;
+
+#ifdef HAVE_LIBURING
+	if (b->uring)
+		err = send_uring(b);
+	else
+#endif
+		err = send_mmsg(b);
+
+	b->n = 0;
+
+	return err;
+}
+
+
+int rtpbatch_debug(struct re_printf *pf, const struct rtpbatch *b)
+{
+	if (!b)
+		return 0;
+
+	return re_hprintf(pf, " batch: %llu packets in %llu calls"
+			  " (errors=%llu)%s\n",
+			  b->n_pkt, b->n_call, b->n_err,
+#ifdef HAVE_LIBURING
+			  b->uring ? " io_uring" :
+#endif
+			  "");
+}
+
+
+#else
+
+
+int rtpbatch_alloc(struct rtpbatch **bp, struct udp_sock *us, uint32_t size,
+		   bool uring)
+{
+	(void)bp;
+	(void)us;
+	(void)size;
+	(void)uring;
+
+	return ENOSYS;
+}
+
+
+void rtpbatch_begin(struct rtpbatch *b)
+{
+	(void)b;
+}
+
+
+int rtpbatch_flush(struct rtpbatch *b)
+{
+	(void)b;
+
+	return 0;
+}
+
+
+int rtpbatch_debug(struct re_printf *pf, const struct rtpbatch *b)
+{
+	(void)pf;
+	(void)b;
+
+	return 0;
+}
+
+
+#endif
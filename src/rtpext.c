@@ -0,0 +1,398 @@
+/**
+ * @file rtpext.c  RTP header extensions (RFC 8285)
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * A UDP helper is registered above the media encryption layer, so it
+ * sees each outgoing RTP packet of the stream in plain text. It inserts
+ * a one-byte header extension block after the fixed header, with the
+ * extensions that the peer listed in a=extmap:
+ *
+ *   abs-send-time      24-bit send time, 6.18 fixed point seconds
+ *   transport-cc       16-bit sequence number over all streams of a
+ *                      socket, for transport-wide congestion control
+ *   ssrc-audio-level   level of the audio frame (RFC 6464)
+ *
+ * The audio level of received packets is read from the extension block,
+ * which libre leaves in the buffer just before the payload.
+ */
+
+
+enum {
+	LAYER_EXT  = 40,
+	EXT_HDRSZ  = 4,         /* 0xBEDE and length                */
+	EXT_MAXSZ  = 16,        /* size of all extensions, padded   */
+	LEVEL_VOICE = 50,       /* voice activity below [-dBov]     */
+	LEVEL_MAX  = 127,       /* silence [-dBov]                  */
+};
+
+enum rtpext_type {
+	EXT_ABS_SEND_TIME = 0,
+	EXT_TRANSPORT_CC,
+	EXT_AUDIO_LEVEL,
+	EXT_MAX
+};
+
+static const char *uriv[EXT_MAX] = {
+	"http://www.webrtc.org/experiments/rtp-hdrext/abs-send-time",
+	"http://www.ietf.org/id/"
+		"draft-holmer-rmcat-transport-wide-cc-extensions-01",
+	"urn:ietf:params:rtp-hdrext:ssrc-audio-level",
+};
+
+struct rtpext {
+	struct udp_helper *uh;
+	uint32_t ssrc;              /**< SSRC of the outgoing stream    */
+	uint16_t *seqp;             /**< Transport-wide sequence number */
+	uint8_t idv[EXT_MAX];       /**< Negotiated IDs, 0 if not used  */
+	bool audio;                 /**< Offer the audio level          */
+	uint8_t level;              /**< Level of next packet [-dBov]   */
+	uint64_t n_pkt;             /**< Packets with extensions        */
+};
+
+
+static void destructor(void *arg)
+{
+	struct rtpext *x = arg;
+
+	mem_deref(x->uh);
+}
+
+
+static size_t ext_encode(struct rtpext *x, uint8_t *ext)
+{
+	size_t w = EXT_HDRSZ;
+	uint16_t words;
+
+	if (x->idv[EXT_ABS_SEND_TIME]) {
+
+		uint32_t v = (uint32_t)((tmr_jiffies() << 18) / 1000);
+
+		ext[w++] = x->idv[EXT_ABS_SEND_TIME] << 4 | (3 - 1);
+		ext[w++] = v >> 16;
+		ext[w++] = v >> 8;
+		ext[w++] = v;
+	}
+
+	if (x->idv[EXT_TRANSPORT_CC]) {
+
+		uint16_t seq = __atomic_fetch_add(x->seqp, 1,
+						  __ATOMIC_RELAXED);
+
+		ext[w++] = x->idv[EXT_TRANSPORT_CC] << 4 | (2 - 1);
+		ext[w++] = seq >> 8;
+		ext[w++] = seq;
+	}
+
+	if (x->audio && x->idv[EXT_AUDIO_LEVEL]) {
+
+		uint8_t level = x->level;
+
+		ext[w++] = x->idv[EXT_AUDIO_LEVEL] << 4 | (1 - 1);
+		ext[w++] = (level < LEVEL_VOICE ? 0x80 : 0) | level;
+	}
+
+	if (w == EXT_HDRSZ)
+		return 0;
+
+	while (w & 3)
+		ext[w++] = 0;
+
+	words = (uint16_t)((w - EXT_HDRSZ) / 4);
+
+	ext[0] = 0xbe;
+	ext[1] = 0xde;
+	ext[2] = words >> 8;
+	ext[3] = words & 0xff;
+
+	return w;
+}
+
+
+static bool send_handler(int *err, struct sa *dst, struct mbuf *mb,
+			 void *arg)
+{
+	struct rtpext *x = arg;
+	uint8_t ext[EXT_MAXSZ];
+	size_t len = mbuf_get_left(mb);
+	size_t hdrlen, extlen;
+	uint8_t *p = mbuf_buf(mb);
+	(void)dst;
+
+	/* RTP version 2 only; skip RTCP when multiplexed (RFC 5761) */
+	if (len < RTP_HEADER_SIZE || (p[0] >> 6) != 2)
+		return false;
+	if (p[1] >= 192 && p[1] <= 223)
+		return false;
+
+	/* already has an extension, or belongs to another stream */
+	if (p[0] & 0x10)
+		return false;
+	if (x->ssrc != ((uint32_t)p[8] << 24 | p[9] << 16 |
+			p[10] << 8 | p[11]))
+		return false;
+
+	hdrlen = RTP_HEADER_SIZE + 4 * (p[0] & 0x0f);
+	if (len < hdrlen)
+		return false;
+
+	extlen = ext_encode(x, ext);
+	if (!extlen)
+		return false;
+
+	if (mb->pos >= extlen) {
+
+		/* move the header into the headroom */
+		memmove(p - extlen, p, hdrlen);
+		mb->pos -= extlen;
+	}
+	else {
+		/* move the payload, the buffer may be reallocated */
+		if (mb->size < mb->end + extlen) {
+			*err = mbuf_resize(mb, mb->end + extlen);
+			if (*err)
+				return true;
+		}
+
+		p = mbuf_buf(mb);
+		memmove(p + hdrlen + extlen, p + hdrlen, len - hdrlen);
+		mb->end += extlen;
+	}
+
+	p = mbuf_buf(mb);
+	memcpy(p + hdrlen, ext, extlen);
+	p[0] |= 0x10;
+
+	++x->n_pkt;
+
+	return false;
+}
+
+
+/**
+ * Allocate the RTP header extensions of an outgoing stream
+ *
+ * @param xp    Pointer to allocated header extensions
+ * @param us    RTP socket
+ * @param ssrc  SSRC of the outgoing stream
+ * @param seqp  Transport-wide sequence number of the socket
+ * @param audio True for an audio stream
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int rtpext_alloc(struct rtpext **xp, struct udp_sock *us, uint32_t ssrc,
+		 uint16_t *seqp, bool audio)
+{
+	struct rtpext *x;
+	int err;
+
+	if (!xp || !us || !seqp)
+		return EINVAL;
+
+	x = mem_zalloc(sizeof(*x), destructor);
+	if (!x)
+		return ENOMEM;
+
+	x->ssrc  = ssrc;
+	x->seqp  = seqp;
+	x->audio = audio;
+	x->level = LEVEL_MAX;
+
+	err = udp_register_helper(&x->uh, us, LAYER_EXT,
+				  send_handler, NULL, x);
+	if (err)
+		mem_deref(x);
+	else
+		*xp = x;
+
+	return err;
+}
+
+
+static int extmap_add(struct sdp_media *m, uint8_t id, enum rtpext_type t)
+{
+	return sdp_media_set_lattr(m, false, "extmap", "%u %s", id, uriv[t]);
+}
+
+
+/**
+ * Add the supported header extensions to the local SDP media
+ *
+ * @param x Header extensions
+ * @param m SDP media
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int rtpext_sdp_offer(const struct rtpext *x, struct sdp_media *m)
+{
+	int t, err = 0;
+
+	if (!x || !m)
+		return EINVAL;
+
+	for (t=0; t<EXT_MAX; t++) {
+
+		if (t == EXT_AUDIO_LEVEL && !x->audio)
+			continue;
+
+		err |= extmap_add(m, t + 1, t);
+	}
+
+	return err;
+}
+
+
+static bool extmap_handler(const char *name, const char *value, void *arg)
+{
+	struct rtpext *x = arg;
+	struct pl id, uri;
+	int t;
+	(void)name;
+
+	if (re_regex(value, str_len(value), "[0-9]+[/a-z]* [^ ]+",
+		     &id, NULL, &uri))
+		return false;
+
+	for (t=0; t<EXT_MAX; t++) {
+
+		uint32_t v = pl_u32(&id);
+
+		if (t == EXT_AUDIO_LEVEL && !x->audio)
+			continue;
+
+		/* only the one-byte header format is supported */
+		if (0 == pl_strcmp(&uri, uriv[t]) && v >= 1 && v <= 14)
+			x->idv[t] = v;
+	}
+
+	return false;
+}
+
+
+/**
+ * Use the header extensions that the peer listed in its SDP. The local
+ * a=extmap lines are updated to the negotiated IDs.
+ *
+ * @param x Header extensions
+ * @param m SDP media
+ */
+void rtpext_sdp_decode(struct rtpext *x, struct sdp_media *m)
+{
+	int t;
+
+	if (!x || !m)
+		return;
+
+	memset(x->idv, 0, sizeof(x->idv));
+
+	if (!sdp_media_rattr(m, "extmap"))
+		return;
+
+	(void)sdp_media_rattr_apply(m, "extmap", extmap_handler, x);
+
+	sdp_media_del_lattr(m, "extmap");
+
+	for (t=0; t<EXT_MAX; t++) {
+
+		if (x->idv[t])
+			(void)extmap_add(m, x->idv[t], t);
+	}
+}
+
+
+/**
+ * Set the audio level sent with the next packets
+ *
+ * @param x     Header extensions
+ * @param dbov  Level of the audio frame [-dBov], see aulevel_calc()
+ *
+ * @note This function has REAL-TIME properties
+ */
+void rtpext_set_audio_level(struct rtpext *x, uint8_t dbov)
+{
+	if (!x)
+		return;
+
+	x->level = min(dbov, LEVEL_MAX);
+}
+
+
+/**
+ * Get the audio level of a received RTP packet (RFC 6464)
+ *
+ * @param x     Header extensions
+ * @param hdr   RTP header of the packet
+ * @param mb    Payload of the packet
+ * @param dbov  Returns the level of the audio frame [-dBov]
+ * @param voice Returns the voice activity flag
+ *
+ * @return 0 if success, ENOENT if the packet has no audio level
+ */
+int rtpext_audio_level_rx(const struct rtpext *x,
+			  const struct rtp_header *hdr,
+			  const struct mbuf *mb, uint8_t *dbov, bool *voice)
+{
+	const uint8_t id = x ? x->idv[EXT_AUDIO_LEVEL] : 0;
+	const uint8_t *p, *end;
+	size_t len;
+
+	if (!id || !hdr || !mb || !dbov || !voice)
+		return ENOENT;
+
+	len = hdr->x.len * 4;
+	if (!hdr->ext || hdr->x.type != 0xbede || mb->pos < len)
+		return ENOENT;
+
+	p   = mb->buf + mb->pos - len;
+	end = mb->buf + mb->pos;
+
+	while (p < end) {
+
+		const uint8_t eid = *p >> 4;
+		const size_t elen = (*p & 0x0f) + 1;
+
+		/* padding */
+		if (*p == 0) {
+			++p;
+			continue;
+		}
+
+		if (eid == 15 || p + 1 + elen > end)
+			break;
+
+		if (eid == id) {
+			*voice = (p[1] & 0x80) != 0;
+			*dbov  = p[1] & 0x7f;
+			return 0;
+		}
+
+		p += 1 + elen;
+	}
+
+	return ENOENT;
+}
+
+
+int rtpext_debug(struct re_printf *pf, const struct rtpext *x)
+{
+	int t, err = 0;
+
+	if (!x)
+		return 0;
+
+	err |= re_hprintf(pf, " hdrext: packets=%llu", x->n_pkt);
+	for (t=0; t<EXT_MAX; t++) {
+		if (x->idv[t])
+			err |= re_hprintf(pf, " %u=%s", x->idv[t], uriv[t]);
+	}
+	err |= re_hprintf(pf, "\n");
+
+	return err;
+}
@@ -20,14 +20,15 @@
 
 enum {
 	Tr_UDP =   15,
-	Tr_TCP = 7200
+	Tr_TCP = 7200,
+	T_FIRST =  20   /**< Delay of the first keepalive [ms] */
 };
 
 /** RTP Keepalive */
 struct rtpkeep {
 	struct rtp_sock *rtp;
 	struct sdp_media *sdp;
-	struct tmr tmr;
+	struct hktmr hkt;
 	char *method;
 	uint32_t ts;
 	bool flag;
@@ -38,7 +39,7 @@ static void destructor(void *arg)
 {
 	struct rtpkeep *rk = arg;
 
-	tmr_cancel(&rk->tmr);
+	hktmr_cancel(&rk->hkt);
 	mem_deref(rk->method);
 }
 
@@ -61,12 +62,13 @@ static int send_keepalive(struct rtpkeep *rk)
 				      STUN_METHOD_BINDING, NULL, 0, false, 0);
 	}
 	else if (!str_casecmp(rk->method, "dyna")) {
-		struct mbuf *mb = mbuf_alloc(RTP_HEADER_SIZE);
 		int pt = sdp_media_find_unused_pt(rk->sdp);
-		if (!mb)
-			return ENOMEM;
+		struct mbuf *mb;
 		if (pt == -1)
 			return ENOENT;
+		mb = mbuf_alloc(RTP_HEADER_SIZE);
+		if (!mb)
+			return ENOMEM;
 		mb->pos = mb->end = RTP_HEADER_SIZE;
 
 		err = rtp_send(rk->rtp, sdp_media_raddr(rk->sdp), false,
@@ -102,6 +104,9 @@ static int send_keepalive(struct rtpkeep *rk)
  * last period of 0 - 15 seconds. Start transmitting RTP keepalives
  * now and every 15 seconds after that.
  *
+ * All streams share the housekeeping timer of the interval, so a stream
+ * that sends RTP costs one flag update per packet and nothing else.
+ *
  * @param arg Handler argument
  */
 static void timeout(void *arg)
@@ -109,8 +114,6 @@ static void timeout(void *arg)
 	struct rtpkeep *rk = arg;
 	int err;
 
-	tmr_start(&rk->tmr, Tr_UDP * 1000, timeout, rk);
-
 	if (rk->flag) {
 		rk->flag = false;
 		return;
@@ -123,6 +126,21 @@ static void timeout(void *arg)
 }
 
 
+/* The first keepalive opens the NAT binding, unless RTP already did */
+static void first_timeout(void *arg)
+{
+	struct rtpkeep *rk = arg;
+	int err;
+
+	err = hktmr_start(&rk->hkt, Tr_UDP * 1000, timeout, rk);
+	if (err) {
+		warning("rtpkeep: timer failed: %m\n", err);
+	}
+
+	timeout(rk);
+}
+
+
 int rtpkeep_alloc(struct rtpkeep **rkp, const char *method, int proto,
 		  struct rtp_sock *rtp, struct sdp_media *sdp)
 {
@@ -143,7 +161,7 @@ int rtpkeep_alloc(struct rtpkeep **rkp, const char *method, int proto,
 	if (err)
 		goto out;
 
-	tmr_start(&rk->tmr, 20, timeout, rk);
+	err = hktmr_start(&rk->hkt, T_FIRST, first_timeout, rk);
 
  out:
 	if (err)
@@ -0,0 +1,261 @@
+/**
+ * @file rtpport.c  Pool of local RTP ports
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * The even ports of the configured range are kept in a bitmap, with a
+ * set bit for a free port. A second level has a bit for each word of
+ * the first level that has a free port, so with at most 32768 even
+ * ports a free one is found after looking at a few words only.
+ *
+ * The ports are handed out in a round, from after the last port that
+ * was given out, so that a port that was just released is not used
+ * again at once. The late packets of the last call are then not
+ * received by the next one.
+ *
+ * The event loops of the User-Agents share the pool, see shard_lock().
+ */
+
+
+#define BITS 64
+
+#if defined (__GNUC__) || defined (__clang__)
+#define FIRST_BIT(v)   __builtin_ctzll(v)
+#else
+#error "rtpport: bit scan builtin is required"
+#endif
+
+static struct {
+	uint64_t *mapv;         /**< Free ports, one bit per even port  */
+	uint64_t topv[8];       /**< Words of mapv with a free port     */
+	uint32_t nwords;        /**< Number of words in mapv            */
+	uint16_t min;           /**< First even port                    */
+	uint32_t n;             /**< Number of even ports               */
+	uint32_t next;          /**< Index to search from               */
+	struct rtpport_stat stat;
+} pool;
+
+
+static void pool_set(uint32_t ix, bool free)
+{
+	const uint32_t w = ix / BITS;
+
+	if (free)
+		pool.mapv[w] |= (uint64_t)1 << (ix % BITS);
+	else
+		pool.mapv[w] &= ~((uint64_t)1 << (ix % BITS));
+
+	if (pool.mapv[w])
+		pool.topv[w / BITS] |= (uint64_t)1 << (w % BITS);
+	else
+		pool.topv[w / BITS] &= ~((uint64_t)1 << (w % BITS));
+}
+
+
+/* First word with a free port, from word w on, or -1 */
+static int word_find(uint32_t w)
+{
+	uint32_t t;
+
+	for (t = w / BITS; t < ARRAY_SIZE(pool.topv); t++) {
+
+		uint64_t v = pool.topv[t];
+
+		if (t == w / BITS)
+			v &= ~(uint64_t)0 << (w % BITS);
+
+		if (v)
+			return (int)(t * BITS + FIRST_BIT(v));
+	}
+
+	return -1;
+}
+
+
+/* First free port, from index ix on, or -1 */
+static int port_find(uint32_t ix)
+{
+	const uint32_t w = ix / BITS;
+	uint64_t v;
+	int x;
+
+	if (ix >= pool.n)
+		return -1;
+
+	v = pool.mapv[w] & (~(uint64_t)0 << (ix % BITS));
+	if (v)
+		return (int)(w * BITS + FIRST_BIT(v));
+
+	x = word_find(w + 1);
+	if (x < 0)
+		return -1;
+
+	return x * BITS + FIRST_BIT(pool.mapv[x]);
+}
+
+
+static int pool_init(const struct range *range)
+{
+	uint32_t min = (range->min + 1) & ~1u;
+	uint32_t i;
+
+	pool.mapv = mem_deref(pool.mapv);
+	memset(&pool, 0, sizeof(pool));
+
+	if (range->max > 65535 || min + 1 > range->max)
+		return EINVAL;
+
+	pool.min    = (uint16_t)min;
+	pool.n      = (range->max - min + 1) / 2;
+	pool.nwords = (pool.n + BITS - 1) / BITS;
+
+	pool.mapv = mem_zalloc(pool.nwords * sizeof(*pool.mapv), NULL);
+	if (!pool.mapv)
+		return ENOMEM;
+
+	for (i=0; i<pool.n; i++)
+		pool_set(i, true);
+
+	pool.next = rand_u32() % pool.n;
+
+	pool.stat.total = pool.n;
+	pool.stat.free  = pool.n;
+
+	return 0;
+}
+
+
+static int pool_alloc(uint16_t *portp, const struct range *range)
+{
+	int ix;
+
+	/* the range is set again when no port is in use */
+	if (!pool.mapv || pool.stat.free == pool.n) {
+
+		const uint32_t min = (range->min + 1) & ~1u;
+
+		if (!pool.mapv || min != pool.min ||
+		    (range->max - min + 1) / 2 != pool.n) {
+
+			int err = pool_init(range);
+			if (err)
+				return err;
+		}
+	}
+
+	ix = port_find(pool.next);
+	if (ix < 0)
+		ix = port_find(0);
+	if (ix < 0) {
+		++pool.stat.n_full;
+		return ENOSPC;
+	}
+
+	pool_set(ix, false);
+	--pool.stat.free;
+	++pool.stat.n_alloc;
+
+	pool.next = (ix + 1) % pool.n;
+
+	*portp = pool.min + 2 * ix;
+
+	return 0;
+}
+
+
+/**
+ * Get a free even port for RTP, and the odd port above it for RTCP
+ *
+ * @param portp Pointer to the port
+ * @param range Port range
+ *
+ * @return 0 if success, ENOSPC if all ports are in use, otherwise
+ *         errorcode
+ */
+int rtpport_alloc(uint16_t *portp, const struct range *range)
+{
+	int err;
+
+	if (!portp || !range)
+		return EINVAL;
+
+	shard_lock();
+	err = pool_alloc(portp, range);
+	shard_unlock();
+
+	return err;
+}
+
+
+/**
+ * Give a port back to the pool
+ *
+ * @param port Port from rtpport_alloc()
+ */
+void rtpport_release(uint16_t port)
+{
+	uint32_t ix;
+
+	shard_lock();
+
+	if (!pool.mapv || !port || port < pool.min || (port - pool.min) & 1)
+		goto out;
+
+	ix = (port - pool.min) / 2;
+	if (ix >= pool.n)
+		goto out;
+
+	if (pool.mapv[ix / BITS] & ((uint64_t)1 << (ix % BITS)))
+		goto out;
+
+	pool_set(ix, true);
+	++pool.stat.free;
+
+ out:
+	shard_unlock();
+}
+
+
+/**
+ * Count a port that could not be bound, it is used by someone else
+ */
+void rtpport_failed(void)
+{
+	shard_lock();
+	++pool.stat.n_bind_fail;
+	shard_unlock();
+}
+
+
+void rtpport_close(void)
+{
+	pool.mapv = mem_deref(pool.mapv);
+	memset(&pool, 0, sizeof(pool));
+}
+
+
+/**
+ * Get the statistics of the RTP port pool
+ *
+ * @param st Statistics
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int rtpport_stats(struct rtpport_stat *st)
+{
+	if (!st)
+		return EINVAL;
+
+	shard_lock();
+	*st = pool.stat;
+	shard_unlock();
+
+	return 0;
+}
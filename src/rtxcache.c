@@ -0,0 +1,206 @@
+/**
+ * @file rtxcache.c  Send history for RTP retransmission
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * A UDP helper is registered between the media encryption layer
+ * (SRTP, layer 10 and above) and the NAT traversal layer (ICE, TURN,
+ * layer 0). It keeps a copy of the last RTXCACHE_SIZE outgoing RTP
+ * packets, indexed by sequence number, exactly as they were protected.
+ * A packet requested by a generic NACK (RFC 4585) is sent again with
+ * the same bytes through the layers below, which is also valid for SRTP
+ * since the receiver never got that packet index.
+ */
+
+
+enum {
+	LAYER_RTX    = 5,
+	RTXCACHE_SIZE = 256,       /* number of packets, power of two  */
+	RTXCACHE_PKTSZ = 1500,     /* max size of a cached packet      */
+	RTXCACHE_AGE = 1000,       /* do not resend older packets [ms] */
+	RTXCACHE_PRESZ = 36,       /* headroom for the layers below    */
+};
+
+
+struct rtxpkt {
+	uint64_t ts;               /**< Time when sent [ms], 0 = empty */
+	struct sa dst;
+	uint16_t seq;
+	uint16_t len;
+	uint8_t buf[RTXCACHE_PKTSZ];
+};
+
+struct rtxcache {
+	struct udp_helper *uh;
+	struct udp_sock *us;
+	struct rtxpkt *pktv;
+	struct mbuf *mb;            /**< Buffer for resending          */
+	uint32_t ssrc;              /**< SSRC of the cached stream     */
+	uint32_t n_resent;
+	uint32_t n_miss;
+};
+
+
+static void destructor(void *arg)
+{
+	struct rtxcache *rc = arg;
+
+	mem_deref(rc->uh);
+	mem_deref(rc->pktv);
+	mem_deref(rc->mb);
+}
+
+
+static bool send_handler(int *err, struct sa *dst, struct mbuf *mb,
+			 void *arg)
+{
+	struct rtxcache *rc = arg;
+	const uint8_t *p = mbuf_buf(mb);
+	size_t len = mbuf_get_left(mb);
+	struct rtxpkt *pkt;
+	uint16_t seq;
+	(void)err;
+
+	/* RTP version 2 only; skip RTCP when multiplexed (RFC 5761) */
+	if (len < RTP_HEADER_SIZE || len > RTXCACHE_PKTSZ)
+		return false;
+	if ((p[0] >> 6) != 2 || (p[1] >= 192 && p[1] <= 223))
+		return false;
+
+	/* other streams on the socket, e.g. FEC, have their own SSRC */
+	if (rc->ssrc != ((uint32_t)p[8] << 24 | p[9] << 16 |
+			 p[10] << 8 | p[11]))
+		return false;
+
+	seq = (uint16_t)(p[2] << 8 | p[3]);
+
+	pkt = &rc->pktv[seq & (RTXCACHE_SIZE - 1)];
+
+	pkt->ts  = tmr_jiffies();
+	pkt->dst = *dst;
+	pkt->seq = seq;
+	pkt->len = (uint16_t)len;
+	memcpy(pkt->buf, p, len);
+
+	return false;
+}
+
+
+/**
+ * Allocate a send history for RTP retransmission
+ *
+ * @param rcp  Pointer to allocated send history
+ * @param us   RTP socket
+ * @param ssrc SSRC of the outgoing stream
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int rtxcache_alloc(struct rtxcache **rcp, struct udp_sock *us,
+		   uint32_t ssrc)
+{
+	struct rtxcache *rc;
+	int err;
+
+	if (!rcp || !us)
+		return EINVAL;
+
+	rc = mem_zalloc(sizeof(*rc), destructor);
+	if (!rc)
+		return ENOMEM;
+
+	rc->us   = us;
+	rc->ssrc = ssrc;
+	rc->pktv = mem_zalloc(RTXCACHE_SIZE * sizeof(*rc->pktv), NULL);
+	rc->mb   = mbuf_alloc(RTXCACHE_PRESZ + RTXCACHE_PKTSZ);
+	if (!rc->pktv || !rc->mb) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err = udp_register_helper(&rc->uh, us, LAYER_RTX,
+				  send_handler, NULL, rc);
+
+ out:
+	if (err)
+		mem_deref(rc);
+	else
+		*rcp = rc;
+
+	return err;
+}
+
+
+static bool resend(struct rtxcache *rc, uint16_t seq, uint64_t now)
+{
+	struct rtxpkt *pkt = &rc->pktv[seq & (RTXCACHE_SIZE - 1)];
+	int err;
+
+	if (!pkt->ts || pkt->seq != seq || now - pkt->ts > RTXCACHE_AGE) {
+		++rc->n_miss;
+		return false;
+	}
+
+	rc->mb->pos = RTXCACHE_PRESZ;
+	rc->mb->end = RTXCACHE_PRESZ;
+	(void)mbuf_write_mem(rc->mb, pkt->buf, pkt->len);
+	rc->mb->pos = RTXCACHE_PRESZ;
+
+	/* only the layers below us see the resent packet */
+	err = udp_send_helper(rc->us, &pkt->dst, rc->mb, rc->uh);
+
+	if (err)
+		return false;
+
+	++rc->n_resent;
+
+	return true;
+}
+
+
+/**
+ * Resend the packets requested by one generic NACK item
+ *
+ * @param rc  Send history
+ * @param pid Packet ID, the sequence number of the first lost packet
+ * @param blp Bitmask of following lost packets
+ *
+ * @return Number of packets that were not found in the history
+ */
+unsigned rtxcache_resend(struct rtxcache *rc, uint16_t pid, uint16_t blp)
+{
+	uint64_t now = tmr_jiffies();
+	unsigned i, missing = 0;
+
+	if (!rc)
+		return 1;
+
+	if (!resend(rc, pid, now))
+		++missing;
+
+	for (i=0; i<16; i++) {
+
+		if (blp & (1 << i)) {
+			if (!resend(rc, pid + i + 1, now))
+				++missing;
+		}
+	}
+
+	return missing;
+}
+
+
+int rtxcache_debug(struct re_printf *pf, const struct rtxcache *rc)
+{
+	if (!rc)
+		return 0;
+
+	return re_hprintf(pf, " rtx: resent=%u missing=%u\n",
+			  rc->n_resent, rc->n_miss);
+}
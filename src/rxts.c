@@ -0,0 +1,109 @@
+/**
+ * @file rxts.c  Kernel receive timestamps for RTP sockets
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#ifdef LINUX
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <errno.h>
+#include <time.h>
+#endif
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * libre reads the socket itself, so the ancillary data with the
+ * timestamp is not available. Instead SIOCGSTAMPNS is used from the
+ * receive handler, which returns the kernel arrival time of the last
+ * packet read from the socket. This costs one system call per packet.
+ */
+
+
+#ifdef LINUX
+
+
+/**
+ * Enable kernel receive timestamps on a socket
+ *
+ * @param us UDP socket
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int rxts_enable(struct udp_sock *us)
+{
+	int on = 1;
+
+	if (!us)
+		return EINVAL;
+
+	return udp_setsockopt(us, SOL_SOCKET, SO_TIMESTAMPNS,
+			      &on, sizeof(on));
+}
+
+
+/**
+ * Get the time since the kernel received the last packet on a socket.
+ * Must be called from the receive handler of that packet.
+ *
+ * @param us    UDP socket
+ * @param af    Address family of the packet
+ * @param delay Returned delay in [us]
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int rxts_delay(struct udp_sock *us, int af, uint64_t *delay)
+{
+	struct timespec ts, now;
+	int64_t d;
+	int fd;
+
+	if (!us || !delay)
+		return EINVAL;
+
+	fd = udp_sock_fd(us, af);
+	if (fd < 0)
+		return EBADF;
+
+	if (ioctl(fd, SIOCGSTAMPNS, &ts) < 0)
+		return errno;
+
+	if (clock_gettime(CLOCK_REALTIME, &now) < 0)
+		return errno;
+
+	d = (int64_t)(now.tv_sec - ts.tv_sec) * 1000000
+		+ (now.tv_nsec - ts.tv_nsec) / 1000;
+
+	/* the wall clock may have been stepped */
+	*delay = d > 0 ? (uint64_t)d : 0;
+
+	return 0;
+}
+
+
+#else
+
+
+int rxts_enable(struct udp_sock *us)
+{
+	(void)us;
+
+	return ENOSYS;
+}
+
+
+int rxts_delay(struct udp_sock *us, int af, uint64_t *delay)
+{
+	(void)us;
+	(void)af;
+	(void)delay;
+
+	return ENOSYS;
+}
+
+
+#endif
@@ -0,0 +1,513 @@
+/**
+ * @file shard.c  Media of the calls on several event loops
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * With call_shards set, the media of the calls runs on that many event
+ * loops, each on a thread of its own. A loop has its own DNS client and
+ * timers. The SDP session and the media streams of a call, with their
+ * sockets, media NAT and encryption, belong to one loop and are only
+ * used from there.
+ *
+ * The main loop keeps the SIP stack with its one listener, the
+ * User-Agents, the calls, the modules and the commands. It hands work to
+ * a loop with shard_exec(), which waits for the result, and the loops
+ * hand their events back with shard_post().
+ *
+ * The loops are numbered from 1, the main loop is 0.
+ */
+
+
+#ifdef HAVE_PTHREAD
+
+enum {
+	JOB_SYNC = 0,
+	JOB_ASYNC,
+};
+
+struct job {
+	shard_exec_h *h;
+	void *arg;
+	int err;
+	bool done;
+};
+
+struct shard {
+	pthread_t tid;
+	struct mqueue *mq;       /**< Jobs for this loop                 */
+	struct dnsc *dnsc;       /**< DNS client of this loop            */
+	unsigned loop;           /**< Loop number, from 1                */
+	int err;                 /**< Result of the startup              */
+	bool up;                 /**< Startup is done                    */
+	bool run;                /**< Thread is running                  */
+};
+
+static struct {
+	struct shard *shardv;    /**< The loops, except the main loop    */
+	unsigned n;              /**< Number of loops                    */
+	unsigned next;           /**< Loop of the next call, main only   */
+	struct mqueue *mq;       /**< Jobs for the main loop             */
+	pthread_key_t key;       /**< Loop of the calling thread         */
+	pthread_mutex_t mutex;   /**< Protects done and up               */
+	pthread_cond_t cond;     /**< Signalled when a job is done       */
+} shards = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond  = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_mutex_t core_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void job_done(struct job *job, int err)
+{
+	pthread_mutex_lock(&shards.mutex);
+	job->err  = err;
+	job->done = true;
+	pthread_cond_broadcast(&shards.cond);
+	pthread_mutex_unlock(&shards.mutex);
+}
+
+
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	struct job *job = data;
+	(void)arg;
+
+	switch (id) {
+
+	case JOB_SYNC:
+		job_done(job, job->h(job->arg));
+		break;
+
+	case JOB_ASYNC:
+		(void)job->h(job->arg);
+		mem_deref(job);
+		break;
+	}
+}
+
+
+static void *shard_thread(void *arg)
+{
+	struct shard *sh = arg;
+	struct sa nsv[NET_MAX_NS];
+	uint32_t nsn = ARRAY_SIZE(nsv);
+	int err;
+
+	err = re_thread_init();
+	if (err)
+		goto out;
+
+	(void)pthread_setspecific(shards.key, sh);
+
+	err = mqueue_alloc(&sh->mq, mqueue_handler, sh);
+	if (err)
+		goto out;
+
+	err = net_dns_servers(baresip_network(), nsv, &nsn);
+	if (err)
+		goto out;
+
+	err = dnsc_alloc(&sh->dnsc, NULL, nsv, nsn);
+
+ out:
+	pthread_mutex_lock(&shards.mutex);
+	sh->err = err;
+	sh->up  = true;
+	pthread_cond_broadcast(&shards.cond);
+	pthread_mutex_unlock(&shards.mutex);
+
+	if (!err) {
+		err = re_main(NULL);
+		if (err)
+			warning("shard: loop %u: %m\n", sh->loop, err);
+	}
+
+	sh->dnsc = mem_deref(sh->dnsc);
+	sh->mq   = mem_deref(sh->mq);
+
+	re_thread_close();
+
+	return NULL;
+}
+
+
+static int stop_handler(void *arg)
+{
+	(void)arg;
+
+	re_cancel();
+
+	return 0;
+}
+
+
+static int shard_start(struct shard *sh)
+{
+	int err;
+
+	sh->run = true;
+
+	err = pthread_create(&sh->tid, NULL, shard_thread, sh);
+	if (err) {
+		sh->run = false;
+		return err;
+	}
+
+	pthread_mutex_lock(&shards.mutex);
+	while (!sh->up)
+		pthread_cond_wait(&shards.cond, &shards.mutex);
+	pthread_mutex_unlock(&shards.mutex);
+
+	return sh->err;
+}
+
+
+static struct shard *shard_get(unsigned loop)
+{
+	if (!loop || loop > shards.n)
+		return NULL;
+
+	return &shards.shardv[loop - 1];
+}
+
+
+/**
+ * Start the event loops of the media. Called from the main loop.
+ *
+ * @param n Number of loops, at most SHARD_MAX
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int shard_init(unsigned n)
+{
+	unsigned i;
+	int err;
+
+	if (!n || n > SHARD_MAX)
+		return EINVAL;
+
+	if (shards.n)
+		return EALREADY;
+
+	err = pthread_key_create(&shards.key, NULL);
+	if (err)
+		return err;
+
+	err = mqueue_alloc(&shards.mq, mqueue_handler, NULL);
+	if (err) {
+		(void)pthread_key_delete(shards.key);
+		return err;
+	}
+
+	shards.shardv = mem_zalloc(n * sizeof(*shards.shardv), NULL);
+	if (!shards.shardv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	shards.n = n;
+
+	for (i=0; i<n; i++) {
+
+		shards.shardv[i].loop = i + 1;
+
+		err = shard_start(&shards.shardv[i]);
+		if (err) {
+			warning("shard: loop %u: start failed (%m)\n",
+				i + 1, err);
+			goto out;
+		}
+	}
+
+	info("shard: started %u event loops\n", n);
+
+ out:
+	if (err)
+		shard_close();
+
+	return err;
+}
+
+
+/**
+ * Stop the event loops. Everything that was allocated on a loop must be
+ * freed on that loop before.
+ */
+void shard_close(void)
+{
+	unsigned i;
+
+	for (i=0; i<shards.n; i++) {
+
+		struct shard *sh = &shards.shardv[i];
+
+		if (!sh->run)
+			continue;
+
+		if (!sh->err)
+			(void)shard_exec(sh->loop, stop_handler, NULL);
+
+		pthread_join(sh->tid, NULL);
+		sh->run = false;
+	}
+
+	if (shards.mq) {
+		(void)pthread_key_delete(shards.key);
+		shards.mq = mem_deref(shards.mq);
+	}
+
+	shards.shardv = mem_deref(shards.shardv);
+	shards.n = 0;
+}
+
+
+/**
+ * Run a handler on an event loop and wait for its result. The handler
+ * is called directly if the caller is on that loop already. Only the
+ * main loop may wait for another loop.
+ *
+ * @param loop Event loop, 0 for the main loop
+ * @param h    Handler
+ * @param arg  Handler argument
+ *
+ * @return Result of the handler, or errorcode
+ */
+int shard_exec(unsigned loop, shard_exec_h *h, void *arg)
+{
+	const unsigned cur = shard_loop();
+	struct shard *sh;
+	struct job job;
+	int err;
+
+	if (!h)
+		return EINVAL;
+
+	if (loop == cur)
+		return h(arg);
+
+	/* two loops waiting for each other would never return */
+	if (cur)
+		return EDEADLK;
+
+	sh = shard_get(loop);
+	if (!sh || !sh->mq)
+		return ENOENT;
+
+	job.h    = h;
+	job.arg  = arg;
+	job.err  = 0;
+	job.done = false;
+
+	err = mqueue_push(sh->mq, JOB_SYNC, &job);
+	if (err)
+		return err;
+
+	pthread_mutex_lock(&shards.mutex);
+	while (!job.done)
+		pthread_cond_wait(&shards.cond, &shards.mutex);
+	pthread_mutex_unlock(&shards.mutex);
+
+	return job.err;
+}
+
+
+/**
+ * Run a handler on an event loop later, without waiting for it
+ *
+ * @param loop Event loop, 0 for the main loop
+ * @param h    Handler
+ * @param arg  Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int shard_post(unsigned loop, shard_exec_h *h, void *arg)
+{
+	struct mqueue *mq;
+	struct job *job;
+	int err;
+
+	if (!h)
+		return EINVAL;
+
+	if (loop) {
+		struct shard *sh = shard_get(loop);
+
+		mq = sh ? sh->mq : NULL;
+	}
+	else {
+		mq = shards.mq;
+	}
+
+	if (!mq)
+		return ENOENT;
+
+	job = mem_zalloc(sizeof(*job), NULL);
+	if (!job)
+		return ENOMEM;
+
+	job->h   = h;
+	job->arg = arg;
+
+	err = mqueue_push(mq, JOB_ASYNC, job);
+	if (err)
+		mem_deref(job);
+
+	return err;
+}
+
+
+/**
+ * Get the number of event loops for the media
+ *
+ * @return Number of loops, 0 if the media runs on the main loop
+ */
+unsigned shard_count(void)
+{
+	return shards.n;
+}
+
+
+/**
+ * Pick the event loop for the media of a new call, the loops are used
+ * in turn. Called from the main loop.
+ *
+ * @return Loop number, 0 if the media runs on the main loop
+ */
+unsigned shard_next(void)
+{
+	if (!shards.n)
+		return 0;
+
+	return shards.next++ % shards.n + 1;
+}
+
+
+/**
+ * Get the event loop of the calling thread
+ *
+ * @return Loop number, 0 for the main loop and for other threads
+ */
+unsigned shard_loop(void)
+{
+	const struct shard *sh;
+
+	if (!shards.n)
+		return 0;
+
+	sh = pthread_getspecific(shards.key);
+
+	return sh ? sh->loop : 0;
+}
+
+
+/**
+ * Get the DNS client of the calling event loop
+ *
+ * @return DNS client, NULL on the main loop
+ */
+struct dnsc *shard_dnsc(void)
+{
+	const struct shard *sh = shard_get(shard_loop());
+
+	return sh ? sh->dnsc : NULL;
+}
+
+
+/**
+ * Lock the core state that is shared by the event loops
+ */
+void shard_lock(void)
+{
+	pthread_mutex_lock(&core_lock);
+}
+
+
+/**
+ * Unlock the core state that is shared by the event loops
+ */
+void shard_unlock(void)
+{
+	pthread_mutex_unlock(&core_lock);
+}
+
+
+#else
+
+
+int shard_init(unsigned n)
+{
+	(void)n;
+
+	return ENOSYS;
+}
+
+
+void shard_close(void)
+{
+}
+
+
+int shard_exec(unsigned loop, shard_exec_h *h, void *arg)
+{
+	if (!h)
+		return EINVAL;
+
+	return loop ? ENOENT : h(arg);
+}
+
+
+int shard_post(unsigned loop, shard_exec_h *h, void *arg)
+{
+	(void)loop;
+	(void)h;
+	(void)arg;
+
+	return ENOSYS;
+}
+
+
+unsigned shard_count(void)
+{
+	return 0;
+}
+
+
+unsigned shard_next(void)
+{
+	return 0;
+}
+
+
+unsigned shard_loop(void)
+{
+	return 0;
+}
+
+
+struct dnsc *shard_dnsc(void)
+{
+	return NULL;
+}
+
+
+void shard_lock(void)
+{
+}
+
+
+void shard_unlock(void)
+{
+}
+
+
+#endif
@@ -108,7 +108,7 @@ int sip_req_send(struct ua *ua, const char *method, const char *uri,
 	if (!ua || !method || !uri || !fmt)
 		return EINVAL;
 
-	routev[0] = ua_outbound(ua);
+	routev[0] = eyeballs_route(ua_outbound(ua));
 
 	sr = mem_zalloc(sizeof(*sr), destructor);
 	if (!sr)
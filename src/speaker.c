@@ -0,0 +1,241 @@
+/**
+ * @file speaker.c  Selection of the active speakers of a conference
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * The audio streams that play to the same device, e.g. the participants
+ * of one aumix room, form a group. Each stream reports the audio level
+ * that the peer sends in the RFC 6464 header extension, and a timer
+ * picks the loudest streams of each group several times per second.
+ * Only those are decoded, the packets of the others are dropped before
+ * the decoder, without concealment. A stream whose peer does not send
+ * the level is always decoded.
+ *
+ * A speaker stays selected for a while after its last voice packet, so
+ * that the selection does not change between two words.
+ */
+
+
+enum {
+	SELECT_INTERVAL = 100,      /* Interval of the selection [ms]    */
+	HOLD            = 1000,     /* Selected after last voice [ms]    */
+};
+
+struct spkgroup {
+	struct le le;
+	struct list entl;           /**< Streams of the group (spkent)   */
+	struct hktmr tmr;
+	char key[160];              /**< Player module and device        */
+	uint32_t n;                 /**< Streams that are decoded        */
+};
+
+
+static struct list groupl;
+
+
+static void group_destructor(void *arg)
+{
+	struct spkgroup *g = arg;
+
+	hktmr_cancel(&g->tmr);
+	list_unlink(&g->le);
+}
+
+
+/* Loudest first, a speaker that was selected wins a tie */
+static bool louder(const struct spkent *a, const struct spkent *b)
+{
+	const uint8_t la = __atomic_load_n(&a->level, __ATOMIC_RELAXED);
+	const uint8_t lb = __atomic_load_n(&b->level, __ATOMIC_RELAXED);
+
+	if (la != lb)
+		return la < lb;
+
+	return a->active && !b->active;
+}
+
+
+static void select_handler(void *arg)
+{
+	struct spkgroup *g = arg;
+	const uint64_t now = tmr_jiffies();
+	struct spkent *best;
+	struct le *le;
+	uint32_t i;
+
+	for (le = g->entl.head; le; le = le->next) {
+		struct spkent *e = le->data;
+		const uint64_t ts = __atomic_load_n(&e->ts_voice,
+						    __ATOMIC_RELAXED);
+
+		e->speaking = ts && now - ts < HOLD;
+		e->chosen   = false;
+	}
+
+	for (i=0; i<g->n; i++) {
+
+		best = NULL;
+
+		for (le = g->entl.head; le; le = le->next) {
+			struct spkent *e = le->data;
+
+			if (!e->speaking || e->chosen)
+				continue;
+
+			if (!best || louder(e, best))
+				best = e;
+		}
+
+		if (!best)
+			break;
+
+		best->chosen = true;
+	}
+
+	for (le = g->entl.head; le; le = le->next) {
+		struct spkent *e = le->data;
+		const bool active = e->chosen ||
+			!__atomic_load_n(&e->known, __ATOMIC_RELAXED);
+
+		if (active != e->active) {
+			debug("speaker: %s: %p %s\n", g->key, e,
+			      active ? "decoded" : "dormant");
+		}
+
+		__atomic_store_n(&e->active, active, __ATOMIC_RELAXED);
+	}
+}
+
+
+static struct spkgroup *group_find(const char *key)
+{
+	struct le *le;
+
+	for (le = groupl.head; le; le = le->next) {
+		struct spkgroup *g = le->data;
+
+		if (0 == str_cmp(g->key, key))
+			return g;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Add an audio stream to the group of its player device
+ *
+ * @param e   Speaker entry of the stream
+ * @param mod Audio player module
+ * @param dev Audio player device
+ * @param n   Number of streams of the group that are decoded
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int speaker_join(struct spkent *e, const char *mod, const char *dev,
+		 uint32_t n)
+{
+	struct spkgroup *g;
+	char key[160];
+	int err;
+
+	if (!e || !n)
+		return EINVAL;
+
+	re_snprintf(key, sizeof(key), "%s,%s", mod, dev);
+
+	g = group_find(key);
+	if (g) {
+		mem_ref(g);
+	}
+	else {
+		g = mem_zalloc(sizeof(*g), group_destructor);
+		if (!g)
+			return ENOMEM;
+
+		str_ncpy(g->key, key, sizeof(g->key));
+		g->n = n;
+
+		err = hktmr_start(&g->tmr, SELECT_INTERVAL,
+				  select_handler, g);
+		if (err) {
+			mem_deref(g);
+			return err;
+		}
+
+		list_append(&groupl, &g->le, g);
+	}
+
+	memset(e, 0, sizeof(*e));
+	e->grp    = g;
+	e->level  = 127;
+	e->active = true;
+
+	list_append(&g->entl, &e->le, e);
+
+	return 0;
+}
+
+
+/**
+ * Remove an audio stream from its group
+ *
+ * @param e Speaker entry of the stream
+ */
+void speaker_leave(struct spkent *e)
+{
+	if (!e || !e->grp)
+		return;
+
+	list_unlink(&e->le);
+	e->grp = mem_deref(e->grp);
+}
+
+
+/**
+ * Report the audio level of a received packet
+ *
+ * @param e     Speaker entry of the stream
+ * @param dbov  Level [-dBov]
+ * @param voice True if the packet has voice
+ *
+ * @note This function has REAL-TIME properties
+ */
+void speaker_level(struct spkent *e, uint8_t dbov, bool voice)
+{
+	if (!e || !e->grp)
+		return;
+
+	__atomic_store_n(&e->known, true, __ATOMIC_RELAXED);
+
+	if (voice) {
+		__atomic_store_n(&e->level, dbov, __ATOMIC_RELAXED);
+		__atomic_store_n(&e->ts_voice, tmr_jiffies(),
+				 __ATOMIC_RELAXED);
+	}
+}
+
+
+/**
+ * Check if the packets of a stream are decoded
+ *
+ * @param e Speaker entry of the stream
+ *
+ * @return True if decoded, false if dormant
+ *
+ * @note This function has REAL-TIME properties
+ */
+bool speaker_active(const struct spkent *e)
+{
+	if (!e || !e->grp)
+		return true;
+
+	return __atomic_load_n(&e->active, __ATOMIC_RELAXED);
+}
@@ -5,18 +5,33 @@
 #
 
 SRCS	+= account.c
+SRCS	+= admit.c
 SRCS	+= aucodec.c
 SRCS	+= audio.c
+SRCS	+= audrift.c
 SRCS	+= aufilt.c
+SRCS	+= aulevel.c
+SRCS	+= aupcm.c
+SRCS	+= auring.c
+SRCS	+= aushare.c
 SRCS	+= auplay.c
 SRCS	+= ausrc.c
+SRCS	+= avsync.c
 SRCS	+= baresip.c
+SRCS	+= bwctrl.c
 SRCS	+= call.c
 SRCS	+= cmd.c
 SRCS	+= conf.c
 SRCS	+= config.c
 SRCS	+= contact.c
+SRCS	+= dnscache.c
+SRCS	+= eyeballs.c
+SRCS	+= fec.c
+SRCS	+= governor.c
+SRCS	+= hktimer.c
+SRCS	+= kernel.c
 SRCS	+= log.c
+SRCS	+= memtag.c
 SRCS	+= menc.c
 SRCS	+= message.c
 SRCS	+= metric.c
@@ -24,24 +39,48 @@ SRCS	+= mnat.c
 SRCS	+= module.c
 SRCS	+= mos.c
 SRCS	+= net.c
+SRCS	+= pathq.c
+SRCS	+= pipeprof.c
 SRCS	+= play.c
+SRCS	+= ptring.c
 SRCS	+= realtime.c
+SRCS	+= red.c
+SRCS	+= resamp.c
 SRCS	+= reg.c
+SRCS	+= reorder.c
+SRCS	+= rtcpxr.c
+SRCS	+= rtpbatch.c
+SRCS	+= rtpext.c
+SRCS	+= rtpport.c
 SRCS	+= rtpkeep.c
+SRCS	+= rtxcache.c
+SRCS	+= rxts.c
 SRCS	+= sdp.c
+SRCS	+= shard.c
 SRCS	+= sipreq.c
+SRCS	+= speaker.c
+SRCS	+= statepool.c
 SRCS	+= stream.c
+SRCS	+= txpool.c
 SRCS	+= ua.c
 SRCS	+= ui.c
+SRCS	+= vidbuf.c
+SRCS	+= watchdog.c
+SRCS	+= wsola.c
 
 ifneq ($(USE_VIDEO),)
 SRCS	+= bfcp.c
+SRCS	+= encshare.c
 SRCS	+= h264.c
 SRCS	+= mctrl.c
 SRCS	+= video.c
+SRCS	+= vidchange.c
 SRCS	+= vidcodec.c
 SRCS	+= vidfilt.c
 SRCS	+= vidisp.c
+SRCS	+= vidpool.c
+SRCS	+= vidscale.c
+SRCS	+= vidshare.c
 SRCS	+= vidsrc.c
 endif
 
@@ -0,0 +1,213 @@
+/**
+ * @file statepool.c  Pool of reusable codec states
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+
+
+/*
+ * Creating a codec state can be expensive, e.g. an Opus encoder
+ * allocates and initialises its analysis and coding state. A codec
+ * that can reset its states puts them in a pool when a stream is
+ * closed, and takes them from the pool when the next stream with the
+ * same key (typically sample rate and channels) is set up.
+ *
+ * States are given back and taken from any thread, the pool is
+ * protected by a lock. When the pool is full, the state is not taken
+ * and the caller frees it.
+ */
+
+
+struct statepool {
+	struct list statel;       /**< Pooled states (struct entry)   */
+	struct lock *lock;        /**< Protects statel and counters   */
+	statepool_free_h *freeh;  /**< Frees a pooled state           */
+	unsigned max;             /**< Maximum number of states       */
+	uint64_t n_hit;           /**< States taken from the pool     */
+	uint64_t n_miss;          /**< Lookups without a state        */
+	uint64_t n_full;          /**< States not taken, pool full    */
+};
+
+struct entry {
+	struct le le;
+	uint32_t key;
+	void *st;
+};
+
+
+static void entry_destructor(void *arg)
+{
+	struct entry *e = arg;
+
+	list_unlink(&e->le);
+}
+
+
+static void destructor(void *arg)
+{
+	struct statepool *pool = arg;
+	struct le *le;
+
+	while ((le = list_head(&pool->statel))) {
+
+		struct entry *e = le->data;
+
+		pool->freeh(e->st);
+		mem_deref(e);
+	}
+
+	mem_deref(pool->lock);
+}
+
+
+/**
+ * Allocate a codec state pool
+ *
+ * @param poolp Pointer to allocated pool
+ * @param max   Maximum number of pooled states
+ * @param freeh Handler that frees a state, when the pool is freed
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int statepool_alloc(struct statepool **poolp, unsigned max,
+		    statepool_free_h *freeh)
+{
+	struct statepool *pool;
+	int err;
+
+	if (!poolp || !max || !freeh)
+		return EINVAL;
+
+	pool = mem_zalloc(sizeof(*pool), destructor);
+	if (!pool)
+		return ENOMEM;
+
+	pool->freeh = freeh;
+	pool->max   = max;
+
+	err = lock_alloc(&pool->lock);
+	if (err)
+		mem_deref(pool);
+	else
+		*poolp = pool;
+
+	return err;
+}
+
+
+/**
+ * Take a state from the pool
+ *
+ * @param pool Codec state pool
+ * @param key  Key of the state
+ *
+ * @return State, or NULL if the pool has no state with this key
+ */
+void *statepool_get(struct statepool *pool, uint32_t key)
+{
+	struct entry *e = NULL;
+	struct le *le;
+	void *st = NULL;
+
+	if (!pool)
+		return NULL;
+
+	lock_write_get(pool->lock);
+
+	for (le = list_head(&pool->statel); le; le = le->next) {
+
+		if (((struct entry *)le->data)->key == key) {
+			e = le->data;
+			break;
+		}
+	}
+
+	if (e) {
+		st = e->st;
+		++pool->n_hit;
+		list_unlink(&e->le);
+	}
+	else {
+		++pool->n_miss;
+	}
+
+	lock_rel(pool->lock);
+
+	mem_deref(e);
+
+	return st;
+}
+
+
+/**
+ * Give a state back to the pool. The state must have been reset.
+ *
+ * @param pool Codec state pool
+ * @param key  Key of the state
+ * @param st   State
+ *
+ * @return True if the pool took the state, false if the caller frees it
+ */
+bool statepool_put(struct statepool *pool, uint32_t key, void *st)
+{
+	struct entry *e;
+
+	if (!pool || !st)
+		return false;
+
+	e = mem_zalloc(sizeof(*e), entry_destructor);
+	if (!e)
+		return false;
+
+	e->key = key;
+	e->st  = st;
+
+	lock_write_get(pool->lock);
+
+	if (list_count(&pool->statel) < pool->max) {
+		list_append(&pool->statel, &e->le, e);
+		e = NULL;
+	}
+	else {
+		++pool->n_full;
+	}
+
+	lock_rel(pool->lock);
+
+	if (e) {
+		e->st = NULL;
+		mem_deref(e);
+		return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * Print the usage of a codec state pool
+ *
+ * @param pf   Print handler
+ * @param pool Codec state pool
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int statepool_debug(struct re_printf *pf, const struct statepool *pool)
+{
+	int err;
+
+	if (!pool)
+		return 0;
+
+	lock_read_get(pool->lock);
+
+	err = re_hprintf(pf, "pooled=%u/%u hit=%llu miss=%llu full=%llu",
+			 list_count(&pool->statel), pool->max,
+			 pool->n_hit, pool->n_miss, pool->n_full);
+
+	lock_rel(pool->lock);
+
+	return err;
+}
@@ -12,10 +12,21 @@
 
 enum {
 	RTP_RECV_SIZE = 8192,
-	RTP_CHECK_INTERVAL = 1000  /* how often to check for RTP [ms] */
+	RTP_CHECK_INTERVAL = 1000, /* how often to check for RTP [ms] */
+	NACK_MAX  = 64,            /* max gap to request with NACK     */
+	NACK_WAIT = 200,           /* time to wait for resends [ms]    */
+	PORT_TRIES = 4,            /* ports to try binding to          */
+	XR_INTERVAL = 5000,        /* how often to send RTCP XR [ms]   */
+	RELAY_QMAX = 1000,         /* max delayed packets to relay     */
+	RELAY_DELAY_MAX = 10000,   /* max relay delay [ms]             */
+	FB_DELAY = 10,             /* RTCP feedback is collected [ms]  */
+	FB_SIZE  = 1000,           /* max. bytes of RTCP feedback      */
 };
 
 
+static struct log_mod stream_log = LOG_MOD_INIT("stream");
+
+
 static void stream_close(struct stream *strm, int err)
 {
 	stream_error_h *errorh = strm->errorh;
@@ -38,9 +49,6 @@ static void check_rtp_handler(void *arg)
 	const uint64_t now = tmr_jiffies();
 	int diff_ms;
 
-	tmr_start(&strm->tmr_rtp, RTP_CHECK_INTERVAL,
-		  check_rtp_handler, strm);
-
 	/* If no RTP was received at all, check later */
 	if (!strm->ts_last)
 		return;
@@ -52,8 +60,9 @@ static void check_rtp_handler(void *arg)
 
 		diff_ms = (int)(now - strm->ts_last);
 
-		debug("stream: last \"%s\" RTP packet: %d milliseconds\n",
-		      sdp_media_name(strm->sdp), diff_ms);
+		mod_dbg(stream_log,
+			"stream: last \"%s\" RTP packet: %d milliseconds\n",
+			sdp_media_name(strm->sdp), diff_ms);
 
 		if (diff_ms > (int)strm->rtp_timeout_ms) {
 
@@ -65,554 +74,2367 @@ static void check_rtp_handler(void *arg)
 		}
 	}
 	else {
-		re_printf("check_rtp: not checking (dir=%s)\n",
-			  sdp_dir_name(sdp_media_dir(strm->sdp)));
+		mod_dbg(stream_log,
+			"stream: check_rtp: not checking (dir=%s)\n",
+			sdp_dir_name(sdp_media_dir(strm->sdp)));
 	}
 }
 
 
-static inline int lostcalc(struct stream *s, uint16_t seq)
+/* The RTP socket of a stream, which may be shared with other streams */
+static struct rtp_sock *stream_transport(const struct stream *s)
 {
-	const uint16_t delta = seq - s->pseq;
-	int lostc;
+	return s->base ? s->base->rtp : s->rtp;
+}
 
-	if (s->pseq == (uint32_t)-1)
-		lostc = 0;
-	else if (delta == 0)
-		return -1;
-	else if (delta < 3000)
-		lostc = delta - 1;
-	else if (delta < 0xff9c)
-		lostc = 0;
-	else
-		return -2;
 
-	s->pseq = seq;
+static int gnack_encode(struct mbuf *mb, void *arg)
+{
+	const struct gnack *fci = arg;
+	int err;
 
-	return lostc;
+	err  = mbuf_write_u16(mb, htons(fci->pid));
+	err |= mbuf_write_u16(mb, htons(fci->blp));
+
+	return err;
 }
 
 
-static void print_rtp_stats(const struct stream *s)
+/*
+ * Send an RTCP packet that was encoded here. A bundled stream has no
+ * RTCP socket of its own, so it is sent on the shared socket.
+ */
+static int rtcp_send_raw(struct stream *s, struct mbuf *mb)
 {
-	bool started = s->metric_tx.n_packets>0 || s->metric_rx.n_packets>0;
+	const struct stream *owner = s->base ? s->base : s;
+	struct sa rtcp;
+	void *sock;
 
-	if (!started)
-		return;
+	if (s->rtcp_mux) {
+		sock = rtp_sock(owner->rtp);
+		rtcp = *sdp_media_raddr(s->sdp);
+	}
+	else {
+		sock = rtcp_sock(owner->rtp);
+		sdp_media_raddr_rtcp(s->sdp, &rtcp);
+	}
 
-	info("\n%-9s       Transmit:     Receive:\n"
-	     "packets:        %7u      %7u\n"
-	     "avg. bitrate:   %7.1f      %7.1f  (kbit/s)\n"
-	     "errors:         %7d      %7d\n"
-	     ,
-	     sdp_media_name(s->sdp),
-	     s->metric_tx.n_packets, s->metric_rx.n_packets,
-	     1.0*metric_avg_bitrate(&s->metric_tx)/1000,
-	     1.0*metric_avg_bitrate(&s->metric_rx)/1000,
-	     s->metric_tx.n_err, s->metric_rx.n_err
-	     );
+	if (!sock)
+		return ENOTCONN;
 
-	if (s->rtcp_stats.tx.sent || s->rtcp_stats.rx.sent) {
+	mb->pos = 0;
 
-		info("pkt.report:     %7u      %7u\n"
-		     "lost:           %7d      %7d\n"
-		     "jitter:         %7.1f      %7.1f  (ms)\n",
-		     s->rtcp_stats.tx.sent, s->rtcp_stats.rx.sent,
-		     s->rtcp_stats.tx.lost, s->rtcp_stats.rx.lost,
-		     1.0*s->rtcp_stats.tx.jit/1000,
-		     1.0*s->rtcp_stats.rx.jit/1000);
-	}
+	return udp_send(sock, &rtcp, mb);
 }
 
 
-static void stream_destructor(void *arg)
+/*
+ * RTCP feedback
+ *
+ * The feedback of all streams on a socket, NACK, PLI and FIR, is
+ * collected for a short time by the owner of the socket and sent in one
+ * packet. If the peer takes reduced-size RTCP (RFC 5506) the packet has
+ * only the feedback, otherwise it is a compound packet that starts with
+ * an empty RR and the CNAME (RFC 4585). A PLI that is waiting already
+ * is not added again.
+ */
+static int sdes_encode(struct mbuf *mb, void *arg)
 {
-	struct stream *s = arg;
+	const struct stream *s = arg;
 
-	if (s->cfg.rtp_stats)
-		print_rtp_stats(s);
-
-	metric_reset(&s->metric_tx);
-	metric_reset(&s->metric_rx);
-
-	tmr_cancel(&s->tmr_rtp);
-	list_unlink(&s->le);
-	mem_deref(s->rtpkeep);
-	mem_deref(s->sdp);
-	mem_deref(s->mes);
-	mem_deref(s->mencs);
-	mem_deref(s->mns);
-	mem_deref(s->jbuf);
-	mem_deref(s->rtp);
-	mem_deref(s->cname);
+	return rtcp_sdes_encode(mb, rtp_sess_ssrc(s->rtp), 1,
+				RTCP_SDES_CNAME, s->cname);
 }
 
 
-static void rtp_recv(const struct sa *src, const struct rtp_header *hdr,
-		     struct mbuf *mb, void *arg)
+static void fb_flush(struct stream *s)
 {
-	struct stream *s = arg;
-	bool flush = false;
-	int err;
+	struct mbuf *mb = s->fb.mb;
+	int err = 0;
 
-	s->ts_last = tmr_jiffies();
+	tmr_cancel(&s->fb.tmr);
+	s->fb.mb = NULL;
 
-	if (!mbuf_get_left(mb))
-		return;
+	if (!mb || !mb->end)
+		goto out;
 
-	if (!(sdp_media_ldir(s->sdp) & SDP_RECVONLY))
-		return;
+	++s->fb.n_pkt;
 
-	metric_add_packet(&s->metric_rx, mbuf_get_left(mb));
+	if (!sdp_media_rattr(s->sdp, "rtcp-rsize")) {
 
-	if (hdr->ssrc != s->ssrc_rx) {
-		if (s->ssrc_rx) {
-			flush = true;
-			info("stream: %s: SSRC changed %x -> %x"
-			     " (%u bytes from %J)\n",
-			     sdp_media_name(s->sdp), s->ssrc_rx, hdr->ssrc,
-			     mbuf_get_left(mb), src);
+		struct mbuf *fb = mb;
+
+		mb = mbuf_alloc(fb->end + 64);
+		if (!mb) {
+			mb = fb;
+			err = ENOMEM;
+			goto out;
 		}
-		s->ssrc_rx = hdr->ssrc;
-	}
 
-	if (s->jbuf) {
+		err  = rtcp_encode(mb, RTCP_RR, 0, rtp_sess_ssrc(s->rtp),
+				   NULL, NULL);
+		err |= rtcp_encode(mb, RTCP_SDES, 1, sdes_encode, s);
+		err |= mbuf_write_mem(mb, fb->buf, fb->end);
+
+		mem_deref(fb);
+		if (err)
+			goto out;
+	}
 
-		struct rtp_header hdr2;
-		void *mb2 = NULL;
+	err = rtcp_send_raw(s, mb);
 
-		/* Put frame in Jitter Buffer */
-		if (flush)
-			jbuf_flush(s->jbuf);
+ out:
+	if (err)
+		metric_add_error(&s->metric_tx);
 
-		err = jbuf_put(s->jbuf, hdr, mb);
-		if (err) {
-			info("%s: dropping %u bytes from %J (%m)\n",
-			     sdp_media_name(s->sdp), mb->end,
-			     src, err);
-			s->metric_rx.n_err++;
-		}
+	mem_deref(mb);
+}
 
-		if (jbuf_get(s->jbuf, &hdr2, &mb2)) {
 
-			if (!s->jbuf_started)
-				return;
+static void fb_tmr_handler(void *arg)
+{
+	fb_flush(arg);
+}
 
-			memset(&hdr2, 0, sizeof(hdr2));
-		}
 
-		s->jbuf_started = true;
+/* The buffer that a feedback message is added to */
+static struct mbuf *fb_buf(struct stream *s)
+{
+	struct stream *owner = s->base ? s->base : s;
 
-		if (lostcalc(s, hdr2.seq) > 0)
-			s->rtph(hdr, NULL, s->arg);
+	if (owner->fb.mb && owner->fb.mb->end >= FB_SIZE)
+		fb_flush(owner);
 
-		s->rtph(&hdr2, mb2, s->arg);
+	if (!owner->fb.mb) {
+		owner->fb.mb = mbuf_alloc(256);
+		if (!owner->fb.mb)
+			return NULL;
 
-		mem_deref(mb2);
+		tmr_start(&owner->fb.tmr, FB_DELAY, fb_tmr_handler, owner);
 	}
-	else {
-		if (lostcalc(s, hdr->seq) > 0)
-			s->rtph(hdr, NULL, s->arg);
 
-		s->rtph(hdr, mb, s->arg);
-	}
+	++owner->fb.n_msg;
+
+	return owner->fb.mb;
 }
 
 
-static void rtcp_handler(const struct sa *src, struct rtcp_msg *msg, void *arg)
+static int send_nack(struct stream *s, uint16_t pid, uint16_t blp)
 {
-	struct stream *s = arg;
-	(void)src;
+	struct gnack fci;
+	struct mbuf *mb;
 
-	if (s->rtcph)
-		s->rtcph(msg, s->arg);
+	mb = fb_buf(s);
+	if (!mb)
+		return ENOMEM;
 
-	switch (msg->hdr.pt) {
+	fci.pid = pid;
+	fci.blp = blp;
 
-	case RTCP_SR:
-		(void)rtcp_stats(s->rtp, msg->r.sr.ssrc, &s->rtcp_stats);
+	return rtcp_encode(mb, RTCP_RTPFB, RTCP_RTPFB_GNACK,
+			   rtp_sess_ssrc(s->rtp), s->ssrc_rx,
+			   gnack_encode, &fci);
+}
 
-		if (s->cfg.rtp_stats)
-			call_set_xrtpstat(s->call);
 
-		break;
+static int send_fir(struct stream *s, bool pli)
+{
+	const struct stream *owner = s->base ? s->base : s;
+	struct mbuf *mb;
+	int err;
+
+	/* the PLI in the packet that is waiting covers this one */
+	if (pli && owner->fb.mb && s->fb_pli == owner->fb.n_pkt + 1)
+		return 0;
+
+	mb = fb_buf(s);
+	if (!mb)
+		return ENOMEM;
+
+	if (pli) {
+		err = rtcp_encode(mb, RTCP_PSFB, RTCP_PSFB_PLI,
+				  rtp_sess_ssrc(s->rtp), s->ssrc_rx,
+				  NULL, NULL);
+		if (!err)
+			s->fb_pli = owner->fb.n_pkt + 1;
+	}
+	else {
+		err = rtcp_encode(mb, RTCP_FIR, 0, rtp_sess_ssrc(s->rtp));
 	}
+
+	return err;
 }
 
 
-static int stream_sock_alloc(struct stream *s, int af)
+/* Send RTP on the stream's socket, with the SSRC and sequence of rs */
+static int transport_send(struct stream *s, struct rtp_sock *rs,
+			  bool marker, int pt, uint32_t ts, struct mbuf *mb)
 {
-	struct sa laddr;
-	int tos, err;
+	size_t pos;
+	int err;
 
-	if (!s)
-		return EINVAL;
+	if (mb->pos < RTP_HEADER_SIZE)
+		return EBUSY;
 
-	/* we listen on all interfaces */
-	sa_init(&laddr, af);
+	mb->pos -= RTP_HEADER_SIZE;
+	pos = mb->pos;
 
-	err = rtp_listen(&s->rtp, IPPROTO_UDP, &laddr,
-			 s->cfg.rtp_ports.min, s->cfg.rtp_ports.max,
-			 s->rtcp, rtp_recv, rtcp_handler, s);
-	if (err) {
-		warning("stream: rtp_listen failed: af=%s ports=%u-%u"
-			" (%m)\n", net_af2name(af),
-			s->cfg.rtp_ports.min, s->cfg.rtp_ports.max, err);
+	err = rtp_encode(rs, marker, pt, ts, mb);
+	if (err)
 		return err;
-	}
 
-	tos = s->cfg.rtp_tos;
-	(void)udp_setsockopt(rtp_sock(s->rtp), IPPROTO_IP, IP_TOS,
-			     &tos, sizeof(tos));
-	(void)udp_setsockopt(rtcp_sock(s->rtp), IPPROTO_IP, IP_TOS,
-			     &tos, sizeof(tos));
+	mb->pos = pos;
 
-	udp_rxsz_set(rtp_sock(s->rtp), RTP_RECV_SIZE);
+	return udp_send(rtp_sock(stream_transport(s)),
+			sdp_media_raddr(s->sdp), mb);
+}
 
-	return 0;
+
+/* Send RTP on the shared socket, with our own SSRC and sequence */
+static int bundle_send(struct stream *s, bool marker, int pt, uint32_t ts,
+		       struct mbuf *mb)
+{
+	if (!s->base)
+		return ENOTCONN;
+
+	return transport_send(s, s->rtp, marker, pt, ts, mb);
 }
 
 
-int stream_alloc(struct stream **sp, const struct config_avt *cfg,
-		 struct call *call, struct sdp_session *sdp_sess,
-		 const char *name, int label,
-		 const struct mnat *mnat, struct mnat_sess *mnat_sess,
-		 const struct menc *menc, struct menc_sess *menc_sess,
-		 const char *cname,
-		 stream_rtp_h *rtph, stream_rtcp_h *rtcph, void *arg)
+/*
+ * Find the stream of a packet received on a shared socket. The SSRC
+ * signalled in SDP or learnt from earlier packets is used first, then
+ * the payload type, preferring streams that have no SSRC yet.
+ */
+static struct stream *bundle_demux(struct stream *base,
+				   const struct rtp_header *hdr)
 {
-	struct stream *s;
-	int err;
+	struct stream *match_new = NULL, *match = NULL;
+	struct le *le;
 
-	if (!sp || !cfg || !call || !rtph)
-		return EINVAL;
+	if (!base->n_bundle)
+		return base;
 
-	s = mem_zalloc(sizeof(*s), stream_destructor);
-	if (!s)
-		return ENOMEM;
+	for (le = list_head(call_streaml(base->call)); le; le = le->next) {
 
-	s->cfg   = *cfg;
-	s->call  = call;
-	s->rtph  = rtph;
-	s->rtcph = rtcph;
-	s->arg   = arg;
-	s->pseq  = -1;
-	s->rtcp  = s->cfg.rtcp_enable;
+		struct stream *s = le->data;
 
-	err = stream_sock_alloc(s, call_af(call));
-	if (err) {
-		warning("stream: failed to create socket for media '%s'"
-			" (%m)\n", name, err);
-		goto out;
-	}
+		if (s != base && s->base != base)
+			continue;
 
-	err = str_dup(&s->cname, cname);
-	if (err)
-		goto out;
+		if ((s->ssrc_sig && hdr->ssrc == s->ssrc_sig) ||
+		    (s->ssrc_rx && hdr->ssrc == s->ssrc_rx))
+			return s;
 
-	/* Jitter buffer */
-	if (cfg->jbuf_del.min && cfg->jbuf_del.max) {
+		if (s->fec && hdr->pt == fec_pt_rx(s->fec))
+			return s;
 
-		err = jbuf_alloc(&s->jbuf, cfg->jbuf_del.min,
-				 cfg->jbuf_del.max);
-		if (err)
-			goto out;
+		if (!sdp_media_lformat(s->sdp, hdr->pt))
+			continue;
+
+		if (!match_new && !s->ssrc_sig && !s->ssrc_rx)
+			match_new = s;
+		else if (!match)
+			match = s;
 	}
 
-	err = sdp_media_add(&s->sdp, sdp_sess, name,
-			    sa_port(rtp_local(s->rtp)),
-			    (menc && menc->sdp_proto) ? menc->sdp_proto :
-			    sdp_proto_rtpavp);
-	if (err)
-		goto out;
+	if (match_new)
+		return match_new;
 
-	if (label) {
-		err |= sdp_media_set_lattr(s->sdp, true,
-					   "label", "%d", label);
-	}
+	return match ? match : base;
+}
 
-	/* RFC 5506 */
-	if (s->rtcp)
-		err |= sdp_media_set_lattr(s->sdp, true, "rtcp-rsize", NULL);
 
-	/* RFC 5576 */
-	if (s->rtcp) {
-		err |= sdp_media_set_lattr(s->sdp, true,
-					   "ssrc", "%u cname:%s",
-					   rtp_sess_ssrc(s->rtp), cname);
-	}
+/* The shared socket goes away, and so must everything bound to it */
+static void bundle_detach(struct stream *base)
+{
+	struct le *le;
 
-	/* RFC 5761 */
-	if (cfg->rtcp_mux)
-		err |= sdp_media_set_lattr(s->sdp, true, "rtcp-mux", NULL);
+	for (le = list_head(call_streaml(base->call)); le; le = le->next) {
 
-	if (err)
-		goto out;
+		struct stream *s = le->data;
 
-	if (mnat) {
-		err = mnat->mediah(&s->mns, mnat_sess, IPPROTO_UDP,
-				   rtp_sock(s->rtp),
-				   s->rtcp ? rtcp_sock(s->rtp) : NULL,
-				   s->sdp);
-		if (err)
-			goto out;
-	}
+		if (s->base != base)
+			continue;
 
-	if (menc) {
-		s->menc  = menc;
-		s->mencs = mem_ref(menc_sess);
-		err = menc->mediah(&s->mes, menc_sess,
-				   s->rtp,
-				   IPPROTO_UDP,
-				   rtp_sock(s->rtp),
-				   s->rtcp ? rtcp_sock(s->rtp) : NULL,
-				   s->sdp);
-		if (err)
-			goto out;
+		s->rtx  = mem_deref(s->rtx);
+		s->fec  = mem_deref(s->fec);
+		s->ext  = mem_deref(s->ext);
+		s->base = NULL;
 	}
 
-	if (err)
-		goto out;
+	base->n_bundle = 0;
+}
 
-	s->pt_enc = -1;
 
-	metric_init(&s->metric_tx);
-	metric_init(&s->metric_rx);
+static int bundle_print_mids(struct re_printf *pf, const struct stream *base)
+{
+	struct le *le;
+	int err = 0;
 
-	list_append(call_streaml(call), &s->le, s);
+	for (le = list_head(call_streaml(base->call)); le; le = le->next) {
 
- out:
-	if (err)
-		mem_deref(s);
-	else
-		*sp = s;
+		const struct stream *s = le->data;
+
+		if (s == base || s->base == base)
+			err |= re_hprintf(pf, " %s", sdp_media_name(s->sdp));
+	}
 
 	return err;
 }
 
 
-struct sdp_media *stream_sdpmedia(const struct stream *s)
+static bool ssrc_handler(const char *name, const char *value, void *arg)
 {
-	return s ? s->sdp : NULL;
-}
+	uint32_t *ssrc = arg;
+	struct pl pl;
+	(void)name;
 
+	if (re_regex(value, str_len(value), "[0-9]+", &pl))
+		return false;
 
-static void stream_start_keepalive(struct stream *s)
-{
-	const char *rtpkeep;
+	*ssrc = pl_u32(&pl);
 
+	return true;
+}
+
+
+static inline int lostcalc(struct stream *s, uint16_t seq)
+{
+	const uint16_t delta = seq - s->pseq;
+	int lostc;
+
+	if (s->pseq == (uint32_t)-1)
+		lostc = 0;
+	else if (delta == 0)
+		return -1;
+	else if (delta < 3000)
+		lostc = delta - 1;
+	else if (delta < 0xff9c)
+		lostc = 0;
+	else
+		return -2;
+
+	s->pseq = seq;
+
+	if (lostc > 0)
+		mos_est_loss(&s->mos, lostc);
+
+	return lostc;
+}
+
+
+/* Request missing packets with generic NACK (RFC 4585) */
+static void nack_check(struct stream *s, uint16_t seq)
+{
+	uint16_t delta, i;
+	int err = 0;
+
+	if (!s->nack_valid) {
+		s->nack_seq   = seq;
+		s->nack_valid = true;
+		return;
+	}
+
+	delta = seq - s->nack_seq;
+
+	/* duplicate, reordered or resent packet */
+	if (delta == 0 || delta >= 0x8000)
+		return;
+
+	if (delta > 1 && delta <= NACK_MAX) {
+
+		for (i = 1; i < delta; i += 17) {
+
+			uint16_t pid = s->nack_seq + i;
+			uint16_t blp = 0;
+			uint16_t j;
+
+			for (j = 1; j <= 16 && i + j < delta; j++)
+				blp |= 1 << (j - 1);
+
+			err |= send_nack(s, pid, blp);
+			++s->n_nack;
+		}
+
+		if (err)
+			metric_add_error(&s->metric_tx);
+
+		s->nack_ts = tmr_jiffies();
+	}
+
+	s->nack_seq = seq;
+}
+
+
+/*
+ * Adaptive jitter buffer
+ *
+ * The jitter is estimated per packet as specified in RFC 3550 section
+ * 6.4.1, and the target delay is set to twice the jitter plus one frame
+ * plus the delay added for lip-sync, limited to the configured
+ * jitter_buffer_delay range. The buffer is
+ * shrunk by dropping a frame and grown by skipping a read.
+ */
+
+static void jba_reset(struct jbuf_adapt *jba, uint32_t target)
+{
+	jba->valid  = false;
+	jba->depth  = 0;
+	jba->jitter = 0;
+	jba->target = target;
+}
+
+
+static void jba_update(struct stream *s, const struct rtp_header *hdr,
+		       uint64_t arrival)
+{
+	struct jbuf_adapt *jba = &s->jba;
+	int64_t transit, d;
+	uint32_t target;
+
+	if (!s->srate_rx)
+		return;
+
+	transit = (int64_t)arrival
+		- (int64_t)hdr->ts * 1000000 / s->srate_rx;
+
+	if (jba->valid) {
+
+		d = transit - jba->transit;
+		if (d < 0)
+			d = -d;
+
+		/* avoid outliers from timestamp wrap-around */
+		if (d < 10000000)
+			jba->jitter = (uint32_t)(jba->jitter +
+					(d - (int64_t)jba->jitter) / 16);
+
+		if ((uint16_t)(hdr->seq - jba->seq_prev) == 1 &&
+		    hdr->ts != jba->ts_prev) {
+
+			jba->frame_us = (uint32_t)((uint64_t)
+				(hdr->ts - jba->ts_prev) * 1000000
+						       / s->srate_rx);
+		}
+	}
+
+	jba->transit  = transit;
+	jba->ts_prev  = hdr->ts;
+	jba->seq_prev = hdr->seq;
+	jba->valid    = true;
+
+	if (!jba->frame_us)
+		return;
+
+	target = 1 + (2 * jba->jitter + jba->extra + jba->frame_us - 1)
+		/ jba->frame_us;
+
+	if (target < s->cfg.jbuf_del.min)
+		target = s->cfg.jbuf_del.min;
+	if (target > s->cfg.jbuf_del.max)
+		target = s->cfg.jbuf_del.max;
+
+	jba->target = target;
+}
+
+
+static uint32_t jba_delay_ms(const struct jbuf_adapt *jba)
+{
+	return jba->depth * jba->frame_us / 1000;
+}
+
+
+static void print_rtp_stats(const struct stream *s)
+{
+	struct metric_snapshot tx, rx;
+
+	metric_snapshot(&s->metric_tx, &tx);
+	metric_snapshot(&s->metric_rx, &rx);
+
+	if (!tx.n_packets && !rx.n_packets)
+		return;
+
+	info("\n%-9s       Transmit:     Receive:\n"
+	     "packets:        %7llu      %7llu\n"
+	     "avg. bitrate:   %7.1f      %7.1f  (kbit/s)\n"
+	     "errors:         %7llu      %7llu\n"
+	     ,
+	     sdp_media_name(s->sdp),
+	     tx.n_packets, rx.n_packets,
+	     1.0*tx.avg_bitrate/1000,
+	     1.0*rx.avg_bitrate/1000,
+	     tx.n_err, rx.n_err
+	     );
+
+	if (s->rtcp_stats.tx.sent || s->rtcp_stats.rx.sent) {
+
+		info("pkt.report:     %7u      %7u\n"
+		     "lost:           %7d      %7d\n"
+		     "jitter:         %7.1f      %7.1f  (ms)\n",
+		     s->rtcp_stats.tx.sent, s->rtcp_stats.rx.sent,
+		     s->rtcp_stats.tx.lost, s->rtcp_stats.rx.lost,
+		     1.0*s->rtcp_stats.tx.jit/1000,
+		     1.0*s->rtcp_stats.rx.jit/1000);
+	}
+}
+
+
+static void stream_destructor(void *arg)
+{
+	struct stream *s = arg;
+
+	memtag_free(memtag_core(MEMTAG_STREAM), sizeof(*s));
+
+	(void)stream_relay(s, NULL);
+	(void)stream_relay(s->relay_src, NULL);
+
+	if (s->cfg.rtp_stats)
+		print_rtp_stats(s);
+
+	metric_reset(&s->metric_tx);
+	metric_reset(&s->metric_rx);
+
+	hktmr_cancel(&s->tmr_rtp);
+	hktmr_cancel(&s->tmr_xr);
+	tmr_cancel(&s->fb.tmr);
+	mem_deref(s->fb.mb);
+
+	if (s->base)
+		--s->base->n_bundle;
+	else if (s->n_bundle)
+		bundle_detach(s);
+
+	list_unlink(&s->le);
+	mem_deref(s->rtpkeep);
+	mem_deref(s->sdp);
+	mem_deref(s->mes);
+	mem_deref(s->mencs);
+	mem_deref(s->mns);
+	mem_deref(s->jbuf);
+	mem_deref(s->vbuf);
+	mem_deref(s->reord);
+	mem_deref(s->batch);
+	mem_deref(s->rtx);
+	mem_deref(s->fec);
+	mem_deref(s->ext);
+	mem_deref(s->xr);
+	while (s->n_sim)
+		mem_deref(s->simv[--s->n_sim]);
+	mem_deref(s->rtp);
+	rtpport_release(s->rtp_port);
+	mem_deref(s->cname);
+}
+
+
+/* Payload type to send a relayed packet with, or -1 */
+static int relay_pt(struct stream *s, uint8_t pt)
+{
+	const struct sdp_format *lf, *rf = NULL;
+
+	if (pt == s->relay_pt_in)
+		return s->relay_pt_out;
+
+	/* the peer sends with the payload types that we offered */
+	lf = sdp_media_lformat(s->sdp, pt);
+	if (lf) {
+		rf = sdp_media_format(s->relay->sdp, false, NULL, -1,
+				      lf->name, lf->srate, lf->ch);
+	}
+
+	s->relay_pt_in  = pt;
+	s->relay_pt_out = rf ? rf->pt : -1;
+
+	return s->relay_pt_out;
+}
+
+
+/* A relayed packet that waits for the delay */
+struct relay_pkt {
+	struct le le;
+	struct mbuf *mb;
+	uint64_t due;
+	uint32_t ts;
+	int pt;
+	bool marker;
+};
+
+
+static void relay_pkt_destructor(void *arg)
+{
+	struct relay_pkt *pkt = arg;
+
+	if (pkt->mb) {
+		memtag_free(memtag_core(MEMTAG_STREAM),
+			    sizeof(*pkt) + pkt->mb->size);
+	}
+
+	list_unlink(&pkt->le);
+	mem_deref(pkt->mb);
+}
+
+
+static void relay_tmr_handler(void *arg)
+{
+	struct stream *s = arg;
+	const uint64_t now = tmr_jiffies();
+	struct relay_pkt *pkt;
+
+	while ((pkt = list_ledata(list_head(&s->relay_q)))) {
+
+		if (pkt->due > now) {
+			tmr_start(&s->relay_tmr, pkt->due - now,
+				  relay_tmr_handler, s);
+			return;
+		}
+
+		if (s->relay &&
+		    !send_rtp(s->relay, pkt->marker, pkt->pt, pkt->ts,
+			      pkt->mb))
+			++s->n_relay;
+
+		mem_deref(pkt);
+	}
+}
+
+
+/* The packet is copied with headroom for the RTP header */
+static void relay_delay(struct stream *s, bool marker, int pt, uint32_t ts,
+			const struct mbuf *mb)
+{
+	const size_t len = mbuf_get_left(mb);
+	struct relay_pkt *pkt;
+
+	if (list_count(&s->relay_q) >= RELAY_QMAX)
+		return;
+
+	pkt = mem_zalloc(sizeof(*pkt), relay_pkt_destructor);
+	if (!pkt)
+		return;
+
+	pkt->mb = mbuf_alloc(RTP_HEADER_SIZE + len);
+	if (!pkt->mb) {
+		mem_deref(pkt);
+		return;
+	}
+
+	memtag_alloc(memtag_core(MEMTAG_STREAM), sizeof(*pkt) + pkt->mb->size);
+
+	pkt->mb->pos = RTP_HEADER_SIZE;
+	(void)mbuf_write_mem(pkt->mb, mbuf_buf(mb), len);
+	pkt->mb->pos = RTP_HEADER_SIZE;
+
+	pkt->due    = tmr_jiffies() + s->relay_delay;
+	pkt->ts     = ts;
+	pkt->pt     = pt;
+	pkt->marker = marker;
+
+	list_append(&s->relay_q, &pkt->le, pkt);
+
+	if (!tmr_isrunning(&s->relay_tmr))
+		tmr_start(&s->relay_tmr, s->relay_delay,
+			  relay_tmr_handler, s);
+}
+
+
+static void relay_send(struct stream *s, const struct rtp_header *hdr,
+		       struct mbuf *mb)
+{
+	struct stream *dst = s->relay;
+	bool marker = hdr->m;
+	int pt;
+
+	pt = relay_pt(s, hdr->pt);
+	if (pt < 0)
+		return;
+
+	/* continue from the last timestamp sent on the other stream, the
+	 * marker bit tells the receiver to resynchronise */
+	if (s->relay_sync) {
+		s->relay_ts_off = dst->ts_tx - hdr->ts;
+		s->relay_sync = false;
+		marker = true;
+	}
+
+	if (s->relay_delay) {
+		relay_delay(s, marker, pt, hdr->ts + s->relay_ts_off, mb);
+		return;
+	}
+
+	if (!send_rtp(dst, marker, pt, hdr->ts + s->relay_ts_off, mb))
+		++s->n_relay;
+}
+
+
+/* Dropped packets come in bursts, do not log every one of them */
+static void drop_info(struct stream *s, const struct sa *src,
+		      const struct mbuf *mb, int err)
+{
+	uint32_t nsupp = 0;
+
+	if (!log_ratelimit(&s->rl_drop, &nsupp))
+		return;
+
+	if (nsupp) {
+		info("%s: dropping %u bytes from %J (%m)"
+		     " (%u more suppressed)\n",
+		     sdp_media_name(s->sdp), mb->end, src, err, nsupp);
+	}
+	else {
+		info("%s: dropping %u bytes from %J (%m)\n",
+		     sdp_media_name(s->sdp), mb->end, src, err);
+	}
+}
+
+
+/*
+ * The depth is the number of frames in the jitter buffer. It follows the
+ * result of each put and get of the stream, and the buffer is only
+ * flushed through the stream.
+ */
+static int jba_put(struct stream *s, const struct rtp_header *hdr,
+		   struct mbuf *mb)
+{
+	int err;
+
+	err = jbuf_put(s->jbuf, hdr, mb);
+	switch (err) {
+
+	case 0:
+		/* when the buffer is full, the oldest frame is dropped */
+		if (s->jba.depth < s->cfg.jbuf_del.max)
+			++s->jba.depth;
+		else
+			++s->jba.n_drop;
+		break;
+
+	case ETIMEDOUT:
+		++s->jba.n_late;
+		break;
+
+	case EALREADY:
+		++s->jba.n_dup;
+		break;
+
+	default:
+		break;
+	}
+
+	return err;
+}
+
+
+static int jba_get(struct stream *s, struct rtp_header *hdr, void **mem)
+{
+	int err;
+
+	err = jbuf_get(s->jbuf, hdr, mem);
+	if (!err && s->jba.depth)
+		--s->jba.depth;
+
+	return err;
+}
+
+
+static void jbuf_recv(struct stream *s, const struct sa *src,
+		      const struct rtp_header *hdr, struct mbuf *mb,
+		      uint64_t arrival, bool flush)
+{
+	struct rtp_header hdr2;
+	void *mb2 = NULL;
+	int err;
+
+	/* Put frame in Jitter Buffer */
+	if (flush) {
+		jbuf_flush(s->jbuf);
+		jba_reset(&s->jba, s->cfg.jbuf_del.min);
+	}
+
+	err = jba_put(s, hdr, mb);
+	if (err) {
+		drop_info(s, src, mb, err);
+		metric_add_error(&s->metric_rx);
+	}
+
+	if (s->cfg.jbuf_mode == JBUF_MODE_ADAPTIVE && s->jbuf_started) {
+
+		jba_update(s, hdr, arrival);
+
+		if (s->jba.depth + 1 < s->jba.target) {
+
+			/* grow: let the buffer fill up */
+			++s->jba.n_grow;
+			return;
+		}
+		else if (s->jba.depth > s->jba.target + 1) {
+
+			/* shrink: drop the oldest frame, or hand it to the
+			 * receiver which time-compresses it */
+			if (0 == jba_get(s, &hdr2, &mb2)) {
+				(void)lostcalc(s, hdr2.seq);
+				if (s->jba.smooth)
+					s->rtph(&hdr2, mb2, s->arg);
+				else
+					++s->jba.n_drop;
+
+				mb2 = mem_deref(mb2);
+			}
+		}
+	}
+
+	if (jba_get(s, &hdr2, &mb2)) {
+
+		if (!s->jbuf_started)
+			return;
+
+		memset(&hdr2, 0, sizeof(hdr2));
+	}
+
+	s->jbuf_started = true;
+
+	if (lostcalc(s, hdr2.seq) > 0)
+		s->rtph(hdr, NULL, s->arg);
+
+	s->rtph(&hdr2, mb2, s->arg);
+
+	mem_deref(mb2);
+}
+
+
+static void rtp_recv(const struct sa *src, const struct rtp_header *hdr,
+		     struct mbuf *mb, void *arg)
+{
+	struct stream *s = bundle_demux(arg, hdr);
+	uint64_t arrival, delay;
+	bool flush = false;
+	int err;
+
+	PROBE4(rtp_recv, s, hdr->ssrc, hdr->seq, mbuf_get_left(mb));
+
+	s->ts_last = tmr_jiffies();
+
+	/* arrival time [us], from the kernel if possible */
+	arrival = s->ts_last * 1000;
+
+	if (s->rxts && !rxts_delay(rtp_sock(stream_transport(s)),
+				   sa_af(src), &delay)) {
+		arrival -= delay;
+		metric_add_delay(&s->metric_rx, delay);
+	}
+
+	if (!mbuf_get_left(mb))
+		return;
+
+	if (!(sdp_media_ldir(s->sdp) & SDP_RECVONLY))
+		return;
+
+	metric_add_packet_at(&s->metric_rx, mbuf_get_left(mb),
+			     arrival / 1000);
+
+	/* FEC packets have their own SSRC */
+	if (s->fec && hdr->pt == fec_pt_rx(s->fec)) {
+		fec_recv(s->fec, s->ssrc_rx, mb);
+		return;
+	}
+
+	if (hdr->ssrc != s->ssrc_rx) {
+		if (s->ssrc_rx) {
+			flush = true;
+			info("stream: %s: SSRC changed %x -> %x"
+			     " (%u bytes from %J)\n",
+			     sdp_media_name(s->sdp), s->ssrc_rx, hdr->ssrc,
+			     mbuf_get_left(mb), src);
+		}
+		s->ssrc_rx = hdr->ssrc;
+		s->nack_valid = false;
+		s->relay_sync = true;
+	}
+
+	if (s->nack)
+		nack_check(s, hdr->seq);
+
+	fec_recv_media(s->fec, hdr, mb);
+
+	if (s->relay) {
+		(void)lostcalc(s, hdr->seq);
+		relay_send(s, hdr, mb);
+		return;
+	}
+
+	if (s->vbuf) {
+
+		if (flush)
+			vidbuf_flush(s->vbuf);
+
+		err = vidbuf_put(s->vbuf, hdr, mb);
+		if (err) {
+			drop_info(s, src, mb, err);
+			metric_add_error(&s->metric_rx);
+		}
+	}
+	else if (s->jbuf) {
+		jbuf_recv(s, src, hdr, mb, arrival, flush);
+	}
+	else if (s->reord) {
+
+		if (flush)
+			reorder_flush(s->reord);
+
+		reorder_put(s->reord, hdr, mb);
+	}
+	else {
+		if (lostcalc(s, hdr->seq) > 0)
+			s->rtph(hdr, NULL, s->arg);
+
+		s->rtph(hdr, mb, s->arg);
+	}
+}
+
+
+/* Packets of the frames given out by the video frame buffer */
+static void vidbuf_handler(const struct rtp_header *hdr, struct mbuf *mb,
+			   void *arg)
+{
+	struct stream *s = arg;
+
+	if (mb)
+		(void)lostcalc(s, hdr->seq);
+
+	s->rtph(hdr, mb, s->arg);
+}
+
+
+/* Packets in sequence order from the reorder window */
+static void reorder_handler(const struct rtp_header *hdr, struct mbuf *mb,
+			    void *arg)
+{
+	struct stream *s = arg;
+
+	if (lostcalc(s, hdr->seq) > 0)
+		s->rtph(hdr, NULL, s->arg);
+
+	s->rtph(hdr, mb, s->arg);
+}
+
+
+static void fec_recover_handler(const struct rtp_header *hdr,
+				struct mbuf *mb, void *arg)
+{
+	struct stream *s = arg;
+
+	rtp_recv(sdp_media_raddr(s->sdp), hdr, mb, s);
+}
+
+
+/* Report blocks about our outgoing stream */
+static void rr_handler(struct stream *s, const struct rtcp_rr *rrv,
+		       uint32_t rrc)
+{
+	uint32_t ssrc = rtp_sess_ssrc(s->rtp);
+	bool changed = false;
+	uint32_t i;
+
+	if (!rrv)
+		return;
+
+	for (i=0; i<rrc; i++) {
+
+		if (rrv[i].ssrc != ssrc)
+			continue;
+
+		fec_set_loss(s->fec, rrv[i].fraction);
+
+		if (s->lossh)
+			s->lossh(rrv[i].fraction, s->lossh_arg);
+
+		if (s->bwh)
+			changed |= bwctrl_rr_handler(&s->bwc, &rrv[i]);
+	}
+
+	if (changed)
+		s->bwh(s->bwc.rate, s->bwh_arg);
+}
+
+
+static void rtcp_recv(struct stream *s, struct rtcp_msg *msg)
+{
+	if (s->rtcph)
+		s->rtcph(msg, s->arg);
+
+	switch (msg->hdr.pt) {
+
+	case RTCP_SR:
+		(void)rtcp_stats(stream_transport(s), msg->r.sr.ssrc,
+				 &s->rtcp_stats);
+
+		if (s->jbuf) {
+			mos_est_update(&s->mos,
+				       metric_n_packets(&s->metric_rx),
+				       s->rtcp_stats.rtt,
+				       s->rtcp_stats.rx.jit,
+				       jba_delay_ms(&s->jba));
+		}
+
+		avsync_sr(s->avsync, s->avsync_media,
+			  msg->r.sr.ntp_sec, msg->r.sr.ntp_frac,
+			  msg->r.sr.rtp_ts, s->srate_rx);
+
+		if (s->cfg.rtp_stats)
+			call_set_xrtpstat(s->call);
+
+		rr_handler(s, msg->r.sr.rrv, msg->hdr.count);
+		break;
+
+	case RTCP_RR:
+		rr_handler(s, msg->r.rr.rrv, msg->hdr.count);
+		break;
+
+	case RTCP_PSFB:
+		if (msg->hdr.count == RTCP_PSFB_AFB && s->bwh &&
+		    bwctrl_remb_handler(&s->bwc, msg->r.fb.fci.afb))
+			s->bwh(s->bwc.rate, s->bwh_arg);
+
+		/* a picture request is for the sender of the relayed RTP */
+		if (msg->hdr.count == RTCP_PSFB_PLI && s->relay_src)
+			stream_send_fir(s->relay_src, true);
+		break;
+
+	case RTCP_FIR:
+		if (s->relay_src)
+			stream_send_fir(s->relay_src, false);
+		break;
+	}
+}
+
+
+/* True if one of our outgoing layers is sent with this SSRC */
+static bool has_ssrc(const struct stream *s, uint32_t ssrc)
+{
+	unsigned i;
+
+	if (ssrc == rtp_sess_ssrc(s->rtp))
+		return true;
+
+	for (i=0; i<s->n_sim; i++) {
+		if (ssrc == rtp_sess_ssrc(s->simv[i]))
+			return true;
+	}
+
+	return false;
+}
+
+
+static void xr_recv(struct stream *s, const struct rtcpxr_voip *v)
+{
+	s->xr_rx = *v;
+	++s->n_xr_rx;
+
+	mod_dbg(stream_log, "stream: %s: RTCP XR %H\n",
+		sdp_media_name(s->sdp), rtcpxr_voip_debug, v);
+}
+
+
+/* RTCP XR VoIP Metrics from the peer, about one of our streams */
+static void xr_handler(const struct rtcpxr_voip *v, void *arg)
+{
+	struct stream *base = arg;
+	struct le *le;
+
+	if (!base->n_bundle) {
+		xr_recv(base, v);
+		return;
+	}
+
+	for (le = list_head(call_streaml(base->call)); le; le = le->next) {
+
+		struct stream *s = le->data;
+
+		if (s != base && s->base != base)
+			continue;
+
+		if (has_ssrc(s, v->ssrc))
+			xr_recv(s, v);
+	}
+}
+
+
+static void xr_send_handler(void *arg)
+{
+	struct stream *s = arg;
+	struct stream_stats st;
+	uint16_t jb_max = s->xr_tx.jb_max;
+	struct mbuf *mb;
+	int err;
+
+	if (stream_stats(s, &st) || !st.rx.packets)
+		return;
+
+	rtcpxr_voip_calc(&s->xr_tx, s->ssrc_rx, &st,
+			 s->cfg.jbuf_mode == JBUF_MODE_ADAPTIVE);
+
+	s->xr_tx.jb_max     = max(jb_max, s->xr_tx.jb_nominal);
+	s->xr_tx.jb_abs_max = (uint16_t)min(65535, max(s->xr_tx.jb_max,
+				s->cfg.jbuf_del.max * s->jba.frame_us / 1000));
+
+	mb = mbuf_alloc(64);
+	if (!mb)
+		return;
+
+	err = rtcpxr_encode(mb, rtp_sess_ssrc(s->rtp), &s->xr_tx);
+	if (!err)
+		err = rtcp_send_raw(s, mb);
+	if (err) {
+		debug("stream: %s: sending RTCP XR failed (%m)\n",
+		      sdp_media_name(s->sdp), err);
+	}
+
+	mem_deref(mb);
+}
+
+
+/* RFC 3611, VoIP Metrics are sent for audio if the peer wants them */
+static bool xr_wanted(const struct stream *s)
+{
+	const char *val;
+
+	if (!s->rtcp || !s->cfg.rtcp_xr ||
+	    str_casecmp(sdp_media_name(s->sdp), "audio"))
+		return false;
+
+	val = sdp_media_rattr(s->sdp, "rtcp-xr");
+
+	return val && strstr(val, "voip-metrics");
+}
+
+
+static void rtcp_handler(const struct sa *src, struct rtcp_msg *msg, void *arg)
+{
+	struct stream *base = arg;
+	struct le *le;
+	(void)src;
+
+	if (!base->n_bundle) {
+		rtcp_recv(base, msg);
+		return;
+	}
+
+	/* shared socket: pass each message to the streams it is about */
+	for (le = list_head(call_streaml(base->call)); le; le = le->next) {
+
+		struct stream *s = le->data;
+
+		if (s != base && s->base != base)
+			continue;
+
+		switch (msg->hdr.pt) {
+
+		case RTCP_SR:
+			if (msg->r.sr.ssrc != s->ssrc_rx) {
+				rr_handler(s, msg->r.sr.rrv, msg->hdr.count);
+				continue;
+			}
+			break;
+
+		case RTCP_RTPFB:
+		case RTCP_PSFB:
+			if (msg->r.fb.ssrc_media &&
+			    !has_ssrc(s, msg->r.fb.ssrc_media))
+				continue;
+			break;
+		}
+
+		rtcp_recv(s, msg);
+	}
+}
+
+
+static int stream_sock_alloc(struct stream *s, int af)
+{
+	struct sa laddr;
+	unsigned i;
+	int tos, err = 0;
+
+	if (!s)
+		return EINVAL;
+
+	/* we listen on all interfaces */
+	sa_init(&laddr, af);
+
+	for (i=0; i<PORT_TRIES; i++) {
+
+		uint16_t port;
+
+		err = rtpport_alloc(&port, &s->cfg.rtp_ports);
+		if (err)
+			break;
+
+		err = rtp_listen(&s->rtp, IPPROTO_UDP, &laddr, port, port + 1,
+				 s->rtcp, rtp_recv, rtcp_handler, s);
+		if (!err) {
+			s->rtp_port = port;
+			break;
+		}
+
+		rtpport_failed();
+		rtpport_release(port);
+	}
+
+	/* a range the pool cannot hold is left to rtp_listen() */
+	if (err == EINVAL) {
+		err = rtp_listen(&s->rtp, IPPROTO_UDP, &laddr,
+				 s->cfg.rtp_ports.min, s->cfg.rtp_ports.max,
+				 s->rtcp, rtp_recv, rtcp_handler, s);
+	}
+	if (err) {
+		warning("stream: rtp_listen failed: af=%s ports=%u-%u"
+			" (%m)\n", net_af2name(af),
+			s->cfg.rtp_ports.min, s->cfg.rtp_ports.max, err);
+		return err;
+	}
+
+	tos = s->cfg.rtp_tos;
+	(void)udp_setsockopt(rtp_sock(s->rtp), IPPROTO_IP, IP_TOS,
+			     &tos, sizeof(tos));
+	(void)udp_setsockopt(rtcp_sock(s->rtp), IPPROTO_IP, IP_TOS,
+			     &tos, sizeof(tos));
+
+	udp_rxsz_set(rtp_sock(s->rtp), RTP_RECV_SIZE);
+
+	if (s->cfg.rtp_rxts) {
+		err = rxts_enable(rtp_sock(s->rtp));
+		if (err) {
+			warning("stream: kernel timestamps not available"
+				" (%m)\n", err);
+		}
+		s->rxts = !err;
+	}
+
+	return 0;
+}
+
+
+int stream_alloc(struct stream **sp, const struct config_avt *cfg,
+		 struct call *call, struct sdp_session *sdp_sess,
+		 const char *name, int label,
+		 const struct mnat *mnat, struct mnat_sess *mnat_sess,
+		 const struct menc *menc, struct menc_sess *menc_sess,
+		 const char *cname,
+		 stream_rtp_h *rtph, stream_rtcp_h *rtcph, void *arg)
+{
+	struct stream *s, *base = NULL;
+	int err;
+
+	if (!sp || !cfg || !call || !rtph)
+		return EINVAL;
+
+	/* media NAT and encryption need a socket per stream */
+	if (cfg->rtp_bundle && !mnat && !menc && call_streaml(call)->head)
+		base = list_ledata(call_streaml(call)->head);
+
+	/* once, the core has no init hook per file */
+	log_mod_register(&stream_log);
+
+	s = mem_zalloc(sizeof(*s), stream_destructor);
+	if (!s)
+		return ENOMEM;
+
+	memtag_alloc(memtag_core(MEMTAG_STREAM), sizeof(*s));
+
+	s->cfg   = *cfg;
+	s->call  = call;
+	s->rtph  = rtph;
+	s->rtcph = rtcph;
+	s->arg   = arg;
+	s->pseq  = -1;
+	s->rtcp  = s->cfg.rtcp_enable;
+
+	if (base) {
+		err = rtp_alloc(&s->rtp);
+		if (!err) {
+			s->base = base;
+			s->rxts = base->rxts;
+			++base->n_bundle;
+		}
+	}
+	else {
+		err = stream_sock_alloc(s, call_af(call));
+	}
+	if (err) {
+		warning("stream: failed to create socket for media '%s'"
+			" (%m)\n", name, err);
+		goto out;
+	}
+
+	err = str_dup(&s->cname, cname);
+	if (err)
+		goto out;
+
+	/* the transport-wide sequence is shared by a bundle */
+	err = rtpext_alloc(&s->ext, rtp_sock(stream_transport(s)),
+			   rtp_sess_ssrc(s->rtp),
+			   s->base ? &s->base->twcc_seq : &s->twcc_seq,
+			   0 == str_casecmp(name, "audio"));
+	if (err)
+		goto out;
+
+	/* RTCP XR is received by the owner of the socket */
+	if (s->rtcp && !s->base) {
+		err = rtcpxr_alloc(&s->xr, s->rtp, xr_handler, s);
+		if (err)
+			goto out;
+	}
+
+	/* Jitter buffer, video is buffered in whole frames */
+	if (cfg->jbuf_video && 0 == str_casecmp(name, "video")) {
+
+		err = vidbuf_alloc(&s->vbuf, cfg->jbuf_video,
+				   vidbuf_handler, s);
+		if (err)
+			goto out;
+	}
+	else if (cfg->jbuf_del.min && cfg->jbuf_del.max) {
+
+		err = jbuf_alloc(&s->jbuf, cfg->jbuf_del.min,
+				 cfg->jbuf_del.max);
+		if (err)
+			goto out;
+
+		jba_reset(&s->jba, cfg->jbuf_del.min);
+	}
+	else if (0 == str_casecmp(name, "video")) {
+
+		/* no jitter buffer, only the order is restored */
+		err = reorder_alloc(&s->reord, reorder_handler, s);
+		if (err)
+			goto out;
+	}
+
+	err = sdp_media_add(&s->sdp, sdp_sess, name,
+			    sa_port(rtp_local(stream_transport(s))),
+			    (menc && menc->sdp_proto) ? menc->sdp_proto :
+			    sdp_proto_rtpavp);
+	if (err)
+		goto out;
+
+	if (label) {
+		err |= sdp_media_set_lattr(s->sdp, true,
+					   "label", "%d", label);
+	}
+
+	/* RFC 5506 */
+	if (s->rtcp)
+		err |= sdp_media_set_lattr(s->sdp, true, "rtcp-rsize", NULL);
+
+	/* RFC 5576 */
+	if (s->rtcp) {
+		err |= sdp_media_set_lattr(s->sdp, true,
+					   "ssrc", "%u cname:%s",
+					   rtp_sess_ssrc(s->rtp), cname);
+	}
+
+	/* RFC 5761 */
+	if (cfg->rtcp_mux)
+		err |= sdp_media_set_lattr(s->sdp, true, "rtcp-mux", NULL);
+
+	/* RFC 3611 */
+	if (s->rtcp && cfg->rtcp_xr && 0 == str_casecmp(name, "audio")) {
+		err |= sdp_media_set_lattr(s->sdp, true,
+					   "rtcp-xr", "voip-metrics");
+	}
+
+	/* RFC 8843 */
+	if (cfg->rtp_bundle)
+		err |= sdp_media_set_lattr(s->sdp, true, "mid", "%s", name);
+
+	/* RFC 8285 */
+	err |= rtpext_sdp_offer(s->ext, s->sdp);
+
+	if (err)
+		goto out;
+
+	if (mnat) {
+		err = mnat->mediah(&s->mns, mnat_sess, IPPROTO_UDP,
+				   rtp_sock(s->rtp),
+				   s->rtcp ? rtcp_sock(s->rtp) : NULL,
+				   s->sdp);
+		if (err)
+			goto out;
+	}
+
+	if (menc) {
+		s->menc  = menc;
+		s->mencs = mem_ref(menc_sess);
+		err = menc->mediah(&s->mes, menc_sess,
+				   s->rtp,
+				   IPPROTO_UDP,
+				   rtp_sock(s->rtp),
+				   s->rtcp ? rtcp_sock(s->rtp) : NULL,
+				   s->sdp);
+		if (err)
+			goto out;
+	}
+
+	if (err)
+		goto out;
+
+	s->pt_enc = -1;
+	s->relay_pt_in = -1;
+
+	metric_init(&s->metric_tx);
+	metric_init(&s->metric_rx);
+
+	list_append(call_streaml(call), &s->le, s);
+
+	if (s->base) {
+		err = sdp_session_set_lattr(sdp_sess, true, "group",
+					    "BUNDLE%H", bundle_print_mids,
+					    s->base);
+	}
+
+ out:
+	if (err)
+		mem_deref(s);
+	else
+		*sp = s;
+
+	return err;
+}
+
+
+struct sdp_media *stream_sdpmedia(const struct stream *s)
+{
+	return s ? s->sdp : NULL;
+}
+
+
+static void stream_start_keepalive(struct stream *s)
+{
+	const char *rtpkeep;
+
+	/* the owner of a shared socket keeps the binding open */
+	if (!s || s->base)
+		return;
+
+	rtpkeep = call_account(s->call)->rtpkeep;
+
+	s->rtpkeep = mem_deref(s->rtpkeep);
+
+	if (rtpkeep && sdp_media_rformat(s->sdp, NULL)) {
+		int err;
+		err = rtpkeep_alloc(&s->rtpkeep, rtpkeep,
+				    IPPROTO_UDP, s->rtp, s->sdp);
+		if (err) {
+			warning("stream: rtpkeep_alloc failed: %m\n", err);
+		}
+	}
+}
+
+
+static int send_rtp(struct stream *s, bool marker, int pt, uint32_t ts,
+		    struct mbuf *mb)
+{
+	int err = 0;
+
+	if (!sa_isset(sdp_media_raddr(s->sdp), SA_ALL))
+		return 0;
+	if (sdp_media_dir(s->sdp) != SDP_SENDRECV)
+		return 0;
+
+	metric_add_packet(&s->metric_tx, mbuf_get_left(mb));
+
+	if (pt < 0)
+		pt = s->pt_enc;
+
+	if (pt >= 0) {
+		if (s->base)
+			err = bundle_send(s, marker, pt, ts, mb);
+		else
+			err = rtp_send(s->rtp, sdp_media_raddr(s->sdp),
+				       marker, pt, ts, mb);
+		if (err)
+			metric_add_error(&s->metric_tx);
+
+		if (s->fec && fec_send(s->fec, sdp_media_raddr(s->sdp)))
+			metric_add_error(&s->metric_tx);
+	}
+
+	s->ts_tx = ts;
+	rtpkeep_refresh(s->rtpkeep, ts);
+
+	return err;
+}
+
+
+int stream_send(struct stream *s, bool marker, int pt, uint32_t ts,
+		struct mbuf *mb)
+{
+	if (!s)
+		return EINVAL;
+
+	PROBE4(stream_send, s, pt, ts, mbuf_get_left(mb));
+
+	/* the packets of the other stream are sent instead */
+	if (s->relay_src)
+		return 0;
+
+	return send_rtp(s, marker, pt, ts, mb);
+}
+
+
+static void stream_remote_set(struct stream *s)
+{
+	struct sa rtcp;
+
+	if (!s)
+		return;
+
+	/* RFC 5761 */
+	if (s->cfg.rtcp_mux && sdp_media_rattr(s->sdp, "rtcp-mux")) {
+
+		if (!s->rtcp_mux)
+			info("%s: RTP/RTCP multiplexing enabled\n",
+			     sdp_media_name(s->sdp));
+		s->rtcp_mux = true;
+	}
+
+	/* RTCP reports are sent by the owner of the shared socket */
+	if (s->base)
+		return;
+
+	rtcp_enable_mux(s->rtp, s->rtcp_mux);
+
+	sdp_media_raddr_rtcp(s->sdp, &rtcp);
+
+	rtcp_start(s->rtp, s->cname,
+		   s->rtcp_mux ? sdp_media_raddr(s->sdp): &rtcp);
+}
+
+
+void stream_update(struct stream *s)
+{
+	const struct sdp_format *fmt;
+	int err = 0;
+
+	if (!s)
+		return;
+
+	fmt = sdp_media_rformat(s->sdp, NULL);
+
+	s->pt_enc = fmt ? fmt->pt : -1;
+
+	/* RFC 5576, used to demultiplex a shared socket */
+	s->ssrc_sig = 0;
+	(void)sdp_media_rattr_apply(s->sdp, "ssrc", ssrc_handler,
+				    &s->ssrc_sig);
+
+	if (sdp_media_has_media(s->sdp))
+		stream_remote_set(s);
+
+	rtpext_sdp_decode(s->ext, s->sdp);
+
+	mos_est_set_codec(&s->mos, fmt ? fmt->name : NULL);
+
+	if (!xr_wanted(s))
+		hktmr_cancel(&s->tmr_xr);
+	else if (!hktmr_isrunning(&s->tmr_xr))
+		(void)hktmr_start(&s->tmr_xr, XR_INTERVAL, xr_send_handler, s);
+
+	/* RFC 8853, the lower layers are only sent if the peer wants them */
+	s->sim_active = s->n_sim && sdp_media_rattr(s->sdp, "simulcast");
+
+	/* FEC is only used if both sides have it */
+	if (s->fec) {
+		fmt = sdp_media_rformat(s->sdp, "ulpfec");
+		if (fmt)
+			fec_set_pt(s->fec, fmt->pt, s->fec_pt);
+		else
+			fec_set_pt(s->fec, -1, -1);
+	}
+
+	if (s->menc && s->menc->mediah) {
+		err = s->menc->mediah(&s->mes, s->mencs, s->rtp,
+				      IPPROTO_UDP,
+				      rtp_sock(s->rtp),
+				      s->rtcp ? rtcp_sock(s->rtp) : NULL,
+				      s->sdp);
+		if (err) {
+			warning("stream: mediaenc update: %m\n", err);
+		}
+	}
+}
+
+
+void stream_update_encoder(struct stream *s, int pt_enc)
+{
+	if (!s)
+		return;
+
+	if (pt_enc >= 0)
+		s->pt_enc = pt_enc;
+}
+
+
+int stream_jbuf_stat(struct re_printf *pf, const struct stream *s)
+{
+	struct vidbuf_stat vstat;
+	struct jbuf_stat stat;
+	int err;
+
+	if (!s)
+		return EINVAL;
+
+	err  = re_hprintf(pf, " %s:", sdp_media_name(s->sdp));
+
+	if (s->vbuf) {
+		(void)vidbuf_stats(s->vbuf, &vstat);
+
+		return re_hprintf(pf, "Frame buffer stat: put=%u frames=%u"
+				  " incomplete=%u late=%u or=%u delay=%ums",
+				  vstat.n_put, vstat.n_get,
+				  vstat.n_incomplete, vstat.n_late,
+				  vstat.n_overflow, vstat.delay);
+	}
+
+	err |= jbuf_stats(s->jbuf, &stat);
+	if (err) {
+		err = re_hprintf(pf, "Jbuf stat: (not available)");
+	}
+	else {
+		err = re_hprintf(pf, "Jbuf stat: put=%u get=%u or=%u ur=%u",
+				  stat.n_put, stat.n_get,
+				  stat.n_overflow, stat.n_underflow);
+	}
+
+	if (s->jbuf) {
+		err |= re_hprintf(pf, " delay=%ums", jba_delay_ms(&s->jba));
+
+		if (s->cfg.jbuf_mode == JBUF_MODE_ADAPTIVE) {
+			err |= re_hprintf(pf, " target=%u jitter=%.1fms",
+					  s->jba.target,
+					  s->jba.jitter / 1000.0);
+		}
+
+		err |= re_hprintf(pf, " late=%u dup=%u dropped=%u",
+				  s->jba.n_late, s->jba.n_dup,
+				  s->jba.n_drop);
+	}
+
+	return err;
+}
+
+
+void stream_hold(struct stream *s, bool hold)
+{
+	if (!s)
+		return;
+
+	sdp_media_set_ldir(s->sdp, hold ? SDP_SENDONLY : SDP_SENDRECV);
+}
+
+
+void stream_set_srate(struct stream *s, uint32_t srate_tx, uint32_t srate_rx)
+{
 	if (!s)
 		return;
 
-	rtpkeep = call_account(s->call)->rtpkeep;
+	rtcp_set_srate(s->rtp, srate_tx, srate_rx);
 
-	s->rtpkeep = mem_deref(s->rtpkeep);
+	s->srate_rx = srate_rx;
+}
 
-	if (rtpkeep && sdp_media_rformat(s->sdp, NULL)) {
-		int err;
-		err = rtpkeep_alloc(&s->rtpkeep, rtpkeep,
-				    IPPROTO_UDP, s->rtp, s->sdp);
+
+void stream_send_fir(struct stream *s, bool pli)
+{
+	int err;
+
+	if (!s)
+		return;
+
+	err = send_fir(s, pli);
+	if (err) {
+		metric_add_error(&s->metric_tx);
+
+		warning("stream: failed to send RTCP %s: %m\n",
+			pli ? "PLI" : "FIR", err);
+	}
+}
+
+
+void stream_reset(struct stream *s)
+{
+	if (!s)
+		return;
+
+	jbuf_flush(s->jbuf);
+	jba_reset(&s->jba, s->cfg.jbuf_del.min);
+	vidbuf_flush(s->vbuf);
+	reorder_flush(s->reord);
+
+	stream_start_keepalive(s);
+}
+
+
+void stream_set_bw(struct stream *s, uint32_t bps)
+{
+	if (!s)
+		return;
+
+	sdp_media_set_lbandwidth(s->sdp, SDP_BANDWIDTH_AS, bps / 1000);
+}
+
+
+void stream_enable_rtp_timeout(struct stream *strm, uint32_t timeout_ms)
+{
+	if (!strm)
+		return;
+
+	strm->rtp_timeout_ms = timeout_ms;
+
+	hktmr_cancel(&strm->tmr_rtp);
+
+	if (timeout_ms) {
+
+		info("stream: Enable RTP timeout (%u milliseconds)\n",
+		     timeout_ms);
+
+		strm->ts_last = tmr_jiffies();
+		(void)hktmr_start(&strm->tmr_rtp, RTP_CHECK_INTERVAL,
+				  check_rtp_handler, strm);
+	}
+}
+
+
+/**
+ * Let the receiver absorb jitter buffer delay changes by time-scaling,
+ * instead of dropping frames when the adaptive buffer shrinks
+ *
+ * @param s      Stream object
+ * @param enable True to enable, false to disable
+ */
+void stream_jbuf_smooth(struct stream *s, bool enable)
+{
+	if (!s)
+		return;
+
+	s->jba.smooth = enable;
+}
+
+
+/**
+ * Set the range of the jitter buffer, before any packets are received
+ *
+ * @param s   Stream object
+ * @param min Minimum number of frames
+ * @param max Maximum number of frames
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int stream_jbuf_reset(struct stream *s, uint32_t min, uint32_t max)
+{
+	struct jbuf *jb;
+	int err;
+
+	if (!s)
+		return EINVAL;
+
+	if (!s->jbuf)
+		return 0;
+
+	max = max(max, min);
+
+	err = jbuf_alloc(&jb, min, max);
+	if (err)
+		return err;
+
+	mem_deref(s->jbuf);
+	s->jbuf = jb;
+
+	s->cfg.jbuf_del.min = min;
+	s->cfg.jbuf_del.max = max;
+	jba_reset(&s->jba, min);
+
+	return 0;
+}
+
+
+/**
+ * Add a delay to the adaptive jitter buffer, used for lip-sync
+ *
+ * @param s     Stream object
+ * @param delay Added delay [ms]
+ */
+void stream_jbuf_delay(struct stream *s, uint32_t delay)
+{
+	if (!s)
+		return;
+
+	s->jba.extra = delay * 1000;
+}
+
+
+/**
+ * Report the state of the send queue of the media, for the statistics
+ *
+ * @param s      Stream object
+ * @param age    Age of the oldest queued packet [ms]
+ * @param n_drop Number of frames dropped from the queue
+ */
+void stream_sendq_report(struct stream *s, uint32_t age, uint64_t n_drop)
+{
+	if (!s)
+		return;
+
+	s->sendq.valid  = true;
+	s->sendq.age    = age;
+	s->sendq.n_drop = n_drop;
+}
+
+
+/**
+ * Set the lip-sync state that gets the sender reports of this stream
+ *
+ * @param s     Stream object
+ * @param as    Lip-sync state of the call, or NULL
+ * @param media Media of this stream
+ */
+void stream_set_avsync(struct stream *s, struct avsync *as,
+		       enum avsync_media media)
+{
+	if (!s)
+		return;
+
+	s->avsync       = as;
+	s->avsync_media = media;
+}
+
+
+/**
+ * Start collecting the RTP packets sent on this stream, so that they
+ * can be sent with one system call by stream_batch_flush()
+ *
+ * @param s Stream object
+ */
+void stream_batch_begin(struct stream *s)
+{
+	int err;
+
+	if (!s || s->cfg.rtp_batch < 2 || s->batch_failed)
+		return;
+
+	/* a shared socket is also used by the other media threads */
+	if (s->base || s->n_bundle)
+		return;
+
+	if (!s->batch) {
+		err = rtpbatch_alloc(&s->batch, rtp_sock(s->rtp),
+				     s->cfg.rtp_batch, s->cfg.rtp_uring);
 		if (err) {
-			warning("stream: rtpkeep_alloc failed: %m\n", err);
+			warning("stream: batched send not available (%m)\n",
+				err);
+			s->batch_failed = true;
+			return;
 		}
 	}
+
+	rtpbatch_begin(s->batch);
 }
 
 
-int stream_send(struct stream *s, bool marker, int pt, uint32_t ts,
-		struct mbuf *mb)
+/**
+ * Send all RTP packets collected since stream_batch_begin()
+ *
+ * @param s Stream object
+ */
+void stream_batch_flush(struct stream *s)
 {
-	int err = 0;
+	int err;
 
-	if (!s)
+	if (!s || !s->batch)
+		return;
+
+	err = rtpbatch_flush(s->batch);
+	if (err)
+		metric_add_error(&s->metric_tx);
+}
+
+
+/**
+ * Offer forward error correction (RFC 5109) on this stream, if it is
+ * enabled in the configuration. Must be called after the codecs are
+ * added to the SDP media.
+ *
+ * @param s     Stream object
+ * @param srate Clock rate of the FEC payload type
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int stream_enable_fec(struct stream *s, uint32_t srate)
+{
+	struct sdp_format *sf;
+	int err;
+
+	if (!s || !srate)
 		return EINVAL;
 
-	if (!sa_isset(sdp_media_raddr(s->sdp), SA_ALL))
+	if (!s->cfg.rtp_fec || s->fec)
 		return 0;
-	if (sdp_media_dir(s->sdp) != SDP_SENDRECV)
+
+	err = fec_alloc(&s->fec, rtp_sock(stream_transport(s)),
+			rtp_sess_ssrc(s->rtp), fec_recover_handler, s);
+	if (err)
+		return err;
+
+	err = sdp_format_add(&sf, s->sdp, false, NULL, "ulpfec", srate, 1,
+			     NULL, NULL, NULL, false, NULL);
+	if (err) {
+		s->fec = mem_deref(s->fec);
+		return err;
+	}
+
+	s->fec_pt = sf->pt;
+
+	return 0;
+}
+
+
+/**
+ * Keep a send history, so that packets requested by NACK can be resent
+ *
+ * @param s Stream object
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int stream_enable_rtx(struct stream *s)
+{
+	if (!s)
+		return EINVAL;
+
+	if (s->rtx)
 		return 0;
 
-	metric_add_packet(&s->metric_tx, mbuf_get_left(mb));
+	return rtxcache_alloc(&s->rtx, rtp_sock(stream_transport(s)),
+			      rtp_sess_ssrc(s->rtp));
+}
+
+
+/**
+ * Resend the packets requested by one generic NACK item
+ *
+ * @param s   Stream object
+ * @param pid Packet ID of the first lost packet
+ * @param blp Bitmask of following lost packets
+ *
+ * @return Number of requested packets that could not be resent
+ */
+unsigned stream_resend(struct stream *s, uint16_t pid, uint16_t blp)
+{
+	if (!s || !s->rtx)
+		return 1;
+
+	return rtxcache_resend(s->rtx, pid, blp);
+}
+
+
+/**
+ * Enable or disable sending of NACK for lost incoming packets
+ *
+ * @param s      Stream object
+ * @param enable True to enable
+ */
+void stream_set_nack(struct stream *s, bool enable)
+{
+	if (!s)
+		return;
+
+	s->nack = enable && s->rtcp;
+}
+
+
+/**
+ * Check if a NACK was sent recently, so resent packets may still arrive
+ *
+ * @param s Stream object
+ *
+ * @return True if resent packets are expected
+ */
+bool stream_nack_pending(const struct stream *s)
+{
+	if (!s || !s->nack || !s->nack_ts)
+		return false;
+
+	return tmr_jiffies() - s->nack_ts < NACK_WAIT;
+}
+
+
+/**
+ * Set the audio level sent in the RTP header extension (RFC 6464)
+ *
+ * @param s     Stream object
+ * @param dbov  Level of the next frame [-dBov]
+ *
+ * @note This function has REAL-TIME properties
+ */
+void stream_set_audio_level(struct stream *s, uint8_t dbov)
+{
+	if (!s)
+		return;
+
+	rtpext_set_audio_level(s->ext, dbov);
+}
+
+
+/**
+ * Get the audio level that the peer sent with a received packet
+ *
+ * @param s     Stream object
+ * @param hdr   RTP header of the packet
+ * @param mb    Payload of the packet
+ * @param dbov  Returns the level [-dBov]
+ * @param voice Returns the voice activity flag
+ *
+ * @return 0 if success, ENOENT if the packet has no audio level
+ */
+int stream_rx_audio_level(const struct stream *s,
+			  const struct rtp_header *hdr,
+			  const struct mbuf *mb, uint8_t *dbov, bool *voice)
+{
+	if (!s)
+		return EINVAL;
+
+	return rtpext_audio_level_rx(s->ext, hdr, mb, dbov, voice);
+}
+
+
+/**
+ * Count decoded audio samples, for the concealment statistics
+ *
+ * @param s         Stream object
+ * @param sampc     Number of samples
+ * @param concealed True if the samples were concealed
+ * @param fec       True if the samples were recovered from FEC data
+ *
+ * @note This function has REAL-TIME properties
+ */
+void stream_plc_count(struct stream *s, size_t sampc, bool concealed,
+		      bool fec)
+{
+	if (!s)
+		return;
+
+	s->plc.n_samp += sampc;
+
+	if (concealed)
+		s->plc.n_conceal += sampc;
+	if (fec)
+		s->plc.n_fec += sampc;
+}
+
+
+/**
+ * Enable congestion control for the sending direction. The target
+ * bitrate is estimated from RTCP receiver reports and REMB feedback,
+ * and reported to the handler whenever it changes.
+ *
+ * @param s   Stream object
+ * @param min Lower bound of the target bitrate [bit/s]
+ * @param max Upper bound and initial target bitrate [bit/s]
+ * @param bwh Target bitrate handler
+ * @param arg Handler argument
+ */
+void stream_set_bw_handler(struct stream *s, uint32_t min, uint32_t max,
+			   stream_bw_h *bwh, void *arg)
+{
+	if (!s)
+		return;
+
+	bwctrl_init(&s->bwc, max, min, max);
 
-	if (pt < 0)
-		pt = s->pt_enc;
+	s->bwh     = bwh;
+	s->bwh_arg = arg;
+}
 
-	if (pt >= 0) {
-		err = rtp_send(s->rtp, sdp_media_raddr(s->sdp),
-			       marker, pt, ts, mb);
-		if (err)
-			s->metric_tx.n_err++;
-	}
 
-	rtpkeep_refresh(s->rtpkeep, ts);
+/**
+ * Set the handler for the packet loss of the sending direction, as
+ * reported by the peer in RTCP receiver reports
+ *
+ * @param s     Stream object
+ * @param lossh Loss handler, called with the fraction lost (1/256 units)
+ * @param arg   Handler argument
+ */
+void stream_set_loss_handler(struct stream *s, stream_loss_h *lossh,
+			     void *arg)
+{
+	if (!s)
+		return;
 
-	return err;
+	s->lossh     = lossh;
+	s->lossh_arg = arg;
 }
 
 
-static void stream_remote_set(struct stream *s)
+static const char *ridv[STREAM_SIMULCAST_MAX] = {"f", "h", "q"};
+
+
+static int rid_print(struct re_printf *pf, const struct stream *s)
 {
-	struct sa rtcp;
+	unsigned i;
+	int err = 0;
 
-	if (!s)
-		return;
+	for (i=0; i<=s->n_sim; i++)
+		err |= re_hprintf(pf, "%s%s", i ? ";" : "", ridv[i]);
 
-	/* RFC 5761 */
-	if (s->cfg.rtcp_mux && sdp_media_rattr(s->sdp, "rtcp-mux")) {
+	return err;
+}
 
-		if (!s->rtcp_mux)
-			info("%s: RTP/RTCP multiplexing enabled\n",
-			     sdp_media_name(s->sdp));
-		s->rtcp_mux = true;
-	}
 
-	rtcp_enable_mux(s->rtp, s->rtcp_mux);
+static int sim_ssrc_print(struct re_printf *pf, const struct stream *s)
+{
+	unsigned i;
+	int err;
 
-	sdp_media_raddr_rtcp(s->sdp, &rtcp);
+	err = re_hprintf(pf, "%u", rtp_sess_ssrc(s->rtp));
+	for (i=0; i<s->n_sim; i++)
+		err |= re_hprintf(pf, " %u", rtp_sess_ssrc(s->simv[i]));
 
-	rtcp_start(s->rtp, s->cname,
-		   s->rtcp_mux ? sdp_media_raddr(s->sdp): &rtcp);
+	return err;
 }
 
 
-void stream_update(struct stream *s)
+/**
+ * Offer simulcast on this stream. Layer 0 is sent with the SSRC of the
+ * stream, and each lower layer has its own SSRC and sequence numbers on
+ * the same socket. The layers are signalled with RIDs and an SSRC group.
+ *
+ * @param s      Stream object
+ * @param layers Number of layers, including layer 0
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int stream_enable_simulcast(struct stream *s, unsigned layers)
 {
-	const struct sdp_format *fmt;
+	struct sdp_media *m;
+	unsigned i;
 	int err = 0;
 
 	if (!s)
-		return;
+		return EINVAL;
 
-	fmt = sdp_media_rformat(s->sdp, NULL);
+	layers = min(layers, STREAM_SIMULCAST_MAX);
+	if (layers < 2 || s->n_sim)
+		return 0;
 
-	s->pt_enc = fmt ? fmt->pt : -1;
+	for (i=1; i<layers; i++) {
 
-	if (sdp_media_has_media(s->sdp))
-		stream_remote_set(s);
+		err = rtp_alloc(&s->simv[s->n_sim]);
+		if (err)
+			return err;
 
-	if (s->menc && s->menc->mediah) {
-		err = s->menc->mediah(&s->mes, s->mencs, s->rtp,
-				      IPPROTO_UDP,
-				      rtp_sock(s->rtp),
-				      s->rtcp ? rtcp_sock(s->rtp) : NULL,
-				      s->sdp);
-		if (err) {
-			warning("stream: mediaenc update: %m\n", err);
-		}
+		++s->n_sim;
+	}
+
+	m = s->sdp;
+
+	/* RFC 8851 and RFC 8853 */
+	for (i=0; i<layers; i++)
+		err |= sdp_media_set_lattr(m, false, "rid", "%s send",
+					   ridv[i]);
+	err |= sdp_media_set_lattr(m, true, "simulcast", "send %H",
+				   rid_print, s);
+
+	/* RFC 5576, for peers that find the layers by SSRC */
+	err |= sdp_media_set_lattr(m, true, "ssrc-group", "SIM %H",
+				   sim_ssrc_print, s);
+	for (i=0; i<s->n_sim; i++) {
+		err |= sdp_media_set_lattr(m, false, "ssrc", "%u cname:%s",
+					   rtp_sess_ssrc(s->simv[i]),
+					   s->cname);
 	}
+
+	return err;
 }
 
 
-void stream_update_encoder(struct stream *s, int pt_enc)
+/**
+ * Get the number of simulcast layers to send
+ *
+ * @param s Stream object
+ *
+ * @return Number of layers, 1 if the peer did not accept simulcast
+ */
+unsigned stream_simulcast_layers(const struct stream *s)
 {
 	if (!s)
-		return;
+		return 0;
 
-	if (pt_enc >= 0)
-		s->pt_enc = pt_enc;
+	return s->sim_active ? 1 + s->n_sim : 1;
 }
 
 
-int stream_jbuf_stat(struct re_printf *pf, const struct stream *s)
+/**
+ * Send an RTP packet of one simulcast layer
+ *
+ * @param s      Stream object
+ * @param layer  Layer, 0 is the stream itself
+ * @param marker Set marker bit
+ * @param pt     Payload type, -1 for the encoder payload type
+ * @param ts     RTP timestamp
+ * @param mb     Payload, with headroom for the RTP header
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int stream_send_layer(struct stream *s, unsigned layer, bool marker,
+		      int pt, uint32_t ts, struct mbuf *mb)
 {
-	struct jbuf_stat stat;
 	int err;
 
-	if (!s)
+	if (!s || !mb)
 		return EINVAL;
 
-	err  = re_hprintf(pf, " %s:", sdp_media_name(s->sdp));
+	if (!layer)
+		return stream_send(s, marker, pt, ts, mb);
 
-	err |= jbuf_stats(s->jbuf, &stat);
-	if (err) {
-		err = re_hprintf(pf, "Jbuf stat: (not available)");
-	}
-	else {
-		err = re_hprintf(pf, "Jbuf stat: put=%u get=%u or=%u ur=%u",
-				  stat.n_put, stat.n_get,
-				  stat.n_overflow, stat.n_underflow);
-	}
+	if (s->relay_src || !s->sim_active || layer > s->n_sim)
+		return 0;
+	if (!sa_isset(sdp_media_raddr(s->sdp), SA_ALL))
+		return 0;
+	if (sdp_media_dir(s->sdp) != SDP_SENDRECV)
+		return 0;
+
+	if (pt < 0)
+		pt = s->pt_enc;
+	if (pt < 0)
+		return 0;
+
+	metric_add_packet(&s->metric_tx, mbuf_get_left(mb));
+
+	err = transport_send(s, s->simv[layer - 1], marker, pt, ts, mb);
+	if (err)
+		metric_add_error(&s->metric_tx);
 
 	return err;
 }
 
 
-void stream_hold(struct stream *s, bool hold)
+static bool format_match(const struct sdp_format *a,
+			 const struct sdp_format *b)
 {
-	if (!s)
-		return;
+	if (!a || !b)
+		return false;
 
-	sdp_media_set_ldir(s->sdp, hold ? SDP_SENDONLY : SDP_SENDRECV);
+	/* the same codec has the same name, clock rate and channels */
+	if (!a->data || a->data != b->data) {
+
+		if (str_casecmp(a->name, b->name) ||
+		    a->srate != b->srate || a->ch != b->ch)
+			return false;
+	}
+
+	return a->cmph ? a->cmph(a->params, b->params, a->data) : true;
 }
 
 
-void stream_set_srate(struct stream *s, uint32_t srate_tx, uint32_t srate_rx)
+/**
+ * Relay the RTP packets received on a stream to another stream, without
+ * decoding them. The packets are sent with the SSRC, sequence numbers
+ * and timestamps of the other stream, and the packets that are sent on
+ * that stream by the local encoder are dropped. RTCP is terminated on
+ * each stream, except for picture requests which go to the sender.
+ *
+ * @param s    Stream to relay from
+ * @param dst  Stream to relay to, NULL to stop relaying
+ *
+ * @return 0 if success, ENOTSUP if the streams use different codecs,
+ *         otherwise errorcode
+ */
+int stream_relay(struct stream *s, struct stream *dst)
 {
 	if (!s)
-		return;
+		return EINVAL;
 
-	rtcp_set_srate(s->rtp, srate_tx, srate_rx);
-}
+	if (s->relay) {
+		s->relay->relay_src = NULL;
+		s->relay = NULL;
+	}
 
+	tmr_cancel(&s->relay_tmr);
+	list_flush(&s->relay_q);
+	s->relay_delay = 0;
 
-void stream_send_fir(struct stream *s, bool pli)
-{
-	int err;
+	if (!dst)
+		return 0;
 
-	if (!s)
-		return;
+	if (dst == s)
+		return EINVAL;
 
-	if (pli)
-		err = rtcp_send_pli(s->rtp, s->ssrc_rx);
-	else
-		err = rtcp_send_fir(s->rtp, rtp_sess_ssrc(s->rtp));
+	if (!format_match(sdp_media_rformat(s->sdp, NULL),
+			  sdp_media_rformat(dst->sdp, NULL)))
+		return ENOTSUP;
 
-	if (err) {
-		s->metric_tx.n_err++;
+	if (dst->relay_src)
+		(void)stream_relay(dst->relay_src, NULL);
 
-		warning("stream: failed to send RTCP %s: %m\n",
-			pli ? "PLI" : "FIR", err);
-	}
+	s->relay        = dst;
+	s->relay_pt_in  = -1;
+	s->relay_sync   = true;
+	dst->relay_src  = s;
+
+	return 0;
 }
 
 
-void stream_reset(struct stream *s)
+/**
+ * Send the RTP packets received on a stream back to the sender, without
+ * decoding them. The packets are sent with the SSRC, sequence numbers
+ * and timestamps of the stream, and the payload types of the peer. RTCP
+ * is terminated, the reports of the stream tell the sender the loss,
+ * jitter and round-trip time of both directions.
+ *
+ * @param s      Stream object
+ * @param enable True to reflect, false to stop
+ * @param delay  Delay of the reflected packets [ms]
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int stream_reflect(struct stream *s, bool enable, uint32_t delay)
 {
 	if (!s)
-		return;
-
-	jbuf_flush(s->jbuf);
+		return EINVAL;
 
-	stream_start_keepalive(s);
-}
+	(void)stream_relay(s->relay_src, NULL);
+	(void)stream_relay(s, NULL);
 
+	if (!enable)
+		return 0;
 
-void stream_set_bw(struct stream *s, uint32_t bps)
-{
-	if (!s)
-		return;
+	s->relay        = s;
+	s->relay_src    = s;
+	s->relay_pt_in  = -1;
+	s->relay_sync   = true;
+	s->relay_delay  = min(delay, RELAY_DELAY_MAX);
 
-	sdp_media_set_lbandwidth(s->sdp, SDP_BANDWIDTH_AS, bps / 1000);
+	return 0;
 }
 
 
-void stream_enable_rtp_timeout(struct stream *strm, uint32_t timeout_ms)
+/* True if the local encoder output of the stream is not sent */
+bool stream_is_relayed(const struct stream *s)
 {
-	if (!strm)
-		return;
-
-	strm->rtp_timeout_ms = timeout_ms;
+	return s ? s->relay_src != NULL : false;
+}
 
-	tmr_cancel(&strm->tmr_rtp);
 
-	if (timeout_ms) {
+/* True if the stream sends back what it receives, with no codecs */
+bool stream_is_reflected(const struct stream *s)
+{
+	return s ? s->relay == s : false;
+}
 
-		info("stream: Enable RTP timeout (%u milliseconds)\n",
-		     timeout_ms);
 
-		strm->ts_last = tmr_jiffies();
-		tmr_start(&strm->tmr_rtp, 10, check_rtp_handler, strm);
-	}
+/* False while the stream is on hold, in either direction */
+bool stream_is_sending(const struct stream *s)
+{
+	return s ? sdp_media_dir(s->sdp) == SDP_SENDRECV : false;
 }
 
 
@@ -645,12 +2467,184 @@ int stream_debug(struct re_printf *pf, const struct stream *s)
 			  sdp_media_raddr(s->sdp), &rrtcp);
 
 	err |= rtp_debug(pf, s->rtp);
+	if (s->base) {
+		err |= re_hprintf(pf, " bundle: socket of %s\n",
+				  sdp_media_name(s->base->sdp));
+	}
+	if (s->relay) {
+		err |= re_hprintf(pf, " %s: %llu packets to %J"
+				  " (delay=%ums)\n",
+				  s->relay == s ? "reflect" : "relay",
+				  s->n_relay, sdp_media_raddr(s->relay->sdp),
+				  s->relay_delay);
+	}
 	err |= jbuf_debug(pf, s->jbuf);
+	err |= vidbuf_debug(pf, s->vbuf);
+	err |= reorder_debug(pf, s->reord);
+	err |= rtpbatch_debug(pf, s->batch);
+	err |= rtxcache_debug(pf, s->rtx);
+	err |= fec_debug(pf, s->fec);
+	err |= rtpext_debug(pf, s->ext);
+	if (s->fb.n_msg) {
+		err |= re_hprintf(pf, " rtcp-fb: %llu messages in %u packets"
+				  " (%s)\n", s->fb.n_msg, s->fb.n_pkt,
+				  sdp_media_rattr(s->sdp, "rtcp-rsize") ?
+				  "reduced-size" : "compound");
+	}
+	if (s->n_sim) {
+		unsigned i;
+
+		err |= re_hprintf(pf, " simulcast: %s ssrc=%08x",
+				  s->sim_active ? "active" : "offered",
+				  rtp_sess_ssrc(s->rtp));
+		for (i=0; i<s->n_sim; i++)
+			err |= re_hprintf(pf, ",%08x",
+					  rtp_sess_ssrc(s->simv[i]));
+		err |= re_hprintf(pf, "\n");
+	}
+	err |= re_hprintf(pf, " metric tx:\n%H", metric_debug, &s->metric_tx);
+	err |= re_hprintf(pf, " metric rx:\n%H", metric_debug, &s->metric_rx);
+	if (s->nack)
+		err |= re_hprintf(pf, " nack: sent=%u\n", s->n_nack);
+	err |= mos_est_debug(pf, &s->mos);
+	if (s->plc.n_samp) {
+		err |= re_hprintf(pf, " plc: concealed=%llu (%.2f%%)"
+				  " fec=%llu samples\n",
+				  s->plc.n_conceal,
+				  100.0 * s->plc.n_conceal / s->plc.n_samp,
+				  s->plc.n_fec);
+	}
+	if (hktmr_isrunning(&s->tmr_xr)) {
+		err |= re_hprintf(pf, " rtcp-xr tx: %H\n",
+				  rtcpxr_voip_debug, &s->xr_tx);
+	}
+	if (s->n_xr_rx) {
+		err |= re_hprintf(pf, " rtcp-xr rx: %H (%u reports)\n",
+				  rtcpxr_voip_debug, &s->xr_rx, s->n_xr_rx);
+	}
+	if (s->bwh)
+		err |= bwctrl_debug(pf, &s->bwc);
 
 	return err;
 }
 
 
+struct stats_job {
+	const struct stream *s;
+	struct stream_stats *st;
+};
+
+
+static int stats_job_handler(void *arg)
+{
+	struct stats_job *job = arg;
+
+	return stream_stats(job->s, job->st);
+}
+
+
+/**
+ * Get the statistics of a media stream
+ *
+ * @param s  Stream object
+ * @param st Returned statistics
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int stream_stats(const struct stream *s, struct stream_stats *st)
+{
+	struct metric_snapshot tx, rx;
+	const struct sdp_format *fmt;
+	struct vidbuf_stat vstat;
+	struct jbuf_stat jstat;
+
+	if (!s || !st)
+		return EINVAL;
+
+	/* read on the event loop of the media of the call */
+	if (call_loop(s->call) != shard_loop()) {
+		struct stats_job job;
+
+		job.s  = s;
+		job.st = st;
+
+		return shard_exec(call_loop(s->call), stats_job_handler, &job);
+	}
+
+	memset(st, 0, sizeof(*st));
+
+	metric_snapshot(&s->metric_tx, &tx);
+	metric_snapshot(&s->metric_rx, &rx);
+
+	st->media = sdp_media_name(s->sdp);
+
+	fmt = sdp_media_rformat(s->sdp, NULL);
+	st->codec = fmt ? fmt->name : NULL;
+
+	st->tx.packets = tx.n_packets;
+	st->tx.bytes   = tx.n_bytes;
+	st->tx.errors  = tx.n_err;
+	st->tx.bitrate = tx.cur_bitrate;
+	st->tx.lost    = s->rtcp_stats.tx.lost;
+	st->tx.jitter  = s->rtcp_stats.tx.jit;
+
+	st->rx.packets = rx.n_packets;
+	st->rx.bytes   = rx.n_bytes;
+	st->rx.errors  = rx.n_err;
+	st->rx.bitrate = rx.cur_bitrate;
+	st->rx.lost    = s->rtcp_stats.rx.lost;
+	st->rx.jitter  = s->rtcp_stats.rx.jit;
+
+	st->rtt = s->rtcp_stats.rtt;
+
+	if (s->jbuf && 0 == jbuf_stats(s->jbuf, &jstat)) {
+
+		st->jbuf           = true;
+		st->jbuf_put       = jstat.n_put;
+		st->jbuf_get       = jstat.n_get;
+		st->jbuf_overflow  = jstat.n_overflow;
+		st->jbuf_underflow = jstat.n_underflow;
+		st->jbuf_delay     = jba_delay_ms(&s->jba);
+	}
+	else if (s->vbuf && 0 == vidbuf_stats(s->vbuf, &vstat)) {
+
+		st->jbuf           = true;
+		st->jbuf_put       = vstat.n_put;
+		st->jbuf_get       = vstat.n_get;
+		st->jbuf_overflow  = vstat.n_overflow;
+		st->jbuf_underflow = vstat.n_incomplete;
+		st->jbuf_delay     = vstat.delay;
+	}
+
+	if (s->mos.valid) {
+		st->mos_valid = true;
+		st->mos       = s->mos.mos;
+		st->r_factor  = s->mos.r;
+	}
+
+	if (s->plc.n_samp) {
+		st->plc       = true;
+		st->samples   = s->plc.n_samp;
+		st->concealed = s->plc.n_conceal;
+		st->fec       = s->plc.n_fec;
+	}
+
+	if (s->avsync) {
+		st->sync       = 0 == avsync_offset(s->avsync,
+						    &st->sync_offset);
+		st->sync_delay = avsync_delay(s->avsync, s->avsync_media);
+	}
+
+	if (s->sendq.valid) {
+		st->sendq      = true;
+		st->sendq_age  = s->sendq.age;
+		st->sendq_drop = s->sendq.n_drop;
+	}
+
+	return 0;
+}
+
+
 int stream_print(struct re_printf *pf, const struct stream *s)
 {
 	if (!s)
@@ -660,3 +2654,78 @@ int stream_print(struct re_printf *pf, const struct stream *s)
 			  s->metric_tx.cur_bitrate,
 			  s->metric_rx.cur_bitrate);
 }
+
+
+/*
+ * Selftest hooks, they are not part of the API
+ */
+
+
+/**
+ * Allocate a stream that only has a jitter buffer, to feed it packets
+ * without a call or a socket
+ *
+ * @param sp    Pointer to allocated stream
+ * @param cfg   AVT configuration, with the jitter buffer range and mode
+ * @param srate Receive sample rate [Hz]
+ * @param rtph  Handler for the packets out of the jitter buffer
+ * @param arg   Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int stream_test_alloc(struct stream **sp, const struct config_avt *cfg,
+		      uint32_t srate, stream_rtp_h *rtph, void *arg)
+{
+	struct stream *s;
+	int err;
+
+	if (!sp || !cfg || !rtph || !cfg->jbuf_del.min)
+		return EINVAL;
+
+	s = mem_zalloc(sizeof(*s), stream_destructor);
+	if (!s)
+		return ENOMEM;
+
+	memtag_alloc(memtag_core(MEMTAG_STREAM), sizeof(*s));
+
+	s->cfg      = *cfg;
+	s->rtph     = rtph;
+	s->arg      = arg;
+	s->pseq     = -1;
+	s->srate_rx = srate;
+
+	err = jbuf_alloc(&s->jbuf, cfg->jbuf_del.min,
+			 max(cfg->jbuf_del.max, cfg->jbuf_del.min));
+	if (err) {
+		mem_deref(s);
+		return err;
+	}
+
+	jba_reset(&s->jba, cfg->jbuf_del.min);
+
+	*sp = s;
+
+	return 0;
+}
+
+
+/**
+ * Feed a received packet to the jitter buffer of a stream
+ *
+ * @param s       Stream from stream_test_alloc()
+ * @param hdr     RTP header
+ * @param mb      RTP payload
+ * @param arrival Arrival time [us]
+ */
+void stream_test_recv(struct stream *s, const struct rtp_header *hdr,
+		      struct mbuf *mb, uint64_t arrival)
+{
+	struct sa src;
+
+	if (!s || !s->jbuf || !hdr || !mb)
+		return;
+
+	sa_init(&src, AF_INET);
+
+	jbuf_recv(s, &src, hdr, mb, arrival, false);
+}
@@ -0,0 +1,332 @@
+/**
+ * @file txpool.c  Shared audio transmit worker pool
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#define _DEFAULT_SOURCE 1
+#define _BSD_SOURCE 1
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * A fixed number of worker threads is shared by all audio streams using
+ * the "pool" transmit mode. Each stream is attached to the least loaded
+ * shard, or to the shard given by its affinity key, and the shard's
+ * worker runs the poll handler for all of its streams whenever one of
+ * them signals that a packet is ready.
+ *
+ * The streams of all event loops share the pool, so attaching and
+ * detaching is done under shard_lock().
+ */
+
+
+#ifdef HAVE_PTHREAD
+
+enum { TXPOOL_MAX_THREADS = 64 };
+
+struct txpool_shard {
+	struct list entl;         /**< Attached entries (struct txpool_entry) */
+	pthread_mutex_t lock;     /**< Protects entl, held while polling      */
+	pthread_mutex_t mutex;    /**< Protects pending and cond              */
+	pthread_cond_t cond;      /**< Signalled when a packet is ready       */
+	pthread_t tid;            /**< Worker thread                          */
+	bool pending;             /**< At least one entry has a packet ready  */
+	bool run;                 /**< Worker thread is running               */
+	unsigned n;               /**< Number of attached entries             */
+	unsigned idx;             /**< Index of the shard, for CPU pinning    */
+};
+
+struct txpool {
+	struct txpool_shard *shardv;
+	unsigned shardc;
+	unsigned n;               /**< Total number of attached entries       */
+};
+
+
+static struct txpool *pool;
+
+
+static void *worker_thread(void *arg)
+{
+	struct txpool_shard *sh = arg;
+	struct le *le;
+
+	/* one CPU of the list per worker */
+	(void)realtime_affinity(conf_config()->audio.cpus_pool, sh->idx);
+
+	for (;;) {
+
+		pthread_mutex_lock(&sh->mutex);
+
+		while (sh->run && !sh->pending)
+			pthread_cond_wait(&sh->cond, &sh->mutex);
+
+		sh->pending = false;
+
+		pthread_mutex_unlock(&sh->mutex);
+
+		if (!sh->run)
+			break;
+
+		pthread_mutex_lock(&sh->lock);
+
+		for (le = sh->entl.head; le; le = le->next) {
+			struct txpool_entry *ent = le->data;
+
+			ent->pollh(ent->arg);
+		}
+
+		pthread_mutex_unlock(&sh->lock);
+	}
+
+	return NULL;
+}
+
+
+static void pool_destructor(void *arg)
+{
+	struct txpool *p = arg;
+	unsigned i;
+
+	for (i=0; i<p->shardc; i++) {
+		struct txpool_shard *sh = &p->shardv[i];
+
+		if (sh->run) {
+			pthread_mutex_lock(&sh->mutex);
+			sh->run = false;
+			pthread_cond_signal(&sh->cond);
+			pthread_mutex_unlock(&sh->mutex);
+
+			pthread_join(sh->tid, NULL);
+		}
+
+		pthread_cond_destroy(&sh->cond);
+		pthread_mutex_destroy(&sh->mutex);
+		pthread_mutex_destroy(&sh->lock);
+	}
+
+	mem_deref(p->shardv);
+}
+
+
+static unsigned default_threads(void)
+{
+#if defined (HAVE_UNISTD_H) && defined (_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n > 0)
+		return (unsigned)n;
+#endif
+
+	return 1;
+}
+
+
+static int pool_alloc(struct txpool **poolp, unsigned nthreads)
+{
+	struct txpool *p;
+	unsigned i;
+	int err = 0;
+
+	if (!nthreads)
+		nthreads = default_threads();
+
+	nthreads = min(nthreads, TXPOOL_MAX_THREADS);
+
+	p = mem_zalloc(sizeof(*p), pool_destructor);
+	if (!p)
+		return ENOMEM;
+
+	p->shardv = mem_zalloc(nthreads * sizeof(*p->shardv), NULL);
+	if (!p->shardv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i=0; i<nthreads; i++) {
+		struct txpool_shard *sh = &p->shardv[i];
+
+		list_init(&sh->entl);
+		pthread_mutex_init(&sh->lock, NULL);
+		pthread_mutex_init(&sh->mutex, NULL);
+		pthread_cond_init(&sh->cond, NULL);
+
+		++p->shardc;
+
+		sh->idx = i;
+		sh->run = true;
+		err = pthread_create(&sh->tid, NULL, worker_thread, sh);
+		if (err) {
+			sh->run = false;
+			goto out;
+		}
+	}
+
+	info("txpool: started %u audio transmit workers\n", p->shardc);
+
+ out:
+	if (err)
+		mem_deref(p);
+	else
+		*poolp = p;
+
+	return err;
+}
+
+
+/**
+ * Attach an entry to the shared transmit pool. The pool is created
+ * when the first entry is attached.
+ *
+ * @param ent      Pool entry (owned by caller)
+ * @param nthreads Number of worker threads, 0 for number of CPUs
+ * @param key      Affinity key, entries with the same key share a shard.
+ *                 0 for the least loaded shard
+ * @param pollh    Handler called from the worker when a packet is ready
+ * @param arg      Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int txpool_attach(struct txpool_entry *ent, unsigned nthreads,
+		  uint32_t key, txpool_poll_h *pollh, void *arg)
+{
+	struct txpool_shard *sh;
+	unsigned i;
+	int err = 0;
+
+	if (!ent || !pollh)
+		return EINVAL;
+
+	if (ent->shard)
+		return EALREADY;
+
+	shard_lock();
+
+	if (!pool) {
+		err = pool_alloc(&pool, nthreads);
+		if (err)
+			goto out;
+	}
+
+	if (key) {
+		sh = &pool->shardv[key % pool->shardc];
+	}
+	else {
+		/* pick the least loaded shard */
+		sh = &pool->shardv[0];
+		for (i=1; i<pool->shardc; i++) {
+			if (pool->shardv[i].n < sh->n)
+				sh = &pool->shardv[i];
+		}
+	}
+
+	ent->pollh = pollh;
+	ent->arg   = arg;
+	ent->shard = sh;
+
+	pthread_mutex_lock(&sh->lock);
+	list_append(&sh->entl, &ent->le, ent);
+	++sh->n;
+	pthread_mutex_unlock(&sh->lock);
+
+	++pool->n;
+
+ out:
+	shard_unlock();
+
+	return err;
+}
+
+
+/**
+ * Detach an entry from the transmit pool. When this function returns
+ * the poll handler is not running and will not be called again.
+ *
+ * @param ent Pool entry
+ */
+void txpool_detach(struct txpool_entry *ent)
+{
+	struct txpool_shard *sh;
+
+	if (!ent || !ent->shard)
+		return;
+
+	sh = ent->shard;
+
+	shard_lock();
+
+	pthread_mutex_lock(&sh->lock);
+	list_unlink(&ent->le);
+	--sh->n;
+	pthread_mutex_unlock(&sh->lock);
+
+	ent->shard = NULL;
+
+	if (pool && --pool->n == 0)
+		pool = mem_deref(pool);
+
+	shard_unlock();
+}
+
+
+/**
+ * Wake up the worker owning this entry
+ *
+ * @param ent Pool entry
+ *
+ * @note This function has REAL-TIME properties and may be called from
+ *       any thread
+ */
+void txpool_signal(struct txpool_entry *ent)
+{
+	struct txpool_shard *sh;
+
+	if (!ent || !ent->shard)
+		return;
+
+	sh = ent->shard;
+
+	pthread_mutex_lock(&sh->mutex);
+	sh->pending = true;
+	pthread_cond_signal(&sh->cond);
+	pthread_mutex_unlock(&sh->mutex);
+}
+
+
+#else
+
+
+int txpool_attach(struct txpool_entry *ent, unsigned nthreads,
+		  uint32_t key, txpool_poll_h *pollh, void *arg)
+{
+	(void)ent;
+	(void)nthreads;
+	(void)key;
+	(void)pollh;
+	(void)arg;
+
+	return ENOSYS;
+}
+
+
+void txpool_detach(struct txpool_entry *ent)
+{
+	(void)ent;
+}
+
+
+void txpool_signal(struct txpool_entry *ent)
+{
+	(void)ent;
+}
+
+
+#endif
@@ -15,11 +15,23 @@
 #include "magic.h"
 
 
+enum {
+	UA_HASH_SIZE = 1024,   /**< Buckets of the User-Agent hashes     */
+	DRAIN_TICK = 10,       /**< Drain timer interval [ms]            */
+	DRAIN_REPORT = 1000,   /**< Drain progress interval [ms]         */
+};
+
+
 /** Defines a SIP User Agent object */
 struct ua {
 	MAGIC_DECL                   /**< Magic number for struct ua         */
 	struct ua **uap;             /**< Pointer to application's ua        */
 	struct le le;                /**< Linked list element                */
+	struct le le_cuser;          /**< Hash element, by contact username  */
+	struct le le_user;           /**< Hash element, by AOR username      */
+	struct le le_aor;            /**< Hash element, by AOR               */
+	uint32_t key_cuser;          /**< Hash of the contact username       */
+	uint32_t key_user;           /**< Hash of the AOR username           */
 	struct account *acc;         /**< Account Parameters                 */
 	struct list regl;            /**< List of Register clients           */
 	struct list calls;           /**< List of active calls (struct call) */
@@ -35,12 +47,17 @@ struct ua {
 struct ua_eh {
 	struct le le;
 	ua_event_h *h;
+	uint32_t mask;           /**< Events of interest (UA_EVENT_BIT)  */
+	const struct ua *ua;     /**< Only events of this UA (optional)  */
 	void *arg;
 };
 
 static struct {
 	struct config_sip *cfg;        /**< SIP configuration               */
 	struct list ual;               /**< List of User-Agents (struct ua) */
+	struct hash *ht_cuser;         /**< User-Agents by contact username */
+	struct hash *ht_user;          /**< User-Agents by AOR username     */
+	struct hash *ht_aor;           /**< User-Agents by AOR              */
 	struct list ehl;               /**< Event handlers (struct ua_eh)   */
 	struct sip *sip;               /**< SIP Stack                       */
 	struct sip_lsnr *lsnr;         /**< SIP Listener                    */
@@ -61,6 +78,9 @@ static struct {
 } uag = {
 	NULL,
 	LIST_INIT,
+	NULL,
+	NULL,
+	NULL,
 	LIST_INIT,
 	NULL,
 	NULL,
@@ -81,10 +101,32 @@ static struct {
 };
 
 
+/*
+ * With sip_drain_rate set, a graceful stop drains the User-Agents at
+ * that rate instead of closing all of them at once. New calls are
+ * rejected while draining. Each User-Agent that is closed sends its
+ * un-REGISTERs and BYEs, and they run in parallel with the ones of the
+ * User-Agents closed before. After sip_drain_timeout the rest is
+ * closed by force, including the SIP transactions still running.
+ */
+static struct {
+	struct tmr tmr;                /**< Closes the User-Agents          */
+	uint64_t ts_start;             /**< Time the drain started          */
+	uint64_t ts;                   /**< Time of the last tick           */
+	uint64_t ts_report;            /**< Time of the last progress line  */
+	uint32_t credit;               /**< UAs that may be closed, x1000   */
+	uint32_t n_total;              /**< UAs when the drain started      */
+	uint32_t n_closed;             /**< UAs closed so far               */
+	uint32_t n_calls;              /**< Calls hung up so far            */
+	bool active;                   /**< Drain is running                */
+} drain;
+
+
 /* prototypes */
 static int  ua_call_alloc(struct call **callp, struct ua *ua,
 			  enum vidmode vidmode, const struct sip_msg *msg,
-			  struct call *xcall, const char *local_uri);
+			  struct call *xcall, const char *local_uri,
+			  const struct call *peer);
 
 
 /* This function is called when all SIP transactions are done */
@@ -118,21 +160,64 @@ void ua_event(struct ua *ua, enum ua_event ev, struct call *call,
 	      const char *fmt, ...)
 {
 	struct le *le;
+	const char *prev;
+	bool fmt_done = false;
 	char buf[256];
 	va_list ap;
 
-	va_start(ap, fmt);
-	(void)re_vsnprintf(buf, sizeof(buf), fmt, ap);
-	va_end(ap);
+	prev = watchdog_enter(uag_event_str(ev));
 
-	/* send event to all clients */
+	/* send event to the clients that subscribed to it */
 	le = uag.ehl.head;
 	while (le) {
 		struct ua_eh *eh = le->data;
 		le = le->next;
 
+		if (!(eh->mask & UA_EVENT_BIT(ev)))
+			continue;
+
+		if (eh->ua && eh->ua != ua)
+			continue;
+
+		/* the parameter is only printed if it is used */
+		if (!fmt_done) {
+			va_start(ap, fmt);
+			(void)re_vsnprintf(buf, sizeof(buf), fmt, ap);
+			va_end(ap);
+			fmt_done = true;
+		}
+
 		eh->h(ua, ev, call, buf, eh->arg);
 	}
+
+	(void)watchdog_enter(prev);
+}
+
+
+/**
+ * Send an event from a module to the UA event handlers. The parameter
+ * of the event is "module,event,prm"
+ *
+ * @param module Module name
+ * @param event  Event name
+ * @param ua     User-Agent (optional)
+ * @param call   Call (optional)
+ * @param fmt    Formatted event parameter
+ */
+void module_event(const char *module, const char *event, struct ua *ua,
+		  struct call *call, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	if (!module || !event)
+		return;
+
+	va_start(ap, fmt);
+	(void)re_vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	ua_event(ua, UA_EVENT_MODULE, call, "%s,%s,%s", module, event, buf);
 }
 
 
@@ -362,7 +447,7 @@ static void call_event_handler(struct call *call, enum call_event ev,
 		ua_printf(ua, "transferring call to %s\n", str);
 
 		err = ua_call_alloc(&call2, ua, VIDMODE_ON, NULL, call,
-				    call_localuri(call));
+				    call_localuri(call), NULL);
 		if (!err) {
 			struct pl pl;
 
@@ -384,6 +469,14 @@ static void call_event_handler(struct call *call, enum call_event ev,
 	case CALL_EVENT_TRANSFER_FAILED:
 		ua_event(ua, UA_EVENT_CALL_TRANSFER_FAILED, call, str);
 		break;
+
+	case CALL_EVENT_SETUP:
+		ua_event(ua, UA_EVENT_CALL_SETUP, call, str);
+		break;
+
+	case CALL_EVENT_STATS:
+		ua_event(ua, UA_EVENT_CALL_STATS, call, str);
+		break;
 	}
 }
 
@@ -410,7 +503,8 @@ static void call_dtmf_handler(struct call *call, char key, void *arg)
 
 static int ua_call_alloc(struct call **callp, struct ua *ua,
 			 enum vidmode vidmode, const struct sip_msg *msg,
-			 struct call *xcall, const char *local_uri)
+			 struct call *xcall, const char *local_uri,
+			 const struct call *peer)
 {
 	const struct network *net = baresip_network();
 	struct call_prm cprm;
@@ -437,6 +531,7 @@ static int ua_call_alloc(struct call **callp, struct ua *ua,
 	sa_cpy(&cprm.laddr, net_laddr_af(net, af));
 	cprm.vidmode = vidmode;
 	cprm.af      = af;
+	cprm.loop    = peer ? call_loop(peer) : 0;
 
 	err = call_alloc(callp, conf_config(), &ua->calls,
 			 ua->acc->dispname,
@@ -464,7 +559,7 @@ static void handle_options(struct ua *ua, const struct sip_msg *msg)
 	debug("ua: incoming OPTIONS message from %r (%J)\n",
 	      &msg->from.auri, &msg->src);
 
-	err = ua_call_alloc(&call, ua, VIDMODE_ON, NULL, NULL, NULL);
+	err = ua_call_alloc(&call, ua, VIDMODE_ON, NULL, NULL, NULL, NULL);
 	if (err) {
 		(void)sip_treply(NULL, uag.sip, msg, 500, "Call Error");
 		return;
@@ -501,16 +596,52 @@ static void handle_options(struct ua *ua, const struct sip_msg *msg)
 }
 
 
+/* The User-Agents are also indexed by the names that incoming requests
+ * are matched against. The order of each hash bucket is the order of
+ * uag.ual, so the first UA found is the same as with a linear search.
+ *
+ * The case-folded hashes of the names are kept in the UA, and a lookup
+ * compares them before the names, so that the names are only compared
+ * for the UA that matches.
+ */
+static void ua_index(struct ua *ua)
+{
+	const struct pl *user = &ua->acc->luri.user;
+
+	ua->key_cuser = hash_joaat_ci(ua->cuser, str_len(ua->cuser));
+	ua->key_user  = hash_joaat_ci(user->p, user->l);
+
+	hash_append(uag.ht_cuser, ua->key_cuser, &ua->le_cuser, ua);
+	hash_append(uag.ht_user, ua->key_user, &ua->le_user, ua);
+	hash_append(uag.ht_aor, hash_joaat_str(ua->acc->aor),
+		    &ua->le_aor, ua);
+}
+
+
+static void ua_unindex(struct ua *ua)
+{
+	hash_unlink(&ua->le_cuser);
+	hash_unlink(&ua->le_user);
+	hash_unlink(&ua->le_aor);
+}
+
+
 static void ua_destructor(void *arg)
 {
 	struct ua *ua = arg;
 
+	memtag_free(memtag_core(MEMTAG_UA), sizeof(*ua));
+
 	if (ua->uap) {
 		*ua->uap = NULL;
 		ua->uap = NULL;
 	}
 
 	list_unlink(&ua->le);
+	ua_unindex(ua);
+
+	if (uag.ua_cur == ua)
+		uag.ua_cur = list_ledata(list_head(&uag.ual));
 
 	if (!list_isempty(&ua->regl))
 		ua_event(ua, UA_EVENT_UNREGISTERING, NULL, NULL);
@@ -527,12 +658,15 @@ static void ua_destructor(void *arg)
 }
 
 
+/* The first SIP listener, it sees all requests */
 static bool request_handler(const struct sip_msg *msg, void *arg)
 {
 	struct ua *ua;
 
 	(void)arg;
 
+	PROBE3(sip_request, msg->met.p, msg->met.l, msg->cseq.num);
+
 	if (pl_strcmp(&msg->met, "OPTIONS"))
 		return false;
 
@@ -584,6 +718,8 @@ int ua_alloc(struct ua **uap, const char *aor)
 	if (!ua)
 		return ENOMEM;
 
+	memtag_alloc(memtag_core(MEMTAG_UA), sizeof(*ua));
+
 	MAGIC_INIT(ua);
 
 	list_init(&ua->calls);
@@ -663,6 +799,7 @@ int ua_alloc(struct ua **uap, const char *aor)
 		goto out;
 
 	list_append(&uag.ual, &ua->le, ua);
+	ua_index(ua);
 
 	if (ua->acc->regint) {
 		err = ua_register(ua);
@@ -745,6 +882,31 @@ static int uri_complete(struct ua *ua, struct mbuf *buf, const char *uri)
 int ua_connect(struct ua *ua, struct call **callp,
 	       const char *from_uri, const char *uri,
 	       const char *params, enum vidmode vmode)
+{
+	return ua_connect_pinned(ua, callp, from_uri, uri, params, vmode,
+				 NULL);
+}
+
+
+/**
+ * Connect an outgoing call, with its media on the event loop of another
+ * call. The media of the two calls can then be relayed with
+ * call_relay(), which needs both on one loop.
+ *
+ * @param ua        User-Agent
+ * @param callp     Optional pointer to allocated call object
+ * @param from_uri  Optional From uri, or NULL for default AOR
+ * @param uri       SIP uri to connect to
+ * @param params    Optional URI parameters
+ * @param vmode     Video mode
+ * @param peer      Call to share the event loop with, NULL for any
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int ua_connect_pinned(struct ua *ua, struct call **callp,
+		      const char *from_uri, const char *uri,
+		      const char *params, enum vidmode vmode,
+		      const struct call *peer)
 {
 	struct call *call = NULL;
 	struct mbuf *dialbuf;
@@ -754,6 +916,9 @@ int ua_connect(struct ua *ua, struct call **callp,
 	if (!ua || !str_isset(uri))
 		return EINVAL;
 
+	if (drain.active)
+		return EBUSY;
+
 	dialbuf = mbuf_alloc(64);
 	if (!dialbuf)
 		return ENOMEM;
@@ -776,7 +941,7 @@ int ua_connect(struct ua *ua, struct call **callp,
 	if (err)
 		goto out;
 
-	err = ua_call_alloc(&call, ua, vmode, NULL, NULL, from_uri);
+	err = ua_call_alloc(&call, ua, vmode, NULL, NULL, from_uri, peer);
 	if (err)
 		goto out;
 
@@ -1187,6 +1352,16 @@ static bool require_handler(const struct sip_hdr *hdr,
 }
 
 
+/* An INVITE without an offer may get video in the answer */
+static bool offer_video(const struct sip_msg *msg)
+{
+	const size_t len = mbuf_get_left(msg->mb);
+
+	return !len || 0 == re_regex((const char *)mbuf_buf(msg->mb), len,
+				     "m=video");
+}
+
+
 /* Handle incoming calls */
 static void sipsess_conn_handler(const struct sip_msg *msg, void *arg)
 {
@@ -1194,6 +1369,7 @@ static void sipsess_conn_handler(const struct sip_msg *msg, void *arg)
 	const struct sip_hdr *hdr;
 	struct ua *ua;
 	struct call *call = NULL;
+	enum vidmode vmode = VIDMODE_ON;
 	char to_uri[256];
 	int err;
 
@@ -1207,6 +1383,16 @@ static void sipsess_conn_handler(const struct sip_msg *msg, void *arg)
 		return;
 	}
 
+	/* shutting down, the other side can try elsewhere */
+	if (drain.active) {
+
+		info("ua: rejected call from %r (shutting down)\n",
+		     &msg->from.auri);
+		(void)sip_treply(NULL, uag.sip, msg, 503,
+				 "Service Unavailable");
+		return;
+	}
+
 	/* handle multiple calls */
 	if (config->call.max_calls &&
 	    list_count(&ua->calls) + 1 > config->call.max_calls) {
@@ -1217,6 +1403,16 @@ static void sipsess_conn_handler(const struct sip_msg *msg, void *arg)
 		return;
 	}
 
+	/* the CPU budget is used up, keep the calls we have */
+	if (governor_level() >= GOV_REJECT) {
+
+		info("ua: rejected call from %r (CPU budget)\n",
+		     &msg->from.auri);
+		(void)sip_treply(NULL, uag.sip, msg, 503,
+				 "Service Unavailable");
+		return;
+	}
+
 	/* Handle Require: header, check for any required extensions */
 	hdr = sip_msg_hdr_apply(msg, true, SIP_HDR_REQUIRE,
 				require_handler, ua);
@@ -1233,9 +1429,29 @@ static void sipsess_conn_handler(const struct sip_msg *msg, void *arg)
 		return;
 	}
 
+	/* the node must have room for the call, maybe only for audio */
+	switch (admit_call(offer_video(msg))) {
+
+	case ADMIT_REJECT:
+		info("ua: rejected call from %r (capacity)\n",
+		     &msg->from.auri);
+		(void)sip_treply(NULL, uag.sip, msg, 503,
+				 "Service Unavailable");
+		return;
+
+	case ADMIT_AUDIO:
+		info("ua: call from %r answered without video (capacity)\n",
+		     &msg->from.auri);
+		vmode = VIDMODE_OFF;
+		break;
+
+	default:
+		break;
+	}
+
 	(void)pl_strcpy(&msg->to.auri, to_uri, sizeof(to_uri));
 
-	err = ua_call_alloc(&call, ua, VIDMODE_ON, msg, NULL, to_uri);
+	err = ua_call_alloc(&call, ua, vmode, msg, NULL, to_uri, NULL);
 	if (err) {
 		warning("ua: call_alloc: %m\n", err);
 		goto error;
@@ -1260,6 +1476,7 @@ static void net_change_handler(void *arg)
 	info("IP-address changed: %j\n",
 	     net_laddr_af(baresip_network(), AF_INET));
 
+	eyeballs_flush();
 	(void)uag_reset_transp(true, true);
 }
 
@@ -1278,8 +1495,51 @@ static int cmd_quit(struct re_printf *pf, void *unused)
 }
 
 
+static int cmd_media_profile(struct re_printf *pf, void *unused)
+{
+	struct le *le;
+	int err = 0;
+
+	(void)unused;
+
+	for (le = list_head(uag_list()); le; le = le->next) {
+
+		const struct ua *ua = le->data;
+		struct le *lec;
+
+		for (lec = list_head(ua_calls(ua)); lec; lec = lec->next) {
+
+			const struct call *call = lec->data;
+
+			err |= re_hprintf(pf, "Call %s:\n%H", call_id(call),
+					  audio_print_profile,
+					  call_audio(call));
+#ifdef USE_VIDEO
+			err |= video_print_profile(pf, call_video(call));
+#endif
+		}
+	}
+
+	return err;
+}
+
+
+static int cmd_drain(struct re_printf *pf, void *unused)
+{
+	(void)unused;
+
+	return ua_drain_debug(pf);
+}
+
+
 static const struct cmd cmdv[] = {
 	{"quit", 'q', 0, "Quit",                     cmd_quit             },
+	{"regqueue", 0, 0, "Register queue status",  reg_queue_debug      },
+	{"callsetup", 0, 0, "Call setup latency",    call_setup_stats     },
+	{"mediaprof", 0, 0, "Media pipeline profile", cmd_media_profile   },
+	{"drain", 0, 0, "Shutdown drain status",      cmd_drain            },
+	{"msgstats", 0, 0, "Outgoing MESSAGE stats",  message_debug        },
+	{"admit", 0, 0, "Admission control status",   admit_debug          },
 };
 
 
@@ -1330,6 +1590,15 @@ int ua_init(const char *software, bool udp, bool tcp, bool tls,
 	uag.cfg = &cfg->sip;
 	bsize = cfg->sip.trans_bsize;
 
+	if (cfg->call.shards) {
+
+		err = shard_init(min(cfg->call.shards, (uint32_t)SHARD_MAX));
+		if (err) {
+			warning("ua: call_shards: %m\n", err);
+			return err;
+		}
+	}
+
 	uag.use_udp = udp;
 	uag.use_tcp = tcp;
 	uag.use_tls = tls;
@@ -1337,6 +1606,12 @@ int ua_init(const char *software, bool udp, bool tcp, bool tls,
 
 	list_init(&uag.ual);
 
+	err  = hash_alloc(&uag.ht_cuser, UA_HASH_SIZE);
+	err |= hash_alloc(&uag.ht_user, UA_HASH_SIZE);
+	err |= hash_alloc(&uag.ht_aor, UA_HASH_SIZE);
+	if (err)
+		goto out;
+
 	err = sip_alloc(&uag.sip, net_dnsc(net), bsize, bsize, bsize,
 			software, exit_handler, NULL);
 	if (err) {
@@ -1382,6 +1657,9 @@ int ua_init(const char *software, bool udp, bool tcp, bool tls,
  */
 void ua_close(void)
 {
+	tmr_cancel(&drain.tmr);
+	drain.active = false;
+
 	cmd_unregister(baresip_commands(), cmdv);
 	ui_reset();
 
@@ -1391,6 +1669,8 @@ void ua_close(void)
 	uag.sip      = mem_deref(uag.sip);
 	uag.eprm     = mem_deref(uag.eprm);
 
+	eyeballs_flush();
+
 #ifdef USE_TLS
 	uag.tls = mem_deref(uag.tls);
 #endif
@@ -1398,8 +1678,96 @@ void ua_close(void)
 	list_flush(&uag.ual);
 	list_flush(&uag.ehl);
 
+	uag.ht_cuser = mem_deref(uag.ht_cuser);
+	uag.ht_user  = mem_deref(uag.ht_user);
+	uag.ht_aor   = mem_deref(uag.ht_aor);
+
 	/* note: must be done before mod_close() */
 	module_app_unload();
+
+	/* the media of all calls is freed by now */
+	shard_close();
+}
+
+
+/* Close the User-Agents that are left, and the SIP transactions */
+static void drain_force(void)
+{
+	const uint32_t n = list_count(&uag.ual);
+
+	tmr_cancel(&drain.tmr);
+
+	warning("ua: drain: closing %u useragent%s by force\n",
+		n, n==1 ? "" : "s");
+
+	sipsess_close_all(uag.sock);
+	list_flush(&uag.ual);
+	sip_close(uag.sip, true);
+}
+
+
+static void drain_handler(void *arg)
+{
+	const uint64_t now = tmr_jiffies();
+	struct le *le;
+	(void)arg;
+
+	if (uag.cfg->drain_timeout &&
+	    now - drain.ts_start >= uag.cfg->drain_timeout * 1000ULL) {
+		drain_force();
+		return;
+	}
+
+	/* allow a burst of one tick at most */
+	drain.credit += (uint32_t)min(now - drain.ts, DRAIN_TICK) *
+		uag.cfg->drain_rate;
+	drain.ts = now;
+
+	while ((le = list_head(&uag.ual)) && drain.credit >= 1000) {
+
+		struct ua *ua = le->data;
+
+		drain.credit -= 1000;
+		drain.n_calls += list_count(&ua->calls);
+		++drain.n_closed;
+
+		/* the SIP stack is closed with the last one */
+		mem_deref(ua);
+	}
+
+	if (now - drain.ts_report >= DRAIN_REPORT) {
+		drain.ts_report = now;
+		info("%H", ua_drain_debug);
+	}
+
+	/* wait for the SIP stack to exit, or for the deadline */
+	if (list_isempty(&uag.ual)) {
+		drain.credit = 0;
+		tmr_start(&drain.tmr, DRAIN_REPORT, drain_handler, NULL);
+	}
+	else {
+		tmr_start(&drain.tmr, DRAIN_TICK, drain_handler, NULL);
+	}
+}
+
+
+/**
+ * Print the progress of the shutdown drain
+ *
+ * @param pf Print handler for debug output
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int ua_drain_debug(struct re_printf *pf)
+{
+	if (!drain.active)
+		return re_hprintf(pf, "ua: drain not running\n");
+
+	return re_hprintf(pf, "ua: drain %u/%u useragents closed,"
+			  " %u calls hung up, %u left, %llu ms\n",
+			  drain.n_closed, drain.n_total, drain.n_calls,
+			  list_count(&uag.ual),
+			  tmr_jiffies() - drain.ts_start);
 }
 
 
@@ -1415,6 +1783,15 @@ void ua_stop_all(bool forced)
 
 	info("ua: stop all (forced=%d)\n", forced);
 
+	/* stopped again while draining */
+	if (drain.active) {
+		if (forced)
+			drain_force();
+		else
+			info("%H", ua_drain_debug);
+		return;
+	}
+
 	/* check if someone else has grabbed a ref to ua */
 	le = uag.ual.head;
 	while (le) {
@@ -1425,6 +1802,7 @@ void ua_stop_all(bool forced)
 		if (mem_nrefs(ua) > 1) {
 
 			list_unlink(&ua->le);
+			ua_unindex(ua);
 			list_flush(&ua->calls);
 			mem_deref(ua);
 
@@ -1448,6 +1826,27 @@ void ua_stop_all(bool forced)
 		     n, n==1 ? "" : "s", forced ? "(Forced)" : "");
 	}
 
+	if (!forced && uag.cfg && uag.cfg->drain_rate &&
+	    !list_isempty(&uag.ual)) {
+
+		const uint64_t now = tmr_jiffies();
+
+		drain.active    = true;
+		drain.ts_start  = now;
+		drain.ts        = now;
+		drain.ts_report = now;
+		drain.credit    = 1000;
+		drain.n_total   = list_count(&uag.ual);
+		drain.n_closed  = 0;
+		drain.n_calls   = 0;
+
+		info("ua: draining %u useragents at %u per second\n",
+		     drain.n_total, uag.cfg->drain_rate);
+
+		drain_handler(NULL);
+		return;
+	}
+
 	if (forced)
 		sipsess_close_all(uag.sock);
 	else
@@ -1530,8 +1929,13 @@ int uag_reset_transp(bool reg, bool reinvite)
  */
 int ua_print_sip_status(struct re_printf *pf, void *unused)
 {
+	int err;
 	(void)unused;
-	return sip_debug(pf, uag.sip);
+
+	err  = sip_debug(pf, uag.sip);
+	err |= reg_conn_debug(pf);
+
+	return err;
 }
 
 
@@ -1540,6 +1944,8 @@ int ua_print_sip_status(struct re_printf *pf, void *unused)
  */
 int ua_print_calls(struct re_printf *pf, const struct ua *ua)
 {
+	const struct call *linev[CALL_LINENUM_MAX] = {NULL};
+	struct le *le;
 	uint32_t n, count=0;
 	uint32_t linenum;
 	int err = 0;
@@ -1554,11 +1960,20 @@ int ua_print_calls(struct re_printf *pf, const struct ua *ua)
 	err |= re_hprintf(pf, "\n--- List of active calls (%u): ---\n",
 			  n);
 
+	/* one pass over the calls, then print them in line order */
+	for (le = ua->calls.head; le; le = le->next) {
+
+		const struct call *call = le->data;
+
+		linenum = call_linenum(call);
+		if (linenum < CALL_LINENUM_MAX)
+			linev[linenum] = call;
+	}
+
 	for (linenum=CALL_LINENUM_MIN; linenum<CALL_LINENUM_MAX; linenum++) {
 
-		const struct call *call;
+		const struct call *call = linev[linenum];
 
-		call = call_find_linenum(&ua->calls, linenum);
 		if (call) {
 			++count;
 
@@ -1645,6 +2060,9 @@ const char *uag_event_str(enum ua_event ev)
 	case UA_EVENT_CALL_TRANSFER_FAILED: return "TRANSFER_FAILED";
 	case UA_EVENT_CALL_DTMF_START:      return "CALL_DTMF_START";
 	case UA_EVENT_CALL_DTMF_END:        return "CALL_DTMF_END";
+	case UA_EVENT_CALL_SETUP:           return "CALL_SETUP";
+	case UA_EVENT_CALL_STATS:           return "CALL_STATS";
+	case UA_EVENT_MODULE:               return "MODULE";
 	default: return "?";
 	}
 }
@@ -1678,6 +2096,40 @@ int ua_sipfd(const struct ua *ua)
 }
 
 
+/** A name to look up, with its case-folded hash */
+struct ua_key {
+	const struct pl *pl;
+	uint32_t key;
+};
+
+
+static bool cuser_cmp_handler(struct le *le, void *arg)
+{
+	const struct ua *ua = le->data;
+	const struct ua_key *k = arg;
+
+	return ua->key_cuser == k->key && 0 == pl_strcasecmp(k->pl, ua->cuser);
+}
+
+
+static bool user_cmp_handler(struct le *le, void *arg)
+{
+	const struct ua *ua = le->data;
+	const struct ua_key *k = arg;
+
+	return ua->key_user == k->key &&
+		0 == pl_casecmp(k->pl, &ua->acc->luri.user);
+}
+
+
+static bool aor_cmp_handler(struct le *le, void *arg)
+{
+	const struct ua *ua = le->data;
+
+	return 0 == str_cmp(ua->acc->aor, arg);
+}
+
+
 /**
  * Find the correct UA from the contact user
  *
@@ -1687,24 +2139,23 @@ int ua_sipfd(const struct ua *ua)
  */
 struct ua *uag_find(const struct pl *cuser)
 {
+	struct ua_key k;
 	struct le *le;
 
-	for (le = uag.ual.head; le; le = le->next) {
-		struct ua *ua = le->data;
+	if (!cuser)
+		return NULL;
 
-		if (0 == pl_strcasecmp(cuser, ua->cuser))
-			return ua;
-	}
+	k.pl  = cuser;
+	k.key = hash_joaat_ci(cuser->p, cuser->l);
 
-	/* Try also matching by AOR, for better interop */
-	for (le = uag.ual.head; le; le = le->next) {
-		struct ua *ua = le->data;
+	le = hash_lookup(uag.ht_cuser, k.key, cuser_cmp_handler, &k);
+	if (le)
+		return le->data;
 
-		if (0 == pl_casecmp(cuser, &ua->acc->luri.user))
-			return ua;
-	}
+	/* Try also matching by AOR, for better interop */
+	le = hash_lookup(uag.ht_user, k.key, user_cmp_handler, &k);
 
-	return NULL;
+	return le ? le->data : NULL;
 }
 
 
@@ -1719,16 +2170,13 @@ struct ua *uag_find_aor(const char *aor)
 {
 	struct le *le;
 
-	for (le = uag.ual.head; le; le = le->next) {
-		struct ua *ua = le->data;
+	if (!str_isset(aor))
+		return list_ledata(list_head(&uag.ual));
 
-		if (str_isset(aor) && str_cmp(ua->acc->aor, aor))
-			continue;
-
-		return ua;
-	}
+	le = hash_lookup(uag.ht_aor, hash_joaat_str(aor),
+			 aor_cmp_handler, (void *)aor);
 
-	return NULL;
+	return le ? le->data : NULL;
 }
 
 
@@ -1873,11 +2321,36 @@ static void eh_destructor(void *arg)
 }
 
 
+/**
+ * Register an event handler for all events of all User-Agents
+ *
+ * @param h   Event handler
+ * @param arg Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
 int uag_event_register(ua_event_h *h, void *arg)
+{
+	return uag_event_register_mask(h, UA_EVENT_ALL, NULL, arg);
+}
+
+
+/**
+ * Register an event handler for some events
+ *
+ * @param h    Event handler
+ * @param mask Events to handle, as a mask of UA_EVENT_BIT()
+ * @param ua   Only handle the events of this User-Agent (optional)
+ * @param arg  Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int uag_event_register_mask(ua_event_h *h, uint32_t mask,
+			    const struct ua *ua, void *arg)
 {
 	struct ua_eh *eh;
 
-	if (!h)
+	if (!h || !mask)
 		return EINVAL;
 
 	uag_event_unregister(h);
@@ -1887,6 +2360,8 @@ int uag_event_register(ua_event_h *h, void *arg)
 		return ENOMEM;
 
 	eh->h = h;
+	eh->mask = mask;
+	eh->ua = ua;
 	eh->arg = arg;
 
 	list_append(&uag.ehl, &eh->le, eh);
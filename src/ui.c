@@ -117,6 +117,11 @@ int ui_input_pl(struct re_printf *pf, const struct pl *pl)
 	if (!pf || !pl)
 		return EINVAL;
 
+	/* a complete long command is run without the line editor */
+	if (pl->l > 1 && pl->p[0] == '/')
+		return cmd_process_long(commands, pl->p + 1, pl->l - 1,
+					pf, NULL);
+
 	for (i=0; i<pl->l; i++) {
 		err |= cmd_process(commands, &ctx, pl->p[i], pf, NULL);
 	}
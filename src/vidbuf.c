@@ -0,0 +1,404 @@
+/**
+ * @file vidbuf.c  Video frame assembly buffer
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * The packets of a video frame share one RTP timestamp, and the last
+ * packet has the marker bit set. The buffer collects the packets per
+ * frame and keeps the frames in decode order. A frame is complete when
+ * it has the marker packet and all packets since the end of the frame
+ * before it, since every frame may refer to the one before.
+ *
+ * A complete frame is given out as soon as the frames before it are
+ * out, so it never waits for more than the packets it depends on. A
+ * frame that is not complete is given out after the wait, which should
+ * be long enough for a retransmission. The loss is then reported to
+ * the receiver before the packets of the frame, so that the decoder can
+ * ask for a new picture. The buffer is sized in frames, so a large
+ * keyframe takes one frame of it and not hundreds.
+ */
+
+
+enum {
+	FRAMES_MAX = 32,        /**< Frames in the buffer               */
+	PKTS_MAX   = 2048,      /**< Packets in the buffer              */
+};
+
+struct vidbuf_pkt {
+	struct le le;
+	struct rtp_header hdr;
+	struct mbuf *mb;
+};
+
+struct vidbuf_frame {
+	struct le le;
+	struct list pktl;       /**< Packets in sequence order          */
+	uint32_t ts;            /**< RTP timestamp of the frame         */
+	uint16_t seq_lo;        /**< Lowest sequence number received    */
+	uint16_t seq_hi;        /**< Highest sequence number received   */
+	bool marker;            /**< The last packet was received       */
+	unsigned n;             /**< Number of packets received         */
+	uint64_t ts_first;      /**< Arrival of the first packet [ms]   */
+};
+
+struct vidbuf {
+	struct list framel;     /**< Frames in decode order             */
+	struct tmr tmr;         /**< Gives out an incomplete frame      */
+	uint32_t wait;          /**< Wait for missing packets [ms]      */
+	unsigned n_frames;      /**< Frames in the buffer               */
+	unsigned n_pkts;        /**< Packets in the buffer              */
+	uint16_t seq_next;      /**< First packet of the next frame     */
+	bool started;           /**< seq_next is valid                  */
+	bool running;           /**< Frames are being given out         */
+	struct vidbuf_stat stat;
+	vidbuf_h *h;
+	void *arg;
+};
+
+
+static void vidbuf_release(struct vidbuf *vb);
+
+
+static inline bool seq_less(uint16_t a, uint16_t b)
+{
+	return (int16_t)(a - b) < 0;
+}
+
+
+static void destructor(void *arg)
+{
+	struct vidbuf *vb = arg;
+
+	tmr_cancel(&vb->tmr);
+	list_flush(&vb->framel);
+}
+
+
+static void pkt_destructor(void *arg)
+{
+	struct vidbuf_pkt *pkt = arg;
+
+	list_unlink(&pkt->le);
+	mem_deref(pkt->mb);
+}
+
+
+static void frame_destructor(void *arg)
+{
+	struct vidbuf_frame *f = arg;
+
+	list_unlink(&f->le);
+	list_flush(&f->pktl);
+}
+
+
+static void tmr_handler(void *arg)
+{
+	struct vidbuf *vb = arg;
+
+	vidbuf_release(vb);
+}
+
+
+static struct vidbuf_frame *frame_lookup(struct vidbuf *vb, uint32_t ts)
+{
+	struct le *le;
+
+	for (le = vb->framel.tail; le; le = le->prev) {
+
+		struct vidbuf_frame *f = le->data;
+
+		if (f->ts == ts)
+			return f;
+	}
+
+	return NULL;
+}
+
+
+static struct vidbuf_frame *frame_alloc(struct vidbuf *vb,
+					const struct rtp_header *hdr)
+{
+	struct vidbuf_frame *f;
+	struct le *le;
+
+	f = mem_zalloc(sizeof(*f), frame_destructor);
+	if (!f)
+		return NULL;
+
+	f->ts       = hdr->ts;
+	f->seq_lo   = hdr->seq;
+	f->seq_hi   = hdr->seq;
+	f->ts_first = tmr_jiffies();
+
+	/* the frames do not overlap in sequence numbers */
+	for (le = vb->framel.tail; le; le = le->prev) {
+
+		struct vidbuf_frame *g = le->data;
+
+		if (seq_less(g->seq_lo, hdr->seq))
+			break;
+	}
+
+	if (le)
+		list_insert_after(&vb->framel, le, &f->le, f);
+	else
+		list_prepend(&vb->framel, &f->le, f);
+
+	++vb->n_frames;
+
+	return f;
+}
+
+
+static int frame_add(struct vidbuf_frame *f, const struct rtp_header *hdr,
+		     struct mbuf *mb)
+{
+	struct vidbuf_pkt *pkt;
+	struct le *le;
+
+	for (le = f->pktl.tail; le; le = le->prev) {
+
+		struct vidbuf_pkt *p = le->data;
+
+		if (p->hdr.seq == hdr->seq)
+			return EALREADY;
+
+		if (seq_less(p->hdr.seq, hdr->seq))
+			break;
+	}
+
+	pkt = mem_zalloc(sizeof(*pkt), pkt_destructor);
+	if (!pkt)
+		return ENOMEM;
+
+	pkt->hdr = *hdr;
+	pkt->mb  = mem_ref(mb);
+
+	if (le)
+		list_insert_after(&f->pktl, le, &pkt->le, pkt);
+	else
+		list_prepend(&f->pktl, &pkt->le, pkt);
+
+	if (seq_less(hdr->seq, f->seq_lo))
+		f->seq_lo = hdr->seq;
+	if (seq_less(f->seq_hi, hdr->seq))
+		f->seq_hi = hdr->seq;
+	if (hdr->m)
+		f->marker = true;
+
+	++f->n;
+
+	return 0;
+}
+
+
+static bool frame_complete(const struct vidbuf_frame *f, uint16_t start)
+{
+	return f->marker && f->seq_lo == start &&
+		(uint16_t)(f->seq_hi - start + 1) == f->n;
+}
+
+
+/* Give out the packets of a frame, with a loss report before a gap */
+static void frame_release(struct vidbuf *vb, struct vidbuf_frame *f,
+			  uint16_t start)
+{
+	uint16_t seq = start;
+	struct le *le;
+
+	vb->stat.delay = (uint32_t)(tmr_jiffies() - f->ts_first);
+	++vb->stat.n_get;
+
+	list_unlink(&f->le);
+	--vb->n_frames;
+	vb->n_pkts -= f->n;
+
+	for (le = f->pktl.head; le; le = le->next) {
+
+		struct vidbuf_pkt *pkt = le->data;
+
+		if (seq_less(seq, pkt->hdr.seq))
+			vb->h(&pkt->hdr, NULL, vb->arg);
+
+		vb->h(&pkt->hdr, pkt->mb, vb->arg);
+
+		seq = pkt->hdr.seq + 1;
+	}
+
+	vb->seq_next = seq;
+	vb->started  = true;
+
+	mem_deref(f);
+}
+
+
+static void vidbuf_release(struct vidbuf *vb)
+{
+	struct vidbuf_frame *f;
+	const uint64_t now = tmr_jiffies();
+
+	/* the handler may put packets again */
+	if (vb->running)
+		return;
+
+	vb->running = true;
+
+	while ((f = list_ledata(list_head(&vb->framel)))) {
+
+		const uint16_t start = vb->started ? vb->seq_next : f->seq_lo;
+
+		if (!frame_complete(f, start)) {
+
+			if (vb->n_frames > FRAMES_MAX || vb->n_pkts > PKTS_MAX)
+				++vb->stat.n_overflow;
+			else if (now < f->ts_first + vb->wait)
+				break;
+
+			++vb->stat.n_incomplete;
+		}
+
+		frame_release(vb, f, start);
+	}
+
+	vb->running = false;
+
+	if (f)
+		tmr_start(&vb->tmr, f->ts_first + vb->wait - now,
+			  tmr_handler, vb);
+	else
+		tmr_cancel(&vb->tmr);
+}
+
+
+/**
+ * Allocate a video frame assembly buffer
+ *
+ * @param vbp  Pointer to allocated buffer
+ * @param wait Time to wait for the missing packets of a frame [ms]
+ * @param h    Handler for the packets given out, mb is NULL for a loss
+ * @param arg  Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int vidbuf_alloc(struct vidbuf **vbp, uint32_t wait, vidbuf_h *h, void *arg)
+{
+	struct vidbuf *vb;
+
+	if (!vbp || !h)
+		return EINVAL;
+
+	vb = mem_zalloc(sizeof(*vb), destructor);
+	if (!vb)
+		return ENOMEM;
+
+	vb->wait = wait;
+	vb->h    = h;
+	vb->arg  = arg;
+
+	*vbp = vb;
+
+	return 0;
+}
+
+
+/**
+ * Put a received RTP packet in the buffer, and give out the frames that
+ * are ready
+ *
+ * @param vb  Video frame buffer
+ * @param hdr RTP header
+ * @param mb  RTP payload
+ *
+ * @return 0 if success, EALREADY if late or duplicate, otherwise
+ *         errorcode
+ */
+int vidbuf_put(struct vidbuf *vb, const struct rtp_header *hdr,
+	       struct mbuf *mb)
+{
+	struct vidbuf_frame *f;
+	int err;
+
+	if (!vb || !hdr || !mb)
+		return EINVAL;
+
+	if (vb->started && seq_less(hdr->seq, vb->seq_next)) {
+		++vb->stat.n_late;
+		return EALREADY;
+	}
+
+	f = frame_lookup(vb, hdr->ts);
+	if (!f) {
+		f = frame_alloc(vb, hdr);
+		if (!f)
+			return ENOMEM;
+	}
+
+	err = frame_add(f, hdr, mb);
+	if (err) {
+		if (!f->n) {
+			--vb->n_frames;
+			mem_deref(f);
+		}
+		return err;
+	}
+
+	++vb->n_pkts;
+	++vb->stat.n_put;
+
+	vidbuf_release(vb);
+
+	return 0;
+}
+
+
+/**
+ * Drop all frames and start again with the next packet
+ *
+ * @param vb Video frame buffer
+ */
+void vidbuf_flush(struct vidbuf *vb)
+{
+	if (!vb)
+		return;
+
+	tmr_cancel(&vb->tmr);
+	list_flush(&vb->framel);
+
+	vb->n_frames = 0;
+	vb->n_pkts   = 0;
+	vb->started  = false;
+}
+
+
+int vidbuf_stats(const struct vidbuf *vb, struct vidbuf_stat *st)
+{
+	if (!vb || !st)
+		return EINVAL;
+
+	*st = vb->stat;
+
+	return 0;
+}
+
+
+int vidbuf_debug(struct re_printf *pf, const struct vidbuf *vb)
+{
+	if (!vb)
+		return 0;
+
+	return re_hprintf(pf, "--- Video frame buffer (wait %u ms) ---\n"
+			  " frames=%u packets=%u\n"
+			  " put=%u get=%u incomplete=%u late=%u"
+			  " overflow=%u delay=%ums\n",
+			  vb->wait, vb->n_frames, vb->n_pkts,
+			  vb->stat.n_put, vb->stat.n_get,
+			  vb->stat.n_incomplete, vb->stat.n_late,
+			  vb->stat.n_overflow, vb->stat.delay);
+}
@@ -0,0 +1,222 @@
+/**
+ * @file vidchange.c  Changed regions of a video picture
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * The picture is divided into blocks of 16 x 16 pixels, the macroblocks
+ * of the encoders, and a hash of the pixels of each block is compared
+ * with the hash from the previous picture. Screen content is copied
+ * pixel by pixel, so a block that did not change has the same hash.
+ *
+ * A block stays active for a while after it changed, so that the
+ * encoder can refine it over the next pictures. The map of the active
+ * blocks is given to the encoder, which spends the bits there.
+ */
+
+
+enum {
+	BLOCK = VIDENC_ROI_BLOCK,
+};
+
+struct vidchange {
+	struct vidsz size;      /**< Size of the picture                */
+	unsigned cols, rows;    /**< Number of blocks                   */
+	uint64_t *hashv;        /**< Hash of each block                 */
+	uint16_t *agev;         /**< Pictures since the block changed   */
+	uint8_t *mapv;          /**< 1 if the block is active           */
+	unsigned n_active;      /**< Number of active blocks            */
+	uint32_t hold;          /**< Pictures a block stays active      */
+};
+
+
+static void destructor(void *arg)
+{
+	struct vidchange *vc = arg;
+
+	mem_deref(vc->hashv);
+	mem_deref(vc->agev);
+	mem_deref(vc->mapv);
+}
+
+
+/*
+ * Each step is a bijection of the hash for a given word, so two blocks
+ * that differ in one word always have different hashes.
+ */
+static uint64_t hash_rect(uint64_t hash, const uint8_t *p, unsigned stride,
+			  unsigned w, unsigned h)
+{
+	const uint64_t prime = 0x100000001b3ULL;
+	unsigned x, y;
+
+	for (y=0; y<h; y++) {
+
+		for (x=0; x+8 <= w; x+=8) {
+			uint64_t word;
+
+			memcpy(&word, &p[x], sizeof(word));
+			hash = (hash ^ word) * prime;
+		}
+
+		for (; x<w; x++)
+			hash = (hash ^ p[x]) * prime;
+
+		p += stride;
+	}
+
+	return hash;
+}
+
+
+static int resize(struct vidchange *vc, const struct vidsz *size)
+{
+	const unsigned cols = (size->w + BLOCK - 1) / BLOCK;
+	const unsigned rows = (size->h + BLOCK - 1) / BLOCK;
+	const size_t n = (size_t)cols * rows;
+
+	vc->hashv = mem_deref(vc->hashv);
+	vc->agev  = mem_deref(vc->agev);
+	vc->mapv  = mem_deref(vc->mapv);
+	vc->cols  = vc->rows = 0;
+
+	vc->hashv = mem_zalloc(n * sizeof(*vc->hashv), NULL);
+	vc->agev  = mem_zalloc(n * sizeof(*vc->agev), NULL);
+	vc->mapv  = mem_zalloc(n * sizeof(*vc->mapv), NULL);
+	if (!vc->hashv || !vc->agev || !vc->mapv)
+		return ENOMEM;
+
+	vc->size = *size;
+	vc->cols = cols;
+	vc->rows = rows;
+
+	return 0;
+}
+
+
+/**
+ * Allocate a detector of the changed regions of a picture
+ *
+ * @param vcp  Pointer to allocated detector
+ * @param hold Number of pictures that a block stays active after it
+ *             changed
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int vidchange_alloc(struct vidchange **vcp, uint32_t hold)
+{
+	struct vidchange *vc;
+
+	if (!vcp)
+		return EINVAL;
+
+	vc = mem_zalloc(sizeof(*vc), destructor);
+	if (!vc)
+		return ENOMEM;
+
+	vc->hold = max(hold, 1u);
+
+	*vcp = vc;
+
+	return 0;
+}
+
+
+/**
+ * Compare a picture with the previous one
+ *
+ * @param vc    Change detector
+ * @param frame Video frame, in YUV420P format
+ *
+ * @return True if any block is active, false if the picture is static
+ */
+bool vidchange_update(struct vidchange *vc, const struct vidframe *frame)
+{
+	const uint64_t seed = 0xcbf29ce484222325ULL;
+	unsigned bx, by, cw, ch;
+	size_t i = 0;
+
+	if (!vc || !frame || frame->fmt != VID_FMT_YUV420P)
+		return true;
+
+	if (!vidsz_cmp(&vc->size, &frame->size)) {
+
+		if (resize(vc, &frame->size))
+			return true;
+	}
+
+	cw = (frame->size.w + 1) / 2;
+	ch = (frame->size.h + 1) / 2;
+
+	vc->n_active = 0;
+
+	for (by=0; by<vc->rows; by++) {
+
+		const unsigned y = by * BLOCK;
+		const unsigned h = min(BLOCK, frame->size.h - y);
+		const unsigned hc = min(BLOCK/2, ch - y/2);
+
+		for (bx=0; bx<vc->cols; bx++, i++) {
+
+			const unsigned x = bx * BLOCK;
+			const unsigned w = min(BLOCK, frame->size.w - x);
+			const unsigned wc = min(BLOCK/2, cw - x/2);
+			uint64_t hash;
+
+			hash = hash_rect(seed, frame->data[0] +
+					 y * frame->linesize[0] + x,
+					 frame->linesize[0], w, h);
+			hash = hash_rect(hash, frame->data[1] +
+					 y/2 * frame->linesize[1] + x/2,
+					 frame->linesize[1], wc, hc);
+			hash = hash_rect(hash, frame->data[2] +
+					 y/2 * frame->linesize[2] + x/2,
+					 frame->linesize[2], wc, hc);
+
+			if (hash != vc->hashv[i]) {
+				vc->hashv[i] = hash;
+				vc->agev[i]  = 0;
+			}
+			else if (vc->agev[i] < UINT16_MAX) {
+				++vc->agev[i];
+			}
+
+			vc->mapv[i] = vc->agev[i] < vc->hold;
+			vc->n_active += vc->mapv[i];
+		}
+	}
+
+	return vc->n_active > 0;
+}
+
+
+/**
+ * Get the map of the active blocks of the last picture
+ *
+ * @param vc   Change detector
+ * @param cols Returns the number of block columns
+ * @param rows Returns the number of block rows
+ *
+ * @return One byte per block, row by row, 1 if active, otherwise 0.
+ *         NULL if all blocks are active
+ */
+const uint8_t *vidchange_map(const struct vidchange *vc,
+			     unsigned *cols, unsigned *rows)
+{
+	if (!vc || !vc->mapv || vc->n_active == vc->cols * vc->rows)
+		return NULL;
+
+	if (cols)
+		*cols = vc->cols;
+	if (rows)
+		*rows = vc->rows;
+
+	return vc->mapv;
+}
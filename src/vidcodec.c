@@ -6,9 +6,21 @@
 
 #include <re.h>
 #include <baresip.h>
+#include "core.h"
 
 
+enum { CODEC_HASH_SIZE = 32 };
+
+struct find {
+	const char *name;
+	const char *variant;
+	bool enc;
+	bool dec;
+	const struct vidcodec *vc;   /* the codec that was found */
+};
+
 static struct list vidcodecl;
+static struct hash *vidcodech;   /* the codecs by name, for lookups */
 
 
 /**
@@ -21,7 +33,12 @@ void vidcodec_register(struct vidcodec *vc)
 	if (!vc)
 		return;
 
+	if (!vidcodech && hash_alloc(&vidcodech, CODEC_HASH_SIZE))
+		return;
+
 	list_append(&vidcodecl, &vc->le, vc);
+	hash_append(vidcodech, hash_joaat_ci(vc->name, str_len(vc->name)),
+		    &vc->he, vc);
 
 	info("vidcodec: %s\n", vc->name);
 }
@@ -38,6 +55,56 @@ void vidcodec_unregister(struct vidcodec *vc)
 		return;
 
 	list_unlink(&vc->le);
+	hash_unlink(&vc->he);
+
+	if (list_isempty(&vidcodecl))
+		vidcodech = mem_deref(vidcodech);
+}
+
+
+static bool find_handler(struct le *le, void *arg)
+{
+	const struct vidcodec *vc = le->data;
+	struct find *f = arg;
+
+	if (f->name && 0 != str_casecmp(f->name, vc->name))
+		return false;
+
+	if (f->variant && 0 != str_casecmp(f->variant, vc->variant))
+		return false;
+
+	if (f->enc || f->dec) {
+
+		/* a codec that is loaded on demand */
+		if (!vc->encupdh && !vc->decupdh) {
+			vc = module_lazy_vidcodec(vc);
+			if (!vc)
+				return false;
+		}
+
+		if ((f->enc && !vc->ench) || (f->dec && !vc->dech))
+			return false;
+	}
+
+	f->vc = vc;
+
+	return true;
+}
+
+
+/* The codecs with the same name are in order of registration */
+static const struct vidcodec *find(struct find *f)
+{
+	if (f->name) {
+		(void)hash_lookup(vidcodech,
+				  hash_joaat_ci(f->name, str_len(f->name)),
+				  find_handler, f);
+	}
+	else {
+		(void)list_apply(&vidcodecl, true, find_handler, f);
+	}
+
+	return f->vc;
 }
 
 
@@ -51,22 +118,9 @@ void vidcodec_unregister(struct vidcodec *vc)
  */
 const struct vidcodec *vidcodec_find(const char *name, const char *variant)
 {
-	struct le *le;
-
-	for (le=vidcodecl.head; le; le=le->next) {
-
-		struct vidcodec *vc = le->data;
-
-		if (name && 0 != str_casecmp(name, vc->name))
-			continue;
-
-		if (variant && 0 != str_casecmp(variant, vc->variant))
-			continue;
-
-		return vc;
-	}
+	struct find f = {name, variant, false, false, NULL};
 
-	return NULL;
+	return find(&f);
 }
 
 
@@ -79,20 +133,9 @@ const struct vidcodec *vidcodec_find(const char *name, const char *variant)
  */
 const struct vidcodec *vidcodec_find_encoder(const char *name)
 {
-	struct le *le;
+	struct find f = {name, NULL, true, false, NULL};
 
-	for (le=vidcodecl.head; le; le=le->next) {
-
-		struct vidcodec *vc = le->data;
-
-		if (name && 0 != str_casecmp(name, vc->name))
-			continue;
-
-		if (vc->ench)
-			return vc;
-	}
-
-	return NULL;
+	return find(&f);
 }
 
 
@@ -105,20 +148,9 @@ const struct vidcodec *vidcodec_find_encoder(const char *name)
  */
 const struct vidcodec *vidcodec_find_decoder(const char *name)
 {
-	struct le *le;
-
-	for (le=vidcodecl.head; le; le=le->next) {
-
-		struct vidcodec *vc = le->data;
-
-		if (name && 0 != str_casecmp(name, vc->name))
-			continue;
-
-		if (vc->dech)
-			return vc;
-	}
+	struct find f = {name, NULL, false, true, NULL};
 
-	return NULL;
+	return find(&f);
 }
 
 
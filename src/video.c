@@ -7,6 +7,9 @@
  */
 #include <string.h>
 #include <stdlib.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -27,15 +30,28 @@
 enum {
 	SRATE = 90000,
 	MAX_MUTED_FRAMES = 3,
+	DEC_QUEUE_MAX = 64,     /**< Packets waiting for the decoder thread */
+	HOLD_MAX = 32,          /**< Frames held back for lip-sync          */
 };
 
 /** Video transmit parameters */
 enum {
 	MEDIA_POLL_RATE = 250,                 /**< in [Hz]             */
-	BURST_MAX       = 8192,                /**< in bytes            */
-	RTP_PRESZ       = 4 + RTP_HEADER_SIZE, /**< TURN and RTP header */
+	BURST_MAX       = 8192,                /**< Token bucket [bytes] */
+	RTP_PRESZ       = 4 + RTP_HEADER_SIZE + 16, /**< TURN, RTP hdr, ext */
 	RTP_TRAILSZ     = 12 + 4,              /**< SRTP/SRTCP trailer  */
-	PICUP_INTERVAL  = 500,
+	VIDQENT_PKTSZ   = 1280,                /**< Default packet size */
+	VIDQENT_POOL_MAX = 256,                /**< Max recycled packets */
+	VIDQ_RING       = 1024,                /**< Packets to the pacer */
+	VTX_CMDQ        = 32,                  /**< Encoder commands     */
+	BITRATE_MIN     = 64000,               /**< Congestion ctrl floor */
+	PICUP_INTERVAL  = 500,                 /**< Wait for keyframe [ms] */
+	PICUP_WAIT_MAX  = 4000,                /**< Longest wait [ms]   */
+	NACK_WAIT       = 200,                 /**< Wait for resends [ms] */
+	RTXQ_SIZE       = 32,                  /**< Queued NACK items    */
+	PACER_HIST      = 10,                  /**< Queue delay buckets  */
+	STATIC_REFRESH  = 1000,                /**< Static picture [ms] */
+	CHANGE_HOLD     = 500,                 /**< Refine change [ms]  */
 };
 
 
@@ -67,6 +83,47 @@ enum {
  *</pre>
  */
 
+/*
+ * The pacer sends at pacing [%] of the target bitrate from a token
+ * bucket of BURST_MAX bytes, which may go into debt by one packet. The
+ * queues are served in strict priority: first the retransmissions that
+ * the peer asked for with NACK, then the media packets in sendq. The
+ * time that each media packet waited in sendq is kept in a histogram.
+ *
+ * When the oldest packet in sendq is older than video_sendq_max, the
+ * frames that have not started to go out are dropped, each frame as a
+ * whole, also its packets that the encoder has not written yet. A frame
+ * that is partly sent is always finished. After a drop the encoder is
+ * asked for a keyframe at a lower bitrate.
+ *
+ * The retransmission queue and the sendq are only used by the main
+ * thread, from the RTCP handler and the pacer timer, so they are not
+ * locked. The encoder hands its packets over through a ring.
+ */
+struct pacer_layer {
+	uint32_t ts_sent;                  /**< Frame of last packet sent */
+	bool open;                         /**< Frame is partly sent      */
+	uint32_t ts_drop;                  /**< Frame being dropped       */
+	bool drop;                         /**< Dropping ts_drop          */
+};
+
+struct pacer {
+	int64_t tokens;                    /**< Token bucket [bytes]      */
+	struct gnack rtxq[RTXQ_SIZE];      /**< Pending NACK items        */
+	unsigned rtxq_head;                /**< First item in rtxq        */
+	unsigned rtxq_n;                   /**< Number of items in rtxq   */
+	uint64_t n_media;                  /**< Media packets sent        */
+	uint64_t n_resent;                 /**< Packets resent            */
+	uint64_t n_rtx_drop;               /**< NACK items dropped        */
+	uint64_t delay_sum;                /**< Total queue delay [ms]    */
+	uint32_t delay_max;                /**< Largest queue delay [ms]  */
+	uint64_t delayv[PACER_HIST];       /**< Queue delay, 2^n [ms]     */
+	uint64_t n_drop;                   /**< Frames dropped, too old   */
+	uint32_t age;                      /**< Age of oldest packet [ms] */
+	struct pacer_layer layerv[STREAM_SIMULCAST_MAX]; /**< Per layer   */
+};
+
+
 /**
  * Video stream - transmitter/encoder direction
 
@@ -82,28 +139,99 @@ enum {
                          (optional)
  \endverbatim
  */
+/** One lower simulcast layer, encoded from a downscaled frame */
+struct vlayer {
+	struct vtx *vtx;                   /**< Parent                    */
+	unsigned ix;                       /**< Layer number, 1 and up    */
+	struct videnc_state *enc;          /**< Video encoder state       */
+	struct vidframe *frame;            /**< Downscaled frame          */
+	uint32_t bitrate;                  /**< Encoder bitrate [bit/s]   */
+};
+
+/** Encoder made ahead of a codec change, switched to between frames */
+struct enc_next {
+	const struct vidcodec *vc;         /**< Video codec               */
+	struct videnc_state *enc;          /**< Video encoder state       */
+	struct videnc_state *encv[STREAM_SIMULCAST_MAX - 1]; /**< Layers  */
+	struct videnc_param prm;           /**< Encoder params            */
+	char *fmtp;                        /**< Encoder fmtp              */
+	int pt;                            /**< Payload type of encoder   */
+};
+
+/** Encoder control, from the main thread to the encoder */
+enum vtx_cmd_type {
+	VTX_CMD_BITRATE,                   /**< New target bitrate        */
+	VTX_CMD_KEYFRAME,                  /**< Send a keyframe           */
+	VTX_CMD_CODEC,                     /**< Switch to a new encoder   */
+};
+
+struct vtx_cmd {
+	enum vtx_cmd_type type;            /**< Command                   */
+	uint32_t bitrate;                  /**< Target bitrate [bit/s]    */
+	struct enc_next *en;               /**< Encoder to switch to      */
+};
+
 struct vtx {
 	struct video *video;               /**< Parent                    */
 	const struct vidcodec *vc;         /**< Current Video encoder     */
 	struct videnc_state *enc;          /**< Video encoder state       */
 	struct vidsrc_prm vsrc_prm;        /**< Video source parameters   */
 	struct vidsz vsrc_size;            /**< Video source size         */
-	struct vidsrc_st *vsrc;            /**< Video source              */
+	struct vidsrc_sub *vsub;           /**< Video source subscription */
 	struct lock *lock;                 /**< Lock for encoder          */
 	struct vidframe *frame;            /**< Source frame              */
 	struct vidframe *mute_frame;       /**< Frame with muted video    */
-	struct lock *lock_tx;              /**< Protect the sendq         */
-	struct list sendq;                 /**< Tx-Queue (struct vidqent) */
-	struct tmr tmr_rtp;                /**< Timer for sending RTP     */
-	unsigned skipc;                    /**< Number of frames skipped  */
+	struct ptring *pktq;               /**< Packets to the pacer      */
+	struct ptring *freeq;              /**< Recycled queue entries    */
+	struct list sendq;                 /**< Tx-Queue, of the pacer    */
+	unsigned n_sendq;                  /**< Packets in pktq and sendq */
+	struct ptring *cmdq;               /**< Commands to the encoder   */
+	struct hktmr tmr_rtp;              /**< Timer for sending RTP     */
+	uint64_t ts_poll;                  /**< Time of last send [ms]    */
+	struct pacer pacer;                /**< Token bucket and queues   */
+	unsigned skipc;                    /**< Frames skipped (atomic)   */
+	unsigned n_load;                   /**< Frames seen under load    */
 	struct list filtl;                 /**< Filters in encoding order */
 	char device[64];                   /**< Source device name        */
 	int muted_frames;                  /**< # of muted frames sent    */
 	uint32_t ts_tx;                    /**< Outgoing RTP timestamp    */
 	bool picup;                        /**< Send picture update       */
+	bool picup_full;                   /**< pktq was full (atomic)    */
+	uint64_t ts_key;                   /**< Last keyframe sent [ms]   */
+	unsigned n_picup_rx;               /**< Picture updates received  */
+	unsigned n_key;                    /**< Keyframes sent on request */
 	bool muted;                        /**< Muted flag                */
 	int frames;                        /**< Number of frames sent     */
 	int efps;                          /**< Estimated frame-rate      */
+	uint32_t bitrate;                  /**< Pacer bitrate [bit/s]     */
+	struct videnc_param enc_prm;       /**< Current encoder params    */
+	char *enc_fmtp;                    /**< Current encoder fmtp      */
+	uint32_t enc_bitrate;              /**< Bitrate sent to encoder   */
+	const struct vidcodec *vc_set;     /**< Codec sent to encoder     */
+	struct enc_next *enc_old;          /**< Switched out, to be freed */
+	struct vlayer simv[STREAM_SIMULCAST_MAX - 1]; /**< Lower layers   */
+	unsigned n_sim;                    /**< Number of lower layers    */
+	struct encshare_sub *eshare;       /**< Shared encoder, or NULL   */
+	uint32_t ts_share;                 /**< Last shared timestamp     */
+	struct pipeprof prof;              /**< Optional stage timing     */
+	struct pipeprof_lat lat;           /**< Glass-to-wire latency     */
+	uint64_t t_cap;                    /**< Capture time of frame     */
+	struct vidchange *chg;             /**< Changed blocks, adaptive  */
+	uint64_t ts_enc;                   /**< Last frame encoded [ms]   */
+	unsigned n_static;                 /**< Static frames not sent    */
+#ifdef HAVE_PTHREAD
+	struct {
+		pthread_t tid;             /**< Encoder thread            */
+		bool run;                  /**< Encoder thread running    */
+		pthread_mutex_t mutex;     /**< Protects the mailbox      */
+		pthread_cond_t cond;       /**< Signalled per new frame   */
+		struct vidframe *slot;     /**< Newest captured frame     */
+		struct vidframe *work;     /**< Frame being encoded       */
+		uint64_t t_slot;           /**< Capture time of slot      */
+		bool full;                 /**< Slot has a new frame      */
+		bool up;                   /**< Mutex and cond are ready  */
+	} thr;
+#endif
 };
 
 
@@ -131,6 +259,7 @@ struct vrx {
 	struct vidisp_st *vidisp;          /**< Video display             */
 	struct lock *lock;                 /**< Lock for decoder          */
 	struct list filtl;                 /**< Filters in decoding order */
+	struct vidpool *pool;              /**< Frames for the filters    */
 	struct tmr tmr_picup;              /**< Picture update timer      */
 	enum vidorient orient;             /**< Display orientation       */
 	char device[64];                   /**< Display device name       */
@@ -140,6 +269,55 @@ struct vrx {
 	int efps;                          /**< Estimated frame-rate      */
 	unsigned n_intra;                  /**< Intra-frames decoded      */
 	unsigned n_picup;                  /**< Picture updates sent      */
+	unsigned n_picup_retry;            /**< Sent again, no keyframe   */
+	uint32_t picup_wait;               /**< Keyframe wait [ms]        */
+	unsigned n_repair;                 /**< Pictures repaired by NACK */
+	bool picup_defer;                  /**< Picture update deferred   */
+	bool hidden;                       /**< Display is not visible    */
+	bool resync;                       /**< Shown again, wait for key */
+	unsigned n_skip;                   /**< Packets skipped, hidden   */
+	struct list holdl;                 /**< Frames held for lip-sync  */
+	unsigned n_hold;                   /**< Frames shown before due   */
+	struct pipeprof prof;              /**< Optional stage timing     */
+	struct pipeprof_lat lat;           /**< Wire-to-glass latency     */
+	uint64_t t_first;                  /**< Arrival of frame's first  */
+	uint32_t ts_cur;                   /**< RTP timestamp of frame    */
+#ifdef HAVE_PTHREAD
+	struct {
+		pthread_t tid;             /**< Decoder thread            */
+		bool run;                  /**< Decoder thread running    */
+		pthread_mutex_t mutex;     /**< Protects the packet queue */
+		pthread_cond_t cond;       /**< Signalled per new packet  */
+		struct list pktl;          /**< Packets waiting to decode */
+		unsigned n;                /**< Number of queued packets  */
+		unsigned n_drop;           /**< Packets dropped, overflow */
+		struct mqueue *mq;         /**< Events to the main thread */
+		bool up;                   /**< Mutex and cond are ready  */
+	} thr;
+	struct {
+		pthread_t tid;             /**< Display thread            */
+		bool run;                  /**< Display thread running    */
+		pthread_mutex_t mutex;     /**< Protects slot and full    */
+		pthread_mutex_t lock;      /**< Protects vidisp, in use   */
+		pthread_cond_t cond;       /**< Signalled per new frame   */
+		struct vidframe *slot;     /**< Newest decoded frame      */
+		struct vidframe *work;     /**< Frame being displayed     */
+		uint64_t t_slot;           /**< Arrival time of slot      */
+		bool full;                 /**< Slot holds a new frame    */
+		unsigned n_drop;           /**< Frames never displayed    */
+		struct mqueue *mq;         /**< Events to the main thread */
+		bool up;                   /**< Mutexes and cond ready    */
+	} disp;
+#endif
+};
+
+
+/* Decoder events that must be handled in the main thread */
+enum vrx_event {
+	VRX_EV_PICUP,                      /**< Request a picture update  */
+	VRX_EV_INTRA,                      /**< Intra-frame decoded       */
+	VRX_EV_REPAIR,                     /**< Deferred picture complete */
+	VRX_EV_CLOSED,                     /**< Video display was closed  */
 };
 
 
@@ -154,58 +332,171 @@ struct video {
 	bool started;           /**< True if video is started             */
 	char *peer;             /**< Peer URI                             */
 	bool nack_pli;          /**< Send NACK/PLI to peer                */
+	struct avsync *avsync;  /**< Lip-sync of the call, or NULL        */
+	bool content;           /**< Presentation, source when presenting */
+	video_bw_h *bwh;        /**< Target bitrate to the owner, or NULL */
+	void *bwh_arg;          /**< Target bitrate handler argument      */
 	video_err_h *errh;      /**< Error handler                        */
 	void *arg;              /**< Error handler argument               */
 };
 
 
+/** Decoded frame held back for lip-sync */
+struct vidhold {
+	struct le le;
+	struct vidframe *frame;
+	uint64_t due;           /**< Time to display the frame [ms]      */
+	uint64_t t_first;       /**< Arrival of the first packet [ns]    */
+	uint32_t ts;            /**< RTP timestamp of the frame          */
+};
+
+
 struct vidqent {
 	struct le le;
 	struct sa dst;
 	bool marker;
 	uint8_t pt;
 	uint32_t ts;
+	unsigned layer;         /**< Simulcast layer                     */
+	uint64_t ts_queue;      /**< Time when queued [ms]               */
+	uint64_t t_cap;         /**< Capture time of the frame [ns]      */
 	struct mbuf *mb;
 };
 
 
 static void request_picture_update(struct vrx *vrx);
+static void enc_thread_stop(struct vtx *vtx);
+static int dec_thread_start(struct vrx *vrx);
+static void dec_thread_stop(struct vrx *vrx);
+static int disp_thread_start(struct vrx *vrx);
+static void disp_thread_stop(struct vrx *vrx);
+static bool disp_thread_post(struct vrx *vrx, const struct vidframe *frame,
+			     uint64_t t_first);
+
+
+static void vtx_cmd_destructor(void *arg)
+{
+	struct vtx_cmd *cmd = arg;
+
+	mem_deref(cmd->en);
+}
+
+
+/*
+ * The main thread controls the encoder with commands, that the encoder
+ * applies between two frames. The main thread does not wait for the
+ * encoder, and the encoder does not wait for the main thread.
+ *
+ * The refcounts of libre are not atomic, so an object is never shared
+ * by the two threads: the command owns the new encoder, and the encoder
+ * thread takes it over. If the command is not queued, the caller still
+ * owns the new encoder.
+ */
+static bool vtx_cmd_push(struct vtx *vtx, enum vtx_cmd_type type,
+			 uint32_t bitrate, struct enc_next *en)
+{
+	struct vtx_cmd *cmd;
+
+	cmd = mem_zalloc(sizeof(*cmd), vtx_cmd_destructor);
+	if (!cmd)
+		return false;
+
+	cmd->type    = type;
+	cmd->bitrate = bitrate;
+	cmd->en      = en;
+
+	if (!ptring_push(vtx->cmdq, cmd)) {
+		debug("video: encoder command queue is full\n");
+		cmd->en = NULL;
+		mem_deref(cmd);
+		return false;
+	}
+
+	return true;
+}
+static void disp_lock(struct vrx *vrx, bool lock);
+
+
+static void vidhold_destructor(void *arg)
+{
+	struct vidhold *vh = arg;
+
+	list_unlink(&vh->le);
+	mem_deref(vh->frame);
+}
 
 
 static void vidqent_destructor(void *arg)
 {
 	struct vidqent *qent = arg;
 
+	if (qent->mb) {
+		memtag_free(memtag_core(MEMTAG_VIDEO),
+			    sizeof(*qent) + qent->mb->size);
+	}
+
 	list_unlink(&qent->le);
 	mem_deref(qent->mb);
 }
 
 
-static int vidqent_alloc(struct vidqent **qentp,
-			 bool marker, uint8_t pt, uint32_t ts,
-			 const uint8_t *hdr, size_t hdr_len,
-			 const uint8_t *pld, size_t pld_len)
+/*
+ * Queue entries and their packet buffers are recycled through a free
+ * ring from the pacer back to the packetizer, so the packetizer does not
+ * allocate from the heap once the pool has warmed up. The buffers are
+ * sized for one packet of up to VIDQENT_PKTSZ bytes and only grow for
+ * larger packets.
+ *
+ * The packetizer writes the header and payload straight into the
+ * headroom-reserved buffer, and hands the entry to the pacer through the
+ * packet ring. The pacer moves the entries to its own sendq and sends
+ * the buffer as it is. No lock is taken for a packet: the rings have
+ * one writer and one reader each, the packets come from one thread at
+ * a time, the encoder or the owner of a shared encoder, and the pacer
+ * runs in the main thread.
+ */
+static int vidqent_get(struct vtx *vtx, struct vidqent **qentp,
+		       bool marker, uint8_t pt, uint32_t ts,
+		       const uint8_t *hdr, size_t hdr_len,
+		       const uint8_t *pld, size_t pld_len)
 {
 	struct vidqent *qent;
+	size_t sz = RTP_PRESZ + hdr_len + pld_len + RTP_TRAILSZ;
 	int err = 0;
 
 	if (!qentp || !pld)
 		return EINVAL;
 
-	qent = mem_zalloc(sizeof(*qent), vidqent_destructor);
-	if (!qent)
-		return ENOMEM;
+	qent = ptring_pop(vtx->freeq);
+	if (!qent) {
+		qent = mem_zalloc(sizeof(*qent), vidqent_destructor);
+		if (!qent)
+			return ENOMEM;
+
+		qent->mb = mbuf_alloc(max(sz, RTP_PRESZ + VIDQENT_PKTSZ
+					  + RTP_TRAILSZ));
+		if (!qent->mb) {
+			err = ENOMEM;
+			goto out;
+		}
+
+		memtag_alloc(memtag_core(MEMTAG_VIDEO),
+			     sizeof(*qent) + qent->mb->size);
+	}
+	else if (qent->mb->size < sz) {
+		const size_t old = qent->mb->size;
+
+		err = mbuf_resize(qent->mb, sz);
+		if (err)
+			goto out;
+
+		memtag_resize(memtag_core(MEMTAG_VIDEO), old, qent->mb->size);
+	}
 
 	qent->marker = marker;
 	qent->pt     = pt;
 	qent->ts     = ts;
 
-	qent->mb = mbuf_alloc(RTP_PRESZ + hdr_len + pld_len + RTP_TRAILSZ);
-	if (!qent->mb) {
-		err = ENOMEM;
-		goto out;
-	}
-
 	qent->mb->pos = qent->mb->end = RTP_PRESZ;
 
 	if (hdr)
@@ -225,62 +516,222 @@ static int vidqent_alloc(struct vidqent **qentp,
 }
 
 
+/* A packet in the sendq was sent or dropped */
+static void vidqent_put(struct vtx *vtx, struct vidqent *qent)
+{
+	list_unlink(&qent->le);
+
+	__atomic_sub_fetch(&vtx->n_sendq, 1, __ATOMIC_RELAXED);
+
+	if (!ptring_push(vtx->freeq, qent))
+		mem_deref(qent);
+}
+
+
+static void pacer_delay(struct pacer *pc, uint64_t delay)
+{
+	unsigned i = 0;
+
+	while (i < PACER_HIST - 1 && delay >> i)
+		++i;
+
+	++pc->delayv[i];
+	pc->delay_sum += delay;
+	pc->delay_max = max(pc->delay_max, (uint32_t)delay);
+}
+
+
+static void pacer_resend(struct vtx *vtx, struct pacer *pc)
+{
+	while (pc->rtxq_n && pc->tokens > 0) {
+
+		const struct gnack *gn = &pc->rtxq[pc->rtxq_head];
+		unsigned n = 1, missing;
+		uint16_t blp;
+
+		for (blp = gn->blp; blp; blp &= blp - 1)
+			++n;
+
+		missing = stream_resend(vtx->video->strm, gn->pid, gn->blp);
+
+		pc->rtxq_head = (pc->rtxq_head + 1) % RTXQ_SIZE;
+		--pc->rtxq_n;
+
+		/* the history does not tell the size, assume full packets */
+		pc->n_resent += n - missing;
+		pc->tokens   -= (int64_t)(n - missing) * VIDQENT_PKTSZ;
+
+		/* fall back to a new keyframe */
+		if (missing)
+			vtx_cmd_push(vtx, VTX_CMD_KEYFRAME, 0, NULL);
+	}
+}
+
+
+/*
+ * Drop the frames whose packets are too old, and the rest of the
+ * frames that are being dropped. Returns the number of frames dropped.
+ */
+static unsigned pacer_drop(struct vtx *vtx, struct pacer *pc, uint64_t jfs)
+{
+	const uint32_t budget = vtx->video->cfg.sendq_max;
+	struct vidqent *head = list_ledata(vtx->sendq.head);
+	bool dropping = false;
+	unsigned i, n = 0;
+	struct le *le;
+
+	if (!budget || !head)
+		return 0;
+
+	for (i=0; i<STREAM_SIMULCAST_MAX; i++)
+		dropping |= pc->layerv[i].drop;
+
+	if (!dropping && jfs <= head->ts_queue + budget)
+		return 0;
+
+	le = vtx->sendq.head;
+	while (le) {
+
+		struct vidqent *qent = le->data;
+		struct pacer_layer *l = &pc->layerv[qent->layer];
+
+		le = le->next;
+
+		/* the rest of a frame that is partly sent */
+		if (l->open && l->ts_sent == qent->ts)
+			continue;
+
+		/* a newer frame, the dropped one had no marker */
+		if (l->drop && l->ts_drop != qent->ts)
+			l->drop = false;
+
+		if (!l->drop) {
+
+			if (jfs <= qent->ts_queue + budget)
+				continue;
+
+			l->drop    = true;
+			l->ts_drop = qent->ts;
+			++n;
+		}
+
+		if (qent->marker)
+			l->drop = false;
+
+		vidqent_put(vtx, qent);
+	}
+
+	pc->n_drop += n;
+
+	return n;
+}
+
+
+/* Keyframe at a lower bitrate, after frames were dropped */
+static void pacer_recover(struct vtx *vtx)
+{
+	uint32_t bps;
+
+	vtx_cmd_push(vtx, VTX_CMD_KEYFRAME, 0, NULL);
+
+	if (vtx->vc && vtx->enc_bitrate > BITRATE_MIN) {
+
+		bps = max(vtx->enc_bitrate * 3 / 4, (uint32_t)BITRATE_MIN);
+
+		if (vtx_cmd_push(vtx, VTX_CMD_BITRATE, bps, NULL))
+			vtx->enc_bitrate = bps;
+	}
+}
+
+
 static void vidqueue_poll(struct vtx *vtx, uint64_t jfs, uint64_t prev_jfs)
 {
-	size_t burst, sent;
-	uint64_t bandwidth_kbps;
+	struct vidqent *head, *qent;
+	unsigned n_drop;
+	struct pacer *pc;
+	uint64_t rate;
 	struct le *le;
+	unsigned i;
 
 	if (!vtx)
 		return;
 
-	lock_write_get(vtx->lock_tx);
+	pc = &vtx->pacer;
+
+	/*
+	 * time [ms] * bitrate [bit/s] * pacing [%] / (8 * 1000 * 100)
+	 *   = bytes
+	 */
+	rate = vtx->bitrate;
+	for (i=0; i<vtx->n_sim; i++)
+		rate += vtx->simv[i].bitrate;
+	rate *= max(vtx->video->cfg.pacing, 100);
+	pc->tokens += (int64_t)((1 + jfs - prev_jfs) * rate / 800000);
+	pc->tokens  = min(pc->tokens, BURST_MAX);
+
+	pacer_resend(vtx, pc);
+
+	/* the packets that the encoder queued since the last poll */
+	while ((qent = ptring_pop(vtx->pktq)))
+		list_append(&vtx->sendq, &qent->le, qent);
+
+	n_drop = pacer_drop(vtx, pc, jfs);
 
 	le = vtx->sendq.head;
 	if (!le)
 		goto out;
 
-	/*
-	 * time [ms] * bitrate [kbps] / 8 = bytes
-	 */
-	bandwidth_kbps = vtx->video->cfg.bitrate / 1000;
-	burst = (1 + jfs - prev_jfs) * bandwidth_kbps / 4;
+	stream_batch_begin(vtx->video->strm);
 
-	burst = min(burst, BURST_MAX);
-	sent  = 0;
+	while (le && pc->tokens > 0) {
 
-	while (le) {
+		qent = le->data;
 
-		struct vidqent *qent = le->data;
+		pc->tokens -= (int64_t)mbuf_get_left(qent->mb);
 
-		sent += mbuf_get_left(qent->mb);
+		stream_send_layer(vtx->video->strm, qent->layer,
+				  qent->marker, qent->pt, qent->ts, qent->mb);
 
-		stream_send(vtx->video->strm, qent->marker, qent->pt,
-			    qent->ts, qent->mb);
+		++pc->n_media;
+		pacer_delay(pc, jfs > qent->ts_queue ?
+			    jfs - qent->ts_queue : 0);
 
-		le = le->next;
-		mem_deref(qent);
+		if (qent->marker && !qent->layer)
+			pipeprof_lat_add(&vtx->lat, qent->t_cap);
 
-		if (sent > burst) {
-			break;
-		}
+		pc->layerv[qent->layer].ts_sent = qent->ts;
+		pc->layerv[qent->layer].open    = !qent->marker;
+
+		le = le->next;
+		vidqent_put(vtx, qent);
 	}
 
+	stream_batch_flush(vtx->video->strm);
+
  out:
-	lock_rel(vtx->lock_tx);
+	head = list_ledata(vtx->sendq.head);
+	pc->age = (head && jfs > head->ts_queue) ?
+		(uint32_t)(jfs - head->ts_queue) : 0;
+
+	stream_sendq_report(vtx->video->strm, pc->age, pc->n_drop);
+
+	if (n_drop) {
+		debug("video: sendq: dropped %u frames\n", n_drop);
+		pacer_recover(vtx);
+	}
 }
 
 
 static void rtp_tmr_handler(void *arg)
 {
 	struct vtx *vtx = arg;
+	const uint64_t now = tmr_jiffies();
 	uint64_t pjfs;
 
-	pjfs = vtx->tmr_rtp.jfs;
+	pjfs = vtx->ts_poll ? vtx->ts_poll : now;
+	vtx->ts_poll = now;
 
-	tmr_start(&vtx->tmr_rtp, 1000/MEDIA_POLL_RATE, rtp_tmr_handler, vtx);
-
-	vidqueue_poll(vtx, vtx->tmr_rtp.jfs, pjfs);
+	vidqueue_poll(vtx, now, pjfs);
 }
 
 
@@ -289,35 +740,90 @@ static void video_destructor(void *arg)
 	struct video *v = arg;
 	struct vtx *vtx = &v->vtx;
 	struct vrx *vrx = &v->vrx;
+	unsigned i;
+
+	memtag_free(memtag_core(MEMTAG_VIDEO), sizeof(*v));
 
 	/* transmit */
-	lock_write_get(vtx->lock_tx);
-	list_flush(&vtx->sendq);
-	lock_rel(vtx->lock_tx);
-	mem_deref(vtx->lock_tx);
+	enc_thread_stop(vtx);
+
+	lock_write_get(vtx->lock);
+	vtx->eshare = mem_deref(vtx->eshare);
+	lock_rel(vtx->lock);
 
-	tmr_cancel(&vtx->tmr_rtp);
-	mem_deref(vtx->vsrc);
+	list_flush(&vtx->sendq);
+	ptring_flush(vtx->pktq);
+	ptring_flush(vtx->freeq);
+	ptring_flush(vtx->cmdq);
+	mem_deref(vtx->pktq);
+	mem_deref(vtx->freeq);
+	mem_deref(vtx->cmdq);
+
+	hktmr_cancel(&vtx->tmr_rtp);
+	mem_deref(vtx->vsub);
+	for (i=0; i<vtx->n_sim; i++) {
+		mem_deref(vtx->simv[i].enc);
+		mem_deref(vtx->simv[i].frame);
+	}
 	lock_write_get(vtx->lock);
 	mem_deref(vtx->frame);
 	mem_deref(vtx->mute_frame);
 	mem_deref(vtx->enc);
+	mem_deref(vtx->enc_fmtp);
+	mem_deref(vtx->enc_old);
+	mem_deref(vtx->chg);
 	list_flush(&vtx->filtl);
 	lock_rel(vtx->lock);
 	mem_deref(vtx->lock);
 
+#ifdef HAVE_PTHREAD
+	if (vtx->thr.up) {
+		pthread_cond_destroy(&vtx->thr.cond);
+		pthread_mutex_destroy(&vtx->thr.mutex);
+		mem_deref(vtx->thr.slot);
+		mem_deref(vtx->thr.work);
+	}
+#endif
+
 	/* receive */
+	dec_thread_stop(vrx);
+
+#ifdef HAVE_PTHREAD
+	if (vrx->thr.up) {
+		list_flush(&vrx->thr.pktl);
+		pthread_cond_destroy(&vrx->thr.cond);
+		pthread_mutex_destroy(&vrx->thr.mutex);
+		vrx->thr.mq = mem_deref(vrx->thr.mq);
+	}
+#endif
+
+	disp_thread_stop(vrx);
+
+#ifdef HAVE_PTHREAD
+	if (vrx->disp.up) {
+		pthread_cond_destroy(&vrx->disp.cond);
+		pthread_mutex_destroy(&vrx->disp.lock);
+		pthread_mutex_destroy(&vrx->disp.mutex);
+		mem_deref(vrx->disp.slot);
+		mem_deref(vrx->disp.work);
+		vrx->disp.mq = mem_deref(vrx->disp.mq);
+	}
+#endif
+
 	tmr_cancel(&vrx->tmr_picup);
 	lock_write_get(vrx->lock);
 	mem_deref(vrx->dec);
 	mem_deref(vrx->vidisp);
 	list_flush(&vrx->filtl);
+	list_flush(&vrx->holdl);
+	mem_deref(vrx->pool);
 	lock_rel(vrx->lock);
 	mem_deref(vrx->lock);
 
 	tmr_cancel(&v->tmr);
 	mem_deref(v->strm);
 	mem_deref(v->peer);
+	mem_deref(v->avsync);
 }
 
 
@@ -337,198 +843,971 @@ static int get_fps(const struct video *v)
 }
 
 
-static int packet_handler(bool marker, const uint8_t *hdr, size_t hdr_len,
-			  const uint8_t *pld, size_t pld_len, void *arg)
+static int queue_packet(struct vtx *vtx, unsigned layer, bool marker,
+			uint32_t ts, uint64_t t_cap,
+			const uint8_t *hdr, size_t hdr_len,
+			const uint8_t *pld, size_t pld_len)
 {
-	struct vtx *vtx = arg;
 	struct stream *strm = vtx->video->strm;
 	struct vidqent *qent;
 	int err;
 
-	err = vidqent_alloc(&qent, marker, strm->pt_enc, vtx->ts_tx,
-			    hdr, hdr_len, pld, pld_len);
+	err = vidqent_get(vtx, &qent, marker, strm->pt_enc,
+			  ts, hdr, hdr_len, pld, pld_len);
 	if (err)
 		return err;
 
-	lock_write_get(vtx->lock_tx);
-	qent->dst = *sdp_media_raddr(strm->sdp);
-	list_append(&vtx->sendq, &qent->le, qent);
-	lock_rel(vtx->lock_tx);
-
-	return err;
-}
-
+	qent->layer    = layer;
+	qent->ts_queue = tmr_jiffies();
+	qent->t_cap    = t_cap;
 
-/**
- * Encode video and send via RTP stream
- *
- * @note This function has REAL-TIME properties
- *
- * @param vtx   Video transmit object
- * @param frame Video frame to send
- */
-static void encode_rtp_send(struct vtx *vtx, struct vidframe *frame)
-{
-	struct le *le;
-	int err = 0;
-	bool sendq_empty;
+	qent->dst      = *sdp_media_raddr(strm->sdp);
 
-	if (!vtx->enc)
-		return;
+	__atomic_add_fetch(&vtx->n_sendq, 1, __ATOMIC_RELAXED);
 
-	lock_write_get(vtx->lock_tx);
-	sendq_empty = (vtx->sendq.head == NULL);
-	lock_rel(vtx->lock_tx);
+	/* the pacer is far behind, the frame is broken */
+	if (!ptring_push(vtx->pktq, qent)) {
+		__atomic_sub_fetch(&vtx->n_sendq, 1, __ATOMIC_RELAXED);
+		mem_deref(qent);
 
-	if (!sendq_empty) {
-		++vtx->skipc;
-		return;
+		/* with a shared encoder this runs in the thread of another
+		 * stream, the encoder of this one picks the flag up */
+		__atomic_store_n(&vtx->picup_full, true, __ATOMIC_RELAXED);
+		return ENOSPC;
 	}
 
-	lock_write_get(vtx->lock);
+	return err;
+}
 
-	/* Convert image */
-	if (frame->fmt != VIDENC_INTERNAL_FMT) {
 
-		vtx->vsrc_size = frame->size;
+static int packet_handler(bool marker, const uint8_t *hdr, size_t hdr_len,
+			  const uint8_t *pld, size_t pld_len, void *arg)
+{
+	struct vtx *vtx = arg;
 
-		if (!vtx->frame) {
+	return queue_packet(vtx, 0, marker, vtx->ts_tx,
+			    vtx->t_cap, hdr, hdr_len, pld, pld_len);
+}
 
-			err = vidframe_alloc(&vtx->frame, VIDENC_INTERNAL_FMT,
-					     &vtx->vsrc_size);
-			if (err)
-				goto unlock;
-		}
 
-		vidconv(vtx->frame, frame, 0);
-		frame = vtx->frame;
-	}
+/* Packet of the shared encoder, called in the thread of its owner */
+static int share_packet_handler(bool marker, uint32_t ts,
+				const uint8_t *hdr, size_t hdr_len,
+				const uint8_t *pld, size_t pld_len, void *arg)
+{
+	struct vtx *vtx = arg;
 
-	/* Process video frame through all Video Filters */
-	for (le = vtx->filtl.head; le; le = le->next) {
+	vtx->ts_share = ts;
 
-		struct vidfilt_enc_st *st = le->data;
+	/* the capture time is only known in the thread of the owner */
+	return queue_packet(vtx, 0, marker, ts, 0,
+			    hdr, hdr_len, pld, pld_len);
+}
 
-		if (st->vf && st->vf->ench)
-			err |= st->vf->ench(st, frame);
-	}
 
- unlock:
-	lock_rel(vtx->lock);
+static int layer_packet_handler(bool marker,
+				const uint8_t *hdr, size_t hdr_len,
+				const uint8_t *pld, size_t pld_len, void *arg)
+{
+	struct vlayer *l = arg;
 
-	if (err)
-		return;
+	return queue_packet(l->vtx, l->ix, marker,
+			    l->vtx->ts_tx, l->vtx->t_cap,
+			    hdr, hdr_len, pld, pld_len);
+}
 
-	/* Encode the whole picture frame */
-	err = vtx->vc->ench(vtx->enc, vtx->picup, frame);
-	if (err)
-		return;
 
-	vtx->ts_tx += (SRATE/vtx->vsrc_prm.fps);
-	vtx->picup = false;
+static uint32_t layer_bitrate(uint32_t bitrate, unsigned ix)
+{
+	return max(bitrate >> (2 * ix), BITRATE_MIN / 2);
 }
 
 
-/**
- * Read frames from video source
- *
- * @param frame Video frame
- * @param arg   Handler argument
- *
- * @note This function has REAL-TIME properties
+/*
+ * The lower simulcast layers halve the resolution of the layer above and
+ * have a quarter of its bitrate. Each layer is scaled from the one above,
+ * so every downscale of a frame is computed once. A running encoder is
+ * reconfigured, if the codec can do that.
  */
-static void vidsrc_frame_handler(struct vidframe *frame, void *arg)
+static int layers_encoder_set(struct vtx *vtx, const struct vidcodec *vc,
+			      const struct videnc_param *prm,
+			      const char *fmtp)
 {
-	struct vtx *vtx = arg;
+	unsigned i;
+	int err = 0;
 
-	++vtx->frames;
+	for (i=0; i<vtx->n_sim; i++) {
 
-	/* Is the video muted? If so insert video mute image */
-	if (vtx->muted)
-		frame = vtx->mute_frame;
+		struct vlayer *l = &vtx->simv[i];
+		struct videnc_param lprm = *prm;
 
-	if (vtx->muted && vtx->muted_frames >= MAX_MUTED_FRAMES)
-		return;
+		lprm.bitrate = layer_bitrate(prm->bitrate, l->ix);
 
-	/* Encode and send */
-	encode_rtp_send(vtx, frame);
-	vtx->muted_frames++;
+		if (l->enc && vc->reconfh) {
+			err = vc->reconfh(l->enc, &lprm);
+		}
+		else {
+			err = vc->encupdh(&l->enc, vc, &lprm, fmtp,
+					  layer_packet_handler, l);
+		}
+		if (err)
+			break;
+
+		l->bitrate = lprm.bitrate;
+	}
+
+	return err;
 }
 
 
-static void vidsrc_error_handler(int err, void *arg)
+/* Encode the lower simulcast layers that the peer accepted */
+static void layers_encode(struct vtx *vtx, const struct vidframe *frame,
+			  bool picup)
 {
-	struct vtx *vtx = arg;
+	unsigned i, n;
 
-	warning("video: video-source error: %m\n", err);
+	n = stream_simulcast_layers(vtx->video->strm) - 1;
+	n = min(n, vtx->n_sim);
 
-	vtx->vsrc = mem_deref(vtx->vsrc);
+	for (i=0; i<n; i++) {
+
+		struct vlayer *l = &vtx->simv[i];
+		struct vidsz sz;
+
+		if (!l->enc)
+			break;
+
+		sz.w = (frame->size.w / 2) & ~1;
+		sz.h = (frame->size.h / 2) & ~1;
+		if (sz.w < 16 || sz.h < 16)
+			break;
+
+		if (l->frame && !vidsz_cmp(&l->frame->size, &sz))
+			l->frame = mem_deref(l->frame);
+
+		if (!l->frame) {
+			if (vidframe_alloc(&l->frame, VIDENC_INTERNAL_FMT,
+					   &sz))
+				break;
+		}
+
+		vidconv(l->frame, frame, NULL);
+
+		if (vtx->vc->ench(l->enc, picup, l->frame))
+			break;
+
+		frame = l->frame;
+	}
+}
+
+
+/* Give the frame to the shared encoder, called with the lock */
+static void share_encode(struct vtx *vtx, const struct vidframe *frame)
+{
+	const uint64_t now = tmr_jiffies();
+	bool picup;
+
+	picup = vtx->picup &&
+		now >= vtx->ts_key + vtx->video->cfg.key_interval;
+
+	if (encshare_encode(vtx->eshare, picup, vtx->bitrate, frame,
+			    vtx->ts_tx))
+		return;
+
+	vtx->ts_tx += (SRATE/vtx->vsrc_prm.fps);
+	vtx->ts_enc = now;
+
+	if (picup) {
+		vtx->picup  = false;
+		vtx->ts_key = now;
+		++vtx->n_key;
+	}
+}
+
+
+/*
+ * Content-adaptive mode, for screen content: a picture that did not
+ * change is sent once per STATIC_REFRESH, so the frame-rate is near zero
+ * while a slide is shown. The blocks that changed are given to the
+ * encoder as the region of interest, so the bits of a frame go to the
+ * changed regions, which are refined for CHANGE_HOLD. Returns false if
+ * the frame is not encoded.
+ */
+static bool content_adapt(struct vtx *vtx, const struct vidframe *frame,
+			  bool picup, uint64_t now)
+{
+	const uint8_t *map = NULL;
+	unsigned cols = 0, rows = 0;
+
+	if (!vidchange_update(vtx->chg, frame) && !picup &&
+	    now < vtx->ts_enc + STATIC_REFRESH) {
+		vtx->ts_tx += (SRATE/vtx->vsrc_prm.fps);
+		++vtx->n_static;
+		return false;
+	}
+
+	if (!vtx->vc->roih)
+		return true;
+
+	/* a keyframe codes every block */
+	if (!picup)
+		map = vidchange_map(vtx->chg, &cols, &rows);
+
+	(void)vtx->vc->roih(vtx->enc, map, cols, rows);
+
+	return true;
+}
+
+
+static void enc_next_destructor(void *arg)
+{
+	struct enc_next *en = arg;
+	unsigned i;
+
+	mem_deref(en->enc);
+	for (i=0; i<ARRAY_SIZE(en->encv); i++)
+		mem_deref(en->encv[i]);
+	mem_deref(en->fmtp);
+}
+
+
+/*
+ * Switch to the encoder that was made ahead, between two frames, called
+ * with the lock. The first frame of the new encoder is a keyframe. The
+ * encoder that was switched out is left for the main thread to free,
+ * in the object that is taken over here.
+ */
+static void enc_switch(struct vtx *vtx, struct enc_next *en)
+{
+	const struct vidcodec *vc = vtx->vc;
+	struct videnc_state *enc = vtx->enc;
+	struct videnc_param prm = vtx->enc_prm;
+	char *fmtp = vtx->enc_fmtp;
+	unsigned i;
+
+	vtx->vc       = en->vc;
+	vtx->enc      = en->enc;
+	vtx->enc_prm  = en->prm;
+	vtx->enc_fmtp = en->fmtp;
+
+	en->vc   = vc;
+	en->enc  = enc;
+	en->prm  = prm;
+	en->fmtp = fmtp;
+
+	for (i=0; i<vtx->n_sim; i++) {
+
+		struct vlayer *l = &vtx->simv[i];
+
+		enc = l->enc;
+		l->enc = en->encv[i];
+		en->encv[i] = enc;
+
+		l->bitrate = layer_bitrate(vtx->enc_prm.bitrate, l->ix);
+	}
+
+	stream_update_encoder(vtx->video->strm, en->pt);
+
+	vtx->picup  = false;
+	vtx->ts_key = tmr_jiffies();
+
+	/* the main thread has not freed the last one, two quick changes */
+	mem_deref(__atomic_exchange_n(&vtx->enc_old, en, __ATOMIC_ACQ_REL));
+}
+
+
+/* Free the encoder that was switched out */
+static void enc_old_free(struct vtx *vtx)
+{
+	mem_deref(__atomic_exchange_n(&vtx->enc_old, NULL,
+				      __ATOMIC_ACQ_REL));
+}
+
+
+/*
+ * Apply the commands of the main thread, and the keyframe request of a
+ * full packet queue, called with the lock
+ */
+static bool vtx_cmd_apply(struct vtx *vtx)
+{
+	struct vtx_cmd *cmd;
+	bool update = false;
+
+	while ((cmd = ptring_pop(vtx->cmdq))) {
+
+		switch (cmd->type) {
+
+		case VTX_CMD_BITRATE:
+			vtx->enc_prm.bitrate = cmd->bitrate;
+			update = true;
+			break;
+
+		case VTX_CMD_KEYFRAME:
+			vtx->picup = true;
+			break;
+
+		case VTX_CMD_CODEC:
+			enc_switch(vtx, cmd->en);
+			cmd->en = NULL;
+			break;
+		}
+
+		mem_deref(cmd);
+	}
+
+	if (__atomic_exchange_n(&vtx->picup_full, false, __ATOMIC_RELAXED))
+		vtx->picup = true;
+
+	return update;
+}
+
+
+/*
+ * The new encoders are made while the old ones are still sending, and
+ * the transmit path switches to them between two frames, without a gap.
+ */
+static int enc_prewarm(struct vtx *vtx, const struct vidcodec *vc,
+		       const struct videnc_param *prm, int pt_tx,
+		       const char *params)
+{
+	struct enc_next *en;
+	unsigned i;
+	int err;
+
+	en = mem_zalloc(sizeof(*en), enc_next_destructor);
+	if (!en)
+		return ENOMEM;
+
+	en->vc  = vc;
+	en->prm = *prm;
+	en->pt  = pt_tx;
+
+	err = vc->encupdh(&en->enc, vc, &en->prm, params,
+			  packet_handler, vtx);
+	if (err)
+		goto out;
+
+	for (i=0; i<vtx->n_sim; i++) {
+
+		struct vlayer *l = &vtx->simv[i];
+		struct videnc_param lprm = *prm;
+
+		lprm.bitrate = layer_bitrate(prm->bitrate, l->ix);
+
+		err = vc->encupdh(&en->encv[i], vc, &lprm, params,
+				  layer_packet_handler, l);
+		if (err)
+			goto out;
+	}
+
+	if (params) {
+		err = str_dup(&en->fmtp, params);
+		if (err)
+			goto out;
+	}
+
+	/* the encoder thread owns it from here */
+	if (vtx_cmd_push(vtx, VTX_CMD_CODEC, 0, en))
+		return 0;
+
+	err = ENOSPC;
+
+ out:
+	warning("video: encoder alloc: %m\n", err);
+
+	mem_deref(en);
+
+	return err;
+}
+
+
+/**
+ * Encode video and send via RTP stream
+ *
+ * @note This function has REAL-TIME properties
+ *
+ * @param vtx    Video transmit object
+ * @param frame  Video frame to send
+ * @param shared The frame is shared and must not be changed
+ * @param t_cap  Capture time from pipeprof_stamp(), or 0
+ */
+static void encode_rtp_send(struct vtx *vtx, struct vidframe *frame,
+			    bool shared, uint64_t t_cap)
+{
+	struct le *le;
+	int err = 0;
+	bool update = false;
+	bool picup;
+	uint64_t now;
+	struct videnc_param prm;
+
+	if (!vtx->enc)
+		return;
+
+	/* the RTP of another call is relayed instead */
+	if (stream_is_relayed(vtx->video->strm))
+		return;
+
+	/* from capture to here, the wait for the encoder thread */
+	pipeprof_begin(&vtx->prof, t_cap);
+	pipeprof_mark(&vtx->prof, "capture");
+
+	/* on hold, a keyframe is sent first when the call is resumed */
+	if (!stream_is_sending(vtx->video->strm)) {
+		vtx->ts_tx += (SRATE/vtx->vsrc_prm.fps);
+		vtx->picup  = true;
+		return;
+	}
+
+	/* the packets of the last frame are not sent yet */
+	if (__atomic_load_n(&vtx->n_sendq, __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(&vtx->skipc, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	/* under CPU load every other frame is dropped */
+	if (governor_level() >= GOV_VIDEO && (++vtx->n_load & 1)) {
+		vtx->ts_tx += (SRATE/vtx->vsrc_prm.fps);
+		__atomic_add_fetch(&vtx->skipc, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	lock_write_get(vtx->lock);
+
+	/* New encoder, keyframe or target bitrate */
+	update = vtx_cmd_apply(vtx);
+	prm    = vtx->enc_prm;
+
+	/* Convert image, or copy it for the filters */
+	if (frame->fmt != VIDENC_INTERNAL_FMT ||
+	    (shared && !list_isempty(&vtx->filtl))) {
+
+		vtx->vsrc_size = frame->size;
+
+		if (!vtx->frame) {
+
+			err = vidframe_alloc(&vtx->frame, VIDENC_INTERNAL_FMT,
+					     &vtx->vsrc_size);
+			if (err)
+				goto unlock;
+		}
+
+		vidconv(vtx->frame, frame, 0);
+		frame = vtx->frame;
+
+		pipeprof_mark(&vtx->prof, "convert");
+	}
+
+	/* the picture is encoded once for all streams that share it */
+	if (vtx->eshare) {
+		share_encode(vtx, frame);
+		lock_rel(vtx->lock);
+		return;
+	}
+
+	/* Process video frame through all Video Filters */
+	for (le = vtx->filtl.head; le; le = le->next) {
+
+		struct vidfilt_enc_st *st = le->data;
+
+		if (st->vf && st->vf->ench) {
+			err |= st->vf->ench(st, frame);
+			pipeprof_mark(&vtx->prof, st->vf->name);
+		}
+	}
+
+ unlock:
+	lock_rel(vtx->lock);
+
+	if (err)
+		return;
+
+	if (update) {
+		if (vtx->vc->reconfh) {
+			err = vtx->vc->reconfh(vtx->enc, &prm);
+		}
+		else {
+			err = vtx->vc->encupdh(&vtx->enc, vtx->vc, &prm,
+					       vtx->enc_fmtp,
+					       packet_handler, vtx);
+		}
+		err |= layers_encoder_set(vtx, vtx->vc, &prm, vtx->enc_fmtp);
+		if (err) {
+			warning("video: encoder update: %m\n", err);
+			return;
+		}
+	}
+
+	/* at most one keyframe per interval, more requests are merged */
+	now   = tmr_jiffies();
+	picup = vtx->picup &&
+		now >= vtx->ts_key + vtx->video->cfg.key_interval;
+
+	if (vtx->chg && !content_adapt(vtx, frame, picup, now))
+		return;
+
+	/* Encode the whole picture frame, the packets go to the sendq */
+	vtx->t_cap = t_cap;
+	err = vtx->vc->ench(vtx->enc, picup, frame);
+	if (err)
+		return;
+
+	pipeprof_mark(&vtx->prof, vtx->vc->name);
+
+	if (vtx->n_sim) {
+		layers_encode(vtx, frame, picup);
+		pipeprof_mark(&vtx->prof, "layers");
+	}
+
+	vtx->ts_tx += (SRATE/vtx->vsrc_prm.fps);
+
+	if (picup) {
+		vtx->picup  = false;
+		vtx->ts_key = now;
+		++vtx->n_key;
+	}
+}
+
+
+#ifdef HAVE_PTHREAD
+/*
+ * Pipelined mode: the capture thread leaves its frame in a single-slot
+ * mailbox and returns. The encoder thread always takes the newest frame,
+ * so a frame that was not taken before the next one arrived is skipped.
+ */
+static void *enc_thread(void *arg)
+{
+	struct vtx *vtx = arg;
+
+	for (;;) {
+
+		struct vidframe *frame;
+		uint64_t t_cap;
+
+		pthread_mutex_lock(&vtx->thr.mutex);
+
+		while (vtx->thr.run && !vtx->thr.full)
+			pthread_cond_wait(&vtx->thr.cond, &vtx->thr.mutex);
+
+		if (!vtx->thr.run) {
+			pthread_mutex_unlock(&vtx->thr.mutex);
+			break;
+		}
+
+		frame          = vtx->thr.slot;
+		vtx->thr.slot  = vtx->thr.work;
+		vtx->thr.work  = frame;
+		vtx->thr.full  = false;
+		t_cap          = vtx->thr.t_slot;
+
+		pthread_mutex_unlock(&vtx->thr.mutex);
+
+		encode_rtp_send(vtx, frame, false, t_cap);
+	}
+
+	return NULL;
+}
+
+
+static int enc_thread_start(struct vtx *vtx)
+{
+	int err;
+
+	err = pthread_mutex_init(&vtx->thr.mutex, NULL);
+	if (err)
+		return err;
+
+	err = pthread_cond_init(&vtx->thr.cond, NULL);
+	if (err) {
+		pthread_mutex_destroy(&vtx->thr.mutex);
+		return err;
+	}
+
+	vtx->thr.up  = true;
+	vtx->thr.run = true;
+	err = pthread_create(&vtx->thr.tid, NULL, enc_thread, vtx);
+	if (err)
+		vtx->thr.run = false;
+
+	return err;
+}
+
+
+static void enc_thread_stop(struct vtx *vtx)
+{
+	if (!vtx->thr.run)
+		return;
+
+	pthread_mutex_lock(&vtx->thr.mutex);
+	vtx->thr.run = false;
+	pthread_cond_signal(&vtx->thr.cond);
+	pthread_mutex_unlock(&vtx->thr.mutex);
+
+	pthread_join(vtx->thr.tid, NULL);
+}
+
+
+/*
+ * Returns true if the frame was handed to the encoder thread, or was
+ * skipped. The thread is started with the vtx, before any source.
+ */
+static bool enc_thread_post(struct vtx *vtx, const struct vidframe *frame,
+			    uint64_t t_cap)
+{
+	struct vidframe *slot;
+
+	if (!vtx->thr.up)
+		return false;
+
+	pthread_mutex_lock(&vtx->thr.mutex);
+
+	if (!vtx->thr.run) {
+		pthread_mutex_unlock(&vtx->thr.mutex);
+		return false;
+	}
+
+	/* the previous frame was never encoded */
+	if (vtx->thr.full)
+		__atomic_add_fetch(&vtx->skipc, 1, __ATOMIC_RELAXED);
+
+	slot = vtx->thr.slot;
+	if (slot && (slot->fmt != frame->fmt ||
+		     !vidsz_cmp(&slot->size, &frame->size)))
+		slot = vtx->thr.slot = mem_deref(slot);
+
+	/* the encoder thread may be busy, the frame is not encoded here */
+	if (!slot && vidframe_alloc(&vtx->thr.slot, frame->fmt,
+				    &frame->size)) {
+		__atomic_add_fetch(&vtx->skipc, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&vtx->thr.mutex);
+		return true;
+	}
+
+	vidframe_copy(vtx->thr.slot, frame);
+	vtx->thr.t_slot = t_cap;
+	vtx->thr.full   = true;
+
+	pthread_cond_signal(&vtx->thr.cond);
+	pthread_mutex_unlock(&vtx->thr.mutex);
+
+	return true;
+}
+#else
+static int enc_thread_start(struct vtx *vtx)
+{
+	(void)vtx;
+
+	return ENOSYS;
+}
+
+
+static void enc_thread_stop(struct vtx *vtx)
+{
+	(void)vtx;
+}
+
+
+static bool enc_thread_post(struct vtx *vtx, const struct vidframe *frame,
+			    uint64_t t_cap)
+{
+	(void)vtx;
+	(void)frame;
+	(void)t_cap;
+
+	return false;
+}
+#endif
+
+
+/**
+ * Read frames from video source
+ *
+ * @param frame Video frame
+ * @param arg   Handler argument
+ *
+ * @note This function has REAL-TIME properties
+ */
+static void vidsrc_frame_handler(struct vidframe *frame, void *arg)
+{
+	struct vtx *vtx = arg;
+	const uint64_t t_cap = pipeprof_stamp(&vtx->prof);
+
+	++vtx->frames;
+
+	/* Is the video muted? If so insert video mute image */
+	if (vtx->muted)
+		frame = vtx->mute_frame;
+
+	if (vtx->muted && vtx->muted_frames >= MAX_MUTED_FRAMES)
+		return;
+
+	PROBE3(video_frame_begin, vtx, frame->size.w, frame->size.h);
+
+	/* Encode and send */
+	if (!enc_thread_post(vtx, frame, t_cap))
+		encode_rtp_send(vtx, frame, true, t_cap);
+	vtx->muted_frames++;
+
+	PROBE1(video_frame_end, vtx);
+}
+
+
+static void vidsrc_error_handler(int err, void *arg)
+{
+	struct vtx *vtx = arg;
+
+	warning("video: video-source error: %m\n", err);
+
+	vtx->vsub = mem_deref(vtx->vsub);
+}
+
+
+static int vtx_alloc(struct vtx *vtx, struct video *video)
+{
+	unsigned i;
+	int err;
+
+	err  = lock_alloc(&vtx->lock);
+	err |= ptring_alloc(&vtx->pktq, VIDQ_RING);
+	err |= ptring_alloc(&vtx->freeq, VIDQENT_POOL_MAX);
+	err |= ptring_alloc(&vtx->cmdq, VTX_CMDQ);
+	if (err)
+		return err;
+
+	vtx->video   = video;
+	vtx->ts_tx   = 160;
+	vtx->bitrate = video->cfg.bitrate;
+
+	vtx->n_sim = video->strm->n_sim;
+	for (i=0; i<vtx->n_sim; i++) {
+		vtx->simv[i].vtx = vtx;
+		vtx->simv[i].ix  = i + 1;
+	}
+
+	str_ncpy(vtx->device, video->cfg.src_dev, sizeof(vtx->device));
+
+	err = hktmr_start(&vtx->tmr_rtp, 1000/MEDIA_POLL_RATE,
+			  rtp_tmr_handler, vtx);
+	if (err)
+		return err;
+
+	if (video->cfg.enc_thread) {
+		err = enc_thread_start(vtx);
+		if (err) {
+			warning("video: could not start encoder thread"
+				" (%m)\n", err);
+			err = 0;
+		}
+	}
+
+	return err;
+}
+
+
+static int vrx_alloc(struct vrx *vrx, struct video *video)
+{
+	int err;
+
+	err = lock_alloc(&vrx->lock);
+	if (err)
+		return err;
+
+	err = vidpool_alloc(&vrx->pool, 0);
+	if (err)
+		return err;
+
+	vrx->video  = video;
+	vrx->pt_rx  = -1;
+	vrx->orient = VIDORIENT_PORTRAIT;
+
+	str_ncpy(vrx->device, video->cfg.disp_dev, sizeof(vrx->device));
+
+	if (video->cfg.dec_thread) {
+		err = dec_thread_start(vrx);
+		if (err) {
+			warning("video: could not start decoder thread"
+				" (%m)\n", err);
+			err = 0;
+		}
+	}
+
+	if (video->cfg.disp_thread) {
+		err = disp_thread_start(vrx);
+		if (err) {
+			warning("video: could not start display thread"
+				" (%m)\n", err);
+			err = 0;
+		}
+	}
+
+	return err;
+}
+
+
+static void picup_tmr_handler(void *arg)
+{
+	struct vrx *vrx = arg;
+
+	/* the keyframe did not arrive in time */
+	if (!vrx->picup_defer)
+		++vrx->n_picup_retry;
+
+	request_picture_update(vrx);
+}
+
+
+static void request_picture_update(struct vrx *vrx)
+{
+	struct video *v = vrx->video;
+
+	/* the keyframe is requested when the display is shown again */
+	if (vrx->hidden || tmr_isrunning(&vrx->tmr_picup))
+		return;
+
+	/* packets requested with NACK may still repair the picture */
+	if (!vrx->picup_defer && stream_nack_pending(v->strm)) {
+		vrx->picup_defer = true;
+		tmr_start(&vrx->tmr_picup, NACK_WAIT, picup_tmr_handler, vrx);
+		return;
+	}
+
+	vrx->picup_defer = false;
+
+	/* wait for the keyframe, longer after each request that got none */
+	vrx->picup_wait = vrx->picup_wait
+		? min(2 * vrx->picup_wait, PICUP_WAIT_MAX) : PICUP_INTERVAL;
+
+	tmr_start(&vrx->tmr_picup, vrx->picup_wait, picup_tmr_handler, vrx);
+
+	/* send RTCP FIR to peer */
+	stream_send_fir(v->strm, v->nack_pli);
+
+	/* XXX: if RTCP is not enabled, send XML in SIP INFO ? */
+
+	++vrx->n_picup;
 }
 
 
-static int vtx_alloc(struct vtx *vtx, struct video *video)
+static void vrx_event_handle(struct vrx *vrx, enum vrx_event ev)
 {
-	int err;
+	struct video *v = vrx->video;
 
-	err = lock_alloc(&vtx->lock);
-	err |= lock_alloc(&vtx->lock_tx);
-	if (err)
-		return err;
+	switch (ev) {
 
-	tmr_init(&vtx->tmr_rtp);
+	case VRX_EV_PICUP:
+		request_picture_update(vrx);
+		break;
 
-	vtx->video = video;
-	vtx->ts_tx = 160;
+	case VRX_EV_INTRA:
+		tmr_cancel(&vrx->tmr_picup);
+		vrx->picup_wait = 0;
+		break;
 
-	str_ncpy(vtx->device, video->cfg.src_dev, sizeof(vtx->device));
+	case VRX_EV_REPAIR:
+		if (vrx->picup_defer) {
+			tmr_cancel(&vrx->tmr_picup);
+			vrx->picup_defer = false;
+			++vrx->n_repair;
+		}
+		break;
 
-	tmr_start(&vtx->tmr_rtp, 1, rtp_tmr_handler, vtx);
+	case VRX_EV_CLOSED:
+		if (v->errh)
+			v->errh(ENODEV, "display closed", v->arg);
+		break;
+	}
+}
 
-	return err;
+
+/* Handle the event now, or in the main thread if called from the
+ * decoder thread */
+static void vrx_event(struct vrx *vrx, enum vrx_event ev)
+{
+#ifdef HAVE_PTHREAD
+	if (vrx->thr.mq) {
+		(void)mqueue_push(vrx->thr.mq, ev, NULL);
+		return;
+	}
+#endif
+
+	vrx_event_handle(vrx, ev);
 }
 
 
-static int vrx_alloc(struct vrx *vrx, struct video *video)
+/* Show a decoded frame, called with the lock held */
+static int vrx_show(struct vrx *vrx, const struct vidframe *frame,
+		    uint32_t ts, uint64_t t_first)
 {
+	struct video *v = vrx->video;
 	int err;
 
-	err = lock_alloc(&vrx->lock);
-	if (err)
+	avsync_play(v->avsync, AVSYNC_VIDEO, ts, 0);
+
+	/* the display thread shows the newest frame */
+	if (disp_thread_post(vrx, frame, t_first))
+		return 0;
+
+	err = vidisp_display(vrx->vidisp, v->peer, frame);
+	if (err == ENODEV) {
+		warning("video: video-display was closed\n");
+		vrx->vidisp = mem_deref(vrx->vidisp);
 		return err;
+	}
 
-	vrx->video  = video;
-	vrx->pt_rx  = -1;
-	vrx->orient = VIDORIENT_PORTRAIT;
+	pipeprof_lat_add(&vrx->lat, t_first);
 
-	str_ncpy(vrx->device, video->cfg.disp_dev, sizeof(vrx->device));
+	++vrx->frames;
 
 	return err;
 }
 
 
-static void picup_tmr_handler(void *arg)
+/*
+ * Hold a copy of the frame back for lip-sync, and show the held frames
+ * that are due. When the hold is reduced, the frames already held keep
+ * their time, so the frames are always shown in order.
+ */
+static int vrx_hold(struct vrx *vrx, const struct vidframe *frame,
+		    uint32_t ts, uint64_t t_first, uint32_t hold)
 {
-	struct vrx *vrx = arg;
+	const uint64_t now = tmr_jiffies();
+	struct vidhold *vh;
+	int err = 0;
 
-	request_picture_update(vrx);
-}
+	vh = mem_zalloc(sizeof(*vh), vidhold_destructor);
+	if (!vh)
+		return ENOMEM;
+
+	err = vidpool_get(vrx->pool, &vh->frame, frame->fmt, &frame->size);
+	if (err) {
+		mem_deref(vh);
+		return err;
+	}
 
+	vidframe_copy(vh->frame, frame);
+	vh->due = now + hold;
+	vh->ts  = ts;
+	vh->t_first = t_first;
 
-static void request_picture_update(struct vrx *vrx)
-{
-	struct video *v = vrx->video;
+	list_append(&vrx->holdl, &vh->le, vh);
 
-	if (tmr_isrunning(&vrx->tmr_picup))
-		return;
+	while ((vh = list_ledata(list_head(&vrx->holdl)))) {
 
-	tmr_start(&vrx->tmr_picup, PICUP_INTERVAL, picup_tmr_handler, vrx);
+		/* a full queue limits the hold */
+		if (vh->due > now) {
+			if (list_count(&vrx->holdl) <= HOLD_MAX)
+				break;
 
-	/* send RTCP FIR to peer */
-	stream_send_fir(v->strm, v->nack_pli);
+			++vrx->n_hold;
+		}
 
-	/* XXX: if RTCP is not enabled, send XML in SIP INFO ? */
+		err = vrx_show(vrx, vh->frame, vh->ts, vh->t_first);
+		mem_deref(vh);
+		if (err == ENODEV)
+			break;
+	}
 
-	++vrx->n_picup;
+	return err;
 }
 
 
@@ -537,25 +1816,29 @@ static void request_picture_update(struct vrx *vrx)
  *
  * NOTE: mb=NULL if no packet received
  *
- * @param vrx Video receive object
- * @param hdr RTP Header
- * @param mb  Buffer with RTP payload
+ * @param vrx   Video receive object
+ * @param hdr   RTP Header
+ * @param mb    Buffer with RTP payload
+ * @param t_arr Arrival time from pipeprof_stamp(), or 0
  *
  * @return 0 if success, otherwise errorcode
  */
 static int video_stream_decode(struct vrx *vrx, const struct rtp_header *hdr,
-			       struct mbuf *mb)
+			       struct mbuf *mb, uint64_t t_arr)
 {
 	struct video *v = vrx->video;
 	struct vidframe *frame_filt = NULL;
 	struct vidframe frame_store, *frame = &frame_store;
 	struct le *le;
+	uint32_t hold;
 	bool intra;
 	int err = 0;
 
 	if (!hdr || !mbuf_get_left(mb))
 		return 0;
 
+	PROBE3(video_decode_begin, vrx, hdr->seq, mbuf_get_left(mb));
+
 	lock_write_get(vrx->lock);
 
 	/* No decoder set */
@@ -564,73 +1847,491 @@ static int video_stream_decode(struct vrx *vrx, const struct rtp_header *hdr,
 		goto out;
 	}
 
+	/* the latency of a frame starts with its first packet */
+	if (hdr->ts != vrx->ts_cur || !vrx->t_first) {
+		vrx->ts_cur  = hdr->ts;
+		vrx->t_first = t_arr;
+	}
+
+	pipeprof_begin(&vrx->prof, 0);
+
 	frame->data[0] = NULL;
 	err = vrx->vc->dech(vrx->dec, frame, &intra, hdr->m, hdr->seq, mb);
 	if (err) {
 
-		if (err != EPROTO) {
+		/* the references were skipped while the display was hidden */
+		if (err != EPROTO &&
+		    !__atomic_load_n(&vrx->resync, __ATOMIC_RELAXED)) {
 			warning("video: %s decode error"
 				" (seq=%u, %u bytes): %m\n",
 				vrx->vc->name, hdr->seq,
 				mbuf_get_left(mb), err);
 		}
 
-		request_picture_update(vrx);
+		vrx_event(vrx, VRX_EV_PICUP);
+
+		goto out;
+	}
+
+	if (intra) {
+		vrx_event(vrx, VRX_EV_INTRA);
+		__atomic_store_n(&vrx->resync, false, __ATOMIC_RELAXED);
+		++vrx->n_intra;
+	}
+	else if (__atomic_load_n(&vrx->resync, __ATOMIC_RELAXED)) {
+		/* a picture without its references is not shown */
+		goto out;
+	}
+	else if (vrx->picup_defer && vidframe_isvalid(frame)) {
+		/* a stale flag is checked again by the event handler */
+		vrx_event(vrx, VRX_EV_REPAIR);
+	}
+
+	/* Got a full picture-frame? */
+	if (!vidframe_isvalid(frame))
+		goto out;
+
+	/* only the packet that completes the picture is timed */
+	pipeprof_mark(&vrx->prof, vrx->vc->name);
+
+	if (!list_isempty(&vrx->filtl)) {
+
+		err = vidpool_get(vrx->pool, &frame_filt, frame->fmt,
+				  &frame->size);
+		if (err)
+			goto out;
+
+		vidframe_copy(frame_filt, frame);
+
+		frame = frame_filt;
+
+		pipeprof_mark(&vrx->prof, "copy");
+	}
+
+	/* Process video frame through all Video Filters */
+	for (le = vrx->filtl.head; le; le = le->next) {
+
+		struct vidfilt_dec_st *st = le->data;
+
+		if (st->vf && st->vf->dech) {
+			err |= st->vf->dech(st, frame);
+			pipeprof_mark(&vrx->prof, st->vf->name);
+		}
+	}
+
+	hold = avsync_delay(v->avsync, AVSYNC_VIDEO);
+
+	if (hold || !list_isempty(&vrx->holdl))
+		err = vrx_hold(vrx, frame, hdr->ts, vrx->t_first, hold);
+	else
+		err = vrx_show(vrx, frame, hdr->ts, vrx->t_first);
+
+	pipeprof_mark(&vrx->prof, "display");
+
+	frame_filt = mem_deref(frame_filt);
+	if (err == ENODEV) {
+		lock_rel(vrx->lock);
+
+		vrx_event(vrx, VRX_EV_CLOSED);
+
+		PROBE2(video_decode_end, vrx, err);
+		return err;
+	}
+
+out:
+	lock_rel(vrx->lock);
+
+	PROBE2(video_decode_end, vrx, err);
+
+	return err;
+}
+
+
+#ifdef HAVE_PTHREAD
+struct vidpkt {
+	struct le le;
+	struct rtp_header hdr;
+	struct mbuf *mb;
+	uint64_t t_arr;
+};
+
+
+static void vidpkt_destructor(void *arg)
+{
+	struct vidpkt *pkt = arg;
+
+	mem_deref(pkt->mb);
+}
+
+
+static void *dec_thread(void *arg)
+{
+	struct vrx *vrx = arg;
+
+	for (;;) {
+
+		struct vidpkt *pkt;
+		struct le *le;
+
+		pthread_mutex_lock(&vrx->thr.mutex);
+
+		while (vrx->thr.run && list_isempty(&vrx->thr.pktl))
+			pthread_cond_wait(&vrx->thr.cond, &vrx->thr.mutex);
+
+		if (!vrx->thr.run) {
+			pthread_mutex_unlock(&vrx->thr.mutex);
+			break;
+		}
+
+		le = list_head(&vrx->thr.pktl);
+		list_unlink(le);
+		--vrx->thr.n;
+
+		pthread_mutex_unlock(&vrx->thr.mutex);
+
+		pkt = le->data;
+		(void)video_stream_decode(vrx, &pkt->hdr, pkt->mb,
+					  pkt->t_arr);
+		mem_deref(pkt);
+	}
+
+	return NULL;
+}
+
+
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	struct vrx *vrx = arg;
+	(void)data;
+
+	vrx_event_handle(vrx, id);
+}
+
+
+static int dec_thread_start(struct vrx *vrx)
+{
+	int err;
+
+	err = mqueue_alloc(&vrx->thr.mq, mqueue_handler, vrx);
+	if (err)
+		return err;
+
+	err = pthread_mutex_init(&vrx->thr.mutex, NULL);
+	if (err)
+		goto out;
+
+	err = pthread_cond_init(&vrx->thr.cond, NULL);
+	if (err) {
+		pthread_mutex_destroy(&vrx->thr.mutex);
+		goto out;
+	}
+
+	vrx->thr.up  = true;
+	vrx->thr.run = true;
+	err = pthread_create(&vrx->thr.tid, NULL, dec_thread, vrx);
+	if (err)
+		vrx->thr.run = false;
+
+ out:
+	/* without the thread, events are handled directly */
+	if (err)
+		vrx->thr.mq = mem_deref(vrx->thr.mq);
+
+	return err;
+}
+
+
+static void dec_thread_stop(struct vrx *vrx)
+{
+	if (!vrx->thr.run)
+		return;
+
+	pthread_mutex_lock(&vrx->thr.mutex);
+	vrx->thr.run = false;
+	pthread_cond_signal(&vrx->thr.cond);
+	pthread_mutex_unlock(&vrx->thr.mutex);
+
+	pthread_join(vrx->thr.tid, NULL);
+}
+
+
+/* Returns true if the packet was handed to the decoder thread */
+static bool dec_thread_post(struct vrx *vrx, const struct rtp_header *hdr,
+			    struct mbuf *mb, uint64_t t_arr)
+{
+	struct vidpkt *pkt;
+	bool overflow = false;
+
+	if (!vrx->thr.run)
+		return false;
+
+	if (!mbuf_get_left(mb))
+		return true;
+
+	pkt = mem_zalloc(sizeof(*pkt), vidpkt_destructor);
+	if (!pkt)
+		return true;
+
+	/* a copy, the references of the mbuf are not thread-safe */
+	pkt->hdr   = *hdr;
+	pkt->t_arr = t_arr;
+	pkt->mb  = mbuf_alloc(mbuf_get_left(mb));
+	if (!pkt->mb ||
+	    mbuf_write_mem(pkt->mb, mbuf_buf(mb), mbuf_get_left(mb))) {
+		mem_deref(pkt);
+		return true;
+	}
+	pkt->mb->pos = 0;
+
+	pthread_mutex_lock(&vrx->thr.mutex);
+
+	/* the decoder cannot keep up, start again from a new picture */
+	if (vrx->thr.n >= DEC_QUEUE_MAX) {
+		vrx->thr.n_drop += vrx->thr.n;
+		list_flush(&vrx->thr.pktl);
+		vrx->thr.n = 0;
+		overflow = true;
+	}
+
+	list_append(&vrx->thr.pktl, &pkt->le, pkt);
+	++vrx->thr.n;
+
+	pthread_cond_signal(&vrx->thr.cond);
+	pthread_mutex_unlock(&vrx->thr.mutex);
+
+	if (overflow)
+		request_picture_update(vrx);
+
+	return true;
+}
+
+/*
+ * Display stage: the decoder leaves its frame in a single-slot mailbox
+ * and goes on with the next packet. The display thread always shows the
+ * newest frame, a frame that was replaced before it was shown is
+ * counted as dropped. The lock is held while the display is in use, so
+ * it can be replaced by the main thread.
+ */
+static void *disp_thread(void *arg)
+{
+	struct vrx *vrx = arg;
+	struct video *v = vrx->video;
+
+	for (;;) {
+
+		struct vidframe *frame;
+		uint64_t t_first;
+		int err;
+
+		pthread_mutex_lock(&vrx->disp.mutex);
+
+		while (vrx->disp.run && !vrx->disp.full)
+			pthread_cond_wait(&vrx->disp.cond, &vrx->disp.mutex);
+
+		if (!vrx->disp.run) {
+			pthread_mutex_unlock(&vrx->disp.mutex);
+			break;
+		}
+
+		frame          = vrx->disp.slot;
+		vrx->disp.slot = vrx->disp.work;
+		vrx->disp.work = frame;
+		vrx->disp.full = false;
+		t_first        = vrx->disp.t_slot;
+
+		pthread_mutex_unlock(&vrx->disp.mutex);
+
+		pthread_mutex_lock(&vrx->disp.lock);
+
+		err = vidisp_display(vrx->vidisp, v->peer, frame);
+		if (err == ENODEV) {
+			warning("video: video-display was closed\n");
+			vrx->vidisp = mem_deref(vrx->vidisp);
+		}
+
+		pthread_mutex_unlock(&vrx->disp.lock);
+
+		if (err == ENODEV) {
+			(void)mqueue_push(vrx->disp.mq, VRX_EV_CLOSED, NULL);
+		}
+		else {
+			pipeprof_lat_add(&vrx->lat, t_first);
+			++vrx->frames;
+		}
+	}
+
+	return NULL;
+}
+
+
+static int disp_thread_start(struct vrx *vrx)
+{
+	int err;
+
+	err = mqueue_alloc(&vrx->disp.mq, mqueue_handler, vrx);
+	if (err)
+		return err;
+
+	err = pthread_mutex_init(&vrx->disp.mutex, NULL);
+	if (err)
+		goto out;
+
+	err = pthread_mutex_init(&vrx->disp.lock, NULL);
+	if (err) {
+		pthread_mutex_destroy(&vrx->disp.mutex);
+		goto out;
+	}
+
+	err = pthread_cond_init(&vrx->disp.cond, NULL);
+	if (err) {
+		pthread_mutex_destroy(&vrx->disp.lock);
+		pthread_mutex_destroy(&vrx->disp.mutex);
+		goto out;
+	}
+
+	vrx->disp.up  = true;
+	vrx->disp.run = true;
+	err = pthread_create(&vrx->disp.tid, NULL, disp_thread, vrx);
+	if (err)
+		vrx->disp.run = false;
+
+ out:
+	if (err && !vrx->disp.up)
+		vrx->disp.mq = mem_deref(vrx->disp.mq);
+
+	return err;
+}
+
+
+static void disp_thread_stop(struct vrx *vrx)
+{
+	if (!vrx->disp.run)
+		return;
+
+	pthread_mutex_lock(&vrx->disp.mutex);
+	vrx->disp.run = false;
+	pthread_cond_signal(&vrx->disp.cond);
+	pthread_mutex_unlock(&vrx->disp.mutex);
+
+	pthread_join(vrx->disp.tid, NULL);
+}
+
+
+/*
+ * Returns true if the frame was handed to the display thread, or was
+ * dropped. The thread is started with the vrx, before any decoder.
+ */
+static bool disp_thread_post(struct vrx *vrx, const struct vidframe *frame,
+			     uint64_t t_first)
+{
+	struct vidframe *slot;
+
+	if (!vrx->disp.up)
+		return false;
 
-		goto out;
+	pthread_mutex_lock(&vrx->disp.mutex);
+
+	if (!vrx->disp.run) {
+		pthread_mutex_unlock(&vrx->disp.mutex);
+		return false;
 	}
 
-	if (intra) {
-		tmr_cancel(&vrx->tmr_picup);
-		++vrx->n_intra;
+	/* the previous frame was never displayed */
+	if (vrx->disp.full)
+		++vrx->disp.n_drop;
+
+	slot = vrx->disp.slot;
+	if (slot && (slot->fmt != frame->fmt ||
+		     !vidsz_cmp(&slot->size, &frame->size)))
+		slot = vrx->disp.slot = mem_deref(slot);
+
+	if (!slot && vidframe_alloc(&vrx->disp.slot, frame->fmt,
+				    &frame->size)) {
+		++vrx->disp.n_drop;
+		pthread_mutex_unlock(&vrx->disp.mutex);
+		return true;
 	}
 
-	/* Got a full picture-frame? */
-	if (!vidframe_isvalid(frame))
-		goto out;
+	vidframe_copy(vrx->disp.slot, frame);
+	vrx->disp.t_slot = t_first;
+	vrx->disp.full   = true;
 
-	if (!list_isempty(&vrx->filtl)) {
+	pthread_cond_signal(&vrx->disp.cond);
+	pthread_mutex_unlock(&vrx->disp.mutex);
 
-		err = vidframe_alloc(&frame_filt, frame->fmt, &frame->size);
-		if (err)
-			goto out;
+	return true;
+}
 
-		vidframe_copy(frame_filt, frame);
 
-		frame = frame_filt;
-	}
+/* Hold the display, while it is replaced by the main thread */
+static void disp_lock(struct vrx *vrx, bool lock)
+{
+	if (!vrx->disp.up)
+		return;
 
-	/* Process video frame through all Video Filters */
-	for (le = vrx->filtl.head; le; le = le->next) {
+	if (lock)
+		pthread_mutex_lock(&vrx->disp.lock);
+	else
+		pthread_mutex_unlock(&vrx->disp.lock);
+}
+#else
+static int dec_thread_start(struct vrx *vrx)
+{
+	(void)vrx;
 
-		struct vidfilt_dec_st *st = le->data;
+	return ENOSYS;
+}
 
-		if (st->vf && st->vf->dech)
-			err |= st->vf->dech(st, frame);
-	}
 
-	err = vidisp_display(vrx->vidisp, v->peer, frame);
-	frame_filt = mem_deref(frame_filt);
-	if (err == ENODEV) {
-		warning("video: video-display was closed\n");
-		vrx->vidisp = mem_deref(vrx->vidisp);
+static void dec_thread_stop(struct vrx *vrx)
+{
+	(void)vrx;
+}
 
-		lock_rel(vrx->lock);
 
-		if (v->errh) {
-			v->errh(err, "display closed", v->arg);
-		}
+static bool dec_thread_post(struct vrx *vrx, const struct rtp_header *hdr,
+			    struct mbuf *mb, uint64_t t_arr)
+{
+	(void)vrx;
+	(void)hdr;
+	(void)mb;
+	(void)t_arr;
 
-		return err;
-	}
+	return false;
+}
 
-	++vrx->frames;
 
-out:
-	lock_rel(vrx->lock);
+static int disp_thread_start(struct vrx *vrx)
+{
+	(void)vrx;
 
-	return err;
+	return ENOSYS;
+}
+
+
+static void disp_thread_stop(struct vrx *vrx)
+{
+	(void)vrx;
+}
+
+
+static bool disp_thread_post(struct vrx *vrx, const struct vidframe *frame,
+			     uint64_t t_first)
+{
+	(void)vrx;
+	(void)frame;
+	(void)t_first;
+
+	return false;
+}
+
+
+static void disp_lock(struct vrx *vrx, bool lock)
+{
+	(void)vrx;
+	(void)lock;
 }
+#endif
 
 
 static int pt_handler(struct video *v, uint8_t pt_old, uint8_t pt_new)
@@ -657,6 +2358,7 @@ static void stream_recv_handler(const struct rtp_header *hdr,
 				struct mbuf *mb, void *arg)
 {
 	struct video *v = arg;
+	uint64_t t_arr;
 	int err;
 
 	if (!mb)
@@ -671,7 +2373,58 @@ static void stream_recv_handler(const struct rtp_header *hdr,
 		return;
 
  out:
-	(void)video_stream_decode(&v->vrx, hdr, mb);
+	/* nothing is decoded for a display that is not visible */
+	if (v->vrx.hidden) {
+		++v->vrx.n_skip;
+		return;
+	}
+
+	t_arr = pipeprof_stamp(&v->vrx.prof);
+
+	if (!dec_thread_post(&v->vrx, hdr, mb, t_arr))
+		(void)video_stream_decode(&v->vrx, hdr, mb, t_arr);
+}
+
+
+/* Target bitrate from the stream's congestion control */
+static void bw_handler(uint32_t bps, void *arg)
+{
+	struct video *v = arg;
+
+	/* the owner shares the budget between its streams */
+	if (v->bwh) {
+		v->bwh(bps, v->bwh_arg);
+		return;
+	}
+
+	video_set_bitrate(v, bps);
+}
+
+
+/**
+ * Set the target bitrate of the encoder and the pacer
+ *
+ * @param v   Video stream
+ * @param bps Target bitrate [bit/s]
+ */
+void video_set_bitrate(struct video *v, uint32_t bps)
+{
+	struct vtx *vtx;
+	uint32_t cur, step;
+
+	if (!v || !bps)
+		return;
+
+	vtx = &v->vtx;
+
+	vtx->bitrate = bps;
+
+	/* re-opening the encoder is expensive, skip small changes */
+	cur  = vtx->enc_bitrate;
+	step = (vtx->vc && vtx->vc->reconfh) ? cur/50 : cur/10;
+	if (vtx->vc && (bps > cur + step || bps < cur - step) &&
+	    vtx_cmd_push(vtx, VTX_CMD_BITRATE, bps, NULL))
+		vtx->enc_bitrate = bps;
 }
 
 
@@ -682,17 +2435,45 @@ static void rtcp_handler(struct rtcp_msg *msg, void *arg)
 	switch (msg->hdr.pt) {
 
 	case RTCP_FIR:
-		v->vtx.picup = true;
+		vtx_cmd_push(&v->vtx, VTX_CMD_KEYFRAME, 0, NULL);
+		++v->vtx.n_picup_rx;
 		break;
 
 	case RTCP_PSFB:
-		if (msg->hdr.count == RTCP_PSFB_PLI)
-			v->vtx.picup = true;
+		if (msg->hdr.count == RTCP_PSFB_PLI) {
+			vtx_cmd_push(&v->vtx, VTX_CMD_KEYFRAME, 0, NULL);
+			++v->vtx.n_picup_rx;
+		}
 		break;
 
 	case RTCP_RTPFB:
-		if (msg->hdr.count == RTCP_RTPFB_GNACK)
-			v->vtx.picup = true;
+		/* only layer 0 has a send history */
+		if (msg->hdr.count == RTCP_RTPFB_GNACK &&
+		    msg->r.fb.ssrc_media &&
+		    msg->r.fb.ssrc_media != rtp_sess_ssrc(v->strm->rtp)) {
+			vtx_cmd_push(&v->vtx, VTX_CMD_KEYFRAME, 0, NULL);
+		}
+		else if (msg->hdr.count == RTCP_RTPFB_GNACK) {
+
+			const struct gnack *gnackv = msg->r.fb.fci.gnackv;
+			struct pacer *pc = &v->vtx.pacer;
+			uint32_t i;
+
+			/* resent by the pacer, ahead of the media */
+			for (i=0; i<msg->r.fb.n; i++) {
+
+				if (pc->rtxq_n >= RTXQ_SIZE) {
+					++pc->n_rtx_drop;
+					vtx_cmd_push(&v->vtx, VTX_CMD_KEYFRAME,
+						     0, NULL);
+					continue;
+				}
+
+				pc->rtxq[(pc->rtxq_head + pc->rtxq_n)
+					 % RTXQ_SIZE] = gnackv[i];
+				++pc->rtxq_n;
+			}
+		}
 		break;
 
 	default:
@@ -710,7 +2491,7 @@ static int vtx_print_pipeline(struct re_printf *pf, const struct vtx *vtx)
 	if (!vtx)
 		return 0;
 
-	vs = vidsrc_get(vtx->vsrc);
+	vs = vidsrc_get(vidsrc_sub_st(vtx->vsub));
 
 	err = re_hprintf(pf, "video tx pipeline: %10s",
 			 vs ? vs->name : "src");
@@ -775,11 +2556,16 @@ int video_alloc(struct video **vp, const struct config *cfg,
 	if (!v)
 		return ENOMEM;
 
+	memtag_alloc(memtag_core(MEMTAG_VIDEO), sizeof(*v));
+
 	MAGIC_INIT(v);
 
 	v->cfg = cfg->video;
 	tmr_init(&v->tmr);
 
+	pipeprof_init(&v->vtx.prof, v->cfg.profile);
+	pipeprof_init(&v->vrx.prof, v->cfg.profile);
+
 	err = stream_alloc(&v->strm, &cfg->avt, call, sdp_sess, "video", label,
 			   mnat, mnat_sess, menc, menc_sess,
 			   call_localuri(call),
@@ -798,12 +2584,21 @@ int video_alloc(struct video **vp, const struct config *cfg,
 	err |= sdp_media_set_lattr(stream_sdpmedia(v->strm), true,
 				   "rtcp-fb", "* nack pli");
 
+	/* draft-alvestrand-rmcat-remb */
+	if (cfg->avt.rtp_cc) {
+		err |= sdp_media_set_lattr(stream_sdpmedia(v->strm), false,
+					   "rtcp-fb", "* goog-remb");
+	}
+
 	/* RFC 4796 */
 	if (content) {
 		err |= sdp_media_set_lattr(stream_sdpmedia(v->strm), true,
 					   "content", "%s", content);
 	}
 
+	/* RFC 8853 */
+	err |= stream_enable_simulcast(v->strm, v->cfg.simulcast);
+
 	if (err)
 		goto out;
 
@@ -815,6 +2610,28 @@ int video_alloc(struct video **vp, const struct config *cfg,
 	if (err)
 		goto out;
 
+	/* RFC 4796: slides are screen content */
+	v->content = 0 == str_casecmp(content, "slides");
+
+	if (v->cfg.adaptive || v->content) {
+
+		err = vidchange_alloc(&v->vtx.chg,
+				      v->cfg.fps * CHANGE_HOLD / 1000);
+		if (err)
+			goto out;
+	}
+
+	/* answer NACK from the peer by resending, not with a keyframe */
+	err = stream_enable_rtx(v->strm);
+	if (err)
+		goto out;
+
+	if (cfg->avt.rtp_cc) {
+		stream_set_bw_handler(v->strm,
+				      min(BITRATE_MIN, v->cfg.bitrate),
+				      v->cfg.bitrate, bw_handler, v);
+	}
+
 	/* Video codecs */
 	for (le = list_head(vidcodecl); le; le = le->next) {
 		struct vidcodec *vc = le->data;
@@ -824,6 +2641,8 @@ int video_alloc(struct video **vp, const struct config *cfg,
 				      "%s", vc->fmtp);
 	}
 
+	err |= stream_enable_fec(v->strm, SRATE);
+
 	/* Video filters */
 	for (le = list_head(vidfilt_list()); le; le = le->next) {
 		struct vidfilt *vf = le->data;
@@ -863,16 +2682,78 @@ static void vidisp_resize_handler(const struct vidsz *sz, void *arg)
 static int set_vidisp(struct vrx *vrx)
 {
 	struct vidisp *vd;
+	int err;
+
+	disp_lock(vrx, true);
 
 	vrx->vidisp = mem_deref(vrx->vidisp);
 	vrx->vidisp_prm.view = NULL;
 
 	vd = (struct vidisp *)vidisp_find(vrx->video->cfg.disp_mod);
-	if (!vd)
-		return ENOENT;
+	if (!vd) {
+		err = ENOENT;
+		goto out;
+	}
+
+	err = vd->alloch(&vrx->vidisp, vd, &vrx->vidisp_prm, vrx->device,
+			 vidisp_resize_handler, vrx);
+
+ out:
+	disp_lock(vrx, false);
+
+	return err;
+}
+
 
-	return vd->alloch(&vrx->vidisp, vd, &vrx->vidisp_prm, vrx->device,
-			  vidisp_resize_handler, vrx);
+/*
+ * The encoder is shared with the other calls that send the same picture
+ * with the same codec and parameters. A stream with its own filters,
+ * simulcast layers or the mute picture uses its own encoder.
+ */
+static void vtx_share_update(struct vtx *vtx)
+{
+	struct video *v = vtx->video;
+	struct vidsrc_st *src = vidsrc_sub_st(vtx->vsub);
+	struct videnc_param prm;
+	bool share;
+	int err;
+
+	share = v->cfg.enc_share && v->started && vtx->vc && src &&
+		!vtx->muted && !vtx->n_sim && list_isempty(&vtx->filtl) &&
+		!vtx->chg;
+
+	lock_write_get(vtx->lock);
+
+	if (vtx->eshare) {
+
+		vtx->eshare = mem_deref(vtx->eshare);
+
+		/* continue after the last shared frame, with a keyframe */
+		vtx->ts_tx = vtx->ts_share + SRATE/vtx->vsrc_prm.fps;
+
+		vtx_cmd_push(vtx, VTX_CMD_KEYFRAME, 0, NULL);
+		if (vtx_cmd_push(vtx, VTX_CMD_BITRATE, vtx->bitrate, NULL))
+			vtx->enc_bitrate = vtx->bitrate;
+	}
+
+	if (!share)
+		goto out;
+
+	/* the negotiated parameters, before congestion control */
+	prm = vtx->enc_prm;
+	prm.bitrate = v->cfg.bitrate;
+
+	vtx->ts_share = vtx->ts_tx;
+
+	err = encshare_subscribe(&vtx->eshare, src, &vtx->vsrc_size,
+				 (struct vidcodec *)vtx->vc, &prm,
+				 vtx->enc_fmtp, vtx->ts_tx,
+				 share_packet_handler, vtx);
+	if (err)
+		warning("video: could not share encoder (%m)\n", err);
+
+ out:
+	lock_rel(vtx->lock);
 }
 
 
@@ -880,21 +2761,17 @@ static int set_vidisp(struct vrx *vrx)
 static int set_encoder_format(struct vtx *vtx, const char *src,
 			      const char *dev, struct vidsz *size)
 {
-	struct vidsrc *vs = (struct vidsrc *)vidsrc_find(src);
 	int err;
 
-	if (!vs)
-		return ENOENT;
-
 	vtx->vsrc_size       = *size;
 	vtx->vsrc_prm.fps    = get_fps(vtx->video);
 	vtx->vsrc_prm.orient = VIDORIENT_PORTRAIT;
 
-	vtx->vsrc = mem_deref(vtx->vsrc);
+	vtx->vsub = mem_deref(vtx->vsub);
 
-	err = vs->alloch(&vtx->vsrc, vs, NULL, &vtx->vsrc_prm,
-			 &vtx->vsrc_size, NULL, dev, vidsrc_frame_handler,
-			 vidsrc_error_handler, vtx);
+	err = vidsrc_subscribe(&vtx->vsub, src, &vtx->vsrc_prm,
+			       &vtx->vsrc_size, dev, vidsrc_frame_handler,
+			       vidsrc_error_handler, vtx);
 	if (err) {
 		info("video: no video source '%s': %m\n", src, err);
 		return err;
@@ -935,6 +2812,10 @@ int video_start(struct video *v, const char *peer)
 	if (!v)
 		return EINVAL;
 
+	/* a reflected stream has no codecs and no devices */
+	if (stream_is_reflected(v->strm))
+		return 0;
+
 	if (peer) {
 		mem_deref(v->peer);
 		err = str_dup(&v->peer, peer);
@@ -955,14 +2836,17 @@ int video_start(struct video *v, const char *peer)
 		info("video: no video display\n");
 	}
 
-	size.w = v->cfg.width;
-	size.h = v->cfg.height;
-	err = set_encoder_format(&v->vtx, v->cfg.src_mod,
-				 v->vtx.device, &size);
-	if (err) {
-		warning("video: could not set encoder format to"
-			" [%u x %u] %m\n",
-			size.w, size.h, err);
+	/* the presentation is sent while this side presents */
+	if (!v->content) {
+		size.w = v->cfg.width;
+		size.h = v->cfg.height;
+		err = set_encoder_format(&v->vtx, v->cfg.src_mod,
+					 v->vtx.device, &size);
+		if (err) {
+			warning("video: could not set encoder format to"
+				" [%u x %u] %m\n",
+				size.w, size.h, err);
+		}
 	}
 
 	tmr_start(&v->tmr, TMR_INTERVAL * 1000, tmr_handler, v);
@@ -975,6 +2859,8 @@ int video_start(struct video *v, const char *peer)
 
 	v->started = true;
 
+	vtx_share_update(&v->vtx);
+
 	return 0;
 }
 
@@ -985,7 +2871,8 @@ void video_stop(struct video *v)
 		return;
 
 	v->started = false;
-	v->vtx.vsrc = mem_deref(v->vtx.vsrc);
+	vtx_share_update(&v->vtx);
+	v->vtx.vsub = mem_deref(v->vtx.vsub);
 }
 
 
@@ -995,6 +2882,43 @@ bool video_is_started(const struct video *v)
 }
 
 
+/*
+ * The video belongs to the event loop of the media of its call. The
+ * public functions that are called from another loop run there.
+ */
+struct video_job {
+	struct video *v;
+	struct re_printf *pf;    /**< Print handler                      */
+	const char *mod;         /**< Video source module                */
+	const char *dev;         /**< Device, or the source device       */
+	const char *disp;        /**< Display device                     */
+	int orient;              /**< Video orientation                  */
+	bool flag;               /**< Muted, fullscreen or visible       */
+};
+
+
+static bool video_remote(const struct video *v)
+{
+	return call_loop(v->strm->call) != shard_loop();
+}
+
+
+static int video_exec(struct video_job *job, shard_exec_h *h)
+{
+	return shard_exec(call_loop(job->v->strm->call), h, job);
+}
+
+
+static int mute_handler(void *arg)
+{
+	struct video_job *job = arg;
+
+	video_mute(job->v, job->flag);
+
+	return 0;
+}
+
+
 /**
  * Mute the video stream
  *
@@ -1008,11 +2932,25 @@ void video_mute(struct video *v, bool muted)
 	if (!v)
 		return;
 
+	if (video_remote(v)) {
+		struct video_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.v    = v;
+		job.flag = muted;
+
+		(void)video_exec(&job, mute_handler);
+		return;
+	}
+
 	vtx = &v->vtx;
 
 	vtx->muted        = muted;
 	vtx->muted_frames = 0;
-	vtx->picup        = true;
+
+	vtx_cmd_push(vtx, VTX_CMD_KEYFRAME, 0, NULL);
+
+	vtx_share_update(vtx);
 
 	video_update_picture(v);
 }
@@ -1028,35 +2966,186 @@ static int vidisp_update(struct vrx *vrx)
 				  vrx->orient, NULL);
 	}
 
-	return err;
+	return err;
+}
+
+
+/**
+ * Start or stop sending the presentation, on a stream for the content
+ * "slides"
+ *
+ * @param v   Video stream
+ * @param mod Video source module, NULL to stop
+ * @param dev Video source device
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int video_present(struct video *v, const char *mod, const char *dev)
+{
+	struct vidsz size;
+	int err;
+
+	if (!v || !v->content)
+		return EINVAL;
+
+	if (!mod) {
+		v->vtx.vsub = mem_deref(v->vtx.vsub);
+		return 0;
+	}
+
+	size.w = v->cfg.width;
+	size.h = v->cfg.height;
+
+	err = set_encoder_format(&v->vtx, mod, dev, &size);
+	if (err)
+		return err;
+
+	/* the receivers join with a keyframe */
+	vtx_cmd_push(&v->vtx, VTX_CMD_KEYFRAME, 0, NULL);
+
+	return 0;
+}
+
+
+/**
+ * Set the handler for the target bitrate of the congestion control.
+ * The owner then sets the bitrate with video_set_bitrate().
+ *
+ * @param v   Video stream
+ * @param bwh Target bitrate handler, NULL for the encoder
+ * @param arg Handler argument
+ */
+void video_set_bw_handler(struct video *v, video_bw_h *bwh, void *arg)
+{
+	if (!v)
+		return;
+
+	v->bwh     = bwh;
+	v->bwh_arg = arg;
+}
+
+
+static int fullscreen_handler(void *arg)
+{
+	struct video_job *job = arg;
+
+	return video_set_fullscreen(job->v, job->flag);
+}
+
+
+/**
+ * Enable video display fullscreen
+ *
+ * @param v  Video stream
+ * @param fs True for fullscreen, otherwise false
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int video_set_fullscreen(struct video *v, bool fs)
+{
+	if (!v)
+		return EINVAL;
+
+	if (video_remote(v)) {
+		struct video_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.v    = v;
+		job.flag = fs;
+
+		return video_exec(&job, fullscreen_handler);
+	}
+
+	v->vrx.fullscreen = fs;
+
+	return vidisp_update(&v->vrx);
+}
+
+
+static int visible_handler(void *arg)
+{
+	struct video_job *job = arg;
+
+	return video_set_visible(job->v, job->flag);
 }
 
 
 /**
- * Enable video display fullscreen
+ * Set the visibility of the video display, e.g. when the window of the
+ * call is minimized. While the display is hidden, the received video is
+ * not decoded. When it is shown again, a keyframe is requested and the
+ * decoding starts again from there.
  *
- * @param v  Video stream
- * @param fs True for fullscreen, otherwise false
+ * @param v       Video stream
+ * @param visible True if visible, false if hidden
  *
  * @return 0 if success, otherwise errorcode
  */
-int video_set_fullscreen(struct video *v, bool fs)
+int video_set_visible(struct video *v, bool visible)
 {
+	struct vrx *vrx;
+	struct vidisp *vd;
+
 	if (!v)
 		return EINVAL;
 
-	v->vrx.fullscreen = fs;
+	if (video_remote(v)) {
+		struct video_job job;
 
-	return vidisp_update(&v->vrx);
+		memset(&job, 0, sizeof(job));
+		job.v    = v;
+		job.flag = visible;
+
+		return video_exec(&job, visible_handler);
+	}
+
+	vrx = &v->vrx;
+
+	if (visible != vrx->hidden)
+		return 0;
+
+	vrx->hidden = !visible;
+
+	if (!visible) {
+		tmr_cancel(&vrx->tmr_picup);
+		vrx->picup_defer = false;
+
+		disp_lock(vrx, true);
+
+		vd = vidisp_get(vrx->vidisp);
+		if (vd && vd->hideh)
+			vd->hideh(vrx->vidisp);
+
+		disp_lock(vrx, false);
+
+		return 0;
+	}
+
+	__atomic_store_n(&vrx->resync, true, __ATOMIC_RELAXED);
+	vrx->picup_wait = 0;
+
+	request_picture_update(vrx);
+
+	return 0;
 }
 
 
 static void vidsrc_update(struct vtx *vtx, const char *dev)
 {
-	struct vidsrc *vs = vidsrc_get(vtx->vsrc);
+	struct vidsrc_st *st = vidsrc_sub_st(vtx->vsub);
+	struct vidsrc *vs = vidsrc_get(st);
 
+	/* the device is updated for all streams that share it */
 	if (vs && vs->updateh)
-		vs->updateh(vtx->vsrc, &vtx->vsrc_prm, dev);
+		vs->updateh(st, &vtx->vsrc_prm, dev);
+}
+
+
+static int orient_handler(void *arg)
+{
+	struct video_job *job = arg;
+
+	return video_set_orient(job->v, job->orient);
 }
 
 
@@ -1073,6 +3162,16 @@ int video_set_orient(struct video *v, int orient)
 	if (!v)
 		return EINVAL;
 
+	if (video_remote(v)) {
+		struct video_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.v      = v;
+		job.orient = orient;
+
+		return video_exec(&job, orient_handler);
+	}
+
 	v->vtx.vsrc_prm.orient = v->vrx.orient = orient;
 	vidsrc_update(&v->vtx, NULL);
 	return vidisp_update(&v->vrx);
@@ -1083,23 +3182,35 @@ int video_encoder_set(struct video *v, struct vidcodec *vc,
 		      int pt_tx, const char *params)
 {
 	struct vtx *vtx;
+	unsigned i;
 	int err = 0;
 
-	if (!v)
+	if (!v || !vc)
 		return EINVAL;
 
+	if (stream_is_reflected(v->strm))
+		return 0;
+
 	vtx = &v->vtx;
 
+	vc = (struct vidcodec *)module_lazy_vidcodec(vc);
+	if (!vc)
+		return ENOENT;
+
 	if (!vc->encupdh) {
 		info("video: vidcodec '%s' has no encoder\n", vc->name);
 		return ENOENT;
 	}
 
-	if (vc != vtx->vc) {
+	/* the encoder that was switched out last time */
+	enc_old_free(vtx);
+
+	/* the encoder may not have switched to the last codec yet */
+	if (vc != vtx->vc_set) {
 
 		struct videnc_param prm;
 
-		prm.bitrate = v->cfg.bitrate;
+		prm.bitrate = vtx->bitrate;
 		prm.pktsize = 1024;
 		prm.fps     = get_fps(v);
 		prm.max_fs  = -1;
@@ -1107,15 +3218,52 @@ int video_encoder_set(struct video *v, struct vidcodec *vc,
 		info("Set video encoder: %s %s (%u bit/s, %u fps)\n",
 		     vc->name, vc->variant, prm.bitrate, prm.fps);
 
+		/* the source keeps sending with the old encoder meanwhile */
+		if (vtx->enc && vtx->vsub && !vtx->eshare) {
+
+			err = enc_prewarm(vtx, vc, &prm, pt_tx, params);
+			if (err)
+				return err;
+
+			vtx->vc_set      = vc;
+			vtx->enc_bitrate = prm.bitrate;
+
+			return 0;
+		}
+
+		/* no encoder is running, its old commands do not apply */
+		if (!vtx->vsub)
+			ptring_flush(vtx->cmdq);
+
 		vtx->enc = mem_deref(vtx->enc);
+		for (i=0; i<vtx->n_sim; i++)
+			vtx->simv[i].enc = mem_deref(vtx->simv[i].enc);
+
 		err = vc->encupdh(&vtx->enc, vc, &prm, params,
 				  packet_handler, vtx);
+		err |= layers_encoder_set(vtx, vc, &prm, params);
 		if (err) {
 			warning("video: encoder alloc: %m\n", err);
 			return err;
 		}
 
-		vtx->vc = vc;
+		lock_write_get(vtx->lock);
+		vtx->enc_prm = prm;
+		lock_rel(vtx->lock);
+
+		vtx->enc_bitrate = prm.bitrate;
+
+		vtx->enc_fmtp = mem_deref(vtx->enc_fmtp);
+		if (params) {
+			err = str_dup(&vtx->enc_fmtp, params);
+			if (err)
+				return err;
+		}
+
+		vtx->vc     = vc;
+		vtx->vc_set = vc;
+
+		vtx_share_update(vtx);
 	}
 
 	stream_update_encoder(v->strm, pt_tx);
@@ -1130,9 +3278,16 @@ int video_decoder_set(struct video *v, struct vidcodec *vc, int pt_rx,
 	struct vrx *vrx;
 	int err = 0;
 
-	if (!v)
+	if (!v || !vc)
 		return EINVAL;
 
+	if (stream_is_reflected(v->strm))
+		return 0;
+
+	vc = (struct vidcodec *)module_lazy_vidcodec(vc);
+	if (!vc)
+		return ENOENT;
+
 	/* handle vidcodecs without a decoder */
 	if (!vc->decupdh) {
 		struct vidcodec *vcd;
@@ -1172,6 +3327,16 @@ int video_decoder_set(struct video *v, struct vidcodec *vc, int pt_rx,
 }
 
 
+static int cycle_handler(void *arg)
+{
+	struct video_job *job = arg;
+
+	video_encoder_cycle(job->v);
+
+	return 0;
+}
+
+
 /**
  * Use the next video encoder in the local list of negotiated codecs
  *
@@ -1184,6 +3349,16 @@ void video_encoder_cycle(struct video *video)
 	if (!video)
 		return;
 
+	if (video_remote(video)) {
+		struct video_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.v = video;
+
+		(void)video_exec(&job, cycle_handler);
+		return;
+	}
+
 	rc = sdp_media_format_cycle(stream_sdpmedia(video_strm(video)));
 	if (!rc) {
 		info("cycle video: no remote codec found\n");
@@ -1200,11 +3375,51 @@ struct stream *video_strm(const struct video *v)
 }
 
 
+/**
+ * Set the lip-sync state of the call, to align the video with the audio
+ *
+ * @param v  Video object
+ * @param as Lip-sync state, or NULL
+ */
+void video_set_avsync(struct video *v, struct avsync *as)
+{
+	if (!v)
+		return;
+
+	mem_deref(v->avsync);
+	v->avsync = mem_ref(as);
+
+	stream_set_avsync(v->strm, as, AVSYNC_VIDEO);
+}
+
+
+static int picup_handler(void *arg)
+{
+	struct video_job *job = arg;
+
+	video_update_picture(job->v);
+
+	return 0;
+}
+
+
 void video_update_picture(struct video *v)
 {
 	if (!v)
 		return;
-	v->vtx.picup = true;
+
+	/* the commands of the encoder have one producer, the loop */
+	if (video_remote(v)) {
+		struct video_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.v = v;
+
+		(void)video_exec(&job, picup_handler);
+		return;
+	}
+
+	vtx_cmd_push(&v->vtx, VTX_CMD_KEYFRAME, 0, NULL);
 }
 
 
@@ -1224,6 +3439,16 @@ void *video_view(const struct video *v)
 }
 
 
+static int vidsrc_device_handler(void *arg)
+{
+	struct video_job *job = arg;
+
+	video_vidsrc_set_device(job->v, job->dev);
+
+	return 0;
+}
+
+
 /**
  * Set the current Video Source device name
  *
@@ -1235,6 +3460,17 @@ void video_vidsrc_set_device(struct video *v, const char *dev)
 	if (!v)
 		return;
 
+	if (video_remote(v)) {
+		struct video_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.v   = v;
+		job.dev = dev;
+
+		(void)video_exec(&job, vidsrc_device_handler);
+		return;
+	}
+
 	vidsrc_update(&v->vtx, dev);
 }
 
@@ -1254,6 +3490,89 @@ void video_sdp_attr_decode(struct video *v)
 
 	/* RFC 4585 */
 	v->nack_pli = sdprattr_contains(v->strm, "rtcp-fb", "nack");
+
+	stream_set_nack(v->strm, v->nack_pli);
+}
+
+
+static int pacer_debug(struct re_printf *pf, const struct vtx *vtx)
+{
+	const struct pacer *pc = &vtx->pacer;
+	int i, err;
+
+	err  = re_hprintf(pf, " pacer: %u%% tokens=%lld media=%llu"
+			  " resent=%llu rtx_drop=%llu\n",
+			  vtx->video->cfg.pacing, pc->tokens, pc->n_media,
+			  pc->n_resent, pc->n_rtx_drop);
+	err |= re_hprintf(pf, "     queue: age=%ums max=%ums"
+			  " frames_dropped=%llu ring_full=%llu"
+			  " commands_lost=%llu\n",
+			  pc->age, vtx->video->cfg.sendq_max, pc->n_drop,
+			  ptring_full(vtx->pktq), ptring_full(vtx->cmdq));
+	err |= re_hprintf(pf, "     queue delay: avg=%llums max=%ums"
+			  " (2^n ms):",
+			  pc->n_media ? pc->delay_sum / pc->n_media : 0,
+			  pc->delay_max);
+	for (i=0; i<PACER_HIST; i++)
+		err |= re_hprintf(pf, " %llu", pc->delayv[i]);
+	err |= re_hprintf(pf, "\n");
+
+	return err;
+}
+
+
+static int profile_handler(void *arg)
+{
+	struct video_job *job = arg;
+
+	return video_print_profile(job->pf, job->v);
+}
+
+
+/**
+ * Print the time spent in each stage of the video pipeline, and the
+ * latency percentiles of the frames
+ *
+ * @param pf Print handler
+ * @param v  Video object
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int video_print_profile(struct re_printf *pf, const struct video *v)
+{
+	int err;
+
+	if (!v || !v->cfg.profile)
+		return 0;
+
+	if (video_remote((struct video *)v)) {
+		struct video_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.v  = (struct video *)v;
+		job.pf = pf;
+
+		return video_exec(&job, profile_handler);
+	}
+
+	err  = re_hprintf(pf, " glass-to-wire: %H\n",
+			  pipeprof_lat_debug, &v->vtx.lat);
+	err |= re_hprintf(pf, " wire-to-glass: %H\n",
+			  pipeprof_lat_debug, &v->vrx.lat);
+	err |= re_hprintf(pf, " tx profile:\n%H", pipeprof_debug,
+			  &v->vtx.prof);
+	err |= re_hprintf(pf, " rx profile:\n%H", pipeprof_debug,
+			  &v->vrx.prof);
+
+	return err;
+}
+
+
+static int debug_handler(void *arg)
+{
+	struct video_job *job = arg;
+
+	return video_debug(job->pf, job->v);
 }
 
 
@@ -1266,6 +3585,16 @@ int video_debug(struct re_printf *pf, const struct video *v)
 	if (!v)
 		return 0;
 
+	if (video_remote((struct video *)v)) {
+		struct video_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.v  = (struct video *)v;
+		job.pf = pf;
+
+		return video_exec(&job, debug_handler);
+	}
+
 	vtx = &v->vtx;
 	vrx = &v->vrx;
 
@@ -1274,16 +3603,53 @@ int video_debug(struct re_printf *pf, const struct video *v)
 	err |= re_hprintf(pf, " tx: %u x %u, fps=%d\n",
 			  vtx->vsrc_size.w,
 			  vtx->vsrc_size.h, vtx->vsrc_prm.fps);
-	err |= re_hprintf(pf, "     skipc=%u\n", vtx->skipc);
+	err |= re_hprintf(pf, "     skipc=%u, source shared by %u,"
+			  " encoder shared by %u\n",
+			  vtx->skipc, vidsrc_sub_count(vtx->vsub),
+			  encshare_count(vtx->eshare));
+	err |= re_hprintf(pf, "     n_picup=%u, n_key=%u (interval %u ms)\n",
+			  vtx->n_picup_rx, vtx->n_key,
+			  v->cfg.key_interval);
+	if (vtx->chg) {
+		err |= re_hprintf(pf, "     adaptive: static=%u, roi=%s\n",
+				  vtx->n_static,
+				  vtx->vc && vtx->vc->roih ? "yes" : "no");
+	}
+	err |= pacer_debug(pf, vtx);
 	err |= re_hprintf(pf, " rx: pt=%d\n", vrx->pt_rx);
-	err |= re_hprintf(pf, "     n_intra=%u, n_picup=%u\n",
-			  vrx->n_intra, vrx->n_picup);
+	err |= re_hprintf(pf, "     n_intra=%u, n_picup=%u, n_repair=%u,"
+			  " n_retry=%u\n",
+			  vrx->n_intra, vrx->n_picup, vrx->n_repair,
+			  vrx->n_picup_retry);
+	err |= re_hprintf(pf, "     display %s, n_skip=%u\n",
+			  vrx->hidden ? "hidden" : "visible", vrx->n_skip);
+#ifdef HAVE_PTHREAD
+	if (vrx->thr.run) {
+		err |= re_hprintf(pf, "     decoder thread: queued=%u,"
+				  " dropped=%u\n",
+				  vrx->thr.n, vrx->thr.n_drop);
+	}
+	if (vrx->disp.run) {
+		err |= re_hprintf(pf, "     display thread: shown=%d,"
+				  " dropped=%u\n",
+				  vrx->frames, vrx->disp.n_drop);
+	}
+#endif
+	if (v->avsync) {
+		err |= re_hprintf(pf, "     lip-sync hold: %u ms,"
+				  " shown early=%u\n",
+				  avsync_delay(v->avsync, AVSYNC_VIDEO),
+				  vrx->n_hold);
+	}
 
 	if (!list_isempty(vidfilt_list())) {
 		err |= vtx_print_pipeline(pf, vtx);
 		err |= vrx_print_pipeline(pf, vrx);
+		err |= re_hprintf(pf, "     %H", vidpool_debug, vrx->pool);
 	}
 
+	err |= video_print_profile(pf, v);
+
 	err |= stream_debug(pf, v->strm);
 
 	return err;
@@ -1299,24 +3665,55 @@ int video_print(struct re_printf *pf, const struct video *v)
 }
 
 
+static int source_handler(void *arg)
+{
+	struct video_job *job = arg;
+
+	return video_set_source(job->v, job->mod, job->dev);
+}
+
+
 int video_set_source(struct video *v, const char *name, const char *dev)
 {
-	struct vidsrc *vs = (struct vidsrc *)vidsrc_find(name);
 	struct vtx *vtx;
+	int err;
 
 	if (!v)
 		return EINVAL;
 
-	if (!vs)
-		return ENOENT;
+	if (video_remote(v)) {
+		struct video_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.v   = v;
+		job.mod = name;
+		job.dev = dev;
+
+		return video_exec(&job, source_handler);
+	}
 
 	vtx = &v->vtx;
 
-	vtx->vsrc = mem_deref(vtx->vsrc);
+	vtx->vsub = mem_deref(vtx->vsub);
+
+	err = vidsrc_subscribe(&vtx->vsub, name, &vtx->vsrc_prm,
+			       &vtx->vsrc_size, dev, vidsrc_frame_handler,
+			       vidsrc_error_handler, vtx);
+
+	/* the frames come from another source */
+	vtx_share_update(vtx);
+
+	return err;
+}
+
+
+static int devicename_handler(void *arg)
+{
+	struct video_job *job = arg;
+
+	video_set_devicename(job->v, job->dev, job->disp);
 
-	return vs->alloch(&vtx->vsrc, vs, NULL, &vtx->vsrc_prm,
-			  &vtx->vsrc_size, NULL, dev,
-			  vidsrc_frame_handler, vidsrc_error_handler, vtx);
+	return 0;
 }
 
 
@@ -1325,6 +3722,133 @@ void video_set_devicename(struct video *v, const char *src, const char *disp)
 	if (!v)
 		return;
 
+	if (video_remote(v)) {
+		struct video_job job;
+
+		memset(&job, 0, sizeof(job));
+		job.v    = v;
+		job.dev  = src;
+		job.disp = disp;
+
+		(void)video_exec(&job, devicename_handler);
+		return;
+	}
+
 	str_ncpy(v->vtx.device, src, sizeof(v->vtx.device));
 	str_ncpy(v->vrx.device, disp, sizeof(v->vrx.device));
 }
+
+
+/*
+ * Selftest hooks, they are not part of the API
+ */
+
+
+/**
+ * Allocate a video object that only has the send queue and the pacer,
+ * to feed it packets without a call, an encoder or a timer
+ *
+ * @param vp      Pointer to allocated video object
+ * @param strm    Stream to send on, e.g. from stream_test_alloc()
+ * @param bitrate Send bitrate [bit/s]
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int video_test_alloc(struct video **vp, struct stream *strm,
+		     uint32_t bitrate)
+{
+	struct video *v;
+	struct vtx *vtx;
+	int err;
+
+	if (!vp || !strm || !bitrate)
+		return EINVAL;
+
+	v = mem_zalloc(sizeof(*v), video_destructor);
+	if (!v)
+		return ENOMEM;
+
+	memtag_alloc(memtag_core(MEMTAG_VIDEO), sizeof(*v));
+
+	MAGIC_INIT(v);
+
+	v->strm = mem_ref(strm);
+	v->cfg.bitrate = bitrate;
+	tmr_init(&v->tmr);
+
+	vtx = &v->vtx;
+
+	err  = lock_alloc(&vtx->lock);
+	err |= lock_alloc(&v->vrx.lock);
+	err |= ptring_alloc(&vtx->pktq, VIDQ_RING);
+	err |= ptring_alloc(&vtx->freeq, VIDQENT_POOL_MAX);
+	err |= ptring_alloc(&vtx->cmdq, VTX_CMDQ);
+	if (err) {
+		mem_deref(v);
+		return err;
+	}
+
+	vtx->video   = v;
+	vtx->bitrate = bitrate;
+
+	*vp = v;
+
+	return 0;
+}
+
+
+/**
+ * Queue one packet for the pacer, as the packetizer of the encoder does
+ *
+ * @param v       Video object from video_test_alloc()
+ * @param marker  Last packet of the frame
+ * @param ts      RTP timestamp
+ * @param pld     Payload
+ * @param pld_len Length of the payload
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int video_test_queue(struct video *v, bool marker, uint32_t ts,
+		     const uint8_t *pld, size_t pld_len)
+{
+	struct vtx *vtx;
+	struct vidqent *qent;
+	int err;
+
+	if (!v || !pld)
+		return EINVAL;
+
+	vtx = &v->vtx;
+
+	err = vidqent_get(vtx, &qent, marker, 0, ts, NULL, 0, pld, pld_len);
+	if (err)
+		return err;
+
+	qent->ts_queue = tmr_jiffies();
+
+	__atomic_add_fetch(&vtx->n_sendq, 1, __ATOMIC_RELAXED);
+
+	if (!ptring_push(vtx->pktq, qent)) {
+		__atomic_sub_fetch(&vtx->n_sendq, 1, __ATOMIC_RELAXED);
+		mem_deref(qent);
+		return ENOSPC;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Run the pacer once, as the RTP timer does
+ *
+ * @param v        Video object from video_test_alloc()
+ * @param jfs      Current time [ms]
+ * @param prev_jfs Time of the previous poll [ms]
+ */
+void video_test_poll(struct video *v, uint64_t jfs, uint64_t prev_jfs)
+{
+	if (!v)
+		return;
+
+	vidqueue_poll(&v->vtx, jfs, prev_jfs);
+}
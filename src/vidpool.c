@@ -0,0 +1,197 @@
+/**
+ * @file vidpool.c  Pool of reusable video frames
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * The pool keeps one reference to every frame it has handed out. A
+ * frame has come back when that is the only reference left, so users
+ * simply mem_deref() the frame when they are done with it, like any
+ * other frame. The references are not atomic, so a pool and its frames
+ * must be used by one thread at a time.
+ */
+
+
+enum {
+	POOL_MAX = 8,           /**< Frames kept for reuse              */
+	ALIGN_DEFAULT = 32,     /**< Alignment of the pixel buffer      */
+};
+
+struct vidpool {
+	struct list framel;     /**< Pooled frames, most recent first   */
+	unsigned align;         /**< Alignment of the pixel buffer      */
+	uint64_t n_alloc;       /**< Frames allocated                   */
+	uint64_t n_reuse;       /**< Frames reused                      */
+};
+
+/* The frame comes first, so the frame pointer is the mem object */
+struct vidpent {
+	struct vidframe frame;
+	struct le le;
+	enum vidfmt fmt;
+	struct vidsz size;
+};
+
+
+static void pool_destructor(void *arg)
+{
+	struct vidpool *pool = arg;
+
+	/* frames still in use are freed by their last owner */
+	list_flush(&pool->framel);
+}
+
+
+static void pent_destructor(void *arg)
+{
+	struct vidpent *pent = arg;
+
+	list_unlink(&pent->le);
+}
+
+
+/**
+ * Allocate a pool of video frames
+ *
+ * @param poolp Pointer to allocated pool
+ * @param align Alignment of the pixel buffers in bytes, power of two.
+ *              0 for the default of 32 bytes
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int vidpool_alloc(struct vidpool **poolp, unsigned align)
+{
+	struct vidpool *pool;
+
+	if (!poolp)
+		return EINVAL;
+
+	if (!align)
+		align = ALIGN_DEFAULT;
+
+	if (align & (align - 1))
+		return EINVAL;
+
+	pool = mem_zalloc(sizeof(*pool), pool_destructor);
+	if (!pool)
+		return ENOMEM;
+
+	pool->align = align;
+
+	*poolp = pool;
+
+	return 0;
+}
+
+
+static struct vidpent *pent_alloc(struct vidpool *pool, enum vidfmt fmt,
+				  const struct vidsz *size)
+{
+	struct vidpent *pent;
+	size_t sz = vidframe_size(fmt, size);
+	uintptr_t buf;
+
+	if (!sz)
+		return NULL;
+
+	pent = mem_zalloc(sizeof(*pent) + pool->align - 1 + sz,
+			  pent_destructor);
+	if (!pent)
+		return NULL;
+
+	buf = (uintptr_t)(pent + 1);
+	buf = (buf + pool->align - 1) & ~(uintptr_t)(pool->align - 1);
+
+	vidframe_init_buf(&pent->frame, fmt, size, (uint8_t *)buf);
+
+	pent->fmt  = fmt;
+	pent->size = *size;
+
+	return pent;
+}
+
+
+/**
+ * Get a frame from the pool. The frame is reused if one with the same
+ * format and size has been released, otherwise a new frame is allocated.
+ * The contents of the frame are undefined.
+ *
+ * @param pool   Video frame pool
+ * @param framep Pointer to the frame, release it with mem_deref()
+ * @param fmt    Pixel format
+ * @param size   Frame size
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int vidpool_get(struct vidpool *pool, struct vidframe **framep,
+		enum vidfmt fmt, const struct vidsz *size)
+{
+	struct vidpent *pent = NULL;
+	struct le *le;
+	unsigned n = 0;
+
+	if (!pool || !framep || !size)
+		return EINVAL;
+
+	le = list_head(&pool->framel);
+	while (le) {
+
+		struct vidpent *p = le->data;
+
+		le = le->next;
+
+		if (mem_nrefs(p) > 1) {
+			++n;
+			continue;
+		}
+
+		if (!pent && p->fmt == fmt && vidsz_cmp(&p->size, size)) {
+			pent = p;
+			continue;
+		}
+
+		/* free frames with another format or size, or over the
+		 * limit of the pool */
+		if (p->fmt != fmt || !vidsz_cmp(&p->size, size) ||
+		    n >= POOL_MAX)
+			mem_deref(p);
+		else
+			++n;
+	}
+
+	if (pent) {
+		list_unlink(&pent->le);
+		++pool->n_reuse;
+	}
+	else {
+		pent = pent_alloc(pool, fmt, size);
+		if (!pent)
+			return ENOMEM;
+
+		++pool->n_alloc;
+	}
+
+	list_prepend(&pool->framel, &pent->le, pent);
+
+	*framep = mem_ref(&pent->frame);
+
+	return 0;
+}
+
+
+int vidpool_debug(struct re_printf *pf, const struct vidpool *pool)
+{
+	if (!pool)
+		return 0;
+
+	return re_hprintf(pf, "vidpool: frames=%u allocated=%llu"
+			  " reused=%llu\n",
+			  list_count(&pool->framel),
+			  pool->n_alloc, pool->n_reuse);
+}
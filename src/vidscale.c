@@ -0,0 +1,318 @@
+/**
+ * @file vidscale.c  Scaling of YUV video frames
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
+#define USE_NEON 1
+#endif
+#if defined (__x86_64__) && defined (__GNUC__)
+#include <immintrin.h>
+#define USE_AVX2 1
+#endif
+#include "core.h"
+
+
+/*
+ * Bilinear scaling in two passes per row. The two source rows are first
+ * blended vertically with the same weight for the whole row, which is
+ * done 16 bytes at a time with vectors. The blended row is then
+ * resampled horizontally in plain C. Weights are 8-bit fixed point, and
+ * rows that map exactly onto a source row are not blended at all.
+ */
+
+
+enum {
+	ROW_MAX = 8192,         /**< Widest source row in bytes         */
+};
+
+
+typedef void (lerp_h)(uint8_t *out, const uint8_t *r0, const uint8_t *r1,
+		      size_t n, unsigned f);
+
+
+static void lerp_row_c(uint8_t *out, const uint8_t *r0, const uint8_t *r1,
+		       size_t n, unsigned f)
+{
+	const unsigned g = 256 - f;
+	size_t i;
+
+	for (i=0; i<n; i++)
+		out[i] = (r0[i] * g + r1[i] * f) >> 8;
+}
+
+
+#if defined (__SSE2__)
+
+static void lerp_row_sse2(uint8_t *out, const uint8_t *r0,
+			  const uint8_t *r1, size_t n, unsigned f)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w0   = _mm_set1_epi16((short)(256 - f));
+	const __m128i w1   = _mm_set1_epi16((short)f);
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)&r0[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *)&r1[i]);
+		__m128i lo, hi;
+
+		lo = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1));
+		hi = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1));
+
+		_mm_storeu_si128((__m128i *)&out[i],
+				 _mm_packus_epi16(_mm_srli_epi16(lo, 8),
+						  _mm_srli_epi16(hi, 8)));
+	}
+
+	lerp_row_c(&out[i], &r0[i], &r1[i], n - i, f);
+}
+
+#elif defined (USE_NEON)
+
+static void lerp_row_neon(uint8_t *out, const uint8_t *r0,
+			  const uint8_t *r1, size_t n, unsigned f)
+{
+	const uint8x8_t w0 = vdup_n_u8((uint8_t)(256 - f));
+	const uint8x8_t w1 = vdup_n_u8((uint8_t)f);
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t a = vld1q_u8(&r0[i]);
+		uint8x16_t b = vld1q_u8(&r1[i]);
+		uint16x8_t lo, hi;
+
+		lo = vmlal_u8(vmull_u8(vget_low_u8(a), w0),
+			      vget_low_u8(b), w1);
+		hi = vmlal_u8(vmull_u8(vget_high_u8(a), w0),
+			      vget_high_u8(b), w1);
+
+		vst1q_u8(&out[i], vcombine_u8(vshrn_n_u16(lo, 8),
+					      vshrn_n_u16(hi, 8)));
+	}
+
+	lerp_row_c(&out[i], &r0[i], &r1[i], n - i, f);
+}
+
+#endif
+
+
+#if defined (USE_AVX2)
+
+/* the unpack and pack work within each 128-bit half, the order holds */
+__attribute__((target("avx2")))
+static void lerp_row_avx2(uint8_t *out, const uint8_t *r0,
+			  const uint8_t *r1, size_t n, unsigned f)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i w0   = _mm256_set1_epi16((short)(256 - f));
+	const __m256i w1   = _mm256_set1_epi16((short)f);
+	size_t i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)&r0[i]);
+		__m256i b = _mm256_loadu_si256((const __m256i *)&r1[i]);
+		__m256i lo, hi;
+
+		lo = _mm256_add_epi16(
+			_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), w0),
+			_mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero), w1));
+		hi = _mm256_add_epi16(
+			_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), w0),
+			_mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero), w1));
+
+		lo = _mm256_srli_epi16(lo, 8);
+		hi = _mm256_srli_epi16(hi, 8);
+
+		_mm256_storeu_si256((__m256i *)&out[i],
+				    _mm256_packus_epi16(lo, hi));
+	}
+
+	lerp_row_c(&out[i], &r0[i], &r1[i], n - i, f);
+}
+
+#endif
+
+
+static kernel_fn *lerp_row = (kernel_fn *)lerp_row_c;
+
+static const struct kernel_impl lerp_implv[] = {
+	{"c", 0, (kernel_fn *)lerp_row_c},
+#if defined (__SSE2__)
+	{"sse2", CPU_SSE2, (kernel_fn *)lerp_row_sse2},
+#elif defined (USE_NEON)
+	{"neon", CPU_NEON, (kernel_fn *)lerp_row_neon},
+#endif
+#if defined (USE_AVX2)
+	{"avx2", CPU_SSE2 | CPU_AVX2, (kernel_fn *)lerp_row_avx2},
+#endif
+};
+
+static struct kernel kernel_lerp = {
+	LE_INIT, "vidscale_lerp", &lerp_row,
+	lerp_implv, ARRAY_SIZE(lerp_implv), NULL
+};
+
+
+/* Register the kernels of the scaler */
+void vidscale_kernels(void)
+{
+	kernel_register(&kernel_lerp);
+}
+
+
+/* Source position of the centre of dst pixel i, in 16.8 fixed point */
+static inline unsigned src_pos(unsigned i, unsigned step)
+{
+	uint64_t p = (uint64_t)i * step + step / 2;
+
+	return p < 0x8000 ? 0 : (unsigned)((p - 0x8000) >> 8);
+}
+
+
+static void hscale_row(uint8_t *out, unsigned dw, const uint8_t *in,
+		       unsigned sw, unsigned bpp)
+{
+	const unsigned step = (unsigned)(((uint64_t)sw << 16) / dw);
+	unsigned x, c;
+
+	for (x=0; x<dw; x++) {
+
+		unsigned p  = src_pos(x, step);
+		unsigned x0 = p >> 8;
+		unsigned f  = p & 0xff;
+		unsigned x1 = x0 + 1 < sw ? x0 + 1 : sw - 1;
+
+		if (x0 >= sw)
+			x0 = x1 = sw - 1;
+
+		for (c=0; c<bpp; c++) {
+			out[x*bpp + c] = (in[x0*bpp + c] * (256 - f) +
+					  in[x1*bpp + c] * f) >> 8;
+		}
+	}
+}
+
+
+static void scale_plane(uint8_t *dst, unsigned dls, unsigned dw,
+			unsigned dh, const uint8_t *src, unsigned sls,
+			unsigned sw, unsigned sh, unsigned bpp)
+{
+	uint8_t tmp[ROW_MAX];
+	const unsigned step = (unsigned)(((uint64_t)sh << 16) / dh);
+	unsigned y;
+
+	for (y=0; y<dh; y++, dst += dls) {
+
+		unsigned p  = src_pos(y, step);
+		unsigned y0 = p >> 8;
+		unsigned f  = p & 0xff;
+		const uint8_t *row = src + (size_t)y0 * sls;
+		uint8_t *out = dw == sw ? dst : tmp;
+
+		if (y0 + 1 >= sh) {
+			row = src + (size_t)(sh - 1) * sls;
+			f = 0;
+		}
+
+		if (f) {
+			((lerp_h *)lerp_row)(out, row, row + sls,
+					     sw * bpp, f);
+			row = out;
+		}
+
+		if (dw != sw)
+			hscale_row(dst, dw, row, sw, bpp);
+		else if (row != dst)
+			memcpy(dst, row, sw * bpp);
+	}
+}
+
+
+/**
+ * Scale a YUV frame into a rectangle of another frame. Both frames must
+ * have the same pixel format, which must be YUV420P or NV12.
+ *
+ * @param dst  Destination frame
+ * @param rect Destination rectangle, NULL for the whole frame
+ * @param src  Source frame
+ *
+ * @return 0 if success, ENOTSUP if the formats are not supported,
+ *         otherwise errorcode
+ */
+int vidframe_scale(struct vidframe *dst, const struct vidrect *rect,
+		   const struct vidframe *src)
+{
+	unsigned x, y, w, h, sw, sh, i;
+
+	if (!dst || !src)
+		return EINVAL;
+
+	if (dst->fmt != src->fmt)
+		return ENOTSUP;
+
+	if (src->fmt != VID_FMT_YUV420P && src->fmt != VID_FMT_NV12)
+		return ENOTSUP;
+
+	if (rect) {
+		x = rect->x;
+		y = rect->y;
+		w = rect->w;
+		h = rect->h;
+	}
+	else {
+		x = y = 0;
+		w = dst->size.w;
+		h = dst->size.h;
+	}
+
+	/* chroma is subsampled by two in both directions */
+	x &= ~1u;
+	y &= ~1u;
+	w &= ~1u;
+	h &= ~1u;
+	sw = src->size.w & ~1u;
+	sh = src->size.h & ~1u;
+
+	if (x + w > dst->size.w || y + h > dst->size.h)
+		return EINVAL;
+
+	if (!w || !h || !sw || !sh)
+		return 0;
+
+	if (sw > ROW_MAX)
+		return ENOTSUP;
+
+	scale_plane(dst->data[0] + (size_t)y * dst->linesize[0] + x,
+		    dst->linesize[0], w, h,
+		    src->data[0], src->linesize[0], sw, sh, 1);
+
+	if (src->fmt == VID_FMT_NV12) {
+
+		scale_plane(dst->data[1] + (size_t)y/2 * dst->linesize[1] + x,
+			    dst->linesize[1], w/2, h/2,
+			    src->data[1], src->linesize[1], sw/2, sh/2, 2);
+
+		return 0;
+	}
+
+	for (i=1; i<3; i++) {
+
+		scale_plane(dst->data[i] + (size_t)y/2 * dst->linesize[i]
+			    + x/2, dst->linesize[i], w/2, h/2,
+			    src->data[i], src->linesize[i], sw/2, sh/2, 1);
+	}
+
+	return 0;
+}
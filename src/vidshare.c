@@ -0,0 +1,313 @@
+/**
+ * @file vidshare.c  Video sources shared by several streams
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * A video device is opened once, by the first subscriber, and closed
+ * when the last subscriber is gone. Every captured frame is given to
+ * all subscribers. The frame is the one of the device, so it must not
+ * be changed. A subscriber that wants another size than the device was
+ * opened with gets a scaled copy, and one that wants fewer frames per
+ * second gets every n-th frame only.
+ *
+ * The frames arrive on the thread of the device, the subscribers come
+ * and go in the main thread. The lock protects the list of subscribers,
+ * and a subscriber is not called any more once it is freed.
+ */
+
+
+struct vidshare {
+	struct le le;
+	struct vidsrc_st *st;       /**< Device state                   */
+	struct lock *lock;          /**< Protects subl                  */
+	struct list subl;           /**< Subscribers                    */
+	struct vidsrc_prm prm;      /**< Parameters the device has      */
+	struct vidsz size;          /**< Size the device was opened at  */
+	char name[32];              /**< Video source module            */
+	char dev[128];              /**< Device name                    */
+};
+
+struct vidsrc_sub {
+	struct le le;
+	struct vidshare *sh;
+	struct vidframe *frame;     /**< Scaled copy, or NULL           */
+	struct vidsz size;          /**< Wanted size, 0 for any         */
+	int fps;                    /**< Wanted frame-rate              */
+	int acc;                    /**< Frame-rate accumulator         */
+	vidsrc_frame_h *frameh;
+	vidsrc_error_h *errorh;
+	void *arg;
+};
+
+
+static struct list sharel = LIST_INIT;
+
+
+static void share_destructor(void *arg)
+{
+	struct vidshare *sh = arg;
+
+	list_unlink(&sh->le);
+	mem_deref(sh->st);
+	mem_deref(sh->lock);
+}
+
+
+static void sub_destructor(void *arg)
+{
+	struct vidsrc_sub *sub = arg;
+
+	if (sub->sh) {
+		lock_write_get(sub->sh->lock);
+		list_unlink(&sub->le);
+		lock_rel(sub->sh->lock);
+	}
+
+	mem_deref(sub->sh);
+	mem_deref(sub->frame);
+}
+
+
+static void sub_frame(struct vidsrc_sub *sub, struct vidframe *frame)
+{
+	const int fps = sub->sh->prm.fps;
+
+	/* every n-th frame, for a lower frame-rate */
+	if (sub->fps < fps) {
+
+		sub->acc += sub->fps;
+		if (sub->acc < fps)
+			return;
+
+		sub->acc -= fps;
+	}
+
+	if (sub->size.w && !vidsz_cmp(&sub->size, &frame->size)) {
+
+		if (!sub->frame && vidframe_alloc(&sub->frame, frame->fmt,
+						  &sub->size))
+			return;
+
+		vidconv(sub->frame, frame, NULL);
+		frame = sub->frame;
+	}
+
+	sub->frameh(frame, sub->arg);
+}
+
+
+static void frame_handler(struct vidframe *frame, void *arg)
+{
+	struct vidshare *sh = arg;
+	struct le *le;
+
+	lock_read_get(sh->lock);
+
+	for (le = sh->subl.head; le; le = le->next)
+		sub_frame(le->data, frame);
+
+	lock_rel(sh->lock);
+}
+
+
+static void error_handler(int err, void *arg)
+{
+	struct vidshare *sh = arg;
+	struct list subl = LIST_INIT;
+	struct le *le;
+
+	warning("vidshare: %s,%s: video source error (%m)\n",
+		sh->name, sh->dev, err);
+
+	/* a new subscriber opens the device again */
+	list_unlink(&sh->le);
+
+	lock_write_get(sh->lock);
+
+	while ((le = sh->subl.head)) {
+		list_unlink(le);
+		list_append(&subl, le, le->data);
+	}
+
+	lock_rel(sh->lock);
+
+	/* the subscriber may free itself in the handler */
+	while ((le = subl.head)) {
+
+		struct vidsrc_sub *sub = le->data;
+
+		list_unlink(le);
+
+		if (sub->errorh)
+			sub->errorh(err, sub->arg);
+	}
+}
+
+
+static struct vidshare *share_find(const char *name, const char *dev)
+{
+	struct le *le;
+
+	for (le = sharel.head; le; le = le->next) {
+
+		struct vidshare *sh = le->data;
+
+		if (!str_casecmp(sh->name, name) && !str_cmp(sh->dev, dev))
+			return sh;
+	}
+
+	return NULL;
+}
+
+
+static int share_alloc(struct vidshare **shp, const struct vidsrc *vs,
+		       const struct vidsrc_prm *prm, const struct vidsz *size,
+		       const char *dev)
+{
+	struct vidshare *sh;
+	int err;
+
+	sh = mem_zalloc(sizeof(*sh), share_destructor);
+	if (!sh)
+		return ENOMEM;
+
+	str_ncpy(sh->name, vs->name, sizeof(sh->name));
+	str_ncpy(sh->dev, dev, sizeof(sh->dev));
+	sh->prm  = *prm;
+	sh->size = *size;
+
+	err = lock_alloc(&sh->lock);
+	if (err)
+		goto out;
+
+	err = vs->alloch(&sh->st, vs, NULL, &sh->prm, &sh->size, NULL,
+			 sh->dev, frame_handler, error_handler, sh);
+	if (err)
+		goto out;
+
+	list_append(&sharel, &sh->le, sh);
+
+	info("vidshare: opened %s,%s (%u x %u, %d fps)\n",
+	     sh->name, sh->dev, sh->size.w, sh->size.h, sh->prm.fps);
+
+ out:
+	if (err)
+		mem_deref(sh);
+	else
+		*shp = sh;
+
+	return err;
+}
+
+
+/**
+ * Subscribe to the frames of a video device, the device is opened if
+ * no one else has it open
+ *
+ * @param subp   Pointer to allocated subscription
+ * @param name   Name of the video source
+ * @param prm    Wanted video source parameters
+ * @param size   Wanted video size
+ * @param dev    Video device
+ * @param frameh Video frame handler
+ * @param errorh Error handler (optional)
+ * @param arg    Handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int vidsrc_subscribe(struct vidsrc_sub **subp, const char *name,
+		     const struct vidsrc_prm *prm, const struct vidsz *size,
+		     const char *dev, vidsrc_frame_h *frameh,
+		     vidsrc_error_h *errorh, void *arg)
+{
+	const struct vidsrc *vs = vidsrc_find(name);
+	struct vidsrc_sub *sub;
+	struct vidshare *sh;
+	int err = 0;
+
+	if (!subp || !prm || !size || !frameh)
+		return EINVAL;
+
+	if (!vs)
+		return ENOENT;
+
+	if (!dev)
+		dev = "";
+
+	sub = mem_zalloc(sizeof(*sub), sub_destructor);
+	if (!sub)
+		return ENOMEM;
+
+	sub->fps    = prm->fps;
+	sub->frameh = frameh;
+	sub->errorh = errorh;
+	sub->arg    = arg;
+
+	sh = share_find(vs->name, dev);
+	if (sh) {
+		sub->sh = mem_ref(sh);
+
+		/* the first subscriber gets the frames as they are */
+		if (!vidsz_cmp(&sh->size, size))
+			sub->size = *size;
+	}
+	else {
+		err = share_alloc(&sub->sh, vs, prm, size, dev);
+		if (err)
+			goto out;
+	}
+
+	lock_write_get(sub->sh->lock);
+	list_append(&sub->sh->subl, &sub->le, sub);
+	lock_rel(sub->sh->lock);
+
+ out:
+	if (err)
+		mem_deref(sub);
+	else
+		*subp = sub;
+
+	return err;
+}
+
+
+/**
+ * Get the state of the device that a subscription gets its frames from
+ *
+ * @param sub Subscription
+ *
+ * @return Video source state, shared with the other subscribers
+ */
+struct vidsrc_st *vidsrc_sub_st(const struct vidsrc_sub *sub)
+{
+	return sub && sub->sh ? sub->sh->st : NULL;
+}
+
+
+/**
+ * Get the number of subscribers of the same device
+ *
+ * @param sub Subscription
+ *
+ * @return Number of subscribers, including this one
+ */
+uint32_t vidsrc_sub_count(const struct vidsrc_sub *sub)
+{
+	uint32_t n;
+
+	if (!sub || !sub->sh)
+		return 0;
+
+	lock_read_get(sub->sh->lock);
+	n = list_count(&sub->sh->subl);
+	lock_rel(sub->sh->lock);
+
+	return n;
+}
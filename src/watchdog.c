@@ -0,0 +1,243 @@
+/**
+ * @file watchdog.c  Main loop lag monitor
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <string.h>
+#include <time.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * A tick timer on the main loop stores a heartbeat, and records how
+ * late it fired in a histogram. The watchdog thread looks at the
+ * heartbeat; when it is older than the threshold the main loop is
+ * blocked, and a warning names the handler that is running, as far as
+ * it was marked with watchdog_enter(). The warning is given while the
+ * loop is still blocked, so a handler that never returns is found too.
+ */
+
+
+#if defined (__GNUC__) || defined (__clang__)
+#define LOAD(p)        __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define XCHG(p, v)     __atomic_exchange_n((p), (v), __ATOMIC_RELAXED)
+#else
+#error "watchdog: atomic builtins are required"
+#endif
+
+
+enum {
+	TICK_INTERVAL = 100,  /**< Main loop tick interval [ms]          */
+	POLL_INTERVAL = 50,   /**< Watchdog thread poll interval [ms]    */
+	LAG_HIST      = 12,   /**< Lag histogram, 2^n ms buckets         */
+};
+
+
+static struct {
+	struct tmr tmr;
+	uint32_t threshold;   /**< Alert threshold [ms], 0 = off         */
+	uint64_t beat;        /**< Time of the last tick [ms]            */
+	const char *handler;  /**< Handler running on the main loop      */
+	uint64_t n;
+	uint64_t max;
+	uint64_t n_alert;
+	uint64_t histv[LAG_HIST];
+#ifdef HAVE_PTHREAD
+	pthread_t tid;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool run;
+#endif
+} wd = {
+#ifdef HAVE_PTHREAD
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond  = PTHREAD_COND_INITIALIZER,
+#endif
+};
+
+
+static void tick_handler(void *arg)
+{
+	const uint64_t now = tmr_jiffies();
+	const uint64_t beat = LOAD(&wd.beat);
+	uint64_t lag;
+	unsigned b = 0;
+	(void)arg;
+
+	tmr_start(&wd.tmr, TICK_INTERVAL, tick_handler, NULL);
+
+	lag = now > beat + TICK_INTERVAL ? now - beat - TICK_INTERVAL : 0;
+
+	while (b < LAG_HIST - 1 && (1ULL << b) <= lag)
+		++b;
+
+	++wd.histv[b];
+	++wd.n;
+	wd.max = max(wd.max, lag);
+
+	STORE(&wd.beat, now);
+}
+
+
+#ifdef HAVE_PTHREAD
+static void *thread_handler(void *arg)
+{
+	uint64_t alerted = 0;
+	(void)arg;
+
+	pthread_mutex_lock(&wd.mutex);
+
+	while (wd.run) {
+
+		struct timespec ts;
+		uint64_t beat, now, lag;
+
+		(void)clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += POLL_INTERVAL * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_nsec -= 1000000000;
+			++ts.tv_sec;
+		}
+
+		(void)pthread_cond_timedwait(&wd.cond, &wd.mutex, &ts);
+
+		beat = LOAD(&wd.beat);
+		now  = tmr_jiffies();
+		lag  = now > beat + TICK_INTERVAL ?
+			now - beat - TICK_INTERVAL : 0;
+
+		/* one warning per stall */
+		if (lag < wd.threshold || beat == alerted)
+			continue;
+
+		alerted = beat;
+		STORE(&wd.n_alert, wd.n_alert + 1);
+
+		warning("watchdog: main loop blocked for %llu ms"
+			" (handler: %s)\n",
+			lag, LOAD(&wd.handler) ? LOAD(&wd.handler) : "?");
+	}
+
+	pthread_mutex_unlock(&wd.mutex);
+
+	return NULL;
+}
+#endif
+
+
+/**
+ * Start the main loop watchdog
+ *
+ * @param threshold Lag that gives a warning [ms], 0 to disable
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int watchdog_init(uint32_t threshold)
+{
+	int err = 0;
+
+	watchdog_close();
+
+	if (!threshold)
+		return 0;
+
+	wd.threshold = threshold;
+	wd.n = wd.max = wd.n_alert = 0;
+	memset(wd.histv, 0, sizeof(wd.histv));
+	STORE(&wd.beat, tmr_jiffies());
+
+	tmr_start(&wd.tmr, TICK_INTERVAL, tick_handler, NULL);
+
+#ifdef HAVE_PTHREAD
+	wd.run = true;
+	err = pthread_create(&wd.tid, NULL, thread_handler, NULL);
+	if (err) {
+		wd.run = false;
+		tmr_cancel(&wd.tmr);
+		warning("watchdog: could not start thread (%m)\n", err);
+		return err;
+	}
+#endif
+
+	info("watchdog: main loop lag threshold %u ms\n", threshold);
+
+	return err;
+}
+
+
+void watchdog_close(void)
+{
+	tmr_cancel(&wd.tmr);
+
+#ifdef HAVE_PTHREAD
+	if (wd.run) {
+		pthread_mutex_lock(&wd.mutex);
+		wd.run = false;
+		pthread_cond_signal(&wd.cond);
+		pthread_mutex_unlock(&wd.mutex);
+
+		pthread_join(wd.tid, NULL);
+	}
+#endif
+
+	wd.threshold = 0;
+}
+
+
+/**
+ * Mark the handler that is running on the main loop. Calls from the
+ * event loops of the User-Agents are ignored.
+ *
+ * @param name Name of the handler, must be a static string, or the
+ *             value returned by the matching call to leave it
+ *
+ * @return The previous handler, to be given back when it returns
+ */
+const char *watchdog_enter(const char *name)
+{
+	if (shard_loop())
+		return NULL;
+
+	return XCHG(&wd.handler, name);
+}
+
+
+/**
+ * Print the main loop lag histogram
+ *
+ * @param pf     Print handler
+ * @param unused Unused parameter
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int watchdog_debug(struct re_printf *pf, void *unused)
+{
+	unsigned i, last = 0;
+	int err = 0;
+	(void)unused;
+
+	if (!wd.threshold)
+		return re_hprintf(pf, "watchdog: not enabled\n");
+
+	err |= re_hprintf(pf, "watchdog: threshold=%u ms ticks=%llu"
+			  " max=%llu ms alerts=%llu\n",
+			  wd.threshold, wd.n, wd.max, LOAD(&wd.n_alert));
+
+	for (i=0; i<LAG_HIST; i++) {
+		if (wd.histv[i])
+			last = i + 1;
+	}
+
+	for (i=0; i<last; i++) {
+		err |= re_hprintf(pf, "  lag < %5u ms: %llu\n",
+				  1u << i, wd.histv[i]);
+	}
+
+	return err;
+}
@@ -0,0 +1,235 @@
+/**
+ * @file wsola.c  Time-scale modification of audio (WSOLA)
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <math.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+
+
+/*
+ * Waveform Similarity Overlap-Add, pitch-synchronous variant.
+ *
+ * One frame of decoded audio is shortened or lengthened by exactly one
+ * pitch period. The period is found by maximising the normalised
+ * cross-correlation between two adjacent segments of the frame, and the
+ * segments are cross-faded so the waveform stays continuous. Only one
+ * frame in WSOLA_INTERVAL is modified, which keeps the change of the
+ * playout rate within a few percent.
+ */
+
+
+enum {
+	WSOLA_INTERVAL = 4,      /* modify at most every n-th frame       */
+};
+
+#define WSOLA_MIN_CORR     0.7      /* minimum similarity of segments */
+#define WSOLA_SILENCE_POW  (64.0*64.0)
+
+
+struct wsola {
+	uint32_t srate;
+	uint8_t ch;
+	size_t lmin;             /**< Minimum period in sample-frames     */
+	size_t lmax;             /**< Maximum period in sample-frames     */
+	size_t step;             /**< Decimation for the coarse search    */
+	unsigned holdoff;        /**< Frames until next modification      */
+	uint32_t n_compress;     /**< Number of compressed frames         */
+	uint32_t n_stretch;      /**< Number of stretched frames          */
+};
+
+
+/* cross-correlation of channel 0 between x[0..len) and x[lag..lag+len) */
+static double xcorr(const int16_t *x, uint8_t ch, size_t lag, size_t len,
+		    size_t step, double *powp)
+{
+	double xy = 0, xx = 0, yy = 0;
+	size_t i;
+
+	for (i=0; i<len; i+=step) {
+		double a = x[i*ch];
+		double b = x[(i+lag)*ch];
+
+		xy += a * b;
+		xx += a * a;
+		yy += b * b;
+	}
+
+	if (powp)
+		*powp = (xx + yy) / (2.0 * (len / step + 1));
+
+	if (xx <= 0 || yy <= 0)
+		return 0;
+
+	return xy / sqrt(xx * yy);
+}
+
+
+static size_t find_period(const struct wsola *w, const int16_t *x,
+			  size_t nframes, double *corrp, double *powp)
+{
+	size_t lmax = min(w->lmax, nframes / 2);
+	size_t lag, best = 0, lo, hi;
+	double c, cbest = -1;
+
+	if (lmax < w->lmin)
+		return 0;
+
+	/* coarse search */
+	for (lag = w->lmin; lag <= lmax; lag += w->step) {
+
+		c = xcorr(x, w->ch, lag, lag, w->step, NULL);
+		if (c > cbest) {
+			cbest = c;
+			best  = lag;
+		}
+	}
+
+	/* refine around the best coarse lag */
+	lo = best > w->lmin + w->step ? best - w->step : w->lmin;
+	hi = min(best + w->step, lmax);
+
+	for (lag = lo; lag <= hi; lag++) {
+
+		c = xcorr(x, w->ch, lag, lag, 1, NULL);
+		if (c >= cbest) {
+			cbest = c;
+			best  = lag;
+		}
+	}
+
+	(void)xcorr(x, w->ch, best, best, 1, powp);
+	*corrp = cbest;
+
+	return best;
+}
+
+
+int wsola_alloc(struct wsola **wp, uint32_t srate, uint8_t ch)
+{
+	struct wsola *w;
+
+	if (!wp || !srate || !ch)
+		return EINVAL;
+
+	w = mem_zalloc(sizeof(*w), NULL);
+	if (!w)
+		return ENOMEM;
+
+	w->srate = srate;
+	w->ch    = ch;
+	w->lmin  = max(srate / 400, 1);    /* 2.5 ms, 400 Hz */
+	w->lmax  = max(srate / 100, 2);    /* 10 ms,  100 Hz */
+	w->step  = max(srate / 8000, 1);
+
+	*wp = w;
+
+	return 0;
+}
+
+
+/**
+ * Compress or stretch one frame of audio by one pitch period
+ *
+ * @param w     WSOLA state
+ * @param outv  Output buffer
+ * @param outsz Size of output buffer in samples
+ * @param inv   Input samples (interleaved)
+ * @param inc   Number of input samples
+ * @param dir   Negative to compress, positive to stretch
+ *
+ * @return Number of output samples, or 0 if the frame was not modified
+ *
+ * @note This function has REAL-TIME properties
+ */
+size_t wsola_process(struct wsola *w, int16_t *outv, size_t outsz,
+		     const int16_t *inv, size_t inc, int dir)
+{
+	size_t nframes, per, i, n;
+	double corr, pw;
+	uint8_t ch, c;
+
+	if (!w || !outv || !inv || !dir)
+		return 0;
+
+	if (w->holdoff) {
+		--w->holdoff;
+		return 0;
+	}
+
+	ch = w->ch;
+	nframes = inc / ch;
+
+	per = find_period(w, inv, nframes, &corr, &pw);
+	if (!per)
+		return 0;
+
+	/* in silence any period will do */
+	if (corr < WSOLA_MIN_CORR && pw > WSOLA_SILENCE_POW)
+		return 0;
+
+	if (dir < 0) {
+
+		/* x[0..P) x-fade x[P..2P), then x[2P..N) */
+		n = (nframes - per) * ch;
+		if (n > outsz)
+			return 0;
+
+		for (i=0; i<per; i++) {
+			for (c=0; c<ch; c++) {
+				int32_t a = inv[i*ch + c];
+				int32_t b = inv[(i+per)*ch + c];
+
+				outv[i*ch + c] = (int16_t)
+					((a * (int32_t)(per - i)
+					  + b * (int32_t)i) / (int32_t)per);
+			}
+		}
+
+		memcpy(&outv[per*ch], &inv[2*per*ch],
+		       (nframes - 2*per) * ch * sizeof(int16_t));
+
+		++w->n_compress;
+	}
+	else {
+		/* x[0..P), x[P..2P) x-fade x[0..P), then x[P..N) */
+		n = (nframes + per) * ch;
+		if (n > outsz)
+			return 0;
+
+		memcpy(outv, inv, per*ch * sizeof(int16_t));
+
+		for (i=0; i<per; i++) {
+			for (c=0; c<ch; c++) {
+				int32_t a = inv[(i+per)*ch + c];
+				int32_t b = inv[i*ch + c];
+
+				outv[(per + i)*ch + c] = (int16_t)
+					((a * (int32_t)(per - i)
+					  + b * (int32_t)i) / (int32_t)per);
+			}
+		}
+
+		memcpy(&outv[2*per*ch], &inv[per*ch],
+		       (nframes - per) * ch * sizeof(int16_t));
+
+		++w->n_stretch;
+	}
+
+	w->holdoff = WSOLA_INTERVAL - 1;
+
+	return n;
+}
+
+
+int wsola_debug(struct re_printf *pf, const struct wsola *w)
+{
+	if (!w)
+		return 0;
+
+	return re_hprintf(pf, "wsola: compressed=%u stretched=%u",
+			  w->n_compress, w->n_stretch);
+}
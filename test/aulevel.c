@@ -0,0 +1,48 @@
+/**
+ * @file test/aulevel.c  Test the audio level metering
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "test.h"
+
+
+int test_aulevel(void)
+{
+	struct aulevel lvl;
+	int16_t sampv[160];
+	size_t i;
+	int err = 0;
+
+	/* silence */
+	memset(sampv, 0, sizeof(sampv));
+	aulevel_calc(&lvl, sampv, ARRAY_SIZE(sampv));
+	ASSERT_EQ(0, lvl.rms);
+	ASSERT_EQ(0, lvl.peak);
+	ASSERT_EQ(127, lvl.dbov);
+	ASSERT_TRUE(!lvl.voice);
+
+	/* full-scale square wave */
+	for (i=0; i<ARRAY_SIZE(sampv); i++)
+		sampv[i] = (i & 1) ? -32768 : 32767;
+	aulevel_calc(&lvl, sampv, ARRAY_SIZE(sampv));
+	ASSERT_EQ(32767, lvl.rms);
+	ASSERT_EQ(32767, lvl.peak);
+	ASSERT_EQ(0, lvl.dbov);
+	ASSERT_TRUE(lvl.voice);
+
+	/* low level noise floor, about -70 dBov */
+	for (i=0; i<ARRAY_SIZE(sampv); i++)
+		sampv[i] = (i & 1) ? -10 : 10;
+	sampv[7] = -20;
+	aulevel_calc(&lvl, sampv, ARRAY_SIZE(sampv));
+	ASSERT_EQ(10, lvl.rms);
+	ASSERT_EQ(20, lvl.peak);
+	ASSERT_EQ(70, lvl.dbov);
+	ASSERT_TRUE(!lvl.voice);
+
+ out:
+	return err;
+}
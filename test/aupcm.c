@@ -0,0 +1,53 @@
+/**
+ * @file test/aupcm.c  Test the audio sample conversion
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "test.h"
+
+
+int test_aupcm(void)
+{
+	static int16_t sampv[65536], out[65536];
+	static uint8_t buf[65536];
+	size_t i;
+	int err = 0;
+
+	for (i=0; i<ARRAY_SIZE(sampv); i++)
+		sampv[i] = (int16_t)(i - 32768);
+
+	/* all samples, with an odd count for the scalar tail */
+	aupcm_ulaw_encode(buf, sampv, ARRAY_SIZE(sampv) - 1);
+	for (i=0; i<ARRAY_SIZE(sampv) - 1; i++)
+		ASSERT_EQ(g711_pcm2ulaw(sampv[i]), buf[i]);
+
+	aupcm_alaw_encode(buf, sampv, ARRAY_SIZE(sampv) - 1);
+	for (i=0; i<ARRAY_SIZE(sampv) - 1; i++)
+		ASSERT_EQ(g711_pcm2alaw(sampv[i]), buf[i]);
+
+	/* all codewords */
+	for (i=0; i<259; i++)
+		buf[i] = (uint8_t)i;
+
+	aupcm_ulaw_decode(out, buf, 259);
+	for (i=0; i<259; i++)
+		ASSERT_EQ(g711_ulaw2pcm(buf[i]), out[i]);
+
+	aupcm_alaw_decode(out, buf, 259);
+	for (i=0; i<259; i++)
+		ASSERT_EQ(g711_alaw2pcm(buf[i]), out[i]);
+
+	/* swap twice in place */
+	aupcm_swap16(out, sampv, 1003);
+	ASSERT_EQ(0x0080, (uint16_t)out[0]);
+	ASSERT_EQ(0x0180, (uint16_t)out[1]);
+	aupcm_swap16(out, out, 1003);
+	for (i=0; i<1003; i++)
+		ASSERT_EQ(sampv[i], out[i]);
+
+ out:
+	return err;
+}
@@ -0,0 +1,77 @@
+/**
+ * @file test/auring.c  Test the lock-free audio sample ring
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "test.h"
+
+
+int test_auring(void)
+{
+	struct auring *ar = NULL;
+	int16_t sampv[48], out[48];
+	size_t i, n;
+	int err;
+
+	for (i=0; i<ARRAY_SIZE(sampv); i++)
+		sampv[i] = (int16_t)i;
+
+	err = auring_alloc(&ar, 0, 40);
+	TEST_ERR(err);
+
+	/* capacity is rounded up to 64 samples */
+	ASSERT_EQ(0, auring_cur_sampc(ar));
+
+	n = auring_write(ar, sampv, 48);
+	ASSERT_EQ(48, n);
+	ASSERT_EQ(48, auring_cur_sampc(ar));
+
+	/* overrun: only 16 samples of space left */
+	n = auring_write(ar, sampv, 48);
+	ASSERT_EQ(16, n);
+	ASSERT_EQ(64, auring_cur_sampc(ar));
+
+	n = auring_read(ar, out, 48);
+	ASSERT_EQ(48, n);
+	ASSERT_TRUE(0 == memcmp(out, sampv, sizeof(sampv)));
+
+	/* wrap-around */
+	n = auring_write(ar, sampv, 40);
+	ASSERT_EQ(40, n);
+
+	n = auring_read(ar, out, 16);
+	ASSERT_EQ(16, n);
+	ASSERT_TRUE(0 == memcmp(out, sampv, 16 * sizeof(int16_t)));
+
+	n = auring_read(ar, out, 40);
+	ASSERT_EQ(40, n);
+	ASSERT_TRUE(0 == memcmp(out, sampv, 40 * sizeof(int16_t)));
+
+	/* underrun is filled with silence */
+	out[0] = 1;
+	n = auring_read(ar, out, 8);
+	ASSERT_EQ(0, n);
+	ASSERT_EQ(0, out[0]);
+
+	ar = mem_deref(ar);
+
+	/* prefill: nothing is read until the minimum level is reached */
+	err = auring_alloc(&ar, 32, 64);
+	TEST_ERR(err);
+
+	(void)auring_write(ar, sampv, 16);
+	n = auring_read(ar, out, 8);
+	ASSERT_EQ(0, n);
+	ASSERT_EQ(16, auring_cur_sampc(ar));
+
+	(void)auring_write(ar, sampv, 16);
+	n = auring_read(ar, out, 8);
+	ASSERT_EQ(8, n);
+
+ out:
+	mem_deref(ar);
+	return err;
+}
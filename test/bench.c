@@ -0,0 +1,524 @@
+/**
+ * @file test/bench.c  Baresip selftest -- micro-benchmarks
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#define _DEFAULT_SOURCE 1
+#include <string.h>
+#include <time.h>
+#include <re.h>
+#include <baresip.h>
+#include "../src/core.h"
+#include "test.h"
+
+
+/*
+ * Each benchmark runs its operation a fixed number of times and
+ * reports the time per operation, and the memory blocks of libre that
+ * are still held per operation afterwards. The blocks are counted by
+ * mem_get_stat(), which needs libre built with MEM_DEBUG; the system
+ * allocator is not wrapped, so the benchmarks also run under ASan and
+ * valgrind.
+ */
+
+
+enum {
+	PTIME      = 20,
+	SRATE      = 8000,
+	SAMPC      = SRATE * PTIME / 1000,
+	N_UA       = 10000,
+	PKTSZ      = 1200,
+	FRAME_PKTC = 4,
+};
+
+
+typedef int (bench_h)(void *arg, uint32_t n);
+
+
+static uint64_t now_ns(void)
+{
+#ifdef LINUX
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return tmr_jiffies() * 1000000;
+#endif
+}
+
+
+static int bench_run(const char *name, bench_h *h, void *arg, uint32_t n)
+{
+	struct memstat m0, m1;
+	bool stat;
+	uint64_t t0, ns;
+	int err;
+
+	/* warm up the caches and any lazily allocated state */
+	err = h(arg, n / 10 + 1);
+	if (err)
+		goto out;
+
+	stat = 0 == mem_get_stat(&m0);
+	t0 = now_ns();
+
+	err = h(arg, n);
+	if (err)
+		goto out;
+
+	ns = now_ns() - t0;
+
+	if (stat && 0 == mem_get_stat(&m1)) {
+		(void)re_printf("  %-24s %10.1f ns/op %8.2f blocks/op\n",
+				name, (double)ns / n,
+				((double)m1.blocks_cur - m0.blocks_cur) / n);
+	}
+	else {
+		(void)re_printf("  %-24s %10.1f ns/op\n",
+				name, (double)ns / n);
+	}
+
+ out:
+	if (err)
+		warning("bench: %s: %m\n", name, err);
+
+	return err;
+}
+
+
+/* aubuf read and G.711 encoding of one packet, like the audio TX */
+struct audio_bench {
+	struct aubuf *ab;
+	int16_t sampv[SAMPC];
+	uint8_t x[SAMPC];
+};
+
+
+static int bench_audio_tx(void *arg, uint32_t n)
+{
+	struct audio_bench *b = arg;
+	uint32_t i;
+	int err;
+
+	for (i = 0; i < n; i++) {
+
+		err = aubuf_write_samp(b->ab, b->sampv, SAMPC);
+		if (err)
+			return err;
+
+		aubuf_read_samp(b->ab, b->sampv, SAMPC);
+
+		aupcm_ulaw_encode(b->x, b->sampv, SAMPC);
+	}
+
+	return 0;
+}
+
+
+/* G.711 decoding of one packet into the aubuf, like the audio RX */
+static int bench_audio_rx(void *arg, uint32_t n)
+{
+	struct audio_bench *b = arg;
+	uint32_t i;
+	int err;
+
+	for (i = 0; i < n; i++) {
+
+		aupcm_ulaw_decode(b->sampv, b->x, SAMPC);
+
+		err = aubuf_write_samp(b->ab, b->sampv, SAMPC);
+		if (err)
+			return err;
+
+		aubuf_read_samp(b->ab, b->sampv, SAMPC);
+	}
+
+	return 0;
+}
+
+
+struct jbuf_bench {
+	struct jbuf *jb;
+	struct mbuf *mb;
+	uint16_t seq;
+};
+
+
+static int bench_jbuf(void *arg, uint32_t n)
+{
+	struct jbuf_bench *b = arg;
+	struct rtp_header hdr;
+	uint32_t i;
+	int err;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ssrc = 1;
+
+	for (i = 0; i < n; i++) {
+
+		struct rtp_header hdr2;
+		void *mem;
+
+		hdr.seq = b->seq++;
+		hdr.ts  = hdr.seq * SAMPC;
+
+		err = jbuf_put(b->jb, &hdr, b->mb);
+		if (err)
+			return err;
+
+		if (0 == jbuf_get(b->jb, &hdr2, &mem))
+			mem_deref(mem);
+	}
+
+	return 0;
+}
+
+
+#ifdef USE_VIDEO
+struct h264_bench {
+	uint8_t au[32768];
+	size_t npkt;
+};
+
+
+static int packet_handler(bool marker, const uint8_t *hdr, size_t hdr_len,
+			  const uint8_t *pld, size_t pld_len, void *arg)
+{
+	struct h264_bench *b = arg;
+	(void)marker;
+	(void)hdr;
+	(void)hdr_len;
+	(void)pld;
+	(void)pld_len;
+
+	++b->npkt;
+
+	return 0;
+}
+
+
+static int bench_h264(void *arg, uint32_t n)
+{
+	struct h264_bench *b = arg;
+	uint32_t i;
+	int err;
+
+	for (i = 0; i < n; i++) {
+
+		err = h264_packetize(b->au, sizeof(b->au), 1200,
+				     packet_handler, b);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+#endif
+
+
+/* Packet counters and histograms of one sent or received packet */
+static int bench_metric(void *arg, uint32_t n)
+{
+	struct metric *metric = arg;
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		metric_add_packet(metric, PKTSZ - (i & 0xff));
+
+	return 0;
+}
+
+
+#ifdef USE_VIDEO
+struct vidq_bench {
+	struct stream *strm;
+	struct video *v;
+	uint8_t pld[PKTSZ];
+	uint64_t jfs;
+	uint32_t ts;
+};
+
+
+static void rtp_handler(const struct rtp_header *hdr, struct mbuf *mb,
+			void *arg)
+{
+	(void)hdr;
+	(void)mb;
+	(void)arg;
+}
+
+
+/* The packets of one frame queued and sent by the pacer, like the
+ * video TX; the stream has no socket, so nothing goes on the wire */
+static int bench_vidqueue(void *arg, uint32_t n)
+{
+	struct vidq_bench *b = arg;
+	uint32_t i, j;
+	int err;
+
+	for (i = 0; i < n; i++) {
+
+		for (j = 0; j < FRAME_PKTC; j++) {
+
+			err = video_test_queue(b->v, j == FRAME_PKTC - 1,
+					       b->ts, b->pld, sizeof(b->pld));
+			if (err)
+				return err;
+		}
+
+		video_test_poll(b->v, b->jfs + PTIME, b->jfs);
+
+		b->jfs += PTIME;
+		b->ts  += 90000 / 50;
+	}
+
+	return 0;
+}
+
+
+static int bench_video(void)
+{
+	struct config_avt cfg;
+	struct vidq_bench *b;
+	int err;
+
+	b = mem_zalloc(sizeof(*b), NULL);
+	if (!b)
+		return ENOMEM;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.jbuf_del.min = 1;
+	cfg.jbuf_del.max = 1;
+
+	err = stream_test_alloc(&b->strm, &cfg, 90000, rtp_handler, NULL);
+	if (err)
+		goto out;
+
+	/* the token bucket refills a frame of packets in one frame time */
+	err = video_test_alloc(&b->v, b->strm, 4000000);
+	if (err)
+		goto out;
+
+	b->jfs = tmr_jiffies();
+
+	err = bench_run("vidqueue_poll (4 pkts)", bench_vidqueue, b, 100000);
+
+ out:
+	mem_deref(b->v);
+	mem_deref(b->strm);
+	mem_deref(b);
+
+	return err;
+}
+#endif
+
+
+static int bench_uag_find(void *arg, uint32_t n)
+{
+	struct pl cuser;
+	uint32_t i;
+	(void)arg;
+
+	pl_set_str(&cuser, "bench9999");
+
+	for (i = 0; i < n; i++) {
+
+		if (!uag_find(&cuser))
+			return ENOENT;
+	}
+
+	return 0;
+}
+
+
+static int cmd_nop(struct re_printf *pf, void *arg)
+{
+	(void)pf;
+	(void)arg;
+
+	return 0;
+}
+
+
+static int vprintf_null(const char *p, size_t size, void *arg)
+{
+	(void)p;
+	(void)size;
+	(void)arg;
+
+	return 0;
+}
+
+
+static const struct cmd cmdv[] = {
+	{NULL,    '@', 0, "Benchmark",  cmd_nop},
+	{"bench", 0,   0, "Benchmark",  cmd_nop},
+};
+
+
+static struct commands *commands;
+
+
+static int bench_cmd(void *arg, uint32_t n)
+{
+	struct re_printf pf = {vprintf_null, NULL};
+	struct cmd_ctx *ctx = NULL;
+	uint32_t i;
+	int err;
+	(void)arg;
+
+	for (i = 0; i < n; i++) {
+
+		err = cmd_process(commands, &ctx, '@', &pf, NULL);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+
+static int bench_cmd_long(void *arg, uint32_t n)
+{
+	struct re_printf pf = {vprintf_null, NULL};
+	uint32_t i;
+	int err;
+	(void)arg;
+
+	for (i = 0; i < n; i++) {
+
+		err = cmd_process_long(commands, "bench", 5, &pf, NULL);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+
+static int bench_uag(void)
+{
+	struct ua **uav;
+	uint32_t i;
+	int err;
+
+	uav = mem_zalloc(N_UA * sizeof(*uav), NULL);
+	if (!uav)
+		return ENOMEM;
+
+	err = ua_init("bench", true, false, false, false);
+	if (err)
+		goto out;
+
+	for (i = 0; i < N_UA; i++) {
+
+		char aor[64];
+
+		re_snprintf(aor, sizeof(aor),
+			    "<sip:bench%u@127.0.0.1>;regint=0", i);
+
+		err = ua_alloc(&uav[i], aor);
+		if (err)
+			goto out;
+	}
+
+	err = bench_run("uag_find (10k UAs)", bench_uag_find, NULL, 10000);
+
+ out:
+	for (i = 0; i < N_UA; i++)
+		mem_deref(uav[i]);
+	mem_deref(uav);
+	ua_close();
+
+	return err;
+}
+
+
+/**
+ * Run the micro-benchmarks of the core hot paths
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int test_bench(void)
+{
+	struct audio_bench ab;
+	struct jbuf_bench jb;
+	struct metric metric;
+#ifdef USE_VIDEO
+	struct h264_bench *hb = NULL;
+	size_t i;
+#endif
+	int err;
+
+	memset(&ab, 0, sizeof(ab));
+	memset(&jb, 0, sizeof(jb));
+	memset(&metric, 0, sizeof(metric));
+
+	(void)re_printf("benchmarks:\n");
+
+	err = aubuf_alloc(&ab.ab, SAMPC * 2, SAMPC * 2 * 8);
+	TEST_ERR(err);
+
+	err  = bench_run("audio tx (aubuf+g711)", bench_audio_tx, &ab, 100000);
+	err |= bench_run("audio rx (g711+aubuf)", bench_audio_rx, &ab, 100000);
+	TEST_ERR(err);
+
+	err = jbuf_alloc(&jb.jb, 2, 10);
+	TEST_ERR(err);
+
+	jb.mb = mbuf_alloc(SAMPC);
+	ASSERT_TRUE(jb.mb != NULL);
+
+	err = bench_run("jbuf put/get", bench_jbuf, &jb, 100000);
+	TEST_ERR(err);
+
+	err = bench_run("metric_add_packet", bench_metric, &metric, 1000000);
+	TEST_ERR(err);
+
+#ifdef USE_VIDEO
+	hb = mem_zalloc(sizeof(*hb), NULL);
+	ASSERT_TRUE(hb != NULL);
+
+	/* four NAL units with start codes */
+	for (i = 0; i < 4; i++) {
+
+		uint8_t *p = &hb->au[i * sizeof(hb->au) / 4];
+
+		p[2] = 1;
+		p[3] = i ? 0x01 : 0x65;
+	}
+
+	err = bench_run("h264_packetize (32k)", bench_h264, hb, 10000);
+	TEST_ERR(err);
+
+	err = bench_video();
+	TEST_ERR(err);
+#endif
+
+	err = cmd_init(&commands);
+	TEST_ERR(err);
+
+	err = cmd_register(commands, cmdv, ARRAY_SIZE(cmdv));
+	TEST_ERR(err);
+
+	err  = bench_run("cmd_process", bench_cmd, NULL, 100000);
+	err |= bench_run("cmd_process_long", bench_cmd_long, NULL, 100000);
+	cmd_unregister(commands, cmdv);
+	TEST_ERR(err);
+
+	err = bench_uag();
+	TEST_ERR(err);
+
+ out:
+	commands = mem_deref(commands);
+#ifdef USE_VIDEO
+	mem_deref(hb);
+#endif
+	mem_deref(jb.mb);
+	mem_deref(jb.jb);
+	mem_deref(ab.ab);
+
+	return err;
+}
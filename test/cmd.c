@@ -134,6 +134,9 @@ int test_cmd_long(void)
 	cmd = cmd_find_long(commands, "test");
 	ASSERT_TRUE(cmd != NULL);
 
+	/* long commands are found without case */
+	ASSERT_TRUE(cmd == cmd_find_long(commands, "TeSt"));
+
 	/* Feed it some input data .. */
 
 	for (i=0; i<strlen(input_str); i++) {
@@ -0,0 +1,225 @@
+/**
+ * @file test/fec.c  Test the RTP forward error correction
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "../src/core.h"
+#include "test.h"
+
+
+enum {
+	PT_MEDIA = 0,
+	PT_FEC   = 100,
+	SSRC     = 0x11223344,
+	N_MEDIA  = 4,
+	LOST     = 1,
+};
+
+struct fectest {
+	struct mbuf *sentv[N_MEDIA];
+	struct mbuf *recvv[N_MEDIA + 1];
+	unsigned n_recv;
+	unsigned n_recovered;
+	int err;
+};
+
+
+static void fectest_reset(struct fectest *ft)
+{
+	size_t i;
+
+	for (i=0; i<ARRAY_SIZE(ft->sentv); i++)
+		mem_deref(ft->sentv[i]);
+	for (i=0; i<ARRAY_SIZE(ft->recvv); i++)
+		mem_deref(ft->recvv[i]);
+}
+
+
+/* Media packet with a CSRC, and an audio level in a header extension */
+static int rtp_packet(struct mbuf **mbp, uint16_t seq, size_t len)
+{
+	struct rtp_header hdr;
+	struct mbuf *mb;
+	size_t i;
+	int err;
+
+	mb = mbuf_alloc(RTP_HEADER_SIZE + 12 + len);
+	if (!mb)
+		return ENOMEM;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ver     = RTP_VERSION;
+	hdr.m       = seq == 0;
+	hdr.pt      = PT_MEDIA;
+	hdr.seq     = seq;
+	hdr.ts      = seq * 160u;
+	hdr.ssrc    = SSRC;
+	hdr.cc      = 1;
+	hdr.csrc[0] = 0xcafe0000 | seq;
+	hdr.ext     = true;
+	hdr.x.type  = 0xbede;
+	hdr.x.len   = 1;
+
+	err  = rtp_hdr_encode(mb, &hdr);
+	err |= mbuf_write_u8(mb, 0x10);
+	err |= mbuf_write_u8(mb, 0x80 | (uint8_t)(seq + 30));
+	err |= mbuf_write_u16(mb, 0);
+
+	for (i=0; i<len; i++)
+		err |= mbuf_write_u8(mb, (uint8_t)(seq * 7 + i));
+
+	mb->pos = 0;
+
+	if (err)
+		mem_deref(mb);
+	else
+		*mbp = mb;
+
+	return err;
+}
+
+
+static void udp_recv_handler(const struct sa *src, struct mbuf *mb,
+			     void *arg)
+{
+	struct fectest *ft = arg;
+	struct mbuf *mbc;
+	(void)src;
+
+	if (ft->n_recv >= ARRAY_SIZE(ft->recvv))
+		return;
+
+	mbc = mbuf_alloc(mbuf_get_left(mb));
+	if (!mbc) {
+		ft->err = ENOMEM;
+		re_cancel();
+		return;
+	}
+
+	(void)mbuf_write_mem(mbc, mbuf_buf(mb), mbuf_get_left(mb));
+	mbc->pos = 0;
+
+	ft->recvv[ft->n_recv++] = mbc;
+
+	if (ft->n_recv == ARRAY_SIZE(ft->recvv))
+		re_cancel();
+}
+
+
+static void recover_handler(const struct rtp_header *hdr, struct mbuf *mb,
+			    void *arg)
+{
+	struct fectest *ft = arg;
+	const struct mbuf *sent = ft->sentv[LOST];
+	const size_t hlen = 4 * hdr->cc + 4 + 4 * hdr->x.len;
+	int err = 0;
+
+	ASSERT_EQ(LOST, hdr->seq);
+	ASSERT_EQ(PT_MEDIA, hdr->pt);
+	ASSERT_EQ(0, hdr->m);
+	ASSERT_EQ(LOST * 160, hdr->ts);
+	ASSERT_EQ(SSRC, hdr->ssrc);
+	ASSERT_EQ(1, hdr->cc);
+	ASSERT_TRUE(hdr->csrc[0] == (0xcafe0000 | LOST));
+	ASSERT_TRUE(hdr->ext);
+	ASSERT_EQ(0xbede, hdr->x.type);
+	ASSERT_EQ(1, hdr->x.len);
+
+	/* the payload follows the extension, as in a decoded packet */
+	ASSERT_EQ(hlen, mb->pos);
+	ASSERT_EQ(sent->end - RTP_HEADER_SIZE, mb->end);
+	ASSERT_TRUE(0 == memcmp(mb->buf, sent->buf + RTP_HEADER_SIZE,
+				mb->end));
+
+	++ft->n_recovered;
+
+ out:
+	if (err)
+		ft->err = err;
+}
+
+
+int test_fec(void)
+{
+	static const size_t lenv[N_MEDIA] = {160, 100, 160, 80};
+	struct fectest ft;
+	struct udp_sock *us_tx = NULL, *us_rx = NULL;
+	struct fec *tx = NULL, *rx = NULL;
+	struct rtp_header hdr;
+	struct sa laddr, dst;
+	unsigned i;
+	int err;
+
+	memset(&ft, 0, sizeof(ft));
+
+	err = sa_set_str(&laddr, "127.0.0.1", 0);
+	TEST_ERR(err);
+
+	err  = udp_listen(&us_tx, &laddr, NULL, NULL);
+	err |= udp_listen(&us_rx, &laddr, udp_recv_handler, &ft);
+	TEST_ERR(err);
+
+	err = udp_local_get(us_rx, &dst);
+	TEST_ERR(err);
+
+	err  = fec_alloc(&tx, us_tx, SSRC, recover_handler, &ft);
+	err |= fec_alloc(&rx, us_rx, rand_u32(), recover_handler, &ft);
+	TEST_ERR(err);
+
+	/* 10 percent loss: one FEC packet per group of 4 */
+	fec_set_pt(tx, PT_FEC, -1);
+	fec_set_pt(rx, -1, PT_FEC);
+	fec_set_loss(tx, 256 * 10 / 100);
+
+	for (i=0; i<N_MEDIA; i++) {
+
+		err = rtp_packet(&ft.sentv[i], i, lenv[i]);
+		TEST_ERR(err);
+
+		err = udp_send(us_tx, &dst, ft.sentv[i]);
+		TEST_ERR(err);
+
+		ft.sentv[i]->pos = 0;
+	}
+
+	err = fec_send(tx, &dst);
+	TEST_ERR(err);
+
+	err = re_main_timeout(5000);
+	TEST_ERR(err);
+	TEST_ERR(ft.err);
+
+	ASSERT_EQ(N_MEDIA + 1, ft.n_recv);
+
+	/* one media packet is lost, the others go to the history */
+	for (i=0; i<ft.n_recv; i++) {
+
+		struct mbuf *mb = ft.recvv[i];
+
+		err = rtp_hdr_decode(&hdr, mb);
+		TEST_ERR(err);
+
+		if (hdr.pt == PT_FEC) {
+			ASSERT_EQ(N_MEDIA, i);
+			fec_recv(rx, SSRC, mb);
+		}
+		else if (hdr.seq != LOST) {
+			fec_recv_media(rx, &hdr, mb);
+		}
+	}
+
+	TEST_ERR(ft.err);
+	ASSERT_EQ(1, ft.n_recovered);
+
+ out:
+	mem_deref(rx);
+	mem_deref(tx);
+	mem_deref(us_rx);
+	mem_deref(us_tx);
+	fectest_reset(&ft);
+
+	return err;
+}
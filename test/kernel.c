@@ -0,0 +1,171 @@
+/**
+ * @file test/kernel.c  Test the media kernels against the C version
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "test.h"
+
+
+enum {
+	N = 65536 + 7,          /* All 16-bit values, and a tail */
+};
+
+struct ktest {
+	const char *name;
+	void (*run)(void *out);
+	size_t size;            /* Bytes of output */
+};
+
+
+static int16_t sampv[N];
+static uint8_t codev[N];
+static int16_t ref[N], out[N];
+#ifdef USE_VIDEO
+static struct vidframe *src, *dst;
+#endif
+
+
+static void run_ulaw_enc(void *p)
+{
+	aupcm_ulaw_encode(p, sampv, N);
+}
+
+
+static void run_ulaw_dec(void *p)
+{
+	aupcm_ulaw_decode(p, codev, N);
+}
+
+
+static void run_alaw_enc(void *p)
+{
+	aupcm_alaw_encode(p, sampv, N);
+}
+
+
+static void run_alaw_dec(void *p)
+{
+	aupcm_alaw_decode(p, codev, N);
+}
+
+
+static void run_swap16(void *p)
+{
+	aupcm_swap16(p, sampv, N);
+}
+
+
+#ifdef USE_VIDEO
+/* Only blends rows, the width is the same */
+static void run_lerp(void *p)
+{
+	uint8_t *b = p;
+	unsigned i;
+
+	(void)vidframe_scale(dst, NULL, src);
+
+	for (i=0; i<3; i++) {
+		const size_t sz = (size_t)dst->linesize[i] *
+			(i ? dst->size.h / 2 : dst->size.h);
+
+		memcpy(b, dst->data[i], sz);
+		b += sz;
+	}
+}
+#endif
+
+
+static const struct ktest ktestv[] = {
+	{"ulaw_encode",   run_ulaw_enc, N},
+	{"ulaw_decode",   run_ulaw_dec, N * 2},
+	{"alaw_encode",   run_alaw_enc, N},
+	{"alaw_decode",   run_alaw_dec, N * 2},
+	{"swap16",        run_swap16,   N * 2},
+#ifdef USE_VIDEO
+	{"vidscale_lerp", run_lerp,     350 * 200 * 3 / 2},
+#endif
+};
+
+
+int test_kernel(void)
+{
+	static const char *isav[] = {"sse2", "avx2", "neon"};
+	size_t i, j;
+	int err = 0;
+
+	for (i=0; i<N; i++) {
+		sampv[i] = (int16_t)i;
+		codev[i] = (uint8_t)i;
+	}
+
+#ifdef USE_VIDEO
+	{
+		struct vidsz ssz = {350, 286}, dsz = {350, 200};
+
+		err  = vidframe_alloc(&src, VID_FMT_YUV420P, &ssz);
+		err |= vidframe_alloc(&dst, VID_FMT_YUV420P, &dsz);
+		if (err)
+			goto out;
+
+		for (i=0; i<3; i++) {
+			const size_t sz = (size_t)src->linesize[i] *
+				(i ? ssz.h / 2 : ssz.h);
+
+			for (j=0; j<sz; j++)
+				src->data[i][j] = (uint8_t)(j * 7 + j / 13);
+		}
+	}
+#endif
+
+	for (i=0; i<ARRAY_SIZE(ktestv); i++) {
+
+		const struct ktest *kt = &ktestv[i];
+
+		ASSERT_TRUE(kernel_isa(kt->name) != NULL);
+
+		err = kernel_select(kt->name, "c");
+		TEST_ERR(err);
+
+		memset(ref, 0, sizeof(ref));
+		kt->run(ref);
+
+		for (j=0; j<ARRAY_SIZE(isav); j++) {
+
+			err = kernel_select(kt->name, isav[j]);
+			if (err == ENOENT || err == ENOTSUP) {
+				err = 0;
+				continue;
+			}
+			TEST_ERR(err);
+
+			memset(out, 0x5a, sizeof(out));
+			kt->run(out);
+
+			if (memcmp(ref, out, kt->size)) {
+				warning("selftest: kernel %s: %s differs\n",
+					kt->name, isav[j]);
+				err = EBADMSG;
+				goto out;
+			}
+		}
+
+		err = kernel_select(kt->name, NULL);
+		TEST_ERR(err);
+	}
+
+ out:
+	/* the best implementations again */
+	for (i=0; i<ARRAY_SIZE(ktestv); i++)
+		(void)kernel_select(ktestv[i].name, NULL);
+
+#ifdef USE_VIDEO
+	src = mem_deref(src);
+	dst = mem_deref(dst);
+#endif
+
+	return err;
+}
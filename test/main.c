@@ -20,6 +20,9 @@ struct test {
 
 static const struct test tests[] = {
 	TEST(test_account),
+	TEST(test_aulevel),
+	TEST(test_aupcm),
+	TEST(test_auring),
 	TEST(test_call_af_mismatch),
 	TEST(test_call_answer),
 	TEST(test_call_answer_hangup_a),
@@ -36,8 +39,14 @@ static const struct test tests[] = {
 	TEST(test_cmd_long),
 	TEST(test_contact),
 	TEST(test_cplusplus),
+	TEST(test_fec),
+	TEST(test_kernel),
+	TEST(test_mock_clock),
 	TEST(test_mos),
+	TEST(test_mos_est),
 	TEST(test_network),
+	TEST(test_ptring),
+	TEST(test_stream_jbuf_adaptive),
 	TEST(test_ua_alloc),
 	TEST(test_ua_options),
 	TEST(test_ua_register),
@@ -137,6 +146,7 @@ static void usage(void)
 	(void)re_fprintf(stderr,
 			 "Usage: selftest [options] <testcases..>\n"
 			 "options:\n"
+			 "\t-b               Run the benchmarks and exit\n"
 			 "\t-l               List all testcases and exit\n"
 			 "\t-v               Verbose output (INFO level)\n"
 			 );
@@ -148,6 +158,7 @@ int main(int argc, char *argv[])
 	struct config *config;
 	size_t i, ntests;
 	bool verbose = false;
+	bool bench = false;
 	int err;
 
 	err = libre_init();
@@ -157,7 +168,7 @@ int main(int argc, char *argv[])
 	log_enable_info(false);
 
 	for (;;) {
-		const int c = getopt(argc, argv, "hlv");
+		const int c = getopt(argc, argv, "bhlv");
 		if (0 > c)
 			break;
 
@@ -168,6 +179,10 @@ int main(int argc, char *argv[])
 			usage();
 			return -2;
 
+		case 'b':
+			bench = true;
+			break;
+
 		case 'l':
 			test_listcases();
 			return 0;
@@ -208,6 +223,11 @@ int main(int argc, char *argv[])
 
 	uag_set_exit_handler(ua_exit_handler, NULL);
 
+	if (bench) {
+		err = test_bench();
+		goto out;
+	}
+
 	if (argc >= (optind + 1)) {
 
 		for (i=0; i<ntests; i++) {
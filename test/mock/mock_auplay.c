@@ -0,0 +1,103 @@
+/**
+ * @file mock/mock_auplay.c Mock audio player
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+#include <re.h>
+#include <baresip.h>
+#include "../test.h"
+
+
+struct auplay_st {
+	const struct auplay *ap;      /* inheritance */
+
+	struct mock_tick tick;
+	struct auplay_prm prm;
+	int16_t *sampv;
+	size_t sampc;
+	auplay_write_h *wh;
+	void *arg;
+};
+
+
+static unsigned n_write_total;
+
+
+static void tick_handler(void *arg)
+{
+	struct auplay_st *st = arg;
+
+	if (st->wh)
+		st->wh(st->sampv, st->sampc, st->arg);
+
+	++n_write_total;
+}
+
+
+static void auplay_destructor(void *arg)
+{
+	struct auplay_st *st = arg;
+
+	mock_tick_cancel(&st->tick);
+	mem_deref(st->sampv);
+}
+
+
+static int mock_auplay_alloc(struct auplay_st **stp, const struct auplay *ap,
+			     struct auplay_prm *prm, const char *device,
+			     auplay_write_h *wh, void *arg)
+{
+	struct auplay_st *st;
+	int err = 0;
+	(void)device;
+
+	if (!stp || !ap || !prm)
+		return EINVAL;
+
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
+	st = mem_zalloc(sizeof(*st), auplay_destructor);
+	if (!st)
+		return ENOMEM;
+
+	st->ap   = ap;
+	st->prm  = *prm;
+	st->wh   = wh;
+	st->arg  = arg;
+
+	st->sampc = prm->srate * prm->ch * prm->ptime / 1000;
+
+	st->sampv = mem_zalloc(2 * st->sampc, NULL);
+	if (!st->sampv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	mock_tick_start(&st->tick, prm->ptime, tick_handler, st);
+
+ out:
+	if (err)
+		mem_deref(st);
+	else
+		*stp = st;
+
+	return err;
+}
+
+
+int mock_auplay_register(struct auplay **auplayp)
+{
+	return auplay_register(auplayp, "mock-auplay", mock_auplay_alloc);
+}
+
+
+/**
+ * Get the number of writes to all the mock players
+ *
+ * @return Number of write handler calls
+ */
+unsigned mock_auplay_writes(void)
+{
+	return n_write_total;
+}
@@ -11,7 +11,7 @@
 struct ausrc_st {
 	const struct ausrc *as;      /* inheritance */
 
-	struct tmr tmr;
+	struct mock_tick tick;
 	struct ausrc_prm prm;
 	int16_t *sampv;
 	size_t sampc;
@@ -20,12 +20,10 @@ struct ausrc_st {
 };
 
 
-static void tmr_handler(void *arg)
+static void tick_handler(void *arg)
 {
 	struct ausrc_st *st = arg;
 
-	tmr_start(&st->tmr, st->prm.ptime, tmr_handler, st);
-
 	if (st->rh)
 		st->rh(st->sampv, st->sampc, st->arg);
 }
@@ -35,7 +33,7 @@ static void ausrc_destructor(void *arg)
 {
 	struct ausrc_st *st = arg;
 
-	tmr_cancel(&st->tmr);
+	mock_tick_cancel(&st->tick);
 	mem_deref(st->sampv);
 }
 
@@ -54,6 +52,9 @@ static int mock_ausrc_alloc(struct ausrc_st **stp, const struct ausrc *as,
 	if (!stp || !as || !prm)
 		return EINVAL;
 
+	if (prm->fmt != AUFMT_S16LE)
+		return ENOTSUP;
+
 	st = mem_zalloc(sizeof(*st), ausrc_destructor);
 	if (!st)
 		return ENOMEM;
@@ -71,7 +72,7 @@ static int mock_ausrc_alloc(struct ausrc_st **stp, const struct ausrc *as,
 		goto out;
 	}
 
-	tmr_start(&st->tmr, 0, tmr_handler, st);
+	mock_tick_start(&st->tick, prm->ptime, tick_handler, st);
 
  out:
 	if (err)
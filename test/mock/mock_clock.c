@@ -0,0 +1,183 @@
+/**
+ * @file mock/mock_clock.c Virtual clock for the mock media devices
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+#define _DEFAULT_SOURCE 1
+#include <time.h>
+#include <re.h>
+#include <baresip.h>
+#include "../test.h"
+
+
+/*
+ * The mock devices tick on a real timer by default. When the virtual
+ * clock is enabled they only tick when the test calls
+ * mock_clock_advance(), in deadline order, so media for many calls can
+ * run without waiting for real time.
+ */
+
+
+static struct {
+	struct list tickl;
+	uint64_t now;
+	uint64_t cpu_ns;
+	uint64_t n_tick;
+	bool enabled;
+} vclock;
+
+
+static uint64_t cpu_ns(void)
+{
+#ifdef LINUX
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return tmr_jiffies() * 1000000;
+#endif
+}
+
+
+static bool sort_handler(struct le *le1, struct le *le2, void *arg)
+{
+	const struct mock_tick *t1 = le1->data, *t2 = le2->data;
+	(void)arg;
+
+	return t1->next <= t2->next;
+}
+
+
+static void tmr_handler(void *arg)
+{
+	struct mock_tick *tick = arg;
+
+	tmr_start(&tick->tmr, tick->period, tmr_handler, tick);
+
+	tick->h(tick->arg);
+}
+
+
+/**
+ * Use the virtual clock for the devices that are started after this
+ *
+ * @param enable True to use the virtual clock, false for real time
+ */
+void mock_clock_enable(bool enable)
+{
+	vclock.enabled = enable;
+	vclock.now     = 0;
+	vclock.cpu_ns  = 0;
+	vclock.n_tick  = 0;
+}
+
+
+/**
+ * Get the time of the virtual clock
+ *
+ * @return Virtual time [ms]
+ */
+uint64_t mock_clock_now(void)
+{
+	return vclock.now;
+}
+
+
+/**
+ * Advance the virtual clock, all the device ticks that fall in the
+ * interval are run in order
+ *
+ * @param ms Interval [ms]
+ */
+void mock_clock_advance(uint32_t ms)
+{
+	const uint64_t end = vclock.now + ms;
+
+	/* the list is sorted by deadline */
+	for (;;) {
+		struct mock_tick *next = list_ledata(vclock.tickl.head);
+		uint64_t t0;
+
+		if (!next || next->next > end)
+			break;
+
+		vclock.now  = next->next;
+		next->next += max(next->period, 1u);
+
+		list_unlink(&next->le);
+		list_insert_sorted(&vclock.tickl, sort_handler, NULL,
+				   &next->le, next);
+
+		t0 = cpu_ns();
+		next->h(next->arg);
+		vclock.cpu_ns += cpu_ns() - t0;
+		++vclock.n_tick;
+	}
+
+	vclock.now = end;
+}
+
+
+/**
+ * Get the CPU time spent in the device ticks of the virtual clock
+ *
+ * @return CPU time [ns] since the clock was enabled
+ */
+uint64_t mock_clock_cpu_ns(void)
+{
+	return vclock.cpu_ns;
+}
+
+
+/**
+ * Get the number of device ticks of the virtual clock
+ *
+ * @return Number of ticks since the clock was enabled
+ */
+uint64_t mock_clock_ticks(void)
+{
+	return vclock.n_tick;
+}
+
+
+/**
+ * Start a periodic device tick, the first one is now
+ *
+ * @param tick   Tick object
+ * @param period Period [ms]
+ * @param h      Tick handler
+ * @param arg    Handler argument
+ */
+void mock_tick_start(struct mock_tick *tick, uint32_t period,
+		     mock_tick_h *h, void *arg)
+{
+	if (!tick || !h)
+		return;
+
+	mock_tick_cancel(tick);
+
+	tick->period = period;
+	tick->h      = h;
+	tick->arg    = arg;
+
+	if (vclock.enabled) {
+		tick->next = vclock.now;
+		list_insert_sorted(&vclock.tickl, sort_handler, NULL,
+				   &tick->le, tick);
+	}
+	else {
+		tmr_start(&tick->tmr, 0, tmr_handler, tick);
+	}
+}
+
+
+void mock_tick_cancel(struct mock_tick *tick)
+{
+	if (!tick)
+		return;
+
+	list_unlink(&tick->le);
+	tmr_cancel(&tick->tmr);
+}
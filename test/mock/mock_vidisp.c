@@ -19,6 +19,9 @@ struct vidisp_st {
 };
 
 
+static unsigned n_frame_total;
+
+
 static void disp_destructor(void *arg)
 {
 	struct vidisp_st *st = arg;
@@ -79,6 +82,7 @@ static int mock_display(struct vidisp_st *st, const char *title,
 		return EPROTO;
 
 	++st->n_frame;
+	++n_frame_total;
 
 	if (st->n_frame >= 10) {
 		info("mock_vidisp: got %u frames -- stopping re_main\n",
@@ -95,3 +99,14 @@ int mock_vidisp_register(struct vidisp **vidispp)
 	return vidisp_register(vidispp, "mock-vidisp",
 			       mock_disp_alloc, NULL, mock_display, NULL);
 }
+
+
+/**
+ * Get the number of frames shown by all the mock displays
+ *
+ * @return Number of frames
+ */
+unsigned mock_vidisp_frames(void)
+{
+	return n_frame_total;
+}
@@ -13,19 +13,17 @@ struct vidsrc_st {
 	const struct vidsrc *vs;  /* inheritance */
 
 	struct vidframe *frame;
-	struct tmr tmr;
+	struct mock_tick tick;
 	int fps;
 	vidsrc_frame_h *frameh;
 	void *arg;
 };
 
 
-static void tmr_handler(void *arg)
+static void tick_handler(void *arg)
 {
 	struct vidsrc_st *st = arg;
 
-	tmr_start(&st->tmr, 1000/st->fps, tmr_handler, st);
-
 	if (st->frameh)
 		st->frameh(st->frame, st->arg);
 }
@@ -35,7 +33,7 @@ static void vidsrc_destructor(void *arg)
 {
 	struct vidsrc_st *st = arg;
 
-	tmr_cancel(&st->tmr);
+	mock_tick_cancel(&st->tick);
 	mem_deref(st->frame);
 }
 
@@ -69,7 +67,7 @@ static int mock_vidsrc_alloc(struct vidsrc_st **stp, const struct vidsrc *vs,
 	if (err)
 		goto out;
 
-	tmr_start(&st->tmr, 0, tmr_handler, st);
+	mock_tick_start(&st->tick, 1000/st->fps, tick_handler, st);
 
 	info("mock_vidsrc: new instance with size %u x %u (%d fps)\n",
 	     size->w, size->h, prm->fps);
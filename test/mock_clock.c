@@ -0,0 +1,104 @@
+/**
+ * @file test/mock_clock.c  Baresip selftest -- virtual clock
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "test.h"
+
+
+enum { N_DEV = 100 };
+
+
+struct test {
+	unsigned n_read;
+	unsigned n_write;
+};
+
+
+static void read_handler(const void *sampv, size_t sampc, void *arg)
+{
+	struct test *t = arg;
+	(void)sampv;
+	(void)sampc;
+
+	++t->n_read;
+}
+
+
+static void write_handler(void *sampv, size_t sampc, void *arg)
+{
+	struct test *t = arg;
+	(void)sampv;
+	(void)sampc;
+
+	++t->n_write;
+}
+
+
+int test_mock_clock(void)
+{
+	struct ausrc_st *srcv[N_DEV];
+	struct auplay_st *playv[N_DEV];
+	struct ausrc *ausrc = NULL;
+	struct auplay *auplay = NULL;
+	struct ausrc_prm src_prm;
+	struct auplay_prm play_prm;
+	struct test t;
+	unsigned i;
+	int err;
+
+	memset(srcv, 0, sizeof(srcv));
+	memset(playv, 0, sizeof(playv));
+	memset(&t, 0, sizeof(t));
+
+	mock_clock_enable(true);
+
+	err  = mock_ausrc_register(&ausrc);
+	err |= mock_auplay_register(&auplay);
+	TEST_ERR(err);
+
+	src_prm.srate  = 8000;
+	src_prm.ch     = 1;
+	src_prm.ptime  = 20;
+	src_prm.fmt    = AUFMT_S16LE;
+
+	play_prm.srate = 8000;
+	play_prm.ch    = 1;
+	play_prm.ptime = 10;
+	play_prm.fmt   = AUFMT_S16LE;
+
+	for (i=0; i<N_DEV; i++) {
+
+		err  = ausrc_alloc(&srcv[i], NULL, "mock-ausrc", &src_prm,
+				   NULL, read_handler, NULL, &t);
+		err |= auplay_alloc(&playv[i], "mock-auplay", &play_prm,
+				    NULL, write_handler, &t);
+		TEST_ERR(err);
+	}
+
+	/* nothing happens until the clock is advanced */
+	ASSERT_EQ(0, t.n_read);
+	ASSERT_EQ(0, t.n_write);
+
+	/* one tick at 0 and one at the end of each period */
+	mock_clock_advance(1000);
+
+	ASSERT_EQ(1000, mock_clock_now());
+	ASSERT_EQ(N_DEV * 51, t.n_read);
+	ASSERT_EQ(N_DEV * 101, t.n_write);
+	ASSERT_EQ(N_DEV * 152, mock_clock_ticks());
+
+ out:
+	for (i=0; i<N_DEV; i++) {
+		mem_deref(srcv[i]);
+		mem_deref(playv[i]);
+	}
+	mem_deref(auplay);
+	mem_deref(ausrc);
+	mock_clock_enable(false);
+
+	return err;
+}
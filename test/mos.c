@@ -3,6 +3,7 @@
  *
  * Copyright (C) 2010 - 2016 Creytiv.com
  */
+#include <string.h>
 #include <re.h>
 #include <baresip.h>
 #include "test.h"
@@ -51,3 +52,59 @@ int test_mos(void)
  out:
 	return err;
 }
+
+
+int test_mos_est(void)
+{
+	struct mos_est me;
+	double r_clean, mos_clean;
+	unsigned i;
+	int err = 0;
+
+	memset(&me, 0, sizeof(me));
+	mos_est_set_codec(&me, "PCMU");
+
+	/* no packets, no estimate */
+	mos_est_update(&me, 0, 0, 0, 0);
+	ASSERT_TRUE(!me.valid);
+
+	/* no loss: R = 93.2 - Id(20 ms) */
+	mos_est_update(&me, 250, 0, 0, 0);
+	ASSERT_TRUE(me.valid);
+	ASSERT_DOUBLE_EQ(92.72, me.r, PRECISION);
+	r_clean   = me.r;
+	mos_clean = me.mos;
+
+	/* 5 single losses in 250 packets: random loss, 2% */
+	for (i=0; i<5; i++)
+		mos_est_loss(&me, 1);
+	mos_est_update(&me, 495, 0, 0, 0);
+	ASSERT_TRUE(me.r < r_clean);
+	ASSERT_TRUE(me.mos < mos_clean);
+
+	/* the same loss in one burst is worse for G.711 */
+	{
+		struct mos_est bu;
+
+		memset(&bu, 0, sizeof(bu));
+		mos_est_set_codec(&bu, "PCMU");
+		mos_est_update(&bu, 250, 0, 0, 0);
+		mos_est_loss(&bu, 5);
+		mos_est_update(&bu, 495, 0, 0, 0);
+
+		ASSERT_TRUE(bu.r < me.r);
+	}
+
+	/* the loss leaves the window */
+	for (i=0; i<MOS_WINDOW; i++)
+		mos_est_update(&me, 495 + 250 * (i+1), 0, 0, 0);
+	ASSERT_DOUBLE_EQ(r_clean, me.r, PRECISION);
+
+	/* a lower quality codec */
+	mos_est_set_codec(&me, "G729");
+	mos_est_update(&me, 495 + 250 * (MOS_WINDOW+1), 0, 0, 0);
+	ASSERT_DOUBLE_EQ(r_clean - 11, me.r, PRECISION);
+
+ out:
+	return err;
+}
@@ -0,0 +1,162 @@
+/**
+ * @file test/ptring.c  Test the lock-free pointer ring
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <re.h>
+#include <baresip.h>
+#include "test.h"
+
+
+enum {
+	THREAD_ITEMS = 100000,
+};
+
+
+static unsigned n_freed;
+
+
+static void obj_destructor(void *arg)
+{
+	(void)arg;
+
+	++n_freed;
+}
+
+
+#ifdef HAVE_PTHREAD
+static void *writer_thread(void *arg)
+{
+	struct ptring *pr = arg;
+	uintptr_t i;
+
+	for (i=1; i<=THREAD_ITEMS; i++) {
+
+		while (!ptring_push(pr, (void *)i))
+			sys_usleep(10);
+	}
+
+	return NULL;
+}
+
+
+/* One writer thread and one reader thread, the order is kept */
+static int test_ptring_thread(void)
+{
+	struct ptring *pr = NULL;
+	pthread_t tid;
+	uintptr_t next = 1;
+	int err;
+
+	err = ptring_alloc(&pr, 16);
+	TEST_ERR(err);
+
+	err = pthread_create(&tid, NULL, writer_thread, pr);
+	TEST_ERR(err);
+
+	while (next <= THREAD_ITEMS) {
+
+		uintptr_t v = (uintptr_t)ptring_pop(pr);
+
+		if (!v) {
+			sys_usleep(10);
+			continue;
+		}
+
+		if (v != next) {
+			warning("selftest: ptring: expected %zu, got %zu\n",
+				(size_t)next, (size_t)v);
+			err = EPROTO;
+			break;
+		}
+
+		++next;
+	}
+
+	pthread_join(tid, NULL);
+	TEST_ERR(err);
+
+	ASSERT_EQ(0, ptring_count(pr));
+
+ out:
+	mem_deref(pr);
+	return err;
+}
+#endif
+
+
+int test_ptring(void)
+{
+	struct ptring *pr = NULL;
+	int *objv[8];
+	size_t i;
+	int err;
+
+	memset(objv, 0, sizeof(objv));
+	n_freed = 0;
+
+	for (i=0; i<ARRAY_SIZE(objv); i++) {
+		objv[i] = mem_zalloc(sizeof(int), obj_destructor);
+		if (!objv[i]) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
+	ASSERT_EQ(EINVAL, ptring_alloc(&pr, 0));
+
+	/* capacity is rounded up to 4 */
+	err = ptring_alloc(&pr, 3);
+	TEST_ERR(err);
+
+	ASSERT_TRUE(NULL == ptring_pop(pr));
+	ASSERT_TRUE(!ptring_push(pr, NULL));
+
+	for (i=0; i<4; i++)
+		ASSERT_TRUE(ptring_push(pr, objv[i]));
+
+	ASSERT_EQ(4, ptring_count(pr));
+
+	/* full: refused and counted, the ring does not change */
+	ASSERT_TRUE(!ptring_push(pr, objv[4]));
+	ASSERT_EQ(1, ptring_full(pr));
+	ASSERT_EQ(4, ptring_count(pr));
+
+	ASSERT_TRUE(objv[0] == ptring_pop(pr));
+	ASSERT_TRUE(objv[1] == ptring_pop(pr));
+
+	/* wrap-around */
+	ASSERT_TRUE(ptring_push(pr, objv[4]));
+	ASSERT_TRUE(ptring_push(pr, objv[5]));
+
+	for (i=2; i<6; i++)
+		ASSERT_TRUE(objv[i] == ptring_pop(pr));
+
+	ASSERT_TRUE(NULL == ptring_pop(pr));
+	ASSERT_EQ(0, ptring_count(pr));
+
+	/* flush: the objects that are left are dereferenced */
+	ASSERT_TRUE(ptring_push(pr, objv[6]));
+	ASSERT_TRUE(ptring_push(pr, objv[7]));
+	objv[6] = objv[7] = NULL;
+
+	ptring_flush(pr);
+	ASSERT_EQ(2, n_freed);
+	ASSERT_EQ(0, ptring_count(pr));
+
+#ifdef HAVE_PTHREAD
+	err = test_ptring_thread();
+	TEST_ERR(err);
+#endif
+
+ out:
+	mem_deref(pr);
+	for (i=0; i<ARRAY_SIZE(objv); i++)
+		mem_deref(objv[i]);
+
+	return err;
+}
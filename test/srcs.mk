@@ -9,13 +9,27 @@
 # Test-cases:
 #
 TEST_SRCS	+= account.c
+TEST_SRCS	+= aulevel.c
+TEST_SRCS	+= aupcm.c
+TEST_SRCS	+= auring.c
 TEST_SRCS	+= cmd.c
 TEST_SRCS	+= contact.c
+TEST_SRCS	+= fec.c
+TEST_SRCS	+= kernel.c
 TEST_SRCS	+= ua.c
 TEST_SRCS	+= cplusplus.c
 TEST_SRCS	+= call.c
+TEST_SRCS	+= mock_clock.c
 TEST_SRCS	+= mos.c
 TEST_SRCS	+= net.c
+TEST_SRCS	+= ptring.c
+TEST_SRCS	+= stream.c
+
+
+#
+# Benchmarks:
+#
+TEST_SRCS	+= bench.c
 
 
 #
@@ -34,7 +48,9 @@ ifneq ($(USE_TLS),)
 TEST_SRCS	+= mock/cert.c
 endif
 
+TEST_SRCS	+= mock/mock_clock.c
 TEST_SRCS	+= mock/mock_ausrc.c
+TEST_SRCS	+= mock/mock_auplay.c
 ifneq ($(USE_VIDEO),)
 TEST_SRCS	+= mock/mock_vidsrc.c
 TEST_SRCS	+= mock/mock_vidcodec.c
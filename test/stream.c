@@ -0,0 +1,194 @@
+/**
+ * @file test/stream.c  Test the adaptive jitter buffer of a media stream
+ *
+ * Copyright (C) 2010 - 2016 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <baresip.h>
+#include "../src/core.h"
+#include "test.h"
+
+
+enum {
+	SRATE    = 8000,
+	PTIME    = 20,
+	FRAME_TS = SRATE * PTIME / 1000,
+	FRAME_US = PTIME * 1000,
+	JB_MIN   = 2,
+	JB_MAX   = 10,
+};
+
+struct jbtest {
+	uint16_t seq_last;
+	unsigned n_pkt;
+	unsigned n_reorder;
+	unsigned n_lost;
+};
+
+struct jbnum {
+	uint32_t delay;
+	uint32_t target;
+	uint32_t late;
+	uint32_t dup;
+	uint32_t drop;
+};
+
+
+static void rtp_handler(const struct rtp_header *hdr, struct mbuf *mb,
+			void *arg)
+{
+	struct jbtest *jt = arg;
+
+	/* a loss, or no packet */
+	if (!mb) {
+		++jt->n_lost;
+		return;
+	}
+
+	if (jt->n_pkt && (uint16_t)(hdr->seq - jt->seq_last) >= 0x8000)
+		++jt->n_reorder;
+
+	jt->seq_last = hdr->seq;
+	++jt->n_pkt;
+}
+
+
+/* The packet is sent every PTIME, and arrives late by delay [us] */
+static void put(struct stream *s, struct mbuf *mb, uint16_t seq,
+		uint32_t delay)
+{
+	struct rtp_header hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ver  = RTP_VERSION;
+	hdr.ssrc = 1;
+	hdr.seq  = seq;
+	hdr.ts   = (uint32_t)seq * FRAME_TS;
+
+	mb->pos = 0;
+	stream_test_recv(s, &hdr, mb, 1000000 + (uint64_t)seq * FRAME_US
+			 + delay);
+}
+
+
+static int jbuf_num(const struct stream *s, struct jbnum *n)
+{
+	struct pl delay, target, late, dup, drop;
+	char *str = NULL;
+	int err;
+
+	err = re_sdprintf(&str, "%H", stream_jbuf_stat, s);
+	if (err)
+		return err;
+
+	err = re_regex(str, str_len(str),
+		       "delay=[0-9]+ms target=[0-9]+ jitter=[0-9.]+ms"
+		       " late=[0-9]+ dup=[0-9]+ dropped=[0-9]+",
+		       &delay, &target, NULL, &late, &dup, &drop);
+	if (err) {
+		warning("selftest: jbuf stat: %s\n", str);
+		goto out;
+	}
+
+	n->delay  = pl_u32(&delay);
+	n->target = pl_u32(&target);
+	n->late   = pl_u32(&late);
+	n->dup    = pl_u32(&dup);
+	n->drop   = pl_u32(&drop);
+
+ out:
+	mem_deref(str);
+	return err;
+}
+
+
+int test_stream_jbuf_adaptive(void)
+{
+	struct config_avt cfg;
+	struct stream *s = NULL;
+	struct mbuf *mb = NULL;
+	struct jbtest jt;
+	struct jbnum n;
+	unsigned n_lost;
+	uint16_t seq;
+	int err;
+
+	memset(&cfg, 0, sizeof(cfg));
+	memset(&jt, 0, sizeof(jt));
+
+	cfg.jbuf_del.min = JB_MIN;
+	cfg.jbuf_del.max = JB_MAX;
+	cfg.jbuf_mode    = JBUF_MODE_ADAPTIVE;
+
+	mb = mbuf_alloc(FRAME_TS);
+	if (!mb) {
+		err = ENOMEM;
+		goto out;
+	}
+	(void)mbuf_fill(mb, 0xff, FRAME_TS);
+
+	err = stream_test_alloc(&s, &cfg, SRATE, rtp_handler, &jt);
+	TEST_ERR(err);
+
+	/* no jitter: the target is the minimum */
+	for (seq = 0; seq < 50; seq++)
+		put(s, mb, seq, 0);
+
+	err = jbuf_num(s, &n);
+	TEST_ERR(err);
+	ASSERT_EQ(JB_MIN, n.target);
+	ASSERT_EQ(0, n.late);
+	ASSERT_EQ(0, n.dup);
+	ASSERT_EQ(0, n.drop);
+
+	/* each pair swapped: the jitter is one frame each way, and the
+	 * packets still come out in order */
+	for (seq = 50; seq < 100; seq += 2) {
+		put(s, mb, seq + 1, 0);
+		put(s, mb, seq, FRAME_US);
+	}
+
+	err = jbuf_num(s, &n);
+	TEST_ERR(err);
+	ASSERT_TRUE(n.target > JB_MIN && n.target <= JB_MAX);
+	ASSERT_TRUE(n.delay > 0 && n.delay <= JB_MAX * PTIME);
+	ASSERT_EQ(0, n.late);
+	ASSERT_EQ(0, n.dup);
+	ASSERT_EQ(0, jt.n_reorder);
+
+	/* a duplicate of a packet that is still held */
+	put(s, mb, 100, 0);
+	put(s, mb, 101, 0);
+	put(s, mb, 101, 0);
+
+	/* a packet that was already given out, it arrives now */
+	put(s, mb, 60, 41 * FRAME_US);
+
+	err = jbuf_num(s, &n);
+	TEST_ERR(err);
+	ASSERT_EQ(1, n.dup);
+	ASSERT_EQ(1, n.late);
+
+	/* the jitter is gone: the buffer drops frames to shrink,
+	 * which is not a loss */
+	n_lost = jt.n_lost;
+	for (seq = 102; seq < 600; seq++)
+		put(s, mb, seq, 0);
+
+	err = jbuf_num(s, &n);
+	TEST_ERR(err);
+	ASSERT_EQ(JB_MIN, n.target);
+	ASSERT_TRUE(n.drop > 0);
+	ASSERT_TRUE(n.delay >= PTIME && n.delay <= (JB_MIN + 1) * PTIME);
+	ASSERT_EQ(1, n.late);
+	ASSERT_EQ(1, n.dup);
+	ASSERT_EQ(0, jt.n_reorder);
+	ASSERT_EQ(n_lost, jt.n_lost);
+
+ out:
+	mem_deref(s);
+	mem_deref(mb);
+
+	return err;
+}
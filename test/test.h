@@ -104,6 +104,31 @@ int dns_server_add_srv(struct dns_server *srv, const char *name,
 		       uint16_t pri, uint16_t weight, uint16_t port,
 		       const char *target);
 
+/*
+ * Mock clock
+ */
+
+typedef void (mock_tick_h)(void *arg);
+
+struct mock_tick {
+	struct le le;
+	struct tmr tmr;
+	uint64_t next;            /* Deadline on the virtual clock [ms] */
+	uint32_t period;          /* [ms] */
+	mock_tick_h *h;
+	void *arg;
+};
+
+void     mock_clock_enable(bool enable);
+uint64_t mock_clock_now(void);
+void     mock_clock_advance(uint32_t ms);
+uint64_t mock_clock_cpu_ns(void);
+uint64_t mock_clock_ticks(void);
+void     mock_tick_start(struct mock_tick *tick, uint32_t period,
+			 mock_tick_h *h, void *arg);
+void     mock_tick_cancel(struct mock_tick *tick);
+
+
 /*
  * Mock Audio-source
  */
@@ -113,6 +138,16 @@ struct ausrc;
 int mock_ausrc_register(struct ausrc **ausrcp);
 
 
+/*
+ * Mock Audio-player
+ */
+
+struct auplay;
+
+int      mock_auplay_register(struct auplay **auplayp);
+unsigned mock_auplay_writes(void);
+
+
 /*
  * Mock Video-source
  */
@@ -136,15 +171,22 @@ void mock_vidcodec_unregister(void);
 
 struct vidisp;
 
-int mock_vidisp_register(struct vidisp **vidispp);
+int      mock_vidisp_register(struct vidisp **vidispp);
+unsigned mock_vidisp_frames(void);
 
 
 /* test cases */
 
 int test_account(void);
+int test_aulevel(void);
+int test_aupcm(void);
+int test_auring(void);
 int test_cmd(void);
 int test_cmd_long(void);
+int test_kernel(void);
+int test_mock_clock(void);
 int test_contact(void);
+int test_fec(void);
 int test_ua_alloc(void);
 int test_uag_find_param(void);
 int test_ua_register(void);
@@ -153,7 +195,10 @@ int test_ua_register_auth(void);
 int test_ua_register_auth_dns(void);
 int test_ua_options(void);
 int test_mos(void);
+int test_mos_est(void);
 int test_network(void);
+int test_ptring(void);
+int test_stream_jbuf_adaptive(void);
 
 int test_call_answer(void);
 int test_call_reject(void);
@@ -167,6 +212,11 @@ int test_call_dtmf(void);
 int test_call_video(void);
 
 
+/* benchmarks */
+
+int test_bench(void);
+
+
 #ifdef __cplusplus
 extern "C" {
 #endif